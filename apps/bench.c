@@ -0,0 +1,548 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * bench - system microbenchmarks
+ *
+ * Times the things most of the system leans on: getting in and out
+ * of the kernel, starting processes, moving bytes through pipes and
+ * ptys, looking up paths, reading directories, file I/O, malloc, and
+ * shared memory. Each benchmark prints one tab-separated line:
+ *
+ *     name  iterations  ns/op  MiB/s
+ *
+ * MiB/s is "-" for benchmarks that don't move data. Lines starting
+ * with '#' are comments. Run with no arguments for everything, or
+ * name the benchmarks to run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <pty.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/shm.h>
+#include <sys/termios.h>
+#include <sys/utsname.h>
+
+#include <syscall.h>
+
+static int scale = 1;           /* -s: multiply every iteration count */
+static char * work_dir = "/tmp"; /* -d: where file benchmarks make their files */
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* bytes is 0 for benchmarks that don't have a throughput */
+static void report(const char * name, uint64_t iterations, uint64_t ns, uint64_t bytes) {
+	if (!iterations) iterations = 1;
+	if (!ns) ns = 1;
+	printf("%s\t%llu\t%llu", name, (unsigned long long)iterations, (unsigned long long)(ns / iterations));
+	if (bytes) {
+		uint64_t kib_per_s = bytes * 1000000000ULL / ns / 1024;
+		printf("\t%llu.%02llu\n", (unsigned long long)(kib_per_s / 1024), (unsigned long long)((kib_per_s % 1024) * 100 / 1024));
+	} else {
+		printf("\t-\n");
+	}
+	fflush(stdout);
+}
+
+static void fail(const char * name, const char * what) {
+	printf("# %s: %s: %s\n", name, what, strerror(errno));
+	fflush(stdout);
+}
+
+static char * work_path(const char * name) {
+	char * out = malloc(strlen(work_dir) + strlen(name) + 16);
+	sprintf(out, "%s/%s.%d", work_dir, name, getpid());
+	return out;
+}
+
+static int write_all(int fd, const char * buf, size_t size) {
+	while (size) {
+		ssize_t w = write(fd, buf, size);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		buf += w;
+		size -= w;
+	}
+	return 0;
+}
+
+static int read_all(int fd, char * buf, size_t size) {
+	while (size) {
+		ssize_t r = read(fd, buf, size);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		buf += r;
+		size -= r;
+	}
+	return 0;
+}
+
+/* Cheap repeatable random numbers, so runs do the same work */
+static uint32_t rng_state = 2463534242u;
+static uint32_t rng(uint32_t * state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void bench_syscall(const char * name) {
+	uint64_t n = 200000 * scale;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		syscall_getpid();
+	}
+	report(name, n, now() - start, 0);
+}
+
+static void bench_fork(const char * name) {
+	uint64_t n = 200 * scale;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) _exit(0);
+		if (pid < 0) return fail(name, "fork");
+		waitpid(pid, NULL, 0);
+	}
+	report(name, n, now() - start, 0);
+}
+
+static void bench_exec(const char * name) {
+	uint64_t n = 100 * scale;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			char * args[] = {"/bin/true", NULL};
+			execv(args[0], args);
+			_exit(1);
+		}
+		if (pid < 0) return fail(name, "fork");
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (WEXITSTATUS(status)) {
+			errno = ENOEXEC;
+			return fail(name, "/bin/true");
+		}
+	}
+	report(name, n, now() - start, 0);
+}
+
+/*
+ * A child writes `total` bytes into `out` a chunk at a time, and we
+ * read them back out of `in`. We hold on to `out` until everything has
+ * arrived - a pty throws away what's unread once the writer is gone.
+ * Both ends are closed when it's done.
+ */
+static void stream(const char * name, int in, int out, size_t chunk, uint64_t total) {
+	char * buf = malloc(chunk);
+	memset(buf, 'x', chunk);
+
+	uint64_t start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(in);
+		for (uint64_t done = 0; done < total; done += chunk) {
+			if (write_all(out, buf, chunk) < 0) _exit(1);
+		}
+		_exit(0);
+	}
+	if (pid < 0) {
+		close(in);
+		close(out);
+		free(buf);
+		return fail(name, "fork");
+	}
+
+	uint64_t got = 0;
+	while (got < total) {
+		ssize_t r = read(in, buf, chunk);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		got += r;
+	}
+	uint64_t ns = now() - start;
+	close(in);
+	close(out);
+	waitpid(pid, NULL, 0);
+	free(buf);
+
+	if (got < total) {
+		errno = EPIPE;
+		return fail(name, "short read");
+	}
+	report(name, total / chunk, ns, total);
+}
+
+static void bench_pipe(const char * name) {
+	int fds[2];
+	if (pipe(fds) < 0) return fail(name, "pipe");
+	stream(name, fds[0], fds[1], 4096, (uint64_t)32 * 1024 * 1024 * scale);
+}
+
+/* Ping-pong one byte, for how long a wakeup through a pipe takes */
+static void bench_pipe_latency(const char * name) {
+	int a[2], b[2];
+	if (pipe(a) < 0 || pipe(b) < 0) return fail(name, "pipe");
+
+	uint64_t n = 20000 * scale;
+	char c = 0;
+	pid_t pid = fork();
+	if (pid == 0) {
+		for (uint64_t i = 0; i < n; ++i) {
+			if (read_all(a[0], &c, 1) < 0 || write_all(b[1], &c, 1) < 0) _exit(1);
+		}
+		_exit(0);
+	}
+	if (pid < 0) return fail(name, "fork");
+
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		if (write_all(a[1], &c, 1) < 0 || read_all(b[0], &c, 1) < 0) break;
+	}
+	uint64_t ns = now() - start;
+	waitpid(pid, NULL, 0);
+	close(a[0]); close(a[1]); close(b[0]); close(b[1]);
+	report(name, n * 2, ns, 0);
+}
+
+static void bench_pty(const char * name) {
+	int master, slave;
+	if (openpty(&master, &slave, NULL, NULL, NULL) < 0) return fail(name, "openpty");
+
+	/* Raw, so the line discipline passes bytes straight through */
+	struct termios t;
+	tcgetattr(slave, &t);
+	t.c_lflag &= ~(ICANON | ECHO | ISIG);
+	t.c_oflag &= ~OPOST;
+	t.c_cc[VMIN] = 1;
+	tcsetattr(slave, TCSANOW, &t);
+
+	stream(name, slave, master, 1024, (uint64_t)4 * 1024 * 1024 * scale);
+}
+
+static void bench_stat(const char * name) {
+	uint64_t n = 20000 * scale;
+	struct stat st;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		if (stat("/usr/include/toaru/yutani.h", &st) < 0) return fail(name, "stat");
+	}
+	report(name, n, now() - start, 0);
+}
+
+static void bench_open(const char * name) {
+	uint64_t n = 20000 * scale;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		int fd = open("/usr/include/toaru/yutani.h", O_RDONLY);
+		if (fd < 0) return fail(name, "open");
+		close(fd);
+	}
+	report(name, n, now() - start, 0);
+}
+
+static void remove_files(char * dir, char * path, int files) {
+	for (int i = 0; i < files; ++i) {
+		sprintf(path, "%s/file-%05d", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/* Make a directory with a lot of files, then time listing it */
+static void bench_readdir(const char * name) {
+	const int files = 2000;
+	char * dir = work_path(name);
+	char * path = malloc(strlen(dir) + 32);
+	if (mkdir(dir, 0755) < 0) {
+		fail(name, dir);
+		goto _done;
+	}
+
+	for (int i = 0; i < files; ++i) {
+		sprintf(path, "%s/file-%05d", dir, i);
+		int fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0) {
+			fail(name, path);
+			remove_files(dir, path, i);
+			goto _done;
+		}
+		close(fd);
+	}
+
+	uint64_t n = 20 * scale;
+	uint64_t entries = 0;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		DIR * d = opendir(dir);
+		if (!d) break;
+		while (readdir(d)) entries++;
+		closedir(d);
+	}
+	report(name, entries, now() - start, 0);
+	remove_files(dir, path, files);
+
+_done:
+	free(path);
+	free(dir);
+}
+
+static char * make_file(const char * name, size_t size) {
+	char * path = work_path(name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fail(name, path);
+		free(path);
+		return NULL;
+	}
+	char * buf = malloc(65536);
+	memset(buf, 'x', 65536);
+	for (size_t done = 0; done < size; done += 65536) {
+		if (write_all(fd, buf, 65536) < 0) {
+			fail(name, "write");
+			close(fd);
+			unlink(path);
+			free(path);
+			free(buf);
+			return NULL;
+		}
+	}
+	close(fd);
+	free(buf);
+	return path;
+}
+
+#define FILE_SIZE (8 * 1024 * 1024)
+
+static void bench_file_write(const char * name) {
+	char * path = work_path(name);
+	char * buf = malloc(65536);
+	memset(buf, 'x', 65536);
+	uint64_t total = (uint64_t)FILE_SIZE * scale;
+
+	uint64_t start = now();
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fail(name, path);
+		goto _done;
+	}
+	for (uint64_t done = 0; done < total; done += 65536) {
+		if (write_all(fd, buf, 65536) < 0) {
+			fail(name, "write");
+			close(fd);
+			goto _done;
+		}
+	}
+	close(fd);
+	report(name, total / 65536, now() - start, total);
+
+_done:
+	unlink(path);
+	free(path);
+	free(buf);
+}
+
+static void bench_file_read(const char * name) {
+	char * path = make_file(name, FILE_SIZE);
+	if (!path) return;
+
+	char * buf = malloc(65536);
+	uint64_t total = 0;
+	uint64_t start = now();
+	for (int i = 0; i < scale * 4; ++i) {
+		int fd = open(path, O_RDONLY);
+		ssize_t r;
+		while ((r = read(fd, buf, 65536)) > 0) total += r;
+		close(fd);
+	}
+	report(name, total / 65536, now() - start, total);
+
+	unlink(path);
+	free(path);
+	free(buf);
+}
+
+/* 4KiB reads from all over the file */
+static void bench_file_random(const char * name) {
+	char * path = make_file(name, FILE_SIZE);
+	if (!path) return;
+
+	char buf[4096];
+	uint32_t state = rng_state;
+	uint64_t n = 4000 * scale;
+	int fd = open(path, O_RDONLY);
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		off_t at = (off_t)(rng(&state) % (FILE_SIZE / 4096)) * 4096;
+		lseek(fd, at, SEEK_SET);
+		if (read_all(fd, buf, 4096) < 0) {
+			fail(name, "read");
+			break;
+		}
+	}
+	report(name, n, now() - start, n * 4096);
+	close(fd);
+
+	unlink(path);
+	free(path);
+}
+
+/*
+ * Each thread keeps a few hundred live allocations of mixed sizes and
+ * keeps replacing random ones, like a program that's busy.
+ */
+#define MALLOC_SLOTS 256
+
+static void * malloc_worker(void * arg) {
+	uint64_t n = *(uint64_t *)arg;
+	void * slots[MALLOC_SLOTS] = {NULL};
+	uint32_t state = rng_state ^ (uint32_t)(uintptr_t)&slots;
+	for (uint64_t i = 0; i < n; ++i) {
+		uint32_t r = rng(&state);
+		int slot = r % MALLOC_SLOTS;
+		free(slots[slot]);
+		/* Mostly small, sometimes a page or a few */
+		size_t size = (r >> 8) % 8 ? 16 + (r >> 12) % 240 : 256 + (r >> 12) % 16384;
+		slots[slot] = malloc(size);
+		if (slots[slot]) *(char *)slots[slot] = 0;
+	}
+	for (int i = 0; i < MALLOC_SLOTS; ++i) free(slots[i]);
+	return NULL;
+}
+
+static void malloc_threads(const char * name, int threads) {
+	uint64_t n = 100000 * scale;
+	pthread_t tids[threads];
+	uint64_t start = now();
+	for (int i = 0; i < threads; ++i) {
+		pthread_create(&tids[i], NULL, malloc_worker, &n);
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+	report(name, n * threads, now() - start, 0);
+}
+
+static void bench_malloc(const char * name) {
+	malloc_threads(name, 1);
+}
+
+static void bench_malloc_mt(const char * name) {
+	malloc_threads(name, 4);
+}
+
+/* Get, touch, and let go of a shared memory region */
+static void bench_shm(const char * name) {
+	char key[64];
+	sprintf(key, "bench.%d", getpid());
+	uint64_t n = 200 * scale;
+	uint64_t start = now();
+	for (uint64_t i = 0; i < n; ++i) {
+		size_t size = 1024 * 1024;
+		char * mem = shm_obtain(key, &size);
+		if (!mem) return fail(name, "shm_obtain");
+		for (size_t j = 0; j < size; j += 4096) mem[j] = 1;
+		shm_release(key);
+	}
+	report(name, n, now() - start, n * 1024 * 1024);
+}
+
+static struct {
+	const char * name;
+	void (*run)(const char *);
+	const char * what;
+} benchmarks[] = {
+	{"syscall",      bench_syscall,      "getpid() round trip"},
+	{"fork",         bench_fork,         "fork + _exit + waitpid"},
+	{"exec",         bench_exec,         "fork + exec /bin/true + waitpid"},
+	{"pipe",         bench_pipe,         "pipe throughput, 4KiB writes"},
+	{"pipe-latency", bench_pipe_latency, "one byte back and forth through pipes"},
+	{"pty",          bench_pty,          "raw pty throughput, 1KiB writes"},
+	{"stat",         bench_stat,         "stat() of a path four deep"},
+	{"open",         bench_open,         "open + close of a path four deep"},
+	{"readdir",      bench_readdir,      "readdir of a 2000 file directory, per entry"},
+	{"file-write",   bench_file_write,   "sequential 64KiB writes"},
+	{"file-read",    bench_file_read,    "sequential 64KiB reads"},
+	{"file-random",  bench_file_random,  "random 4KiB reads"},
+	{"malloc",       bench_malloc,       "malloc/free mix, one thread"},
+	{"malloc-mt",    bench_malloc_mt,    "malloc/free mix, four threads"},
+	{"shm",          bench_shm,          "shm_obtain + touch 1MiB + shm_release"},
+	{NULL, NULL, NULL},
+};
+
+static void usage(char * argv0) {
+	fprintf(stderr,
+			"usage: %s [-s SCALE] [-d DIR] [-l] [BENCHMARK...]\n"
+			"\n"
+			" -s     run SCALE times as many iterations\n"
+			" -d     make files in DIR (default /tmp)\n"
+			" -l     list the benchmarks\n"
+			"\n"
+			"Prints: name, iterations, ns per iteration, MiB/s\n", argv0);
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "s:d:lh")) != -1) {
+		switch (opt) {
+			case 's':
+				scale = atoi(optarg);
+				if (scale < 1) scale = 1;
+				break;
+			case 'd':
+				work_dir = optarg;
+				break;
+			case 'l':
+				for (int i = 0; benchmarks[i].name; ++i) {
+					printf("%-14s %s\n", benchmarks[i].name, benchmarks[i].what);
+				}
+				return 0;
+			default:
+				usage(argv[0]);
+				return opt != 'h';
+		}
+	}
+
+	for (int i = optind; i < argc; ++i) {
+		int found = 0;
+		for (int j = 0; benchmarks[j].name; ++j) {
+			if (!strcmp(argv[i], benchmarks[j].name)) found = 1;
+		}
+		if (!found) {
+			fprintf(stderr, "%s: unknown benchmark '%s' (-l lists them)\n", argv[0], argv[i]);
+			return 1;
+		}
+	}
+
+	struct utsname u;
+	uname(&u);
+	printf("# bench 1 %s %s %s scale=%d\n", u.sysname, u.release, u.machine, scale);
+	printf("# name\titerations\tns/op\tMiB/s\n");
+	fflush(stdout);
+
+	for (int j = 0; benchmarks[j].name; ++j) {
+		int run = optind == argc;
+		for (int i = optind; i < argc; ++i) {
+			if (!strcmp(argv[i], benchmarks[j].name)) run = 1;
+		}
+		if (run) benchmarks[j].run(benchmarks[j].name);
+	}
+
+	return 0;
+}
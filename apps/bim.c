@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <termios.h>
 #include <signal.h>
 #include <locale.h>
@@ -167,6 +168,7 @@ typedef struct {
 	int istate;
 	int is_current;
 	int rev_status;
+	int needs_syntax; /* istate has changed since this line was highlighted */
 	char_t   text[];
 } line_t;
 
@@ -211,6 +213,8 @@ struct {
 	int cursor_padding;
 	int split_percent;
 	int scroll_amount;
+	int large_file; /* MiB */
+	int view_large;
 } global_config = {
 	0, /* term_width */
 	0, /* term_height */
@@ -244,6 +248,8 @@ struct {
 	4, /* cursor padding */
 	50, /* split percentage */
 	5, /* how many lines to scroll on mouse wheel */
+	16, /* files this many MiB or larger are viewed without loading them */
+	0, /* view the initial file that way whatever its size */
 };
 
 void redraw_line(int j, int x);
@@ -261,6 +267,8 @@ void bim_unget(int c) {
 }
 
 #define bim_getch() bim_getch_timeout(200)
+void syntax_idle(struct pollfd * fds);
+void screen_flush(void);
 int bim_getch_timeout(int timeout) {
 	if (_bim_unget != -1) {
 		int out = _bim_unget;
@@ -270,6 +278,13 @@ int bim_getch_timeout(int timeout) {
 	struct pollfd fds[1];
 	fds[0].fd = global_config.tty_in;
 	fds[0].events = POLLIN;
+
+	/* Whatever was drawn for the last key goes out now */
+	screen_flush();
+
+	/* Get on with any highlighting while there's nothing to read */
+	syntax_idle(fds);
+
 	int ret = poll(fds,1,timeout);
 	if (ret > 0 && fds[0].revents & POLLIN) {
 		unsigned char buf[1];
@@ -357,6 +372,13 @@ typedef struct _env {
 
 	int start_line;
 	int sel_col;
+
+	/* Lines we've marked, so they can be unmarked without searching for them */
+	int current_line; /* Has is_current set */
+	int paren_line;   /* Has the paren match flagged with FLAG_SELECT */
+
+	int syntax_dirty; /* Lines with needs_syntax set */
+	int syntax_from;  /* None of them come before this one */
 } buffer_t;
 
 /**
@@ -2465,10 +2487,43 @@ struct syntax_definition {
 };
 
 
+/**
+ * Note that a line needs to be highlighted again, which will happen
+ * when it's drawn or when bim is otherwise idle.
+ */
+void syntax_mark(int line_no) {
+	line_t * line = env->lines[line_no];
+	if (!line->needs_syntax) {
+		line->needs_syntax = 1;
+		env->syntax_dirty++;
+	}
+	if (line_no < env->syntax_from) env->syntax_from = line_no;
+}
+
+/**
+ * Highlight the whole buffer again, from the top.
+ */
+void syntax_mark_all(void) {
+	for (int i = 0; i < env->line_count; ++i) {
+		env->lines[i]->istate = 0;
+		env->lines[i]->needs_syntax = 1;
+	}
+	env->syntax_dirty = env->line_count;
+	env->syntax_from = 0;
+}
+
 /**
  * Calculate syntax hilighting for the given line.
+ *
+ * If that changes the state the next line starts in, the next line is
+ * only marked; see syntax_catch_up() for where the marks get cleared.
  */
 void recalculate_syntax(line_t * line, int line_no) {
+	if (line->needs_syntax) {
+		line->needs_syntax = 0;
+		env->syntax_dirty--;
+	}
+
 	/* Clear syntax for this line first */
 	for (int i = 0; i < line->actual; ++i) {
 		line->text[i].flags = 0;
@@ -2490,10 +2545,7 @@ void recalculate_syntax(line_t * line, int line_no) {
 			if (line_no + 1 < env->line_count && env->lines[line_no+1]->istate != state.state) {
 				env->lines[line_no+1]->istate = state.state;
 				if (env->loading) return;
-				recalculate_syntax(env->lines[line_no+1], line_no+1);
-				if (line_no + 1 >= env->offset && line_no + 1 < env->offset + global_config.term_height - global_config.bottom_size - 1) {
-					redraw_line(line_no + 1 - env->offset, line_no + 1);
-				}
+				syntax_mark(line_no + 1);
 			}
 			break;
 		}
@@ -2567,6 +2619,26 @@ void set_history_break(void) {
 	}
 }
 
+/**
+ * Keep the marked lines pointing at the same lines when `count` lines
+ * are added (or, if negative, removed) at `offset`.
+ */
+void shift_line_marks(int offset, int count) {
+	if (env->syntax_from > offset) env->syntax_from = offset;
+
+	int * marks[] = {&env->current_line, &env->paren_line};
+	for (int i = 0; i < 2; ++i) {
+		int * mark = marks[i];
+		if (*mark < offset) continue;
+		if (count < 0 && *mark < offset - count) {
+			/* That line is gone */
+			*mark = -1;
+		} else {
+			*mark += count;
+		}
+	}
+}
+
 /**
  * Insert a character into an existing line.
  */
@@ -2679,17 +2751,24 @@ line_t ** remove_line(line_t ** lines, int offset) {
 		return lines;
 	}
 
+	if (lines[offset]->needs_syntax) {
+		lines[offset]->needs_syntax = 0;
+		env->syntax_dirty--;
+	}
+
 	if (!env->loading && global_config.history_enabled) {
+		/* The history takes the line itself; there's no need to copy it */
 		history_t * e = malloc(sizeof(history_t));
 		e->type = HISTORY_REMOVE_LINE;
 		e->contents.remove_replace_line.lineno = offset;
-		e->contents.remove_replace_line.old_contents = malloc(sizeof(line_t) + sizeof(char_t) * lines[offset]->available);
-		memcpy(e->contents.remove_replace_line.old_contents, lines[offset], sizeof(line_t) + sizeof(char_t) * lines[offset]->available);
+		e->contents.remove_replace_line.old_contents = lines[offset];
 		HIST_APPEND(e);
+	} else {
+		/* Otherwise, free the data used by the line */
+		free(lines[offset]);
 	}
 
-	/* Otherwise, free the data used by the line */
-	free(lines[offset]);
+	shift_line_marks(offset, -1);
 
 	/* Move other lines up */
 	if (offset < env->line_count-1) {
@@ -2736,6 +2815,7 @@ line_t ** add_line(line_t ** lines, int offset) {
 	/* There is one new line */
 	env->line_count += 1;
 	env->lines = lines;
+	shift_line_marks(offset, 1);
 
 	if (!env->loading) {
 		lines[offset]->rev_status = 2; /* Modified */
@@ -2818,7 +2898,10 @@ line_t ** merge_lines(line_t ** lines, int lineb) {
 	}
 
 	/* Remove the second line */
+	if (lines[lineb]->needs_syntax) env->syntax_dirty--;
 	free(lines[lineb]);
+	if (env->paren_line == lineb) env->paren_line = linea;
+	shift_line_marks(lineb, -1);
 
 	/* Move other lines up */
 	if (lineb < env->line_count) {
@@ -2881,6 +2964,17 @@ line_t ** split_line(line_t ** lines, int line, int split) {
 	memmove(lines[line+1]->text, &lines[line]->text[split], sizeof(char_t) * remaining);
 	lines[line]->actual = split;
 
+	shift_line_marks(line + 1, 1);
+	if (env->paren_line == line) {
+		/* The paren match may have moved to the new line */
+		for (int i = 0; i < remaining; ++i) {
+			if (lines[line+1]->text[i].flags & FLAG_SELECT) {
+				env->paren_line = line + 1;
+				break;
+			}
+		}
+	}
+
 	if (!env->loading) {
 		lines[line]->rev_status = 2;
 		lines[line+1]->rev_status = 2;
@@ -3048,6 +3142,10 @@ void setup_buffer(buffer_t * env) {
 	env->history     = malloc(sizeof(struct history));
 	memset(env->history, 0, sizeof(struct history));
 	env->last_save_history = env->history;
+	env->current_line = -1;
+	env->paren_line  = -1;
+	env->syntax_dirty = 0;
+	env->syntax_from = 0;
 
 	/* Allocate line buffer */
 	env->lines = malloc(sizeof(line_t *) * env->line_avail);
@@ -3151,12 +3249,691 @@ int codepoint_width(wchar_t codepoint) {
 	return 1;
 }
 
+/**
+ * Terminal output
+ *
+ * Drawing doesn't go straight to the terminal. Everything is written
+ * into a model of the screen instead. When a frame is done (that is,
+ * when we're about to wait for input), screen_flush() compares the
+ * model with what the terminal was last sent, and writes out only what
+ * changed, all at once. Rows that have moved are spotted and moved
+ * with the terminal's own scrolling rather than being sent again.
+ *
+ * The model understands the escapes we produce ourselves: cursor
+ * movement, colors and attributes, erasing, and scrolling. Anything
+ * else (mode switches, titles) is passed along at the start of the
+ * next frame.
+ *
+ * Outside of screen_start() / screen_stop(), output goes straight to
+ * stdout, as it does for -c and while a shell command is running.
+ */
+typedef struct {
+	uint32_t codepoint; /* 0 for the right half of a wide character */
+	uint32_t fg;
+	uint32_t bg;
+	uint32_t attr;
+} cell_t;
+
+#define CELL_UNKNOWN 0xFFFFFFFF
+
+#define CELL_BOLD      0x01
+#define CELL_ITALIC    0x02
+#define CELL_UNDERLINE 0x04
+
+/* Colors are a kind in the top byte and a value in the rest */
+#define CELL_COLOR_DEFAULT 0x00000000
+#define CELL_COLOR_16      0x01000000
+#define CELL_COLOR_256     0x02000000
+#define CELL_COLOR_RGB     0x03000000
+
+/* Don't bother scrolling for fewer rows than this */
+#define SCREEN_SCROLL_MIN 3
+
+struct output_buffer {
+	char * data;
+	size_t len;
+	size_t size;
+};
+
+struct {
+	int active;
+	int width;
+	int height;
+	cell_t * cells; /* What should be on screen */
+	cell_t * shown; /* What the terminal has */
+
+	/* Where drawing is happening, and how */
+	int x, y;
+	cell_t pen;
+	int saved_x, saved_y;
+	cell_t saved_pen;
+	int cursor_visible;
+
+	/* What we know of the terminal's own state */
+	int term_x, term_y;   /* -1 if unknown */
+	cell_t term_pen;       /* codepoint is CELL_UNKNOWN if unknown */
+	int term_cursor_visible;
+
+	/* Escape parser */
+	int state;
+	char seq[64];
+	int seq_len;
+	uint32_t utf8_codepoint;
+	int utf8_remaining;
+
+	struct output_buffer passthrough;
+	struct output_buffer out;
+} screen = {0};
+
+enum {
+	SCREEN_GROUND,
+	SCREEN_ESCAPE,
+	SCREEN_CSI,
+	SCREEN_OSC,
+	SCREEN_OSC_ESCAPE,
+};
+
+void output_append(struct output_buffer * out, const char * data, size_t len) {
+	if (out->len + len > out->size) {
+		while (out->len + len > out->size) {
+			out->size = out->size ? out->size * 2 : 4096;
+		}
+		out->data = realloc(out->data, out->size);
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+void output_printf(struct output_buffer * out, const char * fmt, ...) {
+	char tmp[64];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	va_end(args);
+	output_append(out, tmp, len);
+}
+
+cell_t * screen_cell(int x, int y) {
+	return &screen.cells[y * screen.width + x];
+}
+
+cell_t screen_blank(void) {
+	cell_t blank = {' ', CELL_COLOR_DEFAULT, screen.pen.bg, 0};
+	return blank;
+}
+
+/**
+ * Two cells look the same. A space only shows its background and
+ * whether it is underlined.
+ */
+int cells_match(cell_t * a, cell_t * b) {
+	if (a->codepoint != b->codepoint || a->bg != b->bg) return 0;
+	if (a->codepoint == ' ') return (a->attr & CELL_UNDERLINE) == (b->attr & CELL_UNDERLINE);
+	return a->fg == b->fg && a->attr == b->attr;
+}
+
+/**
+ * Make the model match the terminal size, throwing away what we
+ * knew about the terminal if it has changed.
+ */
+void screen_check_size(void) {
+	if (screen.width == global_config.term_width && screen.height == global_config.term_height && screen.cells) return;
+	screen.width  = global_config.term_width;
+	screen.height = global_config.term_height;
+	size_t count = screen.width * screen.height;
+	screen.cells = realloc(screen.cells, sizeof(cell_t) * (count ? count : 1));
+	screen.shown = realloc(screen.shown, sizeof(cell_t) * (count ? count : 1));
+	cell_t blank = screen_blank();
+	for (size_t i = 0; i < count; ++i) {
+		screen.cells[i] = blank;
+		screen.shown[i].codepoint = CELL_UNKNOWN;
+	}
+	if (screen.x > screen.width) screen.x = screen.width;
+	if (screen.y >= screen.height) screen.y = screen.height ? screen.height - 1 : 0;
+}
+
+void screen_erase(int from_x, int y, int to_x) {
+	cell_t blank = screen_blank();
+	if (from_x > 0 && screen_cell(from_x, y)->codepoint == 0) {
+		screen_cell(from_x - 1, y)->codepoint = ' ';
+	}
+	for (int x = from_x; x < to_x; ++x) {
+		*screen_cell(x, y) = blank;
+	}
+	if (to_x < screen.width && screen_cell(to_x, y)->codepoint == 0) {
+		screen_cell(to_x, y)->codepoint = ' ';
+	}
+}
+
+/**
+ * Move rows of the model up (count > 0) or down (count < 0).
+ */
+void screen_scroll_cells(cell_t * cells, int count, cell_t fill) {
+	int rows = count > 0 ? count : -count;
+	if (rows > screen.height) rows = screen.height;
+	size_t row_size = sizeof(cell_t) * screen.width;
+	if (count > 0) {
+		memmove(cells, cells + rows * screen.width, row_size * (screen.height - rows));
+	} else {
+		memmove(cells + rows * screen.width, cells, row_size * (screen.height - rows));
+	}
+	int first = count > 0 ? screen.height - rows : 0;
+	for (int y = first; y < first + rows; ++y) {
+		for (int x = 0; x < screen.width; ++x) {
+			cells[y * screen.width + x] = fill;
+		}
+	}
+}
+
+void screen_line_feed(void) {
+	screen.x = 0;
+	if (screen.y == screen.height - 1) {
+		screen_scroll_cells(screen.cells, 1, screen_blank());
+	} else {
+		screen.y++;
+	}
+}
+
+void screen_put(uint32_t codepoint) {
+	int width = (codepoint < 256) ? 1 : wcwidth(codepoint);
+	if (width < 1) width = 1;
+	if (width > 2) width = 2;
+	if (screen.x + width > screen.width) {
+		/* Wrap, as the terminal would */
+		screen_line_feed();
+		if (width > screen.width) return;
+	}
+	screen_erase(screen.x, screen.y, screen.x + width);
+	cell_t * cell = screen_cell(screen.x, screen.y);
+	*cell = screen.pen;
+	cell->codepoint = codepoint;
+	if (width == 2) {
+		cell[1] = screen.pen;
+		cell[1].codepoint = 0;
+	}
+	screen.x += width;
+}
+
+uint32_t screen_sgr_color(int * params, int count, int * i) {
+	if (*i + 2 < count && params[*i + 1] == 5) {
+		*i += 2;
+		return CELL_COLOR_256 | (params[*i] & 0xFF);
+	}
+	if (*i + 4 < count && params[*i + 1] == 2) {
+		*i += 4;
+		return CELL_COLOR_RGB | ((params[*i - 2] & 0xFF) << 16) | ((params[*i - 1] & 0xFF) << 8) | (params[*i] & 0xFF);
+	}
+	return CELL_COLOR_DEFAULT;
+}
+
+void screen_sgr(int * params, int count) {
+	if (!count) {
+		params[0] = 0;
+		count = 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		int p = params[i];
+		if (p == 0) {
+			screen.pen.fg = CELL_COLOR_DEFAULT;
+			screen.pen.bg = CELL_COLOR_DEFAULT;
+			screen.pen.attr = 0;
+		} else if (p == 1) {
+			screen.pen.attr |= CELL_BOLD;
+		} else if (p == 3) {
+			screen.pen.attr |= CELL_ITALIC;
+		} else if (p == 4) {
+			screen.pen.attr |= CELL_UNDERLINE;
+		} else if (p == 22) {
+			screen.pen.attr &= ~CELL_BOLD;
+		} else if (p == 23) {
+			screen.pen.attr &= ~CELL_ITALIC;
+		} else if (p == 24) {
+			screen.pen.attr &= ~CELL_UNDERLINE;
+		} else if (p >= 30 && p <= 37) {
+			screen.pen.fg = CELL_COLOR_16 | (p - 30);
+		} else if (p == 38) {
+			screen.pen.fg = screen_sgr_color(params, count, &i);
+		} else if (p == 39) {
+			screen.pen.fg = CELL_COLOR_DEFAULT;
+		} else if (p >= 40 && p <= 47) {
+			screen.pen.bg = CELL_COLOR_16 | (p - 40);
+		} else if (p == 48) {
+			screen.pen.bg = screen_sgr_color(params, count, &i);
+		} else if (p == 49) {
+			screen.pen.bg = CELL_COLOR_DEFAULT;
+		} else if (p >= 90 && p <= 97) {
+			screen.pen.fg = CELL_COLOR_16 | (p - 90 + 8);
+		} else if (p >= 100 && p <= 107) {
+			screen.pen.bg = CELL_COLOR_16 | (p - 100 + 8);
+		}
+	}
+}
+
+void screen_csi(char final) {
+	int params[16] = {0};
+	int count = 0;
+	int private = (screen.seq_len && screen.seq[0] == '?');
+	char * c = screen.seq + private;
+	char * end = screen.seq + screen.seq_len;
+	if (c < end) {
+		count = 1;
+		for (; c < end; ++c) {
+			if (*c == ';') {
+				if (count == 16) break;
+				count++;
+			} else if (*c >= '0' && *c <= '9') {
+				params[count-1] = params[count-1] * 10 + (*c - '0');
+			}
+		}
+	}
+
+	if (private) {
+		if (count == 1 && params[0] == 25 && (final == 'h' || final == 'l')) {
+			screen.cursor_visible = (final == 'h');
+			return;
+		}
+	} else {
+		switch (final) {
+			case 'H':
+			case 'f':
+				screen.y = (count > 0 && params[0] > 0) ? params[0] - 1 : 0;
+				screen.x = (count > 1 && params[1] > 0) ? params[1] - 1 : 0;
+				if (screen.y >= screen.height) screen.y = screen.height - 1;
+				if (screen.x >= screen.width) screen.x = screen.width - 1;
+				return;
+			case 'J':
+				if (params[0] == 2) {
+					for (int y = 0; y < screen.height; ++y) screen_erase(0, y, screen.width);
+				} else if (params[0] == 0) {
+					screen_erase(screen.x, screen.y, screen.width);
+					for (int y = screen.y + 1; y < screen.height; ++y) screen_erase(0, y, screen.width);
+				}
+				return;
+			case 'K':
+				if (params[0] == 0) {
+					screen_erase(screen.x, screen.y, screen.width);
+					return;
+				}
+				break;
+			case 'm':
+				screen_sgr(params, count);
+				return;
+			case 'S':
+				screen_scroll_cells(screen.cells, params[0] ? params[0] : 1, screen_blank());
+				return;
+			case 'T':
+				screen_scroll_cells(screen.cells, -(params[0] ? params[0] : 1), screen_blank());
+				return;
+		}
+	}
+
+	/* Not something we model; hand it on */
+	output_append(&screen.passthrough, "\033[", 2);
+	output_append(&screen.passthrough, screen.seq, screen.seq_len);
+	output_append(&screen.passthrough, &final, 1);
+}
+
+void screen_feed(const char * data, size_t len) {
+	screen_check_size();
+	if (!screen.width || !screen.height) return;
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = data[i];
+		switch (screen.state) {
+			case SCREEN_GROUND:
+				if (screen.utf8_remaining && (c & 0xC0) == 0x80) {
+					screen.utf8_codepoint = (screen.utf8_codepoint << 6) | (c & 0x3F);
+					if (--screen.utf8_remaining == 0) screen_put(screen.utf8_codepoint);
+					break;
+				}
+				screen.utf8_remaining = 0;
+				if (c == '\033') {
+					screen.state = SCREEN_ESCAPE;
+				} else if (c == '\r') {
+					screen.x = 0;
+				} else if (c == '\n') {
+					screen_line_feed();
+				} else if (c == '\b') {
+					if (screen.x > 0) screen.x--;
+				} else if (c < 0x20 || c == 0x7F) {
+					/* Nothing visible */
+				} else if (c < 0x80) {
+					screen_put(c);
+				} else if ((c & 0xE0) == 0xC0) {
+					screen.utf8_codepoint = c & 0x1F;
+					screen.utf8_remaining = 1;
+				} else if ((c & 0xF0) == 0xE0) {
+					screen.utf8_codepoint = c & 0x0F;
+					screen.utf8_remaining = 2;
+				} else if ((c & 0xF8) == 0xF0) {
+					screen.utf8_codepoint = c & 0x07;
+					screen.utf8_remaining = 3;
+				}
+				break;
+			case SCREEN_ESCAPE:
+				screen.state = SCREEN_GROUND;
+				if (c == '[') {
+					screen.seq_len = 0;
+					screen.state = SCREEN_CSI;
+				} else if (c == ']') {
+					output_append(&screen.passthrough, "\033]", 2);
+					screen.state = SCREEN_OSC;
+				} else if (c == '7') {
+					screen.saved_x = screen.x;
+					screen.saved_y = screen.y;
+					screen.saved_pen = screen.pen;
+				} else if (c == '8') {
+					screen.x = screen.saved_x;
+					screen.y = screen.saved_y;
+					screen.pen = screen.saved_pen;
+					if (screen.x > screen.width) screen.x = screen.width;
+					if (screen.y >= screen.height) screen.y = screen.height - 1;
+				}
+				break;
+			case SCREEN_CSI:
+				if (c >= 0x40 && c <= 0x7E) {
+					screen.state = SCREEN_GROUND;
+					screen_csi(c);
+				} else if (screen.seq_len < (int)sizeof(screen.seq)) {
+					screen.seq[screen.seq_len++] = c;
+				}
+				break;
+			case SCREEN_OSC:
+				output_append(&screen.passthrough, (char *)&c, 1);
+				if (c == '\007') screen.state = SCREEN_GROUND;
+				else if (c == '\033') screen.state = SCREEN_OSC_ESCAPE;
+				break;
+			case SCREEN_OSC_ESCAPE:
+				output_append(&screen.passthrough, (char *)&c, 1);
+				screen.state = SCREEN_GROUND;
+				break;
+		}
+	}
+}
+
+/**
+ * screen_printf() for anything going to the terminal.
+ */
+int screen_printf(const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	if (!screen.active) {
+		int out = vprintf(fmt, args);
+		va_end(args);
+		return out;
+	}
+	char tmp[1024];
+	char * buf = tmp;
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	if (len >= (int)sizeof(tmp)) {
+		buf = malloc(len + 1);
+		vsnprintf(buf, len + 1, fmt, copy);
+	}
+	va_end(copy);
+	va_end(args);
+	if (len > 0) screen_feed(buf, len);
+	if (buf != tmp) free(buf);
+	return len;
+}
+
+/**
+ * Write out a color as SGR parameters (fg, or bg if `bg` is set)
+ */
+void screen_emit_color(uint32_t color, int bg) {
+	uint32_t value = color & 0xFFFFFF;
+	switch (color & 0xFF000000) {
+		case CELL_COLOR_16:
+			if (value < 8) output_printf(&screen.out, "%d;", (bg ? 40 : 30) + value);
+			else output_printf(&screen.out, "%d;", (bg ? 100 : 90) + value - 8);
+			break;
+		case CELL_COLOR_256:
+			output_printf(&screen.out, "%d;5;%d;", bg ? 48 : 38, value);
+			break;
+		case CELL_COLOR_RGB:
+			output_printf(&screen.out, "%d;2;%d;%d;%d;", bg ? 48 : 38, value >> 16, (value >> 8) & 0xFF, value & 0xFF);
+			break;
+		default:
+			output_printf(&screen.out, "%d;", bg ? 49 : 39);
+			break;
+	}
+}
+
+/**
+ * Get the terminal's attributes in line for drawing `cell`, sending
+ * only the ones that are different.
+ */
+void screen_emit_pen(cell_t * cell) {
+	cell_t * have = &screen.term_pen;
+	int known = (have->codepoint != CELL_UNKNOWN);
+	int space = (cell->codepoint == ' ');
+	size_t start = screen.out.len;
+
+	output_append(&screen.out, "\033[", 2);
+	if (!known) {
+		output_append(&screen.out, "0;", 2);
+		*have = screen_blank();
+		have->bg = CELL_COLOR_DEFAULT;
+		have->codepoint = 0;
+	}
+	size_t params = screen.out.len;
+
+	uint32_t attr = cell->attr;
+	if (space) {
+		/* Only underlining matters; leave the rest as it is */
+		attr = (have->attr & ~CELL_UNDERLINE) | (cell->attr & CELL_UNDERLINE);
+	}
+	if ((attr ^ have->attr) & CELL_BOLD)      output_append(&screen.out, attr & CELL_BOLD ? "1;" : "22;", attr & CELL_BOLD ? 2 : 3);
+	if ((attr ^ have->attr) & CELL_ITALIC)    output_append(&screen.out, attr & CELL_ITALIC ? "3;" : "23;", attr & CELL_ITALIC ? 2 : 3);
+	if ((attr ^ have->attr) & CELL_UNDERLINE) output_append(&screen.out, attr & CELL_UNDERLINE ? "4;" : "24;", attr & CELL_UNDERLINE ? 2 : 3);
+	have->attr = attr;
+	if (!space && cell->fg != have->fg) {
+		screen_emit_color(cell->fg, 0);
+		have->fg = cell->fg;
+	}
+	if (cell->bg != have->bg) {
+		screen_emit_color(cell->bg, 1);
+		have->bg = cell->bg;
+	}
+
+	if (screen.out.len == params && known) {
+		/* Nothing to change */
+		screen.out.len = start;
+	} else {
+		/* Swap the trailing ; for the terminator */
+		screen.out.data[screen.out.len - 1] = 'm';
+	}
+}
+
+void screen_emit_move(int x, int y) {
+	if (screen.term_y == y && screen.term_x == x) return;
+	if (screen.term_y == y && screen.term_x >= 0 && screen.term_x < x && screen.term_x < screen.width) {
+		if (x - screen.term_x == 1) {
+			output_append(&screen.out, "\033[C", 3);
+		} else {
+			output_printf(&screen.out, "\033[%dC", x - screen.term_x);
+		}
+	} else {
+		output_printf(&screen.out, "\033[%d;%dH", y + 1, x + 1);
+	}
+	screen.term_x = x;
+	screen.term_y = y;
+}
+
+uint32_t screen_row_hash(cell_t * row, int * blank) {
+	uint32_t hash = 2166136261u;
+	*blank = 1;
+	for (int x = 0; x < screen.width; ++x) {
+		uint32_t parts[3] = {row[x].codepoint, row[x].bg, row[x].attr & CELL_UNDERLINE};
+		if (row[x].codepoint != ' ') {
+			parts[2] = row[x].attr | (row[x].fg << 3);
+			*blank = 0;
+		}
+		if (row[x].bg != row[0].bg) *blank = 0;
+		for (int i = 0; i < 3; ++i) {
+			hash = (hash ^ parts[i]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+/**
+ * If what we want is mostly what's shown, moved up or down, have the
+ * terminal move it.
+ */
+void screen_emit_scroll(void) {
+	int h = screen.height;
+	uint32_t * want = malloc(sizeof(uint32_t) * h * 2);
+	uint32_t * have = want + h;
+	int * blank = malloc(sizeof(int) * h);
+	for (int y = 0; y < h; ++y) {
+		int dummy;
+		want[y] = screen_row_hash(&screen.cells[y * screen.width], &blank[y]);
+		have[y] = screen_row_hash(&screen.shown[y * screen.width], &dummy);
+		if (screen.shown[y * screen.width].codepoint == CELL_UNKNOWN) have[y] = ~want[y];
+	}
+
+	/* Rows that are already right, and the best we could do by moving */
+	int best = 0, best_gain = SCREEN_SCROLL_MIN - 1;
+	int already = 0;
+	for (int y = 0; y < h; ++y) {
+		if (!blank[y] && want[y] == have[y]) already++;
+	}
+	for (int shift = -(h - 1); shift < h; ++shift) {
+		if (!shift) continue;
+		int matched = 0;
+		for (int y = 0; y < h; ++y) {
+			int from = y + shift;
+			if (from < 0 || from >= h) continue;
+			if (!blank[y] && want[y] == have[from]) matched++;
+		}
+		if (matched - already > best_gain) {
+			best_gain = matched - already;
+			best = shift;
+		}
+	}
+	free(blank);
+	free(want);
+
+	if (!best) return;
+
+	output_printf(&screen.out, "\033[%d%c", best > 0 ? best : -best, best > 0 ? 'S' : 'T');
+	cell_t unknown = {CELL_UNKNOWN, 0, 0, 0};
+	screen_scroll_cells(screen.shown, best, unknown);
+}
+
+/**
+ * Send the terminal whatever it takes to show this frame.
+ */
+void screen_flush(void) {
+	if (!screen.active) {
+		fflush(stdout);
+		return;
+	}
+	screen_check_size();
+
+	screen.out.len = 0;
+	output_append(&screen.out, screen.passthrough.data, screen.passthrough.len);
+	screen.passthrough.len = 0;
+	size_t before = screen.out.len;
+
+	if (global_config.can_hideshow && screen.term_cursor_visible) {
+		output_append(&screen.out, "\033[?25l", 6);
+	}
+	size_t drawn = screen.out.len;
+
+	if (global_config.can_scroll) {
+		screen_emit_scroll();
+	}
+
+	for (int y = 0; y < screen.height; ++y) {
+		cell_t * want = &screen.cells[y * screen.width];
+		cell_t * have = &screen.shown[y * screen.width];
+		for (int x = 0; x < screen.width; ++x) {
+			if (cells_match(&want[x], &have[x])) continue;
+
+			/* Draw wide characters from their left half */
+			if (want[x].codepoint == 0 && x > 0) x--;
+
+			/* If the rest of the line is blank, erase it instead */
+			if (global_config.can_bce && want[x].codepoint == ' ') {
+				int end = x;
+				while (end < screen.width && want[end].codepoint == ' ' && want[end].bg == want[x].bg &&
+					!(want[end].attr & CELL_UNDERLINE)) end++;
+				if (end == screen.width && end - x > 3) {
+					screen_emit_move(x, y);
+					screen_emit_pen(&want[x]);
+					output_append(&screen.out, "\033[K", 3);
+					for (; x < screen.width; ++x) have[x] = want[x];
+					break;
+				}
+			}
+
+			screen_emit_move(x, y);
+			screen_emit_pen(&want[x]);
+			char tmp[7] = {0};
+			to_eight(want[x].codepoint ? want[x].codepoint : ' ', tmp);
+			output_append(&screen.out, tmp, strlen(tmp));
+			have[x] = want[x];
+			screen.term_x++;
+			if (x + 1 < screen.width && want[x+1].codepoint == 0) {
+				have[x+1] = want[x+1];
+				screen.term_x++;
+				x++;
+			}
+		}
+	}
+
+	int x = screen.x < screen.width ? screen.x : screen.width - 1;
+	if (screen.out.len == drawn) {
+		/* Nothing was drawn, so don't hide the cursor after all */
+		screen.out.len = before;
+	} else {
+		screen.term_cursor_visible = 0;
+	}
+	screen_emit_move(x, screen.y);
+	if (global_config.can_hideshow && screen.cursor_visible != screen.term_cursor_visible) {
+		output_append(&screen.out, screen.cursor_visible ? "\033[?25h" : "\033[?25l", 6);
+		screen.term_cursor_visible = screen.cursor_visible;
+	}
+
+	size_t written = 0;
+	while (written < screen.out.len) {
+		ssize_t r = write(STDOUT_FILENO, screen.out.data + written, screen.out.len - written);
+		if (r <= 0) break;
+		written += r;
+	}
+}
+
+/**
+ * Start taking output into the screen model. We don't know what the
+ * terminal has on it, so the first frame is drawn in full.
+ */
+void screen_start(void) {
+	fflush(stdout);
+	screen.width = 0;
+	screen_check_size();
+	screen.term_x = -1;
+	screen.term_y = -1;
+	screen.term_pen.codepoint = CELL_UNKNOWN;
+	screen.term_cursor_visible = 1;
+	screen.cursor_visible = 1;
+	screen.active = 1;
+}
+
+/**
+ * Send out what's been drawn and go back to writing straight to stdout.
+ */
+void screen_stop(void) {
+	screen_flush();
+	screen.active = 0;
+}
+
 /**
  * Move the terminal cursor
  */
 void place_cursor(int x, int y) {
-	printf("\033[%d;%dH", y, x);
-	fflush(stdout);
+	screen_printf("\033[%d;%dH", y, x);
 }
 
 /**
@@ -3169,28 +3946,27 @@ void place_cursor(int x, int y) {
  * color modes.
  */
 void set_colors(const char * fg, const char * bg) {
-	printf("\033[22;23;24;");
+	screen_printf("\033[22;23;24;");
 	if (*bg == '@') {
 		int _bg = atoi(bg+1);
 		if (_bg < 10) {
-			printf("4%d;", _bg);
+			screen_printf("4%d;", _bg);
 		} else {
-			printf("10%d;", _bg-10);
+			screen_printf("10%d;", _bg-10);
 		}
 	} else {
-		printf("48;%s;", bg);
+		screen_printf("48;%s;", bg);
 	}
 	if (*fg == '@') {
 		int _fg = atoi(fg+1);
 		if (_fg < 10) {
-			printf("3%dm", _fg);
+			screen_printf("3%dm", _fg);
 		} else {
-			printf("9%dm", _fg-10);
+			screen_printf("9%dm", _fg-10);
 		}
 	} else {
-		printf("38;%sm", fg);
+		screen_printf("38;%sm", fg);
 	}
-	fflush(stdout);
 }
 
 /**
@@ -3199,18 +3975,17 @@ void set_colors(const char * fg, const char * bg) {
  * (See set_colors above)
  */
 void set_fg_color(const char * fg) {
-	printf("\033[22;23;24;");
+	screen_printf("\033[22;23;24;");
 	if (*fg == '@') {
 		int _fg = atoi(fg+1);
 		if (_fg < 10) {
-			printf("3%dm", _fg);
+			screen_printf("3%dm", _fg);
 		} else {
-			printf("9%dm", _fg-10);
+			screen_printf("9%dm", _fg-10);
 		}
 	} else {
-		printf("38;%sm", fg);
+		screen_printf("38;%sm", fg);
 	}
-	fflush(stdout);
 }
 
 /**
@@ -3218,8 +3993,7 @@ void set_fg_color(const char * fg) {
  */
 void clear_to_end(void) {
 	if (global_config.can_bce) {
-		printf("\033[K");
-		fflush(stdout);
+		screen_printf("\033[K");
 	}
 }
 
@@ -3233,9 +4007,9 @@ void paint_line(const char * bg) {
 	if (!global_config.can_bce) {
 		set_colors(COLOR_FG, bg);
 		for (int i = 0; i < global_config.term_width; ++i) {
-			printf(" ");
+			screen_printf(" ");
 		}
-		printf("\r");
+		screen_printf("\r");
 	}
 }
 
@@ -3243,48 +4017,42 @@ void paint_line(const char * bg) {
  * Enable bold text display
  */
 void set_bold(void) {
-	printf("\033[1m");
-	fflush(stdout);
+	screen_printf("\033[1m");
 }
 
 /**
  * Disable bold
  */
 void unset_bold(void) {
-	printf("\033[22m");
-	fflush(stdout);
+	screen_printf("\033[22m");
 }
 
 /**
  * Enable underlined text display
  */
 void set_underline(void) {
-	printf("\033[4m");
-	fflush(stdout);
+	screen_printf("\033[4m");
 }
 
 /**
  * Disable underlined text display
  */
 void unset_underline(void) {
-	printf("\033[24m");
-	fflush(stdout);
+	screen_printf("\033[24m");
 }
 
 /**
  * Reset text display attributes
  */
 void reset(void) {
-	printf("\033[0m");
-	fflush(stdout);
+	screen_printf("\033[0m");
 }
 
 /**
  * Clear the entire screen
  */
 void clear_screen(void) {
-	printf("\033[H\033[2J");
-	fflush(stdout);
+	screen_printf("\033[H\033[2J");
 }
 
 /**
@@ -3292,9 +4060,8 @@ void clear_screen(void) {
  */
 void hide_cursor(void) {
 	if (global_config.can_hideshow) {
-		printf("\033[?25l");
+		screen_printf("\033[?25l");
 	}
-	fflush(stdout);
 }
 
 /**
@@ -3302,9 +4069,8 @@ void hide_cursor(void) {
  */
 void show_cursor(void) {
 	if (global_config.can_hideshow) {
-		printf("\033[?25h");
+		screen_printf("\033[?25h");
 	}
-	fflush(stdout);
 }
 
 /**
@@ -3312,9 +4078,8 @@ void show_cursor(void) {
  */
 void mouse_enable(void) {
 	if (global_config.can_mouse) {
-		printf("\033[?1000h");
+		screen_printf("\033[?1000h");
 	}
-	fflush(stdout);
 }
 
 /**
@@ -3322,23 +4087,22 @@ void mouse_enable(void) {
  */
 void mouse_disable(void) {
 	if (global_config.can_mouse) {
-		printf("\033[?1000l");
+		screen_printf("\033[?1000l");
 	}
-	fflush(stdout);
 }
 
 /**
  * Shift the screen up one line
  */
 void shift_up(void) {
-	printf("\033[1S");
+	screen_printf("\033[1S");
 }
 
 /**
  * Shift the screen down one line.
  */
 void shift_down(void) {
-	printf("\033[1T");
+	screen_printf("\033[1T");
 }
 
 /**
@@ -3346,7 +4110,7 @@ void shift_down(void) {
  */
 void set_alternate_screen(void) {
 	if (global_config.can_altscreen) {
-		printf("\033[?1049h");
+		screen_printf("\033[?1049h");
 	}
 }
 
@@ -3355,7 +4119,7 @@ void set_alternate_screen(void) {
  */
 void unset_alternate_screen(void) {
 	if (global_config.can_altscreen) {
-		printf("\033[?1049l");
+		screen_printf("\033[?1049l");
 	}
 }
 
@@ -3407,11 +4171,11 @@ void redraw_tabbar(void) {
 
 		if (offset + size >= global_config.term_width) {
 			if (global_config.term_width - offset - 1 > 0) {
-				printf("%*s", global_config.term_width - offset - 1, title);
+				screen_printf("%*s", global_config.term_width - offset - 1, title);
 			}
 			break;
 		} else {
-			printf("%s", title);
+			screen_printf("%s", title);
 		}
 
 		offset += size;
@@ -3470,7 +4234,7 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 			if (j >= offset) {
 				/* Fill remainder with -'s */
 				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("-");
+				screen_printf("-");
 				set_colors(COLOR_FG, COLOR_BG);
 			}
 
@@ -3504,12 +4268,12 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 
 				/* If it's wide, draw ---> as needed */
 				while (j - offset < width - 1) {
-					printf("-");
+					screen_printf("-");
 					j++;
 				}
 
 				/* End the line with a > to show it overflows */
-				printf(">");
+				screen_printf(">");
 				set_colors(COLOR_FG, COLOR_BG);
 				return;
 			}
@@ -3550,52 +4314,52 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 			if (c.codepoint == '\t') {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
 				if (global_config.can_unicode) {
-					printf("»");
+					screen_printf("»");
 					for (int i = 1; i < c.display_width; ++i) {
-						printf("·");
+						screen_printf("·");
 					}
 				} else {
-					printf(">");
+					screen_printf(">");
 					for (int i = 1; i < c.display_width; ++i) {
-						printf("-");
+						screen_printf("-");
 					}
 				}
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint < 32) {
 				/* Codepoints under 32 to get converted to ^@ escapes */
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("^%c", '@' + c.codepoint);
+				screen_printf("^%c", '@' + c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == 0x7f) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("^?");
+				screen_printf("^?");
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint > 0x7f && c.codepoint < 0xa0) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("<%2x>", c.codepoint);
+				screen_printf("<%2x>", c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == 0xa0) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("_");
+				screen_printf("_");
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.display_width == 8) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("[U+%04x]", c.codepoint);
+				screen_printf("[U+%04x]", c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.display_width == 10) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("[U+%06x]", c.codepoint);
+				screen_printf("[U+%06x]", c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == ' ' && i == line->actual - 1) {
 				/* Special case: space at end of line */
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("·");
+				screen_printf("·");
 				_set_colors(COLOR_FG, COLOR_BG);
 			} else {
 				/* Normal characters get output */
 				char tmp[7]; /* Max six bytes, use 7 to ensure last is always nil */
 				to_eight(c.codepoint, tmp);
-				printf("%s", tmp);
+				screen_printf("%s", tmp);
 			}
 
 			/* Advance the terminal cell offset by the render width of this character */
@@ -3644,11 +4408,11 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 		env->sel_col < width) {
 		set_colors(COLOR_FG, COLOR_BG);
 		while (j < env->sel_col) {
-			printf(" ");
+			screen_printf(" ");
 			j++;
 		}
 		set_colors(COLOR_SELECTFG, COLOR_SELECTBG);
-		printf(" ");
+		screen_printf(" ");
 		j++;
 		set_colors(COLOR_FG, COLOR_BG);
 	}
@@ -3658,7 +4422,7 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 	} else {
 		/* Paint the rest of the line */
 		for (; j - offset < width; ++j) {
-			printf(" ");
+			screen_printf(" ");
 		}
 	}
 }
@@ -3684,9 +4448,9 @@ void draw_line_number(int x) {
 	}
 	int num_size = num_width();
 	for (int y = 0; y < num_size - log_base_10(x + 1); ++y) {
-		printf(" ");
+		screen_printf(" ");
 	}
-	printf("%d%c", x + 1, (x+1 == env->line_no && env->coffset > 0) ? '<' : ' ');
+	screen_printf("%d%c", x + 1, (x+1 == env->line_no && env->coffset > 0) ? '<' : ' ');
 }
 
 /**
@@ -3694,21 +4458,23 @@ void draw_line_number(int x) {
  */
 void recalculate_current_line(void) {
 	if (!global_config.hilight_current_line) return;
-	for (int i = 0; i < env->line_count; ++i) {
-		if (env->lines[i]->is_current && i != env->line_no-1) {
-			env->lines[i]->is_current = 0;
-			if ((i) - env->offset > -1 &&
-				(i) - env->offset - 1 < global_config.term_height - global_config.bottom_size - 2) {
-				redraw_line((i) - env->offset, i);
-			}
-		} else if (i == env->line_no-1 && !env->lines[i]->is_current) {
-			env->lines[i]->is_current = 1;
-			if ((i) - env->offset > -1 &&
-				(i) - env->offset - 1 < global_config.term_height - global_config.bottom_size - 2) {
-				redraw_line((i) - env->offset, i);
-			}
+	int i = env->current_line;
+	if (i >= 0 && i < env->line_count && i != env->line_no-1 && env->lines[i]->is_current) {
+		env->lines[i]->is_current = 0;
+		if ((i) - env->offset > -1 &&
+			(i) - env->offset - 1 < global_config.term_height - global_config.bottom_size - 2) {
+			redraw_line((i) - env->offset, i);
 		}
 	}
+	i = env->line_no-1;
+	if (i < env->line_count && !env->lines[i]->is_current) {
+		env->lines[i]->is_current = 1;
+		if ((i) - env->offset > -1 &&
+			(i) - env->offset - 1 < global_config.term_height - global_config.bottom_size - 2) {
+			redraw_line((i) - env->offset, i);
+		}
+	}
+	env->current_line = i;
 }
 
 /**
@@ -3729,27 +4495,27 @@ void redraw_line(int j, int x) {
 	switch (env->lines[x]->rev_status) {
 		case 1:
 			set_colors(COLOR_NUMBER_FG, COLOR_GREEN);
-			printf(" ");
+			screen_printf(" ");
 			break;
 		case 2:
 			set_colors(COLOR_NUMBER_FG, global_config.color_gutter ? COLOR_SEARCH_BG : COLOR_ALT_FG);
-			printf(" ");
+			screen_printf(" ");
 			break;
 		case 3:
 			set_colors(COLOR_NUMBER_FG, COLOR_KEYWORD);
-			printf(" ");
+			screen_printf(" ");
 			break;
 		case 4:
 			set_colors(COLOR_ALT_FG, COLOR_RED);
-			printf("▆");
+			screen_printf("▆");
 			break;
 		case 5:
 			set_colors(COLOR_KEYWORD, COLOR_RED);
-			printf("▆");
+			screen_printf("▆");
 			break;
 		default:
 			set_colors(COLOR_NUMBER_FG, COLOR_ALT_FG);
-			printf(" ");
+			screen_printf(" ");
 			break;
 	}
 
@@ -3771,13 +4537,53 @@ void draw_excess_line(int j) {
 	place_cursor(1+env->left,2 + j);
 	paint_line(COLOR_ALT_BG);
 	set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-	printf("~");
+	screen_printf("~");
 	if (env->left + env->width == global_config.term_width && global_config.can_bce) {
 		clear_to_end();
 	} else {
 		/* Paint the rest of the line */
 		for (int x = 1; x < env->width; ++x) {
-			printf(" ");
+			screen_printf(" ");
+		}
+	}
+}
+
+/**
+ * Highlight lines marked by syntax_mark(), in order from the first,
+ * until we're past line `upto` or have done `limit` of them. Lines on
+ * screen are redrawn as they're done if `redraw` is set.
+ */
+#define SYNTAX_BATCH 500
+void syntax_catch_up(int upto, int limit, int redraw) {
+	int i = env->syntax_from;
+	int screen = global_config.term_height - global_config.bottom_size - 1;
+	while (env->syntax_dirty && i < env->line_count && i <= upto && limit > 0) {
+		if (env->lines[i]->needs_syntax) {
+			recalculate_syntax(env->lines[i], i);
+			limit--;
+			if (redraw && i >= env->offset && i < env->offset + screen) {
+				redraw_line(i - env->offset, i);
+			}
+		}
+		i++;
+	}
+	env->syntax_from = env->syntax_dirty ? i : env->line_count;
+}
+
+/**
+ * Highlight the rest of the buffer a batch at a time, for as long as
+ * there's no input waiting.
+ */
+void syntax_idle(struct pollfd * fds) {
+	if (!env) return;
+	int redraw = (env->mode == MODE_NORMAL || env->mode == MODE_INSERT || env->mode == MODE_REPLACE);
+	while (env->syntax_dirty && !env->loading && poll(fds,1,0) == 0) {
+		if (redraw) screen_printf("\0337"); /* Save the cursor */
+		syntax_catch_up(env->line_count, SYNTAX_BATCH, redraw);
+		if (redraw) {
+			screen_printf("\0338");
+			show_cursor();
+			screen_flush();
 		}
 	}
 }
@@ -3793,6 +4599,9 @@ void redraw_text(void) {
 	int l = global_config.term_height - global_config.bottom_size - 1;
 	int j = 0;
 
+	/* Make sure what's about to be drawn is highlighted, if that isn't far off */
+	syntax_catch_up(env->offset + l, SYNTAX_BATCH * 4, 0);
+
 	/* Draw each line */
 	for (int x = env->offset; j < l && x < env->line_count; x++) {
 		redraw_line(j,x);
@@ -3906,14 +4715,14 @@ void redraw_statusbar(void) {
 			len--;
 			i += 1;
 		}
-		printf("%s%s", i > 0 ? "<" : "", env->file_name + i);
+		screen_printf("%s%s", i > 0 ? "<" : "", env->file_name + i);
 	} else {
-		printf("[No Name]");
+		screen_printf("[No Name]");
 	}
 
-	printf(" ");
+	screen_printf(" ");
 
-	printf("%s", status_bits);
+	screen_printf("%s", status_bits);
 
 	/* Clear the rest of the status bar */
 	clear_to_end();
@@ -3921,8 +4730,7 @@ void redraw_statusbar(void) {
 	/* Move the cursor appropriately to draw it */
 	place_cursor(global_config.term_width - strlen(right_hand), global_config.term_height - 1);
 	/* TODO: What if we're localized and this has wide chars? */
-	printf("%s",right_hand);
-	fflush(stdout);
+	screen_printf("%s",right_hand);
 }
 
 /**
@@ -3945,12 +4753,12 @@ void redraw_commandline(void) {
 	/* If we are in an edit mode, note that. */
 	if (env->mode == MODE_INSERT) {
 		set_bold();
-		printf("-- INSERT --");
+		screen_printf("-- INSERT --");
 		clear_to_end();
 		unset_bold();
 	} else if (env->mode == MODE_LINE_SELECTION) {
 		set_bold();
-		printf("-- LINE SELECTION -- (%d:%d)",
+		screen_printf("-- LINE SELECTION -- (%d:%d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line
 		);
@@ -3958,7 +4766,7 @@ void redraw_commandline(void) {
 		unset_bold();
 	} else if (env->mode == MODE_COL_SELECTION) {
 		set_bold();
-		printf("-- COL SELECTION -- (%d:%d %d)",
+		screen_printf("-- COL SELECTION -- (%d:%d %d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line,
 			(env->sel_col)
@@ -3967,7 +4775,7 @@ void redraw_commandline(void) {
 		unset_bold();
 	} else if (env->mode == MODE_COL_INSERT) {
 		set_bold();
-		printf("-- COL INSERT -- (%d:%d %d)",
+		screen_printf("-- COL INSERT -- (%d:%d %d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line,
 			(env->sel_col)
@@ -3976,12 +4784,12 @@ void redraw_commandline(void) {
 		unset_bold();
 	} else if (env->mode == MODE_REPLACE) {
 		set_bold();
-		printf("-- REPLACE --");
+		screen_printf("-- REPLACE --");
 		clear_to_end();
 		unset_bold();
 	} else if (env->mode == MODE_CHAR_SELECTION) {
 		set_bold();
-		printf("-- CHAR SELECTION -- ");
+		screen_printf("-- CHAR SELECTION -- ");
 		clear_to_end();
 		reset();
 	} else {
@@ -4012,7 +4820,7 @@ void render_commandline_message(char * message, ...) {
 	paint_line(COLOR_BG);
 	set_colors(COLOR_FG, COLOR_BG);
 
-	printf("%s", buf);
+	screen_printf("%s", buf);
 
 	/* Clear the rest of the status bar */
 	clear_to_end();
@@ -4021,7 +4829,13 @@ void render_commandline_message(char * message, ...) {
 /**
  * Draw all screen elements
  */
+int large_viewing(void);
+void large_redraw(void);
 void redraw_all(void) {
+	if (large_viewing()) {
+		large_redraw();
+		return;
+	}
 	redraw_tabbar();
 	redraw_text();
 	if (left_buffer) {
@@ -4063,7 +4877,7 @@ void update_title(void) {
 	getcwd(cwd, 1024);
 
 	for (int i = 1; i < 3; ++i) {
-		printf("\033]%d;%s%s (%s) - BIM\007", i, env->file_name ? env->file_name : "[No Name]", env->modified ? " +" : "", cwd);
+		screen_printf("\033]%d;%s%s (%s) - BIM\007", i, env->file_name ? env->file_name : "[No Name]", env->modified ? " +" : "", cwd);
 	}
 }
 
@@ -4107,7 +4921,7 @@ void render_status_message(char * message, ...) {
 	paint_line(COLOR_STATUS_BG);
 	set_colors(COLOR_STATUS_FG, COLOR_STATUS_BG);
 
-	printf("%s", buf);
+	screen_printf("%s", buf);
 
 	/* Clear the rest of the status bar */
 	clear_to_end();
@@ -4136,8 +4950,7 @@ void render_error(char * message, ...) {
 	set_colors(COLOR_ERROR_FG, COLOR_ERROR_BG);
 
 	/* Draw the message */
-	printf("%s", buf);
-	fflush(stdout);
+	screen_printf("%s", buf);
 }
 
 char * paren_pairs = "()[]{}<>";
@@ -4172,7 +4985,12 @@ void highlight_matching_paren(void) {
 		if (line != -1) env->highlighting_paren = 1;
 	}
 	if (!env->highlighting_paren) return;
-	for (int i = 0; i < env->line_count; ++i) {
+
+	/* Only the line with the last match can have anything to clear */
+	int lines[2] = {env->paren_line, line - 1};
+	for (int n = 0; n < 2; ++n) {
+		int i = lines[n];
+		if (i < 0 || i >= env->line_count || (n == 1 && i == lines[0])) continue;
 		int redraw = 0;
 		for (int j = 0; j < env->lines[i]->actual; ++j) {
 			if (i == line-1 && j == col-1) {
@@ -4192,6 +5010,7 @@ void highlight_matching_paren(void) {
 			}
 		}
 	}
+	env->paren_line = line - 1;
 	if (line == -1) env->highlighting_paren = 0;
 }
 
@@ -4319,6 +5138,7 @@ void SIGWINCH_handler(int sig) {
  */
 void SIGTSTP_handler(int sig) {
 	(void)sig;
+	screen_stop();
 	mouse_disable();
 	set_buffered();
 	reset();
@@ -4336,6 +5156,7 @@ void SIGCONT_handler(int sig) {
 	set_alternate_screen();
 	set_unbuffered();
 	mouse_enable();
+	screen_start();
 	redraw_all();
 	signal(SIGCONT, SIGCONT_handler);
 	signal(SIGTSTP, SIGTSTP_handler);
@@ -4408,31 +5229,45 @@ static inline uint32_t decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
 
 /**
  * Processs (part of) a file and add it to a buffer.
+ *
+ * While loading, text only ever goes on the end of the last line, so
+ * it is appended directly, a run of decoded characters at a time,
+ * rather than inserted one at a time.
  */
 void add_buffer(uint8_t * buf, int size) {
+	line_t * line = env->lines[env->line_no - 1];
 	for (int i = 0; i < size; ++i) {
-		if (!decode(&state, &codepoint_r, buf[i])) {
-			uint32_t c = codepoint_r;
-			if (c == '\n') {
-				env->lines = add_line(env->lines, env->line_no);
-				env->col_no = 1;
-				env->line_no += 1;
-			} else {
-				char_t _c;
-				_c.codepoint = (uint32_t)c;
-				_c.flags = 0;
-				_c.display_width = codepoint_width((wchar_t)c);
-				line_t * line  = env->lines[env->line_no - 1];
-				line_t * nline = line_insert(line, _c, env->col_no - 1, env->line_no-1);
-				if (line != nline) {
-					env->lines[env->line_no - 1] = nline;
-				}
-				env->col_no += 1;
+		if (buf[i] < 0x80 && state == UTF8_ACCEPT) {
+			/* ASCII needs no decoding */
+			codepoint_r = buf[i];
+		} else if (decode(&state, &codepoint_r, buf[i])) {
+			if (state == UTF8_REJECT) {
+				state = 0;
 			}
-		} else if (state == UTF8_REJECT) {
-			state = 0;
+			continue;
+		}
+
+		uint32_t c = codepoint_r;
+		if (c == '\n') {
+			env->lines[env->line_no - 1] = line;
+			env->lines = add_line(env->lines, env->line_no);
+			env->col_no = 1;
+			env->line_no += 1;
+			line = env->lines[env->line_no - 1];
+			continue;
+		}
+
+		if (line->actual == line->available) {
+			line->available = line->available ? line->available * 2 : 8;
+			line = realloc(line, sizeof(line_t) + sizeof(char_t) * line->available);
 		}
+		char_t * _c = &line->text[line->actual++];
+		_c->codepoint = c;
+		_c->flags = 0;
+		_c->display_width = codepoint_width((wchar_t)c);
+		env->col_no += 1;
 	}
+	env->lines[env->line_no - 1] = line;
 }
 
 struct syntax_definition * match_syntax(char * file) {
@@ -4552,8 +5387,9 @@ void open_file(char * file) {
 
 	if (global_config.hilight_on_open) {
 		env->syntax = match_syntax(file);
-		for (int i = 0; i < env->line_count; ++i) {
-			recalculate_syntax(env->lines[i],i);
+		if (env->syntax) {
+			/* Highlighted as it's drawn, and in the background */
+			syntax_mark_all();
 		}
 	}
 
@@ -4604,6 +5440,7 @@ void open_file(char * file) {
  * Clean up the terminal and exit the editor.
  */
 void quit(void) {
+	screen_stop();
 	mouse_disable();
 	set_buffered();
 	reset();
@@ -5207,8 +6044,9 @@ void process_command(char * cmd) {
 
 	if (*cmd == '!') {
 		/* Reset and draw some line feeds */
+		screen_stop();
 		reset();
-		printf("\n\n");
+		screen_printf("\n\n");
 
 		/* Set buffered for shell application */
 		set_buffered();
@@ -5218,11 +6056,12 @@ void process_command(char * cmd) {
 
 		/* Return to the editor, wait for user to press enter. */
 		set_unbuffered();
-		printf("\n\nPress ENTER to continue.");
+		screen_printf("\n\nPress ENTER to continue.");
 		fflush(stdout);
 		while ((c = bim_getch(), c != ENTER_KEY && c != LINE_FEED));
 
 		/* Redraw the screen */
+		screen_start();
 		redraw_all();
 
 		/* Done processing command */
@@ -5421,7 +6260,7 @@ void process_command(char * cmd) {
 		render_commandline_message("\n");
 		redraw_tabbar();
 		redraw_commandline();
-		fflush(stdout);
+		screen_flush();
 		int c;
 		while ((c = bim_getch())== -1);
 		bim_unget(c);
@@ -5520,7 +6359,7 @@ void process_command(char * cmd) {
 		/* Redrawing the tabbar makes it look like we just shifted the whole view up */
 		redraw_tabbar();
 		redraw_commandline();
-		fflush(stdout);
+		screen_flush();
 		/* Wait for a character so we can redraw the screen before continuing */
 		int c;
 		while ((c = bim_getch())== -1);
@@ -5595,26 +6434,14 @@ void process_command(char * cmd) {
 		for (struct syntax_definition * s = syntaxes; s->name; ++s) {
 			if (!strcmp(argv[1],s->name)) {
 				env->syntax = s;
-				for (int i = 0; i < env->line_count; ++i) {
-					env->lines[i]->istate = 0;
-				}
-				for (int i = 0; i < env->line_count; ++i) {
-					recalculate_syntax(env->lines[i],i);
-				}
+				syntax_mark_all();
 				redraw_all();
 				return;
 			}
 		}
 		render_error("unrecognized syntax type");
 	} else if (!strcmp(argv[0], "recalc")) {
-		for (int i = 0; i < env->line_count; ++i) {
-			env->lines[i]->istate = 0;
-		}
-		env->loading = 1;
-		for (int i = 0; i < env->line_count; ++i) {
-			recalculate_syntax(env->lines[i],i);
-		}
-		env->loading = 0;
+		syntax_mark_all();
 		redraw_all();
 	} else if (!strcmp(argv[0], "tabs")) {
 		env->tabs = 1;
@@ -5681,6 +6508,7 @@ void process_command(char * cmd) {
 				for (int i = 0; i < env->line_count; ++i) {
 					env->lines[i]->is_current = 0;
 				}
+				env->current_line = -1;
 			}
 			redraw_text();
 			place_cursor_actual();
@@ -5953,7 +6781,7 @@ _reject:
 	/* Redraw command line */
 done:
 	redraw_commandline();
-	printf(":%s", buffer);
+	screen_printf(":%s", buffer);
 
 	free(candidates);
 	free(buf);
@@ -6030,7 +6858,7 @@ void command_mode(void) {
 	int this_buf[20];
 
 	redraw_commandline();
-	printf(":");
+	screen_printf(":");
 	show_cursor();
 
 	int history_point = -1;
@@ -6113,7 +6941,7 @@ void command_mode(void) {
 								goto _redraw_buffer;
 							}
 						} else {
-							printf("%c", c);
+							screen_printf("%c", c);
 						}
 						break;
 				}
@@ -6154,7 +6982,7 @@ void command_mode(void) {
 
 _redraw_buffer:
 			redraw_commandline();
-			printf(":%s", buffer);
+			screen_printf(":%s", buffer);
 			show_cursor();
 		}
 	}
@@ -6266,12 +7094,12 @@ void draw_search_match(uint32_t * buffer, int redraw_buffer) {
 	redraw_statusbar();
 	redraw_commandline();
 	if (redraw_buffer != -1) {
-		printf(redraw_buffer == 1 ? "/" : "?");
+		screen_printf(redraw_buffer == 1 ? "/" : "?");
 		uint32_t * c = buffer;
 		while (*c) {
 			char tmp[7] = {0}; /* Max six bytes, use 7 to ensure last is always nil */
 			to_eight(*c, tmp);
-			printf("%s", tmp);
+			screen_printf("%s", tmp);
 			c++;
 		}
 	}
@@ -6296,18 +7124,18 @@ void search_mode(int direction) {
 	int prev_offset = env->offset;
 
 	redraw_commandline();
-	printf(direction == 1 ? "/" : "?");
+	screen_printf(direction == 1 ? "/" : "?");
 	if (env->search) {
-		printf("\0337");
+		screen_printf("\0337");
 		set_colors(COLOR_ALT_FG, COLOR_BG);
 		uint32_t * c = env->search;
 		while (*c) {
 			char tmp[7] = {0}; /* Max six bytes, use 7 to ensure last is always nil */
 			to_eight(*c, tmp);
-			printf("%s", tmp);
+			screen_printf("%s", tmp);
 			c++;
 		}
-		printf("\0338");
+		screen_printf("\0338");
 		set_colors(COLOR_FG, COLOR_BG);
 	}
 	show_cursor();
@@ -6386,7 +7214,7 @@ void search_mode(int direction) {
 				buffer[buffer_len] = '\0';
 				char tmp[7] = {0}; /* Max six bytes, use 7 to ensure last is always nil */
 				to_eight(c, tmp);
-				printf("%s", tmp);
+				screen_printf("%s", tmp);
 
 				/* Find the next search match */
 				int line = -1, col = -1;
@@ -6813,12 +7641,9 @@ void undo_history(void) {
 	env->loading = 0;
 
 	for (int i = 0; i < env->line_count; ++i) {
-		env->lines[i]->istate = 0;
 		recalculate_tabs(env->lines[i]);
 	}
-	for (int i = 0; i < env->line_count; ++i) {
-		recalculate_syntax(env->lines[i],i);
-	}
+	syntax_mark_all();
 	place_cursor_actual();
 	update_title();
 	redraw_all();
@@ -6941,12 +7766,9 @@ void redo_history(void) {
 	env->loading = 0;
 
 	for (int i = 0; i < env->line_count; ++i) {
-		env->lines[i]->istate = 0;
 		recalculate_tabs(env->lines[i]);
 	}
-	for (int i = 0; i < env->line_count; ++i) {
-		recalculate_syntax(env->lines[i],i);
-	}
+	syntax_mark_all();
 	place_cursor_actual();
 	update_title();
 	redraw_all();
@@ -8629,6 +9451,430 @@ _readonly:
 
 }
 
+/**
+ * Large file viewing
+ *
+ * A file bigger than global_config.large_file (or any file, with -L)
+ * is shown read-only, straight from the file, rather than loaded into
+ * a buffer - which would cost four bytes for every character, plus a
+ * line header for every line. All we keep is where every
+ * LARGE_FILE_STRIDE'th line starts, and one chunk of the file; lines
+ * are only decoded to be drawn.
+ *
+ * The file is read a chunk at a time rather than mapped: a private
+ * mapping would keep every page we ever looked at in memory, which is
+ * exactly what we're trying to avoid.
+ */
+#define LARGE_FILE_STRIDE   256
+#define LARGE_FILE_CHUNK    65536
+#define LARGE_FILE_LINE_MAX 4096 /* Bytes of a line worth decoding for display */
+
+struct {
+	int active;
+	int fd;
+	size_t size;
+
+	unsigned char * chunk;
+	size_t chunk_start;
+	size_t chunk_len;
+
+	size_t * index; /* Where every LARGE_FILE_STRIDE'th line starts */
+	int index_count;
+	int line_count;
+
+	int top;        /* First line on screen, from 0 */
+	int coffset;
+	line_t * line;  /* The line being drawn */
+
+	unsigned char search[256];
+	int search_len;
+} large = {0};
+
+/**
+ * Get up to `len` bytes of the file from `offset`, or fewer at the end
+ * of the file or the end of the current chunk.
+ */
+size_t large_read(size_t offset, unsigned char ** out, size_t len) {
+	if (offset >= large.size) return 0;
+	size_t chunk_end = large.chunk_start + large.chunk_len;
+	if (offset < large.chunk_start || offset >= chunk_end || (offset + len > chunk_end && chunk_end < large.size)) {
+		lseek(large.fd, offset, SEEK_SET);
+		ssize_t r = read(large.fd, large.chunk, LARGE_FILE_CHUNK);
+		large.chunk_start = offset;
+		large.chunk_len = r > 0 ? r : 0;
+		if (!large.chunk_len) return 0;
+	}
+	size_t have = large.chunk_start + large.chunk_len - offset;
+	*out = large.chunk + (offset - large.chunk_start);
+	return have < len ? have : len;
+}
+
+/**
+ * Open a file for viewing and find its lines.
+ */
+int large_open(char * file) {
+	large.fd = open(file, O_RDONLY);
+	if (large.fd < 0) return 1;
+
+	struct stat statbuf;
+	fstat(large.fd, &statbuf);
+	large.size = statbuf.st_size;
+	large.chunk = malloc(LARGE_FILE_CHUNK);
+	large.chunk_start = 0;
+	large.chunk_len = 0;
+
+	int index_avail = 64;
+	large.index = malloc(sizeof(size_t) * index_avail);
+	large.index[0] = 0;
+	large.index_count = 1;
+	large.line_count = 1;
+
+	size_t offset = 0;
+	unsigned char * data;
+	size_t len;
+	while ((len = large_read(offset, &data, LARGE_FILE_CHUNK)) > 0) {
+		unsigned char * c = data;
+		unsigned char * end = data + len;
+		while ((c = memchr(c, '\n', end - c))) {
+			c++;
+			if (offset + (c - data) == large.size) break; /* Nothing after the last line feed */
+			if (large.line_count % LARGE_FILE_STRIDE == 0) {
+				if (large.index_count == index_avail) {
+					index_avail *= 2;
+					large.index = realloc(large.index, sizeof(size_t) * index_avail);
+				}
+				large.index[large.index_count++] = offset + (c - data);
+			}
+			large.line_count++;
+		}
+		offset += len;
+	}
+
+	large.line = malloc(sizeof(line_t) + sizeof(char_t) * 64);
+	memset(large.line, 0, sizeof(line_t));
+	large.line->available = 64;
+	return 0;
+}
+
+/**
+ * Find where a line starts, from the nearest indexed line before it.
+ */
+size_t large_line_start(int line) {
+	size_t offset = large.index[line / LARGE_FILE_STRIDE];
+	int skip = line % LARGE_FILE_STRIDE;
+	unsigned char * data;
+	size_t len;
+	while (skip && (len = large_read(offset, &data, LARGE_FILE_CHUNK)) > 0) {
+		unsigned char * c = data;
+		while (skip && (c = memchr(c, '\n', data + len - c))) {
+			c++;
+			skip--;
+		}
+		offset += c ? (size_t)(c - data) : len;
+	}
+	return offset;
+}
+
+/**
+ * Which line the byte at `offset` is on.
+ */
+int large_line_at(size_t offset) {
+	int lo = 0, hi = large.index_count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (large.index[mid] <= offset) lo = mid;
+		else hi = mid - 1;
+	}
+	int line = lo * LARGE_FILE_STRIDE;
+	size_t at = large.index[lo];
+	unsigned char * data;
+	size_t len;
+	while (at < offset && (len = large_read(at, &data, offset - at < LARGE_FILE_CHUNK ? offset - at : LARGE_FILE_CHUNK)) > 0) {
+		for (unsigned char * c = data; (c = memchr(c, '\n', data + len - c)); c++) {
+			line++;
+		}
+		at += len;
+	}
+	return line;
+}
+
+/**
+ * Decode (the start of) a line for drawing.
+ */
+line_t * large_get_line(int line_no) {
+	line_t * line = large.line;
+	line->actual = 0;
+
+	unsigned char * data;
+	size_t len = large_read(large_line_start(line_no), &data, LARGE_FILE_LINE_MAX);
+	unsigned char * nl = memchr(data, '\n', len);
+	if (nl) len = nl - data;
+
+	uint32_t state = 0, codepoint = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (decode(&state, &codepoint, data[i])) {
+			if (state == UTF8_REJECT) state = 0;
+			continue;
+		}
+		if (line->actual == line->available) {
+			line->available *= 2;
+			line = realloc(line, sizeof(line_t) + sizeof(char_t) * line->available);
+		}
+		char_t * c = &line->text[line->actual++];
+		c->codepoint = codepoint;
+		c->flags = 0;
+		c->display_width = codepoint_width((wchar_t)codepoint);
+	}
+
+	recalculate_tabs(line);
+	large.line = line;
+	return line;
+}
+
+int large_rows(void) {
+	return global_config.term_height - global_config.bottom_size - 1;
+}
+
+int large_viewing(void) {
+	return large.active;
+}
+
+void large_redraw(void) {
+	redraw_tabbar();
+
+	int num_size = log_base_10(large.line_count) + 1;
+	if (num_size < 2) num_size = 2;
+
+	for (int j = 0; j < large_rows(); ++j) {
+		int x = large.top + j;
+		if (x >= large.line_count) {
+			draw_excess_line(j);
+			continue;
+		}
+		place_cursor(1, 2 + j);
+		set_colors(COLOR_NUMBER_FG, COLOR_ALT_FG);
+		screen_printf(" ");
+		set_colors(COLOR_NUMBER_FG, COLOR_NUMBER_BG);
+		screen_printf("%*d ", num_size + 1, x + 1);
+		render_line(large_get_line(x), global_config.term_width - 3 - num_size, large.coffset, x + 1);
+	}
+
+	char right_hand[64];
+	snprintf(right_hand, sizeof(right_hand), " Line %d/%d ", large.top + 1, large.line_count);
+	render_status_message("%s [large file, read-only]", env->file_name);
+	place_cursor(global_config.term_width - strlen(right_hand), global_config.term_height - 1);
+	screen_printf("%s", right_hand);
+
+	redraw_commandline();
+	hide_cursor();
+}
+
+void large_scroll_to(int line) {
+	int last = large.line_count - large_rows();
+	if (line > last) line = last;
+	if (line < 0) line = 0;
+	large.top = line;
+}
+
+/**
+ * Read a line of input on the command line. Returns 0 if it was
+ * cancelled.
+ */
+int large_prompt(char * prefix, char * buf, int size) {
+	int len = 0;
+	buf[0] = '\0';
+	while (1) {
+		render_commandline_message("%s%s", prefix, buf);
+		show_cursor();
+		int c = bim_getch();
+		if (c == -1) continue;
+		if (c == '\033' || c == 3) {
+			redraw_commandline();
+			return 0;
+		} else if (c == ENTER_KEY || c == LINE_FEED) {
+			return 1;
+		} else if (c == BACKSPACE_KEY || c == DELETE_KEY) {
+			if (!len) {
+				redraw_commandline();
+				return 0;
+			}
+			buf[--len] = '\0';
+		} else if ((c >= ' ' || c == '\t') && len < size - 1) {
+			buf[len++] = c;
+			buf[len] = '\0';
+		}
+	}
+}
+
+/**
+ * Find the search between two offsets; returns where, or `to` if it isn't there.
+ */
+size_t large_find(size_t offset, size_t to) {
+	unsigned char * data;
+	size_t len;
+	while (offset + large.search_len <= to && (len = large_read(offset, &data, LARGE_FILE_CHUNK)) >= (size_t)large.search_len) {
+		if (len > to - offset) len = to - offset;
+		unsigned char * end = data + len - large.search_len + 1;
+		for (unsigned char * c = data; (c = memchr(c, large.search[0], end - c)); c++) {
+			if (!memcmp(c, large.search, large.search_len)) {
+				return offset + (c - data);
+			}
+		}
+		if (offset + len == to) break;
+		offset += len - large.search_len + 1;
+	}
+	return to;
+}
+
+/**
+ * Find the next line, after the one at the top, containing the search,
+ * wrapping around to the start of the file.
+ */
+int large_search_next(void) {
+	if (!large.search_len) return 1;
+	size_t start = (large.top + 1 < large.line_count) ? large_line_start(large.top + 1) : large.size;
+	size_t found = large_find(start, large.size);
+	if (found == large.size) {
+		/* Matches that start before `start` but run over it still count */
+		size_t end = start + large.search_len - 1;
+		found = large_find(0, end < large.size ? end : large.size);
+		if (found >= start) return 0;
+	}
+	large_scroll_to(large_line_at(found));
+	return 1;
+}
+
+/**
+ * View a large file until asked to quit.
+ */
+void view_large_file(char * file) {
+	env = buffer_new();
+	setup_buffer(env);
+	env->file_name = strdup(file);
+	env->readonly = 1;
+	env->width = global_config.term_width;
+	update_title();
+
+	render_commandline_message("Indexing %s...", file);
+	screen_flush();
+	if (large_open(file)) {
+		render_error("Could not open %s", file);
+		bim_getch_timeout(-1);
+		return;
+	}
+	large.active = 1;
+
+	large_redraw();
+	while (1) {
+		int c = bim_getch();
+		if (c == -1) continue;
+		int found = 1;
+		int page = large_rows() - 1;
+		if (c == '\033') {
+			int seq[4] = {0};
+			for (int i = 0; i < 4; ++i) {
+				seq[i] = bim_getch_timeout(50);
+				if (seq[i] == -1 || (i > 0 && seq[i] >= '@')) break;
+			}
+			if (seq[0] != '[') continue;
+			switch (seq[1]) {
+				case 'A': c = 'k'; break;
+				case 'B': c = 'j'; break;
+				case 'C': c = 'l'; break;
+				case 'D': c = 'h'; break;
+				case 'H': c = 'g'; break;
+				case 'F': c = 'G'; break;
+				case '5': c = 2; break; /* Page Up */
+				case '6': c = 6; break; /* Page Down */
+				case 'M': {
+					/* Mouse; only the wheel does anything */
+					int b = bim_getch_timeout(50);
+					bim_getch_timeout(50);
+					bim_getch_timeout(50);
+					if (b == 96) large_scroll_to(large.top - global_config.scroll_amount);
+					if (b == 97) large_scroll_to(large.top + global_config.scroll_amount);
+					large_redraw();
+					continue;
+				}
+				default: continue;
+			}
+		}
+		switch (c) {
+			case 'q':
+				return;
+			case 'j':
+			case ENTER_KEY:
+			case LINE_FEED:
+				large_scroll_to(large.top + 1);
+				break;
+			case 'k':
+				large_scroll_to(large.top - 1);
+				break;
+			case 'l':
+				large.coffset += 8;
+				break;
+			case 'h':
+				large.coffset = large.coffset > 8 ? large.coffset - 8 : 0;
+				break;
+			case '0':
+				large.coffset = 0;
+				break;
+			case ' ':
+			case 6: /* ^F */
+				large_scroll_to(large.top + page);
+				break;
+			case 'b':
+			case 2: /* ^B */
+				large_scroll_to(large.top - page);
+				break;
+			case 4: /* ^D */
+				large_scroll_to(large.top + page / 2);
+				break;
+			case 21: /* ^U */
+				large_scroll_to(large.top - page / 2);
+				break;
+			case 'g':
+				large_scroll_to(0);
+				break;
+			case 'G':
+				large_scroll_to(large.line_count);
+				break;
+			case '/': {
+				char buf[sizeof(large.search)];
+				if (large_prompt("/", buf, sizeof(buf)) && *buf) {
+					strcpy((char *)large.search, buf);
+					large.search_len = strlen(buf);
+					found = large_search_next();
+				}
+				break;
+			}
+			case 'n':
+				found = large_search_next();
+				break;
+			case ':': {
+				char buf[64];
+				if (large_prompt(":", buf, sizeof(buf))) {
+					if (!strcmp(buf, "q") || !strcmp(buf, "q!") || !strcmp(buf, "qa")) return;
+					if (is_all_numbers(buf) && *buf) large_scroll_to(atoi(buf) - 1);
+				}
+				break;
+			}
+		}
+		large_redraw();
+		if (!found) render_error("Pattern not found: %s", large.search);
+	}
+}
+
+/**
+ * Whether a file should be viewed with view_large_file()
+ */
+int is_large_file(char * file) {
+	struct stat statbuf;
+	if (stat(file, &statbuf) || !S_ISREG(statbuf.st_mode)) return 0;
+	if (global_config.view_large) return 1;
+	return global_config.large_file > 0 && statbuf.st_size >= (off_t)global_config.large_file * 1024 * 1024;
+}
+
 /**
  * Show help text for -?
  */
@@ -8642,6 +9888,7 @@ static void show_usage(char * argv[]) {
 			"       %s [options] -- -\n"
 			"\n"
 			" -R     " _s "open initial buffer read-only" _e
+			" -L     " _s "view initial file read-only, without loading it" _e
 			" -O     " _s "set various options:" _e
 			"        noscroll    " _s "disable terminal scrolling" _e
 			"        noaltscreen " _s "disable alternate screen buffer" _e
@@ -8777,6 +10024,11 @@ void load_bimrc(void) {
 		if (!strcmp(l,"colorgutter") && value) {
 			global_config.color_gutter = !!atoi(value);
 		}
+
+		/* largefile= size in MiB from which files are viewed, not loaded; 0 for never */
+		if (!strcmp(l,"largefile") && value) {
+			global_config.large_file = atoi(value);
+		}
 	}
 
 	fclose(bimrc);
@@ -8847,21 +10099,27 @@ void init_terminal(void) {
 	signal(SIGWINCH, SIGWINCH_handler);
 	signal(SIGCONT,  SIGCONT_handler);
 	signal(SIGTSTP,  SIGTSTP_handler);
+
+	screen_start();
 }
 
 int main(int argc, char * argv[]) {
 	int opt;
-	while ((opt = getopt(argc, argv, "?c:C:u:RO:-:")) != -1) {
+	while ((opt = getopt(argc, argv, "?c:C:u:RLO:-:")) != -1) {
 		switch (opt) {
 			case 'R':
 				global_config.initial_file_is_read_only = 1;
 				break;
+			case 'L':
+				global_config.view_large = 1;
+				break;
 			case 'c':
 			case 'C':
 				/* Print file to stdout using our syntax highlighting and color theme */
 				initialize();
 				global_config.go_to_line = 0;
 				open_file(optarg);
+				syntax_catch_up(env->line_count, env->line_count, 0);
 				for (int i = 0; i < env->line_count; ++i) {
 					if (opt == 'C') {
 						draw_line_number(i);
@@ -8921,7 +10179,10 @@ int main(int argc, char * argv[]) {
 	init_terminal();
 
 	/* Open file */
-	if (argc > optind) {
+	if (argc > optind && is_large_file(argv[optind])) {
+		view_large_file(argv[optind]);
+		quit();
+	} else if (argc > optind) {
 		open_file(argv[optind]);
 		update_title();
 		if (global_config.initial_file_is_read_only) {
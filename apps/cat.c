@@ -16,6 +16,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
 
@@ -23,6 +24,17 @@ static char * _argv_0;
 static char * _file;
 
 void doit(int fd) {
+	/* Let the kernel move the data if it can */
+	while (1) {
+		ssize_t r = sendfile(STDOUT_FILENO, fd, NULL, CHUNK_SIZE * 16);
+		if (!r) return;
+		if (r < 0) {
+			if (errno == EINVAL || errno == ENOSYS) break;
+			fprintf(stderr, "%s: %s: %s\n", _argv_0, _file, strerror(errno));
+			return;
+		}
+	}
+
 	while (1) {
 		char buf[CHUNK_SIZE];
 		memset(buf, 0, CHUNK_SIZE);
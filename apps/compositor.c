@@ -31,10 +31,14 @@
 #include <sys/fswait.h>
 #include <sys/sysfunc.h>
 #include <sys/shm.h>
+#include <sys/ioctl.h>
+#include <sys/input.h>
 #include <pthread.h>
 #include <dlfcn.h>
 /* auto-dep: export-dynamic */
 
+#include <kernel/video.h>
+
 #include <toaru/graphics.h>
 #include <toaru/mouse.h>
 #include <toaru/kbd.h>
@@ -56,6 +60,8 @@
 
 /* Early definitions */
 static void mark_window(yutani_globals_t * yg, yutani_server_window_t * window);
+static void mark_window_relative(yutani_globals_t * yg, yutani_server_window_t * window, int32_t x, int32_t y, int32_t width, int32_t height);
+static yutani_server_window_t * top_at(yutani_globals_t * yg, uint16_t x, uint16_t y);
 static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t * w);
 static void notify_subscribers(yutani_globals_t * yg);
 
@@ -68,6 +74,7 @@ static int (*renderer_pop_state)(yutani_globals_t * yg) = NULL;
 static int (*renderer_destroy)(yutani_globals_t * yg) = NULL;
 static int (*renderer_blit_window)(yutani_globals_t * yg, yutani_server_window_t * window, int x, int y);
 static int (*renderer_blit_screen)(yutani_globals_t * yg) = NULL;
+static int (*renderer_close_window)(yutani_globals_t * yg, yutani_server_window_t * window) = NULL;
 
 /**
  * Print usage information.
@@ -76,11 +83,12 @@ static int usage(char * argv[]) {
 	fprintf(stderr,
 			"Yutani - Window Compositor\n"
 			"\n"
-			"usage: %s [-n [-g WxH]] [-h]\n"
+			"usage: %s [-n [-g WxH]] [-t N] [-h]\n"
 			"\n"
 			" -n --nested     \033[3mRun in a window.\033[0m\n"
 			" -h --help       \033[3mShow this help message.\033[0m\n"
 			" -g --geometry   \033[3mSet the size of the server framebuffer.\033[0m\n"
+			" -t --threads    \033[3mCompose frames with N threads.\033[0m\n"
 			"\n"
 			"  Yutani is the standard system compositor.\n"
 			"\n",
@@ -95,12 +103,13 @@ static int parse_args(int argc, char * argv[], int * out) {
 	static struct option long_opts[] = {
 		{"nested",     no_argument,       0, 'n'},
 		{"geometry",   required_argument, 0, 'g'},
+		{"threads",    required_argument, 0, 't'},
 		{"help",       no_argument,       0, 'h'},
 		{0,0,0,0}
 	};
 
 	int index, c;
-	while ((c = getopt_long(argc, argv, "hg:n", long_opts, &index)) != -1) {
+	while ((c = getopt_long(argc, argv, "hg:nt:", long_opts, &index)) != -1) {
 		if (!c) {
 			if (long_opts[index].flag == 0) {
 				c = long_opts[index].val;
@@ -123,6 +132,11 @@ static int parse_args(int argc, char * argv[], int * out) {
 					}
 				}
 				break;
+			case 't':
+				yutani_options.render_threads = atoi(optarg);
+				if (yutani_options.render_threads < 1) yutani_options.render_threads = 1;
+				if (yutani_options.render_threads > YUTANI_MAX_RENDER_THREADS) yutani_options.render_threads = YUTANI_MAX_RENDER_THREADS;
+				break;
 			default:
 				fprintf(stderr, "Unrecognized option: %c\n", c);
 				break;
@@ -150,6 +164,7 @@ static void try_load_extensions(yutani_globals_t * yg) {
 		renderer_destroy = dlsym(cairo, "renderer_destroy");
 		renderer_blit_window = dlsym(cairo, "renderer_blit_window");
 		renderer_blit_screen = dlsym(cairo, "renderer_blit_screen");
+		renderer_close_window = dlsym(cairo, "renderer_close_window");
 	}
 
 	/* On success, these are now set */
@@ -255,6 +270,7 @@ void yutani_window_to_device(yutani_server_window_t * window, int32_t x, int32_t
 static void unorder_window(yutani_globals_t * yg, yutani_server_window_t * w) {
 	unsigned short index = w->z;
 	w->z = -1;
+	yg->hit_dirty = 1;
 	if (index == YUTANI_ZORDER_BOTTOM) {
 		yg->bottom_z = NULL;
 		return;
@@ -283,6 +299,7 @@ static void reorder_window(yutani_globals_t * yg, yutani_server_window_t * windo
 	spin_unlock(&yg->redraw_lock);
 
 	window->z = new_zed;
+	yg->hit_dirty = 1;
 
 	if (new_zed != YUTANI_ZORDER_TOP && new_zed != YUTANI_ZORDER_BOTTOM) {
 		spin_lock(&yg->redraw_lock);
@@ -326,6 +343,75 @@ static void make_top(yutani_globals_t * yg, yutani_server_window_t * w) {
 
 	list_delete(yg->mid_zs, n);
 	list_append(yg->mid_zs, n);
+	yg->hit_dirty = 1;
+}
+
+/**
+ * Give a client an event ring, along with its first window.
+ */
+static void client_events_create(yutani_globals_t * yg, unsigned int owner, yutani_wid_t wid) {
+	if (hashmap_has(yg->clients_to_events, (void *)owner)) return;
+
+	char key[1024];
+	YUTANI_SHMKEY_EVENTS(yg->server_ident, key, 1024, wid);
+	size_t size = sizeof(yutani_event_ring_t);
+	yutani_client_events_t * events = malloc(sizeof(yutani_client_events_t));
+	events->wid = wid;
+	events->ring = shm_obtain(key, &size);
+	memset((void *)events->ring, 0, sizeof(yutani_event_ring_t));
+	hashmap_set(yg->clients_to_events, (void *)owner, events);
+}
+
+static void client_events_destroy(yutani_globals_t * yg, unsigned int owner) {
+	yutani_client_events_t * events = hashmap_remove(yg->clients_to_events, (void *)owner);
+	if (!events) return;
+
+	char key[1024];
+	YUTANI_SHMKEY_EVENTS(yg->server_ident, key, 1024, events->wid);
+	shm_release(key);
+	free(events);
+}
+
+/**
+ * Send an event to a client.
+ *
+ * Input, focus and resize offers go in the client's event ring when
+ * it has one ready with room; ringing the bell if the client asked
+ * means sending a message, but only one per wait. Everything else,
+ * and events that don't fit, are sent as messages.
+ */
+static void send_event(yutani_globals_t * yg, unsigned int owner, yutani_msg_t * msg) {
+	switch (msg->type) {
+		case YUTANI_MSG_KEY_EVENT:
+		case YUTANI_MSG_WINDOW_MOUSE_EVENT:
+		case YUTANI_MSG_WINDOW_FOCUS_CHANGE:
+		case YUTANI_MSG_RESIZE_OFFER:
+			break;
+		default:
+			pex_send(yg->server, owner, msg->size, (char *)msg);
+			return;
+	}
+
+	yutani_client_events_t * events = hashmap_get(yg->clients_to_events, (void *)owner);
+	yutani_event_ring_t * ring = events ? events->ring : NULL;
+
+	if (!ring || !ring->ready || msg->size > YUTANI_EVENT_SIZE || ring->head - ring->tail >= YUTANI_EVENT_RING_SIZE) {
+		pex_send(yg->server, owner, msg->size, (char *)msg);
+		return;
+	}
+
+	uint32_t head = ring->head;
+	memcpy(ring->events[head % YUTANI_EVENT_RING_SIZE], msg, msg->size);
+
+	/* The event has to be there before the client can see it, and the client sees it before we look at the bell */
+	__sync_synchronize();
+	ring->head = head + 1;
+	__sync_synchronize();
+
+	if (__sync_lock_test_and_set(&ring->bell, 0)) {
+		yutani_msg_t bell = { YUTANI_MSG__MAGIC, YUTANI_MSG_EVENT_RING, sizeof(yutani_msg_t) };
+		pex_send(yg->server, owner, bell.size, (char *)&bell);
+	}
 }
 
 /**
@@ -344,14 +430,14 @@ static void set_focused_window(yutani_globals_t * yg, yutani_server_window_t * w
 		/* Send focus change to old focused window */
 		yutani_msg_buildx_window_focus_change_alloc(response);
 		yutani_msg_buildx_window_focus_change(response, yg->focused_window->wid, 0);
-		pex_send(yg->server, yg->focused_window->owner, response->size, (char *)response);
+		send_event(yg, yg->focused_window->owner, response);
 	}
 	yg->focused_window = w;
 	if (w) {
 		/* Send focus change to new focused window */
 		yutani_msg_buildx_window_focus_change_alloc(response);
 		yutani_msg_buildx_window_focus_change(response, w->wid, 1);
-		pex_send(yg->server, w->owner, response->size, (char *)response);
+		send_event(yg, w->owner, response);
 		make_top(yg, w);
 		mark_window(yg, w);
 	} else {
@@ -409,6 +495,9 @@ static yutani_server_window_t * server_window_create(yutani_globals_t * yg, int
 	win->bufid = next_buf_id();
 	win->rotation = 0;
 	win->newbufid = 0;
+	win->newbuffer = NULL;
+	win->sparebufid = 0;
+	win->sparebuffer = NULL;
 	win->client_flags   = 0;
 	win->client_offsets[0] = 0;
 	win->client_offsets[1] = 0;
@@ -427,6 +516,8 @@ static yutani_server_window_t * server_window_create(yutani_globals_t * yg, int
 	win->default_mouse = 1;
 	win->server_flags = flags;
 	win->opacity = 255;
+	win->opaque_region = (gfx_rect_t){0, 0, 0, 0};
+	win->renderer_data = NULL;
 
 	char key[1024];
 	YUTANI_SHMKEY(yg->server_ident, key, 1024, win);
@@ -435,6 +526,12 @@ static yutani_server_window_t * server_window_create(yutani_globals_t * yg, int
 
 	win->buffer = shm_obtain(key, &size);
 	memset(win->buffer, 0, size);
+	win->buffer_size = size;
+
+	YUTANI_SHMKEY_DAMAGE(yg->server_ident, key, 1024, win->wid);
+	size = sizeof(yutani_damage_ring_t);
+	win->damage = shm_obtain(key, &size);
+	memset(win->damage, 0, sizeof(yutani_damage_ring_t));
 
 	list_insert(yg->mid_zs, win);
 
@@ -457,6 +554,32 @@ static void server_window_update_shape(yutani_globals_t * yg, yutani_server_wind
 	window->alpha_threshold = set;
 }
 
+/*
+ * Buffers the event thread is done with. The render thread may still be
+ * drawing from one, so they are let go of when the next frame is
+ * planned; by then nothing can be holding on to them.
+ */
+static list_t * retired_buffers = NULL;
+
+static void yutani_retire_buffer(yutani_globals_t * yg, uint32_t bufid) {
+	spin_lock(&yg->redraw_lock);
+	if (!retired_buffers) retired_buffers = list_create();
+	list_insert(retired_buffers, (void *)(uintptr_t)bufid);
+	spin_unlock(&yg->redraw_lock);
+}
+
+/* Called with the redraw lock held */
+static void yutani_release_retired(yutani_globals_t * yg) {
+	if (!retired_buffers) return;
+	while (retired_buffers->length) {
+		node_t * node = list_dequeue(retired_buffers);
+		char key[1024];
+		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, (uint32_t)(uintptr_t)node->value);
+		shm_release(key);
+		free(node);
+	}
+}
+
 /**
  * Start resizing a window.
  *
@@ -472,14 +595,35 @@ static uint32_t server_window_resize(yutani_globals_t * yg, yutani_server_window
 		/* Already in the middle of an accept/done, bail */
 		return win->newbufid;
 	}
+
+	size_t needed = (width * height * 4);
+
+	if (win->sparebufid && win->sparebuffer_size >= needed) {
+		/* The last buffer is big enough; the client still has it too */
+		win->newbufid = win->sparebufid;
+		win->newbuffer = win->sparebuffer;
+		win->newbuffer_size = win->sparebuffer_size;
+		win->sparebufid = 0;
+		win->sparebuffer = NULL;
+		return win->newbufid;
+	}
+
+	if (win->sparebufid) {
+		yutani_retire_buffer(yg, win->sparebufid);
+		win->sparebufid = 0;
+		win->sparebuffer = NULL;
+	}
+
 	win->newbufid = next_buf_id();
 
 	{
 		char key[1024];
 		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, win->newbufid);
 
-		size_t size = (width * height * 4);
+		/* Leave room to grow a bit before we need another one */
+		size_t size = needed + needed / 4;
 		win->newbuffer = shm_obtain(key, &size);
+		win->newbuffer_size = size;
 	}
 
 	return win->newbufid;
@@ -488,35 +632,35 @@ static uint32_t server_window_resize(yutani_globals_t * yg, yutani_server_window
 /**
  * Finish the resize process.
  *
- * We delete the unlink the old buffer and then swap the pointers
- * for the new buffer.
+ * We swap the pointers for the new buffer and keep the old
+ * one around as the spare.
  */
 static void server_window_resize_finish(yutani_globals_t * yg, yutani_server_window_t * win, int width, int height) {
 	if (!win->newbufid) {
 		return;
 	}
 
-	int oldbufid = win->bufid;
-
 	mark_window(yg, win);
 
 	spin_lock(&yg->redraw_lock);
 
 	win->width = width;
 	win->height = height;
+	win->opaque_region = (gfx_rect_t){0, 0, 0, 0};
+	yg->hit_dirty = 1;
+
+	/* The old buffer becomes the spare for next time */
+	win->sparebufid = win->bufid;
+	win->sparebuffer = win->buffer;
+	win->sparebuffer_size = win->buffer_size;
 
 	win->bufid = win->newbufid;
 	win->buffer = win->newbuffer;
+	win->buffer_size = win->newbuffer_size;
 
 	win->newbuffer = NULL;
 	win->newbufid = 0;
 
-	{
-		char key[1024];
-		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, oldbufid);
-		shm_release(key);
-	}
-
 	spin_unlock(&yg->redraw_lock);
 
 	mark_window(yg, win);
@@ -533,6 +677,39 @@ static void yutani_add_clip(yutani_globals_t * yg, double x, double y, double w,
 	}
 }
 
+/**
+ * Queue a damage rectangle for the next frame.
+ *
+ * Clients often flip the same area several times within one frame, so
+ * a rectangle that overlaps one already queued is merged into it when
+ * their bounding box isn't much bigger than the two of them.
+ */
+static void yutani_queue_damage(yutani_globals_t * yg, yutani_damage_rect_t * rect) {
+	int64_t area = (int64_t)rect->width * rect->height;
+
+	spin_lock(&yg->update_list_lock);
+	foreach (node, yg->update_list) {
+		yutani_damage_rect_t * queued = node->value;
+		int32_t x0 = min(queued->x, rect->x);
+		int32_t y0 = min(queued->y, rect->y);
+		int32_t x1 = max(queued->x + (int32_t)queued->width, rect->x + (int32_t)rect->width);
+		int32_t y1 = max(queued->y + (int32_t)queued->height, rect->y + (int32_t)rect->height);
+		int overlaps = rect->x < queued->x + (int32_t)queued->width && queued->x < rect->x + (int32_t)rect->width &&
+			rect->y < queued->y + (int32_t)queued->height && queued->y < rect->y + (int32_t)rect->height;
+		if (overlaps && (int64_t)(x1 - x0) * (y1 - y0) <= area + (int64_t)queued->width * queued->height) {
+			queued->x = x0;
+			queued->y = y0;
+			queued->width = x1 - x0;
+			queued->height = y1 - y0;
+			spin_unlock(&yg->update_list_lock);
+			free(rect);
+			return;
+		}
+	}
+	list_insert(yg->update_list, rect);
+	spin_unlock(&yg->update_list_lock);
+}
+
 /**
  * Mark a screen region as damaged.
  */
@@ -544,17 +721,14 @@ static void mark_screen(yutani_globals_t * yg, int32_t x, int32_t y, int32_t wid
 	rect->width = width;
 	rect->height = height;
 
-	spin_lock(&yg->update_list_lock);
-	list_insert(yg->update_list, rect);
-	spin_unlock(&yg->update_list_lock);
+	yutani_queue_damage(yg, rect);
 }
 
 /**
- * Draw the cursor sprite.
+ * Pick the cursor sprite for the current mouse state.
  */
-static void draw_cursor(yutani_globals_t * yg, int x, int y, int cursor) {
+static sprite_t * cursor_sprite(yutani_globals_t * yg, int cursor) {
 	sprite_t * sprite = &yg->mouse_sprite;
-	static sprite_t * previous = NULL;
 	if (yg->resizing_window) {
 		switch (yg->resizing_direction) {
 			case SCALE_UP:
@@ -587,19 +761,65 @@ static void draw_cursor(yutani_globals_t * yg, int x, int y, int cursor) {
 			case YUTANI_CURSOR_TYPE_RESIZE_DOWN_UP:    sprite = &yg->mouse_sprite_resize_db; break;
 		}
 	}
+	return sprite;
+}
+
+/**
+ * Draw the cursor sprite.
+ */
+static void draw_cursor(yutani_globals_t * yg, int x, int y, int cursor) {
+	sprite_t * sprite = cursor_sprite(yg, cursor);
+	static sprite_t * previous = NULL;
 	if (sprite != previous) {
 		mark_screen(yg, x / MOUSE_SCALE - MOUSE_OFFSET_X, y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
 		previous = sprite;
 	}
 
-	if (yg->vbox_pointer > 0) {
-		if (write(yg->vbox_pointer, sprite->bitmap, 48*48*4) > 0) {
-			/* if that was successful, we don't need to draw the cursor */
-			return;
+	draw_sprite(yg->backend_ctx, sprite, x / MOUSE_SCALE - MOUSE_OFFSET_X, y / MOUSE_SCALE - MOUSE_OFFSET_Y);
+}
+
+/**
+ * Hand the cursor to the display hardware, if it has a cursor plane.
+ *
+ * Returns 1 if the hardware is showing (or hiding) the cursor, so it
+ * needs no drawing and moving it damages nothing; 0 if it has to be
+ * drawn. Only talks to the device when something actually changed.
+ */
+static int update_hw_cursor(yutani_globals_t * yg, int x, int y) {
+	if (yg->display_fd <= 0 || yg->hw_cursor_unavailable) return 0;
+
+	yutani_server_window_t * tmp_window = top_at(yg, x / MOUSE_SCALE, y / MOUSE_SCALE);
+	int visible = !tmp_window || tmp_window->show_mouse;
+	int changed = !yg->hw_cursor;
+
+	if (visible) {
+		sprite_t * sprite = cursor_sprite(yg, tmp_window ? tmp_window->show_mouse : 1);
+		if (sprite != yg->hw_cursor_sprite) {
+			struct vid_cursor cursor = {sprite->width, sprite->height, MOUSE_OFFSET_X, MOUSE_OFFSET_Y, sprite->bitmap};
+			if (ioctl(yg->display_fd, IO_VID_CURSOR, &cursor) < 0) {
+				/* No usable cursor plane; stop asking */
+				TRACE("Hardware cursor unavailable, drawing it instead.");
+				yg->hw_cursor_unavailable = 1;
+				return 0;
+			}
+			yg->hw_cursor_sprite = sprite;
+			changed = 1;
 		}
 	}
 
-	draw_sprite(yg->backend_ctx, sprite, x / MOUSE_SCALE - MOUSE_OFFSET_X, y / MOUSE_SCALE - MOUSE_OFFSET_Y);
+	if (changed || visible != yg->hw_cursor_visible ||
+			(visible && (x / MOUSE_SCALE != yg->hw_cursor_x || y / MOUSE_SCALE != yg->hw_cursor_y))) {
+		struct vid_cursor_pos pos = {x / MOUSE_SCALE, y / MOUSE_SCALE, visible};
+		if (ioctl(yg->display_fd, IO_VID_CURSOR_MOVE, &pos) < 0) {
+			/* The device can't follow us right now (eg. VirtualBox without mouse integration) */
+			return 0;
+		}
+		yg->hw_cursor_x = pos.x;
+		yg->hw_cursor_y = pos.y;
+		yg->hw_cursor_visible = visible;
+	}
+
+	return 1;
 }
 
 /**
@@ -624,22 +844,143 @@ static yutani_server_window_t * check_top_at(yutani_globals_t * yg, yutani_serve
 	return NULL;
 }
 
+#define HIT_CELL_SHIFT 7 /* 128px cells */
+
+/**
+ * The screen-space box a window can take the cursor in.
+ *
+ * Rotated windows get a box around the circle they could sweep
+ * through, which is generous but never misses anything.
+ */
+static void hit_bounds(yutani_server_window_t * w, int * x0, int * y0, int * x1, int * y1) {
+	if (!w->rotation) {
+		*x0 = w->x;
+		*y0 = w->y;
+		*x1 = w->x + w->width;
+		*y1 = w->y + w->height;
+		return;
+	}
+	int cx = w->x + w->width / 2;
+	int cy = w->y + w->height / 2;
+	int r = (int)sqrt((double)w->width * w->width + (double)w->height * w->height) / 2 + 2;
+	*x0 = cx - r;
+	*y0 = cy - r;
+	*x1 = cx + r;
+	*y1 = cy + r;
+}
+
+/* Cells a box covers, clipped to the grid; returns 0 if it's off screen */
+static int hit_cell_range(yutani_globals_t * yg, yutani_server_window_t * w, int * c0, int * r0, int * c1, int * r1) {
+	int x0, y0, x1, y1;
+	hit_bounds(w, &x0, &y0, &x1, &y1);
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > (int)yg->width) x1 = yg->width;
+	if (y1 > (int)yg->height) y1 = yg->height;
+	if (x0 >= x1 || y0 >= y1) return 0;
+	*c0 = x0 >> HIT_CELL_SHIFT;
+	*r0 = y0 >> HIT_CELL_SHIFT;
+	*c1 = (x1 - 1) >> HIT_CELL_SHIFT;
+	*r1 = (y1 - 1) >> HIT_CELL_SHIFT;
+	return 1;
+}
+
+/* Runs body for each window in the stack, top to bottom */
+#define foreach_stacked(yg, w, body) do { \
+	yutani_server_window_t * w; \
+	if ((w = (yg)->top_z)) { body } \
+	foreachr(_node, (yg)->mid_zs) { w = _node->value; body } \
+	if ((w = (yg)->bottom_z)) { body } \
+} while (0)
+
+/**
+ * Rebuild the hit-testing grid.
+ *
+ * Each cell gets the windows whose boxes touch it, in stack order,
+ * packed into one array: two passes, one to count and one to fill.
+ * Only done when something has moved, resized, restacked or rotated.
+ */
+static void hit_rebuild(yutani_globals_t * yg) {
+	int cols = (yg->width + (1 << HIT_CELL_SHIFT) - 1) >> HIT_CELL_SHIFT;
+	int rows = (yg->height + (1 << HIT_CELL_SHIFT) - 1) >> HIT_CELL_SHIFT;
+	int cells = cols * rows;
+
+	if (cells > yg->hit_cells) {
+		free(yg->hit_start);
+		free(yg->hit_fill);
+		yg->hit_start = malloc(sizeof(int) * (cells + 1));
+		yg->hit_fill = malloc(sizeof(int) * cells);
+		yg->hit_cells = cells;
+	}
+	yg->hit_cols = cols;
+	yg->hit_rows = rows;
+
+	memset(yg->hit_fill, 0, sizeof(int) * cells);
+	int c0, r0, c1, r1;
+	foreach_stacked(yg, w, {
+		if (hit_cell_range(yg, w, &c0, &r0, &c1, &r1)) {
+			for (int r = r0; r <= r1; ++r) {
+				for (int c = c0; c <= c1; ++c) {
+					yg->hit_fill[r * cols + c]++;
+				}
+			}
+		}
+	});
+
+	int total = 0;
+	for (int i = 0; i < cells; ++i) {
+		yg->hit_start[i] = total;
+		total += yg->hit_fill[i];
+		yg->hit_fill[i] = yg->hit_start[i];
+	}
+	yg->hit_start[cells] = total;
+
+	if (total > yg->hit_entries) {
+		free(yg->hit_windows);
+		yg->hit_windows = malloc(sizeof(yutani_server_window_t *) * total);
+		yg->hit_entries = total;
+	}
+
+	foreach_stacked(yg, w, {
+		if (hit_cell_range(yg, w, &c0, &r0, &c1, &r1)) {
+			for (int r = r0; r <= r1; ++r) {
+				for (int c = c0; c <= c1; ++c) {
+					yg->hit_windows[yg->hit_fill[r * cols + c]++] = w;
+				}
+			}
+		}
+	});
+
+	yg->hit_dirty = 0;
+}
+
 /**
  * Find the window that is at the top at a particular screen-space coordinate.
  *
- * This walks through each window from top to bottom (foreachr - reverse foreach)
- * until it finds one with a pixel at this coordinate. Again, we only call this
- * at the cursor coordinates, and it is not particularly fast, so don't use it
- * anywhere that needs to hit a lot of coordinates.
+ * Only the windows in the grid cell under the coordinate are looked at,
+ * top to bottom, and only the ones whose boxes hold it get the alpha
+ * test. The redraw thread asks too, so the grid has its own lock.
  */
 static yutani_server_window_t * top_at(yutani_globals_t * yg, uint16_t x, uint16_t y) {
-	if (check_top_at(yg, yg->top_z, x, y)) return yg->top_z;
-	foreachr(node, yg->mid_zs) {
-		yutani_server_window_t * w = node->value;
-		if (check_top_at(yg, w, x, y)) return w;
+	if (x >= yg->width || y >= yg->height) return NULL;
+
+	yutani_server_window_t * out = NULL;
+	spin_lock(&yg->hit_lock);
+	if (yg->hit_dirty || !yg->hit_start) hit_rebuild(yg);
+
+	int cell = (y >> HIT_CELL_SHIFT) * yg->hit_cols + (x >> HIT_CELL_SHIFT);
+	for (int i = yg->hit_start[cell]; i < yg->hit_start[cell+1]; ++i) {
+		yutani_server_window_t * w = yg->hit_windows[i];
+		int x0, y0, x1, y1;
+		hit_bounds(w, &x0, &y0, &x1, &y1);
+		if (x < x0 || x >= x1 || y < y0 || y >= y1) continue;
+		if (check_top_at(yg, w, x, y)) {
+			out = w;
+			break;
+		}
 	}
-	if (check_top_at(yg, yg->bottom_z, x, y)) return yg->bottom_z;
-	return NULL;
+	spin_unlock(&yg->hit_lock);
+	return out;
 }
 
 /**
@@ -696,18 +1037,39 @@ uint32_t yutani_color_for_wid(yutani_wid_t wid) {
 	return colors[i];
 }
 
+/**
+ * Work out which step of its animation a window is on, finishing the
+ * animation if it is over. Returns -1 once a closing window has
+ * finished and should not be drawn again.
+ */
+static int yutani_window_anim_frame(yutani_globals_t * yg, yutani_server_window_t * window) {
+	if (!window->anim_mode) return 0;
+	int frame = yutani_time_since(yg, window->anim_start);
+	if (frame >= yutani_animation_lengths[window->anim_mode]) {
+		/* XXX handle animation-end things like cleanup of closing windows */
+		if (yutani_is_closing_animation[window->anim_mode]) {
+			list_insert(yg->windows_to_remove, window);
+			return -1;
+		}
+		window->anim_mode = 0;
+		window->anim_start = 0;
+		return 0;
+	}
+	return frame;
+}
+
 /**
  * Blit a window to the framebuffer.
  *
  * Applies transformations (rotation, animations) and then renders
- * the window through alpha blitting.
+ * the window through alpha blitting. `frame` is the animation step
+ * from yutani_window_anim_frame(); it is worked out once per frame so
+ * every band of the screen sees the same one. `resize` is where the
+ * window is being stretched to while it is resized interactively, or
+ * NULL. With `solid`, the part being drawn is known to be opaque and is
+ * copied instead.
  */
-static int yutani_blit_window(yutani_globals_t * yg, yutani_server_window_t * window, int x, int y) {
-
-	if (renderer_blit_window) {
-		return renderer_blit_window(yg,window,x,y);
-	}
-
+static void yutani_blit_window(yutani_globals_t * yg, gfx_context_t * ctx, yutani_server_window_t * window, int frame, gfx_rect_t * resize, int solid) {
 	sprite_t _win_sprite;
 	_win_sprite.width = window->width;
 	_win_sprite.height = window->height;
@@ -717,82 +1079,69 @@ static int yutani_blit_window(yutani_globals_t * yg, yutani_server_window_t * wi
 	_win_sprite.alpha = ALPHA_EMBEDDED;
 
 	if (window->anim_mode) {
-		int frame = yutani_time_since(yg, window->anim_start);
-		if (frame >= yutani_animation_lengths[window->anim_mode]) {
-			/* XXX handle animation-end things like cleanup of closing windows */
-			if (yutani_is_closing_animation[window->anim_mode]) {
-				list_insert(yg->windows_to_remove, window);
-				goto draw_finish;
-			}
-			window->anim_mode = 0;
-			window->anim_start = 0;
-			goto draw_window;
-		} else {
-			switch (window->anim_mode) {
-				case YUTANI_EFFECT_SQUEEZE_OUT:
-				case YUTANI_EFFECT_FADE_OUT:
-					{
-						frame = yutani_animation_lengths[window->anim_mode] - frame;
-					}
-				case YUTANI_EFFECT_SQUEEZE_IN:
-				case YUTANI_EFFECT_FADE_IN:
-					{
-						double time_diff = ((double)frame / (float)yutani_animation_lengths[window->anim_mode]);
+		switch (window->anim_mode) {
+			case YUTANI_EFFECT_SQUEEZE_OUT:
+			case YUTANI_EFFECT_FADE_OUT:
+				{
+					frame = yutani_animation_lengths[window->anim_mode] - frame;
+				}
+			case YUTANI_EFFECT_SQUEEZE_IN:
+			case YUTANI_EFFECT_FADE_IN:
+				{
+					double time_diff = ((double)frame / (float)yutani_animation_lengths[window->anim_mode]);
 
-						if (window->server_flags & YUTANI_WINDOW_FLAG_DIALOG_ANIMATION) {
-							double x = time_diff;
-							int t_y = (window->height * (1.0 -x)) / 2;
+					if (window->server_flags & YUTANI_WINDOW_FLAG_DIALOG_ANIMATION) {
+						double x = time_diff;
+						int t_y = (window->height * (1.0 -x)) / 2;
 
-							draw_sprite_scaled(yg->backend_ctx, &_win_sprite, window->x, window->y + t_y, window->width, window->height * x);
-						} else {
-							double x = 0.75 + time_diff * 0.25;
-							int t_x = (window->width * (1.0 - x)) / 2;
-							int t_y = (window->height * (1.0 - x)) / 2;
+						draw_sprite_scaled(ctx, &_win_sprite, window->x, window->y + t_y, window->width, window->height * x);
+					} else {
+						double x = 0.75 + time_diff * 0.25;
+						int t_x = (window->width * (1.0 - x)) / 2;
+						int t_y = (window->height * (1.0 - x)) / 2;
 
-							double opacity = time_diff * (double)(window->opacity) / 255.0;
+						double opacity = time_diff * (double)(window->opacity) / 255.0;
 
-							if (!yutani_window_is_top(yg, window) && !yutani_window_is_bottom(yg, window) &&
-									!(window->server_flags & YUTANI_WINDOW_FLAG_ALT_ANIMATION)) {
-								draw_sprite_scaled_alpha(yg->backend_ctx, &_win_sprite, window->x + t_x, window->y + t_y, window->width * x, window->height * x, opacity);
-							} else {
-								draw_sprite_alpha(yg->backend_ctx, &_win_sprite, window->x, window->y, opacity);
-							}
+						if (!yutani_window_is_top(yg, window) && !yutani_window_is_bottom(yg, window) &&
+								!(window->server_flags & YUTANI_WINDOW_FLAG_ALT_ANIMATION)) {
+							draw_sprite_scaled_alpha(ctx, &_win_sprite, window->x + t_x, window->y + t_y, window->width * x, window->height * x, opacity);
+						} else {
+							draw_sprite_alpha(ctx, &_win_sprite, window->x, window->y, opacity);
 						}
 					}
-					break;
-				default:
-					goto draw_window;
-					break;
-			}
+				}
+				break;
+			default:
+				goto draw_window;
+				break;
 		}
 	} else {
 draw_window:
 		if (window->opacity != 255) {
 			double opacity = (double)(window->opacity) / 255.0;
-			if (window == yg->resizing_window) {
-				draw_sprite_scaled_alpha(yg->backend_ctx, &_win_sprite, window->x + (int)yg->resizing_offset_x, window->y + (int)yg->resizing_offset_y, yg->resizing_w, yg->resizing_h, opacity);
+			if (resize) {
+				draw_sprite_scaled_alpha(ctx, &_win_sprite, window->x + resize->x, window->y + resize->y, resize->w, resize->h, opacity);
 			} else {
 				if (window->rotation) {
-					draw_sprite_rotate(yg->backend_ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, opacity);
+					draw_sprite_rotate(ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, opacity);
 				} else {
-					draw_sprite_alpha(yg->backend_ctx, &_win_sprite, window->x, window->y, opacity);
+					draw_sprite_alpha(ctx, &_win_sprite, window->x, window->y, opacity);
 				}
 			}
 		} else {
-			if (window == yg->resizing_window) {
-				draw_sprite_scaled(yg->backend_ctx, &_win_sprite, window->x + (int)yg->resizing_offset_x, window->y + (int)yg->resizing_offset_y, yg->resizing_w, yg->resizing_h);
+			if (resize) {
+				draw_sprite_scaled(ctx, &_win_sprite, window->x + resize->x, window->y + resize->y, resize->w, resize->h);
 			} else {
 				if (window->rotation) {
-					draw_sprite_rotate(yg->backend_ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, 1.0);
+					draw_sprite_rotate(ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, 1.0);
 				} else {
-					draw_sprite(yg->backend_ctx, &_win_sprite, window->x, window->y);
+					/* Opaque parts can be copied rather than blended */
+					if (solid) _win_sprite.alpha = ALPHA_OPAQUE;
+					draw_sprite(ctx, &_win_sprite, window->x, window->y);
 				}
 			}
 		}
 	}
-draw_finish:
-
-	return 0;
 }
 
 /**
@@ -850,17 +1199,566 @@ static void yutani_post_vbox_rects(yutani_globals_t * yg) {
 }
 
 /**
- * Blit all windows into the given context.
+ * Tell the display device which parts of the screen just changed.
  *
- * This is called for rendering and for screenshots.
+ * Some devices (VMware SVGA, once its command FIFO is in use) only
+ * pass on to the host what they are told about, so this replaces a
+ * full-frame transfer with just the damaged rectangles. Devices that
+ * don't care refuse the ioctl and we stop asking.
  */
-static void yutani_blit_windows(yutani_globals_t * yg) {
-	if (yg->bottom_z) yutani_blit_window(yg, yg->bottom_z, yg->bottom_z->x, yg->bottom_z->y);
-	foreach (node, yg->mid_zs) {
-		yutani_server_window_t * w = node->value;
-		if (w) yutani_blit_window(yg, w, w->x, w->y);
+static void yutani_post_display_update(yutani_globals_t * yg) {
+	if (yg->display_fd <= 0 || yg->display_updates < 0) return;
+
+	struct vid_rect rects[GFX_MAX_CLIP_RECTS];
+	struct vid_rects update = {1, rects};
+	gfx_context_t * ctx = yg->backend_ctx;
+
+	if (!renderer_add_clip && ctx->clips) {
+		update.count = ctx->clip_count;
+		for (int i = 0; i < ctx->clip_count; ++i) {
+			rects[i].x = ctx->clip_rects[i].x;
+			rects[i].y = ctx->clip_rects[i].y;
+			rects[i].width = ctx->clip_rects[i].w;
+			rects[i].height = ctx->clip_rects[i].h;
+		}
+	} else {
+		rects[0].x = 0;
+		rects[0].y = 0;
+		rects[0].width = yg->width;
+		rects[0].height = yg->height;
+	}
+
+	yg->display_updates = ioctl(yg->display_fd, IO_VID_UPDATE, &update) < 0 ? -1 : 1;
+}
+
+/**
+ * Draw straight into video memory, if the display can flip pages.
+ *
+ * With two pages, the one off screen stands in for the backbuffer and
+ * showing it is a flip on the device, so frames aren't copied and are
+ * never seen half drawn. Each page misses what was drawn on the other,
+ * though, so every frame also redraws the one before's damage.
+ */
+static void yutani_pages_init(yutani_globals_t * yg) {
+	gfx_context_t * ctx = yg->backend_ctx;
+	uint32_t pages = 2;
+
+	yg->display_pages = -1;
+	if (yutani_options.nested || renderer_blit_screen) return;
+	if (ioctl(yg->display_fd, IO_VID_PAGES, &pages) < 0 || pages < 2) return;
+
+	if (ctx->backbuffer != ctx->buffer) free(ctx->backbuffer);
+	yg->display_pages = 2;
+	yg->back_page = 1;
+	ctx->backbuffer = ctx->buffer + GFX_S(ctx) * GFX_H(ctx);
+	yg->backend_framebuffer = ctx->backbuffer;
+
+	/* Neither page has the screen on it yet */
+	yg->page_damage[0] = (gfx_rect_t){0, 0, yg->width, yg->height};
+	yg->page_damage_count = 1;
+	mark_screen(yg, 0, 0, yg->width, yg->height);
+}
+
+/**
+ * Go back to a backbuffer in memory, and ask again next frame.
+ */
+static void yutani_pages_drop(yutani_globals_t * yg) {
+	if (yg->display_pages > 0) {
+		gfx_context_t * ctx = yg->backend_ctx;
+		uint32_t page = 0;
+		ioctl(yg->display_fd, IO_VID_FLIP, &page);
+		ctx->backbuffer = malloc(GFX_S(ctx) * GFX_H(ctx));
+		yg->backend_framebuffer = ctx->backbuffer;
+	}
+	yg->display_pages = 0;
+}
+
+/**
+ * Add what the back page missed to this frame's damage, and keep this
+ * frame's own damage for the other page.
+ */
+static void yutani_pages_damage(yutani_globals_t * yg) {
+	gfx_context_t * ctx = yg->backend_ctx;
+	gfx_rect_t missed[GFX_MAX_CLIP_RECTS];
+	int missed_count = yg->page_damage_count;
+	memcpy(missed, yg->page_damage, sizeof(gfx_rect_t) * missed_count);
+
+	if (ctx->clips) {
+		yg->page_damage_count = ctx->clip_count;
+		memcpy(yg->page_damage, ctx->clip_rects, sizeof(gfx_rect_t) * ctx->clip_count);
+		for (int i = 0; i < missed_count; ++i) {
+			gfx_add_clip(ctx, missed[i].x, missed[i].y, missed[i].w, missed[i].h);
+		}
+	} else {
+		yg->page_damage[0] = (gfx_rect_t){0, 0, yg->width, yg->height};
+		yg->page_damage_count = 1;
+	}
+}
+
+/**
+ * Show the back page, and start drawing into the other one.
+ */
+static void yutani_pages_flip(yutani_globals_t * yg) {
+	gfx_context_t * ctx = yg->backend_ctx;
+	uint32_t page = yg->back_page;
+
+	ioctl(yg->display_fd, IO_VID_FLIP, &page);
+	yg->back_page = !yg->back_page;
+	ctx->backbuffer = ctx->buffer + yg->back_page * GFX_S(ctx) * GFX_H(ctx);
+	yg->backend_framebuffer = ctx->backbuffer;
+}
+
+/**
+ * The screen area a window hides everything beneath this frame.
+ *
+ * That's all of it for windows that promised to be fully opaque, or
+ * the part they said was, and only while they are drawn untransformed
+ * at full opacity. Returns 0 if there is none.
+ */
+static int yutani_window_opaque(yutani_globals_t * yg, yutani_server_window_t * w, gfx_rect_t * out) {
+	if (w->opacity != 255 || w->anim_mode || w->rotation || w == yg->resizing_window) return 0;
+
+	gfx_rect_t r = {0, 0, w->width, w->height};
+	if (!(w->server_flags & YUTANI_WINDOW_FLAG_OPAQUE)) {
+		gfx_rect_t * o = &w->opaque_region;
+		int32_t x0 = max(o->x, 0), y0 = max(o->y, 0);
+		int32_t x1 = min(o->x + o->w, w->width), y1 = min(o->y + o->h, w->height);
+		if (o->w <= 0 || o->h <= 0 || x0 >= x1 || y0 >= y1) return 0;
+		r = (gfx_rect_t){x0, y0, x1 - x0, y1 - y0};
+	}
+
+	out->x = w->x + r.x;
+	out->y = w->y + r.y;
+	out->w = r.w;
+	out->h = r.h;
+	return 1;
+}
+
+/**
+ * Remove `cut` from a list of rectangles, splitting any it overlaps
+ * into the (at most four) pieces left around it. Returns the new count,
+ * or -1 if that would not fit in GFX_MAX_CLIP_RECTS, in which case
+ * the list is left alone.
+ */
+static int rects_subtract(gfx_rect_t * rects, int count, gfx_rect_t * cut) {
+	gfx_rect_t out[GFX_MAX_CLIP_RECTS];
+	int n = 0;
+
+	for (int i = 0; i < count; ++i) {
+		gfx_rect_t * r = &rects[i];
+		int32_t x0 = max(r->x, cut->x), y0 = max(r->y, cut->y);
+		int32_t x1 = min(r->x + r->w, cut->x + cut->w), y1 = min(r->y + r->h, cut->y + cut->h);
+
+		gfx_rect_t pieces[4];
+		int p = 0;
+		if (x0 >= x1 || y0 >= y1) {
+			pieces[p++] = *r;
+		} else {
+			if (y0 > r->y)        pieces[p++] = (gfx_rect_t){r->x, r->y, r->w, y0 - r->y};
+			if (y1 < r->y + r->h) pieces[p++] = (gfx_rect_t){r->x, y1, r->w, r->y + r->h - y1};
+			if (x0 > r->x)        pieces[p++] = (gfx_rect_t){r->x, y0, x0 - r->x, y1 - y0};
+			if (x1 < r->x + r->w) pieces[p++] = (gfx_rect_t){x1, y0, r->x + r->w - x1, y1 - y0};
+		}
+
+		if (n + p > GFX_MAX_CLIP_RECTS) return -1;
+		memcpy(&out[n], pieces, sizeof(gfx_rect_t) * p);
+		n += p;
+	}
+
+	memcpy(rects, out, sizeof(gfx_rect_t) * n);
+	return n;
+}
+
+/**
+ * The screen area a window can draw to this frame.
+ */
+static gfx_rect_t yutani_window_bounds(yutani_globals_t * yg, yutani_server_window_t * w) {
+	if (w->rotation || w == yg->resizing_window) {
+		/* Could end up anywhere; don't try to be clever. */
+		return (gfx_rect_t){0, 0, yg->width, yg->height};
+	}
+	return (gfx_rect_t){w->x, w->y, w->width, w->height};
+}
+
+/*
+ * Frame statistics, shared with anyone who asks (see yutani_stats_t).
+ * The frame being drawn is built up in `this_frame` and copied in at the end.
+ */
+static yutani_stats_t * stats = NULL;
+static yutani_frame_stats_t this_frame;
+
+static uint64_t stats_now(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void stats_init(yutani_globals_t * yg) {
+	char key[1024];
+	YUTANI_SHMKEY_STATS(yg->server_ident, key, 1024);
+	size_t size = sizeof(yutani_stats_t);
+	stats = shm_obtain(key, &size);
+	memset(stats, 0, sizeof(yutani_stats_t));
+}
+
+static void stats_record(void) {
+	if (!stats) return;
+	this_frame.total = stats_now() - this_frame.start;
+	stats->frames[stats->count % YUTANI_STATS_FRAMES] = this_frame;
+	__sync_synchronize();
+	stats->count++;
+}
+
+/* Time a renderer hook, if there is one */
+#define RENDERER_HOOK(hook, yg) do { \
+	if (hook) { \
+		uint64_t _t = stats_now(); \
+		hook(yg); \
+		this_frame.renderer += stats_now() - _t; \
+	} \
+} while (0)
+
+/*
+ * What to draw this frame: the windows with anything visible, top to
+ * bottom, each with the animation step to draw and the part of the
+ * screen it is visible in.
+ */
+struct blit_plan {
+	yutani_server_window_t * window;
+	int frame;
+	/*
+	 * The window as it was when the plan was made. Drawing reads only
+	 * this, so the event thread can move, restack and resize windows
+	 * while we blend without waiting for the frame to finish.
+	 */
+	yutani_server_window_t scene;
+	int resizing;
+	gfx_rect_t resize;
+	int count;
+	gfx_rect_t visible[GFX_MAX_CLIP_RECTS];
+	int solid_count; /* Parts of `visible` split off as copyable */
+	gfx_rect_t solid[GFX_MAX_CLIP_RECTS];
+};
+
+static struct blit_plan * blit_plan = NULL;
+static int blit_plan_size = 0;
+static int blit_plan_count = 0;
+
+/* Set by SIGLOWMEM; the plan is let go of before the next redraw */
+static volatile int low_memory = 0;
+
+/**
+ * Build the blit plan.
+ *
+ * Walk the windows top to bottom working out which parts of each are
+ * visible: whatever is in the damage region and not under an opaque
+ * window further up. Windows with nothing visible are left out.
+ */
+static void yutani_plan_blits(yutani_globals_t * yg, gfx_rect_t * damage, int damage_count) {
+	int needed = yg->mid_zs->length + 2;
+	if (needed > blit_plan_size) {
+		blit_plan = realloc(blit_plan, sizeof(struct blit_plan) * needed);
+		blit_plan_size = needed;
+	}
+
+	/* Windows from top to bottom */
+	int count = 0;
+	yutani_server_window_t * windows[needed];
+	if (yg->top_z) windows[count++] = yg->top_z;
+	foreachr (node, yg->mid_zs) {
+		if (node->value) windows[count++] = node->value;
+	}
+	if (yg->bottom_z) windows[count++] = yg->bottom_z;
+
+	int occluders = 0;
+	gfx_rect_t occluder[GFX_MAX_CLIP_RECTS];
+
+	blit_plan_count = 0;
+	for (int i = 0; i < count; ++i) {
+		yutani_server_window_t * w = windows[i];
+		struct blit_plan * plan = &blit_plan[blit_plan_count];
+
+		/* The Cairo renderer runs animations itself. */
+		plan->frame = renderer_blit_window ? 0 : yutani_window_anim_frame(yg, w);
+		if (plan->frame < 0) continue;
+
+		gfx_rect_t bounds = yutani_window_bounds(yg, w);
+
+		/* Damage within the window... */
+		int n = 0;
+		for (int j = 0; j < damage_count; ++j) {
+			int32_t x0 = max(damage[j].x, bounds.x), y0 = max(damage[j].y, bounds.y);
+			int32_t x1 = min(damage[j].x + damage[j].w, bounds.x + bounds.w);
+			int32_t y1 = min(damage[j].y + damage[j].h, bounds.y + bounds.h);
+			if (x0 < x1 && y0 < y1) plan->visible[n++] = (gfx_rect_t){x0, y0, x1 - x0, y1 - y0};
+		}
+
+		/* ...that nothing opaque covers. If a cut won't fit, we just draw a bit more. */
+		for (int j = 0; j < occluders && n; ++j) {
+			int result = rects_subtract(plan->visible, n, &occluder[j]);
+			if (result >= 0) n = result;
+		}
+
+		/* Whatever is left of the window's own opaque part gets copied, not blended. */
+		plan->solid_count = 0;
+		gfx_rect_t opaque;
+		if (yutani_window_opaque(yg, w, &opaque)) {
+			gfx_rect_t solid[GFX_MAX_CLIP_RECTS];
+			int s = 0;
+			for (int j = 0; j < n; ++j) {
+				gfx_rect_t * r = &plan->visible[j];
+				int32_t x0 = max(r->x, opaque.x), y0 = max(r->y, opaque.y);
+				int32_t x1 = min(r->x + r->w, opaque.x + opaque.w), y1 = min(r->y + r->h, opaque.y + opaque.h);
+				if (x0 < x1 && y0 < y1) solid[s++] = (gfx_rect_t){x0, y0, x1 - x0, y1 - y0};
+			}
+			int result = s ? rects_subtract(plan->visible, n, &opaque) : -1;
+			if (result >= 0) {
+				n = result;
+				memcpy(plan->solid, solid, sizeof(gfx_rect_t) * s);
+				plan->solid_count = s;
+			}
+			if (occluders < GFX_MAX_CLIP_RECTS) occluder[occluders++] = opaque;
+		}
+		plan->count = n;
+
+		/*
+		 * With the Cairo renderer, animating windows are always blitted, as
+		 * that's where it notices a closing animation has finished.
+		 */
+		if (n || plan->solid_count || (renderer_blit_window && w->anim_mode)) {
+			plan->window = w;
+			plan->scene = *w;
+			plan->resizing = (w == yg->resizing_window);
+			if (plan->resizing) {
+				plan->resize = (gfx_rect_t){yg->resizing_offset_x, yg->resizing_offset_y, yg->resizing_w, yg->resizing_h};
+			}
+			blit_plan_count++;
+		}
+	}
+}
+
+/* Bump the draw count of every window in the plan */
+static void yutani_plan_drawn(yutani_globals_t * yg) {
+	__sync_synchronize();
+	for (int i = 0; i < blit_plan_count; ++i) {
+		yutani_damage_ring_t * ring = blit_plan[i].window->damage;
+		if (ring) ring->drawn++;
+	}
+	__sync_synchronize();
+}
+
+/* Draw one window clipped to `rects`, within rows [top,bottom) */
+static void yutani_blit_rects(yutani_globals_t * yg, gfx_context_t * ctx, struct blit_plan * plan, gfx_rect_t * rects, int count, int32_t top, int32_t bottom, int solid) {
+	gfx_clear_clip(ctx);
+	if (!ctx->clips) gfx_add_clip(ctx, 0, 0, 0, 0);
+
+	int any = 0;
+	for (int j = 0; j < count; ++j) {
+		gfx_rect_t * r = &rects[j];
+		int32_t y0 = max(r->y, top);
+		int32_t y1 = min(r->y + r->h, bottom);
+		if (y0 >= y1) continue;
+		gfx_add_clip(ctx, r->x, y0, r->w, y1 - y0);
+		any = 1;
+	}
+
+	if (any) yutani_blit_window(yg, ctx, &plan->scene, plan->frame, plan->resizing ? &plan->resize : NULL, solid);
+}
+
+/**
+ * Draw the planned windows, bottom to top, into rows [top,bottom) of `ctx`.
+ *
+ * Each window is drawn clipped to where it is visible, so this replaces
+ * whatever clip region `ctx` had.
+ */
+static void yutani_blit_band(yutani_globals_t * yg, gfx_context_t * ctx, int32_t top, int32_t bottom) {
+	for (int i = blit_plan_count - 1; i >= 0; --i) {
+		struct blit_plan * plan = &blit_plan[i];
+		yutani_blit_rects(yg, ctx, plan, plan->visible, plan->count, top, bottom, 0);
+		yutani_blit_rects(yg, ctx, plan, plan->solid, plan->solid_count, top, bottom, 1);
+	}
+}
+
+/*
+ * Render workers
+ *
+ * With --threads N, the damaged rows are cut into N bands. N-1 worker
+ * threads draw one band each while the render thread draws the first,
+ * and they all meet up again before the cursor is drawn and the frame
+ * is flipped. Every band has its own context on the shared backbuffer,
+ * so their clip regions stay separate and no two threads touch the
+ * same row.
+ */
+static struct {
+	int threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int pending;
+	int32_t top;
+	int32_t band;
+	yutani_globals_t * yg;
+	gfx_context_t ctx[YUTANI_MAX_RENDER_THREADS];
+} render_pool;
+
+static void render_pool_band(int index) {
+	int32_t top = render_pool.top + render_pool.band * index;
+	yutani_blit_band(render_pool.yg, &render_pool.ctx[index], top, top + render_pool.band);
+}
+
+static void * render_worker(void * arg) {
+	int index = (int)(uintptr_t)arg;
+	unsigned int seen = 0;
+
+	sysfunc(TOARU_SYS_FUNC_THREADNAME,(char *[]){"compositor","render worker",NULL});
+
+	pthread_mutex_lock(&render_pool.lock);
+	while (1) {
+		while (render_pool.generation == seen) {
+			pthread_cond_wait(&render_pool.start, &render_pool.lock);
+		}
+		seen = render_pool.generation;
+		pthread_mutex_unlock(&render_pool.lock);
+
+		render_pool_band(index);
+
+		pthread_mutex_lock(&render_pool.lock);
+		if (--render_pool.pending == 0) {
+			pthread_cond_signal(&render_pool.done);
+		}
+	}
+
+	return NULL;
+}
+
+static void render_pool_init(yutani_globals_t * yg, int threads) {
+	render_pool.yg = yg;
+	render_pool.threads = threads;
+	pthread_mutex_init(&render_pool.lock, NULL);
+	pthread_cond_init(&render_pool.start, NULL);
+	pthread_cond_init(&render_pool.done, NULL);
+	for (int i = 1; i < threads; ++i) {
+		pthread_t worker;
+		pthread_create(&worker, NULL, render_worker, (void *)(uintptr_t)i);
+	}
+}
+
+/**
+ * Draw the plan with every render thread, one band each.
+ */
+static void render_pool_run(yutani_globals_t * yg, gfx_rect_t * damage, int damage_count) {
+	int32_t top = yg->height, bottom = 0;
+	for (int i = 0; i < damage_count; ++i) {
+		top = min(top, damage[i].y);
+		bottom = max(bottom, damage[i].y + damage[i].h);
+	}
+	if (top >= bottom) return;
+
+	/* Point every band's context at the current backbuffer */
+	for (int i = 0; i < render_pool.threads; ++i) {
+		gfx_context_t * ctx = &render_pool.ctx[i];
+		if (ctx->clips && ctx->clips_size != yg->backend_ctx->height) {
+			gfx_no_clip(ctx);
+		}
+		ctx->width      = yg->backend_ctx->width;
+		ctx->height     = yg->backend_ctx->height;
+		ctx->depth      = yg->backend_ctx->depth;
+		ctx->size       = yg->backend_ctx->size;
+		ctx->stride     = yg->backend_ctx->stride;
+		ctx->buffer     = yg->backend_ctx->buffer;
+		ctx->backbuffer = yg->backend_ctx->backbuffer;
+		if (!ctx->clips) gfx_add_clip(ctx, 0, 0, 0, 0);
+	}
+
+	render_pool.top  = top;
+	render_pool.band = (bottom - top + render_pool.threads - 1) / render_pool.threads;
+
+	pthread_mutex_lock(&render_pool.lock);
+	render_pool.pending = render_pool.threads - 1;
+	render_pool.generation++;
+	pthread_cond_broadcast(&render_pool.start);
+	pthread_mutex_unlock(&render_pool.lock);
+
+	render_pool_band(0);
+
+	pthread_mutex_lock(&render_pool.lock);
+	while (render_pool.pending) {
+		pthread_cond_wait(&render_pool.done, &render_pool.lock);
+	}
+	pthread_mutex_unlock(&render_pool.lock);
+}
+
+/* The damage region the plan was made for */
+static gfx_rect_t plan_damage[GFX_MAX_CLIP_RECTS];
+static int plan_damage_count = 0;
+static int plan_had_clip = 0;
+
+/**
+ * Plan the blits for this frame.
+ *
+ * Called with the redraw lock held. Everything yutani_draw_windows()
+ * needs is copied into the plan, so the lock can be let go of before
+ * any drawing happens.
+ *
+ * With the Cairo renderer we don't know the damage region, so it is
+ * taken to be the whole screen and windows are only skipped outright.
+ */
+static void yutani_plan_windows(yutani_globals_t * yg) {
+	gfx_context_t * ctx = yg->backend_ctx;
+
+	plan_had_clip = !renderer_blit_window && ctx->clips;
+	if (plan_had_clip) {
+		plan_damage_count = ctx->clip_count;
+		memcpy(plan_damage, ctx->clip_rects, sizeof(gfx_rect_t) * plan_damage_count);
+	} else {
+		plan_damage[0] = (gfx_rect_t){0, 0, yg->width, yg->height};
+		plan_damage_count = 1;
+	}
+
+	yutani_plan_blits(yg, plan_damage, plan_damage_count);
+
+	this_frame.windows = blit_plan_count;
+	for (int i = 0; i < plan_damage_count; ++i) {
+		this_frame.area += plan_damage[i].w * plan_damage[i].h;
+	}
+}
+
+/**
+ * Blit all planned windows into the backbuffer.
+ *
+ * Windows are drawn bottom to top, each clipped to the part of it that
+ * yutani_plan_blits() found visible. Renderer plugins draw from the
+ * live windows, so the redraw lock has to be held for those.
+ */
+static void yutani_draw_windows(yutani_globals_t * yg) {
+	gfx_context_t * ctx = yg->backend_ctx;
+
+	/* Clients that scroll look at this to tell if we drew while they did */
+	yutani_plan_drawn(yg);
+
+	if (renderer_blit_window) {
+		for (int i = blit_plan_count - 1; i >= 0; --i) {
+			yutani_server_window_t * w = blit_plan[i].window;
+			renderer_blit_window(yg, w, w->x, w->y);
+		}
+	} else if (render_pool.threads > 1) {
+		render_pool_run(yg, plan_damage, plan_damage_count);
+	} else {
+		yutani_blit_band(yg, ctx, 0, yg->height);
+
+		/* Put the damage region back for the cursor and flip */
+		if (plan_had_clip) {
+			gfx_clear_clip(ctx);
+			for (int j = 0; j < plan_damage_count; ++j) {
+				gfx_add_clip(ctx, plan_damage[j].x, plan_damage[j].y, plan_damage[j].w, plan_damage[j].h);
+			}
+		} else {
+			gfx_no_clip(ctx);
+		}
 	}
-	if (yg->top_z) yutani_blit_window(yg, yg->top_z, yg->top_z->x, yg->top_z->y);
+
+	yutani_plan_drawn(yg);
 }
 
 /**
@@ -883,6 +1781,10 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 
 	if (task == YUTANI_SCREENSHOT_FULL) {
 		buffer = (void *)yg->backend_ctx->backbuffer;
+		if (yg->display_pages > 0) {
+			/* What's on screen is the page we just flipped away from */
+			buffer = (void *)(yg->backend_ctx->buffer + !yg->back_page * GFX_S(yg->backend_ctx) * GFX_H(yg->backend_ctx));
+		}
 		width = yg->width;
 		height = yg->height;
 		alpha = 0;
@@ -937,6 +1839,193 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 	fclose(f);
 }
 
+/*
+ * Scrolls picked up from damage rings, waiting to be done on screen
+ * once all of this frame's damage is known.
+ */
+#define YUTANI_MAX_SCROLLS 16
+
+static struct {
+	yutani_wid_t wid;
+	yutani_damage_rect_t rect;
+	int32_t dy;
+} pending_scrolls[YUTANI_MAX_SCROLLS];
+static int pending_scroll_count = 0;
+
+/* Screen rows that were moved this frame, and still need to be flipped */
+static gfx_rect_t scrolled[YUTANI_MAX_SCROLLS];
+static int scrolled_count = 0;
+
+/**
+ * Drain every window's damage ring into the update list.
+ *
+ * Scrolls that nothing has drawn over since the client did them are
+ * kept for yutani_do_scrolls(); anything else is just damage.
+ */
+static void yutani_collect_damage(yutani_globals_t * yg) {
+	foreach (node, yg->windows) {
+		yutani_server_window_t * w = node->value;
+		yutani_damage_ring_t * ring = w->damage;
+		if (!ring) continue;
+
+		uint32_t head = ring->head;
+		uint32_t tail = ring->tail;
+		__sync_synchronize();
+
+		if (ring->overflow || head - tail > YUTANI_DAMAGE_RING_SIZE) {
+			ring->overflow = 0;
+			mark_window(yg, w);
+		} else {
+			for (; tail != head; ++tail) {
+				yutani_damage_entry_t * e = &ring->entries[tail % YUTANI_DAMAGE_RING_SIZE];
+				yutani_damage_rect_t * r = &e->rect;
+				if (e->dy && e->drawn == ring->drawn && pending_scroll_count < YUTANI_MAX_SCROLLS) {
+					pending_scrolls[pending_scroll_count].wid = w->wid;
+					pending_scrolls[pending_scroll_count].rect = *r;
+					pending_scrolls[pending_scroll_count].dy = e->dy;
+					pending_scroll_count++;
+					continue;
+				}
+				mark_window_relative(yg, w, r->x, r->y, r->width, r->height);
+			}
+		}
+
+		ring->tail = head;
+	}
+}
+
+/* Whether any window stacked above `w` draws anywhere in `r` */
+static int yutani_covered_above(yutani_globals_t * yg, yutani_server_window_t * w, gfx_rect_t * r) {
+	if (w == yg->top_z) return 0;
+	yutani_server_window_t * above = yg->top_z;
+	node_t * node = yg->mid_zs->tail;
+	while (above || node) {
+		if (above) {
+			gfx_rect_t b = yutani_window_bounds(yg, above);
+			if (b.x < r->x + r->w && r->x < b.x + b.w && b.y < r->y + r->h && r->y < b.y + b.h) return 1;
+		}
+		if (!node) break;
+		above = node->value;
+		node = node->prev;
+		if (above == w) return 0;
+	}
+	return 0;
+}
+
+/* A scroll we can't do on screen is just damage */
+static void yutani_scroll_damage(yutani_globals_t * yg, yutani_server_window_t * w, yutani_damage_rect_t * r) {
+	if (!w->rotation && w != yg->resizing_window) {
+		yutani_add_clip(yg, w->x + r->x, w->y + r->y, r->width, r->height);
+	} else {
+		mark_window_relative(yg, w, r->x, r->y, r->width, r->height);
+	}
+}
+
+/**
+ * Do the scrolls clients asked for on the backbuffer itself.
+ *
+ * A scroll can be done on screen if the part being moved is opaque,
+ * and nothing above the window is in the way. Anything already due to
+ * be redrawn in it moves along with it, as does the cursor, and the
+ * rows left uncovered are redrawn. The rows moved don't need drawing,
+ * but they do need flipping, so they are kept in `scrolled`.
+ *
+ * With page flipping the other page would miss the move, the Cairo
+ * renderer keeps its own clip, and without a clip everything is being
+ * redrawn anyway, so those just treat it as damage.
+ */
+static void yutani_do_scrolls(yutani_globals_t * yg, int hw_cursor, int mouse_x, int mouse_y) {
+	gfx_context_t * ctx = yg->backend_ctx;
+	int on_screen = !renderer_add_clip && yg->display_pages <= 0 && ctx->clips;
+
+	if (on_screen && !hw_cursor) {
+		/* It's in the backbuffer, and may be about to move with something */
+		yutani_add_clip(yg, mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
+	}
+
+	for (int i = 0; i < pending_scroll_count; ++i) {
+		yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)pending_scrolls[i].wid);
+		if (!w) continue;
+		yutani_damage_rect_t * r = &pending_scrolls[i].rect;
+		int32_t dy = pending_scrolls[i].dy;
+
+		gfx_rect_t opaque;
+		if (!on_screen || !yutani_window_opaque(yg, w, &opaque)) {
+			yutani_scroll_damage(yg, w, r);
+			continue;
+		}
+
+		/* The part of it that's opaque and on screen */
+		gfx_rect_t area = {w->x + r->x, w->y + r->y, r->width, r->height};
+		int32_t x0 = max(max(area.x, opaque.x), 0);
+		int32_t y0 = max(max(area.y, opaque.y), 0);
+		int32_t x1 = min(min(area.x + area.w, opaque.x + opaque.w), (int32_t)yg->width);
+		int32_t y1 = min(min(area.y + area.h, opaque.y + opaque.h), (int32_t)yg->height);
+		gfx_rect_t move = {x0, y0, x1 - x0, y1 - y0};
+
+		if (x0 >= x1 || y1 - y0 <= abs(dy) || yutani_covered_above(yg, w, &move)) {
+			yutani_scroll_damage(yg, w, r);
+			continue;
+		}
+
+		/* Whatever else the client moved gets redrawn */
+		gfx_rect_t rest[GFX_MAX_CLIP_RECTS] = {area};
+		int n = rects_subtract(rest, 1, &move);
+		for (int j = 0; j < n; ++j) {
+			yutani_add_clip(yg, rest[j].x, rest[j].y, rest[j].w, rest[j].h);
+		}
+
+		/* Anything due to be redrawn moves with what's there */
+		int count = ctx->clips ? ctx->clip_count : 0;
+		gfx_rect_t due[GFX_MAX_CLIP_RECTS];
+		memcpy(due, ctx->clip_rects, sizeof(gfx_rect_t) * count);
+		for (int j = 0; j < count; ++j) {
+			int32_t dx0 = max(due[j].x, move.x);
+			int32_t dx1 = min(due[j].x + due[j].w, move.x + move.w);
+			int32_t dy0 = max(due[j].y + dy, move.y);
+			int32_t dy1 = min(due[j].y + due[j].h + dy, move.y + move.h);
+			if (dx0 < dx1 && dy0 < dy1) yutani_add_clip(yg, dx0, dy0, dx1 - dx0, dy1 - dy0);
+		}
+
+		/* Move the rows, and redraw the ones left behind */
+		int32_t rows = move.h - abs(dy);
+		size_t width = move.w * GFX_B(ctx);
+		if (dy < 0) {
+			for (int32_t y = 0; y < rows; ++y) {
+				memmove(&GFX(ctx, move.x, move.y + y), &GFX(ctx, move.x, move.y + y - dy), width);
+			}
+			yutani_add_clip(yg, move.x, move.y + rows, move.w, -dy);
+			scrolled[scrolled_count++] = (gfx_rect_t){move.x, move.y, move.w, rows};
+		} else {
+			for (int32_t y = rows - 1; y >= 0; --y) {
+				memmove(&GFX(ctx, move.x, move.y + y + dy), &GFX(ctx, move.x, move.y + y), width);
+			}
+			yutani_add_clip(yg, move.x, move.y, move.w, dy);
+			scrolled[scrolled_count++] = (gfx_rect_t){move.x, move.y + dy, move.w, rows};
+		}
+	}
+
+	pending_scroll_count = 0;
+}
+
+/**
+ * Tell every window that asked that a frame has gone out.
+ */
+static void yutani_send_frame_callbacks(yutani_globals_t * yg) {
+	uint32_t now = yutani_current_time(yg);
+	spin_lock(&yg->redraw_lock);
+	foreach (node, yg->windows) {
+		yutani_server_window_t * w = node->value;
+		if (w->damage && w->damage->frame_requested) {
+			w->damage->frame_requested = 0;
+			yutani_msg_buildx_window_frame_alloc(response);
+			yutani_msg_buildx_window_frame(response, w->wid, now);
+			pex_send(yg->server, w->owner, response->size, (char *)response);
+		}
+	}
+	spin_unlock(&yg->redraw_lock);
+}
+
 /**
  * Redraw all windows, as well as the mouse cursor.
  *
@@ -945,6 +2034,9 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 static void redraw_windows(yutani_globals_t * yg) {
 	int has_updates = 0;
 
+	memset(&this_frame, 0, sizeof(this_frame));
+	this_frame.start = stats_now();
+
 	/* We keep our own temporary mouse coordinates as they may change while we're drawing. */
 	int tmp_mouse_x = yg->mouse_x;
 	int tmp_mouse_y = yg->mouse_y;
@@ -954,6 +2046,8 @@ static void redraw_windows(yutani_globals_t * yg) {
 		TRACE("Resizing display.");
 
 		if (!yutani_options.nested) {
+			/* The mode change put the device back on one page */
+			yutani_pages_drop(yg);
 			reinit_graphics_fullscreen(yg->backend_ctx);
 		} else {
 			reinit_graphics_yutani(yg->backend_ctx, yg->host_window);
@@ -962,6 +2056,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 		TRACE("graphics context resized...");
 		yg->width = yg->backend_ctx->width;
 		yg->height = yg->backend_ctx->height;
+		yg->hit_dirty = 1;
 		yg->backend_framebuffer = yg->backend_ctx->backbuffer;
 
 		if (renderer_destroy) renderer_destroy(yg);
@@ -980,10 +2075,38 @@ static void redraw_windows(yutani_globals_t * yg) {
 		spin_unlock(&yg->redraw_lock);
 	}
 
-	if (renderer_push_state) renderer_push_state(yg);
+	if (low_memory) {
+		low_memory = 0;
+		free(blit_plan);
+		blit_plan = NULL;
+		blit_plan_size = 0;
+		blit_plan_count = 0;
+	}
+
+	if (!yg->display_pages && yg->display_fd > 0) {
+		spin_lock(&yg->redraw_lock);
+		yutani_pages_init(yg);
+		spin_unlock(&yg->redraw_lock);
+	}
+
+	RENDERER_HOOK(renderer_push_state, yg);
 
-	/* If the mouse has moved, that counts as two damage regions */
-	if ((yg->last_mouse_x != tmp_mouse_x) || (yg->last_mouse_y != tmp_mouse_y)) {
+	/* A hardware cursor moves without any composition at all */
+	int hw_cursor = 0;
+	if (!yutani_options.nested) {
+		spin_lock(&yg->redraw_lock);
+		hw_cursor = update_hw_cursor(yg, tmp_mouse_x, tmp_mouse_y);
+		spin_unlock(&yg->redraw_lock);
+	}
+	if (hw_cursor != yg->hw_cursor) {
+		/* Switching between hardware and drawn: redraw under (or draw) the cursor */
+		mark_screen(yg, yg->last_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->last_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
+		mark_screen(yg, tmp_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, tmp_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
+		yg->hw_cursor = hw_cursor;
+	}
+
+	/* Otherwise, if the mouse has moved, that counts as two damage regions */
+	if (!hw_cursor && ((yg->last_mouse_x != tmp_mouse_x) || (yg->last_mouse_y != tmp_mouse_y))) {
 		has_updates = 2;
 		yutani_add_clip(yg, yg->last_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->last_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
 		yutani_add_clip(yg, tmp_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, tmp_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
@@ -999,6 +2122,12 @@ static void redraw_windows(yutani_globals_t * yg) {
 		if (w && w->anim_mode) mark_window(yg, w);
 	}
 
+	/* Pick up whatever clients have flipped since the last frame */
+	uint64_t phase = stats_now();
+	spin_lock(&yg->redraw_lock);
+	yutani_collect_damage(yg);
+	spin_unlock(&yg->redraw_lock);
+
 	/* Calculate damage regions from currently queued updates */
 	spin_lock(&yg->update_list_lock);
 	while (yg->update_list->length) {
@@ -1012,6 +2141,8 @@ static void redraw_windows(yutani_globals_t * yg) {
 		free(win);
 	}
 	spin_unlock(&yg->update_list_lock);
+	if (pending_scroll_count) has_updates = 1;
+	this_frame.damage = stats_now() - phase;
 
 	/* Render */
 	if (has_updates) {
@@ -1021,20 +2152,38 @@ static void redraw_windows(yutani_globals_t * yg) {
 			draw_fill(yg->backend_ctx, rgb(110,110,110));
 		}
 
-		if (renderer_set_clip) renderer_set_clip(yg);
+		RENDERER_HOOK(renderer_set_clip, yg);
 
 		yg->windows_to_remove = list_create();
 
 		/*
-		 * In theory, we should restrict this to windows within the clip region,
-		 * but calculating that may be more trouble than it's worth;
-		 * we also need to render windows in stacking order...
+		 * The event thread only waits on us while the plan is made. Renderer
+		 * plugins draw from the live windows and hold on for the whole frame.
 		 */
+		int hold_lock = !!renderer_blit_window;
+
 		spin_lock(&yg->redraw_lock);
-		yutani_blit_windows(yg);
+		phase = stats_now();
+		yutani_release_retired(yg);
+		if (yg->display_pages > 0) yutani_pages_damage(yg);
+		if (pending_scroll_count) yutani_do_scrolls(yg, hw_cursor, tmp_mouse_x, tmp_mouse_y);
+		yutani_plan_windows(yg);
+		if (!hold_lock) spin_unlock(&yg->redraw_lock);
+
+		yutani_draw_windows(yg);
+		this_frame.blit = stats_now() - phase;
+
+		/* Moved rows weren't drawn, but are still new */
+		for (int i = 0; i < scrolled_count && yg->backend_ctx->clips; ++i) {
+			gfx_add_clip(yg->backend_ctx, scrolled[i].x, scrolled[i].y, scrolled[i].w, scrolled[i].h);
+		}
+		scrolled_count = 0;
+		phase = stats_now();
 
 		/* Send VirtualBox rects */
+		if (!hold_lock) spin_lock(&yg->redraw_lock);
 		yutani_post_vbox_rects(yg);
+		if (!hold_lock) spin_unlock(&yg->redraw_lock);
 
 #if YUTANI_DEBUG_WINDOW_SHAPES
 #define WINDOW_SHAPE_VIEWER_SIZE 20
@@ -1062,13 +2211,16 @@ static void redraw_windows(yutani_globals_t * yg) {
 			} else {
 				flip(yg->backend_ctx);
 			}
-			/*
-			 * We should be able to flip only the places we need to flip, but
-			 * instead we're going to flip the whole thing.
-			 *
-			 * TODO: Do a better job of this.
-			 */
-			yutani_flip(yg->host_context, yg->host_window);
+			/* Only the damaged parts; that matters when the host is on the other end of a network */
+			gfx_context_t * ctx = yg->backend_ctx;
+			if (ctx->clips && !renderer_blit_screen) {
+				for (int i = 0; i < ctx->clip_count; ++i) {
+					gfx_rect_t * r = &ctx->clip_rects[i];
+					yutani_flip_region(yg->host_context, yg->host_window, r->x, r->y, r->w, r->h);
+				}
+			} else {
+				yutani_flip(yg->host_context, yg->host_window);
+			}
 			yutani_server_window_t * tmp_window = top_at(yg, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE);
 			if (yg->mouse_state == YUTANI_MOUSE_STATE_MOVING) {
 				yutani_window_show_mouse(yg->host_context, yg->host_window, YUTANI_CURSOR_TYPE_DRAG);
@@ -1083,7 +2235,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 			 * can also go in the stack order of the windows.
 			 */
 			yutani_server_window_t * tmp_window = top_at(yg, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE);
-			if (!tmp_window || tmp_window->show_mouse) {
+			if (!hw_cursor && (!tmp_window || tmp_window->show_mouse)) {
 				draw_cursor(yg, tmp_mouse_x, tmp_mouse_y, tmp_window ? tmp_window->show_mouse : 1);
 			}
 
@@ -1093,14 +2245,18 @@ static void redraw_windows(yutani_globals_t * yg) {
 			 */
 			if (renderer_blit_screen) {
 				renderer_blit_screen(yg);
+			} else if (yg->display_pages > 0) {
+				yutani_pages_flip(yg);
 			} else {
 				flip(yg->backend_ctx);
 			}
+			yutani_post_display_update(yg);
 		}
 
 		if (!renderer_add_clip) gfx_clear_clip(yg->backend_ctx);
+		this_frame.flip = stats_now() - phase;
 
-		spin_unlock(&yg->redraw_lock);
+		if (hold_lock) spin_unlock(&yg->redraw_lock);
 
 		/*
 		 * If any windows were marked for removal,
@@ -1117,7 +2273,9 @@ static void redraw_windows(yutani_globals_t * yg) {
 
 	}
 
-	if (renderer_pop_state) renderer_pop_state(yg);
+	RENDERER_HOOK(renderer_pop_state, yg);
+
+	if (has_updates) stats_record();
 
 	if (yg->screenshot_frame) {
 		yutani_screenshot(yg);
@@ -1127,6 +2285,9 @@ static void redraw_windows(yutani_globals_t * yg) {
 		yg->reload_renderer = 0;
 		/* Otherwise we won't draw the cursor... */
 		gfx_no_clip(yg->backend_ctx);
+		spin_lock(&yg->redraw_lock);
+		yutani_pages_drop(yg);
+		spin_unlock(&yg->redraw_lock);
 		try_load_extensions(yg);
 	}
 
@@ -1157,6 +2318,7 @@ static void * redraw(void * in) {
 		 * Perform whatever redraw work is required.
 		 */
 		redraw_windows(yg);
+		yutani_send_frame_callbacks(yg);
 
 		/*
 		 * Attempt to run at about 60fps...
@@ -1228,9 +2390,7 @@ static void mark_window_relative(yutani_globals_t * yg, yutani_server_window_t *
 		rect->height = bottom_bound - top_bound;
 	}
 
-	spin_lock(&yg->update_list_lock);
-	list_insert(yg->update_list, rect);
-	spin_unlock(&yg->update_list_lock);
+	yutani_queue_damage(yg, rect);
 }
 
 /**
@@ -1287,6 +2447,9 @@ static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t
 		}
 	}
 
+	/* The renderer may have its own view of the buffers we are about to release */
+	if (renderer_close_window) renderer_close_window(yg, w);
+
 	{
 		char key[1024];
 		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, w->bufid);
@@ -1297,6 +2460,19 @@ static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t
 		 * render thread, so we don't bother.
 		 */
 		shm_release(key);
+
+		if (w->sparebufid) {
+			YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, w->sparebufid);
+			shm_release(key);
+		}
+		if (w->newbufid) {
+			YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, w->newbufid);
+			shm_release(key);
+		}
+
+		YUTANI_SHMKEY_DAMAGE(yg->server_ident, key, 1024, w->wid);
+		shm_release(key);
+		w->damage = NULL;
 	}
 
 	/* Notify subscribers that there are changes to windows */
@@ -1359,6 +2535,7 @@ static void window_move(yutani_globals_t * yg, yutani_server_window_t * window,
 	mark_window(yg, window);
 	window->x = x;
 	window->y = y;
+	yg->hit_dirty = 1;
 	mark_window(yg, window);
 
 	yutani_msg_buildx_window_move_alloc(response);
@@ -1432,7 +2609,7 @@ static void window_tile(yutani_globals_t * yg, yutani_server_window_t * window,
 	window_move(yg, window, _x, _y);
 	yutani_msg_buildx_window_resize_alloc(response);
 	yutani_msg_buildx_window_resize(response, YUTANI_MSG_RESIZE_OFFER, window->wid, w, h, 0, tile);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	send_event(yg, window->owner, response);
 }
 
 /**
@@ -1443,7 +2620,7 @@ static void window_untile(yutani_globals_t * yg, yutani_server_window_t * window
 
 	yutani_msg_buildx_window_resize_alloc(response);
 	yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, window->wid, window->untiled_width, window->untiled_height, 0, 0);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	send_event(yg, window->owner, response);
 }
 
 /**
@@ -1463,6 +2640,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 			(ke->event.keycode == 'z')) {
 			mark_window(yg,focused);
 			focused->rotation -= 5;
+			yg->hit_dirty = 1;
 			mark_window(yg,focused);
 			return;
 		}
@@ -1472,6 +2650,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 			(ke->event.keycode == 'x')) {
 			mark_window(yg,focused);
 			focused->rotation += 5;
+			yg->hit_dirty = 1;
 			mark_window(yg,focused);
 			return;
 		}
@@ -1481,6 +2660,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 			(ke->event.keycode == 'c')) {
 			mark_window(yg,focused);
 			focused->rotation = 0;
+			yg->hit_dirty = 1;
 			mark_window(yg,focused);
 			return;
 		}
@@ -1606,7 +2786,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 
 		yutani_msg_buildx_key_event_alloc(response);
 		yutani_msg_buildx_key_event(response,focused ? focused->wid : UINT32_MAX, &ke->event, &ke->state);
-		pex_send(yg->server, bind->owner, response->size, (char *)response);
+		send_event(yg, bind->owner, response);
 
 		if (bind->response == YUTANI_BIND_STEAL) {
 			/* If this keybinding was registered as "steal", we'll stop here. */
@@ -1619,7 +2799,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 
 		yutani_msg_buildx_key_event_alloc(response);
 		yutani_msg_buildx_key_event(response,focused->wid, &ke->event, &ke->state);
-		pex_send(yg->server, focused->owner, response->size, (char *)response);
+		send_event(yg, focused->owner, response);
 
 	}
 }
@@ -1818,7 +2998,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_DOWN, yg->active_modifiers);
 						yg->mouse_click_x_orig = yg->mouse_click_x;
 						yg->mouse_click_y_orig = yg->mouse_click_y;
-						pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+						send_event(yg, yg->mouse_window->owner, response);
 					}
 				} else {
 					yg->mouse_window = get_focused(yg);
@@ -1828,7 +3008,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						yutani_device_to_window(yg->mouse_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 						yutani_msg_buildx_window_mouse_event_alloc(response);
 						yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_MOVE, yg->active_modifiers);
-						pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+						send_event(yg, yg->mouse_window->owner, response);
 					}
 					if (tmp_window) {
 						int32_t x, y;
@@ -1836,18 +3016,18 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						if (tmp_window != yg->old_hover_window) {
 							yutani_device_to_window(tmp_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 							yutani_msg_buildx_window_mouse_event(response, tmp_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_ENTER, yg->active_modifiers);
-							pex_send(yg->server, tmp_window->owner, response->size, (char *)response);
+							send_event(yg, tmp_window->owner, response);
 							if (yg->old_hover_window) {
 								yutani_device_to_window(yg->old_hover_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 								yutani_msg_buildx_window_mouse_event(response, yg->old_hover_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_LEAVE, yg->active_modifiers);
-								pex_send(yg->server, yg->old_hover_window->owner, response->size, (char *)response);
+								send_event(yg, yg->old_hover_window->owner, response);
 							}
 							yg->old_hover_window = tmp_window;
 						}
 						if (tmp_window != yg->mouse_window || (me->event.buttons & YUTANI_MOUSE_BUTTON_RIGHT)) {
 							yutani_device_to_window(tmp_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 							yutani_msg_buildx_window_mouse_event(response, tmp_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_MOVE, yg->active_modifiers);
-							pex_send(yg->server, tmp_window->owner, response->size, (char *)response);
+							send_event(yg, tmp_window->owner, response);
 						}
 					}
 				}
@@ -1917,6 +3097,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 					int new_r = atan2(x_diff, y_diff) * 180.0 / (-M_PI);
 					mark_window(yg, yg->mouse_window);
 					yg->mouse_window->rotation = new_r + yg->mouse_init_r;
+					yg->hit_dirty = 1;
 					mark_window(yg, yg->mouse_window);
 				}
 			}
@@ -1933,11 +3114,11 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						if (!yg->mouse_moved) {
 							yutani_msg_buildx_window_mouse_event_alloc(response);
 							yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_CLICK, yg->active_modifiers);
-							pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+							send_event(yg, yg->mouse_window->owner, response);
 						} else {
 							yutani_msg_buildx_window_mouse_event_alloc(response);
 							yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, old_x, old_y, me->event.buttons, YUTANI_MOUSE_EVENT_RAISE, yg->active_modifiers);
-							pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+							send_event(yg, yg->mouse_window->owner, response);
 						}
 					}
 				} else {
@@ -1950,7 +3131,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						if (old_x != yg->mouse_click_x || old_y != yg->mouse_click_y) {
 							yutani_msg_buildx_window_mouse_event_alloc(response);
 							yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, old_x, old_y, me->event.buttons, YUTANI_MOUSE_EVENT_DRAG, yg->active_modifiers);
-							pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+							send_event(yg, yg->mouse_window->owner, response);
 						}
 					}
 				}
@@ -2037,7 +3218,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 					window_move(yg, yg->resizing_window, x,y);
 					yutani_msg_buildx_window_resize_alloc(response);
 					yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, yg->resizing_window->wid, yg->resizing_w, yg->resizing_h, 0, yg->resizing_window->tiled);
-					pex_send(yg->server, yg->resizing_window->owner, response->size, (char *)response);
+					send_event(yg, yg->resizing_window->owner, response);
 					yg->resizing_window = NULL;
 					yg->mouse_window = NULL;
 					yg->mouse_state = YUTANI_MOUSE_STATE_NORMAL;
@@ -2050,6 +3231,48 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 	}
 }
 
+#define INPUT_EVENTS_PER_READ 32
+#define COMPOSITOR_BATCH_SIZE 16384 /* Client messages taken per read */
+
+/**
+ * Turn an event from /dev/input into the key and mouse events the
+ * per-device files would have given us.
+ */
+static void handle_input_event(yutani_globals_t * yg, key_event_state_t * state, struct input_event * ie) {
+	switch (ie->type) {
+		case INPUT_KEY:
+			{
+				key_event_t event;
+				kbd_scancode(state, ie->code, &event);
+				yutani_msg_buildx_key_event_alloc(m);
+				yutani_msg_buildx_key_event(m, 0, &event, state);
+				handle_key_event(yg, (struct yutani_msg_key_event *)m->data);
+			}
+			break;
+		case INPUT_RELATIVE:
+		case INPUT_ABSOLUTE:
+			{
+				mouse_device_packet_t packet;
+				packet.magic = MOUSE_MAGIC;
+				packet.x_difference = ie->x;
+				packet.y_difference = ie->y;
+				if (ie->flags & INPUT_F_NO_BUTTONS) {
+					packet.buttons = yg->last_mouse_buttons & 0xF;
+				} else {
+					packet.buttons = ie->buttons;
+					yg->last_mouse_buttons = packet.buttons;
+				}
+				yutani_msg_buildx_mouse_event_alloc(m);
+				yutani_msg_buildx_mouse_event(m, 0, &packet,
+					ie->type == INPUT_RELATIVE ? YUTANI_MOUSE_EVENT_TYPE_RELATIVE : YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
+				handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
 static yutani_globals_t * _static_yg;
 static void yutani_display_resize_handle(int signum) {
 	(void)signum;
@@ -2058,6 +3281,12 @@ static void yutani_display_resize_handle(int signum) {
 	signal(SIGWINEVENT, yutani_display_resize_handle);
 }
 
+static void yutani_low_memory_handle(int signum) {
+	(void)signum;
+	low_memory = 1;
+	signal(SIGLOWMEM, yutani_low_memory_handle);
+}
+
 /**
  * main
  */
@@ -2087,6 +3316,8 @@ int main(int argc, char * argv[]) {
 		yg->backend_ctx = init_graphics_fullscreen_double_buffer();
 	}
 
+	signal(SIGLOWMEM, yutani_low_memory_handle);
+
 	if (!yg->backend_ctx) {
 		free(yg);
 		TRACE("Failed to open framebuffer, bailing.");
@@ -2122,6 +3353,8 @@ int main(int argc, char * argv[]) {
 	TRACE("pex bound? %d", server);
 	yg->server = server;
 
+	stats_init(yg);
+
 	TRACE("Loading fonts...");
 	{
 #define FONT_COUNT 8
@@ -2198,6 +3431,7 @@ int main(int argc, char * argv[]) {
 	yg->wids_to_windows = hashmap_create_int(10);
 	yg->key_binds = hashmap_create_int(10);
 	yg->clients_to_windows = hashmap_create_int(10);
+	yg->clients_to_events = hashmap_create_int(10);
 	yg->mid_zs = list_create();
 
 	yg->window_subscribers = list_create();
@@ -2210,6 +3444,8 @@ int main(int argc, char * argv[]) {
 
 	yutani_clip_init(yg);
 
+	render_pool_init(yg, yutani_options.render_threads);
+
 	pthread_t render_thread;
 
 	TRACE("Starting render thread.");
@@ -2231,130 +3467,168 @@ int main(int argc, char * argv[]) {
 	int mfd = -1;
 	int kfd = -1;
 	int amfd = -1;
+	int ifd = -1;
 	int vmmouse = 0;
 	mouse_device_packet_t packet;
 	key_event_t event;
 	key_event_state_t state = {0};
 
+	/* Client messages are read as many at once as are waiting */
+	char * batch = malloc(COMPOSITOR_BATCH_SIZE);
+	char * batch_next = batch;
+	char * batch_end = batch;
+
 	fds[0] = fileno(server);
 
 	if (yutani_options.nested) {
 		fds[1] = fileno(yg->host_context->sock);
 	} else {
-		mfd = open("/dev/mouse", O_RDONLY);
-		kfd = open("/dev/kbd", O_RDONLY);
-		amfd = open("/dev/absmouse", O_RDONLY);
-		if (amfd < 0) {
-			amfd = open("/dev/vmmouse", O_RDONLY);
-			vmmouse = 1;
+		/* Everything comes through /dev/input if the kernel has it */
+		ifd = open("/dev/input", O_RDONLY);
+		if (ifd < 0) {
+			mfd = open("/dev/mouse", O_RDONLY);
+			kfd = open("/dev/kbd", O_RDONLY);
+			amfd = open("/dev/absmouse", O_RDONLY);
+			if (amfd < 0) {
+				amfd = open("/dev/vmmouse", O_RDONLY);
+				vmmouse = 1;
+			}
 		}
 		yg->vbox_rects = open("/dev/vboxrects", O_WRONLY);
-		yg->vbox_pointer = open("/dev/vboxpointer", O_WRONLY);
+		yg->display_fd = open("/dev/fb0", O_WRONLY);
 
-		fds[1] = mfd;
-		fds[2] = kfd;
-		fds[3] = amfd;
+		if (ifd >= 0) {
+			fds[1] = ifd;
+		} else {
+			fds[1] = mfd;
+			fds[2] = kfd;
+			fds[3] = amfd;
+		}
 	}
 
 	while (1) {
-		if (yutani_options.nested) {
-			int index = fswait(2, fds);
-
-			if (index == 1) {
-				yutani_msg_t * m = yutani_poll(yg->host_context);
-				if (m) {
-					switch (m->type) {
-						case YUTANI_MSG_KEY_EVENT:
-							{
-								struct yutani_msg_key_event * ke = (void*)m->data;
-								yutani_msg_buildx_key_event_alloc(m_);
-								yutani_msg_buildx_key_event(m_, 0, &ke->event, &ke->state);
-								handle_key_event(yg, (struct yutani_msg_key_event *)m_->data);
-							}
-							break;
-						case YUTANI_MSG_WINDOW_MOUSE_EVENT:
-							{
-								struct yutani_msg_window_mouse_event * me = (void*)m->data;
-								mouse_device_packet_t packet;
+		/* Messages already read come before anything else */
+		if (batch_next == batch_end) {
+			if (yutani_options.nested) {
+				int index = fswait(2, fds);
+
+				if (index == 1) {
+					/* Events may be waiting in the ring behind this, so take everything */
+					yutani_msg_t * m = yutani_poll(yg->host_context);
+					while (m) {
+						switch (m->type) {
+							case YUTANI_MSG_KEY_EVENT:
+								{
+									struct yutani_msg_key_event * ke = (void*)m->data;
+									yutani_msg_buildx_key_event_alloc(m_);
+									yutani_msg_buildx_key_event(m_, 0, &ke->event, &ke->state);
+									handle_key_event(yg, (struct yutani_msg_key_event *)m_->data);
+								}
+								break;
+							case YUTANI_MSG_WINDOW_MOUSE_EVENT:
+								{
+									struct yutani_msg_window_mouse_event * me = (void*)m->data;
+									mouse_device_packet_t packet;
 
-								packet.buttons = me->buttons;
-								packet.x_difference = me->new_x;
-								packet.y_difference = me->new_y;
+									packet.buttons = me->buttons;
+									packet.x_difference = me->new_x;
+									packet.y_difference = me->new_y;
 
-								yg->last_mouse_buttons = packet.buttons;
+									yg->last_mouse_buttons = packet.buttons;
 
-								yutani_msg_buildx_mouse_event_alloc(m_);
-								yutani_msg_buildx_mouse_event(m_, 0, &packet, YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
-								handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m_->data);
-							}
-							break;
-						case YUTANI_MSG_RESIZE_OFFER:
-							{
-								struct yutani_msg_window_resize * wr = (void*)m->data;
-								TRACE("Resize request from host compositor for size %dx%d", wr->width, wr->height);
-								yutani_window_resize_accept(yg->host_context, yg->host_window, wr->width, wr->height);
-								yg->resize_on_next = 1;
-							}
-							break;
-						case YUTANI_MSG_WINDOW_CLOSE:
-						case YUTANI_MSG_SESSION_END:
-							{
-								TRACE("Host session ended. Should exit.");
-								yutani_msg_buildx_session_end_alloc(response);
-								yutani_msg_buildx_session_end(response);
-								pex_broadcast(server, response->size, (char *)response);
-								yg->server = NULL;
-								kill(render_thread.id, SIGINT);
-								exit(0);
-							}
-							break;
-						default:
-							break;
+									yutani_msg_buildx_mouse_event_alloc(m_);
+									yutani_msg_buildx_mouse_event(m_, 0, &packet, YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
+									handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m_->data);
+								}
+								break;
+							case YUTANI_MSG_RESIZE_OFFER:
+								{
+									struct yutani_msg_window_resize * wr = (void*)m->data;
+									TRACE("Resize request from host compositor for size %dx%d", wr->width, wr->height);
+									yutani_window_resize_accept(yg->host_context, yg->host_window, wr->width, wr->height);
+									yg->resize_on_next = 1;
+								}
+								break;
+							case YUTANI_MSG_WINDOW_CLOSE:
+							case YUTANI_MSG_SESSION_END:
+								{
+									TRACE("Host session ended. Should exit.");
+									yutani_msg_buildx_session_end_alloc(response);
+									yutani_msg_buildx_session_end(response);
+									pex_broadcast(server, response->size, (char *)response);
+									yg->server = NULL;
+									kill(render_thread.id, SIGINT);
+									exit(0);
+								}
+								break;
+							default:
+								break;
+						}
+						free(m);
+						m = yutani_poll_async(yg->host_context);
 					}
+					continue;
 				}
-				free(m);
-				continue;
-			}
-		} else {
-			int index = fswait(amfd == -1 ? 3 : 4, fds);
-
-			if (index == 2) {
-				unsigned char buf[1];
-				int r = read(kfd, buf, 1);
-				if (r > 0) {
-					kbd_scancode(&state, buf[0], &event);
-					yutani_msg_buildx_key_event_alloc(m);
-					yutani_msg_buildx_key_event(m,0, &event, &state);
-					handle_key_event(yg, (struct yutani_msg_key_event *)m->data);
-				}
-				continue;
-			} else if (index == 1) {
-				int r = read(mfd, (char *)&packet, sizeof(mouse_device_packet_t));
-				if (r > 0) {
-					yg->last_mouse_buttons = packet.buttons;
-					yutani_msg_buildx_mouse_event_alloc(m);
-					yutani_msg_buildx_mouse_event(m,0, &packet, YUTANI_MOUSE_EVENT_TYPE_RELATIVE);
-					handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
-				}
-				continue;
-			} else if (index == 3) {
-				int r = read(amfd, (char *)&packet, sizeof(mouse_device_packet_t));
-				if (r > 0) {
-					if (!vmmouse) {
-						packet.buttons = yg->last_mouse_buttons & 0xF;
-					} else {
+			} else if (ifd >= 0) {
+				int index = fswait(2, fds);
+
+				if (index == 1) {
+					/* Take everything that's queued up at once */
+					struct input_event events[INPUT_EVENTS_PER_READ];
+					int r = read(ifd, (char *)events, sizeof(events));
+					for (int i = 0; i < r / (int)sizeof(struct input_event); ++i) {
+						handle_input_event(yg, &state, &events[i]);
+					}
+					continue;
+				}
+			} else {
+				int index = fswait(amfd == -1 ? 3 : 4, fds);
+
+				if (index == 2) {
+					unsigned char buf[1];
+					int r = read(kfd, buf, 1);
+					if (r > 0) {
+						kbd_scancode(&state, buf[0], &event);
+						yutani_msg_buildx_key_event_alloc(m);
+						yutani_msg_buildx_key_event(m,0, &event, &state);
+						handle_key_event(yg, (struct yutani_msg_key_event *)m->data);
+					}
+					continue;
+				} else if (index == 1) {
+					int r = read(mfd, (char *)&packet, sizeof(mouse_device_packet_t));
+					if (r > 0) {
 						yg->last_mouse_buttons = packet.buttons;
+						yutani_msg_buildx_mouse_event_alloc(m);
+						yutani_msg_buildx_mouse_event(m,0, &packet, YUTANI_MOUSE_EVENT_TYPE_RELATIVE);
+						handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
 					}
-					yutani_msg_buildx_mouse_event_alloc(m);
-					yutani_msg_buildx_mouse_event(m,0, &packet, YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
-					handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
+					continue;
+				} else if (index == 3) {
+					int r = read(amfd, (char *)&packet, sizeof(mouse_device_packet_t));
+					if (r > 0) {
+						if (!vmmouse) {
+							packet.buttons = yg->last_mouse_buttons & 0xF;
+						} else {
+							yg->last_mouse_buttons = packet.buttons;
+						}
+						yutani_msg_buildx_mouse_event_alloc(m);
+						yutani_msg_buildx_mouse_event(m,0, &packet, YUTANI_MOUSE_EVENT_TYPE_ABSOLUTE);
+						handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
+					}
+					continue;
 				}
-				continue;
 			}
 		}
 
-		pex_packet_t * p = calloc(PACKET_SIZE, 1);
-		pex_listen(server, p);
+		if (batch_next == batch_end) {
+			ssize_t r = pex_recv_batch(server, batch, COMPOSITOR_BATCH_SIZE);
+			if (r <= 0) continue;
+			batch_next = batch;
+			batch_end = batch + r;
+		}
+
+		pex_packet_t * p = (pex_packet_t *)batch_next;
+		batch_next += PEX_RECORD_SIZE(p->size);
 
 		yutani_msg_t * m = (yutani_msg_t *)p->data;
 
@@ -2373,6 +3647,7 @@ int main(int argc, char * argv[]) {
 				list_free(client_list);
 				free(client_list);
 			}
+			client_events_destroy(yg, p->source);
 
 			if (hashmap_is_empty(yg->clients_to_windows)) {
 				TRACE("Last compositor client disconnected, exiting.");
@@ -2381,13 +3656,11 @@ int main(int argc, char * argv[]) {
 				exit(0);
 			}
 
-			free(p);
 			continue;
 		}
 
 		if (m->magic != YUTANI_MSG__MAGIC) {
 			TRACE("Message has bad magic. (Should eject client, but will instead skip this message.) 0x%x", m->magic);
-			free(p);
 			continue;
 		}
 
@@ -2412,6 +3685,7 @@ int main(int argc, char * argv[]) {
 					struct yutani_msg_window_new_flags * wn = (void *)m->data;
 					TRACE("Client %08x requested a new window (%dx%d).", p->source, wn->width, wn->height);
 					yutani_server_window_t * w = server_window_create(yg, wn->width, wn->height, p->source, m->type != YUTANI_MSG_WINDOW_NEW ? wn->flags : 0);
+					client_events_create(yg, p->source, w->wid);
 					yutani_msg_buildx_window_init_alloc(response);
 					yutani_msg_buildx_window_init(response,w->wid, w->width, w->height, w->bufid);
 					pex_send(server, p->source, response->size, (char *)response);
@@ -2497,7 +3771,7 @@ int main(int argc, char * argv[]) {
 					if (w) {
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+						send_event(yg, p->source, response);
 					}
 				}
 				break;
@@ -2508,7 +3782,7 @@ int main(int argc, char * argv[]) {
 					if (w) {
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+						send_event(yg, p->source, response);
 					}
 				}
 				break;
@@ -2520,7 +3794,7 @@ int main(int argc, char * argv[]) {
 						uint32_t newbufid = server_window_resize(yg, w, wr->width, wr->height);
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_BUFID, w->wid, wr->width, wr->height, newbufid, 0);
-						pex_send(server, p->source, response->size, (char *)response);
+						send_event(yg, p->source, response);
 					}
 				}
 				break;
@@ -2625,6 +3899,18 @@ int main(int argc, char * argv[]) {
 					}
 				}
 				break;
+			case YUTANI_MSG_WINDOW_OPAQUE_REGION:
+				{
+					struct yutani_msg_window_opaque_region * wo = (void *)m->data;
+					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)wo->wid);
+					if (w) {
+						spin_lock(&yg->redraw_lock);
+						w->opaque_region = (gfx_rect_t){wo->x, wo->y, wo->width, wo->height};
+						spin_unlock(&yg->redraw_lock);
+						mark_window(yg, w);
+					}
+				}
+				break;
 			case YUTANI_MSG_WINDOW_WARP_MOUSE:
 				{
 					struct yutani_msg_window_warp_mouse * wa = (void *)m->data;
@@ -2734,7 +4020,6 @@ int main(int argc, char * argv[]) {
 				}
 				break;
 		}
-		free(p);
 	}
 
 	return 0;
@@ -5,23 +5,53 @@
  *
  * cp - Copy files
  *
+ * File contents are moved by the kernel with sendfile() where it can,
+ * a megabyte at a time. For recursive copies, the tree is walked here
+ * while a few worker threads copy the files, so one file's data can be
+ * moving while the next directory is read.
  */
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
-#define CHUNK_SIZE 4096
+#include <toaru/list.h>
+
+#define CHUNK_SIZE    65536
+#define SENDFILE_SIZE 0x100000
+#define COPY_WORKERS  4
 
 static int recursive = 0;
 static int symlinks = 0;
 static int copy_thing(char * tmp, char * tmp2);
 
+struct copy_job {
+	char * source;
+	char * dest;
+	int mode;
+	int uid;
+	int gid;
+};
+
+/* Files waiting for a worker, during recursive copies */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	list_t * jobs;
+	int running;
+	int finished;
+	int failed;
+	pthread_t workers[COPY_WORKERS];
+} pool;
+
 static int copy_link(char * source, char * dest, int mode, int uid, int gid) {
 	//fprintf(stderr, "need to copy link %s to %s\n", source, dest);
 	char tmp[1024];
@@ -33,33 +63,125 @@ static int copy_link(char * source, char * dest, int mode, int uid, int gid) {
 	return 0;
 }
 
+static int copy_contents(int s_fd, int d_fd) {
+	/* Let the kernel move the data if it can */
+	while (1) {
+		ssize_t r = sendfile(d_fd, s_fd, NULL, SENDFILE_SIZE);
+		if (!r) return 0;
+		if (r < 0) {
+			if (errno == EINVAL || errno == ENOSYS) break;
+			return -1;
+		}
+	}
+
+	char * buf = malloc(CHUNK_SIZE);
+	while (1) {
+		ssize_t r = read(s_fd, buf, CHUNK_SIZE);
+		if (r <= 0) {
+			free(buf);
+			return r;
+		}
+		if (write(d_fd, buf, r) != r) {
+			free(buf);
+			return -1;
+		}
+	}
+}
+
 static int copy_file(char * source, char * dest, int mode,int uid, int gid) {
 	//fprintf(stderr, "need to copy file %s to %s %x\n", source, dest, mode);
 
-	int d_fd = open(dest, O_WRONLY | O_CREAT, mode);
 	int s_fd = open(source, O_RDONLY);
+	if (s_fd < 0) {
+		fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+		return 1;
+	}
 
-	ssize_t length;
-
-	length = lseek(s_fd, 0, SEEK_END);
-	lseek(s_fd, 0, SEEK_SET);
-
-	//fprintf(stderr, "%d bytes to copy\n", length);
-
-	char buf[CHUNK_SIZE];
+	int d_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (d_fd < 0) {
+		fprintf(stderr, "cp: %s: %s\n", dest, strerror(errno));
+		close(s_fd);
+		return 1;
+	}
 
-	while (length > 0) {
-		size_t r = read(s_fd, buf, length < CHUNK_SIZE ? length : CHUNK_SIZE);
-		//fprintf(stderr, "copying %d bytes from %s to %s\n", r, source, dest);
-		write(d_fd, buf, r);
-		length -= r;
-		//fprintf(stderr, "%d bytes remaining\n", length);
+	int ret = 0;
+	if (copy_contents(s_fd, d_fd) < 0) {
+		fprintf(stderr, "cp: %s: %s\n", dest, strerror(errno));
+		ret = 1;
 	}
 
 	close(s_fd);
 	close(d_fd);
 
 	chown(dest, uid, gid);
+	return ret;
+}
+
+static void * copy_worker(void * arg) {
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.jobs->length && !pool.finished) {
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		if (!pool.jobs->length) break;
+
+		node_t * node = list_dequeue(pool.jobs);
+		struct copy_job * job = node->value;
+		free(node);
+		pthread_mutex_unlock(&pool.lock);
+
+		int failed = copy_file(job->source, job->dest, job->mode, job->uid, job->gid);
+		free(job->source);
+		free(job->dest);
+		free(job);
+
+		pthread_mutex_lock(&pool.lock);
+		if (failed) pool.failed = 1;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void pool_start(void) {
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pool.jobs = list_create();
+	for (int i = 0; i < COPY_WORKERS; ++i) {
+		if (pthread_create(&pool.workers[i], NULL, copy_worker, NULL) == 0) {
+			pool.running++;
+		}
+	}
+}
+
+/* Wait for the workers to get through everything that was queued */
+static int pool_finish(void) {
+	if (!pool.running) return 0;
+	pthread_mutex_lock(&pool.lock);
+	pool.finished = 1;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < pool.running; ++i) {
+		pthread_join(pool.workers[i], NULL);
+	}
+	return pool.failed;
+}
+
+static int queue_file(char * source, char * dest, int mode, int uid, int gid) {
+	if (!pool.running) {
+		return copy_file(source, dest, mode, uid, gid);
+	}
+
+	struct copy_job * job = malloc(sizeof(struct copy_job));
+	job->source = strdup(source);
+	job->dest = strdup(dest);
+	job->mode = mode;
+	job->uid = uid;
+	job->gid = gid;
+
+	pthread_mutex_lock(&pool.lock);
+	list_insert(pool.jobs, job);
+	pthread_cond_signal(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
 	return 0;
 }
 
@@ -116,7 +238,7 @@ static int copy_thing(char * tmp, char * tmp2) {
 		}
 		return copy_directory(tmp, tmp2, statbuf.st_mode & 07777, statbuf.st_uid, statbuf.st_gid);
 	} else if (S_ISREG(statbuf.st_mode)) {
-		return copy_file(tmp, tmp2, statbuf.st_mode & 07777, statbuf.st_uid, statbuf.st_gid);
+		return queue_file(tmp, tmp2, statbuf.st_mode & 07777, statbuf.st_uid, statbuf.st_gid);
 	} else {
 		fprintf(stderr, "cp: %s is not any of the required file types?\n", tmp);
 		return 1;
@@ -142,6 +264,12 @@ int main(int argc, char ** argv) {
 		}
 	}
 
+	int ret = 0;
+
+	if (recursive) {
+		pool_start();
+	}
+
 	if (optind < argc - 1) {
 		char * destination = argv[argc-1];
 
@@ -153,7 +281,7 @@ int main(int argc, char ** argv) {
 				if (!source) source = argv[optind];
 				char output[4096];
 				sprintf(output, "%s/%s", destination, source);
-				copy_thing(argv[optind], output);
+				ret |= copy_thing(argv[optind], output);
 				optind++;
 			}
 		} else {
@@ -161,12 +289,14 @@ int main(int argc, char ** argv) {
 				fprintf(stderr, "cp: target '%s' is not a directory\n", destination);
 				return 1;
 			}
-			copy_thing(argv[optind], destination);
+			ret |= copy_thing(argv[optind], destination);
 		}
 	} else {
 		fprintf(stderr, "cp: not enough arguments\n");
 	}
 
-	return 0;
+	ret |= pool_finish();
+
+	return ret;
 }
 
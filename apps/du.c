@@ -7,8 +7,11 @@
  *
  * TODO: Should use st_blocks, but we don't set that in the kernel yet?
  *
+ * The tree is read by toaru_walk, a few directories at a time.
+ *
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -18,12 +21,11 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 
+#include <toaru/walk.h>
+
 static int show_total = 0;
 static int human = 0;
 static int all = 1;
-static int is_arg = 0;
-
-static uint64_t count_thing(char * tmp);
 
 static int print_human_readable_size(char * _out, size_t s) {
 	if (s >= 1<<20) {
@@ -50,52 +52,34 @@ static void print_size(uint64_t size, char * name) {
 	fprintf(stdout, "%7s %s\n", sizes, name);
 }
 
-static uint64_t count_directory(char * source) {
-	DIR * dirp = opendir(source);
-	if (dirp == NULL) {
-		//fprintf(stderr, "could not open %s\n", source);
-		return 0;
-	}
-
-	int was_arg = is_arg;
-	is_arg = 0;
-
-	uint64_t total = 0;
-
-	struct dirent * ent = readdir(dirp);
-	while (ent != NULL) {
-		if (!strcmp(ent->d_name,".") || !strcmp(ent->d_name,"..")) {
-			ent = readdir(dirp);
-			continue;
+/* Directories are printed after what's in them, as they were walked */
+static void print_directory(walk_node_t * node, int is_arg) {
+	for (size_t i = 0; i < node->child_count; ++i) {
+		walk_node_t * child = node->children[i];
+		if (S_ISDIR(child->st.st_mode)) {
+			print_directory(child, 0);
 		}
-		char tmp[strlen(source)+strlen(ent->d_name)+2];
-		sprintf(tmp, "%s/%s", source, ent->d_name);
-		total += count_thing(tmp);
-		ent = readdir(dirp);
 	}
-	closedir(dirp);
-
-	if (all || was_arg) {
-		print_size(total, source);
+	if ((all || is_arg) && !node->error) {
+		char * path = walk_path(node);
+		print_size(node->total, path);
+		free(path);
 	}
-
-	return total;
 }
 
 static uint64_t count_thing(char * tmp) {
-	struct stat statbuf;
-	lstat(tmp,&statbuf);
-	if (S_ISDIR(statbuf.st_mode)) {
-		return count_directory(tmp);
-	} else {
-		if (is_arg) {
-			print_size(statbuf.st_size, tmp);
-		}
-		return statbuf.st_size;
+	walk_node_t * root = walk_tree(tmp, 0);
+	if (!root) return 0;
+	uint64_t total = root->total;
+	if (S_ISDIR(root->st.st_mode)) {
+		print_directory(root, 1);
+	} else if (!root->error) {
+		print_size(total, tmp);
 	}
+	walk_free(root);
+	return total;
 }
 
-
 int main(int argc, char * argv[]) {
 	int opt;
 	while ((opt = getopt(argc, argv, "hsc")) != -1) {
@@ -119,7 +103,6 @@ int main(int argc, char * argv[]) {
 	uint64_t total = 0;
 
 	for (int i = optind; i < argc; ++i) {
-		is_arg = 1;
 		total += count_thing(argv[i]);
 	}
 
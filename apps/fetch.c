@@ -5,6 +5,14 @@
  *
  * fetch - Retreive documents from HTTP servers.
  *
+ * Plain GETs go over HTTP/1.1: requests for the same host share a
+ * connection and are pipelined, and bodies are copied straight to the
+ * output with large reads. Several URLs can be fetched at once, and
+ * --parallel splits them between that many processes.
+ *
+ * A URL can end in #crc32=XXXXXXXX to have its body checked as it's
+ * copied; a download that doesn't match counts as failed and its file
+ * is removed.
  */
 #include <stdio.h>
 #include <string.h>
@@ -14,10 +22,17 @@
 #include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/wait.h>
 
 #include <toaru/hashmap.h>
+#include <toaru/checksum.h>
 
 #define SIZE 512
+#define HTTP_BUFSIZE   0x10000 /* Reads from the socket and writes to the file */
+#define HTTP_PIPELINE  8       /* Requests outstanding on one connection */
+#define HTTP_RETRIES   2
 #define BOUNDARY "------ToaruOSFetchUploadBoundary"
 
 struct http_req {
@@ -40,8 +55,26 @@ struct {
 	int calculate_output;
 	int slow_upload;
 	int machine_readable;
+	int parallel;
 } fetch_options = {0};
 
+struct fetch_job {
+	struct http_req req;
+	const char * output; /* NULL for stdout */
+	int tries;
+	int failed;
+	int verify;          /* Check the body against expected_crc */
+	uint32_t expected_crc;
+};
+
+/* A keep-alive connection, with whatever's been read but not used */
+struct http_conn {
+	int fd;
+	size_t start;
+	size_t end;
+	char buf[HTTP_BUFSIZE];
+};
+
 void parse_url(char * d, struct http_req * r) {
 	if (strstr(d, "http://") == d) {
 
@@ -106,6 +139,7 @@ int usage(char * argv[]) {
 			"fetch - download files over HTTP\n"
 			"\n"
 			"usage: %s [-hOvmp?] [-c cookie] [-o file] [-u file] [-s speed] URL\n"
+			"       %s [-hOvm] [-c cookie] [-P n] [file=]URL...\n"
 			"\n"
 			" -h     \033[3mshow headers\033[0m\n"
 			" -O     \033[3msave the file based on the filename in the URL\033[0m\n"
@@ -116,8 +150,13 @@ int usage(char * argv[]) {
 			" -o ... \033[3msave to the specified file\033[0m\n"
 			" -u ... \033[3mupload the specified file\033[0m\n"
 			" -s ... \033[3mspecify the speed for uploading slowly\033[0m\n"
+			" -P ... \033[3m(--parallel) fetch with this many processes\033[0m\n"
 			" -?     \033[3mshow this help text\033[0m\n"
-			"\n", argv[0]);
+			"\n"
+			"With several URLs, each goes to the file named before it, or\n"
+			"one named after the URL. A URL ending in #crc32=XXXXXXXX fails\n"
+			"if what it fetched has a different CRC32.\n"
+			"\n", argv[0], argv[0]);
 	return 1;
 }
 
@@ -244,11 +283,300 @@ int http_fetch(FILE * f) {
 	return 0;
 }
 
+static int http_open(struct http_conn * c, const char * domain) {
+	char file[SIZE + 16];
+	sprintf(file, "/dev/net/%s", domain);
+	c->fd = open(file, O_RDWR);
+	c->start = c->end = 0;
+	return c->fd < 0 ? -1 : 0;
+}
+
+static void http_close(struct http_conn * c) {
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+}
+
+static int http_fill(struct http_conn * c) {
+	if (c->start == c->end) {
+		c->start = c->end = 0;
+	} else if (c->end == HTTP_BUFSIZE) {
+		memmove(c->buf, c->buf + c->start, c->end - c->start);
+		c->end -= c->start;
+		c->start = 0;
+	}
+	ssize_t r = read(c->fd, c->buf + c->end, HTTP_BUFSIZE - c->end);
+	if (r <= 0) return -1;
+	c->end += r;
+	return 0;
+}
+
+/* One header line without its line ending; -1 if the connection ended */
+static int http_getline(struct http_conn * c, char * line, size_t size) {
+	while (1) {
+		char * nl = memchr(c->buf + c->start, '\n', c->end - c->start);
+		if (nl) {
+			size_t len = nl - (c->buf + c->start);
+			size_t n = len < size - 1 ? len : size - 1;
+			memcpy(line, c->buf + c->start, n);
+			if (n && line[n-1] == '\r') n--;
+			line[n] = '\0';
+			c->start += len + 1;
+			return 0;
+		}
+		if (c->end - c->start == HTTP_BUFSIZE) return -1; /* Absurdly long */
+		if (http_fill(c)) return -1;
+	}
+}
+
+/* Buffered bytes first; past those, read straight into the caller's buffer */
+static ssize_t http_read(struct http_conn * c, void * buf, size_t size) {
+	if (c->start < c->end) {
+		size_t n = c->end - c->start < size ? c->end - c->start : size;
+		memcpy(buf, c->buf + c->start, n);
+		c->start += n;
+		return n;
+	}
+	return read(c->fd, buf, size);
+}
+
+/*
+ * Copy up to len bytes of body to out (-1 to discard); len of -1 means until
+ * the end. The CRC32 of what was copied is added to *crc.
+ */
+static int http_copy_body(struct http_conn * c, int out, ssize_t len, int single, uint32_t * crc) {
+	static char buf[HTTP_BUFSIZE];
+	while (len) {
+		size_t want = (len < 0 || len > HTTP_BUFSIZE) ? HTTP_BUFSIZE : (size_t)len;
+		ssize_t r = http_read(c, buf, want);
+		if (r <= 0) return len < 0 ? 0 : -1;
+		if (out >= 0 && write(out, buf, r) != r) return -1;
+		*crc = checksum_crc32(*crc, buf, r);
+		if (len > 0) len -= r;
+		if (single) {
+			fetch_options.size += r;
+			print_progress(0);
+			if (fetch_options.machine_readable && fetch_options.content_length) {
+				fprintf(stdout,"%d %d\n",(int)fetch_options.size, (int)fetch_options.content_length);
+			}
+		}
+	}
+	return 0;
+}
+
+static int http_copy_chunked(struct http_conn * c, int out, int single, uint32_t * crc) {
+	char line[256];
+	while (1) {
+		if (http_getline(c, line, sizeof(line))) return -1;
+		long size = strtol(line, NULL, 16);
+		if (size <= 0) break;
+		if (http_copy_body(c, out, size, single, crc)) return -1;
+		if (http_getline(c, line, sizeof(line))) return -1; /* CRLF after the data */
+	}
+	/* Trailers, up to a blank line */
+	do {
+		if (http_getline(c, line, sizeof(line))) return -1;
+	} while (*line);
+	return 0;
+}
+
+static void http_send_request(struct http_conn * c, struct fetch_job * job) {
+	char req[SIZE * 2 + 1024];
+	int len = sprintf(req,
+		"GET /%s HTTP/1.1\r\n"
+		"User-Agent: curl/7.35.0\r\n"
+		"Host: %s\r\n"
+		"Accept: */*\r\n"
+		"Connection: keep-alive\r\n", job->req.path, job->req.domain);
+	if (fetch_options.cookie) {
+		len += sprintf(req + len, "Cookie: %s\r\n", fetch_options.cookie);
+	}
+	len += sprintf(req + len, "\r\n");
+	write(c->fd, req, len);
+}
+
+/*
+ * Read one response into the job's output. Returns 0 if the connection
+ * can take more, 1 if the server is closing it, and -1 if it broke before
+ * the response was complete.
+ */
+static int http_response(struct http_conn * c, struct fetch_job * job, int single) {
+	char line[1024];
+	if (http_getline(c, line, sizeof(line))) return -1;
+
+	/* HTTP/1.x code reason */
+	int keep_alive = !strncmp(line, "HTTP/1.1", 8);
+	char * code = strchr(line, ' ');
+	if (!code) return -1;
+	int status = atoi(code + 1);
+
+	ssize_t length = (status / 100 == 1 || status == 204 || status == 304) ? 0 : -1;
+	int chunked = 0;
+	while (1) {
+		if (http_getline(c, line, sizeof(line))) return -1;
+		if (!*line) break;
+
+		char * value = strchr(line, ':');
+		if (!value) continue;
+		*value++ = '\0';
+		while (*value == ' ') value++;
+
+		if (fetch_options.show_headers) {
+			fprintf(stderr, "[%s] = %s\n", line, value);
+		}
+		if (!strcasecmp(line, "Content-Length")) {
+			length = atoi(value);
+		} else if (!strcasecmp(line, "Transfer-Encoding") && strstr(value, "chunked")) {
+			chunked = 1;
+		} else if (!strcasecmp(line, "Connection")) {
+			keep_alive = !strcasecmp(value, "keep-alive");
+		}
+	}
+
+	/* The body gets read either way, so the next response lines up */
+	int out = -1;
+	if (status == 200) {
+		out = job->output ? open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+		if (out < 0) {
+			fprintf(stderr, "%s: can't write\n", job->output);
+		}
+	} else {
+		fprintf(stderr, "Bad response code for /%s: %d\n", job->req.path, status);
+	}
+	job->failed = (out < 0);
+
+	if (single) {
+		fetch_options.content_length = length > 0 ? length : 0;
+		gettimeofday(&fetch_options.start, NULL);
+	}
+
+	int ret;
+	uint32_t crc = 0;
+	if (chunked) {
+		ret = http_copy_chunked(c, out, single, &crc);
+	} else {
+		if (length < 0) keep_alive = 0; /* Ends when the connection does */
+		ret = http_copy_body(c, out, length, single, &crc);
+	}
+
+	if (out >= 0 && out != STDOUT_FILENO) close(out);
+	if (single) print_progress(1);
+	if (ret) {
+		job->failed = 1;
+		return -1;
+	}
+	if (out >= 0 && job->verify && crc != job->expected_crc) {
+		fprintf(stderr, "/%s: checksum mismatch (expected %08x, got %08x)\n", job->req.path,
+			(unsigned int)job->expected_crc, (unsigned int)crc);
+		if (job->output) unlink(job->output);
+		job->failed = 1;
+	}
+	return keep_alive ? 0 : 1;
+}
+
+/*
+ * Fetch jobs in order, pipelining as many as HTTP_PIPELINE consecutive
+ * requests for the same host on one connection. Whatever was still
+ * outstanding when a connection closes is asked for again on a new one.
+ * Returns how many failed.
+ */
+static int fetch_jobs(struct fetch_job ** jobs, int count) {
+	struct http_conn * c = malloc(sizeof(struct http_conn));
+	c->fd = -1;
+	int failures = 0;
+	int next = 0; /* Next job to receive */
+
+	while (next < count) {
+		struct fetch_job * job = jobs[next];
+		if (http_open(c, job->req.domain)) {
+			fprintf(stderr, "%s: can't connect\n", job->req.domain);
+			job->failed = 1;
+			failures++;
+			next++;
+			continue;
+		}
+
+		int sent = next;
+		int broken = 0;
+		while (next < count && !broken) {
+			/* Keep the pipeline full */
+			while (sent < count && sent - next < HTTP_PIPELINE &&
+					!strcmp(jobs[sent]->req.domain, job->req.domain)) {
+				http_send_request(c, jobs[sent]);
+				sent++;
+			}
+			if (sent == next) break; /* Next job is for another host */
+
+			struct fetch_job * current = jobs[next];
+			int ret = http_response(c, current, count == 1);
+			if (ret < 0) {
+				broken = 1;
+				if (++current->tries < HTTP_RETRIES) break; /* Ask again */
+				fprintf(stderr, "/%s: connection lost\n", current->req.path);
+			}
+			if (current->failed) failures++;
+			next++;
+			if (ret) broken = 1;
+		}
+		http_close(c);
+	}
+
+	free(c);
+	return failures;
+}
+
+/* Split the jobs between n processes; fails if any of them did. */
+static int fetch_parallel(struct fetch_job ** jobs, int count, int n) {
+	if (n > count) n = count;
+	if (n <= 1) return fetch_jobs(jobs, count);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t * pids = malloc(sizeof(pid_t) * n);
+	for (int i = 0; i < n; ++i) {
+		pids[i] = fork();
+		if (!pids[i]) {
+			/* Every nth job, so hosts stay grouped within each worker */
+			int mine = 0;
+			for (int j = i; j < count; j += n) {
+				jobs[mine++] = jobs[j];
+			}
+			exit(fetch_jobs(jobs, mine) ? 1 : 0);
+		}
+	}
+
+	int failed = 0;
+	for (int i = 0; i < n; ++i) {
+		int status = 0;
+		if (pids[i] < 0 || waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			failed = 1;
+		}
+	}
+	free(pids);
+	return failed;
+}
+
+static const char * output_for_url(const char * path) {
+	const char * x = strrchr(path, '/');
+	return x ? x + 1 : path;
+}
+
 int main(int argc, char * argv[]) {
 
-	int opt;
+	static struct option long_opts[] = {
+		{"parallel", required_argument, 0, 'P'},
+		{"help",     no_argument,       0, '?'},
+		{0,0,0,0}
+	};
+
+	int opt, index;
 
-	while ((opt = getopt(argc, argv, "?c:hmo:Opu:vs:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "?c:hmo:Opu:vs:P:", long_opts, &index)) != -1) {
+		if (!opt) {
+			if (long_opts[index].flag == 0) {
+				opt = long_opts[index].val;
+			}
+		}
 		switch (opt) {
 			case '?':
 				return usage(argv);
@@ -279,6 +607,9 @@ int main(int argc, char * argv[]) {
 			case 's':
 				fetch_options.slow_upload = atoi(optarg);
 				break;
+			case 'P':
+				fetch_options.parallel = atoi(optarg);
+				break;
 		}
 	}
 
@@ -286,6 +617,48 @@ int main(int argc, char * argv[]) {
 		return usage(argv);
 	}
 
+	if (!fetch_options.upload_file) {
+		int count = argc - optind;
+		struct fetch_job ** jobs = malloc(sizeof(struct fetch_job *) * count);
+		for (int i = 0; i < count; ++i) {
+			char * arg = argv[optind + i];
+			struct fetch_job * job = calloc(1, sizeof(struct fetch_job));
+			char * eq = strstr(arg, "=http://");
+			if (eq && strstr(arg, "http://") != arg) {
+				*eq = '\0';
+				job->output = arg;
+				arg = eq + 1;
+			}
+			char * check = strstr(arg, "#crc32=");
+			if (check) {
+				*check = '\0';
+				job->verify = 1;
+				job->expected_crc = strtoul(check + 7, NULL, 16);
+			}
+			parse_url(arg, &job->req);
+			if (!job->output) {
+				if (count == 1) {
+					job->output = fetch_options.calculate_output ? output_for_url(job->req.path) : fetch_options.output_file;
+				} else {
+					job->output = output_for_url(job->req.path);
+				}
+			}
+			jobs[i] = job;
+		}
+
+		if (count > 1) fetch_options.show_progress = 0; /* One bar can't show them all */
+
+		int failed = fetch_parallel(jobs, count, fetch_options.parallel);
+
+		if (fetch_options.show_progress) {
+			fprintf(stderr,"\n");
+		}
+		if (fetch_options.machine_readable) {
+			fprintf(stdout,"done\n");
+		}
+		return failed ? 1 : 0;
+	}
+
 	struct http_req my_req;
 	parse_url(argv[optind], &my_req);
 
@@ -377,23 +750,6 @@ int main(int argc, char * argv[]) {
 
 		fprintf(f,"\r\n--" BOUNDARY "%08x--\r\n", boundary_fuzz);
 		fflush(f);
-
-	} else if (fetch_options.cookie) {
-		fprintf(f,
-			"GET /%s HTTP/1.0\r\n"
-			"User-Agent: curl/7.35.0\r\n"
-			"Host: %s\r\n"
-			"Accept: */*\r\n"
-			"Cookie: %s\r\n"
-			"\r\n", my_req.path, my_req.domain, fetch_options.cookie);
-
-	} else {
-		fprintf(f,
-			"GET /%s HTTP/1.0\r\n"
-			"User-Agent: curl/7.35.0\r\n"
-			"Host: %s\r\n"
-			"Accept: */*\r\n"
-			"\r\n", my_req.path, my_req.domain);
 	}
 
 	http_fetch(f);
@@ -7,39 +7,126 @@
  *
  * Locates strings in files and prints the lines containing them,
  * with extra color identification if stdout is a tty.
+ *
+ * Several strings can be given at once, separated by newlines, and
+ * -i ignores case. Input is searched a large block at a time rather
+ * than line by line; lines are only picked out around matches.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 
-#define LINE_SIZE 4096
+#include <toaru/search.h>
+
+#define BLOCK_SIZE 65536
+
+static void usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-i] thing-to-grep-for\n", argv[0]);
+}
 
 int main(int argc, char ** argv) {
-	if (argc < 2) {
-		fprintf(stderr, "usage: %s thing-to-grep-for\n", argv[0]);
+	int flags = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "i")) != -1) {
+		switch (opt) {
+			case 'i':
+				flags |= SEARCH_IGNORE_CASE;
+				break;
+			default:
+				usage(argv);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv);
 		return 1;
 	}
 
-	char * needle = argv[1];
-	char buf[LINE_SIZE];
+	/* One pattern per line of the argument */
+	char * needles = strdup(argv[optind]);
+	size_t count = 1;
+	for (char * c = needles; *c; ++c) {
+		if (*c == '\n') count++;
+	}
+	char ** patterns = malloc(sizeof(char *) * count);
+	size_t * lengths = malloc(sizeof(size_t) * count);
+	char * p = needles;
+	for (size_t i = 0; i < count; ++i) {
+		char * nl = strchr(p, '\n');
+		if (nl) *nl = '\0';
+		patterns[i] = p;
+		lengths[i] = strlen(p);
+		p += lengths[i] + 1;
+	}
+
+	search_t * search = search_create(patterns, lengths, count, flags);
+
+	size_t size = BLOCK_SIZE;
+	char * buf = malloc(size);
+	size_t have = 0;
+	int eof = 0;
 	int ret = 1;
 	int is_tty = isatty(STDOUT_FILENO);
 
-	while (fgets(buf, LINE_SIZE, stdin)) {
-		char * found = strstr(buf, needle);
-		if (found) {
+	while (!eof) {
+		ssize_t r = read(STDIN_FILENO, buf + have, size - have);
+		if (r <= 0) {
+			eof = 1;
+		} else {
+			have += r;
+		}
+
+		/* Only search whole lines; the partial one at the end waits for more */
+		size_t complete = have;
+		if (!eof) {
+			char * nl = memrchr(buf, '\n', have);
+			if (!nl) {
+				if (have == size) {
+					/* A very long line; make room for the rest of it */
+					size *= 2;
+					buf = realloc(buf, size);
+				}
+				continue;
+			}
+			complete = nl - buf + 1;
+		}
+
+		size_t pos = 0;
+		while (pos < complete) {
+			size_t which;
+			char * found = search_find(search, buf + pos, complete - pos, &which);
+			if (!found) break;
+
+			/* Pick out the line it's on */
+			char * line = buf + pos;
+			char * start = memrchr(line, '\n', found - line);
+			if (start) line = start + 1;
+			char * end = memchr(found, '\n', buf + complete - found);
+			end = end ? end + 1 : buf + complete;
+
 			if (is_tty) {
-				*found = '\0';
-				found += strlen(needle);
-				fprintf(stdout, "%s\033[1;31m%s\033[0m%s", buf, needle, found);
+				fwrite(line, 1, found - line, stdout);
+				fprintf(stdout, "\033[1;31m");
+				fwrite(found, 1, lengths[which], stdout);
+				fprintf(stdout, "\033[0m");
+				fwrite(found + lengths[which], 1, end - found - lengths[which], stdout);
 			} else {
-				fprintf(stdout, "%s", buf);
+				fwrite(line, 1, end - line, stdout);
 			}
 			ret = 0;
+
+			pos = end - buf;
 		}
+
+		/* Keep the partial line for next time */
+		memmove(buf, buf + complete, have - complete);
+		have -= complete;
 	}
 
+	search_free(search);
+
 	return ret;
 }
-
@@ -18,6 +18,7 @@
 #include <signal.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -33,6 +34,7 @@
 #include <toaru/sdf.h>
 #include <toaru/button.h>
 #include <toaru/jpeg.h>
+#include <toaru/png.h>
 
 #define APPLICATION_TITLE "File Browser"
 #define SCROLL_AMOUNT 120
@@ -48,6 +50,8 @@ struct File {
 	uint64_t size;       /* File size */
 	int type;            /* File type: 0 = normal, 1 = directory, 2 = launcher */
 	int selected;        /* Selection status */
+	time_t mtime;        /* Modification time, for the thumbnail cache */
+	sprite_t * thumbnail; /* Preview for images, once the thumbnailer has made one */
 };
 
 static yutani_t * yctx;
@@ -70,10 +74,13 @@ static int FILE_WIDTH = 100; /* Width of one column of icons */
 static int FILE_PTR_WIDTH = 1; /* How many icons wide the display should be */
 static sprite_t * contents_sprite = NULL; /* Icon view rendering context */
 static gfx_context_t * contents = NULL; /* Icon view rendering context */
+static int contents_scroll = 0; /* Value of scroll_offset the icon view was last drawn at */
 static char * current_directory = NULL; /* Current directory path */
 static int hilighted_offset = -1; /* Which file is hovered by the mouse */
 static struct File ** file_pointers = NULL; /* List of file pointers */
 static ssize_t file_pointers_len = 0; /* How many files are in the current list */
+static ssize_t file_pointers_size = 0; /* How much room file_pointers has */
+static DIR * loading_dir = NULL; /* Directory still being read, if any */
 static uint64_t last_click = 0; /* For double click */
 static int last_click_offset = -1; /* So that clicking two different things quickly doesn't count as a double click */
 
@@ -140,6 +147,19 @@ static int _decor_get_bounds(yutani_window_t * win, struct decor_bounds * bounds
 	return decor_get_bounds(win, bounds);
 }
 
+/**
+ * Tell the compositor everything inside the decorations is solid,
+ * so it gets copied to the screen instead of blended. The desktop
+ * is opaque all over and says so when it makes its window.
+ */
+static void update_opaque_region(void) {
+	if (is_desktop_background) return;
+	struct decor_bounds bounds;
+	decor_get_bounds(main_window, &bounds);
+	yutani_window_set_opaque(yctx, main_window, bounds.left_width, bounds.top_height,
+		main_window->width - bounds.width, main_window->height - bounds.height);
+}
+
 /**
  * This should probably be in a yutani core library...
  *
@@ -168,7 +188,7 @@ static void clear_offset(int offset) {
 	/* From the flat array offset, figure out the x/y offset. */
 	int offset_y = offset / FILE_PTR_WIDTH;
 	int offset_x = offset % FILE_PTR_WIDTH;
-	draw_rectangle_solid(contents, offset_x * FILE_WIDTH, offset_y * FILE_HEIGHT, FILE_WIDTH, FILE_HEIGHT, rgba(0,0,0,0));
+	draw_rectangle_solid(contents, offset_x * FILE_WIDTH, offset_y * FILE_HEIGHT - contents_scroll, FILE_WIDTH, FILE_HEIGHT, rgba(0,0,0,0));
 }
 
 static int print_human_readable_size(char * _out, uint64_t s) {
@@ -200,11 +220,15 @@ static void draw_file(struct File * f, int offset) {
 	int offset_y = offset / FILE_PTR_WIDTH;
 	int offset_x = offset % FILE_PTR_WIDTH;
 	int x = offset_x * FILE_WIDTH;
-	int y = offset_y * FILE_HEIGHT;
+	int y = offset_y * FILE_HEIGHT - contents_scroll;
+
+	/* The icon view only covers what's on screen; skip the rest */
+	if (y + FILE_HEIGHT <= 0 || y >= contents->height) return;
 
 	/* Load the icon sprite from the cache */
 	if (view_mode == VIEW_MODE_ICONS) {
-		sprite_t * icon = icon_get_48(f->icon);
+		sprite_t * icon = f->thumbnail ? f->thumbnail : icon_get_48(f->icon);
+		int icon_y = y + 2 + (48 - icon->height) / 2;
 
 		/* If the display name is too long to fit, cut it with an ellipsis. */
 		int len = strlen(f->name);
@@ -222,12 +246,12 @@ static void draw_file(struct File * f, int offset) {
 		/* Draw the icon */
 		int center_x_icon = (FILE_WIDTH - icon->width) / 2;
 		int center_x_text = (FILE_WIDTH - name_width) / 2;
-		draw_sprite(contents, icon, center_x_icon + x, y + 2);
+		draw_sprite(contents, icon, center_x_icon + x, icon_y);
 
 		if (f->selected) {
 			/* If this file is selected, paint the icon blue... */
 			if (main_window->focused) {
-				draw_sprite_alpha_paint(contents, icon, center_x_icon + x, y + 2, 0.5, rgb(72,167,255));
+				draw_sprite_alpha_paint(contents, icon, center_x_icon + x, icon_y, 0.5, rgb(72,167,255));
 			}
 			/* And draw the name with a blue background and white text */
 			draw_rounded_rectangle(contents, center_x_text + x - 2, y + 54, name_width + 6, 20, 3, rgb(72,167,255));
@@ -245,7 +269,7 @@ static void draw_file(struct File * f, int offset) {
 
 		if (offset == hilighted_offset) {
 			/* The hovered icon should have some added brightness, so paint it white */
-			draw_sprite_alpha_paint(contents, icon, center_x_icon + x, y + 2, 0.3, rgb(255,255,255));
+			draw_sprite_alpha_paint(contents, icon, center_x_icon + x, icon_y, 0.3, rgb(255,255,255));
 		}
 
 		if (f->link[0]) {
@@ -256,7 +280,9 @@ static void draw_file(struct File * f, int offset) {
 
 		free(name);
 	} else if (view_mode == VIEW_MODE_TILES) {
-		sprite_t * icon = icon_get_48(f->icon);
+		sprite_t * icon = f->thumbnail ? f->thumbnail : icon_get_48(f->icon);
+		int icon_x = x + 11 + (48 - icon->width) / 2;
+		int icon_y = y + 11 + (48 - icon->height) / 2;
 
 		uint32_t text_color = rgb(0,0,0);
 
@@ -270,10 +296,10 @@ static void draw_file(struct File * f, int offset) {
 			text_color = rgb(255,255,255);
 		}
 
-		draw_sprite(contents, icon, x + 11, y + 11);
+		draw_sprite(contents, icon, icon_x, icon_y);
 		if (offset == hilighted_offset) {
 			/* The hovered icon should have some added brightness, so paint it white */
-			draw_sprite_alpha_paint(contents, icon, x + 11, y + 11, 0.3, rgb(255,255,255));
+			draw_sprite_alpha_paint(contents, icon, icon_x, icon_y, 0.3, rgb(255,255,255));
 		}
 
 		int len = strlen(f->name);
@@ -356,13 +382,26 @@ static struct File * get_file_at_offset(int offset) {
 }
 
 /**
- * Redraw all icon view entries
+ * Height of the whole icon view, of which contents shows a window's worth.
+ */
+static int contents_height(void) {
+	return (file_pointers_len / FILE_PTR_WIDTH + 1) * FILE_HEIGHT;
+}
+
+/**
+ * Redraw the icon view entries that are on screen
  */
 static void redraw_files(void) {
 	/* Fill to blank */
 	draw_fill(contents, rgba(0,0,0,0));
 
-	for (int i = 0; i < file_pointers_len; ++i) {
+	contents_scroll = scroll_offset;
+
+	int first = (contents_scroll / FILE_HEIGHT) * FILE_PTR_WIDTH;
+	int last  = ((contents_scroll + contents->height) / FILE_HEIGHT + 1) * FILE_PTR_WIDTH;
+	if (last > file_pointers_len) last = file_pointers_len;
+
+	for (int i = first; i < last; ++i) {
 		draw_file(file_pointers[i], i);
 	}
 }
@@ -405,6 +444,304 @@ static int has_extension(struct File * f, char * extension) {
 	return 0;
 }
 
+/**
+ * Thumbnails
+ *
+ * Images in the current directory get previews in place of their icons.
+ * A worker thread makes them, so a directory full of photos doesn't hold
+ * up the UI: it takes requests in display order, decodes each image at a
+ * reduced size where the format allows it, and scales it to fit in an
+ * icon. Finished thumbnails are handed back through a pipe the main loop
+ * waits on, and drawn as they arrive.
+ *
+ * Thumbnails are also kept in ~/.thumbnails, one file per image, named
+ * by a hash of the path and checked against the path, size and mtime of
+ * the image, so revisiting a directory is cheap.
+ */
+#define THUMBNAIL_SIZE  48
+#define THUMBNAIL_MAGIC 0x4D485454 /* TTHM */
+
+struct thumbnail_header {
+	uint32_t magic;
+	uint32_t mtime;
+	uint64_t size;
+	uint16_t width;
+	uint16_t height;
+	char path[256];
+	/* Premultiplied pixels follow */
+};
+
+struct thumbnail_request {
+	unsigned int generation; /* load_directory() that asked for it */
+	struct File * file;      /* Stays valid while the generation matches */
+	char path[512];
+	uint32_t mtime;
+	uint64_t size;
+	sprite_t * result;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	list_t * pending;   /* For the worker */
+	list_t * done;      /* For the main loop */
+	unsigned int generation;
+	int notify[2];      /* Worker writes here when something is done */
+	int running;
+} thumbnails;
+
+static int is_thumbnailable(struct File * f) {
+	return f->type == 0 && !f->link[0] &&
+		(has_extension(f, ".jpg") || has_extension(f, ".jpeg") ||
+		 has_extension(f, ".png") || has_extension(f, ".bmp"));
+}
+
+static void thumbnail_cache_path(char * out, size_t len, const char * path) {
+	unsigned int hash = 5381;
+	for (const char * c = path; *c; ++c) {
+		hash = hash * 33 + (unsigned char)*c;
+	}
+	char * home = getenv("HOME");
+	snprintf(out, len, "%s/.thumbnails/%08x.thm", home ? home : "/tmp", hash);
+}
+
+static sprite_t * thumbnail_from_cache(struct thumbnail_request * req) {
+	char cache[512];
+	thumbnail_cache_path(cache, sizeof(cache), req->path);
+
+	FILE * f = fopen(cache, "r");
+	if (!f) return NULL;
+
+	struct thumbnail_header header;
+	sprite_t * out = NULL;
+	if (fread(&header, sizeof(header), 1, f) == 1 &&
+		header.magic == THUMBNAIL_MAGIC &&
+		header.mtime == req->mtime &&
+		header.size == req->size &&
+		header.width && header.width <= THUMBNAIL_SIZE &&
+		header.height && header.height <= THUMBNAIL_SIZE &&
+		!strncmp(header.path, req->path, sizeof(header.path))) {
+		out = create_sprite(header.width, header.height, ALPHA_EMBEDDED);
+		if (fread(out->bitmap, sizeof(uint32_t) * header.width * header.height, 1, f) != 1) {
+			sprite_free(out);
+			out = NULL;
+		}
+	}
+
+	fclose(f);
+	return out;
+}
+
+static void thumbnail_to_cache(struct thumbnail_request * req, sprite_t * thumb) {
+	if (strlen(req->path) >= sizeof(((struct thumbnail_header *)0)->path)) return;
+
+	char cache[512];
+	char * home = getenv("HOME");
+	snprintf(cache, sizeof(cache), "%s/.thumbnails", home ? home : "/tmp");
+	mkdir(cache, 0700);
+	thumbnail_cache_path(cache, sizeof(cache), req->path);
+
+	FILE * f = fopen(cache, "w");
+	if (!f) return;
+
+	struct thumbnail_header header = {0};
+	header.magic  = THUMBNAIL_MAGIC;
+	header.mtime  = req->mtime;
+	header.size   = req->size;
+	header.width  = thumb->width;
+	header.height = thumb->height;
+	strcpy(header.path, req->path);
+
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(thumb->bitmap, sizeof(uint32_t) * thumb->width * thumb->height, 1, f);
+	fclose(f);
+}
+
+static sprite_t * load_full_image(const char * path) {
+	sprite_t * image = calloc(1, sizeof(sprite_t));
+	int len = strlen(path);
+
+	if ((len > 4 && !strcmp(path + len - 4, ".jpg")) || (len > 5 && !strcmp(path + len - 5, ".jpeg"))) {
+		/* Decode as small as we can get away with */
+		for (int scale = 8; scale >= 1; scale /= 2) {
+			if (load_sprite_jpg_scaled(image, (char *)path, scale)) break;
+			if (scale == 1 || (image->width >= THUMBNAIL_SIZE && image->height >= THUMBNAIL_SIZE)) {
+				return image;
+			}
+			free(image->bitmap);
+			image->bitmap = NULL;
+		}
+	} else if (len > 4 && !strcmp(path + len - 4, ".png")) {
+		if (!load_sprite_png(image, (char *)path)) return image;
+	} else {
+		FILE * f = fopen(path, "r");
+		char magic[2] = {0};
+		if (f) {
+			fread(magic, 2, 1, f);
+			fclose(f);
+		}
+		if (magic[0] == 'B' && magic[1] == 'M') {
+			load_sprite(image, (char *)path);
+			if (image->width && image->height) return image;
+		}
+	}
+
+	free(image->bitmap);
+	free(image);
+	return NULL;
+}
+
+static sprite_t * make_thumbnail(struct thumbnail_request * req) {
+	sprite_t * thumb = thumbnail_from_cache(req);
+	if (thumb) return thumb;
+
+	sprite_t * image = load_full_image(req->path);
+	if (!image) return NULL;
+
+	/* Fit in the icon box, keeping the aspect ratio; never scale up */
+	int w = image->width, h = image->height;
+	if (w > THUMBNAIL_SIZE || h > THUMBNAIL_SIZE) {
+		if (w >= h) {
+			h = h * THUMBNAIL_SIZE / w;
+			w = THUMBNAIL_SIZE;
+		} else {
+			w = w * THUMBNAIL_SIZE / h;
+			h = THUMBNAIL_SIZE;
+		}
+		if (!w) w = 1;
+		if (!h) h = 1;
+	}
+
+	thumb = create_sprite(w, h, ALPHA_EMBEDDED);
+	gfx_context_t * tctx = init_graphics_sprite(thumb);
+	draw_fill(tctx, rgba(0,0,0,0));
+	image->alpha = ALPHA_EMBEDDED;
+	if (w == image->width && h == image->height) {
+		draw_sprite(tctx, image, 0, 0);
+	} else {
+		draw_sprite_scaled(tctx, image, 0, 0, w, h);
+	}
+	free(tctx);
+	sprite_free(image);
+
+	thumbnail_to_cache(req, thumb);
+	return thumb;
+}
+
+static void * thumbnail_worker(void * arg) {
+	pthread_mutex_lock(&thumbnails.lock);
+	while (1) {
+		while (!thumbnails.pending->length) {
+			pthread_cond_wait(&thumbnails.wake, &thumbnails.lock);
+		}
+		node_t * node = list_dequeue(thumbnails.pending);
+		struct thumbnail_request * req = node->value;
+		free(node);
+
+		if (req->generation != thumbnails.generation) {
+			free(req);
+			continue;
+		}
+		pthread_mutex_unlock(&thumbnails.lock);
+
+		req->result = make_thumbnail(req);
+
+		pthread_mutex_lock(&thumbnails.lock);
+		list_insert(thumbnails.done, req);
+		write(thumbnails.notify[1], "!", 1);
+	}
+
+	return NULL;
+}
+
+static void thumbnails_init(void) {
+	pthread_mutex_init(&thumbnails.lock, NULL);
+	pthread_cond_init(&thumbnails.wake, NULL);
+	thumbnails.pending = list_create();
+	thumbnails.done = list_create();
+	if (pipe(thumbnails.notify) < 0) return;
+
+	pthread_t worker;
+	if (pthread_create(&worker, NULL, thumbnail_worker, NULL) == 0) {
+		thumbnails.running = 1;
+	}
+}
+
+/**
+ * Drop whatever is queued for the old directory, before its files go away.
+ */
+static void thumbnails_reset(void) {
+	if (!thumbnails.running) return;
+
+	pthread_mutex_lock(&thumbnails.lock);
+	thumbnails.generation++;
+	while (thumbnails.pending->length) {
+		node_t * node = list_dequeue(thumbnails.pending);
+		free(node->value);
+		free(node);
+	}
+	pthread_mutex_unlock(&thumbnails.lock);
+}
+
+/**
+ * Ask for thumbnails of any images among some newly loaded files.
+ */
+static void thumbnails_request(struct File ** files, int count) {
+	if (!thumbnails.running) return;
+
+	pthread_mutex_lock(&thumbnails.lock);
+	for (int i = 0; i < count; ++i) {
+		struct File * f = files[i];
+		if (!is_thumbnailable(f)) continue;
+		struct thumbnail_request * req = malloc(sizeof(struct thumbnail_request));
+		req->generation = thumbnails.generation;
+		req->file   = f;
+		req->mtime  = f->mtime;
+		req->size   = f->size;
+		req->result = NULL;
+		snprintf(req->path, sizeof(req->path), "%s/%s", current_directory, f->name);
+		list_insert(thumbnails.pending, req);
+	}
+
+	if (thumbnails.pending->length) {
+		pthread_cond_signal(&thumbnails.wake);
+	}
+	pthread_mutex_unlock(&thumbnails.lock);
+}
+
+/**
+ * Called from the main loop when the worker says it has finished some.
+ * Returns whether anything needs to be redrawn.
+ */
+static int thumbnails_collect(void) {
+	char buf[64];
+	read(thumbnails.notify[0], buf, sizeof(buf));
+
+	int redraw = 0;
+	pthread_mutex_lock(&thumbnails.lock);
+	while (thumbnails.done->length) {
+		node_t * node = list_dequeue(thumbnails.done);
+		struct thumbnail_request * req = node->value;
+		free(node);
+
+		if (req->generation == thumbnails.generation && req->result) {
+			req->file->thumbnail = req->result;
+			redraw = 1;
+		} else if (req->result) {
+			sprite_free(req->result);
+		}
+		free(req);
+	}
+	pthread_mutex_unlock(&thumbnails.lock);
+
+	/* Entries move around while a directory loads, so just redraw what's visible */
+	if (redraw) {
+		redraw_files();
+	}
+
+	return redraw;
+}
+
 static list_t * history_back;
 static list_t * history_forward;
 
@@ -436,6 +773,244 @@ static void update_status(void) {
 	}
 }
 
+/**
+ * Build an icon view entry for one directory entry.
+ */
+static struct File * load_file(struct dirent * ent) {
+	/* Set display name from file name */
+	struct File * f = malloc(sizeof(struct File));
+	sprintf(f->name, "%s", ent->d_name); /* snprintf? copy min()? */
+
+	struct stat statbuf;
+	struct stat statbufl;
+
+	/* Calculate absolute path to file */
+	char tmp[strlen(current_directory)+strlen(ent->d_name)+2];
+	sprintf(tmp, "%s/%s", current_directory, ent->d_name);
+	lstat(tmp, &statbuf);
+
+	f->size = statbuf.st_size;
+	f->mtime = statbuf.st_mtime;
+	f->thumbnail = NULL;
+
+	/* Read link target for symlinks */
+	if (S_ISLNK(statbuf.st_mode)) {
+		memcpy(&statbufl, &statbuf, sizeof(struct stat));
+		stat(tmp, &statbuf);
+		readlink(tmp, f->link, 256);
+	} else {
+		f->link[0] = '\0';
+	}
+
+	f->launcher[0] = '\0';
+	f->filetype[0] = '\0';
+	f->selected = 0;
+
+	if (S_ISDIR(statbuf.st_mode)) {
+		/* Directory */
+		sprintf(f->icon, "folder");
+		sprintf(f->filetype, "Directory");
+		f->type = 1;
+	} else {
+		/* Regular file */
+
+		/* Default regular files to open in bim */
+		sprintf(f->launcher, "exec terminal bim");
+
+		if (is_desktop_background && has_extension(f, ".launcher")) {
+			/* In desktop mode, read launchers specially */
+			FILE * file = fopen(tmp,"r");
+			char tbuf[1024];
+			while (!feof(file)) {
+				fgets(tbuf, 1024, file);
+				char * nl = strchr(tbuf,'\n');
+				if (nl) *nl = '\0';
+				char * eq = strchr(tbuf,'=');
+				if (!eq) continue;
+				*eq = '\0'; eq++;
+
+				if (!strcmp(tbuf, "icon")) {
+					sprintf(f->icon, "%s", eq);
+				} else if (!strcmp(tbuf, "run")) {
+					sprintf(f->launcher, "%s #", eq);
+				} else if (!strcmp(tbuf, "title")) {
+					sprintf(f->name, eq);
+				}
+			}
+			sprintf(f->filetype, "Launcher");
+			sprintf(f->filename, "%s", ent->d_name);
+			f->type = 2;
+		} else {
+			/* Handle various file types */
+			if (has_extension(f, ".c")) {
+				sprintf(f->icon, "c");
+				sprintf(f->filetype, "C Source");
+			} else if (has_extension(f, ".h")) {
+				sprintf(f->icon, "h");
+				sprintf(f->filetype, "C Header");
+			} else if (has_extension(f, ".bmp")) {
+				sprintf(f->icon, "image");
+				sprintf(f->launcher, "exec imgviewer");
+				sprintf(f->filetype, "Bitmap Image");
+			} else if (has_extension(f, ".tga")) {
+				sprintf(f->icon, "image");
+				sprintf(f->launcher, "exec imgviewer");
+				sprintf(f->filetype, "Targa Image");
+			} else if (has_extension(f, ".jpg") || has_extension(f,".jpeg")) {
+				sprintf(f->icon, "image");
+				sprintf(f->launcher, "exec imgviewer");
+				sprintf(f->filetype, "JPEG Image");
+			} else if (has_extension(f, ".png")) {
+				sprintf(f->icon, "image");
+				sprintf(f->launcher, "exec imgviewer");
+				sprintf(f->filetype, "PNG Image");
+			} else if (has_extension(f, ".sdf")) {
+				sprintf(f->icon, "font");
+				sprintf(f->filetype, "SDF Font");
+				/* TODO: Font viewer for SDF and TrueType */
+			} else if (has_extension(f, ".ttf")) {
+				sprintf(f->icon, "font");
+				sprintf(f->filetype, "TrueType Font");
+			} else if (has_extension(f, ".tgz") || has_extension(f, ".tar.gz")) {
+				sprintf(f->icon, "package");
+				sprintf(f->filetype, "Compressed Archive File");
+			} else if (has_extension(f, ".tar")) {
+				sprintf(f->icon, "package");
+				sprintf(f->filetype, "Archive File");
+			} else if (has_extension(f, ".sh")) {
+				sprintf(f->icon, "sh");
+				if (statbuf.st_mode & 0111) {
+					/* Make executable */
+					sprintf(f->launcher, "SELF");
+					sprintf(f->filetype, "Executable Shell Script");
+				} else {
+					sprintf(f->filetype, "Shell Script");
+				}
+			} else if (has_extension(f, ".py")) {
+				sprintf(f->icon, "py");
+				if (statbuf.st_mode & 0111) {
+					/* Make executable */
+					sprintf(f->launcher, "SELF");
+					sprintf(f->filetype, "Executable Python Script");
+				} else {
+					sprintf(f->filetype, "Python Script");
+				}
+			} else if (has_extension(f, ".ko")) {
+				sprintf(f->icon, "file");
+				sprintf(f->filetype, "Kernel Module");
+			} else if (has_extension(f, ".o")) {
+				sprintf(f->icon, "file");
+				sprintf(f->filetype, "Object File");
+			} else if (has_extension(f, ".so")) {
+				sprintf(f->icon, "file");
+				sprintf(f->filetype, "Shared Object File");
+			} else if (has_extension(f, ".S")) {
+				sprintf(f->icon, "file");
+				sprintf(f->filetype, "Assembly Source");
+			} else if (has_extension(f, ".ld")) {
+				sprintf(f->icon, "file");
+				sprintf(f->filetype, "Linker Script");
+			} else if (statbuf.st_mode & 0111) {
+				/* Executable files - use their name for their icon, and launch themselves. */
+				sprintf(f->icon, "%s", f->name);
+				sprintf(f->launcher, "SELF");
+				sprintf(f->filetype, "Executable");
+			} else {
+				sprintf(f->icon, "file");
+				sprintf(f->filetype, "File");
+			}
+			f->type = 0;
+		}
+	}
+
+	return f;
+}
+
+/**
+ * Sort order for the icon view.
+ */
+static int compare_files(const struct File * f1, const struct File * f2) {
+	/* Launchers before directories before files */
+	if (f1->type > f2->type) return -1;
+	if (f2->type > f1->type) return 1;
+	/* Launchers sorted by filename, not by display name */
+	if (f1->type == 2 && f2->type == 2) {
+		return strcmp(f1->filename, f2->filename);
+	}
+	/* Files sorted by name */
+	return strcmp(f1->name, f2->name);
+}
+
+/**
+ * Put a new entry where it belongs in file_pointers.
+ */
+static void insert_file(struct File * f) {
+	if (file_pointers_len == file_pointers_size) {
+		file_pointers_size = file_pointers_size ? file_pointers_size * 2 : 64;
+		file_pointers = realloc(file_pointers, sizeof(struct File *) * file_pointers_size);
+	}
+
+	/* Binary search for the first entry that sorts after this one */
+	ssize_t lo = 0, hi = file_pointers_len;
+	while (lo < hi) {
+		ssize_t mid = (lo + hi) / 2;
+		if (compare_files(file_pointers[mid], f) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	memmove(&file_pointers[lo + 1], &file_pointers[lo], sizeof(struct File *) * (file_pointers_len - lo));
+	file_pointers[lo] = f;
+	file_pointers_len++;
+
+	/* Keep the hover on the same entry */
+	if (hilighted_offset >= lo) hilighted_offset++;
+}
+
+/**
+ * Read up to a batch of entries from the directory being loaded.
+ * Large directories come in a batch at a time between events, so the
+ * window can show (and respond to) the first of them straight away.
+ * Returns the number of entries added.
+ */
+#define LOAD_BATCH 64
+static int load_directory_batch(void) {
+	if (!loading_dir) return 0;
+
+	struct File * added[LOAD_BATCH];
+	int count = 0;
+
+	while (count < LOAD_BATCH) {
+		struct dirent * ent = readdir(loading_dir);
+		if (!ent) {
+			closedir(loading_dir);
+			loading_dir = NULL;
+			break;
+		}
+		if (ent->d_name[0] == '.' &&
+			(ent->d_name[1] == '\0' ||
+			 (ent->d_name[1] == '.' &&
+			  ent->d_name[2] == '\0'))) {
+			/* skip . and .. */
+			continue;
+		}
+		if (show_hidden || (ent->d_name[0] != '.')) {
+			struct File * f = load_file(ent);
+			insert_file(f);
+			added[count++] = f;
+		}
+	}
+
+	/* Start on previews for any images */
+	thumbnails_request(added, count);
+
+	update_status();
+
+	return count;
+}
+
 /**
  * Read the contents of a directory into the icon view.
  */
@@ -456,12 +1031,26 @@ static void load_directory(const char * path, int modifies_history) {
 		return;
 	}
 
+	/* Anything still on its way belongs to the old entries */
+	thumbnails_reset();
+	if (loading_dir) {
+		closedir(loading_dir);
+		loading_dir = NULL;
+	}
+
 	if (file_pointers) {
 		for (int i = 0; i < file_pointers_len; ++i) {
+			if (file_pointers[i]->thumbnail) {
+				sprite_free(file_pointers[i]->thumbnail);
+			}
 			free(file_pointers[i]);
 		}
 		free(file_pointers);
+		file_pointers = NULL;
 	}
+	file_pointers_len = 0;
+	file_pointers_size = 0;
+	hilighted_offset = -1;
 
 	if (modifies_history) {
 		/* Clear forward history */
@@ -519,196 +1108,9 @@ static void load_directory(const char * path, int modifies_history) {
 	int this_year = timeinfo->tm_year;
 #endif
 
-	list_t * file_list = list_create();
-
-	struct dirent * ent = readdir(dirp);
-	while (ent != NULL) {
-		if (ent->d_name[0] == '.' &&
-			(ent->d_name[1] == '\0' || 
-			 (ent->d_name[1] == '.' &&
-			  ent->d_name[2] == '\0'))) {
-			/* skip . and .. */
-			ent = readdir(dirp);
-			continue;
-		}
-		if (show_hidden || (ent->d_name[0] != '.')) {
-
-			/* Set display name from file name */
-			struct File * f = malloc(sizeof(struct File));
-			sprintf(f->name, "%s", ent->d_name); /* snprintf? copy min()? */
-
-			struct stat statbuf;
-			struct stat statbufl;
-
-			/* Calculate absolute path to file */
-			char tmp[strlen(path)+strlen(ent->d_name)+2];
-			sprintf(tmp, "%s/%s", path, ent->d_name);
-			lstat(tmp, &statbuf);
-
-			f->size = statbuf.st_size;
-
-			/* Read link target for symlinks */
-			if (S_ISLNK(statbuf.st_mode)) {
-				memcpy(&statbufl, &statbuf, sizeof(struct stat));
-				stat(tmp, &statbuf);
-				readlink(tmp, f->link, 256);
-			} else {
-				f->link[0] = '\0';
-			}
-
-			f->launcher[0] = '\0';
-			f->filetype[0] = '\0';
-			f->selected = 0;
-
-			if (S_ISDIR(statbuf.st_mode)) {
-				/* Directory */
-				sprintf(f->icon, "folder");
-				sprintf(f->filetype, "Directory");
-				f->type = 1;
-			} else {
-				/* Regular file */
-
-				/* Default regular files to open in bim */
-				sprintf(f->launcher, "exec terminal bim");
-
-				if (is_desktop_background && has_extension(f, ".launcher")) {
-					/* In desktop mode, read launchers specially */
-					FILE * file = fopen(tmp,"r");
-					char tbuf[1024];
-					while (!feof(file)) {
-						fgets(tbuf, 1024, file);
-						char * nl = strchr(tbuf,'\n');
-						if (nl) *nl = '\0';
-						char * eq = strchr(tbuf,'=');
-						if (!eq) continue;
-						*eq = '\0'; eq++;
-
-						if (!strcmp(tbuf, "icon")) {
-							sprintf(f->icon, "%s", eq);
-						} else if (!strcmp(tbuf, "run")) {
-							sprintf(f->launcher, "%s #", eq);
-						} else if (!strcmp(tbuf, "title")) {
-							sprintf(f->name, eq);
-						}
-					}
-					sprintf(f->filetype, "Launcher");
-					sprintf(f->filename, "%s", ent->d_name);
-					f->type = 2;
-				} else {
-					/* Handle various file types */
-					if (has_extension(f, ".c")) {
-						sprintf(f->icon, "c");
-						sprintf(f->filetype, "C Source");
-					} else if (has_extension(f, ".h")) {
-						sprintf(f->icon, "h");
-						sprintf(f->filetype, "C Header");
-					} else if (has_extension(f, ".bmp")) {
-						sprintf(f->icon, "image");
-						sprintf(f->launcher, "exec imgviewer");
-						sprintf(f->filetype, "Bitmap Image");
-					} else if (has_extension(f, ".tga")) {
-						sprintf(f->icon, "image");
-						sprintf(f->launcher, "exec imgviewer");
-						sprintf(f->filetype, "Targa Image");
-					} else if (has_extension(f, ".jpg") || has_extension(f,".jpeg")) {
-						sprintf(f->icon, "image");
-						sprintf(f->launcher, "exec imgviewer");
-						sprintf(f->filetype, "JPEG Image");
-					} else if (has_extension(f, ".sdf")) {
-						sprintf(f->icon, "font");
-						sprintf(f->filetype, "SDF Font");
-						/* TODO: Font viewer for SDF and TrueType */
-					} else if (has_extension(f, ".ttf")) {
-						sprintf(f->icon, "font");
-						sprintf(f->filetype, "TrueType Font");
-					} else if (has_extension(f, ".tgz") || has_extension(f, ".tar.gz")) {
-						sprintf(f->icon, "package");
-						sprintf(f->filetype, "Compressed Archive File");
-					} else if (has_extension(f, ".tar")) {
-						sprintf(f->icon, "package");
-						sprintf(f->filetype, "Archive File");
-					} else if (has_extension(f, ".sh")) {
-						sprintf(f->icon, "sh");
-						if (statbuf.st_mode & 0111) {
-							/* Make executable */
-							sprintf(f->launcher, "SELF");
-							sprintf(f->filetype, "Executable Shell Script");
-						} else {
-							sprintf(f->filetype, "Shell Script");
-						}
-					} else if (has_extension(f, ".py")) {
-						sprintf(f->icon, "py");
-						if (statbuf.st_mode & 0111) {
-							/* Make executable */
-							sprintf(f->launcher, "SELF");
-							sprintf(f->filetype, "Executable Python Script");
-						} else {
-							sprintf(f->filetype, "Python Script");
-						}
-					} else if (has_extension(f, ".ko")) {
-						sprintf(f->icon, "file");
-						sprintf(f->filetype, "Kernel Module");
-					} else if (has_extension(f, ".o")) {
-						sprintf(f->icon, "file");
-						sprintf(f->filetype, "Object File");
-					} else if (has_extension(f, ".so")) {
-						sprintf(f->icon, "file");
-						sprintf(f->filetype, "Shared Object File");
-					} else if (has_extension(f, ".S")) {
-						sprintf(f->icon, "file");
-						sprintf(f->filetype, "Assembly Source");
-					} else if (has_extension(f, ".ld")) {
-						sprintf(f->icon, "file");
-						sprintf(f->filetype, "Linker Script");
-					} else if (statbuf.st_mode & 0111) {
-						/* Executable files - use their name for their icon, and launch themselves. */
-						sprintf(f->icon, "%s", f->name);
-						sprintf(f->launcher, "SELF");
-						sprintf(f->filetype, "Executable");
-					} else {
-						sprintf(f->icon, "file");
-						sprintf(f->filetype, "File");
-					}
-					f->type = 0;
-				}
-			}
-
-			list_insert(file_list, f);
-		}
-		ent = readdir(dirp);
-	}
-	closedir(dirp);
-
-	/* Store the entries in a flat array. */
-	file_pointers = malloc(sizeof(struct File *) * file_list->length);
-	file_pointers_len = file_list->length;
-	int i = 0;
-	foreach (node, file_list) {
-		file_pointers[i] = node->value;
-		i++;
-	}
-
-	update_status();
-
-	/* Free our temporary linked list */
-	list_free(file_list);
-	free(file_list);
-
-	/* Sort files */
-	int comparator(const void * c1, const void * c2) {
-		const struct File * f1 = *(const struct File **)(c1);
-		const struct File * f2 = *(const struct File **)(c2);
-		/* Launchers before directories before files */
-		if (f1->type > f2->type) return -1;
-		if (f2->type > f1->type) return 1;
-		/* Launchers sorted by filename, not by display name */
-		if (f1->type == 2 && f2->type == 2) {
-			return strcmp(f1->filename, f2->filename);
-		}
-		/* Files sorted by name */
-		return strcmp(f1->name, f2->name);
-	}
-	qsort(file_pointers, file_pointers_len, sizeof(struct File *), comparator);
+	/* Start reading entries; the rest follow from the main loop */
+	loading_dir = dirp;
+	load_directory_batch();
 
 	/* Reset scroll offset when navigating */
 	scroll_offset = 0;
@@ -745,8 +1147,8 @@ static void reinitialize_contents(void) {
 		FILE_PTR_WIDTH = (ctx->width - bounds.width) / FILE_WIDTH;
 	}
 
-	/* Calculate required height to fit files */
-	int calculated_height = (file_pointers_len / FILE_PTR_WIDTH + 1) * FILE_HEIGHT;
+	/* Only what fits in the window is kept drawn; scrolling redraws it */
+	int calculated_height = available_height > 0 ? available_height : 1;
 
 	/* Create buffer */
 	contents_sprite = create_sprite(FILE_PTR_WIDTH * FILE_WIDTH, calculated_height, ALPHA_EMBEDDED);
@@ -1004,7 +1406,10 @@ static void redraw_window(void) {
 	/* Draw the icon view, clipped to the viewport and scrolled appropriately. */
 	gfx_clear_clip(ctx);
 	gfx_add_clip(ctx, bounds.left_width, bounds.top_height + menu_bar_height, ctx->width - bounds.width, available_height);
-	draw_sprite(ctx, contents_sprite, bounds.left_width, bounds.top_height + menu_bar_height - scroll_offset);
+	if (contents_scroll != scroll_offset) {
+		redraw_files();
+	}
+	draw_sprite(ctx, contents_sprite, bounds.left_width, bounds.top_height + menu_bar_height);
 	gfx_clear_clip(ctx);
 	gfx_add_clip(ctx, 0, 0, ctx->width, ctx->height);
 
@@ -1103,8 +1508,6 @@ static void resize_finish(int w, int h) {
 		return;
 	}
 
-	int width_changed = (main_window->width != (unsigned int)w);
-
 	yutani_window_resize_accept(yctx, main_window, w, h);
 	reinit_graphics_yutani(ctx, main_window);
 
@@ -1115,17 +1518,15 @@ static void resize_finish(int w, int h) {
 	available_height = ctx->height - menu_bar_height - bounds.height - (is_desktop_background ? 0 : STATUS_HEIGHT);
 	fprintf(stderr, "available_height = %d; bounds.bottom_height = %d, (isd...) = %d\n", available_height, bounds.bottom_height, (is_desktop_background ? 0 : STATUS_HEIGHT));
 
-	/* If the width changed, we need to rebuild the icon view */
-	if (width_changed) {
-		reinitialize_contents();
-	}
+	/* The icon view is sized to the window, so it always needs rebuilding */
+	reinitialize_contents();
 
 	/* Make sure we're not scrolled weirdly after resizing */
-	if (available_height > contents->height) {
+	if (available_height > contents_height()) {
 		scroll_offset = 0;
 	} else {
-		if (scroll_offset > contents->height - available_height) {
-			scroll_offset = contents->height - available_height;
+		if (scroll_offset > contents_height() - available_height) {
+			scroll_offset = contents_height() - available_height;
 		}
 	}
 
@@ -1137,6 +1538,7 @@ static void resize_finish(int w, int h) {
 	/* Redraw */
 	redraw_window();
 	yutani_window_resize_done(yctx, main_window);
+	update_opaque_region();
 
 	yutani_flip(yctx, main_window);
 }
@@ -1513,12 +1915,12 @@ static void _scroll_up(void) {
 }
 
 static void _scroll_down(void) {
-	if (available_height > contents->height) {
+	if (available_height > contents_height()) {
 		scroll_offset = 0;
 	} else {
 		scroll_offset += SCROLL_AMOUNT;
-		if (scroll_offset > contents->height - available_height) {
-			scroll_offset = contents->height - available_height;
+		if (scroll_offset > contents_height() - available_height) {
+			scroll_offset = contents_height() - available_height;
 		}
 	}
 }
@@ -1601,7 +2003,7 @@ int main(int argc, char * argv[]) {
 		signal(SIGUSR1, sig_usr1);
 		signal(SIGUSR2, sig_usr2);
 		draw_background(yctx->display_width, yctx->display_height);
-		main_window = yutani_window_create_flags(yctx, yctx->display_width, yctx->display_height, YUTANI_WINDOW_FLAG_NO_STEAL_FOCUS);
+		main_window = yutani_window_create_flags(yctx, yctx->display_width, yctx->display_height, YUTANI_WINDOW_FLAG_NO_STEAL_FOCUS | YUTANI_WINDOW_FLAG_OPAQUE);
 		yutani_window_move(yctx, main_window, 0, 0);
 		yutani_set_stack(yctx, main_window, YUTANI_ZORDER_BOTTOM);
 		arg_ind++;
@@ -1686,6 +2088,7 @@ int main(int argc, char * argv[]) {
 	history_back = list_create();
 	history_forward = list_create();
 
+	thumbnails_init();
 
 	/* Load the current working directory */
 	char tmp[1024];
@@ -1695,19 +2098,34 @@ int main(int argc, char * argv[]) {
 	/* Draw files */
 	reinitialize_contents();
 	redraw_window();
+	update_opaque_region();
 
 	while (application_running) {
 		waitpid(-1, NULL, WNOHANG);
-		int fds[1] = {fileno(yctx->sock)};
-		int index = fswait2(1,fds,wallpaper_old ? 10 : 200);
+		int fds[2] = {fileno(yctx->sock), thumbnails.notify[0]};
+		/* While a directory is still loading, only check for events between batches */
+		int index = fswait2(thumbnails.running ? 2 : 1,fds,loading_dir ? 0 : (wallpaper_old ? 10 : 200));
 
 		if (restart) {
 			execvp(argv[0],argv);
 			return 1;
 		}
 
-		if (index == 1) {
-			if (wallpaper_old) {
+		if (thumbnails.running && index == 1) {
+			/* Some thumbnails are ready */
+			if (thumbnails_collect() || wallpaper_old) {
+				redraw_window();
+			}
+			continue;
+		}
+
+		if (index != 0) {
+			if (loading_dir) {
+				/* Nothing else to do, so bring in some more entries */
+				load_directory_batch();
+				redraw_files();
+				redraw_window();
+			} else if (wallpaper_old) {
 				redraw_window();
 			}
 			continue;
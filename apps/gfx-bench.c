@@ -0,0 +1,380 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * gfx-bench - time graphics primitives and check what they draw
+ *
+ * Every case draws into an offscreen canvas that starts out the same
+ * each time, from sprites generated here, so the result depends only
+ * on the drawing code. Each is timed over a number of runs and printed
+ * as a tab-separated line like bench's:
+ *
+ *     name  iterations  ns/op  golden
+ *
+ * With -g DIR, what each case drew is saved to DIR/<name>.pam (Netpbm
+ * PAM, RGB_ALPHA) as the golden image; with -c DIR it is compared with
+ * the one saved there, and the last column says "ok" or how many
+ * pixels differ. Saving goldens from one build of libtoaru_graphics and
+ * checking another (say, one built with NO_SSE) shows whether the two
+ * draw the same thing bit for bit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include <toaru/graphics.h>
+#include <toaru/sdf.h>
+
+#define CANVAS_W 640
+#define CANVAS_H 480
+
+static int iterations = 100;
+static char * save_dir = NULL;
+static char * check_dir = NULL;
+static int failures = 0;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static gfx_context_t * canvas;
+static sprite_t * canvas_sprite;
+
+/* A checkerboard of opaque greys, so every kind of blend shows */
+static void reset_canvas(void) {
+	for (int y = 0; y < canvas->height; ++y) {
+		for (int x = 0; x < canvas->width; ++x) {
+			GFX(canvas, x, y) = ((x / 16 + y / 16) & 1) ? rgb(0x40, 0x40, 0x48) : rgb(0xc0, 0xb8, 0xb0);
+		}
+	}
+}
+
+/*
+ * Test sprites. Colors and alpha vary across the whole range so any
+ * rounding difference in a blend lands on some pixel.
+ */
+static sprite_t * make_sprite(int w, int h, int alpha) {
+	sprite_t * s = create_sprite(w, h, alpha);
+	if (alpha == ALPHA_MASK) {
+		s->masks = malloc(sizeof(uint32_t) * w * h);
+	}
+	s->blank = rgb(0xff, 0x00, 0xff);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			uint8_t r = x * 255 / (w - 1);
+			uint8_t g = y * 255 / (h - 1);
+			uint8_t b = (x ^ y) & 0xff;
+			uint8_t a = ((x + y) * 255 / (w + h - 2));
+			switch (alpha) {
+				case ALPHA_EMBEDDED:
+				case ALPHA_FORCE_SLOW_EMBEDDED:
+					SPRITE(s, x, y) = premultiply(rgba(r, g, b, a));
+					break;
+				case ALPHA_MASK:
+					SPRITE(s, x, y) = rgb(r, g, b);
+					SMASKS(s, x, y) = rgba(a, a, a, a);
+					break;
+				case ALPHA_INDEXED:
+					SPRITE(s, x, y) = ((x / 8 + y / 8) % 3) ? rgb(r, g, b) : s->blank;
+					break;
+				default:
+					SPRITE(s, x, y) = rgb(r, g, b);
+					break;
+			}
+		}
+	}
+	return s;
+}
+
+static sprite_t * opaque;
+static sprite_t * masked;
+static sprite_t * embedded;
+static sprite_t * indexed;
+static sprite_t * embedded_slow;
+
+/* Freetype is an optional extension library */
+static int (*freetype_draw_string)(gfx_context_t *, int, int, uint32_t, char *) = NULL;
+static void (*freetype_set_font_size)(int) = NULL;
+
+#define TEXT "The quick brown fox jumps over the lazy dog 0123456789"
+
+/* Sprites are drawn at odd offsets, and partly off the canvas, to hit unaligned and clipped spans */
+static void case_opaque(void)        { draw_sprite(canvas, opaque, 13, 7); draw_sprite(canvas, opaque, CANVAS_W - 101, CANVAS_H - 53); }
+static void case_mask(void)          { draw_sprite(canvas, masked, 13, 7); draw_sprite(canvas, masked, CANVAS_W - 101, CANVAS_H - 53); }
+static void case_embedded(void)      { draw_sprite(canvas, embedded, 13, 7); draw_sprite(canvas, embedded, CANVAS_W - 101, CANVAS_H - 53); }
+static void case_indexed(void)       { draw_sprite(canvas, indexed, 13, 7); draw_sprite(canvas, indexed, CANVAS_W - 101, CANVAS_H - 53); }
+static void case_slow_embedded(void) { draw_sprite(canvas, embedded_slow, 13, 7); draw_sprite(canvas, embedded_slow, CANVAS_W - 101, CANVAS_H - 53); }
+static void case_scaled(void)        { draw_sprite_scaled(canvas, embedded, 5, 3, 611, 457); }
+static void case_scaled_alpha(void)  { draw_sprite_scaled_alpha(canvas, embedded, 5, 3, 611, 457, 0.6f); }
+static void case_rotate(void)        { draw_sprite_rotate(canvas, embedded, 320, 240, 0.7f, 0.8f); }
+static void case_blur(void)          { blur_context_box(canvas, 3); }
+
+static void case_rounded(void) {
+	draw_rounded_rectangle(canvas, 21, 17, 400, 300, 12, rgba(0x20, 0x60, 0xc0, 0xc0));
+	draw_rounded_rectangle(canvas, 300, 250, 333, 222, 31, rgb(0xe0, 0x40, 0x20));
+}
+
+static void case_sdf(void) {
+	for (int i = 0; i < 8; ++i) {
+		draw_sdf_string(canvas, 10, 10 + i * 56, TEXT, 8 + i * 4, rgb(0x10, 0x10, 0x10), i % 2 ? SDF_FONT_BOLD : SDF_FONT_THIN);
+	}
+}
+
+static void case_freetype(void) {
+	for (int i = 0; i < 8; ++i) {
+		freetype_set_font_size(8 + i * 4);
+		freetype_draw_string(canvas, 10, 30 + i * 56, rgb(0x10, 0x10, 0x10), TEXT);
+	}
+}
+
+static struct test_case {
+	const char * name;
+	void (*draw)(void);
+	int scale; /* Fewer runs for the slow ones */
+} cases[] = {
+	{"sprite-opaque",        case_opaque,        1},
+	{"sprite-mask",          case_mask,          1},
+	{"sprite-embedded",      case_embedded,      1},
+	{"sprite-indexed",       case_indexed,       1},
+	{"sprite-slow-embedded", case_slow_embedded, 1},
+	{"sprite-scaled",        case_scaled,        4},
+	{"sprite-scaled-alpha",  case_scaled_alpha,  4},
+	{"sprite-rotate",        case_rotate,        4},
+	{"blur-box",             case_blur,          4},
+	{"rounded-rectangle",    case_rounded,       1},
+	{"sdf-string",           case_sdf,           4},
+	{"freetype-string",      case_freetype,      4},
+	{NULL, NULL, 0},
+};
+
+static char * golden_path(const char * dir, const char * name) {
+	char * out = malloc(strlen(dir) + strlen(name) + 8);
+	sprintf(out, "%s/%s.pam", dir, name);
+	return out;
+}
+
+static int save_golden(const char * name) {
+	char * path = golden_path(save_dir, name);
+	FILE * f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "gfx-bench: %s: %s\n", path, strerror(errno));
+		free(path);
+		return 1;
+	}
+	fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", canvas->width, canvas->height);
+	uint8_t * row = malloc(canvas->width * 4);
+	for (int y = 0; y < canvas->height; ++y) {
+		for (int x = 0; x < canvas->width; ++x) {
+			uint32_t p = GFX(canvas, x, y);
+			row[x * 4 + 0] = _RED(p);
+			row[x * 4 + 1] = _GRE(p);
+			row[x * 4 + 2] = _BLU(p);
+			row[x * 4 + 3] = _ALP(p);
+		}
+		fwrite(row, 4, canvas->width, f);
+	}
+	free(row);
+	fclose(f);
+	free(path);
+	return 0;
+}
+
+/* Number of pixels that differ from the golden image, or -1 if there isn't a usable one */
+static long check_golden(const char * name) {
+	char * path = golden_path(check_dir, name);
+	FILE * f = fopen(path, "r");
+	free(path);
+	if (!f) return -1;
+
+	int w = 0, h = 0;
+	char line[64];
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "WIDTH ", 6)) w = atoi(line + 6);
+		if (!strncmp(line, "HEIGHT ", 7)) h = atoi(line + 7);
+		if (!strcmp(line, "ENDHDR\n")) break;
+	}
+	if (w != canvas->width || h != canvas->height) {
+		fclose(f);
+		return -1;
+	}
+
+	long differ = 0;
+	uint8_t * row = malloc(w * 4);
+	for (int y = 0; y < h; ++y) {
+		if (fread(row, 4, w, f) != (size_t)w) {
+			differ = -1;
+			break;
+		}
+		for (int x = 0; x < w; ++x) {
+			uint32_t expect = rgba(row[x * 4 + 0], row[x * 4 + 1], row[x * 4 + 2], row[x * 4 + 3]);
+			if (GFX(canvas, x, y) != expect) differ++;
+		}
+	}
+	free(row);
+	fclose(f);
+	return differ;
+}
+
+static void run_case(struct test_case * c) {
+	/* One run from a clean canvas is the picture... */
+	reset_canvas();
+	c->draw();
+
+	char golden[32] = "-";
+	if (save_dir) {
+		failures += save_golden(c->name);
+		strcpy(golden, "saved");
+	}
+	if (check_dir) {
+		long differ = check_golden(c->name);
+		if (differ < 0) {
+			strcpy(golden, "missing");
+			failures++;
+		} else if (differ) {
+			sprintf(golden, "%ld-differ", differ);
+			failures++;
+		} else {
+			strcpy(golden, "ok");
+		}
+	}
+
+	/* ...and then it's timed */
+	int n = iterations / c->scale;
+	if (n < 1) n = 1;
+	uint64_t start = now();
+	for (int i = 0; i < n; ++i) {
+		c->draw();
+	}
+	uint64_t ns = now() - start;
+	printf("%s\t%d\t%llu\t%s\n", c->name, n, (unsigned long long)(ns / n), golden);
+	fflush(stdout);
+}
+
+/* flip() copies a whole back buffer to the front one; no picture to check */
+static void run_flip(int w, int h) {
+	sprite_t * s = create_sprite(w, h, ALPHA_OPAQUE);
+	gfx_context_t * ctx = init_graphics_sprite(s);
+	char * front = malloc(ctx->size);
+	ctx->buffer = front;
+	memset(ctx->backbuffer, 0x55, ctx->size);
+
+	int n = iterations;
+	uint64_t start = now();
+	for (int i = 0; i < n; ++i) {
+		flip(ctx);
+	}
+	uint64_t ns = now() - start;
+
+	char name[32];
+	sprintf(name, "flip-%dx%d", w, h);
+	printf("%s\t%d\t%llu\t-\n", name, n, (unsigned long long)(ns / n));
+	fflush(stdout);
+
+	free(front);
+	free(ctx);
+	sprite_free(s);
+}
+
+static int selected(int argc, char * argv[], const char * name) {
+	if (optind == argc) return 1;
+	for (int i = optind; i < argc; ++i) {
+		if (!strcmp(argv[i], name)) return 1;
+		/* "flip" picks all of the flips */
+		if (!strcmp(argv[i], "flip") && !strncmp(name, "flip-", 5)) return 1;
+	}
+	return 0;
+}
+
+static void usage(char * argv0) {
+	fprintf(stderr,
+			"usage: %s [-n ITERATIONS] [-g DIR] [-c DIR] [-l] [CASE...]\n"
+			"\n"
+			" -n     times to run each case (default 100)\n"
+			" -g     save what each case draws to DIR as golden images\n"
+			" -c     compare what each case draws with the goldens in DIR\n"
+			" -l     list the cases\n"
+			"\n"
+			"Exits with 1 if any golden image differs or is missing.\n", argv0);
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:g:c:lh")) != -1) {
+		switch (opt) {
+			case 'n':
+				iterations = atoi(optarg);
+				if (iterations < 1) iterations = 1;
+				break;
+			case 'g':
+				save_dir = optarg;
+				break;
+			case 'c':
+				check_dir = optarg;
+				break;
+			case 'l':
+				for (int i = 0; cases[i].name; ++i) {
+					printf("%s\n", cases[i].name);
+				}
+				printf("flip\n");
+				return 0;
+			default:
+				usage(argv[0]);
+				return opt != 'h';
+		}
+	}
+
+	for (int i = optind; i < argc; ++i) {
+		int found = !strcmp(argv[i], "flip");
+		for (int j = 0; cases[j].name; ++j) {
+			if (!strcmp(argv[i], cases[j].name)) found = 1;
+		}
+		if (!found && strncmp(argv[i], "flip-", 5)) {
+			fprintf(stderr, "%s: unknown case '%s' (-l lists them)\n", argv[0], argv[i]);
+			return 1;
+		}
+	}
+
+	canvas_sprite = create_sprite(CANVAS_W, CANVAS_H, ALPHA_EMBEDDED);
+	canvas = init_graphics_sprite(canvas_sprite);
+
+	opaque        = make_sprite(128, 96, ALPHA_OPAQUE);
+	masked        = make_sprite(128, 96, ALPHA_MASK);
+	embedded      = make_sprite(128, 96, ALPHA_EMBEDDED);
+	indexed       = make_sprite(128, 96, ALPHA_INDEXED);
+	embedded_slow = make_sprite(128, 96, ALPHA_FORCE_SLOW_EMBEDDED);
+
+	void * freetype = dlopen("libtoaru_ext_freetype_fonts.so", 0);
+	if (freetype) {
+		freetype_draw_string   = dlsym(freetype, "freetype_draw_string");
+		freetype_set_font_size = dlsym(freetype, "freetype_set_font_size");
+	}
+
+	printf("# name\titerations\tns/op\tgolden\n");
+	for (int i = 0; cases[i].name; ++i) {
+		if (!selected(argc, argv, cases[i].name)) continue;
+		if (cases[i].draw == case_freetype && (!freetype_draw_string || !freetype_set_font_size)) {
+			printf("# %s: freetype extension not available\n", cases[i].name);
+			continue;
+		}
+		run_case(&cases[i]);
+	}
+
+	static const int resolutions[][2] = {
+		{1024, 768}, {1280, 720}, {1440, 900}, {1920, 1080},
+	};
+	for (size_t i = 0; i < sizeof(resolutions) / sizeof(*resolutions); ++i) {
+		char name[32];
+		sprintf(name, "flip-%dx%d", resolutions[i][0], resolutions[i][1]);
+		if (selected(argc, argv, name)) run_flip(resolutions[i][0], resolutions[i][1]);
+	}
+
+	return failures ? 1 : 0;
+}
@@ -313,9 +313,7 @@ redo_everything:
 		}
 
 		/* Three box blurs = good enough approximation of a guassian, but faster*/
-		blur_context_box(bg, 20);
-		blur_context_box(bg, 20);
-		blur_context_box(bg, 20);
+		blur_context_gaussian(bg, 20, 3);
 
 		free(bg);
 		free(wallpaper);
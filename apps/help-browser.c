@@ -38,21 +38,41 @@ static char * current_topic = "This is the ToaruOS Help Browser. No help documen
 #define BASE_X 0
 #define BASE_Y 0
 #define LINE_HEIGHT 20
+#define WORD_SPACING 4
+#define SCROLL_AMOUNT 60
 
-static gfx_context_t * nctx = NULL;
-static int cursor_y = 0;
-static int cursor_x = 0;
+/*
+ * A document is kept as runs of text in a single font. It is parsed
+ * once when it is loaded and laid out again only when the width
+ * changes; drawing just puts down the runs that are in view.
+ */
+struct Run {
+	char * text;
+	int font;
+	int word;   /* Starts a new word, rather than continuing the last */
+	int breaks; /* Line breaks before it */
+	int width;
+	int x;
+	int y;
+};
+
+static struct Run * runs = NULL;
+static size_t runs_len = 0;
+static size_t runs_size = 0;
+static int document_height = 0;
+static int layout_width = -1;
+
+static int scroll_offset = 0;
+
+/* Parser state */
 static list_t * state = NULL;
 static int current_state = 0;
 static int size = 16;
-
-struct Char {
-	char c; /* TODO: unicode */
-	char state;
-};
-
-//static list_t * lines = NULL;
-static list_t * buffer = NULL;
+static int pending_word = 1;
+static int pending_breaks = 0;
+static char * run_text = NULL;
+static size_t run_text_len = 0;
+static size_t run_text_size = 0;
 
 static int state_to_font(int current_state) {
 	if (current_state & (1 << 0)) {
@@ -66,87 +86,164 @@ static int state_to_font(int current_state) {
 	return SDF_FONT_THIN;
 }
 
-static int buffer_width(list_t * buffer) {
-	int out = 0;
-	foreach(node, buffer) {
-		struct Char * c = node->value;
-
-		char tmp[2] = {c->c, '\0'};
-
-		out += draw_sdf_string_width(tmp, size, state_to_font(c->state));
-	}
-	return out;
+static void finish_run(void) {
+	if (!runs_len || runs[runs_len-1].text) return;
+	struct Run * r = &runs[runs_len-1];
+	run_text[run_text_len] = '\0';
+	r->text = strdup(run_text);
+	r->width = draw_sdf_string_width(r->text, size, r->font);
+	run_text_len = 0;
 }
 
-static int draw_buffer(list_t * buffer) {
-	int x = 0;
-	while (buffer->length) {
-		node_t * node = list_dequeue(buffer);
-		struct Char * c = node->value;
-		char tmp[2] = { c->c, '\0' };
-		x += draw_sdf_string(nctx, cursor_x + x, cursor_y, tmp, size, 0xFF000000, state_to_font(c->state));
-		free(c);
-		free(node);
+static void start_run(void) {
+	finish_run();
+	if (runs_len == runs_size) {
+		runs_size = runs_size ? runs_size * 2 : 64;
+		runs = realloc(runs, sizeof(struct Run) * runs_size);
 	}
-	x += 4;
-	return x;
-}
-
-static void write_buffer(void) {
-	if (buffer_width(buffer) + cursor_x > nctx->width) {
-		cursor_x = BASE_X;
-		cursor_y += LINE_HEIGHT;
-	}
-	cursor_x += draw_buffer(buffer);
+	struct Run * r = &runs[runs_len++];
+	r->text = NULL;
+	r->font = state_to_font(current_state);
+	r->word = pending_word;
+	r->breaks = pending_breaks;
+	r->width = 0;
+	pending_word = 0;
+	pending_breaks = 0;
 }
 
 static int parser_open(struct markup_state * self, void * user, struct markup_tag * tag) {
-	if (!strcmp(tag->name, "b")) {
+	if (tag->name == markup_intern("b")) {
 		list_insert(state, (void*)current_state);
 		current_state |= (1 << 0);
-	} else if (!strcmp(tag->name, "i")) {
+	} else if (tag->name == markup_intern("i")) {
 		list_insert(state, (void*)current_state);
 		current_state |= (1 << 1);
-	} else if (!strcmp(tag->name, "br")) {
-		write_buffer();
-		cursor_x = BASE_X;
-		cursor_y += LINE_HEIGHT;
+	} else if (tag->name == markup_intern("br")) {
+		pending_breaks++;
+		pending_word = 1;
 	}
 	markup_free_tag(tag);
 	return 0;
 }
 
 static int parser_close(struct markup_state * self, void * user, char * tag_name) {
-	if (!strcmp(tag_name, "b")) {
-		node_t * nstate = list_pop(state);
-		current_state = (int)nstate->value;
-		free(nstate);
-	} else if (!strcmp(tag_name, "i")) {
+	if (tag_name == markup_intern("b") || tag_name == markup_intern("i")) {
 		node_t * nstate = list_pop(state);
-		current_state = (int)nstate->value;
-		free(nstate);
+		if (nstate) {
+			current_state = (int)nstate->value;
+			free(nstate);
+		}
 	}
 	return 0;
 }
 
 static int parser_data(struct markup_state * self, void * user, char * data) {
-	char * c = data;
-	while (*c) {
-		if (*c == ' ') {
-			if (buffer->length) {
-				write_buffer();
-			}
-		} else {
-			struct Char * ch = malloc(sizeof(struct Char));
-			ch->c = *c;
-			ch->state = current_state;
-			list_insert(buffer, ch);
+	for (char * c = data; *c; ++c) {
+		if (*c == ' ' || *c == '\n' || *c == '\t' || *c == '\r') {
+			pending_word = 1;
+			continue;
 		}
-		c++;
+		if (!runs_len || runs[runs_len-1].text || pending_word || pending_breaks ||
+				runs[runs_len-1].font != state_to_font(current_state)) {
+			start_run();
+		}
+		if (run_text_len + 2 > run_text_size) {
+			run_text_size = run_text_size ? run_text_size * 2 : 64;
+			run_text = realloc(run_text, run_text_size);
+		}
+		run_text[run_text_len++] = *c;
 	}
 	return 0;
 }
 
+static void load_document(const char * str, size_t len) {
+	for (size_t i = 0; i < runs_len; ++i) {
+		free(runs[i].text);
+	}
+	runs_len = 0;
+	layout_width = -1;
+	scroll_offset = 0;
+
+	struct markup_state * parser = markup_init(NULL, parser_open, parser_close, parser_data);
+	state = list_create();
+	current_state = 0;
+	pending_word = 1;
+	pending_breaks = 0;
+	run_text_len = 0;
+
+	if (markup_parse_buffer(parser, str, len)) {
+		fprintf(stderr,"There was an error.\n");
+	} else {
+		markup_finish(parser);
+	}
+	finish_run();
+
+	list_free(state);
+	free(state);
+}
+
+/* Place every run on a line; words that don't fit go on the next one */
+static void layout(int width) {
+	int x = BASE_X;
+	int y = BASE_Y;
+	size_t i = 0;
+	while (i < runs_len) {
+		int w = runs[i].width;
+		size_t j = i + 1;
+		while (j < runs_len && !runs[j].word) {
+			w += runs[j].width;
+			j++;
+		}
+
+		if (runs[i].breaks) {
+			x = BASE_X;
+			y += LINE_HEIGHT * runs[i].breaks;
+		} else if (x > BASE_X && x + w > width) {
+			x = BASE_X;
+			y += LINE_HEIGHT;
+		}
+
+		for (; i < j; ++i) {
+			runs[i].x = x;
+			runs[i].y = y;
+			x += runs[i].width;
+		}
+		x += WORD_SPACING;
+	}
+	document_height = runs_len ? y + LINE_HEIGHT : 0;
+	layout_width = width;
+}
+
+/* Redraw rows [top, bottom) of the view from the layout */
+static void draw_rows(gfx_context_t * view, int top, int bottom) {
+	if (top >= bottom) return;
+
+	for (int y = top; y < bottom; ++y) {
+		for (int x = 0; x < view->width; ++x) {
+			GFX(view, x, y) = rgb(255,255,255);
+		}
+	}
+
+	gfx_add_clip(view, 0, top, view->width, bottom - top);
+
+	/* Runs go down the page in order; find the first line that reaches into view */
+	size_t lo = 0, hi = runs_len;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (runs[mid].y + 2 * LINE_HEIGHT <= scroll_offset + top) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (size_t i = lo; i < runs_len && runs[i].y < scroll_offset + bottom; ++i) {
+		draw_sdf_string(view, runs[i].x, runs[i].y - scroll_offset, runs[i].text, size, 0xFF000000, runs[i].font);
+	}
+
+	gfx_no_clip(view);
+}
+
 /* } End Markup Renderer */
 
 static struct menu_bar menu_bar = {0};
@@ -161,6 +258,11 @@ static void _menu_action_exit(struct MenuEntry * entry) {
 	application_running = 0;
 }
 
+static int max_scroll(void) {
+	int out = document_height - (contents ? contents->height : 0);
+	return out > 0 ? out : 0;
+}
+
 static void reinitialize_contents(void) {
 	if (contents) {
 		free(contents);
@@ -170,37 +272,70 @@ static void reinitialize_contents(void) {
 		sprite_free(contents_sprite);
 	}
 
-	/* Calculate height for current directory */
-	int calculated_height = 200;
-
 	struct decor_bounds bounds;
 	decor_get_bounds(main_window, &bounds);
 
-	contents_sprite = create_sprite(main_window->width - bounds.width, calculated_height, ALPHA_EMBEDDED);
+	/* Only what is in view is kept drawn; scrolling draws the rest */
+	int view_width = main_window->width - bounds.width;
+	int view_height = main_window->height - bounds.height - MENU_BAR_HEIGHT;
+	if (view_width < 1) view_width = 1;
+	if (view_height < 1) view_height = 1;
+
+	contents_sprite = create_sprite(view_width, view_height, ALPHA_OPAQUE);
 	contents = init_graphics_sprite(contents_sprite);
 
-	draw_fill(contents, rgb(255,255,255));
+	if (layout_width != view_width) {
+		layout(view_width);
+	}
 
-	nctx = contents;
-	struct markup_state * parser = markup_init(NULL, parser_open, parser_close, parser_data);
-	cursor_y = BASE_Y;
-	cursor_x = BASE_X;
-	state = list_create();
-	buffer = list_create();
+	if (scroll_offset > max_scroll()) {
+		scroll_offset = max_scroll();
+	}
 
-	char * str = current_topic;
-	while (*str) {
-		if (markup_parse(parser, *str++)) {
-			fprintf(stderr,"There was an error.\n");
-			return;
-		}
+	draw_rows(contents, 0, contents->height);
+}
+
+/* Scroll the view, keeping what is still in view and drawing what isn't */
+static int scroll_to(int offset) {
+	if (offset > max_scroll()) offset = max_scroll();
+	if (offset < 0) offset = 0;
+
+	int delta = offset - scroll_offset;
+	if (!delta) return 0;
+	scroll_offset = offset;
+
+	int h = contents->height;
+	size_t row = contents->width * sizeof(uint32_t);
+	char * bitmap = (char *)contents_sprite->bitmap;
+
+	if (delta > 0 && delta < h) {
+		memmove(bitmap, bitmap + delta * row, (h - delta) * row);
+		draw_rows(contents, h - delta, h);
+	} else if (delta < 0 && -delta < h) {
+		memmove(bitmap + (-delta) * row, bitmap, (h + delta) * row);
+		draw_rows(contents, 0, -delta);
+	} else {
+		draw_rows(contents, 0, h);
 	}
+	return 1;
+}
 
-	markup_finish(parser);
-	write_buffer();
-	list_free(state);
-	free(state);
-	free(buffer);
+/* Put the view back on screen, without redrawing anything around it */
+static void redraw_contents(void) {
+	struct decor_bounds bounds;
+	decor_get_bounds(main_window, &bounds);
+
+	int x = bounds.left_width;
+	int y = bounds.top_height + MENU_BAR_HEIGHT;
+
+	gfx_clear_clip(ctx);
+	gfx_add_clip(ctx, x, y, contents->width, contents->height);
+	draw_sprite(ctx, contents_sprite, x, y);
+	flip(ctx);
+	gfx_clear_clip(ctx);
+	gfx_add_clip(ctx, 0, 0, ctx->width, ctx->height);
+
+	yutani_flip_region(yctx, main_window, x, y, contents->width, contents->height);
 }
 
 static void redraw_window(void) {
@@ -228,14 +363,11 @@ static void redraw_window(void) {
 }
 
 static void resize_finish(int w, int h) {
-	int height_changed = (main_window->width != (unsigned int)w);
-
 	yutani_window_resize_accept(yctx, main_window, w, h);
 	reinit_graphics_yutani(ctx, main_window);
 
-	if (height_changed) {
-		reinitialize_contents();
-	}
+	/* Only lays the document out again if the width changed */
+	reinitialize_contents();
 
 	redraw_window();
 	yutani_window_resize_done(yctx, main_window);
@@ -273,10 +405,26 @@ static void navigate(const char * t) {
 		current_topic =
 			"<i>A list of topics should go here, but, alas...</i>";
 	} else {
+		/* Not a built-in topic; maybe it's a document on disk */
+		FILE * f = fopen(t, "r");
+		if (f) {
+			fseek(f, 0, SEEK_END);
+			size_t len = ftell(f);
+			fseek(f, 0, SEEK_SET);
+			char * doc = malloc(len);
+			len = fread(doc, 1, len, f);
+			fclose(f);
+			load_document(doc, len);
+			free(doc);
+			reinitialize_contents();
+			redraw_window();
+			return;
+		}
 		current_topic =
 			"<i>No help document exists for this topic.</i>";
 	}
 
+	load_document(current_topic, strlen(current_topic));
 	reinitialize_contents();
 	redraw_window();
 
@@ -348,6 +496,7 @@ int main(int argc, char * argv[]) {
 	if (argc > 1) {
 		navigate(argv[1]);
 	} else {
+		load_document(current_topic, strlen(current_topic));
 		reinitialize_contents();
 		redraw_window();
 	}
@@ -382,6 +531,24 @@ int main(int argc, char * argv[]) {
 								case 'q':
 									_menu_action_exit(NULL);
 									break;
+								case KEY_ARROW_UP:
+									if (scroll_to(scroll_offset - LINE_HEIGHT)) redraw_contents();
+									break;
+								case KEY_ARROW_DOWN:
+									if (scroll_to(scroll_offset + LINE_HEIGHT)) redraw_contents();
+									break;
+								case KEY_PAGE_UP:
+									if (scroll_to(scroll_offset - (contents->height - LINE_HEIGHT))) redraw_contents();
+									break;
+								case KEY_PAGE_DOWN:
+									if (scroll_to(scroll_offset + (contents->height - LINE_HEIGHT))) redraw_contents();
+									break;
+								case KEY_HOME:
+									if (scroll_to(0)) redraw_contents();
+									break;
+								case KEY_END:
+									if (scroll_to(max_scroll())) redraw_contents();
+									break;
 							}
 						}
 					}
@@ -426,6 +593,12 @@ int main(int argc, char * argv[]) {
 
 							/* Menu bar */
 							menu_bar_mouse_event(yctx, main_window, &menu_bar, me, me->new_x, me->new_y);
+
+							if (me->buttons & YUTANI_MOUSE_SCROLL_UP) {
+								if (scroll_to(scroll_offset - SCROLL_AMOUNT)) redraw_contents();
+							} else if (me->buttons & YUTANI_MOUSE_SCROLL_DOWN) {
+								if (scroll_to(scroll_offset + SCROLL_AMOUNT)) redraw_contents();
+							}
 						}
 					}
 					break;
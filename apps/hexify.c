@@ -9,41 +9,63 @@
  * Does NOT a hex-to-bin option - something to consider.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 
-void print_line(unsigned char * buf, unsigned int width, unsigned int sizer, unsigned int offset) {
-	fprintf(stdout, "%08x: ", sizer);
+#define BLOCK_SIZE 0x10000
+
+static const char hex[] = "0123456789abcdef";
+
+/* Two hex digits for every byte, and what the dump shows for it on the right */
+static char hex_pairs[256][2];
+static char shown[256];
+
+static void make_tables(void) {
+	for (int i = 0; i < 256; ++i) {
+		hex_pairs[i][0] = hex[i >> 4];
+		hex_pairs[i][1] = hex[i & 0xF];
+		shown[i] = isprint(i) ? i : '.';
+	}
+}
+
+/* Longest a line can be: offset, two digits and a space per byte, the text, and a line feed */
+#define LINE_MAX_SIZE(width) (10 + (width) * 4 + 2)
+
+static char * format_line(char * out, unsigned char * buf, unsigned int width, unsigned int sizer, unsigned int offset) {
+	for (int i = 7; i >= 0; --i) {
+		*out++ = hex[(sizer >> (i * 4)) & 0xF];
+	}
+	*out++ = ':';
+	*out++ = ' ';
 	for (unsigned int i = 0; i < width; ) {
 		if (i >= offset) {
-			fprintf(stdout, "  ");
+			*out++ = ' ';
+			*out++ = ' ';
 		} else {
-			fprintf(stdout, "%02x", buf[i]);
+			*out++ = hex_pairs[buf[i]][0];
+			*out++ = hex_pairs[buf[i]][1];
 		}
 		i++;
 		if (i == width) break; /* in case of odd width */
 		if (i >= offset) {
-			fprintf(stdout, "   ");
+			*out++ = ' ';
+			*out++ = ' ';
 		} else {
-			fprintf(stdout, "%02x ", buf[i]);
+			*out++ = hex_pairs[buf[i]][0];
+			*out++ = hex_pairs[buf[i]][1];
 		}
+		*out++ = ' ';
 		i++;
 	}
-	fprintf(stdout, " ");
+	*out++ = ' ';
 	for (unsigned int i = 0; i < width; i++) {
-		if (i >= offset) {
-			fprintf(stdout, " ");
-		} else {
-			if (isprint(buf[i])) {
-				fprintf(stdout, "%c", buf[i]);
-			} else {
-				fprintf(stdout, ".");
-			}
-		}
+		*out++ = (i >= offset) ? ' ' : shown[buf[i]];
 	}
-	fprintf(stdout, "\n");
+	*out++ = '\n';
+	return out;
 }
 
 static int stoih(int w, char c[w], unsigned int *out) {
@@ -93,6 +115,7 @@ int main(int argc, char * argv[]) {
 		name = argv[optind];
 		if (!f) {
 			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+			return 1;
 		}
 	} else {
 		name = "[stdin]";
@@ -102,22 +125,40 @@ int main(int argc, char * argv[]) {
 	if (direction == 0) {
 		/* Convert to hexadecimal */
 
-		unsigned int sizer = 0;
-		unsigned int offset = 0;
-		unsigned char buf[width];
-		while (!feof(f)) {
-			unsigned int r = fread(buf+offset, 1, width-offset, f);
-			offset += r;
+		/*
+		 * Input is read a block at a time and whole lines of output are
+		 * built from tables into a buffer that's written out when full.
+		 */
+		make_tables();
+		int fd = fileno(f);
+		size_t in_size = BLOCK_SIZE / width * width + width;
+		unsigned char * in = malloc(in_size);
+		size_t out_size = (in_size / width + 1) * LINE_MAX_SIZE(width);
+		char * out = malloc(out_size);
 
-			if (offset == width) {
-				print_line(buf, width, sizer, offset);
-				offset = 0;
+		unsigned int sizer = 0;
+		size_t have = 0;
+		while (1) {
+			ssize_t r = read(fd, in + have, in_size - have);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) break;
+			have += r;
+
+			char * o = out;
+			size_t at = 0;
+			while (have - at >= width) {
+				o = format_line(o, in + at, width, sizer, width);
+				at += width;
 				sizer += width;
 			}
+			fwrite(out, 1, o - out, stdout);
+			memmove(in, in + at, have - at);
+			have -= at;
 		}
 
-		if (offset != 0) {
-			print_line(buf, width, sizer, offset);
+		if (have != 0) {
+			char * o = format_line(out, in, width, sizer, have);
+			fwrite(out, 1, o - out, stdout);
 		}
 
 	} else {
@@ -26,6 +26,7 @@
 #include <toaru/decorations.h>
 #include <toaru/menu.h>
 #include <toaru/jpeg.h>
+#include <toaru/png.h>
 
 /* Pointer to graphics memory */
 static yutani_t * yctx;
@@ -147,6 +148,8 @@ int main(int argc, char * argv[]) {
 
 	if (strstr(argv[optind],".jpg")) {
 		load_sprite_jpg(&img, argv[optind]);
+	} else if (strstr(argv[optind],".png")) {
+		load_sprite_png(&img, argv[optind]);
 	} else {
 		load_sprite(&img, argv[optind]);
 	}
@@ -22,12 +22,30 @@
  * Startup scripts can be any executable binary. Shell scripts are
  * generally used to allow easy editing, but you could also use
  * a binary (even a dynamically linked one) as a startup script.
- * `init` will wait for each startup script (that is, it will wait for
- * the original process it started to exit) before running the next one.
- * So if you wish to run daemons, be sure to fork them off and then
- * exit so that the rest of the startup process can continue.
  *
- * When the last startup script finishes, `init` will reboot the system.
+ * A script can say what it needs with comments at the top:
+ *
+ *     # after: 01_migrate 03_tmpfs
+ *     # ready: start
+ *
+ * `after` names the scripts (with or without their extension) that have
+ * to be ready before this one runs; an empty list means it can run
+ * straight away. Scripts that can run at the same time are started at
+ * the same time. A script without an `after` line waits for every
+ * script before it, as all scripts used to.
+ *
+ * A script is ready when it exits, unless it says `ready: start`, in
+ * which case it is ready as soon as it has been started and init does
+ * not wait for it. So daemons either fork themselves off and exit, or
+ * say `ready: start` and keep running.
+ *
+ * When each script starts, becomes ready and exits is written to
+ * /var/run/startup.log (once /var/run exists), along with the script
+ * it had to wait for last, so the slowest chain through startup can
+ * be read back from it.
+ *
+ * When every script that init waits for has finished, `init` will
+ * reboot the system.
  */
 
 #include <dirent.h>
@@ -39,8 +57,41 @@
 #include <unistd.h>
 #include <wait.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <fcntl.h>
 
 #define INITD_PATH "/etc/startup.d"
+#define INITD_LOG  "/var/run/startup.log"
+
+enum unit_state {
+	UNIT_WAITING,
+	UNIT_RUNNING, /* Started, not ready yet */
+	UNIT_READY,
+};
+
+struct unit {
+	char name[256];
+	char after[256];
+	int has_after;
+	int ready_on_start;
+
+	int * depends;
+	int depend_count;
+	int waited_on; /* The dependency that was ready last, or -1 */
+
+	enum unit_state state;
+	int pid;
+	int exited;
+
+	/* Milliseconds since init started, or -1 */
+	long started;
+	long ready;
+	long finished;
+};
+
+static struct unit * units;
+static int unit_count = 0;
+static struct timeval boot_time;
 
 /* Initialize fd 0, 1, 2 */
 void set_console(void) {
@@ -49,6 +100,190 @@ void set_console(void) {
 	syscall_open("/dev/null", 1, 0);
 }
 
+static long now_ms(void) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - boot_time.tv_sec) * 1000 + (now.tv_usec - boot_time.tv_usec) / 1000;
+}
+
+/* Pick out `# after:` and `# ready:` from the comments at the top of a script */
+static void read_header(struct unit * unit, char * path) {
+	char buf[1024];
+	int fd = syscall_open(path, 0, 0);
+	if (fd < 0) return;
+	int len = syscall_read(fd, buf, sizeof(buf) - 1);
+	syscall_close(fd);
+	if (len <= 0) return;
+	buf[len] = '\0';
+
+	char * line = buf;
+	if (line[0] == '#' && line[1] == '!') {
+		line = strchr(line, '\n');
+		if (!line) return;
+		line++;
+	}
+
+	while (*line) {
+		char * end = strchr(line, '\n');
+		if (end) *end = '\0';
+		else if (len == sizeof(buf) - 1) break; /* Cut off */
+
+		if (*line == '#') {
+			char * c = line + 1;
+			while (*c == ' ') c++;
+			if (!strncmp(c, "after:", 6)) {
+				unit->has_after = 1;
+				strncpy(unit->after, c + 6, sizeof(unit->after) - 1);
+			} else if (!strncmp(c, "ready:", 6)) {
+				c += 6;
+				while (*c == ' ') c++;
+				unit->ready_on_start = !strncmp(c, "start", 5);
+			}
+		} else if (*line) {
+			/* The header is over */
+			break;
+		}
+
+		if (!end) break;
+		line = end + 1;
+	}
+}
+
+static int unit_matches(struct unit * unit, char * name) {
+	size_t len = strlen(name);
+	return !strncmp(unit->name, name, len) && (unit->name[len] == '\0' || unit->name[len] == '.');
+}
+
+static void resolve_depends(int i) {
+	struct unit * unit = &units[i];
+	unit->depends = malloc(sizeof(int) * unit_count);
+	if (!unit->has_after) {
+		/* Everything before it, as it always was */
+		for (int j = 0; j < i; ++j) {
+			unit->depends[unit->depend_count++] = j;
+		}
+		return;
+	}
+
+	char * save;
+	for (char * name = strtok_r(unit->after, " \t", &save); name; name = strtok_r(NULL, " \t", &save)) {
+		for (int j = 0; j < unit_count; ++j) {
+			if (j != i && unit_matches(&units[j], name)) {
+				unit->depends[unit->depend_count++] = j;
+				break;
+			}
+		}
+	}
+}
+
+static void write_log(void) {
+	int fd = syscall_open(INITD_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return;
+
+	/* Room for two full unit names, so nothing is cut off */
+	char line[sizeof(units[0].name) * 2 + 64];
+	snprintf(line, sizeof(line), "%-24s %8s %8s %8s  %s\n", "unit", "start", "ready", "exit", "waited on");
+	syscall_write(fd, line, strlen(line));
+
+	for (int i = 0; i < unit_count; ++i) {
+		struct unit * unit = &units[i];
+		char started[24] = "-", ready[24] = "-", finished[24] = "-";
+		if (unit->started >= 0) snprintf(started, sizeof(started), "%ld", unit->started);
+		if (unit->ready >= 0) snprintf(ready, sizeof(ready), "%ld", unit->ready);
+		if (unit->finished >= 0) snprintf(finished, sizeof(finished), "%ld", unit->finished);
+		snprintf(line, sizeof(line), "%-24s %8s %8s %8s  %s\n", unit->name, started, ready, finished,
+			unit->waited_on >= 0 ? units[unit->waited_on].name : "-");
+		syscall_write(fd, line, strlen(line));
+	}
+
+	syscall_close(fd);
+}
+
+static void set_ready(struct unit * unit) {
+	unit->state = UNIT_READY;
+	unit->ready = now_ms();
+}
+
+static void start_unit(struct unit * unit) {
+	char path[512];
+	sprintf(path, INITD_PATH "/%s", unit->name);
+
+	/* The dependency that held it up the longest */
+	unit->waited_on = -1;
+	for (int i = 0; i < unit->depend_count; ++i) {
+		struct unit * dep = &units[unit->depends[i]];
+		if (dep->state == UNIT_READY && (unit->waited_on < 0 || dep->ready > units[unit->waited_on].ready)) {
+			unit->waited_on = unit->depends[i];
+		}
+	}
+
+	char * args[] = {path, NULL};
+	unit->started = now_ms();
+	unit->pid = syscall_fork();
+
+	if (!unit->pid) {
+		/* Pass environment from init to child */
+		syscall_execve(args[0], args, environ);
+		/* exec failed, exit this subprocess */
+		syscall_exit(0);
+	}
+
+	if (unit->pid < 0) {
+		unit->exited = 1;
+		unit->finished = unit->started;
+		set_ready(unit);
+	} else if (unit->ready_on_start) {
+		set_ready(unit);
+	} else {
+		unit->state = UNIT_RUNNING;
+	}
+}
+
+/* Start everything that isn't waiting on anything any more */
+static void start_units(void) {
+	int started;
+	do {
+		started = 0;
+		int running = 0;
+		int first_waiting = -1;
+		for (int i = 0; i < unit_count; ++i) {
+			struct unit * unit = &units[i];
+			if (unit->state == UNIT_RUNNING) running++;
+			if (unit->state != UNIT_WAITING) continue;
+
+			int clear = 1;
+			for (int j = 0; j < unit->depend_count; ++j) {
+				if (units[unit->depends[j]].state != UNIT_READY) {
+					clear = 0;
+					break;
+				}
+			}
+			if (clear) {
+				start_unit(unit);
+				started = 1;
+			} else if (first_waiting < 0) {
+				first_waiting = i;
+			}
+		}
+
+		if (!started && !running && first_waiting >= 0) {
+			/* Nothing could ever let it go (a loop of scripts waiting on each other); run it anyway */
+			start_unit(&units[first_waiting]);
+			started = 1;
+		}
+	} while (started);
+
+	write_log();
+}
+
+/* Is there anything left that init is waiting on? */
+static int units_pending(void) {
+	for (int i = 0; i < unit_count; ++i) {
+		if (!units[i].exited && !units[i].ready_on_start) return 1;
+	}
+	return 0;
+}
+
 /* Run a startup script and wait for it to finish */
 int start_options(char * args[]) {
 
@@ -88,7 +323,40 @@ int start_options(char * args[]) {
 	return cpid;
 }
 
+static void run_units(void) {
+	start_units();
+
+	while (units_pending()) {
+		/*
+		 * Wait, ignoring kernel threads
+		 * (which also end up as children to init)
+		 */
+		int pid = waitpid(-1, NULL, WNOKERN);
+
+		if (pid == -1) {
+			if (errno == EINTR) continue;
+			/* There are no more children */
+			break;
+		}
+
+		for (int i = 0; i < unit_count; ++i) {
+			struct unit * unit = &units[i];
+			if (unit->pid == pid && !unit->exited) {
+				unit->exited = 1;
+				unit->finished = now_ms();
+				if (unit->state != UNIT_READY) {
+					set_ready(unit);
+				}
+				start_units();
+				break;
+			}
+		}
+	}
+}
+
 int main(int argc, char * argv[]) {
+	gettimeofday(&boot_time, NULL);
+
 	/* Initialize stdin/out/err */
 	set_console();
 
@@ -121,14 +389,25 @@ int main(int argc, char * argv[]) {
 		}
 		qsort(entries, count, sizeof(struct dirent), comparator);
 
-		/* Run scripts */
+		/* Collect scripts and what they say they need */
+		units = calloc(count, sizeof(struct unit));
 		for (int i = 0; i < count; ++i) {
 			if (entries[i].d_name[0] != '.') {
-				char path[256];
-				sprintf(path, "/etc/startup.d/%s", entries[i].d_name);
-				start_options((char *[]){path, NULL});
+				struct unit * unit = &units[unit_count++];
+				char path[512];
+				strncpy(unit->name, entries[i].d_name, sizeof(unit->name) - 1);
+				sprintf(path, INITD_PATH "/%s", unit->name);
+				unit->state = UNIT_WAITING;
+				unit->waited_on = -1;
+				unit->started = unit->ready = unit->finished = -1;
+				read_header(unit, path);
 			}
 		}
+		for (int i = 0; i < unit_count; ++i) {
+			resolve_depends(i);
+		}
+
+		run_units();
 	}
 
 	/* Self-explanatory */
@@ -7,6 +7,11 @@
  *
  * This is the updated windowed version of the
  * julia fractal generator demo.
+ *
+ * The picture is cut into tiles and drawn by a pool of threads, two
+ * pixels at a time with SSE2. With --bench it draws a few frames with
+ * no window and reports how fast it went, which makes it a handy CPU
+ * and scheduler benchmark.
  */
 
 #include <stdio.h>
@@ -16,6 +21,9 @@
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <emmintrin.h>
 
 #include <toaru/yutani.h>
 #include <toaru/graphics.h>
@@ -24,6 +32,12 @@
 
 #define GFX_(xpt, ypt) (GFX(ctx,xpt+decor_left_width,ypt+decor_top_height))
 
+#define TILE_SIZE 32
+#define MAX_THREADS 16
+
+/* Frames drawn by --bench */
+#define BENCH_FRAMES 10
+
 /* Pointer to graphics memory */
 static yutani_t * yctx;
 static yutani_window_t * window = NULL;
@@ -48,8 +62,6 @@ float initer = 1000; /* Iteration levels */
 float pixcorx;       /* Internal values */
 float pixcory;
 
-int newcolor;        /* Color we're placing */
-int lastcolor;       /* Last color we placed */
 int no_repeat = 0;   /* Repeat colors? */
 
 /*
@@ -76,37 +88,180 @@ int top    = 40;
 int width  = 300;
 int height = 300;
 
-void julia(int xpt, int ypt) {
-	long double x = xpt * pixcorx + Minx;
-	long double y = Maxy - ypt * pixcory;
-	long double xnew = 0;
-	long double ynew = 0;
-
-	int k = 0;
-	for (k = 0; k <= initer; k++) {
-		xnew = x * x - y * y + conx;
-		ynew = 2 * x * y     + cony;
-		x    = xnew;
-		y    = ynew;
-		if ((x * x + y * y) > 4)
-			break;
+static uint32_t julia_color(int k) {
+	if (k >= initer) return rgb(0,0,0);
+	if (no_repeat) return colors[(int)(12 * k / initer)];
+	return colors[k % 12];
+}
+
+/* Where the pool is drawing to */
+static uint32_t * pixels;
+static int pixels_stride;
+
+/*
+ * Draw one tile. Each pair of pixels in a row is iterated together;
+ * once a lane escapes it stops counting, and the pair stops when both
+ * have escaped.
+ */
+static void julia_tile(int tile) {
+	int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int x0 = (tile % tiles_x) * TILE_SIZE;
+	int y0 = (tile / tiles_x) * TILE_SIZE;
+	int x1 = x0 + TILE_SIZE < width  ? x0 + TILE_SIZE : width;
+	int y1 = y0 + TILE_SIZE < height ? y0 + TILE_SIZE : height;
+
+	const __m128d cx = _mm_set1_pd(conx);
+	const __m128d cy = _mm_set1_pd(cony);
+	const __m128d four = _mm_set1_pd(4.0);
+	const __m128d one = _mm_set1_pd(1.0);
+	int max_k = initer;
+
+	for (int ypt = y0; ypt < y1; ++ypt) {
+		uint32_t * row = pixels + ypt * pixels_stride;
+		for (int xpt = x0; xpt < x1; xpt += 2) {
+			__m128d x = _mm_setr_pd(xpt * pixcorx + Minx, (xpt + 1) * pixcorx + Minx);
+			__m128d y = _mm_set1_pd(Maxy - ypt * pixcory);
+			__m128d k = _mm_setzero_pd();
+			__m128d active = _mm_cmpeq_pd(k, k);
+
+			for (int i = 0; i <= max_k; ++i) {
+				__m128d xy = _mm_mul_pd(x, y);
+				x = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)), cx);
+				y = _mm_add_pd(_mm_add_pd(xy, xy), cy);
+				__m128d mag = _mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y));
+				active = _mm_andnot_pd(_mm_cmpgt_pd(mag, four), active);
+				if (!_mm_movemask_pd(active)) break;
+				k = _mm_add_pd(k, _mm_and_pd(active, one));
+			}
+
+			double out[2];
+			_mm_storeu_pd(out, k);
+			row[xpt] = julia_color(out[0]);
+			if (xpt + 1 < x1) row[xpt + 1] = julia_color(out[1]);
+		}
 	}
+}
 
-	int color;
-	if (no_repeat) {
-		color = 12 * k / initer;
-	} else {
-		color = k;
-		if (color > 11) {
-			color = color % 12;
+/*
+ * Thread pool. Every thread - the main one included - takes tiles off
+ * a shared counter until there are none left.
+ */
+static struct {
+	int threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int pending;
+	volatile int next_tile;
+	int tiles;
+} pool;
+
+static void pool_draw(void) {
+	int tile;
+	while ((tile = __sync_fetch_and_add(&pool.next_tile, 1)) < pool.tiles) {
+		julia_tile(tile);
+	}
+}
+
+static void * pool_worker(void * arg) {
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (pool.generation == seen) {
+			pthread_cond_wait(&pool.start, &pool.lock);
 		}
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		pool_draw();
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0) {
+			pthread_cond_signal(&pool.done);
+		}
+	}
+
+	return NULL;
+}
+
+static void pool_init(int threads) {
+	pool.threads = threads;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.start, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	for (int i = 1; i < threads; ++i) {
+		pthread_t worker;
+		pthread_create(&worker, NULL, pool_worker, NULL);
+	}
+}
+
+/* Draw the whole picture into buffer, which is stride pixels across */
+static void julia_draw(uint32_t * buffer, int stride) {
+	pixcorx = (Maxx - Minx) / width;
+	pixcory = (Maxy - Miny) / height;
+	pixels = buffer;
+	pixels_stride = stride;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+	pool.next_tile = 0;
+	pool.pending = pool.threads - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_draw();
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending) {
+		pthread_cond_wait(&pool.done, &pool.lock);
 	}
-	if (k >= initer) {
-		GFX_(xpt,ypt) = rgb(0,0,0);
-	} else {
-		GFX_(xpt,ypt) = colors[color];
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Processors, from /proc/cpuinfo */
+static int cpu_count(void) {
+	FILE * f = fopen("/proc/cpuinfo", "r");
+	if (!f) return 1;
+	char line[256];
+	int count = 1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Processors: %d", &count) == 1) break;
 	}
-	newcolor = color;
+	fclose(f);
+	if (count < 1) count = 1;
+	if (count > MAX_THREADS) count = MAX_THREADS;
+	return count;
+}
+
+static void set_bounds(void) {
+	float _x = Maxx - Minx;
+	float _y = _x / width * height;
+	Miny = 0 - _y / 2;
+	Maxy = _y / 2;
+}
+
+static int bench(void) {
+	set_bounds();
+	uint32_t * buffer = malloc(sizeof(uint32_t) * width * height);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < BENCH_FRAMES; ++i) {
+		julia_draw(buffer, width);
+	}
+	gettimeofday(&end, NULL);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	double mpixels = (double)width * height * BENCH_FRAMES / 1000000.0;
+	printf("%dx%d, %d iterations, %d threads: %d frames in %.3fs, %.2f Mpixels/s\n",
+		width, height, (int)initer, pool.threads, BENCH_FRAMES, seconds,
+		seconds > 0.0 ? mpixels / seconds : 0.0);
+
+	free(buffer);
+	return 0;
 }
 
 void usage(char * argv[]) {
@@ -115,7 +270,7 @@ void usage(char * argv[]) {
 			"\n"
 			"usage: %s [-n] [-i \033[3miniter\033[0m] [-x \033[3mminx\033[0m] \n"
 			"          [-X \033[3mmaxx\033[0m] [-c \033[3mconx\033[0m] [-C \033[3mcony\033[0m]\n"
-			"          [-W \033[3mwidth\033[0m] [-H \033[3mheight\033[0m] [-h]\n"
+			"          [-W \033[3mwidth\033[0m] [-H \033[3mheight\033[0m] [-t \033[3mthreads\033[0m] [-b] [-h]\n"
 			"\n"
 			" -n --no-repeat \033[3mDo not repeat colors\033[0m\n"
 			" -i --initer    \033[3mInitializer value\033[0m\n"
@@ -125,8 +280,10 @@ void usage(char * argv[]) {
 			" -C --cony      \033[3mcon y\033[0m\n"
 			" -W --width     \033[3mWindow width\033[0m\n"
 			" -H --height    \033[3mWindow height\033[0m\n"
+			" -t --threads   \033[3mDraw with this many threads (default: one per CPU)\033[0m\n"
+			" -b --bench     \033[3mDraw %d frames without a window and report the speed\033[0m\n"
 			" -h --help      \033[3mShow this help message.\033[0m\n",
-			argv[0]);
+			argv[0], BENCH_FRAMES);
 }
 
 static void decors() {
@@ -136,33 +293,14 @@ static void decors() {
 void redraw() {
 	printf("initer: %f\n", initer);
 	printf("X: %f %f\n", Minx, Maxx);
-	float _x = Maxx - Minx;
-	float _y = _x / width * height;
-	Miny = 0 - _y / 2;
-	Maxy = _y / 2;
+	set_bounds();
 	printf("Y: %f %f\n", Miny, Maxy);
 	printf("conx: %f cony: %f\n", conx, cony);
 
 	decors();
 
-	newcolor  = 0;
-	lastcolor = 0;
-
-	pixcorx = (Maxx - Minx) / width;
-	pixcory = (Maxy - Miny) / height;
-	int j = 0;
-	do {
-		int i = 1;
-		do {
-			julia(i,j);
-			if (lastcolor != newcolor) julia(i-1,j);
-			else if (i > 0) GFX_(i-1,j) = colors[lastcolor];
-			newcolor = lastcolor;
-			i+= 2;
-		} while ( i < width );
-		yutani_flip(yctx, window);
-		++j;
-	} while ( j < height );
+	julia_draw(&GFX_(0,0), GFX_S(ctx) / GFX_B(ctx));
+	yutani_flip(yctx, window);
 }
 
 void resize_finish(int w, int h) {
@@ -193,6 +331,8 @@ void resize_finish(int w, int h) {
 
 
 int main(int argc, char * argv[]) {
+	int threads = 0;
+	int benchmark = 0;
 
 	static struct option long_opts[] = {
 		{"no-repeat", no_argument,    0, 'n'},
@@ -203,6 +343,8 @@ int main(int argc, char * argv[]) {
 		{"cony",   required_argument, 0, 'C'},
 		{"width",  required_argument, 0, 'W'},
 		{"height", required_argument, 0, 'H'},
+		{"threads", required_argument, 0, 't'},
+		{"bench",  no_argument,       0, 'b'},
 		{"help",   no_argument,       0, 'h'},
 		{0,0,0,0}
 	};
@@ -210,7 +352,7 @@ int main(int argc, char * argv[]) {
 	if (argc > 1) {
 		/* Read some arguments */
 		int index, c;
-		while ((c = getopt_long(argc, argv, "ni:x:X:c:C:W:H:h", long_opts, &index)) != -1) {
+		while ((c = getopt_long(argc, argv, "ni:x:X:c:C:W:H:t:bh", long_opts, &index)) != -1) {
 			if (!c) {
 				if (long_opts[index].flag == 0) {
 					c = long_opts[index].val;
@@ -241,6 +383,14 @@ int main(int argc, char * argv[]) {
 				case 'H':
 					height = atoi(optarg);
 					break;
+				case 't':
+					threads = atoi(optarg);
+					if (threads < 1) threads = 1;
+					if (threads > MAX_THREADS) threads = MAX_THREADS;
+					break;
+				case 'b':
+					benchmark = 1;
+					break;
 				case 'h':
 					usage(argv);
 					exit(0);
@@ -251,6 +401,12 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
+	pool_init(threads ? threads : cpu_count());
+
+	if (benchmark) {
+		return bench();
+	}
+
 	yctx = yutani_init();
 	if (!yctx) {
 		fprintf(stderr, "%s: failed to connect to compositor\n", argv[0]);
@@ -140,6 +140,7 @@ struct sig_def signals[] = {
 	{SIGHATE,"HATE"},
 	{SIGWINEVENT,"WINEVENT"},
 	{SIGCAT,"CAT"},
+	{SIGLOWMEM,"LOWMEM"},
 	{0,NULL},
 };
 
@@ -0,0 +1,191 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * ktrace - Record kernel tracepoints
+ *
+ * Turns on the tracepoints behind /dev/ktrace for a while and prints
+ * what they recorded as a timeline. Timestamps come from the TSC; the
+ * kernel's clock is read at the start and end of the trace to work
+ * out how fast it ticks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/ktrace.h>
+
+static const char * event_names[KTRACE_EVENTS] = {
+	[KTRACE_SWITCH]     = "switch",
+	[KTRACE_PAGE_FAULT] = "fault",
+	[KTRACE_READ]       = "read",
+	[KTRACE_READ_DONE]  = "read-done",
+	[KTRACE_WRITE]      = "write",
+	[KTRACE_WRITE_DONE] = "write-done",
+	[KTRACE_SLEEP]      = "sleep",
+	[KTRACE_WAKEUP]     = "wakeup",
+	[KTRACE_IRQ]        = "irq",
+	[KTRACE_SYSCALL]    = "syscall",
+	[KTRACE_SYSRET]     = "sysret",
+};
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"ktrace - record kernel tracepoints\n"
+			"\n"
+			"usage: %s [-e EVENT,...] [SECONDS]\n"
+			"\n"
+			" -e     \033[3monly record these events (default: all)\033[0m\n"
+			" -l     \033[3mlist event names\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			"Traces for SECONDS seconds (default 1). Only the most recent\n"
+			"records are kept if more happen than fit in the trace.\n"
+			"\n", argv[0]);
+}
+
+static uint32_t parse_events(char * list) {
+	uint32_t mask = 0;
+	char * save;
+	for (char * name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		int found = 0;
+		for (int i = 0; i < KTRACE_EVENTS; ++i) {
+			if (!strcmp(name, event_names[i])) {
+				mask |= (1 << i);
+				found = 1;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "ktrace: unknown event '%s'\n", name);
+			exit(1);
+		}
+	}
+	return mask;
+}
+
+static void print_record(struct ktrace_record * r) {
+	unsigned int a = r->args[0], b = r->args[1], c = r->args[2];
+
+	switch (r->event) {
+		case KTRACE_SWITCH:
+			printf("%u -> %u", a, b);
+			break;
+		case KTRACE_PAGE_FAULT:
+			printf("addr=0x%08x err=0x%x eip=0x%08x", a, b, c);
+			break;
+		case KTRACE_READ:
+		case KTRACE_WRITE:
+			printf("inode=%u size=%u offset=%u", a, b, c);
+			break;
+		case KTRACE_READ_DONE:
+		case KTRACE_WRITE_DONE:
+			printf("inode=%u ret=%d", a, (int)b);
+			break;
+		case KTRACE_SLEEP:
+			printf("queue=0x%08x", a);
+			break;
+		case KTRACE_WAKEUP:
+			printf("queue=0x%08x woken=%u", a, b);
+			break;
+		case KTRACE_IRQ:
+			printf("irq=%u eip=0x%08x", a, b);
+			break;
+		case KTRACE_SYSCALL:
+			printf("num=%u 0x%x 0x%x", a, b, c);
+			break;
+		case KTRACE_SYSRET:
+			printf("num=%u ret=%d", a, (int)b);
+			break;
+		default:
+			printf("0x%x 0x%x 0x%x", a, b, c);
+			break;
+	}
+}
+
+int main(int argc, char * argv[]) {
+	uint32_t events = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "e:l?")) != -1) {
+		switch (c) {
+			case 'e':
+				events = parse_events(optarg);
+				break;
+			case 'l':
+				for (int i = 0; i < KTRACE_EVENTS; ++i) {
+					printf("%s\n", event_names[i]);
+				}
+				return 0;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	int seconds = optind < argc ? atoi(argv[optind]) : 1;
+
+	int fd = open("/dev/ktrace", O_RDONLY);
+	if (fd < 0) {
+		perror("ktrace: /dev/ktrace");
+		return 1;
+	}
+
+	struct ktrace_clock start, end;
+	ioctl(fd, IOCTL_KTRACE_CLOCK, &start);
+
+	if (ioctl(fd, IOCTL_KTRACE_START, &events) < 0) {
+		perror("ktrace: start");
+		return 1;
+	}
+
+	sleep(seconds);
+
+	ioctl(fd, IOCTL_KTRACE_STOP, NULL);
+	ioctl(fd, IOCTL_KTRACE_CLOCK, &end);
+
+	/* TSC ticks per microsecond, from the two clock readings */
+	uint64_t elapsed_us = (uint64_t)(end.sec - start.sec) * 1000000 + end.usec - start.usec;
+	double ticks_per_us = elapsed_us ? (double)(end.tsc - start.tsc) / elapsed_us : 1.0;
+	if (ticks_per_us <= 0) ticks_per_us = 1.0;
+
+	struct ktrace_record buf[128];
+	uint64_t first = 0;
+	uint32_t last_seq = 0;
+	size_t count = 0, lost = 0;
+	ssize_t r;
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		for (unsigned int i = 0; i < r / sizeof(struct ktrace_record); ++i) {
+			struct ktrace_record * rec = &buf[i];
+			if (!count) {
+				first = rec->tsc;
+			} else if (rec->seq != last_seq + 1) {
+				lost += rec->seq - last_seq - 1;
+			}
+			last_seq = rec->seq;
+			count++;
+
+			printf("%12.3f %5d %-10s ", (double)(rec->tsc - first) / ticks_per_us, (int)rec->pid,
+				rec->event < KTRACE_EVENTS ? event_names[rec->event] : "?");
+			print_record(rec);
+			printf("\n");
+		}
+	}
+
+	close(fd);
+
+	fprintf(stderr, "%zu records", count);
+	if (count && last_seq > count + lost) {
+		fprintf(stderr, " (%u earlier overwritten)", (unsigned int)(last_seq - count - lost));
+	}
+	if (lost) {
+		fprintf(stderr, ", %zu lost", lost);
+	}
+	fprintf(stderr, ", %.1f TSC ticks/us\n", ticks_per_us);
+
+	return 0;
+}
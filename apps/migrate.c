@@ -5,10 +5,17 @@
  *
  * migrate - Relocate root filesystem to tmpfs
  *
- * Run as part of system startup to move the ext2 root ramdisk
- * into a flexible in-memory temporary filesystem, which allows
- * file creation and editing and is much faster than the using
- * the ext2 driver against the static in-memory ramdisk.
+ * Run as part of system startup to make the root a flexible
+ * in-memory temporary filesystem, which allows file creation
+ * and editing.
+ *
+ * By default the original root stays where it is and a tmpfs is
+ * layered over it with the overlay filesystem: lookups and reads are
+ * served from the ramdisk and files are copied up the first time
+ * they are changed, so boot doesn't wait for a copy of everything
+ * and the ramdisk isn't held in memory twice. With migrate=copy on
+ * the command line, the whole root is copied into a tmpfs instead
+ * and the ramdisk is freed afterwards.
  *
  * Based on the original Python implementation.
  */
@@ -226,6 +233,17 @@ int main(int argc, char * argv[]) {
 	sprintf(tmp, "mount %s %s /dev/base", root_type, root);
 	system(tmp);
 
+	char * mode = hashmap_get(cmdline,"migrate");
+	if (!mode || strcmp(mode, "copy")) {
+		TRACE_("Mounting overlay to /");
+		if (!system("mount overlay /dev/base,755 /")) {
+			/* The overlay holds on to the original root; hide it */
+			system("mount tmpfs x,755 /dev/base");
+			return 0;
+		}
+		TRACE_("Overlay failed, copying root instead");
+	}
+
 	TRACE_("Mounting tmpfs to /");
 	system("mount tmpfs x,755 /");
 
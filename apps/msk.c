@@ -13,14 +13,20 @@
  * important for bootstrapping at the moment.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <toaru/confreader.h>
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
+#include <toaru/inflate.h>
 
 #define MSK_VERSION "1.0.0"
 #define VAR_PATH "/var/msk"
@@ -289,87 +295,436 @@ static int process_package(list_t * pkgs, char * name) {
 	return 0;
 }
 
-static int install_package(char * pkg) {
-
-	char * type = confreader_getd(msk_manifest, pkg, "type", "");
+/*
+ * Downloads run in the background, MSK_PARALLEL (default 4) at a time,
+ * one fetch each, started in install order. Installation waits only for
+ * the package it is about to install, so the downloads behind it keep
+ * going while it is extracted. Packages with a crc32 in the manifest are
+ * checked by fetch as they come in.
+ */
+struct download {
+	char * pkg;
+	pid_t pid;    /* 0 until started */
+	int done;
+	int status;
+};
+
+static list_t * downloads = NULL;
+static int downloads_running = 0;
+static int downloads_parallel = 4;
+
+static int is_remote(char * pkg) {
 	char * msk_remote = confreader_get(msk_manifest, pkg, "remote_path");
+	char * source = confreader_get(msk_manifest, pkg, "source");
+	return msk_remote && source && strstr(msk_remote, "http:") == msk_remote;
+}
 
-	if (strstr(msk_remote, "http:") == msk_remote) {
-		char * source = confreader_get(msk_manifest, pkg, "source");
-		if (source) {
-			fprintf(stderr, "Download %s...\n", pkg);
-			char cmd[1024];
-			sprintf(cmd, "fetch -o /tmp/msk.file -v %s/%s", msk_remote,
-					source);
-			system(cmd);
-			hashmap_set(hashmap_get(msk_manifest->sections, pkg), "source", "/tmp/msk.file");
+static void start_downloads(void) {
+	foreach(node, downloads) {
+		if (downloads_running >= downloads_parallel) return;
+		struct download * d = node->value;
+		if (d->pid || d->done) continue;
+
+		char * msk_remote = confreader_get(msk_manifest, d->pkg, "remote_path");
+		char * source = confreader_get(msk_manifest, d->pkg, "source");
+		char * crc = confreader_get(msk_manifest, d->pkg, "crc32");
+
+		char out[256];
+		sprintf(out, "/tmp/msk.%s", d->pkg);
+		char * arg = malloc(strlen(out) + strlen(msk_remote) + strlen(source) + 32);
+		char * c = arg + sprintf(arg, "%s=%s/%s", out, msk_remote, source);
+		if (crc) {
+			sprintf(c, "#crc32=%.8s", crc);
 		}
-	}
 
-	fprintf(stderr, "Install '%s'...\n", pkg);
+		pid_t pid = fork();
+		if (!pid) {
+			char * args[] = {"fetch", arg, NULL};
+			execvp(args[0], args);
+			exit(1);
+		}
+		free(arg);
 
-	if (!strcmp(type, "file")) {
-		/* Legacy single-file package, has a source and a destination */
+		if (pid < 0) {
+			d->done = 1;
+			d->status = 1;
+			continue;
+		}
 
 		if (verbose) {
-			fprintf(stderr, "  - Copy file '%s' to '%s' and set its mask to '%s'\n",
-					confreader_get(msk_manifest, pkg, "source"),
-					confreader_get(msk_manifest, pkg, "destination"),
-					confreader_get(msk_manifest, pkg, "mask"));
+			fprintf(stderr, "  - Download '%s'\n", d->pkg);
 		}
+		d->pid = pid;
+		downloads_running++;
+		hashmap_set(hashmap_get(msk_manifest->sections, d->pkg), "source", strdup(out));
+	}
+}
+
+static int queue_downloads(list_t * pkgs) {
+	downloads = list_create();
+	char * parallel = getenv("MSK_PARALLEL");
+	if (parallel && atoi(parallel) > 0) downloads_parallel = atoi(parallel);
+
+	foreach(node, pkgs) {
+		char * pkg = node->value;
+		if (!is_remote(pkg)) continue;
+		struct download * d = calloc(1, sizeof(struct download));
+		d->pkg = pkg;
+		list_insert(downloads, d);
+	}
+
+	if (downloads->length) {
+		fprintf(stderr, "Downloading %d package%s...\n", (int)downloads->length, downloads->length == 1 ? "" : "s");
+	}
+	start_downloads();
+	return 0;
+}
 
-		char cmd[1024];
-		sprintf(cmd, "cp %s %s; chmod 0%s %s",
-				confreader_get(msk_manifest, pkg, "source"),
-				confreader_get(msk_manifest, pkg, "destination"),
-				confreader_get(msk_manifest, pkg, "mask"),
-				confreader_get(msk_manifest, pkg, "destination"));
+/* Wait for this package's download; 0 if it arrived, or if it wasn't one */
+static int wait_for_download(char * pkg) {
+	struct download * want = NULL;
+	foreach(node, downloads) {
+		struct download * d = node->value;
+		if (d->pkg == pkg) want = d;
+	}
+	if (!want) return 0;
 
+	while (!want->done) {
 		int status;
-		if ((status = system(cmd))) {
-			fprintf(stderr, "installation command returned %d\n", status);
-			return status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			want->done = 1;
+			want->status = 1;
+			break;
+		}
+		foreach(node, downloads) {
+			struct download * d = node->value;
+			if (d->pid == pid && !d->done) {
+				d->done = 1;
+				d->status = status;
+				downloads_running--;
+			}
+		}
+		start_downloads();
+	}
+
+	if (want->status) {
+		fprintf(stderr, "download of '%s' failed\n", pkg);
+	}
+	return want->status;
+}
+
+static void cancel_downloads(void) {
+	if (!downloads) return;
+	foreach(node, downloads) {
+		struct download * d = node->value;
+		if (d->pid && !d->done) {
+			kill(d->pid, SIGTERM);
+			waitpid(d->pid, NULL, 0);
+			d->done = 1;
+		}
+	}
+}
+
+/*
+ * Packages are unpacked here rather than by forking tar and ungz: the
+ * (decompressed) archive is fed through a small ustar reader a buffer
+ * at a time, so nothing is written but the files themselves.
+ */
+struct extract {
+	char * dest;
+	char * archive;
+	char header[512];
+	size_t header_len;
+	uint64_t remaining;  /* Of the current member's data */
+	uint64_t padding;    /* Up to the next header */
+	int fd;              /* Where the data goes, or -1 to skip it */
+	char * name;
+	unsigned int mode;
+	int finished;        /* Saw the end-of-archive block */
+	int failed;
+};
+
+static unsigned int octal(const char * c, size_t len) {
+	unsigned int out = 0;
+	for (size_t i = 0; i < len && c[i] >= '0' && c[i] <= '7'; ++i) {
+		out = (out << 3) | (c[i] - '0');
+	}
+	return out;
+}
+
+static uint64_t octal64(const char * c, size_t len) {
+	uint64_t out = 0;
+	for (size_t i = 0; i < len && c[i] >= '0' && c[i] <= '7'; ++i) {
+		out = (out << 3) | (c[i] - '0');
+	}
+	return out;
+}
+
+static void make_parents(char * path) {
+	for (char * c = path + 1; *c; ++c) {
+		if (*c != '/') continue;
+		*c = '\0';
+		mkdir(path, 0755);
+		*c = '/';
+	}
+}
+
+static int write_all(int fd, const char * data, size_t size) {
+	while (size) {
+		ssize_t w = write(fd, data, size);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		data += w;
+		size -= w;
+	}
+	return 0;
+}
+
+static int copy_file(char * source, char * dest, unsigned int mode) {
+	int s_fd = open(source, O_RDONLY);
+	if (s_fd < 0) return 1;
+	int d_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (d_fd < 0) {
+		close(s_fd);
+		return 1;
+	}
+	char buf[4096];
+	int err = 0;
+	ssize_t r;
+	while ((r = read(s_fd, buf, sizeof(buf))) > 0) {
+		if (write_all(d_fd, buf, r) < 0) {
+			err = 1;
+			break;
 		}
+	}
+	if (r < 0) err = 1;
+	close(s_fd);
+	close(d_fd);
+	chmod(dest, mode);
+	return err;
+}
+
+static void extract_error(struct extract * x, char * what, char * name) {
+	fprintf(stderr, "%s: %s: %s: %s\n", x->archive, name, what, strerror(errno));
+	x->failed = 1;
+}
+
+static void extract_member(struct extract * x) {
+	char * h = x->header;
+	char name[256 + 2];
+	char path[1024];
 
-	} else if (!strcmp(type, "tar")) {
-		/* Uncompressed archive */
+	int all_zero = 1;
+	for (int i = 0; i < 512; ++i) {
+		if (h[i]) {
+			all_zero = 0;
+			break;
+		}
+	}
+	if (all_zero) {
+		x->finished = 1;
+		return;
+	}
+
+	/* ustar: prefix at 345, name at 0 */
+	if (h[345]) {
+		snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
+	} else {
+		snprintf(name, sizeof(name), "%.100s", h);
+	}
+	snprintf(path, sizeof(path), "%s/%s", x->dest, name);
+
+	char type = h[156];
+	unsigned int mode = octal(h + 100, 8) & 07777;
+	uint64_t size = octal64(h + 124, 12);
+
+	x->fd = -1;
+	x->remaining = size;
+	x->padding = ((size + 511) & ~(uint64_t)511) - size;
+
+	if (verbose) {
+		fprintf(stderr, "    %s\n", name);
+	}
+
+	switch (type) {
+		case '\0':
+		case '0':
+			make_parents(path);
+			x->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+			if (x->fd < 0) extract_error(x, "could not create", name);
+			x->name = strdup(path);
+			x->mode = mode;
+			break;
+		case '1': {
+			/* Hard link: a copy of something already extracted */
+			char target[1024];
+			snprintf(target, sizeof(target), "%s/%.100s", x->dest, h + 157);
+			make_parents(path);
+			if (copy_file(target, path, mode)) extract_error(x, "could not link", name);
+			break;
+		}
+		case '2': {
+			char target[101];
+			snprintf(target, sizeof(target), "%.100s", h + 157);
+			make_parents(path);
+			unlink(path);
+			if (symlink(target, path) < 0) extract_error(x, "could not link", name);
+			break;
+		}
+		case '5': {
+			size_t len = strlen(path);
+			while (len && path[len-1] == '/') path[--len] = '\0';
+			make_parents(path);
+			struct stat buf;
+			if (mkdir(path, mode ? mode : 0755) < 0 && stat(path, &buf) < 0) {
+				extract_error(x, "could not make directory", name);
+			}
+			break;
+		}
+		default:
+			/* Extended headers and such: skip their data */
+			break;
+	}
+}
+
+static void extract_end_member(struct extract * x) {
+	if (x->fd >= 0) {
+		close(x->fd);
+		chmod(x->name, x->mode);
+		x->fd = -1;
+	}
+	free(x->name);
+	x->name = NULL;
+}
+
+/* Take the next piece of the archive; nonzero to stop */
+static int extract_feed(struct extract * x, const uint8_t * buf, size_t size) {
+	while (size && !x->finished) {
+		if (x->remaining) {
+			size_t n = size < x->remaining ? size : x->remaining;
+			if (x->fd >= 0 && write_all(x->fd, (const char *)buf, n) < 0) {
+				extract_error(x, "could not write", x->name);
+				close(x->fd);
+				x->fd = -1;
+			}
+			x->remaining -= n;
+			buf += n;
+			size -= n;
+			if (!x->remaining) extract_end_member(x);
+		} else if (x->padding) {
+			size_t n = size < x->padding ? size : x->padding;
+			x->padding -= n;
+			buf += n;
+			size -= n;
+		} else {
+			size_t n = 512 - x->header_len;
+			if (n > size) n = size;
+			memcpy(x->header + x->header_len, buf, n);
+			x->header_len += n;
+			buf += n;
+			size -= n;
+			if (x->header_len == 512) {
+				x->header_len = 0;
+				extract_member(x);
+				if (!x->remaining) extract_end_member(x);
+			}
+		}
+	}
+	return 0;
+}
+
+static size_t extract_read_input(struct inflate_context * ctx, uint8_t * buf, size_t size) {
+	ssize_t r;
+	do {
+		r = read((int)(uintptr_t)ctx->input_priv, buf, size);
+	} while (r < 0 && errno == EINTR);
+	return r < 0 ? 0 : r;
+}
+
+static int extract_write_output(struct inflate_context * ctx, const uint8_t * buf, size_t size) {
+	return extract_feed(ctx->output_priv, buf, size);
+}
+
+static int extract_archive(char * archive, char * dest, int compressed) {
+	int fd = open(archive, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: could not open: %s\n", archive, strerror(errno));
+		return 1;
+	}
+
+	struct extract x = {0};
+	x.dest = dest;
+	x.archive = archive;
+	x.fd = -1;
+
+	int err = 0;
+	if (compressed) {
+		struct inflate_context ctx;
+		ctx.input_priv = (void *)(uintptr_t)fd;
+		ctx.output_priv = &x;
+		ctx.read_input = extract_read_input;
+		ctx.write_output = extract_write_output;
+		if (gzip_decompress(&ctx)) {
+			fprintf(stderr, "%s: invalid or truncated gzip data\n", archive);
+			err = 1;
+		}
+	} else {
+		char * buf = malloc(0x10000);
+		ssize_t r;
+		while ((r = read(fd, buf, 0x10000)) > 0) {
+			extract_feed(&x, (uint8_t *)buf, r);
+		}
+		free(buf);
+	}
+
+	if (x.remaining) {
+		fprintf(stderr, "%s: truncated archive\n", archive);
+		err = 1;
+	}
+	extract_end_member(&x);
+	close(fd);
+	return err || x.failed;
+}
+
+static int install_package(char * pkg) {
+
+	char * type = confreader_getd(msk_manifest, pkg, "type", "");
+
+	fprintf(stderr, "Install '%s'...\n", pkg);
+
+	if (!strcmp(type, "file")) {
+		/* Legacy single-file package, has a source and a destination */
 
 		if (verbose) {
-			fprintf(stderr, "  - Extract '%s' to '%s'\n",
+			fprintf(stderr, "  - Copy file '%s' to '%s' and set its mask to '%s'\n",
 					confreader_get(msk_manifest, pkg, "source"),
-					confreader_get(msk_manifest, pkg, "destination"));
+					confreader_get(msk_manifest, pkg, "destination"),
+					confreader_get(msk_manifest, pkg, "mask"));
 		}
 
-		char cmd[1024];
-		sprintf(cmd, "cd %s; tar -xf %s",
-				confreader_get(msk_manifest, pkg, "destination"),
-				confreader_get(msk_manifest, pkg, "source"));
-
-		int status;
-		if ((status = system(cmd))) {
-			fprintf(stderr, "installation command returned %d\n", status);
-			return status;
+		char * source = confreader_get(msk_manifest, pkg, "source");
+		char * destination = confreader_get(msk_manifest, pkg, "destination");
+		if (copy_file(source, destination, octal(confreader_get(msk_manifest, pkg, "mask"), 8))) {
+			fprintf(stderr, "could not copy '%s' to '%s': %s\n", source, destination, strerror(errno));
+			return 1;
 		}
 
-	} else if (!strcmp(type, "tgz")) {
-		/* Compressed archive */
+	} else if (!strcmp(type, "tar") || !strcmp(type, "tgz")) {
+		/* Archive, possibly compressed */
 
 		if (verbose) {
-			fprintf(stderr, "  - Extract (compressed) '%s' to '%s'\n",
+			fprintf(stderr, "  - Extract%s '%s' to '%s'\n",
+					!strcmp(type, "tgz") ? " (compressed)" : "",
 					confreader_get(msk_manifest, pkg, "source"),
 					confreader_get(msk_manifest, pkg, "destination"));
 		}
 
-		char cmd[1024];
-		sprintf(cmd, "cd %s; ungz %s /tmp/%s.tar; tar -xf /tmp/%s.tar; rm /tmp/%s.tar",
-				confreader_get(msk_manifest, pkg, "destination"),
-				confreader_get(msk_manifest, pkg, "source"),
-				pkg, pkg, pkg);
-
-		int status;
-		if ((status = system(cmd))) {
-			fprintf(stderr, "installation command returned %d\n", status);
-			return status;
+		if (extract_archive(confreader_get(msk_manifest, pkg, "source"),
+		                    confreader_get(msk_manifest, pkg, "destination"),
+		                    !strcmp(type, "tgz"))) {
+			return 1;
 		}
 
 	} else if (!strcmp(type, "meta")) {
@@ -432,8 +787,11 @@ static int install_packages(int argc, char * argv[]) {
 		}
 	}
 
+	queue_downloads(ordered);
+
 	foreach(node, ordered) {
-		if (install_package(node->value)) {
+		if (wait_for_download(node->value) || install_package(node->value)) {
+			cancel_downloads();
 			return 1;
 		}
 	}
@@ -145,39 +145,71 @@ static void redraw_packages(void) {
 	}
 }
 
+static hashmap_t * load_installed(void) {
+	hashmap_t * msk_installed = hashmap_create(10);
+
+	FILE * installed = fopen(VAR_PATH "/installed", "r");
+	if (installed) {
+		while (!feof(installed)) {
+			char tmp[128] = {0};
+			if (!fgets(tmp, 128, installed)) break;
+			char * nl = strstr(tmp, "\n");
+			if (nl) *nl = '\0';
+
+			char * eqeq = strstr(tmp, "==");
+			if (!eqeq) {
+				/* show error */
+				break;
+			}
+
+			*eqeq = '\0';
+			char * version = eqeq+2;
+
+			hashmap_set(msk_installed, tmp, strdup(version));
+		}
+		fclose(installed);
+	}
+
+	return msk_installed;
+}
+
+static void mark_installed(void) {
+	hashmap_t * msk_installed = load_installed();
+	for (int i = 0; i < pkg_pointers_len; ++i) {
+		pkg_pointers[i]->installed = hashmap_has(msk_installed, pkg_pointers[i]->name);
+	}
+	hashmap_free(msk_installed);
+	free(msk_installed);
+}
+
+/*
+ * The manifest only changes when msk updates it, so the parsed list
+ * is kept and the file is only read again if it has been rewritten.
+ * Installing something just changes which packages are marked.
+ */
+static long manifest_mtime = -1;
+
 static void load_manifest(void) {
+	struct stat st;
+	int have_manifest = !stat(VAR_PATH "/manifest", &st);
+
+	if (pkg_pointers && have_manifest && st.st_mtime == manifest_mtime) {
+		mark_installed();
+		return;
+	}
+
 	if (pkg_pointers) {
 		for (int i = 0; i < pkg_pointers_len; ++i) {
 			free(pkg_pointers[i]);
 		}
 		free(pkg_pointers);
+		pkg_pointers = NULL;
 		pkg_pointers_len = 0;
 	}
 
 	confreader_t * conf = confreader_load(VAR_PATH "/manifest");
 	if (conf) {
-		hashmap_t * msk_installed = hashmap_create(10);
-
-		FILE * installed = fopen(VAR_PATH "/installed", "r");
-		if (installed) {
-			while (!feof(installed)) {
-				char tmp[128] = {0};
-				if (!fgets(tmp, 128, installed)) break;
-				char * nl = strstr(tmp, "\n");
-				if (nl) *nl = '\0';
-
-				char * eqeq = strstr(tmp, "==");
-				if (!eqeq) {
-					/* show error */
-					break;
-				}
-
-				*eqeq = '\0';
-				char * version = eqeq+2;
-
-				hashmap_set(msk_installed, tmp, strdup(version));
-			}
-		}
+		manifest_mtime = have_manifest ? st.st_mtime : -1;
 
 		list_t * package_list = list_create();
 
@@ -196,16 +228,13 @@ static void load_manifest(void) {
 			sprintf(p->description, desc);
 			sprintf(p->version, version);
 			p->selected = 0;
-			p->installed = hashmap_has(msk_installed, name);
+			p->installed = 0;
 
 			list_insert(package_list, p);
 		}
 		list_free(packages);
 		free(packages);
 
-		hashmap_free(msk_installed);
-		free(msk_installed);
-
 		pkg_pointers = malloc(sizeof(struct Package *) * package_list->length);
 		pkg_pointers_len = package_list->length;
 		int i = 0;
@@ -223,6 +252,8 @@ static void load_manifest(void) {
 			return strcmp(f1->name, f2->name);
 		}
 		qsort(pkg_pointers, pkg_pointers_len, sizeof(struct Package *), comparator);
+
+		mark_installed();
 	}
 }
 
@@ -149,6 +149,15 @@ struct window_ad {
 	char * icon;
 	char * strings;
 	int left;
+
+	/* Blurred title shadow, kept until the title or width changes */
+	sprite_t * shadow;
+	char * shadow_title;
+
+	/* Layout, worked out when the window list changes */
+	char * title;     /* Name, shortened to fit a cell */
+	int title_cell;   /* The cell width it was shortened for */
+	sprite_t * image; /* Icon, scaled and ready to draw */
 };
 
 typedef struct {
@@ -169,6 +178,25 @@ static int new_focused = -1;
 
 static int title_width = 0;
 
+/*
+ * Parts of the panel that are redrawn separately. Each is a column of
+ * the panel; only the ones that have changed since they were last drawn
+ * are redrawn and flipped.
+ */
+#define PANEL_APPMENU 0x01
+#define PANEL_WINDOWS 0x02
+#define PANEL_WIDGETS 0x04
+#define PANEL_CLOCK   0x08 /* And the logout button */
+#define PANEL_ALL     0x0F
+
+static int panel_dirty = PANEL_ALL;
+
+/* What the parts were showing when they were drawn */
+static time_t drawn_clock = 0;
+static int drawn_appmenu = -1;
+static int drawn_widgets = -1;
+static int drawn_logout = -1;
+
 static void toggle_hide_panel(void) {
 	static int panel_hidden = 0;
 
@@ -209,6 +237,7 @@ static void launch_application(char * app) {
 static void set_focused(int i) {
 	if (focused_app != i) {
 		focused_app = i;
+		panel_dirty |= PANEL_WINDOWS;
 		redraw();
 	}
 }
@@ -789,22 +818,66 @@ static void handle_key_event(struct yutani_msg_key_event * ke) {
 
 }
 
-static void redraw(void) {
-	spin_lock(&drawlock);
+static void part_bounds(int part, int * x, int * w) {
+	switch (part) {
+		case PANEL_APPMENU:
+			*x = 0;
+			*w = APP_OFFSET;
+			break;
+		case PANEL_WINDOWS:
+			*x = APP_OFFSET;
+			*w = LEFT_BOUND - APP_OFFSET;
+			break;
+		case PANEL_WIDGETS:
+			*x = WIDGET_RIGHT - widgets_width;
+			*w = widgets_width;
+			break;
+		case PANEL_CLOCK:
+		default:
+			*x = WIDGET_RIGHT;
+			*w = width - WIDGET_RIGHT;
+			break;
+	}
+	if (*x < 0) {
+		*w += *x;
+		*x = 0;
+	}
+	if (*w < 0) *w = 0;
+}
 
-	struct timeval now;
+static sprite_t * volume_sprite(void) {
+	if (volume_level < 10) {
+		return sprite_volume_mute;
+	} else if (volume_level < 0x547ae147) {
+		return sprite_volume_low;
+	} else if (volume_level < 0xa8f5c28e) {
+		return sprite_volume_med;
+	} else {
+		return sprite_volume_high;
+	}
+}
+
+/* Everything the widgets show, in one number */
+static int widgets_state(void) {
+	int state = 0;
+	if (widgets_network_enabled) {
+		state |= network_status ? 1 : 0;
+		state |= (netstat && netstat->window) ? 2 : 0;
+	}
+	if (widgets_volume_enabled) {
+		sprite_t * v = volume_sprite();
+		state |= (v == sprite_volume_mute ? 0 : v == sprite_volume_low ? 1 : v == sprite_volume_med ? 2 : 3) << 2;
+	}
+	return state;
+}
+
+static void draw_clock(struct timeval * now) {
 	struct tm * timeinfo;
 	char   buffer[80];
-
 	uint32_t txt_color = TEXT_COLOR;
 	int t = 0;
 
-	/* Redraw the background */
-	memcpy(ctx->backbuffer, bg_blob, bg_size);
-
-	/* Get the current time for the clock */
-	gettimeofday(&now, NULL);
-	timeinfo = localtime((time_t *)&now.tv_sec);
+	timeinfo = localtime((time_t *)&now->tv_sec);
 
 	/* Hours : Minutes : Seconds */
 	strftime(buffer, 80, "%H:%M:%S", timeinfo);
@@ -822,11 +895,12 @@ static void redraw(void) {
 	t = (DATE_WIDTH - t) / 2;
 	draw_sdf_string(ctx, width - TIME_LEFT - DATE_WIDTH + t, 12, buffer, 12, txt_color, SDF_FONT_BOLD);
 
-	/* Applications menu */
-	draw_sdf_string(ctx, 8, 3, "Applications", 20, appmenu->window ? HILIGHT_COLOR : txt_color, SDF_FONT_THIN);
+	/* Draw the logout button; XXX This should probably have some sort of focus hilight */
+	draw_sprite_alpha_paint(ctx, sprite_logout, width - 23, 1, 1.0, (logout_menu->window ? HILIGHT_COLOR : ICON_COLOR)); /* Logout button */
+}
 
-	/* Draw each widget */
-	/* - Volume */
+static void draw_widgets(void) {
+	/* - Network */
 	int widget = 0;
 	if (widgets_network_enabled) {
 		uint32_t color = (netstat && netstat->window) ? HILIGHT_COLOR : ICON_COLOR;
@@ -837,55 +911,30 @@ static void redraw(void) {
 		}
 		widget++;
 	}
+	/* - Volume */
 	if (widgets_volume_enabled) {
-		if (volume_level < 10) {
-			draw_sprite_alpha_paint(ctx, sprite_volume_mute, WIDGET_POSITION(widget), 0, 1.0, ICON_COLOR);
-		} else if (volume_level < 0x547ae147) {
-			draw_sprite_alpha_paint(ctx, sprite_volume_low, WIDGET_POSITION(widget), 0, 1.0, ICON_COLOR);
-		} else if (volume_level < 0xa8f5c28e) {
-			draw_sprite_alpha_paint(ctx, sprite_volume_med, WIDGET_POSITION(widget), 0, 1.0, ICON_COLOR);
-		} else {
-			draw_sprite_alpha_paint(ctx, sprite_volume_high, WIDGET_POSITION(widget), 0, 1.0, ICON_COLOR);
-		}
+		draw_sprite_alpha_paint(ctx, volume_sprite(), WIDGET_POSITION(widget), 0, 1.0, ICON_COLOR);
 		widget++;
 	}
+}
 
-	/* Now draw the window list */
+static void draw_window_list(void) {
+	uint32_t txt_color = TEXT_COLOR;
 	int i = 0, j = 0;
 	spin_lock(&lock);
 	if (window_list) {
 		foreach(node, window_list) {
 			struct window_ad * ad = node->value;
 			char * s = "";
-			char tmp_title[50];
 			int w = 0;
 
 			if (APP_OFFSET + i + w > LEFT_BOUND) {
 				break;
 			}
 
-			if (title_width > MIN_TEXT_WIDTH) {
-
-				memset(tmp_title, 0x0, 50);
-				int t_l = strlen(ad->name);
-				if (t_l > 45) {
-					t_l = 45;
-				}
-				for (int i = 0; i < t_l;  ++i) {
-					tmp_title[i] = ad->name[i];
-					if (!ad->name[i]) break;
-				}
-
-				while (draw_sdf_string_width(tmp_title, 16, SDF_FONT_THIN) > title_width - ICON_PADDING) {
-					t_l--;
-					tmp_title[t_l] = '.';
-					tmp_title[t_l+1] = '.';
-					tmp_title[t_l+2] = '.';
-					tmp_title[t_l+3] = '\0';
-				}
+			if (title_width > MIN_TEXT_WIDTH && ad->title) {
 				w += title_width;
-
-				s = tmp_title;
+				s = ad->title;
 			}
 
 			/* Hilight the focused window */
@@ -898,39 +947,28 @@ static void redraw(void) {
 				}
 			}
 
-			/* Get the icon for this window */
-			sprite_t * icon = icon_get_48(ad->icon);
-
-			{
-				sprite_t * _tmp_s = create_sprite(48, PANEL_HEIGHT-2, ALPHA_EMBEDDED);
-				gfx_context_t * _tmp = init_graphics_sprite(_tmp_s);
-
-				draw_fill(_tmp, rgba(0,0,0,0));
-				/* Draw it, scaled if necessary */
-				if (icon->width == 48) {
-					draw_sprite(_tmp, icon, 0, 0);
-				} else {
-					draw_sprite_scaled(_tmp, icon, 0, 0, 48, 48);
-				}
-
-				free(_tmp);
-				draw_sprite_alpha(ctx, _tmp_s, APP_OFFSET + i + w - 48 - 2, 0, 0.7);
-				sprite_free(_tmp_s);
+			/* The icon for this window */
+			if (ad->image) {
+				draw_sprite_alpha(ctx, ad->image, APP_OFFSET + i + w - 48 - 2, 0, 0.7);
 			}
 
+			if (w) {
+				if (!ad->shadow || ad->shadow->width != w || strcmp(ad->shadow_title, s)) {
+					if (ad->shadow) {
+						sprite_free(ad->shadow);
+						free(ad->shadow_title);
+					}
+					ad->shadow = create_sprite(w, PANEL_HEIGHT, ALPHA_EMBEDDED);
+					ad->shadow_title = strdup(s);
+					gfx_context_t * _tmp = init_graphics_sprite(ad->shadow);
 
-			{
-				sprite_t * _tmp_s = create_sprite(w, PANEL_HEIGHT, ALPHA_EMBEDDED);
-				gfx_context_t * _tmp = init_graphics_sprite(_tmp_s);
-
-				draw_fill(_tmp, rgba(0,0,0,0));
-				draw_sdf_string(_tmp, 0, 0, s, 16, rgb(0,0,0), SDF_FONT_THIN);
-				blur_context_box(_tmp, 4);
-
-				free(_tmp);
-				draw_sprite(ctx, _tmp_s, APP_OFFSET + i + 2, TEXT_Y_OFFSET + 2);
-				sprite_free(_tmp_s);
+					draw_fill(_tmp, rgba(0,0,0,0));
+					draw_sdf_string(_tmp, 0, 0, s, 16, rgb(0,0,0), SDF_FONT_THIN);
+					blur_context_box(_tmp, 4);
 
+					free(_tmp);
+				}
+				draw_sprite(ctx, ad->shadow, APP_OFFSET + i + 2, TEXT_Y_OFFSET + 2);
 			}
 
 			if (title_width > MIN_TEXT_WIDTH) {
@@ -961,17 +999,161 @@ static void redraw(void) {
 		}
 	}
 	spin_unlock(&lock);
+}
 
-	/* Draw the logout button; XXX This should probably have some sort of focus hilight */
-	draw_sprite_alpha_paint(ctx, sprite_logout, width - 23, 1, 1.0, (logout_menu->window ? HILIGHT_COLOR : ICON_COLOR)); /* Logout button */
+/* Redraw whichever parts of the panel have changed */
+static void redraw(void) {
+	spin_lock(&drawlock);
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	int appmenu_open = appmenu->window != NULL;
+	int logout_open = logout_menu->window != NULL;
+	int widgets = widgets_state();
+
+	if (appmenu_open != drawn_appmenu) panel_dirty |= PANEL_APPMENU;
+	if (widgets != drawn_widgets) panel_dirty |= PANEL_WIDGETS;
+	if (now.tv_sec != drawn_clock || logout_open != drawn_logout) panel_dirty |= PANEL_CLOCK;
+
+	int parts = panel_dirty;
+	panel_dirty = 0;
+
+	if (!parts) {
+		spin_unlock(&drawlock);
+		return;
+	}
+
+	drawn_appmenu = appmenu_open;
+	drawn_widgets = widgets;
+	drawn_clock = now.tv_sec;
+	drawn_logout = logout_open;
+
+	if (parts == PANEL_ALL) {
+		/* Redraw the background */
+		memcpy(ctx->backbuffer, bg_blob, bg_size);
+	} else {
+		/* Keep drawing and flipping to the parts being redrawn */
+		for (int part = 1; part < PANEL_ALL; part <<= 1) {
+			if (!(parts & part)) continue;
+			int x, w;
+			part_bounds(part, &x, &w);
+			gfx_add_clip(ctx, x, 0, w, PANEL_HEIGHT);
+			for (int y = 0; y < PANEL_HEIGHT; ++y) {
+				memcpy(&GFX(ctx, x, y), &((uint32_t *)bg_blob)[y * ctx->width + x], w * sizeof(uint32_t));
+			}
+		}
+	}
+
+	if (parts & PANEL_CLOCK) {
+		draw_clock(&now);
+	}
+
+	if (parts & PANEL_APPMENU) {
+		/* Applications menu */
+		draw_sdf_string(ctx, 8, 3, "Applications", 20, appmenu_open ? HILIGHT_COLOR : TEXT_COLOR, SDF_FONT_THIN);
+	}
+
+	if (parts & PANEL_WIDGETS) {
+		draw_widgets();
+	}
+
+	if (parts & PANEL_WINDOWS) {
+		draw_window_list();
+	}
 
 	/* Flip */
 	flip(ctx);
-	yutani_flip(yctx, panel);
+	if (parts == PANEL_ALL) {
+		yutani_flip(yctx, panel);
+	} else {
+		for (int part = 1; part < PANEL_ALL; part <<= 1) {
+			if (!(parts & part)) continue;
+			int x, w;
+			part_bounds(part, &x, &w);
+			if (w) yutani_flip_region(yctx, panel, x, 0, w, PANEL_HEIGHT);
+		}
+		gfx_no_clip(ctx);
+	}
 
 	spin_unlock(&drawlock);
 }
 
+/* Shorten a window's name to fit the current cell width */
+static void layout_title(struct window_ad * ad) {
+	char tmp_title[50];
+
+	memset(tmp_title, 0x0, 50);
+	int t_l = strlen(ad->name);
+	if (t_l > 45) {
+		t_l = 45;
+	}
+	for (int i = 0; i < t_l;  ++i) {
+		tmp_title[i] = ad->name[i];
+		if (!ad->name[i]) break;
+	}
+
+	while (draw_sdf_string_width(tmp_title, 16, SDF_FONT_THIN) > title_width - ICON_PADDING) {
+		t_l--;
+		tmp_title[t_l] = '.';
+		tmp_title[t_l+1] = '.';
+		tmp_title[t_l+2] = '.';
+		tmp_title[t_l+3] = '\0';
+	}
+
+	ad->title = strdup(tmp_title);
+	ad->title_cell = title_width;
+}
+
+/* Get a window's icon ready to draw */
+static void layout_image(struct window_ad * ad) {
+	sprite_t * icon = icon_get_48(ad->icon);
+
+	ad->image = create_sprite(48, PANEL_HEIGHT-2, ALPHA_EMBEDDED);
+	gfx_context_t * _tmp = init_graphics_sprite(ad->image);
+
+	draw_fill(_tmp, rgba(0,0,0,0));
+	/* Draw it, scaled if necessary */
+	if (icon->width == 48) {
+		draw_sprite(_tmp, icon, 0, 0);
+	} else {
+		draw_sprite_scaled(_tmp, icon, 0, 0, 48, 48);
+	}
+
+	free(_tmp);
+}
+
+/*
+ * Hand whatever is still good from a window's old advertisement over
+ * to its new one (or NULL if it's gone), and free the rest.
+ */
+static void window_ad_hand_on(struct window_ad * ad, struct window_ad * keep) {
+	if (ad->shadow) {
+		if (keep) {
+			keep->shadow = ad->shadow;
+			keep->shadow_title = ad->shadow_title;
+		} else {
+			sprite_free(ad->shadow);
+			free(ad->shadow_title);
+		}
+	}
+	if (ad->image) {
+		if (keep && !strcmp(keep->icon, ad->icon)) {
+			keep->image = ad->image;
+		} else {
+			sprite_free(ad->image);
+		}
+	}
+	if (ad->title) {
+		if (keep && ad->title_cell == title_width && !strcmp(keep->name, ad->name)) {
+			keep->title = ad->title;
+			keep->title_cell = ad->title_cell;
+		} else {
+			free(ad->title);
+		}
+	}
+}
+
 static void update_window_list(void) {
 	yutani_query_windows(yctx);
 
@@ -999,6 +1181,11 @@ static void update_window_list(void) {
 		ad->strings = s;
 		ad->flags = wa->flags;
 		ad->wid = wa->wid;
+		ad->shadow = NULL;
+		ad->shadow_title = NULL;
+		ad->title = NULL;
+		ad->title_cell = 0;
+		ad->image = NULL;
 
 		ads_by_z[i] = ad;
 		i++;
@@ -1062,6 +1249,16 @@ static void update_window_list(void) {
 	if (window_list) {
 		foreach(node, window_list) {
 			struct window_ad * ad = (void*)node->value;
+			/* Find the window in the new list, if it's still around */
+			struct window_ad * keep = NULL;
+			foreach(nnode, new_window_list) {
+				struct window_ad * n = nnode->value;
+				if (n->wid == ad->wid) {
+					keep = n;
+					break;
+				}
+			}
+			window_ad_hand_on(ad, keep);
 			free(ad->strings);
 			free(ad);
 		}
@@ -1069,9 +1266,21 @@ static void update_window_list(void) {
 		free(window_list);
 	}
 	window_list = new_window_list;
+
+	/* Lay out anything new */
+	foreach(node, window_list) {
+		struct window_ad * ad = node->value;
+		if (!ad->image) {
+			layout_image(ad);
+		}
+		if (!ad->title && title_width > MIN_TEXT_WIDTH) {
+			layout_title(ad);
+		}
+	}
 	spin_unlock(&lock);
 
 	/* And redraw the panel */
+	panel_dirty |= PANEL_WINDOWS;
 	redraw();
 }
 
@@ -1094,8 +1303,8 @@ static void resize_finish(int xwidth, int xheight) {
 	bg_blob = realloc(bg_blob, bg_size);
 	memcpy(bg_blob, ctx->backbuffer, bg_size);
 
+	panel_dirty = PANEL_ALL;
 	update_window_list();
-	redraw();
 }
 
 static void bind_keys(void) {
@@ -1282,6 +1491,8 @@ int main (int argc, char ** argv) {
 				free(m);
 				m = yutani_poll_async(yctx);
 			}
+			/* Menus opening or closing change the panel */
+			redraw();
 		} else {
 			struct timeval now;
 			gettimeofday(&now, NULL);
@@ -19,7 +19,7 @@
 #include <toaru/spinlock.h>
 #include <toaru/menu.h>
 
-#define dist(a,b,c,d) sqrt((double)(((a) - (c)) * ((a) - (c)) + ((b) - (d)) * ((b) - (d))))
+#define dist2(a,b,c,d) ((float)(((a) - (c)) * ((a) - (c)) + ((b) - (d)) * ((b) - (d))))
 
 static yutani_t * yctx;
 static yutani_window_t * wina;
@@ -33,6 +33,11 @@ uint16_t off_y;
 
 static int volatile draw_lock = 0;
 
+/* Set when the compositor says the last frame is on screen */
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_cond = PTHREAD_COND_INITIALIZER;
+static int frame_done = 0;
+
 gfx_context_t * ctx;
 
 void redraw_borders() {
@@ -58,7 +63,9 @@ uint32_t hsv_to_rgb(int h, float s, float v) {
 void * draw_thread(void * garbage) {
 	(void)garbage;
 
-	double time = 0;
+	float time = 0;
+	float * row = NULL;
+	int row_size = 0;
 
 	/* Generate a palette */
 	uint32_t palette[256];
@@ -68,24 +75,57 @@ void * draw_thread(void * garbage) {
 
 	while (!should_exit) {
 
-		time += 1.0;
+		time += 1.0f;
 
 		spin_lock(&draw_lock);
-		for (int x = 0; x < win_width; ++x) {
-			for (int y = 0; y < win_height; ++y) {
-				double value = sin(dist(x + time, y, 128.0, 128.0) / 8.0)
-					+ sin(dist(x, y, 64.0, 64.0) / 8.0)
-					+ sin(dist(x, y + time / 7, 192.0, 64) / 7.0)
-					+ sin(dist(x, y, 192.0, 100.0) / 8.0);
-				GFX(ctx, x + off_x, y + off_y) = palette[(int)((value + 4) * 32)];
+		if (win_width > row_size) {
+			row_size = win_width;
+			row = realloc(row, sizeof(float) * 4 * row_size);
+		}
+		for (int y = 0; y < win_height; ++y) {
+			/* The four waves for the whole row, one after another */
+			float * a = row;
+			float * b = row + win_width;
+			float * c = row + win_width * 2;
+			float * d = row + win_width * 3;
+			for (int x = 0; x < win_width; ++x) {
+				a[x] = dist2(x + time, y, 128.0f, 128.0f);
+				b[x] = dist2(x, y, 64.0f, 64.0f);
+				c[x] = dist2(x, y + time / 7, 192.0f, 64.0f);
+				d[x] = dist2(x, y, 192.0f, 100.0f);
+			}
+			vsqrtf(row, row, win_width * 4);
+			for (int x = 0; x < win_width; ++x) {
+				a[x] /= 8.0f;
+				b[x] /= 8.0f;
+				c[x] /= 7.0f;
+				d[x] /= 8.0f;
+			}
+			vsinf(row, row, win_width * 4);
+			for (int x = 0; x < win_width; ++x) {
+				int value = (a[x] + b[x] + c[x] + d[x] + 4) * 32;
+				GFX(ctx, x + off_x, y + off_y) = palette[value > 255 ? 255 : value];
 			}
 		}
 		redraw_borders();
 		flip(ctx);
+		frame_done = 0;
 		yutani_flip(yctx, wina);
+		int paced = !yutani_window_request_frame(yctx, wina);
 		spin_unlock(&draw_lock);
-		sched_yield();
+
+		if (paced) {
+			/* Draw the next one when this one has been shown */
+			pthread_mutex_lock(&frame_lock);
+			while (!frame_done && !should_exit) {
+				pthread_cond_wait(&frame_cond, &frame_lock);
+			}
+			pthread_mutex_unlock(&frame_lock);
+		} else {
+			sched_yield();
+		}
 	}
+	free(row);
 	return NULL;
 }
 
@@ -163,6 +203,12 @@ int main (int argc, char ** argv) {
 						}
 					}
 					break;
+				case YUTANI_MSG_WINDOW_FRAME:
+					pthread_mutex_lock(&frame_lock);
+					frame_done = 1;
+					pthread_cond_signal(&frame_cond);
+					pthread_mutex_unlock(&frame_lock);
+					break;
 				case YUTANI_MSG_WINDOW_CLOSE:
 				case YUTANI_MSG_SESSION_END:
 					should_exit = 1;
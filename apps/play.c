@@ -5,24 +5,67 @@
  *
  * play - Play back PCM samples
  *
- * This needs very specifically-formatted PCM data to function
- * properly - 16-bit, signed, stereo, little endian, and 48KHz.
+ * Plays raw PCM data; 16-bit, signed, stereo, little endian, and
+ * 48KHz unless told otherwise. Other formats are converted by the
+ * kernel as they are written to /dev/dsp.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <sys/ioctl.h>
+#include <kernel/mod/sound.h>
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"play - play back PCM samples\n"
+			"\n"
+			"usage: %s [-r RATE] [-c CHANNELS] [-b BITS] FILE\n"
+			"\n"
+			" -r     \033[3msample rate (default 48000)\033[0m\n"
+			" -c     \033[3mchannels, 1 or 2 (default 2)\033[0m\n"
+			" -b     \033[3mbits per sample, 8 or 16 (default 16)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			"FILE may be - for standard input.\n"
+			"\n", argv[0]);
+}
 
 int main(int argc, char * argv[]) {
+	snd_dsp_format_t format = { 48000, 2, 16 };
+
+	int c;
+	while ((c = getopt(argc, argv, "r:c:b:?")) != -1) {
+		switch (c) {
+			case 'r':
+				format.rate = atoi(optarg);
+				break;
+			case 'c':
+				format.channels = atoi(optarg);
+				break;
+			case 'b':
+				format.bits = atoi(optarg);
+				break;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	if (optind >= argc) {
+		show_usage(argc, argv);
+		return 1;
+	}
+
 	int spkr = open("/dev/dsp", O_WRONLY);
 	int song;
-	if (!strcmp(argv[1], "-")) {
+	if (!strcmp(argv[optind], "-")) {
 		song = STDIN_FILENO;
 	} else {
-		song = open(argv[1], O_RDONLY);
+		song = open(argv[optind], O_RDONLY);
 	}
 
 	if (spkr == -1) {
@@ -30,6 +73,11 @@ int main(int argc, char * argv[]) {
 		return 1;
 	}
 
+	if (ioctl(spkr, SND_DSP_SET_FORMAT, &format) < 0) {
+		fprintf(stderr, "%s: can't play this format\n", argv[0]);
+		return 1;
+	}
+
 	if (song == -1) {
 		fprintf(stderr, "audio file not found\n");
 		return 2;
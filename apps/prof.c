@@ -0,0 +1,255 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * prof - Sample where the system spends its time
+ *
+ * Runs the kernel profiler (/dev/prof, from prof.ko) for a while and
+ * then lists the hottest kernel functions, looked up in /proc/ksyms,
+ * and how many samples landed in each process's userspace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/prof.h>
+
+struct symbol {
+	uintptr_t addr;
+	char * name;
+	int self;      /* Samples that were in this function */
+	int total;     /* Samples with this function anywhere in the chain */
+	int seen;      /* Last sample that counted towards total */
+};
+
+struct user_count {
+	int pid;
+	int count;
+};
+
+static struct symbol * symbols = NULL;
+static int symbol_count = 0;
+
+static struct user_count * users = NULL;
+static int user_count = 0;
+
+void show_usage(int argc, char * argv[]) {
+	printf(
+			"prof - sample kernel and process activity\n"
+			"\n"
+			"usage: %s [-g] [-r RATE] [-n COUNT] [SECONDS]\n"
+			"\n"
+			" -g     \033[3malso count callers, from frame pointer call chains\033[0m\n"
+			" -r     \033[3msamples per second (default %d, at most %d)\033[0m\n"
+			" -n     \033[3mshow this many functions (default 20)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			"Samples for SECONDS seconds (default 5). Needs prof.ko.\n"
+			"\n", argv[0], PROF_DEFAULT_RATE, PROF_MAX_RATE);
+}
+
+static int compare_addr(const void * a, const void * b) {
+	const struct symbol * x = a, * y = b;
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int compare_self(const void * a, const void * b) {
+	const struct symbol * x = a, * y = b;
+	return y->self - x->self;
+}
+
+static int compare_total(const void * a, const void * b) {
+	const struct symbol * x = a, * y = b;
+	return y->total - x->total;
+}
+
+static int compare_users(const void * a, const void * b) {
+	const struct user_count * x = a, * y = b;
+	return y->count - x->count;
+}
+
+static void load_symbols(void) {
+	FILE * f = fopen("/proc/ksyms", "r");
+	if (!f) return;
+
+	int space = 1024;
+	symbols = malloc(sizeof(struct symbol) * space);
+
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		char * name = strchr(line, ' ');
+		if (!name) continue;
+		*name++ = '\0';
+		char * nl = strchr(name, '\n');
+		if (nl) *nl = '\0';
+
+		if (symbol_count == space) {
+			space *= 2;
+			symbols = realloc(symbols, sizeof(struct symbol) * space);
+		}
+		symbols[symbol_count].addr = strtoul(line, NULL, 16);
+		symbols[symbol_count].name = strdup(name);
+		symbols[symbol_count].self = 0;
+		symbols[symbol_count].total = 0;
+		symbols[symbol_count].seen = -1;
+		symbol_count++;
+	}
+	fclose(f);
+
+	qsort(symbols, symbol_count, sizeof(struct symbol), compare_addr);
+}
+
+/* The symbol an address falls in: the last one starting at or before it */
+static struct symbol * find_symbol(uintptr_t addr) {
+	int lo = 0, hi = symbol_count - 1;
+	struct symbol * best = NULL;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (symbols[mid].addr <= addr) {
+			best = &symbols[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return best;
+}
+
+static void count_user(int pid) {
+	for (int i = 0; i < user_count; ++i) {
+		if (users[i].pid == pid) {
+			users[i].count++;
+			return;
+		}
+	}
+	users = realloc(users, sizeof(struct user_count) * (user_count + 1));
+	users[user_count].pid = pid;
+	users[user_count].count = 1;
+	user_count++;
+}
+
+static uint64_t now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int main(int argc, char * argv[]) {
+	int callers = 0;
+	int rate = PROF_DEFAULT_RATE;
+	int show = 20;
+
+	int c;
+	while ((c = getopt(argc, argv, "gr:n:?")) != -1) {
+		switch (c) {
+			case 'g':
+				callers = 1;
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'n':
+				show = atoi(optarg);
+				break;
+			case '?':
+				show_usage(argc, argv);
+				return 0;
+		}
+	}
+
+	int seconds = optind < argc ? atoi(argv[optind]) : 5;
+
+	int fd = open("/dev/prof", O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: /dev/prof: not available (is prof.ko loaded?)\n", argv[0]);
+		return 1;
+	}
+
+	load_symbols();
+
+	if (ioctl(fd, IOCTL_PROF_START, &rate) < 0) {
+		perror("prof: start");
+		return 1;
+	}
+
+	int kernel_samples = 0;
+	int user_samples = 0;
+	int sample_index = 0;
+	struct prof_sample buf[64];
+
+	uint64_t deadline = now_ms() + seconds * 1000;
+	int stopped = 0;
+
+	while (1) {
+		if (!stopped) {
+			uint64_t now = now_ms();
+			if (now >= deadline) {
+				ioctl(fd, IOCTL_PROF_STOP, NULL);
+				stopped = 1;
+			} else {
+				struct pollfd p = { fd, POLLIN, 0 };
+				if (poll(&p, 1, (int)(deadline - now)) <= 0) continue;
+			}
+		}
+
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r <= 0) {
+			if (stopped) break;
+			continue;
+		}
+
+		for (unsigned int i = 0; i < r / sizeof(struct prof_sample); ++i, ++sample_index) {
+			struct prof_sample * s = &buf[i];
+			if (s->flags & PROF_USER) {
+				count_user(s->pid);
+				user_samples++;
+				continue;
+			}
+			kernel_samples++;
+			for (int j = 0; j < s->frames && (j == 0 || callers); ++j) {
+				struct symbol * sym = find_symbol(s->chain[j]);
+				if (!sym) continue;
+				if (j == 0) sym->self++;
+				if (sym->seen != sample_index) {
+					sym->seen = sample_index;
+					sym->total++;
+				}
+			}
+		}
+	}
+
+	int dropped = ioctl(fd, IOCTL_PROF_DROPPED, NULL);
+	close(fd);
+
+	int total = kernel_samples + user_samples;
+	printf("%d samples (%d kernel, %d user)", total, kernel_samples, user_samples);
+	if (dropped > 0) printf(", %d dropped", dropped);
+	printf("\n");
+	if (!total) return 0;
+
+	printf("\nKernel:\n");
+	qsort(symbols, symbol_count, sizeof(struct symbol), callers ? compare_total : compare_self);
+	for (int i = 0; i < show && i < symbol_count; ++i) {
+		struct symbol * sym = &symbols[i];
+		if (!sym->self && !sym->total) break;
+		if (callers) {
+			printf(" %5.1f%% %5.1f%%  %s\n", 100.0 * sym->self / total, 100.0 * sym->total / total, sym->name);
+		} else {
+			printf(" %5.1f%%  %s\n", 100.0 * sym->self / total, sym->name);
+		}
+	}
+
+	printf("\nUser:\n");
+	qsort(users, user_count, sizeof(struct user_count), compare_users);
+	for (int i = 0; i < show && i < user_count; ++i) {
+		printf(" %5.1f%%  pid %d\n", 100.0 * users[i].count / total, users[i].pid);
+	}
+
+	return 0;
+}
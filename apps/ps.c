@@ -16,12 +16,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <pwd.h>
 
 #include <toaru/list.h>
-
-#define LINE_LEN 4096
+#include <kernel/mod/procsnap.h>
 
 static int show_all = 0;
 static int show_threads = 0;
@@ -29,7 +27,7 @@ static int show_username = 0;
 static int show_mem = 0;
 static int collect_commandline = 0;
 
-static int widths[] = {3,3,4,3,3,4};
+static int widths[] = {3,3,4,3,3,4,4};
 
 struct process {
 	int uid;
@@ -38,6 +36,7 @@ struct process {
 	int mem;
 	int vsz;
 	int shm;
+	int cpu_ms;
 	char * process;
 	char * command_line;
 };
@@ -54,49 +53,54 @@ void print_username(int uid) {
 	endpwent();
 }
 
-struct process * process_entry(struct dirent *dent) {
-	char tmp[256];
-	FILE * f;
-	char line[LINE_LEN];
-
-	int pid = 0, uid = 0, tgid = 0, mem = 0, shm = 0, vsz = 0;
-	char name[100];
+/* CPU time as minutes:seconds */
+static int print_time(char * out, int ms) {
+	return sprintf(out, "%d:%02d", ms / 60000, (ms / 1000) % 60);
+}
 
-	sprintf(tmp, "/proc/%s/status", dent->d_name);
-	f = fopen(tmp, "r");
+/*
+ * All of /proc/snapshot, in one read so that it all comes from the same
+ * moment; if the buffer was too small for it, read it again.
+ */
+static procsnap_header_t * read_snapshot(void) {
+	size_t size = 16384;
 
-	if (!f) {
-		return NULL;
-	}
+	for (int tries = 0; ; ++tries) {
+		int fd = open("/proc/snapshot", O_RDONLY);
+		if (fd < 0) return NULL;
 
-	line[0] = 0;
+		char * buf = malloc(size);
+		ssize_t r = read(fd, buf, size);
+		close(fd);
 
-	while (fgets(line, LINE_LEN, f) != NULL) {
-		char * n = strstr(line,"\n");
-		if (n) { *n = '\0'; }
-		char * tab = strstr(line,"\t");
-		if (tab) {
-			*tab = '\0';
-			tab++;
+		procsnap_header_t * header = (procsnap_header_t *)buf;
+		if (r < (ssize_t)sizeof(procsnap_header_t)) {
+			free(buf);
+			return NULL;
 		}
-		if (strstr(line, "Pid:") == line) {
-			pid = atoi(tab);
-		} else if (strstr(line, "Uid:") == line) {
-			uid = atoi(tab);
-		} else if (strstr(line, "Tgid:") == line) {
-			tgid = atoi(tab);
-		} else if (strstr(line, "Name:") == line) {
-			strcpy(name, tab);
-		} else if (strstr(line, "VmSize:") == line) {
-			vsz = atoi(tab);
-		} else if (strstr(line, "RssShmem:") == line) {
-			shm = atoi(tab);
-		} else if (strstr(line, "MemPermille:") == line) {
-			mem = atoi(tab);
+
+		size_t needed = header->header_size + header->count * header->entry_size;
+		if ((size_t)r >= needed) {
+			/* The kernel ran out of room for some processes; ask again */
+			if (header->total <= header->count) return header;
+			if (tries >= 4) {
+				fprintf(stderr, "ps: warning: only %u of %u processes listed\n",
+					(unsigned int)header->count, (unsigned int)header->total);
+				return header;
+			}
+			needed = header->header_size + header->total * header->entry_size;
 		}
+
+		free(buf);
+		size = needed * 2;
 	}
+}
+
+struct process * process_entry(procsnap_entry_t * e) {
+	char tmp[256];
+	FILE * f;
 
-	fclose(f);
+	int pid = e->pid, uid = e->uid, tgid = e->tgid;
 
 	if (!show_all) {
 		/* Filter not ours */
@@ -111,10 +115,11 @@ struct process * process_entry(struct dirent *dent) {
 	out->uid = uid;
 	out->pid = tgid;
 	out->tid = pid;
-	out->mem = mem;
-	out->shm = shm;
-	out->vsz = vsz;
-	out->process = strdup(name);
+	out->mem = e->mem_permille;
+	out->shm = e->rss_shmem;
+	out->vsz = e->vm_size;
+	out->cpu_ms = e->utime_ms + e->stime_ms;
+	out->process = strdup(e->name);
 	out->command_line = NULL;
 
 	char garbage[1024];
@@ -125,6 +130,7 @@ struct process * process_entry(struct dirent *dent) {
 	if ((len = sprintf(garbage, "%d", out->vsz)) > widths[3]) widths[3] = len;
 	if ((len = sprintf(garbage, "%d", out->shm)) > widths[4]) widths[4] = len;
 	if ((len = sprintf(garbage, "%d.%01d", out->mem / 10, out->mem % 10)) > widths[5]) widths[5] = len;
+	if ((len = print_time(garbage, out->cpu_ms)) > widths[6]) widths[6] = len;
 
 	struct passwd * p = getpwuid(out->uid);
 	if (p) {
@@ -135,8 +141,10 @@ struct process * process_entry(struct dirent *dent) {
 	endpwent();
 
 	if (collect_commandline) {
-		sprintf(tmp, "/proc/%s/cmdline", dent->d_name);
+		/* Not in the snapshot, and the process may be gone by now */
+		sprintf(tmp, "/proc/%d/cmdline", pid);
 		f = fopen(tmp, "r");
+		if (!f) return out;
 		char foo[1024];
 		int s = fread(foo, 1, 1024, f);
 		if (s > 0) {
@@ -169,6 +177,7 @@ void print_header(void) {
 		printf("%*s ", widths[5], "MEM%");
 		printf("%*s ", widths[3], "VSZ");
 		printf("%*s ", widths[4], "SHM");
+		printf("%*s ", widths[6], "TIME");
 	}
 	printf("CMD\n");
 }
@@ -193,6 +202,9 @@ void print_entry(struct process * out) {
 		printf("%*s ", widths[5], tmp);
 		printf("%*d ", widths[3], out->vsz);
 		printf("%*d ", widths[4], out->shm);
+		char cpu[32];
+		print_time(cpu, out->cpu_ms);
+		printf("%*s ", widths[6], cpu);
 	}
 	if (out->command_line) {
 		printf("%s\n", out->command_line);
@@ -254,24 +266,21 @@ int main (int argc, char * argv[]) {
 		}
 	}
 
-	/* Open the directory */
-	DIR * dirp = opendir("/proc");
+	procsnap_header_t * header = read_snapshot();
+	if (!header) {
+		fprintf(stderr, "%s: can't read /proc/snapshot\n", argv[0]);
+		return 1;
+	}
 
-	/* Read the entries in the directory */
 	list_t * ents_list = list_create();
 
-	struct dirent * ent = readdir(dirp);
-	while (ent != NULL) {
-		if (ent->d_name[0] >= '0' && ent->d_name[0] <= '9') {
-			struct process * p = process_entry(ent);
-			if (p) {
-				list_insert(ents_list, (void *)p);
-			}
+	char * at = (char *)header + header->header_size;
+	for (uint32_t i = 0; i < header->count; ++i, at += header->entry_size) {
+		struct process * p = process_entry((procsnap_entry_t *)at);
+		if (p) {
+			list_insert(ents_list, (void *)p);
 		}
-
-		ent = readdir(dirp);
 	}
-	closedir(dirp);
 
 	print_header();
 	foreach(entry, ents_list) {
@@ -28,6 +28,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <spawn.h>
+#include <libgen.h>
+#include <syscall.h>
 
 #include <sys/time.h>
 #include <sys/wait.h>
@@ -62,6 +65,24 @@ char ** shell_descript;          /* Command descriptions */
 /* This is the number of actual commands installed */
 int shell_commands_len = 0;
 
+/* Builtins by name, for dispatch */
+static hashmap_t * shell_builtins = NULL;
+
+/*
+ * Commands from $PATH are only read when something first needs the
+ * full list (completion, highlighting), and are read again whenever
+ * $PATH or the modification time of one of its directories changes.
+ */
+struct path_dir {
+	char * path;
+	time_t mtime;
+};
+
+static char * path_scanned = NULL; /* $PATH as of the last scan */
+static struct path_dir * path_dirs = NULL;
+static int path_dirs_len = 0;
+static int path_stale = 1;
+
 int shell_interactive = 1;
 int last_ret = 0;
 char ** shell_argv = NULL;
@@ -127,17 +148,17 @@ void shell_install_command(char * name, shell_command_t func, char * desc) {
 	shell_pointers[shell_commands_len] = func;
 	shell_descript[shell_commands_len] = desc;
 	shell_commands_len++;
+	if (func) {
+		hashmap_set(shell_builtins, name, (void *)func);
+	}
 }
 
 shell_command_t shell_find(char * str) {
-	for (int i = 0; i < shell_commands_len; ++i) {
-		if (!strcmp(str, shell_commands[i])) {
-			return shell_pointers[i];
-		}
-	}
-	return NULL;
+	return (shell_command_t)hashmap_get(shell_builtins, str);
 }
 
+void shell_commands_update(void);
+
 void install_commands();
 
 /* Maximum command length */
@@ -472,12 +493,27 @@ void tab_complete_func(rline_context_t * c) {
 	if (complete_mode == COMPLETE_COMMAND) {
 		/* Complete a command name */
 
-		for (int i = 0; i < shell_commands_len; ++i) {
-			if (strstr(shell_commands[i], prefix) == shell_commands[i]) {
-				list_insert(matches, shell_commands[i]);
-				match = shell_commands[i];
+		shell_commands_update();
+		if (experimental_rline) {
+			/* The list may have moved while the line editor was holding it */
+			rline_exp_set_shell_commands(shell_commands, shell_commands_len);
+		}
+
+		/* The list is sorted, so everything starting with prefix is one run */
+		size_t prefix_len = strlen(prefix);
+		int lo = 0, hi = shell_commands_len;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (strcmp(shell_commands[mid], prefix) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
 			}
 		}
+		for (int i = lo; i < shell_commands_len && !strncmp(shell_commands[i], prefix, prefix_len); ++i) {
+			list_insert(matches, shell_commands[i]);
+			match = shell_commands[i];
+		}
 	} else if (complete_mode == COMPLETE_FILE) {
 		/* Complete a file path */
 
@@ -690,6 +726,7 @@ int read_entry(char * buffer) {
 		rline_exit_string="exit";
 		rline_exp_set_syntax("esh");
 		rline_exp_set_prompts(lprompt, rprompt, lwidth, rwidth);
+		shell_commands_update();
 		rline_exp_set_shell_commands(shell_commands, shell_commands_len);
 		rline_exp_set_tab_complete_func(tab_complete_func);
 		return rline_experimental(buffer, LINE_LEN);
@@ -708,6 +745,7 @@ int read_entry_continued(char * buffer) {
 		rline_exit_string="exit";
 		rline_exp_set_syntax("esh");
 		rline_exp_set_prompts("> ", "", 2, 0);
+		shell_commands_update();
 		rline_exp_set_shell_commands(shell_commands, shell_commands_len);
 		rline_exp_set_tab_complete_func(tab_complete_func);
 		return rline_experimental(buffer, LINE_LEN);
@@ -804,6 +842,69 @@ void run_cmd(char ** args) {
 	exit(i);
 }
 
+/* The environment with a command's VAR=value assignments applied */
+static char ** spawn_environment(list_t * extra_env) {
+	int count = 0;
+	while (environ[count]) count++;
+
+	char ** envp = malloc(sizeof(char *) * (count + extra_env->length + 1));
+	memcpy(envp, environ, sizeof(char *) * count);
+
+	foreach (node, extra_env) {
+		char * c = node->value;
+		size_t len = strcspn(c, "=");
+		int i;
+		for (i = 0; i < count; ++i) {
+			if (!strncmp(envp[i], c, len) && envp[i][len] == '=') break;
+		}
+		envp[i] = c;
+		if (i == count) count++;
+	}
+	envp[count] = NULL;
+
+	return envp;
+}
+
+/*
+ * Start an external command without forking the shell. stdin and stdout
+ * come from in and out (-1 leaves them alone), the stage's redirections
+ * are opened for it, and it joins process group pgid (0 for a new one).
+ *
+ * Returns the new PID, or -1 if the command couldn't be started this
+ * way (a builtin, a missing program, a redirection that fails...), in
+ * which case nothing has been started and the caller should fork and
+ * run_cmd() as usual, which also takes care of reporting the problem.
+ */
+static int spawn_cmd(char ** args, list_t * extra_env, int pgid, int in, int out,
+		char * out_file, int out_flags, char * err_file, int err_flags) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+
+	if (shell_interactive == 1) {
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+		posix_spawnattr_setpgroup(&attr, pgid);
+	}
+
+	if (in != -1) posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+	if (out != -1) posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+	if (out_file) posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_file, out_flags, 0666);
+	if (err_file) posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, err_file, err_flags, 0666);
+
+	char ** envp = spawn_environment(extra_env);
+
+	pid_t child;
+	int err = posix_spawnp(&child, args[0], &actions, &attr, args, envp);
+
+	free(envp);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	return err ? -1 : child;
+}
+
 int is_number(const char * c) {
 	while (*c) {
 		if (!isdigit(*c)) return 0;
@@ -1393,26 +1494,32 @@ _nope:
 		int last_output[2];
 		pipe(last_output);
 
-		struct semaphore s = create_semaphore();
-		child_pid = fork();
-		if (!child_pid) {
-			set_pgid(0);
-			if (!nowait) set_pgrp(getpid());
-			raise_semaphore(s);
-			is_subshell = 1;
-			dup2(last_output[1], STDOUT_FILENO);
-			close(last_output[0]);
-			add_environment(extra_env);
-			run_cmd(arg_starts[0]);
+		int spawned = spawn_cmd(arg_starts[0], extra_env, 0, -1, last_output[1], NULL, 0, NULL, 0);
+		if (spawned > 0) {
+			child_pid = spawned;
+			if (!nowait) set_pgrp(child_pid);
+		} else {
+			struct semaphore s = create_semaphore();
+			child_pid = fork();
+			if (!child_pid) {
+				set_pgid(0);
+				if (!nowait) set_pgrp(getpid());
+				raise_semaphore(s);
+				is_subshell = 1;
+				dup2(last_output[1], STDOUT_FILENO);
+				close(last_output[0]);
+				add_environment(extra_env);
+				run_cmd(arg_starts[0]);
+			}
+			wait_semaphore(s);
 		}
-		wait_semaphore(s);
 
 		pgid = child_pid;
 
 		for (int j = 1; j < cmdi; ++j) {
 			int tmp_out[2];
 			pipe(tmp_out);
-			if (!fork()) {
+			if (spawn_cmd(arg_starts[j], extra_env, pgid, last_output[0], tmp_out[1], NULL, 0, NULL, 0) < 0 && !fork()) {
 				is_subshell = 1;
 				set_pgid(pgid);
 				dup2(tmp_out[1], STDOUT_FILENO);
@@ -1428,7 +1535,11 @@ _nope:
 			last_output[1] = tmp_out[1];
 		}
 
-		last_child = fork();
+		last_child = spawn_cmd(arg_starts[cmdi], extra_env, pgid, last_output[0], -1,
+			output_files[cmdi], file_args[cmdi], err_files[cmdi], err_args[cmdi]);
+		if (last_child < 0) {
+			last_child = fork();
+		}
 		if (!last_child) {
 			is_subshell = 1;
 			set_pgid(pgid);
@@ -1489,36 +1600,43 @@ _nope:
 			if (old_err != -1) dup2(old_err, STDERR_FILENO);
 			return result;
 		} else {
-			struct semaphore s = create_semaphore();
-			child_pid = fork();
-			if (!child_pid) {
-				set_pgid(0);
-				if (!nowait) set_pgrp(getpid());
-				raise_semaphore(s);
-				is_subshell = 1;
-				if (output_files[cmdi]) {
-					int fd = open(output_files[cmdi], file_args[cmdi], 0666);
-					if (fd < 0) {
-						fprintf(stderr, "sh: %s: %s\n", output_files[cmdi], strerror(errno));
-						return -1;
-					} else {
-						dup2(fd, STDOUT_FILENO);
+			int spawned = spawn_cmd(arg_starts[0], extra_env, 0, -1, -1,
+				output_files[cmdi], file_args[cmdi], err_files[cmdi], err_args[cmdi]);
+			if (spawned > 0) {
+				child_pid = spawned;
+				if (!nowait) set_pgrp(child_pid);
+			} else {
+				struct semaphore s = create_semaphore();
+				child_pid = fork();
+				if (!child_pid) {
+					set_pgid(0);
+					if (!nowait) set_pgrp(getpid());
+					raise_semaphore(s);
+					is_subshell = 1;
+					if (output_files[cmdi]) {
+						int fd = open(output_files[cmdi], file_args[cmdi], 0666);
+						if (fd < 0) {
+							fprintf(stderr, "sh: %s: %s\n", output_files[cmdi], strerror(errno));
+							return -1;
+						} else {
+							dup2(fd, STDOUT_FILENO);
+						}
 					}
-				}
-				if (err_files[cmdi]) {
-					int fd = open(err_files[cmdi], err_args[cmdi], 0666);
-					if (fd < 0) {
-						fprintf(stderr, "sh: %s: %s\n", err_files[cmdi], strerror(errno));
-						return -1;
-					} else {
-						dup2(fd, STDERR_FILENO);
+					if (err_files[cmdi]) {
+						int fd = open(err_files[cmdi], err_args[cmdi], 0666);
+						if (fd < 0) {
+							fprintf(stderr, "sh: %s: %s\n", err_files[cmdi], strerror(errno));
+							return -1;
+						} else {
+							dup2(fd, STDERR_FILENO);
+						}
 					}
+					add_environment(extra_env);
+					run_cmd(arg_starts[0]);
 				}
-				add_environment(extra_env);
-				run_cmd(arg_starts[0]);
-			}
 
-			wait_semaphore(s);
+				wait_semaphore(s);
+			}
 
 			pgid = child_pid;
 			last_child = child_pid;
@@ -1550,6 +1668,12 @@ _nope:
 }
 
 void add_path_contents(char * path) {
+	struct stat st;
+	path_dirs = realloc(path_dirs, sizeof(struct path_dir) * (path_dirs_len + 1));
+	path_dirs[path_dirs_len].path  = strdup(path);
+	path_dirs[path_dirs_len].mtime = stat(path, &st) ? 0 : st.st_mtime;
+	path_dirs_len++;
+
 	DIR * dirp = opendir(path);
 
 	if (!dirp) return; /* Failed to load directly */
@@ -1557,9 +1681,7 @@ void add_path_contents(char * path) {
 	struct dirent * ent = readdir(dirp);
 	while (ent != NULL) {
 		if (ent->d_name[0] != '.') {
-			char * s = malloc(sizeof(char) * (strlen(ent->d_name) + 1));
-			memcpy(s, ent->d_name, strlen(ent->d_name) + 1);
-			shell_install_command(s, NULL, NULL);
+			shell_install_command(strdup(ent->d_name), NULL, NULL);
 		}
 
 		ent = readdir(dirp);
@@ -1579,18 +1701,33 @@ static int comp_shell_commands(const void *p1, const void *p2) {
 }
 
 void sort_commands() {
-	struct command commands[SHELL_COMMANDS];
+	struct command * commands = malloc(sizeof(struct command) * shell_commands_len);
 	for (int i = 0; i < shell_commands_len; ++i) {
 		commands[i].string = shell_commands[i];
 		commands[i].func   = shell_pointers[i];
 		commands[i].desc   = shell_descript[i];
 	}
-	qsort(&commands, shell_commands_len, sizeof(struct command), comp_shell_commands);
+	qsort(commands, shell_commands_len, sizeof(struct command), comp_shell_commands);
+
+	/* Names found more than once only need to be listed once; builtins win */
+	int j = 0;
 	for (int i = 0; i < shell_commands_len; ++i) {
-		shell_commands[i] = commands[i].string;
-		shell_pointers[i] = commands[i].func;
-		shell_descript[i] = commands[i].desc;
+		if (j && !strcmp(commands[i].string, shell_commands[j-1])) {
+			if (commands[i].func && !shell_pointers[j-1]) {
+				free(shell_commands[j-1]);
+				j--;
+			} else {
+				if (!commands[i].func) free(commands[i].string);
+				continue;
+			}
+		}
+		shell_commands[j] = commands[i].string;
+		shell_pointers[j] = commands[i].func;
+		shell_descript[j] = commands[i].desc;
+		j++;
 	}
+	shell_commands_len = j;
+	free(commands);
 }
 
 void show_version(void) {
@@ -1608,6 +1745,9 @@ void show_usage(int argc, char * argv[]) {
 			" -R     \033[3mdisable experimental line editor\033[0m\n"
 			" -v     \033[3mshow version information\033[0m\n"
 			" -?     \033[3mshow this help text\033[0m\n"
+			"\n"
+			"echo, pwd, sleep and a few other simple utilities are run\n"
+			"inside the shell; set ESH_NO_BUILTIN_UTILS to use /bin instead.\n"
 			"\n", argv[0]);
 }
 
@@ -1615,12 +1755,16 @@ void add_path(void) {
 
 	char * envvar = getenv("PATH");
 
+	free(path_scanned);
+	path_scanned = envvar ? strdup(envvar) : NULL;
+
 	if (!envvar) {
 		add_path_contents("/bin");
 		return;
 	}
 
-	char * tmp = strdup(envvar);
+	char * path = strdup(envvar);
+	char * tmp = path;
 
 	do {
 		char * end = strstr(tmp,":");
@@ -1632,7 +1776,49 @@ void add_path(void) {
 		tmp = end;
 	} while (tmp);
 
-	free(tmp);
+	free(path);
+}
+
+static int path_changed(void) {
+	char * envvar = getenv("PATH");
+	if (!envvar != !path_scanned) return 1;
+	if (envvar && strcmp(envvar, path_scanned)) return 1;
+
+	for (int i = 0; i < path_dirs_len; ++i) {
+		struct stat st;
+		time_t mtime = stat(path_dirs[i].path, &st) ? 0 : st.st_mtime;
+		if (mtime != path_dirs[i].mtime) return 1;
+	}
+
+	return 0;
+}
+
+/* Make sure the command list reflects what is in $PATH right now */
+void shell_commands_update(void) {
+	if (!path_stale && !path_changed()) return;
+
+	/* Keep the builtins, forget everything else */
+	int j = 0;
+	for (int i = 0; i < shell_commands_len; ++i) {
+		if (shell_pointers[i]) {
+			shell_commands[j] = shell_commands[i];
+			shell_pointers[j] = shell_pointers[i];
+			shell_descript[j] = shell_descript[i];
+			j++;
+		} else {
+			free(shell_commands[i]);
+		}
+	}
+	shell_commands_len = j;
+
+	for (int i = 0; i < path_dirs_len; ++i) {
+		free(path_dirs[i].path);
+	}
+	path_dirs_len = 0;
+
+	add_path();
+	sort_commands();
+	path_stale = 0;
 }
 
 int run_script(FILE * f) {
@@ -1736,8 +1922,13 @@ int main(int argc, char ** argv) {
 	signal(SIGTTIN, SIG_IGN);
 
 	source_eshrc();
-	add_path();
-	sort_commands();
+
+	char * home = getenv("HOME");
+	if (home) {
+		char history[1024];
+		snprintf(history, sizeof(history), "%s/.esh_history", home);
+		rline_history_file(history);
+	}
 
 	while (1) {
 		char buffer[LINE_LEN] = {0};
@@ -2248,25 +2439,158 @@ uint32_t shell_cmd_jobs(int argc, char * argv[]) {
 	return 0;
 }
 
-uint32_t shell_cmd_rehash(int argc, char * argv[]) {
-	/* PATH commands are malloc'd */
-	for (int i = 0; i < shell_commands_len; ++i) {
-		if (!shell_pointers[i]) {
-			free(shell_commands[i]);
+/*
+ * Small utilities that scripts call all the time, done here so they
+ * don't each cost a fork and exec. They behave like their counterparts
+ * in /bin; set ESH_NO_BUILTIN_UTILS to use those instead.
+ */
+uint32_t shell_cmd_true(int argc, char * argv[]) {
+	return 0;
+}
+
+uint32_t shell_cmd_false(int argc, char * argv[]) {
+	return 1;
+}
+
+uint32_t shell_cmd_echo(int argc, char * argv[]) {
+	int use_newline     = 1;
+	int process_escapes = 0;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+		if (!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+		if (strspn(argv[i] + 1, "neh?") != strlen(argv[i] + 1)) break;
+		for (char * c = argv[i] + 1; *c; ++c) {
+			switch (*c) {
+				case 'n':
+					use_newline = 0;
+					break;
+				case 'e':
+					process_escapes = 1;
+					break;
+				default:
+					fprintf(stderr, "usage: %s [-ne] ARG...\n", argv[0]);
+					return 1;
+			}
 		}
 	}
-	/* Clear array */
-	shell_commands_len = 0;
-	/* Reset capacity */
-	SHELL_COMMANDS = 64;
-	/* Free existing */
-	free(shell_commands);
-	free(shell_pointers);
-	free(shell_descript);
-	/* Reallocate + install builtins */
-	install_commands();
-	/* Reload PATH */
-	add_path();
+
+	for (int first = i; i < argc; ++i) {
+		if (i != first) {
+			putchar(' ');
+		}
+		if (!process_escapes) {
+			fputs(argv[i], stdout);
+			continue;
+		}
+		for (char * c = argv[i]; *c; ++c) {
+			if (*c != '\\') {
+				putchar(*c);
+				continue;
+			}
+			c++;
+			switch (*c) {
+				case '\\': putchar('\\'); break;
+				case 'a': putchar('\a'); break;
+				case 'b': putchar('\b'); break;
+				case 'c': fflush(stdout); return 0;
+				case 'e': putchar('\033'); break;
+				case 'f': putchar('\f'); break;
+				case 'n': putchar('\n'); break;
+				case 't': putchar('\t'); break;
+				case 'v': putchar('\v'); break;
+				case '0':
+					{
+						int o = 0;
+						int digits = 0;
+						for (; digits < 3 && c[1] >= '0' && c[1] <= '7'; ++digits) {
+							c++;
+							o = (o << 3) | (*c - '0');
+						}
+						if (digits) putchar(o);
+					}
+					break;
+				case '\0':
+					putchar('\\');
+					c--;
+					break;
+				default:
+					putchar('\\');
+					putchar(*c);
+					break;
+			}
+		}
+	}
+
+	if (use_newline) {
+		putchar('\n');
+	}
+
+	fflush(stdout);
+	return 0;
+}
+
+uint32_t shell_cmd_pwd(int argc, char * argv[]) {
+	char tmp[1024];
+	if (!getcwd(tmp, 1023)) return 1;
+	puts(tmp);
+	fflush(stdout);
+	return 0;
+}
+
+uint32_t shell_cmd_basename(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "%s: expected argument\n", argv[0]);
+		return 1;
+	}
+
+	char * c = basename(argv[1]);
+
+	if (argc > 2) {
+		size_t len = strlen(c);
+		size_t suffix = strlen(argv[2]);
+		if (suffix < len && !strcmp(c + len - suffix, argv[2])) {
+			c[len - suffix] = '\0';
+		}
+	}
+
+	puts(c);
+	fflush(stdout);
+	return 0;
+}
+
+uint32_t shell_cmd_dirname(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "%s: expected argument\n", argv[0]);
+		return 1;
+	}
+
+	puts(dirname(argv[1]));
+	fflush(stdout);
+	return 0;
+}
+
+uint32_t shell_cmd_sleep(int argc, char * argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "%s: expected argument\n", argv[0]);
+		return 1;
+	}
+
+	float time = atof(argv[1]);
+
+	unsigned int seconds = (unsigned int)time;
+	unsigned int subsecs = (unsigned int)((time - (float)seconds) * 1000000);
+
+	return syscall_nanosleep(seconds, subsecs);
+}
+
+uint32_t shell_cmd_rehash(int argc, char * argv[]) {
+	/* Read $PATH again, even if it doesn't look like anything changed */
+	path_stale = 1;
+	shell_commands_update();
 
 	return 0;
 }
@@ -2275,6 +2599,7 @@ void install_commands() {
 	shell_commands = malloc(sizeof(char *) * SHELL_COMMANDS);
 	shell_pointers = malloc(sizeof(shell_command_t) * SHELL_COMMANDS);
 	shell_descript = malloc(sizeof(char *) * SHELL_COMMANDS);
+	shell_builtins = hashmap_create(32);
 
 	shell_install_command("cd",      shell_cmd_cd, "change directory");
 	shell_install_command("exit",    shell_cmd_exit, "exit the shell");
@@ -2297,4 +2622,16 @@ void install_commands() {
 	shell_install_command("jobs",    shell_cmd_jobs, "list stopped jobs");
 	shell_install_command("bg",      shell_cmd_bg, "restart suspended job in the background");
 	shell_install_command("rehash",  shell_cmd_rehash, "reset shell command memory");
+
+	if (!getenv("ESH_NO_BUILTIN_UTILS")) {
+		shell_install_command("true",     shell_cmd_true, "return success");
+		shell_install_command("false",    shell_cmd_false, "return failure");
+		shell_install_command("echo",     shell_cmd_echo, "print arguments: echo [-ne] args...");
+		shell_install_command("pwd",      shell_cmd_pwd, "print the working directory");
+		shell_install_command("basename", shell_cmd_basename, "strip directory (and suffix) from a path");
+		shell_install_command("dirname",  shell_cmd_dirname, "strip the last component from a path");
+		shell_install_command("sleep",    shell_cmd_sleep, "wait for some seconds");
+	}
+
+	sort_commands();
 }
@@ -4,18 +4,101 @@
  * Copyright (C) 2018 K. Lange
  *
  * strings - print printable character sequences found in a file
+ *
+ * Files are read a block at a time, and SSE2 finds the next byte in
+ * a block that isn't printable sixteen at a time.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_SIZE 0x10000
+
+static int min_chars = 4;
+static char format = 0;
+
+/* The run of printable characters we're in, when it started in an earlier block */
+static char * carry = NULL;
+static size_t carry_len = 0;
+static size_t carry_size = 0;
+
+static void print_string(size_t offset, const char * a, size_t a_len, const char * b, size_t b_len) {
+	if (a_len + b_len < (size_t)min_chars) return;
+	switch (format) {
+		case 'x':
+			fprintf(stdout, "%lx ", offset);
+			break;
+		case 'd':
+			fprintf(stdout, "%lu ", offset);
+			break;
+		default:
+			break;
+	}
+	fwrite(a, 1, a_len, stdout);
+	fwrite(b, 1, b_len, stdout);
+	fputc('\n', stdout);
+}
+
+static void keep(const char * buf, size_t len) {
+	if (carry_len + len > carry_size) {
+		carry_size = (carry_len + len) * 2;
+		carry = realloc(carry, carry_size);
+	}
+	memcpy(carry + carry_len, buf, len);
+	carry_len += len;
+}
+
+/* Where the next byte that isn't printable is, or len */
+static size_t next_special(const unsigned char * buf, size_t i, size_t len) {
+#ifndef NO_SSE
+	/* Printable is 0x20 through 0x7E: at most 0x5E above a space */
+	const __m128i low   = _mm_set1_epi8(' ');
+	const __m128i range = _mm_set1_epi8(0x5E);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), low);
+		unsigned int printable = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, range), v));
+		if (printable != 0xFFFF) {
+			return i + __builtin_ctz(~printable);
+		}
+	}
+#endif
+	for (; i < len; ++i) {
+		if (!isprint(buf[i])) return i;
+	}
+	return len;
+}
+
+/*
+ * Strings are printed when a newline or a nul ends them; anything else
+ * that isn't printable just throws away what came before it.
+ */
+static void scan(const unsigned char * buf, size_t len, size_t base) {
+	size_t start = 0;
+	while (1) {
+		size_t end = next_special(buf, start, len);
+		if (end == len) {
+			keep((const char *)buf + start, len - start);
+			return;
+		}
+		if (buf[end] == '\n' || buf[end] == '\0') {
+			print_string(base + start - carry_len, carry, carry_len, (const char *)buf + start, end - start);
+		}
+		carry_len = 0;
+		start = end + 1;
+	}
+}
 
 int main(int argc, char * argv[]) {
 	int opt;
-	char format = 0;
-	int min_chars = 4;
 	int ret_val = 0;
 
 	while ((opt = getopt(argc, argv, "an:t:")) != -1) {
@@ -37,51 +120,26 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
+	unsigned char * buf = malloc(BLOCK_SIZE);
+
 	for (int i = optind; i < argc; ++i) {
-		FILE * f = fopen(argv[i], "r");
-		if (!f) {
+		int fd = open(argv[i], O_RDONLY);
+		if (fd < 0) {
 			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
 			ret_val = 1;
 			continue;
 		}
 
-		char buf[1024] = {0};
-		int  ind = 0;
 		size_t offset = 0;
-
-		while (!feof(f)) {
-			int c = fgetc(f);
-			if (c < 0) break;
-			if (c == '\n' || c == '\0') {
-				if (ind >= min_chars) {
-					switch (format) {
-						case 'x':
-							fprintf(stdout, "%lx ", offset - ind);
-							break;
-						case 'd':
-							fprintf(stdout, "%lu ", offset - ind);
-							break;
-						default:
-							break;
-					}
-					buf[ind] = '\0';
-					fprintf(stdout, "%s\n", buf);
-				}
-				ind = 0;
-				offset++;
-				continue;
-			}
-			if (!isprint(c)) {
-				ind = 0;
-			} else {
-				if (ind < 1024) {
-					buf[ind] = c;
-					ind++;
-				}
-			}
-			offset++;
+		carry_len = 0;
+		while (1) {
+			ssize_t r = read(fd, buf, BLOCK_SIZE);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) break;
+			scan(buf, r, offset);
+			offset += r;
 		}
-		fclose(f);
+		close(fd);
 	}
 
 	return ret_val;
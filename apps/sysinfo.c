@@ -73,6 +73,9 @@ int main(int argc, char * argv[]) {
 	/* from environment */
 	sprintf(data_lines[i++], C_A "WM Theme: " C_O "%s", wm_theme);
 
+	prog_lines[i] = "uptime -i";
+	sprintf(data_lines[i++], C_A "CPU: " C_O);
+
 	prog_lines[i] = "free -ut";
 	sprintf(data_lines[i++], C_A "RAM: " C_O);
 
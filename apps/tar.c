@@ -9,8 +9,16 @@
  * It supports on ustar-formatted archives, and its arguments
  * must by the - forms. As of writing, creating archives is not
  * supported. No compression formats are supported, either.
+ *
+ * Archives are read front to back in one pass with large reads, so
+ * they can come from a pipe (ungz foo.tgz - | tar -x). Directories
+ * are made by the reading thread as soon as anything needs them, and
+ * file contents are handed to a few worker threads to write out while
+ * the next headers are read.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -18,8 +26,10 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <toaru/hashmap.h>
+#include <toaru/list.h>
 
 struct ustar {
 	char filename[100];
@@ -46,29 +56,8 @@ struct ustar {
 	char prefix[155];
 };
 
-static struct ustar * file_from_offset(FILE * f, size_t offset) {
-	static struct ustar _ustar;
-	fseek(f, offset, SEEK_SET);
-	if (fread(&_ustar, 1, sizeof(struct ustar), f) != sizeof(struct ustar)) {
-		fprintf(stderr, "failed to read file\n");
-		return NULL;
-	}
-
-	if (_ustar.ustar[0] != 'u' ||
-		_ustar.ustar[1] != 's' ||
-		_ustar.ustar[2] != 't' ||
-		_ustar.ustar[3] != 'a' ||
-		_ustar.ustar[4] != 'r') {
-		return NULL;
-	}
-	return &_ustar;
-}
-
-static unsigned int round_to_512(unsigned int i) {
-	unsigned int t = i % 512;
-
-	if (!t) return i;
-	return i + (512 - t);
+static uint64_t round_to_512(uint64_t i) {
+	return (i + 511) & ~(uint64_t)511;
 }
 
 static unsigned int interpret_mode(struct ustar * file) {
@@ -82,22 +71,12 @@ static unsigned int interpret_mode(struct ustar * file) {
 		((file->mode[6] - '0') <<  0);
 }
 
-static unsigned int interpret_size(struct ustar * file) {
-	if (file->size[0] != '0') {
-		fprintf(stderr, "\033[3;32mWarning:\033[0;3m File is too big.\033[0m\n");
+static uint64_t interpret_size(struct ustar * file) {
+	uint64_t size = 0;
+	for (int i = 0; i < 12 && file->size[i] >= '0' && file->size[i] <= '7'; ++i) {
+		size = (size << 3) | (file->size[i] - '0');
 	}
-	return
-		((file->size[ 0] - '0') << 30) |
-		((file->size[ 1] - '0') << 27) |
-		((file->size[ 2] - '0') << 24) |
-		((file->size[ 3] - '0') << 21) |
-		((file->size[ 4] - '0') << 18) |
-		((file->size[ 5] - '0') << 15) |
-		((file->size[ 6] - '0') << 12) |
-		((file->size[ 7] - '0') <<  9) |
-		((file->size[ 8] - '0') <<  6) |
-		((file->size[ 9] - '0') <<  3) |
-		((file->size[10] - '0') <<  0);
+	return size;
 }
 
 static const char * type_to_string(char type) {
@@ -134,36 +113,300 @@ static void dump_file(struct ustar * file) {
 }
 #endif
 
-#define CHUNK_SIZE 4096
-static void write_file(struct ustar * file, FILE * f, FILE * mf, size_t off, char * name) {
-	size_t length = interpret_size(file);
-	fseek(f, off + 512, SEEK_SET);
-	char buf[CHUNK_SIZE];
-	while (length > CHUNK_SIZE) {
-		fread( buf, 1, CHUNK_SIZE, f);
-		fwrite(buf, 1, CHUNK_SIZE, mf);
-		length -= CHUNK_SIZE;
+/*
+ * Archive input, read in big pieces and parceled out from a buffer.
+ * Nothing ever seeks, so this works the same on a pipe.
+ */
+#define READ_SIZE 0x40000
+
+static struct {
+	int fd;
+	char * buf;
+	size_t pos;
+	size_t len;
+} in;
+
+/* Make sure there is at least one byte buffered; 0 at the end of the input */
+static int fill(void) {
+	if (in.pos < in.len) return 1;
+	in.pos = 0;
+	in.len = 0;
+	while (1) {
+		ssize_t r = read(in.fd, in.buf, READ_SIZE);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return 0;
+		in.len = r;
+		return 1;
+	}
+}
+
+static size_t take(void * out, size_t size) {
+	size_t done = 0;
+	while (done < size && fill()) {
+		size_t n = in.len - in.pos;
+		if (n > size - done) n = size - done;
+		memcpy((char *)out + done, in.buf + in.pos, n);
+		in.pos += n;
+		done += n;
 	}
-	if (length > 0) {
-		fread( buf, 1, length, f);
-		fwrite(buf, 1, length, mf);
+	return done;
+}
+
+static uint64_t skip(uint64_t size) {
+	uint64_t done = 0;
+	while (done < size && fill()) {
+		size_t n = in.len - in.pos;
+		if (n > size - done) n = size - done;
+		in.pos += n;
+		done += n;
 	}
-	fclose(mf);
-	fseek(f, off, SEEK_SET);
+	return done;
+}
+
+static char * argv0;
+static char * fname;
+static int failed = 0;
+
+/*
+ * Write-behind: small files are read into memory whole and written out
+ * by a worker while the reader moves on. How much can be waiting at once
+ * is capped; files big enough to matter on their own are written by the
+ * reader directly, straight out of the input buffer.
+ */
+#define TAR_WORKERS  4
+#define MAX_BEHIND   0x800000
+#define MAX_QUEUED   0x100000
+
+struct write_job {
+	char * name;
+	char * data;
+	size_t size;
+	unsigned int mode;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	list_t * jobs;
+	size_t behind;    /* Bytes read but not yet written */
+	int busy;         /* Jobs taken by a worker and not finished */
+	int running;
+	int finished;
+	pthread_t workers[TAR_WORKERS];
+} pool;
+
+static int write_all(int fd, const char * data, size_t size) {
+	while (size) {
+		ssize_t w = write(fd, data, size);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		data += w;
+		size -= w;
+	}
+	return 0;
+}
+
+static void report(char * name) {
+	fprintf(stderr, "%s: %s: %s: %s\n", argv0, fname, name, strerror(errno));
+}
+
+static int create_file(char * name, unsigned int mode) {
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0) report(name);
+	return fd;
+}
+
+/* Close out a written file; the mode is set again in case it already existed */
+static int finish_file(int fd, char * name, unsigned int mode, int ok) {
+	if (!ok) report(name);
+	close(fd);
 	/* TODO: fchmod? */
-	chmod(name, interpret_mode(file));
+	chmod(name, mode);
+	return !ok;
+}
+
+static void * write_worker(void * arg) {
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.jobs->length && !pool.finished) {
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		}
+		if (!pool.jobs->length) break;
+
+		node_t * node = list_dequeue(pool.jobs);
+		struct write_job * job = node->value;
+		free(node);
+		pool.busy++;
+		pthread_mutex_unlock(&pool.lock);
+
+		int err = 1;
+		int fd = create_file(job->name, job->mode);
+		if (fd >= 0) {
+			err = finish_file(fd, job->name, job->mode, write_all(fd, job->data, job->size) == 0);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		if (err) failed = 1;
+		pool.behind -= job->size;
+		pool.busy--;
+		pthread_cond_broadcast(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+
+		free(job->name);
+		free(job->data);
+		free(job);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void pool_start(void) {
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.jobs = list_create();
+	for (int i = 0; i < TAR_WORKERS; ++i) {
+		if (pthread_create(&pool.workers[i], NULL, write_worker, NULL) == 0) {
+			pool.running++;
+		}
+	}
+}
+
+/* Wait until everything queued so far is on disk */
+static void pool_drain(void) {
+	if (!pool.running) return;
+	pthread_mutex_lock(&pool.lock);
+	while (pool.jobs->length || pool.busy) {
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_finish(void) {
+	if (!pool.running) return;
+	pthread_mutex_lock(&pool.lock);
+	pool.finished = 1;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < pool.running; ++i) {
+		pthread_join(pool.workers[i], NULL);
+	}
+}
+
+/* The reader writes this one itself, a buffer at a time */
+static int write_direct(char * name, uint64_t size, unsigned int mode) {
+	int fd = create_file(name, mode);
+	int ok = 1;
+	while (size && fill()) {
+		size_t n = in.len - in.pos;
+		if (n > size) n = size;
+		if (fd >= 0 && ok && write_all(fd, in.buf + in.pos, n) < 0) ok = 0;
+		in.pos += n;
+		size -= n;
+	}
+	if (fd < 0) return 1;
+	return finish_file(fd, name, mode, ok);
+}
+
+static int extract_file(char * name, uint64_t size, unsigned int mode) {
+	if (!pool.running || size > MAX_QUEUED) {
+		return write_direct(name, size, mode);
+	}
+
+	struct write_job * job = malloc(sizeof(struct write_job));
+	job->name = strdup(name);
+	job->data = malloc(size ? size : 1);
+	job->size = take(job->data, size);
+	job->mode = mode;
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.behind && pool.behind + job->size > MAX_BEHIND) {
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pool.behind += job->size;
+	list_insert(pool.jobs, job);
+	pthread_cond_signal(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+	return 0;
+}
+
+/* Hard links are copies; the target is already written out by now */
+static int copy_file(char * target, char * name, unsigned int mode) {
+	pool_drain();
+	int s_fd = open(target, O_RDONLY);
+	if (s_fd < 0) {
+		report(target);
+		return 1;
+	}
+	int d_fd = create_file(name, mode);
+	if (d_fd < 0) {
+		close(s_fd);
+		return 1;
+	}
+	char * buf = malloc(READ_SIZE);
+	int ok = 1;
+	ssize_t r;
+	while ((r = read(s_fd, buf, READ_SIZE)) > 0) {
+		if (write_all(d_fd, buf, r) < 0) {
+			ok = 0;
+			break;
+		}
+	}
+	if (r < 0) ok = 0;
+	free(buf);
+	close(s_fd);
+	return finish_file(d_fd, name, mode, ok);
+}
+
+/*
+ * Make a directory and any missing parents. Ones already made (or found)
+ * are remembered, so the files in a directory don't keep asking.
+ */
+static hashmap_t * dirs;
+
+static void make_directory(char * name) {
+	size_t len = strlen(name);
+	while (len && name[len-1] == '/') name[--len] = '\0';
+	if (!len || hashmap_has(dirs, name)) return;
+
+	for (char * c = name + 1; *c; ++c) {
+		if (*c != '/') continue;
+		*c = '\0';
+		if (!hashmap_has(dirs, name)) {
+			mkdir(name, 0777);
+			hashmap_set(dirs, name, (void*)1);
+		}
+		*c = '/';
+	}
+
+	if (mkdir(name, 0777) < 0 && errno != EEXIST) {
+		report(name);
+		failed = 1;
+	}
+	hashmap_set(dirs, name, (void*)1);
+}
+
+static void make_parent(char * name) {
+	char * slash = strrchr(name, '/');
+	if (!slash || slash == name) return;
+	*slash = '\0';
+	make_directory(name);
+	*slash = '/';
 }
 
 int main(int argc, char * argv[]) {
 
 	int opt;
-	char * fname = NULL;
 	int verbose = 0;
 	int action = 0;
 #define TAR_ACTION_EXTRACT 1
 #define TAR_ACTION_CREATE  2
 #define TAR_ACTION_LIST    3
 
+	argv0 = argv[0];
+
 	while ((opt = getopt(argc, argv, "ctxvaf:")) != -1) {
 		switch (opt) {
 			case 'c':
@@ -199,33 +442,40 @@ int main(int argc, char * argv[]) {
 		}
 	}
 
-	if (!fname) {
-		fprintf(stderr, "%s: todo: stdin/stdout\n", argv[0]);
-		return 1;
-	}
-
 	if (action == TAR_ACTION_EXTRACT || action == TAR_ACTION_LIST) {
 
 		hashmap_t * files = hashmap_create(10);
-
-		FILE * f = fopen(fname,"r");
-		if (!f) {
-			fprintf(stderr, "%s: %s: %s\n", argv[0], fname, strerror(errno));
-			return 1;
+		dirs = hashmap_create(10);
+
+		if (!fname || !strcmp(fname, "-")) {
+			fname = "-";
+			in.fd = STDIN_FILENO;
+		} else {
+			in.fd = open(fname, O_RDONLY);
+			if (in.fd < 0) {
+				fprintf(stderr, "%s: %s: %s\n", argv[0], fname, strerror(errno));
+				return 1;
+			}
 		}
+		in.buf = malloc(READ_SIZE);
 
-		fseek(f, 0, SEEK_END);
-		size_t length = ftell(f);
-		fseek(f, 0, SEEK_SET);
+		if (action == TAR_ACTION_EXTRACT) {
+			pool_start();
+		}
 
-		size_t off = 0;
-		while (!feof(f)) {
-			struct ustar * file = file_from_offset(f, off);
+		struct ustar _file, * file = &_file;
+		char block[512];
+		while (1) {
+			if (take(block, 512) != 512) break;
+			memcpy(file, block, sizeof(struct ustar));
 
-			if (!file) {
+			if (memcmp(file->ustar, "ustar", 5)) {
 				break;
 			}
 
+			uint64_t size = interpret_size(file);
+			uint64_t body = 0; /* Bytes of the body not yet consumed */
+
 			if (action == TAR_ACTION_LIST || verbose) {
 				fprintf(stdout, "%.155s%.100s\n", file->prefix, file->filename);
 			}
@@ -236,58 +486,52 @@ int main(int argc, char * argv[]) {
 				strncat(name, file->filename, 100);
 
 				if (file->type[0] == '0' || file->type[0] == 0) {
-					FILE * mf = fopen(name,"w");
-					if (!mf) {
-						fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, strerror(errno));
-					} else {
-						write_file(file,f,mf,off,name);
+					make_parent(name);
+					if (hashmap_has(files, name)) {
+						/* Same name again; the earlier one must land first */
+						pool_drain();
 					}
-					struct ustar * tmp = malloc(sizeof(struct ustar));
-					memcpy(tmp, file, sizeof(struct ustar));
-					hashmap_set(files, name, tmp);
+					if (extract_file(name, size, interpret_mode(file))) failed = 1;
+					hashmap_set(files, name, (void*)1);
 				} else if (file->type[0] == '5') {
-					if (name[strlen(name)-1] == '/') {
-						name[strlen(name)-1] = '\0';
-					}
-					if (strlen(name)) {
-						if (mkdir(name, 0777) < 0) {
-							if (errno != EEXIST) {
-								fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, strerror(errno));
-							}
-						}
-					}
+					make_directory(name);
+					body = size;
 				} else if (file->type[0] == '1') {
 					char tmp[101] = {0};
 					strncat(tmp, file->link, 100);
 					if (!hashmap_has(files, tmp)) {
 						fprintf(stderr, "%s: %s: %s: %s: missing target\n", argv[0], fname, name, tmp);
 					} else {
-						FILE * mf = fopen(name,"w");
-						if (!mf) {
-							fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, strerror(errno));
-						} else {
-							write_file(hashmap_get(files,tmp),f,mf,off,name);
-						}
+						make_parent(name);
+						if (copy_file(tmp, name, interpret_mode(file))) failed = 1;
+						hashmap_set(files, name, (void*)1);
 					}
+					body = size;
 				} else if (file->type[0] == '2') {
 					char tmp[101] = {0};
 					strncat(tmp, file->link, 100);
+					make_parent(name);
 					if (symlink(tmp, name) < 0) {
 						fprintf(stderr, "%s: %s: %s: %s: %s\n", argv[0], fname, name, tmp, strerror(errno));
 					}
+					body = size;
 				} else {
 					fprintf(stderr, "%s: %s: %s: %s\n", argv[0], fname, name, type_to_string(file->type[0]));
+					body = size;
 				}
+			} else {
+				body = size;
 			}
 
-			off += 512;
-			off += round_to_512(interpret_size(file));
-			if (off >= length) break;
+			uint64_t rest = body + (round_to_512(size) - size);
+			if (skip(rest) != rest) break;
 		}
+
+		pool_finish();
 	} else {
 		fprintf(stderr, "%s: unsupported action\n", argv[0]);
 		return 1;
 	}
 
-	return 0;
+	return failed;
 }
@@ -301,46 +301,11 @@ static void redraw_new_selection(int old_x, int old_y) {
 static int _selection_count = 0;
 static int _selection_i = 0;
 
-static int to_eight(uint32_t codepoint, char * out) {
-	memset(out, 0x00, 7);
-
-	if (codepoint < 0x0080) {
-		out[0] = (char)codepoint;
-	} else if (codepoint < 0x0800) {
-		out[0] = 0xC0 | (codepoint >> 6);
-		out[1] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x10000) {
-		out[0] = 0xE0 | (codepoint >> 12);
-		out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[2] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x200000) {
-		out[0] = 0xF0 | (codepoint >> 18);
-		out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[3] = 0x80 | ((codepoint) & 0x3F);
-	} else if (codepoint < 0x4000000) {
-		out[0] = 0xF8 | (codepoint >> 24);
-		out[1] = 0x80 | (codepoint >> 18);
-		out[2] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[4] = 0x80 | ((codepoint) & 0x3F);
-	} else {
-		out[0] = 0xF8 | (codepoint >> 30);
-		out[1] = 0x80 | ((codepoint >> 24) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 18) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[4] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[5] = 0x80 | ((codepoint) & 0x3F);
-	}
-
-	return strlen(out);
-}
-
 void count_selection(uint16_t x, uint16_t y) {
 	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
 	if (((uint32_t *)cell)[0] != 0x00000000) {
 		char tmp[7];
-		_selection_count += to_eight(cell->c, tmp);
+		_selection_count += utf8_encode(cell->c, tmp);
 	}
 	if (x == term_width - 1) {
 		_selection_count++;
@@ -351,7 +316,7 @@ void write_selection(uint16_t x, uint16_t y) {
 	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
 	if (((uint32_t *)cell)[0] != 0x00000000) {
 		char tmp[7];
-		int count = to_eight(cell->c, tmp);
+		int count = utf8_encode(cell->c, tmp);
 		for (int i = 0; i < count; ++i) {
 			selection_text[_selection_i] = tmp[i];
 			_selection_i++;
@@ -394,12 +359,53 @@ void input_buffer_stuff(char * str) {
 	write(fd_master, str, s);
 }
 
+/*
+ * Text memory is slow to touch (especially under emulation), so cells are
+ * drawn into a shadow copy and flush_text() writes out only the words
+ * that changed since the last flush, in runs, before we go back to sleep.
+ */
 unsigned short * textmemptr = (unsigned short *)0xB8000;
+static unsigned short text_shadow[80 * 25];
+static unsigned short text_shown[80 * 25];
+static uint32_t text_dirty_rows = 0;
+static int text_shown_valid = 0;
+
 void placech(unsigned char c, int x, int y, int attr) {
-	unsigned short *where;
-	unsigned att = attr << 8;
-	where = textmemptr + (y * 80 + x);
-	*where = c | att;
+	unsigned short val = c | (attr << 8);
+	unsigned short * where = &text_shadow[y * 80 + x];
+	if (*where != val) {
+		*where = val;
+		text_dirty_rows |= (1 << y);
+	}
+}
+
+static void flush_text(void) {
+	if (!text_shown_valid) {
+		memcpy(textmemptr, text_shadow, sizeof(text_shadow));
+		memcpy(text_shown, text_shadow, sizeof(text_shadow));
+		text_shown_valid = 1;
+		text_dirty_rows = 0;
+		return;
+	}
+
+	while (text_dirty_rows) {
+		int y = __builtin_ctz(text_dirty_rows);
+		text_dirty_rows &= ~(1 << y);
+
+		unsigned short * want = &text_shadow[y * 80];
+		unsigned short * have = &text_shown[y * 80];
+		int x = 0;
+		while (x < 80) {
+			if (want[x] == have[x]) {
+				x++;
+				continue;
+			}
+			int start = x;
+			while (x < 80 && want[x] != have[x]) x++;
+			memcpy(&textmemptr[y * 80 + start], &want[start], (x - start) * sizeof(unsigned short));
+			memcpy(&have[start], &want[start], (x - start) * sizeof(unsigned short));
+		}
+	}
 }
 
 /* ANSI-to-VGA */
@@ -1070,6 +1076,7 @@ term_callbacks_t term_callbacks = {
 	unsupported_int,
 	term_set_csr_show,
 	term_switch_buffer,
+	NULL,
 };
 
 void reinit(void) {
@@ -1345,6 +1352,8 @@ int main(int argc, char ** argv) {
 		unsigned char buf[1024];
 		while (!exit_application) {
 
+			flush_text();
+
 			int index = fswait2(amfd == -1 ? 3 : 4,fds,200);
 
 			check_for_exit();
@@ -1354,8 +1363,8 @@ int main(int argc, char ** argv) {
 			if (index == 0) {
 				maybe_flip_cursor();
 				int r = read(fd_master, buf, 1024);
-				for (int i = 0; i < r; ++i) {
-					ansi_put(ansi_state, buf[i]);
+				if (r > 0) {
+					ansi_put_string(ansi_state, (char *)buf, r);
 				}
 			} else if (index == 1) {
 				maybe_flip_cursor();
@@ -1388,6 +1397,7 @@ int main(int argc, char ** argv) {
 			}
 		}
 
+		flush_text();
 	}
 
 	return 0;
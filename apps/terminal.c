@@ -97,7 +97,14 @@ static term_cell_t * term_buffer = NULL; /* The terminal cell buffer */
 static term_cell_t * term_buffer_a = NULL;
 static term_cell_t * term_buffer_b = NULL;
 static term_state_t * ansi_state = NULL; /* ANSI parser library state */
+static int term_offset    = 0;    /* Row of term_buffer holding the top line on screen */
+static uint32_t * dirty_cells = NULL; /* One bit per cell of term_buffer, in buffer order */
+static uint8_t * dirty_rows   = NULL; /* Whether each row of term_buffer has any */
+static int dirty_any          = 0;
+static uint64_t last_paint    = 0;
+#define FRAME_TICKS 16666           /* Microseconds between paints under load */
 static int active_buffer  = 0;
+static int _orig_offset = 0;
 static int _orig_x = 0;
 static int _orig_y = 0;
 static uint32_t _orig_fg = 7;
@@ -145,6 +152,9 @@ static int32_t l_y = INT32_MAX;
 static int32_t r_x = -1;
 static int32_t r_y = -1;
 
+/* How far the text area has moved down since the last flip */
+static int32_t scroll_pending = 0;
+
 static uint32_t window_width  = 640;
 static uint32_t window_height = 480;
 #define TERMINAL_TITLE_SIZE 512
@@ -165,15 +175,22 @@ static int decor_bottom_height = 0;
 static int decor_width = 0;
 static int decor_height = 0;
 
-struct scrollback_row {
-	unsigned short width;
-	term_cell_t cells[];
-};
-
+/*
+ * Scrollback is a ring of fixed-size rows, grown as lines come in up
+ * to MAX_SCROLLBACK and then reused oldest first.
+ */
 #define MAX_SCROLLBACK 10240
-static list_t * scrollback_list = NULL;
+static term_cell_t * scrollback_cells = NULL;
+static unsigned short * scrollback_widths = NULL;
+static int scrollback_stride = 0;   /* Cells per row */
+static int scrollback_capacity = 0; /* Rows allocated */
+static int scrollback_start = 0;    /* Oldest row */
+static int scrollback_length = 0;
 static int scrollback_offset = 0;
 
+/* Set by SIGLOWMEM; the scrollback is let go of unless it's being looked at */
+static volatile int low_memory = 0;
+
 /* Menu bar entries */
 struct menu_bar terminal_menu_bar = {0};
 struct menu_bar_entries terminal_menu_entries[] = {
@@ -200,9 +217,49 @@ static uint64_t get_ticks(void) {
 	return (uint64_t)now.tv_sec * 1000000LL + (uint64_t)now.tv_usec;
 }
 
+/* Returns the lower of two shorts */
+static int32_t min(int32_t a, int32_t b) {
+	return (a < b) ? a : b;
+}
+
+/* Returns the higher of two shorts */
+static int32_t max(int32_t a, int32_t b) {
+	return (a > b) ? a : b;
+}
+
+static void term_paint(void);
+
+/* Copy the changed region of the backbuffer out to the window. */
+static void flip_bounds(void) {
+	int32_t x0 = max(l_x, 0), y0 = max(l_y, 0);
+	int32_t x1 = min(r_x, ctx->width), y1 = min(r_y, ctx->height);
+	for (int32_t y = y0; y < y1; ++y) {
+		size_t offset = y * GFX_S(ctx) + x0 * GFX_B(ctx);
+		memcpy(&ctx->buffer[offset], &ctx->backbuffer[offset], (x1 - x0) * GFX_B(ctx));
+	}
+}
+
+/* Where the terminal cells are drawn in the window */
+static void text_area(int32_t * x, int32_t * y, int32_t * w, int32_t * h) {
+	*x = _no_frame ? 0 : decor_left_width;
+	*y = _no_frame ? 0 : decor_top_height + menu_bar_height;
+	*w = term_width * char_width;
+	*h = term_height * char_height;
+}
+
 static void display_flip(void) {
+	term_paint();
+	if (scroll_pending) {
+		/* Move what the window has too, unless it's all being sent again anyway */
+		int32_t x, y, w, h;
+		text_area(&x, &y, &w, &h);
+		if (!(l_x <= x && l_y <= y && r_x >= x + w && r_y >= y + h)) {
+			yutani_window_scroll(yctx, window, x, y, w, h, scroll_pending);
+		}
+		scroll_pending = 0;
+	}
 	if (l_x != INT32_MAX && l_y != INT32_MAX) {
-		flip(ctx);
+		flip_bounds();
 		yutani_flip_region(yctx, window, l_x, l_y, r_x - l_x, r_y - l_y);
 		l_x = INT32_MAX;
 		l_y = INT32_MAX;
@@ -211,54 +268,25 @@ static void display_flip(void) {
 	}
 }
 
-/* Returns the lower of two shorts */
-static int32_t min(int32_t a, int32_t b) {
-	return (a < b) ? a : b;
-}
-
-/* Returns the higher of two shorts */
-static int32_t max(int32_t a, int32_t b) {
-	return (a > b) ? a : b;
+/* The cell at x,y on screen */
+static inline term_cell_t * cell_at(int x, int y) {
+	int row = y + term_offset;
+	if (row >= term_height) row -= term_height;
+	return &term_buffer[row * term_width + x];
 }
 
 /*
- * Convert codepoint to UTF-8
- *
- * Returns length of byte sequence written.
+ * Scrollback row `back` lines above the screen (0 is the most recent),
+ * or NULL (and a width of 0) if there aren't that many.
  */
-static int to_eight(uint32_t codepoint, char * out) {
-	memset(out, 0x00, 7);
-
-	if (codepoint < 0x0080) {
-		out[0] = (char)codepoint;
-	} else if (codepoint < 0x0800) {
-		out[0] = 0xC0 | (codepoint >> 6);
-		out[1] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x10000) {
-		out[0] = 0xE0 | (codepoint >> 12);
-		out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[2] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x200000) {
-		out[0] = 0xF0 | (codepoint >> 18);
-		out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[3] = 0x80 | ((codepoint) & 0x3F);
-	} else if (codepoint < 0x4000000) {
-		out[0] = 0xF8 | (codepoint >> 24);
-		out[1] = 0x80 | (codepoint >> 18);
-		out[2] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[4] = 0x80 | ((codepoint) & 0x3F);
-	} else {
-		out[0] = 0xF8 | (codepoint >> 30);
-		out[1] = 0x80 | ((codepoint >> 24) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 18) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[4] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[5] = 0x80 | ((codepoint) & 0x3F);
+static term_cell_t * scrollback_row(int back, int * width) {
+	if (back < 0 || back >= scrollback_length) {
+		*width = 0;
+		return NULL;
 	}
-
-	return strlen(out);
+	int index = (scrollback_start + scrollback_length - 1 - back) % scrollback_capacity;
+	*width = scrollback_widths[index];
+	return &scrollback_cells[index * scrollback_stride];
 }
 
 /* Set the terminal title string */
@@ -411,26 +439,22 @@ static void count_selection(uint16_t x, uint16_t _y) {
 	int y = _y;
 	y -= scrollback_offset;
 	if (y >= 0) {
-		term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+		term_cell_t * cell = cell_at(x, y);
 		if (!(cell->flags & ANSI_EXT_IMG)) {
 			if (((uint32_t *)cell)[0] != 0x00000000) {
 				char tmp[7];
-				_selection_count += to_eight(cell->c, tmp);
+				_selection_count += utf8_encode(cell->c, tmp);
 			}
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row) {
+			if (x < width) {
+				term_cell_t * cell = &row[x];
 				if (cell && ((uint32_t *)cell)[0] != 0x00000000) {
 					char tmp[7];
-					_selection_count += to_eight(cell->c, tmp);
+					_selection_count += utf8_encode(cell->c, tmp);
 				}
 			}
 		}
@@ -445,11 +469,11 @@ void write_selection(uint16_t x, uint16_t _y) {
 	int y = _y;
 	y -= scrollback_offset;
 	if (y >= 0) {
-		term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+		term_cell_t * cell = cell_at(x, y);
 		if (!(cell->flags & ANSI_EXT_IMG)) {
 			if (((uint32_t *)cell)[0] != 0x00000000) {
 				char tmp[7];
-				int count = to_eight(cell->c, tmp);
+				int count = utf8_encode(cell->c, tmp);
 				for (int i = 0; i < count; ++i) {
 					selection_text[_selection_i] = tmp[i];
 					_selection_i++;
@@ -457,18 +481,14 @@ void write_selection(uint16_t x, uint16_t _y) {
 			}
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row) {
+			if (x < width) {
+				term_cell_t * cell = &row[x];
 				if (cell && ((uint32_t *)cell)[0] != 0x00000000) {
 					char tmp[7];
-					int count = to_eight(cell->c, tmp);
+					int count = utf8_encode(cell->c, tmp);
 					for (int i = 0; i < count; ++i) {
 						selection_text[_selection_i] = tmp[i];
 						_selection_i++;
@@ -930,7 +950,7 @@ static void cell_set(uint16_t x, uint16_t y, uint32_t c, uint32_t fg, uint32_t b
 	if (x >= term_width || y >= term_height) return;
 
 	/* Calculate the cell position in the terminal buffer */
-	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+	term_cell_t * cell = cell_at(x, y);
 
 	/* Set cell attributes */
 	cell->c     = c;
@@ -974,7 +994,7 @@ static void cell_redraw_offset(uint16_t x, uint16_t _y) {
 	y -= scrollback_offset;
 
 	if (y >= 0) {
-		term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+		term_cell_t * cell = cell_at(x, y);
 		if (cell->flags & ANSI_EXT_IMG) { redraw_cell_image(x,i,cell); return; }
 		if (((uint32_t *)cell)[0] == 0x00000000) {
 			term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
@@ -982,15 +1002,11 @@ static void cell_redraw_offset(uint16_t x, uint16_t _y) {
 			term_write_char(cell->c, x * char_width, i * char_height, cell->fg, cell->bg, cell->flags);
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row) {
+			if (x < width) {
+				term_cell_t * cell = &row[x];
 				if (!cell || ((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				} else {
@@ -1010,7 +1026,7 @@ static void cell_redraw_offset_inverted(uint16_t x, uint16_t _y) {
 	y -= scrollback_offset;
 
 	if (y >= 0) {
-		term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+		term_cell_t * cell = cell_at(x, y);
 		if (cell->flags & ANSI_EXT_IMG) { redraw_cell_image(x,i,cell); return; }
 		if (((uint32_t *)cell)[0] == 0x00000000) {
 			term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_BG, TERM_DEFAULT_FG, TERM_DEFAULT_FLAGS|ANSI_SPECBG);
@@ -1018,15 +1034,11 @@ static void cell_redraw_offset_inverted(uint16_t x, uint16_t _y) {
 			term_write_char(cell->c, x * char_width, i * char_height, cell->bg, cell->fg, cell->flags);
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (; y < -1; y++) {
-			if (!node) break;
-			node = node->prev;
-		}
-		if (node) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
-			if (row && x < row->width) {
-				term_cell_t * cell = &row->cells[x];
+		int width;
+		term_cell_t * row = scrollback_row(-y - 1, &width);
+		if (row) {
+			if (x < width) {
+				term_cell_t * cell = &row[x];
 				if (!cell || ((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_BG, TERM_DEFAULT_FG, TERM_DEFAULT_FLAGS);
 				} else {
@@ -1046,7 +1058,7 @@ static void cell_redraw(uint16_t x, uint16_t y) {
 	if (x >= term_width || y >= term_height) return;
 
 	/* Calculate the cell position in the terminal buffer */
-	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+	term_cell_t * cell = cell_at(x, y);
 
 	/* If it's an image cell, redraw the image data. */
 	if (cell->flags & ANSI_EXT_IMG) {
@@ -1068,7 +1080,7 @@ static void cell_redraw_inverted(uint16_t x, uint16_t y) {
 	if (x >= term_width || y >= term_height) return;
 
 	/* Calculate the cell position in the terminal buffer */
-	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+	term_cell_t * cell = cell_at(x, y);
 
 	/* If it's an image cell, redraw the image data. */
 	if (cell->flags & ANSI_EXT_IMG) {
@@ -1090,7 +1102,7 @@ static void cell_redraw_box(uint16_t x, uint16_t y) {
 	if (x >= term_width || y >= term_height) return;
 
 	/* Calculate the cell position in the terminal buffer */
-	term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+	term_cell_t * cell = cell_at(x, y);
 
 	/* If it's an image cell, redraw the image data. */
 	if (cell->flags & ANSI_EXT_IMG) {
@@ -1106,6 +1118,25 @@ static void cell_redraw_box(uint16_t x, uint16_t y) {
 	}
 }
 
+/* Note a cell as changed, to be painted by the next term_paint(). */
+static void cell_dirty(uint16_t x, uint16_t y) {
+	if (x >= term_width || y >= term_height) return;
+	int row = y + term_offset;
+	if (row >= term_height) row -= term_height;
+	int bit = row * term_width + x;
+	dirty_cells[bit >> 5] |= 1U << (bit & 31);
+	dirty_rows[row] = 1;
+	dirty_any = 1;
+}
+
+/* Forget about changes; everything has just been painted. */
+static void dirty_clear(void) {
+	if (!dirty_any) return;
+	memset(dirty_cells, 0, sizeof(uint32_t) * ((term_width * term_height + 31) / 32));
+	memset(dirty_rows, 0, term_height);
+	dirty_any = 0;
+}
+
 /* Draw the cursor cell */
 static void render_cursor() {
 	if (!cursor_on) return;
@@ -1124,7 +1155,7 @@ static void draw_cursor() {
 	if (!cursor_on) return;
 	mouse_ticks = get_ticks();
 	cursor_flipped = 0;
-	render_cursor();
+	cell_dirty(csr_x, csr_y);
 }
 
 /* Timer callback to flip (flash) the cursor */
@@ -1135,6 +1166,7 @@ static void maybe_flip_cursor(void) {
 		if (scrollback_offset != 0) {
 			return; /* Don't flip cursor while drawing scrollback */
 		}
+		term_paint();
 		if (window->focused && cursor_flipped) {
 			cell_redraw(csr_x, csr_y);
 		} else {
@@ -1145,12 +1177,48 @@ static void maybe_flip_cursor(void) {
 	}
 }
 
+/*
+ * Paint every cell that changed since the last paint. Changes are
+ * tracked by where they are in term_buffer, so they stay with their
+ * rows when the screen scrolls in between.
+ */
+static void term_paint(void) {
+	if (!dirty_any) return;
+	if (scrollback_offset != 0) return; /* Painted when the view comes back */
+
+	int cursor_hit = 0;
+	for (int row = 0; row < term_height; ++row) {
+		if (!dirty_rows[row]) continue;
+		dirty_rows[row] = 0;
+		int y = row - term_offset;
+		if (y < 0) y += term_height;
+		for (int x = 0; x < term_width; ++x) {
+			int bit = row * term_width + x;
+			if (!dirty_cells[bit >> 5]) {
+				x += 31 - (bit & 31); /* Skip the rest of this word */
+				continue;
+			}
+			if (!(dirty_cells[bit >> 5] & (1U << (bit & 31)))) continue;
+			dirty_cells[bit >> 5] &= ~(1U << (bit & 31));
+			cell_redraw(x, y);
+			if (x == csr_x && y == csr_y) cursor_hit = 1;
+		}
+	}
+	dirty_any = 0;
+
+	if (cursor_hit && !cursor_flipped) {
+		render_cursor();
+	}
+	last_paint = get_ticks();
+}
+
 /* Draw all cells. Duplicates code from cell_redraw to avoid unecessary bounds checks. */
 static void term_redraw_all() {
+	dirty_clear();
 	for (int i = 0; i < term_height; i++) {
 		for (int x = 0; x < term_width; ++x) {
 			/* Calculate the cell position in the terminal buffer */
-			term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (i * term_width + x) * sizeof(term_cell_t));
+			term_cell_t * cell = cell_at(x, i);
 			/* If it's an image cell, redraw the image data. */
 			if (cell->flags & ANSI_EXT_IMG) {
 				redraw_cell_image(x,i,cell);
@@ -1172,7 +1240,7 @@ static void flush_unused_images(void) {
 	list_t * tmp = list_create();
 	for (int y = 0; y < term_height; ++y) {
 		for (int x = 0; x < term_width; ++x) {
-			term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+			term_cell_t * cell = cell_at(x, y);
 			if (cell->flags & ANSI_EXT_IMG) {
 				list_insert(tmp, (void *)cell->fg);
 			}
@@ -1205,11 +1273,14 @@ static void term_scroll(int how_much) {
 	/* Redraw the cursor before continuing. */
 	cell_redraw(csr_x, csr_y);
 
+	int32_t dy;
 	if (how_much > 0) {
-		/* Scroll up */
-		memmove(term_buffer, (void *)((uintptr_t)term_buffer + sizeof(term_cell_t) * term_width), sizeof(term_cell_t) * term_width * (term_height - how_much));
-		/* Reset the "new" row to clean cells */
-		memset((void *)((uintptr_t)term_buffer + sizeof(term_cell_t) * term_width * (term_height - how_much)), 0x0, sizeof(term_cell_t) * term_width * how_much);
+		dy = -how_much * char_height;
+		/* Scroll up: the top rows come around as the new bottom rows */
+		term_offset = (term_offset + how_much) % term_height;
+		for (int i = term_height - how_much; i < term_height; ++i) {
+			memset(cell_at(0, i), 0x0, sizeof(term_cell_t) * term_width);
+		}
 		/* In graphical modes, we will shift the graphics buffer up as necessary */
 		uintptr_t dst, src;
 		size_t    siz = char_height * (term_height - how_much) * GFX_W(ctx) * GFX_B(ctx);
@@ -1225,18 +1296,20 @@ static void term_scroll(int how_much) {
 		/* Perform the shift */
 		memmove((void *)dst, (void *)src, siz);
 		/* And redraw the new rows */
-		for (int i = 0; i < how_much; ++i) {
+		for (int i = term_height - how_much; i < term_height; ++i) {
 			for (uint16_t x = 0; x < term_width; ++x) {
-				cell_set(x,term_height - how_much,' ', current_fg, current_bg, ansi_state->flags);
-				cell_redraw(x, term_height - how_much);
+				cell_set(x, i, ' ', current_fg, current_bg, ansi_state->flags);
+				cell_dirty(x, i);
 			}
 		}
 	} else {
 		how_much = -how_much;
-		/* Scroll down */
-		memmove((void *)((uintptr_t)term_buffer + sizeof(term_cell_t) * term_width), term_buffer, sizeof(term_cell_t) * term_width * (term_height - how_much));
-		/* Reset the "new" row to clean cells */
-		memset(term_buffer, 0x0, sizeof(term_cell_t) * term_width * how_much);
+		dy = how_much * char_height;
+		/* Scroll down: the bottom rows come around as the new top rows */
+		term_offset = (term_offset + term_height - how_much) % term_height;
+		for (int i = 0; i < how_much; ++i) {
+			memset(cell_at(0, i), 0x0, sizeof(term_cell_t) * term_width);
+		}
 		uintptr_t dst, src;
 		size_t    siz = char_height * (term_height - how_much) * GFX_W(ctx) * GFX_B(ctx);
 		if (!_no_frame) {
@@ -1251,7 +1324,7 @@ static void term_scroll(int how_much) {
 		/* And redraw the new rows */
 		for (int i = 0; i < how_much; ++i) {
 			for (uint16_t x = 0; x < term_width; ++x) {
-				cell_redraw(x, i);
+				cell_dirty(x, i);
 			}
 		}
 	}
@@ -1259,8 +1332,35 @@ static void term_scroll(int how_much) {
 	/* Remove image data for image cells that are no longer on screen. */
 	flush_unused_images();
 
-	/* Flip the entire window. */
-	yutani_flip(yctx, window);
+	/*
+	 * The whole text area moved. If nothing outside it is waiting to
+	 * be flipped, the window can just be told to move it too, and what
+	 * is waiting moves along; otherwise it all goes out again.
+	 */
+	int32_t left, top, width, height;
+	text_area(&left, &top, &width, &height);
+	int inside = l_x == INT32_MAX ||
+		(l_x >= left && l_y >= top && r_x <= left + width && r_y <= top + height);
+	if (inside && abs(scroll_pending + dy) < height) {
+		scroll_pending += dy;
+		if (l_x != INT32_MAX) {
+			l_y = max(l_y + dy, top);
+			r_y = min(r_y + dy, top + height);
+			if (l_y >= r_y) {
+				l_x = INT32_MAX;
+				l_y = INT32_MAX;
+				r_x = -1;
+				r_y = -1;
+			}
+		}
+		return;
+	}
+
+	scroll_pending = 0;
+	l_x = min(l_x, left);
+	l_y = min(l_y, top);
+	r_x = max(r_x, left + width);
+	r_y = max(r_y, top + height);
 }
 
 /* Is this a wide character? (does wcwidth == 2) */
@@ -1269,22 +1369,75 @@ static int is_wide(uint32_t codepoint) {
 	return wcwidth(codepoint) == 2;
 }
 
+/*
+ * Make room in the scrollback for rows of term_width cells. Rows only
+ * get copied when the terminal grows wider than it has been before.
+ */
+static void scrollback_reserve(void) {
+	if (term_width > scrollback_stride) {
+		int stride = term_width;
+		term_cell_t * cells = calloc(scrollback_capacity ? scrollback_capacity : 1, sizeof(term_cell_t) * stride);
+		for (int i = 0; i < scrollback_length; ++i) {
+			int index = (scrollback_start + i) % scrollback_capacity;
+			memcpy(&cells[i * stride], &scrollback_cells[index * scrollback_stride], sizeof(term_cell_t) * scrollback_widths[index]);
+		}
+		unsigned short * widths = calloc(scrollback_capacity ? scrollback_capacity : 1, sizeof(unsigned short));
+		for (int i = 0; i < scrollback_length; ++i) {
+			widths[i] = scrollback_widths[(scrollback_start + i) % scrollback_capacity];
+		}
+		free(scrollback_cells);
+		free(scrollback_widths);
+		scrollback_cells = cells;
+		scrollback_widths = widths;
+		scrollback_stride = stride;
+		scrollback_start = 0;
+	}
+
+	if (scrollback_length == scrollback_capacity && scrollback_capacity < MAX_SCROLLBACK) {
+		/* Still growing, so the ring hasn't wrapped and rows are in order */
+		int capacity = scrollback_capacity ? scrollback_capacity * 2 : 256;
+		if (capacity > MAX_SCROLLBACK) capacity = MAX_SCROLLBACK;
+		scrollback_cells = realloc(scrollback_cells, sizeof(term_cell_t) * scrollback_stride * capacity);
+		scrollback_widths = realloc(scrollback_widths, sizeof(unsigned short) * capacity);
+		scrollback_capacity = capacity;
+	}
+}
+
 /* Save the row that is about to be scrolled offscreen into the scrollback buffer. */
 static void save_scrollback(void) {
+	scrollback_reserve();
 
-	/* If the scrollback is already full, remove the oldest element. */
-	if (scrollback_list->length == MAX_SCROLLBACK) {
-		free(list_dequeue(scrollback_list));
+	int index;
+	if (scrollback_length == scrollback_capacity) {
+		/* Full; the oldest row makes way */
+		index = scrollback_start;
+		scrollback_start = (scrollback_start + 1) % scrollback_capacity;
+	} else {
+		index = (scrollback_start + scrollback_length) % scrollback_capacity;
+		scrollback_length++;
 	}
 
-	struct scrollback_row * row = malloc(sizeof(struct scrollback_row) + sizeof(term_cell_t) * term_width + 20);
-	row->width = term_width;
-	for (int i = 0; i < term_width; ++i) {
-		term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (i) * sizeof(term_cell_t));
-		memcpy(&row->cells[i], cell, sizeof(term_cell_t));
-	}
+	scrollback_widths[index] = term_width;
+	memcpy(&scrollback_cells[index * scrollback_stride], cell_at(0, 0), sizeof(term_cell_t) * term_width);
+}
 
-	list_insert(scrollback_list, row);
+/* Give back the scrollback's memory when the system is short of it. */
+static void release_scrollback(void) {
+	if (scrollback_offset) return;
+	free(scrollback_cells);
+	free(scrollback_widths);
+	scrollback_cells = NULL;
+	scrollback_widths = NULL;
+	scrollback_stride = 0;
+	scrollback_capacity = 0;
+	scrollback_start = 0;
+	scrollback_length = 0;
+}
+
+static void low_memory_handler(int signum) {
+	(void)signum;
+	low_memory = 1;
+	signal(SIGLOWMEM, low_memory_handler);
 }
 
 /* Draw the scrollback. */
@@ -1298,7 +1451,7 @@ static void redraw_scrollback(void) {
 		for (int i = scrollback_offset; i < term_height; i++) {
 			int y = i - scrollback_offset;
 			for (int x = 0; x < term_width; ++x) {
-				term_cell_t * cell = (term_cell_t *)((uintptr_t)term_buffer + (y * term_width + x) * sizeof(term_cell_t));
+				term_cell_t * cell = cell_at(x, y);
 				if (cell->flags & ANSI_EXT_IMG) { redraw_cell_image(x,i,cell); continue; }
 				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, i * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
@@ -1308,79 +1461,69 @@ static void redraw_scrollback(void) {
 			}
 		}
 
-		node_t * node = scrollback_list->tail;
 		for (int i = 0; i < scrollback_offset; ++i) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
+			int row_width = 0;
+			term_cell_t * row = scrollback_row(i, &row_width);
 
 			int y = scrollback_offset - 1 - i;
-			int width = row->width;
+			int width = row_width;
 			if (width > term_width) {
 				width = term_width;
 			} else {
-				for (int x = row->width; x < term_width; ++x) {
+				for (int x = row_width; x < term_width; ++x) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				}
 			}
 			for (int x = 0; x < width; ++x) {
-				term_cell_t * cell = &row->cells[x];
+				term_cell_t * cell = &row[x];
 				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				} else {
 					term_write_char(cell->c, x * char_width, y * char_height, cell->fg, cell->bg, cell->flags);
 				}
 			}
-
-			node = node->prev;
 		}
 	} else {
-		node_t * node = scrollback_list->tail;
-		for (int i = 0; i < scrollback_offset - term_height; ++i) {
-			node = node->prev;
-		}
 		for (int i = scrollback_offset - term_height; i < scrollback_offset; ++i) {
-			struct scrollback_row * row = (struct scrollback_row *)node->value;
+			int row_width = 0;
+			term_cell_t * row = scrollback_row(i, &row_width);
 
 			int y = scrollback_offset - 1 - i;
-			int width = row->width;
+			int width = row_width;
 			if (width > term_width) {
 				width = term_width;
 			} else {
-				for (int x = row->width; x < term_width; ++x) {
+				for (int x = row_width; x < term_width; ++x) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				}
 			}
 			for (int x = 0; x < width; ++x) {
-				term_cell_t * cell = &row->cells[x];
+				term_cell_t * cell = &row[x];
 				if (((uint32_t *)cell)[0] == 0x00000000) {
 					term_write_char(' ', x * char_width, y * char_height, TERM_DEFAULT_FG, TERM_DEFAULT_BG, TERM_DEFAULT_FLAGS);
 				} else {
 					term_write_char(cell->c, x * char_width, y * char_height, cell->fg, cell->bg, cell->flags);
 				}
 			}
-
-			node = node->prev;
 		}
 	}
 	display_flip();
 }
 
 /*
- * ANSI callback for writing characters.
+ * Put one byte of output on the screen, leaving the cursor to the caller.
  * Parses some things (\n\r, etc.) itself that should probably
  * be moved into the ANSI library.
  */
-static void term_write(char c) {
+static void term_put(char c) {
 	static uint32_t unicode_state = 0;
 	static uint32_t codepoint = 0;
 
-	cell_redraw(csr_x, csr_y);
-
 	if (!decode(&unicode_state, &codepoint, (uint8_t)c)) {
 		uint32_t o = codepoint;
 		codepoint = 0;
 		if (c == '\r') {
 			csr_x = 0;
-			draw_cursor();
 			return;
 		}
 		if (csr_x < 0) csr_x = 0;
@@ -1402,7 +1545,6 @@ static void term_write(char c) {
 				term_scroll(1);
 				csr_y = term_height - 1;
 			}
-			draw_cursor();
 		} else if (c == '\007') {
 			/* bell */
 			/* XXX play sound */
@@ -1410,11 +1552,9 @@ static void term_write(char c) {
 			if (csr_x > 0) {
 				--csr_x;
 			}
-			cell_redraw(csr_x, csr_y);
-			draw_cursor();
+			cell_dirty(csr_x, csr_y);
 		} else if (c == '\t') {
 			csr_x += (8 - csr_x % 8);
-			draw_cursor();
 		} else {
 			int wide = is_wide(o);
 			uint8_t flags = ansi_state->flags;
@@ -1426,12 +1566,12 @@ static void term_write(char c) {
 				flags = flags | ANSI_WIDE;
 			}
 			cell_set(csr_x,csr_y, o, current_fg, current_bg, flags);
-			cell_redraw(csr_x,csr_y);
+			cell_dirty(csr_x,csr_y);
 			csr_x++;
 			if (wide && csr_x != term_width) {
 				cell_set(csr_x, csr_y, 0xFFFF, current_fg, current_bg, ansi_state->flags);
-				cell_redraw(csr_x,csr_y);
-				cell_redraw(csr_x-1,csr_y);
+				cell_dirty(csr_x,csr_y);
+				cell_dirty(csr_x-1,csr_y);
 				csr_x++;
 			}
 		}
@@ -1439,12 +1579,27 @@ static void term_write(char c) {
 		unicode_state = 0;
 		codepoint = 0;
 	}
+}
+
+/* ANSI callback for writing characters. */
+static void term_write(char c) {
+	cell_dirty(csr_x, csr_y);
+	term_put(c);
+	draw_cursor();
+}
+
+/* ANSI callback for writing a run of plain output; the cursor only moves once. */
+static void term_write_string(const char * str, size_t len) {
+	cell_dirty(csr_x, csr_y);
+	for (size_t i = 0; i < len; ++i) {
+		term_put(str[i]);
+	}
 	draw_cursor();
 }
 
 /* ANSI callback to set cursor position */
 static void term_set_csr(int x, int y) {
-	cell_redraw(csr_x,csr_y);
+	cell_dirty(csr_x,csr_y);
 	csr_x = x;
 	csr_y = y;
 	draw_cursor();
@@ -1502,7 +1657,7 @@ static void term_redraw_cursor() {
 /* ANSI callback to set a cell to a codepoint (only ever used to set spaces) */
 static void term_set_cell(int x, int y, uint32_t c) {
 	cell_set(x, y, c, current_fg, current_bg, ansi_state->flags);
-	cell_redraw(x, y);
+	cell_dirty(x, y);
 }
 
 /* ANSI callback to clear the terminal. */
@@ -1512,6 +1667,7 @@ static void term_clear(int i) {
 		csr_x = 0;
 		csr_y = 0;
 		memset((void *)term_buffer, 0x00, term_width * term_height * sizeof(term_cell_t));
+		term_offset = 0;
 		if (!_no_frame) {
 			render_decors();
 		}
@@ -1549,6 +1705,7 @@ static void term_switch_buffer(int buffer) {
 		active_buffer = buffer;
 		term_buffer = active_buffer == 0 ? term_buffer_a : term_buffer_b;
 
+		SWAP(int, term_offset, _orig_offset);
 		SWAP(int, csr_x, _orig_x);
 		SWAP(int, csr_y, _orig_y);
 		SWAP(uint32_t, current_fg, _orig_fg);
@@ -1578,6 +1735,7 @@ term_callbacks_t term_callbacks = {
 	term_get_cell_height,
 	term_set_csr_show,
 	term_switch_buffer,
+	term_write_string,
 };
 
 /* Write data into the PTY */
@@ -1603,7 +1761,7 @@ static void handle_input_s(char * c) {
 /* Scroll the view up (scrollback) */
 static void scroll_up(int amount) {
 	int i = 0;
-	while (i < amount && scrollback_list && scrollback_offset < (int)scrollback_list->length) {
+	while (i < amount && scrollback_offset < scrollback_length) {
 		scrollback_offset ++;
 		i++;
 	}
@@ -1613,7 +1771,7 @@ static void scroll_up(int amount) {
 /* Scroll the view down (scrollback) */
 void scroll_down(int amount) {
 	int i = 0;
-	while (i < amount && scrollback_list && scrollback_offset != 0) {
+	while (i < amount && scrollback_offset != 0) {
 		scrollback_offset -= 1;
 		i++;
 	}
@@ -1794,8 +1952,8 @@ static void key_event(int ret, key_event_t * event) {
 				break;
 			case KEY_HOME:
 				if (event->modifiers & KEY_MOD_LEFT_SHIFT) {
-					if (scrollback_list) {
-						scrollback_offset = scrollback_list->length;
+					if (scrollback_length) {
+						scrollback_offset = scrollback_length;
 						redraw_scrollback();
 					}
 				} else {
@@ -1839,8 +1997,9 @@ static void check_for_exit(void) {
 	write(fd_slave, exit_message, sizeof(exit_message));
 }
 
-static term_cell_t * copy_terminal(int old_width, int old_height, term_cell_t * term_buffer) {
+static term_cell_t * copy_terminal(int old_width, int old_height, int old_offset, term_cell_t * term_buffer) {
 	term_cell_t * new_term_buffer = malloc(sizeof(term_cell_t) * term_width * term_height);
+	int old_rows = old_height;
 
 	memset(new_term_buffer, 0x0, sizeof(term_cell_t) * term_width * term_height);
 
@@ -1854,7 +2013,8 @@ static term_cell_t * copy_terminal(int old_width, int old_height, term_cell_t *
 	}
 	for (int row = 0; row < min(old_height, term_height); ++row) {
 		for (int col = 0; col < min(old_width, term_width); ++col) {
-			term_cell_t * old_cell = (term_cell_t *)((uintptr_t)term_buffer + ((row + offset) * old_width + col) * sizeof(term_cell_t));
+			int old_row = (row + offset + old_offset) % old_rows;
+			term_cell_t * old_cell = (term_cell_t *)((uintptr_t)term_buffer + (old_row * old_width + col) * sizeof(term_cell_t));
 			term_cell_t * new_cell = (term_cell_t *)((uintptr_t)new_term_buffer + (row * term_width + col) * sizeof(term_cell_t));
 			*new_cell = *old_cell;
 		}
@@ -1867,6 +2027,18 @@ static term_cell_t * copy_terminal(int old_width, int old_height, term_cell_t *
 }
 
 /* Reinitialize the terminal after a resize. */
+/*
+ * In fullscreen mode every cell is blended over black before it goes
+ * in the window, so the text area is solid and the compositor can
+ * copy it, scrolls and all, instead of blending it.
+ */
+static void update_opaque_region(void) {
+	if (!_fullscreen) return;
+	int32_t x, y, w, h;
+	text_area(&x, &y, &w, &h);
+	yutani_window_set_opaque(yctx, window, x, y, w, h);
+}
+
 static void reinit(void) {
 
 	/* Figure out character sizes if fonts have changed. */
@@ -1904,8 +2076,10 @@ static void reinit(void) {
 	term_width  = window_width  / char_width;
 	term_height = window_height / char_height;
 	if (term_buffer) {
-		term_cell_t * new_a = copy_terminal(old_width, old_height, term_buffer_a);
-		term_cell_t * new_b = copy_terminal(old_width, old_height, term_buffer_b);
+		term_cell_t * new_a = copy_terminal(old_width, old_height, active_buffer == 0 ? term_offset : _orig_offset, term_buffer_a);
+		term_cell_t * new_b = copy_terminal(old_width, old_height, active_buffer == 1 ? term_offset : _orig_offset, term_buffer_b);
+		term_offset = 0;
+		_orig_offset = 0;
 		free(term_buffer_a);
 		term_buffer_a = new_a;
 		free(term_buffer_b);
@@ -1925,6 +2099,12 @@ static void reinit(void) {
 		term_buffer = term_buffer_a;
 	}
 
+	free(dirty_cells);
+	free(dirty_rows);
+	dirty_cells = calloc((term_width * term_height + 31) / 32, sizeof(uint32_t));
+	dirty_rows = calloc(term_height, 1);
+	dirty_any = 0;
+
 	/* Reset the ANSI library, ensuring we keep certain values */
 	int old_mouse_state = 0;
 	if (ansi_state) old_mouse_state = ansi_state->mouse_on;
@@ -1936,6 +2116,7 @@ static void reinit(void) {
 	render_decors();
 	term_redraw_all();
 	display_flip();
+	update_opaque_region();
 
 	/* Send window size change ioctl */
 	struct winsize w;
@@ -2009,6 +2190,7 @@ static void resize_finish(int width, int height) {
 
 	/* We are done resizing. */
 	yutani_window_resize_done(yctx, window);
+	update_opaque_region();
 	yutani_flip(yctx, window);
 }
 
@@ -2459,7 +2641,6 @@ int main(int argc, char ** argv) {
 	menu_insert(m, menu_create_normal("star","star","About Terminal", _menu_action_show_about));
 	menu_set_insert(terminal_menu_bar.set, "help", m);
 
-	scrollback_list = list_create();
 	images_list = list_create();
 
 	/* Initialize the graphics context */
@@ -2515,6 +2696,8 @@ int main(int argc, char ** argv) {
 		return 1;
 	} else {
 
+		signal(SIGLOWMEM, low_memory_handler);
+
 		/* Set up fswait to check Yutani and the PTY master */
 		int fds[2] = {fileno(yctx->sock), fd_master};
 
@@ -2523,26 +2706,44 @@ int main(int argc, char ** argv) {
 
 		while (!exit_application) {
 
-			/* Wait for something to happen. */
-			int index = fswait2(2,fds,200);
+			/*
+			 * Wait for something to happen. While output is pouring in,
+			 * only paint once a frame; whatever is left over gets painted
+			 * when the frame is up or the output stops.
+			 */
+			int timeout = 200;
+			if (dirty_any) {
+				uint64_t since = get_ticks() - last_paint;
+				timeout = since >= FRAME_TICKS ? 0 : (FRAME_TICKS - since) / 1000;
+			}
+			int index = fswait2(2,fds,timeout);
 
 			/* Check if the child application has closed. */
 			check_for_exit();
 
+			if (low_memory) {
+				low_memory = 0;
+				release_scrollback();
+			}
+
 			if (index == 1) {
 				/* Read from PTY */
 				maybe_flip_cursor();
 				int r = read(fd_master, buf, 1024);
-				for (int i = 0; i < r; ++i) {
-					ansi_put(ansi_state, buf[i]);
+				if (r > 0) {
+					ansi_put_string(ansi_state, (char *)buf, r);
+				}
+				if (get_ticks() - last_paint >= FRAME_TICKS) {
+					display_flip();
 				}
-				display_flip();
 			} else if (index == 0) {
 				/* Handle Yutani events. */
 				maybe_flip_cursor();
 				handle_incoming();
+				display_flip();
 			} else if (index == 2) {
-				/* Timeout, flip the cursor. */
+				/* Timeout: paint anything left over and flip the cursor. */
+				display_flip();
 				maybe_flip_cursor();
 			}
 		}
@@ -0,0 +1,80 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * ungz - Decompress gzip files
+ *
+ * ungz file.gz        decompresses to file and removes file.gz
+ * ungz file.gz dest   decompresses to dest and removes file.gz
+ * ungz file.gz -      decompresses to standard output and keeps file.gz
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <toaru/inflate.h>
+
+static size_t read_input(struct inflate_context * ctx, uint8_t * buf, size_t size) {
+	return fread(buf, 1, size, ctx->input_priv);
+}
+
+static int write_output(struct inflate_context * ctx, const uint8_t * buf, size_t size) {
+	return fwrite(buf, 1, size, ctx->output_priv) != size;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s file.gz\n", argv[0]);
+		return 1;
+	}
+
+	char * dest_name = NULL;
+
+	if (argc < 3) {
+		if (strstr(argv[1],".gz") != (argv[1] + strlen(argv[1]) - 3)) {
+			fprintf(stderr, "%s: Not sure if this file is gzipped. Try renaming it to include `.gz' at the end.\n", argv[0]);
+			return 1;
+		}
+		dest_name = strdup(argv[1]);
+		char * t = strstr(dest_name,".gz");
+		*t = '\0';
+	} else {
+		dest_name = argv[2];
+	}
+
+	int to_stdout = !strcmp(dest_name, "-");
+
+	FILE * src = fopen(argv[1], "r");
+	if (!src) {
+		fprintf(stderr, "%s: %s: could not open\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	FILE * dest = to_stdout ? stdout : fopen(dest_name, "w");
+	if (!dest) {
+		fprintf(stderr, "%s: %s: could not open for writing\n", argv[0], dest_name);
+		return 1;
+	}
+
+	struct inflate_context ctx;
+	ctx.input_priv = src;
+	ctx.output_priv = dest;
+	ctx.read_input = read_input;
+	ctx.write_output = write_output;
+
+	int ret = gzip_decompress(&ctx);
+
+	fclose(src);
+	fclose(dest);
+
+	if (ret) {
+		fprintf(stderr, "%s: %s: invalid or truncated gzip data\n", argv[0], argv[1]);
+		if (!to_stdout) unlink(dest_name);
+		return 1;
+	}
+
+	if (!to_stdout) unlink(argv[1]);
+
+	return 0;
+}
@@ -48,56 +48,95 @@ void print_seconds(int seconds) {
 	printf("%2d second%s", seconds, seconds != 1 ? "s" : "");
 }
 
-void print_uptime(void) {
+/*
+ * /proc/uptime is seconds up and seconds idle, each with milliseconds.
+ */
+static int read_uptime(unsigned long * up_ms, unsigned long * idle_ms) {
 	FILE * f = fopen("/proc/uptime", "r");
-	if (!f) return;
-
-	int seconds;
+	if (!f) return 1;
 
 	char buf[1024] = {0};
 	fgets(buf, 1024, f);
-	char * dot = strchr(buf, '.');
-	*dot = '\0';
-	dot++;
-	dot[3] = '\0';
+	fclose(f);
+
+	unsigned long fields[2] = {0,0};
+	char * p = buf;
+	for (int i = 0; i < 2 && *p; ++i) {
+		char * end;
+		fields[i] = strtoul(p, &end, 10) * 1000;
+		if (*end == '.') {
+			fields[i] += strtoul(end + 1, &end, 10);
+		}
+		p = end;
+	}
 
-	seconds = atoi(buf);
+	*up_ms = fields[0];
+	*idle_ms = fields[1];
+	return 0;
+}
+
+void print_uptime(void) {
+	unsigned long up_ms, idle_ms;
+	if (read_uptime(&up_ms, &idle_ms)) return;
 
 	printf("up ");
 
-	print_seconds(seconds);
+	print_seconds(up_ms / 1000);
+}
+
+void print_idle(void) {
+	unsigned long up_ms, idle_ms;
+	if (read_uptime(&up_ms, &idle_ms) || !up_ms) return;
+
+	/* In tenths, without floating point */
+	unsigned long permille = (unsigned long long)idle_ms * 1000 / up_ms;
+	printf("%lu.%lu%% idle", permille / 10, permille % 10);
 }
 
 void show_usage(int argc, char * argv[]) {
 	printf(
 			"uptime - display system uptime information\n"
 			"\n"
-			"usage: %s [-p]\n"
+			"usage: %s [-pi]\n"
 			"\n"
 			" -p     \033[3mshow just the uptime info\033[0m\n"
+			" -i     \033[3mshow just how much of it was idle\033[0m\n"
 			" -?     \033[3mshow this help text\033[0m\n"
 			"\n", argv[0]);
 }
 
 int main(int argc, char * argv[]) {
 	int just_pretty_uptime = 0;
+	int just_idle = 0;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "?p")) != -1 ) {
+	while ((opt = getopt(argc, argv, "?pi")) != -1 ) {
 		switch (opt) {
 			case 'p':
 				just_pretty_uptime = 1;
 				break;
+			case 'i':
+				just_idle = 1;
+				break;
 			case '?':
 				show_usage(argc, argv);
 				return 0;
 		}
 	}
 
+	if (just_idle) {
+		print_idle();
+		printf("\n");
+		return 0;
+	}
 
 	if (!just_pretty_uptime)
 		print_time();
 	print_uptime();
+	if (!just_pretty_uptime) {
+		printf(",  ");
+		print_idle();
+	}
 
 	printf("\n");
 
@@ -4,13 +4,108 @@
  * Copyright (C) 2018 K. Lange
  *
  * wc - count bytes, characters, words, lines...
+ *
+ * Input is read a block at a time and counted sixteen bytes at a time
+ * with SSE2. Words are runs of anything but whitespace; characters are
+ * UTF-8 characters.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
-#include <toaru/decodeutf8.h>
+#include <fcntl.h>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_SIZE 0x10000
+
+struct counts {
+	unsigned long lines;
+	unsigned long words;
+	unsigned long chars;
+	unsigned long bytes;
+	int in_space; /* Last byte seen was whitespace (or there wasn't one) */
+};
+
+static int is_space(unsigned char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Characters are counted as the bytes that don't continue a UTF-8 sequence */
+static void count_bytes(struct counts * n, const unsigned char * buf, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		int space = is_space(buf[i]);
+		if (buf[i] == '\n') n->lines++;
+		if (!space && n->in_space) n->words++;
+		if ((buf[i] & 0xC0) != 0x80) n->chars++;
+		n->in_space = space;
+	}
+}
+
+/*
+ * Sixteen bytes at a time: each test is a compare that gives a bit per
+ * byte, and counts are popcounts of those. A word starts wherever a
+ * byte that isn't whitespace follows one that is.
+ */
+static void count_block(struct counts * n, const unsigned char * buf, size_t len) {
+	size_t i = 0;
+#ifndef NO_SSE
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i space   = _mm_set1_epi8(' ');
+	const __m128i tab     = _mm_set1_epi8('\t');
+	const __m128i four    = _mm_set1_epi8(4);
+	const __m128i lead    = _mm_set1_epi8(-64); /* Continuation bytes are the signed ones below this */
+	unsigned int carry = n->in_space;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		/* \t through \r are the bytes at most four above \t */
+		__m128i ctl = _mm_sub_epi8(v, tab);
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+		unsigned int ws_bits = _mm_movemask_epi8(ws);
+		unsigned int before = ((ws_bits << 1) | carry) & 0xFFFF;
+		n->words += __builtin_popcount(before & ~ws_bits & 0xFFFF);
+		n->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+		n->chars += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(lead, v)));
+		carry = ws_bits >> 15;
+	}
+	n->in_space = carry;
+#endif
+	count_bytes(n, buf + i, len - i);
+	n->bytes += len;
+}
+
+static int count_file(int fd, struct counts * n) {
+	static unsigned char * buf = NULL;
+	if (!buf) buf = malloc(BLOCK_SIZE);
+	memset(n, 0, sizeof(struct counts));
+	n->in_space = 1;
+	while (1) {
+		ssize_t r = read(fd, buf, BLOCK_SIZE);
+		if (r == 0) return 0;
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		count_block(n, buf, r);
+	}
+}
+
+static void print_counts(struct counts * n, int show_lines, int show_words, int show_chars, int show_bytes, char * name) {
+	if (!show_words && !show_chars && !show_bytes && !show_lines) {
+		fprintf(stdout, "%lu %lu %lu %s\n", n->lines, n->words, n->bytes, name);
+	} else {
+		if (show_lines) fprintf(stdout, "%lu ", n->lines);
+		if (show_words) fprintf(stdout, "%lu ", n->words);
+		if (show_chars) fprintf(stdout, "%lu ", n->chars);
+		if (show_bytes) fprintf(stdout, "%lu ", n->bytes);
+		fprintf(stdout, "%s\n", name);
+	}
+}
 
 int main(int argc, char * argv[]) {
 	int show_lines = 0;
@@ -38,9 +133,7 @@ int main(int argc, char * argv[]) {
 	}
 
 	int retval = 0;
-	int total_lines = 0;
-	int total_chars = 0;
-	int total_words = 0;
+	struct counts total = {0};
 	int just_stdin = 0;
 
 	if (optind == argc) {
@@ -55,77 +148,33 @@ int main(int argc, char * argv[]) {
 			retval = 1;
 			continue;
 		}
-		FILE * f = (!strcmp(argv[i], "-") || just_stdin) ? stdin : fopen(argv[i], "r");
-		if (!f) {
+		int fd = (!strcmp(argv[i], "-") || just_stdin) ? STDIN_FILENO : open(argv[i], O_RDONLY);
+		if (fd < 0) {
 			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
 			retval = 1;
 			continue;
 		}
 
-		int lines = 0;
-		int chars = 0;
-		int words = 0;
-		int ch;
-		uint32_t state, c;
-		int last_was_whitespace = 0;
-
-		while (!feof(f)) {
-			ch = getc(f);
-			if (ch < 0) break;
-
-			if (show_chars) {
-				if (!decode(&state, &c, ch)) {
-				} else if (state == UTF8_REJECT) {
-					state = 0;
-				}
-			} else {
-				c = ch;
-			}
-
-			chars++;
-			if (c == '\n') {
-				last_was_whitespace = 1;
-				lines++;
-				words++;
-			} else if (c == ' ') {
-				if (last_was_whitespace) continue;
-				last_was_whitespace = 1;
-				words++;
-			} else {
-				last_was_whitespace = 0;
-			}
+		struct counts n;
+		if (count_file(fd, &n) < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+			retval = 1;
 		}
 
-		if (!last_was_whitespace && chars > 0) words++;
-
-		if (!show_words && !show_chars && !show_bytes && !show_lines) {
-			fprintf(stdout, "%d %d %d %s\n", lines, words, chars, argv[i]);
-		} else {
-			if (show_lines) fprintf(stdout, "%d ", lines);
-			if (show_words) fprintf(stdout, "%d ", words);
-			if (show_bytes|show_chars) fprintf(stdout, "%d ", chars);
-			fprintf(stdout, "%s\n", argv[i]);
-		}
+		print_counts(&n, show_lines, show_words, show_chars, show_bytes, argv[i]);
 
-		total_lines += lines;
-		total_words += words;
-		total_chars += chars;
+		total.lines += n.lines;
+		total.words += n.words;
+		total.chars += n.chars;
+		total.bytes += n.bytes;
 
-		if (f != stdin) fclose(f);
-		if (just_stdin) return 0;
+		if (fd != STDIN_FILENO) close(fd);
+		if (just_stdin) return retval;
 	}
 
 	if (optind + 1 < argc) {
-		if (!show_words && !show_chars && !show_bytes && !show_lines) {
-			fprintf(stdout, "%d %d %d %s\n", total_lines, total_words, total_chars, "total");
-		} else {
-			if (show_lines) fprintf(stdout, "%d ", total_lines);
-			if (show_words) fprintf(stdout, "%d ", total_words);
-			if (show_bytes|show_chars) fprintf(stdout, "%d ", total_chars);
-			fprintf(stdout, "%s\n", "total");
-		}
+		print_counts(&total, show_lines, show_words, show_chars, show_bytes, "total");
 	}
 
 	return retval;
 }
-
@@ -5,14 +5,16 @@
  *
  * yutani-query - Query display server information
  *
- * At the moment, this only supports querying the display
- * resolution. An older version of this application had
+ * Supports querying the display resolution and the compositor's
+ * recent frame timings. An older version of this application had
  * support for getting the default font names, but the
  * font server is no longer part of the compositor, so
  * that functionality doesn't make sense here.
  */
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include <toaru/yutani.h>
 
@@ -23,10 +25,11 @@ void show_usage(int argc, char * argv[]) {
 	printf(
 			"yutani-query - show misc. information about the display system\n"
 			"\n"
-			"usage: %s [-r?]\n"
+			"usage: %s [-res?]\n"
 			"\n"
 			" -r     \033[3mprint display resoluton\033[0m\n"
 			" -e     \033[3mask compositor to reload extensions\033[0m\n"
+			" -s     \033[3mshow recent frame timings\033[0m\n"
 			" -?     \033[3mshow this help text\033[0m\n"
 			"\n", argv[0]);
 }
@@ -49,10 +52,75 @@ int reload(void) {
 	return 0;
 }
 
+/* Frame time histogram buckets, in milliseconds */
+static const int buckets[] = {4, 8, 17, 33, 67};
+#define BUCKETS (sizeof(buckets) / sizeof(*buckets))
+
+int show_stats(void) {
+	if (!yctx) {
+		if (!quiet) printf("(not connected)\n");
+		return 1;
+	}
+
+	yutani_stats_t * stats = yutani_stats(yctx);
+	uint32_t count = stats->count;
+	uint32_t n = count < YUTANI_STATS_FRAMES ? count : YUTANI_STATS_FRAMES;
+	if (!n) {
+		printf("no frames drawn yet\n");
+		return 0;
+	}
+
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	uint64_t now = (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+
+	uint64_t total = 0, damage = 0, blit = 0, flip = 0, renderer = 0, area = 0, windows = 0;
+	uint32_t worst = 0;
+	int recent = 0;
+	int histogram[BUCKETS+1] = {0};
+
+	for (uint32_t i = count - n; i != count; ++i) {
+		yutani_frame_stats_t * f = &stats->frames[i % YUTANI_STATS_FRAMES];
+		total += f->total;
+		damage += f->damage;
+		blit += f->blit;
+		flip += f->flip;
+		renderer += f->renderer;
+		area += f->area;
+		windows += f->windows;
+		if (f->total > worst) worst = f->total;
+		if (now - f->start < 1000000) recent++;
+
+		unsigned int b = 0;
+		while (b < BUCKETS && f->total >= (uint32_t)buckets[b] * 1000) b++;
+		histogram[b]++;
+	}
+
+	printf("frames:   %u drawn, %d in the last second\n", (unsigned int)count, recent);
+	printf("last %u frames, average (ms):\n", (unsigned int)n);
+	printf("  total    %.2f (worst %.2f)\n", total / 1000.0 / n, worst / 1000.0);
+	printf("  damage   %.2f\n", damage / 1000.0 / n);
+	printf("  blit     %.2f (%.1f windows)\n", blit / 1000.0 / n, (double)windows / n);
+	printf("  flip     %.2f\n", flip / 1000.0 / n);
+	printf("  renderer %.2f\n", renderer / 1000.0 / n);
+	printf("  damage area %llu pixels\n", (unsigned long long)(area / n));
+	printf("frame times:\n");
+	for (unsigned int b = 0; b <= BUCKETS; ++b) {
+		char label[32];
+		if (b == 0) sprintf(label, "< %dms", buckets[0]);
+		else if (b == BUCKETS) sprintf(label, ">= %dms", buckets[BUCKETS-1]);
+		else sprintf(label, "%d-%dms", buckets[b-1], buckets[b]);
+		printf("  %-8s %4d ", label, histogram[b]);
+		for (int i = 0; i < histogram[b] * 50 / (int)n; ++i) printf("#");
+		printf("\n");
+	}
+	return 0;
+}
+
 int main(int argc, char * argv[]) {
 	yctx = yutani_init();
 	int opt;
-	while ((opt = getopt(argc, argv, "?qre")) != -1) {
+	while ((opt = getopt(argc, argv, "?qres")) != -1) {
 		switch (opt) {
 			case 'q':
 				quiet = 1;
@@ -63,6 +131,8 @@ int main(int argc, char * argv[]) {
 				return show_resolution();
 			case 'e':
 				return reload();
+			case 's':
+				return show_stats();
 
 			case '?':
 				show_usage(argc,argv);
@@ -75,6 +145,8 @@ int main(int argc, char * argv[]) {
 			return show_resolution();
 		} else if (!strcmp(argv[optind], "reload")) {
 			return reload();
+		} else if (!strcmp(argv[optind], "stats")) {
+			return show_stats();
 		} else {
 			fprintf(stderr, "%s: unsupported command: %s\n", argv[0], argv[optind]);
 			return 1;
@@ -0,0 +1,724 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * yutani-remote - Show a display on another machine
+ *
+ * On the machine to be shown, `yutani-remote serve` stands in for a
+ * compositor with one window, for a nested compositor to run in:
+ *
+ *     yutani-remote serve &
+ *     DISPLAY=remote compositor -n -g 1024x768
+ *
+ * and `yutani-remote view HOST` on the other end shows that window and
+ * sends back keys, the mouse and resizes. Only the rectangles the
+ * client flipped cross the network, each sent as its difference from
+ * the last frame and run-length packed, so anything that didn't change
+ * costs next to nothing.
+ *
+ * One viewer at a time; a new one takes over. Everything goes in the
+ * sender's byte order, as both ends are us.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/shm.h>
+#include <sys/fswait.h>
+#include <sys/socket.h>
+
+#include <toaru/pex.h>
+#include <toaru/yutani.h>
+#include <toaru/yutani-internal.h>
+
+#define REMOTE_PORT     5930
+#define REMOTE_DISPLAY  "remote"
+#define REMOTE_FRAME_MS 16    /* How often damage is collected and sent */
+#define REMOTE_RECTS    32    /* Damage kept apart per frame before it is merged */
+#define REMOTE_INPUT    256   /* Largest packet a viewer sends */
+
+enum {
+	REMOTE_SIZE = 1, /* struct remote_size: the window is now this big */
+	REMOTE_RECT,     /* struct remote_rect, then the packed difference */
+	REMOTE_FRAME,    /* Everything since the last one is ready to show */
+	REMOTE_CURSOR,   /* int32_t: what the client asked show_mouse for */
+	REMOTE_KEY,      /* struct yutani_msg_key_event */
+	REMOTE_MOUSE,    /* struct yutani_msg_window_mouse_event */
+	REMOTE_RESIZE,   /* struct remote_size: the viewer's window was resized */
+};
+
+struct remote_header {
+	uint32_t type;
+	uint32_t size; /* Of what follows */
+};
+
+struct remote_size {
+	uint32_t width;
+	uint32_t height;
+};
+
+struct remote_rect {
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+static int port = REMOTE_PORT;
+static char * display = REMOTE_DISPLAY;
+static int display_width = 1024;
+static int display_height = 768;
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"yutani-remote - show a display on another machine\n"
+			"\n"
+			"usage: %s [-p port] [-d name] [-g WxH] serve\n"
+			"       %s [-p port] view HOST\n"
+			"\n"
+			" -p     \033[3mport to listen on or connect to (default %d)\033[0m\n"
+			" -d     \033[3mdisplay name to serve as (default " REMOTE_DISPLAY ")\033[0m\n"
+			" -g     \033[3mdisplay size to tell the client (default 1024x768)\033[0m\n"
+			"\n", argv[0], argv[0], REMOTE_PORT);
+	return 1;
+}
+
+static uint64_t now_ms(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000 + t.tv_usec / 1000;
+}
+
+static int write_all(int fd, void * buf, size_t len) {
+	char * p = buf;
+	while (len) {
+		ssize_t w = write(fd, p, len);
+		if (w <= 0) return -1;
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void * buf, size_t len) {
+	char * p = buf;
+	while (len) {
+		ssize_t r = read(fd, p, len);
+		if (r <= 0) return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/* For the small packets; rectangles are put together in place */
+static int remote_send(int fd, uint32_t type, void * data, size_t size) {
+	char packet[sizeof(struct remote_header) + REMOTE_INPUT];
+	struct remote_header * header = (void *)packet;
+	header->type = type;
+	header->size = size;
+	memcpy(packet + sizeof(struct remote_header), data, size);
+	return write_all(fd, packet, sizeof(struct remote_header) + size);
+}
+
+/*
+ * Rectangles go as the XOR of each pixel with what it was last frame,
+ * row by row, cut into runs: a 16-bit count with the top bit set means
+ * that many copies (plus one) of the word after it, and without it that
+ * many words (plus one) as they are. What didn't change is all zeroes.
+ */
+#define RUN_REPEAT 0x8000
+#define RUN_MAX    0x8000
+
+/* Room remote_encode() may need for `count` words */
+#define ENCODED_MAX(count) ((count) * 4 + ((count) / RUN_MAX + 2) * 2)
+
+static uint8_t * encode_literal(uint8_t * out, uint32_t * words, size_t count) {
+	while (count) {
+		size_t n = count < RUN_MAX ? count : RUN_MAX;
+		uint16_t header = n - 1;
+		memcpy(out, &header, 2);
+		memcpy(out + 2, words, n * 4);
+		out += 2 + n * 4;
+		words += n;
+		count -= n;
+	}
+	return out;
+}
+
+static size_t remote_encode(uint32_t * words, size_t count, uint8_t * out) {
+	uint8_t * o = out;
+	size_t literal = 0;
+	size_t i = 0;
+
+	while (i < count) {
+		size_t run = 1;
+		while (i + run < count && run < RUN_MAX && words[i + run] == words[i]) run++;
+		if (run < 3) {
+			i += run;
+			continue;
+		}
+		o = encode_literal(o, words + literal, i - literal);
+		uint16_t header = RUN_REPEAT | (run - 1);
+		memcpy(o, &header, 2);
+		memcpy(o + 2, &words[i], 4);
+		o += 6;
+		i += run;
+		literal = i;
+	}
+
+	o = encode_literal(o, words + literal, count - literal);
+	return o - out;
+}
+
+/* XOR a packed rectangle into `dest`; -1 if it doesn't fit what it says it is */
+static int remote_decode(uint8_t * in, size_t length, uint32_t * dest, int stride, int width, int height) {
+	uint8_t * end = in + length;
+	size_t left = (size_t)width * height;
+	uint32_t * row = dest;
+	int x = 0;
+
+#define PUT(v) do { row[x] ^= (v); if (++x == width) { x = 0; row += stride; } } while (0)
+
+	while (in + 2 <= end) {
+		uint16_t header;
+		memcpy(&header, in, 2);
+		in += 2;
+		size_t n = (header & (RUN_MAX - 1)) + 1;
+		if (n > left) return -1;
+		left -= n;
+		if (header & RUN_REPEAT) {
+			uint32_t v;
+			if (in + 4 > end) return -1;
+			memcpy(&v, in, 4);
+			in += 4;
+			while (n--) PUT(v);
+		} else {
+			if (in + n * 4 > end) return -1;
+			while (n--) {
+				uint32_t v;
+				memcpy(&v, in, 4);
+				in += 4;
+				PUT(v);
+			}
+		}
+	}
+
+#undef PUT
+
+	return left ? -1 : 0;
+}
+
+/*
+ * Serving
+ */
+static FILE * server;
+static uintptr_t client;
+static int viewer = -1;
+
+/* The client's window */
+static yutani_wid_t wid;
+static uint32_t bufid;
+static uint32_t * buffer;
+static int width, height;
+static yutani_damage_ring_t * damage;
+static int show_mouse = 1;
+
+/* Where a resize is going */
+static uint32_t newbufid;
+static uint32_t * newbuffer;
+
+/* The last frame the viewer has, and room to send the next */
+static uint32_t * last;
+static uint32_t * delta;
+static uint8_t * packet;
+
+static struct remote_rect dirty[REMOTE_RECTS];
+static int dirty_count;
+
+static uint32_t next_id(void) {
+	static uint32_t _next = 1;
+	return _next++;
+}
+
+static void * buffer_obtain(uint32_t id, int w, int h) {
+	char key[1024];
+	YUTANI_SHMKEY_EXP(display, key, 1024, id);
+	size_t size = (size_t)w * h * 4;
+	return shm_obtain(key, &size);
+}
+
+static void buffer_release(uint32_t id) {
+	char key[1024];
+	YUTANI_SHMKEY_EXP(display, key, 1024, id);
+	shm_release(key);
+}
+
+static void mark(int32_t x, int32_t y, int32_t w, int32_t h) {
+	int32_t x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+	int32_t x1 = x + w > width ? width : x + w;
+	int32_t y1 = y + h > height ? height : y + h;
+	if (x0 >= x1 || y0 >= y1) return;
+
+	if (dirty_count == REMOTE_RECTS) {
+		/* Too many pieces; send the box around all of them */
+		for (int i = 1; i < dirty_count; ++i) {
+			struct remote_rect * r = &dirty[i];
+			int32_t bx1 = dirty[0].x + dirty[0].width, by1 = dirty[0].y + dirty[0].height;
+			if (r->x < dirty[0].x) dirty[0].x = r->x;
+			if (r->y < dirty[0].y) dirty[0].y = r->y;
+			if (r->x + r->width > bx1) bx1 = r->x + r->width;
+			if (r->y + r->height > by1) by1 = r->y + r->height;
+			dirty[0].width = bx1 - dirty[0].x;
+			dirty[0].height = by1 - dirty[0].y;
+		}
+		dirty_count = 1;
+	}
+
+	dirty[dirty_count++] = (struct remote_rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+/* A fresh start for the viewer: it has nothing, so everything is new */
+static void frame_reset(void) {
+	free(last);
+	free(delta);
+	free(packet);
+	size_t count = (size_t)width * height;
+	last = calloc(count, 4);
+	delta = malloc(count * 4);
+	packet = malloc(sizeof(struct remote_header) + sizeof(struct remote_rect) + ENCODED_MAX(count));
+	dirty_count = 0;
+	mark(0, 0, width, height);
+
+	if (viewer >= 0) {
+		struct remote_size size = {width, height};
+		remote_send(viewer, REMOTE_SIZE, &size, sizeof(size));
+		remote_send(viewer, REMOTE_CURSOR, &show_mouse, sizeof(show_mouse));
+	}
+}
+
+static void viewer_close(void) {
+	if (viewer < 0) return;
+	close(viewer);
+	viewer = -1;
+}
+
+/* Pick up what the client flipped */
+static void collect_damage(void) {
+	if (!damage) return;
+	while (damage->tail != damage->head) {
+		uint32_t tail = damage->tail;
+		yutani_damage_rect_t * r = &damage->entries[tail % YUTANI_DAMAGE_RING_SIZE].rect;
+		mark(r->x, r->y, r->width, r->height);
+		/* Done reading the entry before the client can reuse it */
+		__sync_synchronize();
+		damage->tail = tail + 1;
+	}
+	if (damage->overflow) {
+		damage->overflow = 0;
+		mark(0, 0, width, height);
+	}
+}
+
+static void send_frame(void) {
+	if (viewer < 0 || !dirty_count) return;
+
+	for (int i = 0; i < dirty_count; ++i) {
+		struct remote_rect * r = &dirty[i];
+		size_t n = 0;
+		for (int32_t y = r->y; y < r->y + r->height; ++y) {
+			uint32_t * src = &buffer[y * width + r->x];
+			uint32_t * old = &last[y * width + r->x];
+			for (int32_t x = 0; x < r->width; ++x) {
+				delta[n++] = src[x] ^ old[x];
+				old[x] = src[x];
+			}
+		}
+
+		struct remote_header * header = (void *)packet;
+		memcpy(packet + sizeof(struct remote_header), r, sizeof(struct remote_rect));
+		size_t length = remote_encode(delta, n, packet + sizeof(struct remote_header) + sizeof(struct remote_rect));
+		header->type = REMOTE_RECT;
+		header->size = sizeof(struct remote_rect) + length;
+
+		if (write_all(viewer, packet, sizeof(struct remote_header) + header->size) < 0) {
+			viewer_close();
+			return;
+		}
+	}
+
+	dirty_count = 0;
+	if (remote_send(viewer, REMOTE_FRAME, NULL, 0) < 0) viewer_close();
+}
+
+static void client_send(yutani_msg_t * msg) {
+	pex_send(server, client, msg->size, (char *)msg);
+}
+
+static void window_create(int w, int h) {
+	yutani_msg_buildx_window_init_alloc(response);
+
+	if (wid) {
+		/* Past the first, windows aren't shown; the client can back them itself */
+		yutani_msg_buildx_window_init(response, next_id() + 0x10000, w, h, next_id());
+		client_send(response);
+		return;
+	}
+
+	wid = 1;
+	bufid = next_id();
+	width = w;
+	height = h;
+	buffer = buffer_obtain(bufid, w, h);
+
+	char key[1024];
+	YUTANI_SHMKEY_DAMAGE(display, key, 1024, wid);
+	size_t size = sizeof(yutani_damage_ring_t);
+	damage = shm_obtain(key, &size);
+
+	frame_reset();
+
+	yutani_msg_buildx_window_init(response, wid, w, h, bufid);
+	client_send(response);
+}
+
+static void handle_client(pex_packet_t * p) {
+	if (p->size == 0) {
+		if (p->source == client) {
+			fprintf(stderr, "yutani-remote: client went away\n");
+			exit(0);
+		}
+		return;
+	}
+
+	yutani_msg_t * m = (yutani_msg_t *)p->data;
+	if (m->magic != YUTANI_MSG__MAGIC) return;
+
+	switch (m->type) {
+		case YUTANI_MSG_HELLO:
+			{
+				if (!client) client = p->source;
+				yutani_msg_buildx_welcome_alloc(response);
+				yutani_msg_buildx_welcome(response, display_width, display_height);
+				pex_send(server, p->source, response->size, (char *)response);
+			}
+			break;
+		case YUTANI_MSG_WINDOW_NEW:
+		case YUTANI_MSG_WINDOW_NEW_FLAGS:
+			{
+				/* The same size fields come first in both */
+				struct yutani_msg_window_new * wn = (void *)m->data;
+				if (p->source == client) window_create(wn->width, wn->height);
+			}
+			break;
+		case YUTANI_MSG_FLIP:
+			{
+				struct yutani_msg_flip * wf = (void *)m->data;
+				if (wf->wid == wid) mark(0, 0, width, height);
+			}
+			break;
+		case YUTANI_MSG_FLIP_REGION:
+			{
+				struct yutani_msg_flip_region * wf = (void *)m->data;
+				if (wf->wid == wid) mark(wf->x, wf->y, wf->width, wf->height);
+			}
+			break;
+		case YUTANI_MSG_WINDOW_SHOW_MOUSE:
+			{
+				struct yutani_msg_window_show_mouse * ws = (void *)m->data;
+				if (ws->wid == wid && ws->show_mouse != show_mouse) {
+					show_mouse = ws->show_mouse;
+					if (viewer >= 0) remote_send(viewer, REMOTE_CURSOR, &show_mouse, sizeof(show_mouse));
+				}
+			}
+			break;
+		case YUTANI_MSG_RESIZE_ACCEPT:
+			{
+				struct yutani_msg_window_resize * wr = (void *)m->data;
+				if (wr->wid != wid) break;
+				if (!newbufid) {
+					newbufid = next_id();
+					newbuffer = buffer_obtain(newbufid, wr->width, wr->height);
+				}
+				yutani_msg_buildx_window_resize_alloc(response);
+				yutani_msg_buildx_window_resize(response, YUTANI_MSG_RESIZE_BUFID, wid, wr->width, wr->height, newbufid, 0);
+				client_send(response);
+			}
+			break;
+		case YUTANI_MSG_RESIZE_DONE:
+			{
+				struct yutani_msg_window_resize * wr = (void *)m->data;
+				if (wr->wid != wid || !newbufid) break;
+				/* Collect what was flipped into the old one before letting go of it */
+				collect_damage();
+				buffer_release(bufid);
+				bufid = newbufid;
+				buffer = newbuffer;
+				newbufid = 0;
+				newbuffer = NULL;
+				width = wr->width;
+				height = wr->height;
+				frame_reset();
+			}
+			break;
+		default:
+			/* Moving, stacking, titles and the like mean nothing here */
+			break;
+	}
+}
+
+static void handle_viewer(void) {
+	struct remote_header header;
+	char data[REMOTE_INPUT];
+
+	if (read_all(viewer, &header, sizeof(header)) < 0 || header.size > REMOTE_INPUT ||
+			read_all(viewer, data, header.size) < 0) {
+		viewer_close();
+		return;
+	}
+
+	if (!wid) return;
+
+	switch (header.type) {
+		case REMOTE_KEY:
+			if (header.size == sizeof(struct yutani_msg_key_event)) {
+				struct yutani_msg_key_event * ke = (void *)data;
+				yutani_msg_buildx_key_event_alloc(m);
+				yutani_msg_buildx_key_event(m, wid, &ke->event, &ke->state);
+				client_send(m);
+			}
+			break;
+		case REMOTE_MOUSE:
+			if (header.size == sizeof(struct yutani_msg_window_mouse_event)) {
+				struct yutani_msg_window_mouse_event * me = (void *)data;
+				yutani_msg_buildx_window_mouse_event_alloc(m);
+				yutani_msg_buildx_window_mouse_event(m, wid, me->new_x, me->new_y, me->old_x, me->old_y, me->buttons, me->command, me->modifiers);
+				client_send(m);
+			}
+			break;
+		case REMOTE_RESIZE:
+			if (header.size == sizeof(struct remote_size)) {
+				struct remote_size * size = (void *)data;
+				yutani_msg_buildx_window_resize_alloc(m);
+				yutani_msg_buildx_window_resize(m, YUTANI_MSG_RESIZE_OFFER, wid, size->width, size->height, 0, 0);
+				client_send(m);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static int serve(void) {
+	int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0) {
+		fprintf(stderr, "yutani-remote: can't listen on port %d\n", port);
+		return 1;
+	}
+
+	server = pex_bind(display);
+	if (!server) {
+		fprintf(stderr, "yutani-remote: can't serve as %s\n", display);
+		return 1;
+	}
+
+	pex_packet_t * p = malloc(PACKET_SIZE);
+	uint64_t next_frame = now_ms();
+
+	while (1) {
+		int fds[3] = {fileno(server), listener, viewer};
+		int timeout = (int)(next_frame - now_ms());
+		if (timeout < 0) timeout = 0;
+		int index = fswait2(viewer >= 0 ? 3 : 2, fds, timeout);
+
+		if (index == 0) {
+			pex_listen(server, p);
+			handle_client(p);
+		} else if (index == 1) {
+			int fd = accept(listener, NULL, NULL);
+			if (fd >= 0) {
+				viewer_close();
+				viewer = fd;
+				if (wid) frame_reset();
+			}
+		} else if (index == 2) {
+			handle_viewer();
+		}
+
+		if (now_ms() >= next_frame) {
+			collect_damage();
+			send_frame();
+			next_frame = now_ms() + REMOTE_FRAME_MS;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Viewing
+ */
+static int view(char * host) {
+	char path[512];
+	snprintf(path, 512, "/dev/net/%s:%d", host, port);
+	int sock = open(path, O_RDWR);
+	if (sock < 0) {
+		fprintf(stderr, "yutani-remote: can't connect to %s\n", host);
+		return 1;
+	}
+
+	yutani_t * yctx = yutani_init();
+	if (!yctx) {
+		fprintf(stderr, "yutani-remote: no compositor\n");
+		return 1;
+	}
+
+	yutani_window_t * win = NULL;
+	int resizing = 0;
+	struct remote_rect flips[REMOTE_RECTS];
+	int flip_count = 0;
+
+	uint8_t * data = NULL;
+	size_t data_size = 0;
+
+	while (1) {
+		int fds[2] = {sock, fileno(yctx->sock)};
+		int index = fswait2(2, fds, 200);
+
+		if (index == 0) {
+			struct remote_header header;
+			if (read_all(sock, &header, sizeof(header)) < 0) break;
+			if (header.size > data_size) {
+				data = realloc(data, header.size);
+				data_size = header.size;
+			}
+			if (read_all(sock, data, header.size) < 0) break;
+
+			switch (header.type) {
+				case REMOTE_SIZE:
+					{
+						struct remote_size * size = (void *)data;
+						if (header.size != sizeof(struct remote_size)) break;
+						if (!win) {
+							win = yutani_window_create(yctx, size->width, size->height);
+							yutani_window_advertise_icon(yctx, win, "Remote Display", "compositor");
+						} else if (win->width != size->width || win->height != size->height) {
+							yutani_window_resize_accept(yctx, win, size->width, size->height);
+							resizing = 1;
+						}
+						/* Whatever was drawn before is gone on the other end too */
+						memset(win->buffer, 0, win->width * win->height * 4);
+						flip_count = 0;
+					}
+					break;
+				case REMOTE_RECT:
+					{
+						struct remote_rect * r = (void *)data;
+						if (!win || header.size < sizeof(struct remote_rect)) break;
+						if (r->x < 0 || r->y < 0 || r->width <= 0 || r->height <= 0 ||
+								r->x + r->width > (int32_t)win->width || r->y + r->height > (int32_t)win->height) break;
+						uint32_t * dest = (uint32_t *)win->buffer + r->y * win->width + r->x;
+						if (remote_decode(data + sizeof(struct remote_rect), header.size - sizeof(struct remote_rect), dest, win->width, r->width, r->height) < 0) {
+							fprintf(stderr, "yutani-remote: bad rectangle from %s\n", host);
+						}
+						if (flip_count < REMOTE_RECTS) {
+							flips[flip_count++] = *r;
+						} else {
+							flips[0] = (struct remote_rect){0, 0, win->width, win->height};
+							flip_count = 1;
+						}
+					}
+					break;
+				case REMOTE_FRAME:
+					if (!win) break;
+					if (resizing) {
+						/* Only swap to the new size once there is something in it */
+						yutani_window_resize_done(yctx, win);
+						yutani_flip(yctx, win);
+						resizing = 0;
+					} else {
+						for (int i = 0; i < flip_count; ++i) {
+							yutani_flip_region(yctx, win, flips[i].x, flips[i].y, flips[i].width, flips[i].height);
+						}
+					}
+					flip_count = 0;
+					break;
+				case REMOTE_CURSOR:
+					if (win && header.size == sizeof(int32_t)) {
+						yutani_window_show_mouse(yctx, win, *(int32_t *)data);
+					}
+					break;
+				default:
+					break;
+			}
+		}
+
+		/* Events may be waiting in the ring, so look whichever woke us */
+		yutani_msg_t * m = yutani_poll_async(yctx);
+		while (m) {
+			switch (m->type) {
+				case YUTANI_MSG_KEY_EVENT:
+					remote_send(sock, REMOTE_KEY, m->data, sizeof(struct yutani_msg_key_event));
+					break;
+				case YUTANI_MSG_WINDOW_MOUSE_EVENT:
+					remote_send(sock, REMOTE_MOUSE, m->data, sizeof(struct yutani_msg_window_mouse_event));
+					break;
+				case YUTANI_MSG_RESIZE_OFFER:
+					{
+						/* The other end decides; we take the new size when it comes back */
+						struct yutani_msg_window_resize * wr = (void *)m->data;
+						struct remote_size size = {wr->width, wr->height};
+						remote_send(sock, REMOTE_RESIZE, &size, sizeof(size));
+					}
+					break;
+				case YUTANI_MSG_WINDOW_CLOSE:
+				case YUTANI_MSG_SESSION_END:
+					free(m);
+					close(sock);
+					return 0;
+				default:
+					break;
+			}
+			free(m);
+			m = yutani_poll_async(yctx);
+		}
+	}
+
+	fprintf(stderr, "yutani-remote: lost connection to %s\n", host);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "p:d:g:h?")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'd':
+				display = optarg;
+				break;
+			case 'g':
+				if (sscanf(optarg, "%dx%d", &display_width, &display_height) != 2) return usage(argv);
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (optind < argc && !strcmp(argv[optind], "serve")) {
+		return serve();
+	}
+	if (optind + 1 < argc && !strcmp(argv[optind], "view")) {
+		return view(argv[optind + 1]);
+	}
+	return usage(argv);
+}
@@ -1,4 +1,5 @@
 #!/bin/sh
+# after:
 
 # This daemonizes
 exec splash-log
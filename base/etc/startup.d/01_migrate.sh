@@ -1,4 +1,5 @@
 #!/bin/sh
+# after: 00_startuplog
 
 if not kcmdline -q migrate then exit 0
 
@@ -1,4 +1,5 @@
 #!/bin/sh
+# after: 01_migrate
 
 export-cmd HOSTNAME cat /etc/hostname
 
@@ -1,4 +1,5 @@
 #!/bin/sh
+# after: 01_migrate
 
 echo -n "Mounting tmpfs..." > /dev/pex/splash
 mount tmpfs tmp,777 /tmp
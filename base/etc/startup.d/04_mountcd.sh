@@ -1,4 +1,5 @@
 #!/bin/sh
+# after: 01_migrate
 
 if not stat -Lq /dev/cdrom0 then exit 0
 
@@ -1,3 +1,4 @@
 #!/bin/sh
+# after: 01_migrate
 
 if qemu-fwcfg -q opt/org.toaruos.displayharness then /bin/qemu-display-hack
@@ -1,4 +1,5 @@
 #!/bin/sh
+# after: 03_tmpfs
 
 # Only start if we're likely to be running a GUI
 export-cmd START kcmdline -g start
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+# Headless benchmark runs from util/qemu-harness.py --bench
+if not qemu-fwcfg -q opt/org.toaruos.bench then exit 0
+
+export-cmd BENCH qemu-fwcfg opt/org.toaruos.bench
+
+echo -n "Running benchmarks..." > /dev/pex/splash
+
+echo "# bench begin" > /dev/ttyS1
+bench $BENCH > /dev/ttyS1
+echo "# bench end" > /dev/ttyS1
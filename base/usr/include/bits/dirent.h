@@ -13,10 +13,22 @@ typedef struct dirent {
 typedef struct DIR {
 	int fd;
 	int cur_entry;
+
+	/* Entries fetched by the last getdents() */
+	struct dirent * buffer;
+	int buffer_count;
+	int buffer_next;
 } DIR;
 
 DIR * opendir (const char * dirname);
 int closedir (DIR * dir);
 struct dirent * readdir (DIR * dirp);
 
+/*
+ * Read up to `count` entries from the directory open on `fd`,
+ * continuing from where the last call left off. Returns the number
+ * of entries read, 0 at the end of the directory.
+ */
+int getdents (int fd, struct dirent * entries, int count);
+
 _End_C_Header
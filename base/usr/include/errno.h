@@ -134,7 +134,9 @@ _Begin_C_Header
 #define EWOULDBLOCK EAGAIN    /* Operation would block */
 
 #ifndef _KERNEL_
-extern int errno;
+/* Each thread has its own, in its TLS control block */
+extern int * __errno_location(void);
+#define errno (*__errno_location())
 #define __sets_errno(...) int ret = __VA_ARGS__; if (ret < 0) { errno = -ret; ret = -1; } return ret
 #endif
 
@@ -16,6 +16,7 @@ _Begin_C_Header
 #define O_PATH       0x2000
 #define O_NONBLOCK   0x4000
 #define O_DIRECTORY  0x8000
+#define O_CLOEXEC    0x10000
 
 #define F_OK 1
 #define R_OK 4
@@ -48,6 +49,10 @@ struct flock {
 
 #define FD_CLOEXEC (1 << 0)
 
+/* For fstatat() */
+#define AT_FDCWD            -100
+#define AT_SYMLINK_NOFOLLOW 0x100
+
 extern int open (const char *, int, ...);
 extern int chmod(const char *path, mode_t mode);
 extern int fcntl(int fd, int cmd, ...);
@@ -0,0 +1,49 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Block layer (kernel/fs/block.c)
+ */
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/fs.h>
+#include <kernel/mutex.h>
+
+struct block_request;
+
+/*
+ * A disk, as its driver describes it. The driver moves whole sectors
+ * with transfer(), which returns non-zero on failure; everything else -
+ * partial sectors, bounds, partitions, queueing - is the block layer's.
+ */
+typedef struct block_device {
+	char name[32];
+	uint32_t sector_size;
+	uint64_t sectors;
+	int readonly;
+	int (*transfer)(struct block_device * dev, uint64_t lba, unsigned int count, uint8_t * buf, int write);
+	void * driver;
+
+	/* Kept by the block layer */
+	fs_node_t * node;               /* The whole disk */
+	mutex_t lock;
+	int plugged;
+	struct block_request * queue;   /* Writes held back while plugged, by sector */
+	unsigned int queued;            /* Sectors in them */
+	uint64_t position;              /* Where the last transfer ended */
+} block_device_t;
+
+/* The node for the whole disk, for the driver to mount */
+extern fs_node_t * block_register(block_device_t * dev);
+
+/* A node for `count` sectors of a disk's node, starting at `first` */
+extern fs_node_t * block_partition(fs_node_t * disk, uint64_t first, uint64_t count, char * name);
+
+extern block_device_t * block_device_of(fs_node_t * node);
+
+/*
+ * While a disk is plugged, writes to it are queued, merged with their
+ * neighbours, and sent on in order when it is unplugged. Plugs nest;
+ * both do nothing for nodes that aren't from the block layer.
+ */
+extern void block_plug(fs_node_t * node);
+extern void block_unplug(fs_node_t * node);
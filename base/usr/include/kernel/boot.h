@@ -18,3 +18,20 @@
  */
 #include <kernel/multiboot.h>
 
+
+/*
+ * Boot stage log. The loader's stages arrive on the command line as
+ * boottime=stage@cycles,... and the kernel adds its own here, so
+ * /proc/boottime can show where the time between power-on and init
+ * went. Both count TSC cycles.
+ */
+#define BOOT_STAGES 16
+
+typedef struct {
+	char * name;
+	uint64_t cycles;
+} boot_stage_t;
+
+extern boot_stage_t boot_stages[BOOT_STAGES];
+extern int boot_stage_count;
+extern void boot_stage(char * name);
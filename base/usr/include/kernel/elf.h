@@ -101,6 +101,7 @@ typedef struct {
 #define PT_NOTE    4 /* Auxillary information */
 #define PT_SHLIB   5 /* Reserved. */
 #define PT_PHDR    6 /* Oh, it's me. Hello! Back-reference to the header table itself */
+#define PT_TLS     7 /* Initial image of thread-local storage */
 #define PT_LOPROC  0x70000000
 #define PT_HIPROC  0x7FFFFFFF
 
@@ -82,12 +82,27 @@ struct ext2_superblock {
 	/* Other Options */
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
-	uint8_t _unused[760];
+	uint32_t mkfs_time;
+	uint32_t jnl_blocks[17];
+	uint32_t blocks_count_hi;
+	uint32_t r_blocks_count_hi;
+	uint32_t free_blocks_count_hi;
+	uint16_t min_extra_isize;
+	uint16_t want_extra_isize;
+	uint32_t flags;
+	uint8_t _unused[668];
 
 } __attribute__ ((packed));
 
 typedef struct ext2_superblock ext2_superblock_t;
 
+/* feature_compat */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+
+/* Superblock flags */
+#define EXT2_FLAGS_SIGNED_HASH   0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
 /* Block group descriptor. */
 struct ext2_bgdescriptor {
 	uint32_t block_bitmap;
@@ -127,6 +142,9 @@ typedef struct ext2_bgdescriptor ext2_bgdescriptor_t;
 #define EXT2_S_IWOTH	0x0002
 #define EXT2_S_IXOTH	0x0001
 
+/* Inode flags */
+#define EXT2_INDEX_FL 0x00001000 /* Directory has a hash index */
+
 /* This is not actually the inode table.
  * It represents an inode in an inode table on disk. */
 struct ext2_inodetable {
@@ -163,11 +181,41 @@ struct ext2_dir {
 
 typedef struct ext2_dir ext2_dir_t;
 
-typedef struct {
+/* Hash index (htree) directories */
+#define EXT2_DX_HASH_LEGACY            0
+#define EXT2_DX_HASH_HALF_MD4          1
+#define EXT2_DX_HASH_TEA               2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED   3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_DX_HASH_TEA_UNSIGNED      5
+
+/* Follows the "." and ".." entries in the first block of the directory */
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+} __attribute__ ((packed));
+
+/* The first entry of an index block holds its limit and count instead of a hash */
+struct ext2_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__ ((packed));
+
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__ ((packed));
+
+typedef struct ext2_disk_cache_entry {
 	uint32_t block_no;
-	uint32_t last_use;
 	uint8_t  dirty;
 	uint8_t *block;
+	struct ext2_disk_cache_entry * hash_next; /* Next entry in the same hash bucket */
+	struct ext2_disk_cache_entry * lru_prev;  /* More recently used neighbor */
+	struct ext2_disk_cache_entry * lru_next;  /* Less recently used neighbor */
 } ext2_disk_cache_entry_t;
 
 typedef int (*ext2_block_io_t) (void *, uint32_t, uint8_t *);
@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <poll.h>
+
 #define PATH_SEPARATOR '/'
 #define PATH_SEPARATOR_STRING "/"
 #define PATH_UP  ".."
@@ -19,6 +21,12 @@
 #define O_PATH       0x2000
 #define O_NONBLOCK   0x4000
 #define O_DIRECTORY  0x8000
+#define O_CLOEXEC    0x10000
+
+#define FD_CLOEXEC   (1 << 0)
+
+#define AT_FDCWD            -100
+#define AT_SYMLINK_NOFOLLOW 0x100
 
 #define FS_FILE        0x01
 #define FS_DIRECTORY   0x02
@@ -27,6 +35,8 @@
 #define FS_PIPE        0x10
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
+#define FS_CACHED      0x80 /* Block device reads go through the page cache */
+#define FS_DCACHE      0x100 /* Lookups in this directory may be cached */
 
 #define _IFMT       0170000 /* type of file */
 #define     _IFDIR  0040000 /* directory */
@@ -55,8 +65,11 @@ typedef int (*symlink_type_t) (struct fs_node *, char * name, char * value);
 typedef int (*readlink_type_t) (struct fs_node *, char * buf, size_t size);
 typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
+typedef int (*pollcheck_type_t) (struct fs_node *, int events);
+typedef int (*pollwait_type_t) (struct fs_node *, void * process, int events);
 typedef int (*chown_type_t) (struct fs_node *, int, int);
 typedef void (*truncate_type_t) (struct fs_node *);
+typedef uint32_t (*getdents_type_t) (struct fs_node *, uint64_t * offset, struct dirent * entries, uint32_t count);
 
 typedef struct fs_node {
 	char name[256];         /* The filename. */
@@ -100,6 +113,13 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 
 	chown_type_t chown;
+
+	/* Optional; only consulted for pipes and character devices */
+	pollcheck_type_t pollcheck; /* Which of POLLIN/POLLOUT/POLLHUP/POLLERR hold now */
+	pollwait_type_t pollwait;   /* Alert the process when any of `events` may hold */
+
+	/* Optional; fills many directory entries from a driver-defined cursor in *offset */
+	getdents_type_t getdents;
 } fs_node_t;
 
 struct dirent {
@@ -138,14 +158,25 @@ extern int pty_create(void *size, fs_node_t ** fs_master, fs_node_t ** fs_slave)
 
 int has_permission(fs_node_t *node, int permission_bit);
 uint32_t read_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
+uint32_t pagecache_read(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
+void pagecache_invalidate(fs_node_t *node, uint64_t offset, uint32_t size);
+int dcache_lookup(fs_node_t *dir, char *name, fs_node_t **node);
+void dcache_insert(fs_node_t *dir, char *name, fs_node_t *node);
+void dcache_invalidate(fs_node_t *dir, char *name);
+void dcache_flush(void);
+uint32_t pagecache_reclaim(void);
+uint32_t pagecache_count(void);
+uint32_t dcache_reclaim(void);
 uint32_t write_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 struct dirent *readdir_fs(fs_node_t *node, uint32_t index);
+uint32_t getdents_fs(fs_node_t *node, uint64_t *offset, struct dirent *entries, uint32_t count);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
 int mkdir_fs(char *name, uint16_t permission);
 int create_file_fs(char *name, uint16_t permission);
 fs_node_t *kopen(char *filename, uint32_t flags);
+int kfind_at(fs_node_t *dir, char *name, fs_node_t **out);
 char *canonicalize_path(char *cwd, char *input);
 fs_node_t *clone_fs(fs_node_t * source);
 int ioctl_fs(fs_node_t *node, int request, void * argp);
@@ -156,7 +187,10 @@ int symlink_fs(char * value, char * name);
 int readlink_fs(fs_node_t * node, char * buf, size_t size);
 int selectcheck_fs(fs_node_t * node);
 int selectwait_fs(fs_node_t * node, void * process);
+int pollcheck_fs(fs_node_t * node, int events);
+int pollwait_fs(fs_node_t * node, void * process, int events);
 void truncate_fs(fs_node_t * node);
+int splice_fs(fs_node_t * in, uint64_t * in_offset, fs_node_t * out, uint64_t * out_offset, uint32_t size);
 
 void vfs_install(void);
 void * vfs_mount(char * path, fs_node_t * local_root);
@@ -171,4 +205,10 @@ void debug_print_vfs_tree(void);
 void map_vfs_directory(char *);
 
 int make_unix_pipe(fs_node_t ** pipes);
+int unix_pipe_splice(fs_node_t * in, fs_node_t * out, uint32_t size);
+
+struct ioring;
+fs_node_t * ioring_create(struct ioring * user);
+int ioring_enter(fs_node_t * node, uint32_t to_submit, uint32_t min_complete);
+void close_ioring(fs_node_t * node);
 
@@ -0,0 +1,9 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/system.h>
+#include <sys/futex.h>
+
+extern int futex_wait(uint32_t * addr, uint32_t val);
+extern int futex_wake(uint32_t * addr, uint32_t count);
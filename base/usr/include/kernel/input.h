@@ -0,0 +1,15 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Input event queue (kernel/misc/input.c)
+ */
+
+#pragma once
+
+#include <kernel/types.h>
+#include <sys/input.h>
+
+/* All of these may be called from interrupt handlers */
+extern void input_key(uint8_t scancode);
+extern void input_relative(int32_t x, int32_t y, uint32_t buttons);
+extern void input_absolute(int32_t x, int32_t y, uint32_t buttons, int flags);
+extern void input_install(void);
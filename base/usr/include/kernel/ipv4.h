@@ -1,6 +1,7 @@
 #pragma once
 
 #include <kernel/system.h>
+#include <kernel/ringbuffer.h>
 
 struct ethernet_packet {
 	uint8_t destination[6];
@@ -82,18 +83,16 @@ struct tcp_header {
 	uint8_t  payload[];
 } __attribute__((packed));
 
-struct tcp_check_header {
-	uint32_t source;
-	uint32_t destination;
-	uint8_t  zeros;
-	uint8_t  protocol;
-	uint16_t tcp_len;
-	uint8_t  tcp_header[];
-};
-
 #define SOCK_STREAM 1
 #define SOCK_DGRAM 2
 
+#define AF_INET 1
+
+/* send and receive flags, as in <sys/socket.h> */
+#define MSG_TRUNC      0x20
+#define MSG_DONTWAIT   0x40
+#define MSG_WAITFORONE 0x10000
+
 // Note: Data offset is in upper 4 bits of flags field. Shift and subtract 5 since that is the min TCP size.
 //       If the value is more than 5, multiply by 4 because this field is specified in number of words
 #define TCP_OPTIONS_LENGTH(tcp) (((((tcp)->flags) >> 12) - 5) * 4)
@@ -127,13 +126,44 @@ struct tcp_check_header {
 extern uint32_t ip_aton(const char * in);
 extern void ip_ntoa(uint32_t src_addr, char * out);
 extern uint16_t calculate_ipv4_checksum(struct ipv4_packet * p);
-uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, void * d, size_t d_words);
+extern uint16_t calculate_tcp_checksum(uint32_t source, uint32_t destination, struct tcp_header * h, size_t length);
+extern uint16_t calculate_tcp_pseudo_checksum(uint32_t source, uint32_t destination, size_t length);
+extern uint16_t calculate_udp_checksum(uint32_t source, uint32_t destination, struct udp_packet * h, size_t length);
+
+struct netbuf;
 
 struct tcp_socket {
 	list_t* is_connected;
-	uint32_t seq_no;
-	uint32_t ack_no;
-	int status;
+	uint32_t seq_no; /* Next sequence number to send */
+	uint32_t ack_no; /* Next sequence number expected */
+	int status;      /* TCP_OPEN, TCP_LISTEN, TCP_SYN_RECEIVED */
+	int retries;     /* SYN-ACKs sent without an answer */
+
+	spin_lock_t lock;
+
+	/* Sending */
+	uint32_t snd_una;        /* Oldest unacknowledged sequence number */
+	uint32_t snd_wnd;        /* Window the other end advertised */
+	uint32_t cwnd;           /* Congestion window, in bytes */
+	uint32_t ssthresh;
+	uint32_t recover;        /* seq_no when fast recovery started */
+	int dup_acks;
+	int in_recovery;
+	int fin_sent;
+	list_t * unacked;        /* Sent segments kept for retransmission */
+	struct netbuf * pending; /* Segment still being filled (Nagle) */
+	list_t * send_wait;      /* Writers waiting for the window to open */
+
+	/* Retransmission timer, all in milliseconds */
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	uint32_t rto_deadline;   /* 0 when not running */
+
+	/* Receiving */
+	uint32_t rcv_wnd_sent;   /* Window we last advertised */
+	int ack_pending;         /* Segments received but not acknowledged */
+	uint32_t ack_deadline;
 };
 
 // Note: for now, not sure what to put in here, so removing from the union to get rid of compiler warnings about empty struct
@@ -145,19 +175,48 @@ struct socket {
 	uint8_t  mac[6];
 	uint32_t port_dest;
 	uint32_t port_recv;
-	list_t* packet_queue;
-	spin_lock_t packet_queue_lock;
+	ring_buffer_t * recv_buffer; /* Received bytes waiting for recv() */
 	list_t* packet_wait;
 	int32_t status;
-	size_t bytes_available;
-	size_t bytes_read;
-	void * current_packet;
 	uint32_t sock_type;
 	union {
 		struct tcp_socket tcp_socket;
 		// struct udp_socket udp_socket;
 	} proto_sock;
 	list_t * alert_waiters;
+
+	/* Listening */
+	struct socket * listener; /* Who accepts us, until the handshake is done */
+	list_t * accept_queue;    /* Connections waiting for accept() */
+	int backlog;
+	int syn_received;         /* Handshakes still in progress */
+
+	/* Datagrams */
+	list_t * datagrams;       /* Received, oldest first */
+	size_t datagram_bytes;
+	size_t datagram_limit;
+	spin_lock_t datagram_lock;
+};
+
+/* Layouts shared with <sys/socket.h> for sendmmsg() and recvmmsg() */
+struct iovec {
+	void * iov_base;
+	size_t iov_len;
+};
+
+struct msghdr {
+	void * msg_name;
+	size_t msg_namelen;
+	struct iovec * msg_iov;
+	size_t msg_iovlen;
+	void * msg_control;
+	size_t msg_controllen;
+	int msg_flags;
+};
+
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
 };
 
 struct sized_blob {
@@ -180,9 +239,3 @@ struct sockaddr_in {
 	struct in_addr	sin_addr;     // see struct in_addr, below
 	char			sin_zero[8];  // zero this if you want to
 };
-
-typedef struct {
-	uint8_t	*payload;
-	size_t	payload_size;
-} tcpdata_t;
-
@@ -0,0 +1,27 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Static tracepoints (kernel/misc/ktrace.c)
+ */
+
+#pragma once
+
+#include <kernel/types.h>
+#include <sys/ktrace.h>
+
+extern volatile uint32_t ktrace_events; /* Bitmap of events being recorded */
+extern void ktrace_record(int event, uint32_t a, uint32_t b, uint32_t c);
+extern void ktrace_install(void);
+
+/*
+ * A tracepoint costs one test of ktrace_events while tracing is off;
+ * build with -DKTRACE_DISABLE to leave them out entirely.
+ */
+#ifndef KTRACE_DISABLE
+#define KTRACE(event, a, b, c) do { \
+	if (ktrace_events & (1 << (event))) { \
+		ktrace_record((event), (uint32_t)(a), (uint32_t)(b), (uint32_t)(c)); \
+	} \
+} while (0)
+#else
+#define KTRACE(event, a, b, c) do { } while (0)
+#endif
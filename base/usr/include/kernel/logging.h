@@ -14,13 +14,14 @@ extern void * debug_file;
 extern void _debug_print(char * title, int line_no, log_type_t level, char *fmt, ...);
 extern void (*debug_hook)(void *, char *);
 extern void (*debug_video_crash)(char **);
+extern void logging_install(void);
 
 #ifndef MODULE_NAME
 #define MODULE_NAME __FILE__
 #endif
 
 #ifndef QUIET
-#define debug_print(level, ...) _debug_print(MODULE_NAME, __LINE__, level, __VA_ARGS__)
+#define debug_print(level, ...) do { if ((level) >= debug_level) _debug_print(MODULE_NAME, __LINE__, level, __VA_ARGS__); } while (0)
 #else
 #define debug_print(level, ...)
 #endif
@@ -0,0 +1,9 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/types.h>
+
+/* Both return the number of bytes written to dst, or -1 */
+extern int lz4_decompress(const uint8_t * src, size_t src_len, uint8_t * dst, size_t dst_len);
+extern int lz4_compress(const uint8_t * src, size_t src_len, uint8_t * dst, size_t dst_len);
@@ -4,13 +4,42 @@
 #pragma once
 
 #include <kernel/types.h>
+#include <kernel/task.h>
 
 extern uintptr_t heap_end;
 
-extern void set_frame(uintptr_t frame_addr);
-extern void clear_frame(uintptr_t frame_addr);
-extern uint32_t test_frame(uintptr_t frame_addr);
+/*
+ * Physical memory the frame allocator can hand out lies below this:
+ * 64GiB, the 36 bits PAE processors generally have (and frame_refs
+ * takes a byte a frame of it).
+ */
+#define MEMORY_ADDRESSABLE 0x1000000000ULL
+
+/*
+ * The kernel's own frames come from below 4GiB: it hands their
+ * physical addresses to devices and to CR3, which are 32 bits.
+ */
+#define FRAMES_LOW 0x100000
+
+extern void set_frame(uint64_t frame_addr);
+extern void clear_frame(uint64_t frame_addr);
+extern uint32_t test_frame(uint64_t frame_addr);
 extern uint32_t first_frame(void);
 
+/* 2MiB pages, for big shared memory chunks and device memory; a directory entry apiece */
+#define LARGE_PAGE_SIZE   PAGE_TABLE_SPAN
+#define LARGE_PAGE_FRAMES PAGE_TABLE_ENTRIES
+#define PDE_LARGE         0x80 /* Page size bit of a directory entry */
+
+extern int paging_large_pages;
+extern uint32_t alloc_large_frame(void);
+
+/* Device memory mapped in place, with large pages where it can be */
+extern void dma_map_region(uintptr_t start, size_t size, int write_combine);
+
 extern uintptr_t map_to_physical(uintptr_t virtual);
 
+
+/* A page-aligned page of zeroes from the kernel heap, and the idle-time refill for the pool behind it */
+extern void * zeroed_page(uintptr_t * phys);
+extern int zero_pool_fill(void);
@@ -0,0 +1,34 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <sys/mman.h>
+
+/* Regions are placed top-down from here unless MAP_FIXED is given */
+#define MMAP_TOP    USER_STACK_BOTTOM
+#define MMAP_BOTTOM 0x20000000
+
+typedef struct {
+	uintptr_t start;  /* Page aligned */
+	uintptr_t end;    /* Page aligned, exclusive */
+	int prot;
+	int flags;
+	fs_node_t * node; /* NULL for anonymous mappings */
+	uint32_t offset;  /* File offset of `start` */
+} mmap_region_t;
+
+/* Syscalls */
+extern uintptr_t mmap_map(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * node, uint32_t offset);
+extern int mmap_unmap(uintptr_t addr, size_t length);
+extern int mmap_protect(uintptr_t addr, size_t length, int prot);
+
+/* Other exposed functions */
+extern int mmap_fault(uintptr_t address, int write);
+extern int mmap_filling(uintptr_t address);
+extern int mmap_overlaps(process_t * proc, uintptr_t start, uintptr_t end);
+extern void mmap_fork(process_t * parent, process_t * child);
+extern void mmap_release_all(process_t * proc);
+extern uint32_t mmap_reclaim(void);
+extern void mmap_invalidate(fs_node_t * node, uint64_t offset, uint32_t size);
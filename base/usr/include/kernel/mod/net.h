@@ -1,9 +1,82 @@
 #ifndef KERNEL_MOD_NET_H
 #define KERNEL_MOD_NET_H
 
+#include <toaru/list.h>
+
+/*
+ * Packet buffers come from a pool kept by the net module so the packet
+ * path doesn't malloc. `data` is the start of the packet; outgoing
+ * packets are built back to front, with each layer pushing its header
+ * into the headroom in front of the payload.
+ */
+#define NETBUF_SIZE     2048
+#define NETBUF_HEADROOM 128
+
+/*
+ * Offload requests on outgoing netbufs, only set when the interface
+ * advertised the matching NETIF_CAP_ (below). For NETBUF_TX_CSUM_TCP
+ * the checksum field already holds the pseudo-header sum, as cards
+ * expect. NETBUF_RX_CSUM_OK marks a received packet whose IP and TCP
+ * checksums the card already checked.
+ */
+#define NETBUF_TX_CSUM_IP  0x01
+#define NETBUF_TX_CSUM_TCP 0x02
+#define NETBUF_TX_TSO      0x04 /* Cut into tso_mss sized segments */
+#define NETBUF_RX_CSUM_OK  0x10
+
+/*
+ * A frame can go on in more netbufs chained through `next`, so headers
+ * and payload needn't be copied into one buffer; the chain stays the
+ * sender's. Cards that gather (NETIF_CAP_SG) may send straight out of
+ * a netbuf after the call returns, and hold it until they're done: a
+ * netbuf_free() in the meantime only takes effect on the last release.
+ */
+struct netbuf {
+	node_t node; /* For driver and socket queues; node.value is the netbuf */
+	uint8_t * data;
+	size_t len;
+	uint16_t flags;   /* NETBUF_ */
+	uint16_t tso_mss;
+	struct netbuf * next; /* Rest of the frame */
+	int holds;
+	int freed;        /* Freed while held */
+
+	/* TCP bookkeeping while a sent segment waits for its ACK */
+	uint32_t seq;
+	uint32_t sent;
+	int retransmitted;
+
+	uint8_t buffer[NETBUF_SIZE];
+};
+
+extern struct netbuf * netbuf_alloc(void);
+extern void netbuf_free(struct netbuf * nb);
+extern void netbuf_hold(struct netbuf * nb);
+extern void netbuf_release(struct netbuf * nb);
+
+static inline void * netbuf_push(struct netbuf * nb, size_t size) {
+	nb->data -= size;
+	nb->len  += size;
+	return nb->data;
+}
+
+static inline void * netbuf_pull(struct netbuf * nb, size_t size) {
+	nb->data += size;
+	nb->len  -= size;
+	return nb->data;
+}
+
 typedef uint8_t* (*get_mac_func)(void);
-typedef struct ethernet_packet* (*get_packet_func)(void);
+typedef struct netbuf* (*get_packet_func)(void);
 typedef void (*send_packet_func)(uint8_t*, size_t);
+typedef void (*send_netbuf_func)(struct netbuf *);
+typedef int (*tx_room_func)(void);
+
+/* What the card can do for us; anything advertised needs send_netbuf */
+#define NETIF_CAP_TX_CSUM 0x01 /* IPv4 header and TCP checksums on transmit */
+#define NETIF_CAP_RX_CSUM 0x02 /* Same, checked on receive */
+#define NETIF_CAP_TSO     0x04 /* TCP segmentation */
+#define NETIF_CAP_SG      0x08 /* Chained netbufs, sent from where they are */
 
 struct netif {
 	void *extra;
@@ -11,18 +84,31 @@ struct netif {
 	get_mac_func get_mac;
 	get_packet_func get_packet;
 	send_packet_func send_packet;
+	send_netbuf_func send_netbuf; /* Frames with offload requests; may be NULL */
+	uint32_t caps;
+
+	/* Whether another frame fits in the transmit ring, and where to wait until it does */
+	tx_room_func tx_room;
+	list_t * tx_wait;
 
 	uint8_t hwaddr[6];
 	uint32_t source;
+	uint32_t netmask;
 
 	char * driver;
+	char name[8]; /* eth0, eth1, ... in the order drivers registered */
 
 	uint32_t gateway;
+
+	int worker_pid; /* Receive tasklet for this interface */
 };
 
-extern void init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_packet_func send_func, char * device);
+extern struct netif * init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_packet_func send_func, char * device);
+extern void init_netif_offload(struct netif * netif, uint32_t caps, send_netbuf_func send_netbuf);
+extern void init_netif_tx_room(struct netif * netif, tx_room_func tx_room, list_t * tx_wait);
+extern struct netif * get_default_network_interface(void);
 extern void net_handler(void * data, char * name);
-extern size_t write_dhcp_packet(uint8_t * buffer);
+extern size_t write_dhcp_packet(struct netif * netif, uint8_t * buffer);
 
 extern struct socket* net_open(uint32_t type);
 extern int net_send(struct socket* socket, uint8_t* payload, size_t payload_size, int flags);
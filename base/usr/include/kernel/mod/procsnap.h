@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+ * Layout of /proc/snapshot
+ *
+ * A header followed by `count` entries, one for every process, all
+ * taken at the same moment. Fields are only ever added to the end of
+ * either struct; step through entries by `entry_size`, not by
+ * sizeof(procsnap_entry_t), and ignore anything past what you know.
+ *
+ * Read it with a buffer of at least header_size + count * entry_size;
+ * every read takes a new snapshot, so reading it in pieces may mix
+ * two of them.
+ */
+
+#include <stdint.h>
+
+#define PROCSNAP_VERSION   1
+#define PROCSNAP_NAME_SIZE 64
+#define PROCSNAP_PATH_SIZE 128
+
+typedef struct procsnap_header {
+	uint32_t version;      /* PROCSNAP_VERSION */
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t count;        /* Entries that follow */
+	uint32_t uptime;       /* Seconds */
+	uint32_t uptime_ms;
+	uint32_t mem_total;    /* kB */
+	uint32_t mem_used;     /* kB */
+	uint32_t total;        /* Processes there were; only more than count if the kernel ran out of room */
+} procsnap_header_t;
+
+typedef struct procsnap_entry {
+	int32_t  pid;
+	int32_t  tgid;         /* Thread group; equal to pid for the main thread */
+	int32_t  ppid;
+	int32_t  pgid;
+	int32_t  sid;
+	uint32_t uid;
+	char     state;        /* R, S, T or Z, as in /proc/<pid>/status */
+	uint8_t  sched_class;
+	uint16_t _reserved;
+	uint32_t vm_size;      /* kB */
+	uint32_t rss_shmem;    /* kB */
+	uint32_t mem_permille;
+	uint32_t start;        /* Seconds since the epoch */
+	char     name[PROCSNAP_NAME_SIZE];   /* Last path component of the name */
+	char     path[PROCSNAP_PATH_SIZE];   /* First word of the command line */
+	uint32_t utime_ms;     /* CPU time in userspace */
+	uint32_t stime_ms;     /* CPU time in the kernel */
+	uint32_t nvcsw;        /* Context switches while waiting for something */
+	uint32_t nivcsw;       /* ...and while still runnable (preempted) */
+	uint32_t minflt;
+	uint32_t majflt;
+	uint32_t read_kb;      /* Returned by read() and write() */
+	uint32_t write_kb;
+} procsnap_entry_t;
@@ -22,6 +22,9 @@ typedef struct snd_device {
 	void * device;             /* Private data for the device. May be NULL. */
 	uint32_t playback_speed;   /* Playback speed in Hz */
 	uint32_t playback_format;  /* Playback format (SND_FORMAT_*) */
+	uint32_t playback_period;  /* Frames requested per interrupt */
+	uint32_t periods;          /* Periods played, kept by the driver */
+	uint32_t underruns;        /* Times playback caught up with mixing */
 
 	snd_knob_t *knobs;
 	uint32_t num_knobs;
@@ -46,6 +49,9 @@ int snd_unregister(snd_device_t * device);
  * order to fill a buffer on demand. After the call the buffer is garaunteed
  * to be filled to the size requested even if that means writing zeroes for
  * when there are no other samples.
+ *
+ * This takes locks and may wait on them, so call it from a tasklet rather
+ * than from an interrupt handler.
  */
 int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer);
 
@@ -34,3 +34,45 @@ typedef struct snd_knob_value {
 #define SND_MIXER_READ_KNOB 2
 #define SND_MIXER_WRITE_KNOB 3
 
+/* /dev/dsp IOCTLs */
+#define SND_DSP_SET_GAIN 6 /* Per-stream gain; argp points to a uint32_t */
+#define SND_DSP_GET_GAIN 7
+
+#define SND_DSP_SET_FORMAT  8  /* argp points to a snd_dsp_format_t, updated with what we got */
+#define SND_DSP_GET_FORMAT  9
+#define SND_DSP_SET_LATENCY 10 /* argp points to a snd_dsp_latency_t, likewise */
+#define SND_DSP_GET_LATENCY 11
+#define SND_DSP_GET_STATS   12 /* argp points to a snd_dsp_stats_t */
+
+/* Stream gain is fixed point, with SND_GAIN_UNITY as full scale */
+#define SND_GAIN_UNITY 0x100
+#define SND_GAIN_MAX   (SND_GAIN_UNITY * 4)
+
+/*
+ * What a /dev/dsp stream is written in. Anything other than the
+ * device's own format is converted as it is written.
+ */
+typedef struct snd_dsp_format {
+	uint32_t rate;     /* Frames per second */
+	uint32_t channels; /* 1 or 2 */
+	uint32_t bits;     /* 8 (unsigned) or 16 (signed, little endian) */
+} snd_dsp_format_t;
+
+#define SND_DSP_MIN_RATE 4000
+#define SND_DSP_MAX_RATE 192000
+
+typedef struct snd_dsp_latency {
+	uint32_t buffer; /* Bytes of the device's format a stream can queue */
+	uint32_t period; /* OUT: frames the device takes from every stream at a time */
+} snd_dsp_latency_t;
+
+#define SND_DSP_MIN_BUFFER 0x400
+#define SND_DSP_MAX_BUFFER 0x40000
+
+typedef struct snd_dsp_stats {
+	uint32_t periods;          /* Periods the device has played */
+	uint32_t underruns;        /* Times the device ran out of mixed periods */
+	uint32_t stream_underruns; /* Times this stream ran dry while playing */
+	uint32_t queued;           /* Bytes this stream has waiting */
+} snd_dsp_stats_t;
+
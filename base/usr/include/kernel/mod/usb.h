@@ -0,0 +1,210 @@
+#ifndef KERNEL_MOD_USB_H
+#define KERNEL_MOD_USB_H
+
+#include <kernel/types.h>
+#include <kernel/mutex.h>
+
+/*
+ * USB core.
+ *
+ * Host controller drivers register a struct usb_hc and call
+ * usb_hc_changed() from their interrupt handler when a root port
+ * changes. The core's worker thread then asks the controller to look
+ * at its ports; the controller addresses whatever it finds there and
+ * hands it to usb_device_attach(), which fetches the descriptors,
+ * picks the first configuration and offers each interface to the
+ * class drivers that have registered with usb_register_driver().
+ *
+ * Probing and every synchronous transfer happen in process context,
+ * and sleep until the controller says they're done. Interrupt
+ * endpoints are polled by the controller instead, with the driver's
+ * callback run from the controller's interrupt handler for each
+ * report that comes in.
+ *
+ * Devices go straight on root ports; hubs aren't driven yet.
+ */
+
+/* Request types */
+#define USB_DIR_OUT       0x00
+#define USB_DIR_IN        0x80
+#define USB_TYPE_STANDARD 0x00
+#define USB_TYPE_CLASS    0x20
+#define USB_RECIP_DEVICE    0x00
+#define USB_RECIP_INTERFACE 0x01
+#define USB_RECIP_ENDPOINT  0x02
+
+/* Standard requests */
+#define USB_REQ_GET_STATUS        0x00
+#define USB_REQ_CLEAR_FEATURE     0x01
+#define USB_REQ_SET_FEATURE       0x03
+#define USB_REQ_SET_ADDRESS       0x05
+#define USB_REQ_GET_DESCRIPTOR    0x06
+#define USB_REQ_GET_CONFIGURATION 0x08
+#define USB_REQ_SET_CONFIGURATION 0x09
+
+#define USB_FEATURE_ENDPOINT_HALT 0
+
+/* Descriptor types */
+#define USB_DESC_DEVICE    0x01
+#define USB_DESC_CONFIG    0x02
+#define USB_DESC_STRING    0x03
+#define USB_DESC_INTERFACE 0x04
+#define USB_DESC_ENDPOINT  0x05
+
+/* Classes, as interfaces give them */
+#define USB_CLASS_HID     0x03
+#define USB_CLASS_STORAGE 0x08
+#define USB_CLASS_HUB     0x09
+
+/* Endpoint attributes */
+#define USB_ENDPOINT_CONTROL   0
+#define USB_ENDPOINT_ISOCH     1
+#define USB_ENDPOINT_BULK      2
+#define USB_ENDPOINT_INTERRUPT 3
+#define USB_ENDPOINT_TYPE_MASK 3
+
+/* Interfaces a device can have drivers on */
+#define USB_MAX_INTERFACES 8
+
+/* Speeds, numbered as xHCI's default port speed IDs */
+#define USB_SPEED_FULL  1
+#define USB_SPEED_LOW   2
+#define USB_SPEED_HIGH  3
+#define USB_SPEED_SUPER 4
+
+struct usb_setup {
+	uint8_t  type;
+	uint8_t  request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+} __attribute__((packed));
+
+struct usb_device_descriptor {
+	uint8_t  length;
+	uint8_t  type;
+	uint16_t usb_version;
+	uint8_t  device_class;
+	uint8_t  device_subclass;
+	uint8_t  device_protocol;
+	uint8_t  max_packet0;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t device_version;
+	uint8_t  manufacturer;
+	uint8_t  product;
+	uint8_t  serial;
+	uint8_t  configurations;
+} __attribute__((packed));
+
+struct usb_config_descriptor {
+	uint8_t  length;
+	uint8_t  type;
+	uint16_t total_length;
+	uint8_t  interfaces;
+	uint8_t  value;
+	uint8_t  name;
+	uint8_t  attributes;
+	uint8_t  max_power;
+} __attribute__((packed));
+
+struct usb_interface_descriptor {
+	uint8_t  length;
+	uint8_t  type;
+	uint8_t  number;
+	uint8_t  alternate;
+	uint8_t  endpoints;
+	uint8_t  interface_class;
+	uint8_t  interface_subclass;
+	uint8_t  interface_protocol;
+	uint8_t  name;
+} __attribute__((packed));
+
+struct usb_endpoint_descriptor {
+	uint8_t  length;
+	uint8_t  type;
+	uint8_t  address;    /* Number, with USB_DIR_IN for IN endpoints */
+	uint8_t  attributes;
+	uint16_t max_packet;
+	uint8_t  interval;
+} __attribute__((packed));
+
+struct usb_hc;
+struct usb_driver;
+
+struct usb_device {
+	struct usb_hc * hc;
+	void * hc_data;      /* The controller's own state for it */
+	int port;            /* Root port, from 1 */
+	int speed;
+	volatile int gone;   /* Unplugged; transfers fail from here on */
+
+	struct usb_device_descriptor desc;
+	uint8_t * config;    /* The whole first configuration */
+	size_t config_length;
+
+	mutex_t lock;        /* Held over control transfers */
+	struct usb_driver * drivers[USB_MAX_INTERFACES]; /* Who took each interface */
+};
+
+struct usb_endpoint;
+
+/* Interrupt endpoint callback; runs in the controller's interrupt handler */
+typedef void (*usb_complete_t)(struct usb_endpoint * ep, void * data, size_t length);
+
+struct usb_endpoint {
+	struct usb_device * dev;
+	uint8_t  address;
+	uint8_t  attributes;
+	uint16_t max_packet;
+	uint8_t  interval;
+	void * hc_data;
+
+	usb_complete_t callback; /* For interrupt endpoints being polled */
+	void * driver_data;
+};
+
+/*
+ * What a host controller driver does for the core. Transfers return
+ * the bytes moved, or -1; a stalled endpoint is reset on the
+ * controller's side before the transfer returns, but clearing it on
+ * the device is up to the class driver (usb_clear_halt()).
+ */
+struct usb_hc_ops {
+	void (*ports)(struct usb_hc * hc);
+	int  (*control)(struct usb_device * dev, struct usb_setup * setup, void * data);
+	int  (*endpoint)(struct usb_endpoint * ep);
+	int  (*transfer)(struct usb_endpoint * ep, void * data, size_t length);
+	int  (*poll)(struct usb_endpoint * ep, size_t length);
+	void (*release)(struct usb_device * dev);
+};
+
+struct usb_hc {
+	const char * name;
+	struct usb_hc_ops * ops;
+	void * data;
+	volatile int changed;
+};
+
+/* Class drivers; probe() returns 0 if it took the interface */
+struct usb_driver {
+	const char * name;
+	int (*probe)(struct usb_device * dev, struct usb_interface_descriptor * intf);
+	void (*disconnect)(struct usb_device * dev);
+};
+
+extern void usb_hc_register(struct usb_hc * hc);
+extern void usb_hc_changed(struct usb_hc * hc);
+extern void usb_register_driver(struct usb_driver * driver);
+
+extern int usb_device_attach(struct usb_device * dev);
+extern void usb_device_detach(struct usb_device * dev);
+
+extern int usb_control(struct usb_device * dev, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length, void * data);
+extern struct usb_endpoint_descriptor * usb_find_endpoint(struct usb_device * dev, struct usb_interface_descriptor * intf, int type, int dir);
+extern struct usb_endpoint * usb_endpoint_open(struct usb_device * dev, struct usb_endpoint_descriptor * desc);
+extern int usb_transfer(struct usb_endpoint * ep, void * data, size_t length);
+extern int usb_poll(struct usb_endpoint * ep, size_t length, usb_complete_t callback);
+extern int usb_clear_halt(struct usb_endpoint * ep);
+
+#endif
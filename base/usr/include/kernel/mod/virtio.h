@@ -0,0 +1,145 @@
+#ifndef KERNEL_MOD_VIRTIO_H
+#define KERNEL_MOD_VIRTIO_H
+
+#include <kernel/types.h>
+
+/*
+ * Virtio over the legacy PCI transport (I/O BAR0), which QEMU and KVM
+ * offer for every transitional device, and split virtqueues.
+ *
+ * The virtio module does the transport and the queues; device drivers
+ * find their devices with virtio_find(), bring each up with
+ * virtio_device_init(), make their queues with virtq_create() and say
+ * virtio_device_ready() when they're set up.
+ *
+ * Queues keep no locks of their own. The kernel is uniprocessor, so
+ * each queue call runs with interrupts off and can be made from process
+ * context and interrupt handlers alike; drivers serialise anything
+ * bigger than a single call themselves.
+ */
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+
+/* Device types, which legacy devices give as their PCI subsystem ID */
+#define VIRTIO_TYPE_NET   1
+#define VIRTIO_TYPE_BLOCK 2
+
+/* Legacy PCI transport registers */
+#define VIRTIO_PCI_HOST_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN      0x08
+#define VIRTIO_PCI_QUEUE_SIZE     0x0C
+#define VIRTIO_PCI_QUEUE_SEL      0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10
+#define VIRTIO_PCI_STATUS         0x12
+#define VIRTIO_PCI_ISR            0x13
+#define VIRTIO_PCI_CONFIG         0x14 /* Device configuration, with MSI-X off */
+#define VIRTIO_MSI_CONFIG_VECTOR  0x14 /* With MSI-X on */
+#define VIRTIO_MSI_QUEUE_VECTOR   0x16
+#define VIRTIO_PCI_CONFIG_MSIX    0x18
+
+#define VIRTIO_MSI_NO_VECTOR 0xFFFF
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_ISR_QUEUE  0x01
+#define VIRTIO_ISR_CONFIG 0x02
+
+/* Ring features, taken whenever the device has them */
+#define VIRTIO_F_INDIRECT_DESC (1UL << 28)
+#define VIRTIO_F_EVENT_IDX     (1UL << 29)
+
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+/* Longest chain virtq_add() takes */
+#define VIRTQ_CHAIN_MAX 4
+
+/*
+ * The rings as the device sees them. Every field already sits at its
+ * natural alignment, so none of these need to be packed.
+ */
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct virtq_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];  /* Followed by used_event */
+};
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct virtq_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct virtq_used_elem ring[]; /* Followed by avail_event */
+};
+
+/* One piece of a chain handed to virtq_add() */
+struct virtq_buf {
+	uintptr_t phys;
+	uint32_t len;
+	int write;        /* The device writes this one */
+};
+
+struct virtio_device {
+	uint32_t pci;
+	uint16_t io;
+	int irq;
+	int msix;          /* Interrupts by MSI-X, entry 0, rather than the line */
+	uint32_t features; /* As negotiated */
+};
+
+struct virtq {
+	struct virtio_device * dev;
+	uint16_t index;
+	uint16_t size;
+
+	struct virtq_desc  * desc;
+	struct virtq_avail * avail;
+	struct virtq_used  * used;
+	volatile uint16_t  * used_event;  /* With VIRTIO_F_EVENT_IDX */
+	volatile uint16_t  * avail_event;
+
+	/* Indirect tables, VIRTQ_CHAIN_MAX entries for each descriptor */
+	struct virtq_desc * indirect;
+	uintptr_t indirect_phys;
+
+	uint16_t free_head;
+	uint16_t num_free;
+	uint16_t last_used;   /* Next used entry to look at */
+	uint16_t kicked;      /* avail->idx when the device was last told */
+	int interrupts;       /* Whether the driver wants interrupts */
+	void ** cookies;      /* What virtq_get() hands back, by head descriptor */
+};
+
+extern int virtio_find(int type, uint32_t * devices, int max);
+extern int virtio_device_init(struct virtio_device * dev, uint32_t pci, uint32_t features);
+extern void virtio_device_ready(struct virtio_device * dev);
+extern uint8_t virtio_isr(struct virtio_device * dev);
+extern uint8_t virtio_config_read8(struct virtio_device * dev, int offset);
+extern uint32_t virtio_config_read32(struct virtio_device * dev, int offset);
+
+extern struct virtq * virtq_create(struct virtio_device * dev, int index);
+extern int virtq_add(struct virtq * vq, struct virtq_buf * bufs, int count, void * cookie);
+extern void virtq_kick(struct virtq * vq);
+extern void * virtq_get(struct virtq * vq, uint32_t * len);
+extern int virtq_enable_intr(struct virtq * vq);
+extern void virtq_disable_intr(struct virtq * vq);
+
+#endif
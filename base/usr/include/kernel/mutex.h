@@ -0,0 +1,30 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Sleeping locks (kernel/sys/mutex.c)
+ */
+
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/spin.h>
+#include <toaru/list.h>
+
+/*
+ * A lock that sleeps rather than yields while it waits, for things
+ * held across disk I/O and other blocking work. Waiters queue in
+ * order and unlocking hands the lock straight to the first of them.
+ * Not for use from interrupt handlers.
+ */
+typedef struct {
+	volatile void * owner;   /* process_t holding it, or NULL */
+	list_t       waiters;
+	uint32_t     taken;      /* lock_clock() when it was taken */
+	lock_stat_t * stat;
+} mutex_t;
+
+#define MUTEX_INIT { NULL, { NULL, NULL, 0 }, 0, NULL }
+
+extern void mutex_init(mutex_t * mutex);
+extern void mutex_lock_stat(mutex_t * mutex, lock_stat_t * stat);
+extern void mutex_unlock(mutex_t * mutex);
+#define mutex_lock(mutex) LOCK_STAT_SITE(mutex, mutex_lock_stat)
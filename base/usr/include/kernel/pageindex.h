@@ -0,0 +1,33 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/system.h>
+
+/*
+ * A hash of cached pages keyed by (device, key), kept in least
+ * recently used order. Entries are embedded at the start of the
+ * caller's own page records; the caller does its own locking.
+ */
+typedef struct page_index_entry {
+	void * device;
+	uint64_t key;
+	struct page_index_entry * hash_next;
+	struct page_index_entry * lru_prev; /* More recently used */
+	struct page_index_entry * lru_next; /* Less recently used */
+} page_index_entry_t;
+
+typedef struct {
+	page_index_entry_t ** hash;
+	uint32_t buckets; /* Must be a power of two */
+	page_index_entry_t * lru_head;
+	page_index_entry_t * lru_tail;
+	uint32_t count;
+} page_index_t;
+
+void page_index_init(page_index_t * index, uint32_t buckets);
+page_index_entry_t * page_index_lookup(page_index_t * index, void * device, uint64_t key);
+void page_index_insert(page_index_t * index, page_index_entry_t * entry);
+void page_index_remove(page_index_t * index, page_index_entry_t * entry);
+/* Mark an entry as the most recently used */
+void page_index_touch(page_index_t * index, page_index_entry_t * entry);
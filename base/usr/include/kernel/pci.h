@@ -21,8 +21,16 @@
 #define PCI_BAR5                 0x24 // 4
 
 #define PCI_INTERRUPT_LINE       0x3C // 1
+#define PCI_INTERRUPT_PIN        0x3D // 1
 
 #define PCI_SECONDARY_BUS        0x19 // 1
+#define PCI_CAPABILITIES         0x34 // 1
+
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAPABILITIES  (1 << 4)
+
+#define PCI_CAP_MSI  0x05
+#define PCI_CAP_MSIX 0x11
 
 #define PCI_HEADER_TYPE_DEVICE  0
 #define PCI_HEADER_TYPE_BRIDGE  1
@@ -35,6 +43,26 @@
 #define PCI_VALUE_PORT   0xCFC
 
 #define PCI_NONE 0xFFFF
+#define PCI_ANY  0xFFFF /* For pci_find_device(), any device ID */
+
+#define PCI_MAX_DEVICES 256
+
+/*
+ * What pci_enumerate() read from each function at boot. BARs are as
+ * the firmware left them; fields drivers write (the command register,
+ * interrupt line) aren't kept, so read those with pci_read_field().
+ */
+typedef struct {
+	uint32_t address;  /* As from pci_box_device() */
+	uint16_t vendor_id;
+	uint16_t device_id;
+	uint16_t type;     /* Class and subclass, as pci_find_type() */
+	uint8_t  prog_if;
+	uint8_t  revision;
+	uint8_t  header_type;
+	uint8_t  irq_pin;
+	uint32_t bar[6];
+} pci_device_t;
 
 typedef void (*pci_func_t)(uint32_t device, uint16_t vendor_id, uint16_t device_id, void * extra);
 
@@ -64,5 +92,14 @@ void pci_scan_func(pci_func_t f, int type, int bus, int slot, int func, void * e
 void pci_scan_slot(pci_func_t f, int type, int bus, int slot, void * extra);
 void pci_scan_bus(pci_func_t f, int type, int bus, void * extra);
 void pci_scan(pci_func_t f, int type, void * extra);
+void pci_enumerate(void);
+int pci_count(void);
+pci_device_t * pci_device_at(int index);
+pci_device_t * pci_get_device(uint32_t device);
+pci_device_t * pci_find_device(uint16_t vendor_id, uint16_t device_id, int index);
+pci_device_t * pci_find_class(uint16_t type, int index);
 void pci_remap(void);
 int pci_get_interrupt(uint32_t device);
+int pci_find_capability(uint32_t device, int id);
+int pci_enable_msi(uint32_t device);
+int pci_enable_msix(uint32_t device, int entry);
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <kernel/types.h>
+#include <kernel/spin.h>
 
 typedef struct _pipe_device {
 	uint8_t * buffer;
@@ -13,8 +14,8 @@ typedef struct _pipe_device {
 	size_t read_ptr;
 	size_t size;
 	size_t refcount;
-	volatile int lock_read[2];
-	volatile int lock_write[2];
+	spin_lock_t lock_read;
+	spin_lock_t lock_write;
 	list_t * wait_queue_readers;
 	list_t * wait_queue_writers;
 	int dead;
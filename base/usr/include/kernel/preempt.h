@@ -0,0 +1,55 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Kernel preemption and latency tracing (kernel/sys/preempt.c)
+ */
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/smp.h>
+
+/*
+ * Kernel code can be switched away from wherever interrupts are on,
+ * unless it holds a spin lock, is in an interrupt handler, or is
+ * between preempt_disable() and preempt_enable(). A switch that comes
+ * due while it can't happen is left pending and taken at the next
+ * preemption point: the end of the section, the way out of the
+ * interrupt handler, or the way back from a system call.
+ */
+#define preempt_pending (this_cpu()->preempt_pending)
+#define in_switch       (this_cpu()->in_switch)    /* Inside switch_task() itself */
+
+extern void preempt_disable(void);
+extern void preempt_enable(void);
+extern void preempt_disable_at(uintptr_t site);
+extern void preempt_enable_at(void * owner, uintptr_t site);
+
+/* Switch now if something more important is waiting and we're allowed to */
+extern void preempt_point(void);
+
+/* Around interrupt handlers, and on the way out of a system call */
+extern void preempt_irq_enter(void);
+extern void preempt_irq_exit(void);
+extern void preempt_syscall_exit(void);
+
+/*
+ * Latency tracing, when booted with "latency": the longest stretches
+ * with interrupts off and without preemption, and the code addresses
+ * where each began and ended (see /proc/ksyms). Times are in TSC
+ * cycles.
+ */
+typedef struct latency_stat {
+	uint32_t  spans;
+	uint32_t  longest;
+	uintptr_t start_site;
+	uintptr_t end_site;
+} latency_stat_t;
+
+extern int latency_tracing;
+extern latency_stat_t latency_irqs;
+extern latency_stat_t latency_preempt;
+
+extern void latency_irqs_off_at(uintptr_t site);
+extern void latency_irqs_on_at(uintptr_t site);
+extern void latency_irqs_off(void);
+extern void latency_irqs_on(void);
+extern void latency_trace_start(void);
@@ -0,0 +1,24 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+ * A cache that can give memory back when frames run short.
+ * Returns how much it let go of, in kB.
+ */
+typedef uint32_t (*reclaim_func_t)(void);
+
+extern void reclaim_register(const char * name, reclaim_func_t func);
+extern uint32_t memory_reclaim(void);
+
+/* Used by the frame allocator */
+extern void memory_pressure_check(void);
+extern void memory_exhausted(int kernel);
+
+extern void memory_pressure_install(void);
+
+/* Statistics, reported through /proc/meminfo */
+extern uint32_t reclaim_passes;
+extern uint32_t oom_kills;
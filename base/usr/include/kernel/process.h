@@ -5,6 +5,8 @@
 
 #include <kernel/signal.h>
 #include <kernel/task.h>
+#include <kernel/spin.h>
+#include <kernel/smp.h>
 
 #include <toaru/tree.h>
 
@@ -16,6 +18,12 @@ typedef unsigned int  status_t;
 
 #define USER_ROOT_UID (user_t)0
 
+/* Scheduling classes, highest priority first */
+#define SCHED_CLASS_REALTIME    0
+#define SCHED_CLASS_INTERACTIVE 1
+#define SCHED_CLASS_BATCH       2
+#define SCHED_CLASSES           3
+
 /* Unix waitpid() options */
 enum wait_option{
 	WCONTINUED,
@@ -35,6 +43,7 @@ typedef struct thread {
 	uint8_t    padding[32]; /* I don't know */
 
 	page_directory_t * page_directory; /* Page Directory */
+	uintptr_t  tls_base; /* Where the user TLS segment (%gs) points */
 } thread_t;
 
 /* Portable image struct */
@@ -42,21 +51,30 @@ typedef struct image {
 	size_t    size;        /* Image size */
 	uintptr_t entry;       /* Binary entry point */
 	uintptr_t heap;        /* Heap pointer */
-	uintptr_t heap_actual; /* Actual heap location */
+	uintptr_t heap_actual; /* Last page reserved for the heap */
+	uintptr_t heap_start;  /* First page page_fault() may fill in for the heap */
 	uintptr_t stack;       /* Process kernel stack */
 	uintptr_t user_stack;  /* User stack */
 	uintptr_t start;
 	uintptr_t shm_heap;
-	volatile int lock[2];
+	spin_lock_t lock;
 } image_t;
 
+/* An open file descriptor */
+typedef struct {
+	fs_node_t * node;
+	uint64_t    offset;
+	int         mode;
+	int         flags;       /* FD_CLOEXEC */
+} fd_entry_t;
+
 /* Resizable descriptor table */
 typedef struct descriptor_table {
-	fs_node_t ** entries;
-	uint64_t  *  offsets;
-	int       *  modes;
-	size_t       length;
+	fd_entry_t * entries;
+	uint32_t  *  used;       /* Bitmap of allocated slots */
+	size_t       length;     /* One past the highest slot ever allocated */
 	size_t       capacity;
+	size_t       next_free;  /* No free slot below this one */
 	size_t       refs;
 } fd_table_t;
 
@@ -68,6 +86,22 @@ typedef struct signal_table {
 	uintptr_t functions[NUMSIGNALS+1];
 } sig_table_t;
 
+/*
+ * Resource usage. Times are in TSC cycles, charged as a process goes
+ * in and out of the kernel and on and off the CPU; they only become
+ * microseconds when someone asks (timer_cycles_to_us).
+ */
+typedef struct process_usage {
+	uint64_t utime;
+	uint64_t stime;
+	uint32_t nvcsw;        /* Gave up the CPU to wait for something */
+	uint32_t nivcsw;       /* Was switched away from while still runnable */
+	uint32_t minflt;       /* Page faults served from memory */
+	uint32_t majflt;       /* Page faults that had to bring a page back from zswap */
+	uint64_t read_bytes;   /* What read()s and write()s returned */
+	uint64_t write_bytes;
+} process_usage_t;
+
 /* Portable process struct */
 typedef struct process {
 	pid_t         id;                /* Process ID (pid) */
@@ -97,26 +131,43 @@ typedef struct process {
 	struct regs * syscall_registers; /* Registers at interrupt */
 	list_t *      wait_queue;
 	list_t *      shm_mappings;      /* Shared memory chunk mappings */
+	list_t *      mmap_regions;      /* mmap() regions, sorted by address */
 	list_t *      signal_queue;      /* Queued signals */
 	thread_t      signal_state;
 	char *        signal_kstack;
+	node_t        proc_node;         /* In the list of all processes */
 	node_t        sched_node;
 	node_t        sleep_node;
-	node_t *      timed_sleep_node;
+	struct sleeper * timed_sleeper;  /* On the sleep heap for sleep_until() */
+	node_t        job_node;          /* In the member list of its process group */
+	node_t        wait_node;         /* In the parent's wait_events, while there's something to report */
+	list_t *      wait_events;       /* Children that exited or stopped, in that order */
+	list_t *      exit_watchers;     /* Processes waiting on a pidfd for this one */
 	uint8_t       is_tasklet;
 	volatile uint8_t sleep_interrupted;
 	list_t *      node_waits;
 	int           awoken_index;
-	node_t *      timeout_node;
+	struct sleeper * timeout_sleeper; /* On the sleep heap for a node wait with a timeout */
 	struct timeval start;
 	uint8_t       suspended;
+	uint8_t       sched_class;       /* Requested scheduling class */
+	uint8_t       sched_penalty;     /* Interactive process demoted for using whole slices */
+	unsigned int  time_slice;        /* Timer ticks left before preemption */
+	process_usage_t usage;
+	process_usage_t child_usage;     /* Of every child that has been waited for */
+	uint64_t      usage_stamp;       /* TSC when time was last charged to this process */
+	int           preempt_count;     /* Held spin locks, interrupt handlers, preempt_disable()s */
+	uint32_t      preempt_since;     /* lock_clock() when it last became non-preemptible */
+	uintptr_t     preempt_site;      /* ...and where */
+	int           cpu;               /* Processor it last ran on (or was queued for) */
 } process_t;
 
-typedef struct {
+typedef struct sleeper {
 	unsigned long end_tick;
 	unsigned long end_subtick;
 	process_t * process;
 	int is_fswait;
+	int index;                       /* In the sleep heap, or -1 once it's off */
 } sleeper_t;
 
 extern void initialize_process_tree(void);
@@ -128,26 +179,46 @@ extern void set_process_environment(process_t * proc, page_directory_t * directo
 extern void make_process_ready(process_t * proc);
 extern uint8_t process_available(void);
 extern process_t * next_ready_process(void);
+extern int process_tick(void);
+extern int process_should_preempt(void);
+extern int next_sleeper(unsigned long * seconds, unsigned long * subseconds);
+extern void process_start_slice(process_t * proc);
+extern void process_charge(process_t * proc, uint64_t now, int user);
+extern void process_usage_add(process_usage_t * dest, process_usage_t * src);
+extern void process_queue_wait_event(process_t * proc);
+extern fs_node_t * make_pidfd(process_t * proc);
 extern uint32_t process_append_fd(process_t * proc, fs_node_t * node);
+extern fd_table_t * process_fd_table(size_t capacity);
+extern void process_close_fd(process_t * proc, int fd);
 extern process_t * process_from_pid(pid_t pid);
+extern void process_set_job(process_t * proc, pid_t job);
+extern int process_job_exists(pid_t job);
+extern pid_t * process_job_leaders(pid_t job, int * count);
 extern void delete_process(process_t * proc);
 process_t * process_get_parent(process_t * process);
+extern void process_foreach(void (*callback)(process_t * proc, process_t * parent, void * data), void * data);
 extern uint32_t process_move_fd(process_t * proc, int src, int dest);
 extern int process_is_ready(process_t * proc);
 
 extern void wakeup_sleepers(unsigned long seconds, unsigned long subseconds);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
 
-extern volatile process_t * current_process;
-extern process_t * kernel_idle_task;
+/* Each processor's own */
+#define current_process  (this_cpu()->process)
+#define kernel_idle_task (this_cpu()->idle)
+extern uint64_t idle_cycles;
+extern void process_idle_end(uint64_t now);
 extern list_t * process_list;
 
 extern int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout);
+extern int process_wait_poll(process_t * process, fs_node_t * nodes[], int events[], int count, int timeout);
 extern int process_alert_node(process_t * process, void * value);
 extern int process_awaken_from_fswait(process_t * process, int index);
 
 typedef void (*tasklet_t) (void *, char *);
 extern int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp);
+extern int create_user_tasklet(tasklet_t tasklet, char * name, void * argp);
+extern void process_disown(process_t * proc);
 
 extern void release_directory(page_directory_t * dir);
 extern void release_directory_for_exec(page_directory_t * dir);
@@ -33,6 +33,10 @@ typedef struct pty {
 	void (*write_in)(struct pty *, uint8_t);
 	void (*write_out)(struct pty *, uint8_t);
 
+	/* Optional; NULL falls back to the single-character hooks */
+	void (*write_in_block)(struct pty *, uint8_t *, size_t);
+	void (*write_out_block)(struct pty *, uint8_t *, size_t);
+
 	int next_is_verbatim;
 
 	void (*fill_name)(struct pty *, char *);
@@ -42,4 +46,6 @@ typedef struct pty {
 void tty_output_process_slave(pty_t * pty, uint8_t c);
 void tty_output_process(pty_t * pty, uint8_t c);
 void tty_input_process(pty_t * pty, uint8_t c);
+void tty_output_process_slave_block(pty_t * pty, uint8_t * buf, size_t size);
+void tty_input_process_block(pty_t * pty, uint8_t * buf, size_t size);
 pty_t * pty_new(struct winsize * size);
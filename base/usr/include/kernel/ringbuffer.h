@@ -5,12 +5,14 @@ typedef struct {
 	size_t write_ptr;
 	size_t read_ptr;
 	size_t size;
-	volatile int lock[2];
+	size_t mask; /* size - 1 when size is a power of two, else 0 */
+	spin_lock_t lock;
 	list_t * wait_queue_readers;
 	list_t * wait_queue_writers;
 	int internal_stop;
 	list_t * alert_waiters;
 	int discard;
+	list_t * alert_writers; /* Selecting for space rather than data */
 } ring_buffer_t;
 
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer);
@@ -18,10 +20,14 @@ size_t ring_buffer_size(fs_node_t * node);
 size_t ring_buffer_available(ring_buffer_t * ring_buffer);
 size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer);
 size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer);
+size_t ring_buffer_splice(ring_buffer_t * from, ring_buffer_t * to, size_t size);
+int ring_buffer_resize(ring_buffer_t * ring_buffer, size_t size);
 
 ring_buffer_t * ring_buffer_create(size_t size);
 void ring_buffer_destroy(ring_buffer_t * ring_buffer);
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer);
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer);
 void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process);
+void ring_buffer_alert_writers(ring_buffer_t * ring_buffer);
+void ring_buffer_select_wait_write(ring_buffer_t * ring_buffer, void * process);
 
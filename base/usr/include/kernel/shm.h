@@ -17,6 +17,7 @@ typedef struct {
 
 	uint32_t num_frames;
 	uintptr_t *frames;
+	uint32_t large_pages; /* Leading 4MiB runs of frames[] that can be mapped as large pages */
 } shm_chunk_t;
 
 typedef struct shm_node {
@@ -28,8 +29,8 @@ typedef struct {
 	shm_chunk_t * chunk;
 	uint8_t volatile lock;
 
-	uint32_t num_vaddrs;
-	uintptr_t *vaddrs;
+	uintptr_t start;      /* Mapped contiguously from here */
+	uint32_t num_pages;
 } shm_mapping_t;
 
 /* Syscalls */
@@ -0,0 +1,54 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+ * Object caches
+ *
+ * A cache hands out objects of one size from pages of their own, so
+ * the structures the kernel makes and drops all the time don't go
+ * through the general allocator's bins. Objects come back to their
+ * page's free list with slab_free() or plain free(), and keep their
+ * contents: the constructor, if any, runs once per object, when its
+ * page is carved up, not on every allocation.
+ *
+ * Caches are declared statically with SLAB_CACHE() and join the list
+ * reported in /proc/slabinfo on first use. Pages are kept by their
+ * cache once it has them.
+ */
+
+struct slab;
+
+typedef struct slab_cache {
+	const char * name;
+	size_t size;              /* Object size as asked for */
+	void (*ctor)(void *);
+
+	/* Set up on first use */
+	size_t stride;            /* Object size as stored */
+	struct slab * partial;    /* Pages with objects both used and free */
+	struct slab * empty;      /* Pages with nothing allocated */
+	struct slab * full;       /* Pages with nothing free */
+	struct slab_cache * next;
+
+	/* Accounting */
+	uint32_t pages;
+	uint32_t objects;         /* Carved out of those pages */
+	uint32_t in_use;
+	uint32_t allocs;
+} slab_cache_t;
+
+#define SLAB_CACHE(NAME, TYPE, CTOR) { .name = NAME, .size = sizeof(TYPE), .ctor = CTOR }
+
+extern void * slab_alloc(slab_cache_t * cache);
+extern void slab_free(void * object);
+
+/* Every cache that has been used */
+extern slab_cache_t * slab_caches;
+
+/* Caches for the VFS and list structures */
+extern slab_cache_t fs_node_cache;
+extern slab_cache_t dirent_cache;
+extern slab_cache_t list_node_cache;
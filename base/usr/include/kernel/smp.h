@@ -0,0 +1,65 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Multiprocessing (kernel/cpu/smp.c)
+ */
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/task.h>
+
+#define SMP_MAX_CPUS 32
+
+/* GDT entry 7, which each processor points at its own cpu_t */
+#define PERCPU_SELECTOR 0x38
+
+struct process;
+
+/*
+ * What each processor keeps to itself. Every way into the kernel loads
+ * %fs with PERCPU_SELECTOR, which this processor's GDT bases at its
+ * entry here, so this_cpu() is a single load.
+ */
+typedef struct cpu {
+	struct cpu * self;                 /* %fs:0 */
+	int index;                         /* Into cpus[] */
+	uint8_t lapic_id;
+	volatile int online;
+	volatile struct process * process; /* current_process */
+	struct process * idle;             /* kernel_idle_task */
+	page_directory_t * directory;      /* current_directory */
+	volatile int preempt_pending;
+	volatile int in_switch;
+	volatile int tlb_flush;            /* Another processor wants our TLB flushed */
+} cpu_t;
+
+static inline cpu_t * this_cpu(void) {
+	cpu_t * cpu;
+	__asm__ __volatile__ ("movl %%fs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+extern int smp_cpu_count;            /* Found in the MP table */
+extern volatile int smp_cpus_online; /* Started, the bootstrap processor included */
+extern uint8_t smp_lapic_ids[SMP_MAX_CPUS];
+extern uintptr_t smp_lapic_address;
+
+extern void smp_install(void);
+extern void smp_start(void);
+
+/*
+ * One processor at a time runs kernel code. It is taken on the way in
+ * from user mode (and by an interrupt that wakes a halted processor),
+ * and let go on the way back out and while halted.
+ */
+extern void kernel_lock(void);
+extern void kernel_unlock(void);
+extern int kernel_enter(void);
+extern void kernel_leave(int locked);
+
+extern void smp_switched(struct process * next);
+extern void smp_ipi(void);
+extern void smp_wake(int cpu);
+extern int smp_cpu_idle(int cpu);
+extern int smp_directory_elsewhere(page_directory_t * dir);
+extern void smp_tlb_shootdown(page_directory_t * dir);
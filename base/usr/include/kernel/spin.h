@@ -0,0 +1,47 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Spin locks (kernel/spin.c)
+ */
+
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+ * Lock statistics, kept per place a lock is taken; see /proc/lockstat.
+ * Hold times are in TSC cycles and charged to the site that took the
+ * lock.
+ */
+typedef struct lock_stat {
+	const char * name;
+	const char * file;
+	int          line;
+	int          registered;
+	uint32_t     acquired;
+	uint32_t     contended;
+	uint64_t     held;
+	uint32_t     held_max;
+	struct lock_stat * next;
+} lock_stat_t;
+
+extern lock_stat_t * lock_stats;
+extern void lock_stat_register(lock_stat_t * stat);
+extern void lock_stat_release(lock_stat_t * stat, uint32_t since);
+
+static inline uint32_t lock_clock(void) {
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+	return lo;
+}
+
+#define LOCK_STAT_SITE(lock, func) do { \
+	static lock_stat_t _lock_stat = { #lock, __FILE__, __LINE__, 0, 0, 0, 0, 0, NULL }; \
+	func((lock), &_lock_stat); \
+} while (0)
+
+/* [0] held, [1] waiters, [2] when it was taken, [3] the lock_stat_t of who took it, [4] the process that did */
+typedef volatile int spin_lock_t[5];
+extern void spin_init(spin_lock_t lock);
+extern void spin_lock_stat(spin_lock_t lock, lock_stat_t * stat);
+extern void spin_unlock(spin_lock_t lock);
+#define spin_lock(lock) LOCK_STAT_SITE(lock, spin_lock_stat)
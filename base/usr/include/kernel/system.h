@@ -5,9 +5,12 @@
 #include <va_list.h>
 
 #include <kernel/types.h>
+#include <kernel/spin.h>
 #include <kernel/fs.h>
 #include <kernel/task.h>
 #include <kernel/process.h>
+#include <kernel/preempt.h>
+#include <kernel/smp.h>
 #include <kernel/libc.h>
 
 #include <toaru/list.h>
@@ -29,6 +32,25 @@ void int_enable(void);
 #define IRQ_ON  int_enable()
 #define PAUSE   { asm volatile ("hlt"); }
 
+/*
+ * Disable interrupts and hand back the old flags for int_restore().
+ * Unlike IRQ_OFF / IRQ_RES these nest properly and are safe to use
+ * from interrupt handlers.
+ */
+static inline uint32_t int_save(void) {
+	uint32_t flags;
+	asm volatile ("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+	if (latency_tracing && (flags & (1 << 9))) latency_irqs_off();
+	return flags;
+}
+
+static inline void int_restore(uint32_t flags) {
+	if (flags & (1 << 9)) {
+		if (latency_tracing) latency_irqs_on();
+		asm volatile ("sti" : : : "memory");
+	}
+}
+
 #define STOP while (1) { PAUSE; }
 
 #define SYSCALL_VECTOR 0x7F
@@ -43,12 +65,6 @@ extern char * boot_arg_extra; /* Extra data to pass to init */
 
 extern void *sbrk(uintptr_t increment);
 
-/* spin.c */
-typedef volatile int spin_lock_t[2];
-extern void spin_init(spin_lock_t lock);
-extern void spin_lock(spin_lock_t lock);
-extern void spin_unlock(spin_lock_t lock);
-
 extern void return_to_userspace(void);
 
 /* Kernel Main */
@@ -69,15 +85,24 @@ extern size_t rfind(const char * str, const char accept);
 
 extern uint32_t krand(void);
 
+/* Kernel RNG; krand() is only for things that don't need to be unpredictable */
+extern void random_install(void);
+extern void random_add_entropy(uint32_t data);
+extern void random_get_bytes(void * buffer, size_t length);
+extern uint32_t random_u32(void);
+
 extern uint8_t startswith(const char * str, const char * accept);
 
 /* GDT */
 extern void gdt_install(void);
+extern void gdt_install_cpu(cpu_t * cpu);
 extern void gdt_set_gate(uint8_t num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran);
+extern void gdt_set_tls(uintptr_t base);
 extern void set_kernel_stack(uintptr_t stack);
 
 /* IDT */
 extern void idt_install(void);
+extern void idt_install_cpu(void);
 extern void idt_set_gate(uint8_t num, void (*base)(void), uint16_t sel, uint8_t flags);
 
 /* Registers
@@ -108,20 +133,50 @@ extern void isrs_install(void);
 extern void isrs_install_handler(size_t isrs, irq_handler_t);
 extern void isrs_uninstall_handler(size_t isrs);
 
-/* Interrupt Handlers */
+/*
+ * Interrupt Handlers. IRQs 0-15 are the PIC lines; after them come
+ * vectors for message signalled interrupts, handed out one per device
+ * by irq_alloc_msi(), the application processors' timer, the vector
+ * processors signal each other with, and the local APIC's spurious
+ * vector.
+ */
+#define IRQ_LEGACY_COUNT 16
+#define IRQ_MSI_BASE     16
+#define IRQ_MSI_COUNT    13
+#define IRQ_LAPIC_TIMER  29
+#define IRQ_IPI          30
+#define IRQ_SPURIOUS     31
+#define IRQ_COUNT        32
 extern void irq_install(void);
 extern void irq_install_handler(size_t irq, irq_handler_chain_t, char * desc);
 extern void irq_uninstall_handler(size_t irq);
 extern int irq_is_handler_free(size_t irq);
 extern void irq_gates(void);
 extern void irq_ack(size_t);
+extern int irq_alloc_msi(void);
+
+/* Local APIC */
+extern void lapic_install(void);
+extern void lapic_install_cpu(void);
+extern void lapic_eoi(void);
+extern uint8_t lapic_id(void);
+extern void lapic_send_ipi(uint8_t id, uint32_t command);
+extern int lapic_timer_calibrate(void);
+extern void lapic_timer_start(uint32_t us);
+extern int lapic_enabled;
 
 /* Timer */
 extern void timer_install(void);
 extern unsigned long timer_ticks;
 extern unsigned long timer_subticks;
 extern signed long timer_drift;
-extern void relative_time(unsigned long seconds, unsigned long subseconds, unsigned long * out_seconds, unsigned long * out_subseconds);
+extern void (*timer_sample_hook)(struct regs * r);
+extern void relative_time(unsigned long seconds, unsigned long milliseconds, unsigned long * out_seconds, unsigned long * out_subseconds);
+extern void relative_time_us(unsigned long seconds, unsigned long microseconds, unsigned long * out_seconds, unsigned long * out_subseconds);
+extern void timer_now(unsigned long * seconds, unsigned long * subseconds);
+extern uint64_t timer_cycles(void);
+extern uint64_t timer_cycles_to_us(uint64_t cycles);
+extern void timer_wake(void);
 
 /* Memory Management */
 extern uintptr_t placement_pointer;
@@ -135,12 +190,14 @@ extern uintptr_t kvmalloc_p(size_t size, uintptr_t * phys);
 // Page types moved to task.h
 
 extern page_directory_t *kernel_directory;
-extern page_directory_t *current_directory;
+#define current_directory (this_cpu()->directory)
 
 extern void paging_install(uint32_t memsize);
+extern void paging_install_cpu(void);
 extern void paging_prestart(void);
 extern void paging_finalize(void);
 extern void paging_mark_system(uint64_t addr);
+extern void paging_set_physical(page_directory_t * dir);
 extern void switch_page_directory(page_directory_t * new);
 extern void invalidate_page_tables(void);
 extern void invalidate_tables_at(uintptr_t addr);
@@ -155,6 +212,9 @@ void heap_install(void);
 
 void alloc_frame(page_t *page, int is_kernel, int is_writeable);
 void free_frame(page_t *page);
+int share_frame(page_t *src, page_t *dest);
+int ref_frame(uint32_t frame);
+void copy_frame(uint32_t src, uint32_t dest);
 uintptr_t memory_use(void);
 uintptr_t memory_total(void);
 
@@ -167,7 +227,6 @@ void free(void *ptr);
 
 /* Tasks */
 extern uintptr_t read_eip(void);
-extern void copy_page_physical(uint32_t, uint32_t);
 extern page_directory_t * clone_directory(page_directory_t * src);
 extern page_table_t * clone_table(page_table_t * src, uintptr_t * physAddr);
 extern void move_stack(void *new_stack_start, size_t size);
@@ -179,7 +238,8 @@ extern void tasking_install(void);
 extern void switch_task(uint8_t reschedule);
 extern void switch_next(void);
 extern uint32_t fork(void);
-extern uint32_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg);
+extern uint32_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg, uintptr_t tls);
+extern uint32_t spawn(void (*entry)(void *), void * arg);
 extern uint32_t getpid(void);
 extern void enter_user_jmp(uintptr_t location, int argc, char ** argv, uintptr_t stack);
 
@@ -202,6 +262,7 @@ extern uint32_t now(void);
 extern void switch_fpu(void);
 extern void unswitch_fpu(void);
 extern void fpu_install(void);
+extern void fpu_install_cpu(void);
 
 /* ELF */
 extern int exec( char *, int, char **, char **, int);
@@ -209,10 +270,30 @@ extern int system( char *, int, char **, char **);
 
 /* Sytem Calls */
 extern void syscalls_install(void);
+extern void syscalls_install_cpu(void);
+extern void sysenter_entry(void);
+extern int sysenter_enabled;
+
+typedef struct {
+	uint32_t calls;
+	uint64_t cycles; /* TSC cycles spent inside, including any sleeping */
+} syscall_stat_t;
+
+extern syscall_stat_t syscall_stats[];
+extern uint32_t num_syscalls;
+
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+	asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
 
 /* wakeup queue */
 extern int wakeup_queue(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
+extern int wakeup_queue_count(list_t * queue, int count);
 extern int sleep_on(list_t * queue);
 
 typedef struct {
@@ -2,28 +2,41 @@
 
 #include <kernel/types.h>
 
+/*
+ * PAE: 64-bit entries, so physical memory past 4GiB can be mapped.
+ * Virtual addresses are still 32 bits; the PDPT's four entries each
+ * take a gigabyte, through a directory of 512 tables of 512 pages.
+ */
+#define PAGE_TABLE_ENTRIES     512
+#define PAGE_DIRECTORY_ENTRIES 2048 /* All four directories, as one */
+#define PAGE_TABLE_SPAN        (PAGE_TABLE_ENTRIES * 0x1000) /* 2MiB */
+
 typedef struct page {
-	unsigned int present:1;
-	unsigned int rw:1;
-	unsigned int user:1;
-	unsigned int writethrough:1;
-	unsigned int cachedisable:1;
-	unsigned int accessed:1;
-	unsigned int dirty:1;
-	unsigned int pat:1;
-	unsigned int global:1;
-	unsigned int unused:3;
-	unsigned int frame:20;
+	uint64_t present:1;
+	uint64_t rw:1;
+	uint64_t user:1;
+	uint64_t writethrough:1;
+	uint64_t cachedisable:1;
+	uint64_t accessed:1;
+	uint64_t dirty:1;
+	uint64_t pat:1;
+	uint64_t global:1;
+	uint64_t cow:1; /* Shared frame, copy on write */
+	uint64_t swapped:1; /* Not present; frame is a zswap slot */
+	uint64_t unused:1;
+	uint64_t frame:28; /* Up to 40-bit physical addresses */
+	uint64_t reserved:23;
+	uint64_t nx:1; /* EFER.NXE isn't set, so this must stay clear */
 } __attribute__((packed)) page_t;
 
 typedef struct page_table {
-	page_t pages[1024];
+	page_t pages[PAGE_TABLE_ENTRIES];
 } page_table_t;
 
 typedef struct page_directory {
-	uintptr_t physical_tables[1024];	/* Physical addresses of the tables */
-	page_table_t *tables[1024];	/* 1024 pointers to page tables... */
-	uintptr_t physical_address;	/* The physical address of physical_tables */
+	uint64_t physical_tables[PAGE_DIRECTORY_ENTRIES];	/* The four page directories, back to back */
+	page_table_t *tables[PAGE_DIRECTORY_ENTRIES];	/* ...and pointers to the tables in them */
+	uint64_t pdpt[4] __attribute__((aligned(32)));	/* The physical addresses of the directories */
+	uintptr_t physical_address;	/* The physical address of pdpt, for CR3 */
 	int32_t ref_count;
 } page_directory_t;
-
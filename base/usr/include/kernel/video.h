@@ -9,12 +9,70 @@
 #define IO_VID_STRIDE 0x5007
 #define IO_VID_DRIVER 0x5008
 #define IO_VID_REINIT 0x5009
+#define IO_VID_CURSOR 0x500A
+#define IO_VID_CURSOR_MOVE 0x500B
+#define IO_VID_UPDATE 0x500C
+#define IO_VID_COPY   0x500D
+#define IO_VID_PAGES  0x500E
+#define IO_VID_FLIP   0x500F
+
+/* Largest hardware cursor image, in either dimension */
+#define IO_VID_CURSOR_MAX 64
+
+/* Most rectangles in one IO_VID_UPDATE */
+#define IO_VID_RECTS_MAX 256
 
 struct vid_size {
 	uint32_t width;
 	uint32_t height;
 };
 
+/* IO_VID_CURSOR: load a cursor image; bitmap is premultiplied ARGB */
+struct vid_cursor {
+	uint32_t width;
+	uint32_t height;
+	uint32_t hot_x;
+	uint32_t hot_y;
+	uint32_t * bitmap;
+};
+
+/* IO_VID_CURSOR_MOVE: place the hotspot at x,y, or hide the cursor */
+struct vid_cursor_pos {
+	int32_t x;
+	int32_t y;
+	int32_t visible;
+};
+
+struct vid_rect {
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+/* IO_VID_UPDATE: these parts of the framebuffer changed */
+struct vid_rects {
+	uint32_t count;
+	struct vid_rect * rects;
+};
+
+/* IO_VID_COPY: copy a rectangle of the framebuffer on the device */
+struct vid_copy {
+	int32_t src_x;
+	int32_t src_y;
+	int32_t dst_x;
+	int32_t dst_y;
+	uint32_t width;
+	uint32_t height;
+};
+
+/*
+ * IO_VID_PAGES: ask for this many screen-sized pages of video memory,
+ * stacked one after another from the framebuffer address; the count is
+ * replaced with how many the device can flip between (at least one).
+ * IO_VID_FLIP: show the given page. Changing modes goes back to one.
+ */
+
 #ifdef _KERNEL_
 extern void lfb_set_resolution(uint16_t x, uint16_t y);
 extern uint16_t lfb_resolution_x;
@@ -22,5 +80,11 @@ extern uint16_t lfb_resolution_y;
 extern uint16_t lfb_resolution_b;
 extern uint8_t * lfb_vid_memory;
 extern const char * lfb_driver_name;
+extern int (*lfb_cursor_define)(struct vid_cursor * cursor);
+extern int (*lfb_cursor_move)(struct vid_cursor_pos * pos);
+extern int (*lfb_update_rects)(struct vid_rect * rects, int count);
+extern int (*lfb_copy_rect)(struct vid_copy * copy);
+extern uint32_t (*lfb_set_pages)(uint32_t count);
+extern int (*lfb_flip_page)(uint32_t page);
 #endif
 
@@ -0,0 +1,43 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+ * Deferred work, run by a small pool of kernel threads instead of a
+ * tasklet per driver. A work item is embedded in whatever it works on
+ * and can be queued from anywhere, interrupt handlers included; it is
+ * queued at most once at a time, and may queue itself again from its
+ * own function.
+ */
+typedef void (*work_func_t)(void * data);
+
+#define WORK_NORMAL 0 /* Ordinary deferred work */
+#define WORK_HIGH   1 /* Bottom halves that fall behind audibly or visibly */
+#define WORK_POOLS  2
+
+#define WORK_IDLE    0
+#define WORK_QUEUED  1
+#define WORK_DELAYED 2
+
+typedef struct work {
+	work_func_t func;
+	void * data;
+	int pool;
+	volatile int state;
+	struct work * next;
+	unsigned long end_tick;     /* When a delayed item is due */
+	unsigned long end_subtick;
+} work_t;
+
+extern void work_init(work_t * work, work_func_t func, void * data, int pool);
+
+/* Both return 1 if the item was queued, or 0 if it already was */
+extern int queue_work(work_t * work);
+extern int queue_delayed_work(work_t * work, unsigned long milliseconds);
+
+/* Take an item off its queue; one that is already running isn't waited for */
+extern int cancel_work(work_t * work);
+
+extern void workqueue_install(void);
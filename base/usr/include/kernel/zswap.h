@@ -0,0 +1,29 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ */
+#pragma once
+
+#include <kernel/types.h>
+
+/*
+ * Compressed swap (kernel/mem/zswap.c)
+ *
+ * Cold anonymous pages are compressed into the kernel heap and their
+ * frames given back; a page table entry for one is not present, has
+ * `swapped` set, and keeps a slot number where the frame would be.
+ */
+
+extern void zswap_install(void);
+
+/* Compress up to this many cold pages; returns how many went */
+extern uint32_t zswap_shrink(uint32_t pages);
+
+/* Bring back a page on a not-present fault; returns 0 if it wasn't swapped */
+extern int zswap_fault(uintptr_t address);
+
+/* For page table entries being copied or dropped */
+extern void zswap_dup(uint32_t slot);
+extern void zswap_free(uint32_t slot);
+
+/* Statistics, reported through /proc/meminfo */
+extern uint32_t zswap_pages;  /* Pages held */
+extern uint32_t zswap_stored; /* Bytes they take up */
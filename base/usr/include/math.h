@@ -1,41 +1,65 @@
 #pragma once
 
 #include <_cheader.h>
+#include <stddef.h>
 
 _Begin_C_Header
 
-#define M_PI 3.1415926
+#define M_PI 3.14159265358979323846
 
-extern double floor(double x);
 extern int abs(int j);
-extern double pow(double x, double y);
-extern double exp(double x);
+extern double fabs(double x);
+extern float fabsf(float x);
 extern double fmod(double x, double y);
+
+extern double floor(double x);
+extern double ceil(double x);
+extern double trunc(double x);
+extern float floorf(float x);
+extern float ceilf(float x);
+extern float truncf(float x);
+
+extern double scalbn(double x, int n);
+extern float scalbnf(float x, int n);
+extern double ldexp(double a, int exp);
+double frexp(double x, int *exp);
+
 extern double sqrt(double x);
 extern float sqrtf(float x);
-extern double fabs(double x);
-extern float fabsf(float x);
+extern double exp(double x);
+extern float expf(float x);
+extern double log(double x);
+extern double log2(double x);
+extern double log10(double x);
+extern float logf(float x);
+extern double pow(double x, double y);
+extern float powf(float x, float y);
+
 extern double sin(double x);
 extern double cos(double x);
-
-double frexp(double x, int *exp);
+extern double tan(double x);
+extern float sinf(float x);
+extern float cosf(float x);
+extern float tanf(float x);
+extern double atan(double x);
+extern double atan2(double y, double x);
+extern float atanf(float x);
+extern float atan2f(float y, float x);
 
 #define HUGE_VAL (__builtin_huge_val())
 
 /* Unimplemented, but stubbed */
 extern double acos(double x);
 extern double asin(double x);
-extern double atan2(double y, double x);
-extern double ceil(double x);
 extern double cosh(double x);
-extern double ldexp(double a, int exp);
-extern double log(double x);
-extern double log10(double x);
-extern double log2(double x);
 extern double sinh(double x);
-extern double tan(double x);
 extern double tanh(double x);
-extern double atan(double x);
+
+/* Over whole arrays, four at a time; out may be the same as in */
+extern void vsinf(float * out, const float * in, size_t n);
+extern void vcosf(float * out, const float * in, size_t n);
+extern void vexpf(float * out, const float * in, size_t n);
+extern void vsqrtf(float * out, const float * in, size_t n);
 
 extern double modf(double x, double *iptr);
 
@@ -20,6 +20,8 @@ struct pollfd {
 	short revents;
 };
 
+#ifndef _KERNEL_
 extern int poll(struct pollfd * fds, nfds_t nfds, int timeout);
+#endif
 
 _End_C_Header
@@ -7,8 +7,7 @@ _Begin_C_Header
 
 typedef struct {
 	uint32_t id;
-	char * stack;
-	void * ret_val;
+	struct __pthread * thread; /* Its stack, TLS, and return value */
 } pthread_t;
 typedef unsigned int pthread_attr_t;
 
@@ -38,5 +37,38 @@ extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
 extern int pthread_attr_init(pthread_attr_t *attr);
 extern int pthread_attr_destroy(pthread_attr_t *attr);
 
+typedef struct {
+	volatile uint32_t seq;      /* Bumped by every signal/broadcast */
+	volatile uint32_t waiters;
+} pthread_cond_t;
+typedef int pthread_condattr_t;
+
+#define PTHREAD_COND_INITIALIZER {0, 0}
+
+extern int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+extern int pthread_cond_destroy(pthread_cond_t *cond);
+extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+extern int pthread_cond_signal(pthread_cond_t *cond);
+extern int pthread_cond_broadcast(pthread_cond_t *cond);
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int readers;
+	int writer;
+	int waiting_writers;
+} pthread_rwlock_t;
+typedef int pthread_rwlockattr_t;
+
+#define PTHREAD_RWLOCK_INITIALIZER {0, PTHREAD_COND_INITIALIZER, 0, 0, 0}
+
+extern int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
+extern int pthread_rwlock_destroy(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+extern int pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
+
 
 _End_C_Header
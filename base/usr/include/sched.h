@@ -3,5 +3,18 @@
 #include <_cheader.h>
 
 _Begin_C_Header
+
+/* Scheduling policies */
+#define SCHED_OTHER 0 /* Interactive time-sharing (default) */
+#define SCHED_FIFO  1 /* Realtime */
+#define SCHED_RR    2 /* Realtime */
+#define SCHED_BATCH 3 /* Long-running, throughput over latency */
+
+struct sched_param {
+	int sched_priority;
+};
+
 extern int sched_yield(void);
+extern int sched_setscheduler(int pid, int policy, const struct sched_param * param);
+extern int sched_getscheduler(int pid);
 _End_C_Header
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+typedef struct {
+	volatile uint32_t value;
+	volatile uint32_t waiters;
+} sem_t;
+
+extern int sem_init(sem_t * sem, int pshared, unsigned int value);
+extern int sem_destroy(sem_t * sem);
+extern int sem_wait(sem_t * sem);
+extern int sem_trywait(sem_t * sem);
+extern int sem_post(sem_t * sem);
+extern int sem_getvalue(sem_t * sem, int * sval);
+
+_End_C_Header
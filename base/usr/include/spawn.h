@@ -0,0 +1,74 @@
+#pragma once
+
+/*
+ * posix_spawn
+ *
+ * Starts a program in a new process without copying this one: the
+ * kernel builds the child with an empty address space, applies the
+ * file actions and attributes in it, and execs the program. The call
+ * returns once the program has been found and the actions have been
+ * applied, so failures there come back as an error rather than as a
+ * child that exits. A program that turns out not to be loadable after
+ * that point exits with status 127.
+ *
+ * As with exec(), descriptors above 2 are not passed on to the
+ * program; file actions are the way to set up 0, 1 and 2.
+ */
+
+#include <_cheader.h>
+#ifdef _KERNEL_
+#include <kernel/process.h> /* pid_t */
+#else
+#include <sys/types.h>
+#endif
+
+_Begin_C_Header
+
+#define POSIX_SPAWN_SETPGROUP 0x02
+
+#define __SPAWN_CLOSE 1
+#define __SPAWN_DUP2  2
+#define __SPAWN_OPEN  3
+
+struct __spawn_action {
+	int type;    /* __SPAWN_* */
+	int fd;      /* Descriptor in the child this acts on */
+	int src;     /* DUP2: the descriptor copied onto fd */
+	int flags;   /* OPEN */
+	int mode;    /* OPEN */
+	char * path; /* OPEN */
+};
+
+typedef struct {
+	int count;
+	int capacity;
+	struct __spawn_action * actions;
+} posix_spawn_file_actions_t;
+
+typedef struct {
+	short flags;
+	pid_t pgroup;
+} posix_spawnattr_t;
+
+#ifndef _KERNEL_
+extern int posix_spawn(pid_t * pid, const char * path, const posix_spawn_file_actions_t * file_actions,
+	const posix_spawnattr_t * attrp, char * const argv[], char * const envp[]);
+extern int posix_spawnp(pid_t * pid, const char * file, const posix_spawn_file_actions_t * file_actions,
+	const posix_spawnattr_t * attrp, char * const argv[], char * const envp[]);
+
+extern int posix_spawn_file_actions_init(posix_spawn_file_actions_t * file_actions);
+extern int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t * file_actions);
+extern int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t * file_actions, int fd);
+extern int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t * file_actions, int fd, int newfd);
+extern int posix_spawn_file_actions_addopen(posix_spawn_file_actions_t * file_actions, int fd,
+	const char * path, int oflag, mode_t mode);
+
+extern int posix_spawnattr_init(posix_spawnattr_t * attr);
+extern int posix_spawnattr_destroy(posix_spawnattr_t * attr);
+extern int posix_spawnattr_getflags(const posix_spawnattr_t * attr, short * flags);
+extern int posix_spawnattr_setflags(posix_spawnattr_t * attr, short flags);
+extern int posix_spawnattr_getpgroup(const posix_spawnattr_t * attr, pid_t * pgroup);
+extern int posix_spawnattr_setpgroup(posix_spawnattr_t * attr, pid_t pgroup);
+#endif
+
+_End_C_Header
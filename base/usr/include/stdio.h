@@ -35,6 +35,7 @@ extern int fileno(FILE * stream);
 extern int fflush(FILE * stream);
 
 extern int vasprintf(char ** buf, const char *fmt, va_list args);
+extern int asprintf(char ** buf, const char *fmt, ...);
 extern int sprintf(char *buf, const char *fmt, ...);
 extern int fprintf(FILE *stream, const char *fmt, ...);
 extern int printf(const char *fmt, ...);
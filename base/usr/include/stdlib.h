@@ -14,6 +14,7 @@ extern void *calloc(size_t nmemb, size_t size);
 extern void *realloc(void *ptr, size_t size);
 
 extern void qsort(void *base, size_t nmemb, size_t size, int (*compar)(const void*,const void*));
+extern void qsort_r(void *base, size_t nmemb, size_t size, int (*compar)(const void*,const void*,void*), void *arg);
 
 extern int system(const char * command);
 
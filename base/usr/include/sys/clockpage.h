@@ -0,0 +1,30 @@
+#pragma once
+
+/*
+ * The clock page
+ *
+ * The kernel maps this read-only into every process, at the same
+ * address, and updates it whenever the timer moves on. Reading it is
+ * a seqlock: wait for an even seq, read, and start over if seq has
+ * changed. The time is then ticks.subticks plus however many
+ * microseconds the TSC says have passed since tsc was taken.
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define CLOCK_PAGE_ADDRESS 0xFFFFE000
+
+struct clock_page {
+	volatile uint32_t seq; /* Odd while the kernel is writing */
+	int32_t  boot_time;    /* Wall clock seconds at ticks == 0 */
+	uint32_t ticks;        /* Seconds since boot */
+	uint32_t subticks;     /* Microseconds into the current second */
+	uint64_t tsc;          /* TSC when ticks and subticks were read */
+	uint32_t tsc_mult;     /* Microseconds per TSC cycle, times 2^32; 0 if not calibrated */
+	uint32_t tsc_limit;    /* Don't extrapolate further than this many cycles */
+};
+
+_End_C_Header
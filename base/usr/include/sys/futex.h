@@ -0,0 +1,15 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define FUTEX_WAIT 0 /* Sleep if *addr still equals val */
+#define FUTEX_WAKE 1 /* Wake up to val sleepers on addr */
+
+#ifndef _KERNEL_
+extern int futex(volatile uint32_t * addr, int op, uint32_t val);
+#endif
+
+_End_C_Header
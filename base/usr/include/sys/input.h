@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Input events, read from /dev/input.
+ *
+ * Every keyboard and pointing device feeds the same queue. A read
+ * returns as many whole events as fit, oldest first, and blocks only
+ * while the queue is empty. Pointer motion is merged in the kernel
+ * while it waits to be read: consecutive moves with the same buttons
+ * arrive as one event with the motion summed (or, for absolute
+ * pointers, the latest position).
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define INPUT_KEY      1 /* code: a scancode byte, as from /dev/kbd */
+#define INPUT_RELATIVE 2 /* x, y: motion since the last event; buttons */
+#define INPUT_ABSOLUTE 3 /* x, y: position on the screen; buttons */
+
+#define INPUT_F_NO_BUTTONS 0x01 /* The device doesn't report buttons; ignore them */
+
+struct input_event {
+	uint32_t sec;      /* Since boot */
+	uint32_t usec;
+	uint8_t  type;     /* INPUT_ */
+	uint8_t  flags;    /* INPUT_F_ */
+	uint16_t code;
+	int32_t  x;
+	int32_t  y;
+	uint32_t buttons;  /* As in mouse_device_packet_t */
+};
+
+_End_C_Header
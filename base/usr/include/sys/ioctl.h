@@ -11,5 +11,54 @@
 #define IOCTLTTYNAME  0x4F01
 #define IOCTLTTYLOGIN 0x4F02
 
+/* Pipe capacity in bytes; SETSZ takes an int * and returns what it got */
+#define IOCTL_PIPE_GETSZ 0x4F10
+#define IOCTL_PIPE_SETSZ 0x4F11
+
+/* Socket receive buffer in bytes, the same way (SO_RCVBUF) */
+#define IOCTL_SOCK_GETRCVBUF 0x4F12
+#define IOCTL_SOCK_SETRCVBUF 0x4F13
+
+/*
+ * bind(), listen(), accept() and connect() on /dev/net/tcp sockets.
+ * BIND and CONNECT take a struct sockaddr_in *, LISTEN an int * backlog
+ * (or NULL), and ACCEPT fills in a struct sockaddr_in * (or NULL) and
+ * returns the new descriptor.
+ */
+#define IOCTL_SOCK_BIND      0x4F14
+#define IOCTL_SOCK_LISTEN    0x4F15
+#define IOCTL_SOCK_ACCEPT    0x4F16
+#define IOCTL_SOCK_CONNECT   0x4F17
+
+/* Batched datagrams; argp is void *[3] of mmsghdr array, count and flags */
+#define IOCTL_SOCK_SENDMMSG  0x4F18
+#define IOCTL_SOCK_RECVMMSG  0x4F19
+
+/*
+ * /dev/prof: START takes an int * rate in samples per second (NULL or
+ * 0 for the default), STOP ends sampling, DROPPED returns how many
+ * samples were lost because nobody read them in time.
+ */
+#define IOCTL_PROF_START     0x4F1A
+#define IOCTL_PROF_STOP      0x4F1B
+#define IOCTL_PROF_DROPPED   0x4F1C
+
+/*
+ * /dev/ktrace: START takes a uint32_t * bitmap of KTRACE_ events (NULL
+ * or 0 for all of them) and clears the trace, STOP ends recording,
+ * CLOCK fills in a struct ktrace_clock.
+ */
+#define IOCTL_KTRACE_START   0x4F1D
+#define IOCTL_KTRACE_STOP    0x4F1E
+#define IOCTL_KTRACE_CLOCK   0x4F1F
+
+/*
+ * Packet exchanges: QUEUED is the bytes waiting to be read. RECV and
+ * SEND take a struct pex_batch (sys/pex.h): RECV waits for a message
+ * and then takes as many as fit, SEND queues every record in it. Both
+ * return the bytes of records they used.
+ */
 #define IOCTL_PACKETFS_QUEUED 0x5050
+#define IOCTL_PACKETFS_RECV   0x5051
+#define IOCTL_PACKETFS_SEND   0x5052
 
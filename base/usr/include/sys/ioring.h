@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+ * Asynchronous I/O rings
+ *
+ * A program lays out a struct ioring and its two arrays in its own
+ * memory and hands it to ioring_setup(), which returns a descriptor.
+ * Requests are queued by filling sqes[sq_tail & (entries - 1)] and
+ * advancing sq_tail; ioring_enter() hands everything queued so far to
+ * a kernel worker, which runs the requests in order while the program
+ * carries on. Each finished request puts a completion in
+ * cqes[cq_tail & (entries - 1)] and advances cq_tail; the program reads
+ * them and advances cq_head, with no system call per request. The
+ * ring descriptor polls readable while completions are waiting.
+ *
+ * The ring, and every buffer of a request, must stay mapped until the
+ * request completes. Close the ring before exec().
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define IORING_MAX_ENTRIES 4096
+
+#define IORING_OP_NOP   0
+#define IORING_OP_READ  1
+#define IORING_OP_WRITE 2
+
+struct ioring_sqe {
+	uint8_t  op;         /* IORING_OP_* */
+	uint8_t  _reserved[3];
+	int32_t  fd;
+	uint64_t offset;     /* Where in the file; ignored by pipes and the like */
+	void *   buf;
+	uint32_t len;
+	uint32_t _reserved2;
+	uint64_t user_data;  /* Handed back in the completion */
+};
+
+struct ioring_cqe {
+	uint64_t user_data;
+	int32_t  res;        /* Bytes transferred, or -errno */
+	uint32_t _reserved;
+};
+
+struct ioring {
+	volatile uint32_t sq_head;  /* Advanced by the kernel as it takes requests */
+	volatile uint32_t sq_tail;  /* Advanced by the program */
+	volatile uint32_t cq_head;  /* Advanced by the program */
+	volatile uint32_t cq_tail;  /* Advanced by the kernel */
+	uint32_t entries;           /* Of both arrays; a power of two */
+	uint32_t _reserved[3];
+	struct ioring_sqe * sqes;
+	struct ioring_cqe * cqes;
+};
+
+#ifndef _KERNEL_
+/*
+ * Start a worker for `ring`; returns a descriptor for it, or -1.
+ */
+extern int ioring_setup(struct ioring * ring);
+
+/*
+ * Hand the worker up to `to_submit` queued requests, then wait until at
+ * least `min_complete` completions are waiting (0 to not wait at all).
+ * Returns the number of requests taken, or -1.
+ *
+ * Never more than `entries` requests are in flight or waiting to be
+ * reaped; requests beyond that stay queued for a later call.
+ */
+extern int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete);
+#endif
+
+_End_C_Header
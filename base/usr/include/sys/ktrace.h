@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Kernel trace records, read from /dev/ktrace.
+ *
+ * Every record is the same size. Timestamps are raw TSC values; the
+ * ioctl IOCTL_KTRACE_CLOCK pairs the TSC with the wall clock so a
+ * reader can turn them into time.
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define KTRACE_SWITCH      0  /* args: previous pid, next pid */
+#define KTRACE_PAGE_FAULT  1  /* args: address, error code, eip */
+#define KTRACE_READ        2  /* args: inode, size, offset (low 32 bits) */
+#define KTRACE_READ_DONE   3  /* args: inode, result */
+#define KTRACE_WRITE       4  /* args: inode, size, offset (low 32 bits) */
+#define KTRACE_WRITE_DONE  5  /* args: inode, result */
+#define KTRACE_SLEEP       6  /* args: wait queue */
+#define KTRACE_WAKEUP      7  /* args: wait queue, processes woken */
+#define KTRACE_IRQ         8  /* args: irq, eip */
+#define KTRACE_SYSCALL     9  /* args: number, first two arguments */
+#define KTRACE_SYSRET      10 /* args: number, result */
+#define KTRACE_EVENTS      11
+
+#define KTRACE_ALL ((1 << KTRACE_EVENTS) - 1)
+
+struct ktrace_record {
+	uint64_t tsc;
+	uint32_t seq;      /* Position in the trace, plus one; set last */
+	int32_t  pid;      /* Running when this was recorded */
+	uint16_t event;
+	uint8_t  cpu;
+	uint8_t  _reserved;
+	uint32_t args[3];
+};
+
+struct ktrace_clock {
+	uint64_t tsc;
+	uint32_t sec;
+	uint32_t usec;
+};
+
+_End_C_Header
@@ -1,3 +1,38 @@
 #pragma once
 
-/* Nothing here, we don't have an mmap implementation yet? */
+#include <_cheader.h>
+
+_Begin_C_Header
+
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_ANON      MAP_ANONYMOUS
+
+#define MAP_FAILED ((void *)-1)
+
+/* SYS_MMAP takes more arguments than fit in registers, so they are passed in a block */
+struct mmap_args {
+	void * addr;
+	unsigned long length;
+	int prot;
+	int flags;
+	int fd;
+	long offset;
+};
+
+#ifndef _KERNEL_
+#include <stddef.h>
+#include <sys/types.h>
+extern void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int munmap(void * addr, size_t length);
+extern int mprotect(void * addr, size_t length, int prot);
+#endif
+
+_End_C_Header
@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+ * Batched packet exchange transfers, with IOCTL_PACKETFS_RECV and
+ * IOCTL_PACKETFS_SEND.
+ *
+ * A batch is records laid end to end, each a struct pex_record and its
+ * data padded out with PEX_RECORD_SIZE. Received records have the
+ * sending client as their source on a server, and 0 on a client. To
+ * send from a server, source is the client to send to, or 0 for all of
+ * them; clients' sources are ignored.
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+struct pex_record {
+	uintptr_t source;
+	uint32_t  size;
+	uint8_t   data[];
+};
+
+#define PEX_RECORD_SIZE(size) \
+	((sizeof(struct pex_record) + (size) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1))
+
+struct pex_batch {
+	void * buffer;
+	uint32_t size;  /* Bytes of records to send, or room to receive into */
+};
+
+_End_C_Header
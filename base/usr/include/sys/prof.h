@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+ * Samples from the kernel profiler, read from /dev/prof.
+ *
+ * Each one records what was running when the timer interrupt came in:
+ * the PID, whether it was in user mode, and the interrupted EIP
+ * followed by as many return addresses as could be found by
+ * following frame pointers. Kernel addresses can be looked up in
+ * /proc/ksyms; user addresses belong to the sampled process.
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define PROF_MAX_FRAMES 8
+#define PROF_DEFAULT_RATE 100  /* Samples per second */
+#define PROF_MAX_RATE 1000     /* The scheduler tick; we can't sample faster */
+
+#define PROF_USER 0x01 /* Interrupted in user mode */
+
+struct prof_sample {
+	int32_t  pid;
+	uint16_t flags;
+	uint16_t frames;  /* Valid entries in chain */
+	uintptr_t chain[PROF_MAX_FRAMES];
+};
+
+_End_C_Header
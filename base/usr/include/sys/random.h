@@ -0,0 +1,15 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+/*
+ * Fill buffer with length bytes from the kernel's random number
+ * generator. flags must be 0. Returns the number of bytes written.
+ */
+extern ssize_t getrandom(void * buffer, size_t length, unsigned int flags);
+
+_End_C_Header
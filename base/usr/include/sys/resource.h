@@ -0,0 +1,40 @@
+#pragma once
+
+#include <_cheader.h>
+
+#ifndef _KERNEL_
+#include <sys/time.h>
+#else
+#include <kernel/types.h>
+#endif
+
+_Begin_C_Header
+
+#define RUSAGE_SELF      0  /* Every thread in the calling process */
+#define RUSAGE_CHILDREN -1  /* Children that have exited and been waited for, and theirs */
+#define RUSAGE_THREAD    1  /* Just the calling thread */
+
+struct rusage {
+	struct timeval ru_utime;  /* Time spent running in userspace */
+	struct timeval ru_stime;  /* Time spent in the kernel on its behalf */
+	long ru_maxrss;           /* Not tracked; always 0 */
+	long ru_ixrss;
+	long ru_idrss;
+	long ru_isrss;
+	long ru_minflt;           /* Page faults served from memory */
+	long ru_majflt;           /* Page faults that had to bring a page back in */
+	long ru_nswap;
+	long ru_inblock;
+	long ru_oublock;
+	long ru_msgsnd;
+	long ru_msgrcv;
+	long ru_nsignals;
+	long ru_nvcsw;            /* Gave up the CPU to wait */
+	long ru_nivcsw;           /* Preempted */
+};
+
+#ifndef _KERNEL_
+extern int getrusage(int who, struct rusage * usage);
+#endif
+
+_End_C_Header
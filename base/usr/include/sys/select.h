@@ -0,0 +1,18 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+_Begin_C_Header
+
+#define NFDBITS (8 * sizeof(fd_mask))
+
+#define FD_SET(fd, set)   ((set)->fds_bits[(fd) / NFDBITS] |= (1UL << ((fd) % NFDBITS)))
+#define FD_CLR(fd, set)   ((set)->fds_bits[(fd) / NFDBITS] &= ~(1UL << ((fd) % NFDBITS)))
+#define FD_ISSET(fd, set) (((set)->fds_bits[(fd) / NFDBITS] & (1UL << ((fd) % NFDBITS))) != 0)
+#define FD_ZERO(set)      do { for (unsigned int __i = 0; __i < sizeof(fd_set) / sizeof(fd_mask); ++__i) (set)->fds_bits[__i] = 0; } while (0)
+
+extern int select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval * timeout);
+
+_End_C_Header
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+/*
+ * Copy up to count bytes from in_fd to out_fd inside the kernel.
+ * If offset is given, read from there and update it instead of
+ * in_fd's own offset.
+ */
+extern ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count);
+
+_End_C_Header
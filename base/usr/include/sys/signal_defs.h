@@ -39,6 +39,7 @@
 #define SIGCAT      36 /* Everybody loves cats */
 
 #define SIGTTOU     37
+#define SIGLOWMEM   38 /* Memory is running short; let go of what you can */
 
-#define NUMSIGNALS  38
+#define NUMSIGNALS  39
 #define NSIG        NUMSIGNALS
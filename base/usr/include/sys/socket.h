@@ -18,6 +18,14 @@ _Begin_C_Header
 #define SOL_SOCKET 0
 
 #define SO_KEEPALIVE 1
+#define SO_RCVBUF    8
+
+#define MSG_TRUNC      0x20
+#define MSG_DONTWAIT   0x40
+#define MSG_WAITALL    0x100
+#define MSG_WAITFORONE 0x10000
+
+#define SOMAXCONN 128
 
 struct hostent {
 	char  *h_name;            /* official name of host */
@@ -73,6 +81,11 @@ struct msghdr {
 	int           msg_flags;      /* flags on received message */
 };
 
+struct mmsghdr {
+	struct msghdr msg_hdr;        /* message */
+	unsigned int  msg_len;        /* bytes sent or received */
+};
+
 
 typedef uint32_t in_addr_t;
 typedef uint16_t in_port_t;
@@ -85,6 +98,12 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags);
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
 
+struct timespec;
+
+/* Many datagrams in one call; these return how many went through */
+extern int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+extern int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+
 extern int socket(int domain, int type, int protocol);
 
 extern uint32_t htonl(uint32_t hostlong);
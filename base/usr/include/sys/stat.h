@@ -79,6 +79,14 @@ struct stat  {
 extern int stat(const char *file, struct stat *st);
 extern int lstat(const char *path, struct stat *st);
 extern int fstat(int fd, struct stat *st);
+
+/*
+ * Relative to an open directory, only single names work, and only ones
+ * the directory can answer for without knowing where it is: not ".."
+ * and nothing with a file system mounted under the same name. Those
+ * fail with EXDEV, and so does following a symlink; use the full path.
+ */
+extern int fstatat(int dirfd, const char *path, struct stat *st, int flags);
 extern int mkdir(const char *pathname, mode_t mode);
 extern mode_t umask(mode_t mask);
 
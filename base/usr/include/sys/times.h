@@ -0,0 +1,20 @@
+#pragma once
+
+#include <_cheader.h>
+#include <time.h>
+
+_Begin_C_Header
+
+/* times() counts in ticks of this many a second */
+#define CLK_TCK 100
+
+struct tms {
+	clock_t tms_utime;
+	clock_t tms_stime;
+	clock_t tms_cutime;  /* Of children that have been waited for */
+	clock_t tms_cstime;
+};
+
+extern clock_t times(struct tms * buf);
+
+_End_C_Header
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+/* The %gs selector for a thread's TLS segment (GDT entry 6, ring 3) */
+#define TLS_SELECTOR 0x33
+
+#ifndef _KERNEL_
+#include <stddef.h>
+
+/*
+ * What %gs points at in a thread. The static TLS blocks of the loaded
+ * objects sit just below it, as the i386 ELF TLS ABI lays them out,
+ * and the first word points back here so the address is in %gs:0.
+ */
+typedef struct tls_tcb {
+	struct tls_tcb * self;
+	int errno_value;
+	void * thread;  /* libc's record of the thread; NULL for the main thread */
+	void * malloc_cache; /* The thread's malloc cache, once it has one */
+} tls_tcb_t;
+
+/* Point this thread's %gs at tcb */
+extern int settls(void * tcb);
+
+/*
+ * The calling thread's control block, or NULL if it doesn't have one
+ * (a static binary's main thread, or anything before ld.so set it up).
+ */
+static inline tls_tcb_t * __tls_tcb(void) {
+	uint16_t sel;
+	__asm__ __volatile__("mov %%gs, %0" : "=r" (sel));
+	if (sel != TLS_SELECTOR) return NULL;
+	tls_tcb_t * tcb;
+	__asm__ __volatile__("movl %%gs:0, %0" : "=r" (tcb));
+	return tcb;
+}
+
+/*
+ * Provided by ld.so: how much room the static TLS blocks need below
+ * a control block, and filling them in from the objects' images.
+ */
+extern size_t __ld_tls_size(void);
+extern void __ld_tls_init(tls_tcb_t * tcb);
+#endif
+
+_End_C_Header
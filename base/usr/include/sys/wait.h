@@ -22,6 +22,12 @@ _Begin_C_Header
 #ifndef _KERNEL_
 extern pid_t wait(int*);
 extern pid_t waitpid(pid_t, int *, int);
+
+/*
+ * A descriptor for fswait() that is ready once pid has exited; it
+ * still has to be collected with waitpid().
+ */
+extern int pidfd_open(pid_t pid);
 #endif
 
 _End_C_Header
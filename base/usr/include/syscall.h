@@ -13,49 +13,70 @@ _Begin_C_Header
 #define DECL_SYSCALL4(fn,p1,p2,p3,p4)    int syscall_##fn(p1,p2,p3,p4)
 #define DECL_SYSCALL5(fn,p1,p2,p3,p4,p5) int syscall_##fn(p1,p2,p3,p4,p5)
 
+/*
+ * Set at startup when the CPU has sysenter. The fast path passes the
+ * stack pointer in %ebp with the return address on top of the stack;
+ * sysexit comes back with %ecx and %edx clobbered, so those are saved
+ * around it. A call pushes the return address so this stays PIC.
+ */
+extern int __libc_sysenter;
+
+#define __SYSCALL_SYSENTER \
+	"push %%ecx; push %%edx; push %%ebp; call 1f; jmp 2f; 1: movl %%esp, %%ebp; sysenter; " \
+	"2: addl $4, %%esp; pop %%ebp; pop %%edx; pop %%ecx"
+
+#define __SYSCALL(res, num, ...) \
+	if (__libc_sysenter) { \
+		__asm__ __volatile__("push %%ebx; movl %2,%%ebx; " __SYSCALL_SYSENTER "; pop %%ebx" \
+				: "=a" (res) : "0" (num), __VA_ARGS__); \
+	} else { \
+		__asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
+				: "=a" (res) : "0" (num), __VA_ARGS__); \
+	}
+
 #define DEFN_SYSCALL0(fn, num) \
 	int syscall_##fn() { \
-		int a; __asm__ __volatile__("int $0x7F" : "=a" (a) : "0" (num)); \
+		int a; \
+		if (__libc_sysenter) { \
+			__asm__ __volatile__(__SYSCALL_SYSENTER : "=a" (a) : "0" (num)); \
+		} else { \
+			__asm__ __volatile__("int $0x7F" : "=a" (a) : "0" (num)); \
+		} \
 		return a; \
 	}
 
 #define DEFN_SYSCALL1(fn, num, P1) \
 	int syscall_##fn(P1 p1) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
-				: "=a" (__res) \
-				: "0" (num), "r" ((int)(p1))); \
+		int __res; \
+		__SYSCALL(__res, num, "r" ((int)(p1))); \
 		return __res; \
 	}
 
 #define DEFN_SYSCALL2(fn, num, P1, P2) \
 	int syscall_##fn(P1 p1, P2 p2) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
-				: "=a" (__res) \
-				: "0" (num), "r" ((int)(p1)), "c"((int)(p2))); \
+		int __res; \
+		__SYSCALL(__res, num, "r" ((int)(p1)), "c"((int)(p2))); \
 		return __res; \
 	}
 
 #define DEFN_SYSCALL3(fn, num, P1, P2, P3) \
 	int syscall_##fn(P1 p1, P2 p2, P3 p3) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
-				: "=a" (__res) \
-				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3))); \
+		int __res; \
+		__SYSCALL(__res, num, "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3))); \
 		return __res; \
 	}
 
 #define DEFN_SYSCALL4(fn, num, P1, P2, P3, P4) \
 	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
-				: "=a" (__res) \
-				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4))); \
+		int __res; \
+		__SYSCALL(__res, num, "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4))); \
 		return __res; \
 	}
 
 #define DEFN_SYSCALL5(fn, num, P1, P2, P3, P4, P5) \
 	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) { \
-		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x7F; pop %%ebx" \
-				: "=a" (__res) \
-				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4)), "D"((int)(p5))); \
+		int __res; \
+		__SYSCALL(__res, num, "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4)), "D"((int)(p5))); \
 		return __res; \
 	}
 
@@ -88,9 +109,13 @@ DECL_SYSCALL1(setuid, unsigned int);
 DECL_SYSCALL1(kernel_string_XXX, char *);
 DECL_SYSCALL0(reboot);
 DECL_SYSCALL3(readdir, int, int, void *);
+DECL_SYSCALL3(getdents, int, void *, int);
+DECL_SYSCALL1(ioring_setup, void *);
+DECL_SYSCALL3(ioring_enter, int, unsigned int, unsigned int);
+DECL_SYSCALL5(spawn, char *, char **, char **, void *, void *);
 DECL_SYSCALL1(chdir, char *);
 DECL_SYSCALL2(getcwd, char *, size_t);
-DECL_SYSCALL3(clone, uintptr_t, uintptr_t, void *);
+DECL_SYSCALL4(clone, uintptr_t, uintptr_t, void *, void *);
 DECL_SYSCALL1(sethostname, char *);
 DECL_SYSCALL1(gethostname, char *);
 DECL_SYSCALL0(mousedevice);
@@ -120,6 +145,13 @@ DECL_SYSCALL3(readlink, char *, char *, int);
 DECL_SYSCALL0(setsid);
 DECL_SYSCALL2(setpgid,int,int);
 DECL_SYSCALL1(getpgid,int);
+DECL_SYSCALL3(setscheduler,int,int,void *);
+DECL_SYSCALL1(getscheduler,int);
+DECL_SYSCALL1(mmap,void *);
+DECL_SYSCALL2(munmap,void *,size_t);
+DECL_SYSCALL3(mprotect,void *,size_t,int);
+DECL_SYSCALL3(futex,volatile uint32_t *,int,uint32_t);
+DECL_SYSCALL3(poll,void *,unsigned int,int);
 DECL_SYSCALL0(geteuid);
 DECL_SYSCALL2(lstat, char *, void *);
 
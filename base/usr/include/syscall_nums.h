@@ -54,3 +54,20 @@
 #define SYS_SETSID 62
 #define SYS_SETPGID 63
 #define SYS_GETPGID 64
+#define SYS_SETSCHEDULER 65
+#define SYS_GETSCHEDULER 66
+#define SYS_MMAP 67
+#define SYS_MUNMAP 68
+#define SYS_MPROTECT 69
+#define SYS_FUTEX 70
+#define SYS_POLL 71
+#define SYS_SENDFILE 72
+#define SYS_GETDENTS 73
+#define SYS_IORING_SETUP 74
+#define SYS_IORING_ENTER 75
+#define SYS_SPAWN 76
+#define SYS_GETRANDOM 77
+#define SYS_FSTATAT 78
+#define SYS_GETRUSAGE 79
+#define SYS_SETTLS 80
+#define SYS_PIDFD_OPEN 81
@@ -35,6 +35,20 @@ extern char * ctime(const time_t * timep);
 typedef int clock_t;
 
 extern clock_t clock(void);
-#define CLOCKS_PER_SEC 1
+
+struct timespec {
+	time_t tv_sec;
+	long   tv_nsec;
+};
+
+extern int nanosleep(const struct timespec * req, struct timespec * rem);
+#define CLOCKS_PER_SEC 1000000
+
+typedef int clockid_t;
+
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1 /* Time since boot */
+
+extern int clock_gettime(clockid_t clk_id, struct timespec * tp);
 
 _End_C_Header
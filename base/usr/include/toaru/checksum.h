@@ -0,0 +1,18 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+/*
+ * Both take the checksum so far and return it with `len` more bytes
+ * of `buf` added, so a stream can be summed a block at a time. Start
+ * a CRC32 at 0 and an Adler-32 at 1; the results are the finished
+ * values (as zlib, gzip and PNG store them) at every step.
+ */
+extern uint32_t checksum_crc32(uint32_t crc, const void * buf, size_t len);
+extern uint32_t checksum_adler32(uint32_t adler, const void * buf, size_t len);
+
+_End_C_Header
@@ -8,12 +8,84 @@
  * version that ToaruOS used to use. Keep feeding it bytes and
  * will eventually set *codep to a codepoint. Should also be able
  * to detect bad UTF-8.
+ *
+ * For whole strings, libc has a stricter codec (libc/wchar/utf8.c)
+ * that works on runs at a time.
  */
-#include <stdint.h>
+#pragma once
+
+#ifdef _KERNEL_
+#	include <kernel/types.h>
+#else
+#	include <stdint.h>
+#	include <stddef.h>
+#endif
 
 #define UTF8_ACCEPT 0
 #define UTF8_REJECT 1
 
+/* Why utf8_decode / utf8_encode_run stopped early */
+#define UTF8_BAD   -1 /* Not valid UTF-8, or not a Unicode scalar value */
+#define UTF8_SHORT -2 /* Input ends partway through a sequence */
+
+/*
+ * Write one codepoint as UTF-8 to out, which needs room for seven
+ * bytes, and NUL terminate it. Returns the length; 0 for NUL.
+ * Inline, as the kernel's terminal emulator uses it too.
+ */
+static inline int utf8_encode(uint32_t codepoint, char * out) {
+	int len;
+	if (codepoint < 0x0080) {
+		out[0] = (char)codepoint;
+		len = codepoint ? 1 : 0;
+	} else if (codepoint < 0x0800) {
+		out[0] = 0xC0 | (codepoint >> 6);
+		out[1] = 0x80 | (codepoint & 0x3F);
+		len = 2;
+	} else if (codepoint < 0x10000) {
+		out[0] = 0xE0 | (codepoint >> 12);
+		out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+		out[2] = 0x80 | (codepoint & 0x3F);
+		len = 3;
+	} else if (codepoint < 0x200000) {
+		out[0] = 0xF0 | (codepoint >> 18);
+		out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+		out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+		out[3] = 0x80 | ((codepoint) & 0x3F);
+		len = 4;
+	} else if (codepoint < 0x4000000) {
+		out[0] = 0xF8 | (codepoint >> 24);
+		out[1] = 0x80 | ((codepoint >> 18) & 0x3F);
+		out[2] = 0x80 | ((codepoint >> 12) & 0x3F);
+		out[3] = 0x80 | ((codepoint >> 6) & 0x3F);
+		out[4] = 0x80 | ((codepoint) & 0x3F);
+		len = 5;
+	} else {
+		out[0] = 0xFC | (codepoint >> 30);
+		out[1] = 0x80 | ((codepoint >> 24) & 0x3F);
+		out[2] = 0x80 | ((codepoint >> 18) & 0x3F);
+		out[3] = 0x80 | ((codepoint >> 12) & 0x3F);
+		out[4] = 0x80 | ((codepoint >> 6) & 0x3F);
+		out[5] = 0x80 | ((codepoint) & 0x3F);
+		len = 6;
+	}
+	out[len] = '\0';
+	return len;
+}
+
+/*
+ * Decode up to outleft codepoints from *in, advancing *in and *inleft
+ * past whatever was consumed. out may be NULL to only count. Returns
+ * the number decoded; *status says whether it stopped on bad input.
+ */
+extern size_t utf8_decode(const char ** in, size_t * inleft, uint32_t * out, size_t outleft, int * status);
+
+/*
+ * The other way: encode *in until it runs out or the next codepoint
+ * won't fit in outleft bytes. Returns the number of bytes written.
+ */
+extern size_t utf8_encode_run(const uint32_t ** in, size_t * inleft, char * out, size_t outleft, int * status);
+
 /**
  * Conceptually similar to its predecessor, this implementation is much
  * less cool, as it uses three separate state tables and more shifts.
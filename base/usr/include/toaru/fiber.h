@@ -0,0 +1,91 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Cooperative fibers
+ *
+ * Lightweight user-space threads with small pooled stacks, for
+ * programs that want to service many file descriptors from a single
+ * thread. Fibers only switch when they block in fiber_wait() (or
+ * anything built on it) or call fiber_yield().
+ *
+ * There is one scheduler per process; use fibers from one thread.
+ */
+
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+#define FIBER_STACK_SIZE 0x8000
+
+typedef struct fiber fiber_t;
+typedef void (*fiber_func_t)(void * arg);
+
+/**
+ * fiber_spawn
+ *
+ * Create a fiber that will run func(arg) once the scheduler reaches
+ * it. Fibers may be spawned before fiber_run() or from other fibers.
+ */
+extern fiber_t * fiber_spawn(fiber_func_t func, void * arg);
+
+/**
+ * fiber_run
+ *
+ * Run fibers until every one of them has returned or called
+ * fiber_exit().
+ */
+extern void fiber_run(void);
+
+/**
+ * fiber_self
+ *
+ * The running fiber, or NULL outside of fiber_run().
+ */
+extern fiber_t * fiber_self(void);
+
+/**
+ * fiber_yield
+ *
+ * Let other runnable fibers go first.
+ */
+extern void fiber_yield(void);
+
+/**
+ * fiber_exit
+ *
+ * End the running fiber.
+ */
+extern void fiber_exit(void) __attribute__((noreturn));
+
+/**
+ * fiber_wait
+ *
+ * Block the running fiber until `fd` has one of the poll() `events`,
+ * or `timeout` milliseconds pass (-1 waits forever). Returns the
+ * poll() revents, or 0 on timeout.
+ */
+extern int fiber_wait(int fd, int events, int timeout);
+
+/**
+ * fiber_sleep
+ *
+ * Block the running fiber for `ms` milliseconds.
+ */
+extern void fiber_sleep(int ms);
+
+/**
+ * fiber_read, fiber_write
+ *
+ * read() and write() that wait in the scheduler rather than
+ * blocking every fiber in the process.
+ */
+extern ssize_t fiber_read(int fd, void * buf, size_t count);
+extern ssize_t fiber_write(int fd, const void * buf, size_t count);
+
+_End_C_Header
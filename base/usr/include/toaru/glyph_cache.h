@@ -0,0 +1,81 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Rendered glyph cache
+ *
+ * Text renderers keep the coverage masks of glyphs they have drawn
+ * here, so drawing the same text again is just blending. The cache
+ * is shared by every renderer in a process and evicts the least
+ * recently used glyphs once it grows past its limits.
+ *
+ * Not thread-safe; renderers serialize their own use of it.
+ */
+
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <toaru/graphics.h>
+#include <toaru/list.h>
+
+_Begin_C_Header
+
+/* Keep renderers' font numbers apart */
+#define GLYPH_SOURCE_SDF      1
+#define GLYPH_SOURCE_FREETYPE 2
+#define GLYPH_FONT(source, font) (((source) << 16) | (font))
+
+typedef struct glyph {
+	/* What was rendered */
+	uint32_t font;
+	uint32_t size;
+	uint32_t codepoint;
+	uint64_t variant;   /* Anything else the rendering depends on (gamma...) */
+
+	/* Where the mask goes relative to the pen, and where the pen goes next */
+	int32_t left;
+	int32_t top;
+	int32_t advance;
+
+	int32_t width;
+	int32_t height;
+	uint8_t * mask;     /* width * height coverage values */
+
+	struct glyph * hash_next;
+	node_t lru;
+} glyph_t;
+
+/**
+ * glyph_cache_get
+ *
+ * The cached glyph for this key, or NULL. Marks it recently used.
+ */
+extern glyph_t * glyph_cache_get(uint32_t font, uint32_t size, uint32_t codepoint, uint64_t variant);
+
+/**
+ * glyph_cache_add
+ *
+ * Make an entry for this key with a zeroed width x height mask for the
+ * caller to fill in. May evict other glyphs, so pointers from earlier
+ * calls should not be held across it.
+ */
+extern glyph_t * glyph_cache_add(uint32_t font, uint32_t size, uint32_t codepoint, uint64_t variant, int32_t width, int32_t height);
+
+/**
+ * glyph_colors
+ *
+ * Fill colors[] for draw_glyph with `color` (not premultiplied) scaled
+ * by each coverage level.
+ */
+extern void glyph_colors(uint32_t colors[256], uint32_t color);
+
+/**
+ * draw_glyph
+ *
+ * Blend a cached glyph with its pen at x,y.
+ */
+extern void draw_glyph(gfx_context_t * ctx, glyph_t * glyph, int32_t x, int32_t y, const uint32_t colors[256]);
+
+_End_C_Header
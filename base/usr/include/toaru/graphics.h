@@ -35,6 +35,15 @@ typedef struct sprite {
 	uint8_t  alpha;
 } sprite_t;
 
+#define GFX_MAX_CLIP_RECTS 32
+
+typedef struct gfx_rect {
+	int32_t x;
+	int32_t y;
+	int32_t w;
+	int32_t h;
+} gfx_rect_t;
+
 typedef struct context {
 	uint16_t width;
 	uint16_t height;
@@ -45,6 +54,10 @@ typedef struct context {
 	char *   clips;
 	int32_t  clips_size;
 	uint32_t stride;
+	/* Clip region; only meaningful while `clips` is set. `clips` marks
+	 * the rows any rectangle touches so whole rows can be skipped. */
+	gfx_rect_t * clip_rects;
+	int32_t  clip_count;
 } gfx_context_t;
 
 extern gfx_context_t * init_graphics_fullscreen();
@@ -72,6 +85,13 @@ extern sprite_t * create_sprite(size_t width, size_t height, int alpha);
 extern void blur_context(gfx_context_t * _dst, gfx_context_t * _src, double amount);
 extern void blur_context_no_vignette(gfx_context_t * _dst, gfx_context_t * _src, double amount);
 extern void blur_context_box(gfx_context_t * _src, int radius);
+extern void blur_context_gaussian(gfx_context_t * _src, int radius, int passes);
+
+/*
+ * Blend an 8-bit coverage mask (eg. a glyph) at x,y. colors[c] is the
+ * premultiplied pixel to blend where the mask is c; colors[0] should be 0.
+ */
+extern void draw_coverage_mask(gfx_context_t * ctx, int32_t x, int32_t y, const uint8_t * mask, int32_t width, int32_t height, const uint32_t colors[256]);
 extern void sprite_free(sprite_t * sprite);
 
 extern void load_sprite(sprite_t * sprite, char * filename);
@@ -93,6 +113,7 @@ extern uint32_t premultiply(uint32_t color);
 extern void gfx_add_clip(gfx_context_t * ctx, int32_t x, int32_t y, int32_t w, int32_t h);
 extern void gfx_clear_clip(gfx_context_t * ctx);
 extern void gfx_no_clip(gfx_context_t * ctx);
+extern int gfx_clip_spans(gfx_context_t * ctx, int32_t y, int32_t left, int32_t right, int32_t spans[][2]);
 
 extern uint32_t getBilinearFilteredPixelColor(sprite_t * tex, double u, double v);
 
@@ -22,7 +22,8 @@ typedef void * (*hashmap_dupe_t) (void *);
 typedef struct hashmap_entry {
 	char * key;
 	void * value;
-	struct hashmap_entry * next;
+	unsigned int hash;
+	unsigned int used;
 } hashmap_entry_t;
 
 typedef struct hashmap {
@@ -31,16 +32,26 @@ typedef struct hashmap {
 	hashmap_dupe_t hash_key_dup;
 	hashmap_free_t hash_key_free;
 	hashmap_free_t hash_val_free;
-	size_t         size;
-	hashmap_entry_t ** entries;
+	size_t         size;   /* Slots; always a power of two */
+	size_t         length; /* Slots in use */
+	hashmap_entry_t * entries;
 } hashmap_t;
 
+typedef struct hashmap_iter {
+	hashmap_t * map;
+	size_t index;
+} hashmap_iter_t;
+
 extern hashmap_t * hashmap_create(int size);
 extern hashmap_t * hashmap_create_int(int size);
 extern void * hashmap_set(hashmap_t * map, void * key, void * value);
 extern void * hashmap_get(hashmap_t * map, void * key);
 extern void * hashmap_remove(hashmap_t * map, void * key);
 extern int hashmap_has(hashmap_t * map, void * key);
+extern int hashmap_lookup(hashmap_t * map, void * key, void ** value);
+extern void ** hashmap_get_or_insert(hashmap_t * map, void * key, int * inserted);
+extern void hashmap_iter_init(hashmap_t * map, hashmap_iter_t * iter);
+extern int hashmap_iter_next(hashmap_iter_t * iter, void ** key, void ** value);
 extern list_t * hashmap_keys(hashmap_t * map);
 extern list_t * hashmap_values(hashmap_t * map);
 extern void hashmap_free(hashmap_t * map);
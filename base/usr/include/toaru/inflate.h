@@ -0,0 +1,35 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+struct inflate_context {
+	/* For the callbacks' use */
+	void * input_priv;
+	void * output_priv;
+
+	/*
+	 * Supply up to `size` bytes of compressed data in `buf`; return
+	 * how many, or 0 at the end of the input.
+	 */
+	size_t (*read_input)(struct inflate_context * ctx, uint8_t * buf, size_t size);
+
+	/*
+	 * Take `size` bytes of decompressed data. Return nonzero to stop
+	 * decompressing early.
+	 */
+	int (*write_output)(struct inflate_context * ctx, const uint8_t * buf, size_t size);
+};
+
+/*
+ * All return 0 on success; nonzero if the data is corrupt or truncated,
+ * or write_output() asked to stop.
+ */
+extern int deflate_decompress(struct inflate_context * ctx); /* Raw deflate stream */
+extern int zlib_decompress(struct inflate_context * ctx);    /* RFC 1950 */
+extern int gzip_decompress(struct inflate_context * ctx);    /* RFC 1952 */
+
+_End_C_Header
@@ -7,4 +7,10 @@ _Begin_C_Header
 
 extern int load_sprite_jpg(sprite_t * sprite, char * filename);
 
+/*
+ * Decode at 1/scale of the full size, for scale 1, 2, 4 or 8; cheaper
+ * than decoding everything and scaling it down afterwards.
+ */
+extern int load_sprite_jpg_scaled(sprite_t * sprite, char * filename, int scale);
+
 _End_C_Header
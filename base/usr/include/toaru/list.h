@@ -29,6 +29,13 @@ typedef struct {
 	size_t length;
 } __attribute__((packed)) list_t;
 
+/*
+ * list_insert* allocate a node for the item (from a slab in the kernel).
+ * list_append* link a node the caller owns instead, usually one embedded
+ * in the item itself with value pointing back at it, so joining and
+ * leaving a list never allocates and removal doesn't need a search.
+ * Embedded nodes must start with next and prev cleared.
+ */
 extern void list_destroy(list_t * list);
 extern void list_free(list_t * list);
 extern void list_append(list_t * list, node_t * item);
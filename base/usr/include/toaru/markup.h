@@ -6,8 +6,8 @@
 _Begin_C_Header
 
 struct markup_tag {
-	char * name;
-	hashmap_t * options;
+	char * name;         /* Interned; see markup_intern */
+	hashmap_t * options; /* NULL if the tag has no attributes */
 };
 
 struct markup_state;
@@ -18,6 +18,8 @@ typedef int (*markup_callback_data)(struct markup_state * self, void * user, cha
 extern struct markup_state * markup_init(void * user, markup_callback_tag_open open, markup_callback_tag_close close, markup_callback_data data);
 extern int markup_free_tag(struct markup_tag * tag);
 extern int markup_parse(struct markup_state * state, char c);
+extern int markup_parse_buffer(struct markup_state * state, const char * buf, size_t len);
+extern char * markup_intern(const char * name);
 extern int markup_finish(struct markup_state * state);
 
 _End_C_Header
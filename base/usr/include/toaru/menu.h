@@ -31,6 +31,9 @@ struct MenuEntry {
 	void (*activate)(struct MenuEntry *, int);
 
 	void (*callback)(struct MenuEntry *);
+
+	sprite_t * _rows[2]; /* Cached renderings: plain and hilighted */
+	int _drawn; /* Which of those is on screen, or -1 */
 };
 
 struct MenuEntry_Normal {
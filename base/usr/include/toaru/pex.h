@@ -3,6 +3,8 @@
 #include <_cheader.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/pex.h>
 
 _Begin_C_Header
 
@@ -27,6 +29,9 @@ extern size_t pex_reply(FILE * sock, size_t size, char * blob);
 extern size_t pex_recv(FILE * sock, char * blob);
 extern size_t pex_query(FILE * sock);
 
+extern ssize_t pex_recv_batch(FILE * sock, void * buffer, size_t size);
+extern ssize_t pex_send_batch(FILE * sock, void * buffer, size_t size);
+
 extern FILE * pex_bind(char * target);
 extern FILE * pex_connect(char * target);
 
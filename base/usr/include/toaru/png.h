@@ -0,0 +1,11 @@
+#pragma once
+
+#include <_cheader.h>
+#include <toaru/graphics.h>
+
+_Begin_C_Header
+
+/* Returns 0 on success; the sprite is premultiplied, as load_sprite() makes them */
+extern int load_sprite_png(sprite_t * sprite, char * filename);
+
+_End_C_Header
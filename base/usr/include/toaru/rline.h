@@ -40,6 +40,7 @@ extern void rline_history_insert(char * str);
 extern void rline_history_append_line(char * str);
 extern char * rline_history_get(int item);
 extern char * rline_history_prev(int item);
+extern void rline_history_file(const char * path);
 
 #define RLINE_HISTORY_ENTRIES 128
 extern char * rline_history[RLINE_HISTORY_ENTRIES];
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+#define SEARCH_IGNORE_CASE 0x01
+
+typedef struct {
+	int flags;
+	size_t count;      /* Number of patterns */
+	char ** patterns;
+	size_t * lengths;
+	size_t shortest;
+	size_t shift[256]; /* Horspool skips, for the shortest pattern length */
+} search_t;
+
+/*
+ * Prepare to look for any of `count` patterns. They are copied, and
+ * may contain any bytes - they are not treated as strings here.
+ */
+extern search_t * search_create(char ** patterns, size_t * lengths, size_t count, int flags);
+extern void search_free(search_t * search);
+
+/*
+ * Find the earliest match of any pattern in `len` bytes of `buf`.
+ * Returns a pointer to it, or NULL; if `which` is given, it gets the
+ * index of the pattern that matched.
+ */
+extern char * search_find(search_t * search, const char * buf, size_t len, size_t * which);
+
+_End_C_Header
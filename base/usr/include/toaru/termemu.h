@@ -6,6 +6,7 @@
 #	include <kernel/types.h>
 #else
 #	include <stdint.h>
+#	include <stddef.h>
 #endif
 
 _Begin_C_Header
@@ -37,6 +38,7 @@ typedef struct {
 	int  (*get_cell_height)(void);
 	void (*set_csr_on)(int);
 	void (*switch_buffer)(int);
+	void (*writer_string)(const char *, size_t); /* Optional: a run of plain output */
 } term_callbacks_t;
 
 typedef struct {
@@ -111,6 +113,7 @@ typedef struct {
 
 extern term_state_t * ansi_init(term_state_t * s, int w, int y, term_callbacks_t * callbacks_in);
 extern void ansi_put(term_state_t * s, char c);
+extern void ansi_put_string(term_state_t * s, const char * str, size_t len);
 
 _End_C_Header
 
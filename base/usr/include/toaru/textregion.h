@@ -59,8 +59,18 @@ struct TR_TextRegion {
 	bool break_all; /* False by default */
 	char * title; /* blank by default */
 	int max_lines; /* 0 is None */
+
+	list_t * paragraphs; /* Laid out text, one per line of `text` */
 };
 
+#define TR_ALIGN_LEFT   0
+#define TR_ALIGN_CENTER 1
+#define TR_ALIGN_RIGHT  2
+
+#define TR_VALIGN_TOP    0
+#define TR_VALIGN_MIDDLE 1
+#define TR_VALIGN_BOTTOM 2
+
 struct TR_Offset {
 	struct TR_TextUnit * unit;
 	int line;
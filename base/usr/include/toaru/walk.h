@@ -0,0 +1,37 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+_Begin_C_Header
+
+/*
+ * One file in a walked tree. Children are in the order the directory
+ * listed them, without "." and "..".
+ */
+typedef struct walk_node {
+	struct walk_node * parent;
+	struct walk_node ** children;
+	size_t child_count;
+	struct stat st;       /* As lstat() gives it */
+	int error;            /* errno if it couldn't be looked at or listed */
+	uint64_t total;       /* Sizes of everything under here that isn't a directory */
+	char name[];          /* The path as given, for the root */
+} walk_node_t;
+
+/*
+ * Read a whole tree into memory. Directories are read by `threads`
+ * threads at once (0 picks a default), and symlinks are not followed.
+ * Returns NULL only if memory runs out; a root that can't be looked
+ * at comes back with `error` set.
+ */
+extern walk_node_t * walk_tree(const char * path, int threads);
+
+/* Full path of a node, as a fresh string */
+extern char * walk_path(walk_node_t * node);
+
+extern void walk_free(walk_node_t * node);
+
+_End_C_Header
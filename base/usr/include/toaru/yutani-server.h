@@ -84,12 +84,17 @@ struct {
 	int nested;
 	int nest_width;
 	int nest_height;
+	int render_threads;
 } yutani_options = {
 	.nested = 0,
 	.nest_width = 640,
 	.nest_height = 480,
+	.render_threads = 1,
 };
 
+/* Most threads the compositor will compose a frame with */
+#define YUTANI_MAX_RENDER_THREADS 16
+
 /*
  * Server window definitions
  */
@@ -114,6 +119,18 @@ typedef struct YutaniServerWindow {
 	uint32_t newbufid;
 	uint8_t * newbuffer;
 
+	/*
+	 * Buffers can be bigger than the window needs. After a resize the
+	 * old one is kept as the spare and handed back on the next resize if
+	 * it is big enough, so an interactive resize flips between two
+	 * buffers instead of making a new one for every step.
+	 */
+	size_t buffer_size;
+	size_t newbuffer_size;
+	uint32_t sparebufid;
+	uint8_t * sparebuffer;
+	size_t sparebuffer_size;
+
 	/* Connection that owns this window */
 	uint32_t owner;
 
@@ -154,8 +171,23 @@ typedef struct YutaniServerWindow {
 
 	/* Window opacity */
 	int opacity;
+
+	/* Part of the window the client says is fully opaque, or w = 0 */
+	gfx_rect_t opaque_region;
+
+	/* Damage ring shared with the client */
+	yutani_damage_ring_t * damage;
+
+	/* Whatever a renderer extension keeps for this window */
+	void * renderer_data;
 } yutani_server_window_t;
 
+/* A client's event ring, named after the window it came with */
+typedef struct {
+	yutani_wid_t wid;
+	yutani_event_ring_t * ring;
+} yutani_client_events_t;
+
 typedef struct YutaniGlobals {
 	/* Display resolution */
 	unsigned int width;
@@ -275,6 +307,20 @@ typedef struct YutaniGlobals {
 	/* Map of clients to their windows */
 	hashmap_t * clients_to_windows;
 
+	/* Map of clients to their event rings (yutani_client_events_t) */
+	hashmap_t * clients_to_events;
+
+	/* Hit-testing grid: the windows over each cell, top to bottom */
+	volatile int hit_lock;
+	int hit_dirty;
+	int hit_cols;
+	int hit_rows;
+	int * hit_start;
+	int * hit_fill;
+	yutani_server_window_t ** hit_windows;
+	int hit_cells;
+	int hit_entries;
+
 	/* Toggles for debugging window locations */
 	int debug_bounds;
 	int debug_shapes;
@@ -294,7 +340,24 @@ typedef struct YutaniGlobals {
 
 	/* VirtualBox Seamless mode support information */
 	int vbox_rects;
-	int vbox_pointer;
+
+	/* Framebuffer device, for the hardware cursor and screen updates */
+	int display_fd;
+	int display_updates;        /* Device wants to hear about damage; -1 if it refused */
+
+	/* Drawing straight into video memory pages; -1 if the device can't flip */
+	int display_pages;
+	int back_page;
+	gfx_rect_t page_damage[GFX_MAX_CLIP_RECTS]; /* Drawn last frame, so the back page missed it */
+	int page_damage_count;
+
+	/* Hardware cursor */
+	int hw_cursor_unavailable;
+	int hw_cursor;              /* The hardware is showing the cursor */
+	sprite_t * hw_cursor_sprite;
+	int hw_cursor_x;
+	int hw_cursor_y;
+	int hw_cursor_visible;
 
 	/* Renderer plugin context */
 	void * renderer_ctx;
@@ -24,9 +24,15 @@ _Begin_C_Header
 
 typedef unsigned int yutani_wid_t;
 
+struct yutani_damage_ring;
+struct yutani_event_ring;
+
 /*
  * Server connection context.
  */
+#define YUTANI_ARENA_SLOTS     32
+#define YUTANI_ARENA_SLOT_SIZE 128
+
 typedef struct yutani_context {
 	FILE * sock;
 
@@ -37,11 +43,26 @@ typedef struct yutani_context {
 	/* Hash of window IDs to window objects */
 	hashmap_t * windows;
 
-	/* queued events */
+	/* messages put aside while waiting for a reply; see yutani_wait_for */
 	list_t * queued;
+	uint32_t arena_head;
+	uint32_t arena_tail;
+	char (*arena)[YUTANI_ARENA_SLOT_SIZE];
+	struct yutani_message * recv;
+
+	/* message types with handlers (struct yutani_handler) */
+	hashmap_t * handlers;
 
 	/* server identifier string */
 	char * server_ident;
+
+	/* shared event ring, once we have a window; see yutani_event_ring_t */
+	struct yutani_event_ring * events;
+
+	/* messages held back between yutani_batch_begin and yutani_batch_end */
+	int batching;
+	size_t batch_used;
+	char * batch;
 } yutani_t;
 
 typedef struct yutani_window {
@@ -79,6 +100,17 @@ typedef struct yutani_window {
 
 	/* Server context that owns this window */
 	yutani_t * ctx;
+
+	/* Shared damage ring; see yutani_damage_ring_t */
+	struct yutani_damage_ring * damage;
+
+	/*
+	 * The buffer before the last resize, which the server may hand back
+	 * on the next, and the one being replaced by a resize in progress.
+	 */
+	uint32_t sparebufid;
+	char * sparebuffer;
+	char * oldbuffer;
 } yutani_window_t;
 
 typedef struct yutani_message {
@@ -88,6 +120,14 @@ typedef struct yutani_message {
 	char data[];
 } yutani_msg_t;
 
+/* See yutani_set_handler */
+typedef void (*yutani_handler_t)(yutani_t * y, yutani_msg_t * msg, void * data);
+
+struct yutani_handler {
+	yutani_handler_t func;
+	void * data;
+};
+
 struct yutani_msg_welcome {
 	uint32_t display_width;
 	uint32_t display_height;
@@ -166,6 +206,11 @@ struct yutani_msg_flip_region {
 	int32_t height;
 };
 
+struct yutani_msg_window_frame {
+	yutani_wid_t wid;
+	uint32_t time;
+};
+
 struct yutani_msg_window_resize {
 	yutani_wid_t wid;
 	uint32_t width;
@@ -201,6 +246,14 @@ struct yutani_msg_window_update_shape {
 	int set_shape;
 };
 
+struct yutani_msg_window_opaque_region {
+	yutani_wid_t wid;
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
 struct yutani_msg_window_warp_mouse {
 	yutani_wid_t wid;
 	int32_t x;
@@ -285,9 +338,12 @@ struct yutani_msg_clipboard {
 #define YUTANI_MSG_KEY_BIND            0x00000040
 
 #define YUTANI_MSG_WINDOW_UPDATE_SHAPE 0x00000050
+#define YUTANI_MSG_WINDOW_OPAQUE_REGION 0x00000051
 
 #define YUTANI_MSG_CLIPBOARD           0x00000060
 
+#define YUTANI_MSG_WINDOW_FRAME        0x00000070
+
 #define YUTANI_MSG_GOODBYE             0x000000F0
 
 /* Special request (eg. one-off single-shot requests like "please maximize me" */
@@ -296,6 +352,7 @@ struct yutani_msg_clipboard {
 /* Server responses */
 #define YUTANI_MSG_WELCOME             0x00010001
 #define YUTANI_MSG_WINDOW_INIT         0x00010002
+#define YUTANI_MSG_EVENT_RING          0x00010003 /* Something's in the event ring; no data */
 
 /*
  * YUTANI_ZORDER
@@ -460,6 +517,9 @@ struct yutani_msg_clipboard {
 #define YUTANI_WINDOW_FLAG_DISALLOW_RESIZE  (1 << 2)
 #define YUTANI_WINDOW_FLAG_ALT_ANIMATION    (1 << 3)
 #define YUTANI_WINDOW_FLAG_DIALOG_ANIMATION (1 << 4)
+/* Every pixel of the window will always be fully opaque, so the
+ * compositor need not draw anything it covers. */
+#define YUTANI_WINDOW_FLAG_OPAQUE           (1 << 5)
 
 /* YUTANI_SPECIAL_REQUEST
  *
@@ -492,14 +552,102 @@ typedef struct {
 	unsigned int height;
 } yutani_damage_rect_t;
 
+/*
+ * Damage ring
+ *
+ * Each window shares one of these with the server. Flips append the
+ * damaged rectangle at `head` instead of sending a message, and the
+ * server takes everything up to `head` once per frame. If the ring
+ * fills up first, the client sets `overflow` and the whole window is
+ * redrawn. Setting `frame_requested` asks for a YUTANI_MSG_WINDOW_FRAME
+ * once the next frame is on screen.
+ *
+ * An entry with a nonzero `dy` says the rectangle's contents were moved
+ * down `dy` rows (up, if negative), and the server may move what it has
+ * on screen the same way instead of drawing it all again. The server
+ * bumps `drawn` before and after each time it draws the window; if it
+ * isn't what the client saw before moving anything, the move raced a
+ * redraw and the rectangle is just treated as damaged.
+ */
+#define YUTANI_DAMAGE_RING_SIZE 32
+
+typedef struct yutani_damage_entry {
+	yutani_damage_rect_t rect;
+	int32_t dy;
+	uint32_t drawn;
+} yutani_damage_entry_t;
+
+typedef struct yutani_damage_ring {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t overflow;
+	volatile uint32_t frame_requested;
+	volatile uint32_t drawn;
+	yutani_damage_entry_t entries[YUTANI_DAMAGE_RING_SIZE];
+} yutani_damage_ring_t;
+
+/*
+ * Event ring
+ *
+ * Each client shares one of these with the server, made along with its
+ * first window and named after it. Once the client sets `ready`, the
+ * server writes key, mouse, focus and resize offer events into it at
+ * `head` instead of sending them. A client about to wait for something
+ * sets `bell` first; the server clears it with the next event it adds
+ * and sends a YUTANI_MSG_EVENT_RING, so waiting on the socket still
+ * wakes up for events. Events the ring has no room for are sent as
+ * messages.
+ */
+#define YUTANI_EVENT_RING_SIZE 64
+#define YUTANI_EVENT_SIZE      128 /* Largest event that goes in the ring */
+
+typedef struct yutani_event_ring {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t ready;
+	volatile uint32_t bell;
+	char events[YUTANI_EVENT_RING_SIZE][YUTANI_EVENT_SIZE];
+} yutani_event_ring_t;
+
+/*
+ * Frame statistics
+ *
+ * The server keeps timings for the last YUTANI_STATS_FRAMES frames it
+ * drew in one shared page. `count` is how many frames it has drawn;
+ * frame n is at frames[n % YUTANI_STATS_FRAMES], and is only counted
+ * once it is complete. All times are in microseconds.
+ */
+#define YUTANI_STATS_FRAMES 128
+
+typedef struct yutani_frame_stats {
+	uint64_t start;    /* Wall clock time the frame started */
+	uint32_t total;
+	uint32_t damage;   /* Collecting damage from clients */
+	uint32_t blit;     /* Compositing windows */
+	uint32_t flip;     /* Cursor, and getting the frame on screen */
+	uint32_t renderer; /* Renderer state hooks, outside of blit and flip */
+	uint32_t windows;  /* Windows drawn */
+	uint32_t area;     /* Pixels damaged, overlaps counted twice */
+} yutani_frame_stats_t;
+
+typedef struct yutani_stats {
+	volatile uint32_t count;
+	yutani_frame_stats_t frames[YUTANI_STATS_FRAMES];
+} yutani_stats_t;
+
 extern yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type);
 extern yutani_msg_t * yutani_poll(yutani_t * y);
 extern yutani_msg_t * yutani_poll_async(yutani_t * y);
 extern size_t yutani_query(yutani_t * y);
 
 extern int yutani_msg_send(yutani_t * y, yutani_msg_t * msg);
+extern void yutani_set_handler(yutani_t * y, uint32_t type, yutani_handler_t func, void * data);
+extern int yutani_msg_send_batch(yutani_t * y, yutani_msg_t ** msgs, int count);
+extern void yutani_batch_begin(yutani_t * y);
+extern int yutani_batch_end(yutani_t * y);
 extern yutani_t * yutani_context_create(FILE * socket);
 extern yutani_t * yutani_init(void);
+extern yutani_stats_t * yutani_stats(yutani_t * y);
 extern yutani_window_t * yutani_window_create(yutani_t * y, int width, int height);
 extern yutani_window_t * yutani_window_create_flags(yutani_t * y, int width, int height, uint32_t flags);
 extern void yutani_flip(yutani_t * y, yutani_window_t * win);
@@ -507,6 +655,7 @@ extern void yutani_window_move(yutani_t * yctx, yutani_window_t * window, int x,
 extern void yutani_close(yutani_t * y, yutani_window_t * win);
 extern void yutani_set_stack(yutani_t *, yutani_window_t *, int);
 extern void yutani_flip_region(yutani_t *, yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height);
+extern void yutani_window_scroll(yutani_t * yctx, yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height, int32_t dy);
 extern void yutani_window_resize(yutani_t * yctx, yutani_window_t * window, uint32_t width, uint32_t height);
 extern void yutani_window_resize_offer(yutani_t * yctx, yutani_window_t * window, uint32_t width, uint32_t height);
 extern void yutani_window_resize_accept(yutani_t * yctx, yutani_window_t * window, uint32_t width, uint32_t height);
@@ -522,12 +671,14 @@ extern void yutani_key_bind(yutani_t * yctx, kbd_key_t key, kbd_mod_t mod, int r
 extern void yutani_window_drag_start(yutani_t * yctx, yutani_window_t * window);
 extern void yutani_window_drag_start_wid(yutani_t * yctx, yutani_wid_t wid);
 extern void yutani_window_update_shape(yutani_t * yctx, yutani_window_t * window, int set_shape);
+extern void yutani_window_set_opaque(yutani_t * yctx, yutani_window_t * window, int32_t x, int32_t y, int32_t width, int32_t height);
 extern void yutani_window_warp_mouse(yutani_t * yctx, yutani_window_t * window, int32_t x, int32_t y);
 extern void yutani_window_show_mouse(yutani_t * yctx, yutani_window_t * window, int32_t show_mouse);
 extern void yutani_window_resize_start(yutani_t * yctx, yutani_window_t * window, yutani_scale_direction_t direction);
 extern void yutani_special_request(yutani_t * yctx, yutani_window_t * window, uint32_t request);
 extern void yutani_special_request_wid(yutani_t * yctx, yutani_wid_t wid, uint32_t request);
 extern void yutani_set_clipboard(yutani_t * yctx, char * content);
+extern int yutani_window_request_frame(yutani_t * yctx, yutani_window_t * window);
 extern FILE * yutani_open_clipboard(yutani_t * yctx);
 
 extern gfx_context_t * init_graphics_yutani(yutani_window_t * window);
@@ -5,6 +5,7 @@
 
 _Begin_C_Header
 extern int wcwidth(wchar_t c);
+extern int wcswidth(const wchar_t * s, size_t n);
 extern wchar_t * wcsncpy(wchar_t * dest, const wchar_t * src, size_t n);
 extern size_t wcslen(const wchar_t * s);
 extern int wcscmp(const wchar_t *s1, const wchar_t *s2);
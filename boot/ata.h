@@ -146,8 +146,16 @@ struct ata_device {
 	ata_identify_t identity;
 	unsigned int atapi_lba;
 	unsigned int atapi_sector_size;
+	unsigned int bmr; /* Bus master registers for this channel, or 0 for PIO */
 };
 
+/* Bus master DMA physical region descriptor */
+typedef struct {
+	uint32_t offset;
+	uint16_t bytes; /* 0 means 64KiB */
+	uint16_t last;
+} __attribute__((packed)) prdt_t;
+
 typedef union {
 	uint8_t command_bytes[12];
 	uint16_t command_words[6];
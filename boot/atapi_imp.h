@@ -156,10 +156,153 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sectors_atapi(struct ata_device * dev, uint32_t lba, uint8_t * buf, int sectors) {
+/* READ (10) for `sectors` sectors at `lba` */
+static void atapi_read_command(atapi_command_t * command, uint32_t lba, int sectors) {
+	command->command_bytes[0] = 0x28;
+	command->command_bytes[1] = 0;
+	command->command_bytes[2] = (lba >> 0x18) & 0xFF;
+	command->command_bytes[3] = (lba >> 0x10) & 0xFF;
+	command->command_bytes[4] = (lba >> 0x08) & 0xFF;
+	command->command_bytes[5] = (lba >> 0x00) & 0xFF;
+	command->command_bytes[6] = sectors >> 16;
+	command->command_bytes[7] = sectors >> 8;
+	command->command_bytes[8] = sectors; /* bit 0 = PMI (0, last sector) */
+	command->command_bytes[9] = 0; /* control */
+	command->command_bytes[10] = 0;
+	command->command_bytes[11] = 0;
+}
 
-	if (!dev->is_atapi) return;
+static uint32_t pci_config_read(int bus, int slot, int func, int field) {
+	outportl(0xCF8, 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (field & 0xFC));
+	return inportl(0xCFC);
+}
+
+static void pci_config_write(int bus, int slot, int func, int field, uint32_t value) {
+	outportl(0xCF8, 0x80000000 | (bus << 16) | (slot << 11) | (func << 8) | (field & 0xFC));
+	outportl(0xCFC, value);
+}
 
+/*
+ * Find the IDE controller, let it master the bus, and hand its bus
+ * master registers to the ATAPI drives that can do DMA. Channels in
+ * native mode aren't at the legacy ports we talk to, so those stay PIO.
+ */
+static void ata_find_busmaster(void) {
+	for (int bus = 0; bus < 256; ++bus) {
+		for (int slot = 0; slot < 32; ++slot) {
+			int functions = 1;
+			for (int func = 0; func < functions; ++func) {
+				uint32_t id = pci_config_read(bus, slot, func, 0x00);
+				if ((id & 0xFFFF) == 0xFFFF) continue;
+				if (!func && (pci_config_read(bus, slot, func, 0x0C) & 0x800000)) functions = 8;
+
+				uint32_t class = pci_config_read(bus, slot, func, 0x08);
+				if ((class >> 16) != 0x0101 || !(class & 0x8000)) continue;
+
+				uint32_t bar4 = pci_config_read(bus, slot, func, 0x20);
+				if (!(bar4 & 1)) continue;
+
+				uint32_t command = pci_config_read(bus, slot, func, 0x04);
+				pci_config_write(bus, slot, func, 0x04, (command & 0xFFFF) | 0x05);
+
+				struct ata_device * devices[] = {&ata_primary_master, &ata_primary_slave, &ata_secondary_master, &ata_secondary_slave};
+				for (int i = 0; i < 4; ++i) {
+					struct ata_device * dev = devices[i];
+					int secondary = dev->io_base == 0x170;
+					if (class & (secondary ? 0x400 : 0x100)) continue;
+					if (!dev->is_atapi || !(dev->identity.capabilities[0] & 0x100)) continue;
+					dev->bmr = (bar4 & 0xFFFC) + (secondary ? 8 : 0);
+				}
+				return;
+			}
+		}
+	}
+}
+
+/* Well clear of the loader and the scratch buffers in iso9660.h */
+#define ATAPI_PRDT_COUNT 64
+static prdt_t * atapi_prdt = (prdt_t *)0x22000;
+
+/*
+ * Read straight into `buf` with bus master DMA. The loader runs with
+ * interrupts off and no paging, so the table points at the destination
+ * itself, and we poll for the interrupt the drive raises when it's done.
+ * Returns non-zero if the caller should fall back to PIO.
+ */
+static int ata_device_read_sectors_atapi_dma(struct ata_device * dev, uint32_t lba, uint8_t * buf, int sectors) {
+	uint16_t bus = dev->io_base;
+	uint32_t addr = (uintptr_t)buf;
+	uint32_t left = sectors * dev->atapi_sector_size;
+	int entries = 0;
+
+	/* No region may cross a 64KiB boundary */
+	while (left) {
+		if (entries == ATAPI_PRDT_COUNT) return 1;
+		uint32_t chunk = 0x10000 - (addr & 0xFFFF);
+		if (chunk > left) chunk = left;
+		atapi_prdt[entries].offset = addr;
+		atapi_prdt[entries].bytes = chunk & 0xFFFF;
+		atapi_prdt[entries].last = 0;
+		addr += chunk;
+		left -= chunk;
+		entries++;
+	}
+	if (!entries) return 0;
+	atapi_prdt[entries-1].last = 0x8000;
+
+	/* Stop, set the table, clear error and interrupt, set read */
+	outportb(dev->bmr, 0x00);
+	outportl(dev->bmr + 0x04, (uintptr_t)atapi_prdt);
+	outportb(dev->bmr + 0x02, inportb(dev->bmr + 0x02) | 0x04 | 0x02);
+	outportb(dev->bmr, 0x08);
+
+	outportb(bus + ATA_REG_HDDEVSEL, 0xA0 | dev->slave << 4);
+	ata_io_wait(dev);
+
+	outportb(bus + ATA_REG_FEATURES, 0x01); /* DMA */
+	outportb(bus + ATA_REG_LBA1, 0x00);
+	outportb(bus + ATA_REG_LBA2, 0x00);
+	outportb(bus + ATA_REG_COMMAND, ATA_CMD_PACKET);
+
+	while (1) {
+		uint8_t status = inportb(bus + ATA_REG_STATUS);
+		if ((status & ATA_SR_ERR)) goto dma_error;
+		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ)) break;
+	}
+
+	atapi_command_t command;
+	atapi_read_command(&command, lba, sectors);
+	for (int i = 0; i < 6; ++i) {
+		outports(bus, command.command_words[i]);
+	}
+
+	/* Start */
+	outportb(dev->bmr, 0x08 | 0x01);
+
+	for (int timeout = 0; ; ++timeout) {
+		uint8_t status = inportb(dev->bmr + 0x02);
+		if (status & 0x02) goto dma_error;
+		if (status & 0x04) break;
+		if (timeout == 10000000) goto dma_error;
+	}
+
+	while (1) {
+		uint8_t status = inportb(bus + ATA_REG_STATUS);
+		if ((status & ATA_SR_ERR)) goto dma_error;
+		if (!(status & ATA_SR_BSY)) break;
+	}
+
+	outportb(dev->bmr, 0x00);
+	outportb(dev->bmr + 0x02, inportb(dev->bmr + 0x02) | 0x04 | 0x02);
+	return 0;
+
+dma_error:
+	outportb(dev->bmr, 0x00);
+	outportb(dev->bmr + 0x02, inportb(dev->bmr + 0x02) | 0x04 | 0x02);
+	return 1;
+}
+
+static void ata_device_read_sectors_atapi_pio(struct ata_device * dev, uint32_t lba, uint8_t * buf, int sectors) {
 
 	uint16_t bus = dev->io_base;
 
@@ -180,18 +323,7 @@ _try_again:
 	}
 
 	atapi_command_t command;
-	command.command_bytes[0] = 0x28;
-	command.command_bytes[1] = 0;
-	command.command_bytes[2] = (lba >> 0x18) & 0xFF;
-	command.command_bytes[3] = (lba >> 0x10) & 0xFF;
-	command.command_bytes[4] = (lba >> 0x08) & 0xFF;
-	command.command_bytes[5] = (lba >> 0x00) & 0xFF;
-	command.command_bytes[6] = sectors >> 16;
-	command.command_bytes[7] = sectors >> 8;
-	command.command_bytes[8] = sectors; /* bit 0 = PMI (0, last sector) */
-	command.command_bytes[9] = 0; /* control */
-	command.command_bytes[10] = 0;
-	command.command_bytes[11] = 0;
+	atapi_read_command(&command, lba, sectors);
 
 	for (int i = 0; i < 6; ++i) {
 		outports(bus, command.command_words[i]);
@@ -227,5 +359,18 @@ atapi_error_on_read_setup_cmd:
 	return;
 }
 
+static void ata_device_read_sectors_atapi(struct ata_device * dev, uint32_t lba, uint8_t * buf, int sectors) {
+
+	if (!dev->is_atapi) return;
+
+	if (dev->bmr) {
+		if (!ata_device_read_sectors_atapi_dma(dev, lba, buf, sectors)) return;
+		print("DMA read failed, falling back to PIO\n");
+		dev->bmr = 0;
+	}
+
+	ata_device_read_sectors_atapi_pio(dev, lba, buf, sectors);
+}
+
 
 #define ata_device_read_sector_atapi(a,b,c) ata_device_read_sectors_atapi(a,b,c,1)
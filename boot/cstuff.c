@@ -85,6 +85,16 @@ static char * modules[] = {
 	"PCSPKR.KO",   // 22
 	"PORTIO.KO",   // 23
 	"TARFS.KO",    // 24
+	"OVERLAY.KO",  // 25
+	"AHCI.KO",     // 26
+	"VIRTIO.KO",   // 27
+	"VIRTBLK.KO",  // 28
+	"VIRTNET.KO",  // 29
+	"USB.KO",      // 30
+	"XHCI.KO",     // 31
+	"USBHID.KO",   // 32
+	"USBMSD.KO",   // 33
+	"HDA.KO",      // 34
 	0
 };
 
@@ -125,8 +135,8 @@ int kmain() {
 			"ATAPI or use DMA. May be necessary in some virtual machines.");
 
 	BOOT_OPTION(_normal_ata,  1, "DMA ATA driver",
-			"Enable the normal, DMA-capable ATA driver. This is the default.",
-			NULL);
+			"Enable the normal, DMA-capable ATA driver and the",
+			"AHCI and virtio disk drivers. This is the default.");
 
 	BOOT_OPTION(_debug_shell, 1, "Debug shell",
 			"Enable the kernel debug shell. This can be accessed using",
@@ -260,6 +270,9 @@ int kmain() {
 	/* Configure modules */
 	if (!_normal_ata) {
 		modules[6] = "NONE";
+		modules[26] = "NONE";
+		modules[28] = "NONE";
+		modules[33] = "NONE";
 	}
 
 	if (_legacy_ata) {
@@ -289,6 +302,7 @@ int kmain() {
 	if (!_sound) {
 		modules[16] = "NONE";
 		modules[17] = "NONE";
+		modules[34] = "NONE";
 	}
 
 	if (!_net) {
@@ -296,6 +310,11 @@ int kmain() {
 		modules[19] = "NONE";
 		modules[20] = "NONE";
 		modules[21] = "NONE";
+		modules[29] = "NONE";
+	}
+
+	if (!_normal_ata && !_net) {
+		modules[27] = "NONE";
 	}
 
 	boot();
@@ -123,9 +123,7 @@ static int navigate(char * name) {
 	//print("reading from sector ");
 	//print_hex(dir_entry->extent_start_LSB);
 	//print("\n");
-	ata_device_read_sector_atapi(device, dir_entry->extent_start_LSB, dir_entries);
-	ata_device_read_sector_atapi(device, dir_entry->extent_start_LSB+1, dir_entries + 2048);
-	ata_device_read_sector_atapi(device, dir_entry->extent_start_LSB+2, dir_entries + 4096);
+	ata_device_read_sectors_atapi(device, dir_entry->extent_start_LSB, dir_entries, 3);
 
 	long offset = 0;
 	while (1) {
@@ -60,12 +60,65 @@ static int strlen(char * s) {
 	return out;
 }
 
+/*
+ * Boot stage log. Each stage is stamped with the TSC when it starts,
+ * and the lot is passed to the kernel on its command line as
+ * boottime=stage@cycles,... in hex; the kernel carries on stamping
+ * with the same counter and shows the whole thing in /proc/boottime.
+ */
+#define BOOT_STAGES 16
+static struct {
+	char * name;
+	uint64_t tsc;
+} boot_stages[BOOT_STAGES];
+static int boot_stage_count = 0;
+
+static void boot_stage(char * name) {
+	if (boot_stage_count == BOOT_STAGES) return;
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	boot_stages[boot_stage_count].name = name;
+	boot_stages[boot_stage_count].tsc = ((uint64_t)hi << 32) | lo;
+	boot_stage_count++;
+}
+
+static char * boot_stage_put(char * out, char * end, char c) {
+	if (out < end) *out++ = c;
+	return out;
+}
+
+static void boot_stage_cmdline(void) {
+	char * out = cmdline + strlen(cmdline);
+	char * end = cmdline + sizeof(cmdline) - 1;
+
+	if (out > cmdline && out[-1] != ' ') out = boot_stage_put(out, end, ' ');
+	for (char * c = "boottime="; *c; ++c) out = boot_stage_put(out, end, *c);
+
+	for (int i = 0; i < boot_stage_count; ++i) {
+		if (i) out = boot_stage_put(out, end, ',');
+		for (char * c = boot_stages[i].name; *c; ++c) out = boot_stage_put(out, end, *c);
+		out = boot_stage_put(out, end, '@');
+		int started = 0;
+		for (int shift = 60; shift >= 0; shift -= 4) {
+			int digit = (boot_stages[i].tsc >> shift) & 0xF;
+			if (!digit && !started && shift) continue;
+			started = 1;
+			out = boot_stage_put(out, end, "0123456789abcdef"[digit]);
+		}
+	}
+
+	*out = '\0';
+}
+
 #ifdef EFI_PLATFORM
 static EFI_GUID efi_graphics_output_protocol_guid =
   {0x9042a9de,0x23dc,0x4a38,  {0x96,0xfb,0x7a,0xde,0xd0,0x80,0x51,0x6a}};
 #endif
 
 static void move_kernel(void) {
+	boot_stage("relocate");
+	boot_stage_cmdline();
+
 	clear();
 	print("Relocating kernel...\n");
 
@@ -418,6 +471,27 @@ done_video:
 #endif
 
 #ifndef EFI_PLATFORM
+/*
+ * Read all of the file in dir_entry to dest in commands of up to
+ * SECTORS sectors; with DMA each is one transfer straight into place.
+ * Returns how many bytes went in, in whole sectors.
+ */
+#define SECTORS 512
+static long read_extent(uint8_t * dest, int progress) {
+	uint32_t lba = dir_entry->extent_start_LSB;
+	int sectors = (dir_entry->extent_length_LSB + 2047) / 2048;
+	long offset = 0;
+	while (sectors > 0) {
+		int count = sectors < SECTORS ? sectors : SECTORS;
+		if (progress) print_(count == SECTORS ? "." : "!");
+		ata_device_read_sectors_atapi(device, lba, dest + offset, count);
+		sectors -= count;
+		offset += 2048 * count;
+		lba += count;
+	}
+	return offset;
+}
+
 static void do_it(struct ata_device * _device) {
 	device = _device;
 	if (device->atapi_sector_size != 2048) {
@@ -443,16 +517,14 @@ done:
 		print("Found kernel.\n");
 		print_hex(dir_entry->extent_start_LSB); print(" ");
 		print_hex(dir_entry->extent_length_LSB); print("\n");
-		long offset = 0;
-		for (int i = dir_entry->extent_start_LSB; i < dir_entry->extent_start_LSB + dir_entry->extent_length_LSB / 2048 + 1; ++i, offset += 2048) {
-
-			ata_device_read_sector_atapi(device, i, (uint8_t *)KERNEL_LOAD_START + offset);
-		}
+		boot_stage("read-kernel");
+		long offset = read_extent((uint8_t *)KERNEL_LOAD_START, 0);
 		while (offset % 4096) offset++;
 		restore_root();
 		if (navigate(module_dir)) {
 			memcpy(mod_dir, dir_entry, sizeof(iso_9660_directory_entry_t));
 			print("Scanning modules...\n");
+			boot_stage("read-modules");
 			char ** c = modules;
 			int j = 0;
 			while (*c) {
@@ -465,9 +537,7 @@ done:
 				} else {
 					modules_mboot[j].mod_start = KERNEL_LOAD_START + offset;
 					modules_mboot[j].mod_end = KERNEL_LOAD_START + offset + dir_entry->extent_length_LSB;
-					for (int i = dir_entry->extent_start_LSB; i < dir_entry->extent_start_LSB + dir_entry->extent_length_LSB / 2048 + 1; ++i, offset += 2048) {
-						ata_device_read_sector_atapi(device, i, (uint8_t *)KERNEL_LOAD_START + offset);
-					}
+					offset += read_extent((uint8_t *)KERNEL_LOAD_START + offset, 0);
 					while (offset % 4096) offset++;
 					j++;
 				}
@@ -484,23 +554,9 @@ done:
 				modules_mboot[multiboot_header.mods_count-1].mod_end = ramdisk_off + ramdisk_len;
 
 				print_("Loading ramdisk");
+				boot_stage("read-ramdisk");
 
-				int i = dir_entry->extent_start_LSB;
-				int sectors = dir_entry->extent_length_LSB / 2048 + 1;
-#define SECTORS 512
-				while (sectors >= SECTORS) {
-					print_(".");
-					ata_device_read_sectors_atapi(device, i, (uint8_t *)KERNEL_LOAD_START + offset, SECTORS);
-
-					sectors -= SECTORS;
-					offset += 2048 * SECTORS;
-					i += SECTORS;
-				}
-				if (sectors > 0) {
-					print_("!");
-					ata_device_read_sectors_atapi(device, i, (uint8_t *)KERNEL_LOAD_START + offset, sectors);
-					offset += 2048 * sectors;
-				}
+				offset += read_extent((uint8_t *)KERNEL_LOAD_START + offset, 1);
 
 				final_offset = (uint8_t *)KERNEL_LOAD_START + offset;
 				set_attr(0x07);
@@ -539,6 +595,7 @@ void swap_bytes(void * in, int count) {
 }
 
 void show_menu(void) {
+	boot_stage("menu");
 
 #if 1
 	/* Try to detect qemu headless boot */
@@ -729,6 +786,7 @@ static void boot(void) {
 	EFI_FILE *root;
 	EFI_STATUS status;
 
+	boot_stage("probe");
 	clear_();
 
 	status = uefi_call_wrapper(ST->BootServices->HandleProtocol,
@@ -777,6 +835,7 @@ static void boot(void) {
 	}
 
 	/* Load kernel */
+	boot_stage("read-kernel");
 	status = uefi_call_wrapper(root->Open,
 			5, root, &file, kernel_name, EFI_FILE_MODE_READ, 0);
 
@@ -801,6 +860,7 @@ static void boot(void) {
 	while (offset % 4096) offset++;
 
 	print_("Reading modules...\n");
+	boot_stage("read-modules");
 
 	char ** c = modules;
 	int j = 0;
@@ -864,6 +924,7 @@ _try_module_again:
 			name[i-1] == 0;
 		}
 		bytes = 134217728;
+		boot_stage("read-ramdisk");
 		status = uefi_call_wrapper(root->Open,
 				5, root, &file, name, EFI_FILE_MODE_READ, 0);
 		if (!EFI_ERROR(status)) {
@@ -897,10 +958,12 @@ static void boot(void) {
 
 	multiboot_header.cmdline = (uintptr_t)cmdline;
 
+	boot_stage("probe");
 	ata_device_detect(&ata_primary_master);
 	ata_device_detect(&ata_primary_slave);
 	ata_device_detect(&ata_secondary_master);
 	ata_device_detect(&ata_secondary_slave);
+	ata_find_busmaster();
 
 	if (ata_primary_master.is_atapi) {
 		do_it(&ata_primary_master);
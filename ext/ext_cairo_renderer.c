@@ -7,22 +7,82 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include <cairo.h>
 #include <toaru/yutani-server.h>
 
+/* Past this many damage rectangles in a frame, the whole screen is sent */
+#define CAIRO_DAMAGE_MAX 64
+
 struct cairo_renderer {
 	cairo_t * framebuffer_ctx;
 	cairo_surface_t * framebuffer_surface;
-	cairo_t * real_ctx;
-	cairo_surface_t * real_surface;
+
+	/* This frame's damage, for the copy to the screen */
+	gfx_rect_t damage[CAIRO_DAMAGE_MAX];
+	int damage_count;
+	int damage_all;
+};
+
+/*
+ * A window's surface is made once, and again only when its buffer
+ * changes under it - on a resize - or it stops or starts promising to
+ * be opaque. Opaque windows are RGB24, which cairo composites with a
+ * plain copy.
+ */
+struct cairo_window {
+	cairo_surface_t * surface;
+	uint8_t * buffer;
+	int32_t width;
+	int32_t height;
+	int opaque;
 };
 
+static cairo_surface_t * window_surface(yutani_server_window_t * window) {
+	struct cairo_window * cw = window->renderer_data;
+	int opaque = !!(window->server_flags & YUTANI_WINDOW_FLAG_OPAQUE);
+
+	if (cw && cw->buffer == window->buffer && cw->width == window->width &&
+	    cw->height == window->height && cw->opaque == opaque) {
+		/* The client draws into it behind our back */
+		cairo_surface_mark_dirty(cw->surface);
+		return cw->surface;
+	}
+
+	if (!cw) {
+		cw = malloc(sizeof(struct cairo_window));
+		window->renderer_data = cw;
+	} else {
+		cairo_surface_destroy(cw->surface);
+	}
+
+	/* Window stride is always 4 bytes per pixel... */
+	cw->surface = cairo_image_surface_create_for_data(window->buffer,
+			opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+			window->width, window->height, window->width * 4);
+	cw->buffer = window->buffer;
+	cw->width = window->width;
+	cw->height = window->height;
+	cw->opaque = opaque;
+	return cw->surface;
+}
+
+int renderer_close_window(yutani_globals_t * yg, yutani_server_window_t * window) {
+	struct cairo_window * cw = window->renderer_data;
+	if (cw) {
+		cairo_surface_destroy(cw->surface);
+		free(cw);
+		window->renderer_data = NULL;
+	}
+	return 0;
+}
+
 int renderer_alloc(yutani_globals_t * yg) {
 	struct cairo_renderer * c = malloc(sizeof(struct cairo_renderer));
 	c->framebuffer_ctx = NULL;
 	c->framebuffer_surface = NULL;
-	c->real_ctx = NULL;
-	c->real_surface = NULL;
+	c->damage_count = 0;
+	c->damage_all = 1;
 	yg->renderer_ctx = c;
 	return 0;
 }
@@ -35,9 +95,8 @@ int renderer_init(yutani_globals_t * yg) {
 			yg->backend_framebuffer, CAIRO_FORMAT_ARGB32, yg->width, yg->height, stride);
 	c->framebuffer_ctx = cairo_create(c->framebuffer_surface);
 
-	c->real_surface = cairo_image_surface_create_for_data(
-			(unsigned char *)yg->backend_ctx->buffer, CAIRO_FORMAT_ARGB32, yg->width, yg->height, stride);
-	c->real_ctx = cairo_create(c->real_surface);
+	/* Everything is new to the screen */
+	c->damage_all = 1;
 
 	return 0;
 }
@@ -45,32 +104,37 @@ int renderer_init(yutani_globals_t * yg) {
 int renderer_add_clip(yutani_globals_t * yg, double x, double y, double w, double h) {
 	struct cairo_renderer * c = yg->renderer_ctx;
 	cairo_rectangle(c->framebuffer_ctx, x, y, w, h);
-	if (yg->width > 2490) {
-		x = 0;
-		w = yg->width;
+
+	/* Kept to whole pixels on the screen for the final copy */
+	int32_t x0 = x < 0 ? 0 : (int32_t)x;
+	int32_t y0 = y < 0 ? 0 : (int32_t)y;
+	int32_t x1 = x + w > yg->width ? (int32_t)yg->width : (int32_t)ceil(x + w);
+	int32_t y1 = y + h > yg->height ? (int32_t)yg->height : (int32_t)ceil(y + h);
+	if (x0 >= x1 || y0 >= y1) return 0;
+
+	if (c->damage_count == CAIRO_DAMAGE_MAX) {
+		c->damage_all = 1;
+	} else {
+		c->damage[c->damage_count++] = (gfx_rect_t){x0, y0, x1 - x0, y1 - y0};
 	}
-	cairo_rectangle(c->real_ctx, x, y, w, h);
 	return 0;
 }
 
 int renderer_set_clip(yutani_globals_t * yg) {
 	struct cairo_renderer * c = yg->renderer_ctx;
 	cairo_clip(c->framebuffer_ctx);
-	cairo_clip(c->real_ctx);
 	return 0;
 }
 
 int renderer_push_state(yutani_globals_t * yg) {
 	struct cairo_renderer * c = yg->renderer_ctx;
 	cairo_save(c->framebuffer_ctx);
-	cairo_save(c->real_ctx);
 	return 0;
 }
 
 int renderer_pop_state(yutani_globals_t * yg) {
 	struct cairo_renderer * c = yg->renderer_ctx;
 	cairo_restore(c->framebuffer_ctx);
-	cairo_restore(c->real_ctx);
 	return 0;
 }
 
@@ -78,17 +142,36 @@ int renderer_destroy(yutani_globals_t * yg) {
 	struct cairo_renderer * c = yg->renderer_ctx;
 	cairo_destroy(c->framebuffer_ctx);
 	cairo_surface_destroy(c->framebuffer_surface);
-	cairo_destroy(c->real_ctx);
-	cairo_surface_destroy(c->real_surface);
 	return 0;
 }
 
+/*
+ * Only the damaged rectangles go to the screen, a row at a time; the
+ * backbuffer and the screen share a format and stride, so that's all
+ * cairo would have done for us anyway, without the clip to get through.
+ */
 int renderer_blit_screen(yutani_globals_t * yg) {
 	struct cairo_renderer * c = yg->renderer_ctx;
-	cairo_set_operator(c->real_ctx, CAIRO_OPERATOR_SOURCE);
-	cairo_translate(c->real_ctx, 0, 0);
-	cairo_set_source_surface(c->real_ctx, c->framebuffer_surface, 0, 0);
-	cairo_paint(c->real_ctx);
+	int stride = yg->backend_ctx->stride;
+	uint8_t * src = yg->backend_framebuffer;
+	uint8_t * dst = (uint8_t *)yg->backend_ctx->buffer;
+
+	cairo_surface_flush(c->framebuffer_surface);
+
+	if (c->damage_all) {
+		memcpy(dst, src, stride * yg->height);
+	} else {
+		for (int i = 0; i < c->damage_count; ++i) {
+			gfx_rect_t * r = &c->damage[i];
+			size_t offset = r->y * stride + r->x * 4;
+			for (int32_t y = 0; y < r->h; ++y, offset += stride) {
+				memcpy(dst + offset, src + offset, r->w * 4);
+			}
+		}
+	}
+
+	c->damage_count = 0;
+	c->damage_all = 0;
 	return 0;
 }
 
@@ -97,12 +180,11 @@ int renderer_blit_window(yutani_globals_t * yg, yutani_server_window_t * window,
 	struct cairo_renderer * c = yg->renderer_ctx;
 	cairo_t * cr = c->framebuffer_ctx;
 
-	/* Window stride is always 4 bytes per pixel... */
-	int stride = window->width * 4;
+	cairo_surface_t * surf = window_surface(window);
 
-	/* Initialize a cairo surface object for this window */
-	cairo_surface_t * surf = cairo_image_surface_create_for_data(
-			window->buffer, CAIRO_FORMAT_ARGB32, window->width, window->height, stride);
+	/* Drawn where it is and as it is, so the opaque part can be copied */
+	int plain = !window->anim_mode && window->opacity == 255 && (yutani_window_is_top(yg, window) ||
+			yutani_window_is_bottom(yg, window) || (!window->rotation && window != yg->resizing_window));
 
 	/* Save cairo context */
 	cairo_save(cr);
@@ -200,7 +282,25 @@ draw_window:
 		/* Paint window */
 		cairo_set_source_surface(cr, surf, 0, 0);
 
-		if (window->opacity != 255) {
+		gfx_rect_t o = window->opaque_region;
+		if (plain && (window->server_flags & YUTANI_WINDOW_FLAG_OPAQUE)) {
+			cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+			cairo_paint(cr);
+		} else if (plain && o.w > 0 && o.h > 0) {
+			/* Copy the part the client says is opaque, and blend the rest around it */
+			cairo_save(cr);
+			cairo_rectangle(cr, o.x, o.y, o.w, o.h);
+			cairo_clip(cr);
+			cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+			cairo_paint(cr);
+			cairo_restore(cr);
+
+			cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+			cairo_rectangle(cr, 0, 0, window->width, window->height);
+			cairo_rectangle(cr, o.x, o.y, o.w, o.h);
+			cairo_clip(cr);
+			cairo_paint(cr);
+		} else if (window->opacity != 255) {
 			cairo_paint_with_alpha(cr, (float)(window->opacity)/255.0);
 		} else {
 			cairo_paint(cr);
@@ -209,9 +309,6 @@ draw_window:
 
 draw_finish:
 
-	/* Clean up */
-	cairo_surface_destroy(surf);
-
 	/* Restore context stack */
 	cairo_restore(cr);
 
@@ -5,10 +5,12 @@
  *
  * Extension library for freetype font rendering.
  */
+#include <string.h>
 #include <syscall.h>
 #include <toaru/yutani.h>
 #include <toaru/graphics.h>
 #include <toaru/decodeutf8.h>
+#include <toaru/glyph_cache.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -93,79 +95,84 @@ void freetype_set_font_size(int size) {
 	}
 }
 
-static void draw_char(FT_Bitmap * bitmap, int x, int y, uint32_t fg, gfx_context_t * ctx) {
-	int i, j, p, q;
-	int x_max = x + bitmap->width;
-	int y_max = y + bitmap->rows;
-	for (j = y, q = 0; j < y_max; j++, q++) {
-		if (j < 0 || j >= ctx->height) continue;
-		for ( i = x, p = 0; i < x_max; i++, p++) {
-			uint32_t a = _ALP(fg);
-			a = (a * bitmap->buffer[q * bitmap->width + p]) / 255;
-			uint32_t tmp = premultiply(rgba(_RED(fg),_GRE(fg),_BLU(fg),a));
-			if (i < 0 || i >= ctx->width) continue;
-			SGFX(ctx->backbuffer,i,j,ctx->width) = alpha_blend_rgba(SGFX(ctx->backbuffer,i,j,ctx->width),tmp);
+static int _render_glyph(FT_Face face, FT_UInt glyph_index, uint32_t o) {
+	int error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT);
+	if (error) {
+		fprintf(stderr, "Error loading glyph for '%lu'\n", o);
+		return 1;
+	}
+	slot = face->glyph;
+	if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+		error = FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL);
+		if (error) {
+			fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
+			return 1;
 		}
 	}
+	return 0;
 }
 
-void freetype_draw_char(gfx_context_t * ctx, int x, int y, uint32_t fg, uint32_t o) {
-	int pen_x = x, pen_y = y;
-	int error;
-	slot = faces[selected_face]->glyph;
-	FT_UInt glyph_index;
+/*
+ * Look up (or render and cache) the glyph for `o` in the selected face,
+ * falling back to the faces in fallbacks[] when it has none.
+ */
+static glyph_t * _get_glyph(uint32_t o) {
+	glyph_t * glyph = glyph_cache_get(GLYPH_FONT(GLYPH_SOURCE_FREETYPE, selected_face), _font_size, o, 0);
+	if (glyph) return glyph;
 
-	glyph_index = FT_Get_Char_Index( faces[selected_face], o);
+	FT_UInt glyph_index = FT_Get_Char_Index(faces[selected_face], o);
 	if (glyph_index) {
-		error = FT_Load_Glyph(faces[selected_face], glyph_index, FT_LOAD_DEFAULT);
-		if (error) {
-			fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-			return;
-		}
-		slot = (faces[selected_face])->glyph;
-		if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-			error = FT_Render_Glyph((faces[selected_face])->glyph, FT_RENDER_MODE_NORMAL);
-			if (error) {
-				fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-				return;
-			}
-		}
+		if (_render_glyph(faces[selected_face], glyph_index, o)) return NULL;
 	} else {
 		int i = 0;
 		while (!glyph_index && fallbacks[i] != -1) {
 			int fallback = fallbacks[i++];
-			glyph_index = FT_Get_Char_Index( faces[fallback], o);
-			error = FT_Load_Glyph(faces[fallback], glyph_index, FT_LOAD_DEFAULT);
-			if (error) {
-				fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-				return;
-			}
-			slot = (faces[fallback])->glyph;
-			if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-				error = FT_Render_Glyph((faces[fallback])->glyph, FT_RENDER_MODE_NORMAL);
-				if (error) {
-					fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-					return;
-				}
-			}
+			glyph_index = FT_Get_Char_Index(faces[fallback], o);
+			if (_render_glyph(faces[fallback], glyph_index, o)) return NULL;
 		}
+	}
 
+	FT_Bitmap * bitmap = &slot->bitmap;
+	glyph = glyph_cache_add(GLYPH_FONT(GLYPH_SOURCE_FREETYPE, selected_face), _font_size, o, 0, bitmap->width, bitmap->rows);
+	glyph->left = slot->bitmap_left;
+	glyph->top = slot->bitmap_top;
+	glyph->advance = slot->advance.x >> 6;
+
+	for (unsigned int j = 0; j < bitmap->rows; ++j) {
+		uint8_t * row = bitmap->buffer + j * bitmap->pitch;
+		uint8_t * out = glyph->mask + j * bitmap->width;
+		if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO) {
+			for (unsigned int i = 0; i < bitmap->width; ++i) {
+				out[i] = (row[i / 8] & (0x80 >> (i % 8))) ? 255 : 0;
+			}
+		} else {
+			memcpy(out, row, bitmap->width);
+		}
 	}
 
-	draw_char(&slot->bitmap, pen_x + slot->bitmap_left, pen_y - slot->bitmap_top, fg, ctx);
+	return glyph;
+}
 
+void freetype_draw_char(gfx_context_t * ctx, int x, int y, uint32_t fg, uint32_t o) {
+	glyph_t * glyph = _get_glyph(o);
+	if (!glyph) return;
+
+	uint32_t colors[256];
+	glyph_colors(colors, fg);
+	draw_glyph(ctx, glyph, x, y, colors);
 }
 
 int freetype_draw_string(gfx_context_t * ctx, int x, int y, uint32_t fg, char * string) {
-	slot = faces[selected_face]->glyph;
-	int pen_x = x, pen_y = y;
-	int error;
+	int pen_x = x;
 
 	uint8_t * s = (uint8_t *)string;
 
 	uint32_t codepoint;
 	uint32_t state = 0;
 
+	uint32_t colors[256];
+	glyph_colors(colors, fg);
+
 	while (*s) {
 		uint32_t o = 0;
 		while (*s) {
@@ -182,56 +189,17 @@ int freetype_draw_string(gfx_context_t * ctx, int x, int y, uint32_t fg, char *
 finished:
 		if (!o) continue;
 
-		FT_UInt glyph_index;
-
-		glyph_index = FT_Get_Char_Index( faces[selected_face], o);
-		if (glyph_index) {
-			error = FT_Load_Glyph(faces[selected_face], glyph_index, FT_LOAD_DEFAULT);
-			if (error) {
-				fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-				continue;
-			}
-			slot = (faces[selected_face])->glyph;
-			if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-				error = FT_Render_Glyph((faces[selected_face])->glyph, FT_RENDER_MODE_NORMAL);
-				if (error) {
-					fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-					continue;
-				}
-			}
-		} else {
-			int i = 0;
-			while (!glyph_index && fallbacks[i] != -1) {
-				int fallback = fallbacks[i++];
-				glyph_index = FT_Get_Char_Index( faces[fallback], o);
-				error = FT_Load_Glyph(faces[fallback], glyph_index, FT_LOAD_DEFAULT);
-				if (error) {
-					fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-					continue;
-				}
-				slot = (faces[fallback])->glyph;
-				if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-					error = FT_Render_Glyph((faces[fallback])->glyph, FT_RENDER_MODE_NORMAL);
-					if (error) {
-						fprintf(stderr, "Error rendering glyph for '%lu'\n", o);
-						continue;
-					}
-				}
-			}
-
-		}
+		glyph_t * glyph = _get_glyph(o);
+		if (!glyph) continue;
 
-		draw_char(&slot->bitmap, pen_x + slot->bitmap_left, pen_y - slot->bitmap_top, fg, ctx);
-		pen_x += slot->advance.x >> 6;
-		pen_y += slot->advance.y >> 6;
+		draw_glyph(ctx, glyph, pen_x, y, colors);
+		pen_x += glyph->advance;
 	}
 	return pen_x - x;
 }
 
 int freetype_draw_string_width(char * string) {
-	slot = faces[selected_face]->glyph;
 	int pen_x = 0;
-	int error;
 
 	uint8_t * s = (uint8_t *)string;
 
@@ -254,30 +222,10 @@ int freetype_draw_string_width(char * string) {
 finished_width:
 		if (!o) continue;
 
-		FT_UInt glyph_index;
+		glyph_t * glyph = _get_glyph(o);
+		if (!glyph) continue;
 
-		glyph_index = FT_Get_Char_Index( faces[selected_face], o);
-		if (glyph_index) {
-			error = FT_Load_Glyph(faces[selected_face], glyph_index, FT_LOAD_DEFAULT);
-			if (error) {
-				fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-				continue;
-			}
-			slot = (faces[selected_face])->glyph;
-		} else {
-			int i = 0;
-			while (!glyph_index && fallbacks[i] != -1) {
-				int fallback = fallbacks[i++];
-				glyph_index = FT_Get_Char_Index( faces[fallback], o);
-				error = FT_Load_Glyph(faces[fallback], glyph_index, FT_LOAD_DEFAULT);
-				if (error) {
-					fprintf(stderr, "Error loading glyph for '%lu'\n", o);
-					continue;
-				}
-				slot = (faces[fallback])->glyph;
-			}
-		}
-		pen_x += slot->advance.x >> 6;
+		pen_x += glyph->advance;
 	}
 	return pen_x;
 }
@@ -315,8 +263,7 @@ void freetype_draw_string_shadow(gfx_context_t * ctx, int x, int y, uint32_t fg,
 	freetype_draw_string(out_c, OFFSET_X + offset_x, OFFSET_Y + offset_y + _font_size, shadow_color, string);
 
 	/* Two should work okay? */
-	blur_context_box(out_c, radius);
-	blur_context_box(out_c, radius);
+	blur_context_gaussian(out_c, radius, 2);
 
 	freetype_draw_string(out_c, OFFSET_X, OFFSET_Y + _font_size, fg, string);
 
@@ -0,0 +1,174 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Local APIC
+ *
+ * The bootstrap processor's local APIC is turned on in virtual wire
+ * mode: the PICs still deliver the legacy lines through LINT0, as they
+ * did with the APIC off, and the APIC is there to take message
+ * signalled interrupts from PCI devices (see pci_enable_msi()), which
+ * it sends to the vectors after the PIC ones. Those, and only those,
+ * are acknowledged here rather than at the PIC.
+ *
+ * The application processors' APICs (see smp.c) take no external
+ * lines at all; they get their timer, which is what preempts their
+ * processes, and the interrupts processors send each other.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/args.h>
+#include <kernel/mem.h>
+
+#define IA32_APIC_BASE        0x1B
+#define IA32_APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_ID    0x020
+#define LAPIC_TPR   0x080
+#define LAPIC_EOI   0x0B0
+#define LAPIC_SVR   0x0F0
+#define LAPIC_ICR_LOW  0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_TIMER 0x320
+#define LAPIC_PERF  0x340
+#define LAPIC_LINT0 0x350
+#define LAPIC_LINT1 0x360
+#define LAPIC_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LVT_MASKED       0x10000
+#define LVT_NMI          0x400
+#define LVT_EXTINT       0x700
+#define LVT_PERIODIC     0x20000
+#define ICR_PENDING      0x1000
+#define TIMER_DIVIDE_16  0x3
+
+int lapic_enabled = 0;
+static uintptr_t lapic_base = 0;
+
+static uint32_t lapic_read(int reg) {
+	return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+static void lapic_write(int reg, uint32_t value) {
+	*(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+uint8_t lapic_id(void) {
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+/*
+ * Send an interrupt (or INIT, or a startup) to another processor's
+ * APIC. The previous one has to have gone before the next is written.
+ */
+void lapic_send_ipi(uint8_t id, uint32_t command) {
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING);
+	lapic_write(LAPIC_ICR_HIGH, (uint32_t)id << 24);
+	lapic_write(LAPIC_ICR_LOW, command);
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING);
+}
+
+/* Timer counts a millisecond, at a sixteenth of the bus clock */
+static uint32_t lapic_timer_rate = 0;
+
+/*
+ * Measure the timer against the PIT, with interrupts on so the PIT's
+ * shots keep being rearmed. Every processor's timer runs at the same
+ * rate, so this is done once, here on the bootstrap processor.
+ */
+int lapic_timer_calibrate(void) {
+	lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+	lapic_write(LAPIC_TIMER, LVT_MASKED);
+	lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+
+	unsigned long s, ss, now_s, now_ss;
+	relative_time(0, 10, &s, &ss);
+	do {
+		timer_now(&now_s, &now_ss);
+	} while (now_s < s || (now_s == s && now_ss < ss));
+
+	uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+	lapic_timer_rate = counted / 10;
+	debug_print(NOTICE, "Local APIC timer counts %d per millisecond", lapic_timer_rate);
+	return lapic_timer_rate != 0;
+}
+
+/*
+ * Interrupt this processor every `us` microseconds, on IRQ_LAPIC_TIMER.
+ */
+void lapic_timer_start(uint32_t us) {
+	uint32_t count = (uint64_t)lapic_timer_rate * us / 1000;
+	lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+	lapic_write(LAPIC_TIMER, LVT_PERIODIC | (32 + IRQ_LAPIC_TIMER));
+	lapic_write(LAPIC_TIMER_INITIAL, count ? count : 1);
+}
+
+void lapic_install(void) {
+	if (args_present("noapic")) {
+		debug_print(NOTICE, "Local APIC disabled on the command line.");
+		return;
+	}
+
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if (!(edx & (1 << 9))) {
+		debug_print(NOTICE, "No local APIC.");
+		return;
+	}
+
+	uint64_t base;
+	asm volatile ("rdmsr" : "=A" (base) : "c" (IA32_APIC_BASE));
+	lapic_base = (uintptr_t)(base & 0xFFFFF000);
+	if (smp_lapic_address && smp_lapic_address != lapic_base) {
+		debug_print(WARNING, "MP table puts the local APIC at 0x%x, the processor says 0x%x", smp_lapic_address, lapic_base);
+	}
+
+	page_t * page = get_page(lapic_base, 1, kernel_directory);
+	dma_frame(page, 1, 1, lapic_base);
+	page->cachedisable = 1;
+	invalidate_tables_at(lapic_base);
+
+	base |= IA32_APIC_BASE_ENABLE;
+	asm volatile ("wrmsr" : : "A" (base), "c" (IA32_APIC_BASE));
+
+	/* The PICs come in on LINT0, NMIs on LINT1; nothing else is ours yet */
+	lapic_write(LAPIC_TIMER, LVT_MASKED);
+	lapic_write(LAPIC_PERF,  LVT_MASKED);
+	lapic_write(LAPIC_ERROR, LVT_MASKED);
+	lapic_write(LAPIC_LINT0, LVT_EXTINT);
+	lapic_write(LAPIC_LINT1, LVT_NMI);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | (32 + IRQ_SPURIOUS));
+
+	lapic_enabled = 1;
+	debug_print(NOTICE, "Local APIC %d at 0x%x, in virtual wire mode", lapic_id(), lapic_base);
+}
+
+/*
+ * An application processor's APIC, which lapic_install() has already
+ * mapped. Only the bootstrap processor takes the PICs and NMIs.
+ */
+void lapic_install_cpu(void) {
+	uint64_t base;
+	asm volatile ("rdmsr" : "=A" (base) : "c" (IA32_APIC_BASE));
+	base |= IA32_APIC_BASE_ENABLE;
+	asm volatile ("wrmsr" : : "A" (base), "c" (IA32_APIC_BASE));
+
+	lapic_write(LAPIC_TIMER, LVT_MASKED);
+	lapic_write(LAPIC_PERF,  LVT_MASKED);
+	lapic_write(LAPIC_ERROR, LVT_MASKED);
+	lapic_write(LAPIC_LINT0, LVT_MASKED);
+	lapic_write(LAPIC_LINT1, LVT_MASKED);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | (32 + IRQ_SPURIOUS));
+}
@@ -11,6 +11,8 @@
 #include <kernel/logging.h>
 #include <kernel/tss.h>
 
+#include <sys/tls.h>
+
 typedef struct {
 	/* Limits */
 	uint16_t limit_low;
@@ -28,58 +30,95 @@ typedef struct {
 	uintptr_t base;
 } __attribute__((packed)) gdt_pointer_t;
 
-/* In the future we may need to put a lock on the access of this */
-static struct {
-    gdt_entry_t entries[6];
+/*
+ * Each processor has a table of its own: the TSS it switches stacks
+ * with, the TLS segment task switches rebase, and the segment %fs
+ * reaches its cpu_t through are all per processor.
+ */
+typedef struct {
+    gdt_entry_t entries[8];
     gdt_pointer_t pointer;
     tss_entry_t tss;
-} gdt __attribute__((used));
+} gdt_t;
+
+static gdt_t gdt[SMP_MAX_CPUS] __attribute__((used));
 
 extern void gdt_flush(uintptr_t);
 
-#define ENTRY(X) (gdt.entries[(X)])
+#define THIS_GDT (&gdt[this_cpu()->index])
 
-void gdt_set_gate(uint8_t num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
+static void set_gate(gdt_t * table, uint8_t num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
+	gdt_entry_t * entry = &table->entries[num];
 	/* Base Address */
-	ENTRY(num).base_low = (base & 0xFFFF);
-	ENTRY(num).base_middle = (base >> 16) & 0xFF;
-	ENTRY(num).base_high = (base >> 24) & 0xFF;
+	entry->base_low = (base & 0xFFFF);
+	entry->base_middle = (base >> 16) & 0xFF;
+	entry->base_high = (base >> 24) & 0xFF;
 	/* Limits */
-	ENTRY(num).limit_low = (limit & 0xFFFF);
-	ENTRY(num).granularity = (limit >> 16) & 0X0F;
+	entry->limit_low = (limit & 0xFFFF);
+	entry->granularity = (limit >> 16) & 0X0F;
 	/* Granularity */
-	ENTRY(num).granularity |= (gran & 0xF0);
+	entry->granularity |= (gran & 0xF0);
 	/* Access flags */
-	ENTRY(num).access = access;
+	entry->access = access;
 }
 
-static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0);
+void gdt_set_gate(uint8_t num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
+	set_gate(THIS_GDT, num, base, limit, access, gran);
+}
 
-void gdt_install(void) {
-	gdt_pointer_t *gdtp = &gdt.pointer;
-	gdtp->limit = sizeof gdt.entries - 1;
-	gdtp->base = (uintptr_t)&ENTRY(0);
+static void write_tss(gdt_t * table, int32_t num, uint16_t ss0, uint32_t esp0);
+
+/*
+ * Build and load a processor's table, and point %fs at its cpu_t.
+ */
+void gdt_install_cpu(cpu_t * cpu) {
+	gdt_t * table = &gdt[cpu->index];
+	gdt_pointer_t *gdtp = &table->pointer;
+	gdtp->limit = sizeof table->entries - 1;
+	gdtp->base = (uintptr_t)&table->entries[0];
 
-	gdt_set_gate(0, 0, 0, 0, 0);                /* NULL segment */
-	gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); /* Code segment */
-	gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); /* Data segment */
-	gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); /* User code */
-	gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); /* User data */
+	set_gate(table, 0, 0, 0, 0, 0);                /* NULL segment */
+	set_gate(table, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF); /* Code segment */
+	set_gate(table, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); /* Data segment */
+	set_gate(table, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF); /* User code */
+	set_gate(table, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); /* User data */
 
-	write_tss(5, 0x10, 0x0);
+	write_tss(table, 5, 0x10, 0x0);
+
+	set_gate(table, TLS_SELECTOR >> 3, 0, 0xFFFFFFFF, 0xF2, 0xCF); /* User TLS */
+	set_gate(table, PERCPU_SELECTOR >> 3, (uintptr_t)cpu, sizeof(cpu_t) - 1, 0x92, 0x40); /* This processor */
+
+	cpu->self = cpu;
 
 	/* Go go go */
 	gdt_flush((uintptr_t)gdtp);
 	tss_flush();
+	asm volatile ("mov %0, %%fs" : : "r"((uint32_t)PERCPU_SELECTOR));
+}
+
+void gdt_install(void) {
+	gdt_install_cpu(&cpus[0]);
 }
 
-static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0) {
-	tss_entry_t * tss = &gdt.tss;
+/*
+ * Point the user TLS segment at a thread's control block. Only the base
+ * changes; it takes effect when %gs is next loaded, which every return
+ * to user mode does, so this is called on each task switch.
+ */
+void gdt_set_tls(uintptr_t base) {
+	gdt_entry_t * entry = &THIS_GDT->entries[TLS_SELECTOR >> 3];
+	entry->base_low = (base & 0xFFFF);
+	entry->base_middle = (base >> 16) & 0xFF;
+	entry->base_high = (base >> 24) & 0xFF;
+}
+
+static void write_tss(gdt_t * table, int32_t num, uint16_t ss0, uint32_t esp0) {
+	tss_entry_t * tss = &table->tss;
 	uintptr_t base = (uintptr_t)tss;
 	uintptr_t limit = base + sizeof *tss;
 
 	/* Add the TSS descriptor to the GDT */
-	gdt_set_gate(num, base, limit, 0xE9, 0x00);
+	set_gate(table, num, base, limit, 0xE9, 0x00);
 
 	memset(tss, 0x0, sizeof *tss);
 
@@ -97,6 +136,8 @@ static void write_tss(int32_t num, uint16_t ss0, uint32_t esp0) {
 
 void set_kernel_stack(uintptr_t stack) {
 	/* Set the kernel stack */
-	gdt.tss.esp0 = stack;
+	THIS_GDT->tss.esp0 = stack;
+	if (sysenter_enabled) {
+		wrmsr(MSR_SYSENTER_ESP, stack);
+	}
 }
-
@@ -51,3 +51,10 @@ void idt_install(void) {
 
 	idt_load((uintptr_t)idtp);
 }
+
+/*
+ * The table is shared; each further processor only has to load it.
+ */
+void idt_install_cpu(void) {
+	idt_load((uintptr_t)&idt.pointer);
+}
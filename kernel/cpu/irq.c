@@ -12,6 +12,7 @@
 #include <kernel/module.h>
 #include <kernel/printf.h>
 #include <kernel/args.h>
+#include <kernel/ktrace.h>
 
 /* Programmable interrupt controller */
 #define PIC1           0x20
@@ -38,8 +39,9 @@
 		             "2:"); \
 	} while (0)
 
-/* Interrupts */
-static volatile int sync_depth = 0;
+/* Interrupts; the depth is each processor's own */
+static volatile int sync_depths[SMP_MAX_CPUS] = { 0 };
+#define sync_depth (sync_depths[this_cpu()->index])
 
 #define SYNC_CLI() asm volatile("cli")
 #define SYNC_STI() asm volatile("sti")
@@ -60,6 +62,7 @@ void int_disable(void) {
 	/* If interrupts were enabled, then this is the first call depth */
 	if (flags & (1 << 9)) {
 		sync_depth = 1;
+		if (latency_tracing) latency_irqs_off_at((uintptr_t)__builtin_return_address(0));
 	} else {
 		/* Otherwise there is now an additional call depth */
 		sync_depth++;
@@ -69,6 +72,7 @@ void int_disable(void) {
 void int_resume(void) {
 	/* If there is one or no call depths, reenable interrupts */
 	if (sync_depth == 0 || sync_depth == 1) {
+		if (latency_tracing) latency_irqs_on_at((uintptr_t)__builtin_return_address(0));
 		SYNC_STI();
 	} else {
 		sync_depth--;
@@ -77,11 +81,12 @@ void int_resume(void) {
 
 void int_enable(void) {
 	sync_depth = 0;
+	if (latency_tracing) latency_irqs_on_at((uintptr_t)__builtin_return_address(0));
 	SYNC_STI();
 }
 
 /* Interrupt Requests */
-#define IRQ_CHAIN_SIZE  16
+#define IRQ_CHAIN_SIZE  IRQ_COUNT
 #define IRQ_CHAIN_DEPTH 4
 
 static void (*irqs[IRQ_CHAIN_SIZE])(void);
@@ -115,6 +120,23 @@ void irq_uninstall_handler(size_t irq) {
 	SYNC_STI();
 }
 
+/*
+ * A vector of its own for one device's message signalled interrupts;
+ * -1 when they're all taken or there's no local APIC to receive them.
+ * The caller installs its handler as for any other IRQ.
+ */
+static int msi_allocated[IRQ_MSI_COUNT] = { 0 };
+int irq_alloc_msi(void) {
+	if (!lapic_enabled) return -1;
+	for (int i = 0; i < IRQ_MSI_COUNT; ++i) {
+		if (!msi_allocated[i]) {
+			msi_allocated[i] = 1;
+			return IRQ_MSI_BASE + i;
+		}
+	}
+	return -1;
+}
+
 static void irq_remap(void) {
 	/* Cascade initialization */
 	outportb(PIC1_COMMAND, ICW1_INIT|ICW1_ICW4); PIC_WAIT();
@@ -164,6 +186,10 @@ void irq_install(void) {
 }
 
 void irq_ack(size_t irq_no) {
+	if (irq_no >= IRQ_MSI_BASE) {
+		lapic_eoi();
+		return;
+	}
 	if (irq_no >= 8) {
 		outportb(PIC2_COMMAND, PIC_EOI);
 	}
@@ -171,9 +197,32 @@ void irq_ack(size_t irq_no) {
 }
 
 void irq_handler(struct regs *r) {
+	if (r->int_no == 32 + IRQ_IPI) {
+		/* Answered without the kernel lock; whoever sent it may be holding it */
+		smp_ipi();
+		return;
+	}
+	int locked = kernel_enter();
+
 	/* Disable interrupts when handling */
 	int_disable();
-	if (r->int_no <= 47 && r->int_no >= 32) {
+	preempt_irq_enter();
+
+	/* The gate turned them off; charge that to the first handler for the line */
+	uintptr_t site = (uintptr_t)irq_handler;
+	if (latency_tracing) {
+		if (r->int_no < 32 + IRQ_COUNT && r->int_no >= 32 && irq_routines[r->int_no - 32]) {
+			site = (uintptr_t)irq_routines[r->int_no - 32];
+		}
+		latency_irqs_off_at(site);
+	}
+	if (r->int_no == 32 + IRQ_SPURIOUS) {
+		/* Not a real interrupt, and not to be acknowledged */
+		goto done;
+	}
+	if (r->int_no < 32 + IRQ_COUNT && r->int_no >= 32) {
+		KTRACE(KTRACE_IRQ, r->int_no - 32, r->eip, 0);
+		random_add_entropy(r->int_no ^ r->eip);
 		for (size_t i = 0; i < IRQ_CHAIN_DEPTH; i++) {
 			irq_handler_chain_t handler = irq_routines[i * IRQ_CHAIN_SIZE + (r->int_no - 32)];
 			if (!handler) break;
@@ -185,5 +234,10 @@ void irq_handler(struct regs *r) {
 		irq_ack(r->int_no - 32);
 	}
 done:
+	/* Anything a handler readied, or the timer's end of a slice */
+	preempt_irq_exit();
 	int_resume();
+	/* If they are still off, iret is what turns them back on */
+	if (latency_tracing) latency_irqs_on_at(site);
+	kernel_leave(locked);
 }
@@ -85,8 +85,14 @@ static const char *exception_messages[32] = {
 void fault_handler(struct regs * r) {
 	irq_handler_t handler = isr_routines[r->int_no];
 	if (handler) {
+		int locked = kernel_enter();
+		/* Entered through an interrupt gate, so with interrupts off until it says otherwise */
+		if (latency_tracing) latency_irqs_off_at((uintptr_t)handler);
 		handler(r);
+		if (latency_tracing) latency_irqs_on_at((uintptr_t)handler);
+		kernel_leave(locked);
 	} else {
+		kernel_enter();
 		debug_print(CRITICAL, "Unhandled exception: [%d] %s", r->int_no, exception_messages[r->int_no]);
 		HALT_AND_CATCH_FIRE("Process caused an unhandled exception", r);
 		STOP;
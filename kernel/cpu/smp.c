@@ -0,0 +1,401 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Multiprocessing
+ *
+ * Locates the Intel MP configuration table and records the local
+ * APIC of every usable processor, then starts the others (the
+ * application processors) with INIT and startup IPIs. Each gets its
+ * own GDT, TSS, idle task and ready queues (see process.c, which
+ * lets an idle processor take work queued on a busy one), and its
+ * local APIC's timer to preempt with; the bootstrap processor keeps
+ * the PIT, and with it the clock and the sleepers.
+ *
+ * The kernel itself is not made to run on several processors at
+ * once: one lock covers all of it, taken on every way in from user
+ * mode and let go on the way back out (and while halted in the idle
+ * task). What runs in parallel is user code. A process only runs
+ * while no other processor has its address space loaded, so changes
+ * to one never need flushing anywhere but where they're made; the
+ * kernel's own mappings are in every address space, and the few
+ * places that change them after boot call smp_tlb_shootdown().
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/process.h>
+#include <kernel/args.h>
+
+struct mp_floating {
+	char signature[4]; /* _MP_ */
+	uint32_t config;   /* Physical address of the configuration table */
+	uint8_t length;    /* In 16-byte units */
+	uint8_t revision;
+	uint8_t checksum;
+	uint8_t features[5];
+} __attribute__((packed));
+
+struct mp_config {
+	char signature[4]; /* PCMP */
+	uint16_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[8];
+	char product[12];
+	uint32_t oem_table;
+	uint16_t oem_table_size;
+	uint16_t entry_count;
+	uint32_t lapic_address;
+	uint16_t extended_length;
+	uint8_t extended_checksum;
+	uint8_t reserved;
+} __attribute__((packed));
+
+struct mp_processor {
+	uint8_t type;      /* 0 */
+	uint8_t lapic_id;
+	uint8_t lapic_version;
+	uint8_t flags;     /* bit 0: usable, bit 1: bootstrap processor */
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+} __attribute__((packed));
+
+#define MP_ENTRY_PROCESSOR 0
+#define MP_CPU_USABLE      0x01
+#define MP_CPU_BOOTSTRAP   0x02
+
+int smp_cpu_count = 1;
+uint8_t smp_lapic_ids[SMP_MAX_CPUS];
+uintptr_t smp_lapic_address = 0;
+
+/* The bootstrap processor is cpus[0]; gdt_install() points %fs at it */
+cpu_t cpus[SMP_MAX_CPUS] = { [0] = { .self = &cpus[0], .online = 1 } };
+volatile int smp_cpus_online = 1;
+
+static int mp_checksum(void * start, size_t length) {
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; ++i) {
+		sum += ((uint8_t *)start)[i];
+	}
+	return sum == 0;
+}
+
+static struct mp_floating * mp_search(uintptr_t start, size_t length) {
+	for (uintptr_t i = start; i < start + length; i += 16) {
+		struct mp_floating * mp = (struct mp_floating *)i;
+		if (!memcmp(mp->signature, "_MP_", 4) && mp_checksum(mp, mp->length * 16)) {
+			return mp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The floating pointer lives in the EBDA, the last KiB of base memory,
+ * or the BIOS ROM. Page zero (and with it the BDA pointer to the EBDA)
+ * is unmapped, so we check the usual EBDA location directly.
+ */
+static struct mp_floating * mp_find(void) {
+	struct mp_floating * mp;
+	if ((mp = mp_search(0x9FC00, 1024))) return mp;
+	return mp_search(0xF0000, 0x10000);
+}
+
+void smp_install(void) {
+	struct mp_floating * mp = mp_find();
+
+	if (!mp || !mp->config || mp->config >= 0x100000) {
+		/* No table (or not one we can reach); assume a single processor. */
+		debug_print(NOTICE, "No MP configuration table, assuming one processor.");
+		return;
+	}
+
+	struct mp_config * config = (struct mp_config *)mp->config;
+	if (memcmp(config->signature, "PCMP", 4) || !mp_checksum(config, config->length)) {
+		debug_print(WARNING, "MP configuration table is invalid.");
+		return;
+	}
+
+	smp_lapic_address = config->lapic_address;
+
+	int count = 0;
+	uint8_t * entry = (uint8_t *)config + sizeof(struct mp_config);
+	for (int i = 0; i < config->entry_count; ++i) {
+		if (*entry == MP_ENTRY_PROCESSOR) {
+			struct mp_processor * cpu = (struct mp_processor *)entry;
+			if ((cpu->flags & MP_CPU_USABLE) && count < SMP_MAX_CPUS) {
+				debug_print(NOTICE, "Processor %d: local APIC %d%s", count, cpu->lapic_id,
+						(cpu->flags & MP_CPU_BOOTSTRAP) ? " (bootstrap)" : "");
+				smp_lapic_ids[count] = cpu->lapic_id;
+				if ((cpu->flags & MP_CPU_BOOTSTRAP) && count) {
+					/* The one we're running on comes first, as cpus[0] */
+					smp_lapic_ids[count] = smp_lapic_ids[0];
+					smp_lapic_ids[0] = cpu->lapic_id;
+				}
+				count++;
+			}
+			entry += sizeof(struct mp_processor);
+		} else {
+			/* Buses, I/O APICs and interrupt assignments are all 8 bytes */
+			entry += 8;
+		}
+	}
+
+	if (count) {
+		smp_cpu_count = count;
+		cpus[0].lapic_id = smp_lapic_ids[0];
+	}
+	debug_print(NOTICE, "%d processor%s, local APIC at 0x%x", smp_cpu_count, smp_cpu_count == 1 ? "" : "s", smp_lapic_address);
+}
+
+/*
+ * The kernel lock. The bootstrap processor has it from the start, and
+ * first lets go of it when it enters /bin/init.
+ */
+static volatile int kernel_held = 1;
+static volatile int kernel_owner = 0;
+
+void kernel_lock(void) {
+	cpu_t * cpu = this_cpu();
+	while (__sync_lock_test_and_set(&kernel_held, 1)) {
+		do {
+			/* Whoever has it may be waiting on us to do this */
+			if (cpu->tlb_flush) {
+				invalidate_page_tables();
+				cpu->tlb_flush = 0;
+			}
+			asm volatile ("pause");
+		} while (kernel_held);
+	}
+	kernel_owner = cpu->index;
+}
+
+void kernel_unlock(void) {
+	kernel_owner = -1;
+	__sync_lock_release(&kernel_held);
+}
+
+/*
+ * For interrupts and exceptions, which come from user mode and from
+ * the kernel alike: returns whether the lock was taken here, and so
+ * whether kernel_leave() lets go of it.
+ */
+int kernel_enter(void) {
+	if (kernel_owner == this_cpu()->index) return 0;
+	kernel_lock();
+	return 1;
+}
+
+void kernel_leave(int locked) {
+	if (locked) kernel_unlock();
+}
+
+#define IPI_FIXED    0x4000
+#define IPI_INIT     0x4500
+#define IPI_INIT_END 0x8500
+#define IPI_STARTUP  0x4600
+
+/*
+ * IRQ_IPI, taken without the lock: whoever sent it may be holding it.
+ * Flushes the TLB if that's what it was for; otherwise it was only to
+ * wake a halted idle task.
+ */
+void smp_ipi(void) {
+	cpu_t * cpu = this_cpu();
+	if (cpu->tlb_flush) {
+		invalidate_page_tables();
+		cpu->tlb_flush = 0;
+	}
+	lapic_eoi();
+}
+
+int smp_cpu_idle(int cpu) {
+	return cpus[cpu].online && cpus[cpu].process == cpus[cpu].idle;
+}
+
+/*
+ * Something was queued for another processor; if it's halted, it
+ * wouldn't notice until its timer next went off.
+ */
+void smp_wake(int cpu) {
+	if (cpu == this_cpu()->index || !smp_cpu_idle(cpu)) return;
+	lapic_send_ipi(cpus[cpu].lapic_id, IPI_FIXED | (32 + IRQ_IPI));
+}
+
+int smp_directory_elsewhere(page_directory_t * dir) {
+	cpu_t * me = this_cpu();
+	for (int i = 0; i < smp_cpus_online; ++i) {
+		if (&cpus[i] != me && cpus[i].directory == dir) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Flush the TLB of every other processor with `dir` loaded, or of all
+ * of them for NULL, and wait until they have.
+ */
+void smp_tlb_shootdown(page_directory_t * dir) {
+	cpu_t * me = this_cpu();
+	for (int i = 0; i < smp_cpus_online; ++i) {
+		cpu_t * cpu = &cpus[i];
+		if (cpu == me || (dir && cpu->directory != dir)) continue;
+		cpu->tlb_flush = 1;
+		lapic_send_ipi(cpu->lapic_id, IPI_FIXED | (32 + IRQ_IPI));
+	}
+	for (int i = 0; i < smp_cpus_online; ++i) {
+		while (cpus[i].tlb_flush) {
+			asm volatile ("pause");
+		}
+	}
+}
+
+/*
+ * Application processors' timers tick every millisecond while there's
+ * something to preempt, and just often enough to look for work to
+ * take from the others while idle.
+ */
+#define SMP_BUSY_TICK 1000  /* us */
+#define SMP_IDLE_TICK 50000 /* us */
+
+static int cpu_busy[SMP_MAX_CPUS] = { 0 };
+
+void smp_switched(process_t * next) {
+	cpu_t * cpu = this_cpu();
+	if (!cpu->index) return;
+	int busy = next != cpu->idle;
+	if (busy == cpu_busy[cpu->index]) return;
+	cpu_busy[cpu->index] = busy;
+	lapic_timer_start(busy ? SMP_BUSY_TICK : SMP_IDLE_TICK);
+}
+
+static int smp_timer_handler(struct regs * r) {
+	irq_ack(IRQ_LAPIC_TIMER);
+
+	if (current_process) {
+		process_charge((process_t *)current_process, timer_cycles(), (r->cs & 0x3) == 0x3);
+	}
+
+	/* Taken on the way out of irq_handler, as for the PIT */
+	if (process_tick()) {
+		preempt_pending = 1;
+	}
+	return 1;
+}
+
+/* Filled in at the end of the trampoline, in smp.S */
+struct smp_trampoline_args {
+	uint32_t cr3;
+	uint32_t cr4;
+	uint32_t esp;
+	uint32_t entry;
+} __attribute__((packed));
+
+#define SMP_TRAMPOLINE 0x8000
+
+extern char smp_trampoline[];
+extern char smp_trampoline_args[];
+extern char smp_trampoline_end[];
+
+/* Which cpus[] entry the processor being started is; -1 once given up on */
+static volatile int booting = -1;
+
+static void smp_delay(unsigned long us) {
+	unsigned long s, ss, now_s, now_ss;
+	relative_time_us(0, us, &s, &ss);
+	do {
+		timer_now(&now_s, &now_ss);
+	} while (now_s < s || (now_s == s && now_ss < ss));
+}
+
+/*
+ * Where an application processor goes from the trampoline, on its
+ * idle task's stack, with interrupts off.
+ */
+static void smp_ap_main(void) {
+	if (booting < 0) {
+		/* Too late; we stopped waiting */
+		while (1) asm volatile ("cli\n\thlt");
+	}
+	cpu_t * cpu = &cpus[booting];
+
+	gdt_install_cpu(cpu);
+	idt_install_cpu();
+	switch_page_directory(kernel_directory);
+	paging_install_cpu();
+	fpu_install_cpu();
+	syscalls_install_cpu();
+	lapic_install_cpu();
+	lapic_timer_start(SMP_IDLE_TICK);
+
+	cpu->online = 1;
+
+	kernel_lock();
+	switch_next();
+}
+
+static int smp_start_cpu(int index) {
+	cpu_t * cpu = &cpus[index];
+	struct smp_trampoline_args * args = (void *)(SMP_TRAMPOLINE + (smp_trampoline_args - smp_trampoline));
+
+	cpu->self = cpu;
+	cpu->index = index;
+	cpu->lapic_id = smp_lapic_ids[index];
+	cpu->idle = spawn_kidle();
+	cpu->idle->cpu = index;
+	cpu->process = cpu->idle;
+
+	args->esp = cpu->idle->image.stack;
+	booting = index;
+
+	lapic_send_ipi(cpu->lapic_id, IPI_INIT);
+	smp_delay(10000);
+	lapic_send_ipi(cpu->lapic_id, IPI_INIT_END);
+
+	/* A second startup if the first didn't take, as the MP spec has it */
+	for (int i = 0; i < 2 && !cpu->online; ++i) {
+		lapic_send_ipi(cpu->lapic_id, IPI_STARTUP | (SMP_TRAMPOLINE >> 12));
+		smp_delay(200);
+	}
+	for (int i = 0; i < 100 && !cpu->online; ++i) {
+		smp_delay(1000);
+	}
+
+	booting = -1;
+	return cpu->online;
+}
+
+/*
+ * Start the application processors, one at a time. They each wait in
+ * kernel_lock() until we let go of it for /bin/init.
+ */
+void smp_start(void) {
+	if (!lapic_enabled || smp_cpu_count < 2 || args_present("nosmp")) return;
+
+	if (!lapic_timer_calibrate()) {
+		debug_print(WARNING, "Couldn't measure the local APIC timer; staying on one processor.");
+		return;
+	}
+	irq_install_handler(IRQ_LAPIC_TIMER, smp_timer_handler, "lapic timer");
+
+	/* Low memory is identity mapped and kept out of the frame allocator */
+	memcpy((void *)SMP_TRAMPOLINE, smp_trampoline, smp_trampoline_end - smp_trampoline);
+	struct smp_trampoline_args * args = (void *)(SMP_TRAMPOLINE + (smp_trampoline_args - smp_trampoline));
+	uintptr_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	args->cr3 = kernel_directory->physical_address;
+	args->cr4 = cr4;
+	args->entry = (uintptr_t)&smp_ap_main;
+
+	for (int i = 1; i < smp_cpu_count; ++i) {
+		if (!smp_start_cpu(i)) {
+			/* The rest of cpus[] would be out of order; stop here */
+			debug_print(WARNING, "Processor %d (local APIC %d) didn't start.", i, smp_lapic_ids[i]);
+			break;
+		}
+		smp_cpus_online = i + 1;
+		debug_print(NOTICE, "Processor %d is up.", i);
+	}
+	debug_print(NOTICE, "Running on %d processor%s.", smp_cpus_online, smp_cpus_online == 1 ? "" : "s");
+}
@@ -181,8 +181,10 @@ uint32_t read_cmos(void) {
 }
 
 int gettimeofday(struct timeval * t, void *z) {
-	t->tv_sec = boot_time + timer_ticks + timer_drift;
-	t->tv_usec = timer_subticks * 1000;
+	unsigned long seconds, subseconds;
+	timer_now(&seconds, &subseconds);
+	t->tv_sec = boot_time + seconds + timer_drift;
+	t->tv_usec = subseconds;
 	return 0;
 }
 
@@ -140,3 +140,15 @@ void fpu_install(void) {
 	isrs_install_handler(7, &invalid_op);
 #endif
 }
+
+/* An application processor's FPU, as the bootstrap processor's was above */
+void fpu_install_cpu(void) {
+#ifdef NO_LAZY_FPU
+	enable_fpu();
+	init_fpu();
+	save_fpu((void*)current_process);
+#else
+	enable_fpu();
+	disable_fpu();
+#endif
+}
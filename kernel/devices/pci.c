@@ -9,6 +9,7 @@
 #include <kernel/system.h>
 #include <kernel/pci.h>
 #include <kernel/logging.h>
+#include <kernel/args.h>
 
 void pci_write_field(uint32_t device, int field, int size, uint32_t value) {
 	outportl(PCI_ADDRESS_PORT, pci_get_addr(device, field));
@@ -76,7 +77,8 @@ void pci_scan_bus(pci_func_t f, int type, int bus, void * extra) {
 	}
 }
 
-void pci_scan(pci_func_t f, int type, void * extra) {
+/* Walk the buses themselves; everything after boot uses the table instead */
+static void pci_walk(pci_func_t f, int type, void * extra) {
 
 	if ((pci_read_field(0, PCI_HEADER_TYPE, 1) & 0x80) == 0) {
 		pci_scan_bus(f,type,0,extra);
@@ -93,16 +95,101 @@ void pci_scan(pci_func_t f, int type, void * extra) {
 	}
 }
 
-static void find_isa_bridge(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
-	if (vendorid == 0x8086 && (deviceid == 0x7000 || deviceid == 0x7110)) {
-		*((uint32_t *)extra) = device;
+/*
+ * Every function on every bus, in the order the walk found them,
+ * which is the order pci_scan() has always reported them in. Devices
+ * don't come and go, so the buses are walked once, by
+ * pci_enumerate(), and everything else looks here.
+ */
+static pci_device_t pci_devices[PCI_MAX_DEVICES];
+static int pci_device_count = 0;
+static int pci_enumerated = 0;
+
+static void pci_record(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (pci_device_count == PCI_MAX_DEVICES) {
+		debug_print(WARNING, "pci: more than %d functions, ignoring %2x:%2x.%d", PCI_MAX_DEVICES,
+				pci_extract_bus(device), pci_extract_slot(device), pci_extract_func(device));
+		return;
+	}
+
+	pci_device_t * d = &pci_devices[pci_device_count++];
+	d->address     = device;
+	d->vendor_id   = vendorid;
+	d->device_id   = deviceid;
+	d->type        = pci_find_type(device);
+	d->prog_if     = pci_read_field(device, PCI_PROG_IF, 1);
+	d->revision    = pci_read_field(device, PCI_REVISION_ID, 1);
+	d->header_type = pci_read_field(device, PCI_HEADER_TYPE, 1);
+	d->irq_pin     = pci_read_field(device, PCI_INTERRUPT_PIN, 1);
+	for (int i = 0; i < 6; ++i) {
+		d->bar[i] = pci_read_field(device, PCI_BAR0 + i * 4, 4);
+	}
+}
+
+void pci_enumerate(void) {
+	pci_device_count = 0;
+	pci_walk(&pci_record, -1, NULL);
+	pci_enumerated = 1;
+	debug_print(NOTICE, "pci: %d functions", pci_device_count);
+}
+
+int pci_count(void) {
+	return pci_device_count;
+}
+
+pci_device_t * pci_device_at(int index) {
+	if (index < 0 || index >= pci_device_count) return NULL;
+	return &pci_devices[index];
+}
+
+pci_device_t * pci_get_device(uint32_t device) {
+	for (int i = 0; i < pci_device_count; ++i) {
+		if (pci_devices[i].address == device) return &pci_devices[i];
+	}
+	return NULL;
+}
+
+/* The index'th match, counting from 0; PCI_ANY matches any device ID */
+pci_device_t * pci_find_device(uint16_t vendor_id, uint16_t device_id, int index) {
+	for (int i = 0; i < pci_device_count; ++i) {
+		pci_device_t * d = &pci_devices[i];
+		if (d->vendor_id != vendor_id) continue;
+		if (device_id != PCI_ANY && d->device_id != device_id) continue;
+		if (!index--) return d;
 	}
+	return NULL;
 }
+
+pci_device_t * pci_find_class(uint16_t type, int index) {
+	for (int i = 0; i < pci_device_count; ++i) {
+		pci_device_t * d = &pci_devices[i];
+		if (d->type != type) continue;
+		if (!index--) return d;
+	}
+	return NULL;
+}
+
+void pci_scan(pci_func_t f, int type, void * extra) {
+	if (!pci_enumerated) {
+		pci_walk(f, type, extra);
+		return;
+	}
+
+	for (int i = 0; i < pci_device_count; ++i) {
+		pci_device_t * d = &pci_devices[i];
+		if (type == -1 || type == d->type) {
+			f(d->address, d->vendor_id, d->device_id, extra);
+		}
+	}
+}
+
 static uint32_t pci_isa = 0;
 static uint8_t pci_remaps[4] = {0};
 void pci_remap(void) {
-	pci_scan(&find_isa_bridge, -1, &pci_isa);
-	if (pci_isa) {
+	pci_device_t * isa = pci_find_device(0x8086, 0x7000, 0);
+	if (!isa) isa = pci_find_device(0x8086, 0x7110, 0);
+	if (isa) {
+		pci_isa = isa->address;
 		for (int i = 0; i < 4; ++i) {
 			pci_remaps[i] = pci_read_field(pci_isa, 0x60+i, 1);
 			if (pci_remaps[i] == 0x80) {
@@ -118,7 +205,8 @@ void pci_remap(void) {
 int pci_get_interrupt(uint32_t device) {
 
 	if (pci_isa) {
-		uint32_t irq_pin = pci_read_field(device, 0x3D, 1);
+		pci_device_t * d = pci_get_device(device);
+		uint32_t irq_pin = d ? d->irq_pin : pci_read_field(device, PCI_INTERRUPT_PIN, 1);
 		if (irq_pin == 0) {
 			/* ??? */
 			debug_print(ERROR, "PCI device does not specific interrupt line");
@@ -149,3 +237,118 @@ int pci_get_interrupt(uint32_t device) {
 		return pci_read_field(device, PCI_INTERRUPT_LINE, 1);
 	}
 }
+
+/* Offset of capability `id` in the device's configuration space, or 0 */
+int pci_find_capability(uint32_t device, int id) {
+	if (!(pci_read_field(device, PCI_STATUS, 2) & PCI_STATUS_CAPABILITIES)) {
+		return 0;
+	}
+	int offset = pci_read_field(device, PCI_CAPABILITIES, 1) & 0xFC;
+	for (int i = 0; offset && i < 48; ++i) {
+		if ((int)pci_read_field(device, offset, 1) == id) {
+			return offset;
+		}
+		offset = pci_read_field(device, offset + 1, 1) & 0xFC;
+	}
+	return 0;
+}
+
+/* Message address and data for `irq`, delivered to this processor */
+static uint32_t msi_address(void) {
+	return 0xFEE00000 | ((uint32_t)lapic_id() << 12);
+}
+
+static uint32_t msi_data(int irq) {
+	return 32 + irq; /* Fixed delivery, edge triggered */
+}
+
+static void pci_disable_intx(uint32_t device) {
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	pci_write_field(device, PCI_COMMAND, 2, command_reg | PCI_COMMAND_INTX_DISABLE);
+}
+
+static int msi_allowed(void) {
+	return !args_present("nomsi");
+}
+
+/*
+ * Switch the device from its interrupt line to a single message
+ * signalled interrupt of its own. Returns the IRQ to install a
+ * handler on, or -1 if the device (or the system) can't, in which
+ * case it's left on its line and pci_get_interrupt() still applies.
+ */
+int pci_enable_msi(uint32_t device) {
+	if (!msi_allowed()) return -1;
+
+	int cap = pci_find_capability(device, PCI_CAP_MSI);
+	if (!cap) return -1;
+
+	int irq = irq_alloc_msi();
+	if (irq < 0) return -1;
+
+	/* Config writes are whole dwords; the control word is the top of the first */
+	uint32_t control = pci_read_field(device, cap, 4);
+	int is_64 = !!(control & (1 << 23));
+
+	pci_write_field(device, cap + 4, 4, msi_address());
+	if (is_64) {
+		pci_write_field(device, cap + 8, 4, 0);
+		pci_write_field(device, cap + 12, 4, msi_data(irq));
+	} else {
+		pci_write_field(device, cap + 8, 4, msi_data(irq));
+	}
+
+	control &= ~(7 << 20);  /* One message */
+	control |= (1 << 16);   /* Enable */
+	pci_write_field(device, cap, 4, control);
+	pci_disable_intx(device);
+
+	debug_print(NOTICE, "pci: %2x:%2x.%d using MSI, irq %d", pci_extract_bus(device),
+			pci_extract_slot(device), pci_extract_func(device), irq);
+	return irq;
+}
+
+/*
+ * The same for entry `entry` of the device's MSI-X table; may be
+ * called for several entries, each getting its own IRQ. Entries not
+ * set up this way stay masked.
+ */
+int pci_enable_msix(uint32_t device, int entry) {
+	if (!msi_allowed()) return -1;
+
+	int cap = pci_find_capability(device, PCI_CAP_MSIX);
+	if (!cap) return -1;
+
+	uint32_t control = pci_read_field(device, cap, 4);
+	int table_size = ((control >> 16) & 0x7FF) + 1;
+	if (entry >= table_size) return -1;
+
+	uint32_t table = pci_read_field(device, cap + 4, 4);
+	uint32_t bar = pci_read_field(device, PCI_BAR0 + (table & 7) * 4, 4);
+	if (bar & 1) return -1; /* The table has to be in memory space */
+
+	int irq = irq_alloc_msi();
+	if (irq < 0) return -1;
+
+	uintptr_t addr = (bar & 0xFFFFFFF0) + (table & ~7) + entry * 16;
+	page_t * page = get_page(addr & 0xFFFFF000, 1, kernel_directory);
+	dma_frame(page, 1, 1, addr & 0xFFFFF000);
+	page->cachedisable = 1;
+	invalidate_tables_at(addr & 0xFFFFF000);
+
+	/* Enabled with everything masked while the entry is written */
+	pci_write_field(device, cap, 4, control | (1UL << 31) | (1 << 30));
+
+	volatile uint32_t * e = (volatile uint32_t *)addr;
+	e[0] = msi_address();
+	e[1] = 0;
+	e[2] = msi_data(irq);
+	e[3] = 0; /* Unmasked */
+
+	pci_write_field(device, cap, 4, (control | (1UL << 31)) & ~(1 << 30));
+	pci_disable_intx(device);
+
+	debug_print(NOTICE, "pci: %2x:%2x.%d using MSI-X entry %d, irq %d", pci_extract_bus(device),
+			pci_extract_slot(device), pci_extract_func(device), entry, irq);
+	return irq;
+}
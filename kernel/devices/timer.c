@@ -9,6 +9,8 @@
 #include <kernel/logging.h>
 #include <kernel/process.h>
 
+#include <sys/clockpage.h>
+
 #define PIT_A 0x40
 #define PIT_B 0x41
 #define PIT_C 0x42
@@ -17,10 +19,18 @@
 #define PIT_MASK 0xFF
 #define PIT_SCALE 1193180
 #define PIT_SET 0x34
+#define PIT_ONESHOT  0x30 /* Channel 0, lo/hi byte, interrupt on terminal count */
+#define PIT_READBACK 0xC2 /* Latch count and status of channel 0 */
+#define PIT_STATUS_OUT  0x80
+#define PIT_STATUS_NULL 0x40
+
+#define PIT_MAX_COUNT 0xFFFF /* About 55ms */
+#define PIT_MIN_COUNT 32     /* About 27us; anything shorter is just an interrupt storm */
+#define PIT_TICK (PIT_SCALE / 1000) /* Scheduler tick, 1ms */
 
 #define TIMER_IRQ 0
 
-#define SUBTICKS_PER_TICK 1000
+#define SUBTICKS_PER_TICK 1000000
 #define RESYNC_TIME 1
 
 /*
@@ -39,6 +49,9 @@ timer_phase(
 
 /*
  * Internal timer counters
+ *
+ * timer_ticks counts seconds since boot and timer_subticks the
+ * microseconds into the current one.
  */
 unsigned long timer_ticks = 0;
 unsigned long timer_subticks = 0;
@@ -48,12 +61,114 @@ signed long _timer_drift = 0;
 static int behind = 0;
 
 /*
- * IRQ handler for when the timer fires
+ * The PIT runs in one-shot mode. Each shot is armed for the sooner of
+ * the next scheduler tick and the first sleeper's deadline; when the
+ * idle task has nothing to preempt, ticks are skipped entirely.
  */
-int timer_handler(struct regs *r) {
-	if (++timer_subticks == SUBTICKS_PER_TICK || (behind && ++timer_subticks == SUBTICKS_PER_TICK)) {
+static uint32_t pit_shot = 0;      /* Counts loaded for the current shot */
+static uint32_t pit_accounted = 0; /* Counts of the shot already added to the clock */
+static uint32_t pit_residue = 0;   /* Counts into the current second */
+static uint32_t sched_residue = 0; /* Counts since the last scheduler tick */
+
+static void pit_arm(uint32_t counts) {
+	if (counts < PIT_MIN_COUNT) counts = PIT_MIN_COUNT;
+	if (counts > PIT_MAX_COUNT) counts = PIT_MAX_COUNT;
+	outportb(PIT_CONTROL, PIT_ONESHOT);
+	outportb(PIT_A, counts & PIT_MASK);
+	outportb(PIT_A, (counts >> 8) & PIT_MASK);
+	pit_shot = counts;
+	pit_accounted = 0;
+}
+
+/*
+ * How far the current shot has run; returns 1 once it has expired.
+ */
+static int pit_elapsed(uint32_t * elapsed) {
+	outportb(PIT_CONTROL, PIT_READBACK);
+	uint8_t status = inportb(PIT_A);
+	uint32_t count = inportb(PIT_A);
+	count |= inportb(PIT_A) << 8;
+
+	if (status & PIT_STATUS_OUT) {
+		*elapsed = pit_shot;
+		return 1;
+	}
+	if ((status & PIT_STATUS_NULL) || count > pit_shot) {
+		/* Not loaded yet */
+		*elapsed = 0;
+	} else {
+		*elapsed = pit_shot - count;
+	}
+	return 0;
+}
+
+/*
+ * The clock page. The TSC rate is measured against the clock itself,
+ * over a second at a time, and kept up to date the same way.
+ */
+static struct clock_page * clock_page = NULL;
+static uint64_t cal_tsc = 0;
+static unsigned long cal_ticks = 0;
+static unsigned long cal_subticks = 0;
+
+static inline uint64_t timer_tsc(void) {
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static void clock_page_update(void) {
+	if (!clock_page) return;
+
+	uint64_t tsc = timer_tsc();
+	uint32_t mult = clock_page->tsc_mult;
+
+	if (!cal_tsc) {
+		cal_tsc = tsc;
+		cal_ticks = timer_ticks;
+		cal_subticks = timer_subticks;
+	} else {
+		uint64_t usec = (uint64_t)(timer_ticks - cal_ticks) * SUBTICKS_PER_TICK + timer_subticks - cal_subticks;
+		if (usec >= SUBTICKS_PER_TICK && tsc > cal_tsc) {
+			mult = (usec << 32) / (tsc - cal_tsc);
+			cal_tsc = tsc;
+			cal_ticks = timer_ticks;
+			cal_subticks = timer_subticks;
+		}
+	}
+
+	clock_page->seq++;
+	asm volatile ("" ::: "memory");
+	clock_page->boot_time = boot_time + timer_drift;
+	clock_page->ticks = timer_ticks;
+	clock_page->subticks = timer_subticks;
+	clock_page->tsc = tsc;
+	if (mult) {
+		/* A little over the longest the PIT goes between updates */
+		clock_page->tsc_limit = ((uint64_t)100000 << 32) / mult;
+	}
+	clock_page->tsc_mult = mult;
+	asm volatile ("" ::: "memory");
+	clock_page->seq++;
+}
+
+static void clock_page_install(void) {
+	uintptr_t phys;
+	clock_page = (struct clock_page *)kvmalloc_p(0x1000, &phys);
+	memset(clock_page, 0, 0x1000);
+
+	/* In a kernel page table, so every address space shares it */
+	dma_frame(get_page(CLOCK_PAGE_ADDRESS, 1, kernel_directory), 0, 0, phys);
+	invalidate_tables_at(CLOCK_PAGE_ADDRESS);
+}
+
+static void timer_advance(uint32_t counts) {
+	sched_residue += counts;
+	if (behind) counts *= 2;
+	pit_residue += counts;
+	while (pit_residue >= PIT_SCALE) {
+		pit_residue -= PIT_SCALE;
 		timer_ticks++;
-		timer_subticks = 0;
 		if (timer_ticks % RESYNC_TIME == 0) {
 			uint32_t new_time = read_cmos();
 			_timer_drift = new_time - boot_time - timer_ticks;
@@ -61,30 +176,177 @@ int timer_handler(struct regs *r) {
 			else behind = 0;
 		}
 	}
+	timer_subticks = (uint64_t)pit_residue * SUBTICKS_PER_TICK / PIT_SCALE;
+	clock_page_update();
+}
+
+/*
+ * Bring the clock up to date with the PIT. Interrupts must be off.
+ */
+static int timer_update(void) {
+	uint32_t elapsed;
+	int expired = pit_elapsed(&elapsed);
+	if (elapsed > pit_accounted) {
+		timer_advance(elapsed - pit_accounted);
+		pit_accounted = elapsed;
+	}
+	return expired;
+}
+
+/*
+ * PIT counts from now until a deadline, rounded up.
+ */
+static uint32_t counts_until(unsigned long seconds, unsigned long subseconds) {
+	if (seconds < timer_ticks || (seconds == timer_ticks && subseconds <= timer_subticks)) {
+		return 0;
+	}
+	if (seconds - timer_ticks > 1) {
+		return PIT_MAX_COUNT;
+	}
+	uint32_t usec = (seconds - timer_ticks) * SUBTICKS_PER_TICK + subseconds - timer_subticks;
+	return (uint64_t)usec * PIT_SCALE / SUBTICKS_PER_TICK + 1;
+}
+
+/*
+ * Arm the next shot. Interrupts must be off.
+ */
+static void timer_program(void) {
+	uint32_t counts;
+	if (current_process == kernel_idle_task && !process_available()) {
+		/* Nothing to preempt; only wake for sleepers */
+		counts = PIT_MAX_COUNT;
+	} else if (sched_residue < PIT_TICK) {
+		counts = PIT_TICK - sched_residue;
+	} else {
+		counts = PIT_MIN_COUNT;
+	}
+
+	unsigned long s, ss;
+	if (next_sleeper(&s, &ss)) {
+		uint32_t until = counts_until(s, ss);
+		if (until < counts) counts = until;
+	}
+
+	pit_arm(counts);
+}
+
+/* Set by the profiler while it is sampling */
+void (*timer_sample_hook)(struct regs * r) = NULL;
+
+/*
+ * IRQ handler for when the timer fires
+ */
+int timer_handler(struct regs *r) {
 	irq_ack(TIMER_IRQ);
 
+	if (!timer_update()) {
+		/* Left over from a shot that was rearmed before it went off */
+		return 1;
+	}
+
 	wakeup_sleepers(timer_ticks, timer_subticks);
-	switch_task(1);
+
+	if (timer_sample_hook) {
+		timer_sample_hook(r);
+	}
+
+	if (current_process) {
+		/* Whatever it was doing until the interrupt */
+		process_charge((process_t *)current_process, timer_tsc(), (r->cs & 0x3) == 0x3);
+	}
+
+	int preempt;
+	if (sched_residue >= PIT_TICK) {
+		sched_residue = 0;
+		preempt = process_tick();
+	} else {
+		preempt = process_should_preempt();
+	}
+
+	timer_program();
+
+	/* Taken on the way out of irq_handler, unless something holds it off */
+	if (preempt) {
+		preempt_pending = 1;
+	}
 	return 1;
 }
 
-void relative_time(unsigned long seconds, unsigned long subseconds, unsigned long * out_seconds, unsigned long * out_subseconds) {
-	if (subseconds + timer_subticks > SUBTICKS_PER_TICK) {
-		*out_seconds    = timer_ticks + seconds + 1;
-		*out_subseconds = (subseconds + timer_subticks) - SUBTICKS_PER_TICK;
+/*
+ * Called by the idle task when an interrupt other than the timer
+ * has made something runnable: catch the clock up and go back to
+ * regular ticks before switching to it.
+ */
+void timer_wake(void) {
+	IRQ_OFF;
+	timer_update();
+	wakeup_sleepers(timer_ticks, timer_subticks);
+	sched_residue = 0;
+	timer_program();
+	IRQ_RES;
+}
+
+/*
+ * Current time since boot, read from the PIT rather than
+ * as of the last interrupt.
+ */
+void timer_now(unsigned long * seconds, unsigned long * subseconds) {
+	IRQ_OFF;
+	timer_update();
+	*seconds = timer_ticks;
+	*subseconds = timer_subticks;
+	IRQ_RES;
+}
+
+/*
+ * A cheap clock for accounting: the TSC, counted in cycles.
+ */
+uint64_t timer_cycles(void) {
+	return timer_tsc();
+}
+
+/*
+ * Cycles as microseconds, at the rate the clock page was last
+ * calibrated to; 0 until it has been.
+ */
+uint64_t timer_cycles_to_us(uint64_t cycles) {
+	if (!clock_page) return 0;
+	uint64_t mult = clock_page->tsc_mult;
+	/* In two halves, so a long-running process doesn't overflow */
+	return (cycles >> 32) * mult + (((cycles & 0xFFFFFFFF) * mult) >> 32);
+}
+
+/*
+ * Deadline `seconds` and `microseconds` from now.
+ */
+void relative_time_us(unsigned long seconds, unsigned long microseconds, unsigned long * out_seconds, unsigned long * out_subseconds) {
+	unsigned long now_s, now_ss;
+	timer_now(&now_s, &now_ss);
+	seconds += microseconds / SUBTICKS_PER_TICK;
+	microseconds %= SUBTICKS_PER_TICK;
+	if (microseconds + now_ss >= SUBTICKS_PER_TICK) {
+		*out_seconds    = now_s + seconds + 1;
+		*out_subseconds = (microseconds + now_ss) - SUBTICKS_PER_TICK;
 	} else {
-		*out_seconds    = timer_ticks + seconds;
-		*out_subseconds = timer_subticks + subseconds;
+		*out_seconds    = now_s + seconds;
+		*out_subseconds = now_ss + microseconds;
 	}
 }
 
+/*
+ * Deadline `seconds` and `milliseconds` from now.
+ */
+void relative_time(unsigned long seconds, unsigned long milliseconds, unsigned long * out_seconds, unsigned long * out_subseconds) {
+	relative_time_us(seconds + milliseconds / 1000, (milliseconds % 1000) * 1000, out_seconds, out_subseconds);
+}
+
 /*
  * Device installer for the PIT
  */
 void timer_install(void) {
 	debug_print(NOTICE,"Initializing interval timer");
 	boot_time = read_cmos();
+	clock_page_install();
 	irq_install_handler(TIMER_IRQ, timer_handler, "pit timer");
-	timer_phase(SUBTICKS_PER_TICK); /* 100Hz */
+	pit_arm(PIT_TICK);
 }
-
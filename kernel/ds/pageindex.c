@@ -0,0 +1,71 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Hash and LRU list shared by the block device cache and the
+ * mmap() file page cache.
+ */
+#include <kernel/pageindex.h>
+
+static inline uint32_t page_index_bucket(page_index_t * index, void * device, uint64_t key) {
+	return (((uintptr_t)device >> 4) ^ (uint32_t)key ^ ((uint32_t)(key >> 32) * 31)) & (index->buckets - 1);
+}
+
+void page_index_init(page_index_t * index, uint32_t buckets) {
+	index->hash = malloc(sizeof(page_index_entry_t *) * buckets);
+	memset(index->hash, 0, sizeof(page_index_entry_t *) * buckets);
+	index->buckets  = buckets;
+	index->lru_head = NULL;
+	index->lru_tail = NULL;
+	index->count    = 0;
+}
+
+page_index_entry_t * page_index_lookup(page_index_t * index, void * device, uint64_t key) {
+	page_index_entry_t * entry = index->hash[page_index_bucket(index, device, key)];
+	while (entry) {
+		if (entry->device == device && entry->key == key) return entry;
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+static void lru_unlink(page_index_t * index, page_index_entry_t * entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else index->lru_head = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else index->lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push(page_index_t * index, page_index_entry_t * entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = index->lru_head;
+	if (index->lru_head) index->lru_head->lru_prev = entry;
+	index->lru_head = entry;
+	if (!index->lru_tail) index->lru_tail = entry;
+}
+
+void page_index_insert(page_index_t * index, page_index_entry_t * entry) {
+	uint32_t bucket = page_index_bucket(index, entry->device, entry->key);
+	entry->hash_next = index->hash[bucket];
+	index->hash[bucket] = entry;
+	lru_push(index, entry);
+	index->count++;
+}
+
+void page_index_remove(page_index_t * index, page_index_entry_t * entry) {
+	page_index_entry_t ** link = &index->hash[page_index_bucket(index, entry->device, entry->key)];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	lru_unlink(index, entry);
+	index->count--;
+}
+
+void page_index_touch(page_index_t * index, page_index_entry_t * entry) {
+	lru_unlink(index, entry);
+	lru_push(index, entry);
+}
@@ -8,6 +8,9 @@
 #include <kernel/process.h>
 
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->mask) {
+		return (ring_buffer->write_ptr - ring_buffer->read_ptr) & ring_buffer->mask;
+	}
 	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
 		return 0;
 	}
@@ -24,6 +27,9 @@ size_t ring_buffer_size(fs_node_t * node) {
 }
 
 size_t ring_buffer_available(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->mask) {
+		return (ring_buffer->read_ptr - ring_buffer->write_ptr - 1) & ring_buffer->mask;
+	}
 	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
 		return ring_buffer->size - 1;
 	}
@@ -35,18 +41,15 @@ size_t ring_buffer_available(ring_buffer_t * ring_buffer) {
 	}
 }
 
-static inline void ring_buffer_increment_read(ring_buffer_t * ring_buffer) {
-	ring_buffer->read_ptr++;
-	if (ring_buffer->read_ptr == ring_buffer->size) {
-		ring_buffer->read_ptr = 0;
+static inline size_t ring_buffer_advance(ring_buffer_t * ring_buffer, size_t ptr, size_t count) {
+	ptr += count;
+	if (ring_buffer->mask) {
+		return ptr & ring_buffer->mask;
 	}
-}
-
-static inline void ring_buffer_increment_write(ring_buffer_t * ring_buffer) {
-	ring_buffer->write_ptr++;
-	if (ring_buffer->write_ptr == ring_buffer->size) {
-		ring_buffer->write_ptr = 0;
+	if (ptr >= ring_buffer->size) {
+		ptr -= ring_buffer->size;
 	}
+	return ptr;
 }
 
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer) {
@@ -71,17 +74,89 @@ void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
 	list_insert(((process_t *)process)->node_waits, ring_buffer);
 }
 
+void ring_buffer_alert_writers(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->alert_writers) {
+		while (ring_buffer->alert_writers->head) {
+			node_t * node = list_dequeue(ring_buffer->alert_writers);
+			process_t * p = node->value;
+			process_alert_node(p, ring_buffer);
+			free(node);
+		}
+	}
+}
+
+void ring_buffer_select_wait_write(ring_buffer_t * ring_buffer, void * process) {
+	if (!ring_buffer->alert_writers) {
+		ring_buffer->alert_writers = list_create();
+	}
+
+	if (!list_find(ring_buffer->alert_writers, process)) {
+		list_insert(ring_buffer->alert_writers, process);
+	}
+	list_insert(((process_t *)process)->node_waits, ring_buffer);
+}
+
+/*
+ * Readers only sleep (or poll) on an empty buffer, so waking them is
+ * cheap to skip when nobody is waiting. Writers are held back until at
+ * least half the buffer is free, so they refill it in large chunks
+ * instead of trickling in behind every small read.
+ */
+static inline void ring_buffer_wake_readers(ring_buffer_t * ring_buffer) {
+	if (ring_buffer->wait_queue_readers->length) {
+		wakeup_queue(ring_buffer->wait_queue_readers);
+	}
+	ring_buffer_alert_waiters(ring_buffer);
+}
+
+static inline void ring_buffer_wake_writers(ring_buffer_t * ring_buffer) {
+	if (ring_buffer_available(ring_buffer) < ring_buffer->size / 2) {
+		return;
+	}
+	if (ring_buffer->wait_queue_writers->length) {
+		wakeup_queue(ring_buffer->wait_queue_writers);
+	}
+	ring_buffer_alert_writers(ring_buffer);
+}
+
+/*
+ * Copy out as much as is there (up to size) with at most two memcpys,
+ * one up to the end of the buffer and one from its start.
+ */
+static size_t ring_buffer_copy_out(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	size_t count = ring_buffer_unread(ring_buffer);
+	if (count > size) count = size;
+	if (!count) return 0;
+
+	size_t first = ring_buffer->size - ring_buffer->read_ptr;
+	if (first > count) first = count;
+
+	memcpy(buffer, ring_buffer->buffer + ring_buffer->read_ptr, first);
+	memcpy(buffer + first, ring_buffer->buffer, count - first);
+	ring_buffer->read_ptr = ring_buffer_advance(ring_buffer, ring_buffer->read_ptr, count);
+	return count;
+}
+
+static size_t ring_buffer_copy_in(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	size_t count = ring_buffer_available(ring_buffer);
+	if (count > size) count = size;
+	if (!count) return 0;
+
+	size_t first = ring_buffer->size - ring_buffer->write_ptr;
+	if (first > count) first = count;
+
+	memcpy(ring_buffer->buffer + ring_buffer->write_ptr, buffer, first);
+	memcpy(ring_buffer->buffer, buffer + first, count - first);
+	ring_buffer->write_ptr = ring_buffer_advance(ring_buffer, ring_buffer->write_ptr, count);
+	return count;
+}
+
 size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
 	size_t collected = 0;
 	while (collected == 0) {
 		spin_lock(ring_buffer->lock);
-		while (ring_buffer_unread(ring_buffer) > 0 && collected < size) {
-			buffer[collected] = ring_buffer->buffer[ring_buffer->read_ptr];
-			ring_buffer_increment_read(ring_buffer);
-			collected++;
-		}
+		collected = ring_buffer_copy_out(ring_buffer, size, buffer);
 		spin_unlock(ring_buffer->lock);
-		wakeup_queue(ring_buffer->wait_queue_writers);
 		if (collected == 0) {
 			if (sleep_on(ring_buffer->wait_queue_readers) && ring_buffer->internal_stop) {
 				ring_buffer->internal_stop = 0;
@@ -89,7 +164,9 @@ size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buff
 			}
 		}
 	}
-	wakeup_queue(ring_buffer->wait_queue_writers);
+	if (collected) {
+		ring_buffer_wake_writers(ring_buffer);
+	}
 	return collected;
 }
 
@@ -97,17 +174,14 @@ size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buf
 	size_t written = 0;
 	while (written < size) {
 		spin_lock(ring_buffer->lock);
-
-		while (ring_buffer_available(ring_buffer) > 0 && written < size) {
-			ring_buffer->buffer[ring_buffer->write_ptr] = buffer[written];
-			ring_buffer_increment_write(ring_buffer);
-			written++;
-		}
-
+		written += ring_buffer_copy_in(ring_buffer, size - written, buffer + written);
 		spin_unlock(ring_buffer->lock);
-		wakeup_queue(ring_buffer->wait_queue_readers);
-		ring_buffer_alert_waiters(ring_buffer);
+
 		if (written < size) {
+			/* Full; let readers drain it before we sleep. */
+			if (written) {
+				ring_buffer_wake_readers(ring_buffer);
+			}
 			if (ring_buffer->discard) {
 				break;
 			}
@@ -118,11 +192,86 @@ size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buf
 		}
 	}
 
-	wakeup_queue(ring_buffer->wait_queue_readers);
-	ring_buffer_alert_waiters(ring_buffer);
+	if (written) {
+		ring_buffer_wake_readers(ring_buffer);
+	}
 	return written;
 }
 
+/*
+ * Move up to size bytes straight from one ring buffer into another
+ * without blocking. Both locks are held for the copy, taken in address
+ * order so two opposite splices can't deadlock.
+ */
+size_t ring_buffer_splice(ring_buffer_t * from, ring_buffer_t * to, size_t size) {
+	if (from == to) return 0;
+
+	volatile int * first_lock  = from < to ? from->lock : to->lock;
+	volatile int * second_lock = from < to ? to->lock : from->lock;
+
+	spin_lock(first_lock);
+	spin_lock(second_lock);
+
+	size_t count = ring_buffer_unread(from);
+	size_t space = ring_buffer_available(to);
+	if (count > space) count = space;
+	if (count > size) count = size;
+
+	size_t moved = 0;
+	while (moved < count) {
+		size_t chunk = count - moved;
+		if (chunk > from->size - from->read_ptr) chunk = from->size - from->read_ptr;
+		if (chunk > to->size - to->write_ptr) chunk = to->size - to->write_ptr;
+		memcpy(to->buffer + to->write_ptr, from->buffer + from->read_ptr, chunk);
+		from->read_ptr = ring_buffer_advance(from, from->read_ptr, chunk);
+		to->write_ptr = ring_buffer_advance(to, to->write_ptr, chunk);
+		moved += chunk;
+	}
+
+	spin_unlock(second_lock);
+	spin_unlock(first_lock);
+
+	if (moved) {
+		ring_buffer_wake_writers(from);
+		ring_buffer_wake_readers(to);
+	}
+
+	return moved;
+}
+
+/*
+ * Swap in a new buffer of the given size, keeping whatever is unread.
+ * Fails with -EBUSY if the unread data would not fit.
+ */
+int ring_buffer_resize(ring_buffer_t * ring_buffer, size_t size) {
+	uint8_t * buffer = malloc(size);
+	if (!buffer) return -ENOMEM;
+
+	spin_lock(ring_buffer->lock);
+	size_t count = ring_buffer_unread(ring_buffer);
+	if (count >= size) {
+		spin_unlock(ring_buffer->lock);
+		free(buffer);
+		return -EBUSY;
+	}
+	ring_buffer_copy_out(ring_buffer, count, buffer);
+
+	uint8_t * old = ring_buffer->buffer;
+	ring_buffer->buffer    = buffer;
+	ring_buffer->size      = size;
+	ring_buffer->mask      = (size & (size - 1)) ? 0 : size - 1;
+	ring_buffer->read_ptr  = 0;
+	ring_buffer->write_ptr = count;
+	spin_unlock(ring_buffer->lock);
+
+	free(old);
+
+	/* There may be room now for a writer that was stuck */
+	wakeup_queue(ring_buffer->wait_queue_writers);
+	ring_buffer_alert_writers(ring_buffer);
+	return 0;
+}
+
 ring_buffer_t * ring_buffer_create(size_t size) {
 	ring_buffer_t * out = malloc(sizeof(ring_buffer_t));
 
@@ -130,7 +279,9 @@ ring_buffer_t * ring_buffer_create(size_t size) {
 	out->write_ptr  = 0;
 	out->read_ptr   = 0;
 	out->size       = size;
+	out->mask       = (size && !(size & (size - 1))) ? size - 1 : 0;
 	out->alert_waiters = NULL;
+	out->alert_writers = NULL;
 
 	spin_init(out->lock);
 
@@ -149,6 +300,7 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
 	wakeup_queue(ring_buffer->wait_queue_writers);
 	wakeup_queue(ring_buffer->wait_queue_readers);
 	ring_buffer_alert_waiters(ring_buffer);
+	ring_buffer_alert_writers(ring_buffer);
 
 	list_free(ring_buffer->wait_queue_writers);
 	list_free(ring_buffer->wait_queue_readers);
@@ -160,6 +312,11 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
 		list_free(ring_buffer->alert_waiters);
 		free(ring_buffer->alert_waiters);
 	}
+
+	if (ring_buffer->alert_writers) {
+		list_free(ring_buffer->alert_writers);
+		free(ring_buffer->alert_writers);
+	}
 }
 
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer) {
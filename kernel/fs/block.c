@@ -0,0 +1,415 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Block Layer
+ *
+ * Sits between filesystems and disk drivers. A driver registers a
+ * block_device_t that moves whole sectors, and gets back a node that
+ * takes byte offsets: partial sectors are read and patched here, reads
+ * go through the page cache like any FS_CACHED node, and partitions
+ * are windows onto the disk's node, so they share its cache.
+ *
+ * Each disk has a request queue. Normally it's empty and transfers go
+ * straight to the driver, but while the disk is plugged, writes are
+ * copied into the queue and merged with any that are adjacent, so a
+ * writeback pass over scattered cache blocks reaches the driver as a
+ * few large transfers. Unplugging runs the queue in one sweep up the
+ * disk from wherever it last was (and around), except that writes held
+ * past their deadline go first. So they aren't held too long behind a
+ * plug, the queue also runs when it gets big or something in it
+ * expires, and a read that overlaps a queued write runs it before the
+ * read goes out.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/logging.h>
+#include <kernel/printf.h>
+#include <kernel/block.h>
+
+#define BLOCK_DEADLINE  250  /* ms a queued write may wait for its plug */
+#define BLOCK_QUEUE_MAX 2048 /* Sectors queued before it runs regardless */
+#define BLOCK_MERGE_MAX 256  /* Sectors in one merged request */
+
+struct block_request {
+	uint64_t lba;
+	unsigned int count;
+	uint8_t * data;
+	unsigned long deadline;    /* In timer ticks and subticks */
+	unsigned long deadline_sub;
+	struct block_request * next;
+};
+
+struct block_partition {
+	fs_node_t * disk;
+	block_device_t * dev;
+	uint64_t offset;           /* In bytes */
+	uint64_t length;
+};
+
+static int transfer(block_device_t * dev, uint64_t lba, unsigned int count, uint8_t * buf, int write) {
+	int errors = dev->transfer(dev, lba, count, buf, write);
+	dev->position = lba + count;
+	if (errors) {
+		debug_print(ERROR, "%s: %s of %d sectors at %d failed", dev->name, write ? "write" : "read", count, (uint32_t)lba);
+	}
+	return errors;
+}
+
+static int expired(struct block_request * req, unsigned long s, unsigned long ss) {
+	return req->deadline < s || (req->deadline == s && req->deadline_sub <= ss);
+}
+
+static int deadline_before(struct block_request * a, struct block_request * b) {
+	return a->deadline < b->deadline || (a->deadline == b->deadline && a->deadline_sub < b->deadline_sub);
+}
+
+/*
+ * The next request to send: the one most overdue, or else the first
+ * at or past the last transfer, or else the first.
+ */
+static struct block_request ** next_request(block_device_t * dev) {
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+
+	struct block_request ** overdue = NULL;
+	struct block_request ** ahead = NULL;
+	for (struct block_request ** link = &dev->queue; *link; link = &(*link)->next) {
+		struct block_request * req = *link;
+		if (expired(req, s, ss) && (!overdue || deadline_before(req, *overdue))) {
+			overdue = link;
+		}
+		if (!ahead && req->lba >= dev->position) {
+			ahead = link;
+		}
+	}
+	if (overdue) return overdue;
+	if (ahead) return ahead;
+	return &dev->queue;
+}
+
+/* Send everything queued. The disk's lock is held. */
+static void run_queue(block_device_t * dev) {
+	while (dev->queue) {
+		struct block_request ** link = next_request(dev);
+		struct block_request * req = *link;
+		*link = req->next;
+		dev->queued -= req->count;
+		transfer(dev, req->lba, req->count, req->data, 1);
+		free(req->data);
+		free(req);
+	}
+}
+
+static int overlaps_queue(block_device_t * dev, uint64_t lba, unsigned int count) {
+	for (struct block_request * req = dev->queue; req; req = req->next) {
+		if (req->lba < lba + count && lba < req->lba + req->count) return 1;
+	}
+	return 0;
+}
+
+static int queue_expired(block_device_t * dev) {
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	for (struct block_request * req = dev->queue; req; req = req->next) {
+		if (expired(req, s, ss)) return 1;
+	}
+	return 0;
+}
+
+/* Grow a request by count sectors of data at its end */
+static void append_sectors(block_device_t * dev, struct block_request * req, unsigned int count, uint8_t * data) {
+	req->data = realloc(req->data, (req->count + count) * dev->sector_size);
+	memcpy(req->data + req->count * dev->sector_size, data, count * dev->sector_size);
+	req->count += count;
+}
+
+/* Hold a write back until the disk is unplugged. The disk's lock is held. */
+static void queue_write(block_device_t * dev, uint64_t lba, unsigned int count, uint8_t * buf) {
+	/* Writes to the same sectors have to land in order */
+	if (overlaps_queue(dev, lba, count)) {
+		run_queue(dev);
+	}
+
+	struct block_request * prev = NULL;
+	struct block_request ** link = &dev->queue;
+	while (*link && (*link)->lba < lba) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+	struct block_request * next = *link;
+
+	if (prev && prev->lba + prev->count == lba && prev->count + count <= BLOCK_MERGE_MAX) {
+		append_sectors(dev, prev, count, buf);
+		/* That may have closed the gap to the next one */
+		if (next && prev->lba + prev->count == next->lba && prev->count + next->count <= BLOCK_MERGE_MAX) {
+			append_sectors(dev, prev, next->count, next->data);
+			prev->next = next->next;
+			free(next->data);
+			free(next);
+		}
+	} else if (next && lba + count == next->lba && next->count + count <= BLOCK_MERGE_MAX) {
+		uint8_t * data = malloc((count + next->count) * dev->sector_size);
+		memcpy(data, buf, count * dev->sector_size);
+		memcpy(data + count * dev->sector_size, next->data, next->count * dev->sector_size);
+		free(next->data);
+		next->data = data;
+		next->lba = lba;
+		next->count += count;
+	} else {
+		struct block_request * req = malloc(sizeof(struct block_request));
+		req->lba = lba;
+		req->count = count;
+		req->data = malloc(count * dev->sector_size);
+		memcpy(req->data, buf, count * dev->sector_size);
+		relative_time(0, BLOCK_DEADLINE, &req->deadline, &req->deadline_sub);
+		req->next = next;
+		*link = req;
+	}
+	dev->queued += count;
+
+	if (dev->queued > BLOCK_QUEUE_MAX || queue_expired(dev)) {
+		run_queue(dev);
+	}
+}
+
+/* Whole sectors, in or out */
+static int block_sectors(block_device_t * dev, uint64_t lba, unsigned int count, uint8_t * buf, int write) {
+	int errors = 0;
+	mutex_lock(&dev->lock);
+	if (write && dev->plugged) {
+		queue_write(dev, lba, count, buf);
+	} else {
+		if (dev->queue && overlaps_queue(dev, lba, count)) {
+			run_queue(dev);
+		}
+		errors = transfer(dev, lba, count, buf, write);
+	}
+	mutex_unlock(&dev->lock);
+	return errors;
+}
+
+static uint64_t block_length(block_device_t * dev) {
+	return dev->sectors * dev->sector_size;
+}
+
+static uint32_t read_block(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	block_device_t * dev = node->device;
+	uint32_t ss = dev->sector_size;
+
+	if (offset >= block_length(dev)) return 0;
+	if (offset + size > block_length(dev)) size = block_length(dev) - offset;
+	if (!size) return 0;
+
+	uint64_t start_block = offset / ss;
+	uint64_t end_block = (offset + size - 1) / ss;
+	unsigned int x_offset = 0;
+
+	if (offset % ss || size < ss) {
+		unsigned int prefix_size = ss - (offset % ss);
+		if (prefix_size > size) prefix_size = size;
+		uint8_t * tmp = malloc(ss);
+		if (block_sectors(dev, start_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(buffer, tmp + (offset % ss), prefix_size);
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % ss && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % ss;
+		uint8_t * tmp = malloc(ss);
+		if (block_sectors(dev, end_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(buffer + size - postfix_size, tmp, postfix_size);
+		free(tmp);
+		end_block--;
+	}
+
+	if (start_block <= end_block) {
+		if (block_sectors(dev, start_block, end_block - start_block + 1, buffer + x_offset, 0)) {
+			return 0;
+		}
+	}
+
+	return size;
+}
+
+static uint32_t write_block(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	block_device_t * dev = node->device;
+	uint32_t ss = dev->sector_size;
+
+	if (dev->readonly) return 0;
+	if (offset >= block_length(dev)) return 0;
+	if (offset + size > block_length(dev)) size = block_length(dev) - offset;
+	if (!size) return 0;
+
+	uint64_t start_block = offset / ss;
+	uint64_t end_block = (offset + size - 1) / ss;
+	unsigned int x_offset = 0;
+
+	if (offset % ss || size < ss) {
+		/* Partial sectors are read, patched and written back */
+		unsigned int prefix_size = ss - (offset % ss);
+		if (prefix_size > size) prefix_size = size;
+		uint8_t * tmp = malloc(ss);
+		if (block_sectors(dev, start_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(tmp + (offset % ss), buffer, prefix_size);
+		if (block_sectors(dev, start_block, 1, tmp, 1)) {
+			free(tmp);
+			return 0;
+		}
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % ss && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % ss;
+		uint8_t * tmp = malloc(ss);
+		if (block_sectors(dev, end_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(tmp, buffer + size - postfix_size, postfix_size);
+		if (block_sectors(dev, end_block, 1, tmp, 1)) {
+			free(tmp);
+			return 0;
+		}
+		free(tmp);
+		end_block--;
+	}
+
+	if (start_block <= end_block) {
+		if (block_sectors(dev, start_block, end_block - start_block + 1, buffer + x_offset, 1)) {
+			return 0;
+		}
+	}
+
+	return size;
+}
+
+static void open_block(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_block(fs_node_t * node) {
+	return;
+}
+
+fs_node_t * block_register(block_device_t * dev) {
+	mutex_init(&dev->lock);
+	dev->plugged  = 0;
+	dev->queue    = NULL;
+	dev->queued   = 0;
+	dev->position = 0;
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, dev->name);
+	fnode->device  = dev;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = dev->readonly ? 0440 : 0660;
+	fnode->length  = block_length(dev);
+	fnode->flags   = FS_BLOCKDEVICE | FS_CACHED;
+	fnode->read    = read_block;
+	fnode->write   = dev->readonly ? NULL : write_block;
+	fnode->open    = open_block;
+	fnode->close   = close_block;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = NULL;
+
+	dev->node = fnode;
+	return fnode;
+}
+
+/*
+ * Partitions pass straight through to the disk's node, which checks
+ * bounds again, keeps the page cache in step, and does the work.
+ */
+static uint32_t read_partition(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct block_partition * part = node->device;
+	if (offset >= part->length) return 0;
+	if (offset + size > part->length) size = part->length - offset;
+	return read_fs(part->disk, part->offset + offset, size, buffer);
+}
+
+static uint32_t write_partition(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct block_partition * part = node->device;
+	if (offset >= part->length) return 0;
+	if (offset + size > part->length) size = part->length - offset;
+	return write_fs(part->disk, part->offset + offset, size, buffer);
+}
+
+fs_node_t * block_partition(fs_node_t * disk, uint64_t first, uint64_t count, char * name) {
+	block_device_t * dev = block_device_of(disk);
+	if (!dev) return NULL;
+
+	if (first >= dev->sectors) return NULL;
+	if (first + count > dev->sectors) {
+		debug_print(WARNING, "%s: partition %s runs past the end of the disk; clamped", dev->name, name);
+		count = dev->sectors - first;
+	}
+
+	struct block_partition * part = malloc(sizeof(struct block_partition));
+	part->disk   = disk;
+	part->dev    = dev;
+	part->offset = first * dev->sector_size;
+	part->length = count * dev->sector_size;
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, name);
+	fnode->device  = part;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = disk->mask;
+	fnode->length  = part->length;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_partition;
+	fnode->write   = disk->write ? write_partition : NULL;
+	fnode->open    = open_block;
+	fnode->close   = close_block;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = NULL;
+	return fnode;
+}
+
+block_device_t * block_device_of(fs_node_t * node) {
+	if (!node) return NULL;
+	if (node->read == read_block) return node->device;
+	if (node->read == read_partition) return ((struct block_partition *)node->device)->dev;
+	return NULL;
+}
+
+void block_plug(fs_node_t * node) {
+	block_device_t * dev = block_device_of(node);
+	if (!dev) return;
+	mutex_lock(&dev->lock);
+	dev->plugged++;
+	mutex_unlock(&dev->lock);
+}
+
+void block_unplug(fs_node_t * node) {
+	block_device_t * dev = block_device_of(node);
+	if (!dev) return;
+	mutex_lock(&dev->lock);
+	if (dev->plugged && !--dev->plugged) {
+		run_queue(dev);
+	}
+	mutex_unlock(&dev->lock);
+}
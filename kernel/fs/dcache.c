@@ -0,0 +1,218 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Directory Entry Cache
+ *
+ * Remembers the result of finddir() on directories marked FS_DCACHE,
+ * keyed by (parent directory, name), so kopen() does not go back to the
+ * filesystem for every component of every path. Entries are either a
+ * copy of the node that was found or a negative entry for a name that
+ * does not exist. Only directories and symlinks are kept as positive
+ * entries, since those are all a path walk passes through; the node
+ * at the end of a path is always looked up fresh.
+ *
+ * The VFS drops entries when it creates or removes names through
+ * create_file_fs() and friends, and flushes everything on mounts and
+ * whenever a directory is removed.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/slab.h>
+#include <kernel/logging.h>
+
+#define DCACHE_BUCKETS 512  /* Must be a power of two */
+#define DCACHE_LIMIT   4096 /* Entries we are willing to hold */
+
+typedef struct dentry {
+	/* Identity of the parent directory */
+	finddir_type_t dir_finddir;
+	void * dir_device;
+	uint32_t dir_inode;
+
+	unsigned int hash;
+	char * name;
+	fs_node_t * node; /* NULL for a negative entry */
+
+	struct dentry * hash_next;
+	struct dentry * lru_prev; /* More recently used */
+	struct dentry * lru_next; /* Less recently used */
+} dentry_t;
+
+static spin_lock_t dcache_lock = { 0 };
+static dentry_t * dcache_hash[DCACHE_BUCKETS] = { NULL };
+static dentry_t * lru_head = NULL;
+static dentry_t * lru_tail = NULL;
+
+uint32_t dcache_entries = 0;
+
+static unsigned int dcache_hash_key(fs_node_t * dir, char * name) {
+	unsigned int hash = ((uintptr_t)dir->device >> 4) ^ dir->inode ^ ((uintptr_t)dir->finddir >> 4);
+	while (*name) {
+		hash = hash * 31 + (unsigned char)*name++;
+	}
+	return hash;
+}
+
+static dentry_t * dcache_find(fs_node_t * dir, char * name, unsigned int hash) {
+	dentry_t * entry = dcache_hash[hash & (DCACHE_BUCKETS - 1)];
+	while (entry) {
+		if (entry->hash == hash &&
+			entry->dir_finddir == dir->finddir &&
+			entry->dir_device == dir->device &&
+			entry->dir_inode == dir->inode &&
+			!strcmp(entry->name, name)) {
+			return entry;
+		}
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+static void lru_unlink(dentry_t * entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else lru_head = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push(dentry_t * entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = entry;
+	lru_head = entry;
+	if (!lru_tail) lru_tail = entry;
+}
+
+static void dcache_remove(dentry_t * entry) {
+	dentry_t ** link = &dcache_hash[entry->hash & (DCACHE_BUCKETS - 1)];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	lru_unlink(entry);
+	free(entry->name);
+	if (entry->node) free(entry->node);
+	free(entry);
+	dcache_entries--;
+}
+
+/*
+ * Look up `name` in `dir`. Returns 0 on a miss; otherwise 1, with
+ * *node set to a fresh copy of the cached node, or to NULL if the
+ * name is known not to exist.
+ */
+int dcache_lookup(fs_node_t * dir, char * name, fs_node_t ** node) {
+	if (!(dir->flags & FS_DCACHE)) return 0;
+
+	unsigned int hash = dcache_hash_key(dir, name);
+	int found = 0;
+
+	spin_lock(dcache_lock);
+	dentry_t * entry = dcache_find(dir, name, hash);
+	if (entry) {
+		lru_unlink(entry);
+		lru_push(entry);
+		if (entry->node) {
+			*node = slab_alloc(&fs_node_cache);
+			memcpy(*node, entry->node, sizeof(fs_node_t));
+			(*node)->refcount = 0;
+		} else {
+			*node = NULL;
+		}
+		found = 1;
+	}
+	spin_unlock(dcache_lock);
+
+	return found;
+}
+
+/*
+ * Remember what finddir() returned for `name` in `dir`; `node` may be
+ * NULL to record that the name does not exist. Anything other than a
+ * directory or symlink is ignored.
+ */
+void dcache_insert(fs_node_t * dir, char * name, fs_node_t * node) {
+	if (!(dir->flags & FS_DCACHE)) return;
+	if (node && !(node->flags & (FS_DIRECTORY | FS_SYMLINK))) return;
+
+	unsigned int hash = dcache_hash_key(dir, name);
+
+	spin_lock(dcache_lock);
+
+	dentry_t * entry = dcache_find(dir, name, hash);
+	if (entry) {
+		dcache_remove(entry);
+	}
+
+	while (dcache_entries >= DCACHE_LIMIT && lru_tail) {
+		dcache_remove(lru_tail);
+	}
+
+	entry = malloc(sizeof(dentry_t));
+	entry->dir_finddir = dir->finddir;
+	entry->dir_device  = dir->device;
+	entry->dir_inode   = dir->inode;
+	entry->hash        = hash;
+	entry->name        = strdup(name);
+	entry->node        = NULL;
+	if (node) {
+		entry->node = slab_alloc(&fs_node_cache);
+		memcpy(entry->node, node, sizeof(fs_node_t));
+	}
+
+	unsigned int bucket = hash & (DCACHE_BUCKETS - 1);
+	entry->hash_next = dcache_hash[bucket];
+	dcache_hash[bucket] = entry;
+	lru_push(entry);
+	dcache_entries++;
+
+	spin_unlock(dcache_lock);
+}
+
+/*
+ * Forget `name` in `dir`, after it was created or removed.
+ */
+void dcache_invalidate(fs_node_t * dir, char * name) {
+	if (!(dir->flags & FS_DCACHE)) return;
+
+	unsigned int hash = dcache_hash_key(dir, name);
+
+	spin_lock(dcache_lock);
+	dentry_t * entry = dcache_find(dir, name, hash);
+	if (entry) {
+		dcache_remove(entry);
+	}
+	spin_unlock(dcache_lock);
+}
+
+/*
+ * Drop everything, when memory is short; skipped if the cache is busy.
+ * Returns roughly how many kB that released.
+ */
+uint32_t dcache_reclaim(void) {
+	if (dcache_lock[0]) return 0;
+
+	spin_lock(dcache_lock);
+	uint32_t before = dcache_entries;
+	while (lru_tail) {
+		dcache_remove(lru_tail);
+	}
+	spin_unlock(dcache_lock);
+	return before * (sizeof(dentry_t) + sizeof(fs_node_t)) / 1024;
+}
+
+/*
+ * Forget everything. Used when a directory goes away, as its inode may
+ * be reused for a new one, and when mounts change what paths lead to.
+ */
+void dcache_flush(void) {
+	spin_lock(dcache_lock);
+	while (lru_tail) {
+		dcache_remove(lru_tail);
+	}
+	spin_unlock(dcache_lock);
+}
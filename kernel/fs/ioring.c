@@ -0,0 +1,297 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Asynchronous I/O rings
+ *
+ * Every ring has a worker tasklet that shares its creator's address
+ * space, so it can post completions to the ring and move data in and
+ * out of the program's buffers directly while the program runs.
+ *
+ * Requests are checked, and their descriptors turned into nodes, by
+ * ioring_enter() on the program's side; the worker only ever sees
+ * nodes it holds a reference to, never the descriptor table. Once the
+ * ring is closed nothing is written to the program's memory again;
+ * whatever is still queued is dropped and the worker exits.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/printf.h>
+
+#include <sys/ioring.h>
+
+typedef struct {
+	uint8_t     op;
+	fs_node_t * node;       /* NULL for a NOP or a request that already failed */
+	uint64_t    offset;
+	uint8_t *   buf;
+	uint32_t    len;
+	uint64_t    user_data;
+	int32_t     error;      /* If it failed while being submitted */
+} ioring_request_t;
+
+typedef struct {
+	struct ioring * user;   /* In the program's memory */
+	uint32_t  mask;
+	uint32_t  sq_head;      /* Our copies; the program could scribble on its own */
+	uint32_t  cq_tail;
+	uint32_t  in_flight;    /* Taken from the submission queue, not yet completed */
+
+	list_t *  pending;      /* ioring_request_t, oldest first */
+	list_t *  worker_queue; /* The worker sleeps here when there is nothing to do */
+	list_t *  completion_queue; /* ioring_enter() waits here for completions */
+	list_t *  alert_waiters;    /* Processes in fswait() / poll() */
+	spin_lock_t lock;
+	int       dying;
+} ioring_t;
+
+/* Completions the program has not reaped yet */
+static uint32_t ioring_unreaped(ioring_t * ring) {
+	uint32_t unreaped = ring->cq_tail - ring->user->cq_head;
+	return unreaped > ring->mask + 1 ? ring->mask + 1 : unreaped;
+}
+
+static void ioring_alert_waiters(ioring_t * ring) {
+	while (ring->alert_waiters->head) {
+		node_t * node = list_dequeue(ring->alert_waiters);
+		process_alert_node(node->value, ring);
+		free(node);
+	}
+}
+
+static void ioring_complete(ioring_t * ring, uint64_t user_data, int32_t res) {
+	spin_lock(ring->lock);
+	ring->in_flight--;
+	if (!ring->dying) {
+		struct ioring_cqe * cqe = &ring->user->cqes[ring->cq_tail & ring->mask];
+		cqe->user_data = user_data;
+		cqe->res = res;
+		cqe->_reserved = 0;
+		ring->cq_tail++;
+		ring->user->cq_tail = ring->cq_tail;
+	}
+	spin_unlock(ring->lock);
+
+	if (ring->completion_queue->length) {
+		wakeup_queue(ring->completion_queue);
+	}
+	ioring_alert_waiters(ring);
+}
+
+static void ioring_worker(void * data, char * name) {
+	ioring_t * ring = data;
+
+	while (1) {
+		IRQ_OFF;
+		spin_lock(ring->lock);
+		if (!ring->pending->length) {
+			int dying = ring->dying;
+			spin_unlock(ring->lock);
+			if (dying) {
+				IRQ_RES;
+				break;
+			}
+			sleep_on(ring->worker_queue);
+			IRQ_RES;
+			continue;
+		}
+		node_t * node = list_dequeue(ring->pending);
+		spin_unlock(ring->lock);
+		IRQ_RES;
+
+		ioring_request_t * req = node->value;
+		free(node);
+
+		int32_t res = req->error;
+		if (ring->dying) {
+			res = -ECANCELED;
+		} else if (req->node && req->op == IORING_OP_READ) {
+			res = (int32_t)read_fs(req->node, req->offset, req->len, req->buf);
+		} else if (req->node && req->op == IORING_OP_WRITE) {
+			res = (int32_t)write_fs(req->node, req->offset, req->len, req->buf);
+		}
+
+		if (req->node) {
+			close_fs(req->node);
+		}
+		ioring_complete(ring, req->user_data, res);
+		free(req);
+	}
+
+	list_free(ring->pending);
+	free(ring->pending);
+	list_free(ring->worker_queue);
+	free(ring->worker_queue);
+	list_free(ring->completion_queue);
+	free(ring->completion_queue);
+	list_free(ring->alert_waiters);
+	free(ring->alert_waiters);
+	free(ring);
+}
+
+/*
+ * Check a request on the program's side and take a reference to its
+ * file. Buffers are touched here, in the program's own context, so
+ * that copy-on-write and mmap() faults are dealt with before the
+ * worker gets to them.
+ */
+static void ioring_prepare(struct ioring_sqe * sqe, ioring_request_t * req) {
+	memset(req, 0, sizeof(ioring_request_t));
+	req->op        = sqe->op;
+	req->offset    = sqe->offset;
+	req->buf       = sqe->buf;
+	req->len       = sqe->len;
+	req->user_data = sqe->user_data;
+
+	if (sqe->op == IORING_OP_NOP) return;
+
+	if (sqe->op != IORING_OP_READ && sqe->op != IORING_OP_WRITE) {
+		req->error = -EINVAL;
+		return;
+	}
+
+	fd_table_t * fds = current_process->fds;
+	if (sqe->fd < 0 || sqe->fd >= (int)fds->length || !fds->entries[sqe->fd].node) {
+		req->error = -EBADF;
+		return;
+	}
+	int mode = fds->entries[sqe->fd].mode;
+	if ((sqe->op == IORING_OP_READ && !(mode & 01)) || (sqe->op == IORING_OP_WRITE && !(mode & 02))) {
+		req->error = -EBADF;
+		return;
+	}
+	if (!req->len) {
+		return;
+	}
+	if ((uintptr_t)req->buf <= current_process->image.entry || (uintptr_t)req->buf + req->len < (uintptr_t)req->buf) {
+		req->error = -EFAULT;
+		return;
+	}
+
+	for (uintptr_t page = (uintptr_t)req->buf & ~0xFFF; page < (uintptr_t)req->buf + req->len; page += 0x1000) {
+		volatile uint8_t * p = (uint8_t *)(page < (uintptr_t)req->buf ? (uintptr_t)req->buf : page);
+		if (sqe->op == IORING_OP_READ) {
+			*p = *p;
+		} else {
+			(void)*p;
+		}
+	}
+
+	req->node = clone_fs(fds->entries[sqe->fd].node);
+}
+
+int ioring_enter(fs_node_t * node, uint32_t to_submit, uint32_t min_complete) {
+	if (!node || node->close != close_ioring) return -EBADF;
+
+	ioring_t * ring = node->device;
+	uint32_t submitted = 0;
+
+	while (submitted < to_submit) {
+		spin_lock(ring->lock);
+		if (ring->sq_head == ring->user->sq_tail ||
+			ring->in_flight + ioring_unreaped(ring) > ring->mask) {
+			spin_unlock(ring->lock);
+			break;
+		}
+		struct ioring_sqe sqe;
+		memcpy(&sqe, &ring->user->sqes[ring->sq_head & ring->mask], sizeof(struct ioring_sqe));
+		ring->sq_head++;
+		ring->user->sq_head = ring->sq_head;
+		ring->in_flight++;
+		spin_unlock(ring->lock);
+
+		ioring_request_t * req = malloc(sizeof(ioring_request_t));
+		ioring_prepare(&sqe, req);
+
+		spin_lock(ring->lock);
+		list_insert(ring->pending, req);
+		spin_unlock(ring->lock);
+		submitted++;
+	}
+
+	if (submitted && ring->worker_queue->length) {
+		wakeup_queue(ring->worker_queue);
+	}
+
+	/* Don't wait for more than can ever arrive */
+	while (min_complete) {
+		spin_lock(ring->lock);
+		uint32_t possible = ring->in_flight + ioring_unreaped(ring);
+		uint32_t ready = ioring_unreaped(ring);
+		spin_unlock(ring->lock);
+		if (ready >= min_complete || ready == possible) break;
+		if (sleep_on(ring->completion_queue)) {
+			return submitted ? (int)submitted : -EINTR;
+		}
+	}
+
+	return submitted;
+}
+
+void close_ioring(fs_node_t * node) {
+	ioring_t * ring = node->device;
+
+	spin_lock(ring->lock);
+	ring->dying = 1;
+	spin_unlock(ring->lock);
+
+	/* The worker drops what's left and frees the ring */
+	wakeup_queue(ring->worker_queue);
+}
+
+static int ioring_check(fs_node_t * node) {
+	ioring_t * ring = node->device;
+	return ioring_unreaped(ring) ? 0 : 1;
+}
+
+static int ioring_wait(fs_node_t * node, void * process) {
+	ioring_t * ring = node->device;
+
+	if (!list_find(ring->alert_waiters, process)) {
+		list_insert(ring->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, ring);
+
+	return 0;
+}
+
+fs_node_t * ioring_create(struct ioring * user) {
+	uint32_t entries = user->entries;
+	if (!entries || entries > IORING_MAX_ENTRIES || (entries & (entries - 1))) {
+		return NULL;
+	}
+
+	ioring_t * ring = malloc(sizeof(ioring_t));
+	memset(ring, 0, sizeof(ioring_t));
+	ring->user    = user;
+	ring->mask    = entries - 1;
+	ring->sq_head = user->sq_head;
+	ring->cq_tail = user->cq_tail;
+	ring->pending = list_create();
+	ring->worker_queue = list_create();
+	ring->completion_queue = list_create();
+	ring->alert_waiters = list_create();
+	spin_init(ring->lock);
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+	sprintf(fnode->name, "[ioring]");
+	fnode->mask  = 0600;
+	fnode->uid   = current_process->user;
+	fnode->gid   = current_process->user;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->device = ring;
+	fnode->close = close_ioring;
+	fnode->selectcheck = ioring_check;
+	fnode->selectwait  = ioring_wait;
+	fnode->atime = now();
+	fnode->mtime = fnode->atime;
+	fnode->ctime = fnode->atime;
+
+	create_user_tasklet(ioring_worker, "[ioring]", ring);
+
+	return fnode;
+}
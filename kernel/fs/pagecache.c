@@ -0,0 +1,197 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Block Device Page Cache
+ *
+ * Caches page-sized chunks of block devices whose nodes are marked
+ * FS_CACHED, keyed by (device object, page index). read_fs() sends
+ * reads on those nodes here; write_fs() drops any pages it overwrites.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/logging.h>
+#include <kernel/pageindex.h>
+
+#define PAGECACHE_PAGE_SIZE 0x1000
+#define PAGECACHE_BUCKETS   1024  /* Must be a power of two */
+#define PAGECACHE_READAHEAD 8     /* Pages fetched by one miss */
+
+typedef struct pagecache_page {
+	page_index_entry_t entry; /* Keyed by the page index on the device */
+	uint8_t * data;
+} pagecache_page_t;
+
+static spin_lock_t pagecache_lock = { 0 };
+static page_index_t pagecache_index = { 0 };
+static uint8_t * readahead_buffer = NULL;
+
+/*
+ * Pages we are willing to hold; 1/16th of system memory.
+ */
+static uint32_t pagecache_limit(void) {
+	return memory_total() / 4 / 16;
+}
+
+/*
+ * Memory is considered tight once less than 1/16th of it is free.
+ */
+static int pagecache_pressure(void) {
+	return (memory_total() - memory_use()) < memory_total() / 16;
+}
+
+static pagecache_page_t * pagecache_lookup(void * device, uint64_t index) {
+	return (pagecache_page_t *)page_index_lookup(&pagecache_index, device, index);
+}
+
+static void pagecache_remove(pagecache_page_t * page) {
+	page_index_remove(&pagecache_index, &page->entry);
+	free(page->data);
+	free(page);
+}
+
+/*
+ * Drop least recently used pages until we are under `target`.
+ */
+static void pagecache_shrink(uint32_t target) {
+	while (pagecache_index.count > target && pagecache_index.lru_tail) {
+		pagecache_remove((pagecache_page_t *)pagecache_index.lru_tail);
+	}
+}
+
+static void pagecache_insert(void * device, uint64_t index, uint8_t * data) {
+	if (pagecache_pressure()) {
+		/* Give back half of what we hold rather than grow */
+		pagecache_shrink(pagecache_index.count / 2);
+		if (pagecache_pressure()) return;
+	} else if (pagecache_index.count >= pagecache_limit()) {
+		pagecache_shrink(pagecache_limit() - 1);
+	}
+
+	pagecache_page_t * page = malloc(sizeof(pagecache_page_t));
+	page->entry.device = device;
+	page->entry.key    = index;
+	page->data = malloc(PAGECACHE_PAGE_SIZE);
+	memcpy(page->data, data, PAGECACHE_PAGE_SIZE);
+	page_index_insert(&pagecache_index, &page->entry);
+}
+
+/*
+ * Read `index` and the pages following it from the device in one go,
+ * caching all of them. Returns the requested page, if it could be cached.
+ */
+static pagecache_page_t * pagecache_fill(fs_node_t * node, uint64_t index) {
+	uint32_t count = PAGECACHE_READAHEAD;
+	if (node->length) {
+		uint64_t last = ((uint64_t)node->length + PAGECACHE_PAGE_SIZE - 1) / PAGECACHE_PAGE_SIZE;
+		if (index >= last) return NULL;
+		if (index + count > last) count = last - index;
+	}
+
+	/* Stop short of pages we already have */
+	for (uint32_t i = 1; i < count; ++i) {
+		if (pagecache_lookup(node->device, index + i)) {
+			count = i;
+			break;
+		}
+	}
+
+	uint32_t size = count * PAGECACHE_PAGE_SIZE;
+	uint32_t got = node->read(node, index * PAGECACHE_PAGE_SIZE, size, readahead_buffer);
+	if (got == (uint32_t)-1 || got == 0) return NULL;
+	if (got < size) {
+		memset(readahead_buffer + got, 0, size - got);
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		pagecache_insert(node->device, index + i, readahead_buffer + i * PAGECACHE_PAGE_SIZE);
+	}
+
+	return pagecache_lookup(node->device, index);
+}
+
+/*
+ * read_fs() for FS_CACHED nodes.
+ */
+uint32_t pagecache_read(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	if (node->length) {
+		if (offset >= node->length) return 0;
+		if (offset + size > node->length) size = node->length - offset;
+	}
+
+	spin_lock(pagecache_lock);
+
+	if (!pagecache_index.hash) {
+		page_index_init(&pagecache_index, PAGECACHE_BUCKETS);
+		readahead_buffer = malloc(PAGECACHE_PAGE_SIZE * PAGECACHE_READAHEAD);
+	}
+
+	uint32_t done = 0;
+	while (done < size) {
+		uint64_t index = (offset + done) / PAGECACHE_PAGE_SIZE;
+		uint32_t page_offset = (offset + done) % PAGECACHE_PAGE_SIZE;
+		uint32_t chunk = PAGECACHE_PAGE_SIZE - page_offset;
+		if (chunk > size - done) chunk = size - done;
+
+		pagecache_page_t * page = pagecache_lookup(node->device, index);
+		if (page) {
+			page_index_touch(&pagecache_index, &page->entry);
+		} else {
+			page = pagecache_fill(node, index);
+		}
+
+		if (page) {
+			memcpy(buffer + done, page->data + page_offset, chunk);
+		} else {
+			/* Could not cache it; read directly */
+			uint32_t got = node->read(node, offset + done, chunk, buffer + done);
+			if (got == (uint32_t)-1 || got < chunk) {
+				if (got != (uint32_t)-1) done += got;
+				break;
+			}
+		}
+		done += chunk;
+	}
+
+	spin_unlock(pagecache_lock);
+	return done;
+}
+
+/*
+ * Drop everything, when memory is short. Skipped if the cache is busy,
+ * as it is when the request comes from a fault taken while reading
+ * through it. Returns kB released.
+ */
+uint32_t pagecache_reclaim(void) {
+	if (pagecache_lock[0] || !pagecache_index.hash) return 0;
+
+	spin_lock(pagecache_lock);
+	uint32_t before = pagecache_index.count;
+	pagecache_shrink(0);
+	spin_unlock(pagecache_lock);
+	return before * (PAGECACHE_PAGE_SIZE / 1024);
+}
+
+/*
+ * Pages held, for /proc/meminfo.
+ */
+uint32_t pagecache_count(void) {
+	return pagecache_index.count;
+}
+
+/*
+ * Forget cached pages overlapping a write to a device.
+ */
+void pagecache_invalidate(fs_node_t * node, uint64_t offset, uint32_t size) {
+	if (!pagecache_index.hash || !size) return;
+
+	spin_lock(pagecache_lock);
+	uint64_t first = offset / PAGECACHE_PAGE_SIZE;
+	uint64_t last  = (offset + size - 1) / PAGECACHE_PAGE_SIZE;
+	for (uint64_t index = first; index <= last; ++index) {
+		pagecache_page_t * page = pagecache_lookup(node->device, index);
+		if (page) pagecache_remove(page);
+	}
+	spin_unlock(pagecache_lock);
+}
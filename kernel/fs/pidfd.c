@@ -0,0 +1,85 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Process descriptors
+ *
+ * A pidfd is ready once its process has exited, so an event loop can
+ * fswait() on children along with everything else it watches, and
+ * then collect them with waitpid(pid, ..., WNOHANG). It also stays
+ * ready after the process is gone; the start time tells the process
+ * apart from a later one that gets the same pid.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+
+typedef struct {
+	pid_t pid;
+	struct timeval start;
+} pidfd_t;
+
+/* The process, if it's still around */
+static process_t * pidfd_process(fs_node_t * node) {
+	pidfd_t * pidfd = node->device;
+	process_t * proc = process_from_pid(pidfd->pid);
+	if (!proc || proc->start.tv_sec != pidfd->start.tv_sec || proc->start.tv_usec != pidfd->start.tv_usec) {
+		return NULL;
+	}
+	return proc;
+}
+
+static int pidfd_check(fs_node_t * node) {
+	process_t * proc = pidfd_process(node);
+	if (!proc || proc->finished) {
+		return 0;
+	}
+	return 1;
+}
+
+static int pidfd_wait(fs_node_t * node, void * process) {
+	process_t * proc = pidfd_process(node);
+	if (!proc) return 0;
+
+	if (!proc->exit_watchers) {
+		proc->exit_watchers = list_create();
+	}
+
+	if (!list_find(proc->exit_watchers, process)) {
+		list_insert(proc->exit_watchers, process);
+	}
+	list_insert(((process_t *)process)->node_waits, proc);
+
+	return 0;
+}
+
+static void pidfd_close(fs_node_t * node) {
+	free(node->device);
+}
+
+fs_node_t * make_pidfd(process_t * proc) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	pidfd_t * pidfd = malloc(sizeof(pidfd_t));
+	memset(fnode, 0, sizeof(fs_node_t));
+
+	pidfd->pid = proc->id;
+	pidfd->start = proc->start;
+
+	sprintf(fnode->name, "[pidfd:%d]", proc->id);
+	fnode->inode = proc->id;
+	fnode->mask  = 0444;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->device = pidfd;
+
+	fnode->close = pidfd_close;
+	fnode->selectcheck = pidfd_check;
+	fnode->selectwait  = pidfd_wait;
+
+	fnode->atime = now();
+	fnode->mtime = fnode->atime;
+	fnode->ctime = fnode->atime;
+
+	return fnode;
+}
@@ -48,18 +48,8 @@ int pipe_unsize(fs_node_t * node) {
 	return pipe_available(pipe);
 }
 
-static inline void pipe_increment_read(pipe_device_t * pipe) {
-	pipe->read_ptr++;
-	if (pipe->read_ptr == pipe->size) {
-		pipe->read_ptr = 0;
-	}
-}
-
-static inline void pipe_increment_write(pipe_device_t * pipe) {
-	pipe->write_ptr++;
-	if (pipe->write_ptr == pipe->size) {
-		pipe->write_ptr = 0;
-	}
+static inline void pipe_increment_read_by(pipe_device_t * pipe, size_t amount) {
+	pipe->read_ptr = (pipe->read_ptr + amount) % pipe->size;
 }
 
 static inline void pipe_increment_write_by(pipe_device_t * pipe, size_t amount) {
@@ -104,19 +94,28 @@ uint32_t read_pipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buf
 	size_t collected = 0;
 	while (collected == 0) {
 		spin_lock(pipe->lock_read);
-		while (pipe_unread(pipe) > 0 && collected < size) {
-			buffer[collected] = pipe->buffer[pipe->read_ptr];
-			pipe_increment_read(pipe);
-			collected++;
+		size_t count = pipe_unread(pipe);
+		if (count > size) count = size;
+		if (count) {
+			size_t first = pipe->size - pipe->read_ptr;
+			if (first > count) first = count;
+			memcpy(buffer, &pipe->buffer[pipe->read_ptr], first);
+			memcpy(buffer + first, pipe->buffer, count - first);
+			pipe_increment_read_by(pipe, count);
+			collected = count;
 		}
 		spin_unlock(pipe->lock_read);
-		wakeup_queue(pipe->wait_queue_writers);
 		/* Deschedule and switch */
 		if (collected == 0) {
 			sleep_on(pipe->wait_queue_readers);
 		}
 	}
 
+	/* Let writers at it once there's a good amount of room */
+	if (pipe->wait_queue_writers->length && pipe_available(pipe) >= pipe->size / 2) {
+		wakeup_queue(pipe->wait_queue_writers);
+	}
+
 	return collected;
 }
 
@@ -149,30 +148,25 @@ uint32_t write_pipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *bu
 	while (written < size) {
 		spin_lock(pipe->lock_write);
 
-#if 0
-		size_t available = 0;
-		if (pipe->read_ptr <= pipe->write_ptr) {
-			available = pipe->size - pipe->write_ptr;
-		} else {
-			available = pipe->read_ptr - pipe->write_ptr - 1;
-		}
-		if (available) {
-			available = min(available, size - written);
-			memcpy(&pipe->buffer[pipe->write_ptr], buffer, available);
-			pipe_increment_write_by(pipe, available);
-			written += available;
+		size_t count = pipe_available(pipe);
+		if (count > size - written) count = size - written;
+		if (count) {
+			size_t first = pipe->size - pipe->write_ptr;
+			if (first > count) first = count;
+			memcpy(&pipe->buffer[pipe->write_ptr], buffer + written, first);
+			memcpy(pipe->buffer, buffer + written + first, count - first);
+			pipe_increment_write_by(pipe, count);
+			written += count;
 		}
-#else
-		while (pipe_available(pipe) > 0 && written < size) {
-			pipe->buffer[pipe->write_ptr] = buffer[written];
-			pipe_increment_write(pipe);
-			written++;
-		}
-#endif
 
 		spin_unlock(pipe->lock_write);
-		wakeup_queue(pipe->wait_queue_readers);
-		pipe_alert_waiters(pipe);
+		if (count) {
+			/* Readers only wait on an empty pipe; usually there are none */
+			if (pipe->wait_queue_readers->length) {
+				wakeup_queue(pipe->wait_queue_readers);
+			}
+			pipe_alert_waiters(pipe);
+		}
 		if (written < size) {
 			sleep_on(pipe->wait_queue_writers);
 		}
@@ -6,6 +6,13 @@
  * Ramdisk driver.
  *
  * Provide raw block access to files loaded into kernel memory.
+ *
+ * Images built by createramdisk.py --compress are split into blocks
+ * that were each LZ4-compressed on their own, with an index of where
+ * each one starts. These are presented as the uncompressed device;
+ * only the blocks that are read get decompressed, and what comes out
+ * goes through the page cache, which can drop it again under memory
+ * pressure. Compressed ramdisks are read-only.
  */
 
 #include <kernel/system.h>
@@ -14,6 +21,31 @@
 #include <kernel/fs.h>
 #include <kernel/printf.h>
 #include <kernel/mem.h>
+#include <kernel/lz4.h>
+
+#define RAMDISK_Z_MAGIC "TOARURZ1"
+#define RAMDISK_Z_MAX_BLOCK 0x100000
+
+struct ramdisk_z_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t length;    /* Uncompressed */
+	uint32_t reserved;
+	/* uint32_t offsets[block_count + 1], from the start of the image, follow */
+};
+
+struct ramdisk_z {
+	uintptr_t location;
+	size_t image_size;
+	struct ramdisk_z_header * header;
+	uint32_t * offsets;
+
+	/* The last block decompressed, since reads come a page at a time */
+	uint8_t * block;
+	int block_index;
+	spin_lock_t lock;
+};
 
 static uint32_t read_ramdisk(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
 static uint32_t write_ramdisk(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
@@ -50,6 +82,60 @@ static uint32_t write_ramdisk(fs_node_t *node, uint64_t offset, uint32_t size, u
 	return size;
 }
 
+/* Make `index` the decompressed block; called with the lock held */
+static int ramdisk_z_load(struct ramdisk_z * z, uint32_t index) {
+	if (z->block_index == (int)index) return 0;
+
+	uint32_t block_size = z->header->block_size;
+	uint32_t raw = z->header->length - index * block_size;
+	if (raw > block_size) raw = block_size;
+
+	uint8_t * start = (uint8_t *)(z->location + z->offsets[index]);
+	uint32_t packed = z->offsets[index + 1] - z->offsets[index];
+
+	if (packed == raw) {
+		/* Didn't compress; stored as is */
+		memcpy(z->block, start, raw);
+	} else if (lz4_decompress(start, packed, z->block, raw) != (int)raw) {
+		debug_print(ERROR, "ramdisk: block %d is corrupt", index);
+		z->block_index = -1;
+		return -EIO;
+	}
+
+	z->block_index = index;
+	return 0;
+}
+
+static uint32_t read_ramdisk_z(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	struct ramdisk_z * z = node->device;
+
+	if (offset > node->length) {
+		return 0;
+	}
+
+	if (offset + size > node->length) {
+		size = node->length - offset;
+	}
+
+	uint32_t block_size = z->header->block_size;
+	uint32_t done = 0;
+
+	spin_lock(z->lock);
+	while (done < size) {
+		uint32_t index = (offset + done) / block_size;
+		uint32_t in_block = (offset + done) % block_size;
+		uint32_t chunk = block_size - in_block;
+		if (chunk > size - done) chunk = size - done;
+
+		if (ramdisk_z_load(z, index)) break;
+		memcpy(buffer + done, z->block + in_block, chunk);
+		done += chunk;
+	}
+	spin_unlock(z->lock);
+
+	return done;
+}
+
 static void open_ramdisk(fs_node_t * node, unsigned int flags) {
 	return;
 }
@@ -58,6 +144,16 @@ static void close_ramdisk(fs_node_t * node) {
 	return;
 }
 
+static void ramdisk_free_frames(uintptr_t location, size_t size) {
+	if (size >= 0x1000) {
+		/* It would be a very bad idea to wipe the wrong page here. */
+		size -= size % 0x1000;
+		for (uintptr_t i = location; i < location + size; i += 0x1000) {
+			clear_frame(i);
+		}
+	}
+}
+
 static int ioctl_ramdisk(fs_node_t * node, int request, void * argp) {
 	switch (request) {
 		case 0x4001:
@@ -65,14 +161,15 @@ static int ioctl_ramdisk(fs_node_t * node, int request, void * argp) {
 				return -EPERM;
 			} else {
 				/* Clear all of the memory used by this ramdisk */
-				if (node->length >= 0x1000) {
-					if (node->length % 0x1000) {
-						/* It would be a very bad idea to wipe the wrong page here. */
-						node->length -= node->length % 0x1000;
-					}
-					for (uintptr_t i = node->inode; i < (node->inode + node->length); i += 0x1000) {
-						clear_frame(i);
-					}
+				if (node->read == read_ramdisk_z) {
+					struct ramdisk_z * z = node->device;
+					pagecache_invalidate(node, 0, node->length);
+					ramdisk_free_frames(z->location, z->image_size);
+					free(z->block);
+					z->block = NULL;
+					z->block_index = -1;
+				} else {
+					ramdisk_free_frames(node->inode, node->length);
 				}
 				/* Mark the file length as 0 */
 				node->length = 0;
@@ -83,6 +180,13 @@ static int ioctl_ramdisk(fs_node_t * node, int request, void * argp) {
 	}
 }
 
+static int ramdisk_z_index_ok(uint32_t * offsets, uint32_t block_count) {
+	for (uint32_t i = 0; i < block_count; ++i) {
+		if (offsets[i] > offsets[i + 1]) return 0;
+	}
+	return 1;
+}
+
 static fs_node_t * ramdisk_device_create(int device_number, uintptr_t location, size_t size) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -98,6 +202,38 @@ static fs_node_t * ramdisk_device_create(int device_number, uintptr_t location,
 	fnode->open    = open_ramdisk;
 	fnode->close   = close_ramdisk;
 	fnode->ioctl   = ioctl_ramdisk;
+
+	struct ramdisk_z_header * header = (struct ramdisk_z_header *)location;
+	if (size >= sizeof(struct ramdisk_z_header) && !memcmp(header->magic, RAMDISK_Z_MAGIC, 8)) {
+		size_t index_end = sizeof(struct ramdisk_z_header) + sizeof(uint32_t) * (header->block_count + 1);
+		uint32_t * offsets = (uint32_t *)(location + sizeof(struct ramdisk_z_header));
+		if (!header->block_size || header->block_size > RAMDISK_Z_MAX_BLOCK || index_end > size ||
+			offsets[header->block_count] > size ||
+			(uint64_t)header->block_count * header->block_size < header->length) {
+			debug_print(ERROR, "ramdisk: bad compressed image header");
+		} else if (!ramdisk_z_index_ok(offsets, header->block_count)) {
+			debug_print(ERROR, "ramdisk: bad compressed image index");
+		} else {
+			struct ramdisk_z * z = malloc(sizeof(struct ramdisk_z));
+			memset(z, 0x00, sizeof(struct ramdisk_z));
+			z->location   = location;
+			z->image_size = size;
+			z->header     = header;
+			z->offsets    = offsets;
+			z->block      = malloc(header->block_size);
+			z->block_index = -1;
+
+			debug_print(NOTICE, "ramdisk: %d bytes compressed to %d in %d blocks",
+				header->length, size, header->block_count);
+
+			fnode->device = z;
+			fnode->length = header->length;
+			fnode->flags  = FS_BLOCKDEVICE | FS_CACHED;
+			fnode->read   = read_ramdisk_z;
+			fnode->write  = NULL;
+		}
+	}
+
 	return fnode;
 }
 
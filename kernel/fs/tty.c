@@ -30,9 +30,67 @@ static void pty_write_out(pty_t * pty, uint8_t c) {
 	ring_buffer_write(pty->out, 1, &c);
 }
 
+static void pty_write_in_block(pty_t * pty, uint8_t * buf, size_t len) {
+	ring_buffer_write(pty->in, len, buf);
+}
+
+static void pty_write_out_block(pty_t * pty, uint8_t * buf, size_t len) {
+	ring_buffer_write(pty->out, len, buf);
+}
+
 #define IN(character)   pty->write_in(pty, (uint8_t)character)
 #define OUT(character)  pty->write_out(pty, (uint8_t)character)
 
+/* Backends that only replace the single-character hooks get them called per byte */
+static void in_block(pty_t * pty, uint8_t * buf, size_t len) {
+	if (pty->write_in_block) {
+		pty->write_in_block(pty, buf, len);
+	} else {
+		for (size_t i = 0; i < len; ++i) IN(buf[i]);
+	}
+}
+
+static void out_block(pty_t * pty, uint8_t * buf, size_t len) {
+	if (pty->write_out_block) {
+		pty->write_out_block(pty, buf, len);
+	} else {
+		for (size_t i = 0; i < len; ++i) OUT(buf[i]);
+	}
+}
+
+#define ONES  0x01010101U
+#define HIGHS 0x80808080U
+
+/*
+ * Find the first byte in buf that is one of the count bytes in
+ * special[], checking four bytes at a time for a match with any of
+ * them. Returns len if there is none.
+ */
+static size_t find_special(const uint8_t * buf, size_t len, const uint8_t * special, int count) {
+	uint32_t patterns[count];
+	for (int j = 0; j < count; ++j) {
+		patterns[j] = special[j] * ONES;
+	}
+
+	size_t i = 0;
+	for (; i + 4 <= len; i += 4) {
+		uint32_t word;
+		memcpy(&word, buf + i, 4);
+		uint32_t hit = 0;
+		for (int j = 0; j < count; ++j) {
+			uint32_t x = word ^ patterns[j];
+			hit |= (x - ONES) & ~x & HIGHS;
+		}
+		if (hit) break;
+	}
+	for (; i < len; ++i) {
+		for (int j = 0; j < count; ++j) {
+			if (buf[i] == special[j]) return i;
+		}
+	}
+	return len;
+}
+
 static void dump_input_buffer(pty_t * pty) {
 	char * c = pty->canon_buffer;
 	while (pty->canon_buflen > 0) {
@@ -77,6 +135,38 @@ void tty_output_process(pty_t * pty, uint8_t c) {
 	output_process_slave(pty, c);
 }
 
+/*
+ * Output a whole buffer, passing the runs between bytes that need
+ * translating straight through to the backend.
+ */
+void tty_output_process_slave_block(pty_t * pty, uint8_t * buf, size_t size) {
+	if (pty->tios.c_oflag & OLCUC) {
+		for (size_t i = 0; i < size; ++i) {
+			output_process_slave(pty, buf[i]);
+		}
+		return;
+	}
+
+	uint8_t special[2];
+	int count = 0;
+	if (pty->tios.c_oflag & ONLCR) special[count++] = '\n';
+	if (pty->tios.c_oflag & ONLRET) special[count++] = '\r';
+
+	while (size) {
+		size_t run = count ? find_special(buf, size, special, count) : size;
+		if (run) {
+			out_block(pty, buf, run);
+			buf += run;
+			size -= run;
+		}
+		if (size) {
+			output_process_slave(pty, *buf);
+			buf++;
+			size--;
+		}
+	}
+}
+
 static int is_control(int c) {
 	return c < ' ' || c == 0x7F;
 }
@@ -244,6 +334,47 @@ void tty_input_process(pty_t * pty, uint8_t c) {
 	IN(c);
 }
 
+/*
+ * Input a whole buffer. Outside of canonical mode, runs of bytes that
+ * don't raise signals or get translated go straight into the input
+ * buffer (and the echo, if on) in one piece.
+ */
+void tty_input_process_block(pty_t * pty, uint8_t * buf, size_t size) {
+	if ((pty->tios.c_lflag & ICANON) || (pty->tios.c_iflag & ISTRIP)) {
+		for (size_t i = 0; i < size; ++i) {
+			input_process(pty, buf[i]);
+		}
+		return;
+	}
+
+	uint8_t special[5];
+	int count = 0;
+	if (pty->tios.c_lflag & ISIG) {
+		special[count++] = pty->tios.c_cc[VINTR];
+		special[count++] = pty->tios.c_cc[VQUIT];
+		special[count++] = pty->tios.c_cc[VSUSP];
+	}
+	if (pty->tios.c_iflag & (IGNCR | ICRNL)) special[count++] = '\r';
+	if (pty->tios.c_iflag & INLCR) special[count++] = '\n';
+
+	while (size) {
+		size_t run = pty->next_is_verbatim ? 0 : (count ? find_special(buf, size, special, count) : size);
+		if (run) {
+			if (pty->tios.c_lflag & ECHO) {
+				tty_output_process_slave_block(pty, buf, run);
+			}
+			in_block(pty, buf, run);
+			buf += run;
+			size -= run;
+		}
+		if (size) {
+			input_process(pty, *buf);
+			buf++;
+			size--;
+		}
+	}
+}
+
 static void tty_fill_name(pty_t * pty, char * out) {
 	((char*)out)[0] = '\0';
 	sprintf((char*)out, "/dev/pts/%d", pty->name);
@@ -326,12 +457,9 @@ uint32_t  read_pty_master(fs_node_t * node, uint64_t offset, uint32_t size, uint
 uint32_t write_pty_master(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	pty_t * pty = (pty_t *)node->device;
 
-	size_t l = 0;
-	for (uint8_t * c = buffer; l < size; ++c, ++l) {
-		input_process(pty, *c);
-	}
+	tty_input_process_block(pty, buffer, size);
 
-	return l;
+	return size;
 }
 void      open_pty_master(fs_node_t * node, unsigned int flags) {
 	return;
@@ -357,12 +485,9 @@ uint32_t  read_pty_slave(fs_node_t * node, uint64_t offset, uint32_t size, uint8
 uint32_t write_pty_slave(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	pty_t * pty = (pty_t *)node->device;
 
-	size_t l = 0;
-	for (uint8_t * c = buffer; l < size; ++c, ++l) {
-		output_process_slave(pty, *c);
-	}
+	tty_output_process_slave_block(pty, buffer, size);
 
-	return l;
+	return size;
 }
 void      open_pty_slave(fs_node_t * node, unsigned int flags) {
 	return;
@@ -427,6 +552,40 @@ static int wait_pty_slave(fs_node_t * node, void * process) {
 	return 0;
 }
 
+/*
+ * Writes to the master feed the slave's input and vice versa, so
+ * write readiness is space in the other side's buffer.
+ */
+static int pollcheck_pty_master(fs_node_t * node, int events) {
+	pty_t * pty = (pty_t *)node->device;
+	int ready = 0;
+	if (ring_buffer_unread(pty->out) > 0) ready |= POLLIN;
+	if (ring_buffer_available(pty->in) > 0) ready |= POLLOUT;
+	return ready;
+}
+
+static int pollcheck_pty_slave(fs_node_t * node, int events) {
+	pty_t * pty = (pty_t *)node->device;
+	int ready = 0;
+	if (ring_buffer_unread(pty->in) > 0) ready |= POLLIN;
+	if (ring_buffer_available(pty->out) > 0) ready |= POLLOUT;
+	return ready;
+}
+
+static int pollwait_pty_master(fs_node_t * node, void * process, int events) {
+	pty_t * pty = (pty_t *)node->device;
+	if (events & POLLIN)  ring_buffer_select_wait(pty->out, process);
+	if (events & POLLOUT) ring_buffer_select_wait_write(pty->in, process);
+	return 0;
+}
+
+static int pollwait_pty_slave(fs_node_t * node, void * process, int events) {
+	pty_t * pty = (pty_t *)node->device;
+	if (events & POLLIN)  ring_buffer_select_wait(pty->in, process);
+	if (events & POLLOUT) ring_buffer_select_wait_write(pty->out, process);
+	return 0;
+}
+
 fs_node_t * pty_master_create(pty_t * pty) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -443,6 +602,8 @@ fs_node_t * pty_master_create(pty_t * pty) {
 	fnode->close = close_pty_master;
 	fnode->selectcheck = check_pty_master;
 	fnode->selectwait  = wait_pty_master;
+	fnode->pollcheck   = pollcheck_pty_master;
+	fnode->pollwait    = pollwait_pty_master;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ioctl = ioctl_pty_master;
@@ -472,6 +633,8 @@ fs_node_t * pty_slave_create(pty_t * pty) {
 	fnode->close = close_pty_slave;
 	fnode->selectcheck = check_pty_slave;
 	fnode->selectwait  = wait_pty_slave;
+	fnode->pollcheck   = pollcheck_pty_slave;
+	fnode->pollwait    = pollwait_pty_slave;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ioctl = ioctl_pty_slave;
@@ -495,8 +658,8 @@ static int readlink_dev_tty(fs_node_t * node, char * buf, size_t size) {
 	pty_t * pty = NULL;
 
 	for (unsigned int i = 0; i < ((current_process->fds->length < 3) ? current_process->fds->length : 3); ++i) {
-		if (isatty(current_process->fds->entries[i])) {
-			pty = (pty_t *)current_process->fds->entries[i]->device;
+		if (isatty(current_process->fds->entries[i].node)) {
+			pty = (pty_t *)current_process->fds->entries[i].node->device;
 			break;
 		}
 	}
@@ -664,6 +827,8 @@ pty_t * pty_new(struct winsize * size) {
 
 	pty->write_in = pty_write_in;
 	pty->write_out = pty_write_out;
+	pty->write_in_block = pty_write_in_block;
+	pty->write_out_block = pty_write_out_block;
 
 	hashmap_set(_pty_index, (void*)pty->name, pty);
 
@@ -12,7 +12,13 @@
 
 #include <sys/ioctl.h>
 
-#define UNIX_PIPE_BUFFER 512
+/*
+ * Buffers are whole pages and a power of two in size, so the ring buffer
+ * can mask rather than wrap. One byte of the buffer is never used.
+ */
+#define UNIX_PIPE_BUFFER 0x4000
+#define UNIX_PIPE_MIN    0x1000
+#define UNIX_PIPE_MAX    0x100000
 
 struct unix_pipe {
 	fs_node_t * read_end;
@@ -57,13 +63,76 @@ static uint32_t write_unixpipe(fs_node_t * node, uint64_t offset, uint32_t size,
 
 			return written;
 		}
-		size_t w = ring_buffer_write(self->buffer, 1, buffer+written);
+		size_t w = ring_buffer_write(self->buffer, size - written, buffer+written);
 		written += w;
 	}
 
 	return written;
 }
 
+/*
+ * Pipe to pipe splice: move data from one pipe's buffer straight into
+ * the other's. Blocks only until the first bytes move, like read().
+ * Returns -EINVAL if either end is not a pipe.
+ */
+int unix_pipe_splice(fs_node_t * in, fs_node_t * out, uint32_t size) {
+	if (in->read != read_unixpipe || out->write != write_unixpipe) {
+		return -EINVAL;
+	}
+
+	struct unix_pipe * from = in->device;
+	struct unix_pipe * to = out->device;
+
+	if (from == to) return -EINVAL;
+
+	uint32_t moved = 0;
+	while (moved < size) {
+		if (to->read_closed) {
+			send_signal(getpid(), SIGPIPE, 1);
+			return moved ? (int)moved : -EPIPE;
+		}
+
+		size_t m = ring_buffer_splice(from->buffer, to->buffer, size - moved);
+		moved += m;
+		if (m) continue;
+		if (moved) break;
+
+		/* Closing either end interrupts the sleep; go around and notice */
+		ring_buffer_t * wait = ring_buffer_unread(from->buffer) ? to->buffer : from->buffer;
+		if (wait == from->buffer && from->write_closed) break;
+		if (sleep_on(wait == from->buffer ? wait->wait_queue_readers : wait->wait_queue_writers) && wait->internal_stop) {
+			wait->internal_stop = 0;
+		}
+	}
+
+	return moved;
+}
+
+static int ioctl_unixpipe(fs_node_t * node, int request, void * argp) {
+	struct unix_pipe * self = node->device;
+
+	switch (request) {
+		case IOCTL_PIPE_GETSZ:
+			return self->buffer->size - 1;
+		case IOCTL_PIPE_SETSZ: {
+			if (!argp) return -EINVAL;
+			validate(argp);
+			int want = *(int *)argp;
+			if (want < 0) return -EINVAL;
+			if (want >= UNIX_PIPE_MAX) return -EINVAL;
+			size_t size = UNIX_PIPE_MIN;
+			while (size < (size_t)want + 1) size <<= 1;
+			if (size != self->buffer->size) {
+				int ret = ring_buffer_resize(self->buffer, size);
+				if (ret < 0) return ret;
+			}
+			return size - 1;
+		}
+		default:
+			return -EINVAL;
+	}
+}
+
 static void close_read_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
 
@@ -74,6 +143,7 @@ static void close_read_pipe(fs_node_t * node) {
 		debug_print(NOTICE, "Both ends now closed, should clean up.");
 	} else {
 		ring_buffer_interrupt(self->buffer);
+		ring_buffer_alert_writers(self->buffer);
 	}
 }
 
@@ -108,6 +178,32 @@ static int wait_pipe(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static int pollcheck_read_pipe(fs_node_t * node, int events) {
+	struct unix_pipe * self = node->device;
+	int ready = 0;
+	if (ring_buffer_unread(self->buffer) > 0) ready |= POLLIN;
+	if (self->write_closed) ready |= POLLHUP;
+	return ready;
+}
+
+static int pollcheck_write_pipe(fs_node_t * node, int events) {
+	struct unix_pipe * self = node->device;
+	if (self->read_closed) return POLLERR;
+	return ring_buffer_available(self->buffer) > 0 ? POLLOUT : 0;
+}
+
+static int pollwait_read_pipe(fs_node_t * node, void * process, int events) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_select_wait(self->buffer, process);
+	return 0;
+}
+
+static int pollwait_write_pipe(fs_node_t * node, void * process, int events) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_select_wait_write(self->buffer, process);
+	return 0;
+}
+
 
 int make_unix_pipe(fs_node_t ** pipes) {
 	size_t size = UNIX_PIPE_BUFFER;
@@ -133,10 +229,18 @@ int make_unix_pipe(fs_node_t ** pipes) {
 	pipes[0]->close = close_read_pipe;
 	pipes[1]->close = close_write_pipe;
 
+	pipes[0]->ioctl = ioctl_unixpipe;
+	pipes[1]->ioctl = ioctl_unixpipe;
+
 	/* Read end can wait */
 	pipes[0]->selectcheck = check_pipe;
 	pipes[0]->selectwait = wait_pipe;
 
+	pipes[0]->pollcheck = pollcheck_read_pipe;
+	pipes[0]->pollwait  = pollwait_read_pipe;
+	pipes[1]->pollcheck = pollcheck_write_pipe;
+	pipes[1]->pollwait  = pollwait_write_pipe;
+
 	struct unix_pipe * internals = malloc(sizeof(struct unix_pipe));
 	internals->read_end = pipes[0];
 	internals->write_end = pipes[1];
@@ -10,9 +10,12 @@
  */
 #include <kernel/system.h>
 #include <kernel/fs.h>
+#include <kernel/slab.h>
 #include <kernel/printf.h>
 #include <kernel/process.h>
 #include <kernel/logging.h>
+#include <kernel/mmap.h>
+#include <kernel/ktrace.h>
 
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
@@ -25,6 +28,9 @@ fs_node_t * fs_root = NULL; /* Pointer to the root mount fs_node (must be some f
 
 hashmap_t * fs_types = NULL;
 
+slab_cache_t fs_node_cache = SLAB_CACHE("fs_node", fs_node_t, NULL);
+slab_cache_t dirent_cache  = SLAB_CACHE("dirent", struct dirent, NULL);
+
 
 int has_permission(fs_node_t * node, int permission_bit) {
 	if (!node) return 0;
@@ -54,12 +60,12 @@ static struct dirent * readdir_mapper(fs_node_t *node, uint32_t index) {
 	if (!d) return NULL;
 
 	if (index == 0) {
-		struct dirent * dir = malloc(sizeof(struct dirent));
+		struct dirent * dir = slab_alloc(&dirent_cache);
 		strcpy(dir->name, ".");
 		dir->ino = 0;
 		return dir;
 	} else if (index == 1) {
-		struct dirent * dir = malloc(sizeof(struct dirent));
+		struct dirent * dir = slab_alloc(&dirent_cache);
 		strcpy(dir->name, "..");
 		dir->ino = 1;
 		return dir;
@@ -72,7 +78,7 @@ static struct dirent * readdir_mapper(fs_node_t *node, uint32_t index) {
 			/* Recursively print the children */
 			tree_node_t * tchild = (tree_node_t *)child->value;
 			struct vfs_entry * n = (struct vfs_entry *)tchild->value;
-			struct dirent * dir = malloc(sizeof(struct dirent));
+			struct dirent * dir = slab_alloc(&dirent_cache);
 
 			size_t len = strlen(n->name) + 1;
 			memcpy(&dir->name, n->name, MIN(256, len));
@@ -86,7 +92,7 @@ static struct dirent * readdir_mapper(fs_node_t *node, uint32_t index) {
 }
 
 static fs_node_t * vfs_mapper(void) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = slab_alloc(&fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->mask = 0555;
 	fnode->flags   = FS_DIRECTORY;
@@ -123,6 +129,50 @@ int selectwait_fs(fs_node_t * node, void * process) {
 	return -EINVAL;
 }
 
+static int pollable(fs_node_t * node) {
+	return (node->flags & (FS_PIPE | FS_CHARDEVICE)) && node->pollcheck;
+}
+
+/**
+ * pollcheck_fs: Find which of the requested poll events hold for a node.
+ *
+ * Nodes without their own check are readable when selectcheck says so
+ * (or always, if they have no selectcheck either), and always writable,
+ * since their writes block rather than fail.
+ */
+int pollcheck_fs(fs_node_t * node, int events) {
+	if (!node) return POLLNVAL;
+
+	int ready;
+	if (pollable(node)) {
+		ready = node->pollcheck(node, events);
+	} else if (node->selectcheck) {
+		ready = POLLOUT | (node->selectcheck(node) == 0 ? POLLIN : 0);
+	} else {
+		ready = POLLIN | POLLOUT;
+	}
+
+	/* Hangups and errors are reported whether they were asked for or not */
+	return ready & (events | POLLHUP | POLLERR);
+}
+
+/**
+ * pollwait_fs: Inform a node that it should alert the process on any of `events`.
+ */
+int pollwait_fs(fs_node_t * node, void * process, int events) {
+	if (!node) return -ENOENT;
+
+	if (pollable(node) && node->pollwait) {
+		return node->pollwait(node, process, events);
+	}
+
+	if (events & POLLIN) {
+		return selectwait_fs(node, process);
+	}
+
+	return 0;
+}
+
 /**
  * read_fs: Read a file system node based on its underlying type.
  *
@@ -136,7 +186,14 @@ uint32_t read_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffe
 	if (!node) return -ENOENT;
 
 	if (node->read) {
-		uint32_t ret = node->read(node, offset, size, buffer);
+		KTRACE(KTRACE_READ, node->inode, size, offset);
+		uint32_t ret;
+		if (node->flags & FS_CACHED) {
+			ret = pagecache_read(node, offset, size, buffer);
+		} else {
+			ret = node->read(node, offset, size, buffer);
+		}
+		KTRACE(KTRACE_READ_DONE, node->inode, ret, 0);
 		return ret;
 	} else {
 		return -EINVAL;
@@ -156,7 +213,19 @@ uint32_t write_fs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buff
 	if (!node) return -ENOENT;
 
 	if (node->write) {
+		KTRACE(KTRACE_WRITE, node->inode, size, offset);
 		uint32_t ret = node->write(node, offset, size, buffer);
+		/*
+		 * Only once the write is done: a page read back into a cache
+		 * while it was still going on would have the old data.
+		 */
+		if (node->flags & FS_CACHED) {
+			pagecache_invalidate(node, offset, size);
+		}
+		if (node->flags & FS_FILE) {
+			mmap_invalidate(node, offset, size);
+		}
+		KTRACE(KTRACE_WRITE_DONE, node->inode, ret, 0);
 		return ret;
 	} else {
 		return -EROFS;
@@ -173,7 +242,65 @@ void truncate_fs(fs_node_t * node) {
 
 	if (node->truncate) {
 		node->truncate(node);
+		if (node->flags & FS_FILE) {
+			mmap_invalidate(node, 0, 0xFFFFFFFF);
+		}
+	}
+}
+
+#define SPLICE_PAGE  0x1000
+#define SPLICE_CHUNK 0x10000
+
+/**
+ * splice_fs: Move data from one node to another inside the kernel.
+ *
+ * Pipe to pipe goes buffer to buffer. Everything else is copied up to
+ * 64KiB at a time through a kernel buffer, so file systems can move runs
+ * of blocks at once, with chunks aligned to the source offset's pages
+ * so cached files are read whole pages at a time. The offsets, where
+ * given, are advanced by what was moved.
+ *
+ * Stops after the first short read or write, so it doesn't block any
+ * more than read() would once some data has been moved.
+ */
+int splice_fs(fs_node_t * in, uint64_t * in_offset, fs_node_t * out, uint64_t * out_offset, uint32_t size) {
+	if (!in || !out) return -ENOENT;
+	if (!in->read || !out->write) return -EINVAL;
+
+	int ret = unix_pipe_splice(in, out, size);
+	if (ret != -EINVAL) return ret;
+
+	uint8_t * buffer = malloc(SPLICE_CHUNK);
+	uint32_t moved = 0;
+	ret = 0;
+
+	while (moved < size) {
+		uint64_t offset = in_offset ? *in_offset : 0;
+		uint32_t chunk = SPLICE_CHUNK - (offset & (SPLICE_PAGE - 1));
+		if (chunk > size - moved) chunk = size - moved;
+
+		uint32_t r = read_fs(in, offset, chunk, buffer);
+		if ((int32_t)r <= 0) {
+			if (!moved) ret = (int32_t)r;
+			break;
+		}
+		if (in_offset) *in_offset += r;
+
+		uint32_t w = write_fs(out, out_offset ? *out_offset : 0, r, buffer);
+		if ((int32_t)w < 0) {
+			if (!moved) ret = (int32_t)w;
+			w = 0;
+		}
+		if (in_offset) *in_offset -= r - w; /* Leave what didn't fit to be read again */
+		if (!w) break;
+		if (out_offset) *out_offset += w;
+		moved += w;
+
+		if (w < r || r < chunk) break;
 	}
+
+	free(buffer);
+	return moved ? (int)moved : ret;
 }
 
 //volatile uint8_t tmp_refcount_lock = 0;
@@ -273,6 +400,38 @@ struct dirent *readdir_fs(fs_node_t *node, uint32_t index) {
 	}
 }
 
+/**
+ * getdents_fs: Read many directory entries at once
+ *
+ * `offset` is a cursor owned by the caller, normally the open file's
+ * offset; it starts at 0 and is advanced past the entries returned.
+ * Drivers without a getdents of their own treat it as a readdir index.
+ *
+ * @param node    Directory to read
+ * @param offset  Where to continue from
+ * @param entries Output array
+ * @param count   Room in `entries`
+ * @returns Number of entries filled in; 0 at the end of the directory
+ */
+uint32_t getdents_fs(fs_node_t *node, uint64_t *offset, struct dirent *entries, uint32_t count) {
+	if (!node || !(node->flags & FS_DIRECTORY)) return 0;
+
+	if (node->getdents) {
+		return node->getdents(node, offset, entries, count);
+	}
+
+	uint32_t got = 0;
+	while (got < count && node->readdir) {
+		struct dirent * entry = node->readdir(node, (uint32_t)*offset);
+		if (!entry) break;
+		memcpy(&entries[got], entry, sizeof(struct dirent));
+		free(entry);
+		got++;
+		(*offset)++;
+	}
+	return got;
+}
+
 /**
  * finddir_fs: Find the requested file in the directory and return an fs_node for it
  *
@@ -293,6 +452,22 @@ fs_node_t *finddir_fs(fs_node_t *node, char *name) {
 	}
 }
 
+/*
+ * finddir_fs() through the directory entry cache. Cached directories
+ * and symlinks are only trusted on the way through a path; the final
+ * component is always looked up again so its metadata is current.
+ */
+static fs_node_t * finddir_cached(fs_node_t * node, char * name, int last) {
+	fs_node_t * ret;
+	if (dcache_lookup(node, name, &ret)) {
+		if (!ret || !last) return ret;
+		free(ret);
+	}
+	ret = finddir_fs(node, name);
+	dcache_insert(node, name, ret);
+	return ret;
+}
+
 /**
  * ioctl_fs: Control Device
  *
@@ -359,6 +534,7 @@ int create_file_fs(char *name, uint16_t permission) {
 	int ret = 0;
 	if (parent->create) {
 		ret = parent->create(parent, f_path, permission);
+		dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -408,7 +584,21 @@ int unlink_fs(char * name) {
 
 	int ret = 0;
 	if (parent->unlink) {
+		/* A removed directory takes its cached children with it */
+		int was_directory = 0;
+		if (parent->flags & FS_DCACHE) {
+			fs_node_t * victim = finddir_fs(parent, f_path);
+			if (victim) {
+				was_directory = !!(victim->flags & FS_DIRECTORY);
+				free(victim);
+			}
+		}
 		ret = parent->unlink(parent, f_path);
+		if (was_directory) {
+			dcache_flush();
+		} else {
+			dcache_invalidate(parent, f_path);
+		}
 	} else {
 		ret = -EINVAL;
 	}
@@ -474,6 +664,7 @@ int mkdir_fs(char *name, uint16_t permission) {
 	int ret = 0;
 	if (parent->mkdir) {
 		ret = parent->mkdir(parent, f_path, permission);
+		dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EROFS;
 	}
@@ -526,6 +717,7 @@ int symlink_fs(char * target, char * name) {
 	int ret = 0;
 	if (parent->symlink) {
 		ret = parent->symlink(parent, target, f_path);
+		dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -736,6 +928,9 @@ void * vfs_mount(char * path, fs_node_t * local_root) {
 
 	spin_lock(tmp_vfs_lock);
 
+	/* What a path resolves to may be about to change */
+	dcache_flush();
+
 	local_root->refcount = -1;
 
 	tree_node_t * ret_val = NULL;
@@ -812,6 +1007,46 @@ void * vfs_mount(char * path, fs_node_t * local_root) {
 	return ret_val;
 }
 
+/* Is anything mounted under this name, anywhere in the tree? */
+static int mounted_as(tree_node_t * node, char * name) {
+	foreach(child, node->children) {
+		tree_node_t * tchild = (tree_node_t *)child->value;
+		struct vfs_entry * ent = (struct vfs_entry *)tchild->value;
+		if (ent->file && !strcmp(ent->name, name)) return 1;
+		if (mounted_as(tchild, name)) return 1;
+	}
+	return 0;
+}
+
+/**
+ * kfind_at: Look up one name in an already open directory.
+ *
+ * For code walking a tree a directory at a time, this saves resolving
+ * the directory's whole path again for every entry in it. A directory
+ * node only knows its own file system, so a name that something is
+ * mounted under (anywhere - we don't know where this directory is)
+ * can't be trusted, and neither can anything with more than one
+ * component; those are -EXDEV and the caller should use the full path.
+ *
+ * @param dir  Directory to search
+ * @param name A single path component
+ * @param out  Set to the node found, which is not opened; free() it
+ * @returns 0, -ENOENT, or -EXDEV
+ */
+int kfind_at(fs_node_t *dir, char *name, fs_node_t **out) {
+	if (!*name || !strcmp(name, PATH_DOT) || !strcmp(name, PATH_UP) || strchr(name, PATH_SEPARATOR)) {
+		return -EXDEV;
+	}
+
+	spin_lock(tmp_vfs_lock);
+	int mounted = mounted_as(fs_tree->root, name);
+	spin_unlock(tmp_vfs_lock);
+	if (mounted) return -EXDEV;
+
+	*out = finddir_cached(dir, name, 1);
+	return *out ? 0 : -ENOENT;
+}
+
 void map_vfs_directory(char * c) {
 	fs_node_t * f = vfs_mapper();
 	struct vfs_entry * e = vfs_mount(c, f);
@@ -903,7 +1138,7 @@ fs_node_t *get_mount_point(char * path, unsigned int path_depth, char **outpath,
 	*outdepth = _tree_depth;
 
 	if (last) {
-		fs_node_t * last_clone = malloc(sizeof(fs_node_t));
+		fs_node_t * last_clone = slab_alloc(&fs_node_cache);
 		memcpy(last_clone, last, sizeof(fs_node_t));
 		return last_clone;
 	}
@@ -926,7 +1161,7 @@ fs_node_t *kopen_recur(char *filename, uint32_t flags, uint32_t symlink_depth, c
 	/* If strlen(path) == 1, then path = "/"; return root */
 	if (path_len == 1) {
 		/* Clone the root file system node */
-		fs_node_t *root_clone = malloc(sizeof(fs_node_t));
+		fs_node_t *root_clone = slab_alloc(&fs_node_cache);
 		memcpy(root_clone, fs_root, sizeof(fs_node_t));
 
 		/* Free the path */
@@ -1050,7 +1285,7 @@ fs_node_t *kopen_recur(char *filename, uint32_t flags, uint32_t symlink_depth, c
 		}
 		/* We are still searching... */
 		debug_print(INFO, "... Searching for %s", path_offset);
-		fs_node_t * node_next = finddir_fs(node_ptr, path_offset);
+		fs_node_t * node_next = finddir_cached(node_ptr, path_offset, depth + 1 == path_depth);
 		free(node_ptr); /* Always a clone or an unopened thing */
 		node_ptr = node_next;
 		/* Search the active directory for the requested directory */
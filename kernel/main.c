@@ -49,9 +49,24 @@
 #include <kernel/args.h>
 #include <kernel/module.h>
 #include <kernel/pci.h>
+#include <kernel/input.h>
+#include <kernel/ktrace.h>
+#include <kernel/pressure.h>
+#include <kernel/workqueue.h>
+#include <kernel/mem.h>
 
 uintptr_t initial_esp = 0;
 
+boot_stage_t boot_stages[BOOT_STAGES];
+int boot_stage_count = 0;
+
+void boot_stage(char * name) {
+	if (boot_stage_count == BOOT_STAGES) return;
+	boot_stages[boot_stage_count].name = name;
+	boot_stages[boot_stage_count].cycles = timer_cycles();
+	boot_stage_count++;
+}
+
 fs_node_t * ramdisk_mount(uintptr_t, size_t);
 
 #ifdef EARLY_BOOT_LOG
@@ -79,6 +94,7 @@ struct pack_header {
  * multiboot i386 (pc) kernel entry point
  */
 int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
+	boot_stage("kmain");
 	initial_esp = esp;
 	extern char * cmdline;
 
@@ -86,15 +102,15 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	mboot_mod_t * mboot_mods = NULL;
 	mboot_ptr = mboot;
 
+	/* Initialize core modules; the GDT first, as %fs finds current_process through it */
+	gdt_install();      /* Global descriptor table */
+	idt_install();      /* IDT */
+
 	ENABLE_EARLY_BOOT_LOG(0);
 
 	assert(mboot_mag == MULTIBOOT_EAX_MAGIC && "Didn't boot with multiboot, not sure how we got here.");
 	debug_print(NOTICE, "Processing Multiboot information.");
 
-	/* Initialize core modules */
-	gdt_install();      /* Global descriptor table */
-	idt_install();      /* IDT */
-
 	uintptr_t last_mod = (uintptr_t)&end;
 	if (mboot_ptr->flags & MULTIBOOT_FLAG_MODS) {
 		debug_print(NOTICE, "There %s %d module%s starting at 0x%x.", mboot_ptr->mods_count == 1 ? "is" : "are", mboot_ptr->mods_count, mboot_ptr->mods_count == 1 ? "" : "s", mboot_ptr->mods_addr);
@@ -126,25 +142,56 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	while (last_mod & 0x7FF) last_mod++;
 	kmalloc_startat(last_mod);
 
-	if (mboot_ptr->flags & MULTIBOOT_FLAG_MEM) {
-		paging_install(mboot_ptr->mem_upper + mboot_ptr->mem_lower);
-	} else {
-		debug_print(CRITICAL, "Missing MEM flag in multiboot header\n");
-	}
-
+	/*
+	 * With a memory map, frames run up to the end of the highest block
+	 * of RAM it lists, and everything it doesn't call RAM below that
+	 * (holes for devices included) is kept out of the allocator. The
+	 * basic mem_upper figure stops at the first hole, which on large
+	 * machines leaves most of memory unused. With PAE, page table
+	 * entries hold 40-bit addresses; RAM up to MEMORY_ADDRESSABLE is
+	 * used, and anything above that is reported and left.
+	 */
 	if (mboot_ptr->flags & MULTIBOOT_FLAG_MMAP) {
 		debug_print(NOTICE, "Parsing memory map.");
-		mboot_memmap_t * mmap = (void *)mboot_ptr->mmap_addr;
-		while ((uintptr_t)mmap < mboot_ptr->mmap_addr + mboot_ptr->mmap_length) {
-			if (mmap->type == 2) {
-				for (unsigned long long int i = 0; i < mmap->length; i += 0x1000) {
-					if (mmap->base_addr + i > 0xFFFFFFFF) break; /* xxx */
-					debug_print(INFO, "Marking 0x%x", (uint32_t)(mmap->base_addr + i));
-					paging_mark_system((mmap->base_addr + i) & 0xFFFFF000);
+		uint64_t top = 0;
+		uint64_t above = 0;
+		for (mboot_memmap_t * mmap = (void *)mboot_ptr->mmap_addr;
+				(uintptr_t)mmap < mboot_ptr->mmap_addr + mboot_ptr->mmap_length;
+				mmap = (mboot_memmap_t *) ((uintptr_t)mmap + mmap->size + sizeof(uintptr_t))) {
+			if (mmap->type != 1) continue;
+			uint64_t end = mmap->base_addr + mmap->length;
+			if (end > MEMORY_ADDRESSABLE) {
+				above += end - (mmap->base_addr > MEMORY_ADDRESSABLE ? mmap->base_addr : MEMORY_ADDRESSABLE);
+				end = MEMORY_ADDRESSABLE;
+			}
+			if (end > top) top = end;
+		}
+		if (above) {
+			debug_print(WARNING, "Ignoring %d MiB of memory above 64GiB", (uint32_t)(above >> 20));
+		}
+		paging_install(top / 1024);
+
+		for (uint64_t address = 0; address < top; address += 0x1000) {
+			uint64_t usable = 0;
+			for (mboot_memmap_t * mmap = (void *)mboot_ptr->mmap_addr;
+					(uintptr_t)mmap < mboot_ptr->mmap_addr + mboot_ptr->mmap_length;
+					mmap = (mboot_memmap_t *) ((uintptr_t)mmap + mmap->size + sizeof(uintptr_t))) {
+				if (mmap->type == 1 && address >= mmap->base_addr && address + 0x1000 <= mmap->base_addr + mmap->length) {
+					usable = (mmap->base_addr + mmap->length) & ~0xFFFULL;
+					break;
 				}
 			}
-			mmap = (mboot_memmap_t *) ((uintptr_t)mmap + mmap->size + sizeof(uintptr_t));
+			if (usable) {
+				/* Skip the rest of this block; there can be a lot of it */
+				address = usable - 0x1000;
+			} else {
+				paging_mark_system(address);
+			}
 		}
+	} else if (mboot_ptr->flags & MULTIBOOT_FLAG_MEM) {
+		paging_install(mboot_ptr->mem_upper + mboot_ptr->mem_lower);
+	} else {
+		debug_print(CRITICAL, "Missing MEM flag in multiboot header\n");
 	}
 	paging_finalize();
 
@@ -168,19 +215,29 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 
 	isrs_install();     /* Interrupt service requests */
 	irq_install();      /* Hardware interrupt requests */
+	smp_install();      /* Processor discovery */
+	lapic_install();    /* Local APIC, for message signalled interrupts */
 
 	vfs_install();
 	tasking_install();  /* Multi-tasking */
 	timer_install();    /* PIC driver */
+	random_install();   /* Kernel RNG */
 	fpu_install();      /* FPU/SSE magic */
 	syscalls_install(); /* Install the system calls */
 	shm_install();      /* Install shared memory */
+	memory_pressure_install(); /* Reclaim and the OOM killer */
+	workqueue_install(); /* Worker threads for deferred work */
 	modules_install();  /* Modules! */
+	ktrace_install();   /* Tracepoints */
+	logging_install();  /* /dev/kmsg and klogd */
+	input_install();    /* /dev/input, before the drivers that feed it */
+	pci_enumerate();    /* Walk the PCI buses, once */
 	pci_remap();
 
 	DISABLE_EARLY_BOOT_LOG();
 
 	/* Load modules from bootloader */
+	boot_stage("load-modules");
 	if (mboot_ptr->flags & MULTIBOOT_FLAG_MODS) {
 		debug_print(NOTICE, "%d modules to load", mboot_mods_count);
 		for (unsigned int i = 0; i < mboot_ptr->mods_count; ++i ) {
@@ -223,6 +280,7 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	/* Map /dev to a device mapper */
 	map_vfs_directory("/dev");
 
+	boot_stage("mount-root");
 	if (args_present("root")) {
 		char * root_type = "ext2";
 		if (args_present("root_type")) {
@@ -260,6 +318,13 @@ int kmain(struct multiboot *mboot, uint32_t mboot_mag, uintptr_t esp) {
 	while (argv[argc]) {
 		argc++;
 	}
+	/* The other processors, which wait for the kernel until init is entered */
+	smp_start();
+
+	boot_stage("init");
+	if (args_present("latency")) {
+		latency_trace_start();
+	}
 	system(argv[0], argc, argv, NULL); /* Run init */
 
 	debug_print(CRITICAL, "init failed");
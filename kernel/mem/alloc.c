@@ -103,6 +103,7 @@
 
 /* Includes {{{ */
 #include <kernel/system.h>
+#include <kernel/slab.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -171,6 +172,32 @@ static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size)
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
+/*
+ * Each slab is a single page from sbrk() with this header at the
+ * front and objects after it. The magic sits where a bin header keeps
+ * its own, so free() can tell the two apart from the page alone.
+ */
+#define SLAB_MAGIC 0x51AB51AB
+
+typedef struct slab {
+	struct slab * next;
+	void * head;                /* Free objects, linked through their first word */
+	uint32_t in_use;
+	uint32_t slab_magic;
+	struct slab * prev;
+	slab_cache_t * cache;
+} slab_t;
+
+static inline slab_t * __attribute__ ((always_inline)) slab_of(void * ptr) {
+	/* Objects are never at the front of their page; valloc() blocks are */
+	if ((uintptr_t)ptr % PAGE_SIZE == 0) return NULL;
+	slab_t * slab = (slab_t *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	return (slab->slab_magic == SLAB_MAGIC) ? slab : NULL;
+}
+
+static void * klslab_alloc(slab_cache_t * cache);
+static void klslab_free(slab_t * slab, void * object);
+
 static spin_lock_t mem_lock =  { 0 };
 
 void * __attribute__ ((malloc)) malloc(uintptr_t size) {
@@ -203,6 +230,15 @@ void * __attribute__ ((malloc)) malloc(uintptr_t size) {
 
 void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 	spin_lock(mem_lock);
+	slab_t * slab = ptr ? slab_of(ptr) : NULL;
+	if (slab) {
+		/* Objects from a cache move out to the general allocator */
+		void * ret = size ? klmalloc(size) : NULL;
+		if (ret) memcpy(ret, ptr, size < slab->cache->size ? size : slab->cache->size);
+		if (ret || !size) klslab_free(slab, ptr);
+		spin_unlock(mem_lock);
+		return ret;
+	}
 #ifdef _DEBUG_MALLOC
 	size += 8;
 #endif
@@ -313,7 +349,12 @@ void free(void * ptr) {
 		} __attribute__((packed)) log = {'f',(uint32_t)ptr,_failed ? 0xFFFFFFFF : x[1],_failed ? 0xFFFFFFFF : x[0],_eip};
 		write_fs(&_kmalloc_log, 0, sizeof(log), (uint8_t *)&log);
 #endif
-		klfree(ptr);
+		slab_t * slab = slab_of(ptr);
+		if (slab) {
+			klslab_free(slab, ptr);
+		} else {
+			klfree(ptr);
+		}
 	}
 	spin_unlock(mem_lock);
 }
@@ -841,6 +882,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 */
 			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
 			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
+			memset(bin_header, 0, sizeof(klmalloc_big_bin_header));
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 			/*
@@ -1114,3 +1156,114 @@ static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size)
 	return ptr;
 }
 /* }}} */
+/* Object caches {{{ */
+
+slab_cache_t * slab_caches = NULL;
+
+static void slab_unlink(slab_t ** list, slab_t * slab) {
+	if (slab->prev) slab->prev->next = slab->next;
+	else *list = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+static void slab_push(slab_t ** list, slab_t * slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list) (*list)->prev = slab;
+	*list = slab;
+}
+
+static slab_t * slab_grow(slab_cache_t * cache) {
+	slab_t * slab = (slab_t *)sbrk(PAGE_SIZE);
+	slab->next = NULL;
+	slab->prev = NULL;
+	slab->head = NULL;
+	slab->in_use = 0;
+	slab->slab_magic = SLAB_MAGIC;
+	slab->cache = cache;
+
+	/* Carve it up back to front, so objects come out in address order */
+	uintptr_t first = ((uintptr_t)slab + sizeof(slab_t) + 15) & ~15;
+	uintptr_t count = ((uintptr_t)slab + PAGE_SIZE - first) / cache->stride;
+	for (uintptr_t i = count; i > 0; --i) {
+		void * object = (void *)(first + (i - 1) * cache->stride);
+		if (cache->ctor) cache->ctor(object);
+		*(void **)object = slab->head;
+		slab->head = object;
+	}
+
+	cache->pages++;
+	cache->objects += count;
+	return slab;
+}
+
+static void * klslab_alloc(slab_cache_t * cache) {
+	if (__builtin_expect(!cache->stride, 0)) {
+		cache->stride = (cache->size + 7) & ~7;
+		if (cache->stride < sizeof(void *)) cache->stride = sizeof(void *);
+		assert(cache->stride <= (PAGE_SIZE - sizeof(slab_t)) / 4 && "Object too big for a slab cache");
+		cache->next = slab_caches;
+		slab_caches = cache;
+	}
+
+	slab_t * slab = cache->partial;
+	if (!slab) {
+		slab = cache->empty;
+		if (slab) {
+			slab_unlink(&cache->empty, slab);
+		} else {
+			slab = slab_grow(cache);
+		}
+		slab_push(&cache->partial, slab);
+	}
+
+	void * object = slab->head;
+	slab->head = *(void **)object;
+	slab->in_use++;
+	if (!slab->head) {
+		slab_unlink(&cache->partial, slab);
+		slab_push(&cache->full, slab);
+	}
+
+	cache->in_use++;
+	cache->allocs++;
+	return object;
+}
+
+static void klslab_free(slab_t * slab, void * object) {
+	slab_cache_t * cache = slab->cache;
+
+	if (!slab->head) {
+		slab_unlink(&cache->full, slab);
+		slab_push(&cache->partial, slab);
+	}
+
+	*(void **)object = slab->head;
+	slab->head = object;
+	slab->in_use--;
+	cache->in_use--;
+
+	if (!slab->in_use) {
+		slab_unlink(&cache->partial, slab);
+		slab_push(&cache->empty, slab);
+	}
+}
+
+void * slab_alloc(slab_cache_t * cache) {
+	spin_lock(mem_lock);
+	void * ret = klslab_alloc(cache);
+	spin_unlock(mem_lock);
+	return ret;
+}
+
+void slab_free(void * object) {
+	if (!object) return;
+	spin_lock(mem_lock);
+	slab_t * slab = slab_of(object);
+	assert(slab && "slab_free() of something that isn't from a cache");
+	klslab_free(slab, object);
+	spin_unlock(mem_lock);
+}
+/* }}} */
@@ -13,6 +13,10 @@
 #include <kernel/logging.h>
 #include <kernel/signal.h>
 #include <kernel/module.h>
+#include <kernel/mmap.h>
+#include <kernel/ktrace.h>
+#include <kernel/pressure.h>
+#include <kernel/zswap.h>
 
 #include <toaru/hashmap.h>
 
@@ -65,7 +69,7 @@ kmalloc_real(
 					return 0;
 				}
 				for (unsigned int i = 0; i < (size + 0xFFF) / 0x1000; ++i) {
-					set_frame((index + i) * 0x1000);
+					set_frame((uint64_t)(index + i) * 0x1000);
 					page_t * page = get_page((uintptr_t)address + (i * 0x1000),0,kernel_directory);
 					ASSUME(page != NULL);
 					page->frame = index + i;
@@ -136,58 +140,105 @@ kvmalloc_p(
 uint32_t *frames;
 uint32_t nframes;
 
+/*
+ * Extra references to frames shared copy-on-write between
+ * address spaces. A value of 0 means the frame has a single
+ * owner; frames that reach FRAME_REFS_MAX are no longer shared.
+ */
+uint8_t *frame_refs;
+#define FRAME_REFS_MAX 0xFF
+
 #define INDEX_FROM_BIT(b) (b / 0x20)
 #define OFFSET_FROM_BIT(b) (b % 0x20)
 
+/*
+ * No word of the bitmap below frame_hint has a free frame in it,
+ * so searches can start there instead of at the bottom of memory;
+ * frame_hint_high is the same for frames above 4GiB, which user
+ * memory is taken from first.
+ */
+static uint32_t frame_hint = 0;
+static uint32_t frame_hint_high = INDEX_FROM_BIT(FRAMES_LOW);
+static uint32_t frames_used = 0;
+static uint32_t frames_system = 0; /* Of those, frames that aren't RAM at all */
+
+/* Allocator statistics, reported through /proc/meminfo */
+uint32_t frame_alloc_count = 0;
+uint32_t frame_scan_count = 0;
+
 void
 set_frame(
-		uintptr_t frame_addr
+		uint64_t frame_addr
 		) {
-	if (frame_addr < nframes * 4 * 0x400) {
+	if (frame_addr < (uint64_t)nframes * 0x1000) {
 		uint32_t frame  = frame_addr / 0x1000;
 		uint32_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
-		frames[index] |= ((uint32_t)0x1 << offset);
+		if (!(frames[index] & ((uint32_t)0x1 << offset))) {
+			frames[index] |= ((uint32_t)0x1 << offset);
+			frames_used++;
+		}
 	}
 }
 
 void
 clear_frame(
-		uintptr_t frame_addr
+		uint64_t frame_addr
 		) {
-	uint32_t frame  = frame_addr / 0x1000;
-	uint32_t index  = INDEX_FROM_BIT(frame);
-	uint32_t offset = OFFSET_FROM_BIT(frame);
-	frames[index] &= ~((uint32_t)0x1 << offset);
+	if (frame_addr < (uint64_t)nframes * 0x1000) {
+		uint32_t frame  = frame_addr / 0x1000;
+		uint32_t index  = INDEX_FROM_BIT(frame);
+		uint32_t offset = OFFSET_FROM_BIT(frame);
+		if (frames[index] & ((uint32_t)0x1 << offset)) {
+			frames[index] &= ~((uint32_t)0x1 << offset);
+			frames_used--;
+		}
+		if (index < INDEX_FROM_BIT(FRAMES_LOW)) {
+			if (index < frame_hint) frame_hint = index;
+		} else if (index < frame_hint_high) {
+			frame_hint_high = index;
+		}
+	}
 }
 
-uint32_t test_frame(uintptr_t frame_addr) {
+uint32_t test_frame(uint64_t frame_addr) {
 	uint32_t frame  = frame_addr / 0x1000;
 	uint32_t index  = INDEX_FROM_BIT(frame);
 	uint32_t offset = OFFSET_FROM_BIT(frame);
 	return (frames[index] & ((uint32_t)0x1 << offset));
 }
 
+/* A run of n free frames, for contiguous DMA memory; always below 4GiB */
 uint32_t first_n_frames(int n) {
-	for (uint32_t i = 0; i < nframes * 0x1000; i += 0x1000) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (test_frame(i + 0x1000 * j)) {
-				bad = j+1;
-			}
+	uint32_t run = 0;
+	uint32_t limit = nframes < FRAMES_LOW ? nframes : FRAMES_LOW;
+	for (uint32_t i = frame_hint * 0x20; i < limit; ++i) {
+		if (!OFFSET_FROM_BIT(i) && frames[INDEX_FROM_BIT(i)] == 0xFFFFFFFF) {
+			/* Skip full words entirely */
+			frame_scan_count++;
+			run = 0;
+			i += 0x1F;
+			continue;
 		}
-		if (!bad) {
-			return i / 0x1000;
+		if (test_frame((uint64_t)i * 0x1000)) {
+			run = 0;
+			continue;
+		}
+		if (++run == (uint32_t)n) {
+			return i + 1 - n;
 		}
 	}
 	return 0xFFFFFFFF;
 }
 
-uint32_t first_frame(void) {
+/* The first free frame from word *hint of the bitmap up to word `limit` */
+static uint32_t first_frame_in(uint32_t * hint, uint32_t limit) {
 	uint32_t i, j;
 
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
+	for (i = *hint; i < limit; ++i) {
+		frame_scan_count++;
 		if (frames[i] != 0xFFFFFFFF) {
+			*hint = i;
 			for (j = 0; j < 32; ++j) {
 				uint32_t testFrame = (uint32_t)0x1 << j;
 				if (!(frames[i] & testFrame)) {
@@ -196,17 +247,74 @@ uint32_t first_frame(void) {
 			}
 		}
 	}
+	*hint = limit;
 
-	debug_print(CRITICAL, "System claims to be out of usable memory, which means we probably overwrote the page frames.\033[0m");
+	return -1;
+}
+
+static uint32_t first_low_frame(void) {
+	uint32_t limit = INDEX_FROM_BIT(nframes < FRAMES_LOW ? nframes : FRAMES_LOW);
+	return first_frame_in(&frame_hint, limit);
+}
 
-	if (debug_video_crash) {
-		char * msgs[] = {"Out of memory.", NULL};
-		debug_video_crash(msgs);
+/*
+ * Any free frame: above 4GiB where there's memory there, which only
+ * page tables can reach, so what the kernel needs below lasts longer.
+ */
+uint32_t first_frame(void) {
+	if (nframes > FRAMES_LOW) {
+		uint32_t index = first_frame_in(&frame_hint_high, INDEX_FROM_BIT(nframes));
+		if (index != (uint32_t)-1) return index;
 	}
+	return first_low_frame();
+}
 
-	STOP;
+/*
+ * Claim a free frame, reclaiming or killing for one if there are
+ * none. Called with the frame allocator locked; it is let go while
+ * memory_exhausted() works, and held again on return.
+ */
+static uint32_t take_frame(int is_kernel) {
+	uint32_t index;
+	frame_alloc_count++;
+	while ((index = is_kernel ? first_low_frame() : first_frame()) == (uint32_t)-1) {
+		spin_unlock(frame_alloc_lock);
+		memory_exhausted(is_kernel);
+		spin_lock(frame_alloc_lock);
+	}
+	set_frame((uint64_t)index * 0x1000);
+	return index;
+}
 
-	return -1;
+/*
+ * Claim LARGE_PAGE_FRAMES free frames starting on a 2MiB boundary.
+ * Returns the first frame, or -1 if no such run is free.
+ */
+uint32_t alloc_large_frame(void) {
+	uint32_t found = (uint32_t)-1;
+	spin_lock(frame_alloc_lock);
+	/* The first 4MiB holds the kernel; don't bother looking there */
+	for (uint32_t block = 0x400000 / LARGE_PAGE_SIZE; block < nframes / LARGE_PAGE_FRAMES; ++block) {
+		uint32_t * words = &frames[INDEX_FROM_BIT(block * LARGE_PAGE_FRAMES)];
+		int free = 1;
+		for (int i = 0; i < LARGE_PAGE_FRAMES / 0x20; ++i) {
+			frame_scan_count++;
+			if (words[i]) {
+				free = 0;
+				break;
+			}
+		}
+		if (!free) continue;
+		for (int i = 0; i < LARGE_PAGE_FRAMES / 0x20; ++i) {
+			words[i] = 0xFFFFFFFF;
+		}
+		frames_used += LARGE_PAGE_FRAMES;
+		frame_alloc_count++;
+		found = block * LARGE_PAGE_FRAMES;
+		break;
+	}
+	spin_unlock(frame_alloc_lock);
+	return found;
 }
 
 void
@@ -218,19 +326,18 @@ alloc_frame(
 	ASSUME(page != NULL);
 	if (page->frame != 0) {
 		page->present = 1;
-		page->rw      = (is_writeable == 1) ? 1 : 0;
+		/* Shared frames stay read-only until the write fault breaks the share */
+		page->rw      = (is_writeable == 1 && !page->cow) ? 1 : 0;
 		page->user    = (is_kernel == 1)    ? 0 : 1;
 		return;
 	} else {
 		spin_lock(frame_alloc_lock);
-		uint32_t index = first_frame();
-		assert(index != (uint32_t)-1 && "Out of frames.");
-		set_frame(index * 0x1000);
-		page->frame   = index;
+		page->frame   = take_frame(is_kernel == 1);
 		spin_unlock(frame_alloc_lock);
 		page->present = 1;
 		page->rw      = (is_writeable == 1) ? 1 : 0;
 		page->user    = (is_kernel == 1)    ? 0 : 1;
+		memory_pressure_check();
 	}
 }
 
@@ -250,6 +357,51 @@ dma_frame(
 	set_frame(address);
 }
 
+/*
+ * Map a device's memory (a framebuffer, mostly) where it sits, user
+ * accessible, optionally write-combining. Whole 2MiB runs become large
+ * directory entries in the kernel directory, and in the current one if
+ * it links the same table, so a flip doesn't walk the TLB a page at a
+ * time. The shared table underneath is filled in regardless: address
+ * spaces cloned before this keep a correct view through it, and the
+ * edges of the range, which share their 2MiB with other devices, only
+ * ever get mapped through it.
+ */
+void dma_map_region(uintptr_t start, size_t size, int write_combine) {
+	uintptr_t end = start + size;
+	for (uintptr_t i = start & ~0xFFF; i < end; i += 0x1000) {
+		page_t * p = get_page(i, 1, kernel_directory);
+		dma_frame(p, 0, 1, i);
+		if (write_combine) {
+			/* PAT entry 7, set to write-combining in paging_install */
+			p->pat = 1;
+			p->writethrough = 1;
+			p->cachedisable = 1;
+		}
+	}
+
+	if (!paging_large_pages) {
+		smp_tlb_shootdown(NULL);
+		return;
+	}
+
+	uintptr_t first = (start + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+	for (uintptr_t i = first; i >= start && i < end && end - i >= LARGE_PAGE_SIZE; i += LARGE_PAGE_SIZE) {
+		uint32_t table = i / LARGE_PAGE_SIZE;
+		uint64_t entry = i | PDE_LARGE | 0x7; /* Present, R/w, User */
+		if (write_combine) {
+			entry |= (1 << 12) | 0x18; /* PAT, PCD, PWT: the same entry 7 */
+		}
+		if (current_directory->tables[table] == kernel_directory->tables[table]) {
+			current_directory->physical_tables[table] = entry;
+		}
+		kernel_directory->physical_tables[table] = entry;
+	}
+	invalidate_page_tables();
+	/* Kernel mappings, so in every processor's TLB */
+	smp_tlb_shootdown(NULL);
+}
+
 void
 free_frame(
 		page_t *page
@@ -258,39 +410,168 @@ free_frame(
 	if (!(frame = page->frame)) {
 		assert(0);
 		return;
+	} else if (page->swapped) {
+		zswap_free(frame);
+		page->frame   = 0x0;
+		page->swapped = 0;
 	} else {
-		clear_frame(frame * 0x1000);
+		spin_lock(frame_alloc_lock);
+		if (frame < nframes && frame_refs[frame]) {
+			/* Someone else still has this frame mapped */
+			frame_refs[frame]--;
+		} else {
+			clear_frame((uint64_t)frame * 0x1000);
+		}
+		spin_unlock(frame_alloc_lock);
 		page->frame = 0x0;
+		page->cow   = 0;
 	}
 }
 
-uintptr_t memory_use(void ) {
-	uintptr_t ret = 0;
-	uint32_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
+/*
+ * Map the frame behind `src` into `dest` as well, marking both
+ * pages read-only so that the first write to either one takes a
+ * private copy (see copy_on_write below). Pages that were already
+ * read-only are shared as they are.
+ *
+ * Returns 0 if the page can not be shared and must be copied.
+ */
+int
+share_frame(
+		page_t *src,
+		page_t *dest
+		) {
+	uint32_t frame = src->frame;
+
+	if (src->swapped) {
+		/* Still compressed; the slot is shared instead */
+		zswap_dup(frame);
+		*dest = *src;
+		return 1;
+	}
+	if (!src->present || !src->user) return 0;
+	/* Device memory and uncached mappings are copied as they always were */
+	if (src->writethrough || src->cachedisable) return 0;
+	if (frame >= nframes) return 0;
+
+	spin_lock(frame_alloc_lock);
+	if (frame_refs[frame] == FRAME_REFS_MAX) {
+		spin_unlock(frame_alloc_lock);
+		return 0;
+	}
+	frame_refs[frame]++;
+	spin_unlock(frame_alloc_lock);
+
+	if (src->rw) {
+		src->rw  = 0;
+		src->cow = 1;
+	}
+	*dest = *src;
+	return 1;
+}
+
+/*
+ * Take another reference to a frame on behalf of a new owner, such as
+ * a second mapping of a cached file page.
+ *
+ * Returns 0 if the frame can not take any more owners.
+ */
+int
+ref_frame(
+		uint32_t frame
+		) {
+	if (frame >= nframes) return 0;
+
+	spin_lock(frame_alloc_lock);
+	if (frame_refs[frame] == FRAME_REFS_MAX) {
+		spin_unlock(frame_alloc_lock);
+		return 0;
+	}
+	frame_refs[frame]++;
+	spin_unlock(frame_alloc_lock);
+	return 1;
+}
+
+/*
+ * Two kernel heap pages whose mappings are pointed at the frames being
+ * copied: frames above 4GiB can't be reached with paging turned off.
+ * Set up by heap_install().
+ */
+static uint8_t * copy_window = NULL;
+static page_t * copy_pages[2];
+static uint32_t copy_frames[2];
+
+void copy_frame(uint32_t src, uint32_t dest) {
+	uint32_t flags = int_save();
+	copy_pages[0]->frame = src;
+	copy_pages[1]->frame = dest;
+	invalidate_tables_at((uintptr_t)copy_window);
+	invalidate_tables_at((uintptr_t)copy_window + 0x1000);
+	memcpy(copy_window + 0x1000, copy_window, 0x1000);
+	copy_pages[0]->frame = copy_frames[0];
+	copy_pages[1]->frame = copy_frames[1];
+	invalidate_tables_at((uintptr_t)copy_window);
+	invalidate_tables_at((uintptr_t)copy_window + 0x1000);
+	int_restore(flags);
+}
+
+/*
+ * Resolve a write fault on a copy-on-write page: take a copy of
+ * the frame if it is still shared, or simply reclaim write access
+ * if every other owner has already let go of it.
+ */
+static void
+copy_on_write(
+		page_t *page,
+		uintptr_t address
+		) {
+	uint32_t frame = page->frame;
+
+	spin_lock(frame_alloc_lock);
+	if (frame_refs[frame]) {
+		uint32_t index = take_frame(0);
+		if (frame_refs[frame]) {
+			frame_refs[frame]--;
+			copy_frame(frame, index);
+			page->frame = index;
+		} else {
+			/* The other owners went while we waited for a frame */
+			clear_frame((uint64_t)index * 0x1000);
 		}
 	}
-	return ret * 4;
+	spin_unlock(frame_alloc_lock);
+	memory_pressure_check();
+
+	page->cow = 0;
+	page->rw  = 1;
+	invalidate_tables_at(address & 0xFFFFF000);
+}
+
+uintptr_t memory_use(void ) {
+	return (frames_used - frames_system) * 4;
 }
 
 uintptr_t memory_total(){
-	return nframes * 4;
+	return (nframes - frames_system) * 4;
 }
 
 void paging_install(uint32_t memsize) {
 	nframes = memsize  / 4;
 	frames  = (uint32_t *)kmalloc(INDEX_FROM_BIT(nframes * 8));
 	memset(frames, 0, INDEX_FROM_BIT(nframes * 8));
+	frame_refs = (uint8_t *)kmalloc(nframes);
+	memset(frame_refs, 0, nframes);
 
-	uintptr_t phys;
-	kernel_directory = (page_directory_t *)kvmalloc_p(sizeof(page_directory_t),&phys);
+	kernel_directory = (page_directory_t *)kvmalloc(sizeof(page_directory_t));
 	memset(kernel_directory, 0, sizeof(page_directory_t));
 
+	paging_install_cpu();
+}
+
+/*
+ * The PAT is each processor's own, and has to match on all of them.
+ */
+void paging_install_cpu(void) {
 	/* Set PAT 111b to Write-Combining */
 	asm volatile (
 		"mov $0x277, %%ecx\n" /* IA32_MSR_PAT */
@@ -300,15 +581,57 @@ void paging_install(uint32_t memsize) {
 		"wrmsr\n"
 		: : : "ecx", "edx", "eax"
 	);
-
 }
 
+/*
+ * Keep a frame that isn't RAM out of the allocator.
+ */
 void paging_mark_system(uint64_t addr) {
-	set_frame(addr);
+	if (addr >= (uint64_t)nframes * 0x1000) return;
+	if (!test_frame(addr)) {
+		set_frame(addr);
+		frames_system++;
+	}
+}
+
+/* Set once CR4.PAE is on; PAE always has 2MiB pages */
+int paging_large_pages = 0;
+
+static void paging_enable_pae(void) {
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if (!(edx & (1 << 6))) {
+		debug_print(CRITICAL, "This processor doesn't have PAE, which paging is built on.");
+		IRQ_OFF;
+		STOP;
+	}
+
+	/* Before paging is turned on; the page tables mean something else after */
+	uintptr_t cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= (1 << 5);
+	asm volatile ("mov %0, %%cr4" :: "r"(cr4));
+	paging_large_pages = 1;
+}
+
+/*
+ * Point a directory's PDPT at its four page directories, wherever the
+ * kernel heap put them, and record where the PDPT is for CR3. The
+ * entries are read into the processor when CR3 is loaded, so they are
+ * never changed after this.
+ */
+void paging_set_physical(page_directory_t * dir) {
+	for (int i = 0; i < 4; ++i) {
+		page_t * page = get_page((uintptr_t)&dir->physical_tables[i * PAGE_TABLE_ENTRIES], 0, kernel_directory);
+		dir->pdpt[i] = ((uint64_t)page->frame << 12) | 0x1; /* Present; nothing else is allowed */
+	}
+	uintptr_t pdpt = (uintptr_t)&dir->pdpt;
+	dir->physical_address = get_page(pdpt, 0, kernel_directory)->frame * 0x1000 + (pdpt & 0xFFF);
 }
 
 void paging_finalize(void) {
 	debug_print(INFO, "Placement pointer is at 0x%x", placement_pointer);
+	paging_enable_pae();
 #if 1
 	get_page(0,1,kernel_directory)->present = 0;
 	set_frame(0);
@@ -316,20 +639,20 @@ void paging_finalize(void) {
 #else
 	for (uintptr_t i = 0x0; i < 0x80000; i += 0x1000) {
 #endif
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	for (uintptr_t i = 0x80000; i < 0x100000; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	for (uintptr_t i = 0x100000; i < placement_pointer + 0x3000; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 1, 0, i);
+		dma_frame(get_page(i, 1, kernel_directory), 1, 1, i);
 	}
 	debug_print(INFO, "Mapping VGA text-mode directly.");
 	for (uintptr_t j = 0xb8000; j < 0xc0000; j += 0x1000) {
 		dma_frame(get_page(j, 0, kernel_directory), 0, 1, j);
 	}
 	isrs_install_handler(14, page_fault);
-	kernel_directory->physical_address = (uintptr_t)kernel_directory->physical_tables;
+	paging_set_physical(kernel_directory);
 
 	uintptr_t tmp_heap_start = KERNEL_HEAP_INIT;
 
@@ -341,13 +664,13 @@ void paging_finalize(void) {
 
 	/* Kernel Heap Space */
 	for (uintptr_t i = placement_pointer + 0x3000; i < tmp_heap_start; i += 0x1000) {
-		alloc_frame(get_page(i, 1, kernel_directory), 1, 0);
+		alloc_frame(get_page(i, 1, kernel_directory), 1, 1);
 	}
 	/* And preallocate the page entries for all the rest of the kernel heap as well */
 	for (uintptr_t i = tmp_heap_start; i < KERNEL_HEAP_END; i += 0x1000) {
 		get_page(i, 1, kernel_directory);
 	}
-	for (unsigned int i = 0xE000; i <= 0xFFF0; i += 0x40) {
+	for (unsigned int i = 0xE000; i <= 0xFFF0; i += PAGE_TABLE_SPAN >> 16) {
 		get_page(i << 16UL, 1, kernel_directory);
 	}
 
@@ -359,8 +682,8 @@ void paging_finalize(void) {
 uintptr_t map_to_physical(uintptr_t virtual) {
 	uintptr_t remaining = virtual % 0x1000;
 	uintptr_t frame = virtual / 0x1000;
-	uintptr_t table = frame / 1024;
-	uintptr_t subframe = frame % 1024;
+	uintptr_t table = frame / PAGE_TABLE_ENTRIES;
+	uintptr_t subframe = frame % PAGE_TABLE_ENTRIES;
 
 	if (current_directory->tables[table]) {
 		page_t * p = &current_directory->tables[table]->pages[subframe];
@@ -371,29 +694,29 @@ uintptr_t map_to_physical(uintptr_t virtual) {
 }
 
 void debug_print_directory(page_directory_t * arg) {
-	page_directory_t * current_directory = arg;
-	debug_print(INSANE, " ---- [k:0x%x u:0x%x]", kernel_directory, current_directory);
-	for (uintptr_t i = 0; i < 1024; ++i) {
-		if (!current_directory->tables[i] || (uintptr_t)current_directory->tables[i] == (uintptr_t)0xFFFFFFFF) {
+	page_directory_t * dir = arg;
+	debug_print(INSANE, " ---- [k:0x%x u:0x%x]", kernel_directory, dir);
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
+		if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
 		}
-		if (kernel_directory->tables[i] == current_directory->tables[i]) {
-			debug_print(INSANE, "  0x%x - kern [0x%x/0x%x] 0x%x", current_directory->tables[i], &current_directory->tables[i], &kernel_directory->tables[i], i * 0x1000 * 1024);
-			for (uint16_t j = 0; j < 1024; ++j) {
+		if (kernel_directory->tables[i] == dir->tables[i]) {
+			debug_print(INSANE, "  0x%x - kern [0x%x/0x%x] 0x%x", dir->tables[i], &dir->tables[i], &kernel_directory->tables[i], i * PAGE_TABLE_SPAN);
+			for (uint16_t j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
 #if 1
-				page_t *  p= &current_directory->tables[i]->pages[j];
+				page_t *  p= &dir->tables[i]->pages[j];
 				if (p->frame) {
-					debug_print(INSANE, " k  0x%x 0x%x %s", (i * 1024 + j) * 0x1000, p->frame * 0x1000, p->present ? "[present]" : "");
+					debug_print(INSANE, " k  0x%x 0x%x %s", (i * PAGE_TABLE_ENTRIES + j) * 0x1000, p->frame * 0x1000, p->present ? "[present]" : "");
 				}
 #endif
 			}
 		} else {
-			debug_print(INSANE, "  0x%x - user [0x%x] 0x%x [0x%x]", current_directory->tables[i], &current_directory->tables[i], i * 0x1000 * 1024, kernel_directory->tables[i]);
-			for (uint16_t j = 0; j < 1024; ++j) {
+			debug_print(INSANE, "  0x%x - user [0x%x] 0x%x [0x%x]", dir->tables[i], &dir->tables[i], i * PAGE_TABLE_SPAN, kernel_directory->tables[i]);
+			for (uint16_t j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
 #if 1
-				page_t *  p= &current_directory->tables[i]->pages[j];
+				page_t *  p= &dir->tables[i]->pages[j];
 				if (p->frame) {
-					debug_print(INSANE, "    0x%x 0x%x %s", (i * 1024 + j) * 0x1000, p->frame * 0x1000, p->present ? "[present]" : "");
+					debug_print(INSANE, "    0x%x 0x%x %s", (i * PAGE_TABLE_ENTRIES + j) * 0x1000, p->frame * 0x1000, p->present ? "[present]" : "");
 				}
 #endif
 			}
@@ -410,7 +733,7 @@ switch_page_directory(
 	asm volatile (
 			"mov %0, %%cr3\n"
 			"mov %%cr0, %%eax\n"
-			"orl $0x80000000, %%eax\n"
+			"orl $0x80010000, %%eax\n" /* PG, and WP so kernel writes hit copy-on-write pages */
 			"mov %%eax, %%cr0\n"
 			:: "r"(dir->physical_address)
 			: "%eax");
@@ -430,6 +753,63 @@ void invalidate_tables_at(uintptr_t addr) {
 			:: "r"(addr) : "%eax");
 }
 
+/*
+ * Pages of zeroes for page tables, so cloning an address space
+ * doesn't stop to clear each table it makes. The idle task fills
+ * the pool when there's nothing else to do; when it runs dry,
+ * tables are cleared as they are allocated, as before.
+ *
+ * The pool is guarded by turning interrupts off rather than with a
+ * lock: the idle task can be preempted at any point, and a lock it
+ * held would never be let go.
+ */
+#define ZERO_POOL_SIZE 32
+static void * zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_count = 0;
+
+void * zeroed_page(uintptr_t * phys) {
+	void * page = NULL;
+	if (heap_end) {
+		uint32_t flags = int_save();
+		if (zero_pool_count) {
+			page = zero_pool[--zero_pool_count];
+		}
+		int_restore(flags);
+	}
+	if (page) {
+		if (phys) *phys = map_to_physical((uintptr_t)page);
+		return page;
+	}
+	page = (void *)kvmalloc_p(0x1000, phys);
+	if (page) memset(page, 0, 0x1000);
+	return page;
+}
+
+/*
+ * Add a page to the pool; returns 0 if it is already full.
+ * Expects interrupts to be on, and leaves them that way.
+ */
+int zero_pool_fill(void) {
+	if (zero_pool_count >= ZERO_POOL_SIZE) return 0;
+
+	/* Nobody is in the allocator when the idle task runs, and with
+	 * interrupts off nobody can get in while we are. */
+	IRQ_OFF;
+	void * page = (void *)kvmalloc(0x1000);
+	IRQ_ON;
+
+	memset(page, 0, 0x1000);
+
+	IRQ_OFF;
+	if (zero_pool_count < ZERO_POOL_SIZE) {
+		zero_pool[zero_pool_count++] = page;
+		page = NULL;
+	}
+	if (page) free(page);
+	IRQ_ON;
+	return 1;
+}
+
 page_t *
 get_page(
 		uintptr_t address,
@@ -437,21 +817,81 @@ get_page(
 		page_directory_t * dir
 		) {
 	address /= 0x1000;
-	uint32_t table_index = address / 1024;
+	uint32_t table_index = address / PAGE_TABLE_ENTRIES;
 	if (dir->tables[table_index]) {
-		return &dir->tables[table_index]->pages[address % 1024];
+		return &dir->tables[table_index]->pages[address % PAGE_TABLE_ENTRIES];
 	} else if(make) {
 		uint32_t temp;
-		dir->tables[table_index] = (page_table_t *)kvmalloc_p(sizeof(page_table_t), (uintptr_t *)(&temp));
+		dir->tables[table_index] = (page_table_t *)zeroed_page((uintptr_t *)(&temp));
 		ASSUME(dir->tables[table_index] != NULL);
-		memset(dir->tables[table_index], 0, sizeof(page_table_t));
 		dir->physical_tables[table_index] = temp | 0x7; /* Present, R/w, User */
-		return &dir->tables[table_index]->pages[address % 1024];
+		return &dir->tables[table_index]->pages[address % PAGE_TABLE_ENTRIES];
 	} else {
 		return 0;
 	}
 }
 
+/*
+ * A frame of zeroes that reads of untouched heap pages are given,
+ * shared copy-on-write. The first page read becomes it; the kernel
+ * keeps a reference of its own, so it is never freed.
+ */
+static uint32_t zero_frame = 0;
+
+static int map_zero_frame(page_t * page, uintptr_t address) {
+	if (!zero_frame) {
+		alloc_frame(page, 0, 1);
+		invalidate_tables_at(address);
+		memset((void *)address, 0, 0x1000);
+		zero_frame = page->frame;
+		ref_frame(zero_frame);
+	} else {
+		if (!ref_frame(zero_frame)) return 0;
+		page->frame   = zero_frame;
+		page->present = 1;
+		page->user    = 1;
+	}
+	page->rw  = 0;
+	page->cow = 1;
+	invalidate_tables_at(address);
+	return 1;
+}
+
+/*
+ * sbrk() only reserves heap pages; fill one in on first touch.
+ * Reads get the zero frame, and writes a fresh page of their own.
+ *
+ * Returns 0 if the address isn't in the heap.
+ */
+static int heap_fault(uintptr_t address, int write) {
+	process_t * proc = (process_t *)current_process;
+	if (proc->group != 0) {
+		process_t * leader = process_from_pid(proc->group);
+		if (leader) proc = leader;
+	}
+
+	uintptr_t page_address = address & 0xFFFFF000;
+	if (!proc->image.heap_start || page_address < proc->image.heap_start ||
+		page_address > proc->image.heap_actual) {
+		return 0;
+	}
+
+	page_t * page = get_page(page_address, 1, current_directory);
+	if (page->present) {
+		/* Another thread got here first */
+		return 1;
+	}
+
+	if (!write && map_zero_frame(page, page_address)) {
+		return 1;
+	}
+
+	alloc_frame(page, 0, 1);
+	invalidate_tables_at(page_address);
+	memset((void *)page_address, 0, 0x1000);
+	return 1;
+}
+
 void
 page_fault(
 		struct regs *r)  {
@@ -459,6 +899,8 @@ page_fault(
 	uint32_t faulting_address;
 	asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
 
+	KTRACE(KTRACE_PAGE_FAULT, faulting_address, r->err_code, r->eip);
+
 	if (r->eip == SIGNAL_RETURN) {
 		return_from_signal_handler();
 	} else if (r->eip == THREAD_RETURN) {
@@ -466,6 +908,36 @@ page_fault(
 		kexit(0);
 	}
 
+	/* Write to a present page: may be a frame shared by fork() */
+	if ((r->err_code & 0x3) == 0x3 && faulting_address < SHM_START) {
+		page_t * page = get_page(faulting_address, 0, current_directory);
+		if (page && page->cow) {
+			copy_on_write(page, faulting_address);
+			if (current_process) current_process->usage.minflt++;
+			return;
+		}
+	}
+
+	/* User access to a page another thread is still reading in; wait for it */
+	if ((r->err_code & 0x5) == 0x5 && faulting_address < USER_STACK_BOTTOM && current_process &&
+			mmap_filling(faulting_address)) {
+		switch_task(1);
+		return;
+	}
+
+	/* Not-present page: may be heap or part of an mmap() region not yet touched */
+	if (!(r->err_code & 0x1) && faulting_address < USER_STACK_BOTTOM && current_process) {
+		if (zswap_fault(faulting_address)) {
+			current_process->usage.majflt++;
+			return;
+		}
+		if (heap_fault(faulting_address, r->err_code & 0x2) ||
+			mmap_fault(faulting_address, r->err_code & 0x2)) {
+			current_process->usage.minflt++;
+			return;
+		}
+	}
+
 #if 1
 	int present  = !(r->err_code & 0x1) ? 1 : 0;
 	int rw       = r->err_code & 0x2    ? 1 : 0;
@@ -539,6 +1011,12 @@ page_fault(
 
 void heap_install(void ) {
 	heap_end = (placement_pointer + 0x1000) & ~0xFFF;
+
+	copy_window = (uint8_t *)kvmalloc(0x2000);
+	for (int i = 0; i < 2; ++i) {
+		copy_pages[i] = get_page((uintptr_t)copy_window + i * 0x1000, 0, kernel_directory);
+		copy_frames[i] = copy_pages[i]->frame;
+	}
 }
 
 void * sbrk(uintptr_t increment) {
@@ -553,14 +1031,15 @@ void * sbrk(uintptr_t increment) {
 			debug_print(INFO, "Allocating frame at 0x%x...", i);
 			page_t * page = get_page(i, 0, kernel_directory);
 			assert(page && "Kernel heap allocation fault.");
-			alloc_frame(page, 1, 0);
+			alloc_frame(page, 1, 1);
 		}
 		invalidate_page_tables();
 		debug_print(INFO, "Done.");
 	}
 
+	/* Not cleared: the allocator sets up what it needs, and calloc()
+	 * and zeroed_page() do the clearing for those who ask for it. */
 	heap_end += increment;
-	memset((void *)address, 0x0, increment);
 	return (void *)address;
 }
 
@@ -0,0 +1,573 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Memory Mapped Regions
+ *
+ * mmap() only records a region; its pages are filled in by the page
+ * fault handler when they are first touched. Pages read from files are
+ * kept in a cache keyed by (device, inode, page) and mapped read-only
+ * into every process that maps the same file, so the text of a shared
+ * library is only in memory once. Writes to private mappings break the
+ * share through the same copy-on-write path fork() uses.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/mmap.h>
+#include <kernel/pageindex.h>
+
+#define MMAP_PAGE_SIZE     0x1000
+#define MMAP_CACHE_BUCKETS 1024       /* Must be a power of two */
+#define MMAP_HEAP_GAP      0x10000000 /* Room left above the heap for sbrk() */
+
+typedef struct mmap_page {
+	page_index_entry_t entry; /* Keyed by inode and page of the file */
+	uint32_t frame;
+} mmap_page_t;
+
+static spin_lock_t mmap_cache_lock = { 0 };
+static page_index_t mmap_cache = { 0 };
+
+/*
+ * File page cache
+ */
+
+static inline uint64_t cache_key(uint32_t inode, uint32_t index) {
+	return ((uint64_t)inode << 32) | index;
+}
+
+/*
+ * Only nodes that name their backing object can be told apart
+ * from other files; anything else gets private pages.
+ */
+static int cache_usable(fs_node_t * node) {
+	return node->device != NULL;
+}
+
+/*
+ * Pages we are willing to hold; 1/16th of system memory.
+ */
+static uint32_t cache_limit(void) {
+	return memory_total() / 4 / 16;
+}
+
+static mmap_page_t * cache_lookup(void * device, uint32_t inode, uint32_t index) {
+	return (mmap_page_t *)page_index_lookup(&mmap_cache, device, cache_key(inode, index));
+}
+
+/*
+ * Drop the cache's hold on a page; processes that still have
+ * it mapped keep their own references to the frame.
+ */
+static void cache_remove(mmap_page_t * page) {
+	page_index_remove(&mmap_cache, &page->entry);
+
+	page_t tmp;
+	memset(&tmp, 0, sizeof(page_t));
+	tmp.frame = page->frame;
+	free_frame(&tmp);
+
+	free(page);
+}
+
+/*
+ * Find a cached page of a file and take a reference to its frame.
+ */
+static uint32_t cache_get(fs_node_t * node, uint32_t index) {
+	uint32_t frame = 0;
+	spin_lock(mmap_cache_lock);
+	if (mmap_cache.hash) {
+		mmap_page_t * page = cache_lookup(node->device, node->inode, index);
+		if (page && ref_frame(page->frame)) {
+			page_index_touch(&mmap_cache, &page->entry);
+			frame = page->frame;
+		}
+	}
+	spin_unlock(mmap_cache_lock);
+	return frame;
+}
+
+/*
+ * Offer a freshly read frame to the cache, which takes its own
+ * reference if it accepts it.
+ */
+static int cache_put(fs_node_t * node, uint32_t index, uint32_t frame) {
+	spin_lock(mmap_cache_lock);
+	if (!mmap_cache.hash) {
+		page_index_init(&mmap_cache, MMAP_CACHE_BUCKETS);
+	}
+
+	if (cache_lookup(node->device, node->inode, index)) {
+		/* Someone else read it first; ours stays private */
+		spin_unlock(mmap_cache_lock);
+		return 0;
+	}
+
+	while (mmap_cache.count >= cache_limit() && mmap_cache.lru_tail) {
+		cache_remove((mmap_page_t *)mmap_cache.lru_tail);
+	}
+
+	if (!ref_frame(frame)) {
+		spin_unlock(mmap_cache_lock);
+		return 0;
+	}
+
+	mmap_page_t * page = malloc(sizeof(mmap_page_t));
+	page->entry.device = node->device;
+	page->entry.key    = cache_key(node->inode, index);
+	page->frame = frame;
+	page_index_insert(&mmap_cache, &page->entry);
+
+	spin_unlock(mmap_cache_lock);
+	return 1;
+}
+
+/*
+ * Drop everything, when memory is short. This is the one cache that
+ * holds frames rather than heap, so it is what an out-of-frames fault
+ * looks to first; it is skipped if the cache is busy. Returns kB of
+ * frames the cache was the last holder of.
+ */
+uint32_t mmap_reclaim(void) {
+	if (mmap_cache_lock[0] || !mmap_cache.count) return 0;
+
+	spin_lock(mmap_cache_lock);
+	uint32_t before = memory_use();
+	while (mmap_cache.lru_tail) {
+		cache_remove((mmap_page_t *)mmap_cache.lru_tail);
+	}
+	uint32_t after = memory_use();
+	spin_unlock(mmap_cache_lock);
+	return before - after;
+}
+
+/*
+ * Forget cached pages overlapping a write to a file. Pages already
+ * mapped keep their old contents.
+ */
+void mmap_invalidate(fs_node_t * node, uint64_t offset, uint32_t size) {
+	if (!mmap_cache.count || !size || !cache_usable(node)) return;
+
+	spin_lock(mmap_cache_lock);
+	uint64_t first = offset / MMAP_PAGE_SIZE;
+	uint64_t last  = (offset + size - 1) / MMAP_PAGE_SIZE;
+	if (last > 0xFFFFFFFF) last = 0xFFFFFFFF; /* No page past that is cached */
+	if (first > last) {
+		spin_unlock(mmap_cache_lock);
+		return;
+	}
+	if (last - first >= mmap_cache.count) {
+		/* Cheaper to look at everything we have */
+		page_index_entry_t * entry = mmap_cache.lru_head;
+		while (entry) {
+			page_index_entry_t * next = entry->lru_next;
+			if (entry->device == node->device && entry->key >= cache_key(node->inode, first) &&
+					entry->key <= cache_key(node->inode, last)) {
+				cache_remove((mmap_page_t *)entry);
+			}
+			entry = next;
+		}
+	} else {
+		for (uint64_t index = first; index <= last; ++index) {
+			mmap_page_t * page = cache_lookup(node->device, node->inode, index);
+			if (page) cache_remove(page);
+		}
+	}
+	spin_unlock(mmap_cache_lock);
+}
+
+/*
+ * Regions
+ */
+
+/*
+ * Threads share their leader's address space, and its regions.
+ */
+static process_t * region_owner(process_t * proc) {
+	if (proc->group != 0) {
+		process_t * leader = process_from_pid(proc->group);
+		if (leader) return leader;
+	}
+	return proc;
+}
+
+static node_t * find_region(process_t * proc, uintptr_t address) {
+	foreach(node, proc->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (address < region->start) break;
+		if (address < region->end) return node;
+	}
+	return NULL;
+}
+
+/*
+ * Whether any region overlaps [start, end). The caller holds the image lock.
+ */
+int mmap_overlaps(process_t * proc, uintptr_t start, uintptr_t end) {
+	foreach(node, proc->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (region->start >= end) break;
+		if (region->end > start) return 1;
+	}
+	return 0;
+}
+
+static void free_region(mmap_region_t * region) {
+	if (region->node) {
+		close_fs(region->node);
+	}
+	free(region);
+}
+
+/*
+ * Insert a region, keeping the list sorted by address.
+ */
+static void insert_region(process_t * proc, mmap_region_t * region) {
+	foreach(node, proc->mmap_regions) {
+		mmap_region_t * other = node->value;
+		if (other->start > region->start) {
+			list_insert_before(proc->mmap_regions, node, region);
+			return;
+		}
+	}
+	list_insert(proc->mmap_regions, region);
+}
+
+/*
+ * Make sure no region straddles `address`.
+ */
+static void split_region(process_t * proc, uintptr_t address) {
+	node_t * node = find_region(proc, address);
+	if (!node) return;
+
+	mmap_region_t * region = node->value;
+	if (region->start == address) return;
+
+	mmap_region_t * upper = malloc(sizeof(mmap_region_t));
+	memcpy(upper, region, sizeof(mmap_region_t));
+	upper->start  = address;
+	upper->offset = region->offset + (address - region->start);
+	if (upper->node) {
+		upper->node = clone_fs(upper->node);
+	}
+	region->end = address;
+	list_insert_after(proc->mmap_regions, node, upper);
+}
+
+/*
+ * Unmap and release every page in a range.
+ */
+static void release_pages(uintptr_t start, uintptr_t end) {
+	for (uintptr_t address = start; address < end; address += MMAP_PAGE_SIZE) {
+		page_t * page = get_page(address, 0, current_directory);
+		if (!page) continue;
+		if (page->frame) {
+			free_frame(page);
+		}
+		memset(page, 0, sizeof(page_t));
+		invalidate_tables_at(address);
+	}
+}
+
+/*
+ * Remove the parts of any regions inside a range.
+ */
+static void unmap_range(process_t * proc, uintptr_t start, uintptr_t end) {
+	split_region(proc, start);
+	split_region(proc, end);
+
+	node_t * node = proc->mmap_regions->head;
+	while (node) {
+		node_t * next = node->next;
+		mmap_region_t * region = node->value;
+		if (region->start >= end) break;
+		if (region->start >= start) {
+			release_pages(region->start, region->end);
+			list_delete(proc->mmap_regions, node);
+			free(node);
+			free_region(region);
+		}
+		node = next;
+	}
+}
+
+/*
+ * Highest gap of `length` bytes below the stack and clear of the heap.
+ */
+static uintptr_t find_gap(process_t * proc, size_t length) {
+	uintptr_t top = MMAP_TOP;
+	node_t * node = proc->mmap_regions->tail;
+	while (node) {
+		mmap_region_t * region = node->value;
+		if (top - region->end >= length) break;
+		top = region->start;
+		node = node->prev;
+	}
+
+	uintptr_t bottom = ((proc->image.heap_actual + 0xFFF) & ~0xFFF) + MMAP_HEAP_GAP;
+	if (bottom < MMAP_BOTTOM) bottom = MMAP_BOTTOM;
+	if (top < length || top - length < bottom) return 0;
+	return top - length;
+}
+
+uintptr_t mmap_map(uintptr_t addr, size_t length, int prot, int flags, fs_node_t * node, uint32_t offset) {
+	process_t * proc = region_owner((process_t *)current_process);
+
+	if (!length || (offset & 0xFFF)) return -EINVAL;
+	if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) return -EINVAL;
+	if ((flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+		/* Nothing would carry the writes back to the file or to other processes */
+		debug_print(WARNING, "Writable shared mappings are not supported (pid=%d)", proc->id);
+		return -EINVAL;
+	}
+
+	length = (length + 0xFFF) & ~0xFFF;
+
+	spin_lock(proc->image.lock);
+	uintptr_t start;
+	if (flags & MAP_FIXED) {
+		if ((addr & 0xFFF) || addr < MMAP_BOTTOM || addr + length > MMAP_TOP || addr + length < addr) {
+			spin_unlock(proc->image.lock);
+			return -EINVAL;
+		}
+		start = addr;
+		/* Whatever was there before is replaced */
+		unmap_range(proc, start, start + length);
+		release_pages(start, start + length);
+	} else {
+		start = find_gap(proc, length);
+		if (!start) {
+			spin_unlock(proc->image.lock);
+			return -ENOMEM;
+		}
+	}
+
+	mmap_region_t * region = malloc(sizeof(mmap_region_t));
+	region->start  = start;
+	region->end    = start + length;
+	region->prot   = prot;
+	region->flags  = flags;
+	region->node   = node ? clone_fs(node) : NULL;
+	region->offset = offset;
+	insert_region(proc, region);
+	spin_unlock(proc->image.lock);
+
+	debug_print(INFO, "mmap [0x%x:0x%x] prot=%d flags=0x%x %s (pid=%d)", region->start, region->end,
+			prot, flags, node ? node->name : "(anonymous)", proc->id);
+	return start;
+}
+
+int mmap_unmap(uintptr_t addr, size_t length) {
+	process_t * proc = region_owner((process_t *)current_process);
+
+	if ((addr & 0xFFF) || !length) return -EINVAL;
+	length = (length + 0xFFF) & ~0xFFF;
+	if (addr + length < addr) return -EINVAL;
+
+	spin_lock(proc->image.lock);
+	unmap_range(proc, addr, addr + length);
+	spin_unlock(proc->image.lock);
+	return 0;
+}
+
+int mmap_protect(uintptr_t addr, size_t length, int prot) {
+	process_t * proc = region_owner((process_t *)current_process);
+
+	if ((addr & 0xFFF) || !length) return -EINVAL;
+	length = (length + 0xFFF) & ~0xFFF;
+	uintptr_t end = addr + length;
+	if (end < addr) return -EINVAL;
+
+	spin_lock(proc->image.lock);
+
+	/* The whole range has to be mapped */
+	uintptr_t covered = addr;
+	foreach(node, proc->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (region->end <= covered) continue;
+		if (region->start > covered) break;
+		if ((region->flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+			spin_unlock(proc->image.lock);
+			return -EACCES;
+		}
+		covered = region->end;
+		if (covered >= end) break;
+	}
+	if (covered < end) {
+		spin_unlock(proc->image.lock);
+		return -ENOMEM;
+	}
+
+	split_region(proc, addr);
+	split_region(proc, end);
+
+	foreach(node, proc->mmap_regions) {
+		mmap_region_t * region = node->value;
+		if (region->start >= end) break;
+		if (region->start < addr) continue;
+		region->prot = prot;
+
+		for (uintptr_t address = region->start; address < region->end; address += MMAP_PAGE_SIZE) {
+			page_t * page = get_page(address, 0, current_directory);
+			if (!page || !(page->present || page->swapped)) continue;
+			page->user = (prot == PROT_NONE) ? 0 : 1;
+			if (prot & PROT_WRITE) {
+				/* Shared or not, the next write fault sorts it out */
+				if (!page->rw) page->cow = 1;
+			} else {
+				page->rw  = 0;
+				page->cow = 0;
+			}
+			invalidate_tables_at(address);
+		}
+	}
+
+	spin_unlock(proc->image.lock);
+	return 0;
+}
+
+/*
+ * Fill in a page of a region on first touch.
+ *
+ * Returns 0 if the address is not mapped (or not for this access),
+ * in which case the fault is a real one.
+ */
+int mmap_fault(uintptr_t address, int write) {
+	process_t * proc = region_owner((process_t *)current_process);
+	if (!proc->mmap_regions) return 0;
+
+	spin_lock(proc->image.lock);
+	node_t * node = find_region(proc, address);
+	if (!node) {
+		spin_unlock(proc->image.lock);
+		return 0;
+	}
+	mmap_region_t region;
+	memcpy(&region, node->value, sizeof(mmap_region_t));
+	if (region.prot == PROT_NONE || (write && !(region.prot & PROT_WRITE))) {
+		spin_unlock(proc->image.lock);
+		return 0;
+	}
+	/* Keep the file around while we read from it */
+	fs_node_t * file = region.node ? clone_fs(region.node) : NULL;
+	spin_unlock(proc->image.lock);
+
+	int writable = (region.prot & PROT_WRITE) ? 1 : 0;
+	uintptr_t page_address = address & ~0xFFF;
+	page_t * page = get_page(page_address, 1, current_directory);
+
+	if (page->present) {
+		/* Another thread got here first (and may still be filling it in) */
+		if (file) close_fs(file);
+		return 1;
+	}
+
+	/*
+	 * New frames stay kernel-only until they are filled: other threads
+	 * must not see, or write to, a page that may be about to go into
+	 * the cache for every process. They wait in page_fault() meanwhile.
+	 */
+	if (!file) {
+		alloc_frame(page, 0, 1);
+		page->user = 0;
+		invalidate_tables_at(page_address);
+		memset((void *)page_address, 0, MMAP_PAGE_SIZE);
+		page->rw   = writable;
+		page->user = 1;
+		invalidate_tables_at(page_address);
+		return 1;
+	}
+
+	uint32_t file_offset = region.offset + (page_address - region.start);
+	uint32_t index = file_offset / MMAP_PAGE_SIZE;
+	int shareable = cache_usable(file);
+	uint32_t frame = shareable ? cache_get(file, index) : 0;
+
+	if (frame) {
+		page->frame   = frame;
+		page->present = 1;
+		page->user    = 1;
+		page->rw      = 0;
+		page->cow     = writable;
+	} else {
+		alloc_frame(page, 0, 1);
+		page->user = 0;
+		invalidate_tables_at(page_address);
+
+		uint32_t got = 0;
+		if (file_offset < file->length) {
+			uint32_t size = file->length - file_offset;
+			if (size > MMAP_PAGE_SIZE) size = MMAP_PAGE_SIZE;
+			got = read_fs(file, file_offset, size, (uint8_t *)page_address);
+			if (got > size) got = 0;
+		}
+		if (got < MMAP_PAGE_SIZE) {
+			memset((void *)(page_address + got), 0, MMAP_PAGE_SIZE - got);
+		}
+
+		if (shareable && cache_put(file, index, page->frame)) {
+			page->rw  = 0;
+			page->cow = writable;
+		} else {
+			page->rw  = writable;
+		}
+		page->user = 1;
+	}
+	invalidate_tables_at(page_address);
+
+	close_fs(file);
+	return 1;
+}
+
+/*
+ * Whether a user fault at `address` hit a page that mmap_fault() is
+ * still filling in for another thread, and so is not yet the user's.
+ */
+int mmap_filling(uintptr_t address) {
+	process_t * proc = region_owner((process_t *)current_process);
+	if (!proc->mmap_regions) return 0;
+
+	spin_lock(proc->image.lock);
+	int in_region = find_region(proc, address) != NULL;
+	spin_unlock(proc->image.lock);
+	if (!in_region) return 0;
+
+	page_t * page = get_page(address & ~0xFFF, 0, current_directory);
+	return page && page->present && !page->user;
+}
+
+/*
+ * A forked child gets a copy of its parent's regions; the pages
+ * themselves came across with the page directory.
+ */
+void mmap_fork(process_t * parent, process_t * child) {
+	parent = region_owner(parent);
+	spin_lock(parent->image.lock);
+	foreach(node, parent->mmap_regions) {
+		mmap_region_t * region = malloc(sizeof(mmap_region_t));
+		memcpy(region, node->value, sizeof(mmap_region_t));
+		if (region->node) {
+			region->node = clone_fs(region->node);
+		}
+		list_insert(child->mmap_regions, region);
+	}
+	spin_unlock(parent->image.lock);
+}
+
+/*
+ * Forget all regions of a process (on exit or exec); the pages are
+ * released along with the rest of the address space.
+ */
+void mmap_release_all(process_t * proc) {
+	if (!proc->mmap_regions) return;
+
+	spin_lock(proc->image.lock);
+	node_t * node;
+	while ((node = list_pop(proc->mmap_regions))) {
+		free_region(node->value);
+		free(node);
+	}
+	spin_unlock(proc->image.lock);
+}
@@ -0,0 +1,235 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Memory Pressure
+ *
+ * Once less than 1/32nd of memory is free, the [kmemd] tasklet asks
+ * every registered cache to give back what it can, sends SIGLOWMEM
+ * to processes that have a handler for it, so they can drop caches of
+ * their own, and then compresses cold pages (see zswap.c) until 1/16th
+ * is free again. It does so again only after free memory has climbed
+ * back above that.
+ *
+ * When the frame allocator finds nothing free at all for a process,
+ * it reclaims in place, and if that doesn't help, kills the process
+ * holding the most memory and waits for its frames to come back. Most
+ * caches live in the kernel heap, so only the mmap file cache gives
+ * back frames; the rest just keep the heap from having to grow.
+ *
+ * Frames for the kernel itself are asked for while growing the heap,
+ * under the allocator's lock, which reclaiming and killing would both
+ * need; running out of those still stops the system.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/signal.h>
+#include <kernel/pressure.h>
+#include <kernel/mmap.h>
+#include <kernel/fs.h>
+#include <kernel/zswap.h>
+
+#include <toaru/list.h>
+
+#define MAX_RECLAIMERS 16
+
+static struct {
+	const char * name;
+	reclaim_func_t func;
+} reclaimers[MAX_RECLAIMERS];
+static int reclaimer_count = 0;
+
+static list_t * kmemd_queue = NULL;
+static volatile int kmemd_pending = 0;
+static int low_signalled = 0;
+
+uint32_t reclaim_passes = 0;
+uint32_t oom_kills = 0;
+
+void reclaim_register(const char * name, reclaim_func_t func) {
+	if (reclaimer_count == MAX_RECLAIMERS) {
+		debug_print(ERROR, "Too many reclaimers; not registering %s", name);
+		return;
+	}
+	reclaimers[reclaimer_count].name = name;
+	reclaimers[reclaimer_count].func = func;
+	reclaimer_count++;
+}
+
+uint32_t memory_reclaim(void) {
+	uint32_t total = 0;
+	reclaim_passes++;
+	for (int i = 0; i < reclaimer_count; ++i) {
+		uint32_t released = reclaimers[i].func();
+		if (released) {
+			debug_print(NOTICE, "Reclaimed %d kB from %s", released, reclaimers[i].name);
+		}
+		total += released;
+	}
+	return total;
+}
+
+static uintptr_t memory_free(void) {
+	return memory_total() - memory_use();
+}
+
+/*
+ * Called after each frame is taken; wakes [kmemd] when we first drop
+ * below the low watermark.
+ */
+void memory_pressure_check(void) {
+	if (!low_signalled) {
+		if (kmemd_queue && memory_free() < memory_total() / 32) {
+			low_signalled = 1;
+			kmemd_pending = 1;
+			wakeup_queue(kmemd_queue);
+		}
+	} else if (memory_free() > memory_total() / 16) {
+		low_signalled = 0;
+	}
+}
+
+static int is_leader(process_t * proc) {
+	return !proc->group || proc->group == proc->id;
+}
+
+static void notify_low_memory(void) {
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (proc->finished || proc->is_tasklet || !is_leader(proc)) continue;
+		if ((uintptr_t)proc->signals.functions[SIGLOWMEM] > 1) {
+			send_signal(proc->id, SIGLOWMEM, 1);
+		}
+	}
+}
+
+static void kmemd(void * data, char * name) {
+	while (1) {
+		while (!kmemd_pending) {
+			sleep_on(kmemd_queue);
+		}
+		kmemd_pending = 0;
+		debug_print(WARNING, "Memory is low (%d kB free)", memory_free());
+		memory_reclaim();
+		notify_low_memory();
+		/* Then make room up to the high watermark out of cold pages */
+		uintptr_t high = memory_total() / 16;
+		if (memory_free() < high) {
+			zswap_shrink((high - memory_free()) / 4);
+		}
+	}
+}
+
+/*
+ * Frames a process holds on its own in user memory; frames still
+ * shared after a fork count for both sides.
+ */
+static uint32_t resident_pages(process_t * proc) {
+	page_directory_t * dir = proc->thread.page_directory;
+	uint32_t count = 0;
+	if (!dir) return 0;
+	for (uint32_t i = 0; i < SHM_START / PAGE_TABLE_SPAN; ++i) {
+		if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) continue;
+		if (dir->tables[i] == kernel_directory->tables[i]) continue;
+		for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
+			page_t * page = &dir->tables[i]->pages[j];
+			if (page->frame && !page->swapped) count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * Score a process for the OOM killer: the frames we'd get back,
+ * halved for root's processes, which are more often the services
+ * everything else leans on. Init is never chosen.
+ */
+static uint32_t oom_score(process_t * proc) {
+	uint32_t score = resident_pages(proc);
+	if (proc->user == USER_ROOT_UID) {
+		score /= 2;
+	}
+	return score;
+}
+
+static process_t * oom_select(void) {
+	process_t * victim = NULL;
+	uint32_t best = 0;
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (proc->finished || proc->is_tasklet || proc->id <= 1 || !is_leader(proc)) continue;
+		uint32_t score = oom_score(proc);
+		if (score > best) {
+			best = score;
+			victim = proc;
+		}
+	}
+	return victim;
+}
+
+static void oom_kill(process_t * victim) {
+	pid_t pid = victim->id;
+	process_t * self = (process_t *)current_process;
+
+	oom_kills++;
+	debug_print(WARNING, "Out of memory: killing process %d (%s), score %d", pid, victim->name, oom_score(victim));
+
+	/* Every thread has to go before the address space does */
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (proc->finished || proc == self || proc->group != pid) continue;
+		send_signal(proc->id, SIGKILL, 1);
+	}
+
+	if (self->id == pid || self->group == pid) {
+		kexit(((128 + SIGKILL) << 8) | SIGKILL);
+		__builtin_unreachable();
+	}
+
+	send_signal(pid, SIGKILL, 1);
+
+	/* Let it run to its exit, which is where its frames come back */
+	for (int i = 0; i < 100; ++i) {
+		process_t * proc = process_from_pid(pid);
+		if (!proc || proc->finished) break;
+		switch_task(1);
+	}
+}
+
+/*
+ * The frame allocator has nothing left. Returns once it's worth
+ * looking again.
+ */
+void memory_exhausted(int kernel) {
+	process_t * victim = NULL;
+
+	if (!kernel && current_process != kernel_idle_task) {
+		memory_reclaim();
+		if (memory_use() < memory_total()) return;
+		victim = oom_select();
+	}
+
+	if (!victim) {
+		debug_print(CRITICAL, "Out of memory, and there is nothing left to kill.");
+		if (debug_video_crash) {
+			char * msgs[] = {"Out of memory.", NULL};
+			debug_video_crash(msgs);
+		}
+		STOP;
+	}
+
+	oom_kill(victim);
+}
+
+void memory_pressure_install(void) {
+	reclaim_register("mmap", mmap_reclaim);
+	reclaim_register("pagecache", pagecache_reclaim);
+	reclaim_register("dcache", dcache_reclaim);
+
+	zswap_install();
+
+	kmemd_queue = list_create();
+	create_kernel_tasklet(kmemd, "[kmemd]", NULL);
+}
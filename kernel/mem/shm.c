@@ -16,6 +16,8 @@
 #include <toaru/list.h>
 
 
+#define SHM_END 0xE0000000 /* Kernel page tables start here */
+
 //static volatile uint8_t bsl; // big shm lock
 static spin_lock_t bsl; // big shm lock
 tree_t * shm_tree = NULL;
@@ -103,8 +105,34 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 		return NULL;
 	}
 
-	/* Now grab some frames for this guy. */
-	for (uint32_t i = 0; i < chunk->num_frames; i++) {
+	/*
+	 * Now grab some frames for this guy. Big chunks (window buffers,
+	 * mostly) get whole 2MiB runs while they last, so they can be
+	 * mapped with a directory entry apiece.
+	 */
+	/*
+	 * This runs under the shm lock, which the OOM killer would need to
+	 * tear a process down; don't start what the frames can't finish.
+	 */
+	if ((memory_total() - memory_use()) / 4 < chunk->num_frames) {
+		debug_print(WARNING, "Not enough free memory for a %d-page shm chunk", chunk->num_frames);
+		free(chunk->frames);
+		free(chunk);
+		return NULL;
+	}
+
+	uint32_t i = 0;
+	chunk->large_pages = 0;
+	while (paging_large_pages && i + LARGE_PAGE_FRAMES <= chunk->num_frames) {
+		uint32_t first = alloc_large_frame();
+		if (first == (uint32_t)-1) break;
+		for (uint32_t j = 0; j < LARGE_PAGE_FRAMES; ++j) {
+			chunk->frames[i++] = first + j;
+		}
+		chunk->large_pages++;
+	}
+
+	for (; i < chunk->num_frames; i++) {
 		page_t tmp = {0};
 		alloc_frame(&tmp, 0, 0);
 		chunk->frames[i] = tmp.frame;
@@ -128,7 +156,7 @@ static int release_chunk (shm_chunk_t * chunk) {
 
 			/* First, free the frames used by this chunk */
 			for (uint32_t i = 0; i < chunk->num_frames; i++) {
-				clear_frame(chunk->frames[i] * 0x1000);
+				clear_frame((uint64_t)chunk->frames[i] * 0x1000);
 			}
 
 			/* Then, get rid of the damn thing */
@@ -146,101 +174,113 @@ static int release_chunk (shm_chunk_t * chunk) {
 
 /* Mapping and Unmapping */
 
-static uintptr_t proc_sbrk(uint32_t num_pages, process_t * proc) {
-	uintptr_t initial = proc->image.shm_heap;
-	assert(!(initial & 0xFFF) && "shm_heap not page-aligned!");
+static uintptr_t align_up(uintptr_t addr, uintptr_t align) {
+	return (addr + align - 1) & ~(align - 1);
+}
+
+/*
+ * Fill in the page tables for a mapping: large runs as 2MiB directory
+ * entries, everything else a table at a time. Nothing is flushed here;
+ * the caller reloads CR3 once when it is done.
+ */
+static void map_pages(shm_mapping_t * mapping, page_directory_t * dir) {
+	shm_chunk_t * chunk = mapping->chunk;
+	uintptr_t addr = mapping->start;
+	uint32_t i = 0;
+
+	for (uint32_t l = 0; l < chunk->large_pages; ++l) {
+		uint32_t table = addr / LARGE_PAGE_SIZE;
+		if (dir->tables[table]) {
+			/* Left behind by smaller mappings that are gone; the whole range is ours */
+			free(dir->tables[table]);
+			dir->tables[table] = NULL;
+		}
+		dir->physical_tables[table] = ((uint64_t)chunk->frames[i] * 0x1000) | PDE_LARGE | 0x7; /* Present, R/w, User */
+		addr += LARGE_PAGE_SIZE;
+		i += LARGE_PAGE_FRAMES;
+	}
+
+	page_t * page = NULL;
+	for (; i < chunk->num_frames; ++i, addr += 0x1000, ++page) {
+		if (!page || !(addr & (LARGE_PAGE_SIZE - 1))) {
+			page = get_page(addr, 1, dir);
+		}
+		memset(page, 0, sizeof(page_t));
+		page->frame   = chunk->frames[i];
+		page->present = 1;
+		page->rw      = 1;
+		page->user    = 1;
+	}
+}
+
+static void unmap_pages(shm_mapping_t * mapping, page_directory_t * dir) {
+	uintptr_t addr = mapping->start;
+	uint32_t i = 0;
 
-	if (initial % 0x1000) {
-		initial += 0x1000 - (initial % 0x1000);
-		proc->image.shm_heap = initial;
+	for (uint32_t l = 0; l < mapping->chunk->large_pages; ++l) {
+		dir->physical_tables[addr / LARGE_PAGE_SIZE] = 0;
+		addr += LARGE_PAGE_SIZE;
+		i += LARGE_PAGE_FRAMES;
 	}
-	proc->image.shm_heap += num_pages * 0x1000;
-	assert(!(proc->image.shm_heap & 0xFFF) && "math is wrong, dumbass");
 
-	return initial;
+	page_t * page = NULL;
+	for (; i < mapping->num_pages; ++i, addr += 0x1000, ++page) {
+		if (!page || !(addr & (LARGE_PAGE_SIZE - 1))) {
+			page = get_page(addr, 0, dir);
+			assert(page && "Shared memory mapping was invalid!");
+		}
+		memset(page, 0, sizeof(page_t));
+	}
 }
 
+/*
+ * Find room for the chunk - first fit between the existing mappings,
+ * which are kept sorted by address, or else above all of them - and
+ * map it there.
+ */
 static void * map_in (shm_chunk_t * chunk, process_t * proc) {
 	if (!chunk) {
 		return NULL;
 	}
 
+	uintptr_t size  = chunk->num_frames * 0x1000;
+	uintptr_t align = chunk->large_pages ? LARGE_PAGE_SIZE : 0x1000;
+
 	shm_mapping_t * mapping = malloc(sizeof(shm_mapping_t));
 	mapping->chunk = chunk;
-	mapping->num_vaddrs = chunk->num_frames;
-	mapping->vaddrs = malloc(sizeof(uintptr_t) * mapping->num_vaddrs);
+	mapping->num_pages = chunk->num_frames;
 
-	debug_print(INFO, "want %d bytes, running through mappings...", mapping->num_vaddrs * 0x1000);
 	uintptr_t last_address = SHM_START;
+	node_t * before = NULL;
 	foreach(node, proc->shm_mappings) {
 		shm_mapping_t * m = node->value;
-		if (m->vaddrs[0] > last_address) {
-			size_t gap = (uintptr_t)m->vaddrs[0] - last_address;
-			debug_print(INFO, "gap found at 0x%x of size %d", last_address, gap);
-			if (gap >= mapping->num_vaddrs * 0x1000) {
-				debug_print(INFO, "Gap is sufficient, we can insert here.");
-
-				/* Map the gap */
-				for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-					page_t * page = get_page(last_address + i * 0x1000, 1, proc->thread.page_directory);
-					page->frame = chunk->frames[i];
-					alloc_frame(page, 0, 1);
-					invalidate_tables_at(last_address + i * 0x1000);
-					mapping->vaddrs[i] = last_address + i * 0x1000;
-				}
-
-				/* Insert us before this node */
-				list_insert_before(proc->shm_mappings, node, mapping);
-
-				return (void *)mapping->vaddrs[0];
-			}
+		uintptr_t candidate = align_up(last_address, align);
+		if (candidate + size <= m->start) {
+			before = node;
+			break;
 		}
-		last_address = m->vaddrs[0] + m->num_vaddrs * 0x1000;
-		debug_print(INFO, "[0x%x:0x%x] %s", m->vaddrs[0], last_address, m->chunk->parent->name);
+		last_address = m->start + m->num_pages * 0x1000;
 	}
-	if (proc->image.shm_heap > last_address) {
-		size_t gap = proc->image.shm_heap - last_address;
-		debug_print(INFO, "gap found at 0x%x of size %d", last_address, gap);
-		if (gap >= mapping->num_vaddrs * 0x1000) {
-			debug_print(INFO, "Gap is sufficient, we can insert here.");
-
-			for (unsigned int i = 0; i < chunk->num_frames; ++i) {
-				page_t * page = get_page(last_address + i * 0x1000, 1, proc->thread.page_directory);
-				page->frame = chunk->frames[i];
-				alloc_frame(page, 0, 1);
-				invalidate_tables_at(last_address + i * 0x1000);
-				mapping->vaddrs[i] = last_address + i * 0x1000;
-			}
 
-			list_insert(proc->shm_mappings, mapping);
-
-			return (void *)mapping->vaddrs[0];
-		} else {
-			debug_print(INFO, "should be more efficient here - there is space available, but we are not going to use it");
-		}
+	mapping->start = align_up(last_address, align);
+	if (mapping->start + size > SHM_END || mapping->start + size < mapping->start) {
+		debug_print(ERROR, "Out of shared memory address space for %d bytes", size);
+		free(mapping);
+		return NULL;
 	}
 
-
-	for (uint32_t i = 0; i < chunk->num_frames; i++) {
-		uintptr_t new_vpage = proc_sbrk(1, proc);
-		assert(new_vpage % 0x1000 == 0);
-
-		page_t * page = get_page(new_vpage, 1, proc->thread.page_directory);
-		assert(page && "Page not allocated by sys_sbrk?");
-
-		page->frame = chunk->frames[i];
-		alloc_frame(page, 0, 1);
-		invalidate_tables_at(new_vpage);
-		mapping->vaddrs[i] = new_vpage;
-
-#if 0
-			debug_print(INFO, "mapping vaddr 0x%x --> #%d", new_vpage, page->frame);
-#endif
+	if (before) {
+		list_insert_before(proc->shm_mappings, before, mapping);
+	} else {
+		list_insert(proc->shm_mappings, mapping);
+		if (proc->image.shm_heap < mapping->start + size) {
+			proc->image.shm_heap = mapping->start + size;
+		}
 	}
 
-	list_insert(proc->shm_mappings, mapping);
+	map_pages(mapping, proc->thread.page_directory);
 
-	return (void *)mapping->vaddrs[0];
+	return (void *)mapping->start;
 }
 
 static size_t chunk_size (shm_chunk_t * chunk) {
@@ -262,6 +302,7 @@ void * shm_obtain (char * path, size_t * size) {
 	shm_node_t * node = get_node(path, 1); // (if it exists, just get it)
 	assert(node && "shm_node_t not created by get_node");
 	shm_chunk_t * chunk = node->chunk;
+	int created = 0;
 
 	if (chunk == NULL) {
 		/* There's no chunk for that key -- we need to allocate it! */
@@ -282,13 +323,31 @@ void * shm_obtain (char * path, size_t * size) {
 		}
 
 		node->chunk = chunk;
+		created = 1;
 	} else {
 		/* New accessor! */
 		chunk->ref_count++;
 	}
 	void * vshm_start = map_in(chunk, proc);
+	if (!vshm_start) {
+		release_chunk(chunk);
+		spin_unlock(bsl);
+		return NULL;
+	}
 	*size = chunk_size(chunk);
 
+	/*
+	 * New chunks start out zeroed, so whoever gets there first can tell
+	 * an empty region from a filled one, and so they never leak what
+	 * their frames last held. The chunk is mapped into this address
+	 * space now, so that is where we clear it, before anyone else can
+	 * get at it.
+	 */
+	if (created) {
+		invalidate_page_tables();
+		memset(vshm_start, 0, *size);
+	}
+
 	spin_unlock(bsl);
 	invalidate_page_tables();
 
@@ -328,12 +387,7 @@ int shm_release (char * path) {
 	shm_mapping_t * mapping = (shm_mapping_t *)node->value;
 
 	/* Clear the mappings from the process's address space */
-	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
-		page_t * page = get_page(mapping->vaddrs[i], 0, proc->thread.page_directory);
-		assert(page && "Shared memory mapping was invalid!");
-
-		memset(page, 0, sizeof(page_t));
-	}
+	unmap_pages(mapping, proc->thread.page_directory);
 	invalidate_page_tables();
 
 	/* Clean up */
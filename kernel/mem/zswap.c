@@ -0,0 +1,344 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Compressed Swap
+ *
+ * There is no disk to page out to, but most of what processes keep in
+ * memory compresses well. When [kmemd] finds memory low it runs a
+ * clock over the page tables of every process: a page found with its
+ * accessed bit set has the bit cleared and is passed over, and a page
+ * found with it still clear the next time round is LZ4-compressed into
+ * the kernel heap and its frame freed. The page table entry keeps the
+ * slot the page went to, and the next fault on it brings it back.
+ *
+ * Only private, writable, anonymous-looking pages below the user stack
+ * are taken: frames shared copy-on-write or with the mmap cache, device
+ * memory, stacks and shared memory are left where they are. Pages that
+ * don't compress to 3/4 of their size stay too. fork() shares a slot
+ * between parent and child the way it shares a frame; each side gets
+ * its own copy back when it faults.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
+#include <kernel/lz4.h>
+#include <kernel/zswap.h>
+
+#define ZSWAP_PAGE        0x1000
+#define ZSWAP_MAX_STORED  (ZSWAP_PAGE * 3 / 4)
+#define ZSWAP_BATCH       32  /* Cold pages picked out per table before swapping them */
+
+typedef struct {
+	uint8_t * data;  /* NULL for a page of zeroes */
+	uint16_t size;
+	uint32_t refs;   /* Page table entries pointing here; 0 if free */
+	uint32_t next_free;
+} zswap_slot_t;
+
+static spin_lock_t zswap_lock = { 0 };
+static zswap_slot_t * slots = NULL;
+static uint32_t slot_count = 0;
+static uint32_t free_slot = 0;  /* Head of the free list; 0 for none */
+
+/* A kernel page whose mapping is pointed at frames we need to read */
+static uint8_t * window = NULL;
+static page_t * window_page = NULL;
+static uint32_t window_frame = 0;
+
+/* The clock hand */
+static pid_t hand_pid = 0;
+static uintptr_t hand_address = 0;
+
+uint32_t zswap_pages = 0;
+uint32_t zswap_stored = 0;
+
+extern uint8_t * frame_refs;
+extern uint32_t nframes;
+
+/*
+ * Make sure there is a free slot; called with the lock held.
+ * Slot 0 is never used, so an entry's frame field is never 0.
+ */
+static int slot_reserve(void) {
+	if (free_slot) return 1;
+	uint32_t count = slot_count ? slot_count * 2 : 1024;
+	if (count > (1 << 20)) count = 1 << 20; /* All the frame field has room for */
+	if (count == slot_count) return 0;
+	zswap_slot_t * grown = realloc(slots, sizeof(zswap_slot_t) * count);
+	if (!grown) return 0;
+	slots = grown;
+	for (uint32_t i = count - 1; i >= (slot_count ? slot_count : 1); --i) {
+		slots[i].refs = 0;
+		slots[i].next_free = free_slot;
+		free_slot = i;
+	}
+	slot_count = count;
+	return 1;
+}
+
+static uint32_t slot_take(void) {
+	uint32_t slot = free_slot;
+	free_slot = slots[slot].next_free;
+	slots[slot].refs = 1;
+	return slot;
+}
+
+static void slot_put(uint32_t slot) {
+	if (--slots[slot].refs) return;
+	free(slots[slot].data);
+	zswap_stored -= slots[slot].size;
+	zswap_pages--;
+	slots[slot].data = NULL;
+	slots[slot].next_free = free_slot;
+	free_slot = slot;
+}
+
+void zswap_dup(uint32_t slot) {
+	spin_lock(zswap_lock);
+	slots[slot].refs++;
+	spin_unlock(zswap_lock);
+}
+
+void zswap_free(uint32_t slot) {
+	spin_lock(zswap_lock);
+	slot_put(slot);
+	spin_unlock(zswap_lock);
+}
+
+/*
+ * Leaders own their address space; threads share the leader's.
+ */
+static int zswap_eligible(process_t * proc) {
+	if (proc->finished || proc->is_tasklet) return 0;
+	if (proc->group && proc->group != proc->id) return 0;
+	return proc->thread.page_directory != NULL;
+}
+
+static process_t * zswap_process(pid_t pid) {
+	process_t * proc = process_from_pid(pid);
+	return (proc && zswap_eligible(proc)) ? proc : NULL;
+}
+
+/* The next process after `pid` to sweep, wrapping around; -1 for none */
+static pid_t sweep_next(pid_t pid) {
+	pid_t next = -1, first = -1;
+	foreach(node, process_list) {
+		process_t * proc = node->value;
+		if (!zswap_eligible(proc)) continue;
+		if (proc->id > pid && (next == -1 || proc->id < next)) next = proc->id;
+		if (first == -1 || proc->id < first) first = proc->id;
+	}
+	return next != -1 ? next : first;
+}
+
+static page_table_t * user_table(page_directory_t * dir, uintptr_t address) {
+	uint32_t i = address / PAGE_TABLE_SPAN;
+	page_table_t * table = dir->tables[i];
+	if (!table || (uintptr_t)table == (uintptr_t)0xFFFFFFFF) return NULL;
+	if (table == kernel_directory->tables[i]) return NULL;
+	return table;
+}
+
+/* Could this page go? The accessed bit is the caller's business. */
+static int zswap_candidate(page_t * page) {
+	if (!page->present || !page->user || !page->rw || page->cow) return 0;
+	if (page->writethrough || page->cachedisable) return 0;
+	if (page->frame >= nframes || frame_refs[page->frame]) return 0;
+	return 1;
+}
+
+static int page_is_zero(const uint32_t * words) {
+	for (int i = 0; i < ZSWAP_PAGE / 4; ++i) {
+		if (words[i]) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Compress one page out, if it is still a cold candidate. The page is
+ * read and its entry switched with interrupts off, so its owner can't
+ * run and write to it in between; anything that could block is done
+ * before or after. An address space another processor has loaded is
+ * left alone: its owner is running there, and its TLB would keep the
+ * frame mapped.
+ */
+static int zswap_out(pid_t pid, uintptr_t address) {
+	uint8_t * buffer = malloc(ZSWAP_MAX_STORED);
+	if (!buffer) return 0;
+
+	spin_lock(zswap_lock);
+	if (!slot_reserve()) {
+		spin_unlock(zswap_lock);
+		free(buffer);
+		return 0;
+	}
+
+	uint32_t flags = int_save();
+	process_t * proc = zswap_process(pid);
+	page_table_t * table = proc ? user_table(proc->thread.page_directory, address) : NULL;
+	page_t * page = table ? &table->pages[(address / ZSWAP_PAGE) % PAGE_TABLE_ENTRIES] : NULL;
+	if (!page || !zswap_candidate(page) || page->accessed ||
+			smp_directory_elsewhere(proc->thread.page_directory)) {
+		int_restore(flags);
+		spin_unlock(zswap_lock);
+		free(buffer);
+		return 0;
+	}
+
+	uint32_t frame = page->frame;
+	window_page->frame = frame;
+	invalidate_tables_at((uintptr_t)window);
+	int size = page_is_zero((uint32_t *)window) ? 0 : lz4_compress(window, ZSWAP_PAGE, buffer, ZSWAP_MAX_STORED);
+	window_page->frame = window_frame;
+	invalidate_tables_at((uintptr_t)window);
+
+	if (size < 0) {
+		/* Doesn't compress well enough to bother */
+		int_restore(flags);
+		spin_unlock(zswap_lock);
+		free(buffer);
+		return 0;
+	}
+
+	uint32_t slot = slot_take();
+	page->present = 0;
+	page->swapped = 1;
+	page->frame   = slot;
+	if (proc->thread.page_directory == current_directory) {
+		invalidate_tables_at(address);
+	}
+	int_restore(flags);
+
+	if (size) {
+		slots[slot].data = realloc(buffer, size);
+	} else {
+		slots[slot].data = NULL;
+		free(buffer);
+	}
+	slots[slot].size = size;
+	zswap_pages++;
+	zswap_stored += size;
+	spin_unlock(zswap_lock);
+
+	page_t tmp;
+	memset(&tmp, 0, sizeof(page_t));
+	tmp.frame = frame;
+	free_frame(&tmp);
+	return 1;
+}
+
+/*
+ * Sweep the rest of one page table from the hand, ageing pages and
+ * noting those found cold. Returns how many were noted; the hand is
+ * left after the last page looked at.
+ */
+static int zswap_sweep(pid_t pid, uintptr_t * cold, uint32_t * scanned) {
+	int found = 0;
+	uint32_t flags = int_save();
+	process_t * proc = zswap_process(pid);
+	page_table_t * table = proc ? user_table(proc->thread.page_directory, hand_address) : NULL;
+	if (!table) {
+		hand_address = (hand_address | (PAGE_TABLE_SPAN - 1)) + 1;
+		int_restore(flags);
+		return 0;
+	}
+	int current = proc->thread.page_directory == current_directory;
+	do {
+		page_t * page = &table->pages[(hand_address / ZSWAP_PAGE) % PAGE_TABLE_ENTRIES];
+		if (zswap_candidate(page)) {
+			(*scanned)++;
+			if (page->accessed) {
+				page->accessed = 0;
+				if (current) invalidate_tables_at(hand_address);
+			} else {
+				cold[found++] = hand_address;
+			}
+		}
+		hand_address += ZSWAP_PAGE;
+	} while (found < ZSWAP_BATCH && hand_address % PAGE_TABLE_SPAN && hand_address < USER_STACK_BOTTOM);
+	int_restore(flags);
+	return found;
+}
+
+uint32_t zswap_shrink(uint32_t pages) {
+	uintptr_t cold[ZSWAP_BATCH];
+	uint32_t done = 0;
+	uint32_t scanned = 0;
+	uint32_t budget = nframes * 2; /* Twice round, so every page can be aged once */
+
+	if (!window) return 0;
+
+	while (done < pages && scanned < budget) {
+		if (!zswap_process(hand_pid) || hand_address >= USER_STACK_BOTTOM) {
+			pid_t next = sweep_next(hand_pid);
+			if (next == -1) break;
+			hand_pid = next;
+			hand_address = 0;
+			continue;
+		}
+		uint32_t before = scanned;
+		int found = zswap_sweep(hand_pid, cold, &scanned);
+		for (int i = 0; i < found && done < pages; ++i) {
+			done += zswap_out(hand_pid, cold[i]);
+		}
+		if (scanned == before) {
+			/* Empty tables still cost something to look at */
+			scanned++;
+		}
+	}
+
+	if (done) {
+		debug_print(NOTICE, "zswap: compressed %d pages, %d held in %d kB", done, zswap_pages, zswap_stored / 1024);
+	}
+	return done;
+}
+
+int zswap_fault(uintptr_t address) {
+	uintptr_t page_address = address & ~(ZSWAP_PAGE - 1);
+	page_t * page = get_page(page_address, 0, current_directory);
+	if (!page || page->present || !page->swapped) return 0;
+
+	/* Get the frame first: it may take the OOM killer to find one */
+	page_t tmp;
+	memset(&tmp, 0, sizeof(page_t));
+	alloc_frame(&tmp, 0, 1);
+
+	spin_lock(zswap_lock);
+	if (page->present || !page->swapped) {
+		/* Another thread brought it back while we waited */
+		spin_unlock(zswap_lock);
+		free_frame(&tmp);
+		return 1;
+	}
+
+	uint32_t slot = page->frame;
+	int writable = page->rw;
+	page->swapped = 0;
+	page->frame   = tmp.frame;
+	page->present = 1;
+	page->rw      = 1; /* Filled by us first */
+	invalidate_tables_at(page_address);
+
+	if (slots[slot].data) {
+		if (lz4_decompress(slots[slot].data, slots[slot].size, (uint8_t *)page_address, ZSWAP_PAGE) != ZSWAP_PAGE) {
+			debug_print(CRITICAL, "zswap: slot %d did not decompress", slot);
+		}
+	} else {
+		memset((void *)page_address, 0, ZSWAP_PAGE);
+	}
+	slot_put(slot);
+
+	page->rw = writable;
+	invalidate_tables_at(page_address);
+	spin_unlock(zswap_lock);
+	return 1;
+}
+
+void zswap_install(void) {
+	window = (uint8_t *)kvmalloc(ZSWAP_PAGE);
+	window_page = get_page((uintptr_t)window, 0, kernel_directory);
+	window_frame = window_page->frame;
+}
@@ -12,101 +12,237 @@
 #include <kernel/elf.h>
 #include <kernel/process.h>
 #include <kernel/logging.h>
+#include <kernel/mmap.h>
 
-int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env, int interp) {
-	Elf32_Header header;
+#define ELF_MAX_PHDRS 64 /* More than any of our binaries have */
 
-	read_fs(file, 0, sizeof(Elf32_Header), (uint8_t *)&header);
+/*
+ * The dynamic linker is started for every dynamic executable; keep
+ * its checked headers so we don't have to read them each time. The
+ * file's identity, size and modification time tell us when it changed.
+ */
+static struct {
+	void *       device;
+	uint32_t     inode;
+	uint32_t     length;
+	uint32_t     mtime;
+	Elf32_Header header;
+	Elf32_Phdr * phdrs;
+} interp_cache = { 0 };
 
-	if (header.e_ident[0] != ELFMAG0 ||
-	    header.e_ident[1] != ELFMAG1 ||
-	    header.e_ident[2] != ELFMAG2 ||
-	    header.e_ident[3] != ELFMAG3) {
+/*
+ * Read and check an ELF header and its program header table, which
+ * is returned as a freshly allocated array of `e_phnum` entries.
+ */
+static int elf_read_headers(fs_node_t * file, Elf32_Header * header, Elf32_Phdr ** phdrs) {
+	/* The headers are almost always in the first page; read it once */
+	uint8_t * head = malloc(0x1000);
+	uint32_t got = read_fs(file, 0, 0x1000, head);
+	if (got > 0x1000 || got < sizeof(Elf32_Header)) {
+		free(head);
+		return -ENOEXEC;
+	}
+	memcpy(header, head, sizeof(Elf32_Header));
+
+	if (header->e_ident[0] != ELFMAG0 ||
+	    header->e_ident[1] != ELFMAG1 ||
+	    header->e_ident[2] != ELFMAG2 ||
+	    header->e_ident[3] != ELFMAG3 ||
+	    header->e_phentsize < sizeof(Elf32_Phdr) ||
+	    header->e_phnum > ELF_MAX_PHDRS) {
 		debug_print(ERROR, "Not a valid ELF executable.");
-		close_fs(file);
-		return -1;
+		free(head);
+		return -ENOEXEC;
 	}
 
-	if (file->mask & 0x800) {
-		debug_print(WARNING, "setuid binary executed [%s, uid:%d]", file->name, file->uid);
-		current_process->user = file->uid;
+	uint32_t table_size = (uint32_t)header->e_phentsize * header->e_phnum;
+	uint8_t * table = head + header->e_phoff;
+	if (header->e_phoff > got || table_size > got - header->e_phoff) {
+		table = malloc(table_size);
+		if (read_fs(file, header->e_phoff, table_size, table) != table_size) {
+			free(table);
+			free(head);
+			return -ENOEXEC;
+		}
 	}
 
-	for (uintptr_t x = 0; x < (uint32_t)header.e_phentsize * header.e_phnum; x += header.e_phentsize) {
-		Elf32_Phdr phdr;
-		read_fs(file, header.e_phoff + x, sizeof(Elf32_Phdr), (uint8_t *)&phdr);
-		if (phdr.p_type == PT_DYNAMIC) {
-			/* Dynamic */
-			close_fs(file);
+	*phdrs = malloc(sizeof(Elf32_Phdr) * (header->e_phnum ? header->e_phnum : 1));
+	for (unsigned int i = 0; i < header->e_phnum; ++i) {
+		memcpy(&(*phdrs)[i], table + i * header->e_phentsize, sizeof(Elf32_Phdr));
+	}
 
-			/* Find interpreter? */
-			debug_print(INFO, "Dynamic executable");
+	if (table < head || table >= head + 0x1000) free(table);
+	free(head);
+	return 0;
+}
 
-			unsigned int nargc = argc + 3;
-			char * args[nargc+1];
-			args[0] = "ld.so";
-			args[1] = "-e";
-			args[2] = strdup(current_process->name);
-			int j = 3;
-			for (int i = 0; i < argc; ++i, ++j) {
-				args[j] = argv[i];
+static int interp_cache_valid(fs_node_t * file) {
+	return interp_cache.phdrs &&
+		file->device &&
+		interp_cache.device == file->device &&
+		interp_cache.inode  == file->inode &&
+		interp_cache.length == file->length &&
+		interp_cache.mtime  == file->mtime;
+}
+
+/*
+ * Headers of the dynamic linker, from the cache if it hasn't changed.
+ */
+static int interp_read_headers(fs_node_t * file, Elf32_Header * header, Elf32_Phdr ** phdrs) {
+	if (!interp_cache_valid(file)) {
+		Elf32_Header new_header;
+		Elf32_Phdr * new_phdrs;
+		int ret = elf_read_headers(file, &new_header, &new_phdrs);
+		if (ret) return ret;
+		for (unsigned int i = 0; i < new_header.e_phnum; ++i) {
+			if (new_phdrs[i].p_type == PT_DYNAMIC) {
+				/* The linker has to be static; it loads everything else */
+				debug_print(ERROR, "Dynamic linker is itself dynamic.");
+				free(new_phdrs);
+				return -ENOEXEC;
 			}
-			args[j] = NULL;
+		}
+		if (interp_cache.phdrs) free(interp_cache.phdrs);
+		interp_cache.phdrs  = new_phdrs;
+		interp_cache.header = new_header;
+		interp_cache.device = file->device;
+		interp_cache.inode  = file->inode;
+		interp_cache.length = file->length;
+		interp_cache.mtime  = file->mtime;
+	}
 
-			fs_node_t * file = kopen("/lib/ld.so",0);
-			if (!file) return -1;
+	memcpy(header, &interp_cache.header, sizeof(Elf32_Header));
+	*phdrs = malloc(sizeof(Elf32_Phdr) * (header->e_phnum ? header->e_phnum : 1));
+	memcpy(*phdrs, interp_cache.phdrs, sizeof(Elf32_Phdr) * header->e_phnum);
+	return 0;
+}
 
-			return exec_elf(NULL, file, nargc, args, env, 1);
+/*
+ * Segments can be left to the page fault handler, as mmap() regions
+ * backed by the file, if each starts on a page of its own and sits in
+ * the file at the same offset within a page as in memory. Anything
+ * else is read in up front.
+ */
+static int elf_can_map(fs_node_t * file, Elf32_Header * header, Elf32_Phdr * phdrs) {
+	if (!file->device) return 0;
+	uintptr_t mapped_end = 0;
+	for (unsigned int i = 0; i < header->e_phnum; ++i) {
+		Elf32_Phdr * phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD) continue;
+		if ((phdr->p_vaddr ^ phdr->p_offset) & 0xFFF) return 0;
+		if (phdr->p_filesz > phdr->p_memsz) return 0;
+		if ((phdr->p_vaddr & ~0xFFF) < mapped_end) return 0;
+		mapped_end = (phdr->p_vaddr + phdr->p_memsz + 0xFFF) & ~0xFFF;
+	}
+	return 1;
+}
+
+static void elf_load_segment(fs_node_t * file, Elf32_Phdr * phdr) {
+	for (uintptr_t i = phdr->p_vaddr; i < phdr->p_vaddr + phdr->p_memsz; i += 0x1000) {
+		/* This doesn't care if we already allocated this page */
+		alloc_frame(get_page(i, 1, current_directory), 0, 1);
+		invalidate_tables_at(i);
+	}
+	IRQ_RES;
+	read_fs(file, phdr->p_offset, phdr->p_filesz, (uint8_t *)phdr->p_vaddr);
+	IRQ_OFF;
+	size_t r = phdr->p_filesz;
+	while (r < phdr->p_memsz) {
+		*(char *)(phdr->p_vaddr + r) = 0;
+		r++;
+	}
+}
+
+/*
+ * Map a segment as private, writable regions: whole pages of file
+ * data come from the page cache on first touch, shared with everyone
+ * else running the same binary until they are written to, and the
+ * rest of the segment is zero-filled on demand. A page that is part
+ * file data and part bss is the only one read here.
+ */
+static int elf_map_segment(fs_node_t * file, Elf32_Phdr * phdr) {
+	int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+	uintptr_t start    = phdr->p_vaddr & ~0xFFF;
+	uintptr_t file_end = phdr->p_vaddr + phdr->p_filesz;
+	uintptr_t mem_end  = (phdr->p_vaddr + phdr->p_memsz + 0xFFF) & ~0xFFF;
+	uintptr_t data_end = (phdr->p_memsz > phdr->p_filesz) ? (file_end & ~0xFFF) : mem_end;
+
+	if (data_end > start) {
+		if (mmap_map(start, data_end - start, prot, MAP_PRIVATE | MAP_FIXED, file, phdr->p_offset & ~0xFFF) != start) {
+			return -ENOMEM;
+		}
+	}
+
+	if (data_end < mem_end) {
+		uintptr_t bss = data_end;
+		if (file_end & 0xFFF) {
+			/* Shared page of data and bss */
+			uintptr_t from = data_end < phdr->p_vaddr ? phdr->p_vaddr : data_end;
+			alloc_frame(get_page(data_end, 1, current_directory), 0, 1);
+			invalidate_tables_at(data_end);
+			memset((void *)data_end, 0, 0x1000);
+			IRQ_RES;
+			read_fs(file, phdr->p_offset + (from - phdr->p_vaddr), file_end - from, (uint8_t *)from);
+			IRQ_OFF;
+			bss += 0x1000;
+		}
+		if (bss < mem_end) {
+			if (mmap_map(bss, mem_end - bss, prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, NULL, 0) != bss) {
+				return -ENOMEM;
+			}
 		}
 	}
 
-	uintptr_t entry = (uintptr_t)header.e_entry;
+	return 0;
+}
+
+static int elf_load(fs_node_t * file, Elf32_Header * header, Elf32_Phdr * phdrs, int argc, char ** argv, char ** env) {
+	uintptr_t entry = (uintptr_t)header->e_entry;
 	uintptr_t base_addr = 0xFFFFFFFF;
 	uintptr_t end_addr  = 0x0;
 
-	for (uintptr_t x = 0; x < (uint32_t)header.e_phentsize * header.e_phnum; x += header.e_phentsize) {
-		Elf32_Phdr phdr;
-		read_fs(file, header.e_phoff + x, sizeof(Elf32_Phdr), (uint8_t *)&phdr);
-		if (phdr.p_type == PT_LOAD) {
-			if (phdr.p_vaddr < base_addr) {
-				base_addr = phdr.p_vaddr;
+	for (unsigned int i = 0; i < header->e_phnum; ++i) {
+		Elf32_Phdr * phdr = &phdrs[i];
+		if (phdr->p_type == PT_LOAD) {
+			/* TODO: These virtual address bounds should be in a header somewhere */
+			if (phdr->p_vaddr < 0x20000000) {
+				free(phdrs);
+				close_fs(file);
+				return -EINVAL;
 			}
-			if (phdr.p_memsz + phdr.p_vaddr > end_addr) {
-				end_addr = phdr.p_memsz + phdr.p_vaddr;
+			/* TODO Upper bounds */
+			if (phdr->p_vaddr < base_addr) {
+				base_addr = phdr->p_vaddr;
+			}
+			if (phdr->p_memsz + phdr->p_vaddr > end_addr) {
+				end_addr = phdr->p_memsz + phdr->p_vaddr;
 			}
 		}
 	}
 
+	int lazy = elf_can_map(file, header, phdrs);
+
 	current_process->image.entry = base_addr;
 	current_process->image.size  = end_addr - base_addr;
 
 	release_directory_for_exec(current_directory);
 	invalidate_page_tables();
 
-
-	for (uintptr_t x = 0; x < (uint32_t)header.e_phentsize * header.e_phnum; x += header.e_phentsize) {
-		Elf32_Phdr phdr;
-		read_fs(file, header.e_phoff + x, sizeof(Elf32_Phdr), (uint8_t *)&phdr);
-		if (phdr.p_type == PT_LOAD) {
-			/* TODO: These virtual address bounds should be in a header somewhere */
-			if (phdr.p_vaddr < 0x20000000) return -EINVAL;
-			/* TODO Upper bounds */
-			for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
-				/* This doesn't care if we already allocated this page */
-				alloc_frame(get_page(i, 1, current_directory), 0, 1);
-				invalidate_tables_at(i);
-			}
-			IRQ_RES;
-			read_fs(file, phdr.p_offset, phdr.p_filesz, (uint8_t *)phdr.p_vaddr);
-			IRQ_OFF;
-			size_t r = phdr.p_filesz;
-			while (r < phdr.p_memsz) {
-				*(char *)(phdr.p_vaddr + r) = 0;
-				r++;
-			}
+	for (unsigned int i = 0; i < header->e_phnum; ++i) {
+		Elf32_Phdr * phdr = &phdrs[i];
+		if (phdr->p_type != PT_LOAD) continue;
+		if (!lazy) {
+			elf_load_segment(file, phdr);
+		} else if (elf_map_segment(file, phdr)) {
+			/* The old image is gone; there is nothing to go back to */
+			debug_print(ERROR, "Failed to map segment at 0x%x", phdr->p_vaddr);
+			free(phdrs);
+			close_fs(file);
+			kexit(-1);
 		}
 	}
 
+	free(phdrs);
 	close_fs(file);
 
 	for (uintptr_t stack_pointer = USER_STACK_BOTTOM; stack_pointer < USER_STACK_TOP; stack_pointer += 0x1000) {
@@ -167,17 +303,21 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 
 	current_process->image.heap        = heap; /* heap end */
 	current_process->image.heap_actual = heap + (0x1000 - heap % 0x1000);
-	alloc_frame(get_page(current_process->image.heap_actual, 1, current_directory), 0, 1);
-	invalidate_tables_at(current_process->image.heap_actual);
+	current_process->image.heap_start  = current_process->image.heap_actual;
 	current_process->image.user_stack  = USER_STACK_TOP;
 
 	current_process->image.start = entry;
 
-	/* Close all fds >= 3 */
-	for (unsigned int i = 3; i < current_process->fds->length; ++i) {
-		if (current_process->fds->entries[i]) {
-			close_fs(current_process->fds->entries[i]);
-			current_process->fds->entries[i] = NULL;
+	/* Close all fds >= 3, and any others marked close-on-exec */
+	fd_table_t * fds = current_process->fds;
+	for (unsigned int w = 0; w < (fds->length + 31) / 32; ++w) {
+		uint32_t used = fds->used[w];
+		while (used) {
+			unsigned int i = w * 32 + __builtin_ctz(used);
+			used &= used - 1;
+			if (i >= 3 || (fds->entries[i].flags & FD_CLOEXEC)) {
+				process_close_fd((process_t *)current_process, i);
+			}
 		}
 	}
 
@@ -188,6 +328,55 @@ int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env,
 	return -1;
 }
 
+int exec_elf(char * path, fs_node_t * file, int argc, char ** argv, char ** env, int interp) {
+	Elf32_Header header;
+	Elf32_Phdr * phdrs;
+
+	if (elf_read_headers(file, &header, &phdrs)) {
+		close_fs(file);
+		return -1;
+	}
+
+	if (file->mask & 0x800) {
+		debug_print(WARNING, "setuid binary executed [%s, uid:%d]", file->name, file->uid);
+		current_process->user = file->uid;
+	}
+
+	for (unsigned int i = 0; i < header.e_phnum; ++i) {
+		if (phdrs[i].p_type == PT_DYNAMIC) {
+			/* Dynamic */
+			free(phdrs);
+			close_fs(file);
+
+			/* Find interpreter? */
+			debug_print(INFO, "Dynamic executable");
+
+			unsigned int nargc = argc + 3;
+			char * args[nargc+1];
+			args[0] = "ld.so";
+			args[1] = "-e";
+			args[2] = strdup(current_process->name);
+			int j = 3;
+			for (int i = 0; i < argc; ++i, ++j) {
+				args[j] = argv[i];
+			}
+			args[j] = NULL;
+
+			fs_node_t * file = kopen("/lib/ld.so",0);
+			if (!file) return -1;
+
+			if (interp_read_headers(file, &header, &phdrs)) {
+				close_fs(file);
+				return -1;
+			}
+
+			return elf_load(file, &header, phdrs, nargc, args, env);
+		}
+	}
+
+	return elf_load(file, &header, phdrs, argc, argv, env);
+}
+
 int exec_shebang(char * path, fs_node_t * file, int argc, char ** argv, char ** env, int interp) {
 	if (interp > 4) /* sounds good to me */ {
 		return -ELOOP;
@@ -0,0 +1,184 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Input event queue
+ *
+ * /dev/input: keyboard and pointer drivers queue timestamped events
+ * here from their interrupt handlers, and the compositor takes a whole
+ * frame's worth of them with one read. A move that comes in while the
+ * previous one is still unread is folded into it, so a reader that
+ * falls behind sees fewer, bigger moves instead of a backlog. When
+ * the queue does fill, the oldest events go.
+ *
+ * The per-device files (/dev/kbd, /dev/mouse, ...) are still fed too,
+ * for the VGA terminal and anything else reading them.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/input.h>
+
+#include <toaru/list.h>
+
+#define INPUT_QUEUE 256 /* Events; a power of two */
+#define INPUT_READ  32  /* Most events handed out by one read */
+
+/* Scroll is a button press per wheel click; those can't be merged */
+#define INPUT_SCROLL_BUTTONS (0x10 | 0x20)
+
+static struct input_event queue[INPUT_QUEUE];
+static uint32_t queue_head = 0; /* Next to write */
+static uint32_t queue_tail = 0; /* Next to read */
+
+static fs_node_t * input_node = NULL;
+static list_t * input_wait = NULL;
+static list_t * alert_waiters = NULL;
+
+static void input_alert(void) {
+	if (input_wait->length) {
+		wakeup_queue(input_wait);
+	}
+	if (alert_waiters) {
+		while (alert_waiters->head) {
+			node_t * node = list_dequeue(alert_waiters);
+			process_alert_node(node->value, input_node);
+			free(node);
+		}
+	}
+}
+
+/* Fold `event` into the newest unread one if it's more of the same; call with interrupts off */
+static int input_merge(struct input_event * event) {
+	if (queue_head == queue_tail) return 0;
+	if (event->type == INPUT_KEY) return 0;
+
+	struct input_event * last = &queue[(queue_head - 1) & (INPUT_QUEUE - 1)];
+	if (last->type != event->type || last->flags != event->flags) return 0;
+	if (last->buttons != event->buttons) return 0;
+	if (event->buttons & INPUT_SCROLL_BUTTONS) return 0;
+
+	if (event->type == INPUT_RELATIVE) {
+		last->x += event->x;
+		last->y += event->y;
+	} else {
+		last->x = event->x;
+		last->y = event->y;
+	}
+	last->sec  = event->sec;
+	last->usec = event->usec;
+	return 1;
+}
+
+static void input_queue(struct input_event * event) {
+	if (!input_node) return;
+
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	event->sec  = s;
+	event->usec = ss;
+
+	uint32_t flags = int_save();
+	if (!input_merge(event)) {
+		if (queue_head - queue_tail == INPUT_QUEUE) {
+			queue_tail++; /* Full; lose the oldest */
+		}
+		queue[queue_head & (INPUT_QUEUE - 1)] = *event;
+		queue_head++;
+	}
+	int_restore(flags);
+
+	input_alert();
+}
+
+void input_key(uint8_t scancode) {
+	struct input_event event = {0};
+	event.type = INPUT_KEY;
+	event.code = scancode;
+	input_queue(&event);
+}
+
+void input_relative(int32_t x, int32_t y, uint32_t buttons) {
+	struct input_event event = {0};
+	event.type    = INPUT_RELATIVE;
+	event.x       = x;
+	event.y       = y;
+	event.buttons = buttons;
+	input_queue(&event);
+}
+
+void input_absolute(int32_t x, int32_t y, uint32_t buttons, int flags) {
+	struct input_event event = {0};
+	event.type    = INPUT_ABSOLUTE;
+	event.flags   = flags;
+	event.x       = x;
+	event.y       = y;
+	event.buttons = buttons;
+	input_queue(&event);
+}
+
+/*
+ * Whole events only; sleeps until there's at least one. They're taken
+ * off the queue with interrupts off and copied out after, since the
+ * reader's buffer may need faulting in.
+ */
+static uint32_t read_input(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct input_event events[INPUT_READ];
+	unsigned int want = size / sizeof(struct input_event);
+	if (want > INPUT_READ) want = INPUT_READ;
+	if (!want) return 0;
+
+	unsigned int count = 0;
+	while (!count) {
+		uint32_t flags = int_save();
+		while (count < want && queue_tail != queue_head) {
+			events[count++] = queue[queue_tail & (INPUT_QUEUE - 1)];
+			queue_tail++;
+		}
+		if (!count) {
+			sleep_on(input_wait);
+		}
+		int_restore(flags);
+	}
+
+	memcpy(buffer, events, count * sizeof(struct input_event));
+	return count * sizeof(struct input_event);
+}
+
+static int input_check(fs_node_t * node) {
+	return queue_head == queue_tail;
+}
+
+static int input_select(fs_node_t * node, void * process) {
+	if (!alert_waiters) {
+		alert_waiters = list_create();
+	}
+	if (!list_find(alert_waiters, process)) {
+		list_insert(alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, input_node);
+	return 0;
+}
+
+static fs_node_t * input_device_create(void) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, "input");
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask = 0440;
+	fnode->flags   = FS_CHARDEVICE;
+	fnode->read    = read_input;
+	fnode->selectcheck = input_check;
+	fnode->selectwait  = input_select;
+	return fnode;
+}
+
+void input_install(void) {
+	input_wait = list_create();
+	input_node = input_device_create();
+	vfs_mount("/dev/input", input_node);
+}
@@ -0,0 +1,178 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Static tracepoints
+ *
+ * KTRACE() sites around the kernel write fixed-size records into a
+ * ring that /dev/ktrace hands out as struct ktrace_record. Writers take
+ * no locks: a slot is claimed with an atomic increment of the head, and
+ * the record's sequence number is filled in last, so a reader can tell
+ * a finished record from one that is still being written or has been
+ * overwritten since. The ring works as a flight recorder; once it is
+ * full the oldest records are lost.
+ *
+ * There is a single ring, as there is a single CPU; records always
+ * carry CPU 0.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/ktrace.h>
+
+#include <sys/ioctl.h>
+
+#define KTRACE_RECORDS 8192 /* Power of two */
+
+volatile uint32_t ktrace_events = 0;
+
+static struct ktrace_record * records = NULL;
+static volatile uint32_t record_head = 0; /* Next slot to claim */
+static uint32_t record_tail = 0;          /* Next to read */
+
+static inline uint64_t ktrace_clock(void) {
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Called from tracepoints, which may be in interrupt handlers or have
+ * interrupts disabled; must not sleep, lock or trace anything itself.
+ */
+void ktrace_record(int event, uint32_t a, uint32_t b, uint32_t c) {
+	struct ktrace_record * ring = records;
+	if (!ring) return;
+
+	uint32_t index = __sync_fetch_and_add(&record_head, 1);
+	struct ktrace_record * record = &ring[index & (KTRACE_RECORDS - 1)];
+
+	record->seq = 0;
+	__sync_synchronize();
+	record->tsc = ktrace_clock();
+	record->pid = current_process ? (int32_t)current_process->id : 0;
+	record->event = event;
+	record->cpu = 0;
+	record->_reserved = 0;
+	record->args[0] = a;
+	record->args[1] = b;
+	record->args[2] = c;
+	__sync_synchronize();
+	record->seq = index + 1;
+}
+
+static int ioctl_ktrace(fs_node_t * node, int request, void * argp) {
+	switch (request) {
+		case IOCTL_KTRACE_START: {
+			if (current_process->user != USER_ROOT_UID) return -EPERM;
+			uint32_t events = KTRACE_ALL;
+			if (argp) {
+				validate(argp);
+				if (*(uint32_t *)argp) events = *(uint32_t *)argp & KTRACE_ALL;
+			}
+
+			if (!records) {
+				struct ktrace_record * ring = malloc(sizeof(struct ktrace_record) * KTRACE_RECORDS);
+				memset(ring, 0, sizeof(struct ktrace_record) * KTRACE_RECORDS);
+				records = ring;
+			}
+
+			uint32_t flags = int_save();
+			ktrace_events = 0;
+			record_head = 0;
+			record_tail = 0;
+			for (int i = 0; i < KTRACE_RECORDS; ++i) {
+				records[i].seq = 0;
+			}
+			ktrace_events = events;
+			int_restore(flags);
+			debug_print(NOTICE, "Tracing events 0x%x", events);
+			return 0;
+		}
+		case IOCTL_KTRACE_STOP:
+			if (current_process->user != USER_ROOT_UID) return -EPERM;
+			ktrace_events = 0;
+			return 0;
+		case IOCTL_KTRACE_CLOCK: {
+			if (!argp) return -EINVAL;
+			validate(argp);
+			struct ktrace_clock * clock = argp;
+			struct timeval tv;
+			uint32_t flags = int_save();
+			clock->tsc = ktrace_clock();
+			gettimeofday(&tv, NULL);
+			int_restore(flags);
+			clock->sec = tv.tv_sec;
+			clock->usec = tv.tv_usec;
+			return 0;
+		}
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Whole records, oldest first, without blocking. Anything that was
+ * overwritten before we got to it is skipped; a record that is still
+ * being written ends the read, and will be there next time.
+ */
+static uint32_t read_ktrace(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	unsigned int want = size / sizeof(struct ktrace_record);
+	if (!want || !records) return 0;
+
+	unsigned int count = 0;
+	while (count < want) {
+		uint32_t head = record_head;
+		if (head - record_tail > KTRACE_RECORDS) {
+			record_tail = head - KTRACE_RECORDS;
+		}
+		if (record_tail == head) break;
+
+		struct ktrace_record * record = &records[record_tail & (KTRACE_RECORDS - 1)];
+		struct ktrace_record * out = (struct ktrace_record *)&buffer[count * sizeof(struct ktrace_record)];
+
+		uint32_t seq = record->seq;
+		if ((int32_t)(seq - (record_tail + 1)) < 0) break; /* Still being written */
+		if (seq != record_tail + 1) {
+			record_tail++; /* Already overwritten */
+			continue;
+		}
+		__sync_synchronize();
+		memcpy(out, record, sizeof(struct ktrace_record));
+		__sync_synchronize();
+		if (record->seq != seq) {
+			record_tail++;
+			continue;
+		}
+
+		record_tail++;
+		count++;
+	}
+
+	return count * sizeof(struct ktrace_record);
+}
+
+static void close_ktrace(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * ktrace_device_create(void) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, "ktrace");
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask = 0600;
+	fnode->flags   = FS_CHARDEVICE;
+	fnode->read    = read_ktrace;
+	fnode->close   = close_ktrace;
+	fnode->ioctl   = ioctl_ktrace;
+	return fnode;
+}
+
+void ktrace_install(void) {
+	vfs_mount("/dev/ktrace", ktrace_device_create());
+}
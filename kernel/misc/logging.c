@@ -5,13 +5,26 @@
  *
  * Kernel Logging Facility
  *
- * Maintains a log in-memory as well as to serial (unless
- * told not to).
+ * Messages go into an in-memory ring, which klogd, a periodic work
+ * item, copies out to the log device (serial, or whatever debug_file
+ * is) and /dev/kmsg reads back. Writing a message only formats it
+ * into its slot, so logging from a driver's hot path doesn't wait on
+ * the serial port.
+ *
+ * Slots are claimed the way KTRACE() claims them: an atomic increment
+ * of the head, with the sequence number filled in last, so nothing
+ * takes a lock and a message can come from anywhere, interrupt
+ * handlers included. Once the ring is full the oldest messages are
+ * lost. Until klogd is running, and for CRITICAL messages, which are
+ * usually the last thing we get to say, the ring is flushed right away.
  */
 
 #include <kernel/system.h>
 #include <kernel/logging.h>
 #include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/fs.h>
+#include <kernel/workqueue.h>
 
 #include <va_list.h>
 #include <toaru/list.h>
@@ -30,25 +43,184 @@ static char * c_messages[] = {
 	" \033[1;31;44mINSANE\033[0m:"
 };
 
-static char buffer[1024];
+#define KMSG_RECORDS  256 /* Power of two */
+#define KMSG_LINE     504
+#define KLOGD_SLEEP   20  /* ms between looks at the ring */
+
+struct kmsg_record {
+	volatile uint32_t seq; /* Its index + 1, once it's written */
+	uint32_t len;
+	char line[KMSG_LINE];
+};
+
+static struct kmsg_record kmsg_ring[KMSG_RECORDS];
+static volatile uint32_t kmsg_head = 0; /* Next slot to claim */
+static uint32_t kmsg_drained = 0;       /* Next for the log device */
+static volatile int kmsg_draining = 0;
+static int klogd_running = 0;
+static work_t klogd_work;
+
+/*
+ * Copy a finished record out. Returns 1 if out has it, 0 if it's still
+ * being written, and -1 if it has been overwritten.
+ */
+static int kmsg_fetch(uint32_t index, char * out, uint32_t * len) {
+	struct kmsg_record * record = &kmsg_ring[index & (KMSG_RECORDS - 1)];
+	uint32_t seq = record->seq;
+	if ((int32_t)(seq - (index + 1)) < 0) return 0;
+	if (seq != index + 1) return -1;
+	__sync_synchronize();
+	*len = record->len;
+	memcpy(out, record->line, *len);
+	__sync_synchronize();
+	if (record->seq != seq) return -1;
+	return 1;
+}
+
+/* The oldest record still in the ring */
+static uint32_t kmsg_oldest(void) {
+	uint32_t head = kmsg_head;
+	return head > KMSG_RECORDS ? head - KMSG_RECORDS : 0;
+}
+
+/*
+ * Write out everything new. Only one caller does this at a time; the
+ * others return 0 and leave it to whoever is.
+ */
+static int kmsg_drain(void) {
+	if (!debug_file) return 1; /* Keep them until there is somewhere to put them */
+	if (__sync_lock_test_and_set(&kmsg_draining, 1)) return 0;
+
+	char line[KMSG_LINE];
+	int lost = 0;
+	while (kmsg_drained != kmsg_head) {
+		if (kmsg_drained < kmsg_oldest()) {
+			lost += kmsg_oldest() - kmsg_drained;
+			kmsg_drained = kmsg_oldest();
+		}
+		uint32_t len;
+		int got = kmsg_fetch(kmsg_drained, line, &len);
+		if (got == 0) break;
+		kmsg_drained++;
+		if (got < 0) {
+			lost++;
+			continue;
+		}
+		if (lost) {
+			char note[64];
+			sprintf(note, "[... %d messages lost]\n", lost);
+			write_fs(debug_file, 0, strlen(note), (uint8_t *)note);
+			lost = 0;
+		}
+		write_fs(debug_file, 0, len, (uint8_t *)line);
+	}
+
+	__sync_lock_release(&kmsg_draining);
+	return 1;
+}
 
 void _debug_print(char * title, int line_no, log_type_t level, char *fmt, ...) {
-	if (level >= debug_level && debug_file) {
-		va_list args;
-		va_start(args, fmt);
-		vasprintf(buffer, fmt, args);
-		va_end(args);
-
-		char * type;
-		if (level > INSANE) {
-			type = "";
-		} else {
-			type = c_messages[level];
+	if (level < debug_level) return;
+
+	char buffer[1024];
+	va_list args;
+	va_start(args, fmt);
+	size_t msg_len = vasprintf(buffer, fmt, args);
+	va_end(args);
+
+	char * type;
+	if (level > INSANE) {
+		type = "";
+	} else {
+		type = c_messages[level];
+	}
+
+	uint32_t index = __sync_fetch_and_add(&kmsg_head, 1);
+	struct kmsg_record * record = &kmsg_ring[index & (KMSG_RECORDS - 1)];
+
+	record->seq = 0;
+	__sync_synchronize();
+	/* Titles are file names; the message is cut short if it has to be */
+	size_t len = sprintf(record->line, "[%10d.%3d:%s:%d]%s ", timer_ticks, timer_subticks / 1000, title, line_no, type);
+	if (msg_len > KMSG_LINE - 1 - len) msg_len = KMSG_LINE - 1 - len;
+	memcpy(record->line + len, buffer, msg_len);
+	len += msg_len;
+	record->line[len++] = '\n';
+	record->len = len;
+	__sync_synchronize();
+	record->seq = index + 1;
+
+	if (!klogd_running || level >= CRITICAL) {
+		if (!kmsg_drain() && level >= CRITICAL) {
+			/* klogd is in the middle of something; this can't wait for it */
+			write_fs(debug_file, 0, len, (uint8_t *)record->line);
 		}
+	}
+}
 
-		fprintf(debug_file, "[%10d.%3d:%s:%d]%s %s\n", timer_ticks, timer_subticks, title, line_no, type, buffer);
+static void klogd(void * data) {
+	kmsg_drain();
+	queue_delayed_work(&klogd_work, KLOGD_SLEEP);
+}
 
+/*
+ * /dev/kmsg: every open reads from the oldest message still in the
+ * ring, whole lines at a time, and gets 0 once it's caught up.
+ */
+static void open_kmsg(fs_node_t * node, unsigned int flags) {
+	uint32_t * cursor = malloc(sizeof(uint32_t));
+	*cursor = kmsg_oldest();
+	node->device = cursor;
+}
+
+static void close_kmsg(fs_node_t * node) {
+	free(node->device);
+}
+
+static uint32_t read_kmsg(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	uint32_t * cursor = node->device;
+	if (!cursor) return 0;
+
+	char line[KMSG_LINE];
+	uint32_t out = 0;
+	while (*cursor != kmsg_head) {
+		if (*cursor < kmsg_oldest()) *cursor = kmsg_oldest();
+		uint32_t len;
+		int got = kmsg_fetch(*cursor, line, &len);
+		if (got == 0) break;
+		if (got < 0) {
+			(*cursor)++;
+			continue;
+		}
+		if (out + len > size) {
+			if (out) break;
+			len = size; /* A buffer too small for one line gets what fits */
+		}
+		memcpy(buffer + out, line, len);
+		out += len;
+		(*cursor)++;
 	}
-	/* else ignore */
+	return out;
+}
+
+static fs_node_t * kmsg_device_create(void) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, "kmsg");
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask = 0600;
+	fnode->flags = FS_CHARDEVICE;
+	fnode->read  = read_kmsg;
+	fnode->open  = open_kmsg;
+	fnode->close = close_kmsg;
+	return fnode;
 }
 
+void logging_install(void) {
+	vfs_mount("/dev/kmsg", kmsg_device_create());
+	work_init(&klogd_work, klogd, NULL, WORK_NORMAL);
+	queue_work(&klogd_work);
+	klogd_running = 1;
+}
@@ -0,0 +1,163 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * LZ4 blocks
+ *
+ * The block format only, with no frame around it: compressed ramdisk
+ * images are made of these, and so is the compressed swap pool.
+ */
+#include <kernel/system.h>
+#include <kernel/lz4.h>
+
+/*
+ * Decode one LZ4 block (no frame) into `dst`.
+ * Returns the number of bytes produced, or -1 for a bad block.
+ */
+int lz4_decompress(const uint8_t * src, size_t src_len, uint8_t * dst, size_t dst_len) {
+	const uint8_t * end = src + src_len;
+	uint8_t * out = dst;
+	uint8_t * out_end = dst + dst_len;
+
+	while (src < end) {
+		uint8_t token = *src++;
+
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			uint8_t b;
+			do {
+				if (src >= end) return -1;
+				b = *src++;
+				literals += b;
+			} while (b == 255);
+		}
+		if (literals > (size_t)(end - src) || literals > (size_t)(out_end - out)) return -1;
+		memcpy(out, src, literals);
+		out += literals;
+		src += literals;
+
+		/* The last sequence is only literals */
+		if (src >= end) break;
+
+		if (end - src < 2) return -1;
+		size_t distance = src[0] | (src[1] << 8);
+		src += 2;
+		if (!distance || distance > (size_t)(out - dst)) return -1;
+
+		size_t length = token & 15;
+		if (length == 15) {
+			uint8_t b;
+			do {
+				if (src >= end) return -1;
+				b = *src++;
+				length += b;
+			} while (b == 255);
+		}
+		length += 4;
+		if (length > (size_t)(out_end - out)) return -1;
+
+		/* Matches may overlap what they produce */
+		uint8_t * match = out - distance;
+		while (length--) {
+			*out++ = *match++;
+		}
+	}
+
+	return out - dst;
+}
+
+#define LZ4_HASH_BITS 11
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5  /* The block has to end on this many literals */
+#define LZ4_MATCH_LIMIT 12   /* and no match may start closer to the end than this */
+
+static inline uint32_t lz4_read32(const uint8_t * p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Write a length continuation: 255s, then the remainder */
+static uint8_t * lz4_put_length(uint8_t * op, uint8_t * op_end, size_t length) {
+	while (length >= 255) {
+		if (op >= op_end) return NULL;
+		*op++ = 255;
+		length -= 255;
+	}
+	if (op >= op_end) return NULL;
+	*op++ = length;
+	return op;
+}
+
+static uint8_t * lz4_put_sequence(uint8_t * op, uint8_t * op_end, const uint8_t * literals, size_t literal_length, size_t distance, size_t match_length) {
+	if (op >= op_end) return NULL;
+	uint8_t * token = op++;
+	*token = (literal_length >= 15 ? 15 : literal_length) << 4;
+	if (literal_length >= 15 && !(op = lz4_put_length(op, op_end, literal_length - 15))) return NULL;
+	if (literal_length > (size_t)(op_end - op)) return NULL;
+	memcpy(op, literals, literal_length);
+	op += literal_length;
+
+	if (!match_length) return op;
+
+	if (op_end - op < 2) return NULL;
+	*op++ = distance & 0xFF;
+	*op++ = distance >> 8;
+	match_length -= LZ4_MIN_MATCH;
+	*token |= match_length >= 15 ? 15 : match_length;
+	if (match_length >= 15 && !(op = lz4_put_length(op, op_end, match_length - 15))) return NULL;
+	return op;
+}
+
+/*
+ * Encode `src` as one LZ4 block, greedily, taking the first match
+ * the hash table offers. Inputs are limited to 64KiB, which is all
+ * the table can address. Returns the size of the block, or -1 if it
+ * doesn't fit in `dst_len`; callers use that as the test for data
+ * not worth compressing.
+ */
+int lz4_compress(const uint8_t * src, size_t src_len, uint8_t * dst, size_t dst_len) {
+	uint16_t table[1 << LZ4_HASH_BITS]; /* Position + 1 of the last place a hash was seen */
+	const uint8_t * ip = src;
+	const uint8_t * anchor = src;
+	const uint8_t * end = src + src_len;
+	uint8_t * op = dst;
+	uint8_t * op_end = dst + dst_len;
+
+	if (src_len > 0xFFFF) return -1;
+	memset(table, 0, sizeof(table));
+
+	if (src_len > LZ4_MATCH_LIMIT) {
+		const uint8_t * match_start_limit = end - LZ4_MATCH_LIMIT;
+		const uint8_t * match_end_limit = end - LZ4_LAST_LITERALS;
+		while (ip < match_start_limit) {
+			uint32_t sequence = lz4_read32(ip);
+			uint32_t hash = lz4_hash(sequence);
+			const uint8_t * ref = table[hash] ? src + table[hash] - 1 : NULL;
+			table[hash] = ip - src + 1;
+			if (!ref || lz4_read32(ref) != sequence) {
+				ip++;
+				continue;
+			}
+
+			size_t length = LZ4_MIN_MATCH;
+			while (ip + length < match_end_limit && ip[length] == ref[length]) {
+				length++;
+			}
+
+			op = lz4_put_sequence(op, op_end, anchor, ip - anchor, ip - ref, length);
+			if (!op) return -1;
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	op = lz4_put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+	if (!op) return -1;
+	return op - dst;
+}
@@ -0,0 +1,167 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Kernel random number generator
+ *
+ * ChaCha20 in counter mode, keyed from the timestamp counter, the
+ * clock and RDRAND when the processor has it, and rekeyed as entropy
+ * from interrupt timing comes in. Each request takes its own run of
+ * counter values and generates straight into the caller's buffer, 64
+ * bytes a block, without interrupts off; when it's done the key is
+ * replaced with more output, so nothing already handed out can be
+ * worked back to from a later key.
+ *
+ * Backs /dev/random, /dev/urandom and getrandom().
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+
+#define CHACHA_ROUNDS     20
+#define RANDOM_RESEED_AT  64  /* Interrupts between folding the pool into the key */
+
+static uint32_t chacha_key[8];
+static uint64_t chacha_counter = 0;
+
+static uint32_t entropy_pool[8];
+static unsigned int entropy_index = 0;
+static unsigned int entropy_events = 0;
+static int has_rdrand = 0;
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8);  \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+static void chacha_block(const uint32_t key[8], uint64_t counter, uint32_t out[16]) {
+	uint32_t in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574, /* "expand 32-byte k" */
+		key[0], key[1], key[2], key[3],
+		key[4], key[5], key[6], key[7],
+		(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0,
+	};
+	uint32_t x[16];
+	memcpy(x, in, sizeof(x));
+
+	for (int i = 0; i < CHACHA_ROUNDS; i += 2) {
+		QUARTER(x[0], x[4], x[8],  x[12]);
+		QUARTER(x[1], x[5], x[9],  x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8],  x[13]);
+		QUARTER(x[3], x[4], x[9],  x[14]);
+	}
+
+	for (int i = 0; i < 16; ++i) {
+		out[i] = x[i] + in[i];
+	}
+}
+
+static uint32_t read_tsc(void) {
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return lo ^ hi;
+}
+
+static int rdrand(uint32_t * value) {
+	unsigned char ok;
+	for (int i = 0; i < 10; ++i) {
+		asm volatile ("rdrand %0; setc %1" : "=r"(*value), "=qm"(ok));
+		if (ok) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Mix something unpredictable-ish into the pool. Cheap enough to call
+ * from every interrupt; the timestamp counter does most of the work.
+ */
+void random_add_entropy(uint32_t data) {
+	uint32_t i = entropy_index++ & 7;
+	entropy_pool[i] = ROTL(entropy_pool[i], 7) ^ data ^ read_tsc();
+	entropy_events++;
+}
+
+/* Replace the key with output from it, after folding in the pool; call with interrupts off */
+static void random_rekey(void) {
+	uint32_t block[16];
+	if (entropy_events >= RANDOM_RESEED_AT) {
+		for (int i = 0; i < 8; ++i) {
+			chacha_key[i] ^= entropy_pool[i];
+		}
+		if (has_rdrand) {
+			uint32_t r;
+			if (rdrand(&r)) chacha_key[0] ^= r;
+		}
+		entropy_events = 0;
+	}
+	chacha_block(chacha_key, chacha_counter++, block);
+	memcpy(chacha_key, block, sizeof(chacha_key));
+	memset(block, 0, sizeof(block));
+}
+
+void random_get_bytes(void * buffer, size_t length) {
+	uint8_t * out = buffer;
+	size_t blocks = (length + 63) / 64;
+	uint32_t key[8];
+
+	/* Take a run of counter values and a copy of the key to generate with */
+	uint32_t flags = int_save();
+	uint64_t counter = chacha_counter;
+	chacha_counter += blocks;
+	memcpy(key, chacha_key, sizeof(key));
+	int_restore(flags);
+
+	while (length >= 64) {
+		uint32_t block[16];
+		chacha_block(key, counter++, block);
+		memcpy(out, block, 64);
+		out += 64;
+		length -= 64;
+	}
+
+	if (length) {
+		uint32_t block[16];
+		chacha_block(key, counter++, block);
+		memcpy(out, block, length);
+		memset(block, 0, sizeof(block));
+	}
+	memset(key, 0, sizeof(key));
+
+	flags = int_save();
+	random_rekey();
+	int_restore(flags);
+}
+
+uint32_t random_u32(void) {
+	uint32_t value;
+	random_get_bytes(&value, sizeof(value));
+	return value;
+}
+
+void random_install(void) {
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	has_rdrand = !!(ecx & (1 << 30));
+
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+
+	for (int i = 0; i < 8; ++i) {
+		uint32_t r = 0;
+		if (has_rdrand) rdrand(&r);
+		chacha_key[i] ^= r ^ read_tsc() ^ ROTL((uint32_t)s, i) ^ (uint32_t)ss ^ entropy_pool[i];
+	}
+	entropy_events = 0;
+
+	uint32_t flags = int_save();
+	random_rekey();
+	int_restore(flags);
+
+	debug_print(NOTICE, "Random number generator seeded%s", has_rdrand ? " (with RDRAND)" : "");
+}
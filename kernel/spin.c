@@ -5,6 +5,12 @@
  *
  * Spin locks with waiters
  *
+ * Only one processor is in the kernel at a time (see kernel_lock() in
+ * cpu/smp.c), so whoever holds a lock we want can't be running while
+ * we are; rather than spinning, a waiter yields until the holder has
+ * had a chance to let go. Holding a lock keeps the
+ * holder from being preempted, so letting go of the last one is a
+ * preemption point.
  */
 #include <kernel/system.h>
 
@@ -25,6 +31,24 @@ static inline void arch_atomic_dec(volatile int * x) {
 	asm("lock; decl %0" : "=m"(*x) : "m"(*x) : "memory");
 }
 
+lock_stat_t * lock_stats = NULL;
+
+void lock_stat_register(lock_stat_t * stat) {
+	uint32_t flags = int_save();
+	if (!stat->registered) {
+		stat->next = lock_stats;
+		lock_stats = stat;
+		stat->registered = 1;
+	}
+	int_restore(flags);
+}
+
+void lock_stat_release(lock_stat_t * stat, uint32_t since) {
+	uint32_t held = lock_clock() - since;
+	stat->held += held;
+	if (held > stat->held_max) stat->held_max = held;
+}
+
 void spin_wait(volatile int * addr, volatile int * waiters) {
 	if (waiters) {
 		arch_atomic_inc(waiters);
@@ -37,21 +61,41 @@ void spin_wait(volatile int * addr, volatile int * waiters) {
 	}
 }
 
-void spin_lock(spin_lock_t lock) {
-	while (arch_atomic_swap(lock, 1)) {
-		spin_wait(lock, lock+1);
+void spin_lock_stat(spin_lock_t lock, lock_stat_t * stat) {
+	if (arch_atomic_swap(lock, 1)) {
+		stat->contended++;
+		do {
+			spin_wait(lock, lock+1);
+		} while (arch_atomic_swap(lock, 1));
+	}
+	if (!stat->registered) {
+		lock_stat_register(stat);
 	}
+	stat->acquired++;
+	lock[2] = lock_clock();
+	lock[3] = (int)stat;
+	lock[4] = (int)current_process;
+	preempt_disable_at((uintptr_t)__builtin_return_address(0));
 }
 
 void spin_init(spin_lock_t lock) {
 	lock[0] = 0;
 	lock[1] = 0;
+	lock[2] = 0;
+	lock[3] = 0;
+	lock[4] = 0;
 }
 
 void spin_unlock(spin_lock_t lock) {
 	if (lock[0]) {
+		lock_stat_t * stat = (lock_stat_t *)lock[3];
+		if (stat) {
+			lock_stat_release(stat, lock[2]);
+			lock[3] = 0;
+		}
+		void * owner = (void *)lock[4];
+		lock[4] = 0;
 		arch_atomic_store(lock, 0);
-		if (lock[1])
-			switch_task(1);
+		preempt_enable_at(owner, (uintptr_t)__builtin_return_address(0));
 	}
 }
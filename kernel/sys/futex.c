@@ -0,0 +1,121 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Futexes
+ *
+ * Wait queues keyed by a user address, for building blocking locks
+ * in userspace. A waiter only sleeps if the word still holds the
+ * value it expects, so a wake between its check and its sleep can't
+ * be lost. Queues exist only while something is waiting on them.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/futex.h>
+
+#define FUTEX_BUCKETS 64
+
+typedef struct futex {
+	page_directory_t * space; /* Threads sharing an address space share futexes */
+	uintptr_t addr;
+	list_t * waiters;
+	int refs;
+	struct futex * next;
+} futex_t;
+
+static futex_t * futex_hash[FUTEX_BUCKETS];
+static spin_lock_t futex_lock = { 0 };
+
+static inline unsigned int futex_bucket(page_directory_t * space, uintptr_t addr) {
+	return (((uintptr_t)space >> 4) ^ (addr >> 2)) % FUTEX_BUCKETS;
+}
+
+static futex_t * futex_find(page_directory_t * space, uintptr_t addr) {
+	futex_t * f = futex_hash[futex_bucket(space, addr)];
+	while (f) {
+		if (f->space == space && f->addr == addr) return f;
+		f = f->next;
+	}
+	return NULL;
+}
+
+static void futex_put(futex_t * f) {
+	if (--f->refs) return;
+	futex_t ** link = &futex_hash[futex_bucket(f->space, f->addr)];
+	while (*link != f) {
+		link = &(*link)->next;
+	}
+	*link = f->next;
+	list_free(f->waiters);
+	free(f->waiters);
+	free(f);
+}
+
+/*
+ * Whether the word can be read without a fault. Nothing pages it out
+ * again while interrupts are off.
+ */
+static int futex_resident(page_directory_t * space, uint32_t * addr) {
+	page_t * page = get_page((uintptr_t)addr, 0, space);
+	return page && page->present;
+}
+
+int futex_wait(uint32_t * addr, uint32_t val) {
+	page_directory_t * space = current_process->thread.page_directory;
+
+	/* Interrupts stay off until we are on the queue, so no wake can slip in */
+	IRQ_OFF;
+	while (!futex_resident(space, addr)) {
+		/* Fault it in first; that may block, which it can't under the lock */
+		IRQ_RES;
+		(void)*(volatile uint32_t *)addr;
+		IRQ_OFF;
+	}
+	spin_lock(futex_lock);
+	if (*(volatile uint32_t *)addr != val) {
+		spin_unlock(futex_lock);
+		IRQ_RES;
+		return -EAGAIN;
+	}
+
+	futex_t * f = futex_find(space, (uintptr_t)addr);
+	if (!f) {
+		f = malloc(sizeof(futex_t));
+		f->space = space;
+		f->addr = (uintptr_t)addr;
+		f->waiters = list_create();
+		f->refs = 0;
+		unsigned int bucket = futex_bucket(space, (uintptr_t)addr);
+		f->next = futex_hash[bucket];
+		futex_hash[bucket] = f;
+	}
+	f->refs++;
+	spin_unlock(futex_lock);
+
+	int interrupted = sleep_on(f->waiters);
+
+	spin_lock(futex_lock);
+	futex_put(f);
+	spin_unlock(futex_lock);
+	IRQ_RES;
+
+	return interrupted ? -EINTR : 0;
+}
+
+int futex_wake(uint32_t * addr, uint32_t count) {
+	page_directory_t * space = current_process->thread.page_directory;
+	int woken = 0;
+
+	IRQ_OFF;
+	spin_lock(futex_lock);
+	futex_t * f = futex_find(space, (uintptr_t)addr);
+	if (f) {
+		woken = wakeup_queue_count(f->waiters, count);
+	}
+	spin_unlock(futex_lock);
+	IRQ_RES;
+
+	return woken;
+}
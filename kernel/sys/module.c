@@ -11,7 +11,6 @@
 
 #include <toaru/hashmap.h>
 
-#define SYMBOLTABLE_HASHMAP_SIZE 10
 #define MODULE_HASHMAP_SIZE 10
 
 static hashmap_t * symboltable = NULL;
@@ -25,21 +24,36 @@ typedef struct {
 	char name[];
 } kernel_symbol_t;
 
-/* Cannot use symboltable here because symbol_find is used during initialization
- * of IRQs and ISRs.
+#define NEXT_SYMBOL(k) ((kernel_symbol_t *)((uintptr_t)(k) + sizeof(kernel_symbol_t) + strlen((k)->name) + 1))
+
+/*
+ * Index the kernel's own symbols. Done on first use, which is when the
+ * ISRs and IRQs look up their stubs - the heap is up by then - so that
+ * nothing ever walks the packed table more than once.
  */
-void (* symbol_find(const char * name))(void) {
-	kernel_symbol_t * k = (kernel_symbol_t *)&kernel_symbols_start;
+static void symboltable_init(void) {
+	size_t count = 0;
+	for (kernel_symbol_t * k = (kernel_symbol_t *)&kernel_symbols_start; (uintptr_t)k < (uintptr_t)&kernel_symbols_end; k = NEXT_SYMBOL(k)) {
+		count++;
+	}
 
-	while ((uintptr_t)k < (uintptr_t)&kernel_symbols_end) {
-		if (strcmp(k->name, name)) {
-			k = (kernel_symbol_t *)((uintptr_t)k + sizeof *k + strlen(k->name) + 1);
-			continue;
-		}
-		return (void (*)(void))k->addr;
+	/* Room for the kernel and a good number of modules without growing */
+	symboltable = hashmap_create(count * 2);
+
+	for (kernel_symbol_t * k = (kernel_symbol_t *)&kernel_symbols_start; (uintptr_t)k < (uintptr_t)&kernel_symbols_end; k = NEXT_SYMBOL(k)) {
+		hashmap_set(symboltable, k->name, (void *)k->addr);
 	}
 
-	return NULL;
+	/* Also add the kernel_symbol_start and kernel_symbol_end (these were excluded from the generator) */
+	hashmap_set(symboltable, "kernel_symbols_start", &kernel_symbols_start);
+	hashmap_set(symboltable, "kernel_symbols_end",   &kernel_symbols_end);
+}
+
+void (* symbol_find(const char * name))(void) {
+	if (!symboltable) {
+		symboltable_init();
+	}
+	return (void (*)(void))(uintptr_t)hashmap_get(symboltable, (char *)name);
 }
 
 int module_quickcheck(void * blob) {
@@ -69,6 +83,9 @@ _maybe_pack:
 	return 0;
 }
 
+/* Section header by index; NULL for the special indices (SHN_COMMON, SHN_ABS) */
+#define SECTION(i) ((i) < target->e_shnum ? (Elf32_Shdr *)((uintptr_t)target + target->e_shoff + (i) * target->e_shentsize) : NULL)
+
 void * module_load_direct(void * blob, size_t length) {
 	Elf32_Header * target = (Elf32_Header *)blob;
 
@@ -188,19 +205,8 @@ void * module_load_direct(void * blob, size_t length) {
 							undefined = 1;
 						}
 					} else {
-						Elf32_Shdr * s = NULL;
+						Elf32_Shdr * s = SECTION(table->st_shndx);
 						{
-							int i = 0;
-							int set = 0;
-							for (unsigned int x = 0; x < (unsigned int)target->e_shentsize * target->e_shnum; x += target->e_shentsize) {
-								Elf32_Shdr * shdr = (Elf32_Shdr *)((uintptr_t)target + (target->e_shoff + x));
-								if (i == table->st_shndx) {
-									set = 1;
-									s = shdr;
-									break;
-								}
-								i++;
-							}
 							/*
 							 * Common symbols
 							 * If we were a proper linker, we'd look at a bunch of objects
@@ -209,7 +215,7 @@ void * module_load_direct(void * blob, size_t length) {
 							 * undefined common symbol at this point should be immediately
 							 * allocated and zeroed.
 							 */
-							if (!set && table->st_shndx == 65522) {
+							if (!s && table->st_shndx == 65522) {
 								if (!hashmap_get(symboltable, name)) {
 									void * final = malloc(table->st_value);
 									memset(final, 0, table->st_value);
@@ -229,20 +235,9 @@ void * module_load_direct(void * blob, size_t length) {
 					}
 				} else if (ELF32_ST_BIND(table->st_info) == STB_LOCAL) {
 					char * name = (char *)((uintptr_t)symstrtab + table->st_name);
-					Elf32_Shdr * s = NULL;
+					Elf32_Shdr * s = SECTION(table->st_shndx);
 					{
-						int i = 0;
-						int set = 0;
-						for (unsigned int x = 0; x < (unsigned int)target->e_shentsize * target->e_shnum; x += target->e_shentsize) {
-							Elf32_Shdr * shdr = (Elf32_Shdr *)((uintptr_t)target + (target->e_shoff + x));
-							if (i == table->st_shndx) {
-								set = 1;
-								s = shdr;
-								break;
-							}
-							i++;
-						}
-						if (!set && table->st_shndx == 65522) {
+						if (!s && table->st_shndx == 65522) {
 							if (!hashmap_get(symboltable, name)) {
 								void * final = calloc(1, table->st_value);
 								debug_print(NOTICE, "point %s to 0x%x", name, (uintptr_t)final);
@@ -265,6 +260,24 @@ void * module_load_direct(void * blob, size_t length) {
 		goto mod_load_error;
 	}
 
+	/*
+	 * Resolve every named symbol once, so relocations - of which there
+	 * are many more - can just index the result.
+	 */
+	size_t symbol_count = sym_shdr->sh_size / sizeof(Elf32_Sym);
+	uintptr_t * resolved = malloc(sizeof(uintptr_t) * symbol_count);
+	{
+		Elf32_Sym * symtable = (Elf32_Sym *)(sym_shdr->sh_addr);
+		for (size_t i = 0; i < symbol_count; ++i) {
+			resolved[i] = 0;
+			if (!symtable[i].st_name || ELF32_ST_TYPE(symtable[i].st_info) == STT_SECTION) continue;
+			char * name = (char *)((uintptr_t)symstrtab + symtable[i].st_name);
+			void * addr = hashmap_get(symboltable, name);
+			if (!addr) addr = hashmap_get(local_symbols, name);
+			resolved[i] = (uintptr_t)addr;
+		}
+	}
+
 	{
 		for (unsigned int x = 0; x < (unsigned int)target->e_shentsize * target->e_shnum; x += target->e_shentsize) {
 			Elf32_Shdr * shdr = (Elf32_Shdr *)((uintptr_t)target + (target->e_shoff + x));
@@ -288,19 +301,12 @@ void * module_load_direct(void * blob, size_t length) {
 						place  = (uintptr_t)ptr;
 						symbol = s->sh_addr;
 					} else {
-						char * name = (char *)((uintptr_t)symstrtab + sym->st_name);
 						ptr = (uintptr_t *)(table->r_offset + rs->sh_addr);
 						addend = *ptr;
 						place  = (uintptr_t)ptr;
-						if (!hashmap_get(symboltable, name)) {
-							if (!hashmap_get(local_symbols, name)) {
-								debug_print(ERROR, "Wat? Missing symbol %s", name);
-								debug_print(ERROR, "Here's all the symbols:");
-							} else {
-								symbol = (uintptr_t)hashmap_get(local_symbols, name);
-							}
-						} else {
-							symbol = (uintptr_t)hashmap_get(symboltable, name);
+						symbol = resolved[ELF32_R_SYM(table->r_info)];
+						if (!symbol) {
+							debug_print(ERROR, "Wat? Missing symbol %s", (char *)((uintptr_t)symstrtab + sym->st_name));
 						}
 					}
 					switch (ELF32_R_TYPE(table->r_info)) {
@@ -312,6 +318,7 @@ void * module_load_direct(void * blob, size_t length) {
 							break;
 						default:
 							debug_print(ERROR, "Unsupported relocation type: %d", ELF32_R_TYPE(table->r_info));
+							free(resolved);
 							goto mod_load_error;
 					}
 
@@ -321,6 +328,8 @@ void * module_load_direct(void * blob, size_t length) {
 		}
 	}
 
+	free(resolved);
+
 	debug_print(INFO, "Locating module information...");
 	module_defs * mod_info = NULL;
 	list_t * hash_keys = hashmap_keys(local_symbols);
@@ -412,21 +421,11 @@ void module_unload(char * name) {
 }
 
 void modules_install(void) {
-	/* Initialize the symboltable, we use a hashmap of symbols to addresses  */
-	symboltable = hashmap_create(SYMBOLTABLE_HASHMAP_SIZE);
-
-	/* Load all of the kernel symbols into the symboltable */
-	kernel_symbol_t * k = (kernel_symbol_t *)&kernel_symbols_start;
-
-	while ((uintptr_t)k < (uintptr_t)&kernel_symbols_end) {
-		hashmap_set(symboltable, k->name, (void *)k->addr);
-		k = (kernel_symbol_t *)((uintptr_t)k + sizeof(kernel_symbol_t) + strlen(k->name) + 1);
+	/* Symbols to addresses; usually already built for the ISRs */
+	if (!symboltable) {
+		symboltable_init();
 	}
 
-	/* Also add the kernel_symbol_start and kernel_symbol_end (these were excluded from the generator) */
-	hashmap_set(symboltable, "kernel_symbols_start", &kernel_symbols_start);
-	hashmap_set(symboltable, "kernel_symbols_end",   &kernel_symbols_end);
-
 	/* Initialize the module name -> object hashmap */
 	modules = hashmap_create(MODULE_HASHMAP_SIZE);
 }
@@ -0,0 +1,78 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Sleeping locks
+ *
+ * A contended mutex_lock() first gives a holder that is merely
+ * preempted a few chances to finish - the nearest thing to adaptive
+ * spinning we have with one CPU - and then sleeps. mutex_unlock()
+ * passes ownership directly to the longest waiter, so a thread that
+ * keeps taking the same lock can't starve the others.
+ *
+ * A mutex, unlike a spin lock, can be held across a preemption.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/mutex.h>
+
+#define MUTEX_YIELDS 4 /* Times to let a runnable holder go first */
+
+void mutex_init(mutex_t * mutex) {
+	memset(mutex, 0, sizeof(mutex_t));
+}
+
+void mutex_lock_stat(mutex_t * mutex, lock_stat_t * stat) {
+	uint32_t flags = int_save();
+
+	if (mutex->owner) {
+		stat->contended++;
+
+		for (int i = 0; i < MUTEX_YIELDS && mutex->owner; ++i) {
+			if (!process_is_ready((process_t *)mutex->owner)) break;
+			int_restore(flags);
+			switch_task(1);
+			flags = int_save();
+		}
+
+		/* A signal may wake us before it's handed to us; just wait again */
+		while (mutex->owner && mutex->owner != current_process) {
+			sleep_on(&mutex->waiters);
+			(void)int_save(); /* Whoever ran meanwhile may have turned interrupts on */
+		}
+	}
+	mutex->owner = current_process;
+
+	if (!stat->registered) {
+		lock_stat_register(stat);
+	}
+	stat->acquired++;
+	mutex->taken = lock_clock();
+	mutex->stat = stat;
+
+	int_restore(flags);
+}
+
+void mutex_unlock(mutex_t * mutex) {
+	uint32_t flags = int_save();
+
+	if (mutex->stat) {
+		lock_stat_release(mutex->stat, mutex->taken);
+		mutex->stat = NULL;
+	}
+
+	if (mutex->waiters.head) {
+		node_t * node = list_dequeue(&mutex->waiters);
+		process_t * next = node->value;
+		mutex->owner = next;
+		make_process_ready(next);
+	} else {
+		mutex->owner = NULL;
+	}
+
+	int_restore(flags);
+
+	/* The one we handed it to may matter more than we do */
+	preempt_point();
+}
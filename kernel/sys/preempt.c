@@ -0,0 +1,165 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Kernel preemption
+ *
+ * Each process counts the reasons it can't be switched away from -
+ * spin locks it holds, interrupt handlers running on its stack,
+ * explicit preempt_disable()s - and a switch that comes due while any
+ * are outstanding is taken when the last one goes. The count belongs
+ * to the process rather than the CPU, so one that sleeps holding a
+ * lock gets it back when it wakes.
+ *
+ * Also here is the latency tracer, which times the stretches spent
+ * with interrupts off (IRQ_OFF, int_save, and the entry into any
+ * interrupt or system call) and without preemption, and keeps the
+ * longest of each.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/preempt.h>
+
+int latency_tracing = 0;
+latency_stat_t latency_irqs = { 0 };
+latency_stat_t latency_preempt = { 0 };
+
+/* The interrupts-off stretch in progress on each processor */
+static int irqs_open[SMP_MAX_CPUS] = { 0 };
+static uint32_t irqs_since[SMP_MAX_CPUS] = { 0 };
+static uintptr_t irqs_site[SMP_MAX_CPUS] = { 0 };
+
+static void latency_record(latency_stat_t * stat, uint32_t cycles, uintptr_t start, uintptr_t end) {
+	stat->spans++;
+	if (cycles > stat->longest) {
+		stat->longest = cycles;
+		stat->start_site = start;
+		stat->end_site = end;
+	}
+}
+
+/* Both are called with interrupts off: after the cli, before the sti */
+void latency_irqs_off_at(uintptr_t site) {
+	int cpu = this_cpu()->index;
+	irqs_open[cpu] = 1;
+	irqs_since[cpu] = lock_clock();
+	irqs_site[cpu] = site;
+}
+
+void latency_irqs_on_at(uintptr_t site) {
+	int cpu = this_cpu()->index;
+	if (!irqs_open[cpu]) return;
+	irqs_open[cpu] = 0;
+	latency_record(&latency_irqs, lock_clock() - irqs_since[cpu], irqs_site[cpu], site);
+}
+
+/* From int_save() and int_restore(), which are inlined into the site */
+void latency_irqs_off(void) {
+	latency_irqs_off_at((uintptr_t)__builtin_return_address(0));
+}
+
+void latency_irqs_on(void) {
+	latency_irqs_on_at((uintptr_t)__builtin_return_address(0));
+}
+
+void latency_trace_start(void) {
+	uint32_t flags = int_save();
+	memset(&latency_irqs, 0, sizeof(latency_stat_t));
+	memset(&latency_preempt, 0, sizeof(latency_stat_t));
+	memset(irqs_open, 0, sizeof(irqs_open));
+	latency_tracing = 1;
+	int_restore(flags);
+}
+
+static int interrupts_enabled(void) {
+	uint32_t flags;
+	asm volatile ("pushf\n\tpop %0" : "=r"(flags));
+	return !!(flags & (1 << 9));
+}
+
+/*
+ * Whether to switch away from the running process at a preemption
+ * point. A process that has already put itself on a wait queue is
+ * left to finish going to sleep, and the idle task looks for work
+ * (and gets the timer going again) by itself.
+ */
+static int should_switch(process_t * proc) {
+	if (!proc || proc->preempt_count || in_switch) return 0;
+	if (proc->sleep_node.owner) return 0;
+	if (preempt_pending) return 1;
+	return proc != kernel_idle_task && process_should_preempt();
+}
+
+void preempt_disable_at(uintptr_t site) {
+	process_t * proc = (process_t *)current_process;
+	if (!proc) return;
+	if (!proc->preempt_count++ && latency_tracing) {
+		proc->preempt_since = lock_clock();
+		proc->preempt_site = site;
+	}
+}
+
+/*
+ * `owner` is whoever disabled it, which for a spin lock isn't always
+ * the process letting it go.
+ */
+void preempt_enable_at(void * owner, uintptr_t site) {
+	process_t * proc = owner;
+	if (!proc || !proc->preempt_count) return;
+	if (--proc->preempt_count) return;
+
+	if (latency_tracing && proc->preempt_since) {
+		latency_record(&latency_preempt, lock_clock() - proc->preempt_since, proc->preempt_site, site);
+		proc->preempt_since = 0;
+	}
+
+	if (proc == current_process) preempt_point();
+}
+
+void preempt_disable(void) {
+	preempt_disable_at((uintptr_t)__builtin_return_address(0));
+}
+
+void preempt_enable(void) {
+	preempt_enable_at((void *)current_process, (uintptr_t)__builtin_return_address(0));
+}
+
+void preempt_point(void) {
+	process_t * proc = (process_t *)current_process;
+	if (!interrupts_enabled()) return;
+	if (should_switch(proc)) {
+		switch_task(1);
+	}
+}
+
+/*
+ * Interrupt handlers run on the interrupted process's stack with
+ * interrupts off, so they are non-preemptible time of their own;
+ * they don't start a span of it, though, as the interrupts-off one
+ * already covers them.
+ */
+void preempt_irq_enter(void) {
+	if (current_process) current_process->preempt_count++;
+}
+
+/*
+ * The interrupted code had interrupts on, or it couldn't have been
+ * interrupted, so this is the one preemption point that doesn't need
+ * to check for that.
+ */
+void preempt_irq_exit(void) {
+	process_t * proc = (process_t *)current_process;
+	if (!proc) return;
+	if (proc->preempt_count) proc->preempt_count--;
+	if (should_switch(proc)) {
+		switch_task(1);
+	}
+}
+
+void preempt_syscall_exit(void) {
+	process_t * proc = (process_t *)current_process;
+	if (should_switch(proc)) {
+		switch_task(1);
+	}
+}
@@ -15,25 +15,98 @@
 #include <kernel/bitset.h>
 #include <kernel/logging.h>
 #include <kernel/shm.h>
+#include <kernel/mmap.h>
+#include <kernel/mem.h>
 #include <kernel/printf.h>
+#include <kernel/ktrace.h>
 
 #include <sys/wait.h>
 
 #include <toaru/list.h>
 #include <toaru/tree.h>
+#include <toaru/hashmap.h>
 
 tree_t * process_tree;  /* Parent->Children tree */
 list_t * process_list;  /* Flat storage */
-list_t * process_queue; /* Ready queue */
-list_t * sleep_queue;
-volatile process_t * current_process = NULL;
-process_t * kernel_idle_task = NULL;
+/* Ready queues, one per scheduling class on each processor */
+static list_t * process_queues[SMP_MAX_CPUS][SCHED_CLASSES];
+/* Stands in for a wait queue in sleep_node.owner while a process is on the sleep heap */
+static list_t timed_sleep;
+static hashmap_t * pid_map; /* pid -> process_t */
+static hashmap_t * job_map; /* process group -> list_t of member processes */
 
 static spin_lock_t tree_lock = { 0 };
 static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 
+/*
+ * Timed sleepers, in a binary heap on their deadlines. Going to sleep,
+ * waking early and waking on time are all O(log n) under sleep_lock
+ * with interrupts off, instead of a walk along a sorted list.
+ */
+static sleeper_t ** sleep_heap = NULL;
+static int sleep_count = 0;
+static int sleep_space = 0;
+
+static int sleeper_before(sleeper_t * a, sleeper_t * b) {
+	return a->end_tick < b->end_tick || (a->end_tick == b->end_tick && a->end_subtick < b->end_subtick);
+}
+
+static void sleep_heap_place(int i, sleeper_t * proc) {
+	sleep_heap[i] = proc;
+	proc->index = i;
+}
+
+static void sleep_heap_up(int i) {
+	sleeper_t * proc = sleep_heap[i];
+	while (i) {
+		int parent = (i - 1) / 2;
+		if (!sleeper_before(proc, sleep_heap[parent])) break;
+		sleep_heap_place(i, sleep_heap[parent]);
+		i = parent;
+	}
+	sleep_heap_place(i, proc);
+}
+
+static void sleep_heap_down(int i) {
+	sleeper_t * proc = sleep_heap[i];
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= sleep_count) break;
+		if (child + 1 < sleep_count && sleeper_before(sleep_heap[child + 1], sleep_heap[child])) child++;
+		if (!sleeper_before(sleep_heap[child], proc)) break;
+		sleep_heap_place(i, sleep_heap[child]);
+		i = child;
+	}
+	sleep_heap_place(i, proc);
+}
+
+static void sleep_heap_push(sleeper_t * proc) {
+	if (sleep_count == sleep_space) {
+		sleep_space = sleep_space ? sleep_space * 2 : 64;
+		sleep_heap = realloc(sleep_heap, sleep_space * sizeof(sleeper_t *));
+	}
+	sleep_heap_place(sleep_count, proc);
+	sleep_count++;
+	sleep_heap_up(proc->index);
+}
+
+static void sleep_heap_remove(sleeper_t * proc) {
+	int i = proc->index;
+	proc->index = -1;
+	sleep_count--;
+	if (i == sleep_count) return;
+
+	/* The last one fills the hole and moves whichever way it has to */
+	sleep_heap_place(i, sleep_heap[sleep_count]);
+	if (i && sleeper_before(sleep_heap[i], sleep_heap[(i - 1) / 2])) {
+		sleep_heap_up(i);
+	} else {
+		sleep_heap_down(i);
+	}
+}
+
 static bitset_t pid_set;
 
 /* Default process name string */
@@ -55,14 +128,22 @@ int is_valid_process(process_t * process) {
  */
 #define MAX_PID 32768
 
+/* Words in a descriptor table's slot bitmap */
+#define FD_WORDS(capacity) (((capacity) + 31) / 32)
+
 /*
  * Initialize the process tree and ready queue.
  */
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create();
-	process_queue = list_create();
-	sleep_queue = list_create();
+	for (int cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+		for (int i = 0; i < SCHED_CLASSES; ++i) {
+			process_queues[cpu][i] = list_create();
+		}
+	}
+	pid_map = hashmap_create_int(64);
+	job_map = hashmap_create_int(16);
 
 	/* Start off with enough bits for 64 processes */
 	bitset_init(&pid_set, MAX_PID / 8);
@@ -114,6 +195,125 @@ void debug_print_process_tree(void) {
 	debug_print_process_tree_node(process_tree->root, 0);
 }
 
+/* Timer ticks each class may run before being preempted */
+static unsigned int sched_slices[SCHED_CLASSES] = {
+	[SCHED_CLASS_REALTIME]    = 5,
+	[SCHED_CLASS_INTERACTIVE] = 10,
+	[SCHED_CLASS_BATCH]       = 50,
+};
+
+/* Batch work is picked ahead of everything else after being passed over this many times */
+#define SCHED_BATCH_STARVE 20
+static unsigned int batch_passed_over[SMP_MAX_CPUS] = { 0 };
+
+/*
+ * The queue a process actually waits in: interactive processes that
+ * keep exhausting their slices are treated as batch until they block.
+ */
+static int effective_class(process_t * proc) {
+	if (proc->sched_class == SCHED_CLASS_INTERACTIVE && proc->sched_penalty) {
+		return SCHED_CLASS_BATCH;
+	}
+	return proc->sched_class;
+}
+
+/*
+ * Threads share a page directory, and changes to one are only flushed
+ * from the TLB of the processor making them; so a process only runs
+ * while no other processor has its address space loaded. That's never
+ * the case for the kernel's own, which tasklets run in.
+ */
+static int runnable_here(process_t * proc) {
+	if (proc->thread.page_directory == kernel_directory) return 1;
+	return !smp_directory_elsewhere(proc->thread.page_directory);
+}
+
+/* The first process in a queue this processor can run */
+static node_t * queue_first(list_t * queue) {
+	foreach(node, queue) {
+		if (node->owner != queue) {
+			process_t * proc = node->value;
+			debug_print(ERROR, "Erroneous process located in process queue: node 0x%x has owner 0x%x, but queue is 0x%x", node, node->owner, queue);
+			debug_print(ERROR, "PID associated with this node is %d", proc->id);
+		}
+		if (runnable_here(node->value)) return node;
+	}
+	return NULL;
+}
+
+/*
+ * The process one processor's queues would give up next, and the queue
+ * it is in; batch work that has been passed over too often goes first,
+ * but only for the processor it's queued on.
+ */
+static node_t * queues_first(int cpu, int own, list_t ** from) {
+	list_t ** queues = process_queues[cpu];
+	node_t * node = NULL;
+	if (own && queues[SCHED_CLASS_BATCH]->head && batch_passed_over[cpu] >= SCHED_BATCH_STARVE) {
+		node = queue_first(queues[SCHED_CLASS_BATCH]);
+		*from = queues[SCHED_CLASS_BATCH];
+	}
+	for (int i = 0; !node && i < SCHED_CLASSES; ++i) {
+		node = queue_first(queues[i]);
+		*from = queues[i];
+	}
+	return node;
+}
+
+static int queued_on(int cpu) {
+	int count = 0;
+	for (int i = 0; i < SCHED_CLASSES; ++i) {
+		count += process_queues[cpu][i]->length;
+	}
+	return count;
+}
+
+/*
+ * Find something for this processor to run: from its own queues, or
+ * failing that, stolen from another's - the one with the most waiting
+ * first. Taken off its queue if `take` is set.
+ */
+static process_t * find_ready(int take) {
+	int me = this_cpu()->index;
+	list_t * queue = NULL;
+	node_t * node = queues_first(me, 1, &queue);
+	int from = me;
+
+	if (!node && smp_cpus_online > 1) {
+		int busiest = -1;
+		for (int cpu = 0; cpu < smp_cpus_online; ++cpu) {
+			if (cpu == me || !queued_on(cpu)) continue;
+			if (busiest == -1 || queued_on(cpu) > queued_on(busiest)) busiest = cpu;
+		}
+		if (busiest != -1) {
+			node = queues_first(busiest, 0, &queue);
+			from = busiest;
+		}
+		for (int cpu = 0; !node && cpu < smp_cpus_online; ++cpu) {
+			if (cpu == me || cpu == busiest) continue;
+			node = queues_first(cpu, 0, &queue);
+			from = cpu;
+		}
+	}
+
+	if (!node) return NULL;
+	if (!take) return node->value;
+
+	if (from == me) {
+		list_t * batch = process_queues[me][SCHED_CLASS_BATCH];
+		if (queue == batch) {
+			batch_passed_over[me] = 0;
+		} else if (batch->head) {
+			batch_passed_over[me]++;
+		}
+	}
+
+	spin_lock(process_queue_lock);
+	list_delete(queue, node);
+	spin_unlock(process_queue_lock);
+	return node->value;
+}
+
 /*
  * Retreive the next ready process.
  * XXX: POPs from the ready queue!
@@ -121,20 +321,100 @@ void debug_print_process_tree(void) {
  * @return A pointer to the next process in the queue.
  */
 process_t * next_ready_process(void) {
-	if (!process_available()) {
-		return kernel_idle_task;
+	process_t * next = find_ready(1);
+	return next ? next : kernel_idle_task;
+}
+
+/*
+ * Give a process a fresh time slice for its class as it is scheduled.
+ */
+void process_start_slice(process_t * proc) {
+	proc->time_slice = sched_slices[effective_class(proc)];
+}
+
+/*
+ * Charge the time since it was last charged to a process, as user or
+ * system time. Called when it enters or leaves the kernel, when the
+ * timer interrupts it, and when it is switched away from.
+ */
+void process_charge(process_t * proc, uint64_t now, int user) {
+	if (proc->usage_stamp && now > proc->usage_stamp) {
+		if (user) {
+			proc->usage.utime += now - proc->usage_stamp;
+		} else {
+			proc->usage.stime += now - proc->usage_stamp;
+		}
 	}
-	if (process_queue->head->owner != process_queue) {
-		debug_print(ERROR, "Erroneous process located in process queue: node 0x%x has owner 0x%x, but process_queue is 0x%x", process_queue->head, process_queue->head->owner, process_queue);
+	proc->usage_stamp = now;
+}
 
-		process_t * proc = process_queue->head->value;
+void process_usage_add(process_usage_t * dest, process_usage_t * src) {
+	dest->utime       += src->utime;
+	dest->stime       += src->stime;
+	dest->nvcsw       += src->nvcsw;
+	dest->nivcsw      += src->nivcsw;
+	dest->minflt      += src->minflt;
+	dest->majflt      += src->majflt;
+	dest->read_bytes  += src->read_bytes;
+	dest->write_bytes += src->write_bytes;
+}
 
-		debug_print(ERROR, "PID associated with this node is %d", proc->id);
+/*
+ * Account a timer tick to the running process.
+ *
+ * @return 1 if the running process should be preempted
+ */
+int process_tick(void) {
+	process_t * proc = (process_t *)current_process;
+	if (!proc || proc == kernel_idle_task) return 1;
+
+	if (proc->time_slice) proc->time_slice--;
+	if (!proc->time_slice) {
+		/* Ran for its whole slice without blocking */
+		if (proc->sched_class == SCHED_CLASS_INTERACTIVE) {
+			proc->sched_penalty = 1;
+		}
+		return 1;
+	}
+
+	return process_should_preempt();
+}
+
+/*
+ * Whether something more important than the running process is ready.
+ */
+int process_should_preempt(void) {
+	process_t * proc = (process_t *)current_process;
+	if (!proc) return 0;
+	if (proc == kernel_idle_task) return process_available();
+
+	for (int i = 0; i < effective_class(proc); ++i) {
+		if (queue_first(process_queues[this_cpu()->index][i])) return 1;
+	}
+	return 0;
+}
+
+/*
+ * Which processor's queue a newly ready process goes on: one that's
+ * sitting idle if there is one, or else wherever it last ran. Threads
+ * whose address space is in use go where it is, as nowhere else can
+ * run them until it's let go.
+ */
+static int ready_cpu(process_t * proc) {
+	int cpu = (proc->cpu >= 0 && proc->cpu < smp_cpus_online) ? proc->cpu : this_cpu()->index;
+	if (smp_cpus_online == 1) return cpu;
+
+	if (proc->thread.page_directory != kernel_directory) {
+		for (int i = 0; i < smp_cpus_online; ++i) {
+			if (cpus[i].directory == proc->thread.page_directory) return i;
+		}
 	}
-	node_t * np = list_dequeue(process_queue);
-	assert(np && "Ready queue is empty.");
-	process_t * next = np->value;
-	return next;
+
+	if (smp_cpu_idle(cpu)) return cpu;
+	for (int i = 0; i < smp_cpus_online; ++i) {
+		if (smp_cpu_idle(i)) return i;
+	}
+	return cpu;
 }
 
 /*
@@ -143,17 +423,22 @@ process_t * next_ready_process(void) {
  * @param proc Process to reinsert
  */
 void make_process_ready(process_t * proc) {
+	if (proc->running && proc != current_process) {
+		/* On another processor, so not asleep; it sees whatever this was for when it next switches */
+		return;
+	}
 	if (proc->sleep_node.owner != NULL) {
-		if (proc->sleep_node.owner == sleep_queue) {
+		if (proc->sleep_node.owner == &timed_sleep) {
 			/* XXX can't wake from timed sleep */
-			if (proc->timed_sleep_node) {
+			if (proc->timed_sleeper) {
 				IRQ_OFF;
 				spin_lock(sleep_lock);
-				list_delete(sleep_queue, proc->timed_sleep_node);
+				sleep_heap_remove(proc->timed_sleeper);
 				spin_unlock(sleep_lock);
 				IRQ_RES;
 				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
+				free(proc->timed_sleeper);
+				proc->timed_sleeper = NULL;
 			}
 			/* Else: I have no idea what happened. */
 		} else {
@@ -165,17 +450,45 @@ void make_process_ready(process_t * proc) {
 	}
 	if (proc->sched_node.owner) {
 		debug_print(WARNING, "Can't make process ready without removing from owner list: %d", proc->id);
-		debug_print(WARNING, "  (This is a bug) Current owner list is 0x%x (ready queue is 0x%x)", proc->sched_node.owner, process_queue);
+		debug_print(WARNING, "  (This is a bug) Current owner list is 0x%x (ready queue is 0x%x)", proc->sched_node.owner, process_queues[proc->cpu][effective_class(proc)]);
 		return;
 	}
+	int cpu = ready_cpu(proc);
+	proc->cpu = cpu;
 	spin_lock(process_queue_lock);
-	list_append(process_queue, &proc->sched_node);
+	list_append(process_queues[cpu][effective_class(proc)], &proc->sched_node);
 	spin_unlock(process_queue_lock);
+	if (cpu != this_cpu()->index) {
+		smp_wake(cpu);
+	}
 }
 
 
 extern void tree_remove_reparent_root(tree_t * tree, tree_node_t * node);
 
+/*
+ * Process group membership; both need the tree lock held.
+ */
+static void job_join(process_t * proc, pid_t job) {
+	list_t * members = hashmap_get(job_map, (void *)(uintptr_t)job);
+	if (!members) {
+		members = list_create();
+		hashmap_set(job_map, (void *)(uintptr_t)job, members);
+	}
+	list_append(members, &proc->job_node);
+	proc->job = job;
+}
+
+static void job_leave(process_t * proc) {
+	list_t * members = proc->job_node.owner;
+	if (!members) return;
+	list_delete(members, &proc->job_node);
+	if (!members->length) {
+		hashmap_remove(job_map, (void *)(uintptr_t)proc->job);
+		free(members);
+	}
+}
+
 /*
  * Delete a process from the process tree
  *
@@ -197,14 +510,28 @@ void delete_process(process_t * proc) {
 
 	/* Remove the entry. */
 	spin_lock(tree_lock);
-	/* Reparent everyone below me to init */
+	/* Reparent everyone below me to init, along with what they had to report */
 	int has_children = entry->children->length;
 	tree_remove_reparent_root(process_tree, entry);
-	list_delete(process_list, list_find(process_list, proc));
+	process_t * init = process_tree->root->value;
+	node_t * event;
+	while ((event = list_dequeue(proc->wait_events))) {
+		list_append(init->wait_events, event);
+	}
+	free(proc->wait_events);
+	if (proc->wait_node.owner) {
+		list_delete(proc->wait_node.owner, &proc->wait_node);
+	}
+	if (proc->exit_watchers) {
+		list_free(proc->exit_watchers);
+		free(proc->exit_watchers);
+	}
+	list_delete(process_list, &proc->proc_node);
+	hashmap_remove(pid_map, (void *)(uintptr_t)proc->id);
+	job_leave(proc);
 	spin_unlock(tree_lock);
 
 	if (has_children) {
-		process_t * init = process_tree->root->value;
 		wakeup_queue(init->wait_queue);
 	}
 
@@ -214,10 +541,50 @@ void delete_process(process_t * proc) {
 	free(proc);
 }
 
+/*
+ * Time spent halted with nothing to run, in TSC cycles. The idle
+ * task's own stime also has what it spends filling the zero pool.
+ */
+uint64_t idle_cycles = 0;
+static uint64_t idle_since[SMP_MAX_CPUS] = { 0 };
+
+/*
+ * Close out a halt. The idle task does this when it wakes, but an
+ * interrupt that readies something may switch away from it first.
+ */
+void process_idle_end(uint64_t now) {
+	int cpu = this_cpu()->index;
+	if (!idle_since[cpu]) return;
+	if (now > idle_since[cpu]) idle_cycles += now - idle_since[cpu];
+	idle_since[cpu] = 0;
+}
+
 static void _kidle(void) {
+	int bootstrap = this_cpu()->index == 0;
 	while (1) {
 		IRQ_ON;
-		PAUSE;
+		/* Spare time goes into clearing page tables for later */
+		int filled = zero_pool_fill();
+		IRQ_OFF;
+		if (!filled && !process_available()) {
+			/*
+			 * sti doesn't take effect until after the next instruction,
+			 * so an interrupt that comes in after the check above still
+			 * wakes the hlt instead of being taken before it. Other
+			 * processors can have the kernel while this one sleeps.
+			 */
+			idle_since[this_cpu()->index] = timer_cycles();
+			kernel_unlock();
+			asm volatile ("sti\n\thlt\n\tcli");
+			kernel_lock();
+			process_idle_end(timer_cycles());
+		}
+		/* Don't wait for the next shot if an interrupt readied something */
+		if (process_available()) {
+			/* The others' timers aren't the clock; see smp_switched() */
+			if (bootstrap) timer_wake();
+			switch_task(1);
+		}
 	}
 }
 
@@ -238,13 +605,17 @@ process_t * spawn_kidle(void) {
 
 	idle->started = 1;
 	idle->running = 1;
+	idle->cpu = -1;
 	idle->wait_queue = list_create();
+	idle->wait_events = list_create();
 	idle->shm_mappings = list_create();
+	idle->mmap_regions = list_create();
 	idle->signal_queue = list_create();
 
 	gettimeofday(&idle->start, NULL);
 
-	set_process_environment(idle, current_directory);
+	/* Any processor's, so never the address space of something else */
+	set_process_environment(idle, kernel_directory);
 	return idle;
 }
 
@@ -274,13 +645,7 @@ process_t * spawn_init(void) {
 	init->real_user = 0;
 	init->mask    = 022;     /* umask */
 	init->status  = 0;       /* Run status */
-	init->fds = malloc(sizeof(fd_table_t));
-	init->fds->refs = 1;
-	init->fds->length   = 0;  /* Initialize the file descriptors */
-	init->fds->capacity = 4;
-	init->fds->entries  = malloc(sizeof(fs_node_t *) * init->fds->capacity);
-	init->fds->modes    = malloc(sizeof(int) * init->fds->capacity);
-	init->fds->offsets  = malloc(sizeof(uint64_t) * init->fds->capacity);
+	init->fds = process_fd_table(4); /* Initialize the file descriptors */
 
 	/* Set the working directory */
 	init->wd_node = clone_fs(fs_root);
@@ -290,6 +655,7 @@ process_t * spawn_init(void) {
 	init->image.entry       = 0;
 	init->image.heap        = 0;
 	init->image.heap_actual = 0;
+	init->image.heap_start  = 0;
 	init->image.stack       = initial_esp + 1;
 	init->image.user_stack  = 0;
 	init->image.size        = 0;
@@ -303,10 +669,17 @@ process_t * spawn_init(void) {
 	init->started = 1;
 	init->running = 1;
 	init->wait_queue = list_create();
+	init->wait_events = list_create();
+	init->exit_watchers = NULL;
 	init->shm_mappings = list_create();
+	init->mmap_regions = list_create();
 	init->signal_queue = list_create();
 	init->signal_kstack = NULL; /* None yet initialized */
 
+	init->proc_node.prev = NULL;
+	init->proc_node.next = NULL;
+	init->proc_node.value = init;
+
 	init->sched_node.prev = NULL;
 	init->sched_node.next = NULL;
 	init->sched_node.value = init;
@@ -315,15 +688,34 @@ process_t * spawn_init(void) {
 	init->sleep_node.next = NULL;
 	init->sleep_node.value = init;
 
-	init->timed_sleep_node = NULL;
+	init->timed_sleeper = NULL;
+	init->timeout_sleeper = NULL;
+	init->preempt_count = 0;
+
+	init->job_node.prev = NULL;
+	init->job_node.next = NULL;
+	init->job_node.owner = NULL;
+	init->job_node.value = init;
+
+	init->wait_node.prev = NULL;
+	init->wait_node.next = NULL;
+	init->wait_node.owner = NULL;
+	init->wait_node.value = init;
 
 	init->is_tasklet = 0;
+	init->cpu = 0;
+
+	init->sched_class = SCHED_CLASS_INTERACTIVE;
+	init->sched_penalty = 0;
+	init->time_slice = 0;
 
 	set_process_environment(init, current_directory);
 
 	/* What the hey, let's also set the description on this one */
 	init->description = strdup("[init]");
-	list_insert(process_list, (void *)init);
+	list_append(process_list, &init->proc_node);
+	hashmap_set(pid_map, (void *)(uintptr_t)init->id, init);
+	job_join(init, init->job);
 
 	return init;
 }
@@ -398,17 +790,22 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	proc->job = parent->job;
 	proc->session = parent->session;
 
+	/* Start out alongside the parent */
+	proc->cpu = this_cpu()->index;
+
 	/* Zero out the ESP/EBP/EIP */
 	proc->thread.esp = 0;
 	proc->thread.ebp = 0;
 	proc->thread.eip = 0;
 	proc->thread.fpu_enabled = 0;
 	memcpy((void*)proc->thread.fp_regs, (void*)parent->thread.fp_regs, 512);
+	proc->thread.tls_base = parent->thread.tls_base;
 
 	/* Set the process image information from the parent */
 	proc->image.entry       = parent->image.entry;
 	proc->image.heap        = parent->image.heap;
 	proc->image.heap_actual = parent->image.heap_actual;
+	proc->image.heap_start  = parent->image.heap_start;
 	proc->image.size        = parent->image.size;
 	debug_print(INFO,"    stack {");
 	proc->image.stack       = (uintptr_t)kvmalloc(KERNEL_STACK_SIZE) + KERNEL_STACK_SIZE;
@@ -425,21 +822,17 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 		proc->fds = parent->fds;
 		proc->fds->refs++;
 	} else {
-		proc->fds = malloc(sizeof(fd_table_t));
-		proc->fds->refs     = 1;
-		proc->fds->length   = parent->fds->length;
-		proc->fds->capacity = parent->fds->capacity;
 		debug_print(INFO,"    fds / files {");
-		proc->fds->entries  = malloc(sizeof(fs_node_t *) * proc->fds->capacity);
-		proc->fds->modes    = malloc(sizeof(int) * proc->fds->capacity);
-		proc->fds->offsets  = malloc(sizeof(uint64_t) * proc->fds->capacity);
+		proc->fds = process_fd_table(parent->fds->capacity);
 		assert(proc->fds->entries && "Failed to allocate file descriptor table for new process.");
 		debug_print(INFO,"    ---");
+		memcpy(proc->fds->entries, parent->fds->entries, sizeof(fd_entry_t) * parent->fds->length);
+		memcpy(proc->fds->used, parent->fds->used, sizeof(uint32_t) * FD_WORDS(parent->fds->capacity));
 		for (uint32_t i = 0; i < parent->fds->length; ++i) {
-			proc->fds->entries[i] = clone_fs(parent->fds->entries[i]);
-			proc->fds->modes[i]   = parent->fds->modes[i];
-			proc->fds->offsets[i] = parent->fds->offsets[i];
+			clone_fs(proc->fds->entries[i].node);
 		}
+		proc->fds->length    = parent->fds->length;
+		proc->fds->next_free = parent->fds->next_free;
 		debug_print(INFO,"    }");
 	}
 
@@ -455,10 +848,17 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	proc->running = 0;
 	memset(proc->signals.functions, 0x00, sizeof(uintptr_t) * NUMSIGNALS);
 	proc->wait_queue = list_create();
+	proc->wait_events = list_create();
+	proc->exit_watchers = NULL;
 	proc->shm_mappings = list_create();
+	proc->mmap_regions = list_create();
 	proc->signal_queue = list_create();
 	proc->signal_kstack = NULL; /* None yet initialized */
 
+	proc->proc_node.prev = NULL;
+	proc->proc_node.next = NULL;
+	proc->proc_node.value = proc;
+
 	proc->sched_node.prev = NULL;
 	proc->sched_node.next = NULL;
 	proc->sched_node.value = proc;
@@ -467,10 +867,22 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	proc->sleep_node.next = NULL;
 	proc->sleep_node.value = proc;
 
-	proc->timed_sleep_node = NULL;
+	proc->timed_sleeper = NULL;
+
+	proc->job_node.value = proc;
+
+	proc->wait_node.prev = NULL;
+	proc->wait_node.next = NULL;
+	proc->wait_node.owner = NULL;
+	proc->wait_node.value = proc;
 
 	proc->is_tasklet = 0;
 
+	/* Scheduling class is inherited; the interactivity penalty is not */
+	proc->sched_class = parent->sched_class;
+	proc->sched_penalty = 0;
+	proc->time_slice = 0;
+
 	gettimeofday(&proc->start, NULL);
 
 	/* Insert the process into the process tree as a child
@@ -480,30 +892,81 @@ process_t * spawn_process(volatile process_t * parent, int reuse_fds) {
 	proc->tree_entry = entry;
 	spin_lock(tree_lock);
 	tree_node_insert_child_node(process_tree, parent->tree_entry, entry);
-	list_insert(process_list, (void *)proc);
+	list_append(process_list, &proc->proc_node);
+	hashmap_set(pid_map, (void *)(uintptr_t)proc->id, proc);
+	job_join(proc, proc->job);
 	spin_unlock(tree_lock);
 
 	/* Return the new process */
 	return proc;
 }
 
-uint8_t process_compare(void * proc_v, void * pid_v) {
-	pid_t pid = (*(pid_t *)pid_v);
-	process_t * proc = (process_t *)proc_v;
+process_t * process_from_pid(pid_t pid) {
+	if (pid < 0) return NULL;
 
-	return (uint8_t)(proc->id == pid);
+	spin_lock(tree_lock);
+	process_t * proc = hashmap_get(pid_map, (void *)(uintptr_t)pid);
+	spin_unlock(tree_lock);
+	return proc;
 }
 
-process_t * process_from_pid(pid_t pid) {
-	if (pid < 0) return NULL;
+/*
+ * Move a process to another process group.
+ */
+void process_set_job(process_t * proc, pid_t job) {
+	spin_lock(tree_lock);
+	job_leave(proc);
+	job_join(proc, job);
+	spin_unlock(tree_lock);
+}
 
+/*
+ * Does any process belong to process group `job`?
+ */
+int process_job_exists(pid_t job) {
 	spin_lock(tree_lock);
-	tree_node_t * entry = tree_find(process_tree,&pid,process_compare);
+	int exists = hashmap_has(job_map, (void *)(uintptr_t)job);
+	spin_unlock(tree_lock);
+	return exists;
+}
+
+/*
+ * The PIDs of the thread group leaders in process group `job`, in a
+ * malloc()'d array of *count entries; NULL if there are none.
+ */
+pid_t * process_job_leaders(pid_t job, int * count) {
+	pid_t * pids = NULL;
+	*count = 0;
+
+	spin_lock(tree_lock);
+	list_t * members = hashmap_get(job_map, (void *)(uintptr_t)job);
+	if (members && members->length) {
+		pids = malloc(sizeof(pid_t) * members->length);
+		foreach(node, members) {
+			process_t * proc = node->value;
+			if (proc->group == proc->id) {
+				pids[(*count)++] = proc->id;
+			}
+		}
+	}
 	spin_unlock(tree_lock);
-	if (entry) {
-		return (process_t *)entry->value;
+
+	return pids;
+}
+
+/*
+ * Call `callback` for every process, with the tree locked so that none
+ * are created, reparented or reaped along the way. The callback may not
+ * block, nor call anything that takes the tree lock.
+ */
+void process_foreach(void (*callback)(process_t * proc, process_t * parent, void * data), void * data) {
+	spin_lock(tree_lock);
+	foreach(lnode, process_list) {
+		process_t * proc = lnode->value;
+		tree_node_t * entry = proc->tree_entry;
+		callback(proc, (entry && entry->parent) ? entry->parent->value : NULL, data);
 	}
-	return NULL;
+	spin_unlock(tree_lock);
 }
 
 process_t * process_get_parent(process_t * process) {
@@ -569,13 +1032,37 @@ void set_process_environment(process_t * proc, page_directory_t * directory) {
 }
 
 /*
- * Are there any processes available in the queue?
- * (Queue not empty)
+ * Are there any processes this processor could run, in its own
+ * queues or for the taking from another's?
  *
  * @return 1 if there are processes available, 0 otherwise
  */
 uint8_t process_available(void) {
-	return (process_queue->head != NULL);
+	return find_ready(0) != NULL;
+}
+
+/*
+ * Make an empty descriptor table with room for `capacity` descriptors.
+ */
+fd_table_t * process_fd_table(size_t capacity) {
+	fd_table_t * fds = malloc(sizeof(fd_table_t));
+	fds->refs      = 1;
+	fds->length    = 0;
+	fds->capacity  = capacity;
+	fds->next_free = 0;
+	fds->entries   = malloc(sizeof(fd_entry_t) * capacity);
+	fds->used      = malloc(sizeof(uint32_t) * FD_WORDS(capacity));
+	memset(fds->entries, 0, sizeof(fd_entry_t) * capacity);
+	memset(fds->used, 0, sizeof(uint32_t) * FD_WORDS(capacity));
+	return fds;
+}
+
+static void fd_table_grow(fd_table_t * fds, size_t capacity) {
+	fds->entries = realloc(fds->entries, sizeof(fd_entry_t) * capacity);
+	memset(&fds->entries[fds->capacity], 0, sizeof(fd_entry_t) * (capacity - fds->capacity));
+	fds->used = realloc(fds->used, sizeof(uint32_t) * FD_WORDS(capacity));
+	memset(&fds->used[FD_WORDS(fds->capacity)], 0, sizeof(uint32_t) * (FD_WORDS(capacity) - FD_WORDS(fds->capacity)));
+	fds->capacity = capacity;
 }
 
 /*
@@ -586,29 +1073,50 @@ uint8_t process_available(void) {
  * @return The actual fd, for use in userspace
  */
 uint32_t process_append_fd(process_t * proc, fs_node_t * node) {
-	/* Fill gaps */
-	for (unsigned int i = 0; i < proc->fds->length; ++i) {
-		if (!proc->fds->entries[i]) {
-			proc->fds->entries[i] = node;
-			/* modes, offsets must be set by caller */
-			proc->fds->modes[i] = 0;
-			proc->fds->offsets[i] = 0;
-			return i;
+	fd_table_t * fds = proc->fds;
+
+	/* Lowest free slot; bits past the capacity are always clear */
+	size_t fd = fds->capacity;
+	for (size_t w = fds->next_free / 32; w < FD_WORDS(fds->capacity); ++w) {
+		if (fds->used[w] != 0xFFFFFFFF) {
+			fd = w * 32 + __builtin_ctz(~fds->used[w]);
+			break;
 		}
 	}
+
 	/* No gaps, expand */
-	if (proc->fds->length == proc->fds->capacity) {
-		proc->fds->capacity *= 2;
-		proc->fds->entries = realloc(proc->fds->entries, sizeof(fs_node_t *) * proc->fds->capacity);
-		proc->fds->modes   = realloc(proc->fds->modes,   sizeof(int) * proc->fds->capacity);
-		proc->fds->offsets = realloc(proc->fds->offsets, sizeof(uint64_t) * proc->fds->capacity);
+	if (fd >= fds->capacity) {
+		fd_table_grow(fds, fds->capacity * 2);
 	}
-	proc->fds->entries[proc->fds->length] = node;
+
+	fds->used[fd / 32] |= (1 << (fd % 32));
+	fds->entries[fd].node = node;
 	/* modes, offsets must be set by caller */
-	proc->fds->modes[proc->fds->length] = 0;
-	proc->fds->offsets[proc->fds->length] = 0;
-	proc->fds->length++;
-	return proc->fds->length-1;
+	fds->entries[fd].offset = 0;
+	fds->entries[fd].mode   = 0;
+	fds->entries[fd].flags  = 0;
+	fds->next_free = fd + 1;
+	if (fd >= fds->length) {
+		fds->length = fd + 1;
+	}
+	return fd;
+}
+
+/*
+ * Close a file descriptor and give its slot back.
+ */
+void process_close_fd(process_t * proc, int fd) {
+	fd_table_t * fds = proc->fds;
+	if (fd < 0 || (size_t)fd >= fds->length) return;
+
+	if (fds->entries[fd].node) {
+		close_fs(fds->entries[fd].node);
+		fds->entries[fd].node = NULL;
+	}
+	fds->used[fd / 32] &= ~(1 << (fd % 32));
+	if ((size_t)fd < fds->next_free) {
+		fds->next_free = fd;
+	}
 }
 
 /*
@@ -627,13 +1135,13 @@ uint32_t process_move_fd(process_t * proc, int src, int dest) {
 	if (dest == -1) {
 		dest = process_append_fd(proc, NULL);
 	}
-	if (proc->fds->entries[dest] != proc->fds->entries[src]) {
-		close_fs(proc->fds->entries[dest]);
+	if (proc->fds->entries[dest].node != proc->fds->entries[src].node) {
+		close_fs(proc->fds->entries[dest].node);
 		proc->fds->entries[dest] = proc->fds->entries[src];
-		proc->fds->modes[dest] = proc->fds->modes[src];
-		proc->fds->offsets[dest] = proc->fds->offsets[src];
-		open_fs(proc->fds->entries[dest], 0);
+		proc->fds->entries[dest].flags = 0; /* dup()s don't inherit FD_CLOEXEC */
+		open_fs(proc->fds->entries[dest].node, 0);
 	}
+	proc->fds->used[dest / 32] |= (1 << (dest % 32));
 	return dest;
 }
 
@@ -648,6 +1156,9 @@ int wakeup_queue(list_t * queue) {
 		}
 		awoken_processes++;
 	}
+	if (awoken_processes) {
+		KTRACE(KTRACE_WAKEUP, queue, awoken_processes, 0);
+	}
 	return awoken_processes;
 }
 
@@ -664,9 +1175,33 @@ int wakeup_queue_interrupted(list_t * queue) {
 		}
 		awoken_processes++;
 	}
+	if (awoken_processes) {
+		KTRACE(KTRACE_WAKEUP, queue, awoken_processes, 0);
+	}
 	return awoken_processes;
 }
 
+/*
+ * Wake at most `count` processes, oldest first; ones that have exited
+ * since they went to sleep don't count.
+ */
+int wakeup_queue_count(list_t * queue, int count) {
+	int awoken_processes = 0;
+	while (count && queue->length > 0) {
+		spin_lock(wait_lock_tmp);
+		node_t * node = list_pop(queue);
+		spin_unlock(wait_lock_tmp);
+		if (!((process_t *)node->value)->finished) {
+			make_process_ready(node->value);
+			awoken_processes++;
+			count--;
+		}
+	}
+	if (awoken_processes) {
+		KTRACE(KTRACE_WAKEUP, queue, awoken_processes, 0);
+	}
+	return awoken_processes;
+}
 
 int sleep_on(list_t * queue) {
 	if (current_process->sleep_node.owner) {
@@ -675,6 +1210,7 @@ int sleep_on(list_t * queue) {
 		return 0;
 	}
 	current_process->sleep_interrupted = 0;
+	KTRACE(KTRACE_SLEEP, queue, 0, 0);
 	spin_lock(wait_lock_tmp);
 	list_append(queue, (node_t *)&current_process->sleep_node);
 	spin_unlock(wait_lock_tmp);
@@ -690,64 +1226,95 @@ int process_is_ready(process_t * proc) {
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
 	IRQ_OFF;
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					make_process_ready(process);
-				}
-			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
+	while (sleep_count) {
+		sleeper_t * proc = sleep_heap[0];
+		if (proc->end_tick > seconds || (proc->end_tick == seconds && proc->end_subtick > subseconds)) break;
+
+		/* Off the heap first, so waking it doesn't try to take it off again */
+		sleep_heap_remove(proc);
+		if (proc->is_fswait) {
+			proc->is_fswait = -1;
+			process_alert_node(proc->process,proc);
+		} else {
+			process_t * process = proc->process;
+			process->sleep_node.owner = NULL;
+			process->timed_sleeper = NULL;
+			if (!process_is_ready(process)) {
+				make_process_ready(process);
 			}
 		}
+		free(proc);
 	}
 	spin_unlock(sleep_lock);
 	IRQ_RES;
 }
 
+/*
+ * Deadline of the first sleeper, if there is one.
+ */
+int next_sleeper(unsigned long * seconds, unsigned long * subseconds) {
+	int found = 0;
+	spin_lock(sleep_lock);
+	if (sleep_count) {
+		sleeper_t * proc = sleep_heap[0];
+		*seconds    = proc->end_tick;
+		*subseconds = proc->end_subtick;
+		found = 1;
+	}
+	spin_unlock(sleep_lock);
+	return found;
+}
+
 void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds) {
 	if (current_process->sleep_node.owner) {
 		/* Can't sleep, sleeping already */
 		return;
 	}
-	process->sleep_node.owner = sleep_queue;
+	process->sleep_node.owner = &timed_sleep;
 
-	IRQ_OFF;
-	spin_lock(sleep_lock);
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
 	sleeper_t * proc = malloc(sizeof(sleeper_t));
 	proc->process     = process;
 	proc->end_tick    = seconds;
 	proc->end_subtick = subseconds;
 	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+
+	IRQ_OFF;
+	spin_lock(sleep_lock);
+	sleep_heap_push(proc);
+	process->timed_sleeper = proc;
 	spin_unlock(sleep_lock);
 	IRQ_RES;
 }
 
+/*
+ * Note that a child has something for waitpid() to report. Children
+ * are queued on their parent in the order they exited or stopped, so
+ * waitpid() only looks at the ones that did. The queue is under the
+ * tree lock, like the rest of the parent/child links.
+ */
+void process_queue_wait_event(process_t * proc) {
+	spin_lock(tree_lock);
+	tree_node_t * entry = proc->tree_entry;
+	process_t * parent = (entry && entry->parent) ? entry->parent->value : NULL;
+	if (parent && !proc->wait_node.owner) {
+		list_append(parent->wait_events, &proc->wait_node);
+	}
+	spin_unlock(tree_lock);
+}
+
 void cleanup_process(process_t * proc, int retval) {
 	proc->status   = retval;
 	proc->finished = 1;
+	process_queue_wait_event(proc);
+
+	/* Anyone waiting on a pidfd for us */
+	if (proc->exit_watchers) {
+		while (proc->exit_watchers->head) {
+			node_t * node = list_dequeue(proc->exit_watchers);
+			process_alert_node(node->value, proc);
+			free(node);
+		}
+	}
 
 	list_free(proc->wait_queue);
 	free(proc->wait_queue);
@@ -764,6 +1331,8 @@ void cleanup_process(process_t * proc, int retval) {
 	debug_print(INFO, "Releasing shared memory for %d", proc->id);
 	shm_release_all(proc);
 	free(proc->shm_mappings);
+	mmap_release_all(proc);
+	free(proc->mmap_regions);
 	debug_print(INFO, "Freeing more mems %d", proc->id);
 	if (proc->signal_kstack) {
 		free(proc->signal_kstack);
@@ -777,15 +1346,11 @@ void cleanup_process(process_t * proc, int retval) {
 		debug_print(INFO, "Reached 0, all dependencies are closed for %d's file descriptors and page directories", proc->id);
 		debug_print(INFO, "Going to clear out the file descriptors %d", proc->id);
 		for (uint32_t i = 0; i < proc->fds->length; ++i) {
-			if (proc->fds->entries[i]) {
-				close_fs(proc->fds->entries[i]);
-				proc->fds->entries[i] = NULL;
-			}
+			process_close_fd(proc, i);
 		}
 		debug_print(INFO, "... and their storage %d", proc->id);
 		free(proc->fds->entries);
-		free(proc->fds->offsets);
-		free(proc->fds->modes);
+		free(proc->fds->used);
 		free(proc->fds);
 		debug_print(INFO, "... and the kernel stack (hope this ain't us) %d", proc->id);
 		free((void *)(proc->image.stack - KERNEL_STACK_SIZE));
@@ -823,6 +1388,29 @@ static int wait_candidate(process_t * parent, int pid, int options, process_t *
 	return 0;
 }
 
+/* Whether a queued child has anything to report for these options */
+static int wait_ready(process_t * child, int options) {
+	return child->finished || ((options & WSTOPPED) && child->suspended);
+}
+
+/* Whether anything could ever satisfy this wait */
+static int wait_has_children(process_t * parent, int pid, int options) {
+	if (pid > 0) {
+		process_t * child = process_from_pid(pid);
+		return child && child->tree_entry && child->tree_entry->parent == parent->tree_entry &&
+			wait_candidate(parent, pid, options, child);
+	}
+	if (pid == -1 && !(options & WNOKERN)) {
+		return parent->tree_entry->children->length > 0;
+	}
+	foreach(node, parent->tree_entry->children) {
+		if (!node->value) continue;
+		process_t * child = ((tree_node_t *)node->value)->value;
+		if (wait_candidate(parent, pid, options, child)) return 1;
+	}
+	return 0;
+}
+
 int waitpid(int pid, int * status, int options) {
 	process_t * proc = (process_t *)current_process;
 	if (proc->group) {
@@ -833,33 +1421,28 @@ int waitpid(int pid, int * status, int options) {
 
 	do {
 		process_t * candidate = NULL;
-		int has_children = 0;
 
-		/* First, find out if there is anyone to reap */
-		foreach(node, proc->tree_entry->children) {
-			if (!node->value) {
+		/* Children that exited or stopped, oldest first */
+		spin_lock(tree_lock);
+		node_t * next;
+		for (node_t * node = proc->wait_events->head; node; node = next) {
+			next = node->next;
+			process_t * child = node->value;
+			if (!child->finished && !child->suspended) {
+				/* Stopped and since continued; nothing to say any more */
+				list_delete(proc->wait_events, node);
 				continue;
 			}
-			process_t * child = ((tree_node_t *)node->value)->value;
-
-			if (wait_candidate(proc, pid, options, child)) {
-				has_children = 1;
-				if (child->finished) {
-					candidate = child;
-					break;
-				}
-				if ((options & WSTOPPED) && child->suspended) {
-					candidate = child;
-					break;
-				}
+			if (wait_candidate(proc, pid, options, child) && wait_ready(child, options)) {
+				candidate = child;
+				break;
 			}
 		}
 
-		if (!has_children) {
-			/* No valid children matching this description */
-			debug_print(INFO, "No children matching description.");
-			return -ECHILD;
+		if (candidate) {
+			list_delete(proc->wait_events, &candidate->wait_node);
 		}
+		spin_unlock(tree_lock);
 
 		if (candidate) {
 			debug_print(INFO, "Candidate found (%x:%d), bailing early.", candidate, candidate->id);
@@ -868,23 +1451,60 @@ int waitpid(int pid, int * status, int options) {
 			}
 			int pid = candidate->id;
 			if (candidate->finished) {
+				/* Its children were already added to it when it waited for them */
+				process_usage_add(&proc->child_usage, &candidate->usage);
+				process_usage_add(&proc->child_usage, &candidate->child_usage);
 				reap_process(candidate);
 			}
 			return pid;
-		} else {
-			if (options & WNOHANG) {
-				return 0;
-			}
-			debug_print(INFO, "Sleeping until queue is done.");
-			/* Wait */
-			if (sleep_on(proc->wait_queue) != 0) {
-				debug_print(INFO, "wait() was interrupted");
-				return -EINTR;
-			}
+		}
+
+		if (!wait_has_children(proc, pid, options)) {
+			/* No valid children matching this description */
+			debug_print(INFO, "No children matching description.");
+			return -ECHILD;
+		}
+
+		if (options & WNOHANG) {
+			return 0;
+		}
+		debug_print(INFO, "Sleeping until queue is done.");
+		/* Wait */
+		if (sleep_on(proc->wait_queue) != 0) {
+			debug_print(INFO, "wait() was interrupted");
+			return -EINTR;
 		}
 	} while (1);
 }
 
+/*
+ * Put a process waiting on nodes into the sleep queue as well, so that
+ * it is alerted (through its timeout sleeper) if nothing else happens.
+ */
+static void process_wait_timeout(process_t * process, int timeout) {
+	if (timeout > 0) {
+		debug_print(INFO, "fswait with a timeout of %d (pid=%d)", timeout, current_process->id);
+		unsigned long s, ss;
+		relative_time(0, timeout, &s, &ss);
+
+		sleeper_t * proc = malloc(sizeof(sleeper_t));
+		proc->process     = process;
+		proc->end_tick    = s;
+		proc->end_subtick = ss;
+		proc->is_fswait = 1;
+		list_insert(((process_t *)process)->node_waits, proc);
+
+		IRQ_OFF;
+		spin_lock(sleep_lock);
+		sleep_heap_push(proc);
+		process->timeout_sleeper = proc;
+		spin_unlock(sleep_lock);
+		IRQ_RES;
+	} else {
+		process->timeout_sleeper = NULL;
+	}
+}
+
 int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 	assert(!process->node_waits && "Tried to wait on nodes while already waiting on nodes.");
 
@@ -921,39 +1541,49 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 		} while (*n);
 	}
 
-	if (timeout > 0) {
-		debug_print(INFO, "fswait with a timeout of %d (pid=%d)", timeout, current_process->id);
-		unsigned long s, ss;
-		relative_time(0, timeout, &s, &ss);
+	process_wait_timeout(process, timeout);
 
-		IRQ_OFF;
-		spin_lock(sleep_lock);
-		node_t * before = NULL;
-		foreach(node, sleep_queue) {
-			sleeper_t * candidate = ((sleeper_t *)node->value);
-			if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-				break;
-			}
-			before = node;
+	process->awoken_index = -1;
+	/* Wait. */
+	switch_task(0);
+
+	return process->awoken_index;
+}
+
+/*
+ * Sleep until one of `nodes` may have one of its `events`, or until
+ * `timeout` milliseconds pass. The caller re-checks every node
+ * afterwards, so this only reports whether we timed out: it returns
+ * 1 on a node alert, 0 on timeout, and -1 if woken for another reason.
+ */
+int process_wait_poll(process_t * process, fs_node_t * nodes[], int events[], int count, int timeout) {
+	assert(!process->node_waits && "Tried to wait on nodes while already waiting on nodes.");
+
+	process->node_waits = list_create();
+	for (int i = 0; i < count; ++i) {
+		if (pollwait_fs(nodes[i], process, events[i]) < 0) {
+			debug_print(NOTICE, "Bad pollwait? 0x%x", nodes[i]);
 		}
-		sleeper_t * proc = malloc(sizeof(sleeper_t));
-		proc->process     = process;
-		proc->end_tick    = s;
-		proc->end_subtick = ss;
-		proc->is_fswait = 1;
-		list_insert(((process_t *)process)->node_waits, proc);
-		process->timeout_node = list_insert_after(sleep_queue, before, proc);
-		spin_unlock(sleep_lock);
-		IRQ_RES;
-	} else {
-		process->timeout_node = NULL;
 	}
 
+	/* Whatever registered last tells us how many entries belong to nodes */
+	int node_entries = process->node_waits->length;
+	process_wait_timeout(process, timeout);
+
 	process->awoken_index = -1;
-	/* Wait. */
 	switch_task(0);
 
-	return process->awoken_index;
+	if (process->awoken_index < 0) {
+		/* Signalled; nobody cleaned up after us */
+		if (process->node_waits) {
+			list_free(process->node_waits);
+			free(process->node_waits);
+			process->node_waits = NULL;
+		}
+		return -1;
+	}
+
+	return process->awoken_index < node_entries;
 }
 
 int process_awaken_from_fswait(process_t * process, int index) {
@@ -961,15 +1591,17 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	list_free(process->node_waits);
 	free(process->node_waits);
 	process->node_waits = NULL;
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
+	sleeper_t * proc = process->timeout_sleeper;
+	if (proc && proc->index >= 0) {
+		/* Woken by a node; wakeup_sleepers() frees the ones that time out */
+		uint32_t flags = int_save();
+		spin_lock(sleep_lock);
+		sleep_heap_remove(proc);
+		spin_unlock(sleep_lock);
+		int_restore(flags);
+		free(proc);
 	}
-	process->timeout_node = NULL;
+	process->timeout_sleeper = NULL;
 	make_process_ready(process);
 	return 0;
 }
@@ -14,6 +14,8 @@ void enter_signal_handler(uintptr_t location, int signum, uintptr_t stack) {
 	IRQ_OFF;
 	uintptr_t ebp = current_process->syscall_registers->ebp;
 	uintptr_t esp = current_process->syscall_registers->useresp;
+	/* Nothing shared is touched from here on */
+	kernel_unlock();
 	asm volatile(
 			"mov %2, %%esp\n"
 			"pushl %4\n"
@@ -81,6 +83,8 @@ char isdeadly[] = {
 	0, /* SIGHATE    */
 	0, /* SIGWINEVENT*/
 	0, /* SIGCAT     */
+	3, /* SIGTTOU    */
+	0, /* SIGLOWMEM  */
 };
 
 void handle_signal(process_t * proc, signal_t * sig) {
@@ -107,6 +111,7 @@ void handle_signal(process_t * proc, signal_t * sig) {
 			debug_print(WARNING, "suspending pid %d", proc->id);
 			current_process->suspended = 1;
 			current_process->status = 0x7F;
+			process_queue_wait_event((process_t *)current_process);
 
 			process_t * parent = process_get_parent((process_t *)current_process);
 
@@ -275,21 +280,21 @@ int group_send_signal(int group, uint32_t signal, int force_root) {
 
 	debug_print(WARNING, "killing group %d", group);
 
-	foreach(node, process_list) {
-		process_t * proc = node->value;
-		debug_print(WARNING, "examining %d %d %d", proc->id, proc->job, proc->group);
-		if (proc->group == proc->id && proc->job == group) {
-			/* Only thread group leaders */
-			debug_print(WARNING, "killing %d", proc->group);
-			if (proc->group == current_process->group) {
-				kill_self = 1;
-			} else {
-				if (send_signal(proc->group, signal, force_root) == 0) {
-					killed_something = 1;
-				}
+	/* Only thread group leaders */
+	int count;
+	pid_t * leaders = process_job_leaders(group, &count);
+
+	for (int i = 0; i < count; ++i) {
+		debug_print(WARNING, "killing %d", leaders[i]);
+		if (leaders[i] == current_process->group) {
+			kill_self = 1;
+		} else {
+			if (send_signal(leaders[i], signal, force_root) == 0) {
+				killed_something = 1;
 			}
 		}
 	}
+	free(leaders);
 
 	if (kill_self) {
 		if (send_signal(current_process->group, signal, force_root) == 0) {
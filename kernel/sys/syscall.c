@@ -14,12 +14,21 @@
 #include <kernel/pipe.h>
 #include <kernel/version.h>
 #include <kernel/shm.h>
+#include <kernel/mmap.h>
+#include <kernel/futex.h>
 #include <kernel/printf.h>
 #include <kernel/module.h>
 #include <kernel/args.h>
+#include <kernel/ktrace.h>
+#include <kernel/zswap.h>
 
 #include <sys/utsname.h>
+#include <sys/ioring.h>
+#include <sys/resource.h>
+#include <sys/tls.h>
+#include <spawn.h>
 #include <syscall_nums.h>
+#include <sched.h>
 
 static char   hostname[256];
 static size_t hostname_len = 0;
@@ -27,13 +36,15 @@ static size_t hostname_len = 0;
 #define FD_INRANGE(FD) \
 	((FD) < (int)current_process->fds->length && (FD) >= 0)
 #define FD_ENTRY(FD) \
-	(current_process->fds->entries[(FD)])
+	(current_process->fds->entries[(FD)].node)
 #define FD_CHECK(FD) \
 	(FD_INRANGE(FD) && FD_ENTRY(FD))
 #define FD_OFFSET(FD) \
-	(current_process->fds->offsets[(FD)])
+	(current_process->fds->entries[(FD)].offset)
 #define FD_MODE(FD) \
-	(current_process->fds->modes[(FD)])
+	(current_process->fds->entries[(FD)].mode)
+#define FD_FLAGS(FD) \
+	(current_process->fds->entries[(FD)].flags)
 
 #define PTR_INRANGE(PTR) \
 	((uintptr_t)(PTR) > current_process->image.entry)
@@ -73,6 +84,7 @@ static int sys_read(int fd, char * ptr, int len) {
 		}
 		uint32_t out = read_fs(node, FD_OFFSET(fd), len, (uint8_t *)ptr);
 		FD_OFFSET(fd) += out;
+		if ((int)out > 0) current_process->usage.read_bytes += out;
 		return (int)out;
 	}
 	return -EBADF;
@@ -101,6 +113,17 @@ static int sys_readdir(int fd, int index, struct dirent * entry) {
 	return -EBADF;
 }
 
+static int sys_getdents(int fd, struct dirent * entries, int count) {
+	if (FD_CHECK(fd)) {
+		PTR_VALIDATE(entries);
+		if (count <= 0) return -EINVAL;
+		fs_node_t * node = FD_ENTRY(fd);
+		if (!(node->flags & FS_DIRECTORY)) return -ENOTDIR;
+		return getdents_fs(node, &FD_OFFSET(fd), entries, count);
+	}
+	return -EBADF;
+}
+
 static int sys_write(int fd, char * ptr, int len) {
 	if (FD_CHECK(fd)) {
 		PTR_VALIDATE(ptr);
@@ -111,6 +134,7 @@ static int sys_write(int fd, char * ptr, int len) {
 		}
 		uint32_t out = write_fs(node, FD_OFFSET(fd), len, (uint8_t *)ptr);
 		FD_OFFSET(fd) += out;
+		if ((int)out > 0) current_process->usage.write_bytes += out;
 		return out;
 	}
 	return -EBADF;
@@ -123,8 +147,7 @@ static int sys_waitpid(int pid, int * status, int options) {
 	return waitpid(pid, status, options);
 }
 
-static int sys_open(const char * file, int flags, int mode) {
-	PTR_VALIDATE(file);
+static int open_file(const char * file, int flags, int mode) {
 	debug_print(NOTICE, "open(%s) flags=0x%x; mode=0x%x", file, flags, mode);
 	fs_node_t * node = kopen((char *)file, flags);
 
@@ -194,6 +217,9 @@ static int sys_open(const char * file, int flags, int mode) {
 	}
 	int fd = process_append_fd((process_t *)current_process, node);
 	FD_MODE(fd) = access_bits;
+	if (flags & O_CLOEXEC) {
+		FD_FLAGS(fd) = FD_CLOEXEC;
+	}
 	if (flags & O_APPEND) {
 		FD_OFFSET(fd) = node->length;
 	} else {
@@ -203,6 +229,11 @@ static int sys_open(const char * file, int flags, int mode) {
 	return fd;
 }
 
+static int sys_open(const char * file, int flags, int mode) {
+	PTR_VALIDATE(file);
+	return open_file(file, flags, mode);
+}
+
 static int sys_access(const char * file, int flags) {
 	PTR_VALIDATE(file);
 	debug_print(INFO, "access(%s, 0x%x) from pid=%d", file, flags, getpid());
@@ -214,8 +245,7 @@ static int sys_access(const char * file, int flags) {
 
 static int sys_close(int fd) {
 	if (FD_CHECK(fd)) {
-		close_fs(FD_ENTRY(fd));
-		FD_ENTRY(fd) = NULL;
+		process_close_fd((process_t *)current_process, fd);
 		return 0;
 	}
 	return -EBADF;
@@ -228,15 +258,22 @@ static int sys_sbrk(int size) {
 	}
 	spin_lock(proc->image.lock);
 	uintptr_t ret = proc->image.heap;
-	uintptr_t i_ret = ret;
 	ret = (ret + 0xfff) & ~0xfff; /* Rounds ret to 0x1000 in O(1) */
-	proc->image.heap += (ret - i_ret) + size;
-	while (proc->image.heap > proc->image.heap_actual) {
-		proc->image.heap_actual += 0x1000;
-		assert(proc->image.heap_actual % 0x1000 == 0);
-		alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
-		invalidate_tables_at(proc->image.heap_actual);
+	uintptr_t heap = ret + size;
+	uintptr_t actual = proc->image.heap_actual;
+	if (heap > actual) {
+		actual += (heap - actual + 0xFFF) & ~0xFFF;
+	}
+	/* Nothing else may be mapped where the heap grows to */
+	if ((size > 0 && heap < ret) || actual > MMAP_TOP ||
+		(actual > proc->image.heap_actual && mmap_overlaps(proc, proc->image.heap_actual, actual))) {
+		spin_unlock(proc->image.lock);
+		return -ENOMEM;
 	}
+	proc->image.heap = heap;
+	/* Only reserve the pages; page_fault() fills them in on first touch */
+	proc->image.heap_actual = actual;
+	assert(proc->image.heap_actual % 0x1000 == 0);
 	spin_unlock(proc->image.lock);
 	return ret;
 }
@@ -256,6 +293,36 @@ static int sys_gettid(void) {
 	return getpid();
 }
 
+/*
+ * Copy a NULL-terminated array of strings out of user memory.
+ * A NULL array comes back empty.
+ */
+static char ** copy_strings(char * const * strings, int * count) {
+	int c = 0;
+	if (strings) {
+		while (strings[c]) {
+			PTR_VALIDATE(strings[c]);
+			++c;
+		}
+	}
+
+	char ** out = malloc(sizeof(char *) * (c + 1));
+	for (int j = 0; j < c; ++j) {
+		out[j] = strdup(strings[j]);
+	}
+	out[c] = NULL;
+
+	if (count) *count = c;
+	return out;
+}
+
+static void free_strings(char ** strings) {
+	for (char ** s = strings; *s; ++s) {
+		free(*s);
+	}
+	free(strings);
+}
+
 static int sys_execve(const char * filename, char *const argv[], char *const envp[]) {
 	PTR_VALIDATE(argv);
 	PTR_VALIDATE(filename);
@@ -269,41 +336,13 @@ static int sys_execve(const char * filename, char *const argv[], char *const env
 		debug_print(WARNING, "         )");
 	}
 
-	int argc = 0;
-	int envc = 0;
-	while (argv[argc]) {
-		PTR_VALIDATE(argv[argc]);
-		++argc;
-	}
+	int argc;
+	char ** argv_ = copy_strings(argv, &argc);
+	char ** envp_ = copy_strings(envp, NULL);
 
-	if (envp) {
-		while (envp[envc]) {
-			PTR_VALIDATE(envp[envc]);
-			++envc;
-		}
-	}
-
-	debug_print(INFO, "Allocating space for arguments...");
-	char ** argv_ = malloc(sizeof(char *) * (argc + 1));
-	for (int j = 0; j < argc; ++j) {
-		argv_[j] = malloc((strlen(argv[j]) + 1) * sizeof(char));
-		memcpy(argv_[j], argv[j], strlen(argv[j]) + 1);
-	}
-	argv_[argc] = 0;
-	char ** envp_;
-	if (envp && envc) {
-		envp_ = malloc(sizeof(char *) * (envc + 1));
-		for (int j = 0; j < envc; ++j) {
-			envp_[j] = malloc((strlen(envp[j]) + 1) * sizeof(char));
-			memcpy(envp_[j], envp[j], strlen(envp[j]) + 1);
-		}
-		envp_[envc] = 0;
-	} else {
-		envp_ = malloc(sizeof(char *));
-		envp_[0] = NULL;
-	}
 	debug_print(INFO,"Releasing all shmem regions...");
 	shm_release_all((process_t *)current_process);
+	mmap_release_all((process_t *)current_process);
 
 	current_process->cmdline = argv_;
 
@@ -605,7 +644,7 @@ static int sys_sysfunc(int fn, char ** args) {
 			case 4:
 				/* Request kernel output to file descriptor in arg0*/
 				debug_print(NOTICE, "Setting output to file object in process %d's fd=%d!", getpid(), (int)args);
-				debug_file = current_process->fds->entries[(int)args];
+				debug_file = FD_ENTRY((int)args);
 				return 0;
 			case 5:
 				{
@@ -692,14 +731,7 @@ static int sys_sysfunc(int fn, char ** args) {
 				}
 				proc->image.heap = (uintptr_t)address;
 				proc->image.heap_actual = proc->image.heap & 0xFFFFF000;
-				assert(proc->image.heap_actual % 0x1000 == 0);
-				alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
-				invalidate_tables_at(proc->image.heap_actual);
-				while (proc->image.heap > proc->image.heap_actual) {
-					proc->image.heap_actual += 0x1000;
-					alloc_frame(get_page(proc->image.heap_actual, 1, current_directory), 0, 1);
-					invalidate_tables_at(proc->image.heap_actual);
-				}
+				proc->image.heap_start  = proc->image.heap_actual;
 				spin_unlock(proc->image.lock);
 				return 0;
 			}
@@ -725,6 +757,8 @@ static int sys_sysfunc(int fn, char ** args) {
 
 				spin_lock(proc->image.lock);
 				for (size_t x = 0; x < size; x += 0x1000) {
+					/* A compressed page has to come back before it can be kept */
+					zswap_fault(address + x);
 					alloc_frame(get_page(address + x, 1, current_directory), 0, 1);
 					invalidate_tables_at(address + x);
 				}
@@ -807,7 +841,7 @@ static int sys_sleepabs(unsigned long seconds, unsigned long subseconds) {
 
 static int sys_sleep(unsigned long seconds, unsigned long subseconds) {
 	unsigned long s, ss;
-	relative_time(seconds, subseconds * 10, &s, &ss);
+	relative_time_us(seconds, subseconds, &s, &ss);
 	return sys_sleepabs(s, ss);
 }
 
@@ -825,10 +859,23 @@ static int sys_fork(void) {
 	return (int)fork();
 }
 
-static int sys_clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
+static int sys_clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg, uintptr_t tls) {
 	if (!new_stack || !PTR_INRANGE(new_stack)) return -EINVAL;
 	if (!thread_func || !PTR_INRANGE(thread_func)) return -EINVAL;
-	return (int)clone(new_stack, thread_func, arg);
+	if (tls && !PTR_INRANGE(tls)) return -EINVAL;
+	return (int)clone(new_stack, thread_func, arg, tls);
+}
+
+/*
+ * Point this thread's TLS segment at base. %gs is loaded with the
+ * selector on the way back out, so it's usable straight away.
+ */
+static int sys_settls(uintptr_t base) {
+	if (!base || !PTR_INRANGE(base)) return -EINVAL;
+	current_process->thread.tls_base = base;
+	gdt_set_tls(base);
+	current_process->syscall_registers->gs = TLS_SELECTOR;
+	return TLS_SELECTOR;
 }
 
 static int sys_shm_obtain(char * path, size_t * size) {
@@ -950,6 +997,94 @@ static int sys_lstat(char * file, uintptr_t st) {
 	return result;
 }
 
+/*
+ * Stat a name in a directory that's already open. Anything the
+ * directory can't answer for itself (see kfind_at) is -EXDEV, so
+ * is following a symlink, since we don't know where we are.
+ */
+static int sys_fstatat(int fd, char * name, uintptr_t st, int flags) {
+	PTR_VALIDATE(name);
+	PTR_VALIDATE(st);
+	if (!FD_CHECK(fd)) return -EBADF;
+	fs_node_t * dir = FD_ENTRY(fd);
+	if (!(dir->flags & FS_DIRECTORY)) return -ENOTDIR;
+	if (!strcmp(name, PATH_DOT)) return stat_node(dir, st);
+
+	fs_node_t * fn;
+	int result = kfind_at(dir, name, &fn);
+	if (result) return result;
+	if ((fn->flags & FS_SYMLINK) && !(flags & AT_SYMLINK_NOFOLLOW)) {
+		free(fn);
+		return -EXDEV;
+	}
+	result = stat_node(fn, st);
+	free(fn);
+	return result;
+}
+
+struct _usage_sum {
+	pid_t tgid;
+	process_usage_t * total;
+};
+
+static void usage_sum_thread(process_t * proc, process_t * parent, void * data) {
+	struct _usage_sum * sum = data;
+	if ((proc->group ? proc->group : proc->id) == sum->tgid) {
+		process_usage_add(sum->total, &proc->usage);
+	}
+}
+
+static void usage_timeval(struct timeval * out, uint64_t cycles) {
+	uint64_t us = timer_cycles_to_us(cycles);
+	out->tv_sec  = us / 1000000;
+	out->tv_usec = us % 1000000;
+}
+
+/* A descriptor that becomes ready when the process exits */
+static int sys_pidfd_open(pid_t pid) {
+	if (pid <= 0) return -EINVAL;
+	process_t * proc = process_from_pid(pid);
+	if (!proc) return -ESRCH;
+
+	fs_node_t * node = make_pidfd(proc);
+	open_fs(node, 0);
+	int fd = process_append_fd((process_t *)current_process, node);
+	FD_MODE(fd) = 01;
+	return fd;
+}
+
+static int sys_getrusage(int who, struct rusage * usage) {
+	PTR_VALIDATE(usage);
+	process_t * proc = (process_t *)current_process;
+	pid_t tgid = proc->group ? proc->group : proc->id;
+
+	/* Include this call so far */
+	process_charge(proc, timer_cycles(), 0);
+
+	process_usage_t total;
+	memset(&total, 0, sizeof(total));
+	if (who == RUSAGE_THREAD) {
+		total = proc->usage;
+	} else if (who == RUSAGE_SELF) {
+		struct _usage_sum sum = { tgid, &total };
+		process_foreach(usage_sum_thread, &sum);
+	} else if (who == RUSAGE_CHILDREN) {
+		process_t * leader = process_from_pid(tgid);
+		if (leader) total = leader->child_usage;
+	} else {
+		return -EINVAL;
+	}
+
+	memset(usage, 0, sizeof(struct rusage));
+	usage_timeval(&usage->ru_utime, total.utime);
+	usage_timeval(&usage->ru_stime, total.stime);
+	usage->ru_minflt = total.minflt;
+	usage->ru_majflt = total.majflt;
+	usage->ru_nvcsw  = total.nvcsw;
+	usage->ru_nivcsw = total.nivcsw;
+	return 0;
+}
+
 static int sys_fswait(int c, int fds[]) {
 	PTR_VALIDATE(fds);
 	for (int i = 0; i < c; ++i) {
@@ -987,7 +1122,7 @@ static int sys_setsid(void) {
 		return -EPERM;
 	}
 	current_process->session = current_process->group;
-	current_process->job = current_process->group;
+	process_set_job((process_t *)current_process, current_process->group);
 	return current_process->session;
 }
 
@@ -1015,7 +1150,7 @@ static int sys_setpgid(pid_t pid, pid_t pgid) {
 	}
 
 	if (pgid == 0) {
-		proc->job = proc->group;
+		process_set_job(proc, proc->group);
 	} else {
 		process_t * pgroup = process_from_pid(pgid);
 
@@ -1029,7 +1164,7 @@ static int sys_setpgid(pid_t pid, pid_t pgid) {
 			return -EPERM;
 		}
 
-		proc->job = pgid;
+		process_set_job(proc, pgid);
 	}
 	return 0;
 }
@@ -1049,6 +1184,405 @@ static int sys_getpgid(pid_t pid) {
 	return proc->job;
 }
 
+static int sys_setscheduler(pid_t pid, int policy, struct sched_param * param) {
+	if (param) {
+		PTR_VALIDATE(param);
+	}
+
+	int sched_class;
+	switch (policy) {
+		case SCHED_OTHER: sched_class = SCHED_CLASS_INTERACTIVE; break;
+		case SCHED_FIFO:
+		case SCHED_RR:    sched_class = SCHED_CLASS_REALTIME; break;
+		case SCHED_BATCH: sched_class = SCHED_CLASS_BATCH; break;
+		default:
+			return -EINVAL;
+	}
+
+	process_t * proc;
+	if (pid == 0) {
+		proc = (process_t*)current_process;
+	} else {
+		proc = process_from_pid(pid);
+	}
+	if (!proc) {
+		return -ESRCH;
+	}
+	if (current_process->user != USER_ROOT_UID) {
+		if (proc->user != current_process->user) {
+			return -EPERM;
+		}
+		if (sched_class == SCHED_CLASS_REALTIME) {
+			return -EPERM;
+		}
+	}
+
+	/* Takes effect the next time the process is queued */
+	proc->sched_class = sched_class;
+	proc->sched_penalty = 0;
+	return 0;
+}
+
+static int sys_getscheduler(pid_t pid) {
+	process_t * proc;
+	if (pid == 0) {
+		proc = (process_t*)current_process;
+	} else {
+		proc = process_from_pid(pid);
+	}
+
+	if (!proc) {
+		return -ESRCH;
+	}
+
+	switch (proc->sched_class) {
+		case SCHED_CLASS_REALTIME: return SCHED_FIFO;
+		case SCHED_CLASS_BATCH:    return SCHED_BATCH;
+		default:                   return SCHED_OTHER;
+	}
+}
+
+static int sys_mmap(struct mmap_args * args) {
+	PTR_VALIDATE(args);
+
+	fs_node_t * node = NULL;
+	if (!(args->flags & MAP_ANONYMOUS)) {
+		if (!FD_CHECK(args->fd)) {
+			return -EBADF;
+		}
+		node = FD_ENTRY(args->fd);
+		if (!(node->flags & FS_FILE)) {
+			return -ENODEV;
+		}
+		if (!(FD_MODE(args->fd) & 01)) {
+			return -EACCES;
+		}
+	}
+
+	return (int)mmap_map((uintptr_t)args->addr, args->length, args->prot, args->flags, node, args->offset);
+}
+
+static int sys_munmap(void * addr, size_t length) {
+	return mmap_unmap((uintptr_t)addr, length);
+}
+
+static int sys_mprotect(void * addr, size_t length, int prot) {
+	return mmap_protect((uintptr_t)addr, length, prot);
+}
+
+static int sys_futex(uint32_t * addr, int op, uint32_t val) {
+	PTR_VALIDATE(addr);
+	if (!addr || ((uintptr_t)addr & 3)) {
+		return -EINVAL;
+	}
+
+	switch (op) {
+		case FUTEX_WAIT:
+			return futex_wait(addr, val);
+		case FUTEX_WAKE:
+			return futex_wake(addr, val);
+		default:
+			return -EINVAL;
+	}
+}
+
+#define POLL_MAX_FDS 1024
+
+/*
+ * Fill in revents for every entry; returns how many have something to report.
+ */
+static int poll_scan(struct pollfd * fds, unsigned int nfds, fs_node_t ** nodes, int * events) {
+	int ready = 0;
+	for (unsigned int i = 0; i < nfds; ++i) {
+		nodes[i] = NULL;
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) continue;
+		if (!FD_CHECK(fds[i].fd)) {
+			fds[i].revents = POLLNVAL;
+			ready++;
+			continue;
+		}
+		nodes[i] = FD_ENTRY(fds[i].fd);
+		events[i] = fds[i].events;
+		fds[i].revents = pollcheck_fs(nodes[i], fds[i].events);
+		if (fds[i].revents) ready++;
+	}
+	return ready;
+}
+
+static int sys_poll(struct pollfd * fds, unsigned int nfds, int timeout) {
+	if (nfds) PTR_VALIDATE(fds);
+	if (nfds > POLL_MAX_FDS) return -EINVAL;
+
+	fs_node_t ** nodes = malloc(sizeof(fs_node_t *) * (nfds + 1));
+	int * events = malloc(sizeof(int) * (nfds + 1));
+
+	unsigned long end_s = 0, end_ss = 0;
+	if (timeout > 0) {
+		relative_time(0, timeout, &end_s, &end_ss);
+	}
+
+	int result;
+	while (1) {
+		result = poll_scan(fds, nfds, nodes, events);
+		if (result || timeout == 0) break;
+
+		/* Only wait on the nodes we actually have */
+		int count = 0;
+		for (unsigned int i = 0; i < nfds; ++i) {
+			if (nodes[i]) {
+				nodes[count] = nodes[i];
+				events[count] = events[i];
+				count++;
+			}
+		}
+
+		int remaining = -1;
+		if (timeout > 0) {
+			unsigned long now_s, now_ss;
+			timer_now(&now_s, &now_ss);
+			if (now_s > end_s || (now_s == end_s && now_ss >= end_ss)) {
+				break;
+			}
+			remaining = (end_s - now_s) * 1000 + ((long)end_ss - (long)now_ss) / 1000;
+			if (remaining < 1) remaining = 1;
+		}
+
+		int woken = process_wait_poll((process_t *)current_process, nodes, events, count, remaining);
+		if (woken < 0) {
+			result = -EINTR;
+			break;
+		}
+		if (woken == 0) {
+			/* Timed out; report whatever became ready in the meantime */
+			result = poll_scan(fds, nfds, nodes, events);
+			break;
+		}
+	}
+
+	free(events);
+	free(nodes);
+	return result;
+}
+
+static int sys_sendfile(int out_fd, int in_fd, long * offset, int count) {
+	if (!FD_CHECK(out_fd) || !FD_CHECK(in_fd)) return -EBADF;
+	if (offset) PTR_VALIDATE(offset);
+	if (count < 0) return -EINVAL;
+	if (!(FD_MODE(in_fd) & 01) || !(FD_MODE(out_fd) & 02)) return -EBADF;
+
+	uint64_t in_offset = offset ? (uint64_t)*offset : FD_OFFSET(in_fd);
+	uint64_t out_offset = FD_OFFSET(out_fd);
+
+	int ret = splice_fs(FD_ENTRY(in_fd), &in_offset, FD_ENTRY(out_fd), &out_offset, count);
+
+	/* With an explicit offset, the input descriptor's own offset stays put */
+	if (offset) {
+		*offset = in_offset;
+	} else {
+		FD_OFFSET(in_fd) = in_offset;
+	}
+	FD_OFFSET(out_fd) = out_offset;
+
+	return ret;
+}
+
+static int sys_ioring_setup(struct ioring * ring) {
+	PTR_VALIDATE(ring);
+	if (!ring) return -EFAULT;
+	PTR_VALIDATE(ring->sqes);
+	PTR_VALIDATE(ring->cqes);
+	if (!ring->sqes || !ring->cqes) return -EFAULT;
+
+	fs_node_t * node = ioring_create(ring);
+	if (!node) return -EINVAL;
+	open_fs(node, 0);
+	int fd = process_append_fd((process_t *)current_process, node);
+	FD_MODE(fd) = 03;
+	return fd;
+}
+
+static int sys_ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	return ioring_enter(FD_ENTRY(fd), to_submit, min_complete);
+}
+
+/*
+ * posix_spawn(): the calling process sleeps while the child applies the
+ * file actions and finds the program, so that failures there can be
+ * returned directly; the child then execs on its own.
+ */
+struct spawn_state {
+	char * path;
+	int argc;
+	char ** argv;
+	char ** envp;
+	int flags;
+	pid_t pgroup;
+	int count;
+	struct __spawn_action * actions;
+
+	volatile int done;
+	int error;
+	list_t * queue;
+};
+
+static int spawn_action(struct __spawn_action * action) {
+	switch (action->type) {
+		case __SPAWN_CLOSE:
+			return sys_close(action->fd);
+		case __SPAWN_DUP2:
+			if (!FD_CHECK(action->src) || action->fd < 0) return -EBADF;
+			if ((int)process_move_fd((process_t *)current_process, action->src, action->fd) < 0) return -EBADF;
+			return 0;
+		case __SPAWN_OPEN: {
+			if (!action->path) return -EFAULT;
+			int fd = open_file(action->path, action->flags, action->mode);
+			if (fd < 0) return fd;
+			if (fd != action->fd) {
+				int moved = process_move_fd((process_t *)current_process, fd, action->fd);
+				process_close_fd((process_t *)current_process, fd);
+				if (moved < 0) return -EBADF;
+			}
+			return 0;
+		}
+		default:
+			return -EINVAL;
+	}
+}
+
+static void spawn_entry(void * arg) {
+	struct spawn_state * state = arg;
+	int error = 0;
+
+	if (state->flags & POSIX_SPAWN_SETPGROUP) {
+		error = sys_setpgid(0, state->pgroup);
+	}
+
+	for (int i = 0; !error && i < state->count; ++i) {
+		error = spawn_action(&state->actions[i]);
+	}
+
+	if (!error) {
+		fs_node_t * file = kopen(state->path, 0);
+		if (!file) {
+			error = -ENOENT;
+		} else {
+			if (!has_permission(file, 01)) {
+				error = -EACCES;
+			}
+			close_fs(file);
+		}
+	}
+
+	/* The caller's state is gone once it wakes up */
+	char * path = state->path;
+	int argc = state->argc;
+	char ** argv = state->argv;
+	char ** envp = state->envp;
+
+	/* With interrupts off, as the caller checks `done` and goes to sleep */
+	uint32_t flags = int_save();
+	state->error = error;
+	state->done = 1;
+	wakeup_queue(state->queue);
+	int_restore(flags);
+
+	if (error) {
+		/* Nobody is going to wait for us */
+		process_disown((process_t *)current_process);
+		free(path);
+		free_strings(argv);
+		free_strings(envp);
+		kexit(127 << 8);
+	}
+
+	char ** cmdline = current_process->cmdline;
+	current_process->cmdline = argv;
+	exec(path, argc, argv, envp, 0);
+
+	/* Found, but not something we know how to run */
+	current_process->cmdline = cmdline;
+	free(path);
+	free_strings(argv);
+	free_strings(envp);
+	kexit(127 << 8);
+}
+
+static int sys_spawn(const char * path, char * const argv[], char * const envp[],
+		const posix_spawn_file_actions_t * file_actions, const posix_spawnattr_t * attrp) {
+	PTR_VALIDATE(path);
+	PTR_VALIDATE(argv);
+	PTR_VALIDATE(envp);
+	PTR_VALIDATE(file_actions);
+	PTR_VALIDATE(attrp);
+	if (!path || !argv) return -EFAULT;
+
+	struct spawn_state state;
+	memset(&state, 0, sizeof(state));
+	state.path = strdup(path);
+	state.argv = copy_strings(argv, &state.argc);
+	state.envp = copy_strings(envp, NULL);
+
+	if (attrp) {
+		state.flags  = attrp->flags;
+		state.pgroup = attrp->pgroup;
+	}
+
+	if (file_actions && file_actions->count > 0) {
+		PTR_VALIDATE(file_actions->actions);
+		state.count = file_actions->count;
+		state.actions = malloc(sizeof(struct __spawn_action) * state.count);
+		memcpy(state.actions, file_actions->actions, sizeof(struct __spawn_action) * state.count);
+		for (int i = 0; i < state.count; ++i) {
+			if (state.actions[i].type == __SPAWN_OPEN && state.actions[i].path) {
+				PTR_VALIDATE(state.actions[i].path);
+				state.actions[i].path = strdup(state.actions[i].path);
+			} else {
+				state.actions[i].path = NULL;
+			}
+		}
+	}
+
+	state.queue = list_create();
+
+	/*
+	 * Interrupts stay off from checking `done` until we are on the
+	 * queue, or the child could set it and wake nobody in between.
+	 */
+	int pid = spawn(spawn_entry, &state);
+	uint32_t flags = int_save();
+	while (!state.done) {
+		sleep_on(state.queue);
+		/* Whoever ran meanwhile may have turned interrupts on */
+		(void)int_save();
+	}
+	int_restore(flags);
+
+	for (int i = 0; i < state.count; ++i) {
+		free(state.actions[i].path);
+	}
+	free(state.actions);
+	list_free(state.queue);
+	free(state.queue);
+
+	return state.error ? state.error : pid;
+}
+
+/*
+ * Random bytes from the kernel generator, without a trip through
+ * /dev/urandom. It's always seeded, so there's nothing to wait for and
+ * no flags are defined yet.
+ */
+static int sys_getrandom(void * buffer, size_t length, unsigned int flags) {
+	PTR_VALIDATE(buffer);
+	if (!buffer && length) return -EFAULT;
+	if (flags) return -EINVAL;
+	if (length > 0x7FFFFFFF) length = 0x7FFFFFFF;
+	random_get_bytes(buffer, length);
+	return length;
+}
+
 /*
  * System Call Internals
  */
@@ -1108,14 +1642,41 @@ static int (*syscalls[])() = {
 	[SYS_SETSID]       = sys_setsid,
 	[SYS_SETPGID]      = sys_setpgid,
 	[SYS_GETPGID]      = sys_getpgid,
+	[SYS_SETSCHEDULER] = sys_setscheduler,
+	[SYS_GETSCHEDULER] = sys_getscheduler,
+	[SYS_MMAP]         = sys_mmap,
+	[SYS_MUNMAP]       = sys_munmap,
+	[SYS_MPROTECT]     = sys_mprotect,
+	[SYS_FUTEX]        = sys_futex,
+	[SYS_POLL]         = sys_poll,
+	[SYS_SENDFILE]     = sys_sendfile,
+	[SYS_GETDENTS]     = sys_getdents,
+	[SYS_IORING_SETUP] = sys_ioring_setup,
+	[SYS_IORING_ENTER] = sys_ioring_enter,
+	[SYS_SPAWN]        = sys_spawn,
+	[SYS_GETRANDOM]    = sys_getrandom,
+	[SYS_FSTATAT]      = sys_fstatat,
+	[SYS_GETRUSAGE]    = sys_getrusage,
+	[SYS_SETTLS]       = sys_settls,
+	[SYS_PIDFD_OPEN]   = sys_pidfd_open,
 };
 
 uint32_t num_syscalls = sizeof(syscalls) / sizeof(*syscalls);
 
+syscall_stat_t syscall_stats[sizeof(syscalls) / sizeof(*syscalls)];
+
+int sysenter_enabled = 0;
+
 typedef uint32_t (*scall_func)(unsigned int, ...);
 
 pid_t trace_pid = 0;
 
+static inline uint64_t syscall_clock(void) {
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 void syscall_handler(struct regs * r) {
 	if (r->eax >= num_syscalls) {
 		return;
@@ -1133,18 +1694,80 @@ void syscall_handler(struct regs * r) {
 		debug_print(WARNING, "[syscall trace] %d (0x%x) 0x%x 0x%x 0x%x 0x%x 0x%x", r->eax, location, r->ebx, r->ecx, r->edx, r->esi, r->edi);
 	}
 
+	KTRACE(KTRACE_SYSCALL, r->eax, r->ebx, r->ecx);
+
+	syscall_stat_t * stat = &syscall_stats[r->eax];
+	stat->calls++;
+	uint64_t start = syscall_clock();
+	process_charge((process_t *)current_process, start, 1);
+
 	/* Call the syscall function */
 	scall_func func = (scall_func)location;
 	uint32_t ret = func(r->ebx, r->ecx, r->edx, r->esi, r->edi);
 
+	uint64_t end = syscall_clock();
+	stat->cycles += end - start;
+	process_charge((process_t *)current_process, end, 0);
+
+	KTRACE(KTRACE_SYSRET, r->eax, ret, 0);
+
 	if ((current_process->syscall_registers == r) ||
 			(location != (uintptr_t)&fork && location != (uintptr_t)&clone)) {
 		r->eax = ret;
 	}
+
+	preempt_syscall_exit();
+}
+
+/*
+ * Called from sysenter_entry with the frame it built. The caller's
+ * stack pointer is in useresp and its return address sits on top of
+ * that stack.
+ */
+void sysenter_handler(struct regs * r) {
+	kernel_lock();
+	uintptr_t * ret = (uintptr_t *)r->useresp;
+	if (!PTR_INRANGE(ret)) {
+		debug_print(ERROR, "SEGFAULT: bad stack for sysenter (0x%x)", (uintptr_t)ret);
+		HALT_AND_CATCH_FIRE("Segmentation fault", NULL);
+	}
+	r->eip = *ret;
+	/* sysexit turns interrupts back on; fault_handler does this for int 0x7F */
+	if (latency_tracing) latency_irqs_off_at((uintptr_t)sysenter_handler);
+	syscall_handler(r);
+	if (latency_tracing) latency_irqs_on_at((uintptr_t)sysenter_handler);
+	/* Always from user mode, so always ours to let go of */
+	kernel_unlock();
+}
+
+/* Does this CPU really have sysenter? Early Pentium Pros claim it but don't. */
+static int sysenter_supported(void) {
+	uint32_t eax, ebx, ecx, edx;
+	__asm__ __volatile__ ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+	if (!(edx & (1 << 11))) return 0;
+	uint32_t family = (eax >> 8) & 0xF, model = (eax >> 4) & 0xF, stepping = eax & 0xF;
+	return !(family == 6 && model < 3 && stepping < 3);
 }
 
 void syscalls_install(void) {
 	debug_print(NOTICE, "Initializing syscall table with %d functions", num_syscalls);
 	isrs_install_handler(0x7F, &syscall_handler);
+
+	if (sysenter_supported()) {
+		sysenter_enabled = 1;
+		syscalls_install_cpu();
+		set_kernel_stack(current_process->image.stack);
+		debug_print(NOTICE, "Fast system calls enabled");
+	}
+}
+
+/*
+ * The sysenter MSRs are each processor's own; the stack one is set on
+ * every switch, by set_kernel_stack().
+ */
+void syscalls_install_cpu(void) {
+	if (!sysenter_enabled) return;
+	wrmsr(MSR_SYSENTER_CS, 0x08);
+	wrmsr(MSR_SYSENTER_EIP, (uintptr_t)&sysenter_entry);
 }
 
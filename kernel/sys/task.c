@@ -11,7 +11,11 @@
 #include <kernel/process.h>
 #include <kernel/logging.h>
 #include <kernel/shm.h>
+#include <kernel/mmap.h>
 #include <kernel/mem.h>
+#include <kernel/ktrace.h>
+
+#include <sys/tls.h>
 
 #define TASK_MAGIC 0xDEADBEEF
 
@@ -21,7 +25,6 @@ uint32_t next_pid = 0;
 							*((type *) stack) = item
 
 page_directory_t *kernel_directory;
-page_directory_t *current_directory;
 
 /*
  * Clone a page directory and its contents.
@@ -34,27 +37,27 @@ page_directory_t *
 clone_directory(
 		page_directory_t * src
 		) {
-	/* Allocate a new page directory */
-	uintptr_t phys;
-	page_directory_t * dir = (page_directory_t *)kvmalloc_p(sizeof(page_directory_t), &phys);
-	/* Clear it out */
-	memset(dir, 0, sizeof(page_directory_t));
+	/* Allocate a new page directory; its pages needn't be contiguous */
+	page_directory_t * dir = (page_directory_t *)kvmalloc(sizeof(page_directory_t));
 	dir->ref_count = 1;
 
 	/* And store it... */
-	dir->physical_address = phys;
+	paging_set_physical(dir);
 	uint32_t i;
-	for (i = 0; i < 1024; ++i) {
+	for (i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
+		/* Every entry is written here, so the directory isn't cleared first */
+		dir->tables[i] = NULL;
+		dir->physical_tables[i] = 0;
 		/* Copy each table */
 		if (!src->tables[i] || (uintptr_t)src->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
 		}
 		if (kernel_directory->tables[i] == src->tables[i]) {
-			/* Kernel tables are simply linked together */
+			/* Kernel tables are simply linked together; the entry comes from the kernel, which may map it large */
 			dir->tables[i] = src->tables[i];
-			dir->physical_tables[i] = src->physical_tables[i];
+			dir->physical_tables[i] = kernel_directory->physical_tables[i];
 		} else {
-			if (i * 0x1000 * 1024 < SHM_START) {
+			if (i * PAGE_TABLE_SPAN < SHM_START) {
 				/* User tables must be cloned */
 				uintptr_t phys;
 				dir->tables[i] = clone_table(src->tables[i], &phys);
@@ -73,13 +76,13 @@ void release_directory(page_directory_t * dir) {
 
 	if (dir->ref_count < 1) {
 		uint32_t i;
-		for (i = 0; i < 1024; ++i) {
+		for (i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
 			if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) {
 				continue;
 			}
 			if (kernel_directory->tables[i] != dir->tables[i]) {
-				if (i * 0x1000 * 1024 < SHM_START) {
-					for (uint32_t j = 0; j < 1024; ++j) {
+				if (i * PAGE_TABLE_SPAN < SHM_START) {
+					for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
 						if (dir->tables[i]->pages[j].frame) {
 							free_frame(&(dir->tables[i]->pages[j]));
 						}
@@ -95,13 +98,13 @@ void release_directory(page_directory_t * dir) {
 void release_directory_for_exec(page_directory_t * dir) {
 	uint32_t i;
 	/* This better be the only owner of this directory... */
-	for (i = 0; i < 1024; ++i) {
+	for (i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
 		if (!dir->tables[i] || (uintptr_t)dir->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
 		}
 		if (kernel_directory->tables[i] != dir->tables[i]) {
-			if (i * 0x1000 * 1024 < USER_STACK_BOTTOM) {
-				for (uint32_t j = 0; j < 1024; ++j) {
+			if (i * PAGE_TABLE_SPAN < USER_STACK_BOTTOM) {
+				for (uint32_t j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
 					if (dir->tables[i]->pages[j].frame) {
 						free_frame(&(dir->tables[i]->pages[j]));
 					}
@@ -119,6 +122,9 @@ extern char * default_name;
 /*
  * Clone a page table
  *
+ * Ordinary user pages are shared copy-on-write with the source
+ * table; anything that can not be shared is copied immediately.
+ *
  * @param src      Pointer to a page table to clone.
  * @param physAddr [out] Pointer to the physical address of the new page table
  * @return         A pointer to a new page table.
@@ -129,14 +135,17 @@ clone_table(
 		uintptr_t * physAddr
 		) {
 	/* Allocate a new page table */
-	page_table_t * table = (page_table_t *)kvmalloc_p(sizeof(page_table_t), physAddr);
-	memset(table, 0, sizeof(page_table_t));
+	page_table_t * table = (page_table_t *)zeroed_page(physAddr);
 	uint32_t i;
-	for (i = 0; i < 1024; ++i) {
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
 		/* For each frame in the table... */
 		if (!src->pages[i].frame) {
 			continue;
 		}
+		/* Share the frame with the parent until one of them writes to it */
+		if (share_frame(&src->pages[i], &table->pages[i])) {
+			continue;
+		}
 		/* Allocate a new frame */
 		alloc_frame(&table->pages[i], 0, 0);
 		/* Set the correct access bit */
@@ -146,7 +155,7 @@ clone_table(
 		if (src->pages[i].writethrough)	table->pages[i].writethrough = 1;
 		if (src->pages[i].cachedisable)	table->pages[i].cachedisable = 1;
 		/* Copy the contents of the page from the old table to the new one */
-		copy_page_physical(src->pages[i].frame * 0x1000, table->pages[i].frame * 0x1000);
+		copy_frame(src->pages[i].frame, table->pages[i].frame);
 	}
 	return table;
 }
@@ -197,6 +206,8 @@ uint32_t fork(void) {
 	/* Clone the current process' page directory */
 	page_directory_t * directory = clone_directory(current_directory);
 	assert(directory && "Could not allocate a new page directory!");
+	/* Our writable pages are now shared read-only with the child */
+	invalidate_page_tables();
 	/* Spawn a new process from this one */
 	debug_print(INFO,"\033[1;32mALLOC {\033[0m");
 	process_t * new_proc = spawn_process(current_process, 0);
@@ -204,6 +215,7 @@ uint32_t fork(void) {
 	assert(new_proc && "Could not allocate a new process!");
 	/* Set the new process' page directory to clone */
 	set_process_environment(new_proc, directory);
+	mmap_fork(parent, new_proc);
 
 	struct regs r;
 	memcpy(&r, current_process->syscall_registers, sizeof(struct regs));
@@ -232,7 +244,7 @@ uint32_t fork(void) {
 	return new_proc->id;
 }
 
-int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp) {
+static int spawn_tasklet(tasklet_t tasklet, char * name, void * argp, int user) {
 	IRQ_OFF;
 
 	uintptr_t esp, ebp;
@@ -241,13 +253,24 @@ int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp) {
 		current_process->syscall_registers->eax = 0;
 	}
 
-	page_directory_t * directory = kernel_directory;
+	page_directory_t * directory = user ? current_directory : kernel_directory;
 	/* Spawn a new process from this one */
 	process_t * new_proc = spawn_process(current_process, 0);
 	assert(new_proc && "Could not allocate a new process!");
 	/* Set the new process' page directory to the original process' */
 	set_process_environment(new_proc, directory);
 	directory->ref_count++;
+
+	if (user) {
+		/*
+		 * Don't keep the creator's files open behind its back, and
+		 * belong to init, so the creator never sees us exit.
+		 */
+		for (uint32_t i = 0; i < new_proc->fds->length; ++i) {
+			process_close_fd(new_proc, i);
+		}
+		process_disown(new_proc);
+	}
 	/* Read the instruction pointer */
 
 
@@ -284,13 +307,27 @@ int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp) {
 	return new_proc->id;
 }
 
+int create_kernel_tasklet(tasklet_t tasklet, char * name, void * argp) {
+	return spawn_tasklet(tasklet, name, argp, 0);
+}
+
+/*
+ * Like create_kernel_tasklet(), but the tasklet runs in the current
+ * process's address space, so it can reach that process's memory.
+ */
+int create_user_tasklet(tasklet_t tasklet, char * name, void * argp) {
+	return spawn_tasklet(tasklet, name, argp, 1);
+}
+
 
 /*
  * clone the current thread and create a new one in the same
  * memory space with the given pointer as its new stack.
+ * If tls is set, the new thread's %gs points there; otherwise
+ * it shares ours.
  */
 uint32_t
-clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
+clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg, uintptr_t tls) {
 	uintptr_t esp, ebp;
 
 	IRQ_OFF;
@@ -327,6 +364,11 @@ clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 	new_proc->syscall_registers->ebp = new_stack;
 	new_proc->syscall_registers->eip = thread_func;
 
+	if (tls) {
+		new_proc->thread.tls_base = tls;
+		new_proc->syscall_registers->gs = TLS_SELECTOR;
+	}
+
 	/* Push arg, bogus return address onto the new thread's stack */
 	PUSH(new_stack, uintptr_t, arg);
 	PUSH(new_stack, uintptr_t, THREAD_RETURN);
@@ -353,6 +395,62 @@ clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 	return new_proc->id;
 }
 
+/*
+ * A page directory with the kernel in it and no user memory at all.
+ */
+static page_directory_t * empty_directory(void) {
+	page_directory_t * dir = (page_directory_t *)kvmalloc(sizeof(page_directory_t));
+	memset(dir, 0, sizeof(page_directory_t));
+	dir->ref_count = 1;
+	paging_set_physical(dir);
+
+	for (uint32_t i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
+		if (!kernel_directory->tables[i] || (uintptr_t)kernel_directory->tables[i] == (uintptr_t)0xFFFFFFFF) {
+			continue;
+		}
+		dir->tables[i] = kernel_directory->tables[i];
+		dir->physical_tables[i] = kernel_directory->physical_tables[i];
+	}
+	return dir;
+}
+
+/*
+ * Start a new process that runs entry(arg) in the kernel, with the
+ * current process's descriptors and none of its memory. The entry is
+ * expected to exec() something, or exit.
+ *
+ * Nothing is copied, so this is much cheaper than fork() followed by
+ * exec() in the child.
+ *
+ * @return The PID of the new process
+ */
+uint32_t spawn(void (*entry)(void *), void * arg) {
+	IRQ_OFF;
+
+	uintptr_t esp, ebp;
+
+	process_t * new_proc = spawn_process(current_process, 0);
+	assert(new_proc && "Could not allocate a new process!");
+	set_process_environment(new_proc, empty_directory());
+
+	esp = new_proc->image.stack;
+	ebp = esp;
+
+	PUSH(esp, uintptr_t, (uintptr_t)arg);
+	PUSH(esp, uintptr_t, (uintptr_t)&task_exit);
+
+	new_proc->thread.esp = esp;
+	new_proc->thread.ebp = ebp;
+
+	new_proc->thread.eip = (uintptr_t)entry;
+
+	make_process_ready(new_proc);
+
+	IRQ_RES;
+
+	return new_proc->id;
+}
+
 /*
  * Get the process ID of the current process.
  *
@@ -374,6 +472,8 @@ void switch_task(uint8_t reschedule) {
 		/* Tasking is not yet installed. */
 		return;
 	}
+	/* No preempting the scheduler; switch_next() clears this as it jumps */
+	in_switch = 1;
 	if (!current_process->running) {
 		switch_next();
 	}
@@ -412,7 +512,12 @@ void switch_task(uint8_t reschedule) {
 
 	if (reschedule && current_process != kernel_idle_task) {
 		/* And reinsert it into the ready queue */
+		current_process->usage.nivcsw++;
 		make_process_ready((process_t *)current_process);
+	} else {
+		if (current_process != kernel_idle_task) current_process->usage.nvcsw++;
+		/* Blocking voluntarily; no longer looks CPU-bound */
+		current_process->sched_penalty = 0;
 	}
 
 	/* Switch to the next task */
@@ -427,7 +532,23 @@ void switch_task(uint8_t reschedule) {
 void switch_next(void) {
 	uintptr_t esp, ebp, eip;
 	/* Get the next available process */
-	current_process = next_ready_process();
+	process_t * next = next_ready_process();
+	KTRACE(KTRACE_SWITCH, current_process ? current_process->id : 0, next->id, 0);
+	uint64_t now = timer_cycles();
+	if (current_process) {
+		if (current_process == kernel_idle_task) process_idle_end(now);
+		process_charge((process_t *)current_process, now, 0);
+	}
+	next->usage_stamp = now;
+	next->cpu = this_cpu()->index;
+	current_process = next;
+	smp_switched(next);
+	process_start_slice((process_t *)current_process);
+	preempt_pending = 0;
+	if (next->preempt_count && latency_tracing) {
+		/* A non-preemptible stretch only counts while it runs */
+		next->preempt_since = lock_clock();
+	}
 	/* Retreive the ESP/EBP/EIP */
 	eip = current_process->thread.eip;
 	esp = current_process->thread.esp;
@@ -450,6 +571,7 @@ void switch_next(void) {
 	switch_page_directory(current_directory);
 	/* Set the kernel stack in the TSS */
 	set_kernel_stack(current_process->image.stack);
+	gdt_set_tls(current_process->thread.tls_base);
 
 	if (current_process->started) {
 		if (!current_process->signal_kstack) {
@@ -466,6 +588,7 @@ void switch_next(void) {
 	}
 
 	current_process->running = 1;
+	in_switch = 0;
 
 	/* Jump, baby, jump */
 	asm volatile (
@@ -494,8 +617,13 @@ enter_user_jmp(uintptr_t location, int argc, char ** argv, uintptr_t stack) {
 	IRQ_OFF;
 	set_kernel_stack(current_process->image.stack);
 
+	/* A new image starts without thread-local storage */
+	current_process->thread.tls_base = 0;
+	gdt_set_tls(0);
+
 	PUSH(stack, uintptr_t, (uintptr_t)argv);
 	PUSH(stack, int, argc);
+	kernel_unlock();
 	enter_userspace(location, stack);
 }
 
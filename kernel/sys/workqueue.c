@@ -0,0 +1,206 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Work Queues
+ *
+ * Drivers hand deferred work - interrupt bottom halves, periodic
+ * timers, slow device bring-up - to a shared pool of [kworker]
+ * threads rather than each spawning a tasklet of its own. There is a
+ * normal pool and a high priority one whose workers are in the
+ * realtime class.
+ *
+ * Items are linked through themselves, so queueing one doesn't
+ * allocate and is safe from an interrupt handler. Delayed items wait
+ * on a list sorted by deadline; one idle worker per pool sleeps until
+ * the first of them is due, and is woken early if something else
+ * turns up. The rest sleep on the pool's idle queue.
+ */
+#include <kernel/system.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+#include <kernel/printf.h>
+#include <kernel/workqueue.h>
+
+#include <toaru/list.h>
+
+struct work_pool {
+	const char * name;
+	int workers;
+	int sched_class;
+	work_t * head;       /* Ready to run, in order */
+	work_t * tail;
+	work_t * delayed;    /* Sorted by deadline */
+	list_t * idle;       /* Workers with nothing to do */
+	process_t * timer;   /* The worker sleeping until the first delayed item */
+};
+
+static struct work_pool pools[WORK_POOLS] = {
+	{.name = "kworker",    .workers = 2, .sched_class = SCHED_CLASS_INTERACTIVE},
+	{.name = "kworker-hi", .workers = 1, .sched_class = SCHED_CLASS_REALTIME},
+};
+
+void work_init(work_t * work, work_func_t func, void * data, int pool) {
+	memset(work, 0, sizeof(work_t));
+	work->func = func;
+	work->data = data;
+	work->pool = pool;
+}
+
+static int deadline_before(work_t * a, work_t * b) {
+	return a->end_tick < b->end_tick || (a->end_tick == b->end_tick && a->end_subtick < b->end_subtick);
+}
+
+/* Get a worker looking at the pool again. Interrupts must be off. */
+static void pool_kick(struct work_pool * pool) {
+	if (pool->idle->length) {
+		wakeup_queue(pool->idle);
+	} else if (pool->timer && !process_is_ready(pool->timer)) {
+		make_process_ready(pool->timer);
+	}
+}
+
+static void pool_append(struct work_pool * pool, work_t * work) {
+	work->state = WORK_QUEUED;
+	work->next = NULL;
+	if (pool->tail) {
+		pool->tail->next = work;
+	} else {
+		pool->head = work;
+	}
+	pool->tail = work;
+}
+
+int queue_work(work_t * work) {
+	struct work_pool * pool = &pools[work->pool];
+	uint32_t flags = int_save();
+	if (work->state != WORK_IDLE) {
+		int_restore(flags);
+		return 0;
+	}
+	pool_append(pool, work);
+	pool_kick(pool);
+	int_restore(flags);
+	return 1;
+}
+
+int queue_delayed_work(work_t * work, unsigned long milliseconds) {
+	if (!milliseconds) return queue_work(work);
+
+	struct work_pool * pool = &pools[work->pool];
+	unsigned long s, ss;
+	relative_time(0, milliseconds, &s, &ss);
+
+	uint32_t flags = int_save();
+	if (work->state != WORK_IDLE) {
+		int_restore(flags);
+		return 0;
+	}
+	work->state = WORK_DELAYED;
+	work->end_tick = s;
+	work->end_subtick = ss;
+
+	work_t ** link = &pool->delayed;
+	while (*link && !deadline_before(work, *link)) {
+		link = &(*link)->next;
+	}
+	work->next = *link;
+	*link = work;
+
+	/* A new first deadline means the timer worker has to sleep less */
+	if (pool->delayed == work) {
+		if (pool->timer && !process_is_ready(pool->timer)) {
+			make_process_ready(pool->timer);
+		} else {
+			pool_kick(pool);
+		}
+	}
+	int_restore(flags);
+	return 1;
+}
+
+static int unlink_work(work_t ** link, work_t * work, work_t ** tail) {
+	work_t * prev = NULL;
+	while (*link) {
+		if (*link == work) {
+			*link = work->next;
+			if (tail && *tail == work) *tail = prev;
+			return 1;
+		}
+		prev = *link;
+		link = &(*link)->next;
+	}
+	return 0;
+}
+
+int cancel_work(work_t * work) {
+	struct work_pool * pool = &pools[work->pool];
+	int found = 0;
+	uint32_t flags = int_save();
+	if (work->state == WORK_QUEUED) {
+		found = unlink_work(&pool->head, work, &pool->tail);
+	} else if (work->state == WORK_DELAYED) {
+		found = unlink_work(&pool->delayed, work, NULL);
+	}
+	work->state = WORK_IDLE;
+	int_restore(flags);
+	return found;
+}
+
+/* Move delayed items that are due onto the run queue. Interrupts must be off. */
+static void pool_promote(struct work_pool * pool) {
+	if (!pool->delayed) return;
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	while (pool->delayed) {
+		work_t * work = pool->delayed;
+		if (work->end_tick > s || (work->end_tick == s && work->end_subtick > ss)) break;
+		pool->delayed = work->next;
+		pool_append(pool, work);
+	}
+}
+
+static void worker(void * data, char * name) {
+	struct work_pool * pool = data;
+	current_process->sched_class = pool->sched_class;
+
+	IRQ_OFF;
+	while (1) {
+		pool_promote(pool);
+
+		work_t * work = pool->head;
+		if (work) {
+			pool->head = work->next;
+			if (!pool->head) pool->tail = NULL;
+			/* Cleared first, so the item can queue itself again */
+			work->state = WORK_IDLE;
+			IRQ_RES;
+			work->func(work->data);
+			IRQ_OFF;
+			continue;
+		}
+
+		if (pool->delayed && !pool->timer) {
+			pool->timer = (process_t *)current_process;
+			sleep_until((process_t *)current_process, pool->delayed->end_tick, pool->delayed->end_subtick);
+			switch_task(0);
+			pool->timer = NULL;
+		} else {
+			sleep_on(pool->idle);
+		}
+	}
+}
+
+void workqueue_install(void) {
+	for (int i = 0; i < WORK_POOLS; ++i) {
+		struct work_pool * pool = &pools[i];
+		pool->idle = list_create();
+		for (int j = 0; j < pool->workers; ++j) {
+			char name[32];
+			sprintf(name, "[%s %d]", pool->name, j);
+			create_kernel_tasklet(worker, strdup(name), pool);
+		}
+	}
+	debug_print(NOTICE, "Started %d work pools", WORK_POOLS);
+}
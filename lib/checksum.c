@@ -0,0 +1,213 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * libtoaru_checksum: CRC32 and Adler-32.
+ *
+ * CRC32 is done eight bytes at a time with eight tables ("slice-by-8"),
+ * or, on CPUs with carry-less multiplication, by folding sixty-four
+ * bytes at a time with PCLMULQDQ and reducing what's left at the end;
+ * that's the method from Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction".
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#include <toaru/checksum.h>
+
+#define CRC32_POLY 0xEDB88320
+
+/* crc_table[k][n] is the CRC of byte n followed by k zero bytes */
+static uint32_t crc_table[8][256];
+static volatile int crc_table_ready = 0;
+
+static void build_crc_table(void) {
+	for (uint32_t n = 0; n < 256; ++n) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+		}
+		crc_table[0][n] = c;
+	}
+	for (uint32_t n = 0; n < 256; ++n) {
+		for (int k = 1; k < 8; ++k) {
+			crc_table[k][n] = (crc_table[k-1][n] >> 8) ^ crc_table[0][crc_table[k-1][n] & 0xFF];
+		}
+	}
+	crc_table_ready = 1;
+}
+
+/* Works on the inverted CRC, as the folding does */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t * buf, size_t len) {
+	while (len && ((uintptr_t)buf & 3)) {
+		crc = crc_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t one, two;
+		memcpy(&one, buf, 4);
+		memcpy(&two, buf + 4, 4);
+		one ^= crc;
+		crc = crc_table[7][one & 0xFF] ^
+		      crc_table[6][(one >> 8) & 0xFF] ^
+		      crc_table[5][(one >> 16) & 0xFF] ^
+		      crc_table[4][one >> 24] ^
+		      crc_table[3][two & 0xFF] ^
+		      crc_table[2][(two >> 8) & 0xFF] ^
+		      crc_table[1][(two >> 16) & 0xFF] ^
+		      crc_table[0][two >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = crc_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/*
+ * Fold constants for the bit-reflected polynomial: x^(4*128+32),
+ * x^(4*128-32), x^(128+32), x^(128-32) and x^64 mod P, then P and
+ * the Barrett constant floor(x^64 / P).
+ */
+static const uint64_t __attribute__((aligned(16))) fold_4x128[2] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t __attribute__((aligned(16))) fold_1x128[2] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t __attribute__((aligned(16))) fold_64[2]    = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t __attribute__((aligned(16))) barrett[2]    = { 0x01db710641, 0x01f7011641 };
+
+/* At least 64 bytes, and a multiple of 16 */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t * buf, size_t len) {
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	/* Four lanes of 128 bits, each folded 512 bits forward per step */
+	x0 = _mm_load_si128((const __m128i *)fold_4x128);
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)fold_1x128);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)fold_64);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 */
+	x0 = _mm_load_si128((const __m128i *)barrett);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+static int has_clmul(void) {
+	static int result = -1;
+	if (result < 0) {
+		uint32_t a, b, c, d;
+		asm volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1));
+		result = (c >> 1) & 1;
+	}
+	return result;
+}
+
+uint32_t checksum_crc32(uint32_t crc, const void * buf, size_t len) {
+	const uint8_t * p = buf;
+	if (!crc_table_ready) build_crc_table();
+
+	crc = ~crc;
+	if (len >= 64 && has_clmul()) {
+		size_t n = len & ~(size_t)15;
+		crc = crc32_clmul(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return ~crc32_slice8(crc, p, len);
+}
+
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552 /* The most bytes that can be summed before b can overflow */
+
+uint32_t checksum_adler32(uint32_t adler, const void * buf, size_t len) {
+	const uint8_t * p = buf;
+	uint32_t a = adler & 0xFFFF;
+	uint32_t b = adler >> 16;
+
+	while (len) {
+		size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+		len -= n;
+		while (n >= 8) {
+			a += p[0]; b += a;
+			a += p[1]; b += a;
+			a += p[2]; b += a;
+			a += p[3]; b += a;
+			a += p[4]; b += a;
+			a += p[5]; b += a;
+			a += p[6]; b += a;
+			a += p[7]; b += a;
+			p += 8;
+			n -= 8;
+		}
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= ADLER_MOD;
+		b %= ADLER_MOD;
+	}
+
+	return (b << 16) | a;
+}
@@ -9,6 +9,8 @@
  * many years ago.
  */
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <dlfcn.h>
 
 #include <toaru/yutani.h>
@@ -64,10 +66,12 @@ static int get_bounds_fancy(yutani_window_t * window, struct decor_bounds * boun
 	return 0;
 }
 
-static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * ctx, char * title, int decors_active) {
-	int width = window->width;
-	int height = window->height;
-
+/*
+ * The frame: edges, corners and buttons, for a window of the given size.
+ * Pixels outside the borders are left alone, except where the bottom
+ * corners reach up past them.
+ */
+static void render_frame_fancy(yutani_window_t * window, gfx_context_t * ctx, int width, int height, int decors_active) {
 	struct decor_bounds bounds;
 	get_bounds_fancy(window, &bounds);
 
@@ -77,8 +81,6 @@ static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * c
 		}
 	}
 
-	if (decors_active == DECOR_INACTIVE) decors_active = INACTIVE;
-
 	if ((window->decorator_flags & DECOR_FLAG_TILED)) {
 		for (int i = 0; i < width; ++i) {
 			draw_sprite(ctx, sprites[decors_active + 1], i, -6 + !(window->decorator_flags & DECOR_FLAG_TILE_UP));
@@ -87,22 +89,22 @@ static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * c
 		uint32_t clear_color = rgb(62,62,62);
 		if (!(window->decorator_flags & DECOR_FLAG_TILE_DOWN)) {
 			/* Draw bottom line */
-			for (int i = 0; i < (int)window->width; ++i) {
-				GFX(ctx,i,window->height-1) = clear_color;
+			for (int i = 0; i < width; ++i) {
+				GFX(ctx,i,height-1) = clear_color;
 			}
 		}
 
 		if (!(window->decorator_flags & DECOR_FLAG_TILE_LEFT)) {
 			/* Draw left line */
-			for (int i = 0; i < (int)window->height; ++i) {
+			for (int i = 0; i < height; ++i) {
 				GFX(ctx,0,i) = clear_color;
 			}
 		}
 
 		if (!(window->decorator_flags & DECOR_FLAG_TILE_RIGHT)) {
 			/* Draw right line */
-			for (int i = 0; i < (int)window->height; ++i) {
-				GFX(ctx,window->width-1,i) = clear_color;
+			for (int i = 0; i < height; ++i) {
+				GFX(ctx,width-1,i) = clear_color;
 			}
 		}
 
@@ -141,6 +143,14 @@ static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * c
 		draw_sprite(ctx, sprites[decors_active + 7], width - lr_width, height - l_height);
 	}
 
+	/* Buttons */
+	draw_sprite(ctx, sprites[decors_active + 8], width - 28 + BUTTON_OFFSET, 16 - BUTTON_OFFSET);
+	if (!(window->decorator_flags & DECOR_FLAG_NO_MAXIMIZE)) {
+		draw_sprite(ctx, sprites[decors_active + 9], width - 50 + BUTTON_OFFSET, 16 - BUTTON_OFFSET);
+	}
+}
+
+static void render_title_fancy(yutani_window_t * window, gfx_context_t * ctx, int width, char * title, int decors_active) {
 	char * tmp_title = strdup(title);
 	int t_l = strlen(tmp_title);
 
@@ -176,11 +186,150 @@ static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * c
 	}
 
 	free(tmp_title);
+}
 
-	/* Buttons */
-	draw_sprite(ctx, sprites[decors_active + 8], width - 28 + BUTTON_OFFSET, 16 - BUTTON_OFFSET);
-	if (!(window->decorator_flags & DECOR_FLAG_NO_MAXIMIZE)) {
-		draw_sprite(ctx, sprites[decors_active + 9], width - 50 + BUTTON_OFFSET, 16 - BUTTON_OFFSET);
+/*
+ * Rendered decorations, kept so that redrawing a window (or refocusing
+ * it) is a handful of row copies instead of a few thousand sprite
+ * blits and a string render.
+ *
+ * Every row of a window's sides is the same, so an entry is the frame
+ * for a window with a single row between the top and bottom: the top,
+ * that row, and the bottom, including the rows just above it that the
+ * bottom corners reach into. The top is also kept without the title so
+ * a new title can be drawn without redrawing the rest.
+ */
+#define DECOR_CACHE_SIZE 4
+#define CACHE_FLAGS (DECOR_FLAG_NO_MAXIMIZE | DECOR_FLAG_TILED)
+
+struct decor_cache {
+	int width;
+	int decors_active;
+	uint32_t flags;
+	char * title;
+	int overlap;          /* Rows above the bottom that the corners cover */
+	sprite_t * rendered;  /* With the title */
+	sprite_t * frame_top; /* Without it */
+	unsigned long used;
+};
+
+static struct decor_cache decor_cache[DECOR_CACHE_SIZE];
+static unsigned long decor_cache_clock = 0;
+
+static struct decor_cache * get_cache_fancy(yutani_window_t * window, int width, char * title, int decors_active) {
+	struct decor_bounds bounds;
+	get_bounds_fancy(window, &bounds);
+	uint32_t flags = window->decorator_flags & CACHE_FLAGS;
+
+	struct decor_cache * entry = NULL;
+	for (int i = 0; i < DECOR_CACHE_SIZE; ++i) {
+		struct decor_cache * c = &decor_cache[i];
+		if (c->rendered && c->width == width && c->decors_active == decors_active && c->flags == flags) {
+			entry = c;
+			break;
+		}
+	}
+
+	if (!entry) {
+		/* Replace the least recently used one */
+		entry = &decor_cache[0];
+		for (int i = 1; i < DECOR_CACHE_SIZE; ++i) {
+			if (decor_cache[i].used < entry->used) entry = &decor_cache[i];
+		}
+		if (entry->rendered) {
+			sprite_free(entry->rendered);
+			sprite_free(entry->frame_top);
+			free(entry->title);
+			entry->rendered = NULL;
+		}
+
+		int overlap = (flags & DECOR_FLAG_TILED) ? 0 : l_height - (int)bounds.bottom_height;
+		int height = bounds.top_height + 1 + overlap + bounds.bottom_height;
+
+		sprite_t * rendered = create_sprite(width, height, ALPHA_EMBEDDED);
+		if (!rendered) return NULL;
+		memset(rendered->bitmap, 0, sizeof(uint32_t) * width * height);
+		gfx_context_t * ctx = init_graphics_sprite(rendered);
+		render_frame_fancy(window, ctx, width, height, decors_active);
+		free(ctx);
+
+		sprite_t * frame_top = create_sprite(width, bounds.top_height, ALPHA_EMBEDDED);
+		if (!frame_top) {
+			sprite_free(rendered);
+			return NULL;
+		}
+		memcpy(frame_top->bitmap, rendered->bitmap, sizeof(uint32_t) * width * bounds.top_height);
+
+		entry->width = width;
+		entry->decors_active = decors_active;
+		entry->flags = flags;
+		entry->overlap = overlap;
+		entry->rendered = rendered;
+		entry->frame_top = frame_top;
+		entry->title = NULL;
+	}
+
+	if (!entry->title || strcmp(entry->title, title)) {
+		if (entry->title) {
+			memcpy(entry->rendered->bitmap, entry->frame_top->bitmap, sizeof(uint32_t) * width * entry->frame_top->height);
+			free(entry->title);
+		}
+		gfx_context_t * ctx = init_graphics_sprite(entry->rendered);
+		render_title_fancy(window, ctx, width, title, decors_active);
+		free(ctx);
+		entry->title = strdup(title);
+	}
+
+	entry->used = ++decor_cache_clock;
+	return entry;
+}
+
+static void render_decorations_fancy(yutani_window_t * window, gfx_context_t * ctx, char * title, int decors_active) {
+	int width = window->width;
+	int height = window->height;
+
+	struct decor_bounds bounds;
+	get_bounds_fancy(window, &bounds);
+
+	if (decors_active == DECOR_INACTIVE) decors_active = INACTIVE;
+
+	struct decor_cache * entry = get_cache_fancy(window, width, title, decors_active);
+	if (!entry || height < entry->rendered->height) {
+		/* Too short to be put together from the cached rows */
+		render_frame_fancy(window, ctx, width, height, decors_active);
+		render_title_fancy(window, ctx, width, title, decors_active);
+		return;
+	}
+
+	sprite_t * r = entry->rendered;
+	int middle = bounds.top_height;
+	int bottom = height - bounds.bottom_height;
+	int r_bottom = r->height - bounds.bottom_height;
+
+	for (int j = 0; j < (int)bounds.top_height; ++j) {
+		memcpy(&GFX(ctx,0,j), &SPRITE(r,0,j), sizeof(uint32_t) * width);
+	}
+
+	for (int j = bounds.top_height; j < bottom - entry->overlap; ++j) {
+		memcpy(&GFX(ctx,0,j), &SPRITE(r,0,middle), sizeof(uint32_t) * bounds.left_width);
+		memcpy(&GFX(ctx,width - bounds.right_width,j), &SPRITE(r,width - bounds.right_width,middle), sizeof(uint32_t) * bounds.right_width);
+	}
+
+	/* The corners and bottom edge hang over the window's contents here */
+	for (int k = 0; k < entry->overlap; ++k) {
+		int j = bottom - entry->overlap + k;
+		int r_j = r_bottom - entry->overlap + k;
+		for (int i = 0; i < width; ++i) {
+			if (i < (int)bounds.left_width || i >= width - (int)bounds.right_width) {
+				GFX(ctx,i,j) = SPRITE(r,i,r_j);
+			} else {
+				GFX(ctx,i,j) = alpha_blend_rgba(GFX(ctx,i,j), SPRITE(r,i,r_j));
+			}
+		}
+	}
+
+	for (int j = 0; j < (int)bounds.bottom_height; ++j) {
+		memcpy(&GFX(ctx,0,bottom + j), &SPRITE(r,0,r_bottom + j), sizeof(uint32_t) * width);
 	}
 }
 
@@ -44,29 +44,48 @@ static void render_decorations_simple(yutani_window_t * window, gfx_context_t *
 		color = BORDERCOLOR_INACTIVE;
 	}
 
+	/*
+	 * The title bar only changes with the width, the title and focus;
+	 * keep the last one drawn for each focus state and copy it back in.
+	 */
+	static struct {
+		sprite_t * bar;
+		char * title;
+	} cache[2];
+
+	sprite_t * bar = cache[decors_active].bar;
+	if (!bar || bar->width != window->width || strcmp(cache[decors_active].title, title)) {
+		if (bar) {
+			sprite_free(bar);
+			free(cache[decors_active].title);
+		}
+		bar = create_sprite(window->width, 24, ALPHA_OPAQUE);
+		gfx_context_t * bar_ctx = init_graphics_sprite(bar);
+		draw_fill(bar_ctx, color);
+
+		if (decors_active == DECOR_INACTIVE) {
+			draw_sdf_string(bar_ctx, TEXT_OFFSET_X, TEXT_OFFSET_Y, title, 14, TEXTCOLOR_INACTIVE, SDF_FONT_THIN);
+			draw_sdf_string(bar_ctx, window->width - 20, TEXT_OFFSET_Y, "x", 14, TEXTCOLOR_INACTIVE, SDF_FONT_THIN);
+		} else {
+			draw_sdf_string(bar_ctx, TEXT_OFFSET_X, TEXT_OFFSET_Y, title, 14, TEXTCOLOR, SDF_FONT_THIN);
+			draw_sdf_string(bar_ctx, window->width - 20, TEXT_OFFSET_Y, "x", 14, TEXTCOLOR, SDF_FONT_THIN);
+		}
 
-	for (int i = 0; i < (int)window->height; ++i) {
-		GFX(ctx, 0, i) = color;
-		GFX(ctx, window->width - 1, i) = color;
+		free(bar_ctx);
+		cache[decors_active].bar = bar;
+		cache[decors_active].title = strdup(title);
 	}
 
-	for (int i = 1; i < (int)24; ++i) {
-		for (int j = 1; j < (int)window->width - 1; ++j) {
-			GFX(ctx, j, i) = color;
-		}
+	for (int i = 0; i < 24 && i < (int)window->height; ++i) {
+		memcpy(&GFX(ctx, 0, i), &SPRITE(bar, 0, i), sizeof(uint32_t) * window->width);
 	}
 
-	if (decors_active == DECOR_INACTIVE) {
-		draw_sdf_string(ctx, TEXT_OFFSET_X, TEXT_OFFSET_Y, title, 14, TEXTCOLOR_INACTIVE, SDF_FONT_THIN);
-		draw_sdf_string(ctx, window->width - 20, TEXT_OFFSET_Y, "x", 14, TEXTCOLOR_INACTIVE, SDF_FONT_THIN);
-	} else {
-		draw_sdf_string(ctx, TEXT_OFFSET_X, TEXT_OFFSET_Y, title, 14, TEXTCOLOR, SDF_FONT_THIN);
-		draw_sdf_string(ctx, window->width - 20, TEXT_OFFSET_Y, "x", 14, TEXTCOLOR, SDF_FONT_THIN);
+	for (int i = 24; i < (int)window->height; ++i) {
+		GFX(ctx, 0, i) = color;
+		GFX(ctx, window->width - 1, i) = color;
 	}
 
 	for (uint32_t i = 0; i < window->width; ++i) {
-		GFX(ctx, i, 0) = color;
-		GFX(ctx, i, 24 - 1) = color;
 		GFX(ctx, i, window->height - 1) = color;
 	}
 }
@@ -0,0 +1,278 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Cooperative fibers
+ *
+ * Every fiber runs on its own small stack. Switching saves the
+ * callee-saved registers on the outgoing stack and swaps stack
+ * pointers, so a switch costs a handful of instructions. The
+ * scheduler runs on the stack of whoever called fiber_run(); when
+ * nothing is runnable it poll()s every descriptor a fiber is waiting
+ * on at once and wakes all the fibers whose descriptors are ready.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#include <toaru/list.h>
+#include <toaru/fiber.h>
+
+#define FIBER_POOL 16 /* Stacks kept around for reuse */
+
+struct fiber {
+	node_t node;        /* In the ready or waiting list */
+	void * sp;          /* Saved stack pointer while switched out */
+	void * stack;
+	fiber_func_t func;
+	void * arg;
+	int dead;
+
+	/* What we're waiting for */
+	int fd;
+	int events;
+	int revents;
+	uint64_t deadline;  /* In milliseconds; 0 for none */
+};
+
+static list_t ready = {0};
+static list_t waiting = {0};
+static fiber_t * current = NULL;
+static void * scheduler_sp = NULL;
+
+static void * stack_pool[FIBER_POOL];
+static int stack_pool_count = 0;
+
+/*
+ * fiber_switch_stack(&save, to)
+ *
+ * Push callee-saved registers, store the stack pointer in *save,
+ * switch to `to` and pop whatever was saved there.
+ */
+extern void fiber_switch_stack(void ** save, void * to) __attribute__((visibility("hidden")));
+__asm__(
+	".text\n"
+	".global fiber_switch_stack\n"
+	".hidden fiber_switch_stack\n"
+	".type fiber_switch_stack, @function\n"
+	"fiber_switch_stack:\n"
+	"	movl 4(%esp), %eax\n"
+	"	movl 8(%esp), %edx\n"
+	"	pushl %ebp\n"
+	"	pushl %ebx\n"
+	"	pushl %esi\n"
+	"	pushl %edi\n"
+	"	movl %esp, (%eax)\n"
+	"	movl %edx, %esp\n"
+	"	popl %edi\n"
+	"	popl %esi\n"
+	"	popl %ebx\n"
+	"	popl %ebp\n"
+	"	ret\n"
+);
+
+static uint64_t now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void * stack_get(void) {
+	if (stack_pool_count) {
+		return stack_pool[--stack_pool_count];
+	}
+	return malloc(FIBER_STACK_SIZE);
+}
+
+static void stack_put(void * stack) {
+	if (stack_pool_count < FIBER_POOL) {
+		stack_pool[stack_pool_count++] = stack;
+	} else {
+		free(stack);
+	}
+}
+
+/* Give control back to the scheduler. */
+static void fiber_suspend(void) {
+	fiber_switch_stack(&current->sp, scheduler_sp);
+}
+
+static void fiber_entry(void) {
+	current->func(current->arg);
+	fiber_exit();
+}
+
+fiber_t * fiber_spawn(fiber_func_t func, void * arg) {
+	fiber_t * fiber = malloc(sizeof(fiber_t));
+	if (!fiber) return NULL;
+	memset(fiber, 0, sizeof(fiber_t));
+
+	fiber->stack = stack_get();
+	if (!fiber->stack) {
+		free(fiber);
+		return NULL;
+	}
+	fiber->func = func;
+	fiber->arg = arg;
+	fiber->fd = -1;
+	fiber->node.value = fiber;
+
+	/*
+	 * Lay the stack out as fiber_switch_stack() would have left it:
+	 * four saved registers and a return address into fiber_entry(),
+	 * which in turn sees a (never used) return address of zero with
+	 * the stack aligned as if it had been called normally.
+	 */
+	uintptr_t top = ((uintptr_t)fiber->stack + FIBER_STACK_SIZE) & ~(uintptr_t)0xF;
+	uint32_t * sp = (uint32_t *)top;
+	*--sp = 0;
+	*--sp = (uintptr_t)&fiber_entry;
+	for (int i = 0; i < 4; ++i) *--sp = 0;
+	fiber->sp = sp;
+
+	list_append(&ready, &fiber->node);
+	return fiber;
+}
+
+fiber_t * fiber_self(void) {
+	return current;
+}
+
+void fiber_yield(void) {
+	if (!current) return;
+	list_append(&ready, &current->node);
+	fiber_suspend();
+}
+
+void fiber_exit(void) {
+	current->dead = 1;
+	fiber_suspend();
+	__builtin_unreachable();
+}
+
+static void fiber_wake(fiber_t * fiber, int revents) {
+	list_delete(&waiting, &fiber->node);
+	fiber->revents = revents;
+	list_append(&ready, &fiber->node);
+}
+
+/*
+ * Nothing is runnable: sleep in poll() until some waiting fiber can
+ * continue.
+ */
+static void fiber_poll(void) {
+	struct pollfd fds[waiting.length];
+	fiber_t * owners[waiting.length];
+	int count = 0;
+	uint64_t deadline = 0;
+
+	foreach(node, &waiting) {
+		fiber_t * fiber = node->value;
+		if (fiber->fd >= 0) {
+			fds[count].fd = fiber->fd;
+			fds[count].events = fiber->events;
+			fds[count].revents = 0;
+			owners[count] = fiber;
+			count++;
+		}
+		if (fiber->deadline && (!deadline || fiber->deadline < deadline)) {
+			deadline = fiber->deadline;
+		}
+	}
+
+	int timeout = -1;
+	if (deadline) {
+		uint64_t now = now_ms();
+		timeout = deadline > now ? (int)(deadline - now) : 0;
+	}
+
+	int ret = poll(fds, count, timeout);
+	if (ret > 0) {
+		for (int i = 0; i < count; ++i) {
+			if (fds[i].revents) {
+				fiber_wake(owners[i], fds[i].revents);
+			}
+		}
+	}
+
+	if (deadline) {
+		uint64_t now = now_ms();
+		node_t * node = waiting.head;
+		while (node) {
+			node_t * next = node->next;
+			fiber_t * fiber = node->value;
+			if (fiber->deadline && fiber->deadline <= now) {
+				fiber_wake(fiber, 0);
+			}
+			node = next;
+		}
+	}
+}
+
+void fiber_run(void) {
+	while (ready.length || waiting.length) {
+		if (!ready.length) {
+			fiber_poll();
+			continue;
+		}
+
+		node_t * node = list_dequeue(&ready);
+		current = node->value;
+		fiber_switch_stack(&scheduler_sp, current->sp);
+
+		fiber_t * fiber = current;
+		current = NULL;
+		if (fiber->dead) {
+			stack_put(fiber->stack);
+			free(fiber);
+		}
+	}
+}
+
+int fiber_wait(int fd, int events, int timeout) {
+	if (!current) {
+		/* Not in a fiber; just block */
+		struct pollfd p = { fd, events, 0 };
+		return poll(&p, fd >= 0 ? 1 : 0, timeout) > 0 ? p.revents : 0;
+	}
+
+	current->fd = fd;
+	current->events = events;
+	current->revents = 0;
+	current->deadline = timeout >= 0 ? now_ms() + timeout : 0;
+	if (timeout == 0) current->deadline = 1; /* Already passed */
+
+	list_append(&waiting, &current->node);
+	fiber_suspend();
+
+	current->fd = -1;
+	current->deadline = 0;
+	return current->revents;
+}
+
+void fiber_sleep(int ms) {
+	fiber_wait(-1, 0, ms);
+}
+
+ssize_t fiber_read(int fd, void * buf, size_t count) {
+	int revents = fiber_wait(fd, POLLIN, -1);
+	if (revents & POLLNVAL) {
+		errno = EBADF;
+		return -1;
+	}
+	return read(fd, buf, count);
+}
+
+ssize_t fiber_write(int fd, const void * buf, size_t count) {
+	int revents = fiber_wait(fd, POLLOUT, -1);
+	if (revents & POLLNVAL) {
+		errno = EBADF;
+		return -1;
+	}
+	return write(fd, buf, count);
+}
@@ -0,0 +1,97 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * glyph_cache - rendered glyph masks, shared by the text renderers
+ *
+ * Glyphs live in a chained hash table and on a list ordered by last
+ * use; when the cache holds too many glyphs or too many mask bytes,
+ * the ones at the cold end of the list go first.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <toaru/graphics.h>
+#include <toaru/list.h>
+#include <toaru/glyph_cache.h>
+
+#define GLYPH_BUCKETS   1021
+#define GLYPH_MAX_COUNT 2048
+#define GLYPH_MAX_BYTES (1024 * 1024)
+
+static glyph_t * buckets[GLYPH_BUCKETS];
+static list_t lru = {0};
+static size_t cached_bytes = 0;
+
+static unsigned int glyph_hash(uint32_t font, uint32_t size, uint32_t codepoint, uint64_t variant) {
+	uint32_t h = codepoint * 2654435761U;
+	h ^= (font * 31 + size) * 40503U;
+	h ^= (uint32_t)variant ^ (uint32_t)(variant >> 32);
+	return h % GLYPH_BUCKETS;
+}
+
+static void glyph_evict(void) {
+	glyph_t * glyph = lru.head->value;
+	list_delete(&lru, &glyph->lru);
+
+	glyph_t ** g = &buckets[glyph_hash(glyph->font, glyph->size, glyph->codepoint, glyph->variant)];
+	while (*g != glyph) g = &(*g)->hash_next;
+	*g = glyph->hash_next;
+
+	cached_bytes -= glyph->width * glyph->height;
+	free(glyph->mask);
+	free(glyph);
+}
+
+glyph_t * glyph_cache_get(uint32_t font, uint32_t size, uint32_t codepoint, uint64_t variant) {
+	for (glyph_t * g = buckets[glyph_hash(font, size, codepoint, variant)]; g; g = g->hash_next) {
+		if (g->codepoint == codepoint && g->font == font && g->size == size && g->variant == variant) {
+			if (lru.tail != &g->lru) {
+				list_delete(&lru, &g->lru);
+				list_append(&lru, &g->lru);
+			}
+			return g;
+		}
+	}
+	return NULL;
+}
+
+glyph_t * glyph_cache_add(uint32_t font, uint32_t size, uint32_t codepoint, uint64_t variant, int32_t width, int32_t height) {
+	if (width < 0) width = 0;
+	if (height < 0) height = 0;
+
+	while (lru.length && (lru.length >= GLYPH_MAX_COUNT || cached_bytes + width * height > GLYPH_MAX_BYTES)) {
+		glyph_evict();
+	}
+
+	glyph_t * glyph = calloc(1, sizeof(glyph_t));
+	glyph->font = font;
+	glyph->size = size;
+	glyph->codepoint = codepoint;
+	glyph->variant = variant;
+	glyph->width = width;
+	glyph->height = height;
+	glyph->mask = calloc(width * height + 1, 1);
+
+	unsigned int h = glyph_hash(font, size, codepoint, variant);
+	glyph->hash_next = buckets[h];
+	buckets[h] = glyph;
+
+	glyph->lru.value = glyph;
+	list_append(&lru, &glyph->lru);
+	cached_bytes += width * height;
+
+	return glyph;
+}
+
+void glyph_colors(uint32_t colors[256], uint32_t color) {
+	for (int c = 0; c < 256; ++c) {
+		uint32_t a = (_ALP(color) * c) / 255;
+		colors[c] = premultiply(rgba(_RED(color), _GRE(color), _BLU(color), a));
+	}
+}
+
+void draw_glyph(gfx_context_t * ctx, glyph_t * glyph, int32_t x, int32_t y, const uint32_t colors[256]) {
+	draw_coverage_mask(ctx, x + glyph->left, y - glyph->top, glyph->mask, glyph->width, glyph->height, colors);
+}
@@ -13,6 +13,7 @@
 #include <fcntl.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #ifndef NO_SSE
 #include <xmmintrin.h>
@@ -40,29 +41,145 @@ static inline uint16_t max16(uint16_t a, uint16_t b) {
 }
 
 
+/*
+ * Clipping
+ *
+ * The clip region is a short list of rectangles. A per-row flag lets
+ * drawing skip rows no rectangle touches without looking at the list;
+ * rows that are touched are drawn in spans, the merged horizontal
+ * extents of the rectangles that cover them. With no clip region at
+ * all, everything is drawable.
+ */
 static int _is_in_clip(gfx_context_t * ctx, int32_t y) {
 	if (!ctx->clips) return 1;
 	if (y < 0 || y >= ctx->clips_size) return 1;
 	return ctx->clips[y];
 }
 
+static int _is_in_clip_xy(gfx_context_t * ctx, int32_t x, int32_t y) {
+	if (!_is_in_clip(ctx, y)) return 0;
+	if (!ctx->clips || y >= ctx->clips_size) return 1;
+	for (int i = 0; i < ctx->clip_count; ++i) {
+		gfx_rect_t * r = &ctx->clip_rects[i];
+		if (x >= r->x && x < r->x + r->w && y >= r->y && y < r->y + r->h) return 1;
+	}
+	return 0;
+}
+
+/* Pixel inside the context and the clip region */
+static inline int _is_drawable(gfx_context_t * ctx, int32_t x, int32_t y) {
+	return x >= 0 && y >= 0 && x < ctx->width && y < ctx->height && _is_in_clip_xy(ctx, x, y);
+}
+
+/*
+ * Fill `spans` with the [start,end) pieces of row y between left and
+ * right that are inside the clip region, in order and without overlap.
+ * Returns how many there are; never more than GFX_MAX_CLIP_RECTS.
+ */
+int gfx_clip_spans(gfx_context_t * ctx, int32_t y, int32_t left, int32_t right, int32_t spans[][2]) {
+	if (left >= right) return 0;
+	if (!ctx->clips || y < 0 || y >= ctx->clips_size) {
+		spans[0][0] = left;
+		spans[0][1] = right;
+		return 1;
+	}
+	if (!ctx->clips[y]) return 0;
+
+	int count = 0;
+	for (int i = 0; i < ctx->clip_count; ++i) {
+		gfx_rect_t * r = &ctx->clip_rects[i];
+		if (y < r->y || y >= r->y + r->h) continue;
+		int32_t a = max(r->x, left);
+		int32_t b = min(r->x + r->w, right);
+		if (a >= b) continue;
+		/* Insertion sort by start */
+		int j = count++;
+		while (j > 0 && spans[j-1][0] > a) {
+			spans[j][0] = spans[j-1][0];
+			spans[j][1] = spans[j-1][1];
+			j--;
+		}
+		spans[j][0] = a;
+		spans[j][1] = b;
+	}
+
+	/* Merge overlapping and touching spans */
+	int out = 0;
+	for (int i = 0; i < count; ++i) {
+		if (out && spans[i][0] <= spans[out-1][1]) {
+			spans[out-1][1] = max(spans[out-1][1], spans[i][1]);
+		} else {
+			spans[out][0] = spans[i][0];
+			spans[out][1] = spans[i][1];
+			out++;
+		}
+	}
+	return out;
+}
+
+static int64_t _rect_area(int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+	return (int64_t)(x1 - x0) * (y1 - y0);
+}
 
 void gfx_add_clip(gfx_context_t * ctx, int32_t x, int32_t y, int32_t w, int32_t h) {
-	(void)x;
-	(void)w; // TODO Horizontal clipping
 	if (!ctx->clips) {
 		ctx->clips = malloc(ctx->height);
 		memset(ctx->clips, 0, ctx->height);
 		ctx->clips_size = ctx->height;
+		ctx->clip_rects = malloc(sizeof(gfx_rect_t) * GFX_MAX_CLIP_RECTS);
+		ctx->clip_count = 0;
 	}
-	for (int i = max(y,0); i < min(y+h,ctx->clips_size); ++i) {
-		ctx->clips[i] = 1;
+
+	/* Only the part inside the context matters */
+	int32_t x0 = max(x, 0), y0 = max(y, 0);
+	int32_t x1 = min(x + w, ctx->width), y1 = min(y + h, ctx->clips_size);
+	if (x0 >= x1 || y0 >= y1) return;
+
+	for (int i = 0; i < ctx->clip_count; ++i) {
+		gfx_rect_t * r = &ctx->clip_rects[i];
+		if (x0 >= r->x && y0 >= r->y && x1 <= r->x + r->w && y1 <= r->y + r->h) {
+			return; /* Already covered */
+		}
+		if (r->x >= x0 && r->y >= y0 && r->x + r->w <= x1 && r->y + r->h <= y1) {
+			/* Swallowed by the new one */
+			ctx->clip_rects[i--] = ctx->clip_rects[--ctx->clip_count];
+		}
 	}
+
+	if (ctx->clip_count == GFX_MAX_CLIP_RECTS) {
+		/* Out of room: grow whichever rectangle needs to grow the least */
+		int best = 0;
+		int64_t best_cost = INT64_MAX;
+		for (int i = 0; i < ctx->clip_count; ++i) {
+			gfx_rect_t * r = &ctx->clip_rects[i];
+			int64_t cost = _rect_area(min(r->x, x0), min(r->y, y0), max(r->x + r->w, x1), max(r->y + r->h, y1))
+				- _rect_area(r->x, r->y, r->x + r->w, r->y + r->h);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best = i;
+			}
+		}
+		gfx_rect_t * r = &ctx->clip_rects[best];
+		int32_t bx0 = min(r->x, x0), by0 = min(r->y, y0);
+		int32_t bx1 = max(r->x + r->w, x1), by1 = max(r->y + r->h, y1);
+		ctx->clip_count--;
+		ctx->clip_rects[best] = ctx->clip_rects[ctx->clip_count];
+		gfx_add_clip(ctx, bx0, by0, bx1 - bx0, by1 - by0);
+		return;
+	}
+
+	gfx_rect_t * r = &ctx->clip_rects[ctx->clip_count++];
+	r->x = x0;
+	r->y = y0;
+	r->w = x1 - x0;
+	r->h = y1 - y0;
+	memset(&ctx->clips[y0], 1, y1 - y0);
 }
 
 void gfx_clear_clip(gfx_context_t * ctx) {
 	if (ctx->clips) {
 		memset(ctx->clips, 0, ctx->clips_size);
+		ctx->clip_count = 0;
 	}
 }
 
@@ -71,14 +188,20 @@ void gfx_no_clip(gfx_context_t * ctx) {
 	if (!tmp) return;
 	ctx->clips = NULL;
 	free(tmp);
+	free(ctx->clip_rects);
+	ctx->clip_rects = NULL;
+	ctx->clip_count = 0;
 }
 
 /* Pointer to graphics memory */
 void flip(gfx_context_t * ctx) {
 	if (ctx->clips) {
+		int32_t spans[GFX_MAX_CLIP_RECTS][2];
 		for (size_t i = 0; i < ctx->height; ++i) {
-			if (_is_in_clip(ctx,i)) {
-				memcpy(&ctx->buffer[i*GFX_S(ctx)], &ctx->backbuffer[i*GFX_S(ctx)], 4 * ctx->width);
+			int n = gfx_clip_spans(ctx, i, 0, ctx->width, spans);
+			for (int s = 0; s < n; ++s) {
+				size_t offset = i * GFX_S(ctx) + spans[s][0] * 4;
+				memcpy(&ctx->buffer[offset], &ctx->backbuffer[offset], 4 * (spans[s][1] - spans[s][0]));
 			}
 		}
 	} else {
@@ -143,10 +266,13 @@ gfx_context_t * init_graphics_subregion(gfx_context_t * base, int x, int y, int
 	out->buffer = base->buffer + (base->stride * y) + x * 4;
 
 	if (base->clips) {
-		for (int _y = 0; _y < height; ++_y) {
-			if (_is_in_clip(base, y + _y)) {
-				gfx_add_clip(out,0,_y,width,1);
-			}
+		for (int i = 0; i < base->clip_count; ++i) {
+			gfx_rect_t * r = &base->clip_rects[i];
+			gfx_add_clip(out, r->x - x, r->y - y, r->w, r->h);
+		}
+		if (!out->clips) {
+			/* Nothing of the region is visible; clip everything */
+			gfx_add_clip(out, 0, 0, 0, 0);
 		}
 	}
 
@@ -164,9 +290,7 @@ void reinit_graphics_fullscreen(gfx_context_t * out) {
 	out->size   = GFX_H(out) * GFX_S(out);
 
 	if (out->clips && out->clips_size != out->height) {
-		free(out->clips);
-		out->clips = NULL;
-		out->clips_size = 0;
+		gfx_no_clip(out);
 	}
 
 	if (out->buffer != out->backbuffer) {
@@ -285,109 +409,198 @@ static int clamp(int a, int l, int h) {
 	return a < l ? l : (a > h ? h : a);
 }
 
+/*
+ * Box blurs keep a running sum of each channel over the window and
+ * divide by multiplying with a reciprocal: (sum * ceil(2^24 / n)) >> 24
+ * is exact for any sum of n < 256 eight-bit values, and never overflows
+ * 32 bits. Windows are clamped to that size.
+ */
+#define BLUR_SHIFT 24
+#define BLUR_MAX_HALF 127
+
+static uint32_t * _blur_reciprocals(int half_radius) {
+	int n = half_radius * 2 + 1;
+	uint32_t * recip = malloc(sizeof(uint32_t) * (n + 1));
+	recip[0] = 0;
+	for (int i = 1; i <= n; ++i) {
+		recip[i] = ((1U << BLUR_SHIFT) + i - 1) / i;
+	}
+	return recip;
+}
+
+#ifndef NO_SSE
+typedef __m128i blur_sum_t;
+
+static inline __m128i _blur_unpack(uint32_t p) {
+	__m128i z = _mm_setzero_si128();
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p), z), z);
+}
+
+static inline blur_sum_t _blur_zero(void) {
+	return _mm_setzero_si128();
+}
+
+static inline blur_sum_t _blur_add(blur_sum_t s, uint32_t p) {
+	return _mm_add_epi32(s, _blur_unpack(p));
+}
+
+static inline blur_sum_t _blur_sub(blur_sum_t s, uint32_t p) {
+	return _mm_sub_epi32(s, _blur_unpack(p));
+}
+
+static inline uint32_t _blur_value(blur_sum_t s, uint32_t recip) {
+	__m128i m = _mm_set1_epi32(recip);
+	__m128i even = _mm_srli_epi64(_mm_mul_epu32(s, m), BLUR_SHIFT);
+	__m128i odd  = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(s, 32), m), BLUR_SHIFT);
+	__m128i r = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+	r = _mm_packs_epi32(r, r);
+	return _mm_cvtsi128_si32(_mm_packus_epi16(r, r));
+}
+
+static inline blur_sum_t _blur_load(const uint32_t * sums) {
+	return _mm_loadu_si128((const void *)sums);
+}
+
+static inline void _blur_store(uint32_t * sums, blur_sum_t s) {
+	_mm_storeu_si128((void *)sums, s);
+}
+#else
+typedef struct {
+	uint32_t c[4];
+} blur_sum_t;
+
+static inline blur_sum_t _blur_zero(void) {
+	blur_sum_t s = {{0,0,0,0}};
+	return s;
+}
+
+static inline blur_sum_t _blur_add(blur_sum_t s, uint32_t p) {
+	for (int i = 0; i < 4; ++i) s.c[i] += (p >> (i * 8)) & 0xFF;
+	return s;
+}
+
+static inline blur_sum_t _blur_sub(blur_sum_t s, uint32_t p) {
+	for (int i = 0; i < 4; ++i) s.c[i] -= (p >> (i * 8)) & 0xFF;
+	return s;
+}
+
+static inline uint32_t _blur_value(blur_sum_t s, uint32_t recip) {
+	uint32_t out = 0;
+	for (int i = 0; i < 4; ++i) out |= ((s.c[i] * recip) >> BLUR_SHIFT) << (i * 8);
+	return out;
+}
+
+static inline blur_sum_t _blur_load(const uint32_t * sums) {
+	blur_sum_t s;
+	memcpy(s.c, sums, sizeof(s.c));
+	return s;
+}
+
+static inline void _blur_store(uint32_t * sums, blur_sum_t s) {
+	memcpy(sums, s.c, sizeof(s.c));
+}
+#endif
+
+/*
+ * Each output pixel is the average of the pixels within half_radius of
+ * it, counting only those that fall inside the context.
+ */
+__attribute__((__force_align_arg_pointer__))
 static void _box_blur_horizontal(gfx_context_t * _src, int radius) {
 	int w = _src->width;
 	int h = _src->height;
-	int half_radius = radius / 2;
-	uint32_t * out_color = calloc(sizeof(uint32_t), w);
+	int half_radius = clamp(radius / 2, 0, BLUR_MAX_HALF);
+	uint32_t * out_color = malloc(sizeof(uint32_t) * w);
+	uint32_t * recip = _blur_reciprocals(half_radius);
 
 	for (int y = 0; y < h; y++) {
+		uint32_t * row = (uint32_t *)&GFX(_src, 0, y);
+		blur_sum_t sum = _blur_zero();
 		int hits = 0;
-		int r = 0;
-		int g = 0;
-		int b = 0;
-		int a = 0;
-		for (int x = -half_radius; x < w; x++) {
-			int old_p = x - half_radius - 1;
-			if (old_p >= 0)
-			{
-				uint32_t col = GFX(_src, clamp(old_p,0,w-1), y);
-				if (col) {
-					r -= _RED(col);
-					g -= _GRE(col);
-					b -= _BLU(col);
-					a -= _ALP(col);
-				}
-				hits--;
-			}
 
-			int newPixel = x + half_radius;
-			if (newPixel < w) {
-				uint32_t col = GFX(_src, clamp(newPixel,0,w-1), y);
-				if (col != 0) {
-					r += _RED(col);
-					g += _GRE(col);
-					b += _BLU(col);
-					a += _ALP(col);
-				}
+		for (int x = 0; x < half_radius && x < w; ++x) {
+			sum = _blur_add(sum, row[x]);
+			hits++;
+		}
+
+		for (int x = 0; x < w; x++) {
+			if (x + half_radius < w) {
+				sum = _blur_add(sum, row[x + half_radius]);
 				hits++;
 			}
-
-			if (x >= 0 && x < w) {
-				out_color[x] = rgba(r / hits, g / hits, b / hits, a / hits);
+			if (x - half_radius - 1 >= 0) {
+				sum = _blur_sub(sum, row[x - half_radius - 1]);
+				hits--;
 			}
+			out_color[x] = _blur_value(sum, recip[hits]);
 		}
 
-		if (!_is_in_clip(_src, y)) continue;
-		for (int x = 0; x < w; x++) {
-			GFX(_src,x,y) = out_color[x];
+		int32_t spans[GFX_MAX_CLIP_RECTS][2];
+		int n = gfx_clip_spans(_src, y, 0, w, spans);
+		for (int i = 0; i < n; ++i) {
+			memcpy(&row[spans[i][0]], &out_color[spans[i][0]], (spans[i][1] - spans[i][0]) * sizeof(uint32_t));
 		}
 	}
 
+	free(recip);
 	free(out_color);
 }
 
+/*
+ * The vertical pass walks rows rather than columns, keeping one running
+ * sum per column, so it reads memory in order. Rows are blurred in
+ * place; the originals of the last few are kept in a small ring for the
+ * trailing edge of the window.
+ */
+__attribute__((__force_align_arg_pointer__))
 static void _box_blur_vertical(gfx_context_t * _src, int radius) {
 	int w = _src->width;
 	int h = _src->height;
-	int half_radius = radius / 2;
-
-	uint32_t * out_color = calloc(sizeof(uint32_t), h);
-
-	for (int x = 0; x < w; x++) {
-		int hits = 0;
-		int r = 0;
-		int g = 0;
-		int b = 0;
-		int a = 0;
-		for (int y = -half_radius; y < h; y++) {
-			int old_p = y - half_radius - 1;
-			if (old_p >= 0) {
-				uint32_t col = GFX(_src,x,clamp(old_p,0,h-1));
-				if (col != 0) {
-					r -= _RED(col);
-					g -= _GRE(col);
-					b -= _BLU(col);
-					a -= _ALP(col);
-				}
-				hits--;
-			}
-
-			int newPixel = y + half_radius;
-			if (newPixel < h) {
-				uint32_t col = GFX(_src,x,clamp(newPixel,0,h-1));
-				if (col != 0)
-				{
-					r += _RED(col);
-					g += _GRE(col);
-					b += _BLU(col);
-					a += _ALP(col);
-				}
-				hits++;
-			}
+	int half_radius = clamp(radius / 2, 0, BLUR_MAX_HALF);
+	int ring_rows = half_radius + 2;
+	uint32_t * sums = calloc(sizeof(uint32_t) * 4, w);
+	uint32_t * ring = malloc(sizeof(uint32_t) * w * ring_rows);
+	uint32_t * out_color = malloc(sizeof(uint32_t) * w);
+	uint32_t * recip = _blur_reciprocals(half_radius);
+	int hits = 0;
+
+	for (int y = 0; y < half_radius && y < h; ++y) {
+		uint32_t * row = (uint32_t *)&GFX(_src, 0, y);
+		for (int x = 0; x < w; ++x) {
+			_blur_store(&sums[x * 4], _blur_add(_blur_load(&sums[x * 4]), row[x]));
+		}
+		hits++;
+	}
 
-			if (y >= 0 && y < h) {
-				out_color[y] = rgba(r / hits, g / hits, b / hits, a / hits);
-			}
+	for (int y = 0; y < h; y++) {
+		uint32_t * row = (uint32_t *)&GFX(_src, 0, y);
+		uint32_t * add = (y + half_radius < h) ? (uint32_t *)&GFX(_src, 0, y + half_radius) : NULL;
+		uint32_t * sub = (y - half_radius - 1 >= 0) ? &ring[((y - half_radius - 1) % ring_rows) * w] : NULL;
+
+		if (add) hits++;
+		if (sub) hits--;
+
+		for (int x = 0; x < w; ++x) {
+			blur_sum_t sum = _blur_load(&sums[x * 4]);
+			if (add) sum = _blur_add(sum, add[x]);
+			if (sub) sum = _blur_sub(sum, sub[x]);
+			_blur_store(&sums[x * 4], sum);
+			out_color[x] = _blur_value(sum, recip[hits]);
 		}
 
-		for (int y = 0; y < h; y++) {
-			if (!_is_in_clip(_src, y)) continue;
-			GFX(_src,x,y) = out_color[y];
+		memcpy(&ring[(y % ring_rows) * w], row, w * sizeof(uint32_t));
+
+		int32_t spans[GFX_MAX_CLIP_RECTS][2];
+		int n = gfx_clip_spans(_src, y, 0, w, spans);
+		for (int i = 0; i < n; ++i) {
+			memcpy(&row[spans[i][0]], &out_color[spans[i][0]], (spans[i][1] - spans[i][0]) * sizeof(uint32_t));
 		}
 	}
 
+	free(recip);
 	free(out_color);
+	free(ring);
+	free(sums);
 }
 
 void blur_context_box(gfx_context_t * _src, int radius) {
@@ -395,6 +608,12 @@ void blur_context_box(gfx_context_t * _src, int radius) {
 	_box_blur_vertical(_src,radius);
 }
 
+void blur_context_gaussian(gfx_context_t * _src, int radius, int passes) {
+	for (int i = 0; i < passes; ++i) {
+		blur_context_box(_src, radius);
+	}
+}
+
 void load_sprite(sprite_t * sprite, char * filename) {
 	/* Open the requested binary */
 	FILE * image = fopen(filename, "r");
@@ -404,9 +623,14 @@ void load_sprite(sprite_t * sprite, char * filename) {
 	image_size = ftell(image);
 	fseek(image, 0, SEEK_SET);
 
-	/* Alright, we have the length */
-	char * bufferb = malloc(image_size);
-	fread(bufferb, image_size, 1, image);
+	/* Alright, we have the length; map it if we can, read it if we must */
+	int mapped = 1;
+	char * bufferb = mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fileno(image), 0);
+	if (bufferb == MAP_FAILED) {
+		mapped = 0;
+		bufferb = malloc(image_size);
+		fread(bufferb, image_size, 1, image);
+	}
 
 	if (bufferb[0] == 'B' && bufferb[1] == 'M') {
 		/* Bitmaps */
@@ -516,7 +740,11 @@ void load_sprite(sprite_t * sprite, char * filename) {
 
 _cleanup_sprite:
 	fclose(image);
-	free(bufferb);
+	if (mapped) {
+		munmap(bufferb, image_size);
+	} else {
+		free(bufferb);
+	}
 }
 
 #ifndef NO_SSE
@@ -531,124 +759,291 @@ __attribute__((constructor)) static void _masks(void) {
 }
 #endif
 
-__attribute__((__force_align_arg_pointer__))
-void draw_sprite(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y) {
+/* Scale every channel of a premultiplied pixel by k/255, rounding */
+static inline uint32_t _scale_pixel(uint32_t p, uint16_t k) {
+	uint32_t rb = (p & 0x00FF00FF) * k + 0x00800080;
+	uint32_t ag = ((p >> 8) & 0x00FF00FF) * k + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+	ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+	return rb | ag;
+}
 
-	int32_t _left   = max(x, 0);
-	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	if (sprite->alpha == ALPHA_MASK) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y), SMASKS(sprite, _x, _y));
-			}
-		}
-	} else if (sprite->alpha == ALPHA_EMBEDDED) {
-		/* Alpha embedded is the most important step. */
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-#ifdef NO_SSE
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
-#else
-			uint16_t _x = 0;
-
-			/* Ensure alignment */
-			for (; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				if (!((uintptr_t)&GFX(ctx, x + _x, y + _y) & 15))
-					break;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
-			for (; _x < sprite->width - 3; _x += 4) {
-				if (x + _x < _left || y + _y < _top || y + _y > _bottom) {
-					continue;
-				}
-				if (x + _x + 3 > _right)
-					break;
+/* 0.0-1.0 to the k for _scale_pixel */
+static inline uint16_t _alpha_to_k(float alpha) {
+	if (alpha <= 0.0) return 0;
+	if (alpha >= 1.0) return 255;
+	return (uint16_t)(alpha * 255.0 + 0.5);
+}
 
-				__m128i d = _mm_load_si128((void *)&GFX(ctx, x + _x, y + _y));
-				__m128i s = _mm_loadu_si128((void *)&SPRITE(sprite, _x, _y));
+#ifndef NO_SSE
+/*
+ * Blend four premultiplied pixels, already unpacked to 16 bits per
+ * channel in s_l/s_h, over the four in d; returns the packed result.
+ */
+static inline __m128i _blend4_rgba(__m128i d, __m128i s_l, __m128i s_h) {
+	__m128i d_l, d_h;
 
-				__m128i d_l, d_h;
-				__m128i s_l, s_h;
+	// unpack destination
+	d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+	d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
 
-				// unpack destination
-				d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
-				d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
+	__m128i a_l, a_h;
+	__m128i t_l, t_h;
 
-				// unpack source
-				s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
-				s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+	// extract source alpha RGBA → AAAA
+	a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_h, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
 
-				__m128i a_l, a_h;
-				__m128i t_l, t_h;
+	// negate source alpha
+	t_l = _mm_xor_si128(a_l, mask00ff);
+	t_h = _mm_xor_si128(a_h, mask00ff);
 
-				// extract source alpha RGBA → AAAA
-				a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
-				a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_h, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	// apply source alpha to destination
+	d_l = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_l,t_l),mask0080),mask0101);
+	d_h = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_h,t_h),mask0080),mask0101);
 
-				// negate source alpha
-				t_l = _mm_xor_si128(a_l, mask00ff);
-				t_h = _mm_xor_si128(a_h, mask00ff);
+	// combine source and destination
+	d_l = _mm_adds_epu8(s_l,d_l);
+	d_h = _mm_adds_epu8(s_h,d_h);
 
-				// apply source alpha to destination
-				d_l = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_l,t_l),mask0080),mask0101);
-				d_h = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_h,t_h),mask0080),mask0101);
+	// pack low + high
+	return _mm_packus_epi16(d_l,d_h);
+}
+#endif
+
+/*
+ * Blend `count` premultiplied pixels from src over dst.
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _blend_span_rgba(uint32_t * dst, const uint32_t * src, int32_t count) {
+	int32_t i = 0;
+#ifndef NO_SSE
+	/* Ensure alignment */
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+	for (; i + 3 < count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
 
-				// combine source and destination
-				d_l = _mm_adds_epu8(s_l,d_l);
-				d_h = _mm_adds_epu8(s_h,d_h);
+		// unpack source
+		__m128i s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+		__m128i s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
 
-				// pack low + high and write back to memory
-				_mm_storeu_si128((void*)&GFX(ctx, x + _x, y + _y), _mm_packus_epi16(d_l,d_h));
-			}
-			for (; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
+		_mm_store_si128((void*)&dst[i], _blend4_rgba(d, s_l, s_h));
+	}
 #endif
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], src[i]);
+	}
+}
+
+/*
+ * As above, with the source faded by k/255 first.
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _blend_span_rgba_alpha(uint32_t * dst, const uint32_t * src, int32_t count, uint16_t k) {
+	int32_t i = 0;
+#ifndef NO_SSE
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], _scale_pixel(src[i], k));
+	}
+	__m128i kk = _mm_set1_epi16(k);
+	for (; i + 3 < count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+
+		// unpack and fade source
+		__m128i s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+		__m128i s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+		s_l = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(s_l,kk),mask0080),mask0101);
+		s_h = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(s_h,kk),mask0080),mask0101);
+
+		_mm_store_si128((void*)&dst[i], _blend4_rgba(d, s_l, s_h));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], _scale_pixel(src[i], k));
+	}
+}
+
+/*
+ * alpha_blend() for a span: the red channel of each mask pixel says
+ * how much of the (unmultiplied) source to mix in.
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _blend_span_mask(uint32_t * dst, const uint32_t * src, const uint32_t * mask, int32_t count) {
+	int32_t i = 0;
+#ifndef NO_SSE
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend(dst[i], src[i], mask[i]);
+	}
+	__m128i low_byte = _mm_set1_epi32(0xFF);
+	__m128i alpha_byte = _mm_set1_epi32(0xFF000000);
+	for (; i + 3 < count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+		__m128i m = _mm_loadu_si128((void *)&mask[i]);
+
+		// mask red → AAAA per pixel
+		__m128i a = _mm_and_si128(_mm_srli_epi32(m, 16), low_byte);
+		__m128i aa = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+		__m128i a_l = _mm_unpacklo_epi32(aa, aa);
+		__m128i a_h = _mm_unpackhi_epi32(aa, aa);
+
+		__m128i d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+		__m128i d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
+		__m128i s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+		__m128i s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+
+		// d * (255 - a) + s * a, over 255
+		d_l = _mm_add_epi16(_mm_mullo_epi16(d_l, _mm_xor_si128(a_l, mask00ff)), _mm_mullo_epi16(s_l, a_l));
+		d_h = _mm_add_epi16(_mm_mullo_epi16(d_h, _mm_xor_si128(a_h, mask00ff)), _mm_mullo_epi16(s_h, a_h));
+		d_l = _mm_mulhi_epu16(_mm_adds_epu16(d_l,mask0080),mask0101);
+		d_h = _mm_mulhi_epu16(_mm_adds_epu16(d_h,mask0080),mask0101);
+		__m128i color = _mm_packus_epi16(d_l, d_h);
+
+		// alpha is the saturating sum of the mask and the destination alpha
+		__m128i alpha = _mm_adds_epu8(_mm_and_si128(d, alpha_byte), _mm_slli_epi32(a, 24));
+
+		_mm_store_si128((void*)&dst[i], _mm_or_si128(_mm_andnot_si128(alpha_byte, color), alpha));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend(dst[i], src[i], mask[i]);
+	}
+}
+
+/*
+ * Copy a span of opaque pixels; with `blank`, pixels of exactly that
+ * colour are left alone (ALPHA_INDEXED).
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _copy_span_opaque(uint32_t * dst, const uint32_t * src, int32_t count, int indexed, uint32_t blank) {
+	int32_t i = 0;
+#ifndef NO_SSE
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		if (!indexed || src[i] != blank) dst[i] = src[i] | 0xFF000000;
+	}
+	__m128i alpha_byte = _mm_set1_epi32(0xFF000000);
+	__m128i blanks = _mm_set1_epi32(blank);
+	for (; i + 3 < count; i += 4) {
+		__m128i s = _mm_loadu_si128((void *)&src[i]);
+		__m128i out = _mm_or_si128(s, alpha_byte);
+		if (indexed) {
+			__m128i keep = _mm_cmpeq_epi32(s, blanks);
+			__m128i d = _mm_load_si128((void *)&dst[i]);
+			out = _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, out));
 		}
-	} else if (sprite->alpha == ALPHA_INDEXED) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				if (SPRITE(sprite, _x, _y) != sprite->blank) {
-					GFX(ctx, x + _x, y + _y) = SPRITE(sprite, _x, _y) | 0xFF000000;
-				}
-			}
-		}
-	} else if (sprite->alpha == ALPHA_FORCE_SLOW_EMBEDDED) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-#if 1
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-#else
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(rgba(255,255,0,255), SPRITE(sprite, _x, _y));
+		_mm_store_si128((void*)&dst[i], out);
+	}
+#endif
+	for (; i < count; ++i) {
+		if (!indexed || src[i] != blank) dst[i] = src[i] | 0xFF000000;
+	}
+}
+
+/*
+ * Set a span to one colour.
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _fill_span(uint32_t * dst, uint32_t color, int32_t count) {
+	int32_t i = 0;
+#ifndef NO_SSE
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = color;
+	}
+	__m128i c = _mm_set1_epi32(color);
+	for (; i + 3 < count; i += 4) {
+		_mm_store_si128((void*)&dst[i], c);
+	}
 #endif
+	for (; i < count; ++i) {
+		dst[i] = color;
+	}
+}
+
+/*
+ * Blend one premultiplied colour over a span.
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _blend_span_color(uint32_t * dst, uint32_t color, int32_t count) {
+	if (_ALP(color) == 255) {
+		_fill_span(dst, color, count);
+		return;
+	}
+	if (_ALP(color) == 0) return;
+	int32_t i = 0;
+#ifndef NO_SSE
+	for (; i < count && ((uintptr_t)&dst[i] & 15); ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], color);
+	}
+	__m128i s = _mm_set1_epi32(color);
+	__m128i s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+	__m128i s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+	for (; i + 3 < count; i += 4) {
+		__m128i d = _mm_load_si128((void *)&dst[i]);
+		_mm_store_si128((void*)&dst[i], _blend4_rgba(d, s_l, s_h));
+	}
+#endif
+	for (; i < count; ++i) {
+		dst[i] = alpha_blend_rgba(dst[i], color);
+	}
+}
+
+void draw_coverage_mask(gfx_context_t * ctx, int32_t x, int32_t y, const uint8_t * mask, int32_t width, int32_t height, const uint32_t colors[256]) {
+	if (width <= 0 || height <= 0) return;
+
+	uint32_t row[width];
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	int32_t left = max(x, 0);
+	int32_t right = min(x + width, ctx->width);
+
+	for (int32_t j = max(0, -y); j < height && y + j < (int32_t)ctx->height; ++j) {
+		const uint8_t * m = &mask[j * width];
+		int n = gfx_clip_spans(ctx, y + j, left, right, spans);
+		for (int s = 0; s < n; ++s) {
+			int32_t l = spans[s][0], r = spans[s][1];
+			/* Glyph rows are mostly empty at the ends */
+			while (l < r && !m[l - x]) l++;
+			while (r > l && !m[r - 1 - x]) r--;
+			if (l == r) continue;
+			for (int32_t i = l; i < r; ++i) {
+				row[i - l] = colors[m[i - x]];
 			}
+			_blend_span_rgba((uint32_t *)&GFX(ctx, l, y + j), row, r - l);
 		}
-	} else {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = SPRITE(sprite, _x, _y) | 0xFF000000;
+	}
+}
+
+void draw_sprite(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y) {
+
+	int32_t _left   = max(x, 0);
+	int32_t _top    = max(y, 0);
+	int32_t _right  = min(x + sprite->width,  ctx->width);
+	int32_t _bottom = min(y + sprite->height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			int32_t start = spans[i][0] - x;
+			int32_t end   = spans[i][1] - x;
+			uint32_t * dst = &GFX(ctx, x + start, y + _y);
+			uint32_t * src = &SPRITE(sprite, start, _y);
+			if (sprite->alpha == ALPHA_MASK) {
+				_blend_span_mask(dst, src, &SMASKS(sprite, start, _y), end - start);
+			} else if (sprite->alpha == ALPHA_EMBEDDED) {
+				/* Alpha embedded is the most important step. */
+				_blend_span_rgba(dst, src, end - start);
+			} else if (sprite->alpha == ALPHA_INDEXED) {
+				_copy_span_opaque(dst, src, end - start, 1, sprite->blank);
+			} else if (sprite->alpha == ALPHA_FORCE_SLOW_EMBEDDED) {
+				for (int32_t _x = start; _x < end; ++_x) {
+					GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
+				}
+			} else {
+				_copy_span_opaque(dst, src, end - start, 0, 0);
 			}
 		}
 	}
@@ -661,7 +1056,7 @@ void draw_line(gfx_context_t * ctx, int32_t x0, int32_t x1, int32_t y0, int32_t
 	int sy = (y0 < y1) ? 1 : -1;
 	int error = deltax - deltay;
 	while (1) {
-		if (x0 >= 0 && y0 >= 0 && x0 < ctx->width && y0 < ctx->height) {
+		if (_is_drawable(ctx, x0, y0)) {
 			GFX(ctx, x0, y0) = color;
 		}
 		if (x0 == x1 && y0 == y1) break;
@@ -686,7 +1081,7 @@ void draw_line_thick(gfx_context_t * ctx, int32_t x0, int32_t x1, int32_t y0, in
 	while (1) {
 		for (char j = -thickness; j <= thickness; ++j) {
 			for (char i = -thickness; i <= thickness; ++i) {
-				if (x0 + i >= 0 && x0 + i < ctx->width && y0 + j >= 0 && y0 + j < ctx->height) {
+				if (_is_drawable(ctx, x0 + i, y0 + j)) {
 					GFX(ctx, x0 + i, y0 + j) = color;
 				}
 			}
@@ -706,9 +1101,13 @@ void draw_line_thick(gfx_context_t * ctx, int32_t x0, int32_t x1, int32_t y0, in
 
 
 void draw_fill(gfx_context_t * ctx, uint32_t color) {
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
 	for (uint16_t y = 0; y < ctx->height; ++y) {
-		for (uint16_t x = 0; x < ctx->width; ++x) {
-			GFX(ctx, x, y) = color;
+		int n = gfx_clip_spans(ctx, y, 0, ctx->width, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t x = spans[i][0]; x < spans[i][1]; ++x) {
+				GFX(ctx, x, y) = color;
+			}
 		}
 	}
 }
@@ -743,21 +1142,119 @@ uint32_t getBilinearFilteredPixelColor(sprite_t * tex, double u, double v) {
 	return rgb(r_RED,r_GRE,r_BLU) & (0xFFFFFF + ((uint32_t)r_ALP << 24));
 }
 
+#define SCALE_CHUNK 256
+
+/*
+ * Sample `count` pixels of row _y of `sprite` stretched to width x height,
+ * starting at column _x, with 16.16 fixed-point coordinates and 8-bit
+ * bilinear weights. Only for sprites that keep their alpha in the bitmap.
+ */
+__attribute__((__force_align_arg_pointer__))
+static void _sample_scaled_row(sprite_t * sprite, uint16_t width, uint16_t height, int32_t _x, int32_t _y, int32_t count, uint32_t * out) {
+	uint32_t step_x = ((uint32_t)sprite->width << 16) / width;
+	uint32_t step_y = ((uint32_t)sprite->height << 16) / height;
+
+	uint32_t v = (uint32_t)_y * step_y;
+	int32_t y0 = v >> 16;
+	int32_t y1 = min(y0 + 1, sprite->height - 1);
+	uint16_t wy = (v >> 8) & 0xFF;
+	uint32_t * row0 = &SPRITE(sprite, 0, y0);
+	uint32_t * row1 = &SPRITE(sprite, 0, y1);
+
+	uint32_t u = (uint32_t)_x * step_x;
+#ifndef NO_SSE
+	__m128i wy_b = _mm_set1_epi16(wy);
+	__m128i wy_t = _mm_set1_epi16(256 - wy);
+#endif
+	for (int32_t i = 0; i < count; ++i, u += step_x) {
+		int32_t x0 = u >> 16;
+		int32_t x1 = min(x0 + 1, sprite->width - 1);
+		uint16_t wx = (u >> 8) & 0xFF;
+#ifndef NO_SSE
+		/* Left and right taps side by side, 16 bits per channel */
+		__m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(row0[x0]), _mm_cvtsi32_si128(row0[x1])), _mm_setzero_si128());
+		__m128i bot = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(row1[x0]), _mm_cvtsi32_si128(row1[x1])), _mm_setzero_si128());
+		__m128i col = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, wy_t), _mm_mullo_epi16(bot, wy_b)), 8);
+		__m128i h = _mm_mullo_epi16(col, _mm_set_epi16(wx, wx, wx, wx, 256 - wx, 256 - wx, 256 - wx, 256 - wx));
+		h = _mm_srli_epi16(_mm_add_epi16(h, _mm_srli_si128(h, 8)), 8);
+		out[i] = _mm_cvtsi128_si32(_mm_packus_epi16(h, h));
+#else
+		uint32_t result = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t top = ((row0[x0] >> shift) & 0xFF) * (256 - wx) + ((row0[x1] >> shift) & 0xFF) * wx;
+			uint32_t bot = ((row1[x0] >> shift) & 0xFF) * (256 - wx) + ((row1[x1] >> shift) & 0xFF) * wx;
+			result |= (((top * (256 - wy) + bot * wy) >> 16) & 0xFF) << shift;
+		}
+		out[i] = result;
+#endif
+	}
+}
+
+static int _scales_fast(sprite_t * sprite) {
+	return sprite->alpha == ALPHA_EMBEDDED || sprite->alpha == ALPHA_OPAQUE;
+}
+
+/*
+ * Stretch a sprite to width x height at (x,y), blending with
+ * `k` (255 for none) applied on top of the sprite's own alpha.
+ */
+static void _draw_scaled_fast(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height, uint16_t k) {
+	int32_t _left   = max(x, 0);
+	int32_t _top    = max(y, 0);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	uint32_t row[SCALE_CHUNK];
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; _x += SCALE_CHUNK) {
+				int32_t count = min(SCALE_CHUNK, spans[i][1] - x - _x);
+				uint32_t * dst = &GFX(ctx, x + _x, y + _y);
+				_sample_scaled_row(sprite, width, height, _x, _y, count, row);
+				if (sprite->alpha == ALPHA_OPAQUE) {
+					for (int32_t j = 0; j < count; ++j) row[j] |= 0xFF000000;
+					if (k == 255) {
+						memcpy(dst, row, count * sizeof(uint32_t));
+						continue;
+					}
+				}
+				if (k == 255) {
+					_blend_span_rgba(dst, row, count);
+				} else {
+					_blend_span_rgba_alpha(dst, row, count, k);
+				}
+			}
+		}
+	}
+}
+
 void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height) {
+	if (!width || !height) return;
+	if (_scales_fast(sprite)) {
+		if (width == sprite->width && height == sprite->height) {
+			draw_sprite(ctx, sprite, x, y);
+		} else {
+			_draw_scaled_fast(ctx, sprite, x, y, width, height, 255);
+		}
+		return;
+	}
+
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			if (sprite->alpha > 0) {
-				uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), n_color);
-			} else {
-				GFX(ctx, x + _x, y + _y) = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; ++_x) {
+				if (sprite->alpha > 0) {
+					uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
+					GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), n_color);
+				} else {
+					GFX(ctx, x + _x, y + _y) = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
+				}
 			}
 		}
 	}
@@ -766,17 +1263,15 @@ void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 void draw_sprite_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = SPRITE(sprite, _x, _y);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+	int32_t _right  = min(x + sprite->width,  ctx->width);
+	int32_t _bottom = min(y + sprite->height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	uint16_t k = _alpha_to_k(alpha);
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			int32_t start = spans[i][0] - x;
+			_blend_span_rgba_alpha(&GFX(ctx, x + start, y + _y), &SPRITE(sprite, start, _y), spans[i][1] - spans[i][0], k);
 		}
 	}
 }
@@ -784,34 +1279,42 @@ void draw_sprite_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_
 void draw_sprite_alpha_paint(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha, uint32_t c) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = SPRITE(sprite, _x, _y);
-			uint32_t f_color = rgb(_ALP(n_color) * alpha, 0, 0);
-			GFX(ctx, x + _x, y + _y) = alpha_blend(GFX(ctx, x + _x, y + _y), c, f_color);
+	int32_t _right  = min(x + sprite->width,  ctx->width);
+	int32_t _bottom = min(y + sprite->height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; ++_x) {
+				uint32_t n_color = SPRITE(sprite, _x, _y);
+				uint32_t f_color = rgb(_ALP(n_color) * alpha, 0, 0);
+				GFX(ctx, x + _x, y + _y) = alpha_blend(GFX(ctx, x + _x, y + _y), c, f_color);
+			}
 		}
 	}
 }
 
 void draw_sprite_scaled_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height, float alpha) {
+	if (!width || !height) return;
+	if (_scales_fast(sprite)) {
+		_draw_scaled_fast(ctx, sprite, x, y, width, height, _alpha_to_k(alpha));
+		return;
+	}
+
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; ++_x) {
+				uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
+				uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
+				f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
+				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+			}
 		}
 	}
 }
@@ -828,14 +1331,15 @@ uint32_t interp_colors(uint32_t bottom, uint32_t top, uint8_t interp) {
 void draw_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, uint32_t color) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), color);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; ++_x) {
+				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), color);
+			}
 		}
 	}
 }
@@ -843,18 +1347,65 @@ void draw_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, u
 void draw_rectangle_solid(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, uint32_t color) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			GFX(ctx, x + _x, y + _y) = color;
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int32_t _y = _top - y; _y < _bottom - y; ++_y) {
+		int n = gfx_clip_spans(ctx, y + _y, _left, _right, spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; ++_x) {
+				GFX(ctx, x + _x, y + _y) = color;
+			}
 		}
 	}
 }
 
+/*
+ * Rounded rectangles are drawn a row at a time. Each corner column i
+ * (counted outwards from where the rounding starts) is covered to a
+ * height of sqrt(r² - i²); a row j into the corner is fully covered
+ * where that height is past j and partly where it ends in j. So each
+ * row is one solid span, in the middle, with a few partial pixels at
+ * either end - the same pixels, with the same coverage, that were
+ * once blended one at a time.
+ */
+struct rounded_row {
+	int32_t left, right; /* Solid span */
+	int partial;         /* Corner column of the first partial pixel... */
+	int end;             /* ...and one past the last */
+	int depth;           /* How far into a corner the row is */
+};
+
+static void _rounded_row(int32_t x, int32_t y, uint16_t width, uint16_t height, int radius, const double * heights, int32_t row, struct rounded_row * out) {
+	int j = -1;
+	if (row < y + radius) {
+		j = y + radius - 1 - row;
+	} else if (row >= y + height - radius) {
+		j = row - (y + height - radius);
+	}
+
+	int full = radius;
+	int end = radius;
+	if (j >= 0) {
+		full = 0;
+		while (full < radius && (int)heights[full] > j) full++;
+		end = full;
+		while (end < radius && (int)heights[end] == j) end++;
+	}
+
+	out->left = x + radius - full;
+	out->right = x + width - radius + full;
+	out->partial = full;
+	out->end = end;
+	out->depth = j;
+}
+
+static void _rounded_heights(int radius, double * heights) {
+	for (int i = 0; i < radius; ++i) {
+		heights[i] = sqrt((double)(radius * radius - i * i));
+	}
+}
+
 void draw_rounded_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, int radius, uint32_t color) {
 	/* Draw a rounded rectangle */
 
@@ -866,41 +1417,30 @@ void draw_rounded_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t
 		radius = height / 2;
 	}
 
-	uint32_t c = premultiply(color);
-	for (int row = y; row < y + height; row++){
-		for (int col = x; col < x + width; col++) {
-			if ((col < x + radius || col > x + width - radius - 1) &&
-				(row < y + radius || row > y + height - radius - 1)) {
-				continue;
-			}
-			GFX(ctx, col, row) = alpha_blend_rgba(GFX(ctx, col, row), c);
-		}
-	}
+	double heights[radius + 1];
+	_rounded_heights(radius, heights);
 
-	/* draw the actual rounding */
-	for (int i = 0; i < radius; ++i) {
-		long r2 = radius * radius;
-		long i2 = i * i;
-		long j2 = r2 - i2;
-		double j_max = sqrt((double)j2);
-
-		for (int j = 0; j <= (int)j_max; ++j) {
-			int _x = x + width - radius + i;
-			int _y = y + height - radius + j;
-			int _z = y + radius - j - 1;
-
-			uint32_t c = color;
-			if (j == (int)j_max) {
-				c = premultiply(rgba(_RED(c),_GRE(c),_BLU(c),(int)((double)_ALP(c) * (j_max - (double)j))));
-			} else {
-				c = premultiply(c);
+	uint32_t c = premultiply(color);
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int row = max(y, 0); row < min(y + height, ctx->height); row++){
+		struct rounded_row shape;
+		_rounded_row(x, y, width, height, radius, heights, row, &shape);
+
+		int n = gfx_clip_spans(ctx, row, max(x, 0), min(x + width, ctx->width), spans);
+		for (int i = 0; i < n; ++i) {
+			int32_t l = max(spans[i][0], shape.left);
+			int32_t r = min(spans[i][1], shape.right);
+			if (l < r) _blend_span_color(&GFX(ctx, l, row), c, r - l);
+
+			for (int k = shape.partial; k < shape.end; ++k) {
+				uint32_t p = premultiply(rgba(_RED(color),_GRE(color),_BLU(color),(int)((double)_ALP(color) * (heights[k] - shape.depth))));
+				int32_t cols[2] = {x + radius - k - 1, x + width - radius + k};
+				for (int e = 0; e < 2; ++e) {
+					if (cols[e] >= spans[i][0] && cols[e] < spans[i][1]) {
+						GFX(ctx, cols[e], row) = alpha_blend_rgba(GFX(ctx, cols[e], row), p);
+					}
+				}
 			}
-
-			GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), c);
-			GFX(ctx, _x, _z) = alpha_blend_rgba(GFX(ctx, _x, _z), c);
-			_x = x + radius - i - 1;
-			GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), c);
-			GFX(ctx, _x, _z) = alpha_blend_rgba(GFX(ctx, _x, _z), c);
 		}
 	}
 }
@@ -916,34 +1456,42 @@ void draw_rounded_rectangle_pattern(gfx_context_t * ctx, int32_t x, int32_t y, u
 		radius = height / 2;
 	}
 
-	for (int row = y; row < y + height; row++){
-		for (int col = x; col < x + width; col++) {
-			if ((col < x + radius || col > x + width - radius - 1) &&
-				(row < y + radius || row > y + height - radius - 1)) {
-				continue;
+	double heights[radius + 1];
+	_rounded_heights(radius, heights);
+
+	/* The one pattern we ship only changes down the rectangle, so it is asked once a row */
+	int per_row = pattern == gfx_vertical_gradient_pattern;
+	uint32_t colors[per_row ? 1 : max(width, 1)];
+
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int row = max(y, 0); row < min(y + height, ctx->height); row++){
+		struct rounded_row shape;
+		_rounded_row(x, y, width, height, radius, heights, row, &shape);
+
+		int n = gfx_clip_spans(ctx, row, max(x, 0), min(x + width, ctx->width), spans);
+		for (int i = 0; i < n; ++i) {
+			int32_t l = max(spans[i][0], shape.left);
+			int32_t r = min(spans[i][1], shape.right);
+			if (l < r) {
+				if (per_row) {
+					_blend_span_color(&GFX(ctx, l, row), pattern(l,row,1.0,extra), r - l);
+				} else {
+					for (int32_t col = l; col < r; ++col) {
+						colors[col - l] = pattern(col,row,1.0,extra);
+					}
+					_blend_span_rgba(&GFX(ctx, l, row), colors, r - l);
+				}
 			}
-			GFX(ctx, col, row) = alpha_blend_rgba(GFX(ctx, col, row), pattern(col,row,1.0,extra));
-		}
-	}
 
-	/* draw the actual rounding */
-	for (int i = 0; i < radius; ++i) {
-		long r2 = radius * radius;
-		long i2 = i * i;
-		long j2 = r2 - i2;
-		double j_max = sqrt((double)j2);
-
-		for (int j = 0; j <= (int)j_max; ++j) {
-			int _x = x + width - radius + i;
-			int _y = y + height - radius + j;
-			int _z = y + radius - j - 1;
-
-			double alpha = (j_max - (double)j);
-			GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), pattern(_x,_y,alpha,extra));
-			GFX(ctx, _x, _z) = alpha_blend_rgba(GFX(ctx, _x, _z), pattern(_x,_z,alpha,extra));
-			_x = x + radius - i - 1;
-			GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), pattern(_x,_y,alpha,extra));
-			GFX(ctx, _x, _z) = alpha_blend_rgba(GFX(ctx, _x, _z), pattern(_x,_z,alpha,extra));
+			for (int k = shape.partial; k < shape.end; ++k) {
+				double alpha = heights[k] - shape.depth;
+				int32_t cols[2] = {x + radius - k - 1, x + width - radius + k};
+				for (int e = 0; e < 2; ++e) {
+					if (cols[e] >= spans[i][0] && cols[e] < spans[i][1]) {
+						GFX(ctx, cols[e], row) = alpha_blend_rgba(GFX(ctx, cols[e], row), pattern(cols[e],row,alpha,extra));
+					}
+				}
+			}
 		}
 	}
 }
@@ -991,19 +1539,78 @@ float gfx_line_distance(struct gfx_point * p, struct gfx_point * v, struct gfx_p
 	return gfx_point_distance(p, &v_t);
 }
 
-/**
- * This is slow, but it works...
- *
- * Maybe acceptable for baked UI elements?
+/*
+ * Narrow the run of x for which lo <= k * x + c <= hi down to [*a, *b].
  */
-void draw_line_aa(gfx_context_t * ctx, int x_1, int x_2, int y_1, int y_2, uint32_t color, float thickness) {
-	struct gfx_point v = {(float)x_1, (float)y_1};
-	struct gfx_point w = {(float)x_2, (float)y_2};
+static int _clip_linear(float k, float c, float lo, float hi, float * a, float * b) {
+	if (k == 0.0) return c >= lo && c <= hi;
+	float p = (lo - c) / k;
+	float q = (hi - c) / k;
+	if (k < 0.0) {
+		float t = p; p = q; q = t;
+	}
+	*a = fmax(*a, p);
+	*b = fmin(*b, q);
+	return *a <= *b;
+}
+
+/*
+ * Where row y crosses the points within r of the segment v-w: a box
+ * along the segment with a round cap at each end. It's convex, so the
+ * crossings of the three pieces join into one run, [*lo, *hi].
+ */
+static int _capsule_row(struct gfx_point * v, struct gfx_point * w, float r, float y, float * lo, float * hi) {
+	int found = 0;
+	struct gfx_point * ends[2] = {v, w};
+	for (int i = 0; i < 2; ++i) {
+		float dy = y - ends[i]->y;
+		if (dy * dy >= r * r) continue;
+		float dx = sqrt(r * r - dy * dy);
+		*lo = found ? fmin(*lo, ends[i]->x - dx) : ends[i]->x - dx;
+		*hi = found ? fmax(*hi, ends[i]->x + dx) : ends[i]->x + dx;
+		found = 1;
+	}
+
+	struct gfx_point d = gfx_point_sub(w, v);
+	float lengthlength = gfx_point_dot(&d, &d);
+	if (lengthlength != 0.0) {
+		/* Projection onto the segment in [0,1], and no further than r from it */
+		float py = y - v->y;
+		float a = -HUGE_VAL, b = HUGE_VAL;
+		float reach = r * sqrt(lengthlength);
+		if (_clip_linear(d.x, py * d.y, 0.0, lengthlength, &a, &b) &&
+		    _clip_linear(d.y, -py * d.x, -reach, reach, &a, &b)) {
+			*lo = found ? fmin(*lo, v->x + a) : v->x + a;
+			*hi = found ? fmax(*hi, v->x + b) : v->x + b;
+			found = 1;
+		}
+	}
+
+	return found;
+}
 
-	for (int y = 0; y < ctx->height; ++y) {
-		for (int x = 0; x < ctx->width; ++x) {
+/*
+ * Blend the edge pixels [start, end) of row y by how far they are from
+ * the segment; the square roots are taken a run at a time.
+ */
+static void _line_aa_edge(gfx_context_t * ctx, int y, int start, int end, struct gfx_point * v, struct gfx_point * w_v, float lengthlength, uint32_t color, float thickness) {
+	float dist[256];
+	for (; start < end; start += 256) {
+		int stop = min(start + 256, end);
+		for (int x = start; x < stop; ++x) {
 			struct gfx_point p = {x,y};
-			float d = gfx_line_distance(&p,&v,&w);
+			struct gfx_point v_t = *v;
+			if (lengthlength != 0.0) {
+				struct gfx_point p_v = gfx_point_sub(&p,v);
+				float t = fmax(0.0, fmin(1.0, gfx_point_dot(&p_v,w_v) / lengthlength));
+				v_t.x += w_v->x * t;
+				v_t.y += w_v->y * t;
+			}
+			dist[x - start] = gfx_point_distance_squared(&p, &v_t);
+		}
+		vsqrtf(dist, dist, stop - start);
+		for (int x = start; x < stop; ++x) {
+			float d = dist[x - start];
 			if (d < thickness + 0.5) {
 				if (d < thickness - 0.5) {
 					GFX(ctx,x,y) = color;
@@ -1016,6 +1623,53 @@ void draw_line_aa(gfx_context_t * ctx, int x_1, int x_2, int y_1, int y_2, uint3
 	}
 }
 
+/**
+ * Anti-aliased line, `thickness` out from the segment either way with
+ * round ends.
+ *
+ * Only the rows the line crosses are visited. In each, where the line
+ * starts and stops is worked out directly, both for the full width
+ * and for the part fully inside it: the inside is filled as a span,
+ * and only the pixels in between have their distances measured.
+ */
+void draw_line_aa(gfx_context_t * ctx, int x_1, int x_2, int y_1, int y_2, uint32_t color, float thickness) {
+	struct gfx_point v = {(float)x_1, (float)y_1};
+	struct gfx_point w = {(float)x_2, (float)y_2};
+	struct gfx_point w_v = gfx_point_sub(&w,&v);
+	float lengthlength = gfx_point_distance_squared(&v,&w);
+	float outer = thickness + 0.5;
+	float inner = thickness - 0.5;
+
+	int top = max(0, (int)floor(fmin(v.y, w.y) - outer));
+	int bottom = min(ctx->height, (int)ceil(fmax(v.y, w.y) + outer) + 1);
+
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
+	for (int y = top; y < bottom; ++y) {
+		float lo, hi;
+		if (!_capsule_row(&v, &w, outer, y, &lo, &hi)) continue;
+		int32_t left = max(0, (int)ceil(lo));
+		int32_t right = min(ctx->width, (int)floor(hi) + 1);
+		if (left >= right) continue;
+
+		/* Pixels strictly inside the inner run are solid */
+		int32_t solid_l = right, solid_r = right;
+		if (inner > 0.0 && _capsule_row(&v, &w, inner, y, &lo, &hi)) {
+			solid_l = clamp((int)floor(lo) + 1, left, right);
+			solid_r = clamp((int)ceil(hi), solid_l, right);
+		}
+
+		int n = gfx_clip_spans(ctx, y, left, right, spans);
+		for (int i = 0; i < n; ++i) {
+			int32_t l = spans[i][0], r = spans[i][1];
+			_line_aa_edge(ctx, y, l, min(r, solid_l), &v, &w_v, lengthlength, color, thickness);
+			if (max(l, solid_l) < min(r, solid_r)) {
+				_fill_span(&GFX(ctx, max(l, solid_l), y), color, min(r, solid_r) - max(l, solid_l));
+			}
+			_line_aa_edge(ctx, y, max(l, solid_r), r, &v, &w_v, lengthlength, color, thickness);
+		}
+	}
+}
+
 static void calc_rotation(double x, double y, double px, double py, double s, double c, double * u, double * v) {
 	/* Translate to pivot */
 	x -= px;
@@ -1052,19 +1706,20 @@ void draw_sprite_rotate(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 	int32_t _right  = max(max(ul_x, ll_x), max(ur_x, lr_x));
 	int32_t _bottom = max(max(ul_y, ll_y), max(ur_y, lr_y));
 
+	int32_t spans[GFX_MAX_CLIP_RECTS][2];
 	for (int32_t _y = _top; _y < _bottom; ++_y) {
 		if (_y + y < 0) continue;
 		if (_y + y  >= ctx->height) break;
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (int32_t _x = _left; _x < _right; ++_x) {
-			if (_x + x < 0) continue;
-			if (_x + x >= ctx->width) break;
-			double u, v;
-			calc_rotation(_x + originx, _y + originy, originx, originy, _s, _c, &u, &v);
-			uint32_t n_color = getBilinearFilteredPixelColor(sprite, u / (double)sprite->width, v/(double)sprite->height);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+		int n = gfx_clip_spans(ctx, y + _y, max(x + _left, 0), min(x + _right, ctx->width), spans);
+		for (int i = 0; i < n; ++i) {
+			for (int32_t _x = spans[i][0] - x; _x < spans[i][1] - x; ++_x) {
+				double u, v;
+				calc_rotation(_x + originx, _y + originy, originx, originy, _s, _c, &u, &v);
+				uint32_t n_color = getBilinearFilteredPixelColor(sprite, u / (double)sprite->width, v/(double)sprite->height);
+				uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
+				f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
+				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+			}
 		}
 	}
 }
@@ -2,11 +2,18 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2013-2018 K. Lange
+ *
+ * Open-addressing hash table with linear probing. Each slot keeps
+ * the full hash of its key, so probes only call the comparison
+ * function on a real hash match and growing never rehashes keys.
+ * Removal shifts later entries back instead of leaving tombstones.
  */
 
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
 
+#define HASHMAP_MIN_SIZE 8
+
 unsigned int hashmap_string_hash(void * _key) {
 	unsigned int hash = 0;
 	char * key = (char *)_key;
@@ -28,7 +35,12 @@ void * hashmap_string_dupe(void * key) {
 }
 
 unsigned int hashmap_int_hash(void * key) {
-	return (unsigned int)key;
+	/* Pointers and small integers make poor hashes on their own */
+	unsigned int hash = (unsigned int)key;
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+	return hash;
 }
 
 int hashmap_int_comp(void * a, void * b) {
@@ -44,25 +56,42 @@ static void hashmap_int_free(void * ptr) {
 	return;
 }
 
+static size_t hashmap_round_size(int size) {
+	size_t out = HASHMAP_MIN_SIZE;
+	while ((int)out < size) out <<= 1;
+	return out;
+}
 
-hashmap_t * hashmap_create(int size) {
+static hashmap_entry_t * hashmap_alloc_entries(size_t size) {
+	hashmap_entry_t * entries = malloc(sizeof(hashmap_entry_t) * size);
+	memset(entries, 0x00, sizeof(hashmap_entry_t) * size);
+	return entries;
+}
+
+static hashmap_t * hashmap_alloc(int size) {
 	hashmap_t * map = malloc(sizeof(hashmap_t));
 
+	map->size = hashmap_round_size(size);
+	map->length = 0;
+	map->entries = hashmap_alloc_entries(map->size);
+
+	return map;
+}
+
+hashmap_t * hashmap_create(int size) {
+	hashmap_t * map = hashmap_alloc(size);
+
 	map->hash_func     = &hashmap_string_hash;
 	map->hash_comp     = &hashmap_string_comp;
 	map->hash_key_dup  = &hashmap_string_dupe;
 	map->hash_key_free = &free;
 	map->hash_val_free = &free;
 
-	map->size = size;
-	map->entries = malloc(sizeof(hashmap_entry_t *) * size);
-	memset(map->entries, 0x00, sizeof(hashmap_entry_t *) * size);
-
 	return map;
 }
 
 hashmap_t * hashmap_create_int(int size) {
-	hashmap_t * map = malloc(sizeof(hashmap_t));
+	hashmap_t * map = hashmap_alloc(size);
 
 	map->hash_func     = &hashmap_int_hash;
 	map->hash_comp     = &hashmap_int_comp;
@@ -70,121 +99,148 @@ hashmap_t * hashmap_create_int(int size) {
 	map->hash_key_free = &hashmap_int_free;
 	map->hash_val_free = &free;
 
-	map->size = size;
-	map->entries = malloc(sizeof(hashmap_entry_t *) * size);
-	memset(map->entries, 0x00, sizeof(hashmap_entry_t *) * size);
-
 	return map;
 }
 
-void * hashmap_set(hashmap_t * map, void * key, void * value) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
-		e->key   = map->hash_key_dup(key);
-		e->value = value;
-		e->next = NULL;
-		map->entries[hash] = e;
-		return NULL;
-	} else {
-		hashmap_entry_t * p = NULL;
-		do {
-			if (map->hash_comp(x->key, key)) {
-				void * out = x->value;
-				x->value = value;
-				return out;
-			} else {
-				p = x;
-				x = x->next;
-			}
-		} while (x);
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
-		e->key   = map->hash_key_dup(key);
-		e->value = value;
-		e->next = NULL;
-
-		p->next = e;
-		return NULL;
+/*
+ * Find the slot holding `key`, or the empty slot where it would go.
+ */
+static hashmap_entry_t * hashmap_probe(hashmap_t * map, void * key, unsigned int hash) {
+	size_t mask = map->size - 1;
+	size_t i = hash & mask;
+	while (map->entries[i].used) {
+		hashmap_entry_t * x = &map->entries[i];
+		if (x->hash == hash && map->hash_comp(x->key, key)) {
+			return x;
+		}
+		i = (i + 1) & mask;
 	}
+	return &map->entries[i];
 }
 
-void * hashmap_get(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return NULL;
-	} else {
-		do {
-			if (map->hash_comp(x->key, key)) {
-				return x->value;
-			}
-			x = x->next;
-		} while (x);
-		return NULL;
+/*
+ * Double the table; stored hashes mean keys are never rehashed.
+ */
+static void hashmap_grow(hashmap_t * map) {
+	hashmap_entry_t * old = map->entries;
+	size_t old_size = map->size;
+
+	map->size = old_size * 2;
+	map->entries = hashmap_alloc_entries(map->size);
+
+	size_t mask = map->size - 1;
+	for (size_t i = 0; i < old_size; ++i) {
+		if (!old[i].used) continue;
+		size_t j = old[i].hash & mask;
+		while (map->entries[j].used) {
+			j = (j + 1) & mask;
+		}
+		map->entries[j] = old[i];
 	}
+
+	free(old);
 }
 
-void * hashmap_remove(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return NULL;
-	} else {
-		if (map->hash_comp(x->key, key)) {
-			void * out = x->value;
-			map->entries[hash] = x->next;
-			map->hash_key_free(x->key);
-			map->hash_val_free(x);
-			return out;
-		} else {
-			hashmap_entry_t * p = x;
-			x = x->next;
-			do {
-				if (map->hash_comp(x->key, key)) {
-					void * out = x->value;
-					p->next = x->next;
-					map->hash_key_free(x->key);
-					map->hash_val_free(x);
-					return out;
-				}
-				p = x;
-				x = x->next;
-			} while (x);
-		}
-		return NULL;
+void ** hashmap_get_or_insert(hashmap_t * map, void * key, int * inserted) {
+	unsigned int hash = map->hash_func(key);
+	hashmap_entry_t * x = hashmap_probe(map, key, hash);
+
+	if (x->used) {
+		if (inserted) *inserted = 0;
+		return &x->value;
 	}
+
+	/* Keep the table at most three-quarters full */
+	if ((map->length + 1) * 4 > map->size * 3) {
+		hashmap_grow(map);
+		x = hashmap_probe(map, key, hash);
+	}
+
+	x->key   = map->hash_key_dup(key);
+	x->value = NULL;
+	x->hash  = hash;
+	x->used  = 1;
+	map->length++;
+
+	if (inserted) *inserted = 1;
+	return &x->value;
+}
+
+void * hashmap_set(hashmap_t * map, void * key, void * value) {
+	void ** slot = hashmap_get_or_insert(map, key, NULL);
+	void * out = *slot;
+	*slot = value;
+	return out;
+}
+
+int hashmap_lookup(hashmap_t * map, void * key, void ** value) {
+	hashmap_entry_t * x = hashmap_probe(map, key, map->hash_func(key));
+	if (!x->used) return 0;
+	if (value) *value = x->value;
+	return 1;
+}
+
+void * hashmap_get(hashmap_t * map, void * key) {
+	void * out = NULL;
+	hashmap_lookup(map, key, &out);
+	return out;
 }
 
 int hashmap_has(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return 0;
-	} else {
-		do {
-			if (map->hash_comp(x->key, key)) {
-				return 1;
-			}
-			x = x->next;
-		} while (x);
-		return 0;
+	return hashmap_lookup(map, key, NULL);
+}
+
+void * hashmap_remove(hashmap_t * map, void * key) {
+	hashmap_entry_t * x = hashmap_probe(map, key, map->hash_func(key));
+	if (!x->used) return NULL;
+
+	void * out = x->value;
+	map->hash_key_free(x->key);
+	map->length--;
+
+	/* Pull back any following entries whose probe sequence crossed this slot */
+	size_t mask = map->size - 1;
+	size_t hole = x - map->entries;
+	size_t i = hole;
+	while (1) {
+		i = (i + 1) & mask;
+		hashmap_entry_t * next = &map->entries[i];
+		if (!next->used) break;
+		size_t home = next->hash & mask;
+		/* Stays put if its home lies cyclically in (hole, i] */
+		if (((i - home) & mask) < ((i - hole) & mask)) continue;
+		map->entries[hole] = *next;
+		hole = i;
 	}
+	memset(&map->entries[hole], 0x00, sizeof(hashmap_entry_t));
+
+	return out;
+}
+
+void hashmap_iter_init(hashmap_t * map, hashmap_iter_t * iter) {
+	iter->map = map;
+	iter->index = 0;
+}
 
+int hashmap_iter_next(hashmap_iter_t * iter, void ** key, void ** value) {
+	hashmap_t * map = iter->map;
+	while (iter->index < map->size) {
+		hashmap_entry_t * x = &map->entries[iter->index++];
+		if (x->used) {
+			if (key) *key = x->key;
+			if (value) *value = x->value;
+			return 1;
+		}
+	}
+	return 0;
 }
 
 list_t * hashmap_keys(hashmap_t * map) {
 	list_t * l = list_create();
 
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i];
-		while (x) {
-			list_insert(l, x->key);
-			x = x->next;
+		if (map->entries[i].used) {
+			list_insert(l, map->entries[i].key);
 		}
 	}
 
@@ -195,10 +251,8 @@ list_t * hashmap_values(hashmap_t * map) {
 	list_t * l = list_create();
 
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i];
-		while (x) {
-			list_insert(l, x->value);
-			x = x->next;
+		if (map->entries[i].used) {
+			list_insert(l, map->entries[i].value);
 		}
 	}
 
@@ -207,20 +261,13 @@ list_t * hashmap_values(hashmap_t * map) {
 
 void hashmap_free(hashmap_t * map) {
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i], * p;
-		while (x) {
-			p = x;
-			x = x->next;
-			map->hash_key_free(p->key);
-			map->hash_val_free(p);
+		if (map->entries[i].used) {
+			map->hash_key_free(map->entries[i].key);
 		}
 	}
 	free(map->entries);
 }
 
 int hashmap_is_empty(hashmap_t * map) {
-	for (unsigned int i = 0; i < map->size; ++i) {
-		if (map->entries[i]) return 0;
-	}
-	return 1;
+	return map->length == 0;
 }
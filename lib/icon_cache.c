@@ -7,14 +7,58 @@
  *
  * Used be a few different applications.
  * Probably needs scaling?
+ *
+ * Decoded icons are also published in a shared memory region, so that
+ * an icon is decoded once for the whole system rather than once per
+ * application. Entries are keyed by size and name and remember the file
+ * they came from and its mtime; a process finding an entry only has to
+ * stat() that file to trust it. The region outlives any one process as
+ * long as something holding it (the panel, usually) keeps running.
+ *
+ * Entries are only ever appended: they are filled in under the lock
+ * and then counted, so lookups can read without it.
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <syscall.h>
+#include <sys/stat.h>
+#include <sys/shm.h>
 
 #include <toaru/graphics.h>
 #include <toaru/hashmap.h>
+#include <toaru/png.h>
+#include <toaru/spinlock.h>
+
+#define SHARED_ICONS_KEY   "sys.icons"
+#define SHARED_ICONS_SIZE  0x200000
+#define SHARED_ICONS_SLOTS 512
+#define SHARED_ICONS_MAGIC 0x49434F4E /* ICON */
+
+struct shared_icon {
+	unsigned int hash;
+	uint16_t size;    /* Which cache: 16 or 48 */
+	uint16_t width;
+	uint16_t height;
+	uint16_t alpha;
+	uint32_t mtime;
+	uint32_t offset;  /* Of the bitmap, from the start of the region */
+	char name[64];
+	char path[100];
+};
+
+struct shared_icons {
+	uint32_t magic;
+	volatile int lock;
+	volatile uint32_t count;
+	uint32_t used;    /* Bytes of the region handed out so far */
+	struct shared_icon icons[SHARED_ICONS_SLOTS];
+	/* Bitmaps follow */
+};
+
+static struct shared_icons * shared = NULL;
 
 static hashmap_t * icon_cache_16;
 static hashmap_t * icon_cache_48;
@@ -37,27 +81,153 @@ static char * icon_directories_48[] = {
 	NULL
 };
 
+static unsigned int icon_hash(const char * name, int size) {
+	unsigned int hash = size;
+	while (*name) {
+		hash = hash * 31 + (unsigned char)*name++;
+	}
+	return hash;
+}
+
+static sprite_t * shared_sprite(struct shared_icon * entry) {
+	sprite_t * icon = malloc(sizeof(sprite_t));
+	icon->width  = entry->width;
+	icon->height = entry->height;
+	icon->bitmap = (uint32_t *)((uintptr_t)shared + entry->offset);
+	icon->masks  = NULL;
+	icon->blank  = 0;
+	icon->alpha  = entry->alpha;
+	return icon;
+}
+
+/* Newest entry for this name, or NULL */
+static struct shared_icon * shared_find(const char * name, int size, unsigned int hash, uint32_t count) {
+	for (uint32_t i = count; i > 0; --i) {
+		struct shared_icon * entry = &shared->icons[i - 1];
+		if (entry->hash == hash && entry->size == size && !strcmp(entry->name, name)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static sprite_t * shared_lookup(const char * name, int size) {
+	if (!shared || strlen(name) >= sizeof(shared->icons[0].name)) return NULL;
+
+	uint32_t count = shared->count;
+	__sync_synchronize();
+
+	struct shared_icon * entry = shared_find(name, size, icon_hash(name, size), count);
+	if (!entry) return NULL;
+
+	struct stat st;
+	if (stat(entry->path, &st) || (uint32_t)st.st_mtime != entry->mtime) {
+		return NULL;
+	}
+
+	return shared_sprite(entry);
+}
+
+/*
+ * Offer a freshly decoded icon to everyone else. On success the sprite
+ * is switched over to the shared copy of its bitmap.
+ */
+static void shared_publish(const char * name, int size, const char * path, sprite_t * icon) {
+	if (!shared || strlen(name) >= sizeof(shared->icons[0].name) || strlen(path) >= sizeof(shared->icons[0].path)) return;
+
+	struct stat st;
+	if (stat(path, &st)) return;
+
+	unsigned int hash = icon_hash(name, size);
+	size_t bytes = sizeof(uint32_t) * icon->width * icon->height;
+
+	spin_lock(&shared->lock);
+
+	if (shared->magic != SHARED_ICONS_MAGIC) {
+		/* Fresh region; the kernel hands it over zeroed */
+		shared->used = (sizeof(struct shared_icons) + 15) & ~15;
+		shared->magic = SHARED_ICONS_MAGIC;
+	}
+
+	/* Someone else may have beaten us to it */
+	struct shared_icon * entry = shared_find(name, size, hash, shared->count);
+	if (entry && entry->mtime == (uint32_t)st.st_mtime && !strcmp(entry->path, path)) {
+		spin_unlock(&shared->lock);
+		free(icon->bitmap);
+		icon->bitmap = (uint32_t *)((uintptr_t)shared + entry->offset);
+		return;
+	}
+
+	if (shared->count == SHARED_ICONS_SLOTS || shared->used + bytes > SHARED_ICONS_SIZE) {
+		spin_unlock(&shared->lock);
+		return;
+	}
+
+	entry = &shared->icons[shared->count];
+	entry->hash   = hash;
+	entry->size   = size;
+	entry->width  = icon->width;
+	entry->height = icon->height;
+	entry->alpha  = icon->alpha;
+	entry->mtime  = st.st_mtime;
+	entry->offset = shared->used;
+	strcpy(entry->name, name);
+	strcpy(entry->path, path);
+
+	uint32_t * bitmap = (uint32_t *)((uintptr_t)shared + shared->used);
+	memcpy(bitmap, icon->bitmap, bytes);
+	shared->used = (shared->used + bytes + 15) & ~15;
+
+	__sync_synchronize();
+	shared->count++;
+
+	spin_unlock(&shared->lock);
+
+	free(icon->bitmap);
+	icon->bitmap = bitmap;
+}
+
+static sprite_t * load_icon(const char * name, int size, const char * path) {
+	sprite_t * icon = malloc(sizeof(sprite_t));
+	if (strstr(path, ".png")) {
+		if (load_sprite_png(icon, (char *)path)) {
+			free(icon);
+			return NULL;
+		}
+	} else {
+		load_sprite(icon, (char *)path);
+	}
+	icon->alpha = ALPHA_EMBEDDED;
+	shared_publish(name, size, path, icon);
+	return icon;
+}
+
 __attribute__((constructor))
 static void _init_caches(void) {
+	size_t size = SHARED_ICONS_SIZE;
+	shared = shm_obtain(SHARED_ICONS_KEY, &size);
+	if (shared && size < SHARED_ICONS_SIZE) {
+		shm_release(SHARED_ICONS_KEY);
+		shared = NULL;
+	}
+
 	icon_cache_16 = hashmap_create(10);
 	{ /* Generic fallback icon */
-		sprite_t * app_icon = malloc(sizeof(sprite_t));
-		load_sprite(app_icon, "/usr/share/icons/16/applications-generic.bmp");
-		app_icon->alpha = ALPHA_EMBEDDED;
+		sprite_t * app_icon = shared_lookup("generic", 16);
+		if (!app_icon) app_icon = load_icon("generic", 16, "/usr/share/icons/16/applications-generic.bmp");
 		hashmap_set(icon_cache_16, "generic", app_icon);
 	}
 
 	icon_cache_48 = hashmap_create(10);
 	{ /* Generic fallback icon */
-		sprite_t * app_icon = malloc(sizeof(sprite_t));
-		load_sprite(app_icon, "/usr/share/icons/48/applications-generic.bmp");
-		app_icon->alpha = ALPHA_EMBEDDED;
+		sprite_t * app_icon = shared_lookup("generic", 48);
+		if (!app_icon) app_icon = load_icon("generic", 48, "/usr/share/icons/48/applications-generic.bmp");
 		hashmap_set(icon_cache_48, "generic", app_icon);
 	}
 }
 
 
-static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char ** icon_directories) {
+static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char ** icon_directories, int size) {
 
 	if (!strcmp(name,"")) {
 		/* If a window doesn't have an icon set, return the generic icon */
@@ -68,19 +238,29 @@ static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char *
 	sprite_t * icon = hashmap_get(icon_cache, (void*)name);
 
 	if (!icon) {
+		/* Maybe another process has already decoded it */
+		icon = shared_lookup(name, size);
+		if (icon) {
+			hashmap_set(icon_cache, (void*)name, icon);
+			return icon;
+		}
+
 		/* We don't have an icon cached for this identifier, try search */
 		int i = 0;
 		char path[100];
 		while (icon_directories[i]) {
-			/* Check each path... */
-			sprintf(path, "%s/%s.bmp", icon_directories[i], name);
-			if (access(path, R_OK) == 0) {
-				/* And if we find one, cache it */
-				icon = malloc(sizeof(sprite_t));
-				load_sprite(icon, path);
-				icon->alpha = ALPHA_EMBEDDED;
-				hashmap_set(icon_cache, (void*)name, icon);
-				return icon;
+			/* Check each path, preferring PNGs... */
+			static const char * extensions[] = {"png", "bmp"};
+			for (int e = 0; e < 2; ++e) {
+				snprintf(path, sizeof(path), "%s/%s.%s", icon_directories[i], name, extensions[e]);
+				if (access(path, R_OK) == 0) {
+					/* And if we find one, cache it */
+					icon = load_icon(name, size, path);
+					if (icon) {
+						hashmap_set(icon_cache, (void*)name, icon);
+						return icon;
+					}
+				}
 			}
 			i++;
 		}
@@ -95,9 +275,9 @@ static sprite_t * icon_get_int(const char * name, hashmap_t * icon_cache, char *
 }
 
 sprite_t * icon_get_16(const char * name) {
-	return icon_get_int(name, icon_cache_16, icon_directories_16);
+	return icon_get_int(name, icon_cache_16, icon_directories_16, 16);
 }
 
 sprite_t * icon_get_48(const char * name) {
-	return icon_get_int(name, icon_cache_48, icon_directories_48);
+	return icon_get_int(name, icon_cache_48, icon_directories_48, 48);
 }
@@ -0,0 +1,477 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * libtoaru_inflate: Decompress deflate streams, bare or wrapped as
+ * zlib or gzip data.
+ *
+ * Input is pulled through read_input() in large blocks and output is
+ * handed to write_output() in large blocks as well; the window the
+ * decompressor copies matches from lives in the same buffer, so output
+ * is only ever copied once more when the window slides. Huffman codes
+ * of up to FAST_BITS bits are decoded with a single table lookup,
+ * which covers nearly every symbol in practice.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <toaru/inflate.h>
+#include <toaru/checksum.h>
+
+#define INPUT_SIZE  0x4000
+#define WINDOW_SIZE 0x8000
+#define OUTPUT_SIZE (WINDOW_SIZE * 2) /* Flush and slide once this full */
+#define MAX_MATCH   258
+
+#define FAST_BITS 10
+#define FAST_MASK ((1 << FAST_BITS) - 1)
+
+struct huffman {
+	uint16_t fast[1 << FAST_BITS]; /* symbol << 4 | length, or 0 for longer codes */
+	uint16_t count[16];            /* Codes of each length */
+	uint16_t symbols[288];         /* In canonical order */
+};
+
+struct inflate_state {
+	struct inflate_context * ctx;
+
+	uint8_t  input[INPUT_SIZE];
+	size_t   in_pos;
+	size_t   in_len;
+	int      past_end; /* Zero bytes made up after the input ran out */
+
+	uint32_t bits;
+	int      bit_count;
+
+	uint8_t  output[OUTPUT_SIZE + MAX_MATCH];
+	size_t   out_pos;
+	size_t   out_flushed;
+
+	int      error;
+
+	/* Running checksum of the output, for zlib and gzip trailers */
+	enum { CHECK_NONE, CHECK_ADLER, CHECK_CRC } check;
+	uint32_t sum; /* Adler-32 or CRC32 so far */
+	uint32_t total;
+
+	struct huffman lit;
+	struct huffman dist;
+};
+
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void update_check(struct inflate_state * s, const uint8_t * buf, size_t size) {
+	s->total += size;
+	if (s->check == CHECK_CRC) {
+		s->sum = checksum_crc32(s->sum, buf, size);
+	} else if (s->check == CHECK_ADLER) {
+		s->sum = checksum_adler32(s->sum, buf, size);
+	}
+}
+
+/*
+ * Input
+ */
+static uint8_t next_byte(struct inflate_state * s) {
+	if (s->in_pos == s->in_len) {
+		s->in_pos = 0;
+		s->in_len = s->error ? 0 : s->ctx->read_input(s->ctx, s->input, INPUT_SIZE);
+		if (!s->in_len) {
+			/*
+			 * Up to four bytes can be read ahead into the bit buffer
+			 * without being used; any more and the data is truncated.
+			 */
+			if (++s->past_end > 4) s->error = 1;
+			return 0;
+		}
+	}
+	return s->input[s->in_pos++];
+}
+
+static inline void fill_bits(struct inflate_state * s) {
+	while (s->bit_count <= 24) {
+		s->bits |= (uint32_t)next_byte(s) << s->bit_count;
+		s->bit_count += 8;
+	}
+}
+
+static inline uint32_t get_bits(struct inflate_state * s, int count) {
+	if (!count) return 0;
+	fill_bits(s);
+	uint32_t out = s->bits & ((1u << count) - 1);
+	s->bits >>= count;
+	s->bit_count -= count;
+	return out;
+}
+
+static void align_bits(struct inflate_state * s) {
+	s->bits >>= s->bit_count & 7;
+	s->bit_count -= s->bit_count & 7;
+}
+
+/*
+ * Output
+ */
+static void flush_output(struct inflate_state * s) {
+	size_t size = s->out_pos - s->out_flushed;
+	if (!size || s->error) return;
+	update_check(s, &s->output[s->out_flushed], size);
+	if (s->ctx->write_output(s->ctx, &s->output[s->out_flushed], size)) {
+		s->error = 1;
+	}
+	s->out_flushed = s->out_pos;
+}
+
+static void slide_window(struct inflate_state * s) {
+	flush_output(s);
+	memmove(s->output, &s->output[s->out_pos - WINDOW_SIZE], WINDOW_SIZE);
+	s->out_pos = WINDOW_SIZE;
+	s->out_flushed = WINDOW_SIZE;
+}
+
+/*
+ * Huffman tables
+ */
+static int build_huffman(struct huffman * h, const uint8_t * lengths, int count) {
+	uint16_t offsets[16];
+	uint16_t next_code[16];
+
+	memset(h->count, 0, sizeof(h->count));
+	memset(h->fast, 0, sizeof(h->fast));
+
+	for (int i = 0; i < count; ++i) {
+		h->count[lengths[i]]++;
+	}
+	h->count[0] = 0;
+
+	int left = 1;
+	for (int len = 1; len < 16; ++len) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0) return 1; /* Over-subscribed */
+	}
+
+	offsets[1] = 0;
+	next_code[1] = 0;
+	for (int len = 1; len < 15; ++len) {
+		offsets[len + 1] = offsets[len] + h->count[len];
+		next_code[len + 1] = (next_code[len] + h->count[len]) << 1;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		int len = lengths[i];
+		if (!len) continue;
+		h->symbols[offsets[len]++] = i;
+
+		uint32_t code = next_code[len]++;
+		if (len > FAST_BITS) continue;
+
+		/* Codes are sent most significant bit first */
+		uint32_t reversed = 0;
+		for (int b = 0; b < len; ++b) {
+			reversed = (reversed << 1) | ((code >> b) & 1);
+		}
+		for (uint32_t j = reversed; j < (1 << FAST_BITS); j += (1 << len)) {
+			h->fast[j] = (i << 4) | len;
+		}
+	}
+
+	return 0;
+}
+
+static int decode_slow(struct inflate_state * s, struct huffman * h) {
+	int code = 0, first = 0, index = 0;
+	for (int len = 1; len < 16; ++len) {
+		code |= s->bits & 1;
+		s->bits >>= 1;
+		s->bit_count--;
+		int count = h->count[len];
+		if (code - first < count) {
+			return h->symbols[index + code - first];
+		}
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	s->error = 1;
+	return 0;
+}
+
+static inline int decode_symbol(struct inflate_state * s, struct huffman * h) {
+	fill_bits(s);
+	uint16_t entry = h->fast[s->bits & FAST_MASK];
+	if (entry) {
+		int len = entry & 0xF;
+		s->bits >>= len;
+		s->bit_count -= len;
+		return entry >> 4;
+	}
+	return decode_slow(s, h);
+}
+
+/*
+ * Blocks
+ */
+static int inflate_stored(struct inflate_state * s) {
+	align_bits(s);
+	uint32_t len  = get_bits(s, 16);
+	uint32_t nlen = get_bits(s, 16);
+	if (len != (~nlen & 0xFFFF)) return 1;
+
+	/* Whatever is left in the bit buffer comes first, then straight from the input */
+	while (len && s->bit_count && !s->error) {
+		s->output[s->out_pos++] = get_bits(s, 8);
+		len--;
+		if (s->out_pos >= OUTPUT_SIZE) slide_window(s);
+	}
+
+	while (len && !s->error) {
+		if (s->in_pos == s->in_len) {
+			s->in_pos = 0;
+			s->in_len = s->ctx->read_input(s->ctx, s->input, INPUT_SIZE);
+			if (!s->in_len) return 1;
+		}
+		size_t n = s->in_len - s->in_pos;
+		if (n > len) n = len;
+		if (n > OUTPUT_SIZE - s->out_pos) n = OUTPUT_SIZE - s->out_pos;
+		memcpy(&s->output[s->out_pos], &s->input[s->in_pos], n);
+		s->in_pos += n;
+		s->out_pos += n;
+		len -= n;
+		if (s->out_pos >= OUTPUT_SIZE) slide_window(s);
+	}
+
+	return s->error;
+}
+
+static int inflate_codes(struct inflate_state * s) {
+	while (!s->error) {
+		int symbol = decode_symbol(s, &s->lit);
+
+		if (symbol < 256) {
+			s->output[s->out_pos++] = symbol;
+		} else if (symbol == 256) {
+			return s->error;
+		} else {
+			symbol -= 257;
+			if (symbol >= 29) return 1;
+			size_t len = length_base[symbol] + get_bits(s, length_extra[symbol]);
+
+			int dsym = decode_symbol(s, &s->dist);
+			if (dsym >= 30) return 1;
+			size_t dist = dist_base[dsym] + get_bits(s, dist_extra[dsym]);
+			if (dist > s->out_pos) return 1;
+
+			uint8_t * out = &s->output[s->out_pos];
+			uint8_t * from = out - dist;
+			if (dist >= len) {
+				memcpy(out, from, len);
+			} else {
+				/* Overlapping: repeats the last `dist` bytes */
+				for (size_t i = 0; i < len; ++i) {
+					out[i] = from[i];
+				}
+			}
+			s->out_pos += len;
+		}
+
+		if (s->out_pos >= OUTPUT_SIZE) slide_window(s);
+	}
+	return 1;
+}
+
+static int inflate_fixed(struct inflate_state * s) {
+	static struct huffman fixed_lit, fixed_dist;
+	static int built = 0;
+
+	if (!built) {
+		uint8_t lengths[288];
+		int i = 0;
+		for (; i < 144; ++i) lengths[i] = 8;
+		for (; i < 256; ++i) lengths[i] = 9;
+		for (; i < 280; ++i) lengths[i] = 7;
+		for (; i < 288; ++i) lengths[i] = 8;
+		build_huffman(&fixed_lit, lengths, 288);
+		for (i = 0; i < 30; ++i) lengths[i] = 5;
+		build_huffman(&fixed_dist, lengths, 30);
+		built = 1;
+	}
+
+	memcpy(&s->lit, &fixed_lit, sizeof(struct huffman));
+	memcpy(&s->dist, &fixed_dist, sizeof(struct huffman));
+	return inflate_codes(s);
+}
+
+static int inflate_dynamic(struct inflate_state * s) {
+	static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	uint8_t lengths[288 + 32];
+
+	int nlen  = get_bits(s, 5) + 257;
+	int ndist = get_bits(s, 5) + 1;
+	int ncode = get_bits(s, 4) + 4;
+	if (nlen > 286 || ndist > 30) return 1;
+
+	memset(lengths, 0, 19);
+	for (int i = 0; i < ncode; ++i) {
+		lengths[order[i]] = get_bits(s, 3);
+	}
+	if (build_huffman(&s->lit, lengths, 19)) return 1;
+
+	/* Literal/length and distance code lengths are one run-length coded sequence */
+	int i = 0;
+	while (i < nlen + ndist && !s->error) {
+		int symbol = decode_symbol(s, &s->lit);
+		if (symbol < 16) {
+			lengths[i++] = symbol;
+			continue;
+		}
+		int repeat, value = 0;
+		if (symbol == 16) {
+			if (!i) return 1;
+			value = lengths[i - 1];
+			repeat = 3 + get_bits(s, 2);
+		} else if (symbol == 17) {
+			repeat = 3 + get_bits(s, 3);
+		} else {
+			repeat = 11 + get_bits(s, 7);
+		}
+		if (i + repeat > nlen + ndist) return 1;
+		while (repeat--) {
+			lengths[i++] = value;
+		}
+	}
+	if (s->error || !lengths[256]) return 1;
+
+	if (build_huffman(&s->lit, lengths, nlen)) return 1;
+	if (build_huffman(&s->dist, &lengths[nlen], ndist)) return 1;
+
+	return inflate_codes(s);
+}
+
+static int inflate_blocks(struct inflate_state * s) {
+	int last;
+	do {
+		last = get_bits(s, 1);
+		int type = get_bits(s, 2);
+		int ret;
+		switch (type) {
+			case 0: ret = inflate_stored(s); break;
+			case 1: ret = inflate_fixed(s); break;
+			case 2: ret = inflate_dynamic(s); break;
+			default: ret = 1; break;
+		}
+		if (ret || s->error) return 1;
+	} while (!last);
+
+	flush_output(s);
+	return s->error;
+}
+
+static struct inflate_state * inflate_start(struct inflate_context * ctx) {
+	struct inflate_state * s = malloc(sizeof(struct inflate_state));
+	if (!s) return NULL;
+	s->ctx = ctx;
+	s->in_pos = 0;
+	s->in_len = 0;
+	s->past_end = 0;
+	s->bits = 0;
+	s->bit_count = 0;
+	s->out_pos = 0;
+	s->out_flushed = 0;
+	s->error = 0;
+	s->check = CHECK_NONE;
+	s->sum = 0;
+	s->total = 0;
+	return s;
+}
+
+int deflate_decompress(struct inflate_context * ctx) {
+	struct inflate_state * s = inflate_start(ctx);
+	if (!s) return 1;
+	int ret = inflate_blocks(s);
+	free(s);
+	return ret;
+}
+
+int zlib_decompress(struct inflate_context * ctx) {
+	struct inflate_state * s = inflate_start(ctx);
+	if (!s) return 1;
+
+	int ret = 1;
+	uint32_t cmf = get_bits(s, 8);
+	uint32_t flg = get_bits(s, 8);
+	if ((cmf & 0xF) != 8 || ((cmf << 8) | flg) % 31 || (flg & 0x20)) goto _done;
+
+	s->check = CHECK_ADLER;
+	s->sum = 1;
+	if (inflate_blocks(s)) goto _done;
+
+	align_bits(s);
+	uint32_t adler = get_bits(s, 8) << 24;
+	adler |= get_bits(s, 8) << 16;
+	adler |= get_bits(s, 8) << 8;
+	adler |= get_bits(s, 8);
+	ret = s->error || adler != s->sum;
+
+_done:
+	free(s);
+	return ret;
+}
+
+int gzip_decompress(struct inflate_context * ctx) {
+	struct inflate_state * s = inflate_start(ctx);
+	if (!s) return 1;
+
+	int ret = 1;
+	if (get_bits(s, 8) != 0x1F || get_bits(s, 8) != 0x8B || get_bits(s, 8) != 8) goto _done;
+
+	int flags = get_bits(s, 8);
+	get_bits(s, 16); get_bits(s, 16); /* Modification time */
+	get_bits(s, 16);                  /* Extra flags, OS */
+
+	if (flags & 0x04) { /* FEXTRA */
+		uint32_t len = get_bits(s, 16);
+		while (len-- && !s->error) get_bits(s, 8);
+	}
+	if (flags & 0x08) { /* FNAME */
+		while (get_bits(s, 8) && !s->error);
+	}
+	if (flags & 0x10) { /* FCOMMENT */
+		while (get_bits(s, 8) && !s->error);
+	}
+	if (flags & 0x02) { /* FHCRC */
+		get_bits(s, 16);
+	}
+	if (s->error) goto _done;
+
+	s->check = CHECK_CRC;
+	if (inflate_blocks(s)) goto _done;
+
+	align_bits(s);
+	uint32_t crc = get_bits(s, 16);
+	crc |= get_bits(s, 16) << 16;
+	uint32_t size = get_bits(s, 16);
+	size |= get_bits(s, 16) << 16;
+	ret = s->error || crc != s->sum || size != s->total;
+
+_done:
+	free(s);
+	return ret;
+}
@@ -3,9 +3,15 @@
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2018 K. Lange
  *
- * libtoaru_jpeg: Decode simple JPEGs.
+ * libtoaru_jpeg: Decode JPEGs.
  *
- * Adapted from Raul Aguaviva's Python "micro JPEG visualizer":
+ * Handles baseline and progressive Huffman-coded images with any
+ * chroma subsampling, restart intervals, and grayscale. Huffman codes
+ * are decoded through a lookahead table, blocks go through an integer
+ * IDCT, and images can be decoded straight to 1/2, 1/4 or 1/8 of their
+ * size; at 1/8 the IDCT isn't needed at all.
+ *
+ * Originally adapted from Raul Aguaviva's Python "micro JPEG visualizer":
  *
  * MIT License
  *
@@ -34,34 +40,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 
 #include <toaru/graphics.h>
+#include <toaru/jpeg.h>
 
-#ifndef NO_SSE
-#include <xmmintrin.h>
-#include <emmintrin.h>
-#endif
-
-#if 0
-#include <toaru/trace.h>
-#define TRACE_APP_NAME "jpeg"
-#else
-#define TRACE(...)
-#endif
-
-static sprite_t * sprite = NULL;
-
-/* Byte swap short (because JPEG uses big-endian values) */
-static void swap16(uint16_t * val) {
-	char * a = (char *)val;
-	char b = a[0];
-	a[0] = a[1];
-	a[1] = b;
-}
+#define HUFF_LOOKAHEAD 9 /* Bits resolved with one table lookup */
 
-/* JPEG compontent zig-zag ordering */
-static int zigzag[] = {
+/* JPEG component zig-zag ordering */
+static const uint8_t zigzag[64] = {
 	 0,  1,  8, 16,  9,  2,  3, 10,
 	17, 24, 32, 25, 18, 11,  4,  5,
 	12, 19, 26, 33, 40, 48, 41, 34,
@@ -72,436 +58,806 @@ static int zigzag[] = {
 	53, 60, 61, 54, 47, 55, 62, 63
 };
 
-static uint8_t quant_mapping[3] = {0};
-static uint8_t quant[8][64];
+struct huffman_table {
+	int present;
+	uint8_t  fast[1 << HUFF_LOOKAHEAD];     /* Symbol for a short code... */
+	uint8_t  fast_len[1 << HUFF_LOOKAHEAD]; /* ...and its length, or 0 if longer */
+	int32_t  maxcode[17];  /* Largest code of each length, or -1 */
+	int32_t  delta[17];    /* Code of each length to index in values */
+	uint8_t  values[256];
+};
 
-static int clamp(int col) {
-	if (col > 255) return 255;
-	if (col < 0) return 0;
-	return col;
-}
+struct component {
+	int id;
+	int h, v;          /* Sampling factors */
+	int tq;            /* Quantization table */
+	int dc_table, ac_table;
+	int blocks_w, blocks_h; /* Blocks stored, padded out to whole MCUs */
+	int16_t * coeffs;  /* Quantized coefficients, natural order, 64 per block */
+	int dc_pred;
+	uint8_t * plane;   /* Decoded samples at output scale */
+	int plane_w;
+};
 
-/* YCbCr to RGB conversion */
-static void color_conversion(
-		float Y, float Cb, float Cr,
-		int *R, int *G, int *B
-	) {
-	float r = (Cr*(2.0-2.0*0.299) + Y);
-	float b = (Cb*(2.0-2.0*0.114) + Y);
-	float g = (Y - 0.144 * b - 0.229 * r) / 0.587;
-
-	*R = clamp(r + 128);
-	*G = clamp(g + 128);
-	*B = clamp(b + 128);
-}
+struct jpeg {
+	uint8_t * data;
+	size_t size;
+	size_t pos;
+
+	uint32_t bits;     /* Bit buffer, next bit at the top */
+	int count;         /* Bits in it */
+	int marker;        /* A marker stopped the bit reader */
+	int error;
+
+	int width, height;
+	int progressive;
+	int ncomp;
+	struct component comp[4];
+	int hmax, vmax;
+	int mcus_x, mcus_y;
+	int restart_interval;
+	int eobrun;
+
+	uint16_t quant[4][64]; /* Natural order */
+	struct huffman_table dc[4];
+	struct huffman_table ac[4];
+};
 
-static int xy_to_lin(int x, int y) {
-	return x + y * 8;
+static int read16(struct jpeg * j) {
+	if (j->pos + 2 > j->size) {
+		j->error = 1;
+		return 0;
+	}
+	int val = (j->data[j->pos] << 8) | j->data[j->pos + 1];
+	j->pos += 2;
+	return val;
 }
 
-struct huffman_table {
-	uint8_t lengths[16];
-	uint8_t elements[256];
-} huffman_tables[256] = {0};
-
-struct stream {
-	FILE * file;
-	uint8_t byte;
-	int have;
-	int pos;
-};
+static int read8(struct jpeg * j) {
+	if (j->pos >= j->size) {
+		j->error = 1;
+		return 0;
+	}
+	return j->data[j->pos++];
+}
 
-static void define_quant_table(FILE * f, int len) {
+/*
+ * Bit reader
+ */
 
-	TRACE("Defining quant table");
-	while (len > 0) {
-		uint8_t hdr;
-		fread(&hdr, 1, 1, f);
-		fread(&quant[(hdr) & 0xF], 64, 1, f);
-		len -= 65;
+/* Top up the bit buffer; stuffed zero bytes are dropped, and a marker ends the data */
+static void refill_bits(struct jpeg * j) {
+	while (j->count <= 24) {
+		int byte = 0;
+		if (!j->marker && j->pos < j->size) {
+			byte = j->data[j->pos];
+			if (byte == 0xFF) {
+				int next = (j->pos + 1 < j->size) ? j->data[j->pos + 1] : 0xD9;
+				if (next == 0x00) {
+					j->pos += 2;
+				} else {
+					/* Leave the marker where it is; feed zeroes from here on */
+					j->marker = next;
+					byte = 0;
+				}
+			} else {
+				j->pos++;
+			}
+		}
+		j->bits |= (uint32_t)byte << (24 - j->count);
+		j->count += 8;
 	}
-	TRACE("Done");
 }
 
-static void baseline_dct(FILE * f, int len) {
-
-	struct dct {
-		uint8_t  hdr;
-		uint16_t height;
-		uint16_t width;
-		uint8_t  components;
-	} __attribute__((packed)) dct;
+/* At least 25 bits, enough for any code and its value bits */
+static inline void fill_bits(struct jpeg * j) {
+	if (j->count <= 24) refill_bits(j);
+}
 
-	fread(&dct, sizeof(struct dct), 1, f);
+static inline int get_bits(struct jpeg * j, int n) {
+	if (!n) return 0;
+	fill_bits(j);
+	int val = j->bits >> (32 - n);
+	j->bits <<= n;
+	j->count -= n;
+	return val;
+}
 
-	/* Read image dimensions, each as big-endian 16-bit values */
-	swap16(&dct.height);
-	swap16(&dct.width);
+static inline int get_bit(struct jpeg * j) {
+	return get_bits(j, 1);
+}
 
-	/* We read 7 bytes */
-	len -= sizeof(struct dct);
+/* Turn n bits of magnitude into a signed value */
+static inline int extend(int val, int n) {
+	return (val < (1 << (n - 1))) ? val - (1 << n) + 1 : val;
+}
 
-	TRACE("Image dimensions are %d×%d", dct.width, dct.height);
-	sprite->width  = dct.width;
-	sprite->height = dct.height;
-	sprite->bitmap = malloc(sizeof(uint32_t) * sprite->width * sprite->height);
-	sprite->masks = NULL;
-	sprite->alpha = 0;
-	sprite->blank = 0;
+static inline int receive_extend(struct jpeg * j, int n) {
+	if (!n) return 0;
+	return extend(get_bits(j, n), n);
+}
 
-	TRACE("Loading quantization mappings...");
-	for (int i = 0; i < dct.components; ++i) {
-		/* Quant mapping */
-		struct {
-			uint8_t id;
-			uint8_t samp;
-			uint8_t qtb_id;
-		} __attribute__((packed)) tmp;
+/*
+ * Huffman decoding
+ */
 
-		fread(&tmp, sizeof(tmp), 1, f);
+static int build_huffman(struct huffman_table * t, uint8_t * counts) {
+	uint8_t sizes[256];
+	uint16_t codes[256];
+	int k = 0;
+	int code = 0;
+
+	for (int l = 1; l <= 16; ++l) {
+		t->delta[l] = k - code;
+		for (int i = 0; i < counts[l - 1]; ++i) {
+			if (k >= 256) return 1;
+			sizes[k] = l;
+			codes[k] = code++;
+			k++;
+		}
+		t->maxcode[l] = counts[l - 1] ? code - 1 : -1;
+		code <<= 1;
+	}
 
-		/* There should only be three of these for the images we support. */
-		if (i > 3) {
-			abort();
+	memset(t->fast_len, 0, sizeof(t->fast_len));
+	for (int i = 0; i < k; ++i) {
+		if (sizes[i] > HUFF_LOOKAHEAD) continue;
+		int shift = HUFF_LOOKAHEAD - sizes[i];
+		int base = codes[i] << shift;
+		for (int x = 0; x < (1 << shift); ++x) {
+			t->fast[base + x] = t->values[i];
+			t->fast_len[base + x] = sizes[i];
 		}
+	}
+
+	t->present = 1;
+	return 0;
+}
 
-		quant_mapping[i] = tmp.qtb_id;
+static int decode_huffman(struct jpeg * j, struct huffman_table * t) {
+	fill_bits(j);
 
-		/* 3 bytes were read */
-		len -= 3;
+	int peek = j->bits >> (32 - HUFF_LOOKAHEAD);
+	int len = t->fast_len[peek];
+	if (len) {
+		j->bits <<= len;
+		j->count -= len;
+		return t->fast[peek];
 	}
 
-	/* Skip whatever else might be in this section */
-	if (len > 0) {
-		fseek(f, len, SEEK_CUR);
+	for (len = HUFF_LOOKAHEAD + 1; len <= 16; ++len) {
+		int code = j->bits >> (32 - len);
+		if (code <= t->maxcode[len]) {
+			j->bits <<= len;
+			j->count -= len;
+			return t->values[code + t->delta[len]];
+		}
 	}
+
+	j->error = 1;
+	return 0;
 }
 
-static void define_huffman_table(FILE * f, int len) {
+/*
+ * Sections
+ */
 
-	TRACE("Loading Huffman tables...");
-	while (len > 0) {
-		/* Read header ID */
-		uint8_t hdr;
-		fread(&hdr, 1, 1, f);
-		len--;
+static void define_quant_table(struct jpeg * j, size_t end) {
+	while (j->pos < end && !j->error) {
+		int hdr = read8(j);
+		uint16_t * table = j->quant[hdr & 3];
+		for (int i = 0; i < 64; ++i) {
+			table[zigzag[i]] = (hdr >> 4) ? read16(j) : read8(j);
+		}
+	}
+}
 
-		/* Read length table */
-		fread(huffman_tables[hdr].lengths, 16, 1, f);
-		len -= 16;
+static void define_huffman_table(struct jpeg * j, size_t end) {
+	while (j->pos < end && !j->error) {
+		int hdr = read8(j);
+		struct huffman_table * t = (hdr >> 4) ? &j->ac[hdr & 3] : &j->dc[hdr & 3];
 
-		/* Read Huffman table entries */
-		int o = 0;
+		if (j->pos + 16 > j->size) {
+			j->error = 1;
+			return;
+		}
+		uint8_t counts[16];
+		int total = 0;
 		for (int i = 0; i < 16; ++i) {
-			int l = huffman_tables[hdr].lengths[i];
-			fread(&huffman_tables[hdr].elements[o], l, 1, f);
-			o += l;
-			len -= l;
+			counts[i] = j->data[j->pos++];
+			total += counts[i];
 		}
-	}
+		if (total > 256 || j->pos + total > j->size) {
+			j->error = 1;
+			return;
+		}
+		memcpy(t->values, &j->data[j->pos], total);
+		j->pos += total;
 
-	/* Skip rest of section */
-	if (len > 0) {
-		fseek(f, len, SEEK_CUR);
+		if (build_huffman(t, counts)) {
+			j->error = 1;
+		}
 	}
 }
 
-struct idct {
-	float base[64];
-};
+static void start_of_frame(struct jpeg * j) {
+	read8(j); /* Precision; always 8 for what we support */
+	j->height = read16(j);
+	j->width  = read16(j);
+	j->ncomp  = read8(j);
 
-/**
- * norm_coeff[0] = 0.35355339059
- * norm_coeff[1] = 0.5
- */
-static float cosines[8][8] = {
-	{ 0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059 },
-	{ 0.490392640202,0.415734806151,0.27778511651,0.0975451610081,-0.0975451610081,-0.27778511651,-0.415734806151,-0.490392640202 },
-	{ 0.461939766256,0.191341716183,-0.191341716183,-0.461939766256,-0.461939766256,-0.191341716183,0.191341716183,0.461939766256 },
-	{ 0.415734806151,-0.0975451610081,-0.490392640202,-0.27778511651,0.27778511651,0.490392640202,0.0975451610081,-0.415734806151 },
-	{ 0.353553390593,-0.353553390593,-0.353553390593,0.353553390593,0.353553390593,-0.353553390593,-0.353553390593,0.353553390593 },
-	{ 0.27778511651,-0.490392640202,0.0975451610081,0.415734806151,-0.415734806151,-0.0975451610081,0.490392640202,-0.27778511651 },
-	{ 0.191341716183,-0.461939766256,0.461939766256,-0.191341716183,-0.191341716183,0.461939766256,-0.461939766256,0.191341716183 },
-	{ 0.0975451610081,-0.27778511651,0.415734806151,-0.490392640202,0.490392640202,-0.415734806151,0.27778511651,-0.0975451610081 },
-};
+	if (!j->width || !j->height || (j->ncomp != 1 && j->ncomp != 3)) {
+		j->error = 1;
+		return;
+	}
 
-static float premul[8][8][8][8]= {{{{0}}}};
+	j->hmax = 1;
+	j->vmax = 1;
+	for (int i = 0; i < j->ncomp; ++i) {
+		struct component * c = &j->comp[i];
+		c->id = read8(j);
+		int samp = read8(j);
+		c->h = samp >> 4;
+		c->v = samp & 0xF;
+		c->tq = read8(j) & 3;
+		if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4) {
+			j->error = 1;
+			return;
+		}
+		if (c->h > j->hmax) j->hmax = c->h;
+		if (c->v > j->vmax) j->vmax = c->v;
+	}
 
-static void add_idc(struct idct * self, int n, int m, int coeff) {
-#ifdef NO_SSE
-	for (int y = 0; y < 8; ++y) {
-		for (int x = 0; x < 8; ++x) {
-			self->base[xy_to_lin(x, y)] += premul[n][m][y][x] * coeff;
+	j->mcus_x = (j->width  + j->hmax * 8 - 1) / (j->hmax * 8);
+	j->mcus_y = (j->height + j->vmax * 8 - 1) / (j->vmax * 8);
+
+	for (int i = 0; i < j->ncomp; ++i) {
+		struct component * c = &j->comp[i];
+		c->blocks_w = j->mcus_x * c->h;
+		c->blocks_h = j->mcus_y * c->v;
+		c->coeffs = calloc(c->blocks_w * c->blocks_h, 64 * sizeof(int16_t));
+		if (!c->coeffs) {
+			j->error = 1;
+			return;
 		}
 	}
-#else
-	__m128 c = _mm_set_ps(coeff,coeff,coeff,coeff);
-	for (int y = 0; y < 8; ++y) {
-		__m128 a, b;
-		/* base[y][x] = base[y][x] + premul[n][m][y][x] * coeff */
-
-		/* x = 0..3 */
-		a = _mm_load_ps(&premul[n][m][y][0]);
-		a = _mm_mul_ps(a,c);
-		b = _mm_load_ps(&self->base[xy_to_lin(0,y)]);
-		a = _mm_add_ps(a,b);
-		_mm_store_ps(&self->base[xy_to_lin(0,y)], a);
-
-		/* x = 4..7 */
-		a = _mm_load_ps(&premul[n][m][y][4]);
-		a = _mm_mul_ps(a,c);
-		b = _mm_load_ps(&self->base[xy_to_lin(4,y)]);
-		a = _mm_add_ps(a,b);
-		_mm_store_ps(&self->base[xy_to_lin(4,y)], a);
-	}
-#endif
 }
 
-static void add_zigzag(struct idct * self, int zi, int coeff) {
-	int i = zigzag[zi];
-	int n = i & 0x7;
-	int m = i >> 3;
-	add_idc(self, n, m, coeff);
-}
+/*
+ * Block decoding; coefficients are stored still quantized so that
+ * progressive scans can refine them.
+ */
 
-/* Read a bit from the stream */
-static int get_bit(struct stream * st) {
-	while ((st->pos >> 3) >= st->have) {
-		/* We have finished using the current byte and need to read another one */
-		int t = fgetc(st->file);
-		if (t < 0) {
-			/* EOF */
-			st->byte = 0;
-		} else {
-			st->byte = t;
+static void decode_block(struct jpeg * j, struct component * c, int16_t * block) {
+	int t = decode_huffman(j, &j->dc[c->dc_table]);
+	c->dc_pred += receive_extend(j, t);
+	block[0] = c->dc_pred;
+
+	struct huffman_table * ac = &j->ac[c->ac_table];
+	for (int k = 1; k < 64; ) {
+		int rs = decode_huffman(j, ac);
+		int r = rs >> 4;
+		int s = rs & 0xF;
+		if (!s) {
+			if (r != 15) break;
+			k += 16;
+			continue;
 		}
+		k += r;
+		if (k > 63) break;
+		block[zigzag[k]] = receive_extend(j, s);
+		k++;
+	}
+}
+
+static void decode_dc_progressive(struct jpeg * j, struct component * c, int16_t * block, int ah, int al) {
+	if (!ah) {
+		int t = decode_huffman(j, &j->dc[c->dc_table]);
+		c->dc_pred += receive_extend(j, t);
+		block[0] = c->dc_pred * (1 << al);
+	} else if (get_bit(j)) {
+		block[0] |= 1 << al;
+	}
+}
+
+static void decode_ac_first(struct jpeg * j, struct component * c, int16_t * block, int ss, int se, int al) {
+	if (j->eobrun) {
+		j->eobrun--;
+		return;
+	}
 
-		if (st->byte == 0xFF) {
-			/*
-			 * If we see 0xFF, it's followed by a 0x00
-			 * that should be skipped.
-			 */
-			int tmp = fgetc(st->file);
-			if (tmp != 0) {
-				/*
-				 * If it's *not*, we reached the end of the file - but
-				 * this shouldn't happen.
-				 */
-				st->byte = 0;
+	struct huffman_table * ac = &j->ac[c->ac_table];
+	for (int k = ss; k <= se; ) {
+		int rs = decode_huffman(j, ac);
+		int r = rs >> 4;
+		int s = rs & 0xF;
+		if (!s) {
+			if (r < 15) {
+				/* End of band for this and the next eobrun blocks */
+				j->eobrun = (1 << r) - 1 + get_bits(j, r);
+				break;
 			}
+			k += 16;
+			continue;
 		}
+		k += r;
+		if (k > 63) break;
+		block[zigzag[k]] = receive_extend(j, s) * (1 << al);
+		k++;
+	}
+}
 
-		/* We've seen a new byte */
-		st->have++;
+/* One more bit of an already non-zero coefficient */
+static inline void refine(struct jpeg * j, int16_t * coef, int bit) {
+	if (get_bit(j) && !(*coef & bit)) {
+		*coef += (*coef >= 0) ? bit : -bit;
 	}
+}
+
+static void decode_ac_refine(struct jpeg * j, struct component * c, int16_t * block, int ss, int se, int al) {
+	int bit = 1 << al;
+	int k = ss;
+
+	if (!j->eobrun) {
+		struct huffman_table * ac = &j->ac[c->ac_table];
+		for (; k <= se; k++) {
+			int rs = decode_huffman(j, ac);
+			int r = rs >> 4;
+			int s = rs & 0xF;
+			int value = 0;
+			if (s) {
+				/* Newly non-zero coefficients are always +/- one bit */
+				value = get_bit(j) ? bit : -bit;
+			} else if (r != 15) {
+				j->eobrun = (1 << r) + get_bits(j, r);
+				break;
+			}
 
-	/* Extract appropriate bit from this byte */
-	uint8_t b = st->byte;
-	int s = 7 - (st->pos & 0x7);
+			/* Skip r zero coefficients, refining the non-zero ones passed on the way */
+			while (k <= se) {
+				int16_t * coef = &block[zigzag[k]];
+				if (*coef) {
+					refine(j, coef, bit);
+				} else {
+					if (r == 0) break;
+					r--;
+				}
+				k++;
+			}
+			if (value && k <= se) {
+				block[zigzag[k]] = value;
+			}
+		}
+	}
 
-	/* We move forward one position in the bit stream */
-	st->pos += 1;
-	return (b >> s) & 1;
+	if (j->eobrun) {
+		for (; k <= se; k++) {
+			int16_t * coef = &block[zigzag[k]];
+			if (*coef) {
+				refine(j, coef, bit);
+			}
+		}
+		j->eobrun--;
+	}
 }
 
-/* Advance forward and get the n'th next bit */
-static int get_bitn(struct stream * st, int l) {
-	int val = 0;
-	for (int i = 0; i < l; ++i) {
-		val = val * 2 + get_bit(st);
+/* Skip to and past a restart marker, and start the next interval afresh */
+static void restart(struct jpeg * j) {
+	j->bits = 0;
+	j->count = 0;
+	j->marker = 0;
+	j->eobrun = 0;
+	for (int i = 0; i < j->ncomp; ++i) {
+		j->comp[i].dc_pred = 0;
+	}
+	while (j->pos + 1 < j->size) {
+		if (j->data[j->pos] == 0xFF && j->data[j->pos + 1] >= 0xD0 && j->data[j->pos + 1] <= 0xD7) {
+			j->pos += 2;
+			return;
+		}
+		j->pos++;
 	}
-	return val;
 }
 
-/*
- * Read a Huffman code by reading bits and using
- * the Huffman table.
- */
-static int get_code(struct huffman_table * table, struct stream * st) {
-	int val = 0;
-	int off = 0;
-	int ini = 0;
-
-	for (int i = 0; i < 16; ++i) {
-		val = val * 2 + get_bit(st);
-		if (table->lengths[i] > 0) {
-			if (val - ini < table->lengths[i]) {
-				return table->elements[off + val - ini];
-			}
-			ini = ini + table->lengths[i];
-			off += table->lengths[i];
+static void start_of_scan(struct jpeg * j) {
+	if (!j->ncomp) {
+		j->error = 1;
+		return;
+	}
+
+	int count = read8(j);
+	struct component * scan[4];
+	if (count < 1 || count > j->ncomp) {
+		j->error = 1;
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		int id = read8(j);
+		int tables = read8(j);
+		scan[i] = NULL;
+		for (int c = 0; c < j->ncomp; ++c) {
+			if (j->comp[c].id == id) scan[i] = &j->comp[c];
+		}
+		if (!scan[i]) {
+			j->error = 1;
+			return;
 		}
-		ini *= 2;
+		scan[i]->dc_table = (tables >> 4) & 3;
+		scan[i]->ac_table = tables & 3;
+	}
+	int ss = read8(j);
+	int se = read8(j);
+	int a  = read8(j);
+	int ah = a >> 4;
+	int al = a & 0xF;
+	if (j->error || ss > 63 || se > 63 || ss > se) {
+		j->error = 1;
+		return;
 	}
 
-	/* Invalid */
-	return -1;
-}
+	j->bits = 0;
+	j->count = 0;
+	j->marker = 0;
+	j->eobrun = 0;
+	for (int i = 0; i < j->ncomp; ++i) {
+		j->comp[i].dc_pred = 0;
+	}
 
-/* Decode Huffman codes to values */
-static int decode(int code, int bits) {
-	int l = 1L << (code - 1);
-	if (bits >= l) {
-		return bits;
+	int todo = j->restart_interval;
+
+	if (count == 1) {
+		/* Not interleaved: blocks in raster order, only those covering the image */
+		struct component * c = scan[0];
+		int w = ((j->width  * c->h + j->hmax - 1) / j->hmax + 7) / 8;
+		int h = ((j->height * c->v + j->vmax - 1) / j->vmax + 7) / 8;
+		for (int by = 0; by < h && !j->error; ++by) {
+			for (int bx = 0; bx < w && !j->error; ++bx) {
+				int16_t * block = &c->coeffs[(by * c->blocks_w + bx) * 64];
+				if (!j->progressive) {
+					decode_block(j, c, block);
+				} else if (ss == 0) {
+					decode_dc_progressive(j, c, block, ah, al);
+				} else if (!ah) {
+					decode_ac_first(j, c, block, ss, se, al);
+				} else {
+					decode_ac_refine(j, c, block, ss, se, al);
+				}
+				if (j->restart_interval && !--todo) {
+					restart(j);
+					todo = j->restart_interval;
+				}
+			}
+		}
 	} else {
-		return bits - (2 * l - 1);
+		for (int my = 0; my < j->mcus_y && !j->error; ++my) {
+			for (int mx = 0; mx < j->mcus_x && !j->error; ++mx) {
+				for (int i = 0; i < count; ++i) {
+					struct component * c = scan[i];
+					for (int y = 0; y < c->v; ++y) {
+						for (int x = 0; x < c->h; ++x) {
+							int bx = mx * c->h + x;
+							int by = my * c->v + y;
+							int16_t * block = &c->coeffs[(by * c->blocks_w + bx) * 64];
+							if (!j->progressive) {
+								decode_block(j, c, block);
+							} else {
+								/* Only DC scans can be interleaved */
+								decode_dc_progressive(j, c, block, ah, al);
+							}
+						}
+					}
+				}
+				if (j->restart_interval && !--todo) {
+					restart(j);
+					todo = j->restart_interval;
+				}
+			}
+		}
+	}
+
+	/* Find whatever marker comes next */
+	while (j->pos + 1 < j->size) {
+		if (j->data[j->pos] == 0xFF && j->data[j->pos + 1] != 0x00 &&
+			!(j->data[j->pos + 1] >= 0xD0 && j->data[j->pos + 1] <= 0xD7)) {
+			break;
+		}
+		j->pos++;
 	}
 }
 
-/* Build IDCT matrix */
-static struct idct * build_matrix(struct idct * i, struct stream * st, int idx, uint8_t * quant, int oldcoeff, int * outcoeff) {
-	memset(i, 0, sizeof(struct idct));
+/*
+ * Output
+ */
 
-	int code = get_code(&huffman_tables[idx], st);
-	int bits = get_bitn(st, code);
-	int dccoeff = decode(code, bits) + oldcoeff;
+#define CONST_BITS 13
+#define PASS1_BITS 2
+#define FIX(x) ((int32_t)((x) * (1 << CONST_BITS) + 0.5))
+#define DESCALE(x,n) (((x) + (1 << ((n) - 1))) >> (n))
 
-	add_zigzag(i, 0, dccoeff * quant[0]);
-	int l = 1;
+static inline uint8_t clamp8(int x) {
+	if (x < 0) return 0;
+	if (x > 255) return 255;
+	return x;
+}
 
-	while (l < 64) {
-		code = get_code(&huffman_tables[16+idx], st);
-		if (code == 0) break;
-		if (code > 15) {
-			l += (code >> 4);
-			code = code & 0xF;
+/*
+ * Integer IDCT (the Loeffler-Ligtenberg-Moschytz factorization, as used
+ * by the IJG's jidctint.c): columns into a workspace, then rows into
+ * level-shifted samples.
+ */
+#define IDCT_1D(s0,s1,s2,s3,s4,s5,s6,s7) \
+	int32_t z1, z2, z3, z4, z5; \
+	int32_t t0, t1, t2, t3, t10, t11, t12, t13; \
+	z2 = s2; z3 = s6; \
+	z1 = (z2 + z3) * FIX(0.541196100); \
+	t2 = z1 + z3 * -FIX(1.847759065); \
+	t3 = z1 + z2 * FIX(0.765366865); \
+	t0 = ((int32_t)(s0) + (s4)) * (1 << CONST_BITS); \
+	t1 = ((int32_t)(s0) - (s4)) * (1 << CONST_BITS); \
+	t10 = t0 + t3; t13 = t0 - t3; \
+	t11 = t1 + t2; t12 = t1 - t2; \
+	t0 = s7; t1 = s5; t2 = s3; t3 = s1; \
+	z1 = t0 + t3; z2 = t1 + t2; z3 = t0 + t2; z4 = t1 + t3; \
+	z5 = (z3 + z4) * FIX(1.175875602); \
+	t0 *= FIX(0.298631336); t1 *= FIX(2.053119869); \
+	t2 *= FIX(3.072711026); t3 *= FIX(1.501321110); \
+	z1 *= -FIX(0.899976223); z2 *= -FIX(2.562915447); \
+	z3 *= -FIX(1.961570560); z4 *= -FIX(0.390180644); \
+	z3 += z5; z4 += z5; \
+	t0 += z1 + z3; t1 += z2 + z4; \
+	t2 += z2 + z3; t3 += z1 + z4;
+
+static void idct_block(int16_t * in, uint16_t * q, uint8_t * out, int stride) {
+	int32_t ws[64];
+
+	for (int x = 0; x < 8; ++x) {
+		int16_t * c = &in[x];
+		uint16_t * qc = &q[x];
+		int32_t * w = &ws[x];
+		if (!c[8] && !c[16] && !c[24] && !c[32] && !c[40] && !c[48] && !c[56]) {
+			int32_t dc = (c[0] * qc[0]) * (1 << PASS1_BITS);
+			for (int y = 0; y < 8; ++y) w[y * 8] = dc;
+			continue;
 		}
-		bits = get_bitn(st, code);
-		int coeff = decode(code, bits);
-		add_zigzag(i, l, coeff * quant[l]);
-		l += 1;
+		IDCT_1D(c[0] * qc[0], c[8] * qc[8], c[16] * qc[16], c[24] * qc[24],
+		        c[32] * qc[32], c[40] * qc[40], c[48] * qc[48], c[56] * qc[56]);
+		int n = CONST_BITS - PASS1_BITS;
+		w[0]  = DESCALE(t10 + t3, n);
+		w[56] = DESCALE(t10 - t3, n);
+		w[8]  = DESCALE(t11 + t2, n);
+		w[48] = DESCALE(t11 - t2, n);
+		w[16] = DESCALE(t12 + t1, n);
+		w[40] = DESCALE(t12 - t1, n);
+		w[24] = DESCALE(t13 + t0, n);
+		w[32] = DESCALE(t13 - t0, n);
 	}
 
-	*outcoeff = dccoeff;
-	return i;
+	for (int y = 0; y < 8; ++y) {
+		int32_t * w = &ws[y * 8];
+		uint8_t * o = &out[y * stride];
+		IDCT_1D(w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7]);
+		int n = CONST_BITS + PASS1_BITS + 3;
+		o[0] = clamp8(DESCALE(t10 + t3, n) + 128);
+		o[7] = clamp8(DESCALE(t10 - t3, n) + 128);
+		o[1] = clamp8(DESCALE(t11 + t2, n) + 128);
+		o[6] = clamp8(DESCALE(t11 - t2, n) + 128);
+		o[2] = clamp8(DESCALE(t12 + t1, n) + 128);
+		o[5] = clamp8(DESCALE(t12 - t1, n) + 128);
+		o[3] = clamp8(DESCALE(t13 + t0, n) + 128);
+		o[4] = clamp8(DESCALE(t13 - t0, n) + 128);
+	}
 }
 
-/* Set pixel in sprite buffer with bounds checking */
-static void set_pixel(int x, int y, uint32_t color) {
-	if ((x < sprite->width) && (y < sprite->height)) {
-		SPRITE(sprite,x,y) = color;
+/*
+ * Samples of one block at 1 / (1 << shift) scale: the DC term alone
+ * at 1/8, otherwise the full IDCT averaged down.
+ */
+static void output_block(int16_t * in, uint16_t * q, uint8_t * out, int stride, int shift) {
+	if (shift == 0) {
+		idct_block(in, q, out, stride);
+		return;
+	}
+
+	if (shift == 3) {
+		*out = clamp8(DESCALE(in[0] * q[0], 3) + 128);
+		return;
+	}
+
+	uint8_t full[64];
+	idct_block(in, q, full, 8);
+	int size = 8 >> shift;
+	int step = 1 << shift;
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			int sum = 0;
+			for (int yy = 0; yy < step; ++yy) {
+				for (int xx = 0; xx < step; ++xx) {
+					sum += full[(y * step + yy) * 8 + x * step + xx];
+				}
+			}
+			out[y * stride + x] = (sum + (1 << (2 * shift - 1))) >> (2 * shift);
+		}
 	}
 }
 
-/* Concvert YCbCr values to RGB pixels */
-static void draw_matrix(int x, int y, struct idct * L, struct idct * cb, struct idct * cr) {
-	for (int yy = 0; yy < 8; ++yy) {
-		for (int xx = 0; xx < 8; ++xx) {
-			int o = xy_to_lin(xx,yy);
-			int r, g, b;
-			color_conversion(L->base[o], cb->base[o], cr->base[o], &r, &g, &b);
-			uint32_t c = 0xFF000000 | (r << 16) | (g << 8) | b;
-			set_pixel((x * 8 + xx), (y * 8 + yy), c);
+static int render_planes(struct jpeg * j, int shift) {
+	int size = 8 >> shift;
+	for (int i = 0; i < j->ncomp; ++i) {
+		struct component * c = &j->comp[i];
+		c->plane_w = c->blocks_w * size;
+		c->plane = malloc(c->plane_w * c->blocks_h * size);
+		if (!c->plane) return 1;
+		for (int by = 0; by < c->blocks_h; ++by) {
+			for (int bx = 0; bx < c->blocks_w; ++bx) {
+				output_block(&c->coeffs[(by * c->blocks_w + bx) * 64], j->quant[c->tq],
+					&c->plane[by * size * c->plane_w + bx * size], c->plane_w, shift);
+			}
 		}
 	}
+	return 0;
 }
 
-static void start_of_scan(FILE * f, int len) {
+/* Fixed point YCbCr (JFIF) to RGB coefficients, 16 fractional bits */
+#define CR_R  91881  /* 1.402 */
+#define CB_G  22554  /* 0.344136 */
+#define CR_G  46802  /* 0.714136 */
+#define CB_B 116130  /* 1.772 */
+
+static void color_convert(struct jpeg * j, sprite_t * sprite) {
+	struct component * y_c = &j->comp[0];
+
+	if (j->ncomp == 1) {
+		for (int y = 0; y < sprite->height; ++y) {
+			uint8_t * row = &y_c->plane[y * y_c->plane_w];
+			uint32_t * out = &sprite->bitmap[y * sprite->width];
+			for (int x = 0; x < sprite->width; ++x) {
+				uint32_t l = row[x];
+				out[x] = 0xFF000000 | (l << 16) | (l << 8) | l;
+			}
+		}
+		return;
+	}
 
-	TRACE("Reading image data");
+	struct component * cb_c = &j->comp[1];
+	struct component * cr_c = &j->comp[2];
 
-	/* Skip header */
-	fseek(f, len, SEEK_CUR);
+	/* Chroma is upsampled by repeating samples */
+	int y_h  = j->hmax / y_c->h,  y_v  = j->vmax / y_c->v;
+	int cb_h = j->hmax / cb_c->h, cb_v = j->vmax / cb_c->v;
+	int cr_h = j->hmax / cr_c->h, cr_v = j->vmax / cr_c->v;
 
-	/* Initialize bit stream */
-	struct stream _st = {0};
-	_st.file = f;
-	struct stream * st = &_st;
+	/* Which luma or chroma sample each output column takes */
+	int * columns = malloc(sizeof(int) * sprite->width * 3);
+	for (int x = 0; x < sprite->width; ++x) {
+		columns[x * 3]     = x / y_h;
+		columns[x * 3 + 1] = x / cb_h;
+		columns[x * 3 + 2] = x / cr_h;
+	}
 
-	int old_lum = 0;
-	int old_crd = 0;
-	int old_cbd = 0;
-	for (int y = 0; y < sprite->height / 8 + !!(sprite->height & 0x7); ++y) {
-		TRACE("Star row %d", y );
-		for (int x = 0; x < sprite->width / 8 + !!(sprite->width & 0x7); ++x) {
-			if (y >= 134) {
-				TRACE("Start col %d", x);
-			}
+	for (int y = 0; y < sprite->height; ++y) {
+		uint8_t * y_row  = &y_c->plane[(y / y_v) * y_c->plane_w];
+		uint8_t * cb_row = &cb_c->plane[(y / cb_v) * cb_c->plane_w];
+		uint8_t * cr_row = &cr_c->plane[(y / cr_v) * cr_c->plane_w];
+		uint32_t * out = &sprite->bitmap[y * sprite->width];
+		int * col = columns;
+		for (int x = 0; x < sprite->width; ++x, col += 3) {
+			int l  = (y_row[col[0]] << 16) + 0x8000;
+			int cb = cb_row[col[1]] - 128;
+			int cr = cr_row[col[2]] - 128;
+			int r = (l + CR_R * cr) >> 16;
+			int g = (l - CB_G * cb - CR_G * cr) >> 16;
+			int b = (l + CB_B * cb) >> 16;
+			out[x] = 0xFF000000 | (clamp8(r) << 16) | (clamp8(g) << 8) | clamp8(b);
+		}
+	}
 
-			/* Build matrices */
-			struct idct matL, matCr, matCb;
-			build_matrix(&matL,  st, 0, quant[quant_mapping[0]], old_lum, &old_lum);
-			build_matrix(&matCb, st, 1, quant[quant_mapping[1]], old_cbd, &old_cbd);
-			build_matrix(&matCr, st, 1, quant[quant_mapping[2]], old_crd, &old_crd);
+	free(columns);
+}
 
-			if (y >= 134) {
-				TRACE("Draw col %d", x);
-			}
-			draw_matrix(x, y, &matL, &matCb, &matCr);
+static int decode(struct jpeg * j) {
+	if (j->size < 2 || j->data[0] != 0xFF || j->data[1] != 0xD8) return 1;
+	j->pos = 2;
+
+	while (!j->error) {
+		/* Markers may be padded with any number of 0xFFs */
+		while (j->pos < j->size && j->data[j->pos] != 0xFF) j->pos++;
+		while (j->pos < j->size && j->data[j->pos] == 0xFF) j->pos++;
+		if (j->pos >= j->size) break;
+
+		int marker = j->data[j->pos++];
+		if (marker == 0xD9) break; /* End of image */
+		if (marker == 0xD8 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+
+		int len = read16(j);
+		if (j->error || len < 2 || j->pos + len - 2 > j->size) return 1;
+		size_t end = j->pos + len - 2;
+
+		switch (marker) {
+			case 0xC0: /* Baseline */
+			case 0xC1: /* Extended sequential */
+			case 0xC2: /* Progressive */
+				if (j->ncomp) return 1;
+				j->progressive = (marker == 0xC2);
+				start_of_frame(j);
+				break;
+			case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+			case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+				/* Lossless, hierarchical, arithmetic coding */
+				return 1;
+			case 0xC4:
+				define_huffman_table(j, end);
+				break;
+			case 0xDB:
+				define_quant_table(j, end);
+				break;
+			case 0xDD:
+				j->restart_interval = read16(j);
+				break;
+			case 0xDA:
+				/* Leaves us at the marker after the scan's data */
+				start_of_scan(j);
+				continue;
 		}
+
+		j->pos = end;
 	}
 
-	TRACE("Done.");
+	return j->error || !j->ncomp;
+}
+
+static void jpeg_free(struct jpeg * j) {
+	for (int i = 0; i < 4; ++i) {
+		free(j->comp[i].coeffs);
+		free(j->comp[i].plane);
+	}
+	free(j->data);
+	free(j);
 }
 
-int load_sprite_jpg(sprite_t * tsprite, char * filename) {
+int load_sprite_jpg_scaled(sprite_t * sprite, char * filename, int scale) {
+	int shift = 0;
+	while (shift < 3 && (1 << shift) < scale) shift++;
+
 	FILE * f = fopen(filename, "r");
 	if (!f) {
 		return 1;
 	}
 
-	sprite = tsprite;
-
-	memset(huffman_tables, 0, sizeof(huffman_tables));
-
-	if (premul[0][0][0][0] == 0.0) {
-		for (int n = 0; n < 8; ++n) {
-			for (int m = 0; m < 8; ++m) {
-				for (int y = 0; y < 8; ++y) {
-					for (int x = 0; x < 8; ++x) {
-						premul[n][m][y][x] = cosines[n][x] * cosines[m][y];
-					}
-				}
-			}
-		}
+	struct jpeg * j = calloc(1, sizeof(struct jpeg));
+	fseek(f, 0, SEEK_END);
+	j->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	j->data = malloc(j->size ? j->size : 1);
+	if (fread(j->data, 1, j->size, f) != j->size) {
+		j->error = 1;
 	}
+	fclose(f);
 
-	while (1) {
-
-		/* Read a header */
-		uint16_t hdr;
-		int r = fread(&hdr, 2, 1, f);
-		if (r <= 0) {
-			/* EOF */
-			break;
-		}
+	if (j->error || decode(j)) {
+		jpeg_free(j);
+		return 1;
+	}
 
-		/* These headers are stored big-endian */
-		swap16(&hdr);
+	int step = 1 << shift;
+	sprite->width  = (j->width  + step - 1) / step;
+	sprite->height = (j->height + step - 1) / step;
+	sprite->bitmap = malloc(sizeof(uint32_t) * sprite->width * sprite->height);
+	sprite->masks = NULL;
+	sprite->alpha = 0;
+	sprite->blank = 0;
 
-		if (hdr == 0xffd8) {
-			/* No data */
-			continue;
-		} else if (hdr == 0xffd9) {
-			/* End of file */
-			break;
-		} else {
-			/* Regular sections with data start with a length */
-			uint16_t len;
-			fread(&len, 2, 1, f);
-			swap16(&len);
-
-			/* Subtract two because the length includes itself */
-			len -= 2;
-
-			if (hdr == 0xffdb) {
-				define_quant_table(f, len);
-			} else if (hdr == 0xffc0) {
-				baseline_dct(f, len);
-			} else if (hdr == 0xffc4) {
-				define_huffman_table(f, len);
-			} else if (hdr == 0xffda) {
-				start_of_scan(f, len);
-				/* End immediately after reading the data */
-				break;
-			} else {
-				TRACE("Unknown header\n");
-				fseek(f, len, SEEK_CUR);
-			}
-		}
+	if (!sprite->bitmap || render_planes(j, shift)) {
+		free(sprite->bitmap);
+		sprite->bitmap = NULL;
+		jpeg_free(j);
+		return 1;
 	}
 
-	fclose(f);
-
+	color_convert(j, sprite);
+	jpeg_free(j);
 	return 0;
 }
+
+int load_sprite_jpg(sprite_t * sprite, char * filename) {
+	return load_sprite_jpg_scaled(sprite, filename, 1);
+}
@@ -15,6 +15,14 @@
 
 #include <toaru/list.h>
 
+#ifdef _KERNEL_
+#	include <kernel/slab.h>
+slab_cache_t list_node_cache = SLAB_CACHE("list_node", node_t, NULL);
+#	define node_alloc() slab_alloc(&list_node_cache)
+#else
+#	define node_alloc() malloc(sizeof(node_t))
+#endif
+
 void list_destroy(list_t * list) {
 	/* Free all of the contents of a list */
 	node_t * n = list->head;
@@ -55,7 +63,7 @@ void list_append(list_t * list, node_t * node) {
 
 node_t * list_insert(list_t * list, void * item) {
 	/* Insert an item into a list */
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -92,7 +100,7 @@ void list_append_after(list_t * list, node_t * before, node_t * node) {
 }
 
 node_t * list_insert_after(list_t * list, node_t * before, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -128,7 +136,7 @@ void list_append_before(list_t * list, node_t * after, node_t * node) {
 }
 
 node_t * list_insert_before(list_t * list, node_t * after, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -4,6 +4,11 @@
  * Copyright (C) 2018 K. Lange
  *
  * Markup parser.
+ *
+ * Input can be given a character at a time or a buffer at a time; with
+ * buffers, text between tags is taken in one go. Tag and attribute
+ * names are interned, so they can be compared by pointer against
+ * markup_intern() and aren't allocated for each tag.
  */
 #include <stdio.h>
 #include <toaru/markup.h>
@@ -18,16 +23,34 @@ struct markup_state {
 	/* Private stuff */
 	struct markup_tag tag;
 	size_t len;
-	char data[64];
+	size_t size;
+	char * data;
 	char * attr;
 };
 
+static hashmap_t * interned = NULL;
+
+char * markup_intern(const char * name) {
+	if (!interned) {
+		interned = hashmap_create(16);
+	}
+	char * out = hashmap_get(interned, (void *)name);
+	if (!out) {
+		out = strdup(name);
+		hashmap_set(interned, out, out);
+	}
+	return out;
+}
+
 struct markup_state * markup_init(void * user, markup_callback_tag_open open, markup_callback_tag_close close, markup_callback_data data) {
-	struct markup_state * out = malloc(sizeof(out));
+	struct markup_state * out = malloc(sizeof(struct markup_state));
 
 	out->state = 0;
 	out->user = user;
 	out->len = 0;
+	out->size = 64;
+	out->data = malloc(out->size);
+	out->attr = NULL;
 
 	out->callback_tag_open  = open;
 	out->callback_tag_close = close;
@@ -36,29 +59,42 @@ struct markup_state * markup_init(void * user, markup_callback_tag_open open, ma
 	return out;
 }
 
+static void _append(struct markup_state * state, const char * s, size_t len) {
+	if (state->len + len + 1 > state->size) {
+		while (state->len + len + 1 > state->size) {
+			state->size *= 2;
+		}
+		state->data = realloc(state->data, state->size);
+	}
+	memcpy(state->data + state->len, s, len);
+	state->len += len;
+}
+
+static void _reset(struct markup_state * state) {
+	state->data[0] = '\0';
+	state->len = 0;
+}
+
 static void _dump_buffer(struct markup_state * state) {
 	if (state->len) {
 		state->data[state->len] = '\0';
 		state->callback_data(state, state->user, state->data);
-		state->data[0] = '\0';
-		state->len = 0;
+		_reset(state);
 	}
 }
 
 static void _finish_name(struct markup_state * state) {
 	state->data[state->len] = '\0';
-	state->tag.name = strdup(state->data);
-	state->tag.options = hashmap_create(5);
-	state->data[0] = '\0';
-	state->len = 0;
+	state->tag.name = markup_intern(state->data);
+	state->tag.options = NULL;
+	_reset(state);
 	state->state = 2;
 }
 
 static void _finish_close(struct markup_state * state) {
 	state->data[state->len] = '\0';
-	state->callback_tag_close(state, state->user, state->data);
-	state->data[0] = '\0';
-	state->len = 0;
+	state->callback_tag_close(state, state->user, markup_intern(state->data));
+	_reset(state);
 	state->state = 0;
 }
 
@@ -67,32 +103,36 @@ static void _finish_tag(struct markup_state * state) {
 	state->state = 0;
 }
 
+static void _set_option(struct markup_state * state, char * name, char * value) {
+	if (!state->tag.options) {
+		state->tag.options = hashmap_create(5);
+	}
+	free(hashmap_set(state->tag.options, name, strdup(value)));
+}
+
 static void _finish_bare_attr(struct markup_state * state) {
+	if (!state->len) return;
 	state->data[state->len] = '\0';
-	hashmap_set(state->tag.options, state->data, strdup(state->data));
-	state->data[0] = '\0';
-	state->len = 0;
+	_set_option(state, markup_intern(state->data), state->data);
+	_reset(state);
 }
 
 static void _finish_attr(struct markup_state * state) {
 	state->data[state->len] = '\0';
-	state->attr = strdup(state->data);
-	state->data[0] = '\0';
-	state->len = 0;
+	state->attr = markup_intern(state->data);
+	_reset(state);
 	state->state = 4;
 }
 
 static void _finish_attr_value(struct markup_state * state) {
 	state->data[state->len] = '\0';
-	hashmap_set(state->tag.options, state->attr, strdup(state->data));
-	free(state->attr);
-	state->data[0] = '\0';
-	state->len = 0;
+	_set_option(state, state->attr, state->data);
+	_reset(state);
 	state->state = 2;
 }
 
 int markup_free_tag(struct markup_tag * tag) {
-	free(tag->name);
+	if (!tag->options) return 0;
 	list_t * keys = hashmap_keys(tag->options);
 	if (keys->length) {
 		foreach(node, keys) {
@@ -102,23 +142,21 @@ int markup_free_tag(struct markup_tag * tag) {
 	list_free(keys);
 	free(keys);
 	hashmap_free(tag->options);
+	free(tag->options);
+	tag->options = NULL;
 	return 0;
 }
 
 int markup_parse(struct markup_state * state, char c) {
 	switch (state->state) {
 		case 0: /* STATE_NORMAL */
-			if (state->len == 63) {
-				_dump_buffer(state);
-			}
 			switch (c) {
 				case '<':
 					_dump_buffer(state);
 					state->state = 1;
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, &c, 1);
 					return 0;
 			}
 			break;
@@ -139,8 +177,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_name(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, &c, 1);
 					return 0;
 			}
 			break;
@@ -157,8 +194,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_attr(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, &c, 1);
 					return 0;
 			}
 			return 0;
@@ -168,8 +204,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_close(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, &c, 1);
 					return 0;
 			}
 			break;
@@ -183,8 +218,7 @@ int markup_parse(struct markup_state * state, char c) {
 					_finish_tag(state);
 					return 0;
 				default:
-					state->data[state->len] = c;
-					state->len++;
+					_append(state, &c, 1);
 					return 0;
 			}
 			break;
@@ -195,14 +229,31 @@ int markup_parse(struct markup_state * state, char c) {
 	return 0;
 }
 
+int markup_parse_buffer(struct markup_state * state, const char * buf, size_t len) {
+	const char * end = buf + len;
+	while (buf < end) {
+		if (state->state == 0) {
+			/* Take everything up to the next tag at once */
+			const char * tag = memchr(buf, '<', end - buf);
+			_append(state, buf, (tag ? tag : end) - buf);
+			if (!tag) break;
+			buf = tag;
+		}
+		if (markup_parse(state, *buf++)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int markup_finish(struct markup_state * state) {
 	if (state->state != 0) {
 		fprintf(stderr, "unexpected end of data\n");
 		return 1;
 	} else {
 		_dump_buffer(state);
+		free(state->data);
 		free(state);
 		return 0;
 	}
 }
-
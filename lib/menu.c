@@ -26,6 +26,7 @@
 
 #define MENU_ENTRY_HEIGHT 20
 #define MENU_BACKGROUND rgb(239,238,232)
+#define MENU_BORDER rgb(109,111,112)
 #define MENU_ICON_SIZE 16
 
 #define HILIGHT_BORDER_TOP rgb(54,128,205)
@@ -165,6 +166,8 @@ struct MenuEntry * menu_create_normal(const char * icon, const char * action, co
 	out->title = strdup(title);
 	out->action = action ? strdup(action) : NULL;
 	out->callback = callback;
+	out->_rows[0] = out->_rows[1] = NULL;
+	out->_drawn = -1;
 
 	out->rwidth = 50 + string_width(out->title);
 
@@ -230,6 +233,8 @@ struct MenuEntry * menu_create_submenu(const char * icon, const char * action, c
 	out->icon = icon ? strdup(icon) : NULL;
 	out->title = strdup(title);
 	out->action = action ? strdup(action) : NULL;
+	out->_rows[0] = out->_rows[1] = NULL;
+	out->_drawn = -1;
 
 	out->rwidth = 50 + string_width(out->title);
 
@@ -265,11 +270,23 @@ struct MenuEntry * menu_create_separator(void) {
 	out->focus_change = _menu_focus_MenuEntry_Separator;
 	out->rwidth = 10; /* at least a bit please */
 	out->activate = _menu_activate_MenuEntry_Separator;
+	out->_rows[0] = out->_rows[1] = NULL;
+	out->_drawn = -1;
 
 	return (struct MenuEntry *)out;
 }
 
+static void _menu_entry_forget_rows(struct MenuEntry * self) {
+	for (int i = 0; i < 2; ++i) {
+		if (self->_rows[i]) {
+			sprite_free(self->_rows[i]);
+			self->_rows[i] = NULL;
+		}
+	}
+}
+
 void menu_update_title(struct MenuEntry * self, char * new_title) {
+	_menu_entry_forget_rows(self);
 
 	if (self->_type == MenuEntry_Normal) {
 		struct MenuEntry_Normal * _self = (struct MenuEntry_Normal *)self;
@@ -495,6 +512,50 @@ failure:
 	return NULL;
 }
 
+/*
+ * Entries are rendered once for each of their two looks, plain and
+ * hilighted, into a sprite the size of their row, and copied into the
+ * menu from there; moving the hilight around doesn't render any text.
+ * The rows are rendered again if the title or the menu's width changes.
+ */
+static int _menu_entry_look(struct MenuEntry * entry) {
+	if (entry->hilight) return 1;
+	if (entry->_type == MenuEntry_Submenu) {
+		/* Submenus stay hilighted while their menu is open */
+		struct MenuEntry_Submenu * _self = (struct MenuEntry_Submenu *)entry;
+		return _self->_owner && _self->_my_child && _self->_owner->child == _self->_my_child;
+	}
+	return 0;
+}
+
+static void _menu_draw_entry(gfx_context_t * ctx, struct MenuEntry * entry, int offset) {
+	int look = _menu_entry_look(entry);
+
+	if (entry->_rows[look] && entry->_rows[look]->width != entry->width) {
+		_menu_entry_forget_rows(entry);
+	}
+
+	if (!entry->_rows[look]) {
+		sprite_t * row = create_sprite(entry->width, entry->height, ALPHA_OPAQUE);
+		gfx_context_t * _tmp = init_graphics_sprite(row);
+		draw_fill(_tmp, MENU_BACKGROUND);
+		int h = entry->hilight;
+		entry->hilight = look;
+		entry->renderer(_tmp, entry, 0);
+		entry->hilight = h;
+		free(_tmp);
+		entry->_rows[look] = row;
+	}
+
+	entry->offset = offset;
+	entry->_drawn = look;
+	draw_sprite(ctx, entry->_rows[look], 0, offset);
+
+	/* The row covers the sides of the border */
+	draw_line(ctx, 0, 0, offset, offset + entry->height - 1, MENU_BORDER);
+	draw_line(ctx, ctx->width-1, ctx->width-1, offset, offset + entry->height - 1, MENU_BORDER);
+}
+
 static void _menu_redraw(yutani_window_t * menu_window, yutani_t * yctx, struct MenuList * menu) {
 
 	gfx_context_t * ctx = menu->ctx;
@@ -503,17 +564,17 @@ static void _menu_redraw(yutani_window_t * menu_window, yutani_t * yctx, struct
 	draw_fill(ctx, MENU_BACKGROUND);
 
 	/* Window border */
-	draw_line(ctx, 0, ctx->width-1, 0, 0, rgb(109,111,112));
-	draw_line(ctx, 0, 0, 0, ctx->height-1, rgb(109,111,112));
-	draw_line(ctx, ctx->width-1, ctx->width-1, 0, ctx->height-1, rgb(109,111,112));
-	draw_line(ctx, 0, ctx->width-1, ctx->height-1, ctx->height-1, rgb(109,111,112));
+	draw_line(ctx, 0, ctx->width-1, 0, 0, MENU_BORDER);
+	draw_line(ctx, 0, 0, 0, ctx->height-1, MENU_BORDER);
+	draw_line(ctx, ctx->width-1, ctx->width-1, 0, ctx->height-1, MENU_BORDER);
+	draw_line(ctx, 0, ctx->width-1, ctx->height-1, ctx->height-1, MENU_BORDER);
 
 	/* Draw menu entries */
 	int offset = 4;
 	foreach(node, entries) {
 		struct MenuEntry * entry = node->value;
 		if (entry->renderer) {
-			entry->renderer(ctx, entry, offset);
+			_menu_draw_entry(ctx, entry, offset);
 		}
 
 		offset += entry->height;
@@ -524,6 +585,32 @@ static void _menu_redraw(yutani_window_t * menu_window, yutani_t * yctx, struct
 	yutani_flip(yctx, menu_window);
 }
 
+/*
+ * Redraw just the entries whose look has changed since they were
+ * drawn, and only expose the rows they cover.
+ */
+static void _menu_update(yutani_window_t * menu_window, yutani_t * yctx, struct MenuList * menu) {
+	gfx_context_t * ctx = menu->ctx;
+	int top = ctx->height;
+	int bottom = 0;
+
+	int offset = 4;
+	foreach(node, menu->entries) {
+		struct MenuEntry * entry = node->value;
+		if (entry->renderer && _menu_entry_look(entry) != entry->_drawn) {
+			_menu_draw_entry(ctx, entry, offset);
+			if (offset < top) top = offset;
+			bottom = offset + entry->height;
+		}
+		offset += entry->height;
+	}
+
+	if (top >= bottom) return;
+
+	memcpy(&ctx->buffer[top * GFX_S(ctx)], &ctx->backbuffer[top * GFX_S(ctx)], (bottom - top) * GFX_S(ctx));
+	yutani_flip_region(yctx, menu_window, 0, top, ctx->width, bottom - top);
+}
+
 void menu_show(struct MenuList * menu, yutani_t * yctx) {
 	/* Calculate window dimensions */
 	int height, width;
@@ -678,7 +765,7 @@ void menu_key_action(struct MenuList * menu, struct yutani_msg_key_event * me) {
 			hilighted = menu->entries->head->value;
 		}
 		hilighted->hilight = 1;
-		_menu_redraw(window,yctx,menu);
+		_menu_update(window,yctx,menu);
 	} else if (me->event.keycode == KEY_ARROW_UP) {
 		if (hilighted) {
 			hilighted->hilight = 0;
@@ -689,7 +776,7 @@ void menu_key_action(struct MenuList * menu, struct yutani_msg_key_event * me) {
 			hilighted = menu->entries->tail->value;
 		}
 		hilighted->hilight = 1;
-		_menu_redraw(window,yctx,menu);
+		_menu_update(window,yctx,menu);
 	} else if (me->event.keycode == KEY_ARROW_RIGHT) {
 		if (!hilighted) {
 			hilighted = menu->entries->head->value;
@@ -698,7 +785,7 @@ void menu_key_action(struct MenuList * menu, struct yutani_msg_key_event * me) {
 			hilighted->hilight = 1;
 			if (hilighted->_type == MenuEntry_Submenu) {
 				hilighted->activate(hilighted, 0);
-				_menu_redraw(window,yctx,menu);
+				_menu_update(window,yctx,menu);
 			} else {
 				struct menu_bar * bar = NULL;
 				struct MenuList * p = menu;
@@ -717,7 +804,7 @@ void menu_key_action(struct MenuList * menu, struct yutani_msg_key_event * me) {
 					}
 					menu_bar_show_menu(yctx, bar->window, bar, -1, bar->active_entry);
 				} else {
-					_menu_redraw(window,yctx,menu);
+					_menu_update(window,yctx,menu);
 				}
 			}
 		}
@@ -780,7 +867,7 @@ void menu_mouse_action(struct MenuList * menu, struct yutani_msg_window_mouse_ev
 		offset += entry->height;
 	}
 	if (changed) {
-		_menu_redraw(window,yctx,menu);
+		_menu_update(window,yctx,menu);
 	}
 }
 
@@ -21,12 +21,10 @@
 
 size_t pex_send(FILE * sock, unsigned int rcpt, size_t size, char * blob) {
 	assert(size <= MAX_PACKET_SIZE);
-	pex_header_t * broadcast = malloc(sizeof(pex_header_t) + size);
+	pex_header_t * broadcast = alloca(sizeof(pex_header_t) + size);
 	broadcast->target = rcpt;
 	memcpy(broadcast->data, blob, size);
-	size_t out = write(fileno(sock), broadcast, sizeof(pex_header_t) + size);
-	free(broadcast);
-	return out;
+	return write(fileno(sock), broadcast, sizeof(pex_header_t) + size);
 }
 
 size_t pex_broadcast(FILE * sock, size_t size, char * blob) {
@@ -42,7 +40,6 @@ size_t pex_reply(FILE * sock, size_t size, char * blob) {
 }
 
 size_t pex_recv(FILE * sock, char * blob) {
-	memset(blob, 0, MAX_PACKET_SIZE);
 	return read(fileno(sock), blob, MAX_PACKET_SIZE);
 }
 
@@ -68,6 +65,21 @@ FILE * pex_bind(char * target) {
 	return out;
 }
 
+/*
+ * Take every message waiting (waiting for one if there are none), as
+ * struct pex_records, for as many as fit in the buffer.
+ */
+ssize_t pex_recv_batch(FILE * sock, void * buffer, size_t size) {
+	struct pex_batch batch = {buffer, size};
+	return ioctl(fileno(sock), IOCTL_PACKETFS_RECV, &batch);
+}
+
+/* Send a buffer of struct pex_records as separate messages, in one go */
+ssize_t pex_send_batch(FILE * sock, void * buffer, size_t size) {
+	struct pex_batch batch = {buffer, size};
+	return ioctl(fileno(sock), IOCTL_PACKETFS_SEND, &batch);
+}
+
 size_t pex_query(FILE * sock) {
 	return ioctl(fileno(sock), IOCTL_PACKETFS_QUEUED, NULL);
 }
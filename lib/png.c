@@ -0,0 +1,423 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * libtoaru_png: Decode PNGs.
+ *
+ * IDAT data is fed to the inflater as it is read from the file, and
+ * each scanline is unfiltered and converted into the sprite as soon as
+ * it has been decompressed, so nothing but two rows of the image's own
+ * format is ever held in memory. All color types and bit depths are
+ * supported, with tRNS transparency and Adam7 interlacing; ancillary
+ * chunks other than tRNS are ignored, as are the chunk CRCs.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <toaru/graphics.h>
+#include <toaru/inflate.h>
+#include <toaru/png.h>
+
+#define PNG_GRAY       0
+#define PNG_RGB        2
+#define PNG_PALETTE    3
+#define PNG_GRAY_ALPHA 4
+#define PNG_RGBA       6
+
+/* Adam7 passes: first column, first row, column step, row step */
+static const uint8_t adam7[7][4] = {
+	{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+	{0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2},
+};
+
+struct png {
+	FILE * f;
+	sprite_t * sprite;
+
+	uint32_t width, height;
+	int depth;
+	int color_type;
+	int interlace;
+	int bpp;           /* Bytes per complete pixel, at least 1, for unfiltering */
+	int channels;
+
+	uint32_t palette[256];
+	int has_trns;
+	uint16_t trns[3];  /* Transparent gray, or r/g/b */
+
+	uint32_t chunk_left; /* Of the current IDAT */
+
+	/* Scanline being assembled, and the one before it */
+	uint8_t * line;
+	uint8_t * prior;
+	size_t line_bytes; /* Not counting the filter type */
+	size_t line_pos;
+
+	int pass;
+	uint32_t pass_width;
+	uint32_t pass_rows;
+	uint32_t row;
+	int done;
+};
+
+static uint32_t read_be32(const uint8_t * p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int read_chunk_header(struct png * p, uint32_t * length, uint32_t * type) {
+	uint8_t header[8];
+	if (fread(header, 1, 8, p->f) != 8) return 1;
+	*length = read_be32(header);
+	*type = read_be32(&header[4]);
+	return *length > 0x7FFFFFFF;
+}
+
+#define CHUNK(a,b,c,d) (((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+static inline uint32_t premultiplied(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+	if (a != 255) {
+		r = r * a / 255;
+		g = g * a / 255;
+		b = b * a / 255;
+	}
+	return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+/*
+ * Compressed data for the inflater: the contents of consecutive IDAT
+ * chunks, ending at the first chunk that isn't one.
+ */
+static size_t png_read_input(struct inflate_context * ctx, uint8_t * buf, size_t size) {
+	struct png * p = ctx->input_priv;
+
+	while (!p->chunk_left) {
+		uint32_t length, type;
+		fseek(p->f, 4, SEEK_CUR); /* CRC of the chunk we finished */
+		if (read_chunk_header(p, &length, &type) || type != CHUNK('I','D','A','T')) {
+			return 0;
+		}
+		p->chunk_left = length;
+	}
+
+	if (size > p->chunk_left) size = p->chunk_left;
+	size_t r = fread(buf, 1, size, p->f);
+	p->chunk_left -= r;
+	return r;
+}
+
+static void start_pass(struct png * p) {
+	while (p->pass < 7) {
+		if (p->interlace) {
+			const uint8_t * a = adam7[p->pass];
+			p->pass_width = p->width > a[0] ? (p->width - a[0] + a[2] - 1) / a[2] : 0;
+			p->pass_rows  = p->height > a[1] ? (p->height - a[1] + a[3] - 1) / a[3] : 0;
+		} else {
+			p->pass_width = p->width;
+			p->pass_rows  = p->height;
+		}
+		if (p->pass_width && p->pass_rows) break;
+		p->pass++;
+	}
+	if (p->pass == 7) {
+		p->done = 1;
+		return;
+	}
+	p->line_bytes = ((size_t)p->pass_width * p->channels * p->depth + 7) / 8;
+	p->line_pos = 0;
+	p->row = 0;
+	memset(p->prior, 0, p->line_bytes + 1);
+}
+
+static int unfilter(struct png * p) {
+	uint8_t * line = p->line + 1;
+	uint8_t * prior = p->prior + 1;
+	size_t n = p->line_bytes;
+	int bpp = p->bpp;
+
+	switch (p->line[0]) {
+		case 0: /* None */
+			break;
+		case 1: /* Sub */
+			for (size_t i = bpp; i < n; ++i) {
+				line[i] += line[i - bpp];
+			}
+			break;
+		case 2: /* Up; simple enough for the compiler to vectorize */
+			for (size_t i = 0; i < n; ++i) {
+				line[i] += prior[i];
+			}
+			break;
+		case 3: /* Average */
+			for (size_t i = 0; i < (size_t)bpp && i < n; ++i) {
+				line[i] += prior[i] >> 1;
+			}
+			for (size_t i = bpp; i < n; ++i) {
+				line[i] += (line[i - bpp] + prior[i]) >> 1;
+			}
+			break;
+		case 4: /* Paeth */
+			for (size_t i = 0; i < (size_t)bpp && i < n; ++i) {
+				line[i] += prior[i];
+			}
+			for (size_t i = bpp; i < n; ++i) {
+				int a = line[i - bpp], b = prior[i], c = prior[i - bpp];
+				int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+				line[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+			}
+			break;
+		default:
+			return 1;
+	}
+	return 0;
+}
+
+/* Sample `i` of a row packed at less than 8 bits, scaled to 0-255 */
+static inline uint8_t packed_sample(const uint8_t * line, size_t i, int depth) {
+	int per_byte = 8 / depth;
+	int shift = 8 - depth * (int)(i % per_byte + 1);
+	int value = (line[i / per_byte] >> shift) & ((1 << depth) - 1);
+	return value * (255 / ((1 << depth) - 1));
+}
+
+static inline uint16_t packed_raw(const uint8_t * line, size_t i, int depth) {
+	int per_byte = 8 / depth;
+	int shift = 8 - depth * (int)(i % per_byte + 1);
+	return (line[i / per_byte] >> shift) & ((1 << depth) - 1);
+}
+
+static void emit_row(struct png * p) {
+	const uint8_t * line = p->line + 1;
+	uint32_t y, x0, dx;
+
+	if (p->interlace) {
+		const uint8_t * a = adam7[p->pass];
+		y  = a[1] + p->row * a[3];
+		x0 = a[0];
+		dx = a[2];
+	} else {
+		y  = p->row;
+		x0 = 0;
+		dx = 1;
+	}
+
+	uint32_t * out = &p->sprite->bitmap[y * p->width + x0];
+	uint32_t w = p->pass_width;
+	int step = p->depth == 16 ? 2 : 1; /* 16-bit samples: use the high byte */
+
+	switch (p->color_type) {
+		case PNG_GRAY:
+			for (uint32_t i = 0; i < w; ++i, out += dx) {
+				uint8_t g;
+				uint16_t raw;
+				if (p->depth < 8) {
+					g = packed_sample(line, i, p->depth);
+					raw = packed_raw(line, i, p->depth);
+				} else {
+					g = line[i * step];
+					raw = step == 2 ? (line[i * 2] << 8 | line[i * 2 + 1]) : g;
+				}
+				uint32_t a = (p->has_trns && raw == p->trns[0]) ? 0 : 255;
+				*out = premultiplied(g, g, g, a);
+			}
+			break;
+		case PNG_RGB:
+			for (uint32_t i = 0; i < w; ++i, out += dx) {
+				const uint8_t * s = &line[i * 3 * step];
+				uint32_t a = 255;
+				if (p->has_trns) {
+					uint16_t r, g, b;
+					if (step == 2) {
+						r = s[0] << 8 | s[1]; g = s[2] << 8 | s[3]; b = s[4] << 8 | s[5];
+					} else {
+						r = s[0]; g = s[1]; b = s[2];
+					}
+					if (r == p->trns[0] && g == p->trns[1] && b == p->trns[2]) a = 0;
+				}
+				*out = premultiplied(s[0], s[step], s[2 * step], a);
+			}
+			break;
+		case PNG_PALETTE:
+			for (uint32_t i = 0; i < w; ++i, out += dx) {
+				*out = p->palette[p->depth < 8 ? packed_raw(line, i, p->depth) : line[i]];
+			}
+			break;
+		case PNG_GRAY_ALPHA:
+			for (uint32_t i = 0; i < w; ++i, out += dx) {
+				const uint8_t * s = &line[i * 2 * step];
+				*out = premultiplied(s[0], s[0], s[0], s[step]);
+			}
+			break;
+		case PNG_RGBA:
+			for (uint32_t i = 0; i < w; ++i, out += dx) {
+				const uint8_t * s = &line[i * 4 * step];
+				*out = premultiplied(s[0], s[step], s[2 * step], s[3 * step]);
+			}
+			break;
+	}
+}
+
+/*
+ * Decompressed data: gather it into scanlines and convert each one as
+ * soon as it is whole.
+ */
+static int png_write_output(struct inflate_context * ctx, const uint8_t * buf, size_t size) {
+	struct png * p = ctx->output_priv;
+
+	while (size && !p->done) {
+		size_t n = p->line_bytes + 1 - p->line_pos;
+		if (n > size) n = size;
+		memcpy(&p->line[p->line_pos], buf, n);
+		p->line_pos += n;
+		buf += n;
+		size -= n;
+
+		if (p->line_pos < p->line_bytes + 1) break;
+
+		if (unfilter(p)) return 1;
+		emit_row(p);
+
+		uint8_t * tmp = p->prior;
+		p->prior = p->line;
+		p->line = tmp;
+		p->line_pos = 0;
+
+		if (++p->row == p->pass_rows) {
+			p->pass = p->interlace ? p->pass + 1 : 7;
+			start_pass(p);
+		}
+	}
+
+	return 0;
+}
+
+static int read_header(struct png * p) {
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	uint8_t buf[13];
+	uint32_t length, type;
+
+	if (fread(buf, 1, 8, p->f) != 8 || memcmp(buf, signature, 8)) return 1;
+	if (read_chunk_header(p, &length, &type) || type != CHUNK('I','H','D','R') || length != 13) return 1;
+	if (fread(buf, 1, 13, p->f) != 13) return 1;
+
+	p->width      = read_be32(buf);
+	p->height     = read_be32(&buf[4]);
+	p->depth      = buf[8];
+	p->color_type = buf[9];
+	p->interlace  = buf[12];
+
+	if (!p->width || !p->height || p->width > 0xFFFF || p->height > 0xFFFF) return 1;
+	if (buf[10] != 0 || buf[11] != 0 || p->interlace > 1) return 1;
+
+	switch (p->color_type) {
+		case PNG_GRAY:       p->channels = 1; break;
+		case PNG_RGB:        p->channels = 3; break;
+		case PNG_PALETTE:    p->channels = 1; break;
+		case PNG_GRAY_ALPHA: p->channels = 2; break;
+		case PNG_RGBA:       p->channels = 4; break;
+		default: return 1;
+	}
+
+	int d = p->depth;
+	if (d != 1 && d != 2 && d != 4 && d != 8 && d != 16) return 1;
+	if (p->color_type == PNG_PALETTE && d == 16) return 1;
+	if ((p->color_type != PNG_GRAY && p->color_type != PNG_PALETTE) && d < 8) return 1;
+
+	p->bpp = (p->channels * d + 7) / 8;
+
+	fseek(p->f, 4, SEEK_CUR);
+	return 0;
+}
+
+int load_sprite_png(sprite_t * sprite, char * filename) {
+	struct png * p = calloc(1, sizeof(struct png));
+	p->f = fopen(filename, "r");
+	if (!p->f) {
+		free(p);
+		return 1;
+	}
+
+	int ret = 1;
+	if (read_header(p)) goto _cleanup;
+
+	/* Opaque black until a PLTE and tRNS say otherwise */
+	for (int i = 0; i < 256; ++i) {
+		p->palette[i] = 0xFF000000;
+	}
+
+	uint32_t length, type;
+	while (1) {
+		if (read_chunk_header(p, &length, &type)) goto _cleanup;
+		if (type == CHUNK('I','D','A','T')) break;
+		if (type == CHUNK('I','E','N','D')) goto _cleanup;
+
+		uint8_t data[768];
+		if ((type == CHUNK('P','L','T','E') || type == CHUNK('t','R','N','S')) && length <= sizeof(data)) {
+			if (fread(data, 1, length, p->f) != length) goto _cleanup;
+			if (type == CHUNK('P','L','T','E')) {
+				for (uint32_t i = 0; i < length / 3; ++i) {
+					p->palette[i] = 0xFF000000 | (data[i*3] << 16) | (data[i*3+1] << 8) | data[i*3+2];
+				}
+			} else if (p->color_type == PNG_PALETTE) {
+				for (uint32_t i = 0; i < length && i < 256; ++i) {
+					uint32_t c = p->palette[i];
+					p->palette[i] = premultiplied((c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF, data[i]);
+				}
+				p->has_trns = 1;
+			} else if (p->color_type == PNG_GRAY && length >= 2) {
+				p->trns[0] = data[0] << 8 | data[1];
+				p->has_trns = 1;
+			} else if (p->color_type == PNG_RGB && length >= 6) {
+				p->trns[0] = data[0] << 8 | data[1];
+				p->trns[1] = data[2] << 8 | data[3];
+				p->trns[2] = data[4] << 8 | data[5];
+				p->has_trns = 1;
+			}
+			fseek(p->f, 4, SEEK_CUR);
+		} else {
+			fseek(p->f, length + 4, SEEK_CUR);
+		}
+	}
+	p->chunk_left = length;
+
+	size_t max_line = ((size_t)p->width * p->channels * p->depth + 7) / 8 + 1;
+	p->line  = malloc(max_line);
+	p->prior = malloc(max_line);
+
+	sprite->width  = p->width;
+	sprite->height = p->height;
+	sprite->bitmap = malloc(sizeof(uint32_t) * p->width * p->height);
+	sprite->masks  = NULL;
+	sprite->blank  = 0;
+	sprite->alpha  = (p->has_trns || p->color_type == PNG_GRAY_ALPHA || p->color_type == PNG_RGBA) ? ALPHA_EMBEDDED : 0;
+	p->sprite = sprite;
+
+	if (!p->line || !p->prior || !sprite->bitmap) goto _fail;
+
+	start_pass(p);
+
+	struct inflate_context ctx;
+	ctx.input_priv   = p;
+	ctx.output_priv  = p;
+	ctx.read_input   = png_read_input;
+	ctx.write_output = png_write_output;
+
+	if (zlib_decompress(&ctx) || !p->done) goto _fail;
+
+	ret = 0;
+	goto _cleanup;
+
+_fail:
+	free(sprite->bitmap);
+	sprite->bitmap = NULL;
+	sprite->width  = 0;
+	sprite->height = 0;
+_cleanup:
+	free(p->line);
+	free(p->prior);
+	fclose(p->f);
+	free(p);
+	return ret;
+}
@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <toaru/kbd.h>
 #include <toaru/rline.h>
@@ -61,6 +63,121 @@ char * rline_exit_string = "exit\n";
 
 static char rline_temp[1024];
 
+/*
+ * History can also be kept in a file (see rline_history_file()), which
+ * is only ever appended to: one entry per line, with backslashes and
+ * newlines escaped. At startup only the tail of the file is read, just
+ * enough to fill the ring of recent entries, so a long history doesn't
+ * slow down the first prompt. Everything older is read the first time
+ * a reverse search needs it.
+ */
+static char * history_path = NULL;
+static int history_unsaved = 0;   /* The newest entry isn't in the file yet */
+static off_t history_tail = 0;    /* Where the entries we started with begin in the file */
+
+/* Entries pushed out of the ring this session, oldest first */
+static char ** history_evicted = NULL;
+static int history_evicted_count = 0;
+static int history_evicted_size = 0;
+
+/* Entries from the file before history_tail, newest first, without repeats */
+static char * history_older_text = NULL;
+static char ** history_older = NULL;
+static int history_older_count = 0;
+static int history_older_loaded = 0;
+
+static void history_write(const char * str) {
+	char * out = malloc(strlen(str) * 2 + 2);
+	char * o = out;
+	for (const char * c = str; *c; ++c) {
+		if (*c == '\\') {
+			*o++ = '\\';
+			*o++ = '\\';
+		} else if (*c == '\n') {
+			*o++ = '\\';
+			*o++ = 'n';
+		} else {
+			*o++ = *c;
+		}
+	}
+	*o++ = '\n';
+
+	int fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (fd >= 0) {
+		write(fd, out, o - out);
+		close(fd);
+	}
+	free(out);
+}
+
+static void history_unescape(char * s) {
+	char * o = s;
+	for (char * c = s; *c; ++c) {
+		if (*c == '\\' && c[1]) {
+			c++;
+			*o++ = (*c == 'n') ? '\n' : *c;
+		} else {
+			*o++ = *c;
+		}
+	}
+	*o = '\0';
+}
+
+/*
+ * Entries go to the file once they are complete, which is when the next
+ * one comes along (a multi-line command grows through
+ * rline_history_append_line() until then) or when the program exits.
+ */
+static void history_flush(void) {
+	if (history_path && history_unsaved && rline_history_count) {
+		history_write(rline_history_prev(1));
+	}
+	history_unsaved = 0;
+}
+
+/* A set of strings, for weeding out repeats */
+typedef struct {
+	char ** slots;
+	size_t size;
+} history_set_t;
+
+static void history_set_init(history_set_t * set, size_t count) {
+	set->size = 16;
+	while (set->size < count * 2) set->size *= 2;
+	set->slots = calloc(set->size, sizeof(char *));
+}
+
+/* Returns 1 if str was already there */
+static int history_set_add(history_set_t * set, char * str) {
+	unsigned int hash = 2166136261u;
+	for (unsigned char * c = (unsigned char *)str; *c; ++c) {
+		hash = (hash ^ *c) * 16777619u;
+	}
+	size_t i = hash & (set->size - 1);
+	while (set->slots[i]) {
+		if (!strcmp(set->slots[i], str)) return 1;
+		i = (i + 1) & (set->size - 1);
+	}
+	set->slots[i] = str;
+	return 0;
+}
+
+static void history_push(char * str) {
+	if (rline_history_count == RLINE_HISTORY_ENTRIES) {
+		/* Keep the oldest around for searching */
+		if (history_evicted_count == history_evicted_size) {
+			history_evicted_size = history_evicted_size ? history_evicted_size * 2 : 64;
+			history_evicted = realloc(history_evicted, sizeof(char *) * history_evicted_size);
+		}
+		history_evicted[history_evicted_count++] = rline_history[rline_history_offset];
+		rline_history[rline_history_offset] = str;
+		rline_history_offset = (rline_history_offset + 1) % RLINE_HISTORY_ENTRIES;
+	} else {
+		rline_history[rline_history_count] = str;
+		rline_history_count++;
+	}
+}
+
 void rline_history_insert(char * str) {
 	if (str[strlen(str)-1] == '\n') {
 		str[strlen(str)-1] = '\0';
@@ -71,14 +188,23 @@ void rline_history_insert(char * str) {
 			return;
 		}
 	}
-	if (rline_history_count == RLINE_HISTORY_ENTRIES) {
-		free(rline_history[rline_history_offset]);
-		rline_history[rline_history_offset] = str;
-		rline_history_offset = (rline_history_offset + 1) % RLINE_HISTORY_ENTRIES;
-	} else {
-		rline_history[rline_history_count] = str;
-		rline_history_count++;
+
+	history_flush();
+
+	/* Only the newest copy of an entry stays in the ring */
+	for (int i = 0; i < rline_history_count - 1; ++i) {
+		if (!strcmp(str, rline_history_get(i))) {
+			free(rline_history_get(i));
+			for (int j = i; j < rline_history_count - 1; ++j) {
+				rline_history[(j + rline_history_offset) % RLINE_HISTORY_ENTRIES] = rline_history_get(j + 1);
+			}
+			rline_history_count--;
+			break;
+		}
 	}
+
+	history_push(str);
+	history_unsaved = 1;
 }
 
 void rline_history_append_line(char * str) {
@@ -104,41 +230,205 @@ char * rline_history_prev(int item) {
 	return rline_history_get(rline_history_count - item);
 }
 
+static size_t read_at(int fd, off_t offset, char * buf, size_t len) {
+	size_t got = 0;
+	lseek(fd, offset, SEEK_SET);
+	while (got < len) {
+		ssize_t r = read(fd, buf + got, len - got);
+		if (r <= 0) break;
+		got += r;
+	}
+	return got;
+}
+
+void rline_history_file(const char * path) {
+	history_path = strdup(path);
+	atexit(history_flush);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return;
+	off_t size = lseek(fd, 0, SEEK_END);
+
+	/*
+	 * Read back from the end, a bigger piece each time, until we have
+	 * enough distinct entries for the ring or there is nothing left.
+	 */
+	char * found[RLINE_HISTORY_ENTRIES];
+	int count = 0;
+	char * buf = NULL;
+	off_t window = 0x4000;
+	while (1) {
+		off_t start = size > window ? size - window : 0;
+		buf = realloc(buf, size - start + 1);
+		size_t len = read_at(fd, start, buf, size - start);
+		buf[len] = '\0';
+
+		count = 0;
+		history_tail = start;
+		char * end = buf + len;
+		while (end > buf && count < RLINE_HISTORY_ENTRIES) {
+			if (end[-1] == '\n') *--end = '\0';
+			char * line = end;
+			while (line > buf && line[-1] != '\n') line--;
+			if (line == buf && start > 0) break; /* May be cut off; look again with more */
+			history_tail = start + (line - buf);
+			end = line;
+			if (!*line) continue;
+			history_unescape(line);
+			int seen = 0;
+			for (int i = 0; i < count && !seen; ++i) {
+				seen = !strcmp(found[i], line);
+			}
+			if (!seen) found[count++] = line;
+		}
+
+		if (count == RLINE_HISTORY_ENTRIES || start == 0) break;
+		window *= 4;
+	}
+	close(fd);
+
+	for (int i = count; i > 0; --i) {
+		history_push(strdup(found[i-1]));
+	}
+	free(buf);
+}
+
+static void history_load_older(void) {
+	history_older_loaded = 1;
+	if (!history_path || !history_tail) return;
+
+	int fd = open(history_path, O_RDONLY);
+	if (fd < 0) return;
+	history_older_text = malloc(history_tail + 1);
+	size_t len = read_at(fd, 0, history_older_text, history_tail);
+	history_older_text[len] = '\0';
+	close(fd);
+
+	int lines = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (history_older_text[i] == '\n') lines++;
+	}
+	history_older = malloc(sizeof(char *) * (lines + 1));
+
+	/* Anything the ring or this session already has is left out */
+	history_set_t seen;
+	history_set_init(&seen, lines + rline_history_count + history_evicted_count);
+	for (int i = 0; i < rline_history_count; ++i) {
+		history_set_add(&seen, rline_history_get(i));
+	}
+	for (int i = 0; i < history_evicted_count; ++i) {
+		history_set_add(&seen, history_evicted[i]);
+	}
+
+	char * end = history_older_text + len;
+	while (end > history_older_text) {
+		if (end[-1] == '\n') *--end = '\0';
+		char * line = end;
+		while (line > history_older_text && line[-1] != '\n') line--;
+		end = line;
+		if (!*line) continue;
+		history_unescape(line);
+		if (!history_set_add(&seen, line)) {
+			history_older[history_older_count++] = line;
+		}
+	}
+
+	free(seen.slots);
+}
+
+/* Everything we know about, newest first: the ring, then this session's older entries, then the file */
+static int history_search_count(void) {
+	return rline_history_count + history_evicted_count + history_older_count;
+}
+
+static char * history_search_entry(int i) {
+	if (i < rline_history_count) return rline_history_prev(i + 1);
+	i -= rline_history_count;
+	if (i < history_evicted_count) return history_evicted[history_evicted_count - 1 - i];
+	i -= history_evicted_count;
+	return history_older[i];
+}
+
+/*
+ * Entries containing query, newest first. Typing only ever makes the
+ * query longer, so when the last query is part of the new one, its
+ * matches are narrowed down rather than searching everything again.
+ */
+static int history_matches(const char * query, const char * last_query, int ** matches, int count) {
+	if (*last_query && strstr(query, last_query)) {
+		int * narrowed = malloc(sizeof(int) * (count + 1));
+		int n = 0;
+		for (int i = 0; i < count; ++i) {
+			if (strstr(history_search_entry((*matches)[i]), query)) {
+				narrowed[n++] = (*matches)[i];
+			}
+		}
+		free(*matches);
+		*matches = narrowed;
+		return n;
+	}
+
+	if (!history_older_loaded) {
+		history_load_older();
+	}
+
+	int total = history_search_count();
+	history_set_t seen;
+	history_set_init(&seen, total);
+	int * found = malloc(sizeof(int) * (total + 1));
+	int n = 0;
+	for (int i = 0; i < total; ++i) {
+		char * c = history_search_entry(i);
+		if (strstr(c, query) && !history_set_add(&seen, c)) {
+			found[n++] = i;
+		}
+	}
+	free(seen.slots);
+	free(*matches);
+	*matches = found;
+	return n;
+}
+
 void rline_reverse_search(rline_context_t * context) {
 	char input[512] = {0};
+	char last_input[512] = {0};
 	int collected = 0;
-	int start_at = 0;
 	int changed = 0;
 	fprintf(stderr, "\033[G\033[0m\033[s");
 	fflush(stderr);
 	key_event_state_t kbd_state = {0};
 	char * match = "";
+	int * matches = NULL;
+	int match_count = 0;
 	int match_index = 0;
 	while (1) {
 		/* Find matches */
-try_rev_search_again:
 		if (collected && changed) {
-			match = "";
-			match_index = 0;
-			for (int i = start_at; i < rline_history_count; i++) {
-				char * c = rline_history_prev(i+1);
-				if (strstr(c, input)) {
-					match = c;
-					match_index = i;
-					break;
-				}
+			int * previous = NULL;
+			if (match_count && *last_input) {
+				/* Kept in case this query finds nothing */
+				previous = malloc(sizeof(int) * match_count);
+				memcpy(previous, matches, sizeof(int) * match_count);
 			}
-			if (!strcmp(match,"")) {
-				if (start_at) {
-					start_at = 0;
-					goto try_rev_search_again;
-				}
+			int count = history_matches(input, last_input, &matches, match_count);
+			if (count) {
+				match_count = count;
+				strcpy(last_input, input);
+				free(previous);
+			} else {
+				/* Nothing has this in it; don't take the last key */
 				collected--;
 				input[collected] = '\0';
-				if (collected) {
-					goto try_rev_search_again;
+				if (previous) {
+					free(matches);
+					matches = previous;
+				} else {
+					match_count = collected ? history_matches(input, "", &matches, 0) : 0;
+					strcpy(last_input, input);
 				}
 			}
+			if (match_index >= match_count) match_index = 0;
+			match = match_count ? history_search_entry(matches[match_index]) : "";
 		}
 		fprintf(stderr, "\033[u(reverse-i-search)`%s': %s\033[K", input, match);
 		fflush(stderr);
@@ -153,16 +443,20 @@ try_rev_search_again:
 				if (collected > 0) {
 					collected--;
 					input[collected] = '\0';
-					start_at = 0;
+					match_index = 0;
 					changed = 1;
 				}
 				break;
 			case KEY_CTRL_C:
 				printf("^C\n");
+				free(matches);
 				return;
 			case KEY_CTRL_R:
-				start_at = match_index + 1;
-				changed = 1;
+				/* Next older match, wrapping around */
+				if (match_count) {
+					match_index = (match_index + 1) % match_count;
+					match = history_search_entry(matches[match_index]);
+				}
 				break;
 			case KEY_ESCAPE:
 			case KEY_ARROW_LEFT:
@@ -181,13 +475,14 @@ try_rev_search_again:
 				if (key_sym == '\n' && !context->quiet) {
 					fprintf(stderr, "\n");
 				}
+				free(matches);
 				return;
 			default:
 				if (key_sym < KEY_NORMAL_MAX) {
 					input[collected] = (char)key_sym;
 					collected++;
 					input[collected] = '\0';
-					start_at = 0;
+					match_index = 0;
 					changed = 1;
 				}
 				break;
@@ -146,44 +146,6 @@ static int getch(int immediate) {
 	}
 }
 
-/**
- * Convert from Unicode string to utf-8.
- */
-static int to_eight(uint32_t codepoint, char * out) {
-	memset(out, 0x00, 7);
-
-	if (codepoint < 0x0080) {
-		out[0] = (char)codepoint;
-	} else if (codepoint < 0x0800) {
-		out[0] = 0xC0 | (codepoint >> 6);
-		out[1] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x10000) {
-		out[0] = 0xE0 | (codepoint >> 12);
-		out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[2] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x200000) {
-		out[0] = 0xF0 | (codepoint >> 18);
-		out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[3] = 0x80 | ((codepoint) & 0x3F);
-	} else if (codepoint < 0x4000000) {
-		out[0] = 0xF8 | (codepoint >> 24);
-		out[1] = 0x80 | (codepoint >> 18);
-		out[2] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[4] = 0x80 | ((codepoint) & 0x3F);
-	} else {
-		out[0] = 0xF8 | (codepoint >> 30);
-		out[1] = 0x80 | ((codepoint >> 24) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 18) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[4] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[5] = 0x80 | ((codepoint) & 0x3F);
-	}
-
-	return strlen(out);
-}
-
 /**
  * Obtain codepoint display width.
  *
@@ -649,16 +611,24 @@ static int check_line(line_t * line, int c, char * str, int last) {
  * the bim syntax highlighters should probably be broken
  * out into dynamically-loaded libraries?
  */
-static void recalculate_syntax(line_t * line) {
+static void recalculate_syntax_from(line_t * line, int start) {
 
 	if (!syntax) return;
 
+	/*
+	 * Back up from `start` to just after an unhilighted space: nothing
+	 * before one reaches past it, so the state there is known to be clear
+	 * and the characters before it can keep their flags.
+	 */
+	int i = start < line->actual ? start : line->actual;
+	while (i > 0 && !(line->text[i-1].codepoint == ' ' && line->text[i-1].flags == FLAG_NONE)) i--;
+
 	/* Start from the line's stored in initial state */
-	int state = line->istate;
+	int state = i ? 0 : line->istate;
 	int left  = 0;
-	int last  = 0;
+	int last  = i ? line->text[i-1].codepoint : 0;
 
-	for (int i = 0; i < line->actual; last = line->text[i++].codepoint) {
+	for (; i < line->actual; last = line->text[i++].codepoint) {
 		if (!left) state = 0;
 
 		if (state) {
@@ -724,52 +694,142 @@ _continue:
 	state = 0;
 }
 
+/*
+ * Edits only note where the line changed; the hilighting is brought up
+ * to date from there when the line is next drawn, so a paste costs one
+ * pass instead of one per character.
+ */
+static int syntax_dirty = -1;
+
+static void syntax_changed(int offset) {
+	if (syntax_dirty < 0 || offset < syntax_dirty) syntax_dirty = offset;
+}
+
+static void recalculate_syntax(line_t * line) {
+	recalculate_syntax_from(line, 0);
+	syntax_dirty = -1;
+}
+
 /**
- * Set colors
+ * Color escape for set_colors
  */
-static void set_colors(const char * fg, const char * bg) {
-	printf("\033[22;23;");
+static int color_escape(char * out, const char * fg, const char * bg) {
+	char * o = out + sprintf(out, "\033[22;23;");
 	if (*bg == '@') {
 		int _bg = atoi(bg+1);
 		if (_bg < 10) {
-			printf("4%d;", _bg);
+			o += sprintf(o, "4%d;", _bg);
 		} else {
-			printf("10%d;", _bg-10);
+			o += sprintf(o, "10%d;", _bg-10);
 		}
 	} else {
-		printf("48;%s;", bg);
+		o += sprintf(o, "48;%s;", bg);
 	}
 	if (*fg == '@') {
 		int _fg = atoi(fg+1);
 		if (_fg < 10) {
-			printf("3%dm", _fg);
+			o += sprintf(o, "3%dm", _fg);
 		} else {
-			printf("9%dm", _fg-10);
+			o += sprintf(o, "9%dm", _fg-10);
 		}
 	} else {
-		printf("38;%sm", fg);
+		o += sprintf(o, "38;%sm", fg);
 	}
+	return o - out;
+}
+
+/**
+ * Set colors
+ */
+static void set_colors(const char * fg, const char * bg) {
+	char tmp[64];
+	color_escape(tmp, fg, bg);
+	printf("%s", tmp);
 	fflush(stdout);
 }
 
 /**
- * Set just the foreground color
- *
- * (See set_colors above)
+ * The line is drawn into a frame: the bytes that draw the text area,
+ * and for each terminal cell the colors it was drawn in and which bytes
+ * drew it. The last frame is kept, and drawing the next one only sends
+ * the terminal what comes after the first cell that differs, in a
+ * single write.
  */
-static void set_fg_color(const char * fg) {
-	printf("\033[22;23;");
-	if (*fg == '@') {
-		int _fg = atoi(fg+1);
-		if (_fg < 10) {
-			printf("3%dm", _fg);
-		} else {
-			printf("9%dm", _fg-10);
-		}
-	} else {
-		printf("38;%sm", fg);
+struct render_cell {
+	const char * fg;
+	const char * bg;
+	int start;   /* Offset in bytes of what draws this cell */
+	int len;     /* 0 for the rest of a wide character */
+};
+
+struct render_frame {
+	char * bytes;
+	int len;
+	int size;
+	struct render_cell * cells;
+	int count;
+	int available;
+};
+
+static struct render_frame frames[2];
+static struct render_frame * frame = &frames[0]; /* The one being drawn */
+static struct render_frame * last_frame = &frames[1];
+static int last_frame_valid = 0;
+static struct {
+	int full_width;
+	int prompt_width_calc;
+	int show_left_side;
+	int show_right_side;
+	int scrolled;
+} last_frame_layout;
+
+static const char * pen_fg = NULL;
+static const char * pen_bg = NULL;
+
+/* The terminal has been drawn on by someone else; start over next time */
+static void invalidate_render(void) {
+	last_frame_valid = 0;
+}
+
+static void frame_append(struct render_frame * f, const char * s, int len) {
+	if (f->len + len > f->size) {
+		f->size = (f->len + len) * 2 + 64;
+		f->bytes = realloc(f->bytes, f->size);
 	}
-	fflush(stdout);
+	memcpy(f->bytes + f->len, s, len);
+	f->len += len;
+}
+
+static void frame_colors(const char * fg, const char * bg) {
+	if (pen_fg && !strcmp(fg, pen_fg) && !strcmp(bg, pen_bg)) return;
+	char tmp[64];
+	frame_append(frame, tmp, color_escape(tmp, fg, bg));
+	pen_fg = fg;
+	pen_bg = bg;
+}
+
+/* Draw `s`, which takes up `cells` cells */
+static void frame_put(const char * s, int cells) {
+	if (frame->count + cells > frame->available) {
+		frame->available = (frame->count + cells) * 2 + 16;
+		frame->cells = realloc(frame->cells, sizeof(struct render_cell) * frame->available);
+	}
+	int len = strlen(s);
+	for (int i = 0; i < cells; ++i) {
+		struct render_cell * c = &frame->cells[frame->count++];
+		c->fg = pen_fg;
+		c->bg = pen_bg;
+		c->start = frame->len + (i ? len : 0);
+		c->len = i ? 0 : len;
+	}
+	frame_append(frame, s, len);
+}
+
+static int cells_match(struct render_frame * a, int i, struct render_frame * b) {
+	struct render_cell * x = &a->cells[i];
+	struct render_cell * y = &b->cells[i];
+	return x->len == y->len && !strcmp(x->fg, y->fg) && !strcmp(x->bg, y->bg) &&
+		!memcmp(a->bytes + x->start, b->bytes + y->start, x->len);
 }
 
 /**
@@ -777,17 +837,15 @@ static void set_fg_color(const char * fg) {
  * alterations and removal of selection support.
  */
 static void render_line(void) {
-	printf("\033[?25l");
-	if (show_left_side) {
-		printf("\033[0m\r%s", prompt);
-	} else {
-		printf("\033[0m\r$");
+	if (syntax_dirty >= 0) {
+		recalculate_syntax_from(the_line, syntax_dirty);
+		syntax_dirty = -1;
 	}
 
-	if (offset && prompt_width_calc) {
-		set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-		printf("\b<");
-	}
+	frame->len = 0;
+	frame->count = 0;
+	pen_fg = NULL;
+	pen_bg = NULL;
 
 	int i = 0; /* Offset in char_t line data entries */
 	int j = 0; /* Offset in terminal cells */
@@ -795,7 +853,7 @@ static void render_line(void) {
 	const char * last_color = NULL;
 
 	/* Set default text colors */
-	set_colors(COLOR_FG, COLOR_BG);
+	frame_colors(COLOR_FG, COLOR_BG);
 
 	/*
 	 * When we are rendering in the middle of a wide character,
@@ -815,9 +873,9 @@ static void render_line(void) {
 			/* If we should be drawing by now... */
 			if (j >= offset) {
 				/* Fill remainder with -'s */
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("-");
-				set_colors(COLOR_FG, COLOR_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				frame_put("-", 1);
+				frame_colors(COLOR_FG, COLOR_BG);
 			}
 
 			/* One less remaining width cell to fill */
@@ -846,17 +904,17 @@ static void render_line(void) {
 			/* If this character is going to fall off the edge of the screen... */
 			if (j - offset + c.display_width >= width - prompt_width_calc) {
 				/* We draw this with special colors so it isn't ambiguous */
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
 
 				/* If it's wide, draw ---> as needed */
 				while (j - offset < width - prompt_width_calc - 1) {
-					printf("-");
+					frame_put("-", 1);
 					j++;
 				}
 
 				/* End the line with a > to show it overflows */
-				printf(">");
-				set_colors(COLOR_FG, COLOR_BG);
+				frame_put(">", 1);
+				frame_colors(COLOR_FG, COLOR_BG);
 				j++;
 				break;
 			}
@@ -864,55 +922,53 @@ static void render_line(void) {
 			/* Syntax hilighting */
 			const char * color = flag_to_color(c.flags);
 			if (!last_color || strcmp(color, last_color)) {
-				set_fg_color(color);
+				frame_colors(color, pen_bg);
 				last_color = color;
 			}
 
+			char tmp[16];
+
 			/* Render special characters */
 			if (c.codepoint == '\t') {
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("»");
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				frame_put("»", 1);
 				for (int i = 1; i < c.display_width; ++i) {
-					printf("·");
+					frame_put("·", 1);
 				}
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint < 32) {
 				/* Codepoints under 32 to get converted to ^@ escapes */
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("^%c", '@' + c.codepoint);
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				sprintf(tmp, "^%c", '@' + c.codepoint);
+				frame_put(tmp, 2);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == 0x7f) {
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("^?");
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				frame_put("^?", 2);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint > 0x7f && c.codepoint < 0xa0) {
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("<%2x>", c.codepoint);
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				sprintf(tmp, "<%2x>", c.codepoint);
+				frame_put(tmp, 4);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == 0xa0) {
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("_");
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				frame_put("_", 1);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.display_width == 8) {
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("[U+%04x]", c.codepoint);
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				sprintf(tmp, "[U+%04x]", c.codepoint);
+				frame_put(tmp, 8);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.display_width == 10) {
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("[U+%06x]", c.codepoint);
-				set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
-#if 0
-			} else if (c.codepoint == ' ' && i == line->actual - 1) {
-				/* Special case: space at end of line */
-				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("·");
-				set_colors(COLOR_FG, COLOR_BG);
-#endif
+				frame_colors(COLOR_ALT_FG, COLOR_ALT_BG);
+				sprintf(tmp, "[U+%06x]", c.codepoint);
+				frame_put(tmp, 10);
+				frame_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else {
 				/* Normal characters get output */
-				char tmp[7]; /* Max six bytes, use 7 to ensure last is always nil */
-				to_eight(c.codepoint, tmp);
-				printf("%s", tmp);
+				utf8_encode(c.codepoint, tmp);
+				frame_put(tmp, c.display_width);
 			}
 
 			/* Advance the terminal cell offset by the render width of this character */
@@ -938,13 +994,73 @@ static void render_line(void) {
 
 	/* Fill to end right hand side */
 	for (; j < width + offset - prompt_width_calc; ++j) {
-		printf(" ");
-	}
+		frame_put(" ", 1);
+	}
+
+	int scrolled = offset && prompt_width_calc;
+	int full = !last_frame_valid ||
+		last_frame->count != frame->count ||
+		last_frame_layout.full_width != full_width ||
+		last_frame_layout.prompt_width_calc != prompt_width_calc ||
+		last_frame_layout.show_left_side != show_left_side ||
+		last_frame_layout.show_right_side != show_right_side ||
+		last_frame_layout.scrolled != scrolled;
+
+	/* First cell that changed */
+	int first = 0;
+	if (!full) {
+		while (first < frame->count && cells_match(frame, first, last_frame)) first++;
+		while (first > 0 && first < frame->count && !frame->cells[first].len) first--;
+	}
+
+	if (full || first < frame->count) {
+		struct render_frame out = {0};
+		char tmp[64];
+		frame_append(&out, "\033[?25l", 6);
+		if (full) {
+			if (show_left_side) {
+				frame_append(&out, "\033[0m\r", 5);
+				frame_append(&out, prompt, strlen(prompt));
+			} else {
+				frame_append(&out, "\033[0m\r$", 6);
+			}
+			if (scrolled) {
+				frame_append(&out, tmp, color_escape(tmp, COLOR_ALT_FG, COLOR_ALT_BG));
+				frame_append(&out, "\b<", 2);
+			}
+			frame_append(&out, frame->bytes, frame->len);
+			if (show_right_side) {
+				frame_append(&out, "\033[0m", 4);
+				frame_append(&out, prompt_right, strlen(prompt_right));
+			}
+		} else {
+			struct render_cell * c = &frame->cells[first];
+			frame_append(&out, tmp, sprintf(tmp, "\033[%dG", prompt_width_calc + 1 + first));
+			frame_append(&out, tmp, color_escape(tmp, c->fg, c->bg));
+			frame_append(&out, frame->bytes + c->start, frame->len - c->start);
+		}
 
-	/* Print right hand side */
-	if (show_right_side) {
-		printf("\033[0m%s", prompt_right);
+		fflush(stdout);
+		char * b = out.bytes;
+		while (out.len > 0) {
+			ssize_t w = write(STDOUT_FILENO, b, out.len);
+			if (w <= 0) break;
+			b += w;
+			out.len -= w;
+		}
+		free(out.bytes);
 	}
+
+	last_frame_layout.full_width = full_width;
+	last_frame_layout.prompt_width_calc = prompt_width_calc;
+	last_frame_layout.show_left_side = show_left_side;
+	last_frame_layout.show_right_side = show_right_side;
+	last_frame_layout.scrolled = scrolled;
+	last_frame_valid = 1;
+
+	struct render_frame * tmp_frame = last_frame;
+	last_frame = frame;
+	frame = tmp_frame;
 }
 
 /**
@@ -983,7 +1099,7 @@ static line_t * line_insert(line_t * line, char_t c, int offset) {
 
 	if (!loading) {
 		recalculate_tabs(line);
-		recalculate_syntax(line);
+		syntax_changed(offset);
 	}
 
 	return line;
@@ -1064,7 +1180,7 @@ static void line_delete(line_t * line, int offset) {
 
 	if (!loading) {
 		recalculate_tabs(line);
-		recalculate_syntax(line);
+		syntax_changed(offset - 1);
 	}
 }
 
@@ -1186,7 +1302,7 @@ static void history_previous(void) {
 		memset(temp_buffer, 0, sizeof(temp_buffer));
 		for (int j = 0; j < the_line->actual; j++) {
 			char_t c = the_line->text[j];
-			off += to_eight(c.codepoint, &temp_buffer[off]);
+			off += utf8_encode(c.codepoint, &temp_buffer[off]);
 		}
 	}
 
@@ -1390,7 +1506,7 @@ static void call_rline_func(rline_callback_t func, rline_context_t * context) {
 			context->offset = off;
 		}
 		char_t c = the_line->text[j];
-		off += to_eight(c.codepoint, &context->buffer[off]);
+		off += utf8_encode(c.codepoint, &context->buffer[off]);
 	}
 
 	/* If the cursor was at the end, the loop above didn't catch it */
@@ -1418,6 +1534,7 @@ static void call_rline_func(rline_callback_t func, rline_context_t * context) {
 
 	/* Reset colors (for tab completion candidates, etc. */
 	printf("\033[0m");
+	invalidate_render();
 
 	/* Call the function */
 	func(context);
@@ -1471,6 +1588,7 @@ static int read_line(void) {
 	uint32_t istate = 0;
 	int immediate = 1;
 
+	invalidate_render();
 	set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
 	fprintf(stdout, "◄\033[0m"); /* TODO: This could be retrieved from an envvar */
 	for (int i = 0; i < full_width - 1; ++i) {
@@ -1543,6 +1661,7 @@ static int read_line(void) {
 						/* Don't bother with unicode, just take the next byte */
 						place_cursor_actual();
 						printf("^\b");
+						invalidate_render();
 						insert_char(getc(stdin));
 						immediate = 0;
 						break;
@@ -1552,11 +1671,13 @@ static int read_line(void) {
 						break;
 					case 12: /* ^L - Repaint the whole screen */
 						printf("\033[2J\033[H");
+						invalidate_render();
 						render_line();
 						place_cursor_actual();
 						break;
 					case 11: /* ^K - Clear to end */
 						the_line->actual = column;
+						syntax_changed(column);
 						immediate = 0;
 						break;
 					case 21: /* ^U - Kill to beginning */
@@ -1632,7 +1753,7 @@ int rline_experimental(char * buffer, int buf_size) {
 	unsigned int off = 0;
 	for (int j = 0; j < the_line->actual; j++) {
 		char_t c = the_line->text[j];
-		off += to_eight(c.codepoint, &buffer[off]);
+		off += utf8_encode(c.codepoint, &buffer[off]);
 	}
 
 	free(the_line);
@@ -11,6 +11,7 @@
 #include <sys/shm.h>
 
 #include <toaru/graphics.h>
+#include <toaru/glyph_cache.h>
 #include <toaru/hashmap.h>
 #include <toaru/sdf.h>
 #include <toaru/spinlock.h>
@@ -152,43 +153,56 @@ static int _select_width(char ch, int font) {
 	}
 }
 
-static int draw_sdf_character(gfx_context_t * ctx, int32_t x, int32_t y, int ch, int size, uint32_t color, sprite_t * tmp, int font, sprite_t * _font_data, double buffer) {
-	if (ch < 0 || ch > 255) return 0;
+static uint64_t sdf_variant(double buffer) {
+	union { float f; uint32_t i; } g = { (float)gamma }, b = { (float)buffer };
+	return ((uint64_t)g.i << 32) | b.i;
+}
+
+static glyph_t * sdf_glyph(int ch, int size, sprite_t * tmp, int font, sprite_t * _font_data, double buffer) {
+	uint64_t variant = sdf_variant(buffer);
+	glyph_t * glyph = glyph_cache_get(GLYPH_FONT(GLYPH_SOURCE_SDF, font), size, ch, variant);
+	if (glyph) return glyph;
 
 	double scale = (double)size / 50.0;
-	int width = _select_width(ch, font) * scale;
 	int fx = ((BASE_WIDTH * ch) % _font_data->width) * scale;
 	int fy = (((BASE_WIDTH * ch) / _font_data->width) * BASE_HEIGHT) * scale;
 
 	int height = BASE_HEIGHT * ((double)size / 50.0);
 
+	glyph = glyph_cache_add(GLYPH_FONT(GLYPH_SOURCE_SDF, font), size, ch, variant, size, height);
+	glyph->advance = _select_width(ch, font) * scale;
+
+	double edge0 = buffer - gamma * 1.4142 / (double)size;
+	double edge1 = buffer + gamma * 1.4142 / (double)size;
 
 	/* ignore size */
 	for (int j = 0; j < height; ++j) {
-		if (y + j < 0) continue;
-		if (y + j >= ctx->height) continue;
 		if (fy+j >= tmp->height) continue;
 		for (int i = 0; i < size; ++i) {
 			/* TODO needs to do bilinear filter */
 			if (fx+i >= tmp->width) continue;
-			if (x + i < 0) continue;
-			if (x + i >= ctx->width) continue;
 			uint32_t c = SPRITE((tmp), fx+i, fy+j);
 			double dist = (double)_RED(c) / 255.0;
-			double edge0 = buffer - gamma * 1.4142 / (double)size;
-			double edge1 = buffer + gamma * 1.4142 / (double)size;
 			double a = (dist - edge0) / (edge1 - edge0);
 			if (a < 0.0) a = 0.0;
 			if (a > 1.0) a = 1.0;
 			a = a * a * (3 - 2 * a);
-			uint32_t f_color = premultiply((color & 0xFFFFFF) | ((uint32_t)(255 * a) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(a * _ALP(color)) << 24);
-			GFX(ctx,x+i,y+j) = alpha_blend_rgba(GFX(ctx,x+i,y+j), f_color);
+			glyph->mask[j * size + i] = 255 * a;
 		}
 	}
 
-	return width;
+	return glyph;
+}
 
+/*
+ * SDF text has always scaled the color channels by coverage alone and
+ * only the alpha by the color's alpha; keep it looking the same.
+ */
+static void sdf_colors(uint32_t colors[256], uint32_t color) {
+	for (int c = 0; c < 256; ++c) {
+		uint32_t f_color = premultiply((color & 0xFFFFFF) | ((uint32_t)c << 24));
+		colors[c] = (f_color & 0xFFFFFF) | ((c * _ALP(color) / 255) << 24);
+	}
 }
 
 int draw_sdf_string_stroke(gfx_context_t * ctx, int32_t x, int32_t y, const char * str, int size, uint32_t color, int font, double _gamma, double stroke) {
@@ -212,12 +226,16 @@ int draw_sdf_string_stroke(gfx_context_t * ctx, int32_t x, int32_t y, const char
 		tmp = hashmap_get(_font_cache, (void *)(scale_height | (font << 16)));
 	}
 
+	uint32_t colors[256];
+	sdf_colors(colors, color);
+
 	int32_t out_width = 0;
 	gamma = _gamma;
 	while (*str) {
-		int w = draw_sdf_character(ctx,x,y,*((uint8_t *)str),size,color,tmp,font,_font_data, stroke);
-		out_width += w;
-		x += w;
+		glyph_t * glyph = sdf_glyph(*((uint8_t *)str),size,tmp,font,_font_data, stroke);
+		draw_glyph(ctx, glyph, x, y, colors);
+		out_width += glyph->advance;
+		x += glyph->advance;
 		str++;
 	}
 	spin_unlock(&_sdf_lock);
@@ -0,0 +1,166 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Substring search over large buffers.
+ *
+ * A single pattern is found with SSE2 by checking sixteen positions at a
+ * time for its first and last bytes, and only comparing the whole thing
+ * where both line up. Several patterns are found with Horspool's algorithm,
+ * skipping along by the shortest of them and checking each at every
+ * position it stops on.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
+#include <toaru/search.h>
+
+static int fold(int flags, unsigned char c) {
+	return (flags & SEARCH_IGNORE_CASE) ? tolower(c) : c;
+}
+
+static int matches(search_t * search, const char * a, const char * b, size_t len) {
+	if (!(search->flags & SEARCH_IGNORE_CASE)) {
+		return !memcmp(a, b, len);
+	}
+	for (size_t i = 0; i < len; ++i) {
+		if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return 0;
+	}
+	return 1;
+}
+
+search_t * search_create(char ** patterns, size_t * lengths, size_t count, int flags) {
+	search_t * search = malloc(sizeof(search_t));
+	search->flags = flags;
+	search->count = count;
+	search->patterns = malloc(sizeof(char *) * count);
+	search->lengths = malloc(sizeof(size_t) * count);
+	search->shortest = count ? (size_t)-1 : 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		search->lengths[i] = lengths[i];
+		search->patterns[i] = malloc(lengths[i] + 1);
+		memcpy(search->patterns[i], patterns[i], lengths[i]);
+		search->patterns[i][lengths[i]] = '\0';
+		if (lengths[i] < search->shortest) search->shortest = lengths[i];
+	}
+
+	/*
+	 * How far we can move on when the last byte under the window is c:
+	 * the closest c to the end of any pattern's first `shortest` bytes,
+	 * not counting the last of them.
+	 */
+	size_t m = search->shortest;
+	for (int c = 0; c < 256; ++c) {
+		search->shift[c] = m ? m : 1;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		for (size_t j = 0; j + 1 < m; ++j) {
+			unsigned char c = search->patterns[i][j];
+			size_t skip = m - 1 - j;
+			if (skip < search->shift[c]) search->shift[c] = skip;
+			if (flags & SEARCH_IGNORE_CASE) {
+				if (skip < search->shift[tolower(c)]) search->shift[tolower(c)] = skip;
+				if (skip < search->shift[toupper(c)]) search->shift[toupper(c)] = skip;
+			}
+		}
+	}
+
+	return search;
+}
+
+void search_free(search_t * search) {
+	for (size_t i = 0; i < search->count; ++i) {
+		free(search->patterns[i]);
+	}
+	free(search->patterns);
+	free(search->lengths);
+	free(search);
+}
+
+#ifndef NO_SSE
+static char * find_one_sse(search_t * search, const char * buf, size_t len) {
+	const char * needle = search->patterns[0];
+	size_t m = search->lengths[0];
+	size_t i = 0;
+
+	unsigned char first = needle[0];
+	unsigned char last  = needle[m - 1];
+	__m128i first_a = _mm_set1_epi8(fold(search->flags, first));
+	__m128i last_a  = _mm_set1_epi8(fold(search->flags, last));
+	__m128i first_b = first_a;
+	__m128i last_b  = last_a;
+	if (search->flags & SEARCH_IGNORE_CASE) {
+		first_b = _mm_set1_epi8(toupper(first));
+		last_b  = _mm_set1_epi8(toupper(last));
+	}
+
+	for (; i + m - 1 + 16 <= len; i += 16) {
+		__m128i head = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i tail = _mm_loadu_si128((const __m128i *)(buf + i + m - 1));
+		__m128i f = _mm_or_si128(_mm_cmpeq_epi8(head, first_a), _mm_cmpeq_epi8(head, first_b));
+		__m128i l = _mm_or_si128(_mm_cmpeq_epi8(tail, last_a), _mm_cmpeq_epi8(tail, last_b));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(f, l));
+		while (mask) {
+			unsigned int bit = __builtin_ctz(mask);
+			if (matches(search, buf + i + bit, needle, m)) {
+				return (char *)buf + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	/* The last few positions, a byte at a time */
+	for (; i + m <= len; ++i) {
+		if (fold(search->flags, buf[i]) == fold(search->flags, first) && matches(search, buf + i, needle, m)) {
+			return (char *)buf + i;
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+char * search_find(search_t * search, const char * buf, size_t len, size_t * which) {
+	size_t m = search->shortest;
+
+	if (!search->count || m > len) return NULL;
+
+	if (m == 0) {
+		/* An empty pattern matches straight away */
+		for (size_t i = 0; i < search->count; ++i) {
+			if (!search->lengths[i]) {
+				if (which) *which = i;
+				return (char *)buf;
+			}
+		}
+	}
+
+#ifndef NO_SSE
+	if (search->count == 1) {
+		if (which) *which = 0;
+		return find_one_sse(search, buf, len);
+	}
+#endif
+
+	size_t pos = 0;
+	while (pos + m <= len) {
+		for (size_t i = 0; i < search->count; ++i) {
+			size_t plen = search->lengths[i];
+			if (pos + plen <= len && matches(search, buf + pos, search->patterns[i], plen)) {
+				if (which) *which = i;
+				return (char *)buf + pos;
+			}
+		}
+		pos += search->shift[(unsigned char)buf[pos + m - 1]];
+	}
+
+	return NULL;
+}
@@ -15,6 +15,7 @@ static void _spin_unlock(volatile int * foo) { return; }
 # define rgba(r,g,b,a) (((uint32_t)a * 0x1000000) + ((uint32_t)r * 0x10000) + ((uint32_t)g * 0x100) + ((uint32_t)b * 0x1))
 # define rgb(r,g,b) rgba(r,g,b,0xFF)
 # define atof(i) (0.0f)
+#include <toaru/decodeutf8.h>
 #include <toaru/termemu.h>
 #else
 #include <stdlib.h>
@@ -24,6 +25,7 @@ static void _spin_unlock(volatile int * foo) { return; }
 #include <stdio.h>
 
 #include <toaru/graphics.h>
+#include <toaru/decodeutf8.h>
 #include <toaru/termemu.h>
 
 #include <toaru/spinlock.h>
@@ -60,41 +62,6 @@ static void ansi_buf_add(term_state_t * s, char c) {
 	s->buffer[s->buflen] = '\0';
 }
 
-static int to_eight(uint32_t codepoint, char * out) {
-	memset(out, 0x00, 7);
-
-	if (codepoint < 0x0080) {
-		out[0] = (char)codepoint;
-	} else if (codepoint < 0x0800) {
-		out[0] = 0xC0 | (codepoint >> 6);
-		out[1] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x10000) {
-		out[0] = 0xE0 | (codepoint >> 12);
-		out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[2] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x200000) {
-		out[0] = 0xF0 | (codepoint >> 18);
-		out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[3] = 0x80 | ((codepoint) & 0x3F);
-	} else if (codepoint < 0x4000000) {
-		out[0] = 0xF8 | (codepoint >> 24);
-		out[1] = 0x80 | (codepoint >> 18);
-		out[2] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[4] = 0x80 | ((codepoint) & 0x3F);
-	} else {
-		out[0] = 0xF8 | (codepoint >> 30);
-		out[1] = 0x80 | ((codepoint >> 24) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 18) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[4] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[5] = 0x80 | ((codepoint) & 0x3F);
-	}
-
-	return strlen(out);
-}
-
 
 static void _ansi_put(term_state_t * s, char c) {
 	term_callbacks_t * callbacks = s->callbacks;
@@ -116,7 +83,7 @@ static void _ansi_put(term_state_t * s, char c) {
 				if (s->box && c >= 'a' && c <= 'z') {
 					char buf[7];
 					char *w = (char *)&buf;
-					to_eight(box_chars[c-'a'], w);
+					utf8_encode(box_chars[c-'a'], w);
 					while (*w) {
 						callbacks->writer(*w);
 						w++;
@@ -576,6 +543,45 @@ void ansi_put(term_state_t * s, char c) {
 	_spin_unlock(&s->lock);
 }
 
+/*
+ * Feed a whole buffer through the parser. Outside of escapes the only
+ * bytes the parser acts on are ESC and NUL, so the runs between them
+ * go to the writer as they are, in one call if the terminal has a
+ * writer_string callback.
+ */
+void ansi_put_string(term_state_t * s, const char * str, size_t len) {
+	term_callbacks_t * callbacks = s->callbacks;
+	_spin_lock(&s->lock);
+	size_t i = 0;
+	while (i < len) {
+		if (s->escape || s->box) {
+			_ansi_put(s, str[i]);
+			i++;
+			continue;
+		}
+
+		size_t run = i;
+		while (run < len && str[run] != ANSI_ESCAPE && str[run] != 0) run++;
+
+		if (run > i) {
+			if (callbacks->writer_string) {
+				callbacks->writer_string(&str[i], run - i);
+			} else {
+				for (size_t j = i; j < run; ++j) {
+					callbacks->writer(str[j]);
+				}
+			}
+			i = run;
+		}
+
+		if (i < len) {
+			_ansi_put(s, str[i]);
+			i++;
+		}
+	}
+	_spin_unlock(&s->lock);
+}
+
 term_state_t * ansi_init(term_state_t * s, int w, int y, term_callbacks_t * callbacks_in) {
 
 	if (!s) {
@@ -15,8 +15,54 @@
 #include <toaru/textregion.h>
 #include <toaru/sdf.h>
 
+/*
+ * Glyph advances, per typeface and size. The SDF renderer rounds each
+ * character's width on its own, so a string's width is just the sum.
+ */
+struct TR_Advances {
+	int typeface;
+	int size;
+	int16_t advance[256]; /* -1 until asked for */
+};
+
+static list_t * advance_cache = NULL;
+
+/* Wide enough that nothing wraps */
+#define TR_NO_WRAP 0x7FFFFFFF
+
+static struct TR_Advances * tr_font_advances(struct TR_Font * font) {
+	if (!advance_cache) advance_cache = list_create();
+	foreach(node, advance_cache) {
+		struct TR_Advances * a = node->value;
+		if (a->typeface == font->typeface && a->size == font->size) return a;
+	}
+	struct TR_Advances * a = malloc(sizeof(struct TR_Advances));
+	a->typeface = font->typeface;
+	a->size = font->size;
+	memset(a->advance, 0xFF, sizeof(a->advance));
+	list_insert(advance_cache, a);
+	return a;
+}
+
+static int tr_font_advance(struct TR_Advances * a, unsigned char c) {
+	if (a->advance[c] < 0) {
+		char s[2] = {c, '\0'};
+		a->advance[c] = draw_sdf_string_width(s, a->size, a->typeface);
+	}
+	return a->advance[c];
+}
+
+static int tr_font_get_width_n(struct TR_Font * font, char * string, int length) {
+	struct TR_Advances * a = tr_font_advances(font);
+	int width = 0;
+	for (int i = 0; i < length && string[i]; ++i) {
+		width += tr_font_advance(a, string[i]);
+	}
+	return width;
+}
+
 int tr_font_get_width(struct TR_Font * font, char * string) {
-	return draw_sdf_string_width(string, font->size, font->typeface);
+	return tr_font_get_width_n(font, string, TR_NO_WRAP);
 }
 
 int tr_font_write(struct TR_Font * font, gfx_context_t * ctx, int x, int y, char * string) {
@@ -44,6 +90,125 @@ void tr_textunit_set_extra(struct TR_TextUnit * self, char * key, void * data) {
 	hashmap_set(self->extra, key, data);
 }
 
+/*
+ * A paragraph is one line of the region's text, and keeps the lines it
+ * was last broken into along with the width they were broken for. It
+ * only needs breaking again when that width changes, unless it fit on
+ * one line at both widths.
+ */
+static char * tr_strndup(const char * s, size_t length) {
+	char * out = malloc(length + 1);
+	memcpy(out, s, length);
+	out[length] = '\0';
+	return out;
+}
+
+struct TR_Line {
+	char * string;
+	int width;
+};
+
+struct TR_Paragraph {
+	char * text;
+	int natural_width; /* -1 until measured */
+	int wrap_width;
+	struct TR_Line * lines;
+	int line_count;
+};
+
+static void tr_paragraph_invalidate(struct TR_Paragraph * p) {
+	for (int i = 0; i < p->line_count; ++i) {
+		free(p->lines[i].string);
+	}
+	free(p->lines);
+	p->lines = NULL;
+	p->line_count = 0;
+	p->natural_width = -1;
+}
+
+static void tr_paragraph_free(struct TR_Paragraph * p) {
+	tr_paragraph_invalidate(p);
+	free(p->text);
+	free(p);
+}
+
+static void tr_paragraph_add_line(struct TR_Paragraph * p, struct TR_Font * font, char * start, int length) {
+	p->lines = realloc(p->lines, sizeof(struct TR_Line) * (p->line_count + 1));
+	struct TR_Line * line = &p->lines[p->line_count++];
+	line->string = tr_strndup(start, length);
+	line->width = tr_font_get_width_n(font, start, length);
+}
+
+static void tr_paragraph_layout(struct TR_TextRegion * self, struct TR_Paragraph * p, int width) {
+	struct TR_Font * font = self->font;
+	struct TR_Advances * a = tr_font_advances(font);
+
+	tr_paragraph_invalidate(p);
+	p->natural_width = tr_font_get_width(font, p->text);
+	p->wrap_width = width;
+
+	char * text = p->text;
+	int len = strlen(text);
+	int pos = 0;
+
+	if (self->one_line || p->natural_width <= width) {
+		tr_paragraph_add_line(p, font, text, len);
+		return;
+	}
+
+	while (pos < len) {
+		int start = pos;
+		int w = 0;
+		int last_break = -1;
+		int i = pos;
+		while (i < len) {
+			int advance = tr_font_advance(a, text[i]);
+			if (w + advance > width && i > start) break;
+			w += advance;
+			if (text[i] == ' ') last_break = i + 1;
+			i++;
+		}
+
+		if (i == len) {
+			tr_paragraph_add_line(p, font, text + start, len - start);
+			break;
+		}
+
+		int end = i;
+		if (!self->break_all && last_break > start) {
+			/* Break after the last space, and don't keep it */
+			end = last_break;
+			int trimmed = end;
+			while (trimmed > start && text[trimmed-1] == ' ') trimmed--;
+			tr_paragraph_add_line(p, font, text + start, trimmed - start);
+		} else {
+			/* A word longer than the line, or break_all */
+			tr_paragraph_add_line(p, font, text + start, end - start);
+		}
+
+		pos = end;
+		while (pos < len && text[pos] == ' ') pos++;
+	}
+
+	if (!p->line_count) {
+		tr_paragraph_add_line(p, font, text, 0);
+	}
+}
+
+static int tr_paragraph_valid(struct TR_TextRegion * self, struct TR_Paragraph * p, int width) {
+	if (!p->lines) return 0;
+	if (p->wrap_width == width) return 1;
+	/* Unwrapped both times */
+	return p->natural_width <= width && p->natural_width <= p->wrap_width;
+}
+
+static void tr_textregion_invalidate(struct TR_TextRegion * self) {
+	if (!self->paragraphs) return;
+	foreach(node, self->paragraphs) {
+		tr_paragraph_invalidate(node->value);
+	}
+}
+
 void tr_textregion_set_alignment(struct TR_TextRegion * self, int align) {
 	self->align = align;
 }
@@ -57,29 +222,180 @@ void tr_textregion_set_max_lines(struct TR_TextRegion * self, int max_lines) {
 	tr_textregion_reflow(self);
 }
 
+static int tr_textregion_line_height(struct TR_TextRegion * self) {
+	if (self->line_height) return self->line_height;
+	return self->font ? self->font->size : 1;
+}
+
 int tr_textregion_get_visible_lines(struct TR_TextRegion * self) {
-	return self->height / self->line_height;
+	return self->height / tr_textregion_line_height(self);
 }
 
+/*
+ * Lay out any paragraph whose lines are out of date for the current
+ * width, then collect everyone's lines in order.
+ */
 void tr_textregion_reflow(struct TR_TextRegion * self) {
 	if (self->lines) {
-		fprintf(stderr, "Need to clean out lines\n");
-#if 0
-		list_destroy(self->lines);
 		list_free(self->lines);
 		free(self->lines);
-#endif
 	}
-
-#if 0
 	self->lines = list_create();
 
-	int current_width = 0;
-	list_t * current_units = list_create();
-	struct TR_TextUnit * leftover = NULL;
+	if (!self->font || !self->paragraphs) return;
+
+	int width = self->one_line ? TR_NO_WRAP : self->width;
+
+	foreach(node, self->paragraphs) {
+		struct TR_Paragraph * p = node->value;
+		if (!tr_paragraph_valid(self, p, width)) {
+			tr_paragraph_layout(self, p, width);
+		}
+		for (int i = 0; i < p->line_count; ++i) {
+			list_insert(self->lines, &p->lines[i]);
+		}
+	}
+}
+
+/*
+ * Replace the text. Paragraphs before the first one that changed keep
+ * their layout; the rest are laid out again.
+ */
+void tr_textregion_set_text(struct TR_TextRegion * self, char * text) {
+	if (!self->paragraphs) self->paragraphs = list_create();
+
+	char * c = text;
+	node_t * node = self->paragraphs->head;
+	while (node) {
+		struct TR_Paragraph * p = node->value;
+		size_t len = strlen(p->text);
+		if (strncmp(c, p->text, len) || (c[len] != '\n' && c[len] != '\0')) break;
+		/* The last paragraph only matches if the text ends there too */
+		if (c[len] == '\0' && node->next) break;
+		if (c[len] == '\0' && !node->next) {
+			c += len;
+			node = NULL;
+			goto _done;
+		}
+		c += len + 1;
+		node = node->next;
+	}
+
+	/* Drop everything from the first changed paragraph on */
+	while (node) {
+		node_t * next = node->next;
+		tr_paragraph_free(node->value);
+		list_delete(self->paragraphs, node);
+		free(node);
+		node = next;
+	}
+
+	while (1) {
+		char * end = strchrnul(c, '\n');
+		struct TR_Paragraph * p = calloc(1, sizeof(struct TR_Paragraph));
+		p->text = tr_strndup(c, end - c);
+		p->natural_width = -1;
+		list_insert(self->paragraphs, p);
+		if (!*end) break;
+		c = end + 1;
+	}
+
+_done:
+	if (self->text != text) {
+		free(self->text);
+		self->text = strdup(text);
+	}
+	tr_textregion_reflow(self);
+}
+
+void tr_textregion_set_one_line(struct TR_TextRegion * self, bool one_line) {
+	if (self->one_line == one_line) return;
+	self->one_line = one_line;
+	tr_textregion_invalidate(self);
+	tr_textregion_reflow(self);
+}
+
+void tr_textregion_set_ellipsis(struct TR_TextRegion * self, char * ellipsis) {
+	free(self->ellipsis);
+	self->ellipsis = ellipsis ? strdup(ellipsis) : NULL;
+}
+
+void tr_textregion_set_font(struct TR_TextRegion * self, struct TR_Font * font) {
+	self->font = font;
+	tr_textregion_invalidate(self);
+	tr_textregion_reflow(self);
+}
+
+void tr_textregion_set_line_height(struct TR_TextRegion * self, int line_height) {
+	self->line_height = line_height;
+}
+
+void tr_textregion_resize(struct TR_TextRegion * self, int width, int height) {
+	self->height = height;
+	if (self->width == width) return;
+	self->width = width;
+	tr_textregion_reflow(self);
+}
+
+void tr_textregion_move(struct TR_TextRegion * self, int x, int y) {
+	self->x = x;
+	self->y = y;
+}
+
+void tr_textregion_draw(struct TR_TextRegion * self, gfx_context_t * ctx) {
+	if (!self->font || !self->lines) return;
+
+	int line_height = tr_textregion_line_height(self);
+	int visible = tr_textregion_get_visible_lines(self);
+	if (self->max_lines && self->max_lines < visible) visible = self->max_lines;
+	if (self->one_line && visible > 1) visible = 1;
+
+	int total = self->lines->length;
+	int first = self->scroll < 0 ? 0 : self->scroll;
+	int shown = total - first;
+	if (shown > visible) shown = visible;
+	if (shown <= 0) return;
+
+	int y = self->y;
+	if (self->valign == TR_VALIGN_MIDDLE) {
+		y += (self->height - shown * line_height) / 2;
+	} else if (self->valign == TR_VALIGN_BOTTOM) {
+		y += self->height - shown * line_height;
+	}
 
 	int i = 0;
-	while (i < self->text_units
-#endif
+	foreach(node, self->lines) {
+		if (i >= first + shown) break;
+		if (i++ < first) continue;
+
+		struct TR_Line * line = node->value;
+		char * string = line->string;
+		int width = line->width;
+		char * cut = NULL;
+
+		if (i == first + shown && i < total && self->ellipsis) {
+			/* More follows than fits; end on the ellipsis */
+			int e_width = tr_font_get_width(self->font, self->ellipsis);
+			int length = strlen(string);
+			while (length && tr_font_get_width_n(self->font, string, length) + e_width > self->width) {
+				length--;
+			}
+			cut = malloc(length + strlen(self->ellipsis) + 1);
+			memcpy(cut, string, length);
+			strcpy(cut + length, self->ellipsis);
+			string = cut;
+			width = tr_font_get_width(self->font, cut);
+		}
 
+		int x = self->x;
+		if (self->align == TR_ALIGN_CENTER) {
+			x += (self->width - width) / 2;
+		} else if (self->align == TR_ALIGN_RIGHT) {
+			x += self->width - width;
+		}
+
+		tr_font_write(self->font, ctx, x, y, string);
+		y += line_height;
+		free(cut);
+	}
 }
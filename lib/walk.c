@@ -0,0 +1,224 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Directory tree walker
+ *
+ * Reads a whole tree into memory for tools like du that want to
+ * look at every file under a path. Each directory is opened once
+ * and listed with a few large getdents() calls, and its entries are
+ * looked at with fstatat() against the open directory instead of by
+ * full path. Directories found along the way go into a queue that a
+ * few threads take them from, so a big tree is read in parallel.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <toaru/list.h>
+#include <toaru/walk.h>
+
+#define WALK_THREADS 4
+#define WALK_BATCH   64
+
+static struct walk_state {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	list_t * queue;  /* Directories waiting to be read */
+	int pending;     /* Directories queued or being read */
+} state;
+
+static walk_node_t * node_new(walk_node_t * parent, const char * name) {
+	size_t len = strlen(name);
+	walk_node_t * node = calloc(1, sizeof(walk_node_t) + len + 1);
+	if (!node) return NULL;
+	node->parent = parent;
+	memcpy(node->name, name, len + 1);
+	return node;
+}
+
+char * walk_path(walk_node_t * node) {
+	size_t len = 0;
+	for (walk_node_t * n = node; n; n = n->parent) {
+		len += strlen(n->name) + 1;
+	}
+
+	char * out = malloc(len + 1);
+	char * end = out + len;
+	*end = '\0';
+	for (walk_node_t * n = node; n; n = n->parent) {
+		size_t l = strlen(n->name);
+		end -= l;
+		memcpy(end, n->name, l);
+		if (n->parent) {
+			/* A root of "/" (or "foo/") already ends in one */
+			size_t pl = strlen(n->parent->name);
+			if (!pl || n->parent->name[pl-1] != '/' || n->parent->parent) {
+				*--end = '/';
+			}
+		}
+	}
+	/* Anything skipped above leaves room at the front */
+	if (end != out) memmove(out, end, strlen(end) + 1);
+	return out;
+}
+
+static int add_child(walk_node_t * node, walk_node_t * child, size_t * space) {
+	if (node->child_count == *space) {
+		size_t n = *space ? *space * 2 : 16;
+		walk_node_t ** c = realloc(node->children, n * sizeof(walk_node_t *));
+		if (!c) return -1;
+		node->children = c;
+		*space = n;
+	}
+	node->children[node->child_count++] = child;
+	return 0;
+}
+
+static void stat_child(int fd, walk_node_t * child) {
+	if (fstatat(fd, child->name, &child->st, AT_SYMLINK_NOFOLLOW) == 0) return;
+
+	/* Mounted over, or something else the directory can't answer for */
+	char * path = walk_path(child);
+	if (lstat(path, &child->st) < 0) {
+		child->error = errno;
+	}
+	free(path);
+}
+
+/* List one directory; the subdirectories are queued for whoever is free */
+static void read_directory(walk_node_t * node, struct dirent * ents) {
+	char * path = walk_path(node);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0) {
+		node->error = errno;
+		return;
+	}
+
+	list_t * found = list_create();
+	size_t space = 0;
+	int count;
+	while ((count = getdents(fd, ents, WALK_BATCH)) > 0) {
+		for (int i = 0; i < count; ++i) {
+			char * name = ents[i].d_name;
+			if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+			walk_node_t * child = node_new(node, name);
+			if (!child || add_child(node, child, &space) < 0) {
+				free(child);
+				node->error = ENOMEM;
+				break;
+			}
+			stat_child(fd, child);
+			if (!child->error && S_ISDIR(child->st.st_mode)) {
+				list_insert(found, child);
+			}
+		}
+	}
+	if (count < 0 && !node->error) node->error = errno;
+	close(fd);
+
+	if (found->length) {
+		pthread_mutex_lock(&state.lock);
+		state.pending += found->length;
+		list_merge(state.queue, found);
+		pthread_cond_broadcast(&state.wake);
+		pthread_mutex_unlock(&state.lock);
+	} else {
+		list_free(found);
+		free(found);
+	}
+}
+
+static void * walk_worker(void * arg) {
+	struct dirent * ents = malloc(sizeof(struct dirent) * WALK_BATCH);
+
+	pthread_mutex_lock(&state.lock);
+	while (1) {
+		while (!state.queue->length && state.pending) {
+			pthread_cond_wait(&state.wake, &state.lock);
+		}
+		if (!state.pending) break;
+
+		node_t * next = list_dequeue(state.queue);
+		walk_node_t * node = next->value;
+		free(next);
+		pthread_mutex_unlock(&state.lock);
+
+		read_directory(node, ents);
+
+		pthread_mutex_lock(&state.lock);
+		if (--state.pending == 0) {
+			pthread_cond_broadcast(&state.wake);
+		}
+	}
+	pthread_mutex_unlock(&state.lock);
+
+	free(ents);
+	return NULL;
+}
+
+static uint64_t sum_totals(walk_node_t * node) {
+	if (!S_ISDIR(node->st.st_mode)) {
+		node->total = node->error ? 0 : node->st.st_size;
+		return node->total;
+	}
+	node->total = 0;
+	for (size_t i = 0; i < node->child_count; ++i) {
+		node->total += sum_totals(node->children[i]);
+	}
+	return node->total;
+}
+
+walk_node_t * walk_tree(const char * path, int threads) {
+	walk_node_t * root = node_new(NULL, path);
+	if (!root) return NULL;
+
+	if (lstat(path, &root->st) < 0) {
+		root->error = errno;
+		return root;
+	}
+	if (!S_ISDIR(root->st.st_mode)) {
+		root->total = root->st.st_size;
+		return root;
+	}
+
+	if (threads <= 0) threads = WALK_THREADS;
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.wake, NULL);
+	state.queue = list_create();
+	state.pending = 1;
+	list_insert(state.queue, root);
+
+	/* This thread is one of the walkers */
+	pthread_t workers[threads];
+	int running = 0;
+	for (int i = 1; i < threads; ++i) {
+		if (pthread_create(&workers[running], NULL, walk_worker, NULL) == 0) {
+			running++;
+		}
+	}
+	walk_worker(NULL);
+	for (int i = 0; i < running; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(state.queue);
+	sum_totals(root);
+	return root;
+}
+
+void walk_free(walk_node_t * node) {
+	for (size_t i = 0; i < node->child_count; ++i) {
+		walk_free(node->children[i]);
+	}
+	free(node->children);
+	free(node);
+}
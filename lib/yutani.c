@@ -23,27 +23,130 @@
 /* We need the flags but don't want the library dep (maybe the flags should be here?) */
 #include <toaru/./decorations.h>
 
+static int yutani_batch_flush(yutani_t * y);
+
+static int yutani_events_pending(yutani_t * y) {
+	return y->events && y->events->head != y->events->tail;
+}
+
+/* Take the next event from the ring; there must be one */
+static yutani_msg_t * yutani_events_take(yutani_t * y) {
+	yutani_event_ring_t * ring = y->events;
+	uint32_t tail = ring->tail;
+	yutani_msg_t * event = (yutani_msg_t *)ring->events[tail % YUTANI_EVENT_RING_SIZE];
+
+	size_t size = event->size;
+	if (size > YUTANI_EVENT_SIZE) size = YUTANI_EVENT_SIZE;
+	yutani_msg_t * out = malloc(size);
+	memcpy(out, event, size);
+	out->size = size;
+
+	/* Done reading the slot before the server can reuse it */
+	__sync_synchronize();
+	ring->tail = tail + 1;
+	return out;
+}
+
+/*
+ * Ring the bell on the next event, for when we're about to wait on the
+ * socket. Returns 1 if an event got in first, and there's no need.
+ */
+static int yutani_events_arm(yutani_t * y) {
+	if (!y->events) return 0;
+	y->events->bell = 1;
+	__sync_synchronize();
+	return yutani_events_pending(y);
+}
+
+/*
+ * Messages that arrive while we wait for a reply are put aside for
+ * yutani_poll: small ones in the connection's arena, larger ones (or
+ * all of them, once the arena has filled up) on the queued list, so
+ * they still come out in order.
+ */
+static void yutani_put_aside(yutani_t * y, yutani_msg_t * msg, size_t size) {
+	if (!y->queued->length && size <= YUTANI_ARENA_SLOT_SIZE && y->arena_head - y->arena_tail < YUTANI_ARENA_SLOTS) {
+		memcpy(y->arena[y->arena_head % YUTANI_ARENA_SLOTS], msg, size);
+		y->arena_head++;
+		return;
+	}
+	yutani_msg_t * copy = malloc(size);
+	memcpy(copy, msg, size);
+	list_insert(y->queued, copy);
+}
+
+static int yutani_aside_pending(yutani_t * y) {
+	return y->arena_head != y->arena_tail || y->queued->length;
+}
+
+static yutani_msg_t * yutani_take_aside(yutani_t * y) {
+	if (y->arena_head != y->arena_tail) {
+		yutani_msg_t * msg = (yutani_msg_t *)y->arena[y->arena_tail % YUTANI_ARENA_SLOTS];
+		size_t size = msg->size > YUTANI_ARENA_SLOT_SIZE ? YUTANI_ARENA_SLOT_SIZE : msg->size;
+		yutani_msg_t * out = malloc(size);
+		memcpy(out, msg, size);
+		y->arena_tail++;
+		return out;
+	}
+	node_t * node = list_dequeue(y->queued);
+	yutani_msg_t * out = node->value;
+	free(node);
+	return out;
+}
+
+static void _handle_internal(yutani_t * y, yutani_msg_t * out);
+
+/* Give a message to its type's handler, if there is one; returns 1 if there was */
+static int yutani_dispatch(yutani_t * y, yutani_msg_t * msg) {
+	struct yutani_handler * handler = hashmap_get(y->handlers, (void *)msg->type);
+	if (!handler) return 0;
+	_handle_internal(y, msg);
+	handler->func(y, msg, handler->data);
+	return 1;
+}
+
+/**
+ * yutani_set_handler
+ *
+ * Have messages of one type go to a function as soon as they are read,
+ * even while waiting for some other reply, instead of coming out of
+ * yutani_poll. The message is only good until the function returns.
+ * A NULL func goes back to the usual way.
+ */
+void yutani_set_handler(yutani_t * y, uint32_t type, yutani_handler_t func, void * data) {
+	struct yutani_handler * handler = hashmap_remove(y->handlers, (void *)type);
+	free(handler);
+	if (!func) return;
+
+	handler = malloc(sizeof(struct yutani_handler));
+	handler->func = func;
+	handler->data = data;
+	hashmap_set(y->handlers, (void *)type, handler);
+}
+
 /**
  * yutani_wait_for
  *
- * Wait for a particular kind of message, queuing other types
- * of messages for processing later.
+ * Wait for a particular kind of message, putting other types
+ * of messages aside for processing later.
  */
 yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type) {
+	yutani_batch_flush(y);
 	do {
-		yutani_msg_t * out;
-		size_t size;
-		{
-			char tmp[MAX_PACKET_SIZE];
-			size = pex_recv(y->sock, tmp);
-			out = malloc(size);
-			memcpy(out, tmp, size);
-		}
-
-		if (out->type == type) {
+		/* Read into the connection's buffer; only the reply needs to be kept */
+		int size = pex_recv(y->sock, (char *)y->recv);
+		if (size <= 0) continue;
+		yutani_msg_t * in = y->recv;
+
+		if (in->type == type) {
+			yutani_msg_t * out = malloc(size);
+			memcpy(out, in, size);
 			return out;
-		} else {
-			list_insert(y->queued, out);
+		} else if (in->type == YUTANI_MSG_EVENT_RING) {
+			/* The events stay in the ring for yutani_poll */
+			continue;
+		} else if (!yutani_dispatch(y, in)) {
+			yutani_put_aside(y, in, size);
 		}
 	} while (1); /* XXX: (!y->abort) */
 }
@@ -55,8 +158,12 @@ yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type) {
  * internal queue or directly from the server interface.
  */
 size_t yutani_query(yutani_t * y) {
-	if (y->queued->length > 0) return 1;
-	return pex_query(y->sock);
+	if (yutani_aside_pending(y)) return 1;
+	if (yutani_events_pending(y)) return 1;
+	size_t queued = pex_query(y->sock);
+	if (queued) return queued;
+	/* Nothing; whoever asked is likely to wait on the socket next */
+	return yutani_events_arm(y);
 }
 
 /**
@@ -102,36 +209,58 @@ static void _handle_internal(yutani_t * y, yutani_msg_t * out) {
 	}
 }
 
-/**
- * yutani_poll
- *
- * Wait for a message to be available, processing it if
- * it has internal processing requirements.
- */
-yutani_msg_t * yutani_poll(yutani_t * y) {
+/* The next message from anywhere, waiting for one if need be */
+static yutani_msg_t * yutani_next(yutani_t * y) {
 	yutani_msg_t * out;
 
-	if (y->queued->length > 0) {
-		node_t * node = list_dequeue(y->queued);
-		out = (yutani_msg_t *)node->value;
-		free(node);
-		_handle_internal(y, out);
-		return out;
+	if (yutani_aside_pending(y)) {
+		return yutani_take_aside(y);
 	}
 
-	size_t size;
-	{
-		char tmp[MAX_PACKET_SIZE];
-		size = pex_recv(y->sock, tmp);
-		out = malloc(size);
-		memcpy(out, tmp, size);
+	if (yutani_events_pending(y) || yutani_events_arm(y)) {
+		return yutani_events_take(y);
 	}
 
-	_handle_internal(y, out);
+	/* Don't sit waiting on an answer to something we haven't sent */
+	yutani_batch_flush(y);
+
+	/* Read straight into what we hand back */
+	out = malloc(MAX_PACKET_SIZE);
+	pex_recv(y->sock, (char *)out);
+
+	/*
+	 * If the bell was for events we've already taken, hand it back
+	 * anyway; nobody has a case for it, and we shouldn't wait again.
+	 */
+	if (out->type == YUTANI_MSG_EVENT_RING && yutani_events_pending(y)) {
+		free(out);
+		out = yutani_events_take(y);
+	}
 
 	return out;
 }
 
+/**
+ * yutani_poll
+ *
+ * Wait for a message to be available, processing it if
+ * it has internal processing requirements. Messages with a
+ * handler go to it instead; if that leaves nothing else
+ * waiting, returns NULL.
+ */
+yutani_msg_t * yutani_poll(yutani_t * y) {
+	do {
+		yutani_msg_t * out = yutani_next(y);
+		if (!yutani_dispatch(y, out)) {
+			_handle_internal(y, out);
+			return out;
+		}
+		free(out);
+	} while (yutani_query(y));
+
+	return NULL;
+}
+
 /**
  * yutani_poll_async
  *
@@ -440,6 +569,20 @@ void yutani_msg_buildx_window_update_shape(yutani_msg_t * msg, yutani_wid_t wid,
 	mw->set_shape = set_shape;
 }
 
+void yutani_msg_buildx_window_opaque_region(yutani_msg_t * msg, yutani_wid_t wid, int32_t x, int32_t y, int32_t width, int32_t height) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_WINDOW_OPAQUE_REGION;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_opaque_region);
+
+	struct yutani_msg_window_opaque_region * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->x = x;
+	mw->y = y;
+	mw->width = width;
+	mw->height = height;
+}
+
 
 void yutani_msg_buildx_window_warp_mouse(yutani_msg_t * msg, yutani_wid_t wid, int32_t x, int32_t y) {
 	msg->magic = YUTANI_MSG__MAGIC;
@@ -500,8 +643,76 @@ void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content) {
 	memcpy(cl->content, content, strlen(content));
 }
 
+void yutani_msg_buildx_window_frame(yutani_msg_t * msg, yutani_wid_t wid, uint32_t time) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_WINDOW_FRAME;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_frame);
+
+	struct yutani_msg_window_frame * mw = (void *)msg->data;
+
+	mw->wid = wid;
+	mw->time = time;
+}
+
+#define YUTANI_BATCH_SIZE 4096
+
+static int yutani_batch_flush(yutani_t * y) {
+	if (!y->batch_used) return 0;
+	int out = pex_send_batch(y->sock, y->batch, y->batch_used);
+	y->batch_used = 0;
+	return out;
+}
+
 int yutani_msg_send(yutani_t * y, yutani_msg_t * msg) {
-	return pex_reply(y->sock, msg->size, (char *)msg);
+	if (!y->batching) {
+		return pex_reply(y->sock, msg->size, (char *)msg);
+	}
+
+	if (y->batch_used + PEX_RECORD_SIZE(msg->size) > YUTANI_BATCH_SIZE) {
+		yutani_batch_flush(y);
+	}
+
+	struct pex_record * record = (struct pex_record *)(y->batch + y->batch_used);
+	record->source = 0;
+	record->size = msg->size;
+	memcpy(record->data, msg, msg->size);
+	y->batch_used += PEX_RECORD_SIZE(msg->size);
+	return msg->size;
+}
+
+/**
+ * yutani_batch_begin
+ *
+ * Hold back messages sent from here on, and send them all together
+ * with yutani_batch_end, in one call to the server instead of one
+ * each. Waiting on the server also sends them, so requests that
+ * expect an answer still work.
+ */
+void yutani_batch_begin(yutani_t * y) {
+	if (!y->batch) {
+		y->batch = malloc(YUTANI_BATCH_SIZE);
+	}
+	y->batching = 1;
+}
+
+int yutani_batch_end(yutani_t * y) {
+	y->batching = 0;
+	return yutani_batch_flush(y);
+}
+
+/**
+ * yutani_msg_send_batch
+ *
+ * Send several messages in one go.
+ */
+int yutani_msg_send_batch(yutani_t * y, yutani_msg_t ** msgs, int count) {
+	int batching = y->batching;
+	yutani_batch_begin(y);
+	for (int i = 0; i < count; ++i) {
+		yutani_msg_send(y, msgs[i]);
+	}
+	if (batching) return 0;
+	return yutani_batch_end(y);
 }
 
 yutani_t * yutani_context_create(FILE * socket) {
@@ -512,6 +723,15 @@ yutani_t * yutani_context_create(FILE * socket) {
 	out->display_height = 0;
 	out->windows = hashmap_create_int(10);
 	out->queued = list_create();
+	out->arena_head = 0;
+	out->arena_tail = 0;
+	out->arena = malloc(YUTANI_ARENA_SLOTS * YUTANI_ARENA_SLOT_SIZE);
+	out->recv = malloc(MAX_PACKET_SIZE);
+	out->handlers = hashmap_create_int(10);
+	out->events = NULL;
+	out->batching = 0;
+	out->batch_used = 0;
+	out->batch = NULL;
 	return out;
 }
 
@@ -573,6 +793,9 @@ yutani_window_t * yutani_window_create_flags(yutani_t * y, int width, int height
 	win->y = 0;
 	win->user_data = NULL;
 	win->ctx = y;
+	win->sparebufid = 0;
+	win->sparebuffer = NULL;
+	win->oldbuffer = NULL;
 	free(mm);
 
 	hashmap_set(y->windows, (void*)win->wid, win);
@@ -582,6 +805,22 @@ yutani_window_t * yutani_window_create_flags(yutani_t * y, int width, int height
 
 	size_t size = (width * height * 4);
 	win->buffer = shm_obtain(key, &size);
+
+	YUTANI_SHMKEY_DAMAGE(y->server_ident, key, 1024, win->wid);
+	size = sizeof(yutani_damage_ring_t);
+	win->damage = shm_obtain(key, &size);
+
+	if (!y->events) {
+		/* Our first window; the server made the event ring with it */
+		YUTANI_SHMKEY_EVENTS(y->server_ident, key, 1024, win->wid);
+		size = sizeof(yutani_event_ring_t);
+		y->events = shm_obtain(key, &size);
+		if (y->events) {
+			y->events->bell = 1;
+			__sync_synchronize();
+			y->events->ready = 1;
+		}
+	}
 	return win;
 
 }
@@ -595,12 +834,43 @@ yutani_window_t * yutani_window_create(yutani_t * y, int width, int height) {
 	return yutani_window_create_flags(y,width,height,0);
 }
 
+/*
+ * Queue a damaged rectangle for the server to pick up on its next
+ * frame. Must not be called once the ring is gone.
+ */
+static void yutani_damage_push(yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height, int32_t dy, uint32_t drawn) {
+	yutani_damage_ring_t * ring = win->damage;
+	uint32_t head = ring->head;
+
+	if (head - ring->tail >= YUTANI_DAMAGE_RING_SIZE) {
+		/* Server hasn't caught up; it will redraw everything instead */
+		ring->overflow = 1;
+		return;
+	}
+
+	yutani_damage_entry_t * entry = &ring->entries[head % YUTANI_DAMAGE_RING_SIZE];
+	entry->rect.x = x;
+	entry->rect.y = y;
+	entry->rect.width = width;
+	entry->rect.height = height;
+	entry->dy = dy;
+	entry->drawn = drawn;
+
+	/* The rectangle has to be there before the server can see it */
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
 /**
  * yutani_flip
  *
  * Ask the server to redraw the window.
  */
 void yutani_flip(yutani_t * y, yutani_window_t * win) {
+	if (win->damage) {
+		yutani_damage_push(win, 0, 0, win->width, win->height, 0, 0);
+		return;
+	}
 	yutani_msg_buildx_flip_alloc(m);
 	yutani_msg_buildx_flip(m, win->wid);
 	yutani_msg_send(y, m);
@@ -612,11 +882,71 @@ void yutani_flip(yutani_t * y, yutani_window_t * win) {
  * Ask the server to redraw a region relative the window.
  */
 void yutani_flip_region(yutani_t * yctx, yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height) {
+	if (win->damage) {
+		yutani_damage_push(win, x, y, width, height, 0, 0);
+		return;
+	}
 	yutani_msg_buildx_flip_region_alloc(m);
 	yutani_msg_buildx_flip_region(m, win->wid, x, y, width, height);
 	yutani_msg_send(yctx, m);
 }
 
+/**
+ * yutani_window_scroll
+ *
+ * Move the contents of a rectangle of the window down `dy` rows (up,
+ * if negative), dropping whatever goes off the edge, and let the server
+ * move its copy on screen the same way. The rows left uncovered keep
+ * what they had; draw them and flip them like anything else.
+ */
+void yutani_window_scroll(yutani_t * yctx, yutani_window_t * win, int32_t x, int32_t y, int32_t width, int32_t height, int32_t dy) {
+	if (x < 0) { width += x; x = 0; }
+	if (y < 0) { height += y; y = 0; }
+	if (x + width > (int32_t)win->width) width = win->width - x;
+	if (y + height > (int32_t)win->height) height = win->height - y;
+	if (width <= 0 || height <= 0 || !dy) return;
+
+	int32_t moved = height - (dy > 0 ? dy : -dy);
+	uint32_t drawn = win->damage ? win->damage->drawn : 0;
+	__sync_synchronize();
+
+	if (moved > 0) {
+		uint32_t * buffer = (uint32_t *)win->buffer;
+		size_t row = width * sizeof(uint32_t);
+		if (dy < 0) {
+			for (int32_t i = 0; i < moved; ++i) {
+				memmove(&buffer[(y + i) * win->width + x], &buffer[(y + i - dy) * win->width + x], row);
+			}
+		} else {
+			for (int32_t i = moved - 1; i >= 0; --i) {
+				memmove(&buffer[(y + i + dy) * win->width + x], &buffer[(y + i) * win->width + x], row);
+			}
+		}
+	}
+
+	if (!win->damage || moved <= 0) {
+		yutani_flip_region(yctx, win, x, y, width, height);
+		return;
+	}
+
+	/* The move has to be done before the server can see it */
+	__sync_synchronize();
+	yutani_damage_push(win, x, y, width, height, dy, drawn);
+}
+
+/**
+ * yutani_window_request_frame
+ *
+ * Ask for a YUTANI_MSG_WINDOW_FRAME once the server has put its next
+ * frame on screen, so animations can draw exactly once per frame.
+ * Returns -1 if the server can't do that.
+ */
+int yutani_window_request_frame(yutani_t * yctx, yutani_window_t * win) {
+	if (!win->damage) return -1;
+	win->damage->frame_requested = 1;
+	return 0;
+}
+
 /**
  * yutani_close
  *
@@ -633,6 +963,14 @@ void yutani_close(yutani_t * y, yutani_window_t * win) {
 		char key[1024];
 		YUTANI_SHMKEY_EXP(y->server_ident, key, 1024, win->bufid);
 		shm_release(key);
+		if (win->sparebufid) {
+			YUTANI_SHMKEY_EXP(y->server_ident, key, 1024, win->sparebufid);
+			shm_release(key);
+		}
+		if (win->damage) {
+			YUTANI_SHMKEY_DAMAGE(y->server_ident, key, 1024, win->wid);
+			shm_release(key);
+		}
 	}
 
 	hashmap_remove(y->windows, (void*)win->wid);
@@ -709,17 +1047,28 @@ void yutani_window_resize_accept(yutani_t * yctx, yutani_window_t * window, uint
 	window->width = wr->width;
 	window->height = wr->height;
 	window->oldbufid = window->bufid;
+	window->oldbuffer = window->buffer;
 	window->bufid = wr->bufid;
 	free(mm);
 
-	/* Allocate the buffer */
-	{
+	if (window->sparebufid && window->bufid == window->sparebufid) {
+		/* Our previous buffer was big enough; it's already mapped */
+		window->buffer = window->sparebuffer;
+	} else {
 		char key[1024];
+		if (window->sparebufid) {
+			/* The server has let go of it, so we can too */
+			YUTANI_SHMKEY_EXP(yctx->server_ident, key, 1024, window->sparebufid);
+			shm_release(key);
+		}
+
 		YUTANI_SHMKEY(yctx->server_ident, key, 1024, window);
 
 		size_t size = (window->width * window->height * 4);
 		window->buffer = shm_obtain(key, &size);
 	}
+	window->sparebufid = 0;
+	window->sparebuffer = NULL;
 }
 
 /**
@@ -730,12 +1079,10 @@ void yutani_window_resize_accept(yutani_t * yctx, yutani_window_t * window, uint
  * discard the old buffer and switch to the new one.
  */
 void yutani_window_resize_done(yutani_t * yctx, yutani_window_t * window) {
-	/* Destroy the old buffer */
-	{
-		char key[1024];
-		YUTANI_SHMKEY_EXP(yctx->server_ident, key, 1024, window->oldbufid);
-		shm_release(key);
-	}
+	/* Keep the old buffer; the server may give it back next time */
+	window->sparebufid = window->oldbufid;
+	window->sparebuffer = window->oldbuffer;
+	window->oldbuffer = NULL;
 
 	yutani_msg_buildx_window_resize_alloc(m);
 	yutani_msg_buildx_window_resize(m, YUTANI_MSG_RESIZE_DONE, window->wid, window->width, window->height, window->bufid, 0);
@@ -929,6 +1276,22 @@ void yutani_window_update_shape(yutani_t * yctx, yutani_window_t * window, int s
 	yutani_msg_send(yctx, m);
 }
 
+/**
+ * yutani_window_set_opaque
+ *
+ * Promise that every pixel in a rectangle of the window is fully
+ * opaque, so the server copies it instead of blending it and skips
+ * drawing whatever is under it. Windows with a frame will want to
+ * pass the area inside their decorations. A zero-sized rectangle
+ * takes the promise back. Resizing the window also forgets it, so
+ * send it again after yutani_window_resize_done.
+ */
+void yutani_window_set_opaque(yutani_t * yctx, yutani_window_t * window, int32_t x, int32_t y, int32_t width, int32_t height) {
+	yutani_msg_buildx_window_opaque_region_alloc(m);
+	yutani_msg_buildx_window_opaque_region(m, window->wid, x, y, width, height);
+	yutani_msg_send(yctx, m);
+}
+
 /**
  * yutani_window_warp_mouse
  *
@@ -1004,6 +1367,19 @@ void yutani_special_request_wid(yutani_t * yctx, yutani_wid_t wid, uint32_t requ
 	yutani_msg_send(yctx, m);
 }
 
+/**
+ * yutani_stats
+ *
+ * Map the server's frame statistics. The server writes these
+ * as it draws; look, but don't touch.
+ */
+yutani_stats_t * yutani_stats(yutani_t * yctx) {
+	char key[1024];
+	YUTANI_SHMKEY_STATS(yctx->server_ident, key, 1024);
+	size_t size = sizeof(yutani_stats_t);
+	return shm_obtain(key, &size);
+}
+
 /**
  * yutani_set_clipboard
  *
@@ -1094,9 +1470,7 @@ void reinit_graphics_yutani(gfx_context_t * out, yutani_window_t * window) {
 	out->size   = GFX_H(out) * GFX_W(out) * GFX_B(out);
 
 	if (out->clips && out->clips_size != out->height) {
-		free(out->clips);
-		out->clips = NULL;
-		out->clips_size = 0;
+		gfx_no_clip(out);
 	}
 
 	if (out->buffer == out->backbuffer) {
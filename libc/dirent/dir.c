@@ -1,12 +1,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include <syscall.h>
 #include <syscall_nums.h>
 #include <errno.h>
 #include <bits/dirent.h>
 
+#define DIR_BUFFER_ENTRIES 32
+
 DEFN_SYSCALL3(readdir, SYS_READDIR, int, int, void *);
+DEFN_SYSCALL3(getdents, SYS_GETDENTS, int, void *, int);
 
 DIR * opendir (const char * dirname) {
 	int fd = open(dirname, O_RDONLY);
@@ -18,32 +22,48 @@ DIR * opendir (const char * dirname) {
 	DIR * dir = (DIR *)malloc(sizeof(DIR));
 	dir->fd = fd;
 	dir->cur_entry = -1;
+	dir->buffer = NULL;
+	dir->buffer_count = 0;
+	dir->buffer_next = 0;
 	return dir;
 }
 
 int closedir (DIR * dir) {
 	if (dir && (dir->fd != -1)) {
-		return close(dir->fd);
+		int ret = close(dir->fd);
+		free(dir->buffer);
+		free(dir);
+		return ret;
 	} else {
 		return -EBADF;
 	}
 }
 
+int getdents (int fd, struct dirent * entries, int count) {
+	__sets_errno(syscall_getdents(fd, entries, count));
+}
+
 struct dirent * readdir (DIR * dirp) {
-	static struct dirent ent;
+	if (dirp->buffer_next >= dirp->buffer_count) {
+		if (!dirp->buffer) {
+			dirp->buffer = malloc(sizeof(struct dirent) * DIR_BUFFER_ENTRIES);
+		}
 
-	int ret = syscall_readdir(dirp->fd, ++dirp->cur_entry, &ent);
-	if (ret < 0) {
-		errno = -ret;
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
-	}
+		int ret = syscall_getdents(dirp->fd, dirp->buffer, DIR_BUFFER_ENTRIES);
+		if (ret < 0) {
+			errno = -ret;
+			return NULL;
+		}
 
-	if (ret == 0) {
-		/* end of directory */
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
+		dirp->buffer_count = ret;
+		dirp->buffer_next = 0;
+
+		if (ret == 0) {
+			/* end of directory */
+			return NULL;
+		}
 	}
 
-	return &ent;
+	dirp->cur_entry++;
+	return &dirp->buffer[dirp->buffer_next++];
 }
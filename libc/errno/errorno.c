@@ -1,3 +1,10 @@
 #include <errno.h>
+#include <sys/tls.h>
 
-int errno = 0;
+/* For threads without a control block */
+static int __errno_global = 0;
+
+int * __errno_location(void) {
+	tls_tcb_t * tcb = __tls_tcb();
+	return tcb ? &tcb->errno_value : &__errno_global;
+}
@@ -1,37 +1,168 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * iconv
+ *
+ * Only the encodings we actually use: UTF-8, and UTF-32 in host
+ * order (which is what wchar_t is). Both are stateless, and the
+ * conversions are run a buffer at a time by the libc UTF-8 codec.
+ */
 #include <iconv.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+#include <toaru/decodeutf8.h>
+
+#define ENC_UTF8  1
+#define ENC_UTF32 2
 
 struct _iconv_state {
-	char *tocode;
-	char *fromcode;
+	int to;
+	int from;
 };
 
+static struct {
+	const char * name;
+	int encoding;
+} encodings[] = {
+	{"UTF-8",    ENC_UTF8},
+	{"UTF8",     ENC_UTF8},
+	{"UTF-32",   ENC_UTF32},
+	{"UTF-32LE", ENC_UTF32},
+	{"UTF32",    ENC_UTF32},
+	{"UCS-4",    ENC_UTF32},
+	{"UCS-4LE",  ENC_UTF32},
+	{"WCHAR_T",  ENC_UTF32},
+	{NULL, 0},
+};
+
+static int find_encoding(const char * code) {
+	/* Ignore //TRANSLIT and friends */
+	size_t len = strlen(code);
+	char * suffix = strstr(code, "//");
+	if (suffix) len = suffix - code;
+
+	for (int i = 0; encodings[i].name; ++i) {
+		if (strlen(encodings[i].name) == len && !strncasecmp(encodings[i].name, code, len)) {
+			return encodings[i].encoding;
+		}
+	}
+	return 0;
+}
+
 iconv_t iconv_open(const char *tocode, const char *fromcode) {
-	errno = EINVAL;
-	return (iconv_t)-1;
+	int to = find_encoding(tocode);
+	int from = find_encoding(fromcode);
 
-#if 0
-	struct _iconv_state * state = malloc(sizeof(struct _iconv_state));
+	if (!to || !from) {
+		errno = EINVAL;
+		return (iconv_t)-1;
+	}
 
-	state->tocode = strdup(tocode);
-	state->fromcode = strdup(fromcode);
+	struct _iconv_state * state = malloc(sizeof(struct _iconv_state));
+	state->to = to;
+	state->from = from;
 
 	return (iconv_t)state;
-#endif
 }
 
 int iconv_close(iconv_t cd) {
-	struct _iconv_state * state = (struct _iconv_state*)cd;
+	free(cd);
+	return 0;
+}
 
-	free(state->tocode);
-	free(state->fromcode);
+static size_t fail(int error) {
+	errno = error;
+	return (size_t)-1;
+}
 
-	free(cd);
+static size_t utf8_to_utf32(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) {
+	int status;
+	size_t count = utf8_decode((const char **)inbuf, inbytesleft, (uint32_t *)*outbuf, *outbytesleft / 4, &status);
+	*outbuf += count * 4;
+	*outbytesleft -= count * 4;
 
+	if (status == UTF8_BAD) return fail(EILSEQ);
+	if (status == UTF8_SHORT) return fail(EINVAL);
+	if (*inbytesleft) return fail(E2BIG);
+	return 0;
+}
+
+static size_t utf32_to_utf8(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) {
+	int status;
+	const uint32_t * in = (const uint32_t *)*inbuf;
+	size_t left = *inbytesleft / 4;
+	size_t count = utf8_encode_run(&in, &left, *outbuf, *outbytesleft, &status);
+	*inbytesleft -= (char *)in - *inbuf;
+	*inbuf = (char *)in;
+	*outbuf += count;
+	*outbytesleft -= count;
+
+	if (status == UTF8_BAD) return fail(EILSEQ);
+	if (left) return fail(E2BIG);
+	if (*inbytesleft) return fail(EINVAL);
+	return 0;
+}
+
+/* Same encoding both ways: check it, and copy whatever was good */
+static size_t utf8_to_utf8(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) {
+	int status;
+	const char * in = *inbuf;
+	size_t avail = *inbytesleft < *outbytesleft ? *inbytesleft : *outbytesleft;
+	size_t left = avail;
+	utf8_decode(&in, &left, NULL, SIZE_MAX, &status);
+
+	size_t good = avail - left;
+	memcpy(*outbuf, *inbuf, good);
+	*inbuf += good;
+	*inbytesleft -= good;
+	*outbuf += good;
+	*outbytesleft -= good;
+
+	if (status == UTF8_BAD) return fail(EILSEQ);
+	if (status == UTF8_SHORT && avail == good + *inbytesleft) return fail(EINVAL);
+	if (*inbytesleft) return fail(E2BIG);
+	return 0;
+}
+
+static size_t utf32_to_utf32(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) {
+	const uint32_t * in = (const uint32_t *)*inbuf;
+	uint32_t * out = (uint32_t *)*outbuf;
+	size_t count = *inbytesleft / 4;
+	if (count > *outbytesleft / 4) count = *outbytesleft / 4;
+
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		if (in[i] > 0x10FFFF || (in[i] >= 0xD800 && in[i] <= 0xDFFF)) break;
+		out[i] = in[i];
+	}
+	*inbuf += i * 4;
+	*inbytesleft -= i * 4;
+	*outbuf += i * 4;
+	*outbytesleft -= i * 4;
+
+	if (i < count) return fail(EILSEQ);
+	if (*inbytesleft >= 4) return fail(E2BIG);
+	if (*inbytesleft) return fail(EINVAL);
 	return 0;
 }
 
 size_t iconv(iconv_t cd, char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) {
-	return -1;
+	struct _iconv_state * state = (struct _iconv_state*)cd;
+
+	/* Nothing is stateful, so there is nothing to reset or flush */
+	if (!inbuf || !*inbuf) return 0;
+
+	if (state->from == ENC_UTF8) {
+		if (state->to == ENC_UTF8) return utf8_to_utf8(inbuf, inbytesleft, outbuf, outbytesleft);
+		return utf8_to_utf32(inbuf, inbytesleft, outbuf, outbytesleft);
+	} else {
+		if (state->to == ENC_UTF8) return utf32_to_utf8(inbuf, inbytesleft, outbuf, outbytesleft);
+		return utf32_to_utf32(inbuf, inbytesleft, outbuf, outbytesleft);
+	}
 }
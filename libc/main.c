@@ -15,6 +15,8 @@ char ** environ = NULL;
 int _environ_size = 0;
 char * _argv_0 = NULL;
 int __libc_debug = 0;
+int __libc_threaded = 0;
+int __libc_sysenter = 0;
 
 char ** __argv = NULL;
 extern char ** __get_argv(void) {
@@ -30,8 +32,18 @@ void _exit(int val){
 	__builtin_unreachable();
 }
 
+/* The same test the kernel makes before it enables sysenter */
+static int _libc_have_sysenter(void) {
+	uint32_t eax, edx;
+	__asm__ __volatile__("push %%ebx; cpuid; pop %%ebx" : "=a" (eax), "=d" (edx) : "a" (1) : "ecx");
+	if (!(edx & (1 << 11))) return 0;
+	uint32_t family = (eax >> 8) & 0xF, model = (eax >> 4) & 0xF, stepping = eax & 0xF;
+	return !(family == 6 && model < 3 && stepping < 3);
+}
+
 __attribute__((constructor))
 static void _libc_init(void) {
+	__libc_sysenter = _libc_have_sysenter();
 	__stdio_init_buffers();
 
 	unsigned int x = 0;
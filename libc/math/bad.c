@@ -20,30 +20,6 @@ double cosh(double x) {
 	return 0.0;
 }
 
-double ldexp(double a, int exp) {
-	double out = a;
-	while (exp) {
-		out *= 2.0;
-		exp--;
-	}
-	return out;
-}
-
-double log(double x) {
-	BAD;
-	return 0.0;
-}
-
-double log10(double x) {
-	BAD;
-	return 0.0;
-}
-
-double log2(double x) {
-	BAD;
-	return 0.0;
-}
-
 double sinh(double x) {
 	BAD;
 	return 0.0;
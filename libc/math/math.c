@@ -10,61 +10,509 @@ extern char * _argv_0;
 #define MATH (void)0
 #endif
 
-double exp(double x) {
-	return pow(2.71828182846, x);
+/*
+ * The functions below follow the usual approach (and constants) of
+ * fdlibm: reduce the argument to a small interval around zero, then
+ * evaluate a minimax polynomial there. The float versions use shorter
+ * polynomials and stay in single precision where that is enough.
+ */
+static inline uint64_t to_bits(double x) {
+	uint64_t u;
+	memcpy(&u, &x, sizeof(double));
+	return u;
+}
+
+static inline double from_bits(uint64_t u) {
+	double x;
+	memcpy(&x, &u, sizeof(double));
+	return x;
+}
+
+static inline uint32_t to_bitsf(float x) {
+	uint32_t u;
+	memcpy(&u, &x, sizeof(float));
+	return u;
+}
+
+static inline float from_bitsf(uint32_t u) {
+	float x;
+	memcpy(&x, &u, sizeof(float));
+	return x;
+}
+
+/* Unbiased exponent */
+#define EXPONENT(u)  ((int)(((u) >> 52) & 0x7ff) - 0x3ff)
+#define EXPONENTF(u) ((int)(((u) >> 23) & 0xff) - 0x7f)
+
+/* Nearest integer, for picking how many periods to take out */
+#define NEAREST(x) ((x) < 0 ? (int)((x) - 0.5) : (int)((x) + 0.5))
+
+double trunc(double x) {
+	uint64_t u = to_bits(x);
+	int e = EXPONENT(u);
+	if (e >= 52) return x;
+	if (e < 0) return from_bits(u & (1ULL << 63));
+	return from_bits(u & ~(0x000fffffffffffffULL >> e));
+}
+
+double floor(double x) {
+	MATH;
+	uint64_t u = to_bits(x);
+	int e = EXPONENT(u);
+	if (e >= 52) return x;
+	if (e < 0) {
+		if (x == 0.0) return x;
+		return (u >> 63) ? -1.0 : 0.0;
+	}
+	uint64_t mask = 0x000fffffffffffffULL >> e;
+	if (!(u & mask)) return x;
+	if (u >> 63) u += mask + 1;
+	return from_bits(u & ~mask);
 }
 
 double ceil(double x) {
-	int _x = x;
-	if ((float)_x == x) return x;
-	if (x < 0.0) {
-		return (double)_x;
+	uint64_t u = to_bits(x);
+	int e = EXPONENT(u);
+	if (e >= 52) return x;
+	if (e < 0) {
+		if (x == 0.0) return x;
+		return (u >> 63) ? -0.0 : 1.0;
 	}
-	return (double)_x + 1;
+	uint64_t mask = 0x000fffffffffffffULL >> e;
+	if (!(u & mask)) return x;
+	if (!(u >> 63)) u += mask + 1;
+	return from_bits(u & ~mask);
 }
 
-double floor(double x) {
+float truncf(float x) {
+	uint32_t u = to_bitsf(x);
+	int e = EXPONENTF(u);
+	if (e >= 23) return x;
+	if (e < 0) return from_bitsf(u & 0x80000000);
+	return from_bitsf(u & ~(0x007fffff >> e));
+}
+
+float floorf(float x) {
+	uint32_t u = to_bitsf(x);
+	int e = EXPONENTF(u);
+	if (e >= 23) return x;
+	if (e < 0) {
+		if (x == 0.0f) return x;
+		return (u >> 31) ? -1.0f : 0.0f;
+	}
+	uint32_t mask = 0x007fffff >> e;
+	if (!(u & mask)) return x;
+	if (u >> 31) u += mask + 1;
+	return from_bitsf(u & ~mask);
+}
+
+float ceilf(float x) {
+	uint32_t u = to_bitsf(x);
+	int e = EXPONENTF(u);
+	if (e >= 23) return x;
+	if (e < 0) {
+		if (x == 0.0f) return x;
+		return (u >> 31) ? -0.0f : 1.0f;
+	}
+	uint32_t mask = 0x007fffff >> e;
+	if (!(u & mask)) return x;
+	if (!(u >> 31)) u += mask + 1;
+	return from_bitsf(u & ~mask);
+}
+
+/* x * 2^n, in at most three steps so nothing over- or underflows early */
+double scalbn(double x, int n) {
+	if (n > 1023) {
+		x *= 0x1p1023;
+		n -= 1023;
+		if (n > 1023) {
+			x *= 0x1p1023;
+			n -= 1023;
+			if (n > 1023) n = 1023;
+		}
+	} else if (n < -1022) {
+		x *= 0x1p-1022 * 0x1p53;
+		n += 1022 - 53;
+		if (n < -1022) {
+			x *= 0x1p-1022 * 0x1p53;
+			n += 1022 - 53;
+			if (n < -1022) n = -1022;
+		}
+	}
+	return x * from_bits((uint64_t)(0x3ff + n) << 52);
+}
+
+float scalbnf(float x, int n) {
+	if (n > 127) {
+		x *= 0x1p127f;
+		n -= 127;
+		if (n > 127) n = 127;
+	} else if (n < -126) {
+		x *= 0x1p-126f * 0x1p24f;
+		n += 126 - 24;
+		if (n < -126) n = -126;
+	}
+	return x * from_bitsf((uint32_t)(0x7f + n) << 23);
+}
+
+double ldexp(double a, int exp) {
+	return scalbn(a, exp);
+}
+
+static const double
+	ln2_hi = 6.93147180369123816490e-01,
+	ln2_lo = 1.90821492927058770002e-10,
+	inv_ln2 = 1.44269504088896338700e+00;
+
+/* exp(r) = 1 + r + r*c/(2-c) for |r| <= ln2/2, with c from a polynomial in r^2 */
+static const double
+	P1 = 1.66666666666666019037e-01,
+	P2 = -2.77777777770155933842e-03,
+	P3 = 6.61375632143793436117e-05,
+	P4 = -1.65339022054652515390e-06,
+	P5 = 4.13813679705723846039e-08;
+
+double exp(double x) {
 	MATH;
-	if (x > -1.0 && x < 1.0) {
-		if (x >= 0) {
-			return 0.0;
+	if (x != x) return x;
+	if (x > 709.782712893383973096) return HUGE_VAL;
+	if (x < -745.13321910194110842) return 0.0;
+	if (fabs(x) < 0x1p-28) return 1.0 + x;
+
+	/* x = k*ln2 + r */
+	int k = NEAREST(x * inv_ln2);
+	double hi = x - k * ln2_hi;
+	double lo = k * ln2_lo;
+	double r = hi - lo;
+
+	double t = r * r;
+	double c = r - t * (P1 + t * (P2 + t * (P3 + t * (P4 + t * P5))));
+	double y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+	return scalbn(y, k);
+}
+
+/* log(1+f) = f - f^2/2 + s*(f^2/2 + R(s^2)), s = f/(2+f) */
+static const double
+	Lg1 = 6.666666666666735130e-01,
+	Lg2 = 3.999999999940941908e-01,
+	Lg3 = 2.857142874366239149e-01,
+	Lg4 = 2.222219843214978396e-01,
+	Lg5 = 1.818357216161805012e-01,
+	Lg6 = 1.531383769920937332e-01,
+	Lg7 = 1.479819860511658591e-01;
+
+/*
+ * Split positive, finite x into 2^k * m with sqrt(2)/2 <= m < sqrt(2)
+ * and give back log(m). This is kept in long double (the x87's 64 bits)
+ * so that adding k*ln2 and scaling for log2/log10 don't lose anything.
+ */
+static long double log_reduce(double x, int * k) {
+	uint64_t u = to_bits(x);
+	*k = 0;
+	if (!(u >> 52)) {
+		/* Subnormal; scale it up first */
+		u = to_bits(x * 0x1p54);
+		*k -= 54;
+	}
+
+	uint32_t hx = (u >> 32) + (0x3ff00000 - 0x3fe6a09e);
+	*k += (int)(hx >> 20) - 0x3ff;
+	hx = (hx & 0x000fffff) + 0x3fe6a09e;
+	double m = from_bits((uint64_t)hx << 32 | (u & 0xffffffff));
+
+	long double f = m - 1.0;
+	long double hfsq = 0.5L * f * f;
+	long double s = f / (2.0L + f);
+	double z = s * s;
+	double w = z * z;
+	double t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+	double t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+	return s * (hfsq + t1 + t2) - hfsq + f;
+}
+
+static const long double
+	ln2l = 6.931471805599453094172e-01L,
+	inv_ln2l = 1.442695040888963407360e+00L;
+
+double log(double x) {
+	MATH;
+	if (x != x) return x;
+	if (x < 0.0) return __builtin_nan("");
+	if (x == 0.0) return -HUGE_VAL;
+	if (x == HUGE_VAL) return x;
+
+	int k;
+	long double lm = log_reduce(x, &k);
+	return lm + k * ln2l;
+}
+
+double log2(double x) {
+	MATH;
+	if (x != x || x <= 0.0 || x == HUGE_VAL) return log(x);
+
+	int k;
+	long double lm = log_reduce(x, &k);
+	return lm * inv_ln2l + k;
+}
+
+double log10(double x) {
+	MATH;
+	if (x != x || x <= 0.0 || x == HUGE_VAL) return log(x);
+
+	int k;
+	long double lm = log_reduce(x, &k);
+	return (lm + k * ln2l) * 4.342944819032518276511e-01L;
+}
+
+/*
+ * pow() for positive, finite x other than 1 and finite, non-zero y, as
+ * fdlibm does it: log2(x) comes back as t1 + t2, carrying about 20 bits
+ * more than a double, y is split in two so that y * log2(x) keeps them,
+ * and 2^(that) is evaluated in the same way exp() is. Rounding only
+ * really happens at the end, so it stays within an ulp.
+ */
+static const double
+	bp[]   = { 1.0, 1.5 },
+	dp_h[] = { 0.0, 5.84962487220764160156e-01 }, /* log2(1.5), high */
+	dp_l[] = { 0.0, 1.35003920212974897128e-08 }, /* ...and the rest */
+	/* (3/2)*(log(x) - 2s - 2/3*s^3), as a polynomial in s^2 */
+	L1 = 5.99999999999994648725e-01,
+	L2 = 4.28571428578550184252e-01,
+	L3 = 3.33333329818377432918e-01,
+	L4 = 2.72728123808534006489e-01,
+	L5 = 2.30660745775561754067e-01,
+	L6 = 2.06975017800338417784e-01,
+	lg2   = 6.93147180559945286227e-01,
+	lg2_h = 6.93147182464599609375e-01,
+	lg2_l = -1.90465429995776804525e-09,
+	ovt   = 8.0085662595372944372e-17,  /* -(1024 - log2(overflow + 1/2 ulp)) */
+	cp    = 9.61796693925975554329e-01, /* 2/(3*ln2) */
+	cp_h  = 9.61796700954437255859e-01,
+	cp_l  = -7.02846165095275826516e-09,
+	ivln2   = 1.44269504088896338700e+00,
+	ivln2_h = 1.44269502162933349609e+00,
+	ivln2_l = 1.92596299112661746887e-08;
+
+/* The top and bottom halves of a double, as fdlibm likes to work on them */
+#define HIGH_WORD(x) ((int32_t)(to_bits(x) >> 32))
+#define LOW_WORD(x)  ((uint32_t)to_bits(x))
+
+static inline double with_high(double x, uint32_t high) {
+	return from_bits((uint64_t)high << 32 | LOW_WORD(x));
+}
+
+static inline double low_cleared(double x) {
+	return from_bits(to_bits(x) & 0xffffffff00000000ULL);
+}
+
+static double pow_positive(double x, double y) {
+	int32_t ix = HIGH_WORD(x);
+	int32_t iy = HIGH_WORD(y) & 0x7fffffff;
+	double t1, t2;
+
+	if (iy > 0x41e00000) {
+		/* |y| > 2^31, so anything not very near 1 over- or underflows */
+		if (iy > 0x43f00000) {
+			if (ix <= 0x3fefffff) return y < 0.0 ? HUGE_VAL : 0.0;
+			if (ix >= 0x3ff00000) return y > 0.0 ? HUGE_VAL : 0.0;
+		}
+		if (ix < 0x3fefffff) return y < 0.0 ? HUGE_VAL : 0.0;
+		if (ix > 0x3ff00000) return y > 0.0 ? HUGE_VAL : 0.0;
+
+		/* |1 - x| <= 2^-20, which a few terms of log(1+t) cover */
+		double t = x - 1.0;
+		double w = (t * t) * (0.5 - t * (0.3333333333333333333333 - t * 0.25));
+		double u = ivln2_h * t;
+		double v = t * ivln2_l - w * ivln2;
+		t1 = low_cleared(u + v);
+		t2 = v - (t1 - u);
+	} else {
+		int n = 0;
+		if (ix < 0x00100000) {
+			/* Subnormal */
+			x *= 0x1p53;
+			n -= 53;
+			ix = HIGH_WORD(x);
+		}
+		n += (ix >> 20) - 0x3ff;
+		int32_t j = ix & 0x000fffff;
+
+		/* Bring x into [1, 2), then take it about 1 or about 1.5 */
+		int k;
+		ix = j | 0x3ff00000;
+		if (j <= 0x3988e) {
+			k = 0;   /* x < sqrt(3/2) */
+		} else if (j < 0xbb67a) {
+			k = 1;   /* x < sqrt(3) */
 		} else {
-			return -1.0;
+			k = 0;
+			n += 1;
+			ix -= 0x00100000;
 		}
+		x = with_high(x, ix);
+
+		/* s = s_h + s_l = (x - 1)/(x + 1) or (x - 1.5)/(x + 1.5) */
+		double u = x - bp[k];
+		double v = 1.0 / (x + bp[k]);
+		double ss = u * v;
+		double s_h = low_cleared(ss);
+		double t_h = from_bits((uint64_t)(((ix >> 1) | 0x20000000) + 0x00080000 + (k << 18)) << 32);
+		double t_l = x - (t_h - bp[k]);
+		double s_l = v * ((u - s_h * t_h) - s_h * t_l);
+
+		/* log(x) */
+		double s2 = ss * ss;
+		double r = s2 * s2 * (L1 + s2 * (L2 + s2 * (L3 + s2 * (L4 + s2 * (L5 + s2 * L6)))));
+		r += s_l * (s_h + ss);
+		s2 = s_h * s_h;
+		t_h = low_cleared(3.0 + s2 + r);
+		t_l = r - ((t_h - 3.0) - s2);
+
+		/* u + v = ss * (1 + ...) */
+		u = s_h * t_h;
+		v = s_l * t_h + t_l * ss;
+
+		/* 2/(3*log2) * (ss + ...) */
+		double p_h = low_cleared(u + v);
+		double p_l = v - (p_h - u);
+		double z_h = cp_h * p_h;
+		double z_l = cp_l * p_h + p_l * cp + dp_l[k];
+
+		/* log2(x) = (ss + ...) * 2/(3*log2) = n + dp_h + z_h + z_l */
+		double t = (double)n;
+		t1 = low_cleared(((z_h + z_l) + dp_h[k]) + t);
+		t2 = z_l - (((t1 - t) - dp_h[k]) - z_h);
 	}
 
-	if (x < 0) {
-		int x_i = x;
-		return (double)(x_i - 1);
-	} else {
-		int x_i = x;
-		return (double)x_i;
+	/* (y1 + y2) * (t1 + t2), with y1 short enough that y1 * t1 is exact */
+	double y1 = low_cleared(y);
+	double p_l = (y - y1) * t1 + y * t2;
+	double p_h = y1 * t1;
+	double z = p_l + p_h;
+	int32_t j = HIGH_WORD(z);
+	uint32_t i = LOW_WORD(z);
+
+	if (j >= 0x40900000) {
+		/* z >= 1024 */
+		if (((j - 0x40900000) | i) != 0) return HUGE_VAL;
+		if (p_l + ovt > z - p_h) return HUGE_VAL;
+	} else if ((j & 0x7fffffff) >= 0x4090cc00) {
+		/* z <= -1075 */
+		if (((uint32_t)(j - 0xc090cc00) | i) != 0) return 0.0;
+		if (p_l <= z - p_h) return 0.0;
 	}
-}
 
-int abs(int j) {
-	return (j < 0 ? -j : j);
+	/* 2^(p_h + p_l), taking the nearest whole power of two out first */
+	int32_t ii = j & 0x7fffffff;
+	int k = (ii >> 20) - 0x3ff;
+	int n = 0;
+	if (ii > 0x3fe00000) {
+		n = j + (0x00100000 >> (k + 1));
+		k = ((n & 0x7fffffff) >> 20) - 0x3ff;
+		double t = from_bits((uint64_t)(uint32_t)(n & ~(0x000fffff >> k)) << 32);
+		n = ((n & 0x000fffff) | 0x00100000) >> (20 - k);
+		if (j < 0) n = -n;
+		p_h -= t;
+	}
+	double t = low_cleared(p_l + p_h);
+	double u = t * lg2_h;
+	double v = (p_l - (t - p_h)) * lg2 + t * lg2_l;
+	z = u + v;
+	double w = v - (z - u);
+	t = z * z;
+	t1 = z - t * (P1 + t * (P2 + t * (P3 + t * (P4 + t * P5))));
+	double r = (z * t1) / (t1 - 2.0) - (w + z * w);
+	z = 1.0 - (r - z);
+
+	j = HIGH_WORD(z) + (int32_t)((uint32_t)n << 20);
+	if ((j >> 20) <= 0) return scalbn(z, n); /* Subnormal */
+	return with_high(z, j);
 }
 
 double pow(double x, double y) {
 	MATH;
-	double out;
-	asm volatile (
-		"fyl2x;"
-		"fld %%st;"
-		"frndint;"
-		"fsub %%st,%%st(1);"
-		"fxch;"
-		"fchs;"
-		"f2xm1;"
-		"fld1;"
-		"faddp;"
-		"fxch;"
-		"fld1;"
-		"fscale;"
-		"fstp %%st(1);"
-		"fmulp;" : "=t"(out) : "0"(x),"u"(y) : "st(1)" );
-	return out;
+	if (y == 0.0 || x == 1.0) return 1.0;
+	if (x != x || y != y) return x + y;
+
+	double ay = fabs(y);
+	int y_int = (ay >= 0x1p53) || (floor(y) == y);
+	int y_odd = (ay < 0x1p53) && y_int && (fmod(ay, 2.0) == 1.0);
+
+	double sign = 1.0;
+	if (to_bits(x) >> 63) {
+		x = -x;
+		if (!y_int && x != 0.0 && x != HUGE_VAL) return __builtin_nan("");
+		if (y_odd) sign = -1.0;
+		/* Before pow_positive(), which would overflow for huge y */
+		if (x == 1.0) return sign;
+	}
+
+	if (ay == HUGE_VAL) {
+		return ((x > 1.0) == (y > 0.0)) ? HUGE_VAL : 0.0;
+	}
+	if (x == 0.0 || x == HUGE_VAL) {
+		return sign * (((x == 0.0) == (y < 0.0)) ? HUGE_VAL : 0.0);
+	}
+
+	return sign * pow_positive(x, y);
+}
+
+static const float
+	ln2_hif = 6.9313812256e-01f,
+	ln2_lof = 9.0580006145e-06f,
+	inv_ln2f = 1.4426950216e+00f;
+
+float expf(float x) {
+	if (x != x) return x;
+	if (x > 88.7228390f) return HUGE_VAL;
+	if (x < -103.972084f) return 0.0f;
+	if (fabsf(x) < 0x1p-14f) return 1.0f + x;
+
+	int k = NEAREST(x * inv_ln2f);
+	float hi = x - k * ln2_hif;
+	float lo = k * ln2_lof;
+	float r = hi - lo;
+
+	float t = r * r;
+	float c = r - t * (1.6666625440e-1f + t * -2.7667332906e-3f);
+	float y = 1.0f - ((lo - (r * c) / (2.0f - c)) - hi);
+	return scalbnf(y, k);
+}
+
+float logf(float x) {
+	if (x != x) return x;
+	if (x < 0.0f) return __builtin_nanf("");
+	if (x == 0.0f) return -HUGE_VAL;
+	if (x == HUGE_VAL) return x;
+
+	uint32_t u = to_bitsf(x);
+	int k = 0;
+	if (!(u >> 23)) {
+		u = to_bitsf(x * 0x1p25f);
+		k -= 25;
+	}
+
+	u += 0x3f800000 - 0x3f3504f3;
+	k += (int)(u >> 23) - 0x7f;
+	u = (u & 0x007fffff) + 0x3f3504f3;
+	float f = from_bitsf(u) - 1.0f;
+
+	float s = f / (2.0f + f);
+	float z = s * s;
+	float w = z * z;
+	float t1 = w * (0.40000972152f + w * 0.24279078841f);
+	float t2 = z * (0.66666662693f + w * 0.28498786688f);
+	float hfsq = 0.5f * f * f;
+	return s * (hfsq + t1 + t2) + k * ln2_lof - hfsq + f + k * ln2_hif;
+}
+
+/* Done in double: in float, y*log(x) loses too much for the result to be right */
+float powf(float x, float y) {
+	return pow(x, y);
+}
+
+int abs(int j) {
+	return (j < 0 ? -j : j);
 }
 
 double fabs(double x) {
@@ -91,432 +539,535 @@ double fmod(double x, double y) {
 
 double sqrt(double x) {
 	MATH;
-	return __builtin_sqrt(x);
+	double out;
+	asm ("sqrtsd %1, %0" : "=x"(out) : "x"(x));
+	return out;
 }
 
 float sqrtf(float x) {
-	return sqrt(x);
-}
-
-static double bad_sine_table[] = {
-	0,
-		0.01745240644,
-		0.03489949671,
-		0.05233595625,
-		0.06975647375,
-		0.08715574276,
-		0.1045284633,
-		0.1218693434,
-		0.139173101,
-		0.1564344651,
-		0.1736481777,
-		0.1908089954,
-		0.2079116908,
-		0.2249510544,
-		0.2419218956,
-		0.2588190451,
-		0.2756373559,
-		0.2923717048,
-		0.3090169944,
-		0.3255681545,
-		0.3420201434,
-		0.3583679496,
-		0.3746065935,
-		0.3907311285,
-		0.4067366431,
-		0.4226182618,
-		0.4383711468,
-		0.4539904998,
-		0.4694715628,
-		0.4848096203,
-		0.5000000001,
-		0.515038075,
-		0.5299192643,
-		0.5446390351,
-		0.5591929035,
-		0.5735764364,
-		0.5877852524,
-		0.6018150232,
-		0.6156614754,
-		0.6293203911,
-		0.6427876098,
-		0.6560590291,
-		0.6691306064,
-		0.6819983601,
-		0.6946583705,
-		0.7071067813,
-		0.7193398004,
-		0.7313537017,
-		0.7431448256,
-		0.7547095803,
-		0.7660444432,
-		0.7771459615,
-		0.7880107537,
-		0.7986355101,
-		0.8090169944,
-		0.8191520444,
-		0.8290375726,
-		0.838670568,
-		0.8480480962,
-		0.8571673008,
-		0.8660254039,
-		0.8746197072,
-		0.8829475929,
-		0.8910065243,
-		0.8987940464,
-		0.9063077871,
-		0.9135454577,
-		0.9205048535,
-		0.9271838546,
-		0.9335804266,
-		0.9396926208,
-		0.9455185757,
-		0.9510565163,
-		0.956304756,
-		0.961261696,
-		0.9659258263,
-		0.9702957263,
-		0.9743700648,
-		0.9781476008,
-		0.9816271835,
-		0.984807753,
-		0.9876883406,
-		0.9902680688,
-		0.9925461517,
-		0.9945218954,
-		0.9961946981,
-		0.9975640503,
-		0.9986295348,
-		0.999390827,
-		0.9998476952,
-		1,
-		0.9998476952,
-		0.999390827,
-		0.9986295347,
-		0.9975640502,
-		0.9961946981,
-		0.9945218953,
-		0.9925461516,
-		0.9902680687,
-		0.9876883406,
-		0.984807753,
-		0.9816271834,
-		0.9781476007,
-		0.9743700647,
-		0.9702957262,
-		0.9659258262,
-		0.9612616959,
-		0.9563047559,
-		0.9510565162,
-		0.9455185755,
-		0.9396926207,
-		0.9335804264,
-		0.9271838545,
-		0.9205048534,
-		0.9135454575,
-		0.9063077869,
-		0.8987940462,
-		0.8910065241,
-		0.8829475927,
-		0.874619707,
-		0.8660254036,
-		0.8571673006,
-		0.848048096,
-		0.8386705678,
-		0.8290375724,
-		0.8191520441,
-		0.8090169942,
-		0.7986355099,
-		0.7880107534,
-		0.7771459613,
-		0.7660444429,
-		0.75470958,
-		0.7431448253,
-		0.7313537014,
-		0.7193398001,
-		0.707106781,
-		0.6946583702,
-		0.6819983598,
-		0.6691306061,
-		0.6560590288,
-		0.6427876094,
-		0.6293203908,
-		0.6156614751,
-		0.6018150229,
-		0.587785252,
-		0.5735764361,
-		0.5591929032,
-		0.5446390347,
-		0.5299192639,
-		0.5150380746,
-		0.4999999997,
-		0.4848096199,
-		0.4694715625,
-		0.4539904994,
-		0.4383711465,
-		0.4226182614,
-		0.4067366428,
-		0.3907311282,
-		0.3746065931,
-		0.3583679492,
-		0.342020143,
-		0.3255681541,
-		0.309016994,
-		0.2923717044,
-		0.2756373555,
-		0.2588190447,
-		0.2419218952,
-		0.224951054,
-		0.2079116904,
-		0.190808995,
-		0.1736481773,
-		0.1564344647,
-		0.1391731006,
-		0.121869343,
-		0.1045284629,
-		0.08715574235,
-		0.06975647334,
-		0.05233595584,
-		0.0348994963,
-		0.01745240603,
-		-0.000000000410206857,
-		-0.01745240685,
-		-0.03489949712,
-		-0.05233595666,
-		-0.06975647416,
-		-0.08715574317,
-		-0.1045284637,
-		-0.1218693438,
-		-0.1391731014,
-		-0.1564344655,
-		-0.1736481781,
-		-0.1908089958,
-		-0.2079116912,
-		-0.2249510548,
-		-0.241921896,
-		-0.2588190455,
-		-0.2756373562,
-		-0.2923717052,
-		-0.3090169948,
-		-0.3255681549,
-		-0.3420201438,
-		-0.35836795,
-		-0.3746065938,
-		-0.3907311289,
-		-0.4067366435,
-		-0.4226182622,
-		-0.4383711472,
-		-0.4539905002,
-		-0.4694715632,
-		-0.4848096207,
-		-0.5000000004,
-		-0.5150380753,
-		-0.5299192646,
-		-0.5446390354,
-		-0.5591929039,
-		-0.5735764368,
-		-0.5877852527,
-		-0.6018150235,
-		-0.6156614757,
-		-0.6293203914,
-		-0.6427876101,
-		-0.6560590294,
-		-0.6691306067,
-		-0.6819983604,
-		-0.6946583708,
-		-0.7071067815,
-		-0.7193398007,
-		-0.731353702,
-		-0.7431448258,
-		-0.7547095806,
-		-0.7660444435,
-		-0.7771459618,
-		-0.7880107539,
-		-0.7986355104,
-		-0.8090169947,
-		-0.8191520446,
-		-0.8290375729,
-		-0.8386705682,
-		-0.8480480964,
-		-0.857167301,
-		-0.8660254041,
-		-0.8746197074,
-		-0.8829475931,
-		-0.8910065244,
-		-0.8987940465,
-		-0.9063077873,
-		-0.9135454579,
-		-0.9205048537,
-		-0.9271838548,
-		-0.9335804267,
-		-0.939692621,
-		-0.9455185758,
-		-0.9510565165,
-		-0.9563047561,
-		-0.9612616961,
-		-0.9659258264,
-		-0.9702957264,
-		-0.9743700649,
-		-0.9781476009,
-		-0.9816271836,
-		-0.9848077531,
-		-0.9876883407,
-		-0.9902680688,
-		-0.9925461517,
-		-0.9945218954,
-		-0.9961946981,
-		-0.9975640503,
-		-0.9986295348,
-		-0.999390827,
-		-0.9998476952,
-		-1,
-		-0.9998476951,
-		-0.999390827,
-		-0.9986295347,
-		-0.9975640502,
-		-0.996194698,
-		-0.9945218953,
-		-0.9925461516,
-		-0.9902680687,
-		-0.9876883405,
-		-0.9848077529,
-		-0.9816271833,
-		-0.9781476006,
-		-0.9743700646,
-		-0.9702957261,
-		-0.9659258261,
-		-0.9612616958,
-		-0.9563047558,
-		-0.9510565161,
-		-0.9455185754,
-		-0.9396926206,
-		-0.9335804263,
-		-0.9271838543,
-		-0.9205048532,
-		-0.9135454574,
-		-0.9063077868,
-		-0.898794046,
-		-0.8910065239,
-		-0.8829475925,
-		-0.8746197068,
-		-0.8660254034,
-		-0.8571673003,
-		-0.8480480958,
-		-0.8386705676,
-		-0.8290375722,
-		-0.8191520439,
-		-0.809016994,
-		-0.7986355096,
-		-0.7880107532,
-		-0.777145961,
-		-0.7660444427,
-		-0.7547095798,
-		-0.743144825,
-		-0.7313537011,
-		-0.7193397998,
-		-0.7071067807,
-		-0.6946583699,
-		-0.6819983595,
-		-0.6691306058,
-		-0.6560590284,
-		-0.6427876091,
-		-0.6293203905,
-		-0.6156614747,
-		-0.6018150226,
-		-0.5877852517,
-		-0.5735764357,
-		-0.5591929029,
-		-0.5446390344,
-		-0.5299192636,
-		-0.5150380743,
-		-0.4999999993,
-		-0.4848096196,
-		-0.4694715621,
-		-0.4539904991,
-		-0.4383711461,
-		-0.422618261,
-		-0.4067366424,
-		-0.3907311278,
-		-0.3746065927,
-		-0.3583679488,
-		-0.3420201426,
-		-0.3255681537,
-		-0.3090169936,
-		-0.292371704,
-		-0.2756373551,
-		-0.2588190443,
-		-0.2419218948,
-		-0.2249510536,
-		-0.20791169,
-		-0.1908089946,
-		-0.1736481769,
-		-0.1564344643,
-		-0.1391731002,
-		-0.1218693426,
-		-0.1045284625,
-		-0.08715574194,
-		-0.06975647293,
-		-0.05233595543,
-		-0.03489949589,
-		-0.01745240562,
-		0.0
+	float out;
+	asm ("sqrtss %1, %0" : "=x"(out) : "x"(x));
+	return out;
+}
+
+/* pi/2 in three pieces of 33 bits, each with the rest of it after */
+static const double
+	inv_pio2 = 6.36619772367581382433e-01,
+	pio2_1   = 1.57079632673412561417e+00,
+	pio2_1t  = 6.07710050650619224932e-11,
+	pio2_2   = 6.07710050630396597660e-11,
+	pio2_2t  = 2.02226624879595063154e-21,
+	pio4     = 7.85398163397448278999e-01;
+
+/* 2/pi, 24 bits at a time: enough for the biggest double there is */
+static const int32_t two_over_pi[] = {
+	0xA2F983, 0x6E4E44, 0x1529FC, 0x2757D1, 0xF534DD, 0xC0DB62,
+	0x95993C, 0x439041, 0xFE5163, 0xABDEBB, 0xC561B7, 0x246E3A,
+	0x424DD2, 0xE00649, 0x2EEA09, 0xD1921C, 0xFE1DEB, 0x1CB129,
+	0xA73EE8, 0x8235F5, 0x2EBB44, 0x84E99C, 0x7026B4, 0x5F7E41,
+	0x3991D6, 0x398353, 0x39F49C, 0x845F8B, 0xBDF928, 0x3B1FF8,
+	0x97FFDE, 0x05980F, 0xEF2F11, 0x8B5A0A, 0x6D1F6D, 0x367ECF,
+	0x27CB09, 0xB74F46, 0x3F669E, 0x5FEA2D, 0x7527BA, 0xC7EBE5,
+	0xF17B3D, 0x0739F7, 0x8A5292, 0xEA6BFB, 0x5FB11F, 0x8D5D08,
+	0x560330, 0x46FC7B, 0x6BABF0, 0xCFBC20, 0x9AF436, 0x1DA9E3,
+	0x91615E, 0xE61B08, 0x659985, 0x5F14A0, 0x68408D, 0xFFD880,
+	0x4D7327, 0x310606, 0x1556CA, 0x73A8C9, 0x60E27B, 0xC08C6B,
 };
 
-double sin(double x) {
-	MATH;
-	if (x < 0.0) {
-		x += 3.141592654 * 2.0 * 100.0;
+/* pi/2, 24 bits at a time */
+static const double pio2_24[] = {
+	1.57079625129699707031e+00,
+	7.54978941586159635335e-08,
+	5.39030252995776476554e-15,
+	3.28200341580791294123e-22,
+	1.27065575308067607349e-29,
+};
+
+/*
+ * Payne-Hanek reduction, as fdlibm's __kernel_rem_pio2 does it, for
+ * |x| too big for rem_pio2() to take pi/2 off a few bits at a time.
+ * x is split into 24-bit pieces and multiplied by only the bits of 2/pi
+ * that matter: the ones above them only add multiples of 4 to n, and
+ * those are thrown away. If what's left cancels to nothing, more bits
+ * of 2/pi are brought in until it doesn't.
+ */
+static int rem_pio2_large(double x, double * y0, double * y1) {
+	const int jk = 4; /* Terms of 2/pi past the first that are needed */
+	double tx[3], f[20], q[20], fq[20], z, fw;
+	int32_t iq[20];
+	int nx, n, ih, i, j, k;
+
+	/* x = z * 2^e0, with 24 bits of z above the point */
+	int e0 = EXPONENT(to_bits(x)) - 23;
+	z = fabs(scalbn(x, -e0));
+	for (i = 0; i < 2; ++i) {
+		tx[i] = (double)(int32_t)z;
+		z = (z - tx[i]) * 0x1p24;
+	}
+	tx[2] = z;
+	for (nx = 3; tx[nx - 1] == 0.0; --nx);
+
+	int jx = nx - 1;
+	int jv = (e0 - 3) / 24;
+	if (jv < 0) jv = 0;
+	int q0 = e0 - 24 * (jv + 1);
+
+	for (i = 0, j = jv - jx; i <= jx + jk; ++i, ++j) {
+		f[i] = j < 0 ? 0.0 : (double)two_over_pi[j];
+	}
+	for (i = 0; i <= jk; ++i) {
+		for (j = 0, fw = 0.0; j <= jx; ++j) fw += tx[j] * f[jx + i - j];
+		q[i] = fw;
+	}
+
+	int jz = jk;
+recompute:
+	/* Cut the product into 24-bit integers, lowest first */
+	for (i = 0, j = jz, z = q[jz]; j > 0; ++i, --j) {
+		fw = (double)(int32_t)(0x1p-24 * z);
+		iq[i] = (int32_t)(z - 0x1p24 * fw);
+		z = q[j - 1] + fw;
+	}
+
+	/* The integer part, modulo 8, is n */
+	z = scalbn(z, q0);
+	z -= 8.0 * floor(z * 0.125);
+	n = (int32_t)z;
+	z -= (double)n;
+	ih = 0;
+	if (q0 > 0) {
+		i = iq[jz - 1] >> (24 - q0);
+		n += i;
+		iq[jz - 1] -= i << (24 - q0);
+		ih = iq[jz - 1] >> (23 - q0);
+	} else if (q0 == 0) {
+		ih = iq[jz - 1] >> 23;
+	} else if (z >= 0.5) {
+		ih = 2;
+	}
+
+	/* The fraction is over a half: round n up and take 1 - fraction */
+	if (ih > 0) {
+		int carry = 0;
+		n += 1;
+		for (i = 0; i < jz; ++i) {
+			j = iq[i];
+			if (!carry) {
+				if (j) {
+					carry = 1;
+					iq[i] = 0x1000000 - j;
+				}
+			} else {
+				iq[i] = 0xffffff - j;
+			}
+		}
+		if (q0 == 1) iq[jz - 1] &= 0x7fffff;
+		if (q0 == 2) iq[jz - 1] &= 0x3fffff;
+		if (ih == 2) {
+			z = 1.0 - z;
+			if (carry) z -= scalbn(1.0, q0);
+		}
 	}
-	int i = x * 360.0 / (3.141592654 * 2.0);
-	double z = x * 360.0 / (3.141592654 * 2.0);
-	z -= i;
 
-	i = i % 360;
+	/* Everything cancelled; bring in more of 2/pi */
+	if (z == 0.0) {
+		j = 0;
+		for (i = jz - 1; i >= jk; --i) j |= iq[i];
+		if (!j) {
+			for (k = 1; iq[jk - k] == 0; ++k);
+			for (i = jz + 1; i <= jz + k; ++i) {
+				f[jx + i] = (double)two_over_pi[jv + i];
+				for (j = 0, fw = 0.0; j <= jx; ++j) fw += tx[j] * f[jx + i - j];
+				q[i] = fw;
+			}
+			jz += k;
+			goto recompute;
+		}
+	}
 
-	//fprintf(stderr, "z = %f\n", z);
+	/* Drop pieces that are zero, or split the last one if it's too big */
+	if (z == 0.0) {
+		jz -= 1;
+		q0 -= 24;
+		while (iq[jz] == 0) {
+			jz--;
+			q0 -= 24;
+		}
+	} else {
+		z = scalbn(z, -q0);
+		if (z >= 0x1p24) {
+			fw = (double)(int32_t)(0x1p-24 * z);
+			iq[jz] = (int32_t)(z - 0x1p24 * fw);
+			jz += 1;
+			q0 += 24;
+			iq[jz] = (int32_t)fw;
+		} else {
+			iq[jz] = (int32_t)z;
+		}
+	}
+
+	/* Back to doubles, then times pi/2 */
+	fw = scalbn(1.0, q0);
+	for (i = jz; i >= 0; --i) {
+		q[i] = fw * (double)iq[i];
+		fw *= 0x1p-24;
+	}
+	for (i = jz; i >= 0; --i) {
+		for (fw = 0.0, k = 0; k <= jk && k <= jz - i; ++k) fw += pio2_24[k] * q[i + k];
+		fq[jz - i] = fw;
+	}
 
-	double a = bad_sine_table[i];
-	double b = bad_sine_table[(i+1)%360];
+	/* Sum the small ones first, then whatever of them didn't fit */
+	fw = 0.0;
+	for (i = jz; i >= 0; --i) fw += fq[i];
+	*y0 = ih ? -fw : fw;
+	fw = fq[0] - fw;
+	for (i = 1; i <= jz; ++i) fw += fq[i];
+	*y1 = ih ? -fw : fw;
 
-	return a * (1.0-z) + b * (z);
+	if (x < 0) {
+		*y0 = -*y0;
+		*y1 = -*y1;
+		return -n;
+	}
+	return n;
+}
+
+/*
+ * x = n*pi/2 + (y0 + y1), with |y0 + y1| <= pi/4. Gives back n, or at
+ * least n modulo 4 for arguments too big for an int.
+ *
+ * Up to 2^20*pi/2 this takes 66 bits of pi/2 away, which is plenty.
+ * Anything bigger goes through rem_pio2_large().
+ */
+static int rem_pio2(double x, double * y0, double * y1) {
+	if (fabs(x) <= pio4) {
+		*y0 = x;
+		*y1 = 0.0;
+		return 0;
+	}
+	if (fabs(x) >= 0x1p20 * 1.5707963267948966) {
+		return rem_pio2_large(x, y0, y1);
+	}
+
+	int n = NEAREST(x * inv_pio2);
+	double fn = n;
+	double r = x - fn * pio2_1;
+
+	/*
+	 * Take off the next 33 bits as well, always: the first step can
+	 * cancel most of x when it's close to a multiple of pi/2.
+	 */
+	double t = r;
+	double w = fn * pio2_2;
+	r = t - w;
+	w = fn * pio2_2t - ((t - r) - w);
+	*y0 = r - w;
+	*y1 = (r - *y0) - w;
+	return n;
+}
+
+static const double
+	S1 = -1.66666666666666324348e-01,
+	S2 = 8.33333333332248946124e-03,
+	S3 = -1.98412698298579493134e-04,
+	S4 = 2.75573137070700676789e-06,
+	S5 = -2.50507602534068634195e-08,
+	S6 = 1.58969099521155010221e-10;
+
+static const double
+	C1 = 4.16666666666666019037e-02,
+	C2 = -1.38888888888741095749e-03,
+	C3 = 2.48015872894767294178e-05,
+	C4 = -2.75573143513906633035e-07,
+	C5 = 2.08757232129817482790e-09,
+	C6 = -1.13596475577881948265e-11;
+
+/* sin(x + y) for |x| <= pi/4, with y the part of x too small to be in it */
+static double kernel_sin(double x, double y) {
+	double z = x * x;
+	double v = z * x;
+	double r = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+	return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+}
+
+static double kernel_cos(double x, double y) {
+	double z = x * x;
+	double r = z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+	double hz = 0.5 * z;
+	double w = 1.0 - hz;
+	return w + (((1.0 - w) - hz) + (z * r - x * y));
+}
+
+double sin(double x) {
+	MATH;
+	if (x != x || fabs(x) == HUGE_VAL) return __builtin_nan("");
+	if (fabs(x) < 0x1p-27) return x;
+
+	double y0, y1;
+	switch (rem_pio2(x, &y0, &y1) & 3) {
+		case 0:  return kernel_sin(y0, y1);
+		case 1:  return kernel_cos(y0, y1);
+		case 2:  return -kernel_sin(y0, y1);
+		default: return -kernel_cos(y0, y1);
+	}
 }
 
 double cos(double x) {
-	return sin(x + 3.141592654 / 2.0);
+	MATH;
+	if (x != x || fabs(x) == HUGE_VAL) return __builtin_nan("");
+	if (fabs(x) < 0x1p-27) return 1.0;
+
+	double y0, y1;
+	switch (rem_pio2(x, &y0, &y1) & 3) {
+		case 0:  return kernel_cos(y0, y1);
+		case 1:  return -kernel_sin(y0, y1);
+		case 2:  return -kernel_cos(y0, y1);
+		default: return kernel_sin(y0, y1);
+	}
 }
 
 double tan(double x) {
 	MATH;
-	float out;
-	float _x = x;
-	float one;
-	asm volatile (
-		"fld %2\n"
-		"fptan\n"
-		"fstp %1\n"
-		"fstp %0\n"
-		: "=m"(out), "=m"(one) : "m"(_x)
-	);
-	return out;
+	if (x != x || fabs(x) == HUGE_VAL) return __builtin_nan("");
+	if (fabs(x) < 0x1p-27) return x;
+
+	double y0, y1;
+	int n = rem_pio2(x, &y0, &y1);
+	double s = kernel_sin(y0, y1);
+	double c = kernel_cos(y0, y1);
+	return (n & 1) ? -c / s : s / c;
+}
+
+/*
+ * Single precision: shorter polynomials, good for |x| <= pi/4. These
+ * take the reduced argument as a double so that it carries the bits
+ * the reduction didn't cancel.
+ */
+static float kernel_sinf(double x) {
+	double z = x * x;
+	return x + x * z * (-0.166666666416265235595 + z * (0.0083333293858894631756 +
+		z * (-0.000198393348360966317347 + z * 0.0000027183114939898219064)));
 }
 
+static float kernel_cosf(double x) {
+	double z = x * x;
+	return 1.0 + z * (-0.499999997251031003120 + z * (0.0416666233237390631894 +
+		z * (-0.00138867637746099294692 + z * 0.0000243904487962774090654)));
+}
+
+/* A float has few enough bits that one step of the double reduction does */
+static int rem_pio2f(float x, double * y) {
+	if (fabsf(x) <= 0.785398163f) {
+		*y = x;
+		return 0;
+	}
+	if (fabsf(x) < 0x1p28f) {
+		int n = NEAREST(x * inv_pio2);
+		*y = (x - n * pio2_1) - n * pio2_1t;
+		return n;
+	}
+	double y0, y1;
+	int n = rem_pio2(x, &y0, &y1);
+	*y = y0 + y1;
+	return n;
+}
+
+float sinf(float x) {
+	if (x != x || fabsf(x) == HUGE_VAL) return __builtin_nanf("");
+	double y;
+	switch (rem_pio2f(x, &y) & 3) {
+		case 0:  return kernel_sinf(y);
+		case 1:  return kernel_cosf(y);
+		case 2:  return -kernel_sinf(y);
+		default: return -kernel_cosf(y);
+	}
+}
+
+float cosf(float x) {
+	if (x != x || fabsf(x) == HUGE_VAL) return __builtin_nanf("");
+	double y;
+	switch (rem_pio2f(x, &y) & 3) {
+		case 0:  return kernel_cosf(y);
+		case 1:  return -kernel_sinf(y);
+		case 2:  return -kernel_cosf(y);
+		default: return kernel_sinf(y);
+	}
+}
+
+float tanf(float x) {
+	if (x != x || fabsf(x) == HUGE_VAL) return __builtin_nanf("");
+	double y;
+	int n = rem_pio2f(x, &y);
+	double s = kernel_sinf(y);
+	double c = kernel_cosf(y);
+	return (n & 1) ? -c / s : s / c;
+}
+
+/* atan(x) around each of these points, high and low parts */
+static const double atan_hi[] = {
+	4.63647609000806093515e-01, /* atan(0.5) */
+	7.85398163397448278999e-01, /* atan(1.0) */
+	9.82793723247329054082e-01, /* atan(1.5) */
+	1.57079632679489655800e+00, /* atan(inf) */
+};
+
+static const double atan_lo[] = {
+	2.26987774529616870924e-17,
+	3.06161699786838301793e-17,
+	1.39033110312309984516e-17,
+	6.12323399573676603587e-17,
+};
+
+static const double aT[] = {
+	3.33333333333329318027e-01,
+	-1.99999999998764832476e-01,
+	1.42857142725034663711e-01,
+	-1.11111104054623557880e-01,
+	9.09088713343650656196e-02,
+	-7.69187620504482999495e-02,
+	6.66107313738753120669e-02,
+	-5.83357013379057348645e-02,
+	4.97687799461593236017e-02,
+	-3.65315727442169155270e-02,
+	1.62858201153657823623e-02,
+};
+
+double atan(double x) {
+	MATH;
+	if (x != x) return x;
+	double ax = fabs(x);
+	if (ax >= 0x1p66) return x > 0 ? atan_hi[3] + atan_lo[3] : -atan_hi[3] - atan_lo[3];
+	if (ax < 0x1p-27) return x;
+
+	/* Bring |x| to within 7/16 of one of the points above */
+	int id;
+	if (ax < 0.4375) {
+		id = -1;
+	} else if (ax < 0.6875) {
+		id = 0;
+		ax = (2.0 * ax - 1.0) / (2.0 + ax);
+	} else if (ax < 1.1875) {
+		id = 1;
+		ax = (ax - 1.0) / (ax + 1.0);
+	} else if (ax < 2.4375) {
+		id = 2;
+		ax = (ax - 1.5) / (1.0 + 1.5 * ax);
+	} else {
+		id = 3;
+		ax = -1.0 / ax;
+	}
+
+	double z = ax * ax;
+	double w = z * z;
+	double s1 = z * (aT[0] + w * (aT[2] + w * (aT[4] + w * (aT[6] + w * (aT[8] + w * aT[10])))));
+	double s2 = w * (aT[1] + w * (aT[3] + w * (aT[5] + w * (aT[7] + w * aT[9]))));
+	double out;
+	if (id < 0) {
+		out = ax - ax * (s1 + s2);
+	} else {
+		out = atan_hi[id] - ((ax * (s1 + s2) - atan_lo[id]) - ax);
+	}
+	return x < 0 ? -out : out;
+}
+
+static const double
+	pi    = 3.1415926535897931160E+00,
+	pi_lo = 1.2246467991473531772E-16;
+
 double atan2(double y, double x) {
 	MATH;
+	if (x != x || y != y) return x + y;
+	if (x == 1.0) return atan(y);
+
+	int y_neg = (to_bits(y) >> 63) != 0;
+	int x_neg = (to_bits(x) >> 63) != 0;
+
+	if (y == 0.0) {
+		if (!x_neg) return y;
+		return y_neg ? -pi : pi;
+	}
+	if (x == 0.0) {
+		return y_neg ? -pi / 2 : pi / 2;
+	}
+	if (fabs(x) == HUGE_VAL) {
+		double out;
+		if (fabs(y) == HUGE_VAL) {
+			out = x_neg ? 3.0 * pi / 4 : pi / 4;
+		} else {
+			out = x_neg ? pi : 0.0;
+		}
+		return y_neg ? -out : out;
+	}
+	if (fabs(y) == HUGE_VAL) {
+		return y_neg ? -pi / 2 : pi / 2;
+	}
+
+	double z = atan(fabs(y / x));
+	if (x_neg) z = pi - (z - pi_lo);
+	return y_neg ? -z : z;
+}
+
+static const float atan_hif[] = {
+	4.6364760399e-01f,
+	7.8539812565e-01f,
+	9.8279368877e-01f,
+	1.5707962513e+00f,
+};
+
+static const float atan_lof[] = {
+	5.0121582440e-09f,
+	3.7748947079e-08f,
+	3.4473217170e-08f,
+	7.5497894159e-08f,
+};
+
+float atanf(float x) {
+	if (x != x) return x;
+	float ax = fabsf(x);
+	if (ax >= 0x1p26f) return x > 0 ? atan_hif[3] + atan_lof[3] : -atan_hif[3] - atan_lof[3];
+	if (ax < 0x1p-12f) return x;
+
+	int id;
+	if (ax < 0.4375f) {
+		id = -1;
+	} else if (ax < 0.6875f) {
+		id = 0;
+		ax = (2.0f * ax - 1.0f) / (2.0f + ax);
+	} else if (ax < 1.1875f) {
+		id = 1;
+		ax = (ax - 1.0f) / (ax + 1.0f);
+	} else if (ax < 2.4375f) {
+		id = 2;
+		ax = (ax - 1.5f) / (1.0f + 1.5f * ax);
+	} else {
+		id = 3;
+		ax = -1.0f / ax;
+	}
+
+	float z = ax * ax;
+	float w = z * z;
+	float s1 = z * (3.3333328366e-01f + w * (1.4253635705e-01f + w * 6.1687607318e-02f));
+	float s2 = w * (-1.9999158382e-01f + w * -1.0648017377e-01f);
 	float out;
-	float _x = x;
-	float _y = y;
-	asm volatile (
-		"fld %1\n"
-		"fld %2\n"
-		"fpatan\n"
-		"fstp %0\n"
-		: "=m"(out) : "m"(_y), "m"(_x)
-	);
-	return out;
+	if (id < 0) {
+		out = ax - ax * (s1 + s2);
+	} else {
+		out = atan_hif[id] - ((ax * (s1 + s2) - atan_lof[id]) - ax);
+	}
+	return x < 0 ? -out : out;
 }
 
-double atan(double x) {
-	return atan2(x,1.0);
+float atan2f(float y, float x) {
+	if (x != x || y != y) return x + y;
+	if (fabsf(x) == HUGE_VAL || fabsf(y) == HUGE_VAL || x == 0.0f || y == 0.0f) {
+		/* The edges are all exact; let the double version sort them out */
+		return atan2(y, x);
+	}
+
+	float z = atanf(fabsf(y / x));
+	if (x < 0.0f) z = 3.1415927410e+00f - (z + 8.7422776573e-08f);
+	return y < 0.0f ? -z : z;
 }
 
 double hypot(double x, double y) {
@@ -525,9 +1076,9 @@ double hypot(double x, double y) {
 
 double modf(double x, double *iptr) {
 	MATH;
-	int i = (int)x;
-	*iptr = (double)i;
-	return x - i;
+	*iptr = trunc(x);
+	if (fabs(x) == HUGE_VAL) return x > 0 ? 0.0 : -0.0;
+	return x - *iptr;
 }
 
 double frexp(double x, int *exp) {
@@ -0,0 +1,157 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Batch math functions: the same function over a whole array,
+ * four floats at a time with SSE.
+ *
+ * These are for drawing code that wants a value for every pixel of a
+ * span, and are accurate to what a pixel needs rather than to the last
+ * bit: sines and cosines are within 1e-7, exponentials within an ulp
+ * (and flush to zero below FLT_MIN). Sines and cosines of anything
+ * larger than a few thousand go to the scalar versions.
+ */
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+/* Past this, three pieces of pi/2 in floats isn't enough */
+#define TRIG_MAX 8192.0f
+
+/*
+ * Run a four-wide kernel over an array. The last few floats are copied
+ * into a full vector so the kernel never sees a short one.
+ */
+#define BATCH(kernel) do { \
+	size_t i = 0; \
+	for (; i + 4 <= n; i += 4) { \
+		_mm_storeu_ps(out + i, kernel(_mm_loadu_ps(in + i))); \
+	} \
+	if (i < n) { \
+		float tmp[4] = {0.0f, 0.0f, 0.0f, 0.0f}; \
+		for (size_t j = i; j < n; ++j) tmp[j - i] = in[j]; \
+		_mm_storeu_ps(tmp, kernel(_mm_loadu_ps(tmp))); \
+		for (size_t j = i; j < n; ++j) out[j] = tmp[j - i]; \
+	} \
+} while (0)
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 sqrt4(__m128 x) {
+	return _mm_sqrt_ps(x);
+}
+
+/*
+ * sin and cos of x + quadrant * pi/2. Both polynomials are evaluated and
+ * each lane picks the one its quadrant needs.
+ */
+static inline __m128 sincos4(__m128 x, int quadrant) {
+	__m128 n = _mm_mul_ps(x, _mm_set1_ps(0.636619772f));
+	__m128i q = _mm_cvtps_epi32(n); /* Rounds to nearest */
+	n = _mm_cvtepi32_ps(q);
+	q = _mm_add_epi32(q, _mm_set1_epi32(quadrant));
+
+	/* y = x - n * pi/2, with pi/2 in three parts so n * part is exact */
+	__m128 y = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(1.5703125f)));
+	y = _mm_sub_ps(y, _mm_mul_ps(n, _mm_set1_ps(4.837512969970703125e-4f)));
+	y = _mm_sub_ps(y, _mm_mul_ps(n, _mm_set1_ps(7.54978995489188216e-8f)));
+	__m128 z = _mm_mul_ps(y, y);
+
+	__m128 s = _mm_mul_ps(z, _mm_set1_ps(-1.9515295891e-4f));
+	s = _mm_mul_ps(_mm_add_ps(s, _mm_set1_ps(8.3321608736e-3f)), z);
+	s = _mm_mul_ps(_mm_add_ps(s, _mm_set1_ps(-1.6666654611e-1f)), z);
+	s = _mm_add_ps(_mm_mul_ps(s, y), y);
+
+	__m128 c = _mm_mul_ps(z, _mm_set1_ps(2.443315711809948e-5f));
+	c = _mm_mul_ps(_mm_add_ps(c, _mm_set1_ps(-1.388731625493765e-3f)), z);
+	c = _mm_mul_ps(_mm_add_ps(c, _mm_set1_ps(4.166664568298827e-2f)), z);
+	c = _mm_mul_ps(c, z);
+	c = _mm_sub_ps(c, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+	c = _mm_add_ps(c, _mm_set1_ps(1.0f));
+
+	/* Odd quadrants take the cosine; quadrants 2 and 3 flip the sign */
+	__m128 odd = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+	__m128 out = select_ps(odd, c, s);
+	__m128 sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, _mm_set1_epi32(2)), 30));
+	return _mm_xor_ps(out, sign);
+}
+
+/* Any lane too big (or not a number) for the vector reduction */
+static inline int trig_out_of_range(__m128 x) {
+	__m128 ax = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+	return _mm_movemask_ps(_mm_cmpnlt_ps(ax, _mm_set1_ps(TRIG_MAX))) != 0;
+}
+
+static inline __m128 sin4(__m128 x) {
+	if (trig_out_of_range(x)) {
+		float v[4];
+		_mm_storeu_ps(v, x);
+		return _mm_setr_ps(sinf(v[0]), sinf(v[1]), sinf(v[2]), sinf(v[3]));
+	}
+	return sincos4(x, 0);
+}
+
+static inline __m128 cos4(__m128 x) {
+	if (trig_out_of_range(x)) {
+		float v[4];
+		_mm_storeu_ps(v, x);
+		return _mm_setr_ps(cosf(v[0]), cosf(v[1]), cosf(v[2]), cosf(v[3]));
+	}
+	return sincos4(x, 1);
+}
+
+static inline __m128 exp4(__m128 x) {
+	__m128 big = _mm_cmpgt_ps(x, _mm_set1_ps(88.72283f));
+	__m128 small = _mm_cmplt_ps(x, _mm_set1_ps(-87.33654f));
+	__m128 nan = _mm_cmpunord_ps(x, x);
+	__m128 xc = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.33654f)), _mm_set1_ps(88.72283f));
+
+	/* x = n * ln2 + r */
+	__m128i q = _mm_cvtps_epi32(_mm_mul_ps(xc, _mm_set1_ps(1.44269504f)));
+	__m128 n = _mm_cvtepi32_ps(q);
+	__m128 r = _mm_sub_ps(xc, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+	__m128 z = _mm_mul_ps(r, r);
+
+	__m128 p = _mm_set1_ps(1.9875691500e-4f);
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+	p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p, z), r), _mm_set1_ps(1.0f));
+
+	/*
+	 * Scale by 2^n in two steps: at the top of the range 2^n alone
+	 * doesn't fit in a float even though the result does.
+	 */
+	__m128i half = _mm_srai_epi32(q, 1);
+	__m128 s1 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(half, _mm_set1_epi32(127)), 23));
+	__m128 s2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_sub_epi32(q, half), _mm_set1_epi32(127)), 23));
+	__m128 out = _mm_mul_ps(_mm_mul_ps(p, s1), s2);
+
+	out = select_ps(big, _mm_set1_ps(HUGE_VAL), out);
+	out = select_ps(small, _mm_setzero_ps(), out);
+	return select_ps(nan, x, out);
+}
+
+void vsqrtf(float * out, const float * in, size_t n) {
+	BATCH(sqrt4);
+}
+
+void vsinf(float * out, const float * in, size_t n) {
+	BATCH(sin4);
+}
+
+void vcosf(float * out, const float * in, size_t n) {
+	BATCH(cos4);
+}
+
+void vexpf(float * out, const float * in, size_t n) {
+	BATCH(exp4);
+}
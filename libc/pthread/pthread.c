@@ -11,24 +11,119 @@
 #include <errno.h>
 
 #include <sys/wait.h>
+#include <sys/futex.h>
+#include <sys/mman.h>
+#include <sys/tls.h>
 
-DEFN_SYSCALL3(clone, SYS_CLONE, uintptr_t, uintptr_t, void *);
+DEFN_SYSCALL4(clone, SYS_CLONE, uintptr_t, uintptr_t, void *, void *);
 DEFN_SYSCALL0(gettid, SYS_GETTID);
 
+/*
+ * A thread's memory is one mapping: its stack, then the static TLS
+ * blocks, then its control block. Mappings are only touched as the
+ * thread uses them, and a few are kept after their threads are joined
+ * so creating another thread doesn't need the kernel for anything but
+ * clone().
+ */
 #define PTHREAD_STACK_SIZE 0x100000
+#define PTHREAD_CACHE_MAX  8
+
+extern int __libc_threaded;
+extern void __malloc_thread_exit(void);
+
+struct __pthread {
+	tls_tcb_t tcb;              /* %gs points here, so this comes first */
+	void *(*routine)(void *);
+	void * arg;
+	void * ret_val;
+	char * base;                /* Of the mapping; the stack grows down to here */
+	size_t size;
+	struct __pthread * next;    /* In the cache */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct __pthread * head;
+	int count;
+} thread_cache = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
 
 int clone(uintptr_t a,uintptr_t b,void* c) {
-	__sets_errno(syscall_clone(a,b,c));
+	__libc_threaded = 1;
+	__sets_errno(syscall_clone(a,b,c,NULL));
 }
+
 int gettid() {
 	return syscall_gettid(); /* never fails */
 }
 
+static struct __pthread * thread_alloc(void) {
+	struct __pthread * self = NULL;
+
+	pthread_mutex_lock(&thread_cache.lock);
+	if (thread_cache.head) {
+		self = thread_cache.head;
+		thread_cache.head = self->next;
+		thread_cache.count--;
+	}
+	pthread_mutex_unlock(&thread_cache.lock);
+
+	if (!self) {
+		size_t tls = (__ld_tls_size() + 0xFFF) & ~0xFFF;
+		size_t size = PTHREAD_STACK_SIZE + tls + ((sizeof(struct __pthread) + 0xFFF) & ~0xFFF);
+		char * base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) return NULL;
+		self = (struct __pthread *)(base + PTHREAD_STACK_SIZE + tls);
+		self->base = base;
+		self->size = size;
+	}
+
+	self->tcb.self = &self->tcb;
+	self->tcb.errno_value = 0;
+	self->tcb.thread = self;
+	self->tcb.malloc_cache = NULL;
+	self->ret_val = NULL;
+	__ld_tls_init(&self->tcb);
+	return self;
+}
+
+/* Only once the thread is gone; its stack is still in use until then */
+static void thread_release(struct __pthread * self) {
+	pthread_mutex_lock(&thread_cache.lock);
+	if (thread_cache.count < PTHREAD_CACHE_MAX) {
+		self->next = thread_cache.head;
+		thread_cache.head = self;
+		thread_cache.count++;
+		self = NULL;
+	}
+	pthread_mutex_unlock(&thread_cache.lock);
+
+	if (self) {
+		munmap(self->base, self->size);
+	}
+}
+
+/* Threads begin here so that returning from start_routine still goes through pthread_exit */
+static void * pthread_start(void * _self) {
+	struct __pthread * self = _self;
+	pthread_exit(self->routine(self->arg));
+	return NULL;
+}
+
 int pthread_create(pthread_t * thread, pthread_attr_t * attr, void *(*start_routine)(void *), void * arg) {
-	char * stack = malloc(PTHREAD_STACK_SIZE);
-	uintptr_t stack_top = (uintptr_t)stack + PTHREAD_STACK_SIZE;
-	thread->stack = stack;
-	thread->id = clone(stack_top, (uintptr_t)start_routine, arg);
+	struct __pthread * self = thread_alloc();
+	if (!self) return EAGAIN;
+	self->routine = start_routine;
+	self->arg = arg;
+
+	__libc_threaded = 1;
+	int tid = syscall_clone((uintptr_t)self->base + PTHREAD_STACK_SIZE, (uintptr_t)pthread_start, self, &self->tcb);
+	if (tid < 0) {
+		thread_release(self);
+		return -tid;
+	}
+
+	thread->id = tid;
+	thread->thread = self;
 	return 0;
 }
 
@@ -37,15 +132,32 @@ int pthread_kill(pthread_t thread, int sig) {
 }
 
 void pthread_exit(void * value) {
+	tls_tcb_t * tcb = __tls_tcb();
+	struct __pthread * self = tcb ? tcb->thread : NULL;
+	if (self) {
+		self->ret_val = value;
+	}
+
 	/* Perform nice cleanup */
-#if 0
-	/* XXX: LOCK */
-	free(stack);
-	/* XXX: Return value!? */
-#endif
-	uintptr_t magic_exit_target = 0xFFFFB00F;
-	void (*magic_exit_func)(void) = (void *)magic_exit_target;
-	magic_exit_func();
+	__malloc_thread_exit();
+
+	/* This only ends the calling thread */
+	syscall_exit(0);
+	__builtin_unreachable();
+}
+
+int pthread_join(pthread_t thread, void **retval) {
+	int status;
+	while (waitpid(thread.id, &status, 0) < 0) {
+		if (errno != EINTR) return errno;
+	}
+	if (retval) {
+		*retval = thread.thread ? thread.thread->ret_val : NULL;
+	}
+	if (thread.thread) {
+		thread_release(thread.thread);
+	}
+	return 0;
 }
 
 void pthread_cleanup_push(void (*routine)(void *), void *arg) {
@@ -56,22 +168,38 @@ void pthread_cleanup_pop(int execute) {
 	/* do nothing */
 }
 
+/*
+ * Mutexes are 0 when unlocked, 1 when locked, and 2 when locked with
+ * (possibly) someone sleeping on them; only the last case needs the
+ * kernel on either side.
+ */
 int pthread_mutex_lock(pthread_mutex_t *mutex) {
-	while (__sync_lock_test_and_set(mutex, 0x01)) {
-		syscall_yield();
+	int c = __sync_val_compare_and_swap(mutex, 0, 1);
+	if (c == 0) {
+		return 0;
+	}
+	if (c != 2) {
+		c = __sync_lock_test_and_set(mutex, 2);
+	}
+	while (c != 0) {
+		futex((volatile uint32_t *)mutex, FUTEX_WAIT, 2);
+		c = __sync_lock_test_and_set(mutex, 2);
 	}
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex) {
-	if (__sync_lock_test_and_set(mutex, 0x01)) {
+	if (__sync_val_compare_and_swap(mutex, 0, 1) != 0) {
 		return EBUSY;
 	}
 	return 0;
 }
 
 int pthread_mutex_unlock(pthread_mutex_t *mutex) {
-	__sync_lock_release(mutex);
+	if (__sync_fetch_and_sub(mutex, 1) != 1) {
+		__sync_lock_release(mutex);
+		futex((volatile uint32_t *)mutex, FUTEX_WAKE, 1);
+	}
 	return 0;
 }
 
@@ -93,11 +221,119 @@ int pthread_attr_destroy(pthread_attr_t *attr) {
 	return 0;
 }
 
-int pthread_join(pthread_t thread, void **retval) {
-	int status;
-	int result = waitpid(thread.id, &status, 0);
-	if (retval) {
-		*retval = (void*)status;
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+	cond->seq = 0;
+	cond->waiters = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond) {
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	uint32_t seq = cond->seq;
+	__sync_fetch_and_add(&cond->waiters, 1);
+	pthread_mutex_unlock(mutex);
+
+	/* If a signal came in since we read seq, this returns right away */
+	futex(&cond->seq, FUTEX_WAIT, seq);
+
+	__sync_fetch_and_sub(&cond->waiters, 1);
+
+	/* Others may have been woken with us, so take the mutex as contended */
+	while (__sync_lock_test_and_set(mutex, 2) != 0) {
+		futex((volatile uint32_t *)mutex, FUTEX_WAIT, 2);
+	}
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	if (cond->waiters) {
+		futex(&cond->seq, FUTEX_WAKE, 1);
+	}
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+	__sync_fetch_and_add(&cond->seq, 1);
+	if (cond->waiters) {
+		futex(&cond->seq, FUTEX_WAKE, INT32_MAX);
+	}
+	return 0;
+}
+
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr) {
+	pthread_mutex_init(&rwlock->lock, NULL);
+	pthread_cond_init(&rwlock->cond, NULL);
+	rwlock->readers = 0;
+	rwlock->writer = 0;
+	rwlock->waiting_writers = 0;
+	return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rwlock) {
+	return 0;
+}
+
+/* Waiting writers hold off new readers, so writers can't starve */
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+	pthread_mutex_lock(&rwlock->lock);
+	while (rwlock->writer || rwlock->waiting_writers) {
+		pthread_cond_wait(&rwlock->cond, &rwlock->lock);
 	}
-	return result;
+	rwlock->readers++;
+	pthread_mutex_unlock(&rwlock->lock);
+	return 0;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
+	int out = 0;
+	pthread_mutex_lock(&rwlock->lock);
+	if (rwlock->writer || rwlock->waiting_writers) {
+		out = EBUSY;
+	} else {
+		rwlock->readers++;
+	}
+	pthread_mutex_unlock(&rwlock->lock);
+	return out;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+	pthread_mutex_lock(&rwlock->lock);
+	rwlock->waiting_writers++;
+	while (rwlock->writer || rwlock->readers) {
+		pthread_cond_wait(&rwlock->cond, &rwlock->lock);
+	}
+	rwlock->waiting_writers--;
+	rwlock->writer = 1;
+	pthread_mutex_unlock(&rwlock->lock);
+	return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
+	int out = 0;
+	pthread_mutex_lock(&rwlock->lock);
+	if (rwlock->writer || rwlock->readers) {
+		out = EBUSY;
+	} else {
+		rwlock->writer = 1;
+	}
+	pthread_mutex_unlock(&rwlock->lock);
+	return out;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
+	pthread_mutex_lock(&rwlock->lock);
+	if (rwlock->writer) {
+		rwlock->writer = 0;
+	} else if (rwlock->readers) {
+		rwlock->readers--;
+	}
+	if (!rwlock->readers) {
+		pthread_cond_broadcast(&rwlock->cond);
+	}
+	pthread_mutex_unlock(&rwlock->lock);
+	return 0;
 }
@@ -0,0 +1,15 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sched.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(setscheduler, SYS_SETSCHEDULER, int, int, void *);
+DEFN_SYSCALL1(getscheduler, SYS_GETSCHEDULER, int);
+
+int sched_setscheduler(int pid, int policy, const struct sched_param * param) {
+	__sets_errno(syscall_setscheduler(pid, policy, (void *)param));
+}
+
+int sched_getscheduler(int pid) {
+	__sets_errno(syscall_getscheduler(pid));
+}
@@ -0,0 +1,142 @@
+#include <spawn.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+DEFN_SYSCALL5(spawn, SYS_SPAWN, char *, char **, char **, void *, void *);
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+int posix_spawn(pid_t * pid, const char * path, const posix_spawn_file_actions_t * file_actions,
+		const posix_spawnattr_t * attrp, char * const argv[], char * const envp[]) {
+	int ret = syscall_spawn((char *)path, (char **)argv, (char **)envp, (void *)file_actions, (void *)attrp);
+	if (ret < 0) return -ret;
+	if (pid) *pid = ret;
+	return 0;
+}
+
+int posix_spawnp(pid_t * pid, const char * file, const posix_spawn_file_actions_t * file_actions,
+		const posix_spawnattr_t * attrp, char * const argv[], char * const envp[]) {
+	if (strchr(file, '/')) {
+		return posix_spawn(pid, file, file_actions, attrp, argv, envp);
+	}
+
+	char * path = getenv("PATH");
+	if (!path) {
+		path = DEFAULT_PATH;
+	}
+
+	char * xpath = strdup(path);
+	char * p, * last;
+	int ret = ENOENT;
+	for ((p = strtok_r(xpath, ":", &last)); p; p = strtok_r(NULL, ":", &last)) {
+		char * exe = malloc(strlen(p) + strlen(file) + 2);
+		strcpy(exe, p);
+		strcat(exe, "/");
+		strcat(exe, file);
+
+		struct stat stat_buf;
+		if (stat(exe, &stat_buf) != 0 || !(stat_buf.st_mode & 0111)) {
+			free(exe);
+			continue;
+		}
+
+		ret = posix_spawn(pid, exe, file_actions, attrp, argv, envp);
+		free(exe);
+		break;
+	}
+	free(xpath);
+	return ret;
+}
+
+int posix_spawn_file_actions_init(posix_spawn_file_actions_t * file_actions) {
+	file_actions->count = 0;
+	file_actions->capacity = 0;
+	file_actions->actions = NULL;
+	return 0;
+}
+
+int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t * file_actions) {
+	for (int i = 0; i < file_actions->count; ++i) {
+		free(file_actions->actions[i].path);
+	}
+	free(file_actions->actions);
+	file_actions->actions = NULL;
+	file_actions->count = 0;
+	file_actions->capacity = 0;
+	return 0;
+}
+
+static struct __spawn_action * add_action(posix_spawn_file_actions_t * file_actions, int type, int fd) {
+	if (file_actions->count == file_actions->capacity) {
+		int capacity = file_actions->capacity ? file_actions->capacity * 2 : 4;
+		struct __spawn_action * actions = realloc(file_actions->actions, sizeof(struct __spawn_action) * capacity);
+		if (!actions) return NULL;
+		file_actions->actions = actions;
+		file_actions->capacity = capacity;
+	}
+	struct __spawn_action * action = &file_actions->actions[file_actions->count++];
+	memset(action, 0, sizeof(struct __spawn_action));
+	action->type = type;
+	action->fd = fd;
+	return action;
+}
+
+int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t * file_actions, int fd) {
+	if (fd < 0) return EBADF;
+	if (!add_action(file_actions, __SPAWN_CLOSE, fd)) return ENOMEM;
+	return 0;
+}
+
+int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t * file_actions, int fd, int newfd) {
+	if (fd < 0 || newfd < 0) return EBADF;
+	struct __spawn_action * action = add_action(file_actions, __SPAWN_DUP2, newfd);
+	if (!action) return ENOMEM;
+	action->src = fd;
+	return 0;
+}
+
+int posix_spawn_file_actions_addopen(posix_spawn_file_actions_t * file_actions, int fd,
+		const char * path, int oflag, mode_t mode) {
+	if (fd < 0) return EBADF;
+	struct __spawn_action * action = add_action(file_actions, __SPAWN_OPEN, fd);
+	if (!action) return ENOMEM;
+	action->path  = strdup(path);
+	action->flags = oflag;
+	action->mode  = mode;
+	return 0;
+}
+
+int posix_spawnattr_init(posix_spawnattr_t * attr) {
+	attr->flags = 0;
+	attr->pgroup = 0;
+	return 0;
+}
+
+int posix_spawnattr_destroy(posix_spawnattr_t * attr) {
+	return 0;
+}
+
+int posix_spawnattr_getflags(const posix_spawnattr_t * attr, short * flags) {
+	*flags = attr->flags;
+	return 0;
+}
+
+int posix_spawnattr_setflags(posix_spawnattr_t * attr, short flags) {
+	if (flags & ~POSIX_SPAWN_SETPGROUP) return EINVAL;
+	attr->flags = flags;
+	return 0;
+}
+
+int posix_spawnattr_getpgroup(const posix_spawnattr_t * attr, pid_t * pgroup) {
+	*pgroup = attr->pgroup;
+	return 0;
+}
+
+int posix_spawnattr_setpgroup(posix_spawnattr_t * attr, pid_t pgroup) {
+	attr->pgroup = pgroup;
+	return 0;
+}
@@ -1,310 +1,697 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 #include <va_list.h>
 
-static void print_dec(unsigned int value, unsigned int width, char * buf, int * ptr, int fill_zero, int align_right) {
-	unsigned int n_width = 1;
-	unsigned int i = 9;
-
-	if (value < 10UL) {
-		n_width = 1;
-	} else if (value < 100UL) {
-		n_width = 2;
-	} else if (value < 1000UL) {
-		n_width = 3;
-	} else if (value < 10000UL) {
-		n_width = 4;
-	} else if (value < 100000UL) {
-		n_width = 5;
-	} else if (value < 1000000UL) {
-		n_width = 6;
-	} else if (value < 10000000UL) {
-		n_width = 7;
-	} else if (value < 100000000UL) {
-		n_width = 8;
-	} else if (value < 1000000000UL) {
-		n_width = 9;
-	} else {
-		n_width = 10;
-	}
+/*
+ * Formatted output.
+ *
+ * Everything is rendered through a `struct output`. The snprintf
+ * family writes straight into the caller's buffer and drops what
+ * does not fit; the FILE printers collect output in a stack buffer
+ * that reaches fwrite() in one piece for anything but very long
+ * lines; vasprintf grows a heap buffer as it goes.
+ */
 
-	int printed = 0;
-	if (align_right) {
-		while (n_width + printed < width) {
-			buf[*ptr] = fill_zero ? '0' : ' ';
-			*ptr += 1;
-			printed += 1;
-		}
+#define OUT_BOUNDED 0
+#define OUT_FILE    1
+#define OUT_GROW    2
 
-		i = n_width;
-		while (i > 0) {
-			unsigned int n = value / 10;
-			int r = value % 10;
-			buf[*ptr + i - 1] = r + '0';
-			i--;
-			value = n;
-		}
-		*ptr += n_width;
-	} else {
-		i = n_width;
-		while (i > 0) {
-			unsigned int n = value / 10;
-			int r = value % 10;
-			buf[*ptr + i - 1] = r + '0';
-			i--;
-			value = n;
-			printed++;
+#define OUT_STACK_SIZE 1024
+
+struct output {
+	int kind;
+	char * buf;
+	size_t size;  /* Usable bytes in buf */
+	size_t used;  /* Bytes currently in buf */
+	size_t total; /* Bytes produced, including any that were dropped */
+	FILE * file;
+	int error;
+};
+
+/* Make room in a full buffer; returns 0 if the rest must be dropped. */
+static int out_drain(struct output * o) {
+	if (o->kind == OUT_FILE) {
+		if (o->used && fwrite(o->buf, 1, o->used, o->file) != o->used) {
+			o->error = 1;
 		}
-		*ptr += n_width;
-		while (printed < (int)width) {
-			buf[*ptr] = fill_zero ? '0' : ' ';
-			*ptr += 1;
-			printed += 1;
+		o->used = 0;
+		return 1;
+	} else if (o->kind == OUT_GROW) {
+		size_t size = o->size ? o->size * 2 : 64;
+		char * buf = realloc(o->buf, size + 1);
+		if (!buf) {
+			o->error = 1;
+			return 0;
 		}
+		o->buf = buf;
+		o->size = size;
+		return 1;
+	}
+	return 0;
+}
+
+static void out_write(struct output * o, const char * s, size_t n) {
+	o->total += n;
+	while (n) {
+		if (o->used == o->size && !out_drain(o)) return;
+		size_t chunk = o->size - o->used;
+		if (chunk > n) chunk = n;
+		memcpy(o->buf + o->used, s, chunk);
+		o->used += chunk;
+		s += chunk;
+		n -= chunk;
+	}
+}
+
+static void out_pad(struct output * o, char c, int n) {
+	if (n <= 0) return;
+	o->total += n;
+	while (n) {
+		if (o->used == o->size && !out_drain(o)) return;
+		size_t chunk = o->size - o->used;
+		if (chunk > (size_t)n) chunk = n;
+		memset(o->buf + o->used, c, chunk);
+		o->used += chunk;
+		n -= chunk;
+	}
+}
+
+static inline void out_char(struct output * o, char c) {
+	if (o->used < o->size) {
+		o->buf[o->used++] = c;
+		o->total++;
+	} else {
+		out_write(o, &c, 1);
 	}
 }
 
 /*
- * Hexadecimal to string
+ * Conversion specifications
  */
-static void print_hex(unsigned int value, unsigned int width, char * buf, int * ptr) {
-	int i = width;
+struct spec {
+	int left;    /* - */
+	int plus;    /* + */
+	int space;   /* ' ' */
+	int alt;     /* # */
+	int zero;    /* 0 */
+	int width;
+	int precision; /* -1 if not given */
+	int length;
+};
+
+#define LEN_NONE 0
+#define LEN_HH   1
+#define LEN_H    2
+#define LEN_L    3
+#define LEN_LL   4
+#define LEN_Z    5
+#define LEN_J    6
+#define LEN_T    7
+#define LEN_LD   8
+
+/* Lay out prefix and body in a field of spec->width. */
+static void out_field(struct output * o, struct spec * spec, const char * prefix, int prefix_len, int zeros, const char * body, int body_len) {
+	int pad = spec->width - prefix_len - zeros - body_len;
+	if (!spec->left && !spec->zero) out_pad(o, ' ', pad);
+	out_write(o, prefix, prefix_len);
+	if (!spec->left && spec->zero) out_pad(o, '0', pad);
+	out_pad(o, '0', zeros);
+	out_write(o, body, body_len);
+	if (spec->left) out_pad(o, ' ', pad);
+}
 
-	if (i == 0) i = 8;
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
 
-	unsigned int n_width = 1;
-	unsigned int j = 0x0F;
-	while (value > j && j < UINT32_MAX) {
-		n_width += 1;
-		j *= 0x10;
-		j += 0x0F;
+/* Digits of `value` ending just before `end`; returns the first one. */
+static char * format_dec(char * end, uint64_t value) {
+	/* Stay in 32-bit division as soon as we can; 64-bit is a libgcc call */
+	while (value > UINT32_MAX) {
+		uint64_t q = value / 100;
+		unsigned int r = value - q * 100;
+		end -= 2;
+		memcpy(end, &digit_pairs[r * 2], 2);
+		value = q;
+	}
+	uint32_t v = value;
+	while (v >= 100) {
+		uint32_t q = v / 100;
+		unsigned int r = v - q * 100;
+		end -= 2;
+		memcpy(end, &digit_pairs[r * 2], 2);
+		v = q;
+	}
+	if (v >= 10) {
+		end -= 2;
+		memcpy(end, &digit_pairs[v * 2], 2);
+	} else {
+		*--end = '0' + v;
+	}
+	return end;
+}
+
+static char * format_hex(char * end, uint64_t value, int upper) {
+	const char * digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	do {
+		*--end = digits[value & 0xF];
+		value >>= 4;
+	} while (value);
+	return end;
+}
+
+static char * format_oct(char * end, uint64_t value) {
+	do {
+		*--end = '0' + (value & 7);
+		value >>= 3;
+	} while (value);
+	return end;
+}
+
+static void format_integer(struct output * o, struct spec * spec, uint64_t value, int negative, char conv) {
+	char tmp[24];
+	char * end = tmp + sizeof(tmp);
+	char * start;
+
+	switch (conv) {
+		case 'x': case 'X': case 'p':
+			start = format_hex(end, value, conv == 'X');
+			break;
+		case 'o':
+			start = format_oct(end, value);
+			break;
+		default:
+			start = format_dec(end, value);
+			break;
 	}
 
-	while (i > (int)n_width) {
-		buf[*ptr] = '0';
-		*ptr += 1;
-		i--;
+	int len = end - start;
+	if (spec->precision == 0 && value == 0) {
+		/* "%.0d" of zero prints nothing at all */
+		len = 0;
 	}
 
-	i = (int)n_width;
-	while (i-- > 0) {
-		buf[*ptr] = "0123456789abcdef"[(value>>(i*4))&0xF];
-		*ptr += + 1;
+	char prefix[2];
+	int prefix_len = 0;
+	if (negative) {
+		prefix[prefix_len++] = '-';
+	} else if (spec->plus && (conv == 'd' || conv == 'i')) {
+		prefix[prefix_len++] = '+';
+	} else if (spec->space && (conv == 'd' || conv == 'i')) {
+		prefix[prefix_len++] = ' ';
+	} else if (spec->alt && (conv == 'x' || conv == 'X') && value) {
+		prefix[prefix_len++] = '0';
+		prefix[prefix_len++] = conv;
+	} else if (conv == 'p') {
+		prefix[prefix_len++] = '0';
+		prefix[prefix_len++] = 'x';
 	}
+
+	int zeros = 0;
+	if (spec->precision > len) {
+		zeros = spec->precision - len;
+	}
+	if (spec->alt && conv == 'o' && !zeros && (len == 0 || *start != '0')) {
+		zeros = 1;
+	}
+
+	struct spec s = *spec;
+	if (s.precision >= 0) s.zero = 0; /* The flag is ignored with a precision */
+	out_field(o, &s, prefix, prefix_len, zeros, end - len, len);
 }
 
 /*
- * vasprintf()
+ * Floating point.
+ *
+ * Digits come from an exact decimal expansion of the double, so
+ * rounding is correct (ties to even) at any precision and %.17g
+ * always reads back as the same value.
  */
-int xvasprintf(char * buf, const char * fmt, va_list args) {
-	int i = 0;
-	char * s;
-	char * b = buf;
-	int precision = -1;
-	for (const char *f = fmt; *f; f++) {
+
+#define FP_LIMBS  96   /* Base 1e9; enough for m * 5^1074 */
+#define FP_DIGITS 800
+
+/* Multiply a little-endian base-1e9 number by f (at most 2^31) */
+static int fp_mul(uint32_t * limbs, int count, uint32_t f) {
+	uint32_t carry = 0;
+	for (int i = 0; i < count; ++i) {
+		uint64_t t = (uint64_t)limbs[i] * f + carry;
+		carry = t / 1000000000;
+		limbs[i] = t - (uint64_t)carry * 1000000000;
+	}
+	while (carry) {
+		limbs[count++] = carry % 1000000000;
+		carry /= 1000000000;
+	}
+	return count;
+}
+
+/*
+ * Write the significant digits of a finite, nonzero magnitude to
+ * `digits` with no leading or trailing zeros, returning their count,
+ * and set *exp10 so the value is 0.d1d2d3... * 10^exp10.
+ */
+static int fp_digits(double value, char * digits, int * exp10) {
+	union { double d; uint64_t u; } bits = { value };
+	int e = (bits.u >> 52) & 0x7FF;
+	uint64_t m = bits.u & ((1ULL << 52) - 1);
+	if (e) {
+		m |= 1ULL << 52;
+	} else {
+		e = 1;
+	}
+	e -= 1075; /* value = m * 2^e */
+
+	uint32_t limbs[FP_LIMBS];
+	int count = 0;
+	while (m) {
+		limbs[count++] = m % 1000000000;
+		m /= 1000000000;
+	}
+
+	int fraction = 0;
+	if (e > 0) {
+		while (e > 0) {
+			int s = e > 29 ? 29 : e;
+			count = fp_mul(limbs, count, 1U << s);
+			e -= s;
+		}
+	} else if (e < 0) {
+		/* m / 2^k == m * 5^k / 10^k */
+		fraction = -e;
+		for (int k = -e; k > 0; k -= 13) {
+			uint32_t f = 1;
+			for (int i = 0; i < (k > 13 ? 13 : k); ++i) f *= 5;
+			count = fp_mul(limbs, count, f);
+		}
+	}
+
+	/* Most significant limb without its leading zeros, then 9 digits per limb */
+	char * p = format_dec(digits + 10, limbs[count - 1]);
+	int n = digits + 10 - p;
+	memmove(digits, p, n);
+	for (int i = count - 2; i >= 0; --i) {
+		uint32_t l = limbs[i];
+		for (int j = 8; j >= 0; --j) {
+			digits[n + j] = '0' + l % 10;
+			l /= 10;
+		}
+		n += 9;
+	}
+
+	*exp10 = n - fraction;
+	while (n > 0 && digits[n - 1] == '0') n--;
+	return n;
+}
+
+/* Keep `keep` significant digits, rounding half to even. */
+static int fp_round(char * digits, int count, int keep, int * exp10) {
+	if (keep >= count) return count;
+	if (keep < 0) return 0;
+
+	int up;
+	if (digits[keep] > '5') {
+		up = 1;
+	} else if (digits[keep] < '5') {
+		up = 0;
+	} else if (keep + 1 < count) {
+		/* There are no trailing zeros, so anything after the 5 is nonzero */
+		up = 1;
+	} else {
+		up = keep > 0 && ((digits[keep - 1] - '0') & 1);
+	}
+
+	count = keep;
+	if (up) {
+		while (count > 0 && digits[count - 1] == '9') count--;
+		if (count == 0) {
+			digits[0] = '1';
+			count = 1;
+			(*exp10)++;
+		} else {
+			digits[count - 1]++;
+		}
+	}
+	while (count > 0 && digits[count - 1] == '0') count--;
+	return count;
+}
+
+static void format_double(struct output * o, struct spec * spec, double value, char conv) {
+	int upper = (conv == 'F' || conv == 'E' || conv == 'G');
+	conv |= 0x20;
+
+	union { double d; uint64_t u; } bits = { value };
+	char sign[1];
+	int sign_len = 0;
+	if (bits.u >> 63) {
+		sign[sign_len++] = '-';
+		value = -value;
+	} else if (spec->plus) {
+		sign[sign_len++] = '+';
+	} else if (spec->space) {
+		sign[sign_len++] = ' ';
+	}
+
+	if (((bits.u >> 52) & 0x7FF) == 0x7FF) {
+		const char * word = (bits.u & ((1ULL << 52) - 1)) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf");
+		struct spec s = *spec;
+		s.zero = 0;
+		out_field(o, &s, sign, sign_len, 0, word, 3);
+		return;
+	}
+
+	char digits[FP_DIGITS];
+	int exp10 = 1;
+	int count = 0;
+	if (value != 0.0) {
+		count = fp_digits(value, digits, &exp10);
+	}
+
+	int precision = spec->precision < 0 ? 6 : spec->precision;
+	int exponential = (conv == 'e');
+	int strip = 0;
+
+	if (conv == 'g') {
+		if (precision == 0) precision = 1;
+		count = fp_round(digits, count, precision, &exp10);
+		int x = count ? exp10 - 1 : 0;
+		if (precision > x && x >= -4) {
+			precision = precision - 1 - x;
+		} else {
+			exponential = 1;
+			precision = precision - 1;
+		}
+		strip = !spec->alt;
+	} else if (exponential) {
+		count = fp_round(digits, count, precision + 1, &exp10);
+	} else {
+		count = fp_round(digits, count, exp10 + precision, &exp10);
+	}
+	if (!count) exp10 = 1;
+
+	if (strip) {
+		/* %g drops trailing zeros from the fraction */
+		int have = exponential ? count - 1 : count - exp10;
+		if (have < 0) have = 0;
+		if (precision > have) precision = have;
+	}
+
+	int point = (precision > 0 || spec->alt);
+	char exp_buf[8];
+	int exp_len = 0;
+	int int_len;
+	if (exponential) {
+		int x = count ? exp10 - 1 : 0;
+		char * end = exp_buf + sizeof(exp_buf);
+		char * start = format_dec(end, x < 0 ? -x : x);
+		if (end - start < 2) *--start = '0';
+		*--start = x < 0 ? '-' : '+';
+		*--start = upper ? 'E' : 'e';
+		exp_len = end - start;
+		memmove(exp_buf, start, exp_len);
+		int_len = 1;
+	} else {
+		int_len = exp10 > 0 ? exp10 : 1;
+	}
+
+	int len = sign_len + int_len + point + precision + exp_len;
+	int pad = spec->width - len;
+
+	if (!spec->left && !spec->zero) out_pad(o, ' ', pad);
+	out_write(o, sign, sign_len);
+	if (!spec->left && spec->zero) out_pad(o, '0', pad);
+
+	int next; /* Index in digits of the first fraction digit */
+	if (exponential) {
+		out_char(o, count ? digits[0] : '0');
+		next = 1;
+	} else if (exp10 > 0) {
+		int have = count < exp10 ? count : exp10;
+		out_write(o, digits, have);
+		out_pad(o, '0', exp10 - have);
+		next = exp10;
+	} else {
+		out_char(o, '0');
+		next = exp10;
+	}
+
+	if (point) out_char(o, '.');
+
+	int remaining = precision;
+	if (next < 0) {
+		/* Zeros between the point and the first significant digit */
+		int zeros = -next < remaining ? -next : remaining;
+		out_pad(o, '0', zeros);
+		remaining -= zeros;
+		next = 0;
+	}
+	if (remaining > 0 && next < count) {
+		int have = count - next < remaining ? count - next : remaining;
+		out_write(o, digits + next, have);
+		remaining -= have;
+	}
+	out_pad(o, '0', remaining);
+
+	out_write(o, exp_buf, exp_len);
+	if (spec->left) out_pad(o, ' ', pad);
+}
+
+static void format_string(struct output * o, struct spec * spec, const char * s) {
+	if (!s) s = "(null)";
+	size_t len;
+	if (spec->precision >= 0) {
+		const char * end = memchr(s, '\0', spec->precision);
+		len = end ? (size_t)(end - s) : (size_t)spec->precision;
+	} else {
+		len = strlen(s);
+	}
+	struct spec sp = *spec;
+	sp.zero = 0;
+	out_field(o, &sp, NULL, 0, 0, s, len);
+}
+
+static void format_wide_string(struct output * o, struct spec * spec, const wchar_t * ws) {
+	if (!ws) ws = L"(null)";
+	int len = 0;
+	while (ws[len] && (spec->precision < 0 || len < spec->precision)) len++;
+
+	int pad = spec->width - len;
+	if (!spec->left) out_pad(o, ' ', pad);
+	for (int i = 0; i < len; ++i) {
+		out_char(o, (char)ws[i]);
+	}
+	if (spec->left) out_pad(o, ' ', pad);
+}
+
+static void format(struct output * o, const char * fmt, va_list args) {
+	const char * f = fmt;
+	while (*f) {
 		if (*f != '%') {
-			*b++ = *f;
+			/* Copy the whole run of literal text at once */
+			const char * run = f;
+			while (*f && *f != '%') f++;
+			out_write(o, run, f - run);
 			continue;
 		}
 		++f;
-		unsigned int arg_width = 0;
-		int align = 1; /* right */
-		int fill_zero = 0;
-		int big = 0;
-		int alt = 0;
-		int always_sign = 0;
+
+		struct spec spec = {0};
+		spec.precision = -1;
+
 		while (1) {
-			if (*f == '-') {
-				align = 0;
-				++f;
-			} else if (*f == '#') {
-				alt = 1;
-				++f;
-			} else if (*f == '*') {
-				arg_width = (char)va_arg(args, int);
-				++f;
-			} else if (*f == '0') {
-				fill_zero = 1;
-				++f;
-			} else if (*f == '+') {
-				always_sign = 1;
-				++f;
-			} else {
-				break;
-			}
+			if (*f == '-') spec.left = 1;
+			else if (*f == '+') spec.plus = 1;
+			else if (*f == ' ') spec.space = 1;
+			else if (*f == '#') spec.alt = 1;
+			else if (*f == '0') spec.zero = 1;
+			else break;
+			++f;
 		}
-		while (*f >= '0' && *f <= '9') {
-			arg_width *= 10;
-			arg_width += *f - '0';
+
+		if (*f == '*') {
+			spec.width = va_arg(args, int);
+			if (spec.width < 0) {
+				spec.left = 1;
+				spec.width = -spec.width;
+			}
 			++f;
+		} else {
+			while (*f >= '0' && *f <= '9') {
+				spec.width = spec.width * 10 + (*f - '0');
+				++f;
+			}
 		}
+
 		if (*f == '.') {
 			++f;
-			precision = 0;
+			spec.precision = 0;
 			if (*f == '*') {
-				precision = (int)va_arg(args, int);
+				spec.precision = va_arg(args, int);
+				if (spec.precision < 0) spec.precision = -1;
 				++f;
-			} else  {
+			} else {
 				while (*f >= '0' && *f <= '9') {
-					precision *= 10;
-					precision += *f - '0';
+					spec.precision = spec.precision * 10 + (*f - '0');
 					++f;
 				}
 			}
 		}
-		if (*f == 'l') {
-			big = 1;
-			++f;
-			if (*f == 'l') {
-				big = 2;
-				++f;
-			}
-		}
-		if (*f == 'z') {
-			big = 1;
-			++f;
-		}
-		/* fmt[i] == '%' */
+		if (spec.left) spec.zero = 0;
+
 		switch (*f) {
-			case 's': /* String pointer -> String */
-				{
-					size_t count = 0;
-					if (big) {
-						wchar_t * ws = (wchar_t *)va_arg(args, wchar_t *);
-						if (ws == NULL) {
-							ws = L"(null)";
-						}
-						size_t count = 0;
-						while (*ws) {
-							*b++ = *ws++;
-							count++;
-							if (arg_width && count == arg_width) break;
-						}
-					} else {
-						s = (char *)va_arg(args, char *);
-						if (s == NULL) {
-							s = "(null)";
-						}
-						if (precision >= 0) {
-							while (*s && precision > 0) {
-								*b++ = *s++;
-								count++;
-								precision--;
-								if (arg_width && count == arg_width) break;
-							}
-						} else {
-							while (*s) {
-								*b++ = *s++;
-								count++;
-								if (arg_width && count == arg_width) break;
-							}
-						}
-					}
-					while (count < arg_width) {
-						*b++ = ' ';
-						count++;
-					}
+			case 'h':
+				spec.length = LEN_H;
+				if (*++f == 'h') {
+					spec.length = LEN_HH;
+					++f;
 				}
 				break;
-			case 'c': /* Single character */
-				*b++ = (char)va_arg(args, int);
-				break;
-			case 'p':
-				if (!arg_width) {
-					arg_width = 8;
-				}
-			case 'x': /* Hexadecimal number */
-				if (alt) {
-					*b++ = '0';
-					*b++ = 'x';
-				}
-				i = b - buf;
-				if (big == 2) {
-					unsigned long long val = (unsigned long long)va_arg(args, unsigned long long);
-					if (val > 0xFFFFFFFF) {
-						print_hex(val >> 32, arg_width > 8 ? (arg_width - 8) : 0, buf, &i);
-					}
-					print_hex(val & 0xFFFFFFFF, arg_width > 8 ? 8 : arg_width, buf, &i);
-				} else {
-					print_hex((unsigned long)va_arg(args, unsigned long), arg_width, buf, &i);
+			case 'l':
+				spec.length = LEN_L;
+				if (*++f == 'l') {
+					spec.length = LEN_LL;
+					++f;
 				}
-				b = buf + i;
 				break;
+			case 'q': spec.length = LEN_LL; ++f; break;
+			case 'z': spec.length = LEN_Z;  ++f; break;
+			case 'j': spec.length = LEN_J;  ++f; break;
+			case 't': spec.length = LEN_T;  ++f; break;
+			case 'L': spec.length = LEN_LD; ++f; break;
+		}
+
+		char conv = *f;
+		switch (conv) {
+			case 'd':
 			case 'i':
-			case 'd': /* Decimal number */
-				i = b - buf;
 				{
-					long long val;
-					if (big == 2) {
-						val = (long long)va_arg(args, long long);
-					} else {
-						val = (long)va_arg(args, long);
-					}
-					if (val < 0) {
-						*b++ = '-';
-						buf++;
-						val = -val;
-					} else if (always_sign) {
-						*b++ = '+';
-						buf++;
+					int64_t val;
+					switch (spec.length) {
+						case LEN_LL: case LEN_J: val = va_arg(args, long long); break;
+						case LEN_L: val = va_arg(args, long); break;
+						case LEN_Z: case LEN_T: val = va_arg(args, ssize_t); break;
+						case LEN_HH: val = (signed char)va_arg(args, int); break;
+						case LEN_H: val = (short)va_arg(args, int); break;
+						default: val = va_arg(args, int); break;
 					}
-					print_dec(val, arg_width, buf, &i, fill_zero, align);
+					uint64_t mag = val < 0 ? -(uint64_t)val : (uint64_t)val;
+					format_integer(o, &spec, mag, val < 0, conv);
 				}
-				b = buf + i;
 				break;
-			case 'u': /* Unsigned ecimal number */
-				i = b - buf;
+			case 'u':
+			case 'x':
+			case 'X':
+			case 'o':
 				{
-					unsigned long long val;
-					if (big == 2) {
-						val = (unsigned long long)va_arg(args, unsigned long long);
-					} else {
-						val = (unsigned long)va_arg(args, unsigned long);
+					uint64_t val;
+					switch (spec.length) {
+						case LEN_LL: case LEN_J: val = va_arg(args, unsigned long long); break;
+						case LEN_L: val = va_arg(args, unsigned long); break;
+						case LEN_Z: case LEN_T: val = va_arg(args, size_t); break;
+						case LEN_HH: val = (unsigned char)va_arg(args, unsigned int); break;
+						case LEN_H: val = (unsigned short)va_arg(args, unsigned int); break;
+						default: val = va_arg(args, unsigned int); break;
 					}
-					print_dec(val, arg_width, buf, &i, fill_zero, align);
+					format_integer(o, &spec, val, 0, conv);
 				}
-				b = buf + i;
 				break;
-			case 'g': /* supposed to also support e */
+			case 'p':
+				format_integer(o, &spec, (uintptr_t)va_arg(args, void *), 0, 'p');
+				break;
 			case 'f':
+			case 'F':
+			case 'e':
+			case 'E':
+			case 'g':
+			case 'G':
+				if (spec.length == LEN_LD) {
+					format_double(o, &spec, (double)va_arg(args, long double), conv);
+				} else {
+					format_double(o, &spec, va_arg(args, double), conv);
+				}
+				break;
+			case 's':
+				if (spec.length == LEN_L) {
+					format_wide_string(o, &spec, va_arg(args, wchar_t *));
+				} else {
+					format_string(o, &spec, va_arg(args, char *));
+				}
+				break;
+			case 'c':
 				{
-					double val = (double)va_arg(args, double);
-					i = b - buf;
-					if (val < 0) {
-						*b++ = '-';
-						buf++;
-						val = -val;
-					}
-					print_dec((long)val, arg_width, buf, &i, fill_zero, align);
-					b = buf + i;
-					i = b - buf;
-					*b++ = '.';
-					buf++;
-					for (int j = 0; j < ((precision > -1 && precision < 8) ? precision : 8); ++j) {
-						if ((int)(val * 100000.0) % 100000 == 0 && j != 0) break;
-						val *= 10.0;
-						print_dec((int)(val) % 10, 0, buf, &i, 0, 0);
+					char c = (char)va_arg(args, int);
+					struct spec sp = spec;
+					sp.zero = 0;
+					out_field(o, &sp, NULL, 0, 0, &c, 1);
+				}
+				break;
+			case 'n':
+				{
+					void * p = va_arg(args, void *);
+					switch (spec.length) {
+						case LEN_HH: *(signed char *)p = o->total; break;
+						case LEN_H: *(short *)p = o->total; break;
+						case LEN_LL: case LEN_J: *(long long *)p = o->total; break;
+						default: *(int *)p = o->total; break;
 					}
-					b = buf + i;
 				}
 				break;
-			case '%': /* Escape */
-				*b++ = '%';
+			case '%':
+				out_char(o, '%');
 				break;
+			case '\0':
+				/* Format ends in the middle of a conversion */
+				return;
 			default: /* Nothing at all, just dump it */
-				*b++ = *f;
+				out_char(o, conv);
 				break;
 		}
+		++f;
 	}
-	/* Ensure the buffer ends in a null */
-	*b = '\0';
-	return b - buf;
+}
+
+/*
+ * vasprintf()
+ */
+int xvasprintf(char * buf, const char * fmt, va_list args) {
+	struct output o = { OUT_BOUNDED, buf, SIZE_MAX / 2, 0, 0, NULL, 0 };
+	format(&o, fmt, args);
+	buf[o.used] = '\0';
+	return o.total;
 }
 
 int vasprintf(char ** buf, const char * fmt, va_list args) {
-	char * b = malloc(1024);
-	*buf = b;
-	return xvasprintf(b, fmt, args);
+	struct output o = { OUT_GROW, NULL, 0, 0, 0, NULL, 0 };
+	format(&o, fmt, args);
+	if (!o.buf && !o.error) out_drain(&o);
+	if (o.error) {
+		free(o.buf);
+		*buf = NULL;
+		return -1;
+	}
+	o.buf[o.used] = '\0';
+	*buf = o.buf;
+	return o.total;
+}
+
+int asprintf(char ** buf, const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int out = vasprintf(buf, fmt, args);
+	va_end(args);
+	return out;
 }
 
 int vsprintf(char * buf, const char *fmt, va_list args) {
@@ -312,17 +699,18 @@ int vsprintf(char * buf, const char *fmt, va_list args) {
 }
 
 int vsnprintf(char * buf, size_t size, const char *fmt, va_list args) {
-	/* XXX */
-	return xvasprintf(buf, fmt, args);
+	struct output o = { OUT_BOUNDED, buf, size ? size - 1 : 0, 0, 0, NULL, 0 };
+	format(&o, fmt, args);
+	if (size) buf[o.used] = '\0';
+	return o.total;
 }
 
 int vfprintf(FILE * device, const char *fmt, va_list args) {
-	char * buffer;
-	vasprintf(&buffer, fmt, args);
-
-	int out = fwrite(buffer, 1, strlen(buffer), device);
-	free(buffer);
-	return out;
+	char stack[OUT_STACK_SIZE];
+	struct output o = { OUT_FILE, stack, sizeof(stack), 0, 0, device, 0 };
+	format(&o, fmt, args);
+	out_drain(&o);
+	return o.error ? -1 : (int)o.total;
 }
 
 int vprintf(const char *fmt, va_list args) {
@@ -332,23 +720,16 @@ int vprintf(const char *fmt, va_list args) {
 int fprintf(FILE * device, const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	char * buffer;
-	vasprintf(&buffer, fmt, args);
+	int out = vfprintf(device, fmt, args);
 	va_end(args);
-
-	int out = fwrite(buffer, 1, strlen(buffer), device);
-	free(buffer);
 	return out;
 }
 
 int printf(const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	char * buffer;
-	vasprintf(&buffer, fmt, args);
+	int out = vfprintf(stdout, fmt, args);
 	va_end(args);
-	int out = fwrite(buffer, 1, strlen(buffer), stdout);
-	free(buffer);
 	return out;
 }
 
@@ -361,13 +742,9 @@ int sprintf(char * buf, const char *fmt, ...) {
 }
 
 int snprintf(char * buf, size_t size, const char * fmt, ...) {
-	/* XXX This is bad. */
-	(void)size;
 	va_list args;
 	va_start(args, fmt);
-	int out = xvasprintf(buf, fmt, args);
+	int out = vsnprintf(buf, size, fmt, args);
 	va_end(args);
 	return out;
 }
-
-
@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #include <_xlog.h>
 
@@ -18,8 +20,16 @@ struct _FILE {
 	int ungetc;
 	int eof;
 	int bufsiz;
-	long last_read_start;
 	char * _name;
+
+	char * write_buf;
+	int write_size;
+	int written;
+	int buf_mode;  /* _IONBF, _IOLBF, _IOFBF, or -1 until the first write */
+	int user_buf;  /* write_buf came from setvbuf() and is not ours to free */
+
+	struct _FILE * prev;
+	struct _FILE * next;
 };
 
 FILE _stdin = {
@@ -30,8 +40,8 @@ FILE _stdin = {
 	.read_from = 0,
 	.ungetc = -1,
 	.eof = 0,
-	.last_read_start = 0,
 	.bufsiz = BUFSIZ,
+	.buf_mode = -1,
 };
 
 FILE _stdout = {
@@ -42,8 +52,8 @@ FILE _stdout = {
 	.read_from = 0,
 	.ungetc = -1,
 	.eof = 0,
-	.last_read_start = 0,
 	.bufsiz = BUFSIZ,
+	.buf_mode = -1,
 };
 
 FILE _stderr = {
@@ -54,14 +64,21 @@ FILE _stderr = {
 	.read_from = 0,
 	.ungetc = -1,
 	.eof = 0,
-	.last_read_start = 0,
 	.bufsiz = BUFSIZ,
+	.buf_mode = _IONBF,
 };
 
 FILE * stdin = &_stdin;
 FILE * stdout = &_stdout;
 FILE * stderr = &_stderr;
 
+/* Streams from fopen() and fdopen(), for fflush(NULL) */
+static FILE * open_streams = NULL;
+
+static void __stdio_flush_all(void) {
+	fflush(NULL);
+}
+
 void __stdio_init_buffers(void) {
 	_stdin.read_buf = malloc(BUFSIZ);
 	//_stdout.read_buf = malloc(BUFSIZ);
@@ -69,6 +86,62 @@ void __stdio_init_buffers(void) {
 	_stdin._name = strdup("stdin");
 	_stdout._name = strdup("stdout");
 	_stderr._name = strdup("stderr");
+	atexit(__stdio_flush_all);
+}
+
+static void stream_link(FILE * stream) {
+	stream->prev = NULL;
+	stream->next = open_streams;
+	if (open_streams) open_streams->prev = stream;
+	open_streams = stream;
+}
+
+static void stream_unlink(FILE * stream) {
+	if (stream->prev) stream->prev->next = stream->next;
+	else if (open_streams == stream) open_streams = stream->next;
+	if (stream->next) stream->next->prev = stream->prev;
+	stream->prev = NULL;
+	stream->next = NULL;
+}
+
+/*
+ * Pick a buffering mode on first write: line buffered for terminals,
+ * fully buffered for files and pipes, and unbuffered for anything
+ * else, as device nodes often care about write boundaries.
+ */
+static void stream_pick_mode(FILE * stream) {
+	if (stream->buf_mode >= 0) return;
+
+	int saved_errno = errno;
+	struct stat st;
+	if (isatty(stream->fd)) {
+		stream->buf_mode = _IOLBF;
+	} else if (!fstat(stream->fd, &st) && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode))) {
+		stream->buf_mode = _IOFBF;
+	} else {
+		stream->buf_mode = _IONBF;
+	}
+	errno = saved_errno;
+}
+
+static int write_all(int fd, const char * buf, size_t len) {
+	while (len) {
+		int r = syscall_write(fd, (void*)buf, len);
+		if (r < 0) {
+			errno = -r;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int flush_write_buffer(FILE * stream) {
+	if (!stream->written) return 0;
+	int r = write_all(stream->fd, stream->write_buf, stream->written);
+	stream->written = 0;
+	return r;
 }
 
 #if 0
@@ -82,74 +155,84 @@ static char * stream_id(FILE * stream) {
 }
 #endif
 
-extern int __libc_debug;
-extern char * _argv_0;
-
 int setvbuf(FILE * stream, char * buf, int mode, size_t size) {
-	if (mode != _IOLBF) {
-		return -1; /* Unsupported */
+	if (mode != _IONBF && mode != _IOLBF && mode != _IOFBF) {
+		return -1;
 	}
-	if (buf) {
-		if (stream->read_buf) {
-			free(stream->read_buf);
+	flush_write_buffer(stream);
+	if (buf && size) {
+		if (stream->write_buf && !stream->user_buf) {
+			free(stream->write_buf);
 		}
-		stream->read_buf = buf;
-		stream->bufsiz = size;
+		stream->write_buf = buf;
+		stream->write_size = size;
+		stream->user_buf = 1;
 	}
+	stream->buf_mode = mode;
 	return 0;
 }
 
+/*
+ * Refill the read buffer. Returns the read() result.
+ */
+static ssize_t fill_read_buffer(FILE * f) {
+	/* Anything we wrote should be out before we wait on a reply */
+	flush_write_buffer(f);
+	if (f == &_stdin && _stdout.buf_mode == _IOLBF) {
+		flush_write_buffer(&_stdout);
+	}
+	ssize_t r = read(fileno(f), f->read_buf, f->bufsiz);
+	f->read_from = 0;
+	f->available = r > 0 ? r : 0;
+	f->offset = f->available;
+	if (r == 0) {
+		f->eof = 1;
+	}
+	return r;
+}
+
 static size_t read_bytes(FILE * f, char * out, size_t len) {
 	size_t r_out = 0;
 
-	//fprintf(stderr, "%s: Read %d bytes from %s\n", _argv_0, len, stream_id(f));
-	//fprintf(stderr, "%s: off[%d] avail[%d] read[%d]\n", _argv_0, f->offset, f->available, f->read_from);
+	if (len && f->ungetc >= 0) {
+		*out++ = f->ungetc;
+		f->ungetc = -1;
+		len--;
+		r_out++;
+	}
 
 	while (len > 0) {
-		if (f->ungetc >= 0) {
-			*out = f->ungetc;
-			len--;
-			out++;
-			r_out++;
-			f->ungetc = -1;
+		if (f->available) {
+			size_t chunk = (size_t)f->available < len ? (size_t)f->available : len;
+			memcpy(out, &f->read_buf[f->read_from], chunk);
+			f->read_from += chunk;
+			f->available -= chunk;
+			out += chunk;
+			len -= chunk;
+			r_out += chunk;
 			continue;
 		}
 
-		if (f->available == 0) {
-			if (f->offset == f->bufsiz) {
-				f->offset = 0;
-			}
-			f->last_read_start = syscall_lseek(f->fd, 0, SEEK_CUR);
-			ssize_t r = read(fileno(f), &f->read_buf[f->offset], f->bufsiz - f->offset);
-			if (r < 0) {
-				//fprintf(stderr, "error condition\n");
+		if (len >= (size_t)f->bufsiz) {
+			/* Big enough that buffering would only add a copy */
+			flush_write_buffer(f);
+			ssize_t r = read(fileno(f), out, len);
+			if (r < 0) return r_out;
+			if (r == 0) {
+				f->eof = 1;
 				return r_out;
-			} else {
-				f->read_from = f->offset;
-				f->available = r;
-				f->offset += f->available;
 			}
+			out += r;
+			len -= r;
+			r_out += r;
+			continue;
 		}
 
-		if (f->available == 0) {
-			/* EOF condition */
-			//fprintf(stderr, "%s: no bytes available, returning read value of %d\n", _argv_0, r_out);
-			f->eof = 1;
+		if (fill_read_buffer(f) <= 0) {
 			return r_out;
 		}
-
-		//fprintf(stderr, "%s: reading until %d reaches %d or %d reaches 0\n", _argv_0, f->read_from, f->offset, len);
-		while (f->read_from < f->offset && len > 0 && f->available > 0) {
-			*out = f->read_buf[f->read_from];
-			len--;
-			f->read_from++;
-			f->available--;
-			out++;
-			r_out += 1;
-		}
 	}
 
-	//fprintf(stderr, "%s: read completed, returning read value of %d\n", _argv_0, r_out);
 	return r_out;
 }
 
@@ -205,6 +288,8 @@ FILE * fopen(const char *path, const char *mode) {
 	out->ungetc = -1;
 	out->eof = 0;
 	out->_name = strdup(path);
+	out->buf_mode = -1;
+	stream_link(out);
 
 	return out;
 }
@@ -226,6 +311,8 @@ FILE * freopen(const char *path, const char *mode, FILE * stream) {
 		stream->ungetc = -1;
 		stream->eof = 0;
 		stream->_name = strdup(path);
+		stream->written = 0;
+		stream->buf_mode = (stream == &_stderr) ? _IONBF : -1;
 		if (fd < 0) {
 			errno = -fd;
 			return NULL;
@@ -256,6 +343,8 @@ FILE * fdopen(int fd, const char *mode){
 	char tmp[30];
 	sprintf(tmp, "fd[%d]", fd);
 	out->_name = strdup(tmp);
+	out->buf_mode = -1;
+	stream_link(out);
 
 	return out;
 }
@@ -265,35 +354,36 @@ int _fwouldblock(FILE * stream) {
 }
 
 int fclose(FILE * stream) {
+	flush_write_buffer(stream);
 	int out = syscall_close(stream->fd);
 	free(stream->_name);
 	free(stream->read_buf);
+	if (!stream->user_buf) {
+		free(stream->write_buf);
+	}
+	stream->write_buf = NULL;
+	stream->write_size = 0;
+	stream->user_buf = 0;
 	if (stream == &_stdin || stream == &_stdout || stream == &_stderr) {
 		return out;
 	} else {
+		stream_unlink(stream);
 		free(stream);
 		return out;
 	}
 }
 
-static char * _whence_str(int whence) {
-	if (whence == SEEK_SET) return "SEEK_SET";
-	if (whence == SEEK_CUR) return "SEEK_CUR";
-	if (whence == SEEK_END) return "SEEK_END";
-	return "?";
+/*
+ * Bytes we have taken from the kernel but not handed out yet.
+ */
+static long read_ahead(FILE * stream) {
+	return stream->available + (stream->ungetc >= 0 ? 1 : 0);
 }
 
 int fseek(FILE * stream, long offset, int whence) {
-	if (_argv_0 && strcmp(_argv_0, "ld.so")) {
-		if (stream->read_from && whence == SEEK_CUR) {
-			if (__libc_debug) {
-				fprintf(stderr, "%s: fseek(%s, %ld, %s)\n", _argv_0, stream->_name, offset, _whence_str(whence));
-				fprintf(stderr, "\033[33;3mWARNING\033[0m: seeking when offset is currently %d\n", stream->read_from);
-				fprintf(stderr, "\033[33;3mWARNING\033[0m: this may not be reflected in kernel\n");
-			}
-			offset = offset + stream->read_from + stream->last_read_start;
-			whence = SEEK_SET;
-		}
+	flush_write_buffer(stream);
+	if (whence == SEEK_CUR) {
+		offset -= read_ahead(stream);
 	}
 	stream->offset = 0;
 	stream->read_from = 0;
@@ -310,23 +400,13 @@ int fseek(FILE * stream, long offset, int whence) {
 }
 
 long ftell(FILE * stream) {
-	if (_argv_0 && strcmp(_argv_0, "ld.so") && __libc_debug) {
-		fprintf(stderr, "%s: ftell(%s)\n", _argv_0, stream->_name);
-	}
-	if (stream->read_from || stream->last_read_start) {
-		return stream->last_read_start + stream->read_from;
-	}
-	stream->offset = 0;
-	stream->read_from = 0;
-	stream->available = 0;
-	stream->ungetc = -1;
-	stream->eof = 0;
+	flush_write_buffer(stream);
 	long resp = syscall_lseek(stream->fd, 0, SEEK_CUR);
 	if (resp < 0) {
 		errno = -resp;
 		return -1;
 	}
-	return resp;
+	return resp - read_ahead(stream);
 }
 
 int fgetpos(FILE *stream, fpos_t *pos) {
@@ -342,18 +422,8 @@ int fsetpos(FILE *stream, const fpos_t *pos) {
 }
 
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE * stream) {
-	char * tracking = (char*)ptr;
-	for (size_t i = 0; i < nmemb; ++i) {
-		int r = read_bytes(stream, tracking, size);
-		if (r < 0) {
-			return -1;
-		}
-		tracking += r;
-		if (r < (int)size) {
-			return i;
-		}
-	}
-	return nmemb;
+	if (!size || !nmemb) return 0;
+	return read_bytes(stream, ptr, size * nmemb) / size;
 }
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE * stream) {
@@ -361,13 +431,41 @@ size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE * stream) {
 
 	if (!out_size) return 0;
 
-	int r = syscall_write(stream->fd, (void*)ptr, out_size);
-	if (r < 0) {
-		errno = -r;
-		return -1;
+	stream_pick_mode(stream);
+
+	if (stream->buf_mode == _IONBF) {
+		if (flush_write_buffer(stream) < 0) return -1;
+		int r = syscall_write(stream->fd, (void*)ptr, out_size);
+		if (r < 0) {
+			errno = -r;
+			return -1;
+		}
+		return r / size;
+	}
+
+	if (!stream->write_buf) {
+		stream->write_buf = malloc(BUFSIZ);
+		stream->write_size = BUFSIZ;
+	}
+
+	if (stream->written + out_size > (size_t)stream->write_size) {
+		if (flush_write_buffer(stream) < 0) return -1;
+	}
+
+	if (out_size >= (size_t)stream->write_size) {
+		/* Too big to be worth copying */
+		if (write_all(stream->fd, ptr, out_size) < 0) return -1;
+		return nmemb;
+	}
+
+	memcpy(stream->write_buf + stream->written, ptr, out_size);
+	stream->written += out_size;
+
+	if (stream->buf_mode == _IOLBF && memchr(ptr, '\n', out_size)) {
+		if (flush_write_buffer(stream) < 0) return -1;
 	}
 
-	return r / size;
+	return nmemb;
 }
 
 int fileno(FILE * stream) {
@@ -375,7 +473,16 @@ int fileno(FILE * stream) {
 }
 
 int fflush(FILE * stream) {
-	return 0;
+	if (!stream) {
+		int out = 0;
+		if (flush_write_buffer(&_stdout) < 0) out = EOF;
+		if (flush_write_buffer(&_stderr) < 0) out = EOF;
+		for (FILE * f = open_streams; f; f = f->next) {
+			if (flush_write_buffer(f) < 0) out = EOF;
+		}
+		return out;
+	}
+	return flush_write_buffer(stream) < 0 ? EOF : 0;
 }
 
 int fputs(const char *s, FILE *stream) {
@@ -385,21 +492,24 @@ int fputs(const char *s, FILE *stream) {
 }
 
 int fputc(int c, FILE *stream) {
+	if (stream->write_buf && stream->buf_mode != _IONBF && stream->written < stream->write_size && c != '\n') {
+		stream->write_buf[stream->written++] = c;
+		return (unsigned char)c;
+	}
 	char data[] = {c};
-	fwrite(data, 1, 1, stream);
-	return c;
+	if (fwrite(data, 1, 1, stream) != 1) return EOF;
+	return (unsigned char)c;
 }
 
 int putc(int c, FILE *stream) __attribute__((weak, alias("fputc")));
 
 int fgetc(FILE * stream) {
+	if (stream->available && stream->ungetc < 0) {
+		stream->available--;
+		return (unsigned char)stream->read_buf[stream->read_from++];
+	}
 	char buf[1];
-	int r;
-	r = fread(buf, 1, 1, stream);
-	if (r < 0) {
-		stream->eof = 1;
-		return EOF;
-	} else if (r == 0) {
+	if (read_bytes(stream, buf, 1) != 1) {
 		stream->eof = 1;
 		return EOF;
 	}
@@ -413,28 +523,38 @@ int getchar(void) {
 }
 
 char *fgets(char *s, int size, FILE *stream) {
-	int c;
+	if (size <= 0) return NULL;
+
 	char * out = s;
-	while ((c = fgetc(stream)) > 0) {
-		*s++ = c;
-		size--;
-		if (size == 0) {
-			return out;
-		}
-		*s = '\0';
-		if (c == '\n') {
-			return out;
+	int left = size - 1;
+
+	while (left > 0) {
+		if (stream->available && stream->ungetc < 0) {
+			/* Take as much of the line as the buffer holds at once */
+			int chunk = stream->available < left ? stream->available : left;
+			char * start = &stream->read_buf[stream->read_from];
+			char * newline = memchr(start, '\n', chunk);
+			if (newline) chunk = newline - start + 1;
+			memcpy(s, start, chunk);
+			s += chunk;
+			left -= chunk;
+			stream->read_from += chunk;
+			stream->available -= chunk;
+			if (newline) break;
+			continue;
 		}
+		int c = fgetc(stream);
+		if (c == EOF) break;
+		*s++ = c;
+		left--;
+		if (c == '\n') break;
 	}
-	if (c == EOF) {
-		stream->eof = 1;
-		if (out == s) {
-			return NULL;
-		} else {
-			return out;
-		}
+
+	if (s == out && size > 1) {
+		return NULL;
 	}
-	return NULL;
+	*s = '\0';
+	return out;
 }
 
 int putchar(int c) {
@@ -446,7 +566,7 @@ void rewind(FILE *stream) {
 }
 
 void setbuf(FILE * stream, char * buf) {
-	// ...
+	setvbuf(stream, buf, buf ? _IOFBF : _IONBF, BUFSIZ);
 }
 
 int feof(FILE * stream) {
@@ -1,5 +1,3 @@
-/* Really bad atof */
-
 #include <stdlib.h>
 
 double atof(const char * nptr) {
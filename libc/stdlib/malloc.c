@@ -96,7 +96,6 @@
  * """""""""""""""""
  *
  * TODO: Try to be more consistent on comment widths...
- * FIXME: Make thread safe! Not necessary for competition, but would be nice.
  * FIXME: Splitting/coalescing is broken. Fix this ASAP!
  *
 **/
@@ -107,10 +106,15 @@
 #include <stdint.h>
 #include <limits.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/tls.h>
+#include <sys/mman.h>
 /* }}} */
 /* Definitions {{{ */
 
 #define sbrk syscall_sbrk
+/* The system call gives back -errno when it can't grow the heap */
+#define SBRK_FAILED(p) ((uintptr_t)(p) > (uintptr_t)-4096)
 
 /*
  * Defines for often-used integral values
@@ -127,6 +131,12 @@
 #define SKIP_MAX_LEVEL 6							/* We have a maximum of 6 levels in our skip lists. */
 
 #define BIN_MAGIC 0xDEFAD00D
+#define MMAP_MAGIC 0xDEFAB16B						/* Header magic for blocks mapped directly from the kernel. */
+
+#define MMAP_THRESHOLD 0x20000						/* Allocations this large get their own mapping. */
+#define THREAD_CACHES 64							/* Threads that can have a small-object cache at once. */
+#define CACHE_LIMIT 64								/* Cells a thread may hold per bin before draining. */
+#define CACHE_BATCH 16								/* Cells moved per refill or drain. */
 
 /* }}} */
 
@@ -134,8 +144,6 @@
  * Internal functions.
  */
 static void * __attribute__ ((malloc)) klmalloc(uintptr_t size);
-static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
 
@@ -171,41 +179,6 @@ static void spin_unlock(int volatile * lock) {
 }
 
 
-void * __attribute__ ((malloc)) malloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klmalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klrealloc(ptr, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klcalloc(nmemb, size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void * __attribute__ ((malloc)) valloc(uintptr_t size) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	void * ret = klvalloc(size);
-	spin_unlock(&mem_lock);
-	return ret;
-}
-
-void free(void * ptr) {
-	spin_lock(&mem_lock, __FUNCTION__);
-	klfree(ptr);
-	spin_unlock(&mem_lock);
-}
-
-
 /* Bin management {{{ */
 
 /*
@@ -623,6 +596,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 * Grow the heap for the new bin.
 			 */
 			bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
+			if (SBRK_FAILED(bin_header)) return NULL;
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 
@@ -728,6 +702,7 @@ static void * __attribute__ ((malloc)) klmalloc(uintptr_t size) {
 			 */
 			uintptr_t pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
 			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
+			if (SBRK_FAILED(bin_header)) return NULL;
 			bin_header->bin_magic = BIN_MAGIC;
 			assert((uintptr_t)bin_header % PAGE_SIZE == 0);
 			/*
@@ -906,100 +881,255 @@ static void * __attribute__ ((malloc)) klvalloc(uintptr_t size) {
 	return out;
 }
 /* }}} */
-/* realloc() {{{ */
-static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
+/* Thread caches {{{ */
+
+/*
+ * Once a process has started threads, each thread keeps a short
+ * stack of free cells per small bin, so most malloc()/free() pairs
+ * never touch the global lock. A thread finds its cache through its
+ * control block (threads without one share the global bins), and
+ * only goes to the shared bins to refill or drain a batch at a time.
+ */
+typedef struct {
+	void * head;		/* Free cells, linked through their first word. */
+	uintptr_t count;
+} klmalloc_cache_bin;
+
+typedef struct {
+	int volatile tid;	/* Owning thread, or 0 when free. */
+	klmalloc_cache_bin bins[BIG_BIN];
+} klmalloc_thread_cache;
+
+static klmalloc_thread_cache klmalloc_caches[THREAD_CACHES];
+
+extern int __libc_threaded;
+
+static klmalloc_thread_cache * klmalloc_cache_find(int claim) {
+	tls_tcb_t * tcb = __tls_tcb();
+	if (!tcb) return NULL;
+	if (tcb->malloc_cache || !claim) return tcb->malloc_cache;
+
+	/* First time for this thread; the system call only happens here */
+	int tid = gettid();
+	for (unsigned int i = 0; i < THREAD_CACHES; ++i) {
+		if (!klmalloc_caches[i].tid && __sync_bool_compare_and_swap(&klmalloc_caches[i].tid, 0, tid)) {
+			tcb->malloc_cache = &klmalloc_caches[i];
+			return tcb->malloc_cache;
+		}
+	}
+	return NULL; /* Everyone shares the global bins. */
+}
+
+/*
+ * Give `count` cells from a cache bin back to the shared bins.
+ * The caller holds mem_lock.
+ */
+static void klmalloc_cache_drain(klmalloc_cache_bin * bin, uintptr_t count) {
+	while (count-- && bin->head) {
+		void * cell = bin->head;
+		bin->head = *(void **)cell;
+		bin->count--;
+		klfree(cell);
+	}
+}
+
+static void * klmalloc_cache_alloc(klmalloc_thread_cache * cache, unsigned int bucket_id) {
+	klmalloc_cache_bin * bin = &cache->bins[bucket_id];
+	if (!bin->head) {
+		uintptr_t size = 1UL << (SMALLEST_BIN_LOG + bucket_id);
+		spin_lock(&mem_lock, __FUNCTION__);
+		for (unsigned int i = 0; i < CACHE_BATCH; ++i) {
+			void * cell = klmalloc(size);
+			if (!cell) break;
+			*(void **)cell = bin->head;
+			bin->head = cell;
+			bin->count++;
+		}
+		spin_unlock(&mem_lock);
+		if (!bin->head) return NULL;
+	}
+	void * cell = bin->head;
+	bin->head = *(void **)cell;
+	bin->count--;
+	return cell;
+}
+
+static void klmalloc_cache_free(klmalloc_thread_cache * cache, unsigned int bucket_id, void * ptr) {
+	klmalloc_cache_bin * bin = &cache->bins[bucket_id];
+	*(void **)ptr = bin->head;
+	bin->head = ptr;
+	bin->count++;
+	if (bin->count > CACHE_LIMIT) {
+		spin_lock(&mem_lock, __FUNCTION__);
+		klmalloc_cache_drain(bin, CACHE_BATCH * 2);
+		spin_unlock(&mem_lock);
+	}
+}
+
+/*
+ * Called as a thread exits: return its cells and free its cache slot.
+ */
+void __malloc_thread_exit(void) {
+	klmalloc_thread_cache * cache = klmalloc_cache_find(0);
+	if (!cache) return;
+	spin_lock(&mem_lock, __FUNCTION__);
+	for (unsigned int i = 0; i < BIG_BIN; ++i) {
+		klmalloc_cache_drain(&cache->bins[i], cache->bins[i].count);
+	}
+	spin_unlock(&mem_lock);
+	__tls_tcb()->malloc_cache = NULL;
+	__sync_lock_release(&cache->tid);
+}
+
+/* }}} Thread caches */
+/* Direct mappings {{{ */
+
+/*
+ * Large allocations are mapped on their own and unmapped as soon as
+ * they are freed, so their memory goes straight back to the kernel.
+ * The header matches the start of a bin header so that a pointer can
+ * be classified by looking at the page it starts in.
+ */
+static void * klmalloc_map(uintptr_t size) {
+	uintptr_t length = (size + sizeof(klmalloc_bin_header) + PAGE_MASK) & ~PAGE_MASK;
+	klmalloc_bin_header * header = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (header == MAP_FAILED) {
+		return NULL;
+	}
+	header->next = NULL;
+	header->head = NULL;
+	header->size = length;
+	header->bin_magic = MMAP_MAGIC;
+	return (void *)((uintptr_t)header + sizeof(klmalloc_bin_header));
+}
+
+/* }}} Direct mappings */
+/* Public interface {{{ */
+
+/*
+ * Find the header for an allocation; see klfree() for the page-aligned case.
+ */
+static klmalloc_bin_header * klmalloc_header(void * ptr) {
+	uintptr_t p = (uintptr_t)ptr;
+	if (p % PAGE_SIZE == 0) p--;
+	return (klmalloc_bin_header *)(p & ~PAGE_MASK);
+}
+
+/*
+ * How many bytes may be used at ptr.
+ */
+static uintptr_t klmalloc_usable_size(void * ptr) {
+	klmalloc_bin_header * header = klmalloc_header(ptr);
+	if (header->bin_magic == MMAP_MAGIC) {
+		return (uintptr_t)header + header->size - (uintptr_t)ptr;
+	}
+	if (header->size < (uintptr_t)BIG_BIN) {
+		return 1UL << (SMALLEST_BIN_LOG + header->size);
+	}
+	return (uintptr_t)header + sizeof(klmalloc_big_bin_header) + header->size - (uintptr_t)ptr;
+}
+
+void * __attribute__ ((malloc)) malloc(uintptr_t size) {
+	if (__builtin_expect(size == 0, 0)) {
+		return NULL;
+	}
+	if (size >= MMAP_THRESHOLD) {
+		return klmalloc_map(size);
+	}
+	if (__libc_threaded) {
+		unsigned int bucket_id = klmalloc_bin_size(size);
+		if (bucket_id < BIG_BIN) {
+			klmalloc_thread_cache * cache = klmalloc_cache_find(1);
+			if (cache) {
+				return klmalloc_cache_alloc(cache, bucket_id);
+			}
+		}
+	}
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klmalloc(size);
+	spin_unlock(&mem_lock);
+	return ret;
+}
+
+void free(void * ptr) {
+	if (__builtin_expect(ptr == NULL, 0)) {
+		return;
+	}
+	klmalloc_bin_header * header = klmalloc_header(ptr);
+	if (header->bin_magic == MMAP_MAGIC) {
+		munmap(header, header->size);
+		return;
+	}
+	if (__libc_threaded && header->bin_magic == BIN_MAGIC && header->size < (uintptr_t)BIG_BIN) {
+		klmalloc_thread_cache * cache = klmalloc_cache_find(1);
+		if (cache) {
+			klmalloc_cache_free(cache, header->size, ptr);
+			return;
+		}
+	}
+	spin_lock(&mem_lock, __FUNCTION__);
+	klfree(ptr);
+	spin_unlock(&mem_lock);
+}
+
+void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 	/*
 	 * C standard implementation: When NULL is passed to realloc,
 	 * simply malloc the requested size and return a pointer to that.
 	 */
-	if (__builtin_expect(ptr == NULL, 0))
-		return klmalloc(size);
+	if (__builtin_expect(ptr == NULL, 0)) {
+		return malloc(size);
+	}
 
 	/*
 	 * C standard implementation: For a size of zero, free the
 	 * pointer and return NULL, allocating no new memory.
 	 */
-	if (__builtin_expect(size == 0, 0))
-	{
+	if (__builtin_expect(size == 0, 0)) {
 		free(ptr);
 		return NULL;
 	}
 
-	/*
-	 * Find the bin for the given pointer
-	 * by aligning it to a page.
-	 */
-	klmalloc_bin_header * header_old = (void *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
-	if (header_old->bin_magic != BIN_MAGIC) {
+	klmalloc_bin_header * header = klmalloc_header(ptr);
+	if (header->bin_magic != BIN_MAGIC && header->bin_magic != MMAP_MAGIC) {
 		assert(0 && "Bad magic on realloc.");
 		return NULL;
 	}
 
-	uintptr_t old_size = header_old->size;
-	if (old_size < (uintptr_t)BIG_BIN) {
-		/*
-		 * If we are copying from a small bin,
-		 * we need to get the size of the bin
-		 * from its id.
-		 */
-		old_size = (1UL << (SMALLEST_BIN_LOG + old_size));
-	}
-
 	/*
-	 * (This will only happen for a big bin, mathematically speaking)
 	 * If we still have room in our bin for the additonal space,
 	 * we don't need to do anything.
 	 */
+	uintptr_t old_size = klmalloc_usable_size(ptr);
 	if (old_size >= size) {
-
-		/*
-		 * TODO: Break apart blocks here, which is far more important
-		 *       than breaking them up on allocations.
-		 */
 		return ptr;
 	}
 
-	/*
-	 * Reallocate more memory.
-	 */
-	void * newptr = klmalloc(size);
+	void * newptr = malloc(size);
 	if (__builtin_expect(newptr != NULL, 1)) {
-
-		/*
-		 * Copy the old value into the new value.
-		 * Be sure to only copy as much as was in
-		 * the old block.
-		 */
 		memcpy(newptr, ptr, old_size);
-		klfree(ptr);
-		return newptr;
+		free(ptr);
 	}
-
-	/*
-	 * We failed to allocate more memory,
-	 * which means we're probably out.
-	 *
-	 * Bail and return NULL.
-	 */
-	return NULL;
+	return newptr;
 }
-/* }}} */
-/* calloc() {{{ */
-static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size) {
-	/*
-	 * Allocate memory and zero it before returning
-	 * a pointer to the newly allocated memory.
-	 * 
-	 * Implemented by way of a simple malloc followed
-	 * by a memset to 0x00 across the length of the
-	 * requested memory chunk.
-	 */
 
-	void *ptr = klmalloc(nmemb * size);
-	if (__builtin_expect(ptr != NULL, 1))
-		memset(ptr,0x00,nmemb * size);
+void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
+	if (size && nmemb > UINTPTR_MAX / size) {
+		return NULL;
+	}
+	void * ptr = malloc(nmemb * size);
+	if (__builtin_expect(ptr != NULL, 1) && klmalloc_header(ptr)->bin_magic != MMAP_MAGIC) {
+		/* Fresh mappings are already zeroed */
+		memset(ptr, 0x00, nmemb * size);
+	}
 	return ptr;
 }
-/* }}} */
 
+void * __attribute__ ((malloc)) valloc(uintptr_t size) {
+	spin_lock(&mem_lock, __FUNCTION__);
+	void * ret = klvalloc(size);
+	spin_unlock(&mem_lock);
+	return ret;
+}
 
+/* }}} Public interface */
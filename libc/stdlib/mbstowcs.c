@@ -1,64 +1,22 @@
 #include <stdlib.h>
 #include <wchar.h>
 #include <string.h>
-#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include <toaru/decodeutf8.h>
 
-static int to_eight(uint32_t codepoint, char * out) {
-	memset(out, 0x00, 7);
-
-	if (codepoint < 0x0080) {
-		out[0] = (char)codepoint;
-	} else if (codepoint < 0x0800) {
-		out[0] = 0xC0 | (codepoint >> 6);
-		out[1] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x10000) {
-		out[0] = 0xE0 | (codepoint >> 12);
-		out[1] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[2] = 0x80 | (codepoint & 0x3F);
-	} else if (codepoint < 0x200000) {
-		out[0] = 0xF0 | (codepoint >> 18);
-		out[1] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[3] = 0x80 | ((codepoint) & 0x3F);
-	} else if (codepoint < 0x4000000) {
-		out[0] = 0xF8 | (codepoint >> 24);
-		out[1] = 0x80 | (codepoint >> 18);
-		out[2] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[4] = 0x80 | ((codepoint) & 0x3F);
-	} else {
-		out[0] = 0xF8 | (codepoint >> 30);
-		out[1] = 0x80 | ((codepoint >> 24) & 0x3F);
-		out[2] = 0x80 | ((codepoint >> 18) & 0x3F);
-		out[3] = 0x80 | ((codepoint >> 12) & 0x3F);
-		out[4] = 0x80 | ((codepoint >> 6) & 0x3F);
-		out[5] = 0x80 | ((codepoint) & 0x3F);
-	}
-
-	return strlen(out);
-}
-
 size_t mbstowcs(wchar_t *dest, const char *src, size_t n) {
-	size_t count = 0;
-	uint32_t state = 0;
-	uint32_t codepoint = 0;
+	size_t left = strlen(src);
+	int status;
 
-	while ((!dest || count < n) && *src) {
-		if (!decode(&state, &codepoint, *(unsigned char *)src)) {
-			if (dest) {
-				dest[count] = codepoint;
-			}
-			count++;
-			codepoint = 0;
-		} else if (state == UTF8_REJECT) {
-			return (size_t)-1;
-		}
-		src++;
+	size_t count = utf8_decode(&src, &left, (uint32_t *)dest, dest ? n : SIZE_MAX, &status);
+	if (status) {
+		errno = EILSEQ;
+		return (size_t)-1;
 	}
 
-	if (dest && !*src && count < n) {
+	if (dest && !left && count < n) {
 		dest[count] = L'\0';
 	}
 
@@ -66,21 +24,19 @@ size_t mbstowcs(wchar_t *dest, const char *src, size_t n) {
 }
 
 size_t wcstombs(char * dest, const wchar_t *src, size_t n) {
-	size_t count = 0;
-
-	while ((!dest || count < n) && *src) {
-		char tmp[7];
-		int size = to_eight(*src, tmp);
-		if (count + size > n) return n;
-		memcpy(&dest[count], tmp, size);
-		count += size;
-		src++;
+	const uint32_t * in = (const uint32_t *)src;
+	size_t left = wcslen(src);
+	int status;
+
+	size_t count = utf8_encode_run(&in, &left, dest, dest ? n : SIZE_MAX, &status);
+	if (status) {
+		errno = EILSEQ;
+		return (size_t)-1;
 	}
 
-	if (dest && !*src && count < n) {
+	if (dest && !left && count < n) {
 		dest[count] = '\0';
 	}
 
 	return count;
 }
-
@@ -4,16 +4,20 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/random.h>
 
 char * mktemp(char * template) {
 	if (strstr(template + strlen(template)-6, "XXXXXX") != template + strlen(template) - 6) {
 		errno = EINVAL;
 		return NULL;
 	}
-	static int _i = 0;
-	char tmp[7] = {0};
-	sprintf(tmp,"%04d%02d", getpid(), _i++);
-	memcpy(template + strlen(template) - 6, tmp, 6);
+	static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	unsigned char r[6];
+	getrandom(r, sizeof(r), 0);
+	char * out = template + strlen(template) - 6;
+	for (int i = 0; i < 6; ++i) {
+		out[i] = letters[r[i] % (sizeof(letters) - 1)];
+	}
 	return template;
 }
 
@@ -1,25 +1,137 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 
-extern char * _argv_0;
-extern int __libc_debug;
+/*
+ * Introsort: median-of-three quicksort that falls back to heapsort
+ * when recursion gets too deep, with insertion sort for short runs.
+ */
 
-void qsort(void * base, size_t nmemb, size_t size, int (*compar)(const void *, const void *)) {
-	if (!nmemb) return;
-	if (!size) return;
-	for (size_t i = 0; i < nmemb-1; ++i) {
-		for (size_t j = 0; j < nmemb-1; ++j) {
-			void * left = (char *)base + size * j;
-			void * right = (char *)base + size * (j + 1);
-			if (compar(left,right) > 0) {
-				char tmp[size];
-				memcpy(tmp, right, size);
-				memcpy(right, left, size);
-				memcpy(left, tmp, size);
-			}
+#define INSERTION_CUTOFF 16
+
+typedef int (*compar_r_t)(const void *, const void *, void *);
+
+static inline void swap_elements(char * a, char * b, size_t size) {
+	if (size == sizeof(uint32_t)) {
+		uint32_t tmp = *(uint32_t *)a;
+		*(uint32_t *)a = *(uint32_t *)b;
+		*(uint32_t *)b = tmp;
+	} else if (size == sizeof(uint64_t)) {
+		uint64_t tmp = *(uint64_t *)a;
+		*(uint64_t *)a = *(uint64_t *)b;
+		*(uint64_t *)b = tmp;
+	} else {
+		while (size >= sizeof(uint32_t)) {
+			uint32_t tmp = *(uint32_t *)a;
+			*(uint32_t *)a = *(uint32_t *)b;
+			*(uint32_t *)b = tmp;
+			a += sizeof(uint32_t);
+			b += sizeof(uint32_t);
+			size -= sizeof(uint32_t);
+		}
+		while (size--) {
+			char tmp = *a;
+			*a++ = *b;
+			*b++ = tmp;
 		}
 	}
 }
+
+static void insertion_sort(char * base, size_t nmemb, size_t size, compar_r_t compar, void * arg) {
+	for (size_t i = 1; i < nmemb; ++i) {
+		char * j = base + i * size;
+		while (j > base && compar(j - size, j, arg) > 0) {
+			swap_elements(j - size, j, size);
+			j -= size;
+		}
+	}
+}
+
+static void sift_down(char * base, size_t root, size_t nmemb, size_t size, compar_r_t compar, void * arg) {
+	while (1) {
+		size_t child = root * 2 + 1;
+		if (child >= nmemb) return;
+		if (child + 1 < nmemb && compar(base + child * size, base + (child + 1) * size, arg) < 0) {
+			child++;
+		}
+		if (compar(base + root * size, base + child * size, arg) >= 0) return;
+		swap_elements(base + root * size, base + child * size, size);
+		root = child;
+	}
+}
+
+static void heap_sort(char * base, size_t nmemb, size_t size, compar_r_t compar, void * arg) {
+	for (size_t i = nmemb / 2; i > 0; --i) {
+		sift_down(base, i - 1, nmemb, size, compar, arg);
+	}
+	for (size_t end = nmemb - 1; end > 0; --end) {
+		swap_elements(base, base + end * size, size);
+		sift_down(base, 0, end, size, compar, arg);
+	}
+}
+
+static void intro_sort(char * base, size_t nmemb, size_t size, compar_r_t compar, void * arg, int depth) {
+	while (nmemb > INSERTION_CUTOFF) {
+		if (depth-- == 0) {
+			heap_sort(base, nmemb, size, compar, arg);
+			return;
+		}
+
+		/* Median of three goes to the front as the pivot */
+		char * lo = base;
+		char * mid = base + (nmemb / 2) * size;
+		char * hi = base + (nmemb - 1) * size;
+		if (compar(mid, lo, arg) < 0) swap_elements(mid, lo, size);
+		if (compar(hi, mid, arg) < 0) {
+			swap_elements(hi, mid, size);
+			if (compar(mid, lo, arg) < 0) swap_elements(mid, lo, size);
+		}
+		swap_elements(base, mid, size);
+
+		/* Hoare partition around base[0] */
+		char * i = base;
+		char * j = base + nmemb * size;
+		while (1) {
+			do { i += size; } while (i < j && compar(i, base, arg) < 0);
+			do { j -= size; } while (compar(j, base, arg) > 0);
+			if (i >= j) break;
+			swap_elements(i, j, size);
+		}
+		swap_elements(base, j, size);
+
+		/* Recurse into the smaller side, loop on the larger */
+		size_t left = (j - base) / size;
+		size_t right = nmemb - left - 1;
+		if (left < right) {
+			intro_sort(base, left, size, compar, arg, depth);
+			base = j + size;
+			nmemb = right;
+		} else {
+			intro_sort(j + size, right, size, compar, arg, depth);
+			nmemb = left;
+		}
+	}
+	insertion_sort(base, nmemb, size, compar, arg);
+}
+
+void qsort_r(void * base, size_t nmemb, size_t size, int (*compar)(const void *, const void *, void *), void * arg) {
+	if (nmemb < 2) return;
+	if (!size) return;
+
+	int depth = 0;
+	for (size_t n = nmemb; n > 1; n >>= 1) depth += 2;
+
+	intro_sort(base, nmemb, size, compar, arg, depth);
+}
+
+static int compar_plain(const void * a, const void * b, void * arg) {
+	int (*compar)(const void *, const void *) = arg;
+	return compar(a, b);
+}
+
+void qsort(void * base, size_t nmemb, size_t size, int (*compar)(const void *, const void *)) {
+	qsort_r(base, nmemb, size, compar_plain, (void *)compar);
+}
@@ -1,75 +1,356 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * strtod
+ *
+ * Correctly rounded, in three tiers:
+ *
+ *  - Up to 2^53 with a power of ten up to 10^22 is one exact IEEE
+ *    multiply or divide (Clinger's fast path).
+ *  - Anything else that fits in 19 digits gets Eisel-Lemire: one or
+ *    two 64x128 bit multiplies against a table of powers of five.
+ *  - With more digits than that, the first 19 give a lower and upper
+ *    bound; when those round differently, the full digit string is
+ *    compared against the halfway point with big integers.
+ */
 #include <stdlib.h>
-#include <math.h>
-#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <emmintrin.h>
 
-double strtod(const char *nptr, char **endptr) {
-	int sign = 1;
-	if (*nptr == '-') {
-		sign = -1;
-		nptr++;
+#include "strtod_table.h"
+
+#define DOUBLE_INF   0x7FF0000000000000ULL
+#define DOUBLE_NAN   0x7FF8000000000000ULL
+#define MAX_DIGITS   19   /* That always fit in 64 bits */
+#define BIG_DIGITS   800  /* Enough to decide any halfway case */
+#define BIG_LIMBS    200
+
+static const double exact_pow10[23] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* 64 x 64 -> 128, in 32-bit pieces */
+static void mul64(uint64_t a, uint64_t b, uint64_t * hi, uint64_t * lo) {
+	uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+	uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+	uint64_t p0 = a_lo * b_lo;
+	uint64_t p1 = a_lo * b_hi;
+	uint64_t p2 = a_hi * b_lo;
+	uint64_t p3 = a_hi * b_hi;
+	uint64_t mid = (p0 >> 32) + (uint32_t)p1 + (uint32_t)p2;
+	*lo = (mid << 32) | (uint32_t)p0;
+	*hi = p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+}
+
+/*
+ * w * 10^q, correctly rounded, as the bits of a double. The truncated
+ * 128-bit product is always enough to decide (Mushtak & Lemire, "Fast
+ * Number Parsing Without Fallback").
+ */
+static uint64_t eisel_lemire(uint64_t w, int q) {
+	if (!w || q < POW5_SMALLEST) return 0;
+	if (q > POW5_LARGEST) return DOUBLE_INF;
+
+	int lz = __builtin_clzll(w);
+	w <<= lz;
+
+	const uint64_t * p = &pow5_128[2 * (q - POW5_SMALLEST)];
+	uint64_t hi, lo;
+	mul64(w, p[0], &hi, &lo);
+	if ((hi & 0x1FF) == 0x1FF) {
+		/* The bits below the mantissa might carry; look further */
+		uint64_t hi2, lo2;
+		mul64(w, p[1], &hi2, &lo2);
+		lo += hi2;
+		if (hi2 > lo) hi++;
 	}
 
-	long long decimal_part = 0;
+	int upperbit = hi >> 63;
+	int shift = upperbit + 64 - 52 - 3;
+	uint64_t mantissa = hi >> shift;
+	/* floor(q * log2(10)) + 63, then biased */
+	int power2 = ((217706 * q) >> 16) + 63 + upperbit - lz + 1023;
+
+	if (power2 <= 0) {
+		/* Subnormal, or gone entirely */
+		if (-power2 + 1 >= 64) return 0;
+		mantissa >>= -power2 + 1;
+		mantissa += mantissa & 1;
+		mantissa >>= 1;
+		power2 = mantissa < (1ULL << 52) ? 0 : 1;
+		return ((uint64_t)power2 << 52) | (mantissa & ((1ULL << 52) - 1));
+	}
+
+	/* Exactly halfway can only happen for small q; round that to even */
+	if (lo <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1) {
+		if ((mantissa << shift) == hi) mantissa &= ~1ULL;
+	}
+
+	mantissa += mantissa & 1;
+	mantissa >>= 1;
+	if (mantissa >= (2ULL << 52)) {
+		mantissa = 1ULL << 52;
+		power2++;
+	}
+	if (power2 >= 0x7FF) return DOUBLE_INF;
+
+	return ((uint64_t)power2 << 52) | (mantissa & ((1ULL << 52) - 1));
+}
 
-	while (*nptr && *nptr != '.') {
-		if (*nptr < '0' || *nptr > '9') {
-			break;
+/*
+ * Little-endian base 2^32 integers, just big enough for the digits
+ * times a power of five and two.
+ */
+struct big {
+	int count;
+	uint32_t limbs[BIG_LIMBS];
+};
+
+static void big_mul_add(struct big * b, uint32_t mul, uint32_t add) {
+	uint64_t carry = add;
+	for (int i = 0; i < b->count; ++i) {
+		uint64_t t = (uint64_t)b->limbs[i] * mul + carry;
+		b->limbs[i] = t;
+		carry = t >> 32;
+	}
+	if (carry) b->limbs[b->count++] = carry;
+}
+
+static void big_mul_pow5(struct big * b, int n) {
+	while (n > 0) {
+		int step = n > 13 ? 13 : n;
+		uint32_t f = 1;
+		for (int i = 0; i < step; ++i) f *= 5;
+		big_mul_add(b, f, 0);
+		n -= step;
+	}
+}
+
+static void big_shl(struct big * b, int n) {
+	int words = n / 32;
+	int bits = n % 32;
+	if (!b->count) return;
+	if (bits) {
+		uint32_t carry = 0;
+		for (int i = 0; i < b->count; ++i) {
+			uint32_t l = b->limbs[i];
+			b->limbs[i] = (l << bits) | carry;
+			carry = l >> (32 - bits);
 		}
-		decimal_part *= 10LL;
-		decimal_part += (long long)(*nptr - '0');
-		nptr++;
+		if (carry) b->limbs[b->count++] = carry;
+	}
+	if (words) {
+		memmove(&b->limbs[words], b->limbs, b->count * sizeof(uint32_t));
+		memset(b->limbs, 0, words * sizeof(uint32_t));
+		b->count += words;
 	}
+}
 
-	double sub_part = 0;
-	double multiplier = 0.1;
+static int big_cmp(struct big * a, struct big * b) {
+	if (a->count != b->count) return a->count < b->count ? -1 : 1;
+	for (int i = a->count - 1; i >= 0; --i) {
+		if (a->limbs[i] != b->limbs[i]) return a->limbs[i] < b->limbs[i] ? -1 : 1;
+	}
+	return 0;
+}
 
-	if (*nptr == '.') {
-		nptr++;
+/*
+ * The digits from begin to end (with at most one '.') times 10^exp10
+ * are somewhere at or above the double `bits`; step up until they
+ * round to it.
+ */
+static uint64_t big_round(const char * begin, const char * end, int exp10, uint64_t bits) {
+	struct big digits, left, right;
+	int count = 0;
+	int point = 0;
+	int sticky = 0;
 
-		while (*nptr) {
-			if (*nptr < '0' || *nptr > '9') {
-				break;
-			}
+	digits.count = 0;
+	for (const char * c = begin; c < end; ++c) {
+		if (*c == '.') {
+			point = 1;
+			continue;
+		}
+		int d = *c - '0';
+		if (!count && !d) {
+			if (point) exp10--;
+			continue;
+		}
+		if (count < BIG_DIGITS) {
+			big_mul_add(&digits, 10, d);
+			count++;
+			if (point) exp10--;
+		} else {
+			if (!point) exp10++;
+			if (d) sticky = 1;
+		}
+	}
+
+	while (bits < DOUBLE_INF) {
+		/* Halfway to the next double up is (2m + 1) * 2^(e - 1) */
+		int e = (bits >> 52) & 0x7FF;
+		uint64_t m = bits & ((1ULL << 52) - 1);
+		if (e) {
+			m |= 1ULL << 52;
+		} else {
+			e = 1;
+		}
+		e -= 1075;
+
+		left = digits;
+		int left_pow2 = 0;
+		uint64_t half = 2 * m + 1;
+		right.count = 0;
+		right.limbs[right.count++] = (uint32_t)half;
+		if (half >> 32) right.limbs[right.count++] = half >> 32;
+		int right_pow2 = e - 1;
 
-			sub_part += multiplier * (*nptr - '0');
-			multiplier *= 0.1;
-			nptr++;
+		if (exp10 >= 0) {
+			big_mul_pow5(&left, exp10);
+			left_pow2 += exp10;
+		} else {
+			big_mul_pow5(&right, -exp10);
+			right_pow2 -= exp10;
 		}
+		if (left_pow2 > right_pow2) {
+			big_shl(&left, left_pow2 - right_pow2);
+		} else {
+			big_shl(&right, right_pow2 - left_pow2);
+		}
+
+		int cmp = big_cmp(&left, &right);
+		if (!cmp && sticky) cmp = 1;
+		if (cmp < 0 || (!cmp && !(m & 1))) break;
+		bits++;
+	}
+
+	return bits;
+}
+
+double strtod(const char *nptr, char **endptr) {
+	const char * s = nptr;
+	union { double d; uint64_t u; } result = { 0.0 };
+
+	while (isspace((unsigned char)*s)) s++;
+
+	int negative = 0;
+	if (*s == '-' || *s == '+') {
+		negative = *s == '-';
+		s++;
+	}
+
+	if (!strncasecmp(s, "inf", 3)) {
+		s += 3;
+		if (!strncasecmp(s, "inity", 5)) s += 5;
+		result.u = DOUBLE_INF;
+		goto done;
 	}
 
-	double expn = (double)sign;
+	if (!strncasecmp(s, "nan", 3)) {
+		s += 3;
+		if (*s == '(') {
+			const char * c = s + 1;
+			while (isalnum((unsigned char)*c) || *c == '_') c++;
+			if (*c == ')') s = c + 1;
+		}
+		result.u = DOUBLE_NAN;
+		goto done;
+	}
 
-	if (*nptr == 'e' || *nptr == 'E') {
-		nptr++;
+	/* The first 19 significant digits, and what power of ten they need */
+	const char * begin = s;
+	uint64_t w = 0;
+	int count = 0;
+	int exp10 = 0;
+	int truncated = 0;
+	int any = 0;
 
-		int exponent_sign = 1;
+	while (*s >= '0' && *s <= '9') {
+		if (count < MAX_DIGITS) {
+			w = w * 10 + (*s - '0');
+			if (w) count++;
+		} else {
+			exp10++;
+			if (*s != '0') truncated = 1;
+		}
+		any = 1;
+		s++;
+	}
 
-		if (*nptr == '+') {
-			nptr++;
-		} else if (*nptr == '-') {
-			exponent_sign = -1;
-			nptr++;
+	if (*s == '.') {
+		s++;
+		while (*s >= '0' && *s <= '9') {
+			if (count < MAX_DIGITS) {
+				w = w * 10 + (*s - '0');
+				if (w) count++;
+				exp10--;
+			} else if (*s != '0') {
+				truncated = 1;
+			}
+			any = 1;
+			s++;
 		}
+	}
+
+	if (!any) {
+		/* Not a number at all */
+		s = nptr;
+		goto done;
+	}
 
-		int exponent = 0;
+	const char * end = s;
 
-		while (*nptr) {
-			if (*nptr < '0' || *nptr > '9') {
-				break;
+	int exp_part = 0;
+	if (*s == 'e' || *s == 'E') {
+		const char * e = s + 1;
+		int exp_negative = 0;
+		if (*e == '+' || *e == '-') {
+			exp_negative = *e == '-';
+			e++;
+		}
+		if (*e >= '0' && *e <= '9') {
+			while (*e >= '0' && *e <= '9') {
+				/* Far past where anything is zero or infinite */
+				if (exp_part < 100000) exp_part = exp_part * 10 + (*e - '0');
+				e++;
 			}
-			exponent *= 10;
-			exponent += (*nptr - '0');
-			nptr++;
+			if (exp_negative) exp_part = -exp_part;
+			s = e;
 		}
+	}
+	exp10 += exp_part;
+
+	if (!w) goto done;
+
+	if (!truncated && w <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+		/* Done in SSE, since x87 would round twice */
+		__m128d v = _mm_set_sd((double)w);
+		__m128d p = _mm_set_sd(exact_pow10[exp10 < 0 ? -exp10 : exp10]);
+		result.d = _mm_cvtsd_f64(exp10 < 0 ? _mm_div_sd(v, p) : _mm_mul_sd(v, p));
+		goto done;
+	}
+
+	result.u = eisel_lemire(w, exp10);
+	if (truncated && result.u != eisel_lemire(w + 1, exp10)) {
+		result.u = big_round(begin, end, exp_part, result.u);
+	}
 
-		expn = pow(10.0,(double)(exponent * exponent_sign));
+	if (result.u == 0 || result.u == DOUBLE_INF) {
+		errno = ERANGE;
 	}
 
+done:
 	if (endptr) {
-		*endptr = (char *)nptr;
+		*endptr = (char *)s;
 	}
-	double result = ((double)decimal_part + sub_part) * expn;
-	return result;
+	return negative ? -result.d : result.d;
 }
 
 float strtof(const char *nptr, char **endptr) {
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <errno.h>
 #include <wait.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -11,13 +13,13 @@ int system(const char * command) {
 		(char *)command,
 		NULL,
 	};
-	pid_t pid = fork();
-	if (!pid) {
-		execvp(args[0], args);
-		exit(1);
-	} else {
-		int status;
-		waitpid(pid, &status, 0);
-		return WEXITSTATUS(status);
+	pid_t pid;
+	int err = posix_spawn(&pid, args[0], NULL, NULL, args, environ);
+	if (err) {
+		errno = err;
+		return -1;
 	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WEXITSTATUS(status);
 }
@@ -1,6 +1,39 @@
 #include <stddef.h>
+#include <stdint.h>
+#include <emmintrin.h>
 
 void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
+	if (n >= 64) {
+		char * d = dest;
+		const char * s = src;
+
+		/* Copy the unaligned head, then step to an aligned destination */
+		size_t head = (-(uintptr_t)d) & 15;
+		_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+		d += head;
+		s += head;
+		n -= head;
+
+		for (; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(s +  0));
+			__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_store_si128((__m128i *)(d +  0), a);
+			_mm_store_si128((__m128i *)(d + 16), b);
+			_mm_store_si128((__m128i *)(d + 32), c);
+			_mm_store_si128((__m128i *)(d + 48), e);
+		}
+		for (; n >= 16; n -= 16, d += 16, s += 16) {
+			_mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+		}
+		if (n) {
+			/* The tail may overlap what we already copied */
+			_mm_storeu_si128((__m128i *)(d + n - 16), _mm_loadu_si128((const __m128i *)(s + n - 16)));
+		}
+		return dest;
+	}
+
 	asm volatile("cld; rep movsb"
 	            : "=c"((int){0})
 	            : "D"(dest), "S"(src), "c"(n)
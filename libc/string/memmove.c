@@ -1,6 +1,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <emmintrin.h>
 
 void * memmove(void * dest, const void * src, size_t n) {
 	char * d = dest;
@@ -15,6 +16,10 @@ void * memmove(void * dest, const void * src, size_t n) {
 	}
 
 	if (d<s) {
+		/* Each load is taken before the store that could clobber it */
+		for (; n >= 16; n -= 16, d += 16, s += 16) {
+			_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+		}
 		if ((uintptr_t)s % sizeof(size_t) == (uintptr_t)d % sizeof(size_t)) {
 			while ((uintptr_t)d % sizeof(size_t)) {
 				if (!n--) {
@@ -30,6 +35,10 @@ void * memmove(void * dest, const void * src, size_t n) {
 			*d++ = *s++;
 		}
 	} else {
+		while (n >= 16) {
+			n -= 16;
+			_mm_storeu_si128((__m128i *)(d+n), _mm_loadu_si128((const __m128i *)(s+n)));
+		}
 		if ((uintptr_t)s % sizeof(size_t) == (uintptr_t)d % sizeof(size_t)) {
 			while ((uintptr_t)(d+n) % sizeof(size_t)) {
 				if (!n--) {
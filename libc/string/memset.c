@@ -1,10 +1,34 @@
 #include <stddef.h>
+#include <stdint.h>
+#include <emmintrin.h>
 
 void * memset(void * dest, int c, size_t n) {
+	if (n >= 64) {
+		char * d = dest;
+		char * end = d + n;
+		__m128i v = _mm_set1_epi8((char)c);
+
+		_mm_storeu_si128((__m128i *)d, v);
+		d += (-(uintptr_t)d) & 15;
+
+		for (; d + 64 <= end; d += 64) {
+			_mm_store_si128((__m128i *)(d +  0), v);
+			_mm_store_si128((__m128i *)(d + 16), v);
+			_mm_store_si128((__m128i *)(d + 32), v);
+			_mm_store_si128((__m128i *)(d + 48), v);
+		}
+		for (; d + 16 <= end; d += 16) {
+			_mm_store_si128((__m128i *)d, v);
+		}
+		if (d < end) {
+			_mm_storeu_si128((__m128i *)(end - 16), v);
+		}
+		return dest;
+	}
+
 	asm volatile("cld; rep stosb"
 	             : "=c"((int){0})
 	             : "D"(dest), "a"(c), "c"(n)
 	             : "flags", "memory");
 	return dest;
 }
-
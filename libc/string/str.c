@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <limits.h>
 #include <ctype.h>
+#include <emmintrin.h>
 
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
@@ -19,6 +20,15 @@
 int memcmp(const void * vl, const void * vr, size_t n) {
 	const unsigned char *l = vl;
 	const unsigned char *r = vr;
+	for (; n >= 16; n -= 16, l += 16, r += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)l);
+		__m128i b = _mm_loadu_si128((const __m128i *)r);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+		if (mask) {
+			int i = __builtin_ctz(mask);
+			return l[i] - r[i];
+		}
+	}
 	for (; n && *l == *r; n--, l++, r++);
 	return n ? *l-*r : 0;
 }
@@ -26,19 +36,27 @@ int memcmp(const void * vl, const void * vr, size_t n) {
 void * memchr(const void * src, int c, size_t n) {
 	const unsigned char * s = src;
 	c = (unsigned char)c;
-	for (; ((uintptr_t)s & (ALIGN - 1)) && n && *s != c; s++, n--);
-	if (n && *s != c) {
-		const size_t * w;
-		size_t k = ONES * c;
-		for (w = (const void *)s; n >= sizeof(size_t) && !HASZERO(*w^k); w++, n -= sizeof(size_t));
-		for (s = (const void *)w; n && *s != c; s++, n--);
+	__m128i k = _mm_set1_epi8((char)c);
+	for (; n >= 16; n -= 16, s += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)s), k));
+		if (mask) {
+			return (void *)(s + __builtin_ctz(mask));
+		}
 	}
+	for (; n && *s != c; s++, n--);
 	return n ? (void *)s : 0;
 }
 
 void * memrchr(const void * m, int c, size_t n) {
 	const unsigned char * s = m;
 	c = (unsigned char)c;
+	__m128i k = _mm_set1_epi8((char)c);
+	for (; n >= 16; n -= 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + n - 16)), k));
+		if (mask) {
+			return (void *)(s + n - 16 + (31 - __builtin_clz(mask)));
+		}
+	}
 	while (n--) {
 		if (s[n] == c) {
 			return (void*)(s+n);
@@ -56,17 +74,25 @@ int strcoll(const char * s1, const char * s2) {
 	return strcmp(s1,s2); /* TODO locales */
 }
 
+/*
+ * The SSE2 scans below only issue aligned 16-byte loads, which
+ * can never cross into an unmapped page past the terminator.
+ */
 size_t strlen(const char * s) {
-	const char * a = s;
-	const size_t * w;
-	for (; (uintptr_t)s % ALIGN; s++) {
-		if (!*s) {
-			return s-a;
+	const char * p = (const char *)((uintptr_t)s & ~15);
+	__m128i zero = _mm_setzero_si128();
+	unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+	mask >>= (s - p);
+	if (mask) {
+		return __builtin_ctz(mask);
+	}
+	while (1) {
+		p += 16;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+		if (mask) {
+			return p + __builtin_ctz(mask) - s;
 		}
 	}
-	for (w = (const void *)s; !HASZERO(*w); w++);
-	for (s = (const void *)w; *s; s++);
-	return s-a;
 }
 
 char * strdup(const char * s) {
@@ -121,24 +147,28 @@ size_t strspn(const char * s, const char * c) {
 }
 
 char * strchrnul(const char * s, int c) {
-	size_t * w;
-	size_t k;
-
 	c = (unsigned char)c;
 	if (!c) {
 		return (char *)s + strlen(s);
 	}
 
-	for (; (uintptr_t)s % ALIGN; s++) {
-		if (!*s || *(unsigned char *)s == c) {
-			return (char *)s;
+	const char * p = (const char *)((uintptr_t)s & ~15);
+	__m128i zero = _mm_setzero_si128();
+	__m128i k = _mm_set1_epi8((char)c);
+	__m128i v = _mm_load_si128((const __m128i *)p);
+	unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, k)));
+	mask >>= (s - p);
+	if (mask) {
+		return (char *)s + __builtin_ctz(mask);
+	}
+	while (1) {
+		p += 16;
+		v = _mm_load_si128((const __m128i *)p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, k)));
+		if (mask) {
+			return (char *)p + __builtin_ctz(mask);
 		}
 	}
-
-	k = ONES * c;
-	for (w = (void *)s; !HASZERO(*w) && !HASZERO(*w^k); w++);
-	for (s = (void *)w; *s && *(unsigned char *)s != c; s++);
-	return (char *)s;
 }
 
 char * strchr(const char * s, int c) {
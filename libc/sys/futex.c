@@ -0,0 +1,10 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/futex.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(futex, SYS_FUTEX, volatile uint32_t *, int, uint32_t);
+
+int futex(volatile uint32_t * addr, int op, uint32_t val) {
+	__sets_errno(syscall_futex(addr, op, val));
+}
@@ -0,0 +1,15 @@
+#include <sys/ioring.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(ioring_setup, SYS_IORING_SETUP, void *);
+DEFN_SYSCALL3(ioring_enter, SYS_IORING_ENTER, int, unsigned int, unsigned int);
+
+int ioring_setup(struct ioring * ring) {
+	__sets_errno(syscall_ioring_setup(ring));
+}
+
+int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete) {
+	__sets_errno(syscall_ioring_enter(fd, to_submit, min_complete));
+}
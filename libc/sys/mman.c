@@ -0,0 +1,27 @@
+#include <sys/mman.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(mmap, SYS_MMAP, void *);
+DEFN_SYSCALL2(munmap, SYS_MUNMAP, void *, size_t);
+DEFN_SYSCALL3(mprotect, SYS_MPROTECT, void *, size_t, int);
+
+void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	struct mmap_args args = { addr, length, prot, flags, fd, offset };
+	int ret = syscall_mmap(&args);
+	/* Mappings live high enough that they look negative; errors are the last page */
+	if ((unsigned int)ret >= (unsigned int)-4095) {
+		errno = -ret;
+		return MAP_FAILED;
+	}
+	return (void *)ret;
+}
+
+int munmap(void * addr, size_t length) {
+	__sets_errno(syscall_munmap(addr, length));
+}
+
+int mprotect(void * addr, size_t length, int prot) {
+	__sets_errno(syscall_mprotect(addr, length, prot));
+}
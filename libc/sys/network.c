@@ -7,6 +7,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -37,40 +38,92 @@ struct hostent * gethostbyname(const char * name) {
 }
 
 int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-	UNIMPLEMENTED;
-	return -1;
+	if (addrlen < sizeof(struct sockaddr_in)) {
+		errno = EINVAL;
+		return -1;
+	}
+	__sets_errno(ioctl(sockfd, IOCTL_SOCK_CONNECT, (void *)addr));
 }
 
 /* All of these should just be reads. */
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-	UNIMPLEMENTED;
-	return -1;
+	if (!(flags & MSG_WAITALL)) {
+		return read(sockfd, buf, len);
+	}
+	/* A read returns whatever has arrived; keep going until it's all here */
+	size_t got = 0;
+	while (got < len) {
+		ssize_t r = read(sockfd, (char *)buf + got, len - got);
+		if (r < 0) return got ? (ssize_t)got : -1;
+		if (r == 0) break;
+		got += r;
+	}
+	return got;
 }
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
-	UNIMPLEMENTED;
-	return -1;
+	struct iovec iov = { buf, len };
+	struct msghdr msg = { src_addr, addrlen ? *addrlen : 0, &iov, 1, NULL, 0, 0 };
+	ssize_t ret = recvmsg(sockfd, &msg, flags);
+	if (ret >= 0 && addrlen) *addrlen = msg.msg_namelen;
+	return ret;
 }
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-	UNIMPLEMENTED;
-	return -1;
+	struct mmsghdr mmsg = { *msg, 0 };
+	int ret = recvmmsg(sockfd, &mmsg, 1, flags, NULL);
+	if (ret < 0) {
+		if (errno == EOPNOTSUPP && msg->msg_iovlen) {
+			/* A stream; there's no address to give back */
+			msg->msg_namelen = 0;
+			msg->msg_flags = 0;
+			return recv(sockfd, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len, flags);
+		}
+		return -1;
+	}
+	*msg = mmsg.msg_hdr;
+	return mmsg.msg_len;
 }
 
 ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
-	UNIMPLEMENTED;
-	return len;
+	return write(sockfd, buf, len);
 }
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {
-	UNIMPLEMENTED;
-	return len;
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr msg = { (void *)dest_addr, addrlen, &iov, 1, NULL, 0, 0 };
+	return sendmsg(sockfd, &msg, flags);
 }
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
-	UNIMPLEMENTED;
-	return -1;
+	struct mmsghdr mmsg = { *msg, 0 };
+	int ret = sendmmsg(sockfd, &mmsg, 1, flags);
+	if (ret < 0) return -1;
+	return mmsg.msg_len;
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+	void * args[3] = {msgvec, (void *)(uintptr_t)vlen, (void *)(uintptr_t)flags};
+	__sets_errno(ioctl(sockfd, IOCTL_SOCK_SENDMMSG, args));
+}
+
+/* timeout isn't supported; use MSG_WAITFORONE or MSG_DONTWAIT */
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+	void * args[3] = {msgvec, (void *)(uintptr_t)vlen, (void *)(uintptr_t)flags};
+	__sets_errno(ioctl(sockfd, IOCTL_SOCK_RECVMMSG, args));
 }
 
 int socket(int domain, int type, int protocol) {
-	UNIMPLEMENTED;
-	return -1;
+	if (domain != AF_INET) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	switch (type) {
+		case SOCK_STREAM:
+			/* An unconnected TCP socket; see bind(), listen() and connect() */
+			return open("/dev/net/tcp", O_RDWR);
+		case SOCK_DGRAM:
+			return open("/dev/net/udp", O_RDWR);
+		default:
+			errno = EOPNOTSUPP;
+			return -1;
+	}
 }
 
 uint32_t htonl(uint32_t hostlong) {
@@ -90,18 +143,30 @@ uint16_t ntohs(uint16_t netshort) {
 }
 
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-	UNIMPLEMENTED;
-	return -1;
+	if (addrlen < sizeof(struct sockaddr_in)) {
+		errno = EINVAL;
+		return -1;
+	}
+	__sets_errno(ioctl(sockfd, IOCTL_SOCK_BIND, (void *)addr));
 }
 
 int accept(int sockfd, struct sockaddr * addr, socklen_t * addrlen) {
-	UNIMPLEMENTED;
-	return -1;
+	struct sockaddr_in peer;
+	int ret = ioctl(sockfd, IOCTL_SOCK_ACCEPT, &peer);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	if (addr && addrlen) {
+		size_t len = *addrlen < sizeof(peer) ? *addrlen : sizeof(peer);
+		memcpy(addr, &peer, len);
+		*addrlen = sizeof(peer);
+	}
+	return ret;
 }
 
 int listen(int sockfd, int backlog) {
-	UNIMPLEMENTED;
-	return -1;
+	__sets_errno(ioctl(sockfd, IOCTL_SOCK_LISTEN, &backlog));
 }
 
 int getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
@@ -114,11 +179,22 @@ int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
 }
 
 int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+	if (level == SOL_SOCKET && optname == SO_RCVBUF && *optlen >= sizeof(int)) {
+		int ret = ioctl(sockfd, IOCTL_SOCK_GETRCVBUF, NULL);
+		if (ret < 0) return -1;
+		*(int *)optval = ret;
+		*optlen = sizeof(int);
+		return 0;
+	}
 	UNIMPLEMENTED;
 	return -1;
 }
 
 int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+	if (level == SOL_SOCKET && optname == SO_RCVBUF && optlen >= sizeof(int)) {
+		int size = *(const int *)optval;
+		return ioctl(sockfd, IOCTL_SOCK_SETRCVBUF, &size) < 0 ? -1 : 0;
+	}
 	UNIMPLEMENTED;
 	return -1;
 }
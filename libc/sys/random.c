@@ -0,0 +1,10 @@
+#include <sys/random.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL3(getrandom, SYS_GETRANDOM, void *, size_t, unsigned int);
+
+ssize_t getrandom(void * buffer, size_t length, unsigned int flags) {
+	__sets_errno(syscall_getrandom(buffer, length, flags));
+}
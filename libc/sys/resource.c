@@ -0,0 +1,10 @@
+#include <sys/resource.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL2(getrusage, SYS_GETRUSAGE, int, void *);
+
+int getrusage(int who, struct rusage * usage) {
+	__sets_errno(syscall_getrusage(who, usage));
+}
@@ -0,0 +1,10 @@
+#include <sys/sendfile.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL4(sendfile, SYS_SENDFILE, int, int, off_t *, size_t);
+
+ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count) {
+	__sets_errno(syscall_sendfile(out_fd, in_fd, offset, count));
+}
@@ -0,0 +1,21 @@
+#include <sys/times.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static clock_t ticks(struct timeval * tv) {
+	return tv->tv_sec * CLK_TCK + tv->tv_usec / (1000000 / CLK_TCK);
+}
+
+/* Returns ticks since boot, as an arbitrary point to measure from */
+clock_t times(struct tms * buf) {
+	struct rusage self, children;
+	if (getrusage(RUSAGE_SELF, &self) < 0 || getrusage(RUSAGE_CHILDREN, &children) < 0) return -1;
+	buf->tms_utime  = ticks(&self.ru_utime);
+	buf->tms_stime  = ticks(&self.ru_stime);
+	buf->tms_cutime = ticks(&children.ru_utime);
+	buf->tms_cstime = ticks(&children.ru_stime);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * CLK_TCK + now.tv_nsec / (1000000000 / CLK_TCK);
+}
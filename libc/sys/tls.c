@@ -0,0 +1,19 @@
+#include <sys/tls.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(settls, SYS_SETTLS, void *);
+
+int settls(void * tcb) {
+	__sets_errno(syscall_settls(tcb));
+}
+
+/* ld.so replaces these; a static binary has no TLS blocks to set up */
+size_t __attribute__((weak)) __ld_tls_size(void) {
+	return 0;
+}
+
+void __attribute__((weak)) __ld_tls_init(tls_tcb_t * tcb) {
+	(void)tcb;
+}
@@ -12,3 +12,9 @@ int waitpid(int pid, int *status, int options) {
 int wait(int *status) {
 	return waitpid(-1, status, 0);
 }
+
+DEFN_SYSCALL1(pidfd_open, SYS_PIDFD_OPEN, int);
+
+int pidfd_open(int pid) {
+	__sets_errno(syscall_pidfd_open(pid));
+}
@@ -0,0 +1,28 @@
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/clockpage.h>
+
+extern int __clock_page_read(int32_t * boot_time, unsigned long * seconds, unsigned long * useconds);
+
+int clock_gettime(clockid_t clk_id, struct timespec * tp) {
+	if (clk_id != CLOCK_REALTIME && clk_id != CLOCK_MONOTONIC) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int32_t boot_time;
+	unsigned long seconds, useconds;
+	if (__clock_page_read(&boot_time, &seconds, &useconds) < 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		boot_time = ((const struct clock_page *)CLOCK_PAGE_ADDRESS)->boot_time;
+		seconds = tv.tv_sec - boot_time;
+		useconds = tv.tv_usec;
+	}
+
+	tp->tv_sec = (clk_id == CLOCK_REALTIME) ? boot_time + seconds : seconds;
+	tp->tv_nsec = useconds * 1000;
+	return 0;
+}
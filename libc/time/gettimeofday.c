@@ -1,10 +1,52 @@
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/clockpage.h>
 #include <syscall.h>
 #include <syscall_nums.h>
 
 DEFN_SYSCALL2(gettimeofday, SYS_GETTIMEOFDAY, void *, void *);
 
+/*
+ * Time since boot from the clock page, without entering the kernel.
+ * Returns -1 if the TSC hasn't been calibrated yet or the page is too
+ * stale to extrapolate from, in which case ask the kernel instead.
+ */
+int __clock_page_read(int32_t * boot_time, unsigned long * seconds, unsigned long * useconds) {
+	const struct clock_page * page = (const struct clock_page *)CLOCK_PAGE_ADDRESS;
+	uint32_t seq, mult, limit, subticks;
+	uint64_t tsc, now;
+
+	do {
+		seq = page->seq;
+		if (seq & 1) continue;
+		__asm__ __volatile__ ("" ::: "memory");
+		*boot_time = page->boot_time;
+		*seconds = page->ticks;
+		subticks = page->subticks;
+		tsc = page->tsc;
+		mult = page->tsc_mult;
+		limit = page->tsc_limit;
+		uint32_t lo, hi;
+		__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+		now = ((uint64_t)hi << 32) | lo;
+		__asm__ __volatile__ ("" ::: "memory");
+	} while ((seq & 1) || page->seq != seq);
+
+	if (!mult || now < tsc || now - tsc > limit) return -1;
+
+	uint32_t usec = subticks + (uint32_t)(((now - tsc) * mult) >> 32);
+	*seconds += usec / 1000000;
+	*useconds = usec % 1000000;
+	return 0;
+}
+
 int gettimeofday(struct timeval *p, void *z){
+	int32_t boot_time;
+	unsigned long seconds, useconds;
+	if (p && __clock_page_read(&boot_time, &seconds, &useconds) == 0) {
+		p->tv_sec = boot_time + seconds;
+		p->tv_usec = useconds;
+		return 0;
+	}
 	return syscall_gettimeofday(p,z);
 }
-
@@ -0,0 +1,19 @@
+#include <time.h>
+#include <errno.h>
+#include <syscall.h>
+
+int nanosleep(const struct timespec * req, struct timespec * rem) {
+	if (!req || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The kernel sleeps in microseconds; round up so we never sleep short */
+	syscall_nanosleep(req->tv_sec, (req->tv_nsec + 999) / 1000);
+
+	if (rem) {
+		rem->tv_sec = 0;
+		rem->tv_nsec = 0;
+	}
+	return 0;
+}
@@ -1,9 +1,16 @@
 #include <unistd.h>
+#include <errno.h>
 #include <syscall_nums.h>
 #include <syscall.h>
 
 DEFN_SYSCALL1(sbrk,  SYS_SBRK, int);
 
 void *sbrk(intptr_t increment) {
-	return (void *)syscall_sbrk(increment);
+	int ret = syscall_sbrk(increment);
+	/* Errors are small negative numbers; heap addresses never are */
+	if (ret < 0 && ret > -4096) {
+		errno = -ret;
+		return (void *)-1;
+	}
+	return (void *)ret;
 }
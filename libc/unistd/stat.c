@@ -3,9 +3,11 @@
 #include <syscall_nums.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <fcntl.h>
 
 DEFN_SYSCALL2(stat,  SYS_STATF, char *, void *);
 DEFN_SYSCALL2(lstat, SYS_LSTAT, char *, void *);
+DEFN_SYSCALL4(fstatat, SYS_FSTATAT, int, char *, void *, int);
 
 int stat(const char *file, struct stat *st){
 	int ret = syscall_stat((char *)file, (void *)st);
@@ -28,3 +30,17 @@ int lstat(const char *path, struct stat *st) {
 		return -1;
 	}
 }
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags) {
+	if (dirfd == AT_FDCWD || path[0] == '/') {
+		return (flags & AT_SYMLINK_NOFOLLOW) ? lstat(path, st) : stat(path, st);
+	}
+	int ret = syscall_fstatat(dirfd, (char *)path, (void *)st, flags);
+	if (ret >= 0) {
+		return ret;
+	} else {
+		errno = -ret;
+		memset(st, 0x00, sizeof(struct stat));
+		return -1;
+	}
+}
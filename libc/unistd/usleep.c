@@ -5,7 +5,7 @@
 DEFN_SYSCALL2(nanosleep,  SYS_SLEEP, unsigned long, unsigned long);
 
 int usleep(useconds_t usec) {
-	syscall_nanosleep((usec / 10000) / 1000, (usec / 10000) % 1000);
+	syscall_nanosleep(usec / 1000000, usec % 1000000);
 	return 0;
 }
 
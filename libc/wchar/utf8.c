@@ -0,0 +1,155 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * UTF-8 codec for whole strings.
+ *
+ * Shared by mbstowcs, wcstombs and iconv. Decoding is strict - no
+ * overlong forms, surrogates, or anything past U+10FFFF - and most
+ * text is ASCII, so runs of it are checked and widened sixteen bytes
+ * at a time.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <emmintrin.h>
+
+#include <toaru/decodeutf8.h>
+
+/* Widen sixteen ASCII bytes to codepoints */
+static inline void widen16(__m128i v, uint32_t * out) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(v, zero);
+	__m128i hi = _mm_unpackhi_epi8(v, zero);
+	_mm_storeu_si128((__m128i *)&out[0],  _mm_unpacklo_epi16(lo, zero));
+	_mm_storeu_si128((__m128i *)&out[4],  _mm_unpackhi_epi16(lo, zero));
+	_mm_storeu_si128((__m128i *)&out[8],  _mm_unpacklo_epi16(hi, zero));
+	_mm_storeu_si128((__m128i *)&out[12], _mm_unpackhi_epi16(hi, zero));
+}
+
+/*
+ * One multi-byte sequence at s, with `left` bytes available. Returns
+ * its length, or UTF8_BAD / UTF8_SHORT.
+ */
+static int decode_one(const unsigned char * s, size_t left, uint32_t * codepoint) {
+	unsigned char c = s[0];
+	int len;
+	uint32_t min;
+	uint32_t cp;
+
+	if (c < 0xC2) {
+		return UTF8_BAD; /* Continuation, or an overlong two-byte form */
+	} else if (c < 0xE0) {
+		len = 2; cp = c & 0x1F; min = 0x80;
+	} else if (c < 0xF0) {
+		len = 3; cp = c & 0x0F; min = 0x800;
+	} else if (c < 0xF5) {
+		len = 4; cp = c & 0x07; min = 0x10000;
+	} else {
+		return UTF8_BAD;
+	}
+
+	for (int i = 1; i < len; ++i) {
+		if ((size_t)i >= left) return UTF8_SHORT;
+		if ((s[i] & 0xC0) != 0x80) return UTF8_BAD;
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+
+	if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return UTF8_BAD;
+
+	*codepoint = cp;
+	return len;
+}
+
+size_t utf8_decode(const char ** in, size_t * inleft, uint32_t * out, size_t outleft, int * status) {
+	const unsigned char * s = (const unsigned char *)*in;
+	size_t left = *inleft;
+	size_t count = 0;
+	*status = 0;
+
+	while (left && count < outleft) {
+		if (*s < 0x80) {
+			/* ASCII, as far as it goes */
+			while (left >= 16 && outleft - count >= 16) {
+				__m128i v = _mm_loadu_si128((const __m128i *)s);
+				unsigned int mask = _mm_movemask_epi8(v);
+				if (mask) break;
+				if (out) widen16(v, &out[count]);
+				s += 16;
+				left -= 16;
+				count += 16;
+			}
+			while (left && count < outleft && *s < 0x80) {
+				if (out) out[count] = *s;
+				s++;
+				left--;
+				count++;
+			}
+			continue;
+		}
+
+		uint32_t codepoint;
+		int len = decode_one(s, left, &codepoint);
+		if (len < 0) {
+			*status = len;
+			break;
+		}
+		if (out) out[count] = codepoint;
+		s += len;
+		left -= len;
+		count++;
+	}
+
+	*in = (const char *)s;
+	*inleft = left;
+	return count;
+}
+
+size_t utf8_encode_run(const uint32_t ** in, size_t * inleft, char * out, size_t outleft, int * status) {
+	const uint32_t * s = *in;
+	size_t left = *inleft;
+	size_t count = 0;
+	*status = 0;
+
+	while (left) {
+		/* Sixteen ASCII codepoints narrow to sixteen bytes */
+		if (left >= 16 && outleft - count >= 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)&s[0]);
+			__m128i b = _mm_loadu_si128((const __m128i *)&s[4]);
+			__m128i c = _mm_loadu_si128((const __m128i *)&s[8]);
+			__m128i d = _mm_loadu_si128((const __m128i *)&s[12]);
+			__m128i high = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(high, 7), _mm_setzero_si128())) == 0xFFFF) {
+				if (out) {
+					__m128i ab = _mm_packs_epi32(a, b);
+					__m128i cd = _mm_packs_epi32(c, d);
+					_mm_storeu_si128((__m128i *)&out[count], _mm_packus_epi16(ab, cd));
+				}
+				s += 16;
+				left -= 16;
+				count += 16;
+				continue;
+			}
+		}
+
+		uint32_t codepoint = *s;
+		if (codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+			*status = UTF8_BAD;
+			break;
+		}
+		char tmp[7];
+		int len = utf8_encode(codepoint, tmp);
+		if (!codepoint) len = 1;
+		if (outleft - count < (size_t)len) break;
+		if (out) {
+			for (int i = 0; i < len; ++i) out[count + i] = tmp[i];
+		}
+		s++;
+		left--;
+		count += len;
+	}
+
+	*in = s;
+	*inleft = left;
+	return count;
+}
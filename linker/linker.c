@@ -9,12 +9,10 @@
  * shared library dependencies.
  *
  * As of writing, this is a simplistic and not-fully-compliant
- * implementation of ELF dynamic linking. It suffers from a number
- * of issues, including not actually sharing libraries (there
- * isn't a sufficient mechanism in the kernel at the moment for
- * doing that - we need something with copy-on-write, preferably
- * an mmap-file mechanism), as well as not handling symbol
- * resolution correctly.
+ * implementation of ELF dynamic linking. Segments are mapped from
+ * their files with mmap(), so the pages of a library that are never
+ * written are shared by everything that uses it; it does not handle
+ * symbol resolution correctly.
  *
  * However, it's sufficient for our purposes, and works well enough
  * to load Python C modules.
@@ -26,8 +24,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/sysfunc.h>
+#include <sys/tls.h>
+#include <fcntl.h>
 
 #include <kernel/elf.h>
 
@@ -52,12 +54,14 @@ static void free(void * ptr) {
 
 /*
  * When the LD_DEBUG environment variable is set, TRACE_LD messages
- * will be printed to stderr
+ * will be printed to stderr; LD_DEBUG=statistics reports how long
+ * loading and relocation took instead.
  */
 #define TRACE_APP_NAME "ld.so"
 #define TRACE_LD(...) do { if (__trace_ld) { TRACE(__VA_ARGS__); } } while (0)
 
 static int __trace_ld = 0;
+static int __stats_ld = 0;
 
 #include <toaru/trace.h>
 
@@ -72,17 +76,63 @@ static int __trace_ld = 0;
 typedef int (*entry_point_t)(int, char *[], char**);
 
 /* Global linking state */
-static hashmap_t * dumb_symbol_table;
+static list_t * symbol_search_list; /* Objects in the order their symbols take precedence */
 static hashmap_t * glob_dat;
 static hashmap_t * objects_map;
 
+/* Resolve PLT entries on first call unless LD_BIND_NOW is set */
+static int _bind_now = 0;
+
+/* LD_DEBUG=statistics */
+static struct {
+	size_t objects;
+	size_t relocations;
+	size_t lookups;
+	size_t lazy_slots;
+	size_t prelinked;
+} ld_stats;
+
+/* Recording relocations for the prelink cache (ld.so --prelink) */
+static int _prelink = 0;
+
 /* Used for dlerror */
 static char * last_error = NULL;
 
 static int _target_is_suid = 0;
 
+/*
+ * Prelink cache records. A cache holds the executable's libraries in
+ * the order they were loaded and then the executable itself; for each,
+ * which file it was and where it went, and every write its relocations
+ * made, in order.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t checksum;  /* Of everything after the header */
+	uint32_t objects;
+} ld_cache_header_t;
+
+typedef struct {
+	uint32_t base;
+	uint32_t dev;
+	uint32_t ino;
+	uint32_t size;
+	uint32_t mtime;
+	uint32_t name_len;  /* The name follows, padded to four bytes... */
+	uint32_t count;     /* ...and then this many writes */
+} ld_cache_object_t;
+
+typedef struct {
+	uint32_t addr;
+	uint32_t value;
+	uint32_t size;      /* 0 to store value at addr; a COPY of size bytes from value otherwise */
+} ld_cache_write_t;
+
 typedef struct elf_object {
 	FILE * file;
+	const char * name;  /* As it was asked for */
+	struct stat st;     /* Which file it is, for the prelink cache */
 
 	/* Full copy of the header. */
 	Elf32_Header header;
@@ -95,17 +145,38 @@ typedef struct elf_object {
 
 	Elf32_Dyn * dynamic;
 	Elf32_Word * dyn_hash;
+	Elf32_Word * gnu_hash;
+
+	Elf32_Rel * rel;        /* DT_REL */
+	size_t rel_size;
+	Elf32_Rel * jmprel;     /* DT_JMPREL, the PLT's JUMP_SLOTs */
+	size_t jmprel_size;
+	uintptr_t * plt_got;    /* DT_PLTGOT */
 
 	void (*init)(void);
 	void (**init_array)(void);
 	size_t init_array_size;
 
 	uintptr_t base;
+	size_t size;            /* Of the area reserved by dlopen() */
+
+	/* PT_TLS: what each thread's copy of our thread-local block starts as */
+	uintptr_t tls_image;
+	size_t tls_filesz;
+	size_t tls_memsz;
+	size_t tls_align;
+	size_t tls_offset;      /* How far below the thread pointer the block starts */
+	size_t tls_module;      /* For __tls_get_addr; 0 if we have no block */
 
 	list_t * dependencies;
 
 	int loaded;
 
+	/* Relocation writes, when recording them for the cache */
+	ld_cache_write_t * writes;
+	size_t writes_count;
+	size_t writes_space;
+
 } elf_t;
 
 static elf_t * _main_obj = NULL;
@@ -164,9 +235,9 @@ static elf_t * open_object(const char * path) {
 	}
 
 	/* If we've already opened a file with this name, return it - don't load things twice. */
-	if (hashmap_has(objects_map, (void*)path)) {
-		elf_t * object = hashmap_get(objects_map, (void*)path);
-		return object;
+	elf_t * existing;
+	if (hashmap_lookup(objects_map, (void*)path, (void **)&existing)) {
+		return existing;
 	}
 
 	/* Locate the library */
@@ -200,6 +271,8 @@ static elf_t * open_object(const char * path) {
 	}
 
 	object->file = f;
+	object->name = path;
+	fstat(fileno(f), &object->st);
 
 	/* Read the header */
 	size_t r = fread(&object->header, sizeof(Elf32_Header), 1, object->file);
@@ -268,6 +341,50 @@ static size_t object_calculate_size(elf_t * object) {
 	return end_addr - base_addr;
 }
 
+/*
+ * Map a PT_LOAD segment directly from the file. Writes (relocations,
+ * .data) land on private copies of the pages they touch.
+ *
+ * Returns 0 on success, or 1 if the segment has to be read in instead.
+ */
+static int object_map_segment(elf_t * object, uintptr_t base, Elf32_Phdr * phdr) {
+	uintptr_t vaddr = base + phdr->p_vaddr;
+
+	/* File offset and address have to agree within a page */
+	if ((vaddr & 0xFFF) != (phdr->p_offset & 0xFFF)) return 1;
+
+	uintptr_t map_start = vaddr & ~0xFFF;
+	uintptr_t file_end  = vaddr + phdr->p_filesz;
+	uintptr_t mem_end   = vaddr + phdr->p_memsz;
+	uintptr_t anon_start = map_start;
+
+	if (phdr->p_filesz) {
+		void * out = mmap((void *)map_start, file_end - map_start, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_FIXED, fileno(object->file), phdr->p_offset & ~0xFFF);
+		if (out == MAP_FAILED) return 1;
+
+		anon_start = (file_end + 0xFFF) & ~0xFFF;
+
+		/* The rest of the last file page belongs to .bss */
+		if (mem_end > file_end) {
+			uintptr_t zero_end = mem_end < anon_start ? mem_end : anon_start;
+			memset((void *)file_end, 0, zero_end - file_end);
+		}
+	}
+
+	if (mem_end > anon_start) {
+		void * out = mmap((void *)anon_start, mem_end - anon_start, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+		if (out == MAP_FAILED) {
+			char * args[] = {(char *)anon_start, (char *)(mem_end - anon_start)};
+			sysfunc(TOARU_SYS_FUNC_MMAP, args);
+			memset((void *)anon_start, 0, mem_end - anon_start);
+		}
+	}
+
+	return 0;
+}
+
 /* Load an object into memory */
 static uintptr_t object_load(elf_t * object, uintptr_t base) {
 
@@ -286,19 +403,21 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 		switch (phdr.p_type) {
 			case PT_LOAD:
 				{
-					/* Request memory to load this PHDR into */
-					char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
-					sysfunc(TOARU_SYS_FUNC_MMAP, args);
-
-					/* Copy the code into memory */
-					fseek(object->file, phdr.p_offset, SEEK_SET);
-					fread((void *)(base + phdr.p_vaddr), phdr.p_filesz, 1, object->file);
-
-					/* Zero the remaining area */
-					size_t r = phdr.p_filesz;
-					while (r < phdr.p_memsz) {
-						*(char *)(phdr.p_vaddr + base + r) = 0;
-						r++;
+					if (object_map_segment(object, base, &phdr)) {
+						/* Request memory to load this PHDR into */
+						char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
+						sysfunc(TOARU_SYS_FUNC_MMAP, args);
+
+						/* Copy the code into memory */
+						fseek(object->file, phdr.p_offset, SEEK_SET);
+						fread((void *)(base + phdr.p_vaddr), phdr.p_filesz, 1, object->file);
+
+						/* Zero the remaining area */
+						size_t r = phdr.p_filesz;
+						while (r < phdr.p_memsz) {
+							*(char *)(phdr.p_vaddr + base + r) = 0;
+							r++;
+						}
 					}
 
 					/* If this expands our end address, be sure to update it */
@@ -313,6 +432,15 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 					object->dynamic = (Elf32_Dyn *)(base + phdr.p_vaddr);
 				}
 				break;
+			case PT_TLS:
+				{
+					/* Also inside a PT_LOAD; it's copied out for each thread */
+					object->tls_image  = base + phdr.p_vaddr;
+					object->tls_filesz = phdr.p_filesz;
+					object->tls_memsz  = phdr.p_memsz;
+					object->tls_align  = phdr.p_align ? phdr.p_align : 1;
+				}
+				break;
 			default:
 				break;
 		}
@@ -323,6 +451,8 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 	return end_addr;
 }
 
+static size_t gnu_hash_symbol_count(Elf32_Word * table);
+
 /* Perform cleanup after loading */
 static int object_postload(elf_t * object) {
 
@@ -334,6 +464,12 @@ static int object_postload(elf_t * object) {
 		table = object->dynamic;
 		while (table->d_tag) {
 			switch (table->d_tag) {
+				case 2: /* DT_PLTRELSZ */
+					object->jmprel_size = table->d_un.d_val;
+					break;
+				case 3: /* DT_PLTGOT */
+					object->plt_got = (uintptr_t *)(object->base + table->d_un.d_ptr);
+					break;
 				case 4:
 					object->dyn_hash = (Elf32_Word *)(object->base + table->d_un.d_ptr);
 					object->dyn_symbol_table_size = object->dyn_hash[1];
@@ -347,6 +483,18 @@ static int object_postload(elf_t * object) {
 				case 10: /* Size of string table */
 					object->dyn_string_table_size = table->d_un.d_val;
 					break;
+				case 17: /* DT_REL */
+					object->rel = (Elf32_Rel *)(object->base + table->d_un.d_ptr);
+					break;
+				case 18: /* DT_RELSZ */
+					object->rel_size = table->d_un.d_val;
+					break;
+				case 23: /* DT_JMPREL */
+					object->jmprel = (Elf32_Rel *)(object->base + table->d_un.d_ptr);
+					break;
+				case 0x6ffffef5: /* DT_GNU_HASH */
+					object->gnu_hash = (Elf32_Word *)(object->base + table->d_un.d_ptr);
+					break;
 				case 12: /* DT_INIT - initialization function */
 					object->init = (void (*)(void))(table->d_un.d_ptr + object->base);
 					break;
@@ -360,6 +508,17 @@ static int object_postload(elf_t * object) {
 			table++;
 		}
 
+		if (object->gnu_hash && !object->dyn_hash) {
+			object->dyn_symbol_table_size = gnu_hash_symbol_count(object->gnu_hash);
+		}
+
+		/* Some linkers fold the PLT relocations into DT_REL as well */
+		if (object->rel && object->jmprel &&
+				object->jmprel >= object->rel &&
+				(uintptr_t)object->jmprel < (uintptr_t)object->rel + object->rel_size) {
+			object->rel_size = (uintptr_t)object->jmprel - (uintptr_t)object->rel;
+		}
+
 		/*
 		 * Read through dependencies
 		 * We have to do this separately from the above to make sure
@@ -394,116 +553,613 @@ static int need_symbol_for_type(unsigned char type) {
 	}
 }
 
+/* SysV ELF hash, as used by DT_HASH */
+static uint32_t elf_hash(const char * name) {
+	uint32_t h = 0;
+	while (*name) {
+		h = (h << 4) + (unsigned char)*name++;
+		uint32_t g = h & 0xF0000000;
+		if (g) h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+/* DJB hash, as used by DT_GNU_HASH */
+static uint32_t gnu_hash(const char * name) {
+	uint32_t h = 5381;
+	while (*name) {
+		h = (h << 5) + h + (unsigned char)*name++;
+	}
+	return h;
+}
+
+/* DT_GNU_HASH does not record the size of the symbol table, so find the last chain entry */
+static size_t gnu_hash_symbol_count(Elf32_Word * table) {
+	uint32_t nbuckets   = table[0];
+	uint32_t symoffset  = table[1];
+	uint32_t bloom_size = table[2];
+	Elf32_Word * buckets = &table[4 + bloom_size];
+	Elf32_Word * chain   = &buckets[nbuckets];
+
+	uint32_t last = 0;
+	for (uint32_t i = 0; i < nbuckets; ++i) {
+		if (buckets[i] > last) last = buckets[i];
+	}
+	if (last < symoffset) return symoffset;
+	while (!(chain[last - symoffset] & 1)) last++;
+	return last + 1;
+}
+
+/* Find a defined symbol in one object, using its hash table if it has one. */
+static Elf32_Sym * object_lookup(elf_t * object, const char * name, uint32_t hash, uint32_t ghash) {
+	if (!object->dyn_symbol_table) return NULL;
+
+	if (object->gnu_hash) {
+		Elf32_Word * table = object->gnu_hash;
+		uint32_t nbuckets    = table[0];
+		uint32_t symoffset   = table[1];
+		uint32_t bloom_size  = table[2];
+		uint32_t bloom_shift = table[3];
+		Elf32_Word * bloom   = &table[4];
+		Elf32_Word * buckets = &bloom[bloom_size];
+		Elf32_Word * chain   = &buckets[nbuckets];
+
+		uint32_t word = bloom[(ghash / 32) % bloom_size];
+		uint32_t mask = (1 << (ghash % 32)) | (1 << ((ghash >> bloom_shift) % 32));
+		if ((word & mask) != mask) return NULL;
+
+		uint32_t i = buckets[ghash % nbuckets];
+		if (i < symoffset) return NULL;
+		while (1) {
+			uint32_t h = chain[i - symoffset];
+			if ((h | 1) == (ghash | 1)) {
+				Elf32_Sym * sym = &object->dyn_symbol_table[i];
+				if (sym->st_shndx && !strcmp(name, object->dyn_string_table + sym->st_name)) return sym;
+			}
+			if (h & 1) break;
+			i++;
+		}
+		return NULL;
+	}
+
+	if (object->dyn_hash) {
+		uint32_t nbucket = object->dyn_hash[0];
+		Elf32_Word * bucket = &object->dyn_hash[2];
+		Elf32_Word * chain  = &bucket[nbucket];
+		for (uint32_t i = bucket[hash % nbucket]; i; i = chain[i]) {
+			Elf32_Sym * sym = &object->dyn_symbol_table[i];
+			if (sym->st_shndx && !strcmp(name, object->dyn_string_table + sym->st_name)) return sym;
+		}
+		return NULL;
+	}
+
+	Elf32_Sym * sym = object->dyn_symbol_table;
+	for (size_t i = 0; i < object->dyn_symbol_table_size; ++i, ++sym) {
+		if (sym->st_shndx && !strcmp(name, object->dyn_string_table + sym->st_name)) return sym;
+	}
+	return NULL;
+}
+
+typedef struct {
+	char * name;
+	void * symbol;
+} ld_exports_t;
+extern ld_exports_t ld_builtin_exports[];
+
+/*
+ * Resolve a symbol against everything relocated so far: our own
+ * exports first, then objects in the order they were relocated.
+ */
+static int ld_lookup(const char * name, uintptr_t * out) {
+	ld_stats.lookups++;
+
+	for (ld_exports_t * ex = ld_builtin_exports; ex->name; ex++) {
+		if (!strcmp(ex->name, name)) {
+			*out = (uintptr_t)ex->symbol;
+			return 1;
+		}
+	}
+
+	uint32_t hash  = elf_hash(name);
+	uint32_t ghash = gnu_hash(name);
+	foreach(node, symbol_search_list) {
+		elf_t * object = node->value;
+		Elf32_Sym * sym = object_lookup(object, name, hash, ghash);
+		if (sym) {
+			*out = sym->st_value + object->base;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Called (through _ld_lazy_trampoline) the first time a PLT entry is
+ * used; binds the GOT slot and returns the real target.
+ */
+__attribute__((used))
+static uintptr_t ld_lazy_resolve(elf_t * object, uint32_t offset) {
+	Elf32_Rel * rel = (Elf32_Rel *)((uintptr_t)object->jmprel + offset);
+	Elf32_Sym * sym = &object->dyn_symbol_table[ELF32_R_SYM(rel->r_info)];
+	char * symname = object->dyn_string_table + sym->st_name;
+
+	uintptr_t x;
+	if (!ld_lookup(symname, &x)) {
+		fprintf(stderr, "ld.so: symbol not found: %s\n", symname);
+		exit(1);
+	}
+
+	TRACE_LD("Bound %s to 0x%x", symname, x);
+	*(uintptr_t *)(rel->r_offset + object->base) = x;
+	return x;
+}
+
+/*
+ * PLT0 pushes GOT[1] (the object) and jumps through GOT[2] to here,
+ * with the relocation offset pushed by the PLT entry below that.
+ */
+__asm__(
+	".text\n"
+	"_ld_lazy_trampoline:\n"
+	"	pushl %eax\n"
+	"	pushl %ecx\n"
+	"	pushl %edx\n"
+	"	pushl 16(%esp)\n"       /* relocation offset */
+	"	pushl 16(%esp)\n"       /* object */
+	"	call ld_lazy_resolve\n"
+	"	addl $8, %esp\n"
+	"	movl %eax, 12(%esp)\n"  /* replace the object with the target */
+	"	popl %edx\n"
+	"	popl %ecx\n"
+	"	popl %eax\n"
+	"	ret $4\n"               /* to the target, dropping the offset */
+);
+extern void _ld_lazy_trampoline(void);
+
+/*
+ * Thread-local storage
+ *
+ * Only the static model: the blocks of everything loaded at startup
+ * are laid out once, one after another below the thread pointer (%gs:0)
+ * as the i386 ELF TLS ABI has it, with the executable's nearest since
+ * its offsets were fixed when it was linked. Every thread's copy is
+ * the same distance from its control block, so initial-exec code just
+ * adds an offset, and __tls_get_addr() never has to allocate anything.
+ * Libraries with thread-local storage can't be dlopen()ed later.
+ */
+static struct {
+	size_t size;        /* Of all the blocks, from the lowest to the thread pointer */
+	size_t align;
+	size_t modules;
+	list_t * objects;   /* With blocks, in module order */
+	size_t * offsets;   /* By module ID */
+} tls;
+
+static void tls_assign(elf_t * object) {
+	if (!object->tls_memsz) return;
+	tls.size = (tls.size + object->tls_memsz + object->tls_align - 1) & ~(object->tls_align - 1);
+	if (object->tls_align > tls.align) tls.align = object->tls_align;
+	object->tls_offset = tls.size;
+	object->tls_module = ++tls.modules;
+	list_insert(tls.objects, object);
+	TRACE_LD("TLS module %d: %d bytes at -0x%x", object->tls_module, object->tls_memsz, object->tls_offset);
+}
+
+static size_t tls_size_ld(void) {
+	if (!tls.align) return 0;
+	return (tls.size + tls.align - 1) & ~(tls.align - 1);
+}
+
+/* Fill in a thread's blocks from the images */
+static void tls_init_ld(tls_tcb_t * tcb) {
+	foreach(node, tls.objects) {
+		elf_t * object = node->value;
+		char * block = (char *)tcb - object->tls_offset;
+		memcpy(block, (void *)object->tls_image, object->tls_filesz);
+		memset(block + object->tls_filesz, 0, object->tls_memsz - object->tls_filesz);
+	}
+}
+
+/* Give the main thread its control block and blocks, once relocations are done */
+static void tls_start(void) {
+	size_t below = (tls_size_ld() + 0xFFF) & ~0xFFF;
+	size_t size = below + ((sizeof(tls_tcb_t) + 0xFFF) & ~0xFFF);
+	char * base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		if (tls.modules) {
+			fprintf(stderr, "ld.so: could not allocate thread-local storage\n");
+			exit(1);
+		}
+		return;
+	}
+
+	tls.offsets = malloc(sizeof(size_t) * (tls.modules + 1));
+	foreach(node, tls.objects) {
+		elf_t * object = node->value;
+		tls.offsets[object->tls_module] = object->tls_offset;
+	}
+
+	tls_tcb_t * tcb = (tls_tcb_t *)(base + below);
+	tcb->self = tcb;
+	tcb->errno_value = 0;
+	tcb->thread = NULL;
+	tcb->malloc_cache = NULL;
+	tls_init_ld(tcb);
+	settls(tcb);
+}
+
+typedef struct {
+	uintptr_t module;
+	uintptr_t offset;
+} tls_index_t;
+
+/* General- and local-dynamic code asks for its variables by module and offset */
+static void * tls_get_addr(tls_index_t * index) {
+	return (char *)__tls_tcb() - tls.offsets[index->module] + index->offset;
+}
+
+/* The GNU variant takes its argument in %eax */
+static void * __attribute__((regparm(1))) tls_get_addr_gnu(tls_index_t * index) {
+	return tls_get_addr(index);
+}
+
+/* The object a TLS relocation's symbol is in, and its offset in that object's block */
+static elf_t * tls_lookup(elf_t * object, unsigned int symbol, uintptr_t * offset) {
+	Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
+	if (!symbol) {
+		*offset = 0;
+		return object;
+	}
+
+	char * name = object->dyn_string_table + sym->st_name;
+	uint32_t hash  = elf_hash(name);
+	uint32_t ghash = gnu_hash(name);
+	ld_stats.lookups++;
+	foreach(node, symbol_search_list) {
+		elf_t * other = node->value;
+		Elf32_Sym * found = object_lookup(other, name, hash, ghash);
+		if (found && ELF32_ST_TYPE(found->st_info) == STT_TLS) {
+			*offset = found->st_value;
+			return other;
+		}
+	}
+
+	if (sym->st_shndx) {
+		*offset = sym->st_value;
+		return object;
+	}
+
+	TRACE_LD("TLS symbol not found: %s", name);
+	return NULL;
+}
+
+/* Store a relocated value, noting it down if we're prelinking */
+static void reloc_store(elf_t * object, uintptr_t addr, uintptr_t value, size_t copy) {
+	if (copy) {
+		memcpy((void *)addr, (void *)value, copy);
+	} else {
+		memcpy((void *)addr, &value, sizeof(uintptr_t));
+	}
+
+	if (!_prelink) return;
+	if (object->writes_count == object->writes_space) {
+		size_t space = object->writes_space ? object->writes_space * 2 : 256;
+		ld_cache_write_t * writes = malloc(space * sizeof(ld_cache_write_t));
+		if (object->writes) {
+			memcpy(writes, object->writes, object->writes_count * sizeof(ld_cache_write_t));
+			free(object->writes);
+		}
+		object->writes = writes;
+		object->writes_space = space;
+	}
+	ld_cache_write_t * w = &object->writes[object->writes_count++];
+	w->addr  = addr;
+	w->value = value;
+	w->size  = copy;
+}
+
+/* Apply one table of relocations */
+static void object_apply_relocations(elf_t * object, Elf32_Rel * table, size_t size, int lazy) {
+	Elf32_Rel * end = (Elf32_Rel *)((uintptr_t)table + size);
+	for (; table < end; table++) {
+		unsigned int  symbol = ELF32_R_SYM(table->r_info);
+		unsigned char type = ELF32_R_TYPE(table->r_info);
+		Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
+
+		ld_stats.relocations++;
+
+		if (type == 14 || (type >= 35 && type <= 37)) {
+			uintptr_t where = table->r_offset + object->base;
+			uintptr_t offset;
+			elf_t * def = tls_lookup(object, symbol, &offset);
+			if (!def || !def->tls_module) continue;
+			uintptr_t x = *(uintptr_t *)where;
+			switch (type) {
+				case 14: /* TLS_TPOFF */
+					x += offset - def->tls_offset;
+					break;
+				case 35: /* TLS_DTPMOD32 */
+					x = def->tls_module;
+					break;
+				case 36: /* TLS_DTPOFF32 */
+					x += offset;
+					break;
+				case 37: /* TLS_TPOFF32 */
+					x += def->tls_offset - offset;
+					break;
+			}
+			reloc_store(object, where, x, 0);
+			continue;
+		}
+
+		if (type == 7 && lazy) {
+			/* Leave the slot pointing back at its PLT entry until first use */
+			uintptr_t * slot = (uintptr_t *)(table->r_offset + object->base);
+			reloc_store(object, (uintptr_t)slot, *slot + object->base, 0);
+			ld_stats.lazy_slots++;
+			continue;
+		}
+
+		/* If we need symbol for this, get it. */
+		char * symname = NULL;
+		uintptr_t x = sym->st_value + object->base;
+		if (need_symbol_for_type(type) || (type == 5)) {
+			symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
+			if (!symname || !ld_lookup(symname, &x)) {
+				/* This isn't fatal, but do log a message if debugging is enabled. */
+				TRACE_LD("Symbol not found: %s", symname);
+				x = 0x0;
+			}
+		}
+
+		/* Relocations, symbol lookups, etc. */
+		switch (type) {
+			case 6: /* GLOB_DAT */
+				/* Copy relocations take precedence; x is left alone if there isn't one */
+				if (symname) hashmap_lookup(glob_dat, symname, (void **)&x);
+			case 7: /* JUMP_SLOT */
+				reloc_store(object, table->r_offset + object->base, x, 0);
+				break;
+			case 1: /* 32 */
+				x += *((ssize_t *)(table->r_offset + object->base));
+				reloc_store(object, table->r_offset + object->base, x, 0);
+				break;
+			case 2: /* PC32 */
+				x += *((ssize_t *)(table->r_offset + object->base));
+				x -= (table->r_offset + object->base);
+				reloc_store(object, table->r_offset + object->base, x, 0);
+				break;
+			case 8: /* RELATIVE */
+				x = object->base;
+				x += *((ssize_t *)(table->r_offset + object->base));
+				reloc_store(object, table->r_offset + object->base, x, 0);
+				break;
+			case 5: /* COPY */
+				if (sym->st_size) reloc_store(object, table->r_offset + object->base, x, sym->st_size);
+				break;
+			default:
+				TRACE_LD("Unknown relocation type: %d", type);
+		}
+	}
+}
+
+/* Point the PLT's first entry at the lazy binder */
+static void object_setup_lazy(elf_t * object) {
+	object->plt_got[1] = (uintptr_t)object;
+	object->plt_got[2] = (uintptr_t)&_ld_lazy_trampoline;
+}
+
 /* Apply ELF relocations */
 static int object_relocate(elf_t * object) {
 
-	/* If there is a dynamic symbol table, load symbols */
-	if (object->dyn_symbol_table) {
-		Elf32_Sym * table = object->dyn_symbol_table;
-		size_t i = 0;
-		while (i < object->dyn_symbol_table_size) {
-			char * symname = (char *)((uintptr_t)object->dyn_string_table + table->st_name);
-
-			/* If we haven't added this symbol to our symbol table, do so now. */
-			if (!hashmap_has(dumb_symbol_table, symname)) {
-				if (table->st_shndx) {
-					hashmap_set(dumb_symbol_table, symname, (void*)(table->st_value + object->base));
-				}
-			}
+	/* From here on, this object's symbols are visible to lookups */
+	list_insert(symbol_search_list, object);
+	ld_stats.objects++;
 
-			table++;
-			i++;
+	if (object->rel) {
+		object_apply_relocations(object, object->rel, object->rel_size, 0);
+	}
+
+	if (object->jmprel) {
+		int lazy = !_bind_now && object->plt_got;
+		object_apply_relocations(object, object->jmprel, object->jmprel_size, lazy);
+		if (lazy) {
+			object_setup_lazy(object);
 		}
 	}
 
-	/* Find relocation table */
-	for (uintptr_t x = 0; x < object->header.e_shentsize * object->header.e_shnum; x += object->header.e_shentsize) {
-		Elf32_Shdr shdr;
-		/* Load section header */
-		fseek(object->file, object->header.e_shoff + x, SEEK_SET);
-		fread(&shdr, object->header.e_shentsize, 1, object->file);
-
-		/* Relocation table found */
-		if (shdr.sh_type == 9) {
-			Elf32_Rel * table = (Elf32_Rel *)(shdr.sh_addr + object->base);
-			while ((uintptr_t)table - ((uintptr_t)shdr.sh_addr + object->base) < shdr.sh_size) {
-				unsigned int  symbol = ELF32_R_SYM(table->r_info);
-				unsigned char type = ELF32_R_TYPE(table->r_info);
-				Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
-
-				/* If we need symbol for this, get it. */
-				char * symname = NULL;
-				uintptr_t x = sym->st_value + object->base;
-				if (need_symbol_for_type(type) || (type == 5)) {
-					symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
-					if (symname && hashmap_has(dumb_symbol_table, symname)) {
-						x = (uintptr_t)hashmap_get(dumb_symbol_table, symname);
-					} else {
-						/* This isn't fatal, but do log a message if debugging is enabled. */
-						TRACE_LD("Symbol not found: %s", symname);
-						x = 0x0;
-					}
-				}
+	return 0;
+}
 
-				/* Relocations, symbol lookups, etc. */
-				switch (type) {
-					case 6: /* GLOB_DAT */
-						if (symname && hashmap_has(glob_dat, symname)) {
-							x = (uintptr_t)hashmap_get(glob_dat, symname);
-						}
-					case 7: /* JUMP_SLOT */
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 1: /* 32 */
-						x += *((ssize_t *)(table->r_offset + object->base));
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 2: /* PC32 */
-						x += *((ssize_t *)(table->r_offset + object->base));
-						x -= (table->r_offset + object->base);
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 8: /* RELATIVE */
-						x = object->base;
-						x += *((ssize_t *)(table->r_offset + object->base));
-						memcpy((void *)(table->r_offset + object->base), &x, sizeof(uintptr_t));
-						break;
-					case 5: /* COPY */
-						memcpy((void *)(table->r_offset + object->base), (void *)x, sym->st_size);
-						break;
-					default:
-						TRACE_LD("Unknown relocation type: %d", type);
-				}
+/*
+ * Prelinking
+ *
+ * An executable's libraries always go in the same places - one after
+ * another, after the executable - so as long as none of the files
+ * change, relocating them writes the same values to the same addresses
+ * every time. `ld.so --prelink /bin/foo` records those writes in a
+ * cache file. When the executable starts again, we check that it and
+ * every library are still the same files at the same addresses, and
+ * replay the writes instead of looking up any symbols. If anything is
+ * different, the cache is ignored and we relocate the usual way.
+ *
+ * Caches are only trusted if root owns them and nobody else can write
+ * them, since they can write anywhere in the process.
+ */
+#define LD_CACHE_DIR     "/var/ld"
+#define LD_CACHE_MAGIC   0x314B4C50 /* PLK1 */
+#define LD_CACHE_VERSION 1
+
+/* Caches are named after the executable's path, with '%' for '/' */
+static char * cache_path(const char * file) {
+	char * out = malloc(strlen(LD_CACHE_DIR) + strlen(file) + 2);
+	char * c = out + sprintf(out, "%s/", LD_CACHE_DIR);
+	for (; *file; ++file) {
+		*c++ = (*file == '/') ? '%' : *file;
+	}
+	*c = '\0';
+	return out;
+}
+
+/* FNV-1a, just to notice a cache that was cut short or damaged */
+static uint32_t cache_checksum(const void * buf, size_t len) {
+	const uint8_t * b = buf;
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i) {
+		h = (h ^ b[i]) * 16777619u;
+	}
+	return h;
+}
+
+static int cache_matches(ld_cache_object_t * rec, elf_t * object) {
+	return rec->base  == object->base &&
+	       rec->dev   == (uint32_t)object->st.st_dev &&
+	       rec->ino   == (uint32_t)object->st.st_ino &&
+	       rec->size  == (uint32_t)object->st.st_size &&
+	       rec->mtime == (uint32_t)object->st.st_mtime;
+}
+
+/*
+ * Apply the executable's prelink cache, if it has one and it is still
+ * good for `objects` (everything loaded, in load order). Returns 1 if
+ * it was used; otherwise nothing has been written.
+ */
+static int prelink_apply(const char * file, list_t * objects) {
+	if (file[0] != '/') return 0;
+
+	char * path = cache_path(file);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0) return 0;
+
+	struct stat st;
+	char * cache = NULL;
+	if (fstat(fd, &st) || st.st_uid != 0 || (st.st_mode & 022) || st.st_size < (off_t)sizeof(ld_cache_header_t)) goto _fail;
+
+	size_t size = st.st_size;
+	cache = malloc(size);
+	if (read(fd, cache, size) != (ssize_t)size) goto _fail;
+
+	ld_cache_header_t * header = (ld_cache_header_t *)cache;
+	if (header->magic != LD_CACHE_MAGIC || header->version != LD_CACHE_VERSION ||
+			header->objects != objects->length ||
+			header->checksum != cache_checksum(cache + sizeof(ld_cache_header_t), size - sizeof(ld_cache_header_t))) {
+		TRACE_LD("Prelink cache for %s is out of date", file);
+		goto _fail;
+	}
 
-				table++;
+	/* Check everything before touching anything */
+	char * at = cache + sizeof(ld_cache_header_t);
+	char * end = cache + size;
+	foreach(node, objects) {
+		elf_t * object = node->value;
+		ld_cache_object_t * rec = (ld_cache_object_t *)at;
+		if (end - at < (ssize_t)sizeof(ld_cache_object_t)) goto _stale;
+		at += sizeof(ld_cache_object_t);
+		size_t name_space = (rec->name_len + 3) & ~3;
+		if ((size_t)(end - at) < name_space ||
+				(size_t)(end - at - name_space) / sizeof(ld_cache_write_t) < rec->count) goto _stale;
+		if (rec->name_len != strlen(object->name) || memcmp(at, object->name, rec->name_len)) goto _stale;
+		if (!cache_matches(rec, object)) goto _stale;
+		at += name_space + rec->count * sizeof(ld_cache_write_t);
+	}
+
+	at = cache + sizeof(ld_cache_header_t);
+	foreach(node, objects) {
+		elf_t * object = node->value;
+		ld_cache_object_t * rec = (ld_cache_object_t *)at;
+		ld_cache_write_t * w = (ld_cache_write_t *)(at + sizeof(ld_cache_object_t) + ((rec->name_len + 3) & ~3));
+		for (uint32_t i = 0; i < rec->count; ++i, ++w) {
+			if (w->size) {
+				memcpy((void *)w->addr, (void *)w->value, w->size);
+			} else {
+				*(uintptr_t *)w->addr = w->value;
 			}
 		}
+		ld_stats.prelinked += rec->count;
+		at = (char *)w;
+
+		list_insert(symbol_search_list, object);
+		ld_stats.objects++;
+		if (object->jmprel && object->plt_got) {
+			object_setup_lazy(object);
+		}
 	}
 
+	free(cache);
+	close(fd);
+	return 1;
+
+_stale:
+	TRACE_LD("Prelink cache for %s doesn't match what was loaded", file);
+_fail:
+	free(cache);
+	close(fd);
 	return 0;
 }
 
+/* Write out what relocating `objects` did, for next time */
+static int prelink_save(const char * file, list_t * objects) {
+	size_t size = sizeof(ld_cache_header_t);
+	foreach(node, objects) {
+		elf_t * object = node->value;
+		size += sizeof(ld_cache_object_t) + ((strlen(object->name) + 3) & ~3) + object->writes_count * sizeof(ld_cache_write_t);
+	}
+
+	char * cache = malloc(size);
+	memset(cache, 0, size);
+	ld_cache_header_t * header = (ld_cache_header_t *)cache;
+	header->magic   = LD_CACHE_MAGIC;
+	header->version = LD_CACHE_VERSION;
+	header->objects = objects->length;
+
+	char * at = cache + sizeof(ld_cache_header_t);
+	foreach(node, objects) {
+		elf_t * object = node->value;
+		ld_cache_object_t * rec = (ld_cache_object_t *)at;
+		rec->base     = object->base;
+		rec->dev      = object->st.st_dev;
+		rec->ino      = object->st.st_ino;
+		rec->size     = object->st.st_size;
+		rec->mtime    = object->st.st_mtime;
+		rec->name_len = strlen(object->name);
+		rec->count    = object->writes_count;
+		at += sizeof(ld_cache_object_t);
+		memcpy(at, object->name, rec->name_len);
+		at += (rec->name_len + 3) & ~3;
+		memcpy(at, object->writes, object->writes_count * sizeof(ld_cache_write_t));
+		at += object->writes_count * sizeof(ld_cache_write_t);
+	}
+	header->checksum = cache_checksum(cache + sizeof(ld_cache_header_t), size - sizeof(ld_cache_header_t));
+
+	mkdir(LD_CACHE_DIR, 0755);
+	char * path = cache_path(file);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int ret = 0;
+	if (fd < 0 || write(fd, cache, size) != (ssize_t)size) {
+		fprintf(stderr, "ld.so: %s: could not write prelink cache\n", path);
+		ret = 1;
+	}
+	if (fd >= 0) close(fd);
+	free(path);
+	free(cache);
+	return ret;
+}
+
 /* Copy relocations are special and need to be located before other relocations. */
 static void object_find_copy_relocations(elf_t * object) {
-
-	for (uintptr_t x = 0; x < object->header.e_shentsize * object->header.e_shnum; x += object->header.e_shentsize) {
-		Elf32_Shdr shdr;
-		fseek(object->file, object->header.e_shoff + x, SEEK_SET);
-		fread(&shdr, object->header.e_shentsize, 1, object->file);
-
-		/* Relocation table found */
-		if (shdr.sh_type == 9) {
-			Elf32_Rel * table = (Elf32_Rel *)(shdr.sh_addr + object->base);
-			while ((uintptr_t)table - ((uintptr_t)shdr.sh_addr + object->base) < shdr.sh_size) {
-				unsigned char type = ELF32_R_TYPE(table->r_info);
-				if (type == 5) {
-					unsigned int  symbol = ELF32_R_SYM(table->r_info);
-					Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
-					char * symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
-					hashmap_set(glob_dat, symname, (void *)table->r_offset);
-				}
-				table++;
-			}
+	if (!object->rel) return;
+
+	Elf32_Rel * table = object->rel;
+	Elf32_Rel * end = (Elf32_Rel *)((uintptr_t)table + object->rel_size);
+	for (; table < end; table++) {
+		unsigned char type = ELF32_R_TYPE(table->r_info);
+		if (type == 5) {
+			unsigned int  symbol = ELF32_R_SYM(table->r_info);
+			Elf32_Sym * sym = &object->dyn_symbol_table[symbol];
+			char * symname = (char *)((uintptr_t)object->dyn_string_table + sym->st_name);
+			hashmap_set(glob_dat, symname, (void *)table->r_offset);
 		}
 	}
 }
@@ -516,14 +1172,9 @@ static void * object_find_symbol(elf_t * object, const char * symbol_name) {
 		return NULL;
 	}
 
-	Elf32_Sym * table = object->dyn_symbol_table;
-	size_t i = 0;
-	while (i < object->dyn_symbol_table_size) {
-		if (!strcmp(symbol_name, (char *)((uintptr_t)object->dyn_string_table + table->st_name))) {
-			return (void *)(table->st_value + object->base);
-		}
-		table++;
-		i++;
+	Elf32_Sym * sym = object_lookup(object, symbol_name, elf_hash(symbol_name), gnu_hash(symbol_name));
+	if (sym) {
+		return (void *)(sym->st_value + object->base);
 	}
 
 	last_error = "symbol not found in library";
@@ -547,14 +1198,24 @@ static void * do_actual_load(const char * filename, elf_t * lib, int flags) {
 		lib_size = 4096;
 	}
 
-	/*
-	 * Allocate space to load the library
-	 * This is where we should really be loading things into COW
-	 * but we don't have the functionality available.
-	 */
-	uintptr_t load_addr = (uintptr_t)malloc(lib_size);
+	/* Reserve page-aligned space for the library; its segments are mapped over it */
+	void * region = mmap(NULL, lib_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		last_error = "could not reserve memory for library";
+		return NULL;
+	}
+	uintptr_t load_addr = (uintptr_t)region;
+	lib->size = lib_size;
 	object_load(lib, load_addr);
 
+	/* Threads that already exist have no room for another block */
+	if (lib->tls_memsz) {
+		munmap((void *)load_addr, lib_size);
+		last_error = "library uses thread-local storage";
+		lib->loaded = 0;
+		return NULL;
+	}
+
 	/* Perform cleanup steps */
 	object_postload(lib);
 
@@ -567,7 +1228,7 @@ static void * do_actual_load(const char * filename, elf_t * lib, int flags) {
 		if (!_lib) {
 			/* Missing dependencies are fatal to this process, but
 			 * not to the entire application. */
-			free((void *)load_addr);
+			munmap((void *)load_addr, lib_size);
 			last_error = "Failed to load a dependency.";
 			lib->loaded = 0;
 			TRACE_LD("Failed to load object: %s", item->value);
@@ -635,7 +1296,9 @@ static void * dlopen_ld(const char * filename, int flags) {
 /* exposed dlclose() method - XXX not fully implemented */
 static int dlclose_ld(elf_t * lib) {
 	/* TODO close dependencies? Make sure nothing references this. */
-	free((void *)lib->base);
+	if (lib->size) {
+		munmap((void *)lib->base, lib->size);
+	}
 	return 0;
 }
 
@@ -653,16 +1316,16 @@ static char * argv_value(void) {
 }
 
 /* Exported methods (dlfcn) */
-typedef struct {
-	char * name;
-	void * symbol;
-} ld_exports_t;
 ld_exports_t ld_builtin_exports[] = {
 	{"dlopen", dlopen_ld},
 	{"dlsym", object_find_symbol},
 	{"dlclose", dlclose_ld},
 	{"dlerror", dlerror_ld},
 	{"__get_argv", argv_value},
+	{"__ld_tls_size", tls_size_ld},
+	{"__ld_tls_init", tls_init_ld},
+	{"__tls_get_addr", tls_get_addr},
+	{"___tls_get_addr", tls_get_addr_gnu},
 	{NULL, NULL},
 };
 
@@ -676,6 +1339,16 @@ int main(int argc, char * argv[]) {
 		file = argv[2];
 	}
 
+	if (!strcmp(argv[1], "--prelink")) {
+		if (argc < 3 || argv[2][0] != '/') {
+			fprintf(stderr, "usage: %s --prelink /path/to/executable\n", argv[0]);
+			return 1;
+		}
+		_prelink = 1;
+		arg_offset = 2;
+		file = argv[2];
+	}
+
 	_argv_value = argv+arg_offset;
 
 	/* Enable tracing if requested */
@@ -683,19 +1356,23 @@ int main(int argc, char * argv[]) {
 	if ((trace_ld_env && (!strcmp(trace_ld_env,"1") || !strcmp(trace_ld_env,"yes")))) {
 		__trace_ld = 1;
 	}
+	if (trace_ld_env && !strcmp(trace_ld_env,"statistics")) {
+		__stats_ld = 1;
+	}
 
-	/* Initialize hashmaps for symbols, GLOB_DATs, and objects */
-	dumb_symbol_table = hashmap_create(10);
-	glob_dat = hashmap_create(10);
-	objects_map = hashmap_create(10);
+	struct timeval start_time;
+	if (__stats_ld) gettimeofday(&start_time, NULL);
 
-	/* Setup symbols for built-in exports */
-	ld_exports_t * ex = ld_builtin_exports;
-	while (ex->name) {
-		hashmap_set(dumb_symbol_table, ex->name, ex->symbol);
-		ex++;
+	char * bind_now_env = getenv("LD_BIND_NOW");
+	if (bind_now_env && *bind_now_env) {
+		_bind_now = 1;
 	}
 
+	/* Initialize the symbol search list and hashmaps for GLOB_DATs and objects */
+	symbol_search_list = list_create();
+	glob_dat = hashmap_create(10);
+	objects_map = hashmap_create(10);
+
 	/* Technically there's a potential time-of-use probably if we check like this but
 	 * this is a toy linker for a toy OS so the fact that we even need to check suid
 	 * bits at all is outrageous
@@ -733,6 +1410,7 @@ int main(int argc, char * argv[]) {
 
 	list_t * ctor_libs = list_create();
 	list_t * init_libs = list_create();
+	list_t * load_order = list_create();
 
 	TRACE_LD("Loading dependencies.");
 	node_t * item;
@@ -755,8 +1433,7 @@ int main(int argc, char * argv[]) {
 		TRACE_LD("Loading %s at 0x%x", lib_name, end_addr);
 		end_addr = object_load(lib, end_addr);
 		object_postload(lib);
-		TRACE_LD("Relocating %s", lib_name);
-		object_relocate(lib);
+		list_insert(load_order, lib);
 
 		fclose(lib->file);
 
@@ -774,9 +1451,37 @@ nope:
 		free(item);
 	}
 
-	/* Relocate the main object */
-	TRACE_LD("Relocating main object");
-	object_relocate(main_obj);
+	/*
+	 * Relocate everything, libraries in the order they were loaded and
+	 * then the main object - unless there's a prelink cache for this
+	 * exact set of files, which already knows what that will write.
+	 */
+	list_insert(load_order, main_obj);
+
+	/* The executable's block goes nearest the thread pointer */
+	tls.objects = list_create();
+	tls_assign(main_obj);
+	foreach(node, load_order) {
+		if (node->value != main_obj) tls_assign(node->value);
+	}
+
+	if (!_prelink && !_bind_now && prelink_apply(file, load_order)) {
+		TRACE_LD("Used prelink cache");
+	} else {
+		foreach(node, load_order) {
+			elf_t * object = node->value;
+			TRACE_LD("Relocating %s", object == main_obj ? "main object" : object->name);
+			object_relocate(object);
+		}
+	}
+
+	if (_prelink) {
+		return prelink_save(file, load_order);
+	}
+
+	/* Blocks are copied from the images, so only now that those are relocated */
+	tls_start();
+
 	TRACE_LD("Placing heap at end");
 	while (end_addr & 0xFFF) {
 		end_addr++;
@@ -825,10 +1530,20 @@ nope:
 	}
 
 	/* Set heap functions for later usage */
-	if (hashmap_has(dumb_symbol_table, "malloc")) _malloc = hashmap_get(dumb_symbol_table, "malloc");
-	if (hashmap_has(dumb_symbol_table, "free")) _free = hashmap_get(dumb_symbol_table, "free");
+	uintptr_t heap_func;
+	if (ld_lookup("malloc", &heap_func)) _malloc = (void *)heap_func;
+	if (ld_lookup("free", &heap_func)) _free = (void *)heap_func;
 	_malloc_minimum = 0x40000000;
 
+	if (__stats_ld) {
+		struct timeval end_time;
+		gettimeofday(&end_time, NULL);
+		long elapsed = (end_time.tv_sec - start_time.tv_sec) * 1000000 + (end_time.tv_usec - start_time.tv_usec);
+		fprintf(stderr, "ld.so: %d objects, %d relocations (%d lazy), %d symbol lookups, %d prelinked writes\n",
+				(int)ld_stats.objects, (int)ld_stats.relocations, (int)ld_stats.lazy_slots, (int)ld_stats.lookups, (int)ld_stats.prelinked);
+		fprintf(stderr, "ld.so: startup took %ld.%03ld ms\n", elapsed / 1000, elapsed % 1000);
+	}
+
 	/* Jump to the entry for the main object */
 	TRACE_LD("Jumping to entry point");
 	entry_point_t entry = (entry_point_t)main_obj->header.e_entry;
@@ -15,7 +15,9 @@
 #include <kernel/mod/snd.h>
 #include <kernel/printf.h>
 #include <kernel/pci.h>
+#include <kernel/process.h>
 #include <kernel/system.h>
+#include <kernel/workqueue.h>
 
 /* Utility macros */
 #define N_ELEMENTS(arr) (sizeof(arr) / sizeof((arr)[0]))
@@ -40,6 +42,7 @@
 #define AC97_CL_SET_LENGTH(cl, v) ((cl) = (v) & 0xFFFF) /* Encode length to cl */
 #define AC97_CL_BUP               ((uint32_t)1 << 30)             /* Buffer underrun policy in cl */
 #define AC97_CL_IOC               ((uint32_t)1 << 31)             /* Interrupt on completion flag in cl */
+#define AC97_QUEUE_DEPTH          2                     /* Buffers kept mixed ahead of the one playing */
 
 /* PCM out control register flags */
 #define AC97_X_CR_RPBM  (1 << 0)  /* Run/pause bus master */
@@ -84,6 +87,7 @@ typedef struct {
 	uint16_t * bufs[AC97_BDL_LEN];  /* Virtual addresses for buffers in BDL */
 	uint32_t bdl_p;
 	uint32_t mask;
+	work_t refill;                  /* Queued whenever a buffer completes */
 } ac97_device_t;
 
 static ac97_device_t _device;
@@ -109,6 +113,7 @@ static snd_device_t _snd = {
 	.device          = &_device,
 	.playback_speed  = AC97_PLAYBACK_SPEED,
 	.playback_format = AC97_PLAYBACK_FORMAT,
+	.playback_period = AC97_BDL_BUFFER_LEN / 2, /* One buffer of 16-bit stereo */
 
 	.knobs     = _knobs,
 	.num_knobs = N_ELEMENTS(_knobs),
@@ -132,19 +137,24 @@ static void find_ac97(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 
 }
 
-#define DIVISION 0x1000
+/*
+ * Mixing is left to high priority work; all the interrupt handler does
+ * is note that a buffer finished and queue it. The work keeps the buffers
+ * after the one playing filled and marked valid; if the controller ever
+ * finishes the last valid buffer anyway, it has stopped for lack of
+ * data and we count an underrun. It starts again once the work
+ * moves the last valid index on.
+ */
 static int irq_handler(struct regs * regs) {
 	uint16_t sr = inports(_device.nabmbar + AC97_PO_SR);
 	if (!sr) return 0;
 
 	if (sr & AC97_X_SR_BCIS) {
-		size_t f = (_device.lvi + 2) % AC97_BDL_LEN;
-		for (size_t i = 0; i < AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]); i += DIVISION) {
-			snd_request_buf(&_snd, DIVISION, (uint8_t *)_device.bufs[f] + i);
-			//switch_task(1);
+		_snd.periods++;
+		if (sr & (AC97_X_SR_LVBCI | AC97_X_SR_DCH)) {
+			_snd.underruns++;
 		}
-		_device.lvi = (_device.lvi + 1) % AC97_BDL_LEN;
-		outportb(_device.nabmbar + AC97_PO_LVI, _device.lvi);
+		queue_work(&_device.refill);
 	} else if (sr & AC97_X_SR_LVBCI) {
 		debug_print(NOTICE, "ac97 irq is lvbci");
 	} else if (sr & AC97_X_SR_FIFOE) {
@@ -153,13 +163,23 @@ static int irq_handler(struct regs * regs) {
 		/* don't handle it */
 		return 0;
 	}
-	debug_print(NOTICE, "ac97 status register: 0x%4x", sr);
 	outports(_device.nabmbar + AC97_PO_SR, sr & 0x1E);
 
 	irq_ack(_device.irq);
 	return 1;
 }
 
+/* Falling behind is audible, so this runs in the high priority pool */
+static void ac97_refill(void * data) {
+	uint8_t civ = inportb(_device.nabmbar + AC97_PO_CIV);
+	while (((_device.lvi - civ) & (AC97_BDL_LEN - 1)) < AC97_QUEUE_DEPTH) {
+		uint8_t next = (_device.lvi + 1) % AC97_BDL_LEN;
+		snd_request_buf(&_snd, AC97_BDL_BUFFER_LEN * sizeof(*_device.bufs[0]), (uint8_t *)_device.bufs[next]);
+		_device.lvi = next;
+		outportb(_device.nabmbar + AC97_PO_LVI, _device.lvi);
+	}
+}
+
 /* Currently we just assume right and left are the same */
 static int ac97_mixer_read(uint32_t knob_id, uint32_t *val) {
 	uint16_t tmp;
@@ -242,6 +262,7 @@ static int init(void) {
 	_device.nabmbar = pci_read_field(_device.pci_device, AC97_NABMBAR, 2) & ((uint32_t) -1) << 1;
 	_device.nambar = pci_read_field(_device.pci_device, PCI_BAR0, 4) & ((uint32_t) -1) << 1;
 	_device.irq = pci_get_interrupt(_device.pci_device);
+	work_init(&_device.refill, ac97_refill, NULL, WORK_HIGH);
 	irq_install_handler(_device.irq, irq_handler, "ac97");
 	/* Enable all matter of interrupts */
 	outportb(_device.nabmbar + AC97_PO_CR, AC97_X_CR_FEIE | AC97_X_CR_IOCE);
@@ -288,6 +309,8 @@ static int init(void) {
 	/* Start things playing */
 	outportb(_device.nabmbar + AC97_PO_CR, inportb(_device.nabmbar + AC97_PO_CR) | AC97_X_CR_RPBM);
 
+	queue_work(&_device.refill);
+
 	debug_print(NOTICE, "AC97 initialized successfully");
 
 	return 0;
@@ -295,6 +318,7 @@ static int init(void) {
 
 static int fini(void) {
 	snd_unregister(&_snd);
+	cancel_work(&_device.refill);
 
 	free(_device.bdl);
 	for (int i = 0; i < AC97_BDL_LEN; i++) {
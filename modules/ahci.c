@@ -0,0 +1,673 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * AHCI Disk Driver
+ *
+ * Provides raw block access to SATA disks behind an AHCI controller.
+ * Each port has its own command slots and its own lock. Disks that
+ * support Native Command Queuing take as many commands at once as
+ * there are slots, so big transfers and concurrent callers keep the
+ * disk busy instead of waiting their turn; callers sleep until the
+ * completion interrupt. Disks are mounted as /dev/hdX, after any the
+ * ATA driver found, and behave like ATA disks to everything above.
+ *
+ * ATAPI devices behind AHCI are not supported.
+ *
+ * The number of slots used per disk can be limited with ahci_depth=
+ * on the kernel command line; ahci_depth=1 turns queuing off.
+ */
+
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
+#include <kernel/module.h>
+#include <kernel/fs.h>
+#include <kernel/printf.h>
+#include <kernel/pci.h>
+#include <kernel/args.h>
+#include <kernel/ata.h>
+#include <kernel/mutex.h>
+#include <kernel/block.h>
+
+#include <toaru/list.h>
+
+/* HBA registers */
+#define AHCI_CAP  0x00
+#define AHCI_GHC  0x04
+#define AHCI_IS   0x08
+#define AHCI_PI   0x0C
+#define AHCI_VS   0x10
+
+#define AHCI_CAP_NCQ (1 << 30)
+#define AHCI_GHC_IE  (1 << 1)
+#define AHCI_GHC_AE  (1UL << 31)
+
+/* Port registers, at 0x100 + port * 0x80 */
+#define PORT_CLB  0x00
+#define PORT_CLBU 0x04
+#define PORT_FB   0x08
+#define PORT_FBU  0x0C
+#define PORT_IS   0x10
+#define PORT_IE   0x14
+#define PORT_CMD  0x18
+#define PORT_TFD  0x20
+#define PORT_SIG  0x24
+#define PORT_SSTS 0x28
+#define PORT_SCTL 0x2C
+#define PORT_SERR 0x30
+#define PORT_SACT 0x34
+#define PORT_CI   0x38
+
+#define PORT_CMD_ST  (1 << 0)
+#define PORT_CMD_SUD (1 << 1)
+#define PORT_CMD_POD (1 << 2)
+#define PORT_CMD_FRE (1 << 4)
+#define PORT_CMD_FR  (1 << 14)
+#define PORT_CMD_CR  (1 << 15)
+
+#define PORT_IS_DONE  0x0000000F /* Register, PIO setup, DMA setup and set device bits FISes */
+#define PORT_IS_ERROR 0x78000000 /* Task file, host bus fatal, host bus data and interface errors */
+
+#define PORT_SIG_ATA  0x00000101
+#define PORT_DET_PRESENT 3
+
+/* Command header flags */
+#define CMD_FIS_LENGTH (sizeof(fis_h2d_t) / 4)
+#define CMD_WRITE      (1 << 6)
+#define CMD_PRDTL(n)   ((n) << 16)
+
+#define FIS_TYPE_H2D 0x27
+
+#define ATA_CMD_READ_FPDMA  0x60
+#define ATA_CMD_WRITE_FPDMA 0x61
+
+/* Identify words the ATA driver has no fields for */
+#define IDENTIFY_QUEUE_DEPTH 75
+#define IDENTIFY_SATA_CAPS   76
+#define IDENTIFY_SATA_NCQ    (1 << 8)
+
+#define ATA_SECTOR_SIZE 512
+
+/* Each slot moves up to this much per command, through a buffer of its own */
+#define AHCI_MAX_SLOTS    32
+#define AHCI_SLOT_SECTORS 128
+#define AHCI_SLOT_SIZE    (AHCI_SLOT_SECTORS * ATA_SECTOR_SIZE)
+
+/* Command tables are a header and one PRDT entry, kept 256 bytes apart */
+#define AHCI_TABLE_SIZE   0x100
+
+/* Spins to wait on the controller before giving up on it */
+#define AHCI_TIMEOUT 1000000
+
+typedef struct {
+	uint32_t flags;      /* FIS length, direction, PRDT length */
+	uint32_t prdbc;      /* Bytes transferred */
+	uint32_t ctba;       /* Command table */
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+typedef struct {
+	uint32_t dba;        /* Data buffer */
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc;        /* Byte count less one; bit 31 asks for an interrupt */
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct {
+	uint8_t fis_type;
+	uint8_t flags;       /* Bit 7: this is a command */
+	uint8_t command;
+	uint8_t feature_lo;
+	uint8_t lba0;
+	uint8_t lba1;
+	uint8_t lba2;
+	uint8_t device;
+	uint8_t lba3;
+	uint8_t lba4;
+	uint8_t lba5;
+	uint8_t feature_hi;
+	uint8_t count_lo;
+	uint8_t count_hi;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+} __attribute__((packed)) fis_h2d_t;
+
+typedef struct {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	ahci_prd_t prdt[1];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+struct ahci_port {
+	uintptr_t regs;
+	int index;
+	ata_identify_t identity;
+	uint64_t sectors;
+	int ncq;
+	int depth;           /* Slots in use for this disk */
+
+	ahci_cmd_header_t * headers;
+	uint8_t * tables;
+	uintptr_t tables_phys;
+	uint8_t * buffers[AHCI_MAX_SLOTS];
+	uintptr_t buffers_phys[AHCI_MAX_SLOTS];
+
+	mutex_t lock;        /* Slot bookkeeping, issuing and recovery; never held across a wait */
+	uint32_t busy;       /* Slots taken by callers */
+	uint32_t failed;     /* Slots whose commands were lost to an error */
+	volatile uint32_t fault; /* Error bits from the interrupt handler, until recovered */
+	list_t * wait;       /* Callers waiting on a command */
+	list_t * slot_wait;  /* Callers waiting for a free slot */
+
+	block_device_t block;
+};
+
+/* An issued command, and where its data goes */
+struct ahci_inflight {
+	int slot;
+	uint8_t * buf;
+	size_t bytes;
+};
+
+static uint32_t ahci_pci = 0;
+static uintptr_t ahci_base = 0;
+static int ahci_irq = 0;
+static int ahci_slots = 0;    /* Command slots the HBA has */
+static int ahci_depth_max = AHCI_MAX_SLOTS;
+static struct ahci_port * ahci_ports[32] = { NULL };
+static int ahci_count = 0;
+
+static uint32_t hba_read(int reg) {
+	return *(volatile uint32_t *)(ahci_base + reg);
+}
+
+static void hba_write(int reg, uint32_t val) {
+	*(volatile uint32_t *)(ahci_base + reg) = val;
+}
+
+static uint32_t port_read(struct ahci_port * port, int reg) {
+	return *(volatile uint32_t *)(port->regs + reg);
+}
+
+static void port_write(struct ahci_port * port, int reg, uint32_t val) {
+	*(volatile uint32_t *)(port->regs + reg) = val;
+}
+
+/* Spin until the masked register reads as `value`; returns 1 on timeout */
+static int port_spin(struct ahci_port * port, int reg, uint32_t mask, uint32_t value) {
+	for (int i = 0; i < AHCI_TIMEOUT; ++i) {
+		if ((port_read(port, reg) & mask) == value) return 0;
+	}
+	return 1;
+}
+
+static void find_ahci_pci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (pci_read_field(device, PCI_PROG_IF, 1) == 0x01 && !*((uint32_t *)extra)) {
+		*((uint32_t *)extra) = device;
+	}
+}
+
+static void ahci_port_stop(struct ahci_port * port) {
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_ST);
+	if (port_spin(port, PORT_CMD, PORT_CMD_CR, 0)) {
+		debug_print(WARNING, "ahci: port %d command list won't stop", port->index);
+	}
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_FRE);
+	if (port_spin(port, PORT_CMD, PORT_CMD_FR, 0)) {
+		debug_print(WARNING, "ahci: port %d FIS receive won't stop", port->index);
+	}
+}
+
+static int ahci_port_start(struct ahci_port * port) {
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_SUD | PORT_CMD_POD | PORT_CMD_FRE);
+	if (port_spin(port, PORT_TFD, ATA_SR_BSY | ATA_SR_DRQ, 0)) {
+		/* Still busy with whatever went wrong; reset the link */
+		debug_print(WARNING, "ahci: port %d busy, resetting link", port->index);
+		port_write(port, PORT_SCTL, (port_read(port, PORT_SCTL) & ~0xF) | 1);
+		for (int i = 0; i < AHCI_TIMEOUT; ++i) port_read(port, PORT_SSTS);
+		port_write(port, PORT_SCTL, port_read(port, PORT_SCTL) & ~0xF);
+		port_spin(port, PORT_SSTS, 0xF, PORT_DET_PRESENT);
+		port_write(port, PORT_SERR, 0xFFFFFFFF);
+		if (port_spin(port, PORT_TFD, ATA_SR_BSY | ATA_SR_DRQ, 0)) {
+			debug_print(ERROR, "ahci: port %d did not come back", port->index);
+			return 1;
+		}
+	}
+	port_write(port, PORT_IS, 0xFFFFFFFF);
+	port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_ST);
+	return 0;
+}
+
+/*
+ * After an error the port has to be stopped to be restarted, which
+ * throws away everything outstanding on it. The disk only says which
+ * queued command failed through its error log, so every command that
+ * hadn't finished is failed back to its caller.
+ */
+static void ahci_port_recover(struct ahci_port * port) {
+	mutex_lock(&port->lock);
+	if (port->fault) {
+		uint32_t outstanding = port_read(port, PORT_CI) | port_read(port, PORT_SACT);
+		debug_print(ERROR, "ahci: port %d error, IS=0x%x TFD=0x%x SERR=0x%x outstanding=0x%x",
+				port->index, port->fault, port_read(port, PORT_TFD), port_read(port, PORT_SERR), outstanding);
+		port->failed |= outstanding & port->busy;
+		ahci_port_stop(port);
+		port_write(port, PORT_SERR, 0xFFFFFFFF);
+		port->fault = 0;
+		ahci_port_start(port);
+	}
+	mutex_unlock(&port->lock);
+	wakeup_queue(port->wait);
+}
+
+/*
+ * Take a free slot. With `block` unset this returns -1 rather than
+ * sleeping, for callers that have commands of their own in flight and
+ * could otherwise wait on themselves.
+ */
+static int ahci_slot_take(struct ahci_port * port, int block) {
+	uint32_t all = (port->depth == 32) ? 0xFFFFFFFF : ((1UL << port->depth) - 1);
+	while (1) {
+		mutex_lock(&port->lock);
+		if (port->busy != all) {
+			int slot = 0;
+			while (port->busy & (1UL << slot)) slot++;
+			port->busy |= (1UL << slot);
+			mutex_unlock(&port->lock);
+			return slot;
+		}
+		mutex_unlock(&port->lock);
+		if (!block) return -1;
+
+		uint32_t flags = int_save();
+		if (port->busy == all) {
+			sleep_on(port->slot_wait);
+		}
+		int_restore(flags);
+	}
+}
+
+static void ahci_slot_release(struct ahci_port * port, int slot) {
+	mutex_lock(&port->lock);
+	port->busy &= ~(1UL << slot);
+	port->failed &= ~(1UL << slot);
+	mutex_unlock(&port->lock);
+	wakeup_queue(port->slot_wait);
+}
+
+/* Fill in a slot's command; data, if any, moves through the slot's buffer */
+static void ahci_command(struct ahci_port * port, int slot, uint8_t command, uint64_t lba, unsigned int count, size_t bytes, int write) {
+	ahci_cmd_table_t * table = (ahci_cmd_table_t *)(port->tables + slot * AHCI_TABLE_SIZE);
+	memset(table, 0, sizeof(ahci_cmd_table_t));
+
+	fis_h2d_t * fis = (fis_h2d_t *)table->cfis;
+	fis->fis_type = FIS_TYPE_H2D;
+	fis->flags    = 0x80;
+	fis->command  = command;
+
+	if (command != ATA_CMD_IDENTIFY && command != ATA_CMD_CACHE_FLUSH_EXT) {
+		fis->device = 0x40; /* LBA */
+		fis->lba0 = (lba >>  0) & 0xFF;
+		fis->lba1 = (lba >>  8) & 0xFF;
+		fis->lba2 = (lba >> 16) & 0xFF;
+		fis->lba3 = (lba >> 24) & 0xFF;
+		fis->lba4 = (lba >> 32) & 0xFF;
+		fis->lba5 = (lba >> 40) & 0xFF;
+	}
+
+	if (command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA) {
+		/* Queued commands carry the count in the features and the tag in the count */
+		fis->feature_lo = count & 0xFF;
+		fis->feature_hi = (count >> 8) & 0xFF;
+		fis->count_lo   = slot << 3;
+		if (write) {
+			fis->device |= 0x80; /* FUA: there's no flushing around queued writes */
+		}
+	} else {
+		fis->count_lo = count & 0xFF;
+		fis->count_hi = (count >> 8) & 0xFF;
+	}
+
+	if (bytes) {
+		table->prdt[0].dba  = port->buffers_phys[slot];
+		table->prdt[0].dbau = 0;
+		table->prdt[0].dbc  = (bytes - 1) | (1UL << 31);
+	}
+
+	ahci_cmd_header_t * header = &port->headers[slot];
+	header->flags = CMD_FIS_LENGTH | (write ? CMD_WRITE : 0) | CMD_PRDTL(bytes ? 1 : 0);
+	header->prdbc = 0;
+	header->ctba  = port->tables_phys + slot * AHCI_TABLE_SIZE;
+	header->ctbau = 0;
+}
+
+static void ahci_issue(struct ahci_port * port, int slot) {
+	mutex_lock(&port->lock);
+	if (port->ncq) {
+		port_write(port, PORT_SACT, 1UL << slot);
+	}
+	port_write(port, PORT_CI, 1UL << slot);
+	mutex_unlock(&port->lock);
+}
+
+/* Sleep until a slot's command is done; returns 1 if it failed */
+static int ahci_wait(struct ahci_port * port, int slot) {
+	uint32_t bit = 1UL << slot;
+	while (1) {
+		if (port->fault) {
+			ahci_port_recover(port);
+		}
+		if (port->failed & bit) {
+			return 1;
+		}
+
+		uint32_t flags = int_save();
+		if (!port->fault && ((port_read(port, PORT_CI) | port_read(port, PORT_SACT)) & bit)) {
+			sleep_on(port->wait);
+			int_restore(flags);
+			continue;
+		}
+		int_restore(flags);
+		if (!port->fault) return 0;
+	}
+}
+
+/* The same, without interrupts, for setting up disks */
+static int ahci_wait_poll(struct ahci_port * port, int slot) {
+	for (int i = 0; i < AHCI_TIMEOUT * 10; ++i) {
+		if (port_read(port, PORT_IS) & PORT_IS_ERROR) break;
+		if (!(port_read(port, PORT_CI) & (1UL << slot))) {
+			return 0;
+		}
+	}
+	debug_print(ERROR, "ahci: port %d command failed, IS=0x%x TFD=0x%x", port->index,
+			port_read(port, PORT_IS), port_read(port, PORT_TFD));
+	ahci_port_stop(port);
+	port_write(port, PORT_SERR, 0xFFFFFFFF);
+	ahci_port_start(port);
+	return 1;
+}
+
+/* Wait out an issued command, and copy in what it read */
+static int ahci_finish(struct ahci_port * port, struct ahci_inflight * f, int write) {
+	int error = ahci_wait(port, f->slot);
+	if (!error && write && !port->ncq) {
+		ahci_command(port, f->slot, ATA_CMD_CACHE_FLUSH_EXT, 0, 0, 0, 0);
+		ahci_issue(port, f->slot);
+		error = ahci_wait(port, f->slot);
+	}
+	if (!error && !write) {
+		memcpy(f->buf, port->buffers[f->slot], f->bytes);
+	}
+	ahci_slot_release(port, f->slot);
+	return error;
+}
+
+/*
+ * Move `count` whole sectors between the disk and `buf`, a slot's
+ * worth per command. Commands go out for as long as there are free
+ * slots, so on a queuing disk a big transfer is several commands in
+ * flight at once; they're finished oldest first to make room.
+ */
+static int ahci_transfer(struct ahci_port * port, uint64_t lba, unsigned int count, uint8_t * buf, int write) {
+	struct ahci_inflight inflight[AHCI_MAX_SLOTS];
+	int head = 0, pending = 0;
+	int errors = 0;
+
+	uint8_t command;
+	if (port->ncq) {
+		command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+	} else {
+		command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	}
+
+	while (count || pending) {
+		int slot = count ? ahci_slot_take(port, !pending) : -1;
+		if (slot < 0) {
+			errors |= ahci_finish(port, &inflight[head], write);
+			head = (head + 1) % AHCI_MAX_SLOTS;
+			pending--;
+			continue;
+		}
+
+		unsigned int sectors = count > AHCI_SLOT_SECTORS ? AHCI_SLOT_SECTORS : count;
+		size_t bytes = sectors * ATA_SECTOR_SIZE;
+		if (write) {
+			memcpy(port->buffers[slot], buf, bytes);
+		}
+		ahci_command(port, slot, command, lba, sectors, bytes, write);
+		ahci_issue(port, slot);
+
+		struct ahci_inflight * f = &inflight[(head + pending) % AHCI_MAX_SLOTS];
+		f->slot  = slot;
+		f->buf   = buf;
+		f->bytes = bytes;
+		pending++;
+
+		lba   += sectors;
+		count -= sectors;
+		buf   += bytes;
+	}
+
+	if (errors) {
+		debug_print(ERROR, "ahci: %s failed on port %d", write ? "write" : "read", port->index);
+	}
+	return errors;
+}
+
+static int ahci_block_transfer(block_device_t * dev, uint64_t lba, unsigned int count, uint8_t * buf, int write) {
+	return ahci_transfer(dev->driver, lba, count, buf, write);
+}
+
+static fs_node_t * ahci_device_create(struct ahci_port * port) {
+	sprintf(port->block.name, "ahcidev%d", ahci_count);
+	port->block.sector_size = ATA_SECTOR_SIZE;
+	port->block.sectors     = port->sectors;
+	port->block.transfer    = ahci_block_transfer;
+	port->block.driver      = port;
+	return block_register(&port->block);
+}
+
+static int ahci_irq_handler(struct regs * r) {
+	uint32_t is = hba_read(AHCI_IS);
+	if (!is) {
+		return 0;
+	}
+
+	for (int i = 0; i < 32; ++i) {
+		struct ahci_port * port = ahci_ports[i];
+		if (!(is & (1UL << i)) || !port) continue;
+		uint32_t port_is = port_read(port, PORT_IS);
+		port_write(port, PORT_IS, port_is);
+		if (port_is & PORT_IS_ERROR) {
+			port->fault |= port_is;
+		}
+		wakeup_queue(port->wait);
+	}
+
+	hba_write(AHCI_IS, is);
+	irq_ack(ahci_irq);
+	return 1;
+}
+
+/* Pick the first /dev/hdX nothing else has taken */
+static char ahci_drive_char(void) {
+	char devname[64];
+	for (char l = 'a'; l <= 'z'; ++l) {
+		sprintf(devname, "/dev/hd%c", l);
+		fs_node_t * node = kopen(devname, 0);
+		if (!node) return l;
+		close_fs(node);
+	}
+	return 0;
+}
+
+static int ahci_identify(struct ahci_port * port) {
+	ahci_command(port, 0, ATA_CMD_IDENTIFY, 0, 0, sizeof(ata_identify_t), 0);
+	port_write(port, PORT_CI, 1);
+	if (ahci_wait_poll(port, 0)) {
+		return 1;
+	}
+	memcpy(&port->identity, port->buffers[0], sizeof(ata_identify_t));
+
+	uint8_t * ptr = (uint8_t *)&port->identity.model;
+	for (int i = 0; i < 39; i += 2) {
+		uint8_t tmp = ptr[i+1];
+		ptr[i+1] = ptr[i];
+		ptr[i] = tmp;
+	}
+	ptr[39] = '\0';
+
+	port->sectors = port->identity.sectors_48;
+	if (!port->sectors) {
+		port->sectors = port->identity.sectors_28;
+	}
+	return 0;
+}
+
+static void ahci_port_init(int index) {
+	uintptr_t regs = ahci_base + 0x100 + index * 0x80;
+	uint32_t ssts = *(volatile uint32_t *)(regs + PORT_SSTS);
+	uint32_t sig  = *(volatile uint32_t *)(regs + PORT_SIG);
+
+	if ((ssts & 0xF) != PORT_DET_PRESENT) {
+		return;
+	}
+	if (sig != PORT_SIG_ATA) {
+		debug_print(NOTICE, "ahci: port %d has a device with signature 0x%x, skipping", index, sig);
+		return;
+	}
+
+	struct ahci_port * port = malloc(sizeof(struct ahci_port));
+	memset(port, 0, sizeof(struct ahci_port));
+	port->regs  = regs;
+	port->index = index;
+	mutex_init(&port->lock);
+	port->wait = list_create();
+	port->slot_wait = list_create();
+
+	ahci_port_stop(port);
+
+	/* Command list, received FISes, then the command tables, all in one place */
+	uintptr_t phys;
+	uint8_t * area = (void *)kvmalloc_p(0x3000, &phys);
+	memset(area, 0, 0x3000);
+	port->headers     = (ahci_cmd_header_t *)area;
+	port->tables      = area + 0x1000;
+	port->tables_phys = phys + 0x1000;
+
+	port_write(port, PORT_CLB,  phys);
+	port_write(port, PORT_CLBU, 0);
+	port_write(port, PORT_FB,   phys + 0x400);
+	port_write(port, PORT_FBU,  0);
+	port_write(port, PORT_SERR, 0xFFFFFFFF);
+
+	port->buffers[0] = (void *)kvmalloc_p(AHCI_SLOT_SIZE, &port->buffers_phys[0]);
+
+	if (ahci_port_start(port) || ahci_identify(port)) {
+		debug_print(ERROR, "ahci: port %d did not identify", index);
+		ahci_port_stop(port);
+		return;
+	}
+
+	uint16_t * words = (uint16_t *)&port->identity;
+	port->depth = 1;
+	if ((hba_read(AHCI_CAP) & AHCI_CAP_NCQ) && (words[IDENTIFY_SATA_CAPS] & IDENTIFY_SATA_NCQ) && ahci_depth_max > 1) {
+		port->ncq = 1;
+		port->depth = (words[IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1;
+		if (port->depth > ahci_slots) port->depth = ahci_slots;
+		if (port->depth > ahci_depth_max) port->depth = ahci_depth_max;
+	}
+
+	for (int i = 1; i < port->depth; ++i) {
+		port->buffers[i] = (void *)kvmalloc_p(AHCI_SLOT_SIZE, &port->buffers_phys[i]);
+	}
+
+	debug_print(NOTICE, "ahci: port %d: %s, %d sectors, %s depth %d", index, port->identity.model,
+			(uint32_t)port->sectors, port->ncq ? "NCQ" : "no NCQ", port->depth);
+
+	char l = ahci_drive_char();
+	if (!l) {
+		debug_print(ERROR, "ahci: out of drive letters");
+		ahci_port_stop(port);
+		return;
+	}
+
+	port_write(port, PORT_IS, 0xFFFFFFFF);
+	port_write(port, PORT_IE, PORT_IS_DONE | PORT_IS_ERROR);
+	ahci_ports[index] = port;
+
+	char devname[64];
+	sprintf(devname, "/dev/hd%c", l);
+	vfs_mount(devname, ahci_device_create(port));
+	ahci_count++;
+}
+
+static int ahci_initialize(void) {
+	pci_scan(&find_ahci_pci, PCI_TYPE_SATA, &ahci_pci);
+
+	if (!ahci_pci) {
+		debug_print(NOTICE, "ahci: no controller found");
+		return 0;
+	}
+
+	char * c;
+	if ((c = args_value("ahci_depth"))) {
+		ahci_depth_max = atoi(c);
+		if (ahci_depth_max < 1) ahci_depth_max = 1;
+		if (ahci_depth_max > AHCI_MAX_SLOTS) ahci_depth_max = AHCI_MAX_SLOTS;
+	}
+
+	uint16_t command_reg = pci_read_field(ahci_pci, PCI_COMMAND, 2);
+	command_reg |= (1 << 1) | (1 << 2);  /* Memory space, bus mastering */
+	command_reg &= ~(1 << 10);           /* Interrupts on */
+	pci_write_field(ahci_pci, PCI_COMMAND, 2, command_reg);
+
+	uintptr_t abar = pci_read_field(ahci_pci, PCI_BAR5, 4) & 0xFFFFFFF0;
+	debug_print(NOTICE, "ahci: controller at 0x%x, registers at 0x%x", ahci_pci, abar);
+
+	for (uintptr_t addr = abar & 0xFFFFF000; addr < abar + 0x1100; addr += 0x1000) {
+		page_t * p = get_page(addr, 1, kernel_directory);
+		dma_frame(p, 1, 1, addr);
+		p->writethrough = 1;
+		p->cachedisable = 1;
+	}
+	invalidate_page_tables();
+	ahci_base = abar;
+
+	hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_AE);
+
+	uint32_t cap = hba_read(AHCI_CAP);
+	ahci_slots = ((cap >> 8) & 0x1F) + 1;
+	debug_print(NOTICE, "ahci: version 0x%x, %d ports, %d slots%s", hba_read(AHCI_VS),
+			(cap & 0x1F) + 1, ahci_slots, (cap & AHCI_CAP_NCQ) ? ", NCQ" : "");
+
+	ahci_irq = pci_enable_msi(ahci_pci);
+	if (ahci_irq < 0) {
+		ahci_irq = pci_get_interrupt(ahci_pci);
+	}
+	irq_install_handler(ahci_irq, ahci_irq_handler, "ahci");
+
+	uint32_t implemented = hba_read(AHCI_PI);
+	for (int i = 0; i < 32; ++i) {
+		if (implemented & (1UL << i)) {
+			ahci_port_init(i);
+		}
+	}
+
+	hba_write(AHCI_IS, 0xFFFFFFFF);
+	hba_write(AHCI_GHC, hba_read(AHCI_GHC) | AHCI_GHC_IE);
+
+	return 0;
+}
+
+static int ahci_finalize(void) {
+	return 0;
+}
+
+MODULE_DEF(ahci, ahci_initialize, ahci_finalize);
@@ -10,6 +10,7 @@
 
 #include <kernel/system.h>
 #include <kernel/logging.h>
+#include <kernel/mem.h>
 #include <kernel/module.h>
 #include <kernel/fs.h>
 #include <kernel/printf.h>
@@ -17,14 +18,20 @@
 
 /* TODO: Move this to mod/ata.h */
 #include <kernel/ata.h>
+#include <kernel/mutex.h>
+#include <kernel/block.h>
+#include <kernel/workqueue.h>
 
 #include <toaru/list.h>
 
 static char ata_drive_char = 'a';
 static int  cdrom_number = 0;
 static uint32_t ata_pci = 0x00000000;
-static list_t * atapi_waiter;
-static int atapi_in_progress = 0;
+static list_t * ata_irq_waiter;
+static work_t ata_watchdog;
+
+#define ATA_SPIN_POLLS  64  /* Status reads before sleeping instead */
+#define ATA_WATCHDOG_MS 10  /* For the commands that don't interrupt */
 
 typedef union {
 	uint8_t command_bytes[12];
@@ -65,16 +72,19 @@ static struct ata_device ata_secondary_master = {.io_base = 0x170, .control = 0x
 static struct ata_device ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1};
 
 //static volatile uint8_t ata_lock = 0;
-static spin_lock_t ata_lock = { 0 };
+static mutex_t ata_lock = MUTEX_INIT;
 
 /* TODO support other sector sizes */
 #define ATA_SECTOR_SIZE 512
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+/* Largest single DMA transfer, described to the controller one page per PRDT entry */
+#define ATA_DMA_SECTORS 128
+#define ATA_DMA_SIZE    (ATA_DMA_SECTORS * ATA_SECTOR_SIZE)
+#define ATA_PRDT_COUNT  (ATA_DMA_SIZE / 0x1000)
+
+static void ata_device_read_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf);
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector_retry(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static uint32_t read_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
-static uint32_t write_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer);
+static void ata_device_write_sectors_retry(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf);
 static void     open_ata(fs_node_t *node, unsigned int flags);
 static void     close_ata(fs_node_t *node);
 
@@ -96,65 +106,6 @@ static uint64_t atapi_max_offset(struct ata_device * dev) {
 	return (max_sector + 1) * dev->atapi_sector_size;
 }
 
-static uint32_t read_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-#if 0
-	debug_print(ERROR, "ATA read at offset 0x%8x%8x", (uint32_t)(offset >> 32), (uint32_t)(offset & 0xFFFFFFFF));
-	debug_print(ERROR, "read size is 0x%8x", size);
-#endif
-
-	unsigned int start_block = offset / ATA_SECTOR_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_SECTOR_SIZE;
-
-	unsigned int x_offset = 0;
-
-
-	if (offset > ata_max_offset(dev)) {
-		return 0;
-	}
-
-	if (offset + size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_SECTOR_SIZE || size < ATA_SECTOR_SIZE) {
-		unsigned int prefix_size = (ATA_SECTOR_SIZE - (offset % ATA_SECTOR_SIZE));
-		if (prefix_size > size) prefix_size = size;
-		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_SECTOR_SIZE)), prefix_size);
-
-		free(tmp);
-
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_SECTOR_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_SECTOR_SIZE;
-		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
-
-		free(tmp);
-
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_SECTOR_SIZE;
-		start_block++;
-	}
-
-	return size;
-}
-
 static uint32_t read_atapi(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 
 	struct ata_device * dev = (struct ata_device *)node->device;
@@ -209,68 +160,23 @@ static uint32_t read_atapi(fs_node_t *node, uint64_t offset, uint32_t size, uint
 }
 
 
-static uint32_t write_ata(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-	unsigned int start_block = offset / ATA_SECTOR_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_SECTOR_SIZE;
-
-	unsigned int x_offset = 0;
-
-#if 0
-	debug_print(ERROR, "ATA write at offset 0x%8x%8x", (uint32_t)(offset >> 32), (uint32_t)(offset & 0xFFFFFFFF));
-	debug_print(ERROR, "write size is 0x%8x", size);
-	debug_print(ERROR, "some data from buf: [%2x %2x %2x %2x]", buffer[0], buffer[1], buffer[2], buffer[3]);
-#endif
-
-	if (offset > ata_max_offset(dev)) {
-		return 0;
-	}
-
-	if (offset + size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_SECTOR_SIZE) {
-		unsigned int prefix_size = (ATA_SECTOR_SIZE - (offset % ATA_SECTOR_SIZE));
-
-		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		debug_print(NOTICE, "Writing first block");
-
-		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_SECTOR_SIZE)), buffer, prefix_size);
-		ata_device_write_sector_retry(dev, start_block, (uint8_t *)tmp);
-
-		free(tmp);
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_SECTOR_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_SECTOR_SIZE;
-
-		char * tmp = malloc(ATA_SECTOR_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		debug_print(NOTICE, "Writing last block");
-
-		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
-
-		ata_device_write_sector_retry(dev, end_block, (uint8_t *)tmp);
-
-		free(tmp);
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_write_sector_retry(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_SECTOR_SIZE;
-		start_block++;
+/*
+ * Hard disks go through the block layer, which hands us whole sectors.
+ */
+static int ata_block_transfer(block_device_t * block, uint64_t lba, unsigned int count, uint8_t * buf, int write) {
+	struct ata_device * dev = block->driver;
+	while (count) {
+		unsigned int chunk = count > ATA_DMA_SECTORS ? ATA_DMA_SECTORS : count;
+		if (write) {
+			ata_device_write_sectors_retry(dev, lba, chunk, buf);
+		} else {
+			ata_device_read_sectors(dev, lba, chunk, buf);
+		}
+		lba   += chunk;
+		count -= chunk;
+		buf   += chunk * ATA_SECTOR_SIZE;
 	}
-
-	return size;
+	return 0;
 }
 
 static void open_ata(fs_node_t * node, unsigned int flags) {
@@ -291,7 +197,7 @@ static fs_node_t * atapi_device_create(struct ata_device * device) {
 	fnode->gid = 0;
 	fnode->mask    = 0664;
 	fnode->length  = atapi_max_offset(device);
-	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->flags   = FS_BLOCKDEVICE | FS_CACHED;
 	fnode->read    = read_atapi;
 	fnode->write   = NULL; /* no write support */
 	fnode->open    = open_ata;
@@ -304,24 +210,14 @@ static fs_node_t * atapi_device_create(struct ata_device * device) {
 
 
 static fs_node_t * ata_device_create(struct ata_device * device) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
-	fnode->inode = 0;
-	sprintf(fnode->name, "atadev%d", ata_drive_char - 'a');
-	fnode->device  = device;
-	fnode->uid = 0;
-	fnode->gid = 0;
-	fnode->mask    = 0660;
-	fnode->length  = ata_max_offset(device); /* TODO */
-	fnode->flags   = FS_BLOCKDEVICE;
-	fnode->read    = read_ata;
-	fnode->write   = write_ata;
-	fnode->open    = open_ata;
-	fnode->close   = close_ata;
-	fnode->readdir = NULL;
-	fnode->finddir = NULL;
-	fnode->ioctl   = NULL; /* TODO, identify, etc? */
-	return fnode;
+	block_device_t * block = malloc(sizeof(block_device_t));
+	memset(block, 0x00, sizeof(block_device_t));
+	sprintf(block->name, "atadev%d", ata_drive_char - 'a');
+	block->sector_size = ATA_SECTOR_SIZE;
+	block->sectors     = ata_max_offset(device) / ATA_SECTOR_SIZE;
+	block->transfer    = ata_block_transfer;
+	block->driver      = device;
+	return block_register(block);
 }
 
 static void ata_io_wait(struct ata_device * dev) {
@@ -342,12 +238,58 @@ static int ata_status_wait(struct ata_device * dev, int timeout) {
 	return status;
 }
 
+static void ata_watchdog_func(void * data) {
+	wakeup_queue(ata_irq_waiter);
+}
+
+/* With interrupts off, until the next interrupt from either channel or the watchdog */
+static void ata_sleep(void) {
+	queue_delayed_work(&ata_watchdog, ATA_WATCHDOG_MS);
+	sleep_on(ata_irq_waiter);
+}
+
+/*
+ * Wait for (status & mask) == want, or an error. A drive that is nearly
+ * there gets a few polls; after that we sleep and look again whenever
+ * something might have changed, rather than spinning out the whole
+ * command with everything else held off.
+ */
+static uint8_t ata_wait_for(struct ata_device * dev, uint8_t mask, uint8_t want) {
+	uint8_t status;
+	for (int i = 0; i < ATA_SPIN_POLLS; ++i) {
+		status = inportb(dev->io_base + ATA_REG_STATUS);
+		if ((status & mask) == want) return status;
+		if ((status & (ATA_SR_BSY | ATA_SR_ERR)) == ATA_SR_ERR) return status;
+	}
+
+	if (!current_process) {
+		/* Too early to sleep */
+		while (1) {
+			status = inportb(dev->io_base + ATA_REG_STATUS);
+			if ((status & mask) == want) return status;
+			if ((status & (ATA_SR_BSY | ATA_SR_ERR)) == ATA_SR_ERR) return status;
+		}
+	}
+
+	uint32_t flags = int_save();
+	while (1) {
+		status = inportb(dev->io_base + ATA_REG_STATUS);
+		if ((status & mask) == want) break;
+		if ((status & (ATA_SR_BSY | ATA_SR_ERR)) == ATA_SR_ERR) break;
+		ata_sleep();
+		/* Whoever ran meanwhile may have turned interrupts on */
+		(void)int_save();
+	}
+	int_restore(flags);
+	return status;
+}
+
 static int ata_wait(struct ata_device * dev, int advanced) {
 	uint8_t status = 0;
 
 	ata_io_wait(dev);
 
-	status = ata_status_wait(dev, -1);
+	status = ata_wait_for(dev, ATA_SR_BSY, 0);
 
 	if (advanced) {
 		status = inportb(dev->io_base + ATA_REG_STATUS);
@@ -367,18 +309,14 @@ static void ata_soft_reset(struct ata_device * dev) {
 
 static int ata_irq_handler(struct regs *r) {
 	inportb(ata_primary_master.io_base + ATA_REG_STATUS);
-	if (atapi_in_progress) {
-		wakeup_queue(atapi_waiter);
-	}
+	wakeup_queue(ata_irq_waiter);
 	irq_ack(14);
 	return 1;
 }
 
 static int ata_irq_handler_s(struct regs *r) {
 	inportb(ata_secondary_master.io_base + ATA_REG_STATUS);
-	if (atapi_in_progress) {
-		wakeup_queue(atapi_waiter);
-	}
+	wakeup_queue(ata_irq_waiter);
 	irq_ack(15);
 	return 1;
 }
@@ -421,15 +359,18 @@ static void ata_device_init(struct ata_device * dev) {
 	debug_print(NOTICE, "Sectors (24): %d", dev->identity.sectors_28);
 
 	debug_print(NOTICE, "Setting up DMA...");
-	dev->dma_prdt  = (void *)kvmalloc_p(sizeof(prdt_t) * 1, &dev->dma_prdt_phys);
-	dev->dma_start = (void *)kvmalloc_p(4096, &dev->dma_start_phys);
+	dev->dma_prdt  = (void *)kvmalloc_p(sizeof(prdt_t) * ATA_PRDT_COUNT, &dev->dma_prdt_phys);
+	dev->dma_start = (void *)kvmalloc_p(ATA_DMA_SIZE, &dev->dma_start_phys);
 
 	debug_print(NOTICE, "Putting prdt    at 0x%x (0x%x phys)", dev->dma_prdt, dev->dma_prdt_phys);
 	debug_print(NOTICE, "Putting prdt[0] at 0x%x (0x%x phys)", dev->dma_start, dev->dma_start_phys);
 
-	dev->dma_prdt[0].offset = dev->dma_start_phys;
-	dev->dma_prdt[0].bytes = 512;
-	dev->dma_prdt[0].last = 0x8000;
+	/* One entry per page, so no entry can cross a 64KiB boundary */
+	for (int i = 0; i < ATA_PRDT_COUNT; ++i) {
+		dev->dma_prdt[i].offset = map_to_physical((uintptr_t)dev->dma_start + i * 0x1000);
+		dev->dma_prdt[i].bytes = 0x1000;
+		dev->dma_prdt[i].last = 0;
+	}
 
 	debug_print(NOTICE, "ATA PCI device ID: 0x%x", ata_pci);
 
@@ -591,10 +532,8 @@ static int ata_device_detect(struct ata_device * dev) {
 
 		char devname[64];
 		sprintf((char *)&devname, "/dev/hd%c", ata_drive_char);
-		fs_node_t * node = ata_device_create(dev);
-		vfs_mount(devname, node);
 		ata_device_init(dev);
-		node->length  = ata_max_offset(dev);
+		vfs_mount(devname, ata_device_create(dev));
 
 		ata_drive_char++;
 		return 1;
@@ -620,11 +559,16 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
+/*
+ * Read up to ATA_DMA_SECTORS consecutive sectors with a single
+ * READ DMA EXT command.
+ */
+static void ata_device_read_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
 	if (dev->is_atapi) return;
+	if (!count || count > ATA_DMA_SECTORS) return;
 
 #if 0
 	debug_print(ERROR, "Request to read sector %8x%8x",
@@ -632,13 +576,21 @@ static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_
 			(uint32_t)(lba & 0xFFFFFFFF));
 #endif
 
-	spin_lock(ata_lock);
+	mutex_lock(&ata_lock);
 
 #if 0
 	int errors = 0;
 try_again:
 #endif
 
+	/* Terminate the PRDT after the last page this transfer touches */
+	unsigned int bytes = count * ATA_SECTOR_SIZE;
+	unsigned int entries = (bytes + 0xFFF) / 0x1000;
+	for (unsigned int i = 0; i < entries; ++i) {
+		dev->dma_prdt[i].bytes = (i == entries - 1) ? bytes - i * 0x1000 : 0x1000;
+		dev->dma_prdt[i].last  = (i == entries - 1) ? 0x8000 : 0;
+	}
+
 	ata_wait(dev, 0);
 
 	/* Stop */
@@ -653,51 +605,45 @@ try_again:
 	/* set read */
 	outportb(dev->bar4, 0x08);
 
-	IRQ_ON;
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
+	ata_wait_for(dev, ATA_SR_BSY, 0);
 
 	outportb(bus + ATA_REG_CONTROL, 0x00);
 	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
 	ata_io_wait(dev);
 	outportb(bus + ATA_REG_FEATURES, 0x00);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
+	outportb(bus + ATA_REG_SECCOUNT0, (count >> 8) & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 1);
+	outportb(bus + ATA_REG_SECCOUNT0, count & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
 
 	//outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_PIO);
-#if 1
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-#endif
+	ata_wait_for(dev, ATA_SR_BSY | ATA_SR_DRDY, ATA_SR_DRDY);
 	outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_DMA_EXT);
 
 	ata_io_wait(dev);
 
+	/*
+	 * Sleep until the completion interrupt rather than spinning on the
+	 * bus master status; interrupts stay off until we are on the wait
+	 * queue so the IRQ can't slip in before we get there. It may have
+	 * been for the other channel, so look again each time we wake.
+	 */
+	uint32_t flags = int_save();
 	outportb(dev->bar4, 0x08 | 0x01);
-
 	while (1) {
 		int status = inportb(dev->bar4 + 0x02);
-		int dstatus = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
-		}
+		if (status & 0x02) break;
+		if ((status & 0x04) && !(inportb(dev->io_base + ATA_REG_STATUS) & ATA_SR_BSY)) break;
+		ata_sleep();
+		(void)int_save();
 	}
-	IRQ_OFF;
+	int_restore(flags);
 
 #if 0
 	if (ata_wait(dev, 1)) {
@@ -705,7 +651,7 @@ try_again:
 		errors++;
 		if (errors > 4) {
 			debug_print(WARNING, "-- Too many errors trying to read this block. Bailing.");
-			spin_unlock(ata_lock);
+			mutex_unlock(&ata_lock);
 			return;
 		}
 		goto try_again;
@@ -713,7 +659,7 @@ try_again:
 #endif
 
 	/* Copy from DMA buffer to output buffer. */
-	memcpy(buf, dev->dma_start, 512);
+	memcpy(buf, dev->dma_start, bytes);
 
 	/* Inform device we are done. */
 	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
@@ -724,7 +670,7 @@ try_again:
 	ata_wait(dev, 0);
 	outportb(bus + ATA_REG_CONTROL, 0x02);
 #endif
-	spin_unlock(ata_lock);
+	mutex_unlock(&ata_lock);
 }
 
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
@@ -732,7 +678,7 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 	if (!dev->is_atapi) return;
 
 	uint16_t bus = dev->io_base;
-	spin_lock(ata_lock);
+	mutex_lock(&ata_lock);
 
 	outportb(dev->io_base + ATA_REG_HDDEVSEL, 0xA0 | dev->slave << 4);
 	ata_io_wait(dev);
@@ -742,15 +688,7 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 	outportb(bus + ATA_REG_LBA2, dev->atapi_sector_size >> 8);
 	outportb(bus + ATA_REG_COMMAND, ATA_CMD_PACKET);
 
-	/* poll */
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if ((status & ATA_SR_ERR)) goto atapi_error_on_read_setup;
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ)) break;
-	}
-
-	atapi_in_progress = 1;
-
+	if (ata_wait_for(dev, ATA_SR_BSY | ATA_SR_DRQ, ATA_SR_DRQ) & ATA_SR_ERR) goto atapi_error_on_read_setup;
 
 	atapi_command_t command;
 	command.command_bytes[0] = 0xA8;
@@ -770,16 +708,8 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 		outports(bus, command.command_words[i]);
 	}
 
-	/* Wait */
-	sleep_on(atapi_waiter);
-
-	atapi_in_progress = 0;
-
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if ((status & ATA_SR_ERR)) goto atapi_error_on_read_setup;
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ)) break;
-	}
+	/* Wait for the data, which interrupts when it's ready */
+	if (ata_wait_for(dev, ATA_SR_BSY | ATA_SR_DRQ, ATA_SR_DRQ) & ATA_SR_ERR) goto atapi_error_on_read_setup;
 
 	uint16_t size_to_read = inportb(bus + ATA_REG_LBA2) << 8;
 	size_to_read = size_to_read | inportb(bus + ATA_REG_LBA1);
@@ -787,18 +717,18 @@ static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba,
 
 	inportsm(bus,buf,size_to_read/2);
 
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if ((status & ATA_SR_ERR)) goto atapi_error_on_read_setup;
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
+	ata_wait_for(dev, ATA_SR_BSY | ATA_SR_DRDY, ATA_SR_DRDY);
 
 atapi_error_on_read_setup:
-	spin_unlock(ata_lock);
+	mutex_unlock(&ata_lock);
 
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
+/*
+ * Write consecutive sectors with a single WRITE SECTORS EXT, and flush
+ * the drive's cache once for all of them.
+ */
+static void ata_device_write_sectors(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf) {
 	uint16_t bus = dev->io_base;
 	uint8_t slave = dev->slave;
 
@@ -809,9 +739,10 @@ static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8
 	debug_print(ERROR, "Some data from buf: [%2x %2x %2x %2x]", buf[0], buf[1], buf[2], buf[3]);
 #endif
 
-	spin_lock(ata_lock);
+	mutex_lock(&ata_lock);
 
-	outportb(bus + ATA_REG_CONTROL, 0x02);
+	/* Interrupts on, so ata_wait can sleep through each sector */
+	outportb(bus + ATA_REG_CONTROL, 0x00);
 
 	ata_wait(dev, 0);
 	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
@@ -819,23 +750,24 @@ static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8
 
 	outportb(bus + ATA_REG_FEATURES, 0x00);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
+	outportb(bus + ATA_REG_SECCOUNT0, (count >> 8) & 0xff);
 	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 1);
+	outportb(bus + ATA_REG_SECCOUNT0, count & 0xff);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
 
 	outportb(bus + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO_EXT);
-	ata_wait(dev, 0);
-	int size = ATA_SECTOR_SIZE / 2;
-	outportsm(bus,buf,size);
+	for (unsigned int i = 0; i < count; ++i) {
+		ata_wait(dev, 0);
+		outportsm(bus, buf + i * ATA_SECTOR_SIZE, ATA_SECTOR_SIZE / 2);
+	}
 	outportb(bus + 0x07, ATA_CMD_CACHE_FLUSH);
 	ata_wait(dev, 0);
-	spin_unlock(ata_lock);
+	mutex_unlock(&ata_lock);
 }
 
 static int buffer_compare(uint32_t * ptr1, uint32_t * ptr2, size_t size) {
@@ -850,14 +782,19 @@ static int buffer_compare(uint32_t * ptr1, uint32_t * ptr2, size_t size) {
 	return 0;
 }
 
-static void ata_device_write_sector_retry(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
+/*
+ * Write, then read back and compare, until the drive gets it right.
+ */
+static void ata_device_write_sectors_retry(struct ata_device * dev, uint64_t lba, unsigned int count, uint8_t * buf) {
 	uint64_t sectors = dev->identity.sectors_48;
 	if (lba >= sectors) return;
-	uint8_t * read_buf = malloc(ATA_SECTOR_SIZE);
+	if (lba + count > sectors) count = sectors - lba;
+	size_t size = count * ATA_SECTOR_SIZE;
+	uint8_t * read_buf = malloc(size);
 	do {
-		ata_device_write_sector(dev, lba, buf);
-		ata_device_read_sector(dev, lba, read_buf);
-	} while (buffer_compare((uint32_t *)buf, (uint32_t *)read_buf, ATA_SECTOR_SIZE));
+		ata_device_write_sectors(dev, lba, count, buf);
+		ata_device_read_sectors(dev, lba, count, read_buf);
+	} while (buffer_compare((uint32_t *)buf, (uint32_t *)read_buf, size));
 	free(read_buf);
 }
 
@@ -867,11 +804,12 @@ static int ata_initialize(void) {
 	/* Locate ATA device via PCI */
 	pci_scan(&find_ata_pci, -1, &ata_pci);
 
+	ata_irq_waiter = list_create();
+	work_init(&ata_watchdog, ata_watchdog_func, NULL, WORK_NORMAL);
+
 	irq_install_handler(14, ata_irq_handler, "ide master");
 	irq_install_handler(15, ata_irq_handler_s, "ide slave");
 
-	atapi_waiter = list_create();
-
 	ata_device_detect(&ata_primary_master);
 	ata_device_detect(&ata_primary_slave);
 	ata_device_detect(&ata_secondary_master);
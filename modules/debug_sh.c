@@ -265,15 +265,11 @@ static int shell_pci(fs_node_t * tty, int argc, char * argv[]) {
 	return 0;
 }
 
-static void find_isa_bridge(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
-	if (vendorid == 0x8086 && (deviceid == 0x7000 || deviceid == 0x7110)) {
-		*((uint32_t *)extra) = device;
-	}
-}
 static int shell_frob_piix(fs_node_t * tty, int argc, char * argv[]) {
-	uint32_t pci_isa = 0;
-	pci_scan(&find_isa_bridge, -1, &pci_isa);
-	if (pci_isa) {
+	pci_device_t * isa = pci_find_device(0x8086, 0x7000, 0);
+	if (!isa) isa = pci_find_device(0x8086, 0x7110, 0);
+	if (isa) {
+		uint32_t pci_isa = isa->address;
 		fprintf(tty, "PCI-to-ISA interrupt mappings by line:\n");
 		for (int i = 0; i < 4; ++i) {
 			fprintf(tty, "Line %d: 0x%2x\n", i+1, pci_read_field(pci_isa, 0x60+i, 1));
@@ -661,7 +657,7 @@ struct tty_o {
 static void debug_shell_actual(void * data, char * name) {
 
 	current_process->image.entry = 0;
-	fs_node_t * tty = (fs_node_t *)current_process->fds->entries[1];
+	fs_node_t * tty = current_process->fds->entries[1].node;
 
 	/* Our prompt will include the version number of the current kernel */
 	char version_number[1024];
@@ -685,7 +681,7 @@ static void debug_shell_actual(void * data, char * name) {
 		}
 
 		/* Read a line */
-		if (debug_shell_readline(current_process->fds->entries[0], command, 511) < 0) {
+		if (debug_shell_readline(current_process->fds->entries[0].node, command, 511) < 0) {
 			kexit(0);
 		}
 
@@ -718,7 +714,7 @@ static void debug_shell_run(void * data, char * name) {
 	fs_node_t * tty = kopen("/dev/ttyS0", 0);
 
 	int fd = process_append_fd((process_t *)current_process, tty);
-	current_process->fds->modes[fd] = 03; /* rw */
+	current_process->fds->entries[fd].mode = 03; /* rw */
 	process_move_fd((process_t *)current_process, fd, 0);
 	process_move_fd((process_t *)current_process, fd, 1);
 	process_move_fd((process_t *)current_process, fd, 2);
@@ -8,6 +8,7 @@
 #include <kernel/module.h>
 #include <kernel/printf.h>
 #include <kernel/ata.h>
+#include <kernel/block.h>
 
 #define SECTORSIZE      512
 
@@ -96,7 +97,13 @@ static int read_partition_map(char * name) {
 		for (int i = 0; i < 4; ++i) {
 			if (mbr.partitions[i].status & 0x80) {
 				debug_print(NOTICE, "Partition #%d: @%d+%d", i+1, mbr.partitions[i].lba_first_sector, mbr.partitions[i].sector_count);
-				fs_node_t * node = dospart_device_create(i, device, &mbr.partitions[i]);
+				char part_name[32];
+				sprintf(part_name, "dospart%d", i);
+				/* Disks from the block layer do partitions themselves */
+				fs_node_t * node = block_partition(device, mbr.partitions[i].lba_first_sector, mbr.partitions[i].sector_count, part_name);
+				if (!node) {
+					node = dospart_device_create(i, device, &mbr.partitions[i]);
+				}
 
 				char tmp[64];
 				sprintf(tmp, "%s%d", name, i);
@@ -7,10 +7,12 @@
 #include <kernel/logging.h>
 #include <kernel/printf.h>
 #include <kernel/pci.h>
+#include <kernel/args.h>
 #include <kernel/mem.h>
 #include <kernel/pipe.h>
 #include <kernel/ipv4.h>
 #include <kernel/mod/net.h>
+#include <kernel/workqueue.h>
 
 #include <toaru/list.h>
 
@@ -21,12 +23,14 @@ static int e1000_irq = 0;
 static uintptr_t mem_base = 0;
 static int has_eeprom = 0;
 static uint8_t mac[6];
-static int rx_index = 0;
-static int tx_index = 0;
+static int rx_index = 0; /* Next receive descriptor to look at */
+static int rx_tail = 0;  /* Last one handed back to the card */
+static int tx_index = 0; /* Next transmit descriptor to fill */
+static int tx_clean = 0; /* Oldest one the card may still be sending */
 
-static list_t * net_queue = NULL;
-static spin_lock_t net_queue_lock = { 0 };
 static list_t * rx_wait;
+static list_t * tx_wait;
+static spin_lock_t tx_lock = { 0 };
 
 static uint32_t mmio_read32(uintptr_t addr) {
 	return *((volatile uint32_t*)(addr));
@@ -43,8 +47,28 @@ static uint32_t read_command(uint16_t addr) {
 	return mmio_read32(mem_base + addr);
 }
 
-#define E1000_NUM_RX_DESC 32
-#define E1000_NUM_TX_DESC 8
+/*
+ * Ring sizes and interrupt moderation can be set on the kernel command
+ * line: e1000_rx=, e1000_tx= (descriptors), e1000_irqrate= (interrupts
+ * per second, 0 for no limit) and e1000_rdtr= (receive delay, in
+ * microseconds).
+ */
+#define E1000_RX_DESC_DEFAULT 256
+#define E1000_TX_DESC_DEFAULT 64
+#define E1000_DESC_MIN        8 /* Rings are a multiple of 128 bytes */
+#define E1000_DESC_MAX        4096
+#define E1000_IRQRATE_DEFAULT 8000
+#define E1000_RDTR_DEFAULT    0
+
+#define E1000_BUFFER_SIZE     2048 /* Matches RCTL_BSIZE_2048 */
+#define E1000_RX_REFILL       16   /* Give descriptors back this many at a time */
+
+#define E1000_TX_PIECES       4    /* Descriptors a frame's payload may take besides its headers */
+#define E1000_TX_FRAME_DESC   (E1000_TX_PIECES + 2) /* ...and with a context and the headers */
+#define E1000_TX_COPYBREAK    256  /* Payloads shorter than this are cheaper to copy */
+
+static int e1000_num_rx_desc = E1000_RX_DESC_DEFAULT;
+static int e1000_num_tx_desc = E1000_TX_DESC_DEFAULT;
 
 struct rx_desc {
 	volatile uint64_t addr;
@@ -65,32 +89,28 @@ struct tx_desc {
 	volatile uint16_t special;
 } __attribute__((packed));
 
-static uint8_t * rx_virt[E1000_NUM_RX_DESC];
-static uint8_t * tx_virt[E1000_NUM_TX_DESC];
+/* Shares a slot in the transmit ring; sets up checksum offload for the data descriptors after it */
+struct tx_context_desc {
+	volatile uint8_t  ipcss;   /* Start of the IP header */
+	volatile uint8_t  ipcso;   /* Where its checksum goes */
+	volatile uint16_t ipcse;   /* Last byte it covers */
+	volatile uint8_t  tucss;   /* Same for TCP, which runs to the end (tucse = 0) */
+	volatile uint8_t  tucso;
+	volatile uint16_t tucse;
+	volatile uint32_t cmd_len; /* Payload length, type and TUCMD */
+	volatile uint8_t  status;
+	volatile uint8_t  hdrlen;
+	volatile uint16_t mss;
+} __attribute__((packed));
+
+static uint8_t ** rx_virt;
+static uint8_t ** tx_virt;
+static struct netbuf ** tx_held; /* Netbuf to release when each descriptor is done */
 static struct rx_desc * rx;
 static struct tx_desc * tx;
 static uintptr_t rx_phys;
 static uintptr_t tx_phys;
-
-static void enqueue_packet(void * buffer) {
-	spin_lock(net_queue_lock);
-	list_insert(net_queue, buffer);
-	spin_unlock(net_queue_lock);
-}
-
-static struct ethernet_packet * dequeue_packet(void) {
-	while (!net_queue->length) {
-		sleep_on(rx_wait);
-	}
-
-	spin_lock(net_queue_lock);
-	node_t * n = list_dequeue(net_queue);
-	void* value = n->value;
-	free(n);
-	spin_unlock(net_queue_lock);
-
-	return value;
-}
+static uintptr_t tx_buf_phys;
 
 static uint8_t* get_mac() {
 	return mac;
@@ -101,12 +121,19 @@ static uint8_t* get_mac() {
 #define E1000_REG_EEPROM     0x0014
 #define E1000_REG_CTRL_EXT   0x0018
 
+#define E1000_REG_ICR        0x00C0
+#define E1000_REG_ITR        0x00C4
+#define E1000_REG_IMS        0x00D0
+#define E1000_REG_IMC        0x00D8
+
 #define E1000_REG_RCTRL      0x0100
 #define E1000_REG_RXDESCLO   0x2800
 #define E1000_REG_RXDESCHI   0x2804
 #define E1000_REG_RXDESCLEN  0x2808
 #define E1000_REG_RXDESCHEAD 0x2810
 #define E1000_REG_RXDESCTAIL 0x2818
+#define E1000_REG_RDTR       0x2820
+#define E1000_REG_RADV       0x282C
 
 #define E1000_REG_TCTRL      0x0400
 #define E1000_REG_TXDESCLO   0x3800
@@ -115,8 +142,37 @@ static uint8_t* get_mac() {
 #define E1000_REG_TXDESCHEAD 0x3810
 #define E1000_REG_TXDESCTAIL 0x3818
 
+#define E1000_REG_RXCSUM     0x5000
 #define E1000_REG_RXADDR     0x5400
 
+#define ICR_TXDW                        (1 << 0)    /* Transmit Descriptor Written Back */
+#define ICR_TXQE                        (1 << 1)    /* Transmit Queue Empty */
+#define ICR_LSC                         (1 << 2)    /* Link Status Change */
+#define ICR_RXDMT0                      (1 << 4)    /* Receive Descriptors Running Low */
+#define ICR_RXO                         (1 << 6)    /* Receiver Overrun */
+#define ICR_RXT0                        (1 << 7)    /* Receiver Timer Interrupt */
+#define ICR_RX                          (ICR_RXDMT0 | ICR_RXO | ICR_RXT0)
+
+#define DESC_DD                         (1 << 0)    /* Descriptor Done */
+
+#define RXCSUM_IPOFL                    (1 << 8)    /* Check IP header checksums */
+#define RXCSUM_TUOFL                    (1 << 9)    /* Check TCP/UDP checksums */
+
+#define RX_STATUS_IXSM                  (1 << 2)    /* Ignore checksum indication */
+#define RX_STATUS_TCPCS                 (1 << 5)    /* TCP checksum was checked */
+#define RX_STATUS_IPCS                  (1 << 6)    /* IP checksum was checked */
+#define RX_ERROR_TCPE                   (1 << 5)
+#define RX_ERROR_IPE                    (1 << 6)
+
+#define TX_DTYP_CONTEXT                 (0x0 << 20)
+#define TX_DTYP_DATA                    (0x1 << 4)  /* In the cso byte of a data descriptor */
+#define TUCMD_TCP                       (1 << 24)
+#define TUCMD_IP                        (1 << 25)   /* IPv4 */
+#define TUCMD_RS                        (1 << 27)
+#define TUCMD_DEXT                      (1 << 29)
+#define POPTS_IXSM                      (1 << 0)    /* Insert IP checksum */
+#define POPTS_TXSM                      (1 << 1)    /* Insert TCP checksum */
+
 #define RCTL_EN                         (1 << 1)    /* Receiver Enable */
 #define RCTL_SBP                        (1 << 2)    /* Store Bad Packets */
 #define RCTL_UPE                        (1 << 3)    /* Unicast Promiscuous Enabled */
@@ -161,6 +217,7 @@ static uint8_t* get_mac() {
 #define CMD_RPS                         (1 << 4)    /* Report Packet Sent */
 #define CMD_VLE                         (1 << 6)    /* VLAN Packet Enable */
 #define CMD_IDE                         (1 << 7)    /* Interrupt Delay Enable */
+#define CMD_DEXT                        (1 << 5)    /* Extended (not legacy) descriptor */
 
 static int eeprom_detect(void) {
 
@@ -222,9 +279,15 @@ static void read_mac(void) {
 	}
 }
 
+/*
+ * Receive interrupts only happen while the network worker is idle: the
+ * first one masks them and wakes it, and it then polls the ring until
+ * it's empty before asking for them again. This keeps a busy link from
+ * raising an interrupt per packet.
+ */
 static int irq_handler(struct regs *r) {
 
-	uint32_t status = read_command(0xc0);
+	uint32_t status = read_command(E1000_REG_ICR);
 
 	if (!status) {
 		return 0;
@@ -232,63 +295,307 @@ static int irq_handler(struct regs *r) {
 
 	irq_ack(e1000_irq);
 
-	if (status & 0x04) {
+	if (status & ICR_LSC) {
 		/* Start link */
 		debug_print(E1000_LOG_LEVEL, "start link");
-	} else if (status & 0x10) {
-		/* ?? */
-	} else if (status & ((1 << 6) | (1 << 7))) {
-		/* receive packet */
-		do {
-			rx_index = read_command(E1000_REG_RXDESCTAIL);
-			if (rx_index == (int)read_command(E1000_REG_RXDESCHEAD)) return 1;
-			rx_index = (rx_index + 1) % E1000_NUM_RX_DESC;
-			if (rx[rx_index].status & 0x01) {
-				uint8_t * pbuf = (uint8_t *)rx_virt[rx_index];
-				uint16_t  plen = rx[rx_index].length;
-
-				void * packet = malloc(plen);
-				memcpy(packet, pbuf, plen);
-
-				rx[rx_index].status = 0;
-
-				enqueue_packet(packet);
-
-				write_command(E1000_REG_RXDESCTAIL, rx_index);
-			} else {
-				break;
-			}
-		} while (1);
+	}
+
+	if (status & ICR_RX) {
+		write_command(E1000_REG_IMC, ICR_RX);
 		wakeup_queue(rx_wait);
 	}
 
+	if (status & ICR_TXDW) {
+		write_command(E1000_REG_IMC, ICR_TXDW);
+		wakeup_queue(tx_wait);
+	}
+
 	return 1;
 }
 
-static void send_packet(uint8_t* payload, size_t payload_size) {
-	tx_index = read_command(E1000_REG_TXDESCTAIL);
-	debug_print(E1000_LOG_LEVEL,"sending packet 0x%x, %d desc[%d]", payload, payload_size, tx_index);
+static void rx_give_back(void) {
+	write_command(E1000_REG_RXDESCTAIL, rx_tail);
+}
+
+static struct netbuf * rx_poll(void) {
+	static int since_refill = 0;
+
+	while (rx[rx_index].status & DESC_DD) {
+		uint8_t * pbuf = rx_virt[rx_index];
+		uint16_t  plen = rx[rx_index].length;
+		struct netbuf * nb = NULL;
 
-	memcpy(tx_virt[tx_index], payload, payload_size);
-	tx[tx_index].length = payload_size;
-	tx[tx_index].cmd = CMD_EOP | CMD_IFCS | CMD_RS; //| CMD_RPS;
+		if (plen <= NETBUF_SIZE - NETBUF_HEADROOM) {
+			nb = netbuf_alloc();
+			memcpy(nb->data, pbuf, plen);
+			nb->len = plen;
+
+			uint8_t status = rx[rx_index].status;
+			if (!(status & RX_STATUS_IXSM) &&
+				(status & (RX_STATUS_IPCS | RX_STATUS_TCPCS)) == (RX_STATUS_IPCS | RX_STATUS_TCPCS) &&
+				!(rx[rx_index].errors & (RX_ERROR_IPE | RX_ERROR_TCPE))) {
+				nb->flags |= NETBUF_RX_CSUM_OK;
+			}
+		}
+
+		rx[rx_index].status = 0;
+		rx_tail = rx_index;
+		rx_index = (rx_index + 1) % e1000_num_rx_desc;
+
+		if (++since_refill == E1000_RX_REFILL) {
+			since_refill = 0;
+			rx_give_back();
+		}
+
+		if (nb) return nb;
+	}
+
+	since_refill = 0;
+	rx_give_back();
+	return NULL;
+}
+
+static struct netbuf * dequeue_packet(void) {
+	while (1) {
+		struct netbuf * nb = rx_poll();
+		if (nb) return nb;
+
+		/* Ring is empty; sleep until the card interrupts again */
+		uint32_t flags = int_save();
+		write_command(E1000_REG_IMS, ICR_RX);
+		if (rx[rx_index].status & DESC_DD) {
+			/* Something came in while we were turning interrupts on */
+			write_command(E1000_REG_IMC, ICR_RX);
+		} else {
+			sleep_on(rx_wait);
+		}
+		int_restore(flags);
+	}
+}
+
+/* Move tx_clean past descriptors the card is done with; returns free slots. */
+static int tx_reclaim(void) {
+	while (tx_clean != tx_index && (tx[tx_clean].status & DESC_DD)) {
+		if (tx_held[tx_clean]) {
+			netbuf_release(tx_held[tx_clean]);
+			tx_held[tx_clean] = NULL;
+		}
+		tx_clean = (tx_clean + 1) % e1000_num_tx_desc;
+	}
+	return (tx_clean - tx_index - 1 + e1000_num_tx_desc) % e1000_num_tx_desc;
+}
+
+/* Wait for `count` free transmit slots; call with tx_lock held */
+static void tx_wait_for(int count) {
+	while (tx_reclaim() < count) {
+		/* Ring is full; wait for the card to write back a descriptor */
+		uint32_t flags = int_save();
+		write_command(E1000_REG_IMS, ICR_TXDW);
+		if (tx_reclaim() < count) {
+			sleep_on(tx_wait);
+		}
+		int_restore(flags);
+	}
+}
+
+/*
+ * Whether a frame would fit in the ring right now, for the socket layer
+ * to wait on instead of blocking in here. Only looks, as the sender
+ * holding tx_lock may be in the middle of reclaiming; when the answer
+ * is no, the next write-back interrupt wakes tx_wait.
+ */
+static int tx_room(void) {
+	int clean = tx_clean;
+	int index = tx_index;
+	while (clean != index && (tx[clean].status & DESC_DD)) {
+		clean = (clean + 1) % e1000_num_tx_desc;
+	}
+	if ((clean - index - 1 + e1000_num_tx_desc) % e1000_num_tx_desc >= E1000_TX_FRAME_DESC) {
+		return 1;
+	}
+	write_command(E1000_REG_IMS, ICR_TXDW);
+	return 0;
+}
+
+/* Part of a frame the card reads from where it is */
+struct tx_piece {
+	uintptr_t phys;
+	size_t length;
+	struct netbuf * nb; /* Released when this, its last piece, is done */
+};
+
+/*
+ * Add the pages under [data, data+length) to a frame's pieces; a netbuf
+ * needn't be physically contiguous. Returns the new count, or -1 if
+ * they don't fit.
+ */
+static int tx_gather(struct tx_piece * pieces, int count, uint8_t * data, size_t length, struct netbuf * nb) {
+	while (length) {
+		size_t chunk = MIN(length, 0x1000 - ((uintptr_t)data & 0xFFF));
+		uintptr_t phys = map_to_physical((uintptr_t)data);
+		if (count && pieces[count-1].phys + pieces[count-1].length == phys && !pieces[count-1].nb) {
+			pieces[count-1].length += chunk;
+		} else if (count == E1000_TX_PIECES) {
+			return -1;
+		} else {
+			pieces[count].phys = phys;
+			pieces[count].length = chunk;
+			pieces[count].nb = NULL;
+			count++;
+		}
+		data += chunk;
+		length -= chunk;
+	}
+	if (count) pieces[count-1].nb = nb;
+	return count;
+}
+
+static void tx_put(uintptr_t addr, size_t length, uint8_t popts, int last, struct netbuf * nb) {
+	tx[tx_index].addr = addr;
+	tx[tx_index].length = length;
+	if (popts) {
+		tx[tx_index].cso = TX_DTYP_DATA;
+		tx[tx_index].cmd = CMD_IFCS | CMD_RS | CMD_DEXT;
+		tx[tx_index].css = popts;
+	} else {
+		tx[tx_index].cso = 0;
+		tx[tx_index].cmd = CMD_IFCS | CMD_RS; //| CMD_RPS;
+		tx[tx_index].css = 0;
+	}
+	if (last) tx[tx_index].cmd |= CMD_EOP;
 	tx[tx_index].status = 0;
+	tx_held[tx_index] = nb;
+
+	tx_index = (tx_index + 1) % e1000_num_tx_desc;
+}
+
+/*
+ * One frame: `payload` copied into this slot's buffer (NULL if it's
+ * already there), then any pieces the card reads for itself. Every
+ * descriptor asks for a write-back so tx_reclaim() can follow them.
+ */
+static void tx_queue(uint8_t * payload, size_t payload_size, uint8_t popts, struct tx_piece * pieces, int count) {
+	debug_print(E1000_LOG_LEVEL,"sending packet 0x%x, %d + %d pieces desc[%d]", payload, payload_size, count, tx_index);
+
+	if (payload) memcpy(tx_virt[tx_index], payload, payload_size);
+	/* A context may have been here, so the address is always set */
+	tx_put(tx_buf_phys + tx_index * E1000_BUFFER_SIZE, payload_size, popts, !count, NULL);
+	for (int i = 0; i < count; ++i) {
+		if (pieces[i].nb) netbuf_hold(pieces[i].nb);
+		tx_put(pieces[i].phys, pieces[i].length, popts, i == count - 1, pieces[i].nb);
+	}
 
-	tx_index = (tx_index + 1) % E1000_NUM_TX_DESC;
 	write_command(E1000_REG_TXDESCTAIL, tx_index);
 }
 
+static void send_packet(uint8_t* payload, size_t payload_size) {
+	if (payload_size > E1000_BUFFER_SIZE) {
+		debug_print(WARNING, "e1000: dropping oversized frame of %d bytes", payload_size);
+		return;
+	}
+
+	spin_lock(tx_lock);
+	tx_wait_for(1);
+	tx_queue(payload, payload_size, 0, NULL, 0);
+	spin_unlock(tx_lock);
+}
+
+/*
+ * Frames with checksum offload, which may be chained. The card keeps
+ * the last context it was given, and every frame we offload has the
+ * same layout (Ethernet, IPv4 without options, TCP), so a context only
+ * goes out when that changes.
+ *
+ * The headers are copied: a segment kept for retransmission gets new
+ * ones pushed over the old when it goes again, maybe before the card
+ * has read these. Payloads are read by the card from the netbufs,
+ * which are held until it has; short ones are copied along with the
+ * headers, and a frame in too many pieces is copied whole.
+ */
+static void send_netbuf(struct netbuf * nb) {
+	size_t total = 0;
+	for (struct netbuf * f = nb; f; f = f->next) {
+		total += f->len;
+	}
+	if (total > E1000_BUFFER_SIZE) {
+		debug_print(WARNING, "e1000: dropping oversized frame of %d bytes", total);
+		return;
+	}
+
+	static int context_ip_len = -1;
+	struct ipv4_packet * ipv4 = (struct ipv4_packet *)(nb->data + sizeof(struct ethernet_packet));
+	int ip_start = sizeof(struct ethernet_packet);
+	int ip_len = (ipv4->version_ihl & 0xF) * 4;
+	size_t headers = ip_start + ip_len + (nb->data[ip_start + ip_len + 12] >> 4) * 4;
+
+	uint8_t popts = 0;
+	if (nb->flags & NETBUF_TX_CSUM_IP)  popts |= POPTS_IXSM;
+	if (nb->flags & NETBUF_TX_CSUM_TCP) popts |= POPTS_TXSM;
+
+	struct tx_piece pieces[E1000_TX_PIECES];
+	int count = 0;
+	size_t copy = nb->len;
+	if (nb->len >= headers + E1000_TX_COPYBREAK) {
+		copy = headers;
+		count = tx_gather(pieces, 0, nb->data + headers, nb->len - headers, nb);
+	}
+	for (struct netbuf * f = nb->next; f && count >= 0; f = f->next) {
+		count = tx_gather(pieces, count, f->data, f->len, f);
+	}
+
+	int scattered = count < 0;
+	if (scattered) count = 0;
+
+	spin_lock(tx_lock);
+
+	if (ip_len != context_ip_len) {
+		tx_wait_for(count + 2);
+		struct tx_context_desc * ctx = (struct tx_context_desc *)&tx[tx_index];
+		ctx->ipcss = ip_start;
+		ctx->ipcso = ip_start + 10; /* ipv4_packet.checksum */
+		ctx->ipcse = ip_start + ip_len - 1;
+		ctx->tucss = ip_start + ip_len;
+		ctx->tucso = ip_start + ip_len + 16; /* tcp_header.checksum */
+		ctx->tucse = 0;
+		ctx->cmd_len = TX_DTYP_CONTEXT | TUCMD_TCP | TUCMD_IP | TUCMD_RS | TUCMD_DEXT;
+		ctx->status = 0;
+		ctx->hdrlen = 0;
+		ctx->mss = 0;
+		tx_held[tx_index] = NULL;
+		tx_index = (tx_index + 1) % e1000_num_tx_desc;
+		context_ip_len = ip_len;
+	} else {
+		tx_wait_for(count + 1);
+	}
+
+	if (scattered) {
+		/* Too many pieces to send as they are */
+		size_t offset = 0;
+		for (struct netbuf * f = nb; f; f = f->next) {
+			memcpy(tx_virt[tx_index] + offset, f->data, f->len);
+			offset += f->len;
+		}
+		tx_queue(NULL, total, popts, NULL, 0);
+	} else {
+		tx_queue(nb->data, copy, popts, pieces, count);
+	}
+	spin_unlock(tx_lock);
+}
+
 static void init_rx(void) {
 
 	write_command(E1000_REG_RXDESCLO, rx_phys);
 	write_command(E1000_REG_RXDESCHI, 0);
 
-	write_command(E1000_REG_RXDESCLEN, E1000_NUM_RX_DESC * sizeof(struct rx_desc));
+	write_command(E1000_REG_RXDESCLEN, e1000_num_rx_desc * sizeof(struct rx_desc));
 
 	write_command(E1000_REG_RXDESCHEAD, 0);
-	write_command(E1000_REG_RXDESCTAIL, E1000_NUM_RX_DESC - 1);
+	write_command(E1000_REG_RXDESCTAIL, e1000_num_rx_desc - 1);
 
 	rx_index = 0;
+	rx_tail = e1000_num_rx_desc - 1;
+
+	write_command(E1000_REG_RXCSUM, RXCSUM_IPOFL | RXCSUM_TUOFL);
 
 	write_command(E1000_REG_RCTRL,
 		RCTL_EN  |
@@ -302,12 +609,13 @@ static void init_tx(void) {
 	write_command(E1000_REG_TXDESCLO, tx_phys);
 	write_command(E1000_REG_TXDESCHI, 0);
 
-	write_command(E1000_REG_TXDESCLEN, E1000_NUM_TX_DESC * sizeof(struct tx_desc));
+	write_command(E1000_REG_TXDESCLEN, e1000_num_tx_desc * sizeof(struct tx_desc));
 
 	write_command(E1000_REG_TXDESCHEAD, 0);
 	write_command(E1000_REG_TXDESCTAIL, 0);
 
 	tx_index = 0;
+	tx_clean = 0;
 
 	write_command(E1000_REG_TCTRL,
 		TCTL_EN |
@@ -315,8 +623,38 @@ static void init_tx(void) {
 		read_command(E1000_REG_TCTRL));
 }
 
+static void set_moderation(void) {
+	char * c;
+	int rate = E1000_IRQRATE_DEFAULT;
+	int rdtr = E1000_RDTR_DEFAULT;
+	if ((c = args_value("e1000_irqrate"))) rate = atoi(c);
+	if ((c = args_value("e1000_rdtr"))) rdtr = atoi(c);
+
+	/* ITR counts in 256ns, the receive timers in 1.024us */
+	write_command(E1000_REG_ITR, rate > 0 ? 1000000000 / (rate * 256) : 0);
+	if (rdtr > 0) {
+		write_command(E1000_REG_RDTR, rdtr);
+		write_command(E1000_REG_RADV, MIN(rdtr * 4, 0xFFFF));
+	} else {
+		write_command(E1000_REG_RDTR, 0);
+		write_command(E1000_REG_RADV, 0);
+	}
+	debug_print(E1000_LOG_LEVEL, "interrupt rate limit %d/s, receive delay %dus", rate, rdtr);
+}
+
+static int ring_size_arg(char * name, int def) {
+	char * c = args_value(name);
+	if (!c) return def;
+	int n = atoi(c);
+	if (n < E1000_DESC_MIN) n = E1000_DESC_MIN;
+	if (n > E1000_DESC_MAX) n = E1000_DESC_MAX;
+	return n & ~(E1000_DESC_MIN - 1);
+}
+
+static work_t e1000_init_work;
 
-static void e1000_init(void * data, char * name) {
+/* Bringing the device up sleeps through several resets; a worker waits them out */
+static void e1000_init(void * data) {
 
 	debug_print(E1000_LOG_LEVEL, "enabling bus mastering");
 	uint16_t command_reg = pci_read_field(e1000_device_pci, PCI_COMMAND, 2);
@@ -389,10 +727,14 @@ static void e1000_init(void * data, char * name) {
 	sleep_until((process_t *)current_process, s, ss);
 	switch_task(0);
 
-	net_queue = list_create();
 	rx_wait = list_create();
+	tx_wait = list_create();
 
-	e1000_irq = pci_get_interrupt(e1000_device_pci);
+	e1000_irq = pci_enable_msi(e1000_device_pci);
+	if (e1000_irq < 0) {
+		/* The 82540EM QEMU emulates has no MSI; it shares a line */
+		e1000_irq = pci_get_interrupt(e1000_device_pci);
+	}
 
 	irq_install_handler(e1000_irq, irq_handler, "e1000");
 
@@ -418,10 +760,12 @@ static void e1000_init(void * data, char * name) {
 	init_rx();
 	init_tx();
 
-	/* Twiddle interrupts */
-	write_command(0x00D0, 0xFF);
-	write_command(0x00D8, 0xFF);
-	write_command(0x00D0,(1 << 2) | (1 << 6) | (1 << 7) | (1 << 1) | (1 << 0));
+	set_moderation();
+
+	/* Twiddle interrupts; transmit ones are only asked for when the ring fills */
+	write_command(E1000_REG_IMS, 0xFF);
+	write_command(E1000_REG_IMC, 0xFF);
+	write_command(E1000_REG_IMS, ICR_LSC | ICR_RX);
 
 	relative_time(0, 10, &s, &ss);
 	sleep_until((process_t *)current_process, s, ss);
@@ -430,7 +774,9 @@ static void e1000_init(void * data, char * name) {
 	int link_is_up = (read_command(E1000_REG_STATUS) & (1 << 1));
 	debug_print(E1000_LOG_LEVEL,"e1000 done. has_eeprom = %d, link is up = %d, irq=%d", has_eeprom, link_is_up, e1000_irq);
 
-	init_netif_funcs(get_mac, dequeue_packet, send_packet, "Intel E1000");
+	struct netif * netif = init_netif_funcs(get_mac, dequeue_packet, send_packet, "Intel E1000");
+	init_netif_offload(netif, NETIF_CAP_TX_CSUM | NETIF_CAP_RX_CSUM | NETIF_CAP_SG, send_netbuf);
+	init_netif_tx_room(netif, tx_room, tx_wait);
 }
 
 static int init(void) {
@@ -449,25 +795,39 @@ static int init(void) {
 		dma_frame(get_page(addr, 1, kernel_directory), 1, 1, addr);
 	}
 
-	rx = (void*)kvmalloc_p(sizeof(struct rx_desc) * E1000_NUM_RX_DESC + 16, &rx_phys);
+	e1000_num_rx_desc = ring_size_arg("e1000_rx", E1000_RX_DESC_DEFAULT);
+	e1000_num_tx_desc = ring_size_arg("e1000_tx", E1000_TX_DESC_DEFAULT);
+	debug_print(E1000_LOG_LEVEL, "%d receive and %d transmit descriptors", e1000_num_rx_desc, e1000_num_tx_desc);
+
+	rx_virt = malloc(sizeof(uint8_t *) * e1000_num_rx_desc);
+	tx_virt = malloc(sizeof(uint8_t *) * e1000_num_tx_desc);
+	tx_held = malloc(sizeof(struct netbuf *) * e1000_num_tx_desc);
+	memset(tx_held, 0, sizeof(struct netbuf *) * e1000_num_tx_desc);
 
-	for (int i = 0; i < E1000_NUM_RX_DESC; ++i) {
-		rx_virt[i] = (void*)kvmalloc_p(8192 + 16, (uint32_t *)&rx[i].addr);
-		debug_print(E1000_LOG_LEVEL, "rx[%d] 0x%x → 0x%x", i, rx_virt[i], (uint32_t)rx[i].addr);
+	/* Packet buffers are carved out of one physically contiguous block per ring */
+	uintptr_t buf_phys;
+
+	rx = (void*)kvmalloc_p(sizeof(struct rx_desc) * e1000_num_rx_desc + 16, &rx_phys);
+	uint8_t * rx_bufs = (void*)kvmalloc_p(E1000_BUFFER_SIZE * e1000_num_rx_desc, &buf_phys);
+
+	for (int i = 0; i < e1000_num_rx_desc; ++i) {
+		rx_virt[i] = rx_bufs + i * E1000_BUFFER_SIZE;
+		rx[i].addr = buf_phys + i * E1000_BUFFER_SIZE;
 		rx[i].status = 0;
 	}
 
-	tx = (void*)kvmalloc_p(sizeof(struct tx_desc) * E1000_NUM_TX_DESC + 16, &tx_phys);
+	tx = (void*)kvmalloc_p(sizeof(struct tx_desc) * e1000_num_tx_desc + 16, &tx_phys);
+	uint8_t * tx_bufs = (void*)kvmalloc_p(E1000_BUFFER_SIZE * e1000_num_tx_desc, &tx_buf_phys);
 
-	for (int i = 0; i < E1000_NUM_TX_DESC; ++i) {
-		tx_virt[i] = (void*)kvmalloc_p(8192+16, (uint32_t *)&tx[i].addr);
-		debug_print(E1000_LOG_LEVEL, "tx[%d] 0x%x → 0x%x", i, tx_virt[i], (uint32_t)tx[i].addr);
+	for (int i = 0; i < e1000_num_tx_desc; ++i) {
+		tx_virt[i] = tx_bufs + i * E1000_BUFFER_SIZE;
+		tx[i].addr = tx_buf_phys + i * E1000_BUFFER_SIZE;
 		tx[i].status = 0;
 		tx[i].cmd = (1 << 0);
 	}
 
-
-	create_kernel_tasklet(e1000_init, "[e1000]", NULL);
+	work_init(&e1000_init_work, e1000_init, NULL, WORK_NORMAL);
+	queue_work(&e1000_init_work);
 
 	return 0;
 }
@@ -6,12 +6,17 @@
 #include <kernel/system.h>
 #include <kernel/types.h>
 #include <kernel/fs.h>
+#include <kernel/slab.h>
 #include <kernel/ext2.h>
 #include <kernel/logging.h>
 #include <kernel/module.h>
 #include <kernel/args.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
+#include <kernel/workqueue.h>
+#include <kernel/block.h>
+
+#include <toaru/hashmap.h>
 
 #define EXT2_BGD_BLOCK 2
 
@@ -23,6 +28,39 @@
 #undef _symlink
 #define _symlink(inode) ((char *)(inode)->block)
 
+#define EXT2_CACHE_SHARDS       8   /* Independently locked partitions of the block cache */
+#define EXT2_WRITEBACK_INTERVAL 5   /* Seconds between writeback passes */
+#define EXT2_WRITEBACK_BATCH    64  /* Dirty blocks flushed per shard per pass */
+#define EXT2_NAME_CACHE_DIRS    32  /* Unindexed directories with an in-memory name table */
+#define EXT2_FILE_MAPS          16  /* Inodes with a cached block map and readahead window */
+#define EXT2_READAHEAD_BYTES    0x10000 /* Largest readahead for sequential reads */
+#define EXT2_PREALLOC_FILES     8   /* Files being appended to with blocks reserved ahead */
+#define EXT2_PREALLOC_BLOCKS    16  /* Blocks reserved at a time for such a file */
+#define EXT2_PREALLOC_MAX       1024 /* Most blocks reserved at once for one large write */
+
+/*
+ * One partition of the block cache: a hash table of its cached blocks
+ * and an LRU list of all of its entries, under a single lock.
+ */
+typedef struct {
+	spin_lock_t               lock;
+	ext2_disk_cache_entry_t ** hash;               /* Hash buckets, cache_hash_mask+1 of them */
+	ext2_disk_cache_entry_t * lru_head;            /* Most recently used entry */
+	ext2_disk_cache_entry_t * lru_tail;            /* Least recently used entry, next to be replaced */
+	unsigned int              dirty_count;         /* Number of entries waiting to be written */
+} ext2_cache_shard_t;
+
+/*
+ * Blocks reserved in the bitmap for the next blocks of a file that is
+ * being appended to, so that they end up next to each other on disk.
+ */
+typedef struct {
+	uint32_t inode;   /* 0 if the slot is unused */
+	uint32_t iblock;  /* File block the next reserved block is for */
+	uint32_t block;   /* Next reserved disk block */
+	uint32_t count;
+} ext2_prealloc_t;
+
 /*
  * EXT2 filesystem object
  */
@@ -40,9 +78,10 @@ typedef struct {
 
 	ext2_disk_cache_entry_t * disk_cache;          /* Dynamically allocated array of cache entries */
 	unsigned int              cache_entries;       /* Size of ->disk_cache */
-	unsigned int              cache_time;          /* "timer" that increments with each cache read/write */
+	ext2_cache_shard_t        cache_shards[EXT2_CACHE_SHARDS];
+	unsigned int              cache_hash_mask;     /* Buckets per shard, minus one */
 
-	spin_lock_t               lock;                /* Synchronization lock point */
+	spin_lock_t               lock;                /* Serializes device access when the cache is disabled */
 
 	uint8_t                   bgd_block_span;
 	uint8_t                   bgd_offset;
@@ -50,9 +89,51 @@ typedef struct {
 
 	uint8_t *                 cache_data;
 
+	list_t                  * name_caches;         /* ext2_name_cache_t, most recently used last */
+	spin_lock_t               name_cache_lock;
+
+	list_t                  * file_maps;           /* ext2_file_map_t, most recently used last */
+	spin_lock_t               file_map_lock;
+
+	ext2_prealloc_t           prealloc[EXT2_PREALLOC_FILES];
+	unsigned int              prealloc_next;       /* Slot to reuse when all are taken */
+	unsigned int              prealloc_want;       /* New blocks the write in progress will need */
+	int                       superblock_dirty;    /* Free counts changed since the superblock was written */
+	work_t                    writeback;           /* Queued every EXT2_WRITEBACK_INTERVAL */
+
 	int flags;
 } ext2_fs_t;
 
+/*
+ * Name -> inode table for one large directory without a hash index,
+ * built the first time something is looked up in it.
+ */
+typedef struct {
+	uint32_t    inode;  /* Of the directory */
+	uint32_t    size;   /* Directory size when the table was built */
+	hashmap_t * names;  /* Values are inode numbers */
+} ext2_name_cache_t;
+
+/*
+ * Read state for one file: a window of its block map, so that reading
+ * through it does not resolve indirect blocks again for every block,
+ * and the data fetched ahead of a sequential reader.
+ */
+typedef struct {
+	uint32_t   inode;
+	int        busy;       /* Being used by a read */
+	int        stale;      /* File changed during that read */
+
+	uint32_t   map_first;  /* First file block in the window */
+	uint32_t   map_count;  /* 0 if the window is empty */
+	uint32_t * map;        /* Disk block for each; one block's worth of pointers */
+
+	uint64_t   next_offset; /* Where the last read ended */
+	uint32_t   ra_first;
+	uint32_t   ra_count;
+	uint8_t  * ra_data;    /* EXT2_READAHEAD_BYTES */
+} ext2_file_map_t;
+
 #define EXT2_FLAG_NOCACHE 0x0001
 
 /*
@@ -78,30 +159,101 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, uint32_t inode);
 static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  uint32_t inode);
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, uint32_t index);
 static fs_node_t * finddir_ext2(fs_node_t *node, char *name);
-static unsigned int allocate_block(ext2_fs_t * this);
+static unsigned int allocate_block(ext2_fs_t * this, unsigned int goal);
+static void name_cache_drop(ext2_fs_t * this, uint32_t dir_inode);
+static void file_map_drop(ext2_fs_t * this, uint32_t inode);
 
 /**
- * ext2->get_cache_time Increment and return the current cache time
- *
- * @returns Current cache time
+ * ext2->cache_shard Find the cache shard responsible for a block.
  */
-static unsigned int get_cache_time(ext2_fs_t * this) {
-	return this->cache_time++;
+static ext2_cache_shard_t * cache_shard(ext2_fs_t * this, unsigned int block_no) {
+	return &this->cache_shards[block_no % EXT2_CACHE_SHARDS];
+}
+
+/**
+ * ext2->cache_bucket Find the hash bucket for a block within its shard.
+ */
+static ext2_disk_cache_entry_t ** cache_bucket(ext2_fs_t * this, ext2_cache_shard_t * shard, unsigned int block_no) {
+	return &shard->hash[(block_no / EXT2_CACHE_SHARDS) & this->cache_hash_mask];
+}
+
+/**
+ * ext2->cache_lookup Find a cached block, or NULL if it is not in the cache.
+ */
+static ext2_disk_cache_entry_t * cache_lookup(ext2_fs_t * this, ext2_cache_shard_t * shard, unsigned int block_no) {
+	ext2_disk_cache_entry_t * entry = *cache_bucket(this, shard, block_no);
+	while (entry) {
+		if (entry->block_no == block_no) return entry;
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+/**
+ * ext2->cache_touch Move an entry to the most-recently-used end of its shard.
+ */
+static void cache_touch(ext2_cache_shard_t * shard, ext2_disk_cache_entry_t * entry) {
+	if (shard->lru_head == entry) return;
+
+	/* Unlink */
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	if (shard->lru_tail == entry) shard->lru_tail = entry->lru_prev;
+
+	/* And push to the front */
+	entry->lru_prev = NULL;
+	entry->lru_next = shard->lru_head;
+	if (shard->lru_head) shard->lru_head->lru_prev = entry;
+	shard->lru_head = entry;
+	if (!shard->lru_tail) shard->lru_tail = entry;
 }
 
 /**
  * ext2->cache_flush_dirty Flush dirty cache entry to the disk.
  *
- * @param ent_no Cache entry to dump
+ * @param entry Cache entry to dump
  * @returns Error code or E_SUCCESS
  */
-static int cache_flush_dirty(ext2_fs_t * this, unsigned int ent_no) {
-	write_fs(this->block_device, (DC[ent_no].block_no) * this->block_size, this->block_size, (uint8_t *)(DC[ent_no].block));
-	DC[ent_no].dirty = 0;
+static int cache_flush_dirty(ext2_fs_t * this, ext2_cache_shard_t * shard, ext2_disk_cache_entry_t * entry) {
+	write_fs(this->block_device, (entry->block_no) * this->block_size, this->block_size, (uint8_t *)(entry->block));
+	entry->dirty = 0;
+	shard->dirty_count--;
 
 	return E_SUCCESS;
 }
 
+/**
+ * ext2->cache_replace Recycle the least recently used entry of a shard for a new block.
+ *
+ * The old contents are written back first if they were dirty.
+ * The returned entry is hashed under `block_no` and is the most recently used.
+ */
+static ext2_disk_cache_entry_t * cache_replace(ext2_fs_t * this, ext2_cache_shard_t * shard, unsigned int block_no) {
+	ext2_disk_cache_entry_t * entry = shard->lru_tail;
+
+	if (entry->dirty) {
+		cache_flush_dirty(this, shard, entry);
+	}
+
+	/* Remove the old block from its hash chain */
+	if (entry->block_no) {
+		ext2_disk_cache_entry_t ** link = cache_bucket(this, shard, entry->block_no);
+		while (*link != entry) {
+			link = &(*link)->hash_next;
+		}
+		*link = entry->hash_next;
+	}
+
+	/* And insert it under its new block number */
+	ext2_disk_cache_entry_t ** bucket = cache_bucket(this, shard, block_no);
+	entry->block_no  = block_no;
+	entry->hash_next = *bucket;
+	*bucket = entry;
+
+	cache_touch(shard, entry);
+	return entry;
+}
+
 /**
  * ext2->rewrite_superblock Rewrite the superblock.
  *
@@ -129,12 +281,10 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 		return E_BADBLOCK;
 	}
 
-	/* This operation requires the filesystem lock to be obtained */
-	spin_lock(this->lock);
-
 	/* We can make reads without a cache in place. */
 	if (!DC) {
 		/* In such cases, we read directly from the block device */
+		spin_lock(this->lock);
 		read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf);
 		/* We are done, release the lock */
 		spin_unlock(this->lock);
@@ -142,53 +292,28 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 		return E_SUCCESS;
 	}
 
-	/*
-	 * Search the cache for this entry
-	 * We'll look for the oldest entry, too.
-	 */
-	int oldest = -1;
-	unsigned int oldest_age = UINT32_MAX;
-	for (unsigned int i = 0; i < this->cache_entries; ++i) {
-		if (DC[i].block_no == block_no) {
-			/* We found it! Update usage times */
-			DC[i].last_use = get_cache_time(this);
-			/* Read the block */
-			memcpy(buf, DC[i].block, this->block_size);
-			/* Release the lock */
-			spin_unlock(this->lock);
-			/* Success! */
-			return E_SUCCESS;
-		}
-		if (DC[i].last_use < oldest_age) {
-			/* We found an older block, remember this. */
-			oldest = i;
-			oldest_age = DC[i].last_use;
-		}
-	}
+	/* This operation requires the lock for this block's shard */
+	ext2_cache_shard_t * shard = cache_shard(this, block_no);
+	spin_lock(shard->lock);
 
-	/*
-	 * At this point, we did not find this block in the cache.
-	 * We are going to replace the oldest entry with this new one.
-	 */
-
-	/* We'll start by flushing the block if it was dirty. */
-	if (DC[oldest].dirty) {
-		cache_flush_dirty(this, oldest);
+	ext2_disk_cache_entry_t * entry = cache_lookup(this, shard, block_no);
+	if (entry) {
+		/* We found it! Mark it as recently used */
+		cache_touch(shard, entry);
+		memcpy(buf, entry->block, this->block_size);
+		spin_unlock(shard->lock);
+		return E_SUCCESS;
 	}
 
-	/* Then we'll read the new one */
-	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)DC[oldest].block);
+	/* Not cached: take over the least recently used entry and read into it */
+	entry = cache_replace(this, shard, block_no);
+	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)entry->block);
 
 	/* And copy the results to the output buffer */
-	memcpy(buf, DC[oldest].block, this->block_size);
-
-	/* And update the cache entry to point to the new block */
-	DC[oldest].block_no = block_no;
-	DC[oldest].last_use = get_cache_time(this);
-	DC[oldest].dirty = 0;
+	memcpy(buf, entry->block, this->block_size);
 
 	/* Release the lock */
-	spin_unlock(this->lock);
+	spin_unlock(shard->lock);
 
 	/* And return success */
 	return E_SUCCESS;
@@ -197,6 +322,9 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 /**
  * ext2->write_block Write a block to the block device.
  *
+ * With the cache enabled, the block is only marked dirty; it reaches
+ * the disk on eviction, on ext2_sync, or from the writeback tasklet.
+ *
  * @param block_no Block to write
  * @param buf      Data in the block
  * @returns Error code or E_SUCCESSS
@@ -208,72 +336,104 @@ static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
 		return E_BADBLOCK;
 	}
 
-	/* This operation requires the filesystem lock */
-	spin_lock(this->lock);
-
 	if (!DC) {
+		spin_lock(this->lock);
 		write_fs(this->block_device, block_no * this->block_size, this->block_size, buf);
 		spin_unlock(this->lock);
 		return E_SUCCESS;
 	}
 
-	/* Find the entry in the cache */
-	int oldest = -1;
-	unsigned int oldest_age = UINT32_MAX;
-	for (unsigned int i = 0; i < this->cache_entries; ++i) {
-		if (DC[i].block_no == block_no) {
-			/* We found it. Update the cache entry */
-			DC[i].last_use = get_cache_time(this);
-			DC[i].dirty = 1;
-			memcpy(DC[i].block, buf, this->block_size);
-			spin_unlock(this->lock);
-			return E_SUCCESS;
-		}
-		if (DC[i].last_use < oldest_age) {
-			/* Keep track of the oldest entry */
-			oldest = i;
-			oldest_age = DC[i].last_use;
-		}
-	}
+	/* This operation requires the lock for this block's shard */
+	ext2_cache_shard_t * shard = cache_shard(this, block_no);
+	spin_lock(shard->lock);
 
-	/* We did not find this element in the cache, so make room. */
-	if (DC[oldest].dirty) {
-		/* Flush the oldest entry */
-		cache_flush_dirty(this, oldest);
+	ext2_disk_cache_entry_t * entry = cache_lookup(this, shard, block_no);
+	if (entry) {
+		cache_touch(shard, entry);
+	} else {
+		/* We did not find this element in the cache, so make room. */
+		entry = cache_replace(this, shard, block_no);
 	}
 
 	/* Update the entry */
-	memcpy(DC[oldest].block, buf, this->block_size);
-	DC[oldest].block_no = block_no;
-	DC[oldest].last_use = get_cache_time(this);
-	DC[oldest].dirty = 1;
+	memcpy(entry->block, buf, this->block_size);
+	if (!entry->dirty) {
+		entry->dirty = 1;
+		shard->dirty_count++;
+	}
 
 	/* Release the lock */
-	spin_unlock(this->lock);
+	spin_unlock(shard->lock);
 
 	/* We're done. */
 	return E_SUCCESS;
 }
 
+/**
+ * ext2->cache_writeback Write out dirty blocks of one shard, oldest first.
+ *
+ * @param limit Maximum number of blocks to write, or 0 for all of them
+ */
+static void cache_writeback(ext2_fs_t * this, ext2_cache_shard_t * shard, unsigned int limit) {
+	spin_lock(shard->lock);
+	unsigned int written = 0;
+	for (ext2_disk_cache_entry_t * entry = shard->lru_tail; entry && shard->dirty_count; entry = entry->lru_prev) {
+		if (entry->dirty) {
+			cache_flush_dirty(this, shard, entry);
+			if (limit && ++written == limit) break;
+		}
+	}
+	spin_unlock(shard->lock);
+}
+
 static unsigned int ext2_sync(ext2_fs_t * this) {
-	if (!this->disk_cache) return 0;
+	if (this->superblock_dirty) {
+		this->superblock_dirty = 0;
+		rewrite_superblock(this);
+	}
 
-	/* This operation requires the filesystem lock */
-	spin_lock(this->lock);
+	if (!this->disk_cache) return 0;
 
-	/* Flush each cache entry. */
-	for (unsigned int i = 0; i < this->cache_entries; ++i) {
-		if (DC[i].dirty) {
-			cache_flush_dirty(this, i);
+	/*
+	 * Flush each cache entry. Neighbouring blocks are in different
+	 * shards, so one plug covers all of them.
+	 */
+	block_plug(this->block_device);
+	for (unsigned int i = 0; i < EXT2_CACHE_SHARDS; ++i) {
+		if (this->cache_shards[i].dirty_count) {
+			cache_writeback(this, &this->cache_shards[i], 0);
 		}
 	}
-
-	/* Release the lock */
-	spin_unlock(this->lock);
+	block_unplug(this->block_device);
 
 	return 0;
 }
 
+/**
+ * ext2->writeback Periodically flush batches of dirty blocks.
+ *
+ * Keeps the number of dirty blocks down so that eviction in the
+ * read path rarely has to stop and write.
+ */
+static void ext2_writeback(void * data) {
+	ext2_fs_t * this = data;
+
+	if (this->superblock_dirty) {
+		this->superblock_dirty = 0;
+		rewrite_superblock(this);
+	}
+
+	block_plug(this->block_device);
+	for (unsigned int i = 0; i < EXT2_CACHE_SHARDS; ++i) {
+		if (this->cache_shards[i].dirty_count) {
+			cache_writeback(this, &this->cache_shards[i], EXT2_WRITEBACK_BATCH);
+		}
+	}
+	block_unplug(this->block_device);
+
+	queue_delayed_work(&this->writeback, EXT2_WRITEBACK_INTERVAL * 1000);
+}
+
 /**
  * ext2->set_block_number Set the "real" block number for a given "inode" block number.
  *
@@ -286,6 +446,8 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 
 	unsigned int p = this->pointers_per_block;
 
+	file_map_drop(this, inode_no);
+
 	/* We're going to do some crazy math in a bit... */
 	unsigned int a, b, c, d, e, f, g;
 
@@ -297,7 +459,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
 		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
 		if (!inode->block[EXT2_DIRECT_BLOCKS]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, rblock);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS] = block_no;
 			write_inode(this, inode, inode_no);
@@ -317,7 +479,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		d = b - c * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+1]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, rblock);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+1] = block_no;
 			write_inode(this, inode, inode_no);
@@ -327,7 +489,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[c]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, rblock);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[c] = block_no;
 			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
@@ -351,7 +513,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		g = e - f * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+2]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, rblock);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+2] = block_no;
 			write_inode(this, inode, inode_no);
@@ -361,7 +523,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[d]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, rblock);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[d] = block_no;
 			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
@@ -371,7 +533,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, nblock, (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[f]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, rblock);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[f] = block_no;
 			write_block(this, nblock, (uint8_t *)tmp);
@@ -484,52 +646,249 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, uint32_t inde
 	return E_SUCCESS;
 }
 
-static unsigned int allocate_block(ext2_fs_t * this) {
-	unsigned int block_no     = 0;
-	unsigned int block_offset = 0;
-	unsigned int group        = 0;
-	uint8_t * bg_buffer = malloc(this->block_size);
+/**
+ * ext2->write_group Write back the descriptor of one block group.
+ */
+static void write_group(ext2_fs_t * this, unsigned int group) {
+	unsigned int i = group * sizeof(ext2_bgdescriptor_t) / this->block_size;
+	write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
+}
 
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_blocks_count > 0) {
-			read_block(this, BGD[i].block_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(block_offset)) {
-				++block_offset;
-			}
-			block_no = block_offset + SB->blocks_per_group * i;
-			group = i;
-			break;
+/**
+ * ext2->counts_changed The superblock's free counts changed.
+ *
+ * With the block cache on, the superblock is written with the next sync
+ * or writeback pass instead of once for every allocation.
+ */
+static void counts_changed(ext2_fs_t * this) {
+	if (DC) {
+		this->superblock_dirty = 1;
+	} else {
+		rewrite_superblock(this);
+	}
+}
+
+/**
+ * ext2->group_blocks Number of blocks in a group; the last one may be short.
+ */
+static unsigned int group_blocks(ext2_fs_t * this, unsigned int group) {
+	unsigned int first = SB->first_data_block + group * SB->blocks_per_group;
+	if (SB->blocks_count - first < SB->blocks_per_group) {
+		return SB->blocks_count - first;
+	}
+	return SB->blocks_per_group;
+}
+
+/**
+ * ext2->bitmap_find_free First clear bit in [from, to) of a bitmap, or `to`.
+ */
+static unsigned int bitmap_find_free(uint8_t * bg_buffer, unsigned int from, unsigned int to) {
+	unsigned int n = from;
+	while (n < to) {
+		if (!(n % 8) && BLOCKBYTE(n) == 0xFF) {
+			n += 8;
+			continue;
 		}
+		if (!BLOCKBIT(n)) return n;
+		n++;
 	}
+	return to;
+}
 
-	if (!block_no) {
-		debug_print(CRITICAL, "No available blocks, disk is out of space!");
-		free(bg_buffer);
-		return 0;
+/**
+ * ext2->allocate_blocks Reserve up to `want` consecutive blocks.
+ *
+ * Looks for the first free block at or after `goal`, in the goal's
+ * group first and then in the following groups that have free blocks,
+ * and takes as many of the free blocks right after it as it can, with
+ * one update of the bitmap and counts for the lot. The blocks are not
+ * cleared.
+ *
+ * @param goal Block we would like to have, 0 for no preference
+ * @param got  Set to the number of blocks reserved
+ * @returns First block reserved, or 0 if the disk is full
+ */
+static unsigned int allocate_blocks(ext2_fs_t * this, unsigned int goal, unsigned int want, unsigned int * got) {
+	if (goal < SB->first_data_block || goal >= SB->blocks_count) {
+		goal = SB->first_data_block;
 	}
+	unsigned int goal_group = (goal - SB->first_data_block) / SB->blocks_per_group;
+	unsigned int goal_bit   = (goal - SB->first_data_block) % SB->blocks_per_group;
 
-	debug_print(WARNING, "allocating block #%d (group %d)", block_no, group);
+	uint8_t * bg_buffer = malloc(this->block_size);
 
-	BLOCKBYTE(block_offset) |= SETBIT(block_offset);
-	write_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+	for (unsigned int n = 0; n < BGDS; ++n) {
+		unsigned int group = (goal_group + n) % BGDS;
+		if (!BGD[group].free_blocks_count) continue;
 
-	BGD[group].free_blocks_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
+		unsigned int bits  = group_blocks(this, group);
+		unsigned int start = n ? 0 : goal_bit;
+
+		read_block(this, BGD[group].block_bitmap, bg_buffer);
+		unsigned int bit = bitmap_find_free(bg_buffer, start, bits);
+		if (bit == bits) {
+			bit = bitmap_find_free(bg_buffer, 0, start);
+			if (bit == start) continue;
+		}
+
+		unsigned int count = 0;
+		while (count < want && count < BGD[group].free_blocks_count && bit + count < bits && !BLOCKBIT(bit + count)) {
+			BLOCKBYTE(bit + count) |= SETBIT(bit + count);
+			count++;
+		}
+		write_block(this, BGD[group].block_bitmap, bg_buffer);
+		free(bg_buffer);
+
+		BGD[group].free_blocks_count -= count;
+		write_group(this, group);
+		SB->free_blocks_count -= count;
+		counts_changed(this);
+
+		*got = count;
+		return SB->first_data_block + group * SB->blocks_per_group + bit;
 	}
 
-	SB->free_blocks_count--;
-	rewrite_superblock(this);
+	debug_print(CRITICAL, "No available blocks, disk is out of space!");
+	free(bg_buffer);
+	*got = 0;
+	return 0;
+}
 
-	memset(bg_buffer, 0x00, this->block_size);
-	write_block(this, block_no, bg_buffer);
+/**
+ * ext2->free_blocks Give back blocks taken with allocate_blocks().
+ *
+ * The range must lie within one group.
+ */
+static void free_blocks(ext2_fs_t * this, unsigned int block_no, unsigned int count) {
+	unsigned int group = (block_no - SB->first_data_block) / SB->blocks_per_group;
+	unsigned int bit   = (block_no - SB->first_data_block) % SB->blocks_per_group;
 
+	uint8_t * bg_buffer = malloc(this->block_size);
+	read_block(this, BGD[group].block_bitmap, bg_buffer);
+	for (unsigned int i = 0; i < count; ++i) {
+		BLOCKBYTE(bit + i) &= ~SETBIT(bit + i);
+	}
+	write_block(this, BGD[group].block_bitmap, bg_buffer);
 	free(bg_buffer);
 
+	BGD[group].free_blocks_count += count;
+	write_group(this, group);
+	SB->free_blocks_count += count;
+	counts_changed(this);
+}
+
+/**
+ * ext2->allocate_block Allocate one cleared block, as close to `goal` as we can.
+ */
+static unsigned int allocate_block(ext2_fs_t * this, unsigned int goal) {
+	unsigned int got;
+	unsigned int block_no = allocate_blocks(this, goal, 1, &got);
+	if (!block_no) return 0;
+
+	debug_print(WARNING, "allocating block #%d", block_no);
+
+	uint8_t * zero = malloc(this->block_size);
+	memset(zero, 0x00, this->block_size);
+	write_block(this, block_no, zero);
+	free(zero);
+
 	return block_no;
+}
 
+/**
+ * ext2->prealloc_release Return the unused blocks reserved for a file.
+ */
+static void prealloc_release(ext2_fs_t * this, ext2_prealloc_t * slot) {
+	if (slot->count) {
+		free_blocks(this, slot->block, slot->count);
+	}
+	slot->inode = 0;
+	slot->count = 0;
 }
 
+static void prealloc_drop(ext2_fs_t * this, uint32_t inode_no) {
+	for (unsigned int i = 0; i < EXT2_PREALLOC_FILES; ++i) {
+		if (this->prealloc[i].inode == inode_no) {
+			prealloc_release(this, &this->prealloc[i]);
+		}
+	}
+}
+
+/**
+ * ext2->allocate_file_block Pick the disk block for file block `iblock`.
+ *
+ * Aims for the block after the file's previous one, or for the inode's
+ * own group if this is the first. Regular files take a run of blocks
+ * at a time and keep the rest reserved for the blocks that follow.
+ *
+ * @returns Cleared block, or 0 if the disk is full
+ */
+static unsigned int allocate_file_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int iblock) {
+	unsigned int goal = iblock ? get_block_number(this, inode, iblock - 1) : 0;
+	if (goal) {
+		goal++;
+	} else {
+		goal = SB->first_data_block + ((inode_no - 1) / this->inodes_per_group) * SB->blocks_per_group;
+	}
+
+	if ((inode->mode & 0xF000) != EXT2_S_IFREG) {
+		return allocate_block(this, goal);
+	}
+
+	ext2_prealloc_t * slot = NULL;
+	for (unsigned int i = 0; i < EXT2_PREALLOC_FILES; ++i) {
+		if (this->prealloc[i].inode == inode_no) {
+			slot = &this->prealloc[i];
+			break;
+		}
+	}
+
+	unsigned int block_no;
+	if (slot && slot->count && slot->iblock == iblock) {
+		block_no = slot->block;
+		slot->block++;
+		slot->iblock++;
+		slot->count--;
+	} else {
+		if (slot) {
+			prealloc_release(this, slot);
+		} else {
+			for (unsigned int i = 0; i < EXT2_PREALLOC_FILES; ++i) {
+				if (!this->prealloc[i].inode) {
+					slot = &this->prealloc[i];
+					break;
+				}
+			}
+			if (!slot) {
+				slot = &this->prealloc[this->prealloc_next];
+				this->prealloc_next = (this->prealloc_next + 1) % EXT2_PREALLOC_FILES;
+				prealloc_release(this, slot);
+			}
+		}
+
+		/* A big write gets its blocks reserved in one go, so they end up together */
+		unsigned int want = EXT2_PREALLOC_BLOCKS;
+		if (this->prealloc_want > want) {
+			want = this->prealloc_want < EXT2_PREALLOC_MAX ? this->prealloc_want : EXT2_PREALLOC_MAX;
+		}
+
+		unsigned int got;
+		block_no = allocate_blocks(this, goal, want, &got);
+		if (!block_no) return 0;
+
+		slot->inode  = inode_no;
+		slot->iblock = iblock + 1;
+		slot->block  = block_no + 1;
+		slot->count  = got - 1;
+	}
+
+	uint8_t * zero = malloc(this->block_size);
+	memset(zero, 0x00, this->block_size);
+	write_block(this, block_no, zero);
+	free(zero);
+
+	return block_no;
+}
 
 /**
  * ext2->allocate_inode_block Allocate a block in an inode.
@@ -541,7 +900,7 @@ static unsigned int allocate_block(ext2_fs_t * this) {
  */
 static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
 	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
-	unsigned int block_no = allocate_block(this);
+	unsigned int block_no = allocate_file_block(this, inode, inode_no, block);
 
 	if (!block_no) return E_NOSPACE;
 
@@ -723,6 +1082,13 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 
 	inode_write_block(this, pinode, parent->inode, block_nr, block);
 
+	refresh_inode(this, pinode, parent->inode);
+	pinode->mtime = now();
+	/* We don't keep the hash index up to date, so stop using it */
+	pinode->flags &= ~EXT2_INDEX_FL;
+	write_inode(this, pinode, parent->inode);
+	name_cache_drop(this, parent->inode);
+
 	free(block);
 	free(pinode);
 
@@ -730,43 +1096,76 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	return E_NOSPACE;
 }
 
-static unsigned int allocate_inode(ext2_fs_t * this) {
-	uint32_t node_no     = 0;
-	uint32_t node_offset = 0;
-	uint32_t group       = 0;
-	uint8_t * bg_buffer  = malloc(this->block_size);
-
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_inodes_count > 0) {
-			debug_print(NOTICE, "Group %d has %d free inodes.", i, BGD[i].free_inodes_count);
-			read_block(this, BGD[i].inode_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(node_offset)) {
-				node_offset++;
+/**
+ * ext2->inode_group Choose the block group for a new inode.
+ *
+ * Files go in their directory's group, next to their siblings, so long
+ * as it still has room for their data. Directories are spread out:
+ * they go to the group with the most free blocks among those with at
+ * least an average share of free inodes.
+ *
+ * @returns Group number, or BGDS if there are no free inodes
+ */
+static unsigned int inode_group(ext2_fs_t * this, uint32_t parent, int directory) {
+	if (directory) {
+		unsigned int average = SB->free_inodes_count / BGDS;
+		unsigned int best = BGDS;
+		for (unsigned int i = 0; i < BGDS; ++i) {
+			if (!BGD[i].free_inodes_count || BGD[i].free_inodes_count < average) continue;
+			if (best == BGDS || BGD[i].free_blocks_count > BGD[best].free_blocks_count) {
+				best = i;
 			}
-			node_no = node_offset + i * this->inodes_per_group + 1;
-			group = i;
-			break;
 		}
+		if (best != BGDS) return best;
+	}
+
+	unsigned int parent_group = (parent - 1) / this->inodes_per_group;
+	for (unsigned int n = 0; n < BGDS; ++n) {
+		unsigned int group = (parent_group + n) % BGDS;
+		if (BGD[group].free_inodes_count && BGD[group].free_blocks_count) return group;
 	}
-	if (!node_no) {
+	for (unsigned int i = 0; i < BGDS; ++i) {
+		if (BGD[i].free_inodes_count) return i;
+	}
+	return BGDS;
+}
+
+/**
+ * ext2->allocate_inode Allocate an inode for a new entry in `parent`.
+ */
+static unsigned int allocate_inode(ext2_fs_t * this, uint32_t parent, int directory) {
+	unsigned int group = inode_group(this, parent, directory);
+	if (group == BGDS) {
 		debug_print(ERROR, "Ran out of inodes!");
 		return 0;
 	}
 
+	debug_print(NOTICE, "Group %d has %d free inodes.", group, BGD[group].free_inodes_count);
+
+	uint8_t * bg_buffer = malloc(this->block_size);
+	read_block(this, BGD[group].inode_bitmap, bg_buffer);
+	uint32_t node_offset = bitmap_find_free(bg_buffer, 0, this->inodes_per_group);
+	if (node_offset == this->inodes_per_group) {
+		debug_print(ERROR, "Group %d claims free inodes but has none", group);
+		free(bg_buffer);
+		return 0;
+	}
+
 	BLOCKBYTE(node_offset) |= SETBIT(node_offset);
 
-	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
+	write_block(this, BGD[group].inode_bitmap, bg_buffer);
 	free(bg_buffer);
 
 	BGD[group].free_inodes_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
+	if (directory) {
+		BGD[group].used_dirs_count++;
 	}
+	write_group(this, group);
 
 	SB->free_inodes_count--;
-	rewrite_superblock(this);
+	counts_changed(this);
 
-	return node_no;
+	return node_offset + group * this->inodes_per_group + 1;
 }
 
 static int mkdir_ext2(fs_node_t * parent, char * name, uint16_t permission) {
@@ -783,7 +1182,8 @@ static int mkdir_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode, 1);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -852,13 +1252,6 @@ static int mkdir_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 	write_inode(this, pinode, parent->inode);
 	free(pinode);
 
-	/* Update directory count in block group descriptor */
-	uint32_t group = inode_no / this->inodes_per_group;
-	BGD[group].used_dirs_count++;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uint32_t)BGD + this->block_size * i));
-	}
-
 	ext2_sync(this);
 
 	return 0;
@@ -878,7 +1271,8 @@ static int create_ext2(fs_node_t * parent, char * name, uint16_t permission) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode, 0);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -979,57 +1373,382 @@ static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, u
 	return NULL;
 }
 
-/**
- * finddir_ext2
+/*
+ * Directory hashes, as used by htree indexes. These follow the
+ * definitions in the ext3 directory indexing design.
  */
-static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
+#define DX_TEA_DELTA 0x9E3779B9
+
+static void dx_tea_transform(uint32_t buf[4], uint32_t const in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	for (int n = 0; n < 16; ++n) {
+		sum += DX_TEA_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
 
-	ext2_fs_t * this = (ext2_fs_t *)node->device;
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + (x), a = ((a) << (s)) | ((a) >> (32 - (s))))
+#define DX_K1 0
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+static void dx_half_md4_transform(uint32_t buf[4], uint32_t const in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1,  3);
+	DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1,  7);
+	DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1,  3);
+	DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1,  7);
+	DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static uint32_t dx_legacy_hash(const char * name, int len, int is_unsigned) {
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (int i = 0; i < len; ++i) {
+		int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static void dx_str2hashbuf(const char * msg, int len, uint32_t * buf, int num, int is_unsigned) {
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4) len = num * 4;
+	for (int i = 0; i < len; ++i) {
+		int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) *buf++ = val;
+	while (--num >= 0) *buf++ = pad;
+}
+
+static uint32_t dx_hash(ext2_fs_t * this, int version, const char * name, int len) {
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8];
+	uint32_t hash = 0;
+
+	for (int i = 0; i < 4; ++i) {
+		if (SB->hash_seed[i]) {
+			memcpy(buf, SB->hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	int is_unsigned = version >= EXT2_DX_HASH_LEGACY_UNSIGNED;
+	switch (version) {
+		case EXT2_DX_HASH_LEGACY:
+		case EXT2_DX_HASH_LEGACY_UNSIGNED:
+			hash = dx_legacy_hash(name, len, is_unsigned);
+			break;
+		case EXT2_DX_HASH_HALF_MD4:
+		case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+			for (const char * p = name; len > 0; len -= 32, p += 32) {
+				dx_str2hashbuf(p, len, in, 8, is_unsigned);
+				dx_half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case EXT2_DX_HASH_TEA:
+		case EXT2_DX_HASH_TEA_UNSIGNED:
+			for (const char * p = name; len > 0; len -= 16, p += 16) {
+				dx_str2hashbuf(p, len, in, 4, is_unsigned);
+				dx_tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1U;
+	if (hash == (0x7fffffffU << 1)) hash = (0x7fffffffU - 1) << 1;
+	return hash;
+}
+
+/*
+ * Look for `name` in one directory block. Returns its inode number, or 0.
+ */
+static uint32_t dir_block_lookup(ext2_fs_t * this, uint8_t * block, char * name, size_t len) {
+	uint32_t offset = 0;
+	while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)((uintptr_t)block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t)) break;
+		if (d_ent->inode && d_ent->name_len == len && !memcmp(d_ent->name, name, len)) {
+			return d_ent->inode;
+		}
+		offset += d_ent->rec_len;
+	}
+	return 0;
+}
+
+/*
+ * Look `name` up through the directory's htree index.
+ *
+ * Returns -1 if the directory has no index we understand, in which
+ * case the caller scans it instead; otherwise 0 with *out set to the
+ * inode number found, or 0 if there is no such name.
+ */
+static int dx_lookup(ext2_fs_t * this, ext2_inodetable_t * inode, char * name, uint32_t * out) {
+	if (!(SB->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) return -1;
+	if (!(inode->flags & EXT2_INDEX_FL)) return -1;
 
-	ext2_inodetable_t *inode = read_inode(this,node->inode);
-	assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
-	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
+	inode_read_block(this, inode, 0, block);
 
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
+	struct ext2_dx_root_info * info = (struct ext2_dx_root_info *)(block + 24);
+	if (info->reserved_zero || info->info_length != 8 || info->indirect_levels > 1 ||
+		info->hash_version > EXT2_DX_HASH_TEA) {
+		free(block);
+		return -1;
+	}
+
+	int version = info->hash_version;
+	if (SB->flags & EXT2_FLAGS_UNSIGNED_HASH) version += 3;
+	int levels = info->indirect_levels;
+
+	size_t len = strlen(name);
+	uint32_t hash = dx_hash(this, version, name, len);
+
+	/* Walk down the index to the leaf that should hold the name */
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(block + 24 + info->info_length);
+	uint32_t count, at;
+	while (1) {
+		struct ext2_dx_countlimit * cl = (struct ext2_dx_countlimit *)entries;
+		count = cl->count;
+		if (!count || count > cl->limit ||
+			(uintptr_t)&entries[count] > (uintptr_t)block + this->block_size) {
+			free(block);
+			return -1;
 		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
+		/* Last entry whose hash is not above ours; entry 0 covers everything below entry 1 */
+		uint32_t lo = 1, hi = count;
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+			if (entries[mid].hash > hash) hi = mid;
+			else lo = mid + 1;
+		}
+		at = lo - 1;
 
-			continue;
+		if (!levels--) break;
+
+		inode_read_block(this, inode, entries[at].block & 0x0FFFFFFF, block);
+		entries = (struct ext2_dx_entry *)(block + 8);
+	}
+
+	/* Copy the bottom index block's entries so the leaf can reuse `block` */
+	struct ext2_dx_entry * leaves = malloc(sizeof(struct ext2_dx_entry) * count);
+	memcpy(leaves, entries, sizeof(struct ext2_dx_entry) * count);
+
+	*out = 0;
+	while (1) {
+		inode_read_block(this, inode, leaves[at].block & 0x0FFFFFFF, block);
+		*out = dir_block_lookup(this, block, name, len);
+		if (*out) break;
+
+		/* Names that hash alike may continue into the next leaf, marked by the low bit */
+		if (++at >= count) break;
+		if ((leaves[at].hash & ~1U) != hash || !(leaves[at].hash & 1)) break;
+	}
+
+	free(leaves);
+	free(block);
+	return 0;
+}
+
+/*
+ * Plain scan of every block of a directory.
+ */
+static uint32_t linear_lookup(ext2_fs_t * this, ext2_inodetable_t * inode, char * name) {
+	uint8_t * block = malloc(this->block_size);
+	uint32_t blocks = (inode->size + this->block_size - 1) / this->block_size;
+	size_t len = strlen(name);
+	uint32_t found = 0;
+
+	for (uint32_t i = 0; i < blocks && !found; ++i) {
+		inode_read_block(this, inode, i, block);
+		found = dir_block_lookup(this, block, name, len);
+	}
+
+	free(block);
+	return found;
+}
+
+static void name_cache_free(ext2_name_cache_t * cache) {
+	hashmap_free(cache->names);
+	free(cache->names);
+	free(cache);
+}
+
+/*
+ * Forget the name table for a directory that was just changed.
+ */
+static void name_cache_drop(ext2_fs_t * this, uint32_t dir_inode) {
+	spin_lock(this->name_cache_lock);
+	foreach(node, this->name_caches) {
+		ext2_name_cache_t * cache = node->value;
+		if (cache->inode == dir_inode) {
+			list_delete(this->name_caches, node);
+			free(node);
+			name_cache_free(cache);
+			break;
 		}
+	}
+	spin_unlock(this->name_cache_lock);
+}
 
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = malloc(d_ent->rec_len);
-			memcpy(direntry, d_ent, d_ent->rec_len);
+static ext2_name_cache_t * name_cache_build(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t dir_inode) {
+	ext2_name_cache_t * cache = malloc(sizeof(ext2_name_cache_t));
+	cache->inode = dir_inode;
+	cache->size  = inode->size;
+	cache->names = hashmap_create(64);
+
+	uint8_t * block = malloc(this->block_size);
+	uint32_t blocks = (inode->size + this->block_size - 1) / this->block_size;
+	char name[256];
+
+	for (uint32_t i = 0; i < blocks; ++i) {
+		inode_read_block(this, inode, i, block);
+		uint32_t offset = 0;
+		while (offset + sizeof(ext2_dir_t) <= this->block_size) {
+			ext2_dir_t * d_ent = (ext2_dir_t *)((uintptr_t)block + offset);
+			if (d_ent->rec_len < sizeof(ext2_dir_t)) break;
+			if (d_ent->inode) {
+				memcpy(name, d_ent->name, d_ent->name_len);
+				name[d_ent->name_len] = '\0';
+				if (!hashmap_has(cache->names, name)) {
+					hashmap_set(cache->names, name, (void *)(uintptr_t)d_ent->inode);
+				}
+			}
+			offset += d_ent->rec_len;
+		}
+	}
+
+	free(block);
+	return cache;
+}
+
+/*
+ * Look `name` up in a large unindexed directory through its in-memory
+ * name table, building the table if we don't have one yet.
+ */
+static uint32_t name_cache_lookup(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t dir_inode, char * name) {
+	uint32_t found = 0;
+	int hit = 0;
+
+	spin_lock(this->name_cache_lock);
+	foreach(node, this->name_caches) {
+		ext2_name_cache_t * cache = node->value;
+		if (cache->inode == dir_inode) {
+			if (cache->size == inode->size) {
+				found = (uint32_t)(uintptr_t)hashmap_get(cache->names, name);
+				hit = 1;
+				/* Most recently used goes last */
+				list_delete(this->name_caches, node);
+				list_append(this->name_caches, node);
+			}
 			break;
 		}
-		free(dname);
+	}
+	spin_unlock(this->name_cache_lock);
 
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
+	if (hit) return found;
+
+	/* Reading the directory may block, so build the table unlocked */
+	ext2_name_cache_t * cache = name_cache_build(this, inode, dir_inode);
+	found = (uint32_t)(uintptr_t)hashmap_get(cache->names, name);
+
+	name_cache_drop(this, dir_inode);
+
+	spin_lock(this->name_cache_lock);
+	list_insert(this->name_caches, cache);
+	while (this->name_caches->length > EXT2_NAME_CACHE_DIRS) {
+		node_t * oldest = list_dequeue(this->name_caches);
+		name_cache_free(oldest->value);
+		free(oldest);
+	}
+	spin_unlock(this->name_cache_lock);
+
+	return found;
+}
+
+/**
+ * finddir_ext2
+ */
+static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
+
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+
+	ext2_inodetable_t *inode = read_inode(this,node->inode);
+	assert(inode->mode & EXT2_S_IFDIR);
+
+	uint32_t found = 0;
+	if (dx_lookup(this, inode, name, &found) < 0) {
+		if (inode->size > this->block_size) {
+			found = name_cache_lookup(this, inode, node->inode, name);
+		} else {
+			found = linear_lookup(this, inode, name);
+		}
 	}
 	free(inode);
-	if (!direntry) {
-		free(block);
+
+	if (!found) {
 		return NULL;
 	}
-	fs_node_t *outnode = malloc(sizeof(fs_node_t));
+
+	size_t len = strlen(name);
+	ext2_dir_t * direntry = malloc(sizeof(ext2_dir_t) + len);
+	direntry->inode = found;
+	direntry->rec_len = sizeof(ext2_dir_t) + len;
+	direntry->name_len = len;
+	direntry->file_type = 0;
+	memcpy(direntry->name, name, len);
+
+	fs_node_t *outnode = slab_alloc(&fs_node_cache);
 	memset(outnode, 0, sizeof(fs_node_t));
 
 	inode = read_inode(this, direntry->inode);
@@ -1040,7 +1759,6 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 
 	free(direntry);
 	free(inode);
-	free(block);
 	return outnode;
 }
 
@@ -1085,8 +1803,8 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 		dir_offset += d_ent->rec_len;
 		total_offset += d_ent->rec_len;
 	}
-	free(inode);
 	if (!direntry) {
+		free(inode);
 		free(block);
 		return -ENOENT;
 	}
@@ -1094,6 +1812,10 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 	direntry->inode = 0;
 
 	inode_write_block(this, inode, node->inode, block_nr, block);
+	inode->mtime = now();
+	write_inode(this, inode, node->inode);
+	name_cache_drop(this, node->inode);
+	free(inode);
 	free(block);
 
 	ext2_sync(this);
@@ -1132,48 +1854,282 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, uint32_t inode) {
 	return inodet;
 }
 
+static void file_map_reset(ext2_file_map_t * map) {
+	map->map_count = 0;
+	map->ra_count = 0;
+	map->stale = 0;
+}
+
+static void file_map_free(ext2_file_map_t * map) {
+	free(map->map);
+	if (map->ra_data) free(map->ra_data);
+	free(map);
+}
+
+static ext2_file_map_t * file_map_new(ext2_fs_t * this, uint32_t inode) {
+	ext2_file_map_t * map = malloc(sizeof(ext2_file_map_t));
+	memset(map, 0, sizeof(ext2_file_map_t));
+	map->inode = inode;
+	map->busy = 1;
+	map->map = malloc(this->block_size);
+	return map;
+}
+
+/*
+ * Take the read state for `inode`. If another read is already using it,
+ * the caller gets a private one that is thrown away afterwards.
+ */
+static ext2_file_map_t * file_map_get(ext2_fs_t * this, uint32_t inode) {
+	spin_lock(this->file_map_lock);
+
+	foreach(node, this->file_maps) {
+		ext2_file_map_t * map = node->value;
+		if (map->inode != inode) continue;
+		if (map->busy) {
+			spin_unlock(this->file_map_lock);
+			ext2_file_map_t * private = file_map_new(this, inode);
+			private->busy = 2;
+			return private;
+		}
+		map->busy = 1;
+		list_delete(this->file_maps, node);
+		list_append(this->file_maps, node);
+		spin_unlock(this->file_map_lock);
+		return map;
+	}
+
+	ext2_file_map_t * map = file_map_new(this, inode);
+	list_insert(this->file_maps, map);
+	if (this->file_maps->length > EXT2_FILE_MAPS) {
+		foreach(node, this->file_maps) {
+			ext2_file_map_t * old = node->value;
+			if (!old->busy) {
+				list_delete(this->file_maps, node);
+				free(node);
+				file_map_free(old);
+				break;
+			}
+		}
+	}
+
+	spin_unlock(this->file_map_lock);
+	return map;
+}
+
+static void file_map_put(ext2_fs_t * this, ext2_file_map_t * map) {
+	if (map->busy == 2) {
+		file_map_free(map);
+		return;
+	}
+	spin_lock(this->file_map_lock);
+	map->busy = 0;
+	if (map->stale) file_map_reset(map);
+	spin_unlock(this->file_map_lock);
+}
+
+/*
+ * The blocks of `inode` changed; forget what we know about them.
+ */
+static void file_map_drop(ext2_fs_t * this, uint32_t inode) {
+	spin_lock(this->file_map_lock);
+	foreach(node, this->file_maps) {
+		ext2_file_map_t * map = node->value;
+		if (map->inode == inode) {
+			if (map->busy) {
+				map->stale = 1;
+			} else {
+				file_map_reset(map);
+			}
+		}
+	}
+	spin_unlock(this->file_map_lock);
+}
+
+/*
+ * Load the window of the block map that covers file block `iblock`:
+ * the direct blocks, or the one table of pointers that holds it.
+ */
+static void file_map_fill(ext2_fs_t * this, ext2_inodetable_t * inode, ext2_file_map_t * map, uint32_t iblock) {
+	unsigned int p = this->pointers_per_block;
+
+	if (iblock < EXT2_DIRECT_BLOCKS) {
+		memcpy(map->map, inode->block, sizeof(uint32_t) * EXT2_DIRECT_BLOCKS);
+		map->map_first = 0;
+		map->map_count = EXT2_DIRECT_BLOCKS;
+		return;
+	}
+
+	uint32_t b = iblock - EXT2_DIRECT_BLOCKS;
+	uint32_t table;
+
+	if (b < p) {
+		map->map_first = EXT2_DIRECT_BLOCKS;
+		table = inode->block[EXT2_DIRECT_BLOCKS];
+	} else if ((b -= p) < p * p) {
+		map->map_first = EXT2_DIRECT_BLOCKS + p + (b / p) * p;
+		table = 0;
+		if (inode->block[EXT2_DIRECT_BLOCKS + 1] &&
+			read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)map->map) == E_SUCCESS) {
+			table = map->map[b / p];
+		}
+	} else if ((b -= p * p) / p < p * p) {
+		map->map_first = EXT2_DIRECT_BLOCKS + p + p * p + (b / p) * p;
+		table = 0;
+		if (inode->block[EXT2_DIRECT_BLOCKS + 2] &&
+			read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)map->map) == E_SUCCESS) {
+			table = map->map[b / (p * p)];
+			if (table && read_block(this, table, (uint8_t *)map->map) == E_SUCCESS) {
+				table = map->map[(b / p) % p];
+			} else {
+				table = 0;
+			}
+		}
+	} else {
+		debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
+		map->map_count = 0;
+		return;
+	}
+
+	if (!table || read_block(this, table, (uint8_t *)map->map) != E_SUCCESS) {
+		/* A hole */
+		memset(map->map, 0, this->block_size);
+	}
+	map->map_count = p;
+}
+
+/*
+ * Disk block behind file block `iblock`, and in *run how many of the
+ * following file blocks (up to `limit`) sit right after it on disk.
+ */
+static uint32_t file_map_run(ext2_fs_t * this, ext2_inodetable_t * inode, ext2_file_map_t * map, uint32_t iblock, uint32_t limit, uint32_t * run) {
+	if (!map->map_count || iblock < map->map_first || iblock >= map->map_first + map->map_count) {
+		file_map_fill(this, inode, map, iblock);
+		if (!map->map_count) {
+			*run = 1;
+			return 0;
+		}
+	}
+
+	uint32_t index = iblock - map->map_first;
+	uint32_t start = map->map[index];
+	uint32_t count = 1;
+	while (start && count < limit && index + count < map->map_count &&
+			map->map[index + count] == start + count) {
+		count++;
+	}
+	*run = count;
+	return start;
+}
+
+/*
+ * Read `count` consecutive disk blocks in one request to the device,
+ * bypassing the block cache, except for blocks that are waiting there
+ * to be written back, as those are newer than what is on the disk.
+ */
+static void read_block_run(ext2_fs_t * this, uint32_t block_no, uint32_t count, uint8_t * buf) {
+	if (!DC) {
+		spin_lock(this->lock);
+		read_fs(this->block_device, (uint64_t)block_no * this->block_size, count * this->block_size, buf);
+		spin_unlock(this->lock);
+		return;
+	}
+
+	read_fs(this->block_device, (uint64_t)block_no * this->block_size, count * this->block_size, buf);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		ext2_cache_shard_t * shard = cache_shard(this, block_no + i);
+		spin_lock(shard->lock);
+		ext2_disk_cache_entry_t * entry = cache_lookup(this, shard, block_no + i);
+		if (entry && entry->dirty) {
+			memcpy(buf + i * this->block_size, entry->block, this->block_size);
+		}
+		spin_unlock(shard->lock);
+	}
+}
+
 static uint32_t read_ext2(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
-	uint32_t end;
-	if (inode->size == 0) return 0;
-	if (offset + size > inode->size) {
+	if (offset >= inode->size) {
+		free(inode);
+		return 0;
+	}
+
+	uint64_t end = offset + size;
+	if (end > inode->size) {
 		end = inode->size;
-	} else {
-		end = offset + size;
 	}
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
 
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
-			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
-			}
+	uint32_t bs = this->block_size;
+	uint32_t last_block = (inode->size - 1) / bs;
+	uint32_t ra_blocks = EXT2_READAHEAD_BYTES / bs;
+
+	ext2_file_map_t * map = file_map_get(this, node->inode);
+	int sequential = (offset == map->next_offset);
+	uint8_t * tmp = NULL;
+
+	uint64_t pos = offset;
+	while (pos < end) {
+		uint32_t iblock = pos / bs;
+		uint32_t in_block = pos % bs;
+		uint32_t chunk = bs - in_block;
+		if (chunk > end - pos) chunk = end - pos;
+		uint8_t * out = buffer + (pos - offset);
+
+		/* Already read ahead */
+		if (map->ra_count && iblock >= map->ra_first && iblock < map->ra_first + map->ra_count) {
+			memcpy(out, map->ra_data + (iblock - map->ra_first) * bs + in_block, chunk);
+			pos += chunk;
+			continue;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
+
+		uint32_t run;
+		uint32_t block_no = file_map_run(this, inode, map, iblock, last_block - iblock + 1, &run);
+
+		if (!block_no) {
+			/* Sparse */
+			memset(out, 0, chunk);
+			pos += chunk;
+			continue;
+		}
+
+		uint32_t whole = in_block ? 0 : (end - pos) / bs;
+
+		if (sequential && end - pos < EXT2_READAHEAD_BYTES) {
+			/* Small sequential reads: fetch the rest of the run ahead of them */
+			if (!map->ra_data) map->ra_data = malloc(EXT2_READAHEAD_BYTES);
+			if (run > ra_blocks) run = ra_blocks;
+			read_block_run(this, block_no, run, map->ra_data);
+			map->ra_first = iblock;
+			map->ra_count = run;
+			continue;
 		}
+
+		if (whole >= 2) {
+			/* Large reads go straight to the caller's buffer, a run at a time */
+			if (run > whole) run = whole;
+			read_block_run(this, block_no, run, out);
+			pos += run * bs;
+			continue;
+		}
+
+		if (!tmp) tmp = malloc(bs);
+		read_block(this, block_no, tmp);
+		memcpy(out, tmp + in_block, chunk);
+		pos += chunk;
 	}
+
+	map->next_offset = end;
+	file_map_put(this, map);
+
+	if (tmp) free(tmp);
 	free(inode);
-	free(buf);
-	return size_to_read;
+	return end - offset;
 }
 
 static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	file_map_drop(this, inode_number);
+
 	uint32_t end = offset + size;
 	if (end > inode->size) {
 		inode->size = end;
@@ -1184,6 +2140,12 @@ static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode,
 	uint32_t end_block    = end / this->block_size;
 	uint32_t end_size     = end - end_block * this->block_size;
 	uint32_t size_to_read = end - offset;
+
+	uint32_t allocated = inode->blocks / (this->block_size / 512);
+	if (end_block >= allocated) {
+		this->prealloc_want = end_block + 1 - allocated;
+	}
+
 	uint8_t * buf = malloc(this->block_size);
 	if (start_block == end_block) {
 		inode_read_block(this, inode, start_block, buf);
@@ -1193,7 +2155,7 @@ static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode,
 		uint32_t block_offset;
 		uint32_t blocks_read = 0;
 		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
+			if (block_offset == start_block && (offset % this->block_size)) {
 				int b = inode_read_block(this, inode, block_offset, buf);
 				memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
 				inode_write_block(this, inode, inode_number, block_offset, buf);
@@ -1201,9 +2163,9 @@ static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode,
 					refresh_inode(this, inode, inode_number);
 				}
 			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
-				inode_write_block(this, inode, inode_number, block_offset, buf);
+				/* Overwritten whole, so there's no need to read what was there */
+				int b = block_offset < inode->blocks / (this->block_size / 512);
+				inode_write_block(this, inode, inode_number, block_offset, buffer + this->block_size * blocks_read - (offset % this->block_size));
 				if (!b) {
 					refresh_inode(this, inode, inode_number);
 				}
@@ -1216,6 +2178,7 @@ static uint32_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode,
 		}
 	}
 	free(buf);
+	this->prealloc_want = 0;
 	return size_to_read;
 }
 
@@ -1233,6 +2196,7 @@ static void truncate_ext2(fs_node_t * node) {
 	ext2_inodetable_t * inode = read_inode(this,node->inode);
 	inode->size = 0;
 	write_inode(this, inode, node->inode);
+	file_map_drop(this, node->inode);
 }
 
 static void open_ext2(fs_node_t *node, unsigned int flags) {
@@ -1240,7 +2204,8 @@ static void open_ext2(fs_node_t *node, unsigned int flags) {
 }
 
 static void close_ext2(fs_node_t *node) {
-	/* Nothing to do here */
+	/* Hand back any blocks still reserved for appending to it */
+	prealloc_drop((ext2_fs_t *)node->device, node->inode);
 }
 
 
@@ -1258,7 +2223,7 @@ static struct dirent * readdir_ext2(fs_node_t *node, uint32_t index) {
 		free(inode);
 		return NULL;
 	}
-	struct dirent *dirent = malloc(sizeof(struct dirent));
+	struct dirent *dirent = slab_alloc(&dirent_cache);
 	memcpy(&dirent->name, &direntry->name, direntry->name_len);
 	dirent->name[direntry->name_len] = '\0';
 	dirent->ino = direntry->inode;
@@ -1267,6 +2232,53 @@ static struct dirent * readdir_ext2(fs_node_t *node, uint32_t index) {
 	return dirent;
 }
 
+/**
+ * getdents_ext2
+ *
+ * The cursor is a byte offset into the directory, so a listing reads
+ * each directory block once however many calls it takes.
+ */
+static uint32_t getdents_ext2(fs_node_t *node, uint64_t *offset, struct dirent *entries, uint32_t count) {
+
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+
+	ext2_inodetable_t *inode = read_inode(this, node->inode);
+	assert(inode->mode & EXT2_S_IFDIR);
+	uint8_t * block = malloc(this->block_size);
+	uint32_t loaded = (uint32_t)-1;
+	uint32_t pos = (uint32_t)*offset;
+	uint32_t got = 0;
+
+	while (got < count && pos < inode->size) {
+		uint32_t block_nr = pos / this->block_size;
+		if (block_nr != loaded) {
+			inode_read_block(this, inode, block_nr, block);
+			loaded = block_nr;
+		}
+
+		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + pos % this->block_size);
+		if (d_ent->rec_len == 0) {
+			/* Corrupt entry; skip the rest of the block */
+			pos = (block_nr + 1) * this->block_size;
+			continue;
+		}
+
+		if (d_ent->inode) {
+			memcpy(&entries[got].name, &d_ent->name, d_ent->name_len);
+			entries[got].name[d_ent->name_len] = '\0';
+			entries[got].ino = d_ent->inode;
+			got++;
+		}
+
+		pos += d_ent->rec_len;
+	}
+
+	*offset = pos;
+	free(block);
+	free(inode);
+	return got;
+}
+
 static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	if (!name) return -EINVAL;
 
@@ -1281,7 +2293,8 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode, 0);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -1393,10 +2406,11 @@ static uint32_t node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_
 		fnode->truncate = truncate_ext2;
 	}
 	if ((inode->mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
-		fnode->flags   |= FS_DIRECTORY;
+		fnode->flags   |= FS_DIRECTORY | FS_DCACHE;
 		fnode->create   = create_ext2;
 		fnode->mkdir    = mkdir_ext2;
 		fnode->readdir  = readdir_ext2;
+		fnode->getdents = getdents_ext2;
 		fnode->finddir  = finddir_ext2;
 		fnode->unlink   = unlink_ext2;
 		fnode->write    = NULL;
@@ -1488,13 +2502,14 @@ static uint32_t ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t
 	fnode->mtime   = inode->mtime;
 	fnode->ctime   = inode->ctime;
 
-	fnode->flags |= FS_DIRECTORY;
+	fnode->flags |= FS_DIRECTORY | FS_DCACHE;
 	fnode->read    = NULL;
 	fnode->write   = NULL;
 	fnode->chmod   = chmod_ext2;
 	fnode->open    = open_ext2;
 	fnode->close   = close_ext2;
 	fnode->readdir = readdir_ext2;
+	fnode->getdents = getdents_ext2;
 	fnode->finddir = finddir_ext2;
 	fnode->ioctl   = NULL;
 	fnode->create  = create_ext2;
@@ -1503,7 +2518,7 @@ static uint32_t ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t
 	return 1;
 }
 
-static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
+static fs_node_t * mount_ext2(fs_node_t * block_device, int flags, unsigned int cache_entries) {
 
 	debug_print(NOTICE, "Mounting ext2 file system...");
 	ext2_fs_t * this = malloc(sizeof(ext2_fs_t));
@@ -1511,6 +2526,8 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	memset(this, 0x00, sizeof(ext2_fs_t));
 
 	this->flags = flags;
+	this->name_caches = list_create();
+	this->file_maps = list_create();
 
 	this->block_device = block_device;
 	this->block_size = 1024;
@@ -1529,9 +2546,16 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 		this->inode_size = 128;
 	}
 	this->block_size = 1024 << SB->log_block_size;
-	this->cache_entries = 10240;
-	if (this->block_size > 2048) {
-		this->cache_entries /= 4;
+	if (cache_entries) {
+		this->cache_entries = cache_entries;
+	} else {
+		this->cache_entries = 10240;
+		if (this->block_size > 2048) {
+			this->cache_entries /= 4;
+		}
+	}
+	if (this->cache_entries < EXT2_CACHE_SHARDS) {
+		this->cache_entries = EXT2_CACHE_SHARDS;
 	}
 	debug_print(INFO, "bs=%d, cache entries=%d", this->block_size, this->cache_entries);
 	this->pointers_per_block = this->block_size / 4;
@@ -1547,16 +2571,41 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 		DC = malloc(sizeof(ext2_disk_cache_entry_t) * this->cache_entries);
 		this->cache_data = malloc(this->block_size * this->cache_entries);
 		memset(this->cache_data, 0, this->block_size * this->cache_entries);
+
+		/* Roughly one bucket per entry in each shard */
+		unsigned int buckets = 1;
+		while (buckets * EXT2_CACHE_SHARDS < this->cache_entries) {
+			buckets <<= 1;
+		}
+		this->cache_hash_mask = buckets - 1;
+
+		for (uint32_t i = 0; i < EXT2_CACHE_SHARDS; ++i) {
+			ext2_cache_shard_t * shard = &this->cache_shards[i];
+			spin_init(shard->lock);
+			shard->hash = malloc(sizeof(ext2_disk_cache_entry_t *) * buckets);
+			memset(shard->hash, 0, sizeof(ext2_disk_cache_entry_t *) * buckets);
+			shard->lru_head = NULL;
+			shard->lru_tail = NULL;
+			shard->dirty_count = 0;
+		}
+
+		/* Deal the (empty) entries out to the shards' LRU lists */
 		for (uint32_t i = 0; i < this->cache_entries; ++i) {
 			DC[i].block_no = 0;
 			DC[i].dirty = 0;
-			DC[i].last_use = 0;
 			DC[i].block = this->cache_data + i * this->block_size;
+			DC[i].hash_next = NULL;
+			DC[i].lru_prev = NULL;
+			DC[i].lru_next = NULL;
+			cache_touch(&this->cache_shards[i % EXT2_CACHE_SHARDS], &DC[i]);
 			if (i % 128 == 0) {
 				debug_print(INFO, "Allocated cache block #%d", i+1);
 			}
 		}
 		debug_print(INFO, "Allocated cache.");
+
+		work_init(&this->writeback, ext2_writeback, this, WORK_NORMAL);
+		queue_delayed_work(&this->writeback, EXT2_WRITEBACK_INTERVAL * 1000);
 	} else {
 		DC = NULL;
 		debug_print(NOTICE, "ext2 cache is disabled (nocache)");
@@ -1608,7 +2657,8 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 #endif
 
 	ext2_inodetable_t *root_inode = read_inode(this, 2);
-	RN = (fs_node_t *)malloc(sizeof(fs_node_t));
+	RN = slab_alloc(&fs_node_cache);
+	memset(RN, 0, sizeof(fs_node_t));
 	if (!ext2_root(this, root_inode, RN)) {
 		return NULL;
 	}
@@ -1629,16 +2679,19 @@ fs_node_t * ext2_fs_mount(char * device, char * mount_path) {
 	}
 
 	int flags = 0;
+	unsigned int cache_entries = 0;
 
 	for (int i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i],"nocache")) {
 			flags |= EXT2_FLAG_NOCACHE;
+		} else if (startswith(argv[i],"cache=")) {
+			cache_entries = atoi(argv[i] + strlen("cache="));
 		} else {
 			debug_print(WARNING, "Unrecognized option to ext2 driver: %s", argv[i]);
 		}
 	}
 
-	fs_node_t * fs = mount_ext2(dev, flags);
+	fs_node_t * fs = mount_ext2(dev, flags, cache_entries);
 
 	free(arg);
 	return fs;
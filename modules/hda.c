@@ -1,51 +1,810 @@
-/*
- * Experimental Intel High-Definition Audio "driver"
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Intel High Definition Audio
+ *
+ * Brings up the controller, finds the first codec with a way from a
+ * DAC to an output pin, and plays through the controller's first
+ * output stream. Verbs go to the codec on the CORB and come back on
+ * the RIRB, which we poll; after setup, only volume changes use them.
+ *
+ * The stream plays a cyclic buffer of HDA_BDL_LEN periods. Each one
+ * interrupts when it's done and wakes the [hda] tasklet, which reads
+ * where the stream is from the DMA position buffer and mixes the
+ * periods after it, staying hda_queue periods ahead. Unlike AC'97 the
+ * stream never stops for lack of data: if it catches up, it replays
+ * old audio, so that's counted as an underrun and we skip ahead.
+ *
+ * Kernel arguments: hda_rate= (44100, 48000, 96000 or 192000, if the
+ * DAC does it), hda_period= (frames per period), hda_queue= (periods
+ * mixed ahead), and hda_lpib to read positions from the stream's
+ * registers where the position buffer isn't trustworthy.
  */
-
+#include <kernel/system.h>
+#include <kernel/logging.h>
 #include <kernel/module.h>
-#include <kernel/printf.h>
 #include <kernel/pci.h>
-#include <kernel/mod/shell.h>
+#include <kernel/args.h>
+#include <kernel/mem.h>
+#include <kernel/process.h>
+#include <kernel/mod/snd.h>
+
+/* Utility macros */
+#define N_ELEMENTS(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/* Controller registers */
+#define HDA_GCAP      0x00
+#define HDA_GCTL      0x08
+#define HDA_STATESTS  0x0E
+#define HDA_INTCTL    0x20
+#define HDA_INTSTS    0x24
+#define HDA_CORBLBASE 0x40
+#define HDA_CORBUBASE 0x44
+#define HDA_CORBWP    0x48
+#define HDA_CORBRP    0x4A
+#define HDA_CORBCTL   0x4C
+#define HDA_CORBSIZE  0x4E
+#define HDA_RIRBLBASE 0x50
+#define HDA_RIRBUBASE 0x54
+#define HDA_RIRBWP    0x58
+#define HDA_RINTCNT   0x5A
+#define HDA_RIRBCTL   0x5C
+#define HDA_RIRBSTS   0x5D
+#define HDA_RIRBSIZE  0x5E
+#define HDA_DPLBASE   0x70
+#define HDA_DPUBASE   0x74
+#define HDA_SD(n)     (0x80 + (n) * 0x20)
+
+/* Stream descriptor registers, from HDA_SD() */
+#define SD_CTL   0x00
+#define SD_STS   0x03
+#define SD_LPIB  0x04
+#define SD_CBL   0x08
+#define SD_LVI   0x0C
+#define SD_FMT   0x12
+#define SD_BDPL  0x18
+#define SD_BDPU  0x1C
+
+#define GCTL_CRST      (1 << 0)
+#define INTCTL_GIE     (1UL << 31)
+#define CORBRP_RST     (1 << 15)
+#define CORBCTL_RUN    (1 << 1)
+#define RIRBWP_RST     (1 << 15)
+#define RIRBCTL_RUN    (1 << 1)
+#define DPLBASE_ENABLE (1 << 0)
+
+#define SD_CTL_SRST    (1 << 0)
+#define SD_CTL_RUN     (1 << 1)
+#define SD_CTL_IOCE    (1 << 2)
+#define SD_CTL_STRM(n) ((uint32_t)(n) << 20)
+#define SD_STS_BCIS    (1 << 2)
+#define SD_STS_CLEAR   0x1C /* BCIS, FIFOE and DESE */
+
+/* Verbs; the 4-bit ones carry a 16-bit payload */
+#define VERB_GET_PARAMETER     0xF00
+#define VERB_GET_CONN_LIST     0xF02
+#define VERB_GET_CONFIG        0xF1C
+#define VERB_SET_CONN_SELECT   0x701
+#define VERB_SET_POWER_STATE   0x705
+#define VERB_SET_STREAM        0x706
+#define VERB_SET_PIN_CONTROL   0x707
+#define VERB_SET_EAPD          0x70C
+#define VERB_SET_FORMAT        0x2
+#define VERB_SET_AMP           0x3
+
+/* Parameters */
+#define PARAM_SUBNODES         0x04
+#define PARAM_FUNCTION_TYPE    0x05
+#define PARAM_WIDGET_CAPS      0x09
+#define PARAM_PCM              0x0A
+#define PARAM_PIN_CAPS         0x0C
+#define PARAM_CONN_LIST_LEN    0x0E
+#define PARAM_AMP_OUT_CAPS     0x12
+
+#define FUNCTION_AUDIO         0x01
+
+#define WIDGET_TYPE(caps)      (((caps) >> 20) & 0xF)
+#define WIDGET_OUTPUT          0x0
+#define WIDGET_MIXER           0x2
+#define WIDGET_SELECTOR        0x3
+#define WIDGET_PIN             0x4
+#define WCAP_IN_AMP            (1 << 1)
+#define WCAP_OUT_AMP           (1 << 2)
+#define WCAP_AMP_OVERRIDE      (1 << 3)
+#define WCAP_FORMAT_OVERRIDE   (1 << 4)
+#define WCAP_CONN_LIST         (1 << 8)
+#define WCAP_DIGITAL           (1 << 9)
+
+#define PINCAP_OUTPUT          (1 << 4)
+#define PINCAP_EAPD            (1 << 16)
+#define PIN_OUT_ENABLE         0x40
+#define PIN_HP_ENABLE          0x80
 
-struct hda_device {
+#define CONFIG_DEVICE(c)       (((c) >> 20) & 0xF)
+#define CONFIG_NO_CONNECTION(c) ((((c) >> 30) & 0x3) == 1)
+#define DEVICE_LINE_OUT        0x0
+#define DEVICE_SPEAKER         0x1
+#define DEVICE_HP_OUT          0x2
+
+#define AMP_SET_OUTPUT         (1 << 15)
+#define AMP_SET_INPUT          (1 << 14)
+#define AMP_SET_BOTH           (3 << 12) /* Left and right */
+#define AMP_SET_INDEX(i)       ((i) << 8)
+#define AMP_MUTE               (1 << 7)
+#define AMP_STEPS(caps)        (((caps) >> 8) & 0x7F)
+#define AMP_OFFSET(caps)       ((caps) & 0x7F)
+
+/* PCM rates a converter can do, as bits of PARAM_PCM */
+#define PCM_44100              (1 << 5)
+#define PCM_48000              (1 << 6)
+#define PCM_96000              (1 << 8)
+#define PCM_192000             (1 << 10)
+
+/* Stream format: 16-bit stereo, and the rate's base and multiplier */
+#define FORMAT_16_STEREO       0x0011
+#define FORMAT_BASE_44100      (1 << 14)
+#define FORMAT_MULT(m)         (((m) - 1) << 11)
+
+#define HDA_TIMEOUT      1000000
+#define HDA_MAX_NODES    256
+#define HDA_MAX_CONNS    32
+#define HDA_MAX_PATH     5    /* Widgets from a pin to its DAC, both included */
+#define HDA_STREAM_TAG   1
+#define HDA_BDL_LEN      32   /* Periods in the cyclic buffer */
+#define HDA_PERIOD       512  /* Frames; default */
+#define HDA_PERIOD_MIN   64
+#define HDA_PERIOD_MAX   1024 /* So a period fits in a page */
+#define HDA_QUEUE        2    /* Periods mixed ahead of the one playing; default */
+#define HDA_FRAME        4    /* 16-bit stereo */
+
+/* snd values */
+#define HDA_SND_NAME "Intel HD Audio"
+#define HDA_PLAYBACK_SPEED 48000
+#define HDA_PLAYBACK_FORMAT SND_FORMAT_L16SLE
+
+/* An entry in a buffer descriptor list */
+typedef struct {
+	uint64_t pointer;
+	uint32_t length;
+	uint32_t ioc;      /* Interrupt on completion */
+} __attribute__((packed)) hda_bdl_entry_t;
+
+typedef struct {
 	uint32_t pci_device;
+	uintptr_t mmio;
+	int irq;
+	int stream;                     /* Index of our stream descriptor */
+
+	uint32_t * corb;
+	uint64_t * rirb;
+	int corb_entries;
+	int rirb_entries;
+	uint16_t rirb_rp;               /* Last response read */
+	spin_lock_t verb_lock;
+
+	int codec;
+	int afg;                        /* Audio function group */
+	int dac;
+	int amp_node;                   /* Where the master volume is; 0 if nowhere */
+	uint32_t amp_caps;
+	uint32_t volume;                /* As the knob was last set */
+
+	hda_bdl_entry_t * bdl;
+	uint8_t * bufs[HDA_BDL_LEN];
+	volatile uint32_t * positions;  /* DMA position buffer */
+	int use_lpib;
+	uint32_t period_bytes;
+	int queue;
+	int next_fill;                  /* Next period to mix */
+
+	list_t * refill_wait;           /* The refill tasklet sleeps here */
+	volatile int refill;            /* A period completed since the tasklet last looked */
+} hda_device_t;
+
+static hda_device_t _device;
+
+static snd_knob_t _knobs[] = {
+	{
+		"Master",
+		SND_KNOB_MASTER
+	},
 };
 
-static struct hda_device _device;
+static int hda_mixer_read(uint32_t knob_id, uint32_t *val);
+static int hda_mixer_write(uint32_t knob_id, uint32_t val);
+
+static snd_device_t _snd = {
+	.name            = HDA_SND_NAME,
+	.device          = &_device,
+	.playback_speed  = HDA_PLAYBACK_SPEED,
+	.playback_format = HDA_PLAYBACK_FORMAT,
+	.playback_period = HDA_PERIOD,
+
+	.knobs     = _knobs,
+	.num_knobs = N_ELEMENTS(_knobs),
+
+	.mixer_read  = hda_mixer_read,
+	.mixer_write = hda_mixer_write,
+};
 
-static void find_hda(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+static uint32_t read32(int reg) {
+	return *(volatile uint32_t *)(_device.mmio + reg);
+}
+static uint16_t read16(int reg) {
+	return *(volatile uint16_t *)(_device.mmio + reg);
+}
+static uint8_t read8(int reg) {
+	return *(volatile uint8_t *)(_device.mmio + reg);
+}
+static void write32(int reg, uint32_t val) {
+	*(volatile uint32_t *)(_device.mmio + reg) = val;
+}
+static void write16(int reg, uint16_t val) {
+	*(volatile uint16_t *)(_device.mmio + reg) = val;
+}
+static void write8(int reg, uint8_t val) {
+	*(volatile uint8_t *)(_device.mmio + reg) = val;
+}
+
+static void hda_sleep(unsigned long ms) {
+	unsigned long s, ss;
+	relative_time(0, ms, &s, &ss);
+	sleep_until((process_t *)current_process, s, ss);
+	switch_task(0);
+}
+
+static void * dma_page(uintptr_t * phys) {
+	void * page = (void *)kvmalloc_p(0x1000, phys);
+	memset(page, 0, 0x1000);
+	return page;
+}
+
+/* Wait for (reg & mask) == want; returns 1 if it never was */
+static int hda_wait(int reg, uint32_t mask, uint32_t want) {
+	for (int i = 0; i < HDA_TIMEOUT; ++i) {
+		if ((read32(reg) & mask) == want) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Send a verb and wait for its response, which is -1 if none came.
+ * Unsolicited responses, which we never ask for, are skipped.
+ */
+static uint32_t hda_command(int nid, uint32_t verb, uint32_t payload) {
+	uint32_t cmd = ((uint32_t)_device.codec << 28) | ((uint32_t)nid << 20);
+	if (verb < 0x10) {
+		cmd |= (verb << 16) | (payload & 0xFFFF);
+	} else {
+		cmd |= (verb << 8) | (payload & 0xFF);
+	}
 
-	struct hda_device * hda = extra;
+	spin_lock(_device.verb_lock);
+	uint16_t wp = ((read16(HDA_CORBWP) & 0xFF) + 1) % _device.corb_entries;
+	_device.corb[wp] = cmd;
+	write16(HDA_CORBWP, wp);
 
-	if ((vendorid == 0x8086) && (deviceid == 0x2668)) {
-		hda->pci_device = device;
+	uint32_t response = (uint32_t)-1;
+	for (int i = 0; i < HDA_TIMEOUT; ++i) {
+		if ((read16(HDA_RIRBWP) & 0xFF) == _device.rirb_rp) continue;
+		_device.rirb_rp = (_device.rirb_rp + 1) % _device.rirb_entries;
+		uint64_t entry = _device.rirb[_device.rirb_rp];
+		if ((entry >> 32) & 0x10) continue; /* Unsolicited */
+		response = (uint32_t)entry;
+		break;
 	}
+	spin_unlock(_device.verb_lock);
 
+	return response;
 }
 
-DEFINE_SHELL_FUNCTION(hda_test, "[debug] Intel HDA experiments") {
+static uint32_t hda_param(int nid, int param) {
+	return hda_command(nid, VERB_GET_PARAMETER, param);
+}
+
+/* CORB and RIRB size registers: the largest of 256, 16 or 2 entries the controller does */
+static int ring_size(int reg) {
+	uint8_t caps = read8(reg) >> 4;
+	if (caps & 0x4) { write8(reg, 2); return 256; }
+	if (caps & 0x2) { write8(reg, 1); return 16; }
+	write8(reg, 0);
+	return 2;
+}
+
+static int hda_rings_init(void) {
+	uintptr_t phys;
+
+	write8(HDA_CORBCTL, 0);
+	write8(HDA_RIRBCTL, 0);
+	if (hda_wait(HDA_CORBCTL, CORBCTL_RUN, 0) || hda_wait(HDA_RIRBCTL, RIRBCTL_RUN, 0)) {
+		debug_print(ERROR, "hda: command rings didn't stop");
+		return 1;
+	}
+
+	_device.corb = dma_page(&phys);
+	write32(HDA_CORBLBASE, phys);
+	write32(HDA_CORBUBASE, 0);
+	_device.corb_entries = ring_size(HDA_CORBSIZE);
 
-	if (!_device.pci_device) {
-		fprintf(tty, "No HDA device found.\n");
+	/* Some controllers want to see the reset bit set before it's cleared */
+	write16(HDA_CORBRP, CORBRP_RST);
+	hda_wait(HDA_CORBRP, CORBRP_RST, CORBRP_RST);
+	write16(HDA_CORBRP, 0);
+	if (hda_wait(HDA_CORBRP, CORBRP_RST, 0)) {
+		debug_print(ERROR, "hda: CORB read pointer didn't reset");
 		return 1;
 	}
-	fprintf(tty, "HDA audio device is at 0x%x.\n", _device.pci_device);
+	write16(HDA_CORBWP, 0);
+
+	_device.rirb = dma_page(&phys);
+	write32(HDA_RIRBLBASE, phys);
+	write32(HDA_RIRBUBASE, 0);
+	_device.rirb_entries = ring_size(HDA_RIRBSIZE);
+	write16(HDA_RIRBWP, RIRBWP_RST);
+	write16(HDA_RINTCNT, 1);
+	_device.rirb_rp = 0;
+
+	write8(HDA_CORBCTL, CORBCTL_RUN);
+	write8(HDA_RIRBCTL, RIRBCTL_RUN);
+	return 0;
+}
 
+static int hda_reset(void) {
+	write32(HDA_GCTL, read32(HDA_GCTL) & ~GCTL_CRST);
+	if (hda_wait(HDA_GCTL, GCTL_CRST, 0)) return 1;
+	hda_sleep(1);
+	write32(HDA_GCTL, read32(HDA_GCTL) | GCTL_CRST);
+	if (hda_wait(HDA_GCTL, GCTL_CRST, GCTL_CRST)) return 1;
+	/* Codecs get 521us to ask for an address */
+	hda_sleep(10);
 	return 0;
 }
 
+/* The nodes a widget takes input from; returns how many */
+static int hda_connections(int nid, uint32_t caps, int * conns) {
+	if (!(caps & WCAP_CONN_LIST)) return 0;
+
+	uint32_t len = hda_param(nid, PARAM_CONN_LIST_LEN);
+	int count = len & 0x7F;
+	int longform = len & 0x80;
+	int per = longform ? 2 : 4;
+	int bits = longform ? 16 : 8;
+	int n = 0, prev = 0;
+
+	for (int i = 0; i < count; i += per) {
+		uint32_t entries = hda_command(nid, VERB_GET_CONN_LIST, i);
+		for (int j = 0; j < per && i + j < count; ++j) {
+			uint32_t entry = (entries >> (j * bits)) & ((1 << bits) - 1);
+			int range = entry & (1 << (bits - 1));
+			int id = entry & ((1 << (bits - 1)) - 1);
+			/* A range entry covers everything since the one before it */
+			for (int c = range ? prev + 1 : id; c <= id && n < HDA_MAX_CONNS; ++c) {
+				conns[n++] = c;
+			}
+			prev = id;
+		}
+	}
+	return n;
+}
+
+static uint32_t widget_caps[HDA_MAX_NODES];
+
+/*
+ * Depth-first from `nid` for an analog DAC. On the way back out, path[]
+ * gets the widgets from `nid` to the DAC and conn[] which input of
+ * each leads on. Returns the path's length, or 0.
+ */
+static int hda_find_path(int nid, int depth, int * path, int * conn) {
+	if (nid <= 0 || nid >= HDA_MAX_NODES || depth == HDA_MAX_PATH) return 0;
+	uint32_t caps = widget_caps[nid];
+	if (caps & WCAP_DIGITAL) return 0;
+
+	path[depth] = nid;
+	if (WIDGET_TYPE(caps) == WIDGET_OUTPUT) return depth + 1;
+	if (depth && WIDGET_TYPE(caps) != WIDGET_MIXER && WIDGET_TYPE(caps) != WIDGET_SELECTOR) return 0;
+
+	int conns[HDA_MAX_CONNS];
+	int count = hda_connections(nid, caps, conns);
+	for (int i = 0; i < count; ++i) {
+		int len = hda_find_path(conns[i], depth + 1, path, conn);
+		if (len) {
+			conn[depth] = i;
+			return len;
+		}
+	}
+	return 0;
+}
+
+static uint32_t hda_amp_caps(int nid) {
+	if (widget_caps[nid] & WCAP_AMP_OVERRIDE) {
+		return hda_param(nid, PARAM_AMP_OUT_CAPS);
+	}
+	return hda_param(_device.afg, PARAM_AMP_OUT_CAPS);
+}
+
+static void hda_set_amp(int nid, uint32_t which, uint32_t gain) {
+	hda_command(nid, VERB_SET_AMP, which | AMP_SET_BOTH | gain);
+}
+
+/*
+ * Turn on everything between a pin and its DAC: select the way on at
+ * each widget, unmute amps at 0dB, and enable the pin. The first amp
+ * nearest the DAC becomes the master volume, if there isn't one yet.
+ */
+static void hda_enable_path(int * path, int * conn, int len) {
+	for (int i = len - 1; i >= 0; --i) {
+		int nid = path[i];
+		uint32_t caps = widget_caps[nid];
+
+		hda_command(nid, VERB_SET_POWER_STATE, 0);
+
+		if (i < len - 1) {
+			if (WIDGET_TYPE(caps) == WIDGET_MIXER) {
+				if (caps & WCAP_IN_AMP) hda_set_amp(nid, AMP_SET_INPUT | AMP_SET_INDEX(conn[i]), 0);
+			} else {
+				hda_command(nid, VERB_SET_CONN_SELECT, conn[i]);
+			}
+		}
+
+		if (caps & WCAP_OUT_AMP) {
+			uint32_t amp = hda_amp_caps(nid);
+			hda_set_amp(nid, AMP_SET_OUTPUT, AMP_OFFSET(amp));
+			if (!_device.amp_node && AMP_STEPS(amp)) {
+				_device.amp_node = nid;
+				_device.amp_caps = amp;
+			}
+		}
+	}
+
+	int pin = path[0];
+	uint32_t pin_caps = hda_param(pin, PARAM_PIN_CAPS);
+	uint32_t config = hda_command(pin, VERB_GET_CONFIG, 0);
+	hda_command(pin, VERB_SET_PIN_CONTROL, PIN_OUT_ENABLE | (CONFIG_DEVICE(config) == DEVICE_HP_OUT ? PIN_HP_ENABLE : 0));
+	if (pin_caps & PINCAP_EAPD) {
+		hda_command(pin, VERB_SET_EAPD, 0x02);
+	}
+}
+
+/* Line outs are preferred to speakers, and speakers to headphones */
+static int pin_rank(uint32_t config) {
+	switch (CONFIG_DEVICE(config)) {
+		case DEVICE_LINE_OUT: return 0;
+		case DEVICE_SPEAKER:  return 1;
+		case DEVICE_HP_OUT:   return 2;
+		default:              return -1;
+	}
+}
+
+/*
+ * Pick the codec's DAC from its best output pin, and drive every other
+ * output pin that can reach the same DAC too, so speakers and
+ * headphones both play.
+ */
+static int hda_codec_init(int codec) {
+	_device.codec = codec;
+	_device.afg = 0;
+
+	uint32_t nodes = hda_param(0, PARAM_SUBNODES);
+	for (uint32_t n = (nodes >> 16) & 0xFF; n < ((nodes >> 16) & 0xFF) + (nodes & 0xFF); ++n) {
+		if ((hda_param(n, PARAM_FUNCTION_TYPE) & 0xFF) == FUNCTION_AUDIO) {
+			_device.afg = n;
+			break;
+		}
+	}
+	if (!_device.afg) return 1;
+
+	hda_command(_device.afg, VERB_SET_POWER_STATE, 0);
+
+	nodes = hda_param(_device.afg, PARAM_SUBNODES);
+	int first = (nodes >> 16) & 0xFF;
+	int last = first + (nodes & 0xFF);
+	if (last > HDA_MAX_NODES) last = HDA_MAX_NODES;
+	memset(widget_caps, 0, sizeof(widget_caps));
+	for (int nid = first; nid < last; ++nid) {
+		widget_caps[nid] = hda_param(nid, PARAM_WIDGET_CAPS);
+	}
+
+	int best = 0, best_rank = 3;
+	for (int nid = first; nid < last; ++nid) {
+		if (WIDGET_TYPE(widget_caps[nid]) != WIDGET_PIN) continue;
+		if (!(hda_param(nid, PARAM_PIN_CAPS) & PINCAP_OUTPUT)) continue;
+		uint32_t config = hda_command(nid, VERB_GET_CONFIG, 0);
+		int rank = pin_rank(config);
+		if (CONFIG_NO_CONNECTION(config) || rank < 0 || rank >= best_rank) continue;
+
+		int path[HDA_MAX_PATH], conn[HDA_MAX_PATH];
+		if (hda_find_path(nid, 0, path, conn)) {
+			best = nid;
+			best_rank = rank;
+		}
+	}
+	if (!best) return 1;
+
+	int path[HDA_MAX_PATH], conn[HDA_MAX_PATH];
+	int len = hda_find_path(best, 0, path, conn);
+	_device.dac = path[len - 1];
+	_device.amp_node = 0;
+	hda_enable_path(path, conn, len);
+
+	for (int nid = first; nid < last; ++nid) {
+		if (nid == best || WIDGET_TYPE(widget_caps[nid]) != WIDGET_PIN) continue;
+		if (!(hda_param(nid, PARAM_PIN_CAPS) & PINCAP_OUTPUT)) continue;
+		uint32_t config = hda_command(nid, VERB_GET_CONFIG, 0);
+		if (CONFIG_NO_CONNECTION(config) || pin_rank(config) < 0) continue;
+		len = hda_find_path(nid, 0, path, conn);
+		if (len && path[len - 1] == _device.dac) {
+			hda_enable_path(path, conn, len);
+		}
+	}
+
+	debug_print(NOTICE, "hda: codec %d, DAC 0x%x, output pin 0x%x, volume on 0x%x",
+			codec, _device.dac, best, _device.amp_node);
+	return 0;
+}
+
+/* Stream format for hda_rate=, if the DAC can do it */
+static uint16_t hda_format(void) {
+	uint32_t pcm = 0;
+	if (widget_caps[_device.dac] & WCAP_FORMAT_OVERRIDE) pcm = hda_param(_device.dac, PARAM_PCM);
+	if (!pcm) pcm = hda_param(_device.afg, PARAM_PCM);
+
+	char * arg = args_value("hda_rate");
+	int rate = arg ? atoi(arg) : HDA_PLAYBACK_SPEED;
+
+	if (rate == 192000 && (pcm & PCM_192000)) {
+		_snd.playback_speed = 192000;
+		return FORMAT_MULT(4) | FORMAT_16_STEREO;
+	} else if (rate == 96000 && (pcm & PCM_96000)) {
+		_snd.playback_speed = 96000;
+		return FORMAT_MULT(2) | FORMAT_16_STEREO;
+	} else if (rate == 44100 && (pcm & PCM_44100)) {
+		_snd.playback_speed = 44100;
+		return FORMAT_BASE_44100 | FORMAT_16_STEREO;
+	}
+
+	if (rate != HDA_PLAYBACK_SPEED) {
+		debug_print(WARNING, "hda: DAC can't do %d Hz; playing at %d", rate, HDA_PLAYBACK_SPEED);
+	}
+	_snd.playback_speed = HDA_PLAYBACK_SPEED;
+	return FORMAT_16_STEREO;
+}
+
+static int hda_stream_init(uint16_t format) {
+	int sd = HDA_SD(_device.stream);
+
+	write32(sd + SD_CTL, read32(sd + SD_CTL) | SD_CTL_SRST);
+	if (hda_wait(sd + SD_CTL, SD_CTL_SRST, SD_CTL_SRST)) return 1;
+	write32(sd + SD_CTL, read32(sd + SD_CTL) & ~SD_CTL_SRST);
+	if (hda_wait(sd + SD_CTL, SD_CTL_SRST, 0)) return 1;
+
+	uintptr_t phys;
+	_device.bdl = dma_page(&phys);
+	for (int i = 0; i < HDA_BDL_LEN; ++i) {
+		uintptr_t buf_phys;
+		_device.bufs[i] = dma_page(&buf_phys);
+		_device.bdl[i].pointer = buf_phys;
+		_device.bdl[i].length = _device.period_bytes;
+		_device.bdl[i].ioc = 1;
+	}
+
+	write32(sd + SD_BDPL, phys);
+	write32(sd + SD_BDPU, 0);
+	write32(sd + SD_CBL, HDA_BDL_LEN * _device.period_bytes);
+	write16(sd + SD_LVI, HDA_BDL_LEN - 1);
+	write16(sd + SD_FMT, format);
+	write32(sd + SD_CTL, (read32(sd + SD_CTL) & 0xFF0FFFFF) | SD_CTL_STRM(HDA_STREAM_TAG) | SD_CTL_IOCE);
+
+	_device.positions = dma_page(&phys);
+	write32(HDA_DPLBASE, phys | DPLBASE_ENABLE);
+	write32(HDA_DPUBASE, 0);
+
+	hda_command(_device.dac, VERB_SET_FORMAT, format);
+	hda_command(_device.dac, VERB_SET_STREAM, HDA_STREAM_TAG << 4);
+	return 0;
+}
+
+/* Byte offset into the cyclic buffer the stream has reached */
+static uint32_t hda_position(void) {
+	uint32_t pos;
+	if (_device.use_lpib) {
+		pos = read32(HDA_SD(_device.stream) + SD_LPIB);
+	} else {
+		pos = _device.positions[_device.stream * 2];
+	}
+	return pos % (HDA_BDL_LEN * _device.period_bytes);
+}
+
+static int irq_handler(struct regs * regs) {
+	uint32_t status = read32(HDA_INTSTS);
+	if (!status) return 0;
+
+	if (status & (1 << _device.stream)) {
+		int sd = HDA_SD(_device.stream);
+		uint8_t sts = read8(sd + SD_STS);
+		write8(sd + SD_STS, sts & SD_STS_CLEAR);
+		if (sts & SD_STS_BCIS) {
+			_snd.periods++;
+			_device.refill = 1;
+			wakeup_queue(_device.refill_wait);
+		}
+	}
+
+	/* Controller interrupts are off, but clear anything the RIRB raised anyway */
+	write8(HDA_RIRBSTS, read8(HDA_RIRBSTS));
+
+	irq_ack(_device.irq);
+	return 1;
+}
+
+/* Mix the periods from next_fill until we're hda_queue ahead of `playing` */
+static void hda_fill(int playing) {
+	while ((_device.next_fill - playing + HDA_BDL_LEN) % HDA_BDL_LEN <= _device.queue) {
+		snd_request_buf(&_snd, _device.period_bytes, _device.bufs[_device.next_fill]);
+		_device.next_fill = (_device.next_fill + 1) % HDA_BDL_LEN;
+	}
+}
+
+static void hda_refill(void) {
+	/* Falling behind is audible; get ahead of ordinary work */
+	current_process->sched_class = SCHED_CLASS_REALTIME;
+
+	while (1) {
+		int playing = hda_position() / _device.period_bytes;
+		if (_device.next_fill == playing) {
+			/* It's playing a period we haven't mixed; it'll be old audio */
+			_snd.underruns++;
+			_device.next_fill = (playing + 1) % HDA_BDL_LEN;
+		}
+		hda_fill(playing);
+
+		IRQ_OFF;
+		if (!_device.refill) {
+			sleep_on(_device.refill_wait);
+		}
+		_device.refill = 0;
+		IRQ_RES;
+	}
+}
+
+static int hda_mixer_read(uint32_t knob_id, uint32_t *val) {
+	if (knob_id != SND_KNOB_MASTER) return -1;
+	*val = _device.volume;
+	return 0;
+}
+
+static int hda_mixer_write(uint32_t knob_id, uint32_t val) {
+	if (knob_id != SND_KNOB_MASTER) return -1;
+	if (!_device.amp_node) return -1;
+
+	uint32_t steps = AMP_STEPS(_device.amp_caps);
+	uint32_t gain = (uint64_t)val * steps / SND_KNOB_MAX_VALUE;
+	hda_set_amp(_device.amp_node, AMP_SET_OUTPUT, val ? gain : AMP_MUTE);
+	_device.volume = val;
+	return 0;
+}
+
+static int int_arg(char * name, int def, int min, int max) {
+	char * c = args_value(name);
+	if (!c) return def;
+	int n = atoi(c);
+	if (n < min) n = min;
+	if (n > max) n = max;
+	return n;
+}
+
+/* Resets have to be waited for, so setup happens here and not in init() */
+static void hda_main(void * data, char * name) {
+	if (hda_reset()) {
+		debug_print(ERROR, "hda: controller didn't come out of reset");
+		return;
+	}
+
+	if (hda_rings_init()) return;
+
+	uint16_t codecs = read16(HDA_STATESTS);
+	int codec;
+	for (codec = 0; codec < 15; ++codec) {
+		if ((codecs & (1 << codec)) && !hda_codec_init(codec)) break;
+	}
+	if (codec == 15) {
+		debug_print(WARNING, "hda: no codec with an output (codecs: 0x%x)", codecs);
+		return;
+	}
+
+	_device.period_bytes = int_arg("hda_period", HDA_PERIOD, HDA_PERIOD_MIN, HDA_PERIOD_MAX) * HDA_FRAME;
+	_device.queue = int_arg("hda_queue", HDA_QUEUE, 1, HDA_BDL_LEN - 2);
+	_device.use_lpib = !!args_present("hda_lpib");
+	_snd.playback_period = _device.period_bytes / HDA_FRAME;
+
+	if (hda_stream_init(hda_format())) {
+		debug_print(ERROR, "hda: output stream didn't reset");
+		return;
+	}
+
+	_device.refill_wait = list_create();
+
+	_device.irq = pci_enable_msi(_device.pci_device);
+	if (_device.irq < 0) {
+		_device.irq = pci_get_interrupt(_device.pci_device);
+	}
+	irq_install_handler(_device.irq, irq_handler, "hda");
+	write32(HDA_INTCTL, INTCTL_GIE | (1 << _device.stream));
+
+	if (_device.amp_node) {
+		/* Start out where the codec's 0dB is */
+		uint32_t steps = AMP_STEPS(_device.amp_caps);
+		_device.volume = (uint64_t)MIN(AMP_OFFSET(_device.amp_caps), steps) * SND_KNOB_MAX_VALUE / steps;
+	} else {
+		_device.volume = SND_KNOB_MAX_VALUE;
+	}
+
+	snd_register(&_snd);
+
+	/* Start with everything up to the queue depth mixed */
+	_device.next_fill = 0;
+	hda_fill(0);
+	int sd = HDA_SD(_device.stream);
+	write32(sd + SD_CTL, read32(sd + SD_CTL) | SD_CTL_RUN);
+
+	debug_print(NOTICE, "hda: playing at %d Hz, %d-frame periods, %d ahead, irq %d",
+			_snd.playback_speed, _snd.playback_period, _device.queue, _device.irq);
+
+	hda_refill();
+}
+
 static int init(void) {
-	BIND_SHELL_FUNCTION(hda_test);
-	pci_scan(&find_hda, -1, &_device);
-	if (!_device.pci_device) {
+	pci_device_t * pdev = pci_find_class(0x0403, 0);
+	if (!pdev) {
+		return 1;
+	}
+	_device.pci_device = pdev->address;
+
+	uint32_t bar = pci_read_field(_device.pci_device, PCI_BAR0, 4);
+	if ((bar & 0x6) == 0x4 && pci_read_field(_device.pci_device, PCI_BAR1, 4)) {
+		debug_print(ERROR, "hda: registers are above 4GiB");
 		return 1;
 	}
+	_device.mmio = bar & 0xFFFFFFF0;
+
+	/* Memory space and bus mastering */
+	pci_write_field(_device.pci_device, PCI_COMMAND, 2, pci_read_field(_device.pci_device, PCI_COMMAND, 2) | (1 << 1) | (1 << 2));
+
+	if (pdev->vendor_id == 0x8086) {
+		/* Intel's traffic class select; anything but TC0 crackles on some boards */
+		pci_write_field(_device.pci_device, 0x44, 1, pci_read_field(_device.pci_device, 0x44, 1) & ~0x07);
+	}
+
+	for (uintptr_t addr = _device.mmio & 0xFFFFF000; addr < _device.mmio + 0x4000; addr += 0x1000) {
+		page_t * p = get_page(addr, 1, kernel_directory);
+		dma_frame(p, 1, 1, addr);
+		p->writethrough = 1;
+		p->cachedisable = 1;
+	}
+	invalidate_page_tables();
+
+	uint16_t gcap = read16(HDA_GCAP);
+	int inputs = (gcap >> 8) & 0xF;
+	int outputs = (gcap >> 12) & 0xF;
+	if (!outputs) {
+		debug_print(ERROR, "hda: controller has no output streams");
+		return 1;
+	}
+	/* Input stream descriptors come first */
+	_device.stream = inputs;
+
+	debug_print(NOTICE, "hda: controller %4x:%4x at 0x%x, %d in, %d out",
+			pdev->vendor_id, pdev->device_id, _device.mmio, inputs, outputs);
+
+	create_kernel_tasklet(hda_main, "[hda]", NULL);
 	return 0;
 }
 
 static int fini(void) {
+	snd_unregister(&_snd);
 	return 0;
 }
 
 MODULE_DEF(hda, init, fini);
-MODULE_DEPENDS(debugshell);
+MODULE_DEPENDS(snd);
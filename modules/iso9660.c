@@ -8,6 +8,7 @@
 #include <kernel/system.h>
 #include <kernel/types.h>
 #include <kernel/fs.h>
+#include <kernel/slab.h>
 #include <kernel/logging.h>
 #include <kernel/module.h>
 #include <kernel/args.h>
@@ -26,11 +27,48 @@
 #define FLAG_PERMISSIONS 0x10
 #define FLAG_CONTINUES   0x80
 
+#define CACHE_SIZE     64 /* Sectors */
+#define DIR_CACHE_SIZE 64 /* Directories with a parsed index */
+
+typedef struct {
+	node_t lru;       /* In ->lru, most recently used last */
+	uint32_t sector;
+	char data[ISO_SECTOR_SIZE];
+} iso_sector_t;
+
+/*
+ * One visible record of a directory, with its name already turned
+ * into the form we present.
+ */
+typedef struct {
+	char * name;
+	uint32_t sector;  /* Where the record itself is */
+	uint32_t offset;
+	uint32_t length;  /* Of the file's extent */
+	uint8_t flags;
+} iso_entry_t;
+
+/*
+ * Parsed contents of a directory, built the first time it is read or
+ * searched. The filesystem is read-only, so these never go stale.
+ */
+typedef struct {
+	node_t lru;       /* In ->dir_lru, most recently used last */
+	uint32_t extent;
+	uint32_t count;
+	iso_entry_t * entries;  /* In directory order */
+	hashmap_t * by_name;    /* name -> iso_entry_t */
+} iso_dir_t;
+
 typedef struct {
 	fs_node_t * block_device;
 	uint32_t block_size;
-	hashmap_t * cache;
+	hashmap_t * cache;      /* sector -> iso_sector_t, NULL with nocache */
 	list_t * lru;
+	spin_lock_t cache_lock;
+	hashmap_t * dirs;       /* extent -> iso_dir_t */
+	list_t * dir_lru;
+	spin_lock_t dir_lock;
 } iso_9660_fs_t;
 
 typedef struct {
@@ -135,36 +173,56 @@ typedef struct {
 	char application_use[];
 } __attribute__((packed)) iso_9660_volume_descriptor_t;
 
-static void file_from_dir_entry(iso_9660_fs_t * this, size_t sector, iso_9660_directory_entry_t * dir, size_t offset, fs_node_t * fs);
-
-#define CACHE_SIZE 64
+static void node_from_entry(iso_9660_fs_t * this, iso_entry_t * entry, fs_node_t * fs);
 
 static void read_sector(iso_9660_fs_t * this, uint32_t sector_id, char * buffer) {
-	if (this->cache) {
-		void * sector_id_v = (void *)sector_id;
-		if (hashmap_has(this->cache, sector_id_v)) {
-			memcpy(buffer,hashmap_get(this->cache, sector_id_v), this->block_size);
+	if (!this->cache) {
+		read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
+		return;
+	}
+
+	void * sector_id_v = (void *)sector_id;
+	iso_sector_t * cached;
 
-			node_t * me = list_find(this->lru, sector_id_v);
-			list_delete(this->lru, me);
-			list_append(this->lru, me);
+	spin_lock(this->cache_lock);
+	if (hashmap_lookup(this->cache, sector_id_v, (void **)&cached)) {
+		memcpy(buffer, cached->data, this->block_size);
+		list_delete(this->lru, &cached->lru);
+		list_append(this->lru, &cached->lru);
+		spin_unlock(this->cache_lock);
+		return;
+	}
+	spin_unlock(this->cache_lock);
+
+	read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
 
+	spin_lock(this->cache_lock);
+	if (!hashmap_has(this->cache, sector_id_v)) {
+		if (this->lru->length >= CACHE_SIZE) {
+			cached = list_dequeue(this->lru)->value;
+			hashmap_remove(this->cache, (void *)cached->sector);
 		} else {
-			if (this->lru->length > CACHE_SIZE) {
-				node_t * l = list_dequeue(this->lru);
-				free(hashmap_get(this->cache, l->value));
-				hashmap_remove(this->cache, l->value);
-				free(l);
-			}
-			read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
-			char * buf = malloc(this->block_size);
-			memcpy(buf, buffer, this->block_size);
-			hashmap_set(this->cache, sector_id_v, buf);
-			list_insert(this->lru, sector_id_v);
+			cached = malloc(sizeof(iso_sector_t));
 		}
-	} else {
-		read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
+		cached->sector = sector_id;
+		cached->lru.value = cached;
+		memcpy(cached->data, buffer, this->block_size);
+		hashmap_set(this->cache, sector_id_v, cached);
+		list_append(this->lru, &cached->lru);
 	}
+	spin_unlock(this->cache_lock);
+}
+
+/*
+ * Where the extent described by the record at (sector, offset) is.
+ */
+static void record_extent(iso_9660_fs_t * this, uint32_t sector, uint32_t offset, uint32_t * start, uint32_t * length) {
+	char * buffer = malloc(this->block_size);
+	read_sector(this, sector, buffer);
+	iso_9660_directory_entry_t * record = (iso_9660_directory_entry_t *)(buffer + offset);
+	*start  = record->extent_start_LSB;
+	*length = record->extent_length_LSB;
+	free(buffer);
 }
 
 static void inplace_lower(char * string) {
@@ -176,6 +234,140 @@ static void inplace_lower(char * string) {
 	}
 }
 
+/*
+ * Turn an ISO 9660 identifier ("FOO.TXT;1", "BAR.") into our name for it.
+ */
+static char * record_name(iso_9660_directory_entry_t * dir) {
+	char * file_name = malloc(dir->name_len + 1);
+	memcpy(file_name, dir->name, dir->name_len);
+	file_name[dir->name_len] = 0;
+	inplace_lower(file_name);
+	char * dot = strchr(file_name, '.');
+	if (!dot) {
+		/* It's a directory. */
+	} else {
+		char * ext = dot + 1;
+		char * semi = strchr(ext, ';');
+		if (semi) {
+			*semi = 0;
+		}
+		if (strlen(ext) == 0) {
+			*dot = 0;
+		} else {
+			char * derp = ext;
+			while (*derp == '.') derp++;
+			if (derp != ext) {
+				memmove(ext, derp, strlen(derp)+1);
+			}
+		}
+	}
+	return file_name;
+}
+
+static void entry_from_record(iso_9660_directory_entry_t * dir, uint32_t sector, uint32_t offset, iso_entry_t * entry) {
+	entry->name   = record_name(dir);
+	entry->sector = sector;
+	entry->offset = offset;
+	entry->length = dir->extent_length_LSB;
+	entry->flags  = dir->flags;
+}
+
+static void dir_free(iso_dir_t * dir) {
+	for (uint32_t i = 0; i < dir->count; ++i) {
+		free(dir->entries[i].name);
+	}
+	free(dir->entries);
+	hashmap_free(dir->by_name);
+	free(dir->by_name);
+	free(dir);
+}
+
+/*
+ * Read a whole directory extent in one request and index its records.
+ */
+static iso_dir_t * dir_build(iso_9660_fs_t * this, uint32_t extent, uint32_t length) {
+	uint32_t sectors = (length + this->block_size - 1) / this->block_size;
+	uint8_t * data = malloc(sectors * this->block_size);
+	read_fs(this->block_device, extent * this->block_size, sectors * this->block_size, data);
+
+	iso_dir_t * dir = malloc(sizeof(iso_dir_t));
+	dir->lru.value = dir;
+	dir->extent = extent;
+	dir->count = 0;
+	dir->by_name = hashmap_create(16);
+
+	/* Count first, so the entries can live in one array */
+	uint32_t capacity = 0;
+	for (int pass = 0; pass < 2; ++pass) {
+		uint32_t offset = 0;
+		while (offset < length) {
+			iso_9660_directory_entry_t * record = (iso_9660_directory_entry_t *)(data + offset);
+			if (record->length == 0) {
+				/* Records don't cross sectors; the rest of this one is padding */
+				offset = (offset / this->block_size + 1) * this->block_size;
+				continue;
+			}
+			/* Skip hidden files and the records for the directory itself and its parent */
+			if (!(record->flags & FLAG_HIDDEN) &&
+				!(record->name_len == 1 && (record->name[0] == 0 || record->name[0] == 1))) {
+				if (pass == 0) {
+					capacity++;
+				} else {
+					iso_entry_t * entry = &dir->entries[dir->count++];
+					entry_from_record(record, extent + offset / this->block_size, offset % this->block_size, entry);
+					if (!hashmap_has(dir->by_name, entry->name)) {
+						hashmap_set(dir->by_name, entry->name, entry);
+					}
+				}
+			}
+			offset += record->length;
+		}
+		if (pass == 0) {
+			dir->entries = malloc(sizeof(iso_entry_t) * (capacity ? capacity : 1));
+		}
+	}
+
+	free(data);
+	return dir;
+}
+
+/*
+ * Find (or build) the index for a directory node. Returns with
+ * dir_lock held; the index may be evicted once it is released.
+ */
+static iso_dir_t * dir_get(iso_9660_fs_t * this, fs_node_t * node) {
+	uint32_t extent, length;
+	record_extent(this, node->inode, node->impl, &extent, &length);
+
+	spin_lock(this->dir_lock);
+	iso_dir_t * dir = hashmap_get(this->dirs, (void *)extent);
+	if (!dir) {
+		spin_unlock(this->dir_lock);
+		iso_dir_t * fresh = dir_build(this, extent, length);
+		spin_lock(this->dir_lock);
+
+		dir = hashmap_get(this->dirs, (void *)extent);
+		if (dir) {
+			/* Someone else got here while we were reading */
+			dir_free(fresh);
+		} else {
+			dir = fresh;
+			hashmap_set(this->dirs, (void *)extent, dir);
+			list_append(this->dir_lru, &dir->lru);
+			if (this->dir_lru->length > DIR_CACHE_SIZE) {
+				iso_dir_t * old = list_dequeue(this->dir_lru)->value;
+				hashmap_remove(this->dirs, (void *)old->extent);
+				dir_free(old);
+			}
+			return dir;
+		}
+	}
+
+	list_delete(this->dir_lru, &dir->lru);
+	list_append(this->dir_lru, &dir->lru);
+	return dir;
+}
+
 static void open_iso(fs_node_t *node, unsigned int flags) {
 	/* Nothing to do here */
 }
@@ -186,7 +378,7 @@ static void close_iso(fs_node_t *node) {
 
 static struct dirent * readdir_iso(fs_node_t *node, uint32_t index) {
 	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
+		struct dirent * out = slab_alloc(&dirent_cache);
 		memset(out, 0x00, sizeof(struct dirent));
 		out->ino = 0;
 		strcpy(out->name, ".");
@@ -194,7 +386,7 @@ static struct dirent * readdir_iso(fs_node_t *node, uint32_t index) {
 	}
 
 	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
+		struct dirent * out = slab_alloc(&dirent_cache);
 		memset(out, 0x00, sizeof(struct dirent));
 		out->ino = 0;
 		strcpy(out->name, "..");
@@ -202,189 +394,74 @@ static struct dirent * readdir_iso(fs_node_t *node, uint32_t index) {
 	}
 
 	iso_9660_fs_t * this = node->device;
-	char * buffer = malloc(this->block_size);
-	read_sector(this, node->inode, buffer);
-	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(buffer + node->impl);
-
-	debug_print(INFO, "[iso] Reading directory for readdir; sector = %d, offset = %d", node->inode, node->impl);
-
-	uint8_t * root_data = malloc(root_entry->extent_length_LSB);
-	uint8_t * offset = root_data;
-	size_t sector_offset = 0;
-	size_t length_to_read = root_entry->extent_length_LSB;
-	while (length_to_read) {
-		read_sector(this, root_entry->extent_start_LSB + sector_offset, (char*)offset);
-		if (length_to_read >= this->block_size) {
-			offset += this->block_size;
-			sector_offset += 1;
-			length_to_read -= this->block_size;
-		} else {
-			break;
-		}
+	iso_dir_t * dir = dir_get(this, node);
+
+	struct dirent * dirent = NULL;
+	if (index - 2 < dir->count) {
+		iso_entry_t * entry = &dir->entries[index - 2];
+		dirent = slab_alloc(&dirent_cache);
+		memset(dirent, 0, sizeof(struct dirent));
+		strcpy(dirent->name, entry->name);
+		dirent->ino = entry->sector;
 	}
 
-	debug_print(INFO, "[iso] Done, want index = %d", index);
-
-	/* Examine directory */
-	offset = root_data;
-
-	unsigned int i = 0;
-	struct dirent *dirent = malloc(sizeof(struct dirent));
-	fs_node_t * out = malloc(sizeof(fs_node_t));
-	memset(dirent, 0, sizeof(struct dirent));
-	while (1) {
-		iso_9660_directory_entry_t * dir = (iso_9660_directory_entry_t *)offset;
-		if (dir->length == 0) {
-			debug_print(INFO, "dir->length = %d", dir->length);
-			if ((size_t)(offset - root_data) < root_entry->extent_length_LSB) {
-				offset += 1; // this->block_size - ((uintptr_t)offset % this->block_size);
-				goto try_again;
-			}
-			break;
-		}
-		if (!(dir->flags & FLAG_HIDDEN)) {
-			debug_print(INFO, "[iso] Found file %d", i);
-			if (i == index) {
-				file_from_dir_entry(this, (root_entry->extent_start_LSB)+(offset - root_data)/this->block_size, dir, (offset - root_data) % this->block_size, out);
-				memcpy(&dirent->name, out->name, strlen(out->name)+1);
-				dirent->ino = out->inode;
-				goto cleanup;
-			}
-			i += 1;
-		}
-		offset += dir->length;
-try_again:
-		if ((size_t)(offset - root_data) > root_entry->extent_length_LSB) break;
-	}
-
-	debug_print(INFO, "offset = %x; root_data = %x; extent = %x", offset, root_data, root_entry->extent_length_LSB);
-
-	free(dirent);
-	dirent = NULL;
-
-cleanup:
-	free(root_data);
-	free(buffer);
-	free(out);
+	spin_unlock(this->dir_lock);
 	return dirent;
 }
 
 static uint32_t read_iso(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
 	iso_9660_fs_t * this = node->device;
-	char * tmp = malloc(this->block_size);
-	read_sector(this, node->inode, tmp);
-	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(tmp + node->impl);
+	uint32_t extent, length;
+	record_extent(this, node->inode, node->impl, &extent, &length);
+
+	if (offset >= length) {
+		return 0;
+	}
 
 	uint32_t end;
 	/* We can do this in a single underlying read to the filesystem */
-	if (offset + size > root_entry->extent_length_LSB) {
-		end = root_entry->extent_length_LSB;
+	if (offset + size > length) {
+		end = length;
 	} else {
 		end = offset + size;
 	}
 	uint32_t size_to_read = end - offset;
 
-	read_fs(this->block_device, root_entry->extent_start_LSB * this->block_size + offset, size_to_read, (uint8_t *)buffer);
+	read_fs(this->block_device, extent * this->block_size + offset, size_to_read, (uint8_t *)buffer);
 
-	free(tmp);
 	return size_to_read;
 }
 
 static fs_node_t * finddir_iso(fs_node_t *node, char *name) {
 	iso_9660_fs_t * this = node->device;
-	char * buffer = malloc(this->block_size);
-	read_sector(this, node->inode, buffer);
-	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(buffer + node->impl);
-
-	uint8_t * root_data = malloc(root_entry->extent_length_LSB);
-	uint8_t * offset = root_data;
-	size_t sector_offset = 0;
-	size_t length_to_read = root_entry->extent_length_LSB;
-	while (length_to_read) {
-		read_sector(this, root_entry->extent_start_LSB + sector_offset, (char*)offset);
-		if (length_to_read >= this->block_size) {
-			offset += this->block_size;
-			sector_offset += 1;
-			length_to_read -= this->block_size;
-		} else {
-			break;
-		}
-	}
-
-	/* Examine directory */
-	offset = root_data;
-
-	fs_node_t * out = malloc(sizeof(fs_node_t));
-	while (1) {
-		iso_9660_directory_entry_t * dir = (iso_9660_directory_entry_t *)offset;
-		if (dir->length == 0) {
-			if ((size_t)(offset - root_data) < root_entry->extent_length_LSB) {
-				offset += 1; // this->block_size - ((uintptr_t)offset % this->block_size);
-				goto try_next_finddir;
-			}
-			break;
-		}
-		if (!(dir->flags & FLAG_HIDDEN)) {
-			memset(out, 0, sizeof(fs_node_t));
-			file_from_dir_entry(this, (root_entry->extent_start_LSB)+(offset - root_data)/this->block_size, dir, (offset - root_data) % this->block_size, out);
-
-			if (!strcmp(out->name, name)) {
-				goto cleanup; /* found it */
-			}
-
-		}
-		offset += dir->length;
-try_next_finddir:
-		if ((size_t)(offset - root_data) > root_entry->extent_length_LSB) break;
+	iso_dir_t * dir = dir_get(this, node);
+
+	fs_node_t * out = NULL;
+	iso_entry_t * entry = hashmap_get(dir->by_name, name);
+	if (entry) {
+		out = slab_alloc(&fs_node_cache);
+		memset(out, 0, sizeof(fs_node_t));
+		node_from_entry(this, entry, out);
 	}
 
-	free(out);
-	out = NULL;
-
-cleanup:
-	free(root_data);
-	free(buffer);
+	spin_unlock(this->dir_lock);
 	return out;
 }
 
-static void file_from_dir_entry(iso_9660_fs_t * this, size_t sector, iso_9660_directory_entry_t * dir, size_t offset, fs_node_t * fs) {
+static void node_from_entry(iso_9660_fs_t * this, iso_entry_t * entry, fs_node_t * fs) {
 	fs->device = this;
-	fs->inode  = sector; /* Sector the file is in */
-	fs->impl   = offset; /* Offset */
+	fs->inode  = entry->sector; /* Sector the record is in */
+	fs->impl   = entry->offset; /* Offset */
 
-	char * file_name = malloc(dir->name_len + 1);
-	memcpy(file_name, dir->name, dir->name_len);
-	file_name[dir->name_len] = 0;
-	inplace_lower(file_name);
-	char * dot = strchr(file_name, '.');
-	if (!dot) {
-		/* It's a directory. */
-	} else {
-		char * ext = dot + 1;
-		char * semi = strchr(ext, ';');
-		if (semi) {
-			*semi = 0;
-		}
-		if (strlen(ext) == 0) {
-			*dot = 0;
-		} else {
-			char * derp = ext;
-			while (*derp == '.') derp++;
-			if (derp != ext) {
-				memmove(ext, derp, strlen(derp)+1);
-			}
-		}
-	}
-	memcpy(fs->name, file_name, strlen(file_name)+1);
-	free(file_name);
+	strcpy(fs->name, entry->name);
 
 	fs->uid = 0;
 	fs->gid = 0;
-	fs->length = dir->extent_length_LSB;
+	fs->length = entry->length;
 	fs->mask = 0555;
 	fs->nlink = 0; /* Unsupported */
-	if (dir->flags & FLAG_DIRECTORY) {
-		fs->flags = FS_DIRECTORY;
+	if (entry->flags & FLAG_DIRECTORY) {
+		fs->flags = FS_DIRECTORY | FS_DCACHE;
 		fs->readdir = readdir_iso;
 		fs->finddir = finddir_iso;
 	} else {
@@ -429,16 +506,17 @@ static fs_node_t * iso_fs_mount(char * device, char * mount_path) {
 	}
 
 	iso_9660_fs_t * this = malloc(sizeof(iso_9660_fs_t));
+	memset(this, 0, sizeof(iso_9660_fs_t));
 	this->block_device = dev;
 	this->block_size = ISO_SECTOR_SIZE;
 	if (cache) {
-		this->cache = hashmap_create_int(10);
+		this->cache = hashmap_create_int(CACHE_SIZE);
 		this->lru = list_create();
 	} else {
 		this->cache = NULL;
 	}
-
-	/* Probably want to put a block cache on this like EXT2 driver does; or do that in the ATAPI layer... */
+	this->dirs = hashmap_create_int(DIR_CACHE_SIZE);
+	this->dir_lru = list_create();
 
 	debug_print(WARNING, "ISO 9660 file system driver mounting %s to %s", device, mount_path);
 
@@ -489,9 +567,13 @@ static fs_node_t * iso_fs_mount(char * device, char * mount_path) {
 	debug_print(WARNING, " Interleave gap:   %d", root_entry->interleave_gap);
 	debug_print(WARNING, " Volume Seq:       %d", root_entry->volume_seq_LSB);
 
-	fs_node_t * fs = malloc(sizeof(fs_node_t));
+	iso_entry_t entry;
+	entry_from_record(root_entry, i, 156, &entry);
+
+	fs_node_t * fs = slab_alloc(&fs_node_cache);
 	memset(fs, 0, sizeof(fs_node_t));
-	file_from_dir_entry(this, i, root_entry, 156, fs);
+	node_from_entry(this, &entry, fs);
+	free(entry.name);
 
 	free(arg);
 	return fs;
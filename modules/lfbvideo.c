@@ -15,6 +15,7 @@
 #include <kernel/fs.h>
 #include <kernel/printf.h>
 #include <kernel/types.h>
+#include <kernel/mem.h>
 #include <kernel/logging.h>
 #include <kernel/pci.h>
 #include <kernel/boot.h>
@@ -37,6 +38,18 @@ uint32_t lfb_resolution_s = 0;
 uint8_t * lfb_vid_memory = (uint8_t *)0xE0000000;
 const char * lfb_driver_name = NULL;
 
+/* Hardware cursor, if the active driver (or a guest driver) has one */
+int (*lfb_cursor_define)(struct vid_cursor * cursor) = NULL;
+int (*lfb_cursor_move)(struct vid_cursor_pos * pos) = NULL;
+
+/* Telling the device what changed, and copies done by the device */
+int (*lfb_update_rects)(struct vid_rect * rects, int count) = NULL;
+int (*lfb_copy_rect)(struct vid_copy * copy) = NULL;
+
+/* Flipping between pages of video memory */
+uint32_t (*lfb_set_pages)(uint32_t count) = NULL;
+int (*lfb_flip_page)(uint32_t page) = NULL;
+
 static fs_node_t * lfb_device = NULL;
 static int lfb_init(char * c);
 
@@ -108,6 +121,60 @@ static int ioctl_vid(fs_node_t * node, int request, void * argp) {
 			}
 			validate(argp);
 			return lfb_init(argp);
+		case IO_VID_CURSOR:
+			/* Load a hardware cursor image */
+			validate(argp);
+			{
+				struct vid_cursor * cursor = argp;
+				if (!lfb_cursor_define) return -EINVAL;
+				if (!cursor->width || !cursor->height) return -EINVAL;
+				if (cursor->width > IO_VID_CURSOR_MAX || cursor->height > IO_VID_CURSOR_MAX) return -EINVAL;
+				if (cursor->hot_x >= cursor->width || cursor->hot_y >= cursor->height) return -EINVAL;
+				validate(cursor->bitmap);
+				validate(cursor->bitmap + cursor->width * cursor->height - 1);
+				return lfb_cursor_define(cursor);
+			}
+		case IO_VID_CURSOR_MOVE:
+			/* Move, show, or hide the hardware cursor */
+			validate(argp);
+			if (!lfb_cursor_move) return -EINVAL;
+			return lfb_cursor_move(argp);
+		case IO_VID_UPDATE:
+			/* Ask the device to show changed regions of the framebuffer */
+			validate(argp);
+			{
+				struct vid_rects * update = argp;
+				if (!lfb_update_rects) return -EINVAL;
+				if (!update->count) return 0;
+				if (update->count > IO_VID_RECTS_MAX) return -EINVAL;
+				validate(update->rects);
+				validate(update->rects + update->count - 1);
+				return lfb_update_rects(update->rects, update->count);
+			}
+		case IO_VID_COPY:
+			/* Move a region of the framebuffer on the device */
+			validate(argp);
+			{
+				struct vid_copy * copy = argp;
+				if (!lfb_copy_rect) return -EINVAL;
+				if (copy->src_x < 0 || copy->src_y < 0 || copy->dst_x < 0 || copy->dst_y < 0) return -EINVAL;
+				if (copy->width > lfb_resolution_x || copy->height > lfb_resolution_y) return -EINVAL;
+				if (copy->src_x + copy->width > lfb_resolution_x || copy->dst_x + copy->width > lfb_resolution_x) return -EINVAL;
+				if (copy->src_y + copy->height > lfb_resolution_y || copy->dst_y + copy->height > lfb_resolution_y) return -EINVAL;
+				if (!copy->width || !copy->height) return 0;
+				return lfb_copy_rect(copy);
+			}
+		case IO_VID_PAGES:
+			/* Set up pages to flip between; says how many we got */
+			validate(argp);
+			if (!lfb_set_pages) return -EINVAL;
+			*((uint32_t *)argp) = lfb_set_pages(*((uint32_t *)argp));
+			return 0;
+		case IO_VID_FLIP:
+			/* Show another page */
+			validate(argp);
+			if (!lfb_flip_page) return -EINVAL;
+			return lfb_flip_page(*((uint32_t *)argp));
 		default:
 			return -EINVAL;
 	}
@@ -219,6 +286,11 @@ static void lfb_video_panic(char ** msgs) {
 		}
 		y += char_height;
 	}
+
+	if (lfb_update_rects) {
+		struct vid_rect all = {0, 0, lfb_resolution_x, lfb_resolution_y};
+		lfb_update_rects(&all, 1);
+	}
 }
 
 static uint32_t framebuffer_func(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
@@ -285,6 +357,9 @@ static void bochs_scan_pci(uint32_t device, uint16_t v, uint16_t d, void * extra
 	}
 }
 
+static uint32_t bochs_vid_memsize = 0;
+static uint32_t bochs_pages = 1;
+
 static void bochs_set_resolution(uint16_t x, uint16_t y) {
 	outports(0x1CE, 0x04);
 	outports(0x1CF, 0x00);
@@ -311,12 +386,45 @@ static void bochs_set_resolution(uint16_t x, uint16_t y) {
 		x = new_x;
 	}
 
+	/* Back to showing the first page */
+	outports(0x1CE, 0x09);
+	outports(0x1CF, 0);
+	bochs_pages = 1;
+
 	lfb_resolution_x = x;
 	lfb_resolution_s = x * 4;
 	lfb_resolution_y = y;
 	lfb_resolution_b = 32;
 }
 
+static int bochs_flip_page(uint32_t page) {
+	if (page >= bochs_pages) return -EINVAL;
+	/* Pan the display down to the page's first line */
+	outports(0x1CE, 0x09);
+	outports(0x1CF, page * lfb_resolution_y);
+	return 0;
+}
+
+/*
+ * Pages are stacked in the virtual screen, which is as tall as the
+ * device would make it when we set the mode, so they're already there;
+ * this just works out how many fit.
+ */
+static uint32_t bochs_set_pages(uint32_t count) {
+	outports(0x1CE, 0x07);
+	uint32_t fit = inports(0x1CF) / lfb_resolution_y;
+	if (bochs_vid_memsize) {
+		uint32_t in_memory = bochs_vid_memsize / (lfb_resolution_s * lfb_resolution_y);
+		if (in_memory < fit) fit = in_memory;
+	}
+	if (count > fit) count = fit;
+	if (count < 1) count = 1;
+
+	bochs_pages = count;
+	bochs_flip_page(0);
+	return count;
+}
+
 static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y) {
 	uint32_t vid_memsize;
 	debug_print(NOTICE, "Setting up BOCHS/QEMU graphics controller...");
@@ -334,6 +442,8 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 	pci_scan(bochs_scan_pci, -1, &lfb_vid_memory);
 
 	lfb_resolution_impl = &bochs_set_resolution;
+	lfb_set_pages = &bochs_set_pages;
+	lfb_flip_page = &bochs_flip_page;
 
 	if (!lfb_vid_memory) {
 		debug_print(ERROR, "Failed to locate video memory.");
@@ -341,14 +451,7 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 	}
 
 	/* Enable the higher memory */
-	uintptr_t fb_offset = (uintptr_t)lfb_vid_memory;
-	for (uintptr_t i = fb_offset; i <= fb_offset + 0xFF0000; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	dma_map_region((uintptr_t)lfb_vid_memory, 0x1000000, 1);
 
 	outports(0x1CE, 0x0a);
 	i = inports(0x1CF);
@@ -358,9 +461,8 @@ static void graphics_install_bochs(uint16_t resolution_x, uint16_t resolution_y)
 		vid_memsize = inportl(0x1CF);
 	}
 	debug_print(WARNING, "Video memory size is 0x%x", vid_memsize);
-	for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + vid_memsize; i += 0x1000) {
-		dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
-	}
+	dma_map_region((uintptr_t)lfb_vid_memory, vid_memsize, 1);
+	bochs_vid_memsize = vid_memsize;
 
 	finalize_graphics("bochs");
 }
@@ -380,13 +482,7 @@ static void graphics_install_preset(uint16_t w, uint16_t h) {
 
 	debug_print(WARNING, "Mode was set by bootloader: %dx%d bpp should be 32, framebuffer is at 0x%x", w, h, (uintptr_t)lfb_vid_memory);
 
-	for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + w * h * 4; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	dma_map_region((uintptr_t)lfb_vid_memory, w * h * 4, 1);
 	finalize_graphics("preset");
 }
 
@@ -421,13 +517,7 @@ mem_found:
 	lfb_resolution_s = w * 4;
 	lfb_resolution_b = 32;
 
-	for (uintptr_t i = (uintptr_t)lfb_vid_memory; i <= (uintptr_t)lfb_vid_memory + w * h * 4; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
-	}
+	dma_map_region((uintptr_t)lfb_vid_memory, w * h * 4, 1);
 	finalize_graphics("kludge");
 }
 
@@ -443,8 +533,47 @@ mem_found:
 #define SVGA_REG_BITS_PER_PIXEL 7
 #define SVGA_REG_BYTES_PER_LINE 12
 #define SVGA_REG_FB_START 13
+#define SVGA_REG_VRAM_SIZE 15
+#define SVGA_REG_CAPABILITIES 17
+#define SVGA_REG_MEM_START 18
+#define SVGA_REG_MEM_SIZE 19
+#define SVGA_REG_CONFIG_DONE 20
+#define SVGA_REG_SYNC 21
+#define SVGA_REG_BUSY 22
+#define SVGA_REG_CURSOR_ID 24
+#define SVGA_REG_CURSOR_X 25
+#define SVGA_REG_CURSOR_Y 26
+#define SVGA_REG_CURSOR_ON 27
+
+#define SVGA_ID_2 0x90000002
+
+#define SVGA_CAP_RECT_COPY 0x00000002
+#define SVGA_CAP_CURSOR_BYPASS_2 0x00000080
+#define SVGA_CAP_ALPHA_CURSOR 0x00000200
+
+#define SVGA_FIFO_MIN 0
+#define SVGA_FIFO_MAX 1
+#define SVGA_FIFO_NEXT_CMD 2
+#define SVGA_FIFO_STOP 3
+#define SVGA_FIFO_NUM_REGS 4
+
+#define SVGA_CMD_UPDATE 1
+#define SVGA_CMD_RECT_COPY 3
+#define SVGA_CMD_DEFINE_ALPHA_CURSOR 22
+
+#define SVGA_CURSOR_ON_HIDE 0
+#define SVGA_CURSOR_ON_SHOW 1
+
+#define VMWARE_CURSOR_ID 1
 
 static uint32_t vmware_io = 0;
+static uint32_t vmware_id = 0;
+static volatile uint32_t * vmware_fifo = NULL;
+static int vmware_fifo_enabled = 0;
+
+/* Kept so the cursor can be loaded again after a mode set */
+static struct vid_cursor vmware_cursor = {0};
+static uint32_t vmware_cursor_image[IO_VID_CURSOR_MAX * IO_VID_CURSOR_MAX];
 
 static void vmware_scan_pci(uint32_t device, uint16_t v, uint16_t d, void * extra) {
 	if ((v == 0x15ad && d == 0x0405)) {
@@ -465,9 +594,125 @@ static uint32_t vmware_read(int reg) {
 	return inportl(SVGA_IO_MUL * SVGA_VALUE_PORT + SVGA_IO_BASE);
 }
 
+static void vmware_sync(void) {
+	vmware_write(SVGA_REG_SYNC, 1);
+	while (vmware_read(SVGA_REG_BUSY));
+}
+
+/*
+ * The command FIFO. Commands are short, so there's no reservation
+ * scheme: words go in one at a time, and if the device hasn't caught
+ * up we make it drain the whole thing.
+ *
+ * Once the FIFO is on, the device stops watching the framebuffer and
+ * only shows what UPDATE commands point it at, so it stays off until
+ * someone who will send those (the compositor) asks for a command.
+ */
+static void vmware_fifo_reset(void) {
+	uint32_t min = SVGA_FIFO_NUM_REGS * sizeof(uint32_t);
+	vmware_fifo[SVGA_FIFO_MIN] = min;
+	vmware_fifo[SVGA_FIFO_MAX] = vmware_read(SVGA_REG_MEM_SIZE);
+	vmware_fifo[SVGA_FIFO_NEXT_CMD] = min;
+	vmware_fifo[SVGA_FIFO_STOP] = min;
+	vmware_write(SVGA_REG_CONFIG_DONE, 1);
+}
+
+static void vmware_fifo_write(uint32_t value) {
+	uint32_t next = vmware_fifo[SVGA_FIFO_NEXT_CMD];
+	uint32_t after = next + sizeof(uint32_t);
+	if (after == vmware_fifo[SVGA_FIFO_MAX]) {
+		after = vmware_fifo[SVGA_FIFO_MIN];
+	}
+	while (after == vmware_fifo[SVGA_FIFO_STOP]) {
+		/* Full */
+		vmware_sync();
+	}
+	vmware_fifo[next / sizeof(uint32_t)] = value;
+	vmware_fifo[SVGA_FIFO_NEXT_CMD] = after;
+}
+
+static void vmware_fifo_enable(void) {
+	if (vmware_fifo_enabled) return;
+	vmware_fifo_reset();
+	vmware_fifo_enabled = 1;
+}
+
+/* Have the host look at the FIFO without waiting for it */
+static void vmware_fifo_kick(void) {
+	vmware_write(SVGA_REG_SYNC, 1);
+}
+
+static int vmware_update_rects(struct vid_rect * rects, int count) {
+	vmware_fifo_enable();
+	for (int i = 0; i < count; ++i) {
+		int64_t left   = rects[i].x < 0 ? 0 : rects[i].x;
+		int64_t top    = rects[i].y < 0 ? 0 : rects[i].y;
+		int64_t right  = (int64_t)rects[i].x + rects[i].width;
+		int64_t bottom = (int64_t)rects[i].y + rects[i].height;
+		if (right > lfb_resolution_x) right = lfb_resolution_x;
+		if (bottom > lfb_resolution_y) bottom = lfb_resolution_y;
+		if (right <= left || bottom <= top) continue;
+
+		vmware_fifo_write(SVGA_CMD_UPDATE);
+		vmware_fifo_write(left);
+		vmware_fifo_write(top);
+		vmware_fifo_write(right - left);
+		vmware_fifo_write(bottom - top);
+	}
+	vmware_fifo_kick();
+	return 0;
+}
+
+static int vmware_copy_rect(struct vid_copy * copy) {
+	vmware_fifo_enable();
+	vmware_fifo_write(SVGA_CMD_RECT_COPY);
+	vmware_fifo_write(copy->src_x);
+	vmware_fifo_write(copy->src_y);
+	vmware_fifo_write(copy->dst_x);
+	vmware_fifo_write(copy->dst_y);
+	vmware_fifo_write(copy->width);
+	vmware_fifo_write(copy->height);
+	/* The caller is likely to draw over the result next */
+	vmware_sync();
+	return 0;
+}
+
+static void vmware_cursor_load(void) {
+	vmware_fifo_write(SVGA_CMD_DEFINE_ALPHA_CURSOR);
+	vmware_fifo_write(VMWARE_CURSOR_ID);
+	vmware_fifo_write(vmware_cursor.hot_x);
+	vmware_fifo_write(vmware_cursor.hot_y);
+	vmware_fifo_write(vmware_cursor.width);
+	vmware_fifo_write(vmware_cursor.height);
+	for (uint32_t i = 0; i < vmware_cursor.width * vmware_cursor.height; ++i) {
+		vmware_fifo_write(vmware_cursor_image[i]);
+	}
+	vmware_sync();
+}
+
+static int vmware_cursor_define(struct vid_cursor * cursor) {
+	vmware_fifo_enable();
+	memcpy(vmware_cursor_image, cursor->bitmap, cursor->width * cursor->height * sizeof(uint32_t));
+	vmware_cursor = *cursor;
+	vmware_cursor.bitmap = vmware_cursor_image;
+	vmware_cursor_load();
+	return 0;
+}
+
+static int vmware_cursor_move(struct vid_cursor_pos * pos) {
+	/* "Cursor bypass 2": the device draws the cursor wherever these say */
+	vmware_write(SVGA_REG_CURSOR_ID, VMWARE_CURSOR_ID);
+	if (pos->visible) {
+		vmware_write(SVGA_REG_CURSOR_X, pos->x);
+		vmware_write(SVGA_REG_CURSOR_Y, pos->y);
+	}
+	vmware_write(SVGA_REG_CURSOR_ON, pos->visible ? SVGA_CURSOR_ON_SHOW : SVGA_CURSOR_ON_HIDE);
+	return 0;
+}
+
 static void vmware_set_resolution(uint16_t w, uint16_t h) {
 	vmware_write(SVGA_REG_ENABLE, 0);
-	vmware_write(SVGA_REG_ID, 0);
+	vmware_write(SVGA_REG_ID, vmware_id);
 	vmware_write(SVGA_REG_WIDTH, w);
 	vmware_write(SVGA_REG_HEIGHT, h);
 	vmware_write(SVGA_REG_BITS_PER_PIXEL, 32);
@@ -479,6 +724,41 @@ static void vmware_set_resolution(uint16_t w, uint16_t h) {
 	lfb_resolution_s = bpl;
 	lfb_resolution_y = h;
 	lfb_resolution_b = 32;
+
+	if (vmware_fifo_enabled) {
+		vmware_fifo_reset();
+		if (vmware_cursor.width) {
+			vmware_cursor_load();
+		}
+	}
+}
+
+static void vmware_fifo_install(void) {
+	if (vmware_id != SVGA_ID_2) return;
+
+	uint32_t caps = vmware_read(SVGA_REG_CAPABILITIES);
+	debug_print(WARNING, "vmware capabilities: 0x%x", caps);
+
+	uintptr_t fifo_addr = vmware_read(SVGA_REG_MEM_START);
+	uint32_t fifo_size = vmware_read(SVGA_REG_MEM_SIZE);
+	debug_print(WARNING, "vmware fifo: 0x%x (0x%x bytes)", fifo_addr, fifo_size);
+
+	for (uintptr_t i = fifo_addr; i < fifo_addr + fifo_size; i += 0x1000) {
+		dma_frame(get_page(i, 1, kernel_directory), 0, 1, i);
+	}
+
+	vmware_fifo = (volatile uint32_t *)fifo_addr;
+
+	lfb_update_rects = vmware_update_rects;
+
+	if (caps & SVGA_CAP_RECT_COPY) {
+		lfb_copy_rect = vmware_copy_rect;
+	}
+
+	if ((caps & SVGA_CAP_ALPHA_CURSOR) && (caps & SVGA_CAP_CURSOR_BYPASS_2) && !args_present("novmwarecursor")) {
+		lfb_cursor_define = vmware_cursor_define;
+		lfb_cursor_move = vmware_cursor_move;
+	}
 }
 
 static void graphics_install_vmware(uint16_t w, uint16_t h) {
@@ -491,25 +771,28 @@ static void graphics_install_vmware(uint16_t w, uint16_t h) {
 		debug_print(WARNING, "vmware io base: 0x%x", vmware_io);
 	}
 
+	/* Version 2 of the interface is needed for capabilities and the FIFO */
+	vmware_write(SVGA_REG_ID, SVGA_ID_2);
+	if (vmware_read(SVGA_REG_ID) == SVGA_ID_2) {
+		vmware_id = SVGA_ID_2;
+	}
+
 	vmware_set_resolution(w,h);
 	lfb_resolution_impl = &vmware_set_resolution;
 
 	uint32_t fb_addr = vmware_read(SVGA_REG_FB_START);
 	debug_print(WARNING, "vmware fb address: 0x%x", fb_addr);
 
-	uint32_t fb_size = vmware_read(15);
+	uint32_t fb_size = vmware_read(SVGA_REG_VRAM_SIZE);
 
 	debug_print(WARNING, "vmware fb size: 0x%x", fb_size);
 
 	lfb_vid_memory = (uint8_t *)fb_addr;
 
-	uintptr_t fb_offset = (uintptr_t)lfb_vid_memory;
-	for (uintptr_t i = fb_offset; i <= fb_offset + fb_size; i += 0x1000) {
-		page_t * p = get_page(i, 1, kernel_directory);
-		dma_frame(p, 0, 1, i);
-		p->pat = 1;
-		p->writethrough = 1;
-		p->cachedisable = 1;
+	dma_map_region((uintptr_t)lfb_vid_memory, fb_size, 1);
+
+	if (!vmware_fifo) {
+		vmware_fifo_install();
 	}
 
 	finalize_graphics("vmware");
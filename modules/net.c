@@ -10,63 +10,290 @@
 #include <kernel/tokenize.h>
 #include <kernel/mod/net.h>
 #include <kernel/mod/procfs.h>
+#include <kernel/workqueue.h>
 
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
+#include <sys/ioctl.h>
 
 static hashmap_t * dns_cache;
+static spin_lock_t dns_lock = { 0 };
 static list_t * dns_waiters = NULL;
 static uint32_t _dns_server;
 
-static hashmap_t *_tcp_sockets = NULL;
+static hashmap_t *_tcp_sockets = NULL;   /* Connections, by address and both ports */
+static hashmap_t *_tcp_listeners = NULL; /* Listening sockets, by port */
 static hashmap_t *_udp_sockets = NULL;
+static spin_lock_t tcp_table_lock = { 0 };
 
 static void parse_dns_response(fs_node_t * tty, void * last_packet);
-static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * queries);
-size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip);
-static size_t write_arp_request(uint8_t * buffer, uint32_t ip);
+static size_t write_dns_packet(struct netif * netif, uint8_t * buffer, size_t queries_len, uint8_t * queries);
+size_t write_dhcp_request(struct netif * netif, uint8_t * buffer, uint8_t * ip);
+static size_t write_arp_request(struct netif * netif, uint8_t * buffer, uint32_t ip);
+
+static uint8_t broadcast_mac[6] = {255,255,255,255,255,255};
+
+#define NETBUF_POOL_MIN 32  /* Allocated up front */
+#define NETBUF_POOL_MAX 256 /* Idle buffers kept beyond that are freed */
+#define TCP_MSS (1500 - sizeof(struct ipv4_packet) - sizeof(struct tcp_header))
+
+#define TCP_RECV_WINDOW 65535 /* No window scaling */
+#define TCP_RCVBUF      0x10000 /* Holds one full window */
+#define TCP_RCVBUF_MIN  0x1000
+#define TCP_RCVBUF_MAX  0x10000 /* More is no use without window scaling */
+#define TCP_INIT_CWND   (10 * TCP_MSS)
+#define TCP_INIT_RTO    1000 /* All times in milliseconds */
+#define TCP_MIN_RTO     200
+#define TCP_MAX_RTO     60000
+#define TCP_DELACK      40
+#define TCP_TIMER       20
+
+#define TCP_SYN_RETRIES 3
+#define TCP_MAX_RETRIES 8 /* Timeouts in a row before a connection is given up on */
+#define TCP_MAX_BACKLOG 128
+
+/* tcp_socket.status */
+#define TCP_OPEN         0 /* Connecting or connected */
+#define TCP_LISTEN       1
+#define TCP_SYN_RECEIVED 2
+
+#define UDP_RCVBUF      0x10000 /* Bytes of datagrams queued per socket */
+#define UDP_MAX_PAYLOAD (1500 - sizeof(struct ipv4_packet) - sizeof(struct udp_packet)) /* No fragmentation */
+#define DNS_CLIENT_PORT  50053
+#define DHCP_CLIENT_PORT 68
+
+#define SEQ_LT(a,b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a) - (b)) <= 0)
+
+/* Connections the timer looks after; taken before any socket's lock */
+static list_t * tcp_socket_list = NULL;
+static spin_lock_t tcp_socket_list_lock = { 0 };
+
+/*
+ * Connections are found by the other end's address and port along with
+ * our own port, so any number of them can share a local port.
+ */
+struct tcp_key {
+	uint32_t ip;
+	uint16_t port_dest;
+	uint16_t port_recv;
+};
+
+static unsigned int tcp_key_hash(void * key) {
+	struct tcp_key * k = key;
+	unsigned int hash = k->ip ^ ((unsigned int)k->port_dest << 16 | k->port_recv);
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static int tcp_key_comp(void * a, void * b) {
+	struct tcp_key * x = a, * y = b;
+	return x->ip == y->ip && x->port_dest == y->port_dest && x->port_recv == y->port_recv;
+}
+
+static void * tcp_key_dupe(void * key) {
+	struct tcp_key * out = malloc(sizeof(struct tcp_key));
+	memcpy(out, key, sizeof(struct tcp_key));
+	return out;
+}
+
+static struct socket * tcp_table_lookup(uint32_t ip, uint16_t port_dest, uint16_t port_recv) {
+	struct tcp_key key = { ip, port_dest, port_recv };
+	spin_lock(tcp_table_lock);
+	struct socket * socket = hashmap_get(_tcp_sockets, &key);
+	spin_unlock(tcp_table_lock);
+	return socket;
+}
+
+static void tcp_table_insert(struct socket * socket) {
+	struct tcp_key key = { socket->ip, socket->port_dest, socket->port_recv };
+	spin_lock(tcp_table_lock);
+	hashmap_set(_tcp_sockets, &key, socket);
+	spin_unlock(tcp_table_lock);
+}
+
+static void tcp_table_remove(struct socket * socket) {
+	struct tcp_key key = { socket->ip, socket->port_dest, socket->port_recv };
+	spin_lock(tcp_table_lock);
+	if (hashmap_get(_tcp_sockets, &key) == socket) {
+		hashmap_remove(_tcp_sockets, &key);
+	}
+	spin_unlock(tcp_table_lock);
+}
+
+static node_t * netbuf_pool = NULL;
+static size_t netbuf_pool_count = 0;
+
+/*
+ * Drivers take buffers from their interrupt handlers, so the pool is
+ * guarded by disabling interrupts rather than with a spin lock.
+ */
+struct netbuf * netbuf_alloc(void) {
+	struct netbuf * nb = NULL;
+
+	uint32_t flags = int_save();
+	if (netbuf_pool) {
+		nb = netbuf_pool->value;
+		netbuf_pool = netbuf_pool->next;
+		netbuf_pool_count--;
+	}
+	int_restore(flags);
+
+	if (!nb) {
+		nb = malloc(sizeof(struct netbuf));
+	}
+
+	nb->node.next  = NULL;
+	nb->node.prev  = NULL;
+	nb->node.value = nb;
+	nb->node.owner = NULL;
+	nb->data = nb->buffer + NETBUF_HEADROOM;
+	nb->len  = 0;
+	nb->flags = 0;
+	nb->tso_mss = 0;
+	nb->next  = NULL;
+	nb->holds = 0;
+	nb->freed = 0;
+	return nb;
+}
+
+void netbuf_free(struct netbuf * nb) {
+	uint32_t flags = int_save();
+	if (nb->holds) {
+		/* A card is still sending from it; the last release frees it */
+		nb->freed = 1;
+		nb = NULL;
+	} else if (netbuf_pool_count < NETBUF_POOL_MAX) {
+		nb->node.value = nb;
+		nb->node.next = netbuf_pool;
+		netbuf_pool = &nb->node;
+		netbuf_pool_count++;
+		nb = NULL;
+	}
+	int_restore(flags);
+
+	if (nb) {
+		free(nb);
+	}
+}
+
+void netbuf_hold(struct netbuf * nb) {
+	uint32_t flags = int_save();
+	nb->holds++;
+	int_restore(flags);
+}
+
+void netbuf_release(struct netbuf * nb) {
+	uint32_t flags = int_save();
+	int freed = !--nb->holds && nb->freed;
+	int_restore(flags);
+
+	if (freed) {
+		nb->freed = 0;
+		netbuf_free(nb);
+	}
+}
+
+/*
+ * Every card a driver registered, in the order they showed up. Each one
+ * has its own receive worker, so a busy interface doesn't hold up the
+ * others. Outgoing packets pick their interface from the route table.
+ */
+static list_t * netif_list = NULL;
+static spin_lock_t netif_lock = { 0 };
+
+struct route {
+	uint32_t dest;    /* All in host order */
+	uint32_t mask;
+	uint32_t gateway; /* 0 for directly attached networks */
+	struct netif * netif;
+};
+
+static list_t * route_table = NULL;
+static spin_lock_t route_lock = { 0 };
+
+/* IP addresses (host order) to MAC addresses, for every interface */
+static hashmap_t * arp_cache = NULL;
+static spin_lock_t arp_lock = { 0 };
 
-static uint8_t _gateway[6] = {255,255,255,255,255,255};
+#define ARP_TTL   300 /* Seconds before an answer is checked again */
+#define ARP_RETRY 1   /* Seconds between requests for the same address */
+
+struct arp_entry {
+	uint8_t mac[6];
+	int resolved;
+	unsigned long expires; /* When the answer goes stale */
+	unsigned long retry;   /* When we may ask again */
+};
 
-static struct netif _netif = {0};
+/*
+ * Resolver cache, names to addresses. Entries last as long as the
+ * answer's TTL said; failed lookups are remembered for a while too so
+ * they don't go back to the server every time.
+ */
+#define DNS_MIN_TTL      5
+#define DNS_MAX_TTL      86400
+#define DNS_NEGATIVE_TTL 30
+
+struct dns_entry {
+	uint32_t ip;
+	int negative;
+	unsigned long expires; /* 0 for entries that never expire */
+};
 
-static int tasklet_pid = 0;
+static unsigned long net_seconds(void) {
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	return s;
+}
 
 uint32_t get_primary_dns(void);
 
 static uint32_t netif_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	char * buf = malloc(4096);
-
-	struct netif * netif = &_netif;
-	char ip[16];
-	ip_ntoa(netif->source, ip);
-	char dns[16];
-	ip_ntoa(get_primary_dns(), dns);
-	char gw[16];
-	ip_ntoa(netif->gateway, gw);
-
-	if (netif->hwaddr[0] == 0 &&
-		netif->hwaddr[1] == 0 &&
-		netif->hwaddr[2] == 0 &&
-		netif->hwaddr[3] == 0 &&
-		netif->hwaddr[4] == 0 &&
-		netif->hwaddr[5] == 0) {
-
-		sprintf(buf, "no network\n");
-	} else {
-		sprintf(buf,
+	char * out = buf;
+
+	*buf = '\0';
+
+	spin_lock(netif_lock);
+	foreach(node, netif_list) {
+		struct netif * netif = node->value;
+		char ip[16];
+		ip_ntoa(netif->source, ip);
+		char mask[16];
+		ip_ntoa(netif->netmask, mask);
+		char dns[16];
+		ip_ntoa(get_primary_dns(), dns);
+		char gw[16];
+		ip_ntoa(netif->gateway, gw);
+
+		sprintf(out,
+			"%s"
+			"name:\t%s\n"
 			"ip:\t%s\n"
+			"netmask:\t%s\n"
 			"mac:\t%2x:%2x:%2x:%2x:%2x:%2x\n"
 			"device:\t%s\n"
 			"dns:\t%s\n"
 			"gateway:\t%s\n"
 			,
+			out == buf ? "" : "\n",
+			netif->name,
 			ip,
+			mask,
 			netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2], netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5],
 			netif->driver,
 			dns,
 			gw
 		);
+		out += strlen(out);
+	}
+	spin_unlock(netif_lock);
+
+	if (out == buf) {
+		sprintf(buf, "no network\n");
 	}
 
 	size_t _bsize = strlen(buf);
@@ -87,12 +314,24 @@ static struct procfs_entry netif_entry = {
 	netif_func,
 };
 
-void init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_packet_func send_func, char * device) {
-	_netif.get_mac = mac_func;
-	_netif.get_packet = get_func;
-	_netif.send_packet = send_func;
-	_netif.driver = device;
-	memcpy(_netif.hwaddr, _netif.get_mac(), sizeof(_netif.hwaddr));
+static void tcp_timer(void * data);
+static work_t tcp_timer_work;
+
+struct netif * init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_packet_func send_func, char * device) {
+	static int tcp_timer_started = 0;
+
+	struct netif * netif = malloc(sizeof(struct netif));
+	memset(netif, 0, sizeof(struct netif));
+	netif->get_mac = mac_func;
+	netif->get_packet = get_func;
+	netif->send_packet = send_func;
+	netif->driver = device;
+	memcpy(netif->hwaddr, netif->get_mac(), sizeof(netif->hwaddr));
+
+	spin_lock(netif_lock);
+	sprintf(netif->name, "eth%d", netif_list->length);
+	list_insert(netif_list, netif);
+	spin_unlock(netif_lock);
 
 	if (!netif_entry.id) {
 		int (*procfs_install)(struct procfs_entry *) = (int (*)(struct procfs_entry *))(uintptr_t)hashmap_get(modules_get_symbols(),"procfs_install");
@@ -101,14 +340,202 @@ void init_netif_funcs(get_mac_func mac_func, get_packet_func get_func, send_pack
 		}
 	}
 
-	if (!tasklet_pid) {
-		tasklet_pid = create_kernel_tasklet(net_handler, "[net]", NULL);
-		debug_print(NOTICE, "Network worker tasklet started with pid %d", tasklet_pid);
+	char worker[32];
+	sprintf(worker, "[net %s]", netif->name);
+	netif->worker_pid = create_kernel_tasklet(net_handler, strdup(worker), netif);
+	debug_print(NOTICE, "Network worker for %s (%s) started with pid %d", netif->name, device, netif->worker_pid);
+
+	if (!tcp_timer_started) {
+		tcp_timer_started = 1;
+		work_init(&tcp_timer_work, tcp_timer, NULL, WORK_NORMAL);
+		queue_delayed_work(&tcp_timer_work, TCP_TIMER);
+	}
+
+	return netif;
+}
+
+/* Drivers with offloads call this on the netif they got from init_netif_funcs() */
+void init_netif_offload(struct netif * netif, uint32_t caps, send_netbuf_func send_netbuf) {
+	netif->send_netbuf = send_netbuf;
+	netif->caps = send_netbuf ? caps : 0;
+}
+
+/* Drivers that can say when their transmit ring is full call this too */
+void init_netif_tx_room(struct netif * netif, tx_room_func tx_room, list_t * tx_wait) {
+	netif->tx_room = tx_room;
+	netif->tx_wait = tx_wait;
+}
+
+/*
+ * Sleep until the interface has room for another frame. Returns 0
+ * straight away if it already has, or doesn't say.
+ */
+static int netif_wait_tx_room(struct netif * netif) {
+	if (!netif || !netif->tx_room) return 0;
+	uint32_t flags = int_save();
+	if (netif->tx_room()) {
+		int_restore(flags);
+		return 0;
 	}
+	sleep_on(netif->tx_wait);
+	int_restore(flags);
+	return 1;
+}
+
+/* Is this one of the receive workers? They can't wait on themselves. */
+static int net_in_worker(void) {
+	int found = 0;
+	spin_lock(netif_lock);
+	foreach(node, netif_list) {
+		struct netif * netif = node->value;
+		if (netif->worker_pid == current_process->id) found = 1;
+	}
+	spin_unlock(netif_lock);
+	return found;
+}
+
+static void route_add(uint32_t dest, uint32_t mask, uint32_t gateway, struct netif * netif) {
+	struct route * route = malloc(sizeof(struct route));
+	route->dest = dest & mask;
+	route->mask = mask;
+	route->gateway = gateway;
+	route->netif = netif;
+
+	spin_lock(route_lock);
+	list_insert(route_table, route);
+	spin_unlock(route_lock);
+}
+
+static int route_has_default(void) {
+	int found = 0;
+	spin_lock(route_lock);
+	foreach(node, route_table) {
+		struct route * route = node->value;
+		if (!route->mask) found = 1;
+	}
+	spin_unlock(route_lock);
+	return found;
+}
+
+/*
+ * Longest prefix match. Returns the interface to send on, and the
+ * address to send to there (the gateway, or dest itself if it's on
+ * that network), or NULL if nothing matches.
+ */
+static struct netif * route_lookup(uint32_t dest, uint32_t * next_hop) {
+	struct route * best = NULL;
+
+	spin_lock(route_lock);
+	foreach(node, route_table) {
+		struct route * route = node->value;
+		if ((dest & route->mask) != route->dest) continue;
+		if (!best || route->mask > best->mask) best = route;
+	}
+	struct netif * netif = NULL;
+	if (best) {
+		netif = best->netif;
+		*next_hop = best->gateway ? best->gateway : dest;
+	}
+	spin_unlock(route_lock);
+
+	return netif;
+}
+
+/*
+ * Fill in the MAC address for ip. Stale answers are still used while a
+ * fresh one is asked for; with no answer at all the caller broadcasts.
+ */
+static int arp_lookup(struct netif * netif, uint32_t ip, uint8_t * mac) {
+	unsigned long now = net_seconds();
+
+	spin_lock(arp_lock);
+	struct arp_entry * entry = hashmap_get(arp_cache, (void *)ip);
+	if (!entry) {
+		entry = malloc(sizeof(struct arp_entry));
+		memset(entry, 0, sizeof(struct arp_entry));
+		hashmap_set(arp_cache, (void *)ip, entry);
+	}
+	int ask = !(entry->resolved && now < entry->expires) && now >= entry->retry;
+	if (ask) {
+		entry->retry = now + ARP_RETRY;
+	}
+	int have = entry->resolved;
+	if (have) {
+		memcpy(mac, entry->mac, 6);
+	}
+	spin_unlock(arp_lock);
+
+	if (ask) {
+		void * tmp = malloc(1024);
+		size_t packet_size = write_arp_request(netif, tmp, ip);
+		netif->send_packet(tmp, packet_size);
+		free(tmp);
+	}
+	return have;
+}
+
+static void arp_store(uint32_t ip, uint8_t * mac) {
+	spin_lock(arp_lock);
+	struct arp_entry * entry = hashmap_get(arp_cache, (void *)ip);
+	if (!entry) {
+		entry = malloc(sizeof(struct arp_entry));
+		memset(entry, 0, sizeof(struct arp_entry));
+		hashmap_set(arp_cache, (void *)ip, entry);
+	}
+	memcpy(entry->mac, mac, 6);
+	entry->resolved = 1;
+	entry->expires = net_seconds() + ARP_TTL;
+	entry->retry = 0;
+	spin_unlock(arp_lock);
+}
+
+/* Returns 1 with *ip filled in, -1 if the name is known not to resolve, 0 if we don't know */
+static int dns_cache_lookup(char * name, uint32_t * ip) {
+	int ret = 0;
+	spin_lock(dns_lock);
+	struct dns_entry * entry = hashmap_get(dns_cache, name);
+	if (entry && entry->expires && entry->expires <= net_seconds()) {
+		hashmap_remove(dns_cache, name);
+		free(entry);
+		entry = NULL;
+	}
+	if (entry) {
+		if (entry->negative) {
+			ret = -1;
+		} else {
+			*ip = entry->ip;
+			ret = 1;
+		}
+	}
+	spin_unlock(dns_lock);
+	return ret;
+}
+
+/* ttl of 0 keeps the entry forever */
+static void dns_cache_store(char * name, uint32_t ip, uint32_t ttl, int negative) {
+	spin_lock(dns_lock);
+	struct dns_entry * entry = hashmap_get(dns_cache, name);
+	if (!entry) {
+		entry = malloc(sizeof(struct dns_entry));
+		hashmap_set(dns_cache, name, entry);
+	}
+	entry->ip = ip;
+	entry->negative = negative;
+	if (ttl) {
+		entry->expires = net_seconds() + MIN(MAX(ttl, DNS_MIN_TTL), DNS_MAX_TTL);
+	} else {
+		entry->expires = 0;
+	}
+	spin_unlock(dns_lock);
 }
 
 struct netif * get_default_network_interface(void) {
-	return &_netif;
+	uint32_t next_hop;
+	struct netif * netif = route_lookup(0, &next_hop);
+	if (!netif && netif_list->head) {
+		netif = netif_list->head->value;
+	}
+	return netif;
 }
 
 uint32_t get_primary_dns(void) {
@@ -151,67 +578,72 @@ void ip_ntoa(uint32_t src_addr, char * out) {
 		(src_addr & 0xFF));
 }
 
-uint16_t calculate_ipv4_checksum(struct ipv4_packet * p) {
-	uint32_t sum = 0;
-	uint16_t * s = (uint16_t *)p;
-
-	/* TODO: Checksums for options? */
-	for (int i = 0; i < 10; ++i) {
-		sum += ntohs(s[i]);
+/*
+ * Ones' complement sums, a 32-bit word at a time into a 64-bit
+ * accumulator. The sum comes out the same whichever way round the bytes
+ * are, so packet data is added as it sits in memory and only the final
+ * result is swapped.
+ */
+typedef uint32_t __attribute__((__may_alias__)) csum_u32_t;
+typedef uint16_t __attribute__((__may_alias__)) csum_u16_t;
+
+static uint64_t csum_add(const void * data, size_t len, uint64_t acc) {
+	const uint8_t * p = data;
+
+	while (len >= 16) {
+		acc += ((const csum_u32_t *)p)[0];
+		acc += ((const csum_u32_t *)p)[1];
+		acc += ((const csum_u32_t *)p)[2];
+		acc += ((const csum_u32_t *)p)[3];
+		p += 16;
+		len -= 16;
 	}
-
-	if (sum > 0xFFFF) {
-		sum = (sum >> 16) + (sum & 0xFFFF);
+	while (len >= 4) {
+		acc += *(const csum_u32_t *)p;
+		p += 4;
+		len -= 4;
 	}
-
-	return ~(sum & 0xFFFF) & 0xFFFF;
-}
-
-uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, void * d, size_t payload_size) {
-	uint32_t sum = 0;
-	uint16_t * s = (uint16_t *)p;
-
-	/* TODO: Checksums for options? */
-	for (int i = 0; i < 6; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+	if (len >= 2) {
+		acc += *(const csum_u16_t *)p;
+		p += 2;
+		len -= 2;
 	}
-
-	s = (uint16_t *)h;
-	for (int i = 0; i < 10; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+	if (len) {
+		acc += *p; /* Padded with a zero byte */
 	}
+	return acc;
+}
 
-	uint16_t d_words = payload_size / 2;
+static uint16_t csum_fold(uint64_t acc) {
+	acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+	acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+	acc = (acc & 0xFFFF) + (acc >> 16);
+	acc = (acc & 0xFFFF) + (acc >> 16);
+	return acc;
+}
 
-	s = (uint16_t *)d;
-	for (unsigned int i = 0; i < d_words; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
+/* source and destination as they appear in the packet (network order) */
+static uint64_t csum_pseudo(uint32_t source, uint32_t destination, uint8_t proto, size_t length) {
+	return (uint64_t)source + destination + htons(proto) + htons(length);
+}
 
-	if (d_words * 2 != payload_size) {
-		uint8_t * t = (uint8_t *)d;
-		uint8_t tmp[2];
-		tmp[0] = t[d_words * sizeof(uint16_t)];
-		tmp[1] = 0;
+uint16_t calculate_ipv4_checksum(struct ipv4_packet * p) {
+	return ntohs(~csum_fold(csum_add(p, (p->version_ihl & 0xF) * 4, 0)) & 0xFFFF);
+}
 
-		uint16_t * f = (uint16_t *)tmp;
+/* length covers the TCP header, options and data */
+uint16_t calculate_tcp_checksum(uint32_t source, uint32_t destination, struct tcp_header * h, size_t length) {
+	return ntohs(~csum_fold(csum_add(h, length, csum_pseudo(source, destination, IPV4_PROT_TCP, length))) & 0xFFFF);
+}
 
-		sum += ntohs(f[0]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
-	}
+/* What a card doing the TCP checksum wants left in the checksum field */
+uint16_t calculate_tcp_pseudo_checksum(uint32_t source, uint32_t destination, size_t length) {
+	return ntohs(csum_fold(csum_pseudo(source, destination, IPV4_PROT_TCP, length)));
+}
 
-	return ~(sum & 0xFFFF) & 0xFFFF;
+/* length covers the UDP header and data */
+uint16_t calculate_udp_checksum(uint32_t source, uint32_t destination, struct udp_packet * h, size_t length) {
+	return ntohs(~csum_fold(csum_add(h, length, csum_pseudo(source, destination, IPV4_PROT_UDP, length))) & 0xFFFF);
 }
 
 static struct dirent * readdir_netfs(fs_node_t *node, uint32_t index) {
@@ -336,57 +768,6 @@ static int is_ip(char * name) {
 	return 1;
 }
 
-static char read_a_byte(struct socket * stream, int * status) {
-	static char * foo = NULL;
-	static char * read_ptr = NULL;
-	static int have_bytes = 0;
-	if (!foo) foo = malloc(4096);
-	while (!have_bytes) {
-		memset(foo, 0x00, 4096);
-		have_bytes = net_recv(stream, (uint8_t *)foo, 4096);
-		if (have_bytes == 0) {
-			*status = 1;
-			return 0;
-		}
-		debug_print(WARNING, "Received %d bytes...", have_bytes);
-		read_ptr = foo;
-	}
-
-	char ret = *read_ptr;
-
-	have_bytes -= 1;
-	read_ptr++;
-
-	return ret;
-}
-
-
-static char * fgets(char * buf, int size, struct socket * stream) {
-	char * x = buf;
-	int collected = 0;
-
-	while (collected < size) {
-
-		int status = 0;
-
-		*x = read_a_byte(stream, &status);
-
-		if (status == 1) {
-			return buf;
-		}
-
-		collected++;
-
-		if (*x == '\n') break;
-
-		x++;
-	}
-
-	x++;
-	*x = '\0';
-	return buf;
-}
-
 static void socket_alert_waiters(struct socket * sock) {
 	if (sock->alert_waiters) {
 		while (sock->alert_waiters->head) {
@@ -402,14 +783,22 @@ static void socket_alert_waiters(struct socket * sock) {
 static int socket_check(fs_node_t * node) {
 	struct socket * sock = node->device;
 
-	if (sock->bytes_available) {
-		return 0;
+	if (sock->sock_type == SOCK_DGRAM) {
+		return (sock->datagrams->length || sock->status == 1) ? 0 : 1;
 	}
 
-	if (sock->packet_queue->length > 0) {
+	if (sock->proto_sock.tcp_socket.status == TCP_LISTEN && sock->accept_queue->length) {
+		return 0; /* accept() won't block */
+	}
+
+	if (ring_buffer_unread(sock->recv_buffer)) {
 		return 0;
 	}
 
+	if (sock->status == 1) {
+		return 0; /* read() will say end of file */
+	}
+
 	return 1;
 }
 
@@ -424,22 +813,137 @@ static int socket_wait(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static int udp_bind(struct socket * socket, uint16_t port);
+static int udp_send(struct socket * socket, uint32_t ip, uint16_t port, struct iovec * iov, size_t iovlen);
+static int udp_sendmmsg(struct socket * socket, struct mmsghdr * msgs, unsigned int vlen, int flags);
+static int udp_recvmmsg(struct socket * socket, struct mmsghdr * msgs, unsigned int vlen, int flags);
+static void udp_close(struct socket * socket);
+
 static uint32_t socket_read(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
 	/* Sleep until we have something to receive */
-#if 0
-	fgets((char *)buffer, size, node->device);
-	return strlen((char *)buffer);
-#else
+	struct socket * sock = node->device;
+	if (sock->sock_type == SOCK_DGRAM) {
+		/* One datagram; whatever doesn't fit is gone */
+		struct iovec iov = { buffer, size };
+		struct msghdr msg = { NULL, 0, &iov, 1, NULL, 0, 0 };
+		struct mmsghdr mmsg = { msg, 0 };
+		int ret = udp_recvmmsg(sock, &mmsg, 1, 0);
+		return ret < 0 ? (uint32_t)ret : mmsg.msg_len;
+	}
 	return net_recv(node->device, buffer, size);
-#endif
 }
 static uint32_t socket_write(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
 	/* Add the packet to the appropriate interface queue and send it off. */
+	struct socket * sock = node->device;
+	if (sock->sock_type == SOCK_DGRAM) {
+		if (!sock->port_dest) return -EDESTADDRREQ;
+		struct iovec iov = { buffer, size };
+		return udp_send(sock, sock->ip, sock->port_dest, &iov, 1);
+	}
 
-	net_send((struct socket *)node->device, buffer, size, 0);
+	net_send(sock, buffer, size, 0);
 	return size;
 }
 
+static int net_bind(struct socket * socket, uint16_t port);
+static int net_listen(struct socket * socket, int backlog);
+static struct socket * net_accept(struct socket * socket);
+static fs_node_t * socket_node_create(struct socket * socket, char * name);
+
+static int socket_ioctl(fs_node_t * node, int request, void * argp) {
+	struct socket * sock = node->device;
+
+	switch (request) {
+		case IOCTL_SOCK_GETRCVBUF:
+			if (sock->sock_type == SOCK_DGRAM) return sock->datagram_limit;
+			return sock->recv_buffer->size - 1;
+		case IOCTL_SOCK_SETRCVBUF: {
+			if (!argp) return -EINVAL;
+			validate(argp);
+			int want = *(int *)argp;
+			if (want < 0) return -EINVAL;
+			if (sock->sock_type == SOCK_DGRAM) {
+				sock->datagram_limit = MAX((size_t)want, UDP_MAX_PAYLOAD);
+				return sock->datagram_limit;
+			}
+			size_t size = TCP_RCVBUF_MIN;
+			while (size < TCP_RCVBUF_MAX && size < (size_t)want + 1) size <<= 1;
+			if (size != sock->recv_buffer->size) {
+				int ret = ring_buffer_resize(sock->recv_buffer, size);
+				if (ret < 0) return ret;
+			}
+			return size - 1;
+		}
+		case IOCTL_SOCK_BIND:
+			if (!argp) return -EINVAL;
+			validate(argp);
+			return net_bind(sock, ntohs(((struct sockaddr_in *)argp)->sin_port));
+		case IOCTL_SOCK_LISTEN: {
+			int backlog = TCP_MAX_BACKLOG;
+			if (argp) {
+				validate(argp);
+				backlog = *(int *)argp;
+			}
+			return net_listen(sock, backlog);
+		}
+		case IOCTL_SOCK_ACCEPT: {
+			if (argp) validate(argp);
+			struct socket * conn = net_accept(sock);
+			if (!conn) {
+				return (sock->proto_sock.tcp_socket.status == TCP_LISTEN && !sock->status) ? -EINTR : -EINVAL;
+			}
+			if (argp) {
+				struct sockaddr_in * addr = argp;
+				memset(addr, 0, sizeof(struct sockaddr_in));
+				addr->sin_family = AF_INET;
+				addr->sin_port = htons(conn->port_dest);
+				addr->sin_addr.s_addr = htonl(conn->ip);
+			}
+			fs_node_t * fnode = socket_node_create(conn, "accepted");
+			open_fs(fnode, 0);
+			int fd = process_append_fd((process_t *)current_process, fnode);
+			current_process->fds->entries[fd].mode = 03; /* read write */
+			return fd;
+		}
+		case IOCTL_SOCK_CONNECT: {
+			if (!argp) return -EINVAL;
+			validate(argp);
+			struct sockaddr_in * addr = argp;
+			if (sock->sock_type == SOCK_DGRAM) {
+				/* Just sets where write() goes and who read() hears from */
+				if (!sock->port_recv) {
+					int ret = udp_bind(sock, 0);
+					if (ret < 0) return ret;
+				}
+				sock->ip = ntohl(addr->sin_addr.s_addr);
+				sock->port_dest = ntohs(addr->sin_port);
+				return 0;
+			}
+			if (sock->proto_sock.tcp_socket.status == TCP_LISTEN || sock->port_dest) return -EISCONN;
+			net_connect(sock, ntohl(addr->sin_addr.s_addr), ntohs(addr->sin_port));
+			return sock->status ? -ECONNREFUSED : 0;
+		}
+		case IOCTL_SOCK_SENDMMSG:
+		case IOCTL_SOCK_RECVMMSG: {
+			if (!argp) return -EINVAL;
+			validate(argp);
+			void ** args = argp;
+			struct mmsghdr * msgs = args[0];
+			unsigned int vlen = (uintptr_t)args[1];
+			int flags = (uintptr_t)args[2];
+			if (sock->sock_type != SOCK_DGRAM) return -EOPNOTSUPP;
+			if (!vlen) return 0;
+			validate(msgs);
+			if (request == IOCTL_SOCK_SENDMMSG) {
+				return udp_sendmmsg(sock, msgs, vlen, flags);
+			}
+			return udp_recvmmsg(sock, msgs, vlen, flags);
+		}
+		default:
+			return -EINVAL;
+	}
+}
+
 uint16_t next_ephemeral_port(void) {
 	static uint16_t next = 49152;
 
@@ -459,11 +963,13 @@ uint16_t next_ephemeral_port(void) {
 }
 
 fs_node_t * socket_ipv4_tcp_create(uint32_t dest, uint16_t target_port, uint16_t source_port) {
-
-	/* Okay, first step is to get us added to the table so we can receive syns. */
-
-	return NULL;
-
+	struct socket * socket = net_open(SOCK_STREAM);
+	if (source_port && net_bind(socket, source_port) < 0) {
+		return NULL;
+	}
+	fs_node_t * fnode = socket_node_create(socket, "tcp");
+	net_connect(socket, dest, target_port);
+	return fnode;
 }
 
 static int gethost(char * name, uint32_t * ip) {
@@ -472,10 +978,13 @@ static int gethost(char * name, uint32_t * ip) {
 		*ip = ip_aton(name);
 		return 0;
 	} else {
-		if (hashmap_has(dns_cache, name)) {
-			*ip = ip_aton(hashmap_get(dns_cache, name));
-			debug_print(WARNING, "   In Cache: %s → %x", name, ip);
+		int cached = dns_cache_lookup(name, ip);
+		if (cached > 0) {
+			debug_print(WARNING, "   In Cache: %s → %x", name, *ip);
 			return 0;
+		} else if (cached < 0) {
+			debug_print(WARNING, "   Known not to resolve: %s", name);
+			return 1;
 		} else {
 			debug_print(WARNING, "   Not in cache: %s", name);
 			debug_print(WARNING, "   Still needs look up.");
@@ -499,40 +1008,77 @@ static int gethost(char * name, uint32_t * ip) {
 
 			debug_print(WARNING, "Querying...");
 
+			uint32_t next_hop;
+			struct netif * netif = route_lookup(_dns_server, &next_hop);
+			if (!netif) {
+				debug_print(WARNING, "No route to the DNS server");
+				free(queries);
+				return 1;
+			}
+
 			void * tmp = malloc(1024);
-			size_t packet_size = write_dns_packet(tmp, c + 4, (uint8_t *)queries);
+			size_t packet_size = write_dns_packet(netif, tmp, c + 4, (uint8_t *)queries);
 			free(queries);
 
-			_netif.send_packet(tmp, packet_size);
+			netif->send_packet(tmp, packet_size);
 			free(tmp);
 
 			/* wait for response */
-			if (current_process->id != tasklet_pid) {
+			if (!net_in_worker()) {
 				sleep_on(dns_waiters);
 			}
-			if (hashmap_has(dns_cache, name)) {
-				*ip = ip_aton(hashmap_get(dns_cache, name));
-				debug_print(WARNING, "   Now in cache: %s → %x", name, ip);
+			cached = dns_cache_lookup(name, ip);
+			if (cached > 0) {
+				debug_print(WARNING, "   Now in cache: %s → %x", name, *ip);
 				return 0;
+			} else if (cached < 0) {
+				return 1;
 			} else {
-				if (current_process->id == tasklet_pid) {
+				if (net_in_worker()) {
 					debug_print(WARNING, "Query hasn't returned yet, but we're in the network thread, so we need to yield.");
 					return 2;
 				}
-				gethost(name,ip);
-				return 1;
+				return gethost(name,ip);
 			}
 		}
 	}
 }
 
 static int net_send_tcp(struct socket *socket, uint16_t flags, uint8_t * payload, uint32_t payload_size);
+static int tcp_send_pending(struct socket * socket, int force);
 
 static void socket_close(fs_node_t * node) {
 	debug_print(WARNING, "Closing socket");
 	struct socket * sock = node->device;
 	if (sock->status == 1) return; /* already closed */
+	if (sock->sock_type == SOCK_DGRAM) {
+		udp_close(sock);
+		return;
+	}
+	if (sock->proto_sock.tcp_socket.status == TCP_LISTEN) {
+		/* Refuse anything that was waiting to be accepted */
+		hashmap_remove(_tcp_listeners, (void *)(uintptr_t)sock->port_recv);
+		while (sock->accept_queue->head) {
+			node_t * n = list_dequeue(sock->accept_queue);
+			struct socket * conn = n->value;
+			free(n);
+			spin_lock(conn->proto_sock.tcp_socket.lock);
+			net_send_tcp(conn, TCP_FLAGS_RES | TCP_FLAGS_ACK, NULL, 0);
+			spin_unlock(conn->proto_sock.tcp_socket.lock);
+			net_close(conn);
+		}
+		net_close(sock);
+		return;
+	}
+	if (!sock->port_dest) {
+		/* Never connected */
+		sock->status = 1;
+		return;
+	}
+	spin_lock(sock->proto_sock.tcp_socket.lock);
+	tcp_send_pending(sock, 1);
 	net_send_tcp(sock, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
+	spin_unlock(sock->proto_sock.tcp_socket.lock);
 	sock->status = 2;
 }
 
@@ -540,6 +1086,14 @@ static void socket_close(fs_node_t * node) {
 /* TODO: socket_open - idk, whatever */
 
 static fs_node_t * finddir_netfs(fs_node_t * node, char * name) {
+	if (!strcmp(name, "tcp")) {
+		/* An unconnected socket, for bind() and listen() or connect() */
+		return socket_node_create(net_open(SOCK_STREAM), name);
+	}
+	if (!strcmp(name, "udp")) {
+		return socket_node_create(net_open(SOCK_DGRAM), name);
+	}
+
 	/* Should essentially find anything. */
 	debug_print(WARNING, "Need to look up domain or check if is IP: %s", name);
 	/* Block until lookup is complete */
@@ -556,6 +1110,13 @@ static fs_node_t * finddir_netfs(fs_node_t * node, char * name) {
 	uint32_t ip = 0;
 	if (gethost(name, &ip)) return NULL;
 
+	fs_node_t * fnode = socket_node_create(net_open(SOCK_STREAM), name);
+	net_connect((struct socket *)fnode->device, ip, port);
+
+	return fnode;
+}
+
+static fs_node_t * socket_node_create(struct socket * socket, char * name) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
@@ -565,12 +1126,10 @@ static fs_node_t * finddir_netfs(fs_node_t * node, char * name) {
 	fnode->read    = socket_read;
 	fnode->write   = socket_write;
 	fnode->close   = socket_close;
-	fnode->device  = (void *)net_open(SOCK_STREAM);
+	fnode->device  = (void *)socket;
 	fnode->selectcheck = socket_check;
 	fnode->selectwait = socket_wait;
-
-	net_connect((struct socket *)fnode->device, ip, port);
-
+	fnode->ioctl = socket_ioctl;
 	return fnode;
 }
 
@@ -589,14 +1148,14 @@ static int ioctl_netfs(fs_node_t * node, int request, void * argp) {
 	return 0;
 }
 
-static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * queries) {
+static size_t write_dns_packet(struct netif * netif, uint8_t * buffer, size_t queries_len, uint8_t * queries) {
 	size_t offset = 0;
 	size_t payload_size = sizeof(struct dns_packet) + queries_len;
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0800),
 	};
@@ -617,7 +1176,7 @@ static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * q
 		.ttl = 0x40,
 		.protocol = IPV4_PROT_UDP,
 		.checksum = 0, /* fill this in later */
-		.source = htonl(_netif.source),
+		.source = htonl(netif->source),
 		.destination = htonl(_dns_server),
 	};
 
@@ -627,7 +1186,7 @@ static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * q
 	memcpy(&buffer[offset], &ipv4_out, sizeof(struct ipv4_packet));
 	offset += sizeof(struct ipv4_packet);
 
-	uint16_t _udp_source = htons(50053); /* Use an ephemeral port */
+	uint16_t _udp_source = htons(DNS_CLIENT_PORT);
 	uint16_t _udp_destination = htons(53);
 	uint16_t _udp_length = htons(sizeof(struct udp_packet) + payload_size);
 
@@ -663,98 +1222,392 @@ static size_t write_dns_packet(uint8_t * buffer, size_t queries_len, uint8_t * q
 	return offset;
 }
 
-static int net_send_ether(struct socket *socket, struct netif* netif, uint16_t ether_type, void* payload, uint32_t payload_size) {
-	struct ethernet_packet *eth = malloc(sizeof(struct ethernet_packet) + payload_size);
+static int net_send_ether(struct socket *socket, struct netif* netif, uint16_t ether_type, struct netbuf * nb, uint32_t next_hop) {
+	struct ethernet_packet *eth = netbuf_push(nb, sizeof(struct ethernet_packet));
 	memcpy(eth->source, netif->hwaddr, sizeof(eth->source));
-	//memset(eth->destination, 0xFF, sizeof(eth->destination));
-	memcpy(eth->destination, _gateway, sizeof(_gateway));
+	if (!arp_lookup(netif, next_hop, eth->destination)) {
+		memcpy(eth->destination, broadcast_mac, sizeof(broadcast_mac));
+	}
 	eth->type = htons(ether_type);
 
-	if (payload_size) {
-		memcpy(eth->payload, payload, payload_size);
+	if (nb->flags && netif->send_netbuf) {
+		netif->send_netbuf(nb);
+	} else {
+		netif->send_packet(nb->data, nb->len);
+	}
+
+	return 1; // yolo
+}
+
+static int net_send_ip(struct socket *socket, uint32_t dest, int proto, struct netbuf * nb) {
+	uint32_t next_hop;
+	struct netif * netif = route_lookup(dest, &next_hop);
+	if (!netif) {
+		debug_print(WARNING, "net_send_ip: No route to host");
+		return 0;
+	}
+
+	/* Offloaded TCP goes out chained to cards that gather; anything else in one piece */
+	int offload = (netif->caps & NETIF_CAP_TX_CSUM) && proto == IPV4_PROT_TCP;
+	struct netbuf * chain = nb->next;
+	size_t appended = 0;
+	uint32_t chained = 0;
+	for (struct netbuf * f = chain; f; f = f->next) {
+		if (offload && (netif->caps & NETIF_CAP_SG)) {
+			chained += f->len;
+		} else if (nb->data + nb->len + f->len <= nb->buffer + NETBUF_SIZE) {
+			memcpy(nb->data + nb->len, f->data, f->len);
+			nb->len += f->len;
+			appended += f->len;
+		} else {
+			debug_print(WARNING, "net_send_ip: chained packet too long for %s", netif->name);
+			nb->len -= appended;
+			return 0;
+		}
 	}
+	if (!chained) nb->next = NULL;
 
-	netif->send_packet((uint8_t*)eth, sizeof(struct ethernet_packet) + payload_size);
+	void * payload = nb->data;
+	uint32_t payload_size = nb->len + chained;
+	struct ipv4_packet *ipv4 = netbuf_push(nb, sizeof(struct ipv4_packet));
 
-	free(eth);
+	uint16_t _length = htons(sizeof(struct ipv4_packet) + payload_size);
+	uint16_t _ident  = htons(1);
 
-	return 1; // yolo
+	ipv4->version_ihl = ((0x4 << 4) | (0x5 << 0)); /* 4 = ipv4, 5 = no options */
+	ipv4->dscp_ecn = 0; /* not setting either of those */
+	ipv4->length = _length;
+	ipv4->ident = _ident;
+	ipv4->flags_fragment = 0;
+	ipv4->ttl = 0x40;
+	ipv4->protocol = proto;
+	ipv4->checksum = 0; // Fill in later */
+	ipv4->source = htonl(netif->source),
+	ipv4->destination = htonl(dest);
+
+	/* Leave the checksums to the card when it can do them */
+	nb->flags &= ~(NETBUF_TX_CSUM_IP | NETBUF_TX_CSUM_TCP);
+
+	if (offload) {
+		nb->flags |= NETBUF_TX_CSUM_IP;
+	} else {
+		uint16_t checksum = calculate_ipv4_checksum(ipv4);
+		ipv4->checksum = htons(checksum);
+	}
+
+	if (proto == IPV4_PROT_TCP) {
+		struct tcp_header* tcp_hdr = (struct tcp_header*)payload;
+		if (offload) {
+			nb->flags |= NETBUF_TX_CSUM_TCP;
+			tcp_hdr->checksum = htons(calculate_tcp_pseudo_checksum(ipv4->source, ipv4->destination, payload_size));
+		} else {
+			tcp_hdr->checksum = htons(calculate_tcp_checksum(ipv4->source, ipv4->destination, tcp_hdr, payload_size));
+		}
+	} else if (proto == IPV4_PROT_UDP) {
+		struct udp_packet * udp = (struct udp_packet *)payload;
+		uint16_t checksum = calculate_udp_checksum(ipv4->source, ipv4->destination, udp, payload_size);
+		udp->checksum = htons(checksum ? checksum : 0xFFFF); /* Zero means none */
+	}
+
+	int sent = net_send_ether(socket, netif, ETHERNET_TYPE_IPV4, nb, next_hop);
+
+	/* The chain is still the sender's */
+	nb->next = chain;
+	nb->len -= appended;
+	return sent;
+}
+
+static uint32_t tcp_now(void) {
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	return s * 1000 + ss / 1000;
+}
+
+static uint32_t tcp_recv_window(struct socket * socket) {
+	return MIN(ring_buffer_available(socket->recv_buffer), TCP_RECV_WINDOW);
+}
+
+/*
+ * Put a TCP header in front of what's in the netbuf (options first, then
+ * payload) and send it. The headers come back off afterwards, so a
+ * segment kept for retransmission can go out again as-is. Anything with
+ * ACK set also takes care of any delayed acknowledgement.
+ */
+static void tcp_output(struct socket * socket, struct netbuf * nb, uint32_t seq, uint16_t flags, size_t options) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	uint8_t * data = nb->data;
+	size_t len = nb->len;
+
+	struct tcp_header *tcp = netbuf_push(nb, sizeof(struct tcp_header));
+
+	uint16_t _flags = (((sizeof(struct tcp_header) + options) / 4) << 12) | (flags & 0xFF);
+	t->rcv_wnd_sent = tcp_recv_window(socket);
+
+	tcp->source_port = htons(socket->port_recv);
+	tcp->destination_port = htons(socket->port_dest);
+	tcp->seq_number = htonl(seq);
+	tcp->ack_number = flags & (TCP_FLAGS_ACK) ? htonl(t->ack_no) : 0;
+	tcp->flags = htons(_flags);
+	tcp->window_size = htons(t->rcv_wnd_sent);
+	tcp->checksum = 0; // Fill in later
+	tcp->urgent = 0;
+
+	if (flags & TCP_FLAGS_ACK) {
+		t->ack_pending = 0;
+	}
+
+	net_send_ip(socket, socket->ip, IPV4_PROT_TCP, nb);
+
+	nb->data = data;
+	nb->len  = len;
+}
+
+/* Control segments (SYN, FIN, bare ACKs); these are not retransmitted. */
+static int net_send_tcp(struct socket *socket, uint16_t flags, uint8_t * payload, uint32_t payload_size) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	struct netbuf * nb = netbuf_alloc();
+	size_t options = 0;
+
+	if (flags & TCP_FLAGS_SYN) {
+		/* Tell the other end how big a segment we take */
+		nb->data[0] = 2;
+		nb->data[1] = 4;
+		nb->data[2] = TCP_MSS >> 8;
+		nb->data[3] = TCP_MSS & 0xFF;
+		nb->len = options = 4;
+	}
+
+	if (payload) {
+		memcpy(nb->data + nb->len, payload, payload_size);
+		nb->len += payload_size;
+	}
+
+	tcp_output(socket, nb, t->seq_no, flags, options);
+	netbuf_free(nb);
+
+	if (flags & TCP_FLAGS_SYN) {
+		// SYN takes up a sequence number despite no payload
+		t->seq_no += 1;
+	} else {
+		t->seq_no += payload_size;
+		if ((flags & TCP_FLAGS_FIN) && !t->fin_sent) {
+			t->seq_no += 1;
+			t->fin_sent = 1;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Send the segment being filled if the send and congestion windows have
+ * room for it (or anyway, with force). It's kept until acknowledged.
+ * Call with the socket lock held.
+ */
+static int tcp_send_pending(struct socket * socket, int force) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	struct netbuf * nb = t->pending;
+	if (!nb || !nb->len) return 0;
+
+	uint32_t flight = t->seq_no - t->snd_una;
+	if (!force && flight && flight + nb->len > MIN(t->cwnd, t->snd_wnd)) {
+		return 0;
+	}
+
+	t->pending = NULL;
+	nb->seq = t->seq_no;
+	nb->sent = tcp_now();
+	nb->retransmitted = 0;
+
+	tcp_output(socket, nb, nb->seq, TCP_FLAGS_ACK | TCP_FLAGS_PSH, 0);
+	t->seq_no += nb->len;
+
+	list_append(t->unacked, &nb->node);
+	if (!t->rto_deadline) {
+		t->rto_deadline = nb->sent + t->rto;
+	}
+	return 1;
 }
 
-static int net_send_ip(struct socket *socket, int proto, void* payload, uint32_t payload_size) {
-	struct ipv4_packet *ipv4 = malloc(sizeof(struct ipv4_packet) + payload_size);
+/* Resend the oldest unacknowledged segment. */
+static void tcp_retransmit(struct socket * socket) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	if (!t->unacked->head) return;
 
-	uint16_t _length = htons(sizeof(struct ipv4_packet) + payload_size);
-	uint16_t _ident  = htons(1);
+	struct netbuf * nb = t->unacked->head->value;
+	nb->retransmitted = 1;
+	tcp_output(socket, nb, nb->seq, TCP_FLAGS_ACK | TCP_FLAGS_PSH, 0);
+	t->rto_deadline = tcp_now() + t->rto;
+}
 
-	ipv4->version_ihl = ((0x4 << 4) | (0x5 << 0)); /* 4 = ipv4, 5 = no options */
-	ipv4->dscp_ecn = 0; /* not setting either of those */
-	ipv4->length = _length;
-	ipv4->ident = _ident;
-	ipv4->flags_fragment = 0;
-	ipv4->ttl = 0x40;
-	ipv4->protocol = proto;
-	ipv4->checksum = 0; // Fill in later */
-	ipv4->source = htonl(_netif.source),
-	ipv4->destination = htonl(socket->ip);
+/* RFC 6298 smoothed round trip time and retransmission timeout */
+static void tcp_rtt_sample(struct tcp_socket * t, uint32_t rtt) {
+	if (!t->srtt) {
+		t->srtt = rtt ? rtt : 1;
+		t->rttvar = rtt / 2;
+	} else {
+		uint32_t err = rtt > t->srtt ? rtt - t->srtt : t->srtt - rtt;
+		t->rttvar = (3 * t->rttvar + err) / 4;
+		t->srtt = (7 * t->srtt + rtt) / 8;
+		if (!t->srtt) t->srtt = 1;
+	}
+	t->rto = t->srtt + MAX(TCP_TIMER, 4 * t->rttvar);
+	if (t->rto < TCP_MIN_RTO) t->rto = TCP_MIN_RTO;
+	if (t->rto > TCP_MAX_RTO) t->rto = TCP_MAX_RTO;
+}
 
-	uint16_t checksum = calculate_ipv4_checksum(ipv4);
-	ipv4->checksum = htons(checksum);
+/*
+ * Process the acknowledgement in an incoming segment: retire what it
+ * covers, run NewReno (slow start, congestion avoidance, fast retransmit
+ * and recovery), and send whatever the window now allows.
+ */
+static void tcp_handle_ack(struct socket * socket, struct tcp_header * tcp, size_t data_length) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	uint32_t ack = ntohl(tcp->ack_number);
+	uint32_t window = ntohs(tcp->window_size);
+	uint32_t now = tcp_now();
+
+	if (SEQ_LT(t->snd_una, ack)) {
+		uint32_t acked = ack - t->snd_una;
+		t->snd_una = ack;
+		t->snd_wnd = window;
+		t->dup_acks = 0;
+		t->retries = 0;
+
+		while (t->unacked->head) {
+			struct netbuf * nb = t->unacked->head->value;
+			if (SEQ_LT(ack, nb->seq + nb->len)) break;
+			list_dequeue(t->unacked);
+			if (!nb->retransmitted) {
+				/* Karn: only time segments that went out once */
+				tcp_rtt_sample(t, now - nb->sent);
+			}
+			netbuf_free(nb);
+		}
 
-	if (proto == IPV4_PROT_TCP) {
-		// Need to calculate TCP checksum
-		struct tcp_check_header check_hd = {
-			.source = ipv4->source,
-			.destination = ipv4->destination,
-			.zeros = 0,
-			.protocol = 6,
-			.tcp_len = htons(payload_size),
-		};
-
-		// debug_print(WARNING, "net_send_ip: Payload size: %d\n", payload_size);
-		struct tcp_header* tcp_hdr = (struct tcp_header*)payload;
-		// debug_print(WARNING, "net_send_ip: Header len htons: %d\n", TCP_HEADER_LENGTH_FLIPPED(tcp_hdr));
-		size_t orig_payload_size = payload_size - TCP_HEADER_LENGTH_FLIPPED(tcp_hdr);
+		if (t->in_recovery) {
+			if (SEQ_LEQ(t->recover, ack)) {
+				t->in_recovery = 0;
+				t->cwnd = t->ssthresh;
+			} else {
+				/* Partial ACK: the next segment was lost as well */
+				tcp_retransmit(socket);
+				t->cwnd = (t->cwnd > acked ? t->cwnd - acked : 0) + TCP_MSS;
+			}
+		} else if (t->cwnd < t->ssthresh) {
+			t->cwnd += MIN(acked, TCP_MSS);
+		} else {
+			t->cwnd += MAX(1, TCP_MSS * TCP_MSS / t->cwnd);
+		}
 
-		uint16_t chk = calculate_tcp_checksum(&check_hd, tcp_hdr, tcp_hdr->payload, orig_payload_size);
-		tcp_hdr->checksum = htons(chk);
+		t->rto_deadline = t->unacked->head ? now + t->rto : 0;
+	} else if (ack == t->snd_una) {
+		if (!data_length && t->unacked->head && window == t->snd_wnd) {
+			if (++t->dup_acks == 3 && !t->in_recovery) {
+				uint32_t flight = t->seq_no - t->snd_una;
+				t->ssthresh = MAX(flight / 2, 2 * TCP_MSS);
+				t->cwnd = t->ssthresh + 3 * TCP_MSS;
+				t->in_recovery = 1;
+				t->recover = t->seq_no;
+				tcp_retransmit(socket);
+			} else if (t->in_recovery) {
+				t->cwnd += TCP_MSS;
+			}
+		}
+		t->snd_wnd = window;
 	}
 
-	if (payload) {
-		memcpy(ipv4->payload, payload, payload_size);
-		free(payload);
+	/* Full segments go when there's room, short ones once all is acked */
+	if (t->pending && (t->pending->len == TCP_MSS || t->seq_no == t->snd_una)) {
+		tcp_send_pending(socket, 0);
 	}
-
-	// TODO: netif should not be a global thing. But the route should be looked up here and a netif object created/returned
-	int out = net_send_ether(socket, &_netif, ETHERNET_TYPE_IPV4, ipv4, sizeof(struct ipv4_packet) + payload_size);
-	free(ipv4);
-	return out;
+	wakeup_queue(t->send_wait);
 }
 
-static int net_send_tcp(struct socket *socket, uint16_t flags, uint8_t * payload, uint32_t payload_size) {
-	struct tcp_header *tcp = malloc(sizeof(struct tcp_header) + payload_size);
+static void tcp_drop_syn_received(struct socket * socket);
 
-	tcp->source_port = htons(socket->port_recv);
-	tcp->destination_port = htons(socket->port_dest);
-	tcp->seq_number = htonl(socket->proto_sock.tcp_socket.seq_no);
-	tcp->ack_number = flags & (TCP_FLAGS_ACK) ? htonl(socket->proto_sock.tcp_socket.ack_no) : 0;
-	tcp->flags = htons(0x5000 ^ (flags & 0xFF));
-	tcp->window_size = htons(1548-54);
-	tcp->checksum = 0; // Fill in later
-	tcp->urgent = 0;
+/* The other end stopped answering; tell it so if it's still there, and close. */
+static void tcp_abort(struct socket * socket) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	debug_print(WARNING, "tcp: giving up on connection to port %d after %d timeouts", socket->port_dest, TCP_MAX_RETRIES);
+	spin_lock(t->lock);
+	net_send_tcp(socket, TCP_FLAGS_RES | TCP_FLAGS_ACK, NULL, 0);
+	spin_unlock(t->lock);
+	net_close(socket);
+}
 
-	if ((flags & 0xff) == TCP_FLAGS_SYN) {
-		// If only SYN set, expected ACK will be 1 despite no payload
-		socket->proto_sock.tcp_socket.seq_no += 1;
-	} else {
-		socket->proto_sock.tcp_socket.seq_no += payload_size;
+/*
+ * Retransmission, delayed ACK and handshake timers for every connection.
+ */
+static void tcp_timer(void * data) {
+	uint32_t now = tcp_now();
+	list_t * expired = NULL; /* Closing takes the list lock, so it waits until we're done */
+
+	spin_lock(tcp_socket_list_lock);
+	foreach(node, tcp_socket_list) {
+		struct socket * socket = node->value;
+		struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+		if (socket->status == 1) continue;
+
+		if (t->status == TCP_LISTEN) continue;
+		if (t->status == TCP_SYN_RECEIVED) {
+			if (SEQ_LEQ(t->rto_deadline, now)) {
+				if (++t->retries > TCP_SYN_RETRIES) {
+					if (!expired) expired = list_create();
+					list_insert(expired, socket);
+					continue;
+				}
+				spin_lock(t->lock);
+				t->seq_no = t->snd_una;
+				net_send_tcp(socket, TCP_FLAGS_SYN | TCP_FLAGS_ACK, NULL, 0);
+				t->rto = MIN(t->rto * 2, TCP_MAX_RTO);
+				t->rto_deadline = now + t->rto;
+				spin_unlock(t->lock);
+			}
+			continue;
+		}
+
+		spin_lock(t->lock);
+		if (t->ack_pending && SEQ_LEQ(t->ack_deadline, now)) {
+			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
+		}
+		if (t->rto_deadline && SEQ_LEQ(t->rto_deadline, now) && t->unacked->head) {
+			if (++t->retries > TCP_MAX_RETRIES) {
+				t->rto_deadline = 0;
+				spin_unlock(t->lock);
+				if (!expired) expired = list_create();
+				list_insert(expired, socket);
+				continue;
+			}
+			/* Timed out: assume the worst and start again from one segment */
+			uint32_t flight = t->seq_no - t->snd_una;
+			t->ssthresh = MAX(flight / 2, 2 * TCP_MSS);
+			t->cwnd = TCP_MSS;
+			t->in_recovery = 0;
+			t->dup_acks = 0;
+			t->rto = MIN(t->rto * 2, TCP_MAX_RTO);
+			tcp_retransmit(socket);
+		}
+		spin_unlock(t->lock);
 	}
+	spin_unlock(tcp_socket_list_lock);
 
-	if (payload) {
-		memcpy(tcp->payload, payload, payload_size);
+	if (expired) {
+		node_t * node;
+		while ((node = list_dequeue(expired))) {
+			struct socket * socket = node->value;
+			free(node);
+			if (socket->status == 1) continue; /* Closed meanwhile */
+			if (socket->proto_sock.tcp_socket.status == TCP_SYN_RECEIVED) {
+				tcp_drop_syn_received(socket);
+			} else {
+				tcp_abort(socket);
+			}
+		}
+		free(expired);
 	}
 
-	return net_send_ip(socket, IPV4_PROT_TCP, tcp, sizeof(struct tcp_header) + payload_size);
+	queue_delayed_work(&tcp_timer_work, TCP_TIMER);
 }
 
 struct socket* net_open(uint32_t type) {
@@ -763,92 +1616,282 @@ struct socket* net_open(uint32_t type) {
 	memset(sock, 0, sizeof(struct socket));
 	sock->sock_type = type;
 
+	struct tcp_socket * t = &sock->proto_sock.tcp_socket;
+	spin_init(t->lock);
+	t->is_connected = list_create();
+	t->snd_wnd  = TCP_MSS;
+	t->cwnd     = TCP_INIT_CWND;
+	t->ssthresh = TCP_RECV_WINDOW;
+	t->rto      = TCP_INIT_RTO;
+	t->unacked   = list_create();
+	t->send_wait = list_create();
+
+	if (type == SOCK_DGRAM) {
+		sock->datagrams = list_create();
+		sock->datagram_limit = UDP_RCVBUF;
+		spin_init(sock->datagram_lock);
+	} else {
+		sock->recv_buffer = ring_buffer_create(TCP_RCVBUF);
+	}
+	sock->packet_wait = list_create();
+	sock->alert_waiters = list_create();
+	sock->accept_queue = list_create();
+
 	return sock;
 }
 
+/* RFC 793's four microsecond clock, so new connections don't reuse old sequence numbers */
+static uint32_t tcp_isn(void) {
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	return s * 250000 + ss / 4;
+}
+
+static int net_bind(struct socket * socket, uint16_t port) {
+	if (socket->sock_type == SOCK_DGRAM) return udp_bind(socket, port);
+	if (socket->port_recv) return -EINVAL;
+	if (!port) {
+		port = next_ephemeral_port();
+	} else if (hashmap_has(_tcp_listeners, (void *)(uintptr_t)port)) {
+		return -EADDRINUSE;
+	}
+	socket->port_recv = port;
+	return 0;
+}
+
+static int net_listen(struct socket * socket, int backlog) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	if (socket->port_dest || socket->status) return -EINVAL;
+	if (!socket->port_recv) {
+		socket->port_recv = next_ephemeral_port();
+	}
+
+	struct socket * other = hashmap_get(_tcp_listeners, (void *)(uintptr_t)socket->port_recv);
+	if (other && other != socket) return -EADDRINUSE;
+
+	socket->backlog = MIN(MAX(backlog, 1), TCP_MAX_BACKLOG);
+	t->status = TCP_LISTEN;
+	hashmap_set(_tcp_listeners, (void *)(uintptr_t)socket->port_recv, socket);
+	debug_print(NOTICE, "Listening on port %d (backlog %d)", socket->port_recv, socket->backlog);
+	return 0;
+}
+
+/* Wait for the next connection to finish its handshake. */
+static struct socket * net_accept(struct socket * socket) {
+	if (socket->proto_sock.tcp_socket.status != TCP_LISTEN) return NULL;
+
+	while (!socket->accept_queue->head) {
+		if (socket->status == 1) return NULL;
+		if (sleep_on(socket->packet_wait)) return NULL;
+	}
+
+	node_t * n = list_dequeue(socket->accept_queue);
+	struct socket * conn = n->value;
+	free(n);
+	return conn;
+}
+
+/*
+ * Take a closed connection off the timer's list and let go of what it
+ * still had waiting to be sent or acknowledged.
+ */
+static void tcp_forget(struct socket * socket) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+
+	spin_lock(tcp_socket_list_lock);
+	node_t * node = list_find(tcp_socket_list, socket);
+	if (node) {
+		list_delete(tcp_socket_list, node);
+		free(node);
+	}
+	spin_unlock(tcp_socket_list_lock);
+
+	spin_lock(t->lock);
+	while ((node = list_dequeue(t->unacked))) {
+		netbuf_free(node->value);
+	}
+	if (t->pending) {
+		netbuf_free(t->pending);
+		t->pending = NULL;
+	}
+	t->rto_deadline = 0;
+	spin_unlock(t->lock);
+}
+
+/* Call without the socket lock held */
 int net_close(struct socket* socket) {
 	// socket->is_connected;
 	socket->status = 1; /* Disconnected */
+	if (socket->sock_type == SOCK_STREAM) {
+		tcp_forget(socket);
+	}
 	wakeup_queue(socket->packet_wait);
+	wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
+	if (socket->proto_sock.tcp_socket.send_wait) {
+		wakeup_queue(socket->proto_sock.tcp_socket.send_wait);
+	}
 	socket_alert_waiters(socket);
 	return 1;
 }
 
+/*
+ * Writes are packed into MSS-sized segments. Full segments go out as the
+ * windows and the card's transmit ring allow, blocking the writer while
+ * they're shut; a short tail is held back while anything is
+ * unacknowledged (Nagle).
+ */
 int net_send(struct socket* socket, uint8_t* payload, size_t payload_size, int flags) {
-	return net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_PSH, payload, payload_size);
-}
-
-size_t net_recv(struct socket* socket, uint8_t* buffer, size_t len) {
-	tcpdata_t *tcpdata = NULL;
-	node_t *node = NULL;
-
-	debug_print(INFO, "0x%x [socket]", socket);
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
 
-	size_t offset = 0;
-	size_t size_to_read = 0;
+	spin_lock(t->lock);
+	while (payload_size && !socket->status) {
+		if (!t->pending) {
+			t->pending = netbuf_alloc();
+		}
+		struct netbuf * nb = t->pending;
+		size_t count = MIN(TCP_MSS - nb->len, payload_size);
+		memcpy(nb->data + nb->len, payload, count);
+		nb->len += count;
+		payload += count;
+		payload_size -= count;
+
+		while (t->pending && t->pending->len == TCP_MSS && !socket->status) {
+			/* A full transmit ring holds the writer back too, rather than the card driver */
+			spin_unlock(t->lock);
+			uint32_t next_hop;
+			int waited = netif_wait_tx_room(route_lookup(socket->ip, &next_hop));
+			spin_lock(t->lock);
+			if (waited) continue;
+
+			if (tcp_send_pending(socket, 0)) break;
+			spin_unlock(t->lock);
+			sleep_on(t->send_wait);
+			spin_lock(t->lock);
+		}
+	}
+	if (t->pending && t->seq_no == t->snd_una) {
+		tcp_send_pending(socket, 0);
+	}
+	spin_unlock(t->lock);
 
-	do {
+	return 1;
+}
 
-	if (socket->bytes_available) {
-		tcpdata = socket->current_packet;
-	} else {
-		spin_lock(socket->packet_queue_lock);
-		do {
-			if (socket->packet_queue->length > 0) {
-				node = list_dequeue(socket->packet_queue);
-				spin_unlock(socket->packet_queue_lock);
-				break;
-			} else {
-				if (socket->status == 1) {
-					spin_unlock(socket->packet_queue_lock);
-					debug_print(WARNING, "Socket closed, done reading.");
-					return 0;
-				}
-				spin_unlock(socket->packet_queue_lock);
-				sleep_on(socket->packet_wait);
-				spin_lock(socket->packet_queue_lock);
-			}
-		} while (1);
+size_t net_recv(struct socket* socket, uint8_t* buffer, size_t len) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	size_t available;
 
-		tcpdata = node->value;
-		socket->bytes_available = tcpdata->payload_size;
-		socket->bytes_read = 0;
-		free(node);
+	while (!(available = ring_buffer_unread(socket->recv_buffer))) {
+		if (socket->status == 1) {
+			debug_print(WARNING, "Socket closed, done reading.");
+			return 0;
+		}
+		sleep_on(socket->packet_wait);
 	}
 
-	size_to_read = MIN(len, socket->bytes_available);
+	/* Everything that has arrived, not just one segment */
+	size_t size_to_read = ring_buffer_read(socket->recv_buffer, MIN(len, available), buffer);
 
-	if (tcpdata->payload != 0) {
-		memcpy(buffer + offset, tcpdata->payload + socket->bytes_read, size_to_read);
+	/* Tell the sender once the window has opened up a fair bit */
+	spin_lock(t->lock);
+	if (!socket->status && tcp_recv_window(socket) >= t->rcv_wnd_sent + 2 * TCP_MSS) {
+		net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
 	}
+	spin_unlock(t->lock);
 
-	offset += size_to_read;
+	return size_to_read;
+}
 
-	if (size_to_read < socket->bytes_available) {
-		socket->bytes_available -= size_to_read;
-		socket->bytes_read += size_to_read;
-		socket->current_packet = tcpdata;
-	} else {
-		socket->bytes_available = 0;
-		socket->current_packet = NULL;
-		free(tcpdata->payload);
-		free(tcpdata);
+/*
+ * A SYN for a listening port: start the handshake on a new socket, which
+ * goes on the listener's accept queue once the final ACK arrives. SYNs
+ * beyond the backlog are dropped, and the other end will try again.
+ */
+static void tcp_handle_syn(uint32_t source, struct tcp_header * tcp) {
+	uint16_t port = ntohs(tcp->destination_port);
+	struct socket * listener = hashmap_get(_tcp_listeners, (void *)(uintptr_t)port);
+	if (!listener || listener->status) {
+		debug_print(WARNING, "net_handle_tcp: SYN for port %d, which nobody is listening on", port);
+		return;
 	}
 
+	if (listener->syn_received + (int)listener->accept_queue->length >= listener->backlog) {
+		debug_print(WARNING, "net_handle_tcp: Backlog for port %d is full, dropping SYN", port);
+		return;
+	}
 
-	} while (!size_to_read);
+	struct socket * socket = net_open(SOCK_STREAM);
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	socket->ip = source;
+	socket->port_dest = ntohs(tcp->source_port);
+	socket->port_recv = port;
+	socket->listener = listener;
+	listener->syn_received++;
+
+	t->status = TCP_SYN_RECEIVED;
+	t->ack_no = ntohl(tcp->seq_number) + 1;
+	t->seq_no = tcp_isn();
+	t->snd_una = t->seq_no;
+	t->snd_wnd = ntohs(tcp->window_size);
+
+	tcp_table_insert(socket);
+	spin_lock(tcp_socket_list_lock);
+	list_insert(tcp_socket_list, socket);
+	spin_unlock(tcp_socket_list_lock);
+
+	spin_lock(t->lock);
+	net_send_tcp(socket, TCP_FLAGS_SYN | TCP_FLAGS_ACK, NULL, 0);
+	t->rto_deadline = tcp_now() + t->rto;
+	spin_unlock(t->lock);
+}
 
+/* A handshake that never finished; the listener gets its backlog slot back. */
+static void tcp_drop_syn_received(struct socket * socket) {
+	if (socket->listener) {
+		socket->listener->syn_received--;
+		socket->listener = NULL;
+	}
+	tcp_table_remove(socket);
+	net_close(socket);
+}
 
-	return size_to_read;
+/* The final ACK of a handshake we answered. Call with the socket lock held. */
+static void tcp_established(struct socket * socket, struct tcp_header * tcp) {
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	struct socket * listener = socket->listener;
+
+	t->status = TCP_OPEN;
+	t->snd_una = ntohl(tcp->ack_number);
+	t->snd_wnd = ntohs(tcp->window_size);
+	t->rto_deadline = 0;
+	t->retries = 0;
+
+	socket->listener = NULL;
+	listener->syn_received--;
+	list_insert(listener->accept_queue, socket);
+	wakeup_queue(listener->packet_wait);
+	socket_alert_waiters(listener);
 }
 
-static void net_handle_tcp(struct tcp_header * tcp, size_t length) {
+/*
+ * Returns 1 if the socket kept the netbuf. TCP copies payloads into the
+ * socket's receive buffer, so it never does.
+ */
+static int net_handle_tcp(uint32_t source, struct tcp_header * tcp, size_t length, struct netbuf * nb) {
 
 	size_t data_length = length - TCP_HEADER_LENGTH_FLIPPED(tcp);
+	uint16_t tcp_flags = htons(tcp->flags);
+	int new_syn = (tcp_flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK | TCP_FLAGS_RES)) == TCP_FLAGS_SYN;
 
 	/* Find socket */
-	if (hashmap_has(_tcp_sockets, (void *)ntohs(tcp->destination_port))) {
-		struct socket *socket = hashmap_get(_tcp_sockets, (void *)ntohs(tcp->destination_port));
+	struct socket *socket = tcp_table_lookup(source, ntohs(tcp->source_port), ntohs(tcp->destination_port));
+	if (socket && socket->status == 1 && new_syn) {
+		/* Same ports as an old connection that's done with */
+		tcp_table_remove(socket);
+		socket = NULL;
+	}
+
+	if (socket) {
 
 		if (socket->status == 2) {
 			debug_print(WARNING, "Received packet while connection is in 'closing' statuus");
@@ -857,97 +1900,311 @@ static void net_handle_tcp(struct tcp_header * tcp, size_t length) {
 		if (socket->status == 1) {
 			if ((htons(tcp->flags) & TCP_FLAGS_FIN)) {
 				debug_print(WARNING, "TCP close sequence continues");
-				return;
+				return 0;
 			}
 			if ((htons(tcp->flags) & TCP_FLAGS_ACK)) {
 				debug_print(WARNING, "TCP close sequence continues");
-				return;
+				return 0;
 			}
 			debug_print(ERROR, "Socket is closed? Should send FIN. socket=0x%x flags=0x%x", socket, tcp->flags);
 			net_send_tcp(socket, TCP_FLAGS_FIN | TCP_FLAGS_ACK, NULL, 0);
-			return;
+			return 0;
 		}
 
-		if (socket->proto_sock.tcp_socket.seq_no != ntohl(tcp->ack_number)) {
+		struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+		uint32_t seq_number = ntohl(tcp->seq_number);
+
+		if ((tcp_flags & TCP_FLAGS_ACK) && SEQ_LT(t->seq_no, ntohl(tcp->ack_number))) {
 			// Drop packet
-			debug_print(WARNING, "Dropping packet. Expected ack: %d | Got ack: %d",
-					socket->proto_sock.tcp_socket.seq_no, ntohl(tcp->ack_number));
-			return;
+			debug_print(WARNING, "Dropping packet. Sent up to: %d | Got ack: %d",
+					t->seq_no, ntohl(tcp->ack_number));
+			return 0;
+		}
+
+		if (t->status == TCP_SYN_RECEIVED) {
+			if (tcp_flags & TCP_FLAGS_RES) {
+				tcp_drop_syn_received(socket);
+				return 0;
+			}
+			if (new_syn) {
+				/* They didn't get our SYN-ACK; send it again */
+				spin_lock(t->lock);
+				t->seq_no = t->snd_una;
+				net_send_tcp(socket, TCP_FLAGS_SYN | TCP_FLAGS_ACK, NULL, 0);
+				spin_unlock(t->lock);
+				return 0;
+			}
+			if (!(tcp_flags & TCP_FLAGS_ACK) || ntohl(tcp->ack_number) != t->seq_no) {
+				return 0;
+			}
+			spin_lock(t->lock);
+			tcp_established(socket, tcp);
+			spin_unlock(t->lock);
 		}
 
-		if ((htons(tcp->flags) & TCP_FLAGS_SYN) && (htons(tcp->flags) & TCP_FLAGS_ACK)) {
-			socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length + 1;
+		if ((tcp_flags & TCP_FLAGS_SYN) && (tcp_flags & TCP_FLAGS_ACK)) {
+			spin_lock(t->lock);
+			t->ack_no = seq_number + data_length + 1;
+			t->snd_una = ntohl(tcp->ack_number);
+			t->snd_wnd = ntohs(tcp->window_size);
 			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
-			wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
-		} else if (htons(tcp->flags) & TCP_FLAGS_RES) {
+			spin_unlock(t->lock);
+			wakeup_queue(t->is_connected);
+			return 0;
+		}
+
+		if (tcp_flags & TCP_FLAGS_RES) {
 			/* Reset doesn't necessarily mean close. */
 			debug_print(WARNING, "net_handle_tcp: Received RST - socket closing");
 			net_close(socket);
-			return;
-		} else {
-			// Store a copy of the layer 5 data for a userspace recv() call
-			tcpdata_t *tcpdata = malloc(sizeof(tcpdata_t));
-			tcpdata->payload_size = length - TCP_HEADER_LENGTH_FLIPPED(tcp);
-
-			if (tcpdata->payload_size == 0) {
-				if (htons(tcp->flags) & TCP_FLAGS_FIN) {
-					/* We should make sure we finish sending before closing. */
-					debug_print(WARNING, "net_handle_tcp: Received FIN - socket closing with SYNACK");
-					socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length + 1;
-					net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
-					wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
-					net_close(socket);
-				}
-				free(tcpdata);
-				return;
-			}
-
-			// debug_print(WARNING, "net_handle_tcp: payload length: %d\n",  length);
-			// debug_print(WARNING, "net_handle_tcp: flipped tcp flags hdr len: %d\n",  TCP_HEADER_LENGTH_FLIPPED(tcp));
-			// debug_print(WARNING, "net_handle_tcp: tcpdata->payload_size: %d\n", tcpdata->payload_size);
+			return 0;
+		}
 
-			if (tcpdata->payload_size > 0) {
-				tcpdata->payload = malloc(tcpdata->payload_size);
-				memcpy(tcpdata->payload, tcp->payload, tcpdata->payload_size);
-			} else {
-				tcpdata->payload = NULL;
-			}
+		spin_lock(t->lock);
 
-			socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length;
+		if (tcp_flags & TCP_FLAGS_ACK) {
+			tcp_handle_ack(socket, tcp, data_length);
+		}
 
-			if ((htons(tcp->flags) & TCP_FLAGS_SYN) && (htons(tcp->flags) & TCP_FLAGS_ACK) && data_length == 0) {
-				socket->proto_sock.tcp_socket.ack_no += 1;
+		if (data_length) {
+			if (seq_number != t->ack_no || data_length > ring_buffer_available(socket->recv_buffer)) {
+				/* Out of order, repeated, or past the window: say where we are */
+				net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
+				spin_unlock(t->lock);
+				return 0;
 			}
 
-			socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + tcpdata->payload_size;
-
-			spin_lock(socket->packet_queue_lock);
-			list_insert(socket->packet_queue, tcpdata);
-			spin_unlock(socket->packet_queue_lock);
+			/* Coalesce the layer 5 data with whatever recv() hasn't read yet */
+			ring_buffer_write(socket->recv_buffer, data_length, (uint8_t *)tcp + TCP_HEADER_LENGTH_FLIPPED(tcp));
+			t->ack_no += data_length;
 
-			// Send acknowledgement of receiving data
-			net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
+			/* Delayed ACK: every second segment, or shortly after one */
+			if (++t->ack_pending >= 2) {
+				net_send_tcp(socket, TCP_FLAGS_ACK, NULL, 0);
+			} else {
+				t->ack_deadline = tcp_now() + TCP_DELACK;
+			}
 
 			wakeup_queue(socket->packet_wait);
 			socket_alert_waiters(socket);
+		}
 
-			if (htons(tcp->flags) & TCP_FLAGS_FIN) {
-				/* We should make sure we finish sending before closing. */
-				debug_print(WARNING, "net_handle_tcp: Received FIN - socket closing with SYNACK");
-				socket->proto_sock.tcp_socket.ack_no = ntohl(tcp->seq_number) + data_length + 1;
-				net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
-				wakeup_queue(socket->proto_sock.tcp_socket.is_connected);
-				net_close(socket);
-			}
+		if ((tcp_flags & TCP_FLAGS_FIN) && seq_number + data_length == t->ack_no) {
+			/* We should make sure we finish sending before closing. */
+			debug_print(WARNING, "net_handle_tcp: Received FIN - socket closing with SYNACK");
+			t->ack_no += 1;
+			tcp_send_pending(socket, 1);
+			net_send_tcp(socket, TCP_FLAGS_ACK | TCP_FLAGS_FIN, NULL, 0);
+			spin_unlock(t->lock);
+			wakeup_queue(t->is_connected);
+			net_close(socket);
+			return 0;
 		}
+
+		spin_unlock(t->lock);
+		return 0;
+	} else if (new_syn) {
+		tcp_handle_syn(source, tcp);
 	} else {
 		debug_print(WARNING, "net_handle_tcp: Received packet not associated with a socket!");
 	}
+	return 0;
+}
+
+/*
+ * User sockets: datagrams are queued whole, up to datagram_limit bytes
+ * per socket, and handed out one or a batch at a time.
+ */
+struct udp_datagram {
+	node_t node;
+	uint32_t ip;
+	uint16_t port;
+	size_t len;
+	uint8_t data[];
+};
+
+static int udp_bind(struct socket * socket, uint16_t port) {
+	if (socket->port_recv) return -EINVAL;
+	if (!port) {
+		do {
+			port = next_ephemeral_port();
+		} while (port == DNS_CLIENT_PORT || hashmap_has(_udp_sockets, (void *)(uintptr_t)port));
+	} else if (port == DNS_CLIENT_PORT || port == DHCP_CLIENT_PORT || hashmap_has(_udp_sockets, (void *)(uintptr_t)port)) {
+		return -EADDRINUSE;
+	}
+	socket->port_recv = port;
+	hashmap_set(_udp_sockets, (void *)(uintptr_t)port, socket);
+	return 0;
+}
+
+/* Returns the bytes sent, or a negative error */
+static int udp_send(struct socket * socket, uint32_t ip, uint16_t port, struct iovec * iov, size_t iovlen) {
+	size_t len = 0;
+	for (size_t i = 0; i < iovlen; ++i) {
+		len += iov[i].iov_len;
+	}
+	if (len > UDP_MAX_PAYLOAD) return -EMSGSIZE;
+	if (!socket->port_recv) {
+		int ret = udp_bind(socket, 0);
+		if (ret < 0) return ret;
+	}
+
+	struct netbuf * nb = netbuf_alloc();
+	for (size_t i = 0; i < iovlen; ++i) {
+		if (!iov[i].iov_len) continue;
+		validate(iov[i].iov_base);
+		memcpy(nb->data + nb->len, iov[i].iov_base, iov[i].iov_len);
+		nb->len += iov[i].iov_len;
+	}
+
+	struct udp_packet * udp = netbuf_push(nb, sizeof(struct udp_packet));
+	udp->source_port = htons(socket->port_recv);
+	udp->destination_port = htons(port);
+	udp->length = htons(sizeof(struct udp_packet) + len);
+	udp->checksum = 0; /* Filled in by net_send_ip */
+
+	int sent = net_send_ip(socket, ip, IPV4_PROT_UDP, nb);
+	netbuf_free(nb);
+	return sent ? (int)len : -ENETUNREACH;
+}
+
+static int udp_sendmmsg(struct socket * socket, struct mmsghdr * msgs, unsigned int vlen, int flags) {
+	unsigned int count;
+	for (count = 0; count < vlen; ++count) {
+		struct msghdr * msg = &msgs[count].msg_hdr;
+		uint32_t ip = socket->ip;
+		uint16_t port = socket->port_dest;
+		if (msg->msg_name) {
+			validate(msg->msg_name);
+			if (msg->msg_namelen < sizeof(struct sockaddr_in)) return count ? (int)count : -EINVAL;
+			struct sockaddr_in * addr = msg->msg_name;
+			ip = ntohl(addr->sin_addr.s_addr);
+			port = ntohs(addr->sin_port);
+		}
+		if (!port) return count ? (int)count : -EDESTADDRREQ;
+		if (msg->msg_iovlen) validate(msg->msg_iov);
+
+		int ret = udp_send(socket, ip, port, msg->msg_iov, msg->msg_iovlen);
+		if (ret < 0) return count ? (int)count : ret;
+		msgs[count].msg_len = ret;
+	}
+	return count;
+}
+
+static int udp_dequeue(struct socket * socket, int block, struct udp_datagram ** out) {
+	while (1) {
+		spin_lock(socket->datagram_lock);
+		node_t * node = list_dequeue(socket->datagrams);
+		if (node) {
+			*out = node->value;
+			socket->datagram_bytes -= (*out)->len;
+		}
+		spin_unlock(socket->datagram_lock);
+		if (node) return 0;
+
+		if (socket->status == 1) return -EBADF;
+		if (!block) return -EAGAIN;
+		if (sleep_on(socket->packet_wait)) return -EINTR;
+	}
+}
+
+/* Scatter a datagram into a message; returns how much of it fit */
+static size_t udp_copy_out(struct udp_datagram * d, struct msghdr * msg) {
+	size_t copied = 0;
+	if (msg->msg_iovlen) validate(msg->msg_iov);
+	for (size_t i = 0; i < msg->msg_iovlen && copied < d->len; ++i) {
+		size_t count = MIN(msg->msg_iov[i].iov_len, d->len - copied);
+		if (!count) continue;
+		validate(msg->msg_iov[i].iov_base);
+		memcpy(msg->msg_iov[i].iov_base, d->data + copied, count);
+		copied += count;
+	}
+	msg->msg_flags = copied < d->len ? MSG_TRUNC : 0;
+
+	if (msg->msg_name && msg->msg_namelen >= sizeof(struct sockaddr_in)) {
+		validate(msg->msg_name);
+		struct sockaddr_in * addr = msg->msg_name;
+		memset(addr, 0, sizeof(struct sockaddr_in));
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons(d->port);
+		addr->sin_addr.s_addr = htonl(d->ip);
+		msg->msg_namelen = sizeof(struct sockaddr_in);
+	}
+	return copied;
+}
+
+/*
+ * Blocks for every message unless MSG_WAITFORONE (just the first) or
+ * MSG_DONTWAIT (none); stops early on an error once something's in.
+ */
+static int udp_recvmmsg(struct socket * socket, struct mmsghdr * msgs, unsigned int vlen, int flags) {
+	unsigned int count = 0;
+	while (count < vlen) {
+		int block = !(flags & MSG_DONTWAIT) && !(count && (flags & MSG_WAITFORONE));
+		struct udp_datagram * d;
+		int ret = udp_dequeue(socket, block, &d);
+		if (ret < 0) return count ? (int)count : ret;
+		msgs[count].msg_len = udp_copy_out(d, &msgs[count].msg_hdr);
+		free(d);
+		count++;
+	}
+	return count;
+}
+
+static void udp_deliver(struct socket * socket, uint32_t source, struct udp_packet * udp, size_t len) {
+	uint16_t port = ntohs(udp->source_port);
+	if (socket->port_dest && (socket->ip != source || socket->port_dest != port)) {
+		return; /* Connected sockets only hear from their peer */
+	}
+
+	spin_lock(socket->datagram_lock);
+	if (socket->datagram_bytes + len > socket->datagram_limit) {
+		spin_unlock(socket->datagram_lock);
+		debug_print(WARNING, "UDP port %d receive queue is full, dropping", socket->port_recv);
+		return;
+	}
+	struct udp_datagram * d = malloc(sizeof(struct udp_datagram) + len);
+	d->node.value = d;
+	d->ip = source;
+	d->port = port;
+	d->len = len;
+	memcpy(d->data, udp->payload, len);
+	list_append(socket->datagrams, &d->node);
+	socket->datagram_bytes += len;
+	spin_unlock(socket->datagram_lock);
+
+	wakeup_queue(socket->packet_wait);
+	socket_alert_waiters(socket);
+}
+
+static void udp_close(struct socket * socket) {
+	if (socket->port_recv && hashmap_get(_udp_sockets, (void *)(uintptr_t)socket->port_recv) == socket) {
+		hashmap_remove(_udp_sockets, (void *)(uintptr_t)socket->port_recv);
+	}
+	spin_lock(socket->datagram_lock);
+	node_t * node;
+	while ((node = list_dequeue(socket->datagrams))) {
+		free(node->value);
+	}
+	socket->datagram_bytes = 0;
+	spin_unlock(socket->datagram_lock);
+	net_close(socket);
 }
 
-static void net_handle_udp(struct udp_packet * udp, size_t length) {
+static void net_handle_udp(struct netif * netif, uint32_t source, struct udp_packet * udp, size_t length) {
+
+	size_t len = ntohs(udp->length);
+	if (len < sizeof(struct udp_packet) || len > length) {
+		debug_print(WARNING, "UDP length is bad, dropping");
+		return;
+	}
+
+	struct socket * socket = hashmap_get(_udp_sockets, (void *)(uintptr_t)ntohs(udp->destination_port));
+	if (socket) {
+		udp_deliver(socket, source, udp, len - sizeof(struct udp_packet));
+		return;
+	}
 
-	// size_t data_length = length - sizeof(struct tcp_header);
 	debug_print(WARNING, "UDP response!");
 
 	/* Short-circuit DNS */
@@ -962,43 +2219,60 @@ static void net_handle_udp(struct udp_packet * udp, size_t length) {
 
 		{
 			void * tmp = malloc(1024);
-			size_t packet_size = write_arp_request(tmp, _netif.gateway);
-			_netif.send_packet(tmp, packet_size);
+			size_t packet_size = write_arp_request(netif, tmp, netif->gateway);
+			netif->send_packet(tmp, packet_size);
 			free(tmp);
 		}
 
 		return;
 	}
 
-	/* Find socket */
-	if (hashmap_has(_udp_sockets, (void *)ntohs(udp->source_port))) {
-		/* Do the thing */
-
-	} else {
-		/* ??? */
-	}
-
+	debug_print(WARNING, "net_handle_udp: Received packet not associated with a socket!");
 }
 
-static void net_handle_ipv4(struct ipv4_packet * ipv4) {
+/* Returns 1 if something else took ownership of the netbuf */
+static int net_handle_ipv4(struct netif * netif, struct ipv4_packet * ipv4, struct netbuf * nb) {
 	debug_print(INFO, "net_handle_ipv4: ENTER");
 	switch (ipv4->protocol) {
 		case IPV4_PROT_TCP:
-			net_handle_tcp((struct tcp_header *)ipv4->payload, ntohs(ipv4->length) - sizeof(struct ipv4_packet));
-			break;
-		case IPV4_PROT_UDP:
-			net_handle_udp((struct udp_packet *)ipv4->payload, ntohs(ipv4->length) - sizeof(struct ipv4_packet));
+			if (!(nb->flags & NETBUF_RX_CSUM_OK)) {
+				/* Summing over a correct checksum leaves nothing */
+				size_t length = ntohs(ipv4->length) - sizeof(struct ipv4_packet);
+				uint16_t check = calculate_ipv4_checksum(ipv4);
+				if (check && check != 0xFFFF) {
+					debug_print(WARNING, "net_handle_ipv4: Bad header checksum, dropping");
+					return 0;
+				}
+				struct tcp_header * tcp = (struct tcp_header *)ipv4->payload;
+				check = calculate_tcp_checksum(ipv4->source, ipv4->destination, tcp, length);
+				if (check && check != 0xFFFF) {
+					debug_print(WARNING, "net_handle_ipv4: Bad TCP checksum, dropping");
+					return 0;
+				}
+			}
+			return net_handle_tcp(ntohl(ipv4->source), (struct tcp_header *)ipv4->payload, ntohs(ipv4->length) - sizeof(struct ipv4_packet), nb);
+		case IPV4_PROT_UDP: {
+			size_t length = ntohs(ipv4->length) - sizeof(struct ipv4_packet);
+			struct udp_packet * udp = (struct udp_packet *)ipv4->payload;
+			if (udp->checksum && !(nb->flags & NETBUF_RX_CSUM_OK)) {
+				uint16_t check = calculate_udp_checksum(ipv4->source, ipv4->destination, udp, length);
+				if (check && check != 0xFFFF) {
+					debug_print(WARNING, "net_handle_ipv4: Bad UDP checksum, dropping");
+					return 0;
+				}
+			}
+			net_handle_udp(netif, ntohl(ipv4->source), udp, length);
 			break;
+		}
 		default:
 			/* XXX */
 			break;
 	}
+	return 0;
 }
 
-static struct ethernet_packet* net_receive(void) {
-	struct ethernet_packet *eth = _netif.get_packet();
-
-	return eth;
+static struct netbuf* net_receive(struct netif * netif) {
+	return netif->get_packet();
 }
 
 int net_connect(struct socket* socket, uint32_t dest_ip, uint16_t dest_port) {
@@ -1008,22 +2282,25 @@ int net_connect(struct socket* socket, uint32_t dest_ip, uint16_t dest_port) {
 	}
 
 	memset(socket->mac, 0, sizeof(socket->mac)); // idk
-	socket->port_recv = next_ephemeral_port();
-	socket->proto_sock.tcp_socket.is_connected = list_create();
-	socket->proto_sock.tcp_socket.seq_no = 0;
-	socket->proto_sock.tcp_socket.ack_no = 0;
-	socket->proto_sock.tcp_socket.status = 0;
+	if (!socket->port_recv) {
+		socket->port_recv = next_ephemeral_port();
+	}
 
-	socket->packet_queue = list_create();
-	socket->packet_wait = list_create();
-	socket->alert_waiters = list_create();
+	struct tcp_socket * t = &socket->proto_sock.tcp_socket;
+	t->seq_no = tcp_isn();
+	t->snd_una = t->seq_no;
+	t->ack_no = 0;
+	t->status = TCP_OPEN;
 
 	socket->ip = dest_ip; //ip_aton("10.255.50.206");
 	socket->port_dest = dest_port; //12345;
 
-	debug_print(WARNING, "net_connect: using ephemeral port: %d", (void*)socket->port_recv);
+	debug_print(WARNING, "net_connect: using port: %d", (void*)socket->port_recv);
 
-	hashmap_set(_tcp_sockets, (void*)socket->port_recv, socket);
+	tcp_table_insert(socket);
+	spin_lock(tcp_socket_list_lock);
+	list_insert(tcp_socket_list, socket);
+	spin_unlock(tcp_socket_list_lock);
 
 	net_send_tcp(socket, TCP_FLAGS_SYN, NULL, 0);
 	// debug_print(WARNING, "net_connect:sent tcp SYN: %d", ret);
@@ -1034,15 +2311,16 @@ int net_connect(struct socket* socket, uint32_t dest_ip, uint16_t dest_port) {
 	return 1;
 }
 
-static void placeholder_dhcp(void) {
+static void placeholder_dhcp(struct netif * netif) {
 	debug_print(NOTICE, "Sending DHCP discover");
 	void * tmp = malloc(1024);
-	size_t packet_size = write_dhcp_packet(tmp);
-	_netif.send_packet(tmp, packet_size);
+	size_t packet_size = write_dhcp_packet(netif, tmp);
+	netif->send_packet(tmp, packet_size);
 	free(tmp);
 
 	while (1) {
-		struct ethernet_packet * eth = (struct ethernet_packet *)_netif.get_packet();
+		struct netbuf * nb = netif->get_packet();
+		struct ethernet_packet * eth = (struct ethernet_packet *)nb->data;
 		uint16_t eth_type = ntohs(eth->type);
 
 		debug_print(NOTICE, "Ethernet II, Src: (%2x:%2x:%2x:%2x:%2x:%2x), Dst: (%2x:%2x:%2x:%2x:%2x:%2x) [type=%4x])",
@@ -1054,7 +2332,7 @@ static void placeholder_dhcp(void) {
 
 		if (eth_type != 0x0800) {
 			debug_print(WARNING, "ARP packet while waiting for DHCP...");
-			free(eth);
+			netbuf_free(nb);
 			continue;
 		}
 
@@ -1076,7 +2354,7 @@ static void placeholder_dhcp(void) {
 		if (ipv4->protocol != IPV4_PROT_UDP) {
 			debug_print(WARNING, "Protocol: %d", ipv4->protocol);
 			debug_print(WARNING, "Bad packet...");
-			free(eth);
+			netbuf_free(nb);
 			continue;
 		}
 
@@ -1088,10 +2366,10 @@ static void placeholder_dhcp(void) {
 		debug_print(NOTICE, "UDP [%d → %d] length=%d bytes",
 				src_port, dst_port, udp_len);
 
-		if (dst_port != 68) {
+		if (dst_port != DHCP_CLIENT_PORT) {
 			debug_print(WARNING, "Destination port: %d", dst_port);
 			debug_print(WARNING, "Bad packet...");
-			free(eth);
+			netbuf_free(nb);
 			continue;
 		}
 
@@ -1102,7 +2380,8 @@ static void placeholder_dhcp(void) {
 		ip_ntoa(yiaddr, yiaddr_ip);
 		debug_print(NOTICE,  "DHCP Offer: %s", yiaddr_ip);
 
-		_netif.source = yiaddr;
+		netif->source = yiaddr;
+		netif->netmask = 0xFFFFFF00; /* Unless the offer says otherwise */
 
 		debug_print(NOTICE,"  Scanning offer for DNS servers...");
 
@@ -1124,20 +2403,28 @@ static void placeholder_dhcp(void) {
 				debug_print(NOTICE, "Found one: %s", ip);
 				_dns_server = dnsaddr;
 			} else if (type == 3) {
-				_netif.gateway = ntohl(*(uint32_t *)data);
+				netif->gateway = ntohl(*(uint32_t *)data);
+			} else if (type == 1) {
+				netif->netmask = ntohl(*(uint32_t *)data);
 			}
 
 			j += 2 + len;
 			i += 2 + len;
 		}
 
+		/* The first interface with a gateway gets the default route */
+		route_add(netif->source, netif->netmask, 0, netif);
+		if (netif->gateway && !route_has_default()) {
+			route_add(0, 0, netif->gateway, netif);
+		}
+
 		debug_print(NOTICE, "Sending DHCP Request...");
 		void * tmp = malloc(1024);
-		size_t packet_size = write_dhcp_request(tmp, (uint8_t *)&dhcp->yiaddr);
-		_netif.send_packet(tmp, packet_size);
+		size_t packet_size = write_dhcp_request(netif, tmp, (uint8_t *)&dhcp->yiaddr);
+		netif->send_packet(tmp, packet_size);
 		free(tmp);
 
-		free(eth);
+		netbuf_free(nb);
 
 		break;
 	}
@@ -1161,13 +2448,13 @@ struct arp {
 	uint8_t padding[18];
 } __attribute__((packed));
 
-static size_t write_arp_response(uint8_t * buffer, struct arp * source) {
+static size_t write_arp_response(struct netif * netif, uint8_t * buffer, struct arp * source) {
 	size_t offset = 0;
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0806),
 	};
@@ -1184,13 +2471,13 @@ static size_t write_arp_response(uint8_t * buffer, struct arp * source) {
 	arp_out.plen = 4;
 	arp_out.oper = ntohs(2);
 
-	arp_out.sender_ha[0] = _netif.hwaddr[0];
-	arp_out.sender_ha[1] = _netif.hwaddr[1];
-	arp_out.sender_ha[2] = _netif.hwaddr[2];
-	arp_out.sender_ha[3] = _netif.hwaddr[3];
-	arp_out.sender_ha[4] = _netif.hwaddr[4];
-	arp_out.sender_ha[5] = _netif.hwaddr[5];
-	arp_out.sender_ip = ntohl(_netif.source);
+	arp_out.sender_ha[0] = netif->hwaddr[0];
+	arp_out.sender_ha[1] = netif->hwaddr[1];
+	arp_out.sender_ha[2] = netif->hwaddr[2];
+	arp_out.sender_ha[3] = netif->hwaddr[3];
+	arp_out.sender_ha[4] = netif->hwaddr[4];
+	arp_out.sender_ha[5] = netif->hwaddr[5];
+	arp_out.sender_ip = ntohl(netif->source);
 
 	arp_out.target_ha[0] = source->sender_ha[0];
 	arp_out.target_ha[1] = source->sender_ha[1];
@@ -1207,15 +2494,15 @@ static size_t write_arp_response(uint8_t * buffer, struct arp * source) {
 	return offset;
 }
 
-static size_t write_arp_request(uint8_t * buffer, uint32_t ip) {
+static size_t write_arp_request(struct netif * netif, uint8_t * buffer, uint32_t ip) {
 	size_t offset = 0;
 
 	debug_print(WARNING, "Request ARP from gateway address %x", ip);
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0806),
 	};
@@ -1234,13 +2521,13 @@ static size_t write_arp_request(uint8_t * buffer, uint32_t ip) {
 	arp_out.plen = 4;
 	arp_out.oper = ntohs(1);
 
-	arp_out.sender_ha[0] = _netif.hwaddr[0];
-	arp_out.sender_ha[1] = _netif.hwaddr[1];
-	arp_out.sender_ha[2] = _netif.hwaddr[2];
-	arp_out.sender_ha[3] = _netif.hwaddr[3];
-	arp_out.sender_ha[4] = _netif.hwaddr[4];
-	arp_out.sender_ha[5] = _netif.hwaddr[5];
-	arp_out.sender_ip = ntohl(_netif.source);
+	arp_out.sender_ha[0] = netif->hwaddr[0];
+	arp_out.sender_ha[1] = netif->hwaddr[1];
+	arp_out.sender_ha[2] = netif->hwaddr[2];
+	arp_out.sender_ha[3] = netif->hwaddr[3];
+	arp_out.sender_ha[4] = netif->hwaddr[4];
+	arp_out.sender_ha[5] = netif->hwaddr[5];
+	arp_out.sender_ip = ntohl(netif->source);
 
 	arp_out.target_ha[0] = 0;
 	arp_out.target_ha[1] = 0;
@@ -1258,7 +2545,7 @@ static size_t write_arp_request(uint8_t * buffer, uint32_t ip) {
 }
 
 
-static void net_handle_arp(struct ethernet_packet * eth) {
+static void net_handle_arp(struct netif * netif, struct ethernet_packet * eth) {
 	debug_print(WARNING, "ARP packet...");
 
 	struct arp * arp = (struct arp *)&eth->payload;
@@ -1287,29 +2574,23 @@ static void net_handle_arp(struct ethernet_packet * eth) {
 
 	if (ntohs(arp->oper) == 1) {
 
-		if (ntohl(arp->target_ip) == _netif.source) {
+		if (ntohl(arp->target_ip) == netif->source) {
 			debug_print(WARNING, "That's us!");
+			arp_store(ntohl(arp->sender_ip), arp->sender_ha);
 
 			{
 				void * tmp = malloc(1024);
-				size_t packet_size = write_arp_response(tmp, arp);
-				_netif.send_packet(tmp, packet_size);
+				size_t packet_size = write_arp_response(netif, tmp, arp);
+				netif->send_packet(tmp, packet_size);
 				free(tmp);
 			}
 
 		}
 
 	} else {
-		if (ntohl(arp->target_ip) == _netif.source) {
+		if (ntohl(arp->target_ip) == netif->source) {
 			debug_print(WARNING, "It's a response to our query!");
-			if (ntohl(arp->sender_ip) == _netif.gateway) {
-				_gateway[0] = arp->sender_ha[0];
-				_gateway[1] = arp->sender_ha[1];
-				_gateway[2] = arp->sender_ha[2];
-				_gateway[3] = arp->sender_ha[3];
-				_gateway[4] = arp->sender_ha[4];
-				_gateway[5] = arp->sender_ha[5];
-			}
+			arp_store(ntohl(arp->sender_ip), arp->sender_ha);
 		} else {
 			debug_print(WARNING, "Response to someone else...\n");
 		}
@@ -1318,37 +2599,35 @@ static void net_handle_arp(struct ethernet_packet * eth) {
 }
 
 void net_handler(void * data, char * name) {
-	/* Network Packet Handler*/
-	_netif.extra = NULL;
-
-	_dns_server = ip_aton("10.0.2.3");
-
-	placeholder_dhcp();
-
-	dns_waiters = list_create();
+	/* Network Packet Handler, one per interface */
+	struct netif * netif = data;
 
-	_tcp_sockets = hashmap_create_int(0xFF);
-	_udp_sockets = hashmap_create_int(0xFF);
+	placeholder_dhcp(netif);
 
 	while (1) {
-		struct ethernet_packet * eth = net_receive();
+		struct netbuf * nb = net_receive(netif);
 
-		if (!eth) continue;
+		if (!nb) continue;
+
+		struct ethernet_packet * eth = (struct ethernet_packet *)nb->data;
+		int kept = 0;
 
 		switch (ntohs(eth->type)) {
 			case ETHERNET_TYPE_IPV4:
-				net_handle_ipv4((struct ipv4_packet *)eth->payload);
+				kept = net_handle_ipv4(netif, (struct ipv4_packet *)eth->payload, nb);
 				break;
 			case ETHERNET_TYPE_ARP:
-				net_handle_arp(eth);
+				net_handle_arp(netif, eth);
 				break;
 		}
 
-		free(eth);
+		if (!kept) {
+			netbuf_free(nb);
+		}
 	}
 }
 
-size_t write_dhcp_packet(uint8_t * buffer) {
+size_t write_dhcp_packet(struct netif * netif, uint8_t * buffer) {
 	size_t offset = 0;
 	size_t payload_size = sizeof(struct dhcp_packet);
 
@@ -1359,7 +2638,8 @@ size_t write_dhcp_packet(uint8_t * buffer) {
 		1,  /* Length: 1 */
 		1,  /* Discover */
 		55,
-		2,
+		3,
+		1,
 		3,
 		6,
 		255, /* END */
@@ -1369,8 +2649,8 @@ size_t write_dhcp_packet(uint8_t * buffer) {
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0800),
 	};
@@ -1401,7 +2681,7 @@ size_t write_dhcp_packet(uint8_t * buffer) {
 	memcpy(&buffer[offset], &ipv4_out, sizeof(struct ipv4_packet));
 	offset += sizeof(struct ipv4_packet);
 
-	uint16_t _udp_source = htons(68);
+	uint16_t _udp_source = htons(DHCP_CLIENT_PORT);
 	uint16_t _udp_destination = htons(67);
 	uint16_t _udp_length = htons(sizeof(struct udp_packet) + payload_size);
 
@@ -1433,8 +2713,8 @@ size_t write_dhcp_packet(uint8_t * buffer) {
 		.siaddr = 0x000000,
 		.giaddr = 0x000000,
 
-		.chaddr = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.chaddr = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.sname = {0},
 		.file = {0},
 		.magic = htonl(DHCP_MAGIC),
@@ -1449,7 +2729,7 @@ size_t write_dhcp_packet(uint8_t * buffer) {
 	return offset;
 }
 
-size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip) {
+size_t write_dhcp_request(struct netif * netif, uint8_t * buffer, uint8_t * ip) {
 	size_t offset = 0;
 	size_t payload_size = sizeof(struct dhcp_packet);
 
@@ -1463,7 +2743,8 @@ size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip) {
 		4,  /* requested ip */
 		ip[0],ip[1],ip[2],ip[3],
 		55,
-		2,
+		3,
+		1,
 		3,
 		6,
 		255, /* END */
@@ -1473,8 +2754,8 @@ size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip) {
 
 	/* Then, let's write an ethernet frame */
 	struct ethernet_packet eth_out = {
-		.source = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.source = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.destination = BROADCAST_MAC,
 		.type = htons(0x0800),
 	};
@@ -1505,7 +2786,7 @@ size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip) {
 	memcpy(&buffer[offset], &ipv4_out, sizeof(struct ipv4_packet));
 	offset += sizeof(struct ipv4_packet);
 
-	uint16_t _udp_source = htons(68);
+	uint16_t _udp_source = htons(DHCP_CLIENT_PORT);
 	uint16_t _udp_destination = htons(67);
 	uint16_t _udp_length = htons(sizeof(struct udp_packet) + payload_size);
 
@@ -1537,8 +2818,8 @@ size_t write_dhcp_request(uint8_t * buffer, uint8_t * ip) {
 		.siaddr = 0x000000,
 		.giaddr = 0x000000,
 
-		.chaddr = { _netif.hwaddr[0], _netif.hwaddr[1], _netif.hwaddr[2],
-		            _netif.hwaddr[3], _netif.hwaddr[4], _netif.hwaddr[5] },
+		.chaddr = { netif->hwaddr[0], netif->hwaddr[1], netif->hwaddr[2],
+		            netif->hwaddr[3], netif->hwaddr[4], netif->hwaddr[5] },
 		.sname = {0},
 		.file = {0},
 		.magic = htonl(DHCP_MAGIC),
@@ -1573,7 +2854,12 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 	int offset = sizeof(struct dns_packet);
 	int queries = 0;
 	uint8_t * bytes = (uint8_t *)dns;
+	char query[1024] = {0};
+	int pending = 0; /* Waiting on a CNAME's own lookup */
 	while (queries < dns_questions) {
+		if (!queries) {
+			dns_name_to_normal_name(dns, offset, query);
+		}
 		offset = print_dns_name(tty, dns, offset);
 		uint16_t * d = (uint16_t *)&bytes[offset];
 		fprintf(tty, " - Type: %4x %4x\n", ntohs(d[0]), ntohs(d[1]));
@@ -1592,7 +2878,8 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 		fprintf(tty, " - Type: %4x %4x; ", ntohs(d[0]), ntohs(d[1]));
 		offset += 4;
 		uint32_t * t = (uint32_t *)&bytes[offset];
-		fprintf(tty, "TTL: %d; ", ntohl(t[0]));
+		uint32_t ttl = ntohl(t[0]);
+		fprintf(tty, "TTL: %d; ", ttl);
 		offset += 4;
 		uint16_t * l = (uint16_t *)&bytes[offset];
 		int _l = ntohs(l[0]);
@@ -1604,9 +2891,7 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 			ip_ntoa(ntohl(i[0]), ip);
 			fprintf(tty, " Address: %s\n", ip);
 			debug_print(NOTICE, "Domain [%s] maps to [%s]", buf, ip);
-			if (!hashmap_has(dns_cache, buf)) {
-				hashmap_set(dns_cache, buf, strdup(ip));
-			}
+			dns_cache_store(buf, ntohl(i[0]), ttl, 0);
 		} else {
 			if (ntohs(d[0]) == 5) {
 				fprintf(tty, "CNAME: ");
@@ -1617,15 +2902,15 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 					buffer[strlen(buffer)-1] = '\0';
 				}
 				uint32_t addr;
-				if (gethost(buffer,&addr) == 2) {
+				int ret = gethost(buffer,&addr);
+				if (ret == 2) {
 					debug_print(WARNING,"Can't provide a response yet, but going to query again in a moment.");
-				} else {
-					if (!hashmap_has(dns_cache, buf)) {
-						char ip[16];
-						ip_ntoa(addr, ip);
-						hashmap_set(dns_cache, buf, strdup(ip));
-						fprintf(tty, "resolves to %s\n", ip);
-					}
+					pending = 1;
+				} else if (ret == 0) {
+					char ip[16];
+					ip_ntoa(addr, ip);
+					dns_cache_store(buf, addr, ttl, 0);
+					fprintf(tty, "resolves to %s\n", ip);
 				}
 			} else {
 				fprintf(tty, "dunno\n");
@@ -1635,6 +2920,13 @@ static void parse_dns_response(fs_node_t * tty, void * last_packet) {
 		answers++;
 	}
 
+	/* No address came back (NXDOMAIN, or no A record): remember that */
+	uint32_t addr;
+	if (*query && !pending && dns_cache_lookup(query, &addr) == 0) {
+		debug_print(NOTICE, "Domain [%s] does not resolve (rcode %d)", query, ntohs(dns->flags) & 0xF);
+		dns_cache_store(query, 0, DNS_NEGATIVE_TTL, 1);
+	}
+
 	wakeup_queue(dns_waiters);
 }
 
@@ -1653,17 +2945,38 @@ static fs_node_t * netfs_create(void) {
 }
 
 static int init(void) {
+	tcp_socket_list = list_create();
+
+	for (int i = 0; i < NETBUF_POOL_MIN; ++i) {
+		netbuf_free(malloc(sizeof(struct netbuf)));
+	}
+
+	netif_list = list_create();
+	route_table = list_create();
+	arp_cache = hashmap_create_int(16);
+
+	_dns_server = ip_aton("10.0.2.3");
+	dns_waiters = list_create();
+
+	_tcp_sockets = hashmap_create_int(0xFF);
+	_tcp_sockets->hash_func = tcp_key_hash;
+	_tcp_sockets->hash_comp = tcp_key_comp;
+	_tcp_sockets->hash_key_dup = tcp_key_dupe;
+	_tcp_sockets->hash_key_free = free;
+	_tcp_listeners = hashmap_create_int(16);
+	_udp_sockets = hashmap_create_int(0xFF);
+
 	dns_cache = hashmap_create(10);
 
-	hashmap_set(dns_cache, "dakko.us", strdup("104.131.140.26"));
-	hashmap_set(dns_cache, "toaruos.org", strdup("104.131.140.26"));
-	hashmap_set(dns_cache, "www.toaruos.org", strdup("104.131.140.26"));
-	hashmap_set(dns_cache, "www.yelp.com", strdup("104.16.57.23"));
-	hashmap_set(dns_cache, "s3-media2.fl.yelpcdn.com", strdup("199.27.79.175"));
-	hashmap_set(dns_cache, "forum.osdev.org", strdup("173.255.206.39"));
-	hashmap_set(dns_cache, "wolfgun.puckipedia.com", strdup("104.47.147.203"));
-	hashmap_set(dns_cache, "irc.freenode.net", strdup("91.217.189.42"));
-	hashmap_set(dns_cache, "i.imgur.com", strdup("23.235.47.193"));
+	dns_cache_store("dakko.us", ip_aton("104.131.140.26"), 0, 0);
+	dns_cache_store("toaruos.org", ip_aton("104.131.140.26"), 0, 0);
+	dns_cache_store("www.toaruos.org", ip_aton("104.131.140.26"), 0, 0);
+	dns_cache_store("www.yelp.com", ip_aton("104.16.57.23"), 0, 0);
+	dns_cache_store("s3-media2.fl.yelpcdn.com", ip_aton("199.27.79.175"), 0, 0);
+	dns_cache_store("forum.osdev.org", ip_aton("173.255.206.39"), 0, 0);
+	dns_cache_store("wolfgun.puckipedia.com", ip_aton("104.47.147.203"), 0, 0);
+	dns_cache_store("irc.freenode.net", ip_aton("91.217.189.42"), 0, 0);
+	dns_cache_store("i.imgur.com", ip_aton("23.235.47.193"), 0, 0);
 
 	/* /dev/net/{domain|ip}/{protocol}/{port} */
 	vfs_mount("/dev/net", netfs_create());
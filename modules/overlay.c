@@ -0,0 +1,501 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * overlay - A writable tmpfs layered over a read-only tree
+ *
+ * Mounted as `mount overlay /dev/base,755 /`, with the read-only tree
+ * (normally the tarfs ramdisk) below and a fresh tmpfs above it. Reads
+ * and lookups go to the lower tree until something changes a file; the
+ * first write, truncate, chmod or chown copies it up into the tmpfs,
+ * along with any directories above it, and from then on it lives there.
+ *
+ * Every path that has been looked up gets an entry, owned by the mount,
+ * that remembers the node for it in each layer. Removing something that
+ * exists in the lower tree leaves its entry behind with neither node,
+ * which hides the lower copy; these whiteouts are only kept in memory,
+ * as is everything else about the mount.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/printf.h>
+#include <kernel/fs.h>
+#include <kernel/slab.h>
+#include <kernel/module.h>
+#include <kernel/mod/tmpfs.h>
+#include <kernel/tokenize.h>
+
+#include <toaru/list.h>
+#include <toaru/hashmap.h>
+
+#define COPY_CHUNK 0x10000
+
+struct overlay {
+	hashmap_t * entries; /* Path -> struct overlay_entry */
+	struct overlay_entry * root;
+};
+
+struct overlay_entry {
+	struct overlay * ov;
+	struct overlay_entry * parent;
+	char * path;        /* From the root of the mount; "" for the root */
+	char * name;        /* Last component of path */
+	fs_node_t * lower;  /* NULL if it isn't (or no longer is) in the lower tree */
+	fs_node_t * upper;  /* NULL until it has been copied up or created */
+};
+
+static spin_lock_t overlay_lock = { 0 };
+
+static fs_node_t * overlay_node(struct overlay_entry * e);
+
+static int is_whiteout(struct overlay_entry * e) {
+	return !e->lower && !e->upper;
+}
+
+static char * child_path(struct overlay_entry * dir, char * name) {
+	char * path = malloc(strlen(dir->path) + strlen(name) + 2);
+	sprintf(path, "%s/%s", dir->path, name);
+	return path;
+}
+
+static struct overlay_entry * overlay_entry_new(struct overlay_entry * dir, char * path) {
+	struct overlay_entry * e = malloc(sizeof(struct overlay_entry));
+	memset(e, 0, sizeof(struct overlay_entry));
+	e->ov = dir->ov;
+	e->parent = dir;
+	e->path = path;
+	e->name = strrchr(path, '/') + 1;
+	hashmap_set(dir->ov->entries, path, e);
+	return e;
+}
+
+/*
+ * The entry for `name` in `dir`, looking it up in both layers the first
+ * time. Names that exist in neither layer don't get an entry.
+ */
+static struct overlay_entry * overlay_lookup(struct overlay_entry * dir, char * name) {
+	if (is_whiteout(dir)) return NULL;
+
+	char * path = child_path(dir, name);
+
+	spin_lock(overlay_lock);
+	struct overlay_entry * e = hashmap_get(dir->ov->entries, path);
+	spin_unlock(overlay_lock);
+	if (e) {
+		free(path);
+		return e;
+	}
+
+	fs_node_t * lower = NULL;
+	fs_node_t * upper = NULL;
+	if (dir->lower && (dir->lower->flags & FS_DIRECTORY)) {
+		lower = finddir_fs(dir->lower, name);
+	}
+	if (dir->upper && (dir->upper->flags & FS_DIRECTORY)) {
+		upper = finddir_fs(dir->upper, name);
+	}
+	if (!lower && !upper) {
+		free(path);
+		return NULL;
+	}
+
+	spin_lock(overlay_lock);
+	e = overlay_entry_new(dir, path);
+	e->lower = lower;
+	e->upper = upper;
+	spin_unlock(overlay_lock);
+	return e;
+}
+
+/*
+ * Give `e` a copy of itself in the upper layer, copying the directories
+ * above it first. File contents are only copied if `with_data` is set;
+ * a file about to be truncated doesn't need them.
+ */
+static int overlay_copy_up(struct overlay_entry * e, int with_data) {
+	if (e->upper) return 0;
+	if (!e->lower) return -ENOENT;
+
+	int ret = overlay_copy_up(e->parent, 0);
+	if (ret) return ret;
+
+	fs_node_t * dir = e->parent->upper;
+	fs_node_t * lower = e->lower;
+
+	debug_print(INFO, "overlay: copying up %s", e->path);
+
+	if (lower->flags & FS_SYMLINK) {
+		char target[1024];
+		readlink_fs(lower, target, sizeof(target));
+		ret = dir->symlink(dir, target, e->name);
+	} else if (lower->flags & FS_DIRECTORY) {
+		ret = dir->mkdir(dir, e->name, lower->mask);
+	} else {
+		ret = dir->create(dir, e->name, lower->mask);
+	}
+	if (ret < 0) return ret;
+
+	fs_node_t * upper = finddir_fs(dir, e->name);
+	if (!upper) return -EIO;
+
+	chmod_fs(upper, lower->mask);
+	chown_fs(upper, lower->uid, lower->gid);
+
+	if (with_data && (lower->flags & FS_FILE) && !(lower->flags & FS_SYMLINK)) {
+		uint8_t * buf = malloc(COPY_CHUNK);
+		uint64_t offset = 0;
+		while (offset < lower->length) {
+			uint32_t r = read_fs(lower, offset, COPY_CHUNK, buf);
+			if (!r || r > COPY_CHUNK) break;
+			write_fs(upper, offset, r, buf);
+			offset += r;
+		}
+		free(buf);
+	}
+
+	e->upper = upper;
+	return 0;
+}
+
+/* Turn `e` and everything found below it into whiteouts. */
+static void overlay_remove(struct overlay_entry * e) {
+	size_t len = strlen(e->path);
+
+	spin_lock(overlay_lock);
+	list_t * paths = hashmap_keys(e->ov->entries);
+	foreach(node, paths) {
+		char * path = node->value;
+		if (strlen(path) >= len && !memcmp(path, e->path, len) && (path[len] == '\0' || path[len] == '/')) {
+			struct overlay_entry * victim = hashmap_get(e->ov->entries, path);
+			free(victim->lower);
+			free(victim->upper);
+			victim->lower = NULL;
+			victim->upper = NULL;
+		}
+	}
+	list_free(paths);
+	free(paths);
+	spin_unlock(overlay_lock);
+}
+
+static uint32_t read_overlay(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct overlay_entry * e = node->device;
+	if (e->upper) return read_fs(e->upper, offset, size, buffer);
+	if (e->lower) return read_fs(e->lower, offset, size, buffer);
+	return 0;
+}
+
+static uint32_t write_overlay(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct overlay_entry * e = node->device;
+	int ret = overlay_copy_up(e, 1);
+	if (ret) return ret;
+	uint32_t out = write_fs(e->upper, offset, size, buffer);
+	node->length = e->upper->length;
+	return out;
+}
+
+static void truncate_overlay(fs_node_t * node) {
+	struct overlay_entry * e = node->device;
+	if (overlay_copy_up(e, 0)) return;
+	truncate_fs(e->upper);
+	node->length = 0;
+}
+
+static int chmod_overlay(fs_node_t * node, int mode) {
+	struct overlay_entry * e = node->device;
+	int ret = overlay_copy_up(e, 1);
+	if (ret) return ret;
+	return chmod_fs(e->upper, mode);
+}
+
+static int chown_overlay(fs_node_t * node, int uid, int gid) {
+	struct overlay_entry * e = node->device;
+	int ret = overlay_copy_up(e, 1);
+	if (ret) return ret;
+	return chown_fs(e->upper, uid, gid);
+}
+
+static int readlink_overlay(fs_node_t * node, char * buf, size_t size) {
+	struct overlay_entry * e = node->device;
+	if (e->upper) return readlink_fs(e->upper, buf, size);
+	if (e->lower) return readlink_fs(e->lower, buf, size);
+	return -ENOENT;
+}
+
+static fs_node_t * finddir_overlay(fs_node_t * node, char * name) {
+	struct overlay_entry * e = overlay_lookup(node->device, name);
+	if (!e || is_whiteout(e)) return NULL;
+	return overlay_node(e);
+}
+
+/*
+ * Everything in one layer of a directory, appended to `out`, leaving out
+ * "." and ".." and anything `seen` already has.
+ */
+static void list_layer(fs_node_t * dir, hashmap_t * seen, struct dirent ** out, uint32_t * count, uint32_t * space) {
+	struct dirent batch[16];
+	uint64_t cursor = 0;
+	uint32_t got;
+	while ((got = getdents_fs(dir, &cursor, batch, 16)) > 0) {
+		for (uint32_t i = 0; i < got; ++i) {
+			if (!strcmp(batch[i].name, ".") || !strcmp(batch[i].name, "..")) continue;
+			if (hashmap_has(seen, batch[i].name)) continue;
+			if (*count == *space) {
+				*space *= 2;
+				*out = realloc(*out, sizeof(struct dirent) * *space);
+			}
+			memcpy(&(*out)[*count], &batch[i], sizeof(struct dirent));
+			hashmap_set(seen, (*out)[*count].name, (void *)1);
+			(*count)++;
+		}
+	}
+}
+
+/*
+ * The merged listing of a directory: ".", "..", everything in the upper
+ * layer, and whatever the lower layer has that isn't in the upper one
+ * or whited out.
+ */
+static struct dirent * overlay_listing(struct overlay_entry * e, uint32_t * count) {
+	uint32_t space = 32;
+	struct dirent * out = malloc(sizeof(struct dirent) * space);
+	memset(out, 0, sizeof(struct dirent) * 2);
+	strcpy(out[0].name, ".");
+	strcpy(out[1].name, "..");
+	*count = 2;
+
+	hashmap_t * seen = hashmap_create(16);
+
+	if (e->upper) {
+		list_layer(e->upper, seen, &out, count, &space);
+	}
+
+	if (e->lower) {
+		uint32_t first = *count;
+		list_layer(e->lower, seen, &out, count, &space);
+
+		/* Drop the lower layer's whiteouts */
+		uint32_t kept = first;
+		spin_lock(overlay_lock);
+		for (uint32_t i = first; i < *count; ++i) {
+			char * path = child_path(e, out[i].name);
+			struct overlay_entry * child = hashmap_get(e->ov->entries, path);
+			free(path);
+			if (child && is_whiteout(child)) continue;
+			if (kept != i) memcpy(&out[kept], &out[i], sizeof(struct dirent));
+			kept++;
+		}
+		spin_unlock(overlay_lock);
+		*count = kept;
+	}
+
+	hashmap_free(seen);
+	free(seen);
+	return out;
+}
+
+static uint32_t getdents_overlay(fs_node_t * node, uint64_t * offset, struct dirent * entries, uint32_t count) {
+	uint32_t total;
+	struct dirent * all = overlay_listing(node->device, &total);
+
+	uint32_t got = 0;
+	while (got < count && *offset < total) {
+		memcpy(&entries[got], &all[*offset], sizeof(struct dirent));
+		got++;
+		(*offset)++;
+	}
+
+	free(all);
+	return got;
+}
+
+static struct dirent * readdir_overlay(fs_node_t * node, uint32_t index) {
+	uint64_t offset = index;
+	struct dirent * out = slab_alloc(&dirent_cache);
+	if (!getdents_overlay(node, &offset, out, 1)) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+/*
+ * Before making `name` in `node`: the directory must be in the upper
+ * layer, and the name must not exist in either.
+ */
+static int overlay_prepare_new(fs_node_t * node, char * name) {
+	struct overlay_entry * dir = node->device;
+	struct overlay_entry * e = overlay_lookup(dir, name);
+	if (e && !is_whiteout(e)) return -EEXIST;
+	return overlay_copy_up(dir, 0);
+}
+
+/* After `name` has been made in the upper layer of `node` */
+static void overlay_adopt(fs_node_t * node, char * name) {
+	struct overlay_entry * dir = node->device;
+	fs_node_t * upper = finddir_fs(dir->upper, name);
+	char * path = child_path(dir, name);
+
+	spin_lock(overlay_lock);
+	struct overlay_entry * e = hashmap_get(dir->ov->entries, path);
+	if (e) {
+		/* A whiteout; what was below stays hidden */
+		free(path);
+	} else {
+		e = overlay_entry_new(dir, path);
+	}
+	e->upper = upper;
+	spin_unlock(overlay_lock);
+}
+
+static int create_overlay(fs_node_t * node, char * name, uint16_t permission) {
+	int ret = overlay_prepare_new(node, name);
+	if (ret) return ret;
+	struct overlay_entry * dir = node->device;
+	ret = dir->upper->create(dir->upper, name, permission);
+	if (!ret) overlay_adopt(node, name);
+	return ret;
+}
+
+static int mkdir_overlay(fs_node_t * node, char * name, uint16_t permission) {
+	int ret = overlay_prepare_new(node, name);
+	if (ret) return ret;
+	struct overlay_entry * dir = node->device;
+	ret = dir->upper->mkdir(dir->upper, name, permission);
+	if (!ret) overlay_adopt(node, name);
+	return ret;
+}
+
+static int symlink_overlay(fs_node_t * node, char * target, char * name) {
+	int ret = overlay_prepare_new(node, name);
+	if (ret) return ret;
+	struct overlay_entry * dir = node->device;
+	ret = dir->upper->symlink(dir->upper, target, name);
+	if (!ret) overlay_adopt(node, name);
+	return ret;
+}
+
+static int unlink_overlay(fs_node_t * node, char * name) {
+	struct overlay_entry * dir = node->device;
+	struct overlay_entry * e = overlay_lookup(dir, name);
+	if (!e || is_whiteout(e)) return -ENOENT;
+
+	if (e->upper) {
+		int ret = dir->upper->unlink(dir->upper, name);
+		if (ret) return ret;
+	}
+
+	overlay_remove(e);
+	return 0;
+}
+
+static fs_node_t * overlay_node(struct overlay_entry * e) {
+	fs_node_t * src = e->upper ? e->upper : e->lower;
+
+	fs_node_t * fnode = slab_alloc(&fs_node_cache);
+	memset(fnode, 0, sizeof(fs_node_t));
+	strcpy(fnode->name, e->parent ? e->name : "overlay");
+	fnode->device = e;
+	fnode->inode  = (uintptr_t)e;
+	fnode->flags  = src->flags & (FS_FILE | FS_DIRECTORY | FS_SYMLINK);
+	fnode->mask   = src->mask;
+	fnode->uid    = src->uid;
+	fnode->gid    = src->gid;
+	fnode->length = src->length;
+	fnode->atime  = src->atime;
+	fnode->mtime  = src->mtime;
+	fnode->ctime  = src->ctime;
+	fnode->nlink  = 1;
+
+	if (e->upper) {
+		/* Nodes we hold onto go stale; the tmpfs has the current details */
+		struct tmpfs_file * t = e->upper->device;
+		fnode->mask  = t->mask;
+		fnode->uid   = t->uid;
+		fnode->gid   = t->gid;
+		fnode->atime = t->atime;
+		fnode->mtime = t->mtime;
+		fnode->ctime = t->ctime;
+		if (fnode->flags & FS_FILE) {
+			fnode->length = t->length;
+		}
+	}
+
+	fnode->chmod = chmod_overlay;
+	fnode->chown = chown_overlay;
+
+	if (fnode->flags & FS_DIRECTORY) {
+		fnode->flags   |= FS_DCACHE;
+		fnode->length   = 0;
+		fnode->readdir  = readdir_overlay;
+		fnode->getdents = getdents_overlay;
+		fnode->finddir  = finddir_overlay;
+		fnode->create   = create_overlay;
+		fnode->mkdir    = mkdir_overlay;
+		fnode->symlink  = symlink_overlay;
+		fnode->unlink   = unlink_overlay;
+	} else if (fnode->flags & FS_SYMLINK) {
+		fnode->readlink = readlink_overlay;
+	} else {
+		fnode->read     = read_overlay;
+		fnode->write    = write_overlay;
+		fnode->truncate = truncate_overlay;
+	}
+
+	return fnode;
+}
+
+static fs_node_t * overlay_mount(char * device, char * mount_path) {
+	char * arg = strdup(device);
+	char * argv[10];
+	int argc = tokenize(arg, ",", argv);
+
+	fs_node_t * lower = kopen(argv[0], 0);
+	if (!lower || !(lower->flags & FS_DIRECTORY)) {
+		debug_print(ERROR, "overlay: %s is not a directory", argv[0]);
+		free(arg);
+		return NULL;
+	}
+
+	fs_node_t * upper = tmpfs_create("overlay");
+	chmod_fs(upper, lower->mask);
+
+	if (argc > 1) {
+		if (strlen(argv[1]) < 3) {
+			debug_print(WARNING, "ignoring bad permission option for overlay");
+		} else {
+			int mode = ((argv[1][0] - '0') << 6) |
+			           ((argv[1][1] - '0') << 3) |
+			           ((argv[1][2] - '0') << 0);
+			chmod_fs(upper, mode);
+		}
+	}
+	chown_fs(upper, 0, 0);
+
+	free(arg);
+
+	struct overlay * ov = malloc(sizeof(struct overlay));
+	ov->entries = hashmap_create(64);
+	ov->root = malloc(sizeof(struct overlay_entry));
+	memset(ov->root, 0, sizeof(struct overlay_entry));
+	ov->root->ov = ov;
+	ov->root->path = "";
+	ov->root->name = ov->root->path;
+	ov->root->lower = lower;
+	ov->root->upper = upper;
+
+	return overlay_node(ov->root);
+}
+
+static int init(void) {
+	vfs_register("overlay", overlay_mount);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(overlay, init, fini);
+MODULE_DEPENDS(tmpfs);
@@ -2,37 +2,68 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2014-2018 K. Lange
+ *
+ * Packet exchanges
+ *
+ * Each endpoint (the server, and each client) has a queue of messages.
+ * A message is copied in once when it's written, and out once, straight
+ * into the reader's buffer; a broadcast is one message that every
+ * client's queue holds a reference to. Buffers come back to a small
+ * pool when the last reference goes, so busy exchanges don't malloc.
  */
 #include <kernel/system.h>
 #include <kernel/fs.h>
-#include <kernel/pipe.h>
+#include <kernel/process.h>
 #include <kernel/module.h>
 #include <kernel/logging.h>
 
 #include <sys/ioctl.h>
+#include <sys/pex.h>
 
 #define MAX_PACKET_SIZE 1024
 
+#define PEX_QUEUE_SLOTS 128   /* Messages an endpoint can have queued */
+#define PEX_QUEUE_BYTES 65536 /* ... and how much data they can add up to */
+#define PEX_POOL_MAX    64    /* Idle message buffers we keep around */
+
 typedef struct packet_manager {
 	/* uh, nothing, lol */
 	list_t * exchanges;
 	spin_lock_t lock;
 } pex_t;
 
+typedef struct pex_message {
+	struct pex_message * next; /* In the pool */
+	int refs;
+	struct packet_client * source;
+	size_t size;
+	uint8_t data[];
+} pex_msg_t;
+
+typedef struct pex_queue {
+	pex_msg_t * slots[PEX_QUEUE_SLOTS];
+	unsigned int head;
+	unsigned int count;
+	size_t bytes;
+	list_t * readers;
+	list_t * writers;
+	list_t * alert_waiters;
+} pex_queue_t;
+
 typedef struct packet_exchange {
 	char * name;
 	char fresh;
 	spin_lock_t lock;
-	fs_node_t * server_pipe;
+	pex_queue_t * server_queue;
 	list_t * clients;
 } pex_ex_t;
 
 typedef struct packet_client {
 	pex_ex_t * parent;
-	fs_node_t * pipe;
+	pex_queue_t * queue;
 } pex_client_t;
 
-
+/* What the server reads */
 typedef struct packet {
 	pex_client_t * source;
 	size_t      size;
@@ -44,57 +75,216 @@ typedef struct server_write_header {
 	uint8_t data[];
 } header_t;
 
-static void receive_packet(fs_node_t * socket, packet_t ** out) {
-	packet_t tmp;
-	read_fs(socket, 0, sizeof(struct packet), (uint8_t *)&tmp);
-	*out = malloc(tmp.size + sizeof(struct packet));
-	memcpy(*out, &tmp, sizeof(struct packet));
+static pex_msg_t * msg_pool = NULL;
+static int msg_pool_count = 0;
+
+static pex_msg_t * msg_alloc(pex_client_t * source, size_t size, void * data) {
+	uint32_t flags = int_save();
+	pex_msg_t * m = msg_pool;
+	if (m) {
+		msg_pool = m->next;
+		msg_pool_count--;
+	}
+	int_restore(flags);
 
-	if (tmp.size) {
-		read_fs(socket, 0, tmp.size, (uint8_t *)(*out)->data);
+	if (!m) {
+		/* Always full-sized, so any of them can go back in the pool */
+		m = malloc(sizeof(pex_msg_t) + MAX_PACKET_SIZE);
 	}
+
+	m->refs = 1;
+	m->source = source;
+	m->size = size;
+	if (size) {
+		memcpy(m->data, data, size);
+	}
+	return m;
 }
 
-static void send_to_server(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
-	size_t p_size = size + sizeof(struct packet);
-	packet_t * packet = malloc(p_size);
+static void msg_release(pex_msg_t * m) {
+	uint32_t flags = int_save();
+	if (--m->refs) {
+		int_restore(flags);
+		return;
+	}
+	if (msg_pool_count < PEX_POOL_MAX) {
+		m->next = msg_pool;
+		msg_pool = m;
+		msg_pool_count++;
+		m = NULL;
+	}
+	int_restore(flags);
+	free(m);
+}
 
-	packet->source = c;
-	packet->size = size;
+static pex_queue_t * queue_create(void) {
+	pex_queue_t * q = malloc(sizeof(pex_queue_t));
+	memset(q, 0, sizeof(pex_queue_t));
+	q->readers = list_create();
+	q->writers = list_create();
+	q->alert_waiters = list_create();
+	return q;
+}
 
-	if (size) {
-		memcpy(packet->data, data, size);
+static void queue_destroy(pex_queue_t * q) {
+	for (unsigned int i = 0; i < q->count; ++i) {
+		msg_release(q->slots[(q->head + i) % PEX_QUEUE_SLOTS]);
 	}
+	list_free(q->readers);
+	free(q->readers);
+	list_free(q->writers);
+	free(q->writers);
+	list_free(q->alert_waiters);
+	free(q->alert_waiters);
+	free(q);
+}
 
-	write_fs(p->server_pipe, 0, p_size, (uint8_t *)packet);
+/* Bytes a read would return for everything queued, as pipes counted */
+static int queue_size(pex_queue_t * q) {
+	return q->bytes + q->count * sizeof(packet_t);
+}
+
+/*
+ * Queue another reference to a message; with `block`, wait for room.
+ * An empty queue always takes one, whatever the byte limit says.
+ */
+static int queue_put(pex_queue_t * q, pex_msg_t * m, int block) {
+	uint32_t flags = int_save();
+	while (q->count == PEX_QUEUE_SLOTS || (q->count && q->bytes + m->size > PEX_QUEUE_BYTES)) {
+		if (!block) {
+			int_restore(flags);
+			return -1;
+		}
+		sleep_on(q->writers);
+	}
 
-	free(packet);
+	q->slots[(q->head + q->count) % PEX_QUEUE_SLOTS] = m;
+	q->count++;
+	q->bytes += m->size;
+	m->refs++;
+
+	if (q->readers->length) {
+		wakeup_queue(q->readers);
+	}
+	while (q->alert_waiters->head) {
+		node_t * node = list_dequeue(q->alert_waiters);
+		process_alert_node(node->value, q);
+		free(node);
+	}
+	int_restore(flags);
+	return 0;
 }
 
-static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
-	size_t p_size = size + sizeof(struct packet);
+/*
+ * Take the next message, if it has no more than `max` bytes of data;
+ * the caller gets the queue's reference. With `block`, waits for there
+ * to be one, otherwise returns NULL on an empty queue.
+ */
+static pex_msg_t * queue_get(pex_queue_t * q, size_t max, int block) {
+	uint32_t flags = int_save();
+	while (!q->count) {
+		if (!block) {
+			int_restore(flags);
+			return NULL;
+		}
+		sleep_on(q->readers);
+	}
 
-	/* Verify there is space on the client */
-	if (pipe_unsize(c->pipe) < (int)p_size) {
-		return -1;
+	pex_msg_t * m = q->slots[q->head];
+	if (m->size > max) {
+		int_restore(flags);
+		return NULL;
 	}
+	q->head = (q->head + 1) % PEX_QUEUE_SLOTS;
+	q->count--;
+	q->bytes -= m->size;
 
-	packet_t * packet = malloc(p_size);
+	if (q->writers->length) {
+		wakeup_queue(q->writers);
+	}
+	int_restore(flags);
+	return m;
+}
 
-	memcpy(packet->data, data, size);
-	packet->source = NULL;
-	packet->size = size;
+static int queue_wait(pex_queue_t * q, void * process) {
+	uint32_t flags = int_save();
+	if (!list_find(q->alert_waiters, process)) {
+		list_insert(q->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, q);
+	int_restore(flags);
+	return 0;
+}
 
-	write_fs(c->pipe, 0, p_size, (uint8_t *)packet);
+/*
+ * IOCTL_PACKETFS_RECV: wait for a message, then take as many as fit in
+ * the caller's buffer. Fails if the first one doesn't.
+ */
+static int recv_batch(pex_queue_t * q, struct pex_batch * batch) {
+	validate(batch);
+	validate(batch->buffer);
+
+	uint8_t * buffer = batch->buffer;
+	size_t used = 0;
+	int block = 1;
+
+	while (used + sizeof(struct pex_record) <= batch->size) {
+		pex_msg_t * m = queue_get(q, batch->size - used - sizeof(struct pex_record), block);
+		if (!m) break;
+		block = 0;
+
+		struct pex_record * record = (struct pex_record *)(buffer + used);
+		record->source = (uintptr_t)m->source;
+		record->size = m->size;
+		memcpy(record->data, m->data, m->size);
+		used += PEX_RECORD_SIZE(m->size);
+		msg_release(m);
+	}
 
-	free(packet);
-	return size;
+	return used ? (int)used : -1;
+}
+
+/* IOCTL_PACKETFS_SEND: each record becomes a message, as if written separately */
+static int send_batch(struct pex_batch * batch, int (*put)(void *, struct pex_record *), void * endpoint) {
+	validate(batch);
+	validate(batch->buffer);
+
+	uint8_t * buffer = batch->buffer;
+	size_t used = 0;
+
+	while (used + sizeof(struct pex_record) <= batch->size) {
+		struct pex_record * record = (struct pex_record *)(buffer + used);
+		if (record->size > MAX_PACKET_SIZE || used + sizeof(struct pex_record) + record->size > batch->size) {
+			break;
+		}
+		if (put(endpoint, record) < 0) {
+			return used ? (int)used : -1;
+		}
+		used += PEX_RECORD_SIZE(record->size);
+		if (used > batch->size) used = batch->size;
+	}
+
+	return used ? (int)used : -1;
+}
+
+static void send_to_server(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
+	pex_msg_t * m = msg_alloc(c, size, data);
+	queue_put(p->server_queue, m, 1);
+	msg_release(m);
+}
+
+/* Clients that aren't keeping up miss messages rather than hold up the server */
+static int send_to_client(pex_ex_t * p, pex_client_t * c, pex_msg_t * m) {
+	if (queue_put(c->queue, m, 0)) {
+		return -1;
+	}
+	return m->size;
 }
 
 static pex_client_t * create_client(pex_ex_t * p) {
 	pex_client_t * out = malloc(sizeof(pex_client_t));
 	out->parent = p;
-	out->pipe = make_pipe(4096);
+	out->queue = queue_create();
 	return out;
 }
 
@@ -102,49 +292,69 @@ static uint32_t read_server(fs_node_t * node, uint64_t offset, uint32_t size, ui
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	debug_print(INFO, "[pex] server read(...)");
 
-	packet_t * packet;
-
-	receive_packet(p->server_pipe, &packet);
+	pex_msg_t * m = queue_get(p->server_queue, SIZE_MAX, 1);
 
-	debug_print(INFO, "Server recevied packet of size %d, was waiting for at most %d", packet->size, size);
+	debug_print(INFO, "Server recevied packet of size %d, was waiting for at most %d", m->size, size);
 
-	if (packet->size + sizeof(packet_t) > size) {
+	if (m->size + sizeof(packet_t) > size) {
+		msg_release(m);
 		return -1;
 	}
 
-	memcpy(buffer, packet, packet->size + sizeof(packet_t));
-	uint32_t out = packet->size + sizeof(packet_t);
+	packet_t * packet = (packet_t *)buffer;
+	packet->source = m->source;
+	packet->size = m->size;
+	memcpy(packet->data, m->data, m->size);
+	uint32_t out = m->size + sizeof(packet_t);
 
-	free(packet);
+	msg_release(m);
 	return out;
 }
 
-static uint32_t write_server(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
-	pex_ex_t * p = (pex_ex_t *)node->device;
-	debug_print(INFO, "[pex] server write(...)");
-
-	header_t * head = (header_t *)buffer;
-
-	if (size - sizeof(header_t) > MAX_PACKET_SIZE) {
-		return -1;
-	}
-
-	if (head->target == NULL) {
+/* Send from the server; a NULL target is everyone */
+static int server_send(pex_ex_t * p, pex_client_t * target, size_t size, void * data) {
+	if (target == NULL) {
 		/* Brodcast packet */
+		pex_msg_t * m = msg_alloc(NULL, size, data);
 		spin_lock(p->lock);
 		foreach(f, p->clients) {
 			debug_print(INFO, "Sending to client 0x%x", f->value);
-			send_to_client(p, (pex_client_t *)f->value, size - sizeof(header_t), head->data);
+			send_to_client(p, (pex_client_t *)f->value, m);
 		}
 		spin_unlock(p->lock);
+		msg_release(m);
 		debug_print(INFO, "Done broadcasting to clients.");
 		return size;
-	} else if (head->target->parent != p) {
+	} else if (target->parent != p) {
 		debug_print(WARNING, "[pex] Invalid packet from server? (pid=%d)", current_process->id);
 		return -1;
 	}
 
-	return send_to_client(p, head->target, size - sizeof(header_t), head->data);
+	pex_msg_t * m = msg_alloc(NULL, size, data);
+	int out = send_to_client(p, target, m);
+	msg_release(m);
+	return out;
+}
+
+static uint32_t write_server(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	pex_ex_t * p = (pex_ex_t *)node->device;
+	debug_print(INFO, "[pex] server write(...)");
+
+	header_t * head = (header_t *)buffer;
+
+	if (size < sizeof(header_t) || size - sizeof(header_t) > MAX_PACKET_SIZE) {
+		return -1;
+	}
+
+	int out = server_send(p, head->target, size - sizeof(header_t), head->data);
+	return out < 0 ? (uint32_t)-1 : size;
+}
+
+/* A record's source is who it's for */
+static int server_send_record(void * endpoint, struct pex_record * record) {
+	server_send(endpoint, (pex_client_t *)record->source, record->size, record->data);
+	/* Like a write, a client that's too far behind doesn't fail the rest */
+	return 0;
 }
 
 static int ioctl_server(fs_node_t * node, int request, void * argp) {
@@ -152,7 +362,11 @@ static int ioctl_server(fs_node_t * node, int request, void * argp) {
 
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
-			return pipe_size(p->server_pipe);
+			return queue_size(p->server_queue);
+		case IOCTL_PACKETFS_RECV:
+			return recv_batch(p->server_queue, argp);
+		case IOCTL_PACKETFS_SEND:
+			return send_batch(argp, server_send_record, p);
 		default:
 			return -1;
 	}
@@ -167,21 +381,20 @@ static uint32_t read_client(fs_node_t * node, uint64_t offset, uint32_t size, ui
 
 	debug_print(INFO, "[pex] client read(...)");
 
-	packet_t * packet;
+	pex_msg_t * m = queue_get(c->queue, SIZE_MAX, 1);
 
-	receive_packet(c->pipe, &packet);
-
-	if (packet->size > size) {
-		debug_print(WARNING, "[pex] Client is not reading enough bytes to hold packet of size %d", packet->size);
+	if (m->size > size) {
+		debug_print(WARNING, "[pex] Client is not reading enough bytes to hold packet of size %d", m->size);
+		msg_release(m);
 		return -1;
 	}
 
-	memcpy(buffer, &packet->data, packet->size);
-	uint32_t out = packet->size;
+	memcpy(buffer, m->data, m->size);
+	uint32_t out = m->size;
 
-	debug_print(INFO, "[pex] Client received packet of size %d", packet->size);
+	debug_print(INFO, "[pex] Client received packet of size %d", m->size);
 
-	free(packet);
+	msg_release(m);
 	return out;
 }
 
@@ -205,12 +418,22 @@ static uint32_t write_client(fs_node_t * node, uint64_t offset, uint32_t size, u
 	return size;
 }
 
+static int client_send_record(void * endpoint, struct pex_record * record) {
+	pex_client_t * c = endpoint;
+	send_to_server(c->parent, c, record->size, record->data);
+	return 0;
+}
+
 static int ioctl_client(fs_node_t * node, int request, void * argp) {
 	pex_client_t * c = (pex_client_t *)node->inode;
 
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
-			return pipe_size(c->pipe);
+			return queue_size(c->queue);
+		case IOCTL_PACKETFS_RECV:
+			return recv_batch(c->queue, argp);
+		case IOCTL_PACKETFS_SEND:
+			return send_batch(argp, client_send_record, c);
 		default:
 			return -1;
 	}
@@ -232,29 +455,28 @@ static void close_client(fs_node_t * node) {
 
 	spin_unlock(p->lock);
 
-	char tmp[1];
-
-	send_to_server(p, c, 0, tmp);
+	send_to_server(p, c, 0, NULL);
 
+	queue_destroy(c->queue);
 	free(c);
 }
 
 static int wait_server(fs_node_t * node, void * process) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
-	return selectwait_fs(p->server_pipe, process);
+	return queue_wait(p->server_queue, process);
 }
 static int check_server(fs_node_t * node) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
-	return selectcheck_fs(p->server_pipe);
+	return p->server_queue->count ? 0 : 1;
 }
 
 static int wait_client(fs_node_t * node, void * process) {
 	pex_client_t * c = (pex_client_t *)node->inode;
-	return selectwait_fs(c->pipe, process);
+	return queue_wait(c->queue, process);
 }
 static int check_client(fs_node_t * node) {
 	pex_client_t * c = (pex_client_t *)node->inode;
-	return selectcheck_fs(c->pipe);
+	return c->queue->count ? 0 : 1;
 }
 
 static void open_pex(fs_node_t * node, unsigned int flags) {
@@ -404,10 +626,9 @@ static int create_packetfs(fs_node_t *parent, char *name, uint16_t permission) {
 	new_exchange->name = strdup(name);
 	new_exchange->fresh = 1;
 	new_exchange->clients = list_create();
-	new_exchange->server_pipe = make_pipe(4096);
+	new_exchange->server_queue = queue_create();
 
 	spin_init(new_exchange->lock);
-	/* XXX Create exchange server pipe */
 
 	list_insert(p->exchanges, new_exchange);
 
@@ -11,6 +11,7 @@
 #include <kernel/pipe.h>
 #include <kernel/ipv4.h>
 #include <kernel/mod/net.h>
+#include <kernel/workqueue.h>
 
 #include <toaru/list.h>
 
@@ -124,24 +125,22 @@ static void init_descriptor(int index, int is_tx) {
 	}
 }
 
-static void enqueue_packet(void * buffer) {
+static void enqueue_packet(struct netbuf * nb) {
 	spin_lock(net_queue_lock);
-	list_insert(net_queue, buffer);
+	list_append(net_queue, &nb->node);
 	spin_unlock(net_queue_lock);
 }
 
-static struct ethernet_packet * dequeue_packet(void) {
+static struct netbuf * dequeue_packet(void) {
 	while (!net_queue->length) {
 		sleep_on(rx_wait);
 	}
 
 	spin_lock(net_queue_lock);
 	node_t * n = list_dequeue(net_queue);
-	void* value = n->value;
-	free(n);
 	spin_unlock(net_queue_lock);
 
-	return value;
+	return n->value;
 }
 
 static uint8_t* pcnet_get_mac() {
@@ -184,12 +183,14 @@ static int pcnet_irq_handler(struct regs *r) {
 
 		void * pbuf = (void *)(pcnet_rx_start + pcnet_rx_buffer_id * PCNET_BUFFER_SIZE);
 
-		void * packet = malloc(plen);
-		memcpy(packet, pbuf, plen);
+		if (plen <= NETBUF_SIZE - NETBUF_HEADROOM) {
+			struct netbuf * nb = netbuf_alloc();
+			memcpy(nb->data, pbuf, plen);
+			nb->len = plen;
+			enqueue_packet(nb);
+		}
 		pcnet_rx_de_start[pcnet_rx_buffer_id * PCNET_DE_SIZE + 7] = 0x80;
 
-		enqueue_packet(packet);
-
 		pcnet_rx_buffer_id = next_rx_index(pcnet_rx_buffer_id);
 	}
 	wakeup_queue(rx_wait);
@@ -197,7 +198,9 @@ static int pcnet_irq_handler(struct regs *r) {
 	return 1;
 }
 
-static void pcnet_init(void * data, char * name) {
+static work_t pcnet_init_work;
+
+static void pcnet_init(void * data) {
 	uint16_t command_reg = pci_read_field(pcnet_device_pci, PCI_COMMAND, 4) & 0xFFFF0000;
 	if (command_reg & (1 << 2)) {
 		debug_print(NOTICE, "Bus mastering already enabled.\n");
@@ -362,7 +365,8 @@ static int init(void) {
 	/* This fits 32x1548 (rx) + 8x1548 (tx) + 32x16 (rx DE) + 8x16 (tx DE) */
 	pcnet_buffer_virt = (void*)kvmalloc_p(0x10000, &pcnet_buffer_phys);
 
-	create_kernel_tasklet(pcnet_init, "[pcnet]", NULL);
+	work_init(&pcnet_init_work, pcnet_init, NULL, WORK_NORMAL);
+	queue_work(&pcnet_init_work);
 
 	return 0;
 }
@@ -10,9 +10,16 @@
 #include <kernel/process.h>
 #include <kernel/printf.h>
 #include <kernel/module.h>
+#include <kernel/mem.h>
+#include <kernel/slab.h>
+#include <kernel/pressure.h>
+#include <kernel/zswap.h>
 #include <kernel/multiboot.h>
+#include <kernel/boot.h>
+#include <kernel/args.h>
 #include <kernel/pci.h>
 #include <kernel/mod/procfs.h>
+#include <kernel/mod/procsnap.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
@@ -83,7 +90,7 @@ static uint32_t proc_cmdline_func(fs_node_t *node, uint64_t offset, uint32_t siz
 
 static size_t calculate_memory_usage(page_directory_t * src) {
 	size_t pages = 0;
-	for (uint32_t i = 0; i < 1024; ++i) {
+	for (uint32_t i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
 		if (!src->tables[i] || (uintptr_t)src->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
 		}
@@ -91,11 +98,11 @@ static size_t calculate_memory_usage(page_directory_t * src) {
 			continue;
 		}
 		/* For each table */
-		if (i * 0x1000 * 1024 < SHM_START) {
+		if (i * PAGE_TABLE_SPAN < SHM_START) {
 			/* Ignore shared memory for now */
-			for (int j = 0; j < 1024; ++j) {
+			for (int j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
 				/* For each frame in the table... */
-				if (!src->tables[i]->pages[j].frame) {
+				if (!src->tables[i]->pages[j].frame || src->tables[i]->pages[j].swapped) {
 					continue;
 				}
 				pages++;
@@ -107,17 +114,21 @@ static size_t calculate_memory_usage(page_directory_t * src) {
 
 static size_t calculate_shm_resident(page_directory_t * src) {
 	size_t pages = 0;
-	for (uint32_t i = 0; i < 1024; ++i) {
+	for (uint32_t i = 0; i < PAGE_DIRECTORY_ENTRIES; ++i) {
+		if (!src->tables[i] && (src->physical_tables[i] & PDE_LARGE)) {
+			pages += LARGE_PAGE_FRAMES;
+			continue;
+		}
 		if (!src->tables[i] || (uintptr_t)src->tables[i] == (uintptr_t)0xFFFFFFFF) {
 			continue;
 		}
 		if (kernel_directory->tables[i] == src->tables[i]) {
 			continue;
 		}
-		if (i * 0x1000 * 1024 < SHM_START) {
+		if (i * PAGE_TABLE_SPAN < SHM_START) {
 			continue;
 		}
-		for (int j = 0; j < 1024; ++j) {
+		for (int j = 0; j < PAGE_TABLE_ENTRIES; ++j) {
 			/* For each frame in the table... */
 			if (!src->tables[i]->pages[j].frame) {
 				continue;
@@ -128,19 +139,13 @@ static size_t calculate_shm_resident(page_directory_t * src) {
 	return pages;
 }
 
-static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	char buf[2048];
-	process_t * proc = process_from_pid(node->inode);
-	process_t * parent = process_get_parent(proc);
-
-	if (!proc) {
-		/* wat */
-		return 0;
-	}
-
-	char state = proc->finished ? 'Z' :
+static char process_state(process_t * proc) {
+	return proc->finished ? 'Z' :
 		(proc->suspended ? 'T' :
 			(process_is_ready(proc) ? 'R' : 'S'));
+}
+
+static char * process_basename(process_t * proc) {
 	char * name = proc->name + strlen(proc->name) - 1;
 
 	while (1) {
@@ -152,6 +157,22 @@ static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size
 		name--;
 	}
 
+	return name;
+}
+
+static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	char buf[2048];
+	process_t * proc = process_from_pid(node->inode);
+
+	if (!proc) {
+		/* wat */
+		return 0;
+	}
+
+	process_t * parent = process_get_parent(proc);
+	char state = process_state(proc);
+	char * name = process_basename(proc);
+
 	/* Calculate process memory usage */
 	int mem_usage = calculate_memory_usage(proc->thread.page_directory) * 4;
 	int shm_usage = calculate_shm_resident(proc->thread.page_directory) * 4;
@@ -178,6 +199,14 @@ static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size
 			"VmSize:\t %d kB\n"
 			"RssShmem:\t %d kB\n"
 			"MemPermille:\t %d\n"
+			"UTime:\t %d ms\n"
+			"STime:\t %d ms\n"
+			"CtxSwVol:\t %d\n"
+			"CtxSwInvol:\t %d\n"
+			"MinFlt:\t %d\n"
+			"MajFlt:\t %d\n"
+			"IoRead:\t %d kB\n"
+			"IoWrite:\t %d kB\n"
 			,
 			name,
 			state,
@@ -196,7 +225,13 @@ static uint32_t proc_status_func(fs_node_t *node, uint64_t offset, uint32_t size
 			proc->syscall_registers ? proc->syscall_registers->edi : 0,
 			proc->syscall_registers ? proc->syscall_registers->useresp : 0,
 			proc->cmdline ? proc->cmdline[0] : "(none)",
-			mem_usage, shm_usage, mem_permille
+			mem_usage, shm_usage, mem_permille,
+			(uint32_t)(timer_cycles_to_us(proc->usage.utime) / 1000),
+			(uint32_t)(timer_cycles_to_us(proc->usage.stime) / 1000),
+			proc->usage.nvcsw, proc->usage.nivcsw,
+			proc->usage.minflt, proc->usage.majflt,
+			(uint32_t)(proc->usage.read_bytes / 1024),
+			(uint32_t)(proc->usage.write_bytes / 1024)
 			);
 
 	size_t _bsize = strlen(buf);
@@ -306,7 +341,8 @@ static uint32_t cpuinfo_func(fs_node_t *node, uint64_t offset, uint32_t size, ui
 		"Manufacturer: %s\n"
 		"Family: %d\n"
 		"Model: %d\n"
-		, _manu, _family, _model);
+		"Processors: %d\n"
+		, _manu, _family, _model, smp_cpu_count);
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -318,6 +354,8 @@ static uint32_t cpuinfo_func(fs_node_t *node, uint64_t offset, uint32_t size, ui
 
 extern uintptr_t heap_end;
 extern uintptr_t kernel_heap_alloc_point;
+extern uint32_t frame_alloc_count;
+extern uint32_t frame_scan_count;
 
 static uint32_t meminfo_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[1024];
@@ -331,7 +369,15 @@ static uint32_t meminfo_func(fs_node_t *node, uint64_t offset, uint32_t size, ui
 		"MemTotal: %d kB\n"
 		"MemFree: %d kB\n"
 		"KHeapUse: %d kB\n"
-		, total, free, kheap);
+		"FrameAllocs: %d\n"
+		"FrameScans: %d\n"
+		"PageCache: %d kB\n"
+		"Reclaims: %d\n"
+		"OomKills: %d\n"
+		"Swapped: %d kB\n"
+		"SwapStored: %d kB\n"
+		, total, free, kheap, frame_alloc_count, frame_scan_count, pagecache_count() * 4,
+		reclaim_passes, oom_kills, zswap_pages * 4, zswap_stored / 1024);
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -397,7 +443,9 @@ static uint32_t pat_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 
 static uint32_t uptime_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	char buf[1024];
-	sprintf(buf, "%d.%3d\n", timer_ticks, timer_subticks);
+	/* Then how long the CPU has spent halted, like Linux's second field */
+	uint32_t idle_ms = timer_cycles_to_us(idle_cycles) / 1000;
+	sprintf(buf, "%d.%3d %d.%3d\n", timer_ticks, timer_subticks / 1000, idle_ms / 1000, idle_ms % 1000);
 
 	size_t _bsize = strlen(buf);
 	if (offset > _bsize) return 0;
@@ -456,6 +504,107 @@ static uint32_t compiler_func(fs_node_t *node, uint64_t offset, uint32_t size, u
 	return size;
 }
 
+struct _snapshot_buf {
+	procsnap_entry_t * entries;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t total;
+};
+
+/* Copy a string, truncating it to fit; `out` is already zeroed */
+static void snapshot_copy(char * out, char * in, size_t size) {
+	size_t len = strlen(in);
+	if (len > size - 1) len = size - 1;
+	memcpy(out, in, len);
+}
+
+static void snapshot_entry(process_t * proc, process_t * parent, void * data) {
+	struct _snapshot_buf * b = data;
+	b->total++;
+	if (b->count == b->capacity) return;
+
+	procsnap_entry_t * e = &b->entries[b->count++];
+	memset(e, 0, sizeof(procsnap_entry_t));
+
+	e->pid   = proc->id;
+	e->tgid  = proc->group ? proc->group : proc->id;
+	e->ppid  = parent ? parent->id : 0;
+	e->pgid  = proc->job;
+	e->sid   = proc->session;
+	e->uid   = proc->user;
+	e->state = process_state(proc);
+	e->sched_class = proc->sched_class;
+	e->start = proc->start.tv_sec;
+
+	e->vm_size   = calculate_memory_usage(proc->thread.page_directory) * 4;
+	e->rss_shmem = calculate_shm_resident(proc->thread.page_directory) * 4;
+	e->mem_permille = 1000 * (e->vm_size + e->rss_shmem) / memory_total();
+
+	e->utime_ms = timer_cycles_to_us(proc->usage.utime) / 1000;
+	e->stime_ms = timer_cycles_to_us(proc->usage.stime) / 1000;
+	e->nvcsw    = proc->usage.nvcsw;
+	e->nivcsw   = proc->usage.nivcsw;
+	e->minflt   = proc->usage.minflt;
+	e->majflt   = proc->usage.majflt;
+	e->read_kb  = proc->usage.read_bytes / 1024;
+	e->write_kb = proc->usage.write_bytes / 1024;
+
+	snapshot_copy(e->name, process_basename(proc), PROCSNAP_NAME_SIZE);
+	snapshot_copy(e->path, proc->cmdline ? proc->cmdline[0] : "(none)", PROCSNAP_PATH_SIZE);
+}
+
+/**
+ * Every process's stats in one read, binary; see <kernel/mod/procsnap.h>.
+ */
+static uint32_t snapshot_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	/*
+	 * We can't allocate with the tree locked, so this is sized before
+	 * taking it; if more processes than that turned up meanwhile, try
+	 * again with room for them.
+	 */
+	uint32_t capacity = process_list->length + 16;
+	uint8_t * buf;
+	struct _snapshot_buf b;
+
+	for (int tries = 0; ; ++tries) {
+		buf = malloc(sizeof(procsnap_header_t) + capacity * sizeof(procsnap_entry_t));
+		b.entries  = (procsnap_entry_t *)(buf + sizeof(procsnap_header_t));
+		b.count    = 0;
+		b.capacity = capacity;
+		b.total    = 0;
+
+		process_foreach(snapshot_entry, &b);
+
+		if (b.total <= capacity || tries == 3) break;
+		free(buf);
+		capacity = b.total + 16;
+	}
+
+	procsnap_header_t * header = (procsnap_header_t *)buf;
+
+	unsigned int total = memory_total();
+	header->version     = PROCSNAP_VERSION;
+	header->header_size = sizeof(procsnap_header_t);
+	header->entry_size  = sizeof(procsnap_entry_t);
+	header->count       = b.count;
+	header->uptime      = timer_ticks;
+	header->uptime_ms   = timer_subticks / 1000;
+	header->mem_total   = total;
+	header->mem_used    = memory_use();
+	header->total       = b.total;
+
+	size_t _bsize = sizeof(procsnap_header_t) + b.count * sizeof(procsnap_entry_t);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
 extern tree_t * fs_tree; /* kernel/fs/vfs.c */
 
 static void mount_recurse(char * buf, tree_node_t * node, size_t height) {
@@ -598,7 +747,8 @@ static uint32_t irq_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 	char * buf = malloc(4096);
 	unsigned int soffset = 0;
 
-	for (int i = 0; i < 16; ++i) {
+	for (int i = 0; i < IRQ_COUNT; ++i) {
+		if (i >= IRQ_LEGACY_COUNT && !get_irq_handler(i, 0)) continue;
 		soffset += sprintf(&buf[soffset], "irq %d: ", i);
 		for (int j = 0; j < 4; ++j) {
 			char * t = get_irq_handler(i, j);
@@ -631,61 +781,285 @@ static uint32_t irq_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_
 }
 
 /**
- * Basically the same as the kdebug `pci` command.
+ * Basically the same as the kdebug `pci` command, but from the
+ * device table; only the interrupt and status are read live.
  */
-struct _pci_buf {
-	size_t   offset;
-	char *buffer;
-};
-
-static void scan_hit_list(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
-
-	struct _pci_buf * b = extra;
+static size_t pci_describe(char * buf, pci_device_t * d) {
+	size_t offset = 0;
+	uint32_t device = d->address;
 
-	b->offset += sprintf(b->buffer + b->offset, "%2x:%2x.%d (%4x, %4x:%4x)\n",
+	offset += sprintf(buf + offset, "%2x:%2x.%d (%4x, %4x:%4x)\n",
 			(int)pci_extract_bus(device),
 			(int)pci_extract_slot(device),
 			(int)pci_extract_func(device),
-			(int)pci_find_type(device),
-			vendorid,
-			deviceid);
+			(int)d->type,
+			d->vendor_id,
+			d->device_id);
 
-	b->offset += sprintf(b->buffer + b->offset, " BAR0: 0x%8x", pci_read_field(device, PCI_BAR0, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR1: 0x%8x", pci_read_field(device, PCI_BAR1, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR2: 0x%8x", pci_read_field(device, PCI_BAR2, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR3: 0x%8x", pci_read_field(device, PCI_BAR3, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR4: 0x%8x", pci_read_field(device, PCI_BAR4, 4));
-	b->offset += sprintf(b->buffer + b->offset, " BAR5: 0x%8x\n", pci_read_field(device, PCI_BAR5, 4));
+	for (int i = 0; i < 6; ++i) {
+		offset += sprintf(buf + offset, " BAR%d: 0x%8x%s", i, d->bar[i], i == 5 ? "\n" : "");
+	}
 
-	b->offset += sprintf(b->buffer + b->offset, " IRQ Line: %d", pci_read_field(device, 0x3C, 1));
-	b->offset += sprintf(b->buffer + b->offset, " IRQ Pin: %d", pci_read_field(device, 0x3D, 1));
-	b->offset += sprintf(b->buffer + b->offset, " Interrupt: %d", pci_get_interrupt(device));
-	b->offset += sprintf(b->buffer + b->offset, " Status: 0x%4x\n", pci_read_field(device, PCI_STATUS, 2));
+	offset += sprintf(buf + offset, " IRQ Line: %d", pci_read_field(device, PCI_INTERRUPT_LINE, 1));
+	offset += sprintf(buf + offset, " IRQ Pin: %d", d->irq_pin);
+	offset += sprintf(buf + offset, " Interrupt: %d", pci_get_interrupt(device));
+	offset += sprintf(buf + offset, " Status: 0x%4x\n", pci_read_field(device, PCI_STATUS, 2));
+	return offset;
 }
 
-static void scan_count(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
-	size_t * count = extra;
-	(*count)++;
+/*
+ * One line per place a lock has been taken from:
+ *   lock file:line acquired contended held-kilocycles longest-hold-cycles
+ */
+static uint32_t lockstat_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	unsigned int count = 0;
+	for (lock_stat_t * stat = lock_stats; stat; stat = stat->next) count++;
+
+	char * buf = malloc(count * 160 + 1);
+	buf[0] = '\0';
+	unsigned int soffset = 0;
+
+	lock_stat_t * stat = lock_stats;
+	while (stat && count--) {
+		const char * file = strrchr(stat->file, '/');
+		soffset += sprintf(&buf[soffset], "%s %s:%d %d %d %d %d\n",
+				stat->name, file ? file + 1 : stat->file, stat->line,
+				stat->acquired, stat->contended,
+				(uint32_t)(stat->held / 1000), stat->held_max);
+		stat = stat->next;
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
 }
 
-static uint32_t pci_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	size_t count = 0;
-	pci_scan(&scan_count, -1, &count);
+/*
+ * One line per object cache that has been used:
+ *   name object-size in-use objects pages allocations
+ */
+static uint32_t slabinfo_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	unsigned int count = 0;
+	for (slab_cache_t * cache = slab_caches; cache; cache = cache->next) count++;
+
+	char * buf = malloc(count * 96 + 1);
+	buf[0] = '\0';
+	unsigned int soffset = 0;
+
+	slab_cache_t * cache = slab_caches;
+	while (cache && count--) {
+		soffset += sprintf(&buf[soffset], "%s %d %d %d %d %d\n",
+				cache->name, cache->stride, cache->in_use, cache->objects,
+				cache->pages, cache->allocs);
+		cache = cache->next;
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+/*
+ * One line per system call that has been made:
+ *   number calls kilocycles cycles-per-call
+ */
+static uint32_t syscalls_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	char * buf = malloc(num_syscalls * 48 + 1);
+	buf[0] = '\0';
+	unsigned int soffset = 0;
+
+	for (uint32_t i = 0; i < num_syscalls; ++i) {
+		syscall_stat_t * stat = &syscall_stats[i];
+		if (!stat->calls) continue;
+		soffset += sprintf(&buf[soffset], "%d %d %d %d\n", i, stat->calls,
+				(uint32_t)(stat->cycles / 1000), (uint32_t)(stat->cycles / stat->calls));
+	}
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+/*
+ * Kernel and module symbols, one "address name" per line, for
+ * symbolizing addresses from /dev/prof and the like.
+ */
+static uint32_t ksyms_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	hashmap_t * symbols = modules_get_symbols();
+	list_t * hash_keys = hashmap_keys(symbols);
+
+	size_t total = 1;
+	foreach(_key, hash_keys) {
+		total += strlen((char *)_key->value) + 12;
+	}
+
+	char * buf = malloc(total);
+	buf[0] = '\0';
+	unsigned int soffset = 0;
+	foreach(_key, hash_keys) {
+		char * key = (char *)_key->value;
+		soffset += sprintf(&buf[soffset], "%x %s\n", hashmap_get(symbols, key), key);
+	}
+	list_free(hash_keys);
+	free(hash_keys);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+/* printf pads with zeroes; these columns want spaces */
+static size_t boottime_column(char * buf, size_t at, int width, uint32_t value) {
+	char num[16];
+	int len = sprintf(num, "%d", value);
+	while (width-- > len) buf[at++] = ' ';
+	memcpy(buf + at, num, len);
+	return at + len;
+}
 
-	struct _pci_buf b = {0,NULL};
-	b.buffer = malloc(count * 1024);
+/*
+ * Where boot went: the loader's stages from boottime= on the command
+ * line, then the kernel's, each with when it started and how long it
+ * lasted until the next one did.
+ */
+static uint32_t boottime_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	char names[BOOT_STAGES * 2][16];
+	uint64_t cycles[BOOT_STAGES * 2];
+	int count = 0;
+
+	char * c = args_value("boottime");
+	while (c && *c && count < BOOT_STAGES) {
+		int n = 0;
+		while (*c && *c != '@' && *c != ',') {
+			if (n < 15) names[count][n++] = *c;
+			c++;
+		}
+		names[count][n] = '\0';
+		uint64_t value = 0;
+		if (*c == '@') {
+			for (c++; ; c++) {
+				if (*c >= '0' && *c <= '9') value = value * 16 + (*c - '0');
+				else if (*c >= 'a' && *c <= 'f') value = value * 16 + (*c - 'a' + 10);
+				else break;
+			}
+		}
+		cycles[count++] = value;
+		if (*c == ',') c++;
+	}
+
+	for (int i = 0; i < boot_stage_count; ++i, ++count) {
+		int n = 0;
+		for (char * s = boot_stages[i].name; *s && n < 15; ++s) names[count][n++] = *s;
+		names[count][n] = '\0';
+		cycles[count] = boot_stages[i].cycles;
+	}
+
+	char * buf = malloc(count * 64 + 64);
+	size_t _bsize = sprintf(buf, "stage           start(ms)  length(ms)\n");
 
-	pci_scan(&scan_hit_list, -1, &b);
+	for (int i = 0; i < count; ++i) {
+		_bsize += sprintf(buf + _bsize, "%s", names[i]);
+		for (int n = strlen(names[i]); n < 16; ++n) buf[_bsize++] = ' ';
+		_bsize = boottime_column(buf, _bsize, 9, timer_cycles_to_us(cycles[i]) / 1000);
+		if (i + 1 < count && cycles[i+1] >= cycles[i]) {
+			_bsize = boottime_column(buf, _bsize, 12, timer_cycles_to_us(cycles[i+1] - cycles[i]) / 1000);
+		}
+		buf[_bsize++] = '\n';
+	}
+	buf[_bsize] = '\0';
 
-	size_t _bsize = b.offset;
 	if (offset > _bsize) {
-		free(b.buffer);
+		free(buf);
 		return 0;
 	}
 	if (size > _bsize - offset) size = _bsize - offset;
 
-	memcpy(buffer, b.buffer + offset, size);
-	free(b.buffer);
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+/*
+ * The longest interrupts-off and non-preemptible stretches since the
+ * tracer started (with latency on the command line), one line each:
+ *   kind spans longest-us start-address end-address
+ * The addresses resolve against /proc/ksyms.
+ */
+static uint32_t latency_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	char * buf = malloc(256);
+	size_t _bsize = 0;
+
+	if (!latency_tracing) {
+		_bsize = sprintf(buf, "off\n");
+	} else {
+		struct { char * name; latency_stat_t * stat; } kinds[] = {
+			{"irqs-off",    &latency_irqs},
+			{"preempt-off", &latency_preempt},
+		};
+		for (int i = 0; i < 2; ++i) {
+			latency_stat_t stat = *kinds[i].stat;
+			_bsize += sprintf(buf + _bsize, "%s %d %d 0x%x 0x%x\n",
+					kinds[i].name, stat.spans, (uint32_t)timer_cycles_to_us(stat.longest),
+					stat.start_site, stat.end_site);
+		}
+	}
+
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
+	return size;
+}
+
+static uint32_t pci_func(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+	int count = pci_count();
+	char * buf = malloc(count * 1024 + 1);
+	size_t _bsize = 0;
+
+	for (int i = 0; i < count; ++i) {
+		_bsize += pci_describe(buf + _bsize, pci_device_at(i));
+	}
+
+	if (offset > _bsize) {
+		free(buf);
+		return 0;
+	}
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	free(buf);
 	return size;
 }
 
@@ -703,6 +1077,13 @@ static struct procfs_entry std_entries[] = {
 	{-11,"irq",      irq_func},
 	{-12,"pat",      pat_func},
 	{-13,"pci",      pci_func},
+	{-14,"snapshot", snapshot_func},
+	{-15,"lockstat", lockstat_func},
+	{-16,"ksyms",    ksyms_func},
+	{-17,"syscalls", syscalls_func},
+	{-18,"slabinfo", slabinfo_func},
+	{-19,"boottime", boottime_func},
+	{-20,"latency",  latency_func},
 };
 
 static list_t * extended_entries = NULL;
@@ -0,0 +1,223 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Sampling profiler
+ *
+ * While started, the timer interrupt records what it interrupted -
+ * PID, EIP and a frame pointer call chain - into a ring of samples
+ * that /dev/prof hands out as struct prof_sample. When the ring is
+ * full new samples are dropped and counted. There is one ring, as
+ * there is one CPU taking timer interrupts.
+ */
+#include <kernel/system.h>
+#include <kernel/fs.h>
+#include <kernel/module.h>
+#include <kernel/process.h>
+#include <kernel/logging.h>
+
+#include <sys/ioctl.h>
+#include <sys/prof.h>
+
+#define PROF_SAMPLES 4096 /* Power of two */
+#define PROF_WAKE    (PROF_SAMPLES / 8) /* Wake readers once this many are waiting */
+
+static struct prof_sample * samples = NULL;
+static volatile unsigned int sample_head = 0; /* Next to write */
+static volatile unsigned int sample_tail = 0; /* Next to read */
+static uint32_t dropped = 0;
+static int running = 0;
+
+static unsigned long interval = 0; /* Microseconds between samples */
+static unsigned long last_ticks = 0;
+static unsigned long last_subticks = 0;
+
+static fs_node_t * prof_node = NULL;
+static list_t * readers = NULL;
+static list_t * alert_waiters = NULL;
+
+static void prof_wake(void) {
+	if (readers->length) {
+		wakeup_queue(readers);
+	}
+	while (alert_waiters->head) {
+		node_t * node = list_dequeue(alert_waiters);
+		process_alert_node(node->value, prof_node);
+		free(node);
+	}
+}
+
+/* Can we read a word at `addr` without faulting? */
+static int prof_readable(uintptr_t addr, int user) {
+	if (user) {
+		page_t * page = get_page(addr, 0, current_directory);
+		if (!page || !page->present || !page->user) return 0;
+		if ((addr & 0xFFF) > 0xFF8) {
+			return prof_readable((addr & ~0xFFF) + 0x1000, user);
+		}
+		return 1;
+	}
+	uintptr_t top = current_process->image.stack;
+	return addr >= top - KERNEL_STACK_SIZE && addr <= top - 2 * sizeof(uintptr_t);
+}
+
+static void prof_sample(struct regs * r) {
+	unsigned long elapsed = (timer_ticks - last_ticks) * 1000000 + timer_subticks - last_subticks;
+	if (elapsed < interval) return;
+	last_ticks = timer_ticks;
+	last_subticks = timer_subticks;
+
+	if (sample_head - sample_tail >= PROF_SAMPLES) {
+		dropped++;
+		return;
+	}
+
+	struct prof_sample * sample = &samples[sample_head & (PROF_SAMPLES - 1)];
+	int user = (r->cs & 0x3) == 0x3;
+
+	sample->pid = current_process->id;
+	sample->flags = user ? PROF_USER : 0;
+	sample->chain[0] = r->eip;
+	sample->frames = 1;
+
+	/* [ebp] is the caller's ebp and [ebp+4] our return address */
+	uintptr_t ebp = r->ebp;
+	while (sample->frames < PROF_MAX_FRAMES && prof_readable(ebp, user)) {
+		uintptr_t * frame = (uintptr_t *)ebp;
+		if (!frame[1]) break;
+		sample->chain[sample->frames++] = frame[1];
+		if (frame[0] <= ebp) break; /* Stacks grow down; anything else is garbage */
+		ebp = frame[0];
+	}
+
+	sample_head++;
+
+	if (sample_head - sample_tail == PROF_WAKE) {
+		prof_wake();
+	}
+}
+
+static void prof_stop(void) {
+	uint32_t flags = int_save();
+	timer_sample_hook = NULL;
+	running = 0;
+	int_restore(flags);
+	prof_wake();
+}
+
+static int ioctl_prof(fs_node_t * node, int request, void * argp) {
+	switch (request) {
+		case IOCTL_PROF_START: {
+			if (current_process->user != USER_ROOT_UID) return -EPERM;
+			int rate = PROF_DEFAULT_RATE;
+			if (argp) {
+				validate(argp);
+				if (*(int *)argp) rate = *(int *)argp;
+			}
+			if (rate < 1 || rate > PROF_MAX_RATE) return -EINVAL;
+
+			if (!samples) {
+				samples = malloc(sizeof(struct prof_sample) * PROF_SAMPLES);
+			}
+
+			uint32_t flags = int_save();
+			sample_head = 0;
+			sample_tail = 0;
+			dropped = 0;
+			interval = 1000000 / rate;
+			last_ticks = timer_ticks;
+			last_subticks = timer_subticks;
+			running = 1;
+			timer_sample_hook = prof_sample;
+			int_restore(flags);
+			debug_print(NOTICE, "Profiling at %d samples per second", rate);
+			return 0;
+		}
+		case IOCTL_PROF_STOP:
+			if (current_process->user != USER_ROOT_UID) return -EPERM;
+			prof_stop();
+			return 0;
+		case IOCTL_PROF_DROPPED:
+			return dropped;
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Whole samples only. Blocks until at least one is there, unless
+ * sampling has stopped, in which case running dry is the end of file.
+ */
+static uint32_t read_prof(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	unsigned int want = size / sizeof(struct prof_sample);
+	if (!want || !samples) return 0;
+
+	uint32_t flags = int_save();
+	while (sample_head == sample_tail && running) {
+		if (sleep_on(readers)) {
+			int_restore(flags);
+			return 0;
+		}
+		(void)int_save();
+	}
+
+	unsigned int have = sample_head - sample_tail;
+	if (want > have) want = have;
+	for (unsigned int i = 0; i < want; ++i) {
+		memcpy(&buffer[i * sizeof(struct prof_sample)],
+			&samples[(sample_tail + i) & (PROF_SAMPLES - 1)], sizeof(struct prof_sample));
+	}
+	sample_tail += want;
+	int_restore(flags);
+
+	return want * sizeof(struct prof_sample);
+}
+
+static int check_prof(fs_node_t * node) {
+	return (sample_head != sample_tail || !running) ? 0 : 1;
+}
+
+static int wait_prof(fs_node_t * node, void * process) {
+	if (!list_find(alert_waiters, process)) {
+		list_insert(alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, node);
+	return 0;
+}
+
+static void close_prof(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * prof_device_create(void) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	strcpy(fnode->name, "prof");
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask = 0600;
+	fnode->flags   = FS_CHARDEVICE;
+	fnode->read    = read_prof;
+	fnode->close   = close_prof;
+	fnode->ioctl   = ioctl_prof;
+	fnode->selectcheck = check_prof;
+	fnode->selectwait  = wait_prof;
+	return fnode;
+}
+
+static int prof_initialize(void) {
+	readers = list_create();
+	alert_waiters = list_create();
+	prof_node = prof_device_create();
+	vfs_mount("/dev/prof", prof_node);
+	return 0;
+}
+
+static int prof_finalize(void) {
+	prof_stop();
+	return 0;
+}
+
+MODULE_DEF(prof, prof_initialize, prof_finalize);
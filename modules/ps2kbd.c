@@ -16,6 +16,7 @@
 #include <kernel/pipe.h>
 #include <kernel/process.h>
 #include <kernel/module.h>
+#include <kernel/input.h>
 
 #define KEY_DEVICE  0x60
 #define KEY_PENDING 0x64
@@ -38,7 +39,11 @@ static int keyboard_handler(struct regs *r) {
 	if (inportb(KEY_PENDING) & 0x01) {
 		scancode = inportb(KEY_DEVICE);
 
-		write_fs(keyboard_pipe, 0, 1, (uint8_t []){scancode});
+		input_key(scancode);
+		/* Nobody may be reading /dev/kbd any more; don't block in here on a full pipe */
+		if (pipe_unsize(keyboard_pipe) > 0) {
+			write_fs(keyboard_pipe, 0, 1, (uint8_t []){scancode});
+		}
 	}
 
 	irq_ack(KEY_IRQ);
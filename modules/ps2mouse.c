@@ -11,6 +11,7 @@
 #include <kernel/pipe.h>
 #include <kernel/module.h>
 #include <kernel/mouse.h>
+#include <kernel/input.h>
 #include <kernel/args.h>
 
 static uint8_t mouse_cycle = 0;
@@ -144,6 +145,8 @@ finish_packet:
 			}
 		}
 
+		input_relative(packet.x_difference, packet.y_difference, packet.buttons);
+
 		mouse_device_packet_t bitbucket;
 		while (pipe_size(mouse_pipe) > (int)(DISCARD_POINT * sizeof(packet))) {
 			read_fs(mouse_pipe, 0, sizeof(packet), (uint8_t *)&bitbucket);
@@ -13,11 +13,7 @@
 #include <kernel/module.h>
 
 static uint32_t read_random(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
-	uint32_t s = 0;
-	while (s < size) {
-		buffer[s] = krand() % 0xFF;
-		s++;
-	}
+	random_get_bytes(buffer, size);
 	return size;
 }
 
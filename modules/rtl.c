@@ -50,8 +50,6 @@ static uint8_t * rtl_rx_buffer;
 static uint8_t * rtl_tx_buffer[5];
 static uint8_t mac[6];
 
-static uint8_t * last_packet = NULL;
-
 static uintptr_t rtl_rx_phys;
 static uintptr_t rtl_tx_phys[5];
 
@@ -74,24 +72,22 @@ static int next_tx_buf(void) {
 	return out;
 }
 
-void* rtl_dequeue() {
+struct netbuf * rtl_dequeue() {
 	while (!net_queue->length) {
 		sleep_on(rx_wait);
 	}
 
 	spin_lock(net_queue_lock);
 	node_t * n = list_dequeue(net_queue);
-	void* value = (struct ethernet_packet *)n->value;
-	free(n);
 	spin_unlock(net_queue_lock);
 
-	return value;
+	return n->value;
 }
 
-void rtl_enqueue(void * buffer) {
+void rtl_enqueue(struct netbuf * nb) {
 	/* XXX size? source? */
 	spin_lock(net_queue_lock);
-	list_insert(net_queue, buffer);
+	list_append(net_queue, &nb->node);
 	spin_unlock(net_queue_lock);
 }
 
@@ -107,8 +103,8 @@ void rtl_send_packet(uint8_t* payload, size_t payload_size) {
 	outportl(rtl_iobase + RTL_PORT_TXSTAT + 4 * my_tx, payload_size);
 }
 
-struct ethernet_packet* rtl_get_packet(void) {
-	return (struct ethernet_packet*)rtl_dequeue();
+struct netbuf* rtl_get_packet(void) {
+	return rtl_dequeue();
 }
 
 static int rtl_irq_handler(struct regs *r) {
@@ -137,21 +133,22 @@ static int rtl_irq_handler(struct regs *r) {
 
 			if (rx_status & (0x0020 | 0x0010 | 0x0004 | 0x0002)) {
 				debug_print(WARNING, "rx error :(");
-			} else {
+			} else if (rx_size <= NETBUF_SIZE - NETBUF_HEADROOM) {
 				uint8_t * buf_8 = (uint8_t *)&(buf_start[1]);
 
-				last_packet = malloc(rx_size);
+				struct netbuf * nb = netbuf_alloc();
+				nb->len = rx_size;
 
 				uintptr_t packet_end = (uintptr_t)buf_8 + rx_size;
 				if (packet_end > (uintptr_t)rtl_rx_buffer + 0x2000) {
 					size_t s = ((uintptr_t)rtl_rx_buffer + 0x2000) - (uintptr_t)buf_8;
-					memcpy(last_packet, buf_8, s);
-					memcpy((void *)((uintptr_t)last_packet + s), rtl_rx_buffer, rx_size - s);
+					memcpy(nb->data, buf_8, s);
+					memcpy(nb->data + s, rtl_rx_buffer, rx_size - s);
 				} else {
-					memcpy(last_packet, buf_8, rx_size);
+					memcpy(nb->data, buf_8, rx_size);
 				}
 
-				rtl_enqueue(last_packet);
+				rtl_enqueue(nb);
 			}
 
 			cur_rx = (cur_rx + rx_size + 4 + 3) & ~3;
@@ -192,8 +189,11 @@ static void rtl_netd(void * data, char * name) {
 		outportl(rtl_iobase + RTL_PORT_TXSTAT + 4 * my_tx, packet_size);
 	}
 
-	sleep_on(rx_wait);
-	parse_dns_response(tty, last_packet);
+	{
+		struct netbuf * nb = rtl_get_packet();
+		parse_dns_response(tty, nb->data);
+		netbuf_free(nb);
+	}
 
 	{
 		fprintf(tty, "Sending DNS query...\n");
@@ -213,8 +213,11 @@ static void rtl_netd(void * data, char * name) {
 		outportl(rtl_iobase + RTL_PORT_TXSTAT + 4 * my_tx, packet_size);
 	}
 
-	sleep_on(rx_wait);
-	parse_dns_response(tty, last_packet);
+	{
+		struct netbuf * nb = rtl_get_packet();
+		parse_dns_response(tty, nb->data);
+		netbuf_free(nb);
+	}
 
 	seq_no = krand();
 
@@ -39,50 +39,137 @@ static pty_t ** pty_for_port(int port) {
 	__builtin_unreachable();
 }
 
-static int serial_rcvd(int device) {
-	return inportb(device + 5) & 1;
+/*
+ * Output is queued here and fed to the UART sixteen bytes at a time from
+ * the transmit-empty interrupt, so a burst of logging doesn't spin on the
+ * line status register for every character.
+ */
+#define SERIAL_TX_SIZE    4096
+#define SERIAL_TX_MASK    (SERIAL_TX_SIZE - 1)
+#define SERIAL_FIFO_DEPTH 16
+
+#define SERIAL_IER_RX 0x01
+#define SERIAL_IER_TX 0x02
+
+struct serial_tx {
+	uint8_t buffer[SERIAL_TX_SIZE];
+	volatile size_t head; /* Next byte to queue */
+	volatile size_t tail; /* Next byte to send */
+};
+
+static struct serial_tx _serial_tx_a;
+static struct serial_tx _serial_tx_b;
+static struct serial_tx _serial_tx_c;
+static struct serial_tx _serial_tx_d;
+
+static struct serial_tx * tx_for_port(int port) {
+	switch (port) {
+		case SERIAL_PORT_A: return &_serial_tx_a;
+		case SERIAL_PORT_B: return &_serial_tx_b;
+		case SERIAL_PORT_C: return &_serial_tx_c;
+		case SERIAL_PORT_D: return &_serial_tx_d;
+	}
+	__builtin_unreachable();
 }
 
-static char serial_recv(int device) {
-	while (serial_rcvd(device) == 0) ;
-	return inportb(device);
+static int serial_rcvd(int device) {
+	return inportb(device + 5) & 1;
 }
 
 static int serial_transmit_empty(int device) {
 	return inportb(device + 5) & 0x20;
 }
 
-static void serial_send(int device, char out) {
-	while (serial_transmit_empty(device) == 0);
-	outportb(device, out);
+/*
+ * Top up the FIFO if the transmitter has drained it, and only ask for the
+ * transmit-empty interrupt while there is still something queued.
+ * Call with interrupts off.
+ */
+static void serial_tx_fill(int port) {
+	struct serial_tx * tx = tx_for_port(port);
+
+	if (serial_transmit_empty(port)) {
+		int sent = 0;
+		while (sent < SERIAL_FIFO_DEPTH && tx->tail != tx->head) {
+			outportb(port, tx->buffer[tx->tail]);
+			tx->tail = (tx->tail + 1) & SERIAL_TX_MASK;
+			sent++;
+		}
+	}
+
+	outportb(port + 1, (tx->tail != tx->head) ? (SERIAL_IER_RX | SERIAL_IER_TX) : SERIAL_IER_RX);
 }
 
-static int serial_handler_ac(struct regs *r) {
-	char serial;
-	int  port = 0;
-	if (inportb(SERIAL_PORT_A+1) & 0x01) {
-		port = SERIAL_PORT_A;
-	} else {
-		port = SERIAL_PORT_C;
+/* Logging can reach us from interrupt handlers, hence int_save() */
+static void serial_send_block(int port, uint8_t * buf, size_t len) {
+	struct serial_tx * tx = tx_for_port(port);
+
+	uint32_t flags = int_save();
+	while (len) {
+		size_t space = (tx->tail - tx->head - 1) & SERIAL_TX_MASK;
+		if (!space) {
+			/* Queue is full; fall back to waiting on the UART ourselves */
+			while (!serial_transmit_empty(port));
+			serial_tx_fill(port);
+			continue;
+		}
+		if (space > len) space = len;
+		for (size_t i = 0; i < space; ++i) {
+			tx->buffer[tx->head] = buf[i];
+			tx->head = (tx->head + 1) & SERIAL_TX_MASK;
+		}
+		buf += space;
+		len -= space;
 	}
-	serial = serial_recv(port);
+	serial_tx_fill(port);
+	int_restore(flags);
+}
+
+/*
+ * Serve everything the UART has pending: received bytes go to the TTY
+ * in one block, and an emptied transmitter gets the next batch.
+ */
+static void serial_service(int port) {
+	uint8_t iir;
+	while (!((iir = inportb(port + 2)) & 0x01)) {
+		switch (iir & 0x0E) {
+			case 0x04: /* Received data */
+			case 0x0C: /* Receive timeout */
+			{
+				uint8_t buf[SERIAL_FIFO_DEPTH];
+				size_t count = 0;
+				while (count < sizeof(buf) && serial_rcvd(port)) {
+					buf[count++] = inportb(port);
+				}
+				if (count && *pty_for_port(port)) {
+					tty_input_process_block(*pty_for_port(port), buf, count);
+				}
+				break;
+			}
+			case 0x02: /* Transmitter empty */
+				serial_tx_fill(port);
+				break;
+			case 0x06: /* Line status */
+				inportb(port + 5);
+				break;
+			default: /* Modem status */
+				inportb(port + 6);
+				break;
+		}
+	}
+}
+
+static int serial_handler_ac(struct regs *r) {
+	serial_service(SERIAL_PORT_A);
+	serial_service(SERIAL_PORT_C);
 	irq_ack(SERIAL_IRQ_AC);
-	tty_input_process(*pty_for_port(port), serial);
 	return 1;
 }
 
 static int serial_handler_bd(struct regs *r) {
-	char serial;
-	int  port = 0;
-	debug_print(NOTICE, "Received something on secondary port");
-	if (inportb(SERIAL_PORT_B+1) & 0x01) {
-		port = SERIAL_PORT_B;
-	} else {
-		port = SERIAL_PORT_D;
-	}
-	serial = serial_recv(port);
+	serial_service(SERIAL_PORT_B);
+	serial_service(SERIAL_PORT_D);
 	irq_ack(SERIAL_IRQ_BD);
-	tty_input_process(*pty_for_port(port), serial);
 	return 1;
 }
 
@@ -94,17 +181,28 @@ static void serial_enable(int port) {
 	outportb(port + 3, 0x03); /* Disable divisor mode, set parity */
 	outportb(port + 2, 0xC7); /* Enable FIFO and clear */
 	outportb(port + 4, 0x0B); /* Enable interrupts */
-	outportb(port + 1, 0x01); /* Enable interrupts */
+	outportb(port + 1, SERIAL_IER_RX); /* Transmit interrupts only while output is queued */
 }
 
 static int have_installed_ac = 0;
 static int have_installed_bd = 0;
 
+static int port_for_pty(pty_t * pty) {
+	if (pty == _serial_port_pty_a) return SERIAL_PORT_A;
+	if (pty == _serial_port_pty_b) return SERIAL_PORT_B;
+	if (pty == _serial_port_pty_c) return SERIAL_PORT_C;
+	if (pty == _serial_port_pty_d) return SERIAL_PORT_D;
+	return 0;
+}
+
 static void serial_write_out(pty_t * pty, uint8_t c) {
-	if (pty == _serial_port_pty_a) serial_send(SERIAL_PORT_A, c);
-	if (pty == _serial_port_pty_b) serial_send(SERIAL_PORT_B, c);
-	if (pty == _serial_port_pty_c) serial_send(SERIAL_PORT_C, c);
-	if (pty == _serial_port_pty_d) serial_send(SERIAL_PORT_D, c);
+	int port = port_for_pty(pty);
+	if (port) serial_send_block(port, &c, 1);
+}
+
+static void serial_write_out_block(pty_t * pty, uint8_t * buf, size_t len) {
+	int port = port_for_pty(pty);
+	if (port) serial_send_block(port, buf, len);
 }
 
 #define DEV_PATH "/dev/"
@@ -124,6 +222,7 @@ static fs_node_t * serial_device_create(int port) {
 	pty_t * pty = pty_new(NULL);
 	*pty_for_port(port) = pty;
 	pty->write_out = serial_write_out;
+	pty->write_out_block = serial_write_out_block;
 	pty->fill_name = serial_fill_name;
 
 	serial_enable(port);
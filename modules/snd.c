@@ -23,6 +23,9 @@
 #define N_ELEMENTS(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 #define SND_BUF_SIZE 0x4000
+#define SND_MIX_CHUNK 0x100 /* Samples (one channel) mixed at a time */
+#define SND_CONVERT_FRAMES 0x100 /* Frames converted at a time */
+#define SND_DEFAULT_RATE 48000
 
 static uint32_t snd_dsp_write(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer);
 static int snd_dsp_ioctl(fs_node_t * node, int request, void * argp);
@@ -58,11 +61,29 @@ static spin_lock_t _buffers_lock;
 static list_t _buffers;
 static uint32_t _next_device_id = SND_DEVICE_MAIN;
 
+/*
+ * Streams are mixed by the sound card driver's refill tasklet, not its
+ * interrupt handler, so ordinary locks do: _buffers_lock keeps the
+ * list of streams still while it is walked, and each stream's data is
+ * guarded by its own ring buffer's lock.
+ */
 struct dsp_node {
 	ring_buffer_t * rb;
 	size_t samples;
 	size_t written;
 	int realtime;
+	uint32_t gain; /* SND_GAIN_UNITY is unchanged */
+	uint32_t underruns; /* Times it ran dry while playing */
+
+	/* Conversion from what the writer gives us */
+	snd_dsp_format_t format;
+	int native;       /* Already in the device's format */
+	uint32_t step;    /* Input frames per output frame, 16.16 */
+	uint32_t phase;   /* Position of the next output frame past `prev`, 16.16 */
+	int16_t prev[2];  /* Last two input frames, already converted to 16-bit stereo */
+	int16_t next[2];
+	uint8_t carry[4]; /* Part of a frame left over from the last write */
+	size_t carry_len;
 };
 
 int snd_register(snd_device_t * device) {
@@ -102,11 +123,127 @@ snd_unregister_cleanup:
 	return rv;
 }
 
+static snd_device_t * snd_main_device() {
+	spin_lock(_devices_lock);
+	foreach(node, &_devices) {
+		spin_unlock(_devices_lock);
+		return node->value;
+	}
+
+	spin_unlock(_devices_lock);
+	return NULL;
+}
+
+static uint32_t snd_output_rate(void) {
+	snd_device_t * device = snd_main_device();
+	return (device && device->playback_speed) ? device->playback_speed : SND_DEFAULT_RATE;
+}
+
+/*
+ * Queue converted frames, dropping what doesn't fit for realtime streams.
+ */
+static void snd_dsp_queue(struct dsp_node * dsp, int16_t * frames, size_t count) {
+	size_t bytes = count * 4;
+	if (dsp->realtime) {
+		size_t s = ring_buffer_available(dsp->rb) & ~0x3;
+		if (bytes > s) bytes = s;
+	}
+	dsp->written += ring_buffer_write(dsp->rb, bytes, (uint8_t *)frames) / 4;
+}
+
+/* One input frame as 16-bit stereo */
+static inline void snd_dsp_frame(struct dsp_node * dsp, uint8_t * in, int16_t * frame) {
+	if (dsp->format.bits == 16) {
+		frame[0] = (int16_t)(in[0] | (in[1] << 8));
+		frame[1] = dsp->format.channels == 2 ? (int16_t)(in[2] | (in[3] << 8)) : frame[0];
+	} else {
+		frame[0] = (int16_t)((in[0] - 128) << 8);
+		frame[1] = dsp->format.channels == 2 ? (int16_t)((in[1] - 128) << 8) : frame[0];
+	}
+}
+
+/*
+ * Convert a writer's frames to the device's format and rate in blocks.
+ * Rates are converted by linear interpolation between input frames;
+ * each input frame produces however many output frames fall between
+ * it and the one before.
+ */
+static uint32_t snd_dsp_convert(struct dsp_node * dsp, uint32_t size, uint8_t * buffer) {
+	int16_t block[SND_CONVERT_FRAMES * 2];
+	size_t frame_size = dsp->format.channels * dsp->format.bits / 8;
+	size_t out = 0;
+	uint32_t used = 0;
+
+	while (used < size) {
+		uint8_t * in;
+		if (dsp->carry_len || size - used < frame_size) {
+			size_t take = MIN(frame_size - dsp->carry_len, size - used);
+			memcpy(dsp->carry + dsp->carry_len, buffer + used, take);
+			dsp->carry_len += take;
+			used += take;
+			if (dsp->carry_len < frame_size) break;
+			dsp->carry_len = 0;
+			in = dsp->carry;
+		} else {
+			in = buffer + used;
+			used += frame_size;
+		}
+
+		dsp->prev[0] = dsp->next[0];
+		dsp->prev[1] = dsp->next[1];
+		snd_dsp_frame(dsp, in, dsp->next);
+
+		while (dsp->phase < 0x10000) {
+			/* Scaled down a bit so the product fits in 32 bits */
+			int32_t t = dsp->phase >> 1;
+			block[out * 2]     = dsp->prev[0] + (((dsp->next[0] - dsp->prev[0]) * t) >> 15);
+			block[out * 2 + 1] = dsp->prev[1] + (((dsp->next[1] - dsp->prev[1]) * t) >> 15);
+			dsp->phase += dsp->step;
+			if (++out == SND_CONVERT_FRAMES) {
+				snd_dsp_queue(dsp, block, out);
+				out = 0;
+			}
+		}
+		dsp->phase -= 0x10000;
+	}
+
+	if (out) {
+		snd_dsp_queue(dsp, block, out);
+	}
+
+	return size;
+}
+
+/*
+ * Settle on the nearest format we can convert from and start converting
+ * from scratch.
+ */
+static void snd_dsp_set_format(struct dsp_node * dsp, snd_dsp_format_t * format) {
+	uint32_t rate = snd_output_rate();
+
+	if (format->rate < SND_DSP_MIN_RATE) format->rate = SND_DSP_MIN_RATE;
+	if (format->rate > SND_DSP_MAX_RATE) format->rate = SND_DSP_MAX_RATE;
+	if (format->channels != 1) format->channels = 2;
+	if (format->bits != 8) format->bits = 16;
+
+	memcpy(&dsp->format, format, sizeof(snd_dsp_format_t));
+	dsp->native = (format->rate == rate && format->channels == 2 && format->bits == 16);
+	dsp->step = (uint32_t)(((uint64_t)format->rate << 16) / rate);
+	dsp->phase = 0;
+	dsp->prev[0] = dsp->prev[1] = 0;
+	dsp->next[0] = dsp->next[1] = 0;
+	dsp->carry_len = 0;
+}
+
 static uint32_t snd_dsp_write(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
 	if (!_devices.length) return -1; /* No sink available. */
 
 	struct dsp_node * dsp = node->device;
 
+	if (!dsp->native) {
+		return snd_dsp_convert(dsp, size, buffer);
+	}
+
 	size_t s = ring_buffer_available(dsp->rb);
 	size_t out;
 	if (size > s && dsp->realtime) {
@@ -120,12 +257,60 @@ static uint32_t snd_dsp_write(fs_node_t * node, uint64_t offset, uint32_t size,
 }
 
 static int snd_dsp_ioctl(fs_node_t * node, int request, void * argp) {
-	/* Potentially use this to set sample rates in the future */
 	struct dsp_node * dsp = node->device;
 	if (request == 4) {
 		dsp->realtime = 1;
 	} else if (request == 5) {
 		return dsp->samples;
+	} else if (request == SND_DSP_SET_GAIN) {
+		if (!argp) return -EINVAL;
+		validate(argp);
+		uint32_t gain = *(uint32_t *)argp;
+		dsp->gain = gain > SND_GAIN_MAX ? SND_GAIN_MAX : gain;
+		return 0;
+	} else if (request == SND_DSP_GET_GAIN) {
+		if (!argp) return -EINVAL;
+		validate(argp);
+		*(uint32_t *)argp = dsp->gain;
+		return 0;
+	} else if (request == SND_DSP_SET_FORMAT) {
+		if (!argp) return -EINVAL;
+		validate(argp);
+		snd_dsp_set_format(dsp, argp);
+		return 0;
+	} else if (request == SND_DSP_GET_FORMAT) {
+		if (!argp) return -EINVAL;
+		validate(argp);
+		memcpy(argp, &dsp->format, sizeof(snd_dsp_format_t));
+		return 0;
+	} else if (request == SND_DSP_SET_LATENCY || request == SND_DSP_GET_LATENCY) {
+		if (!argp) return -EINVAL;
+		validate(argp);
+		snd_dsp_latency_t * latency = argp;
+		if (request == SND_DSP_SET_LATENCY) {
+			/* Smaller buffers mean less queued ahead of what is playing now */
+			uint32_t want = latency->buffer;
+			uint32_t size = SND_DSP_MIN_BUFFER;
+			while (size < want && size < SND_DSP_MAX_BUFFER) size <<= 1;
+			if (size != dsp->rb->size) {
+				int ret = ring_buffer_resize(dsp->rb, size);
+				if (ret) return ret;
+			}
+		}
+		snd_device_t * device = snd_main_device();
+		latency->buffer = dsp->rb->size;
+		latency->period = device ? device->playback_period : 0;
+		return 0;
+	} else if (request == SND_DSP_GET_STATS) {
+		if (!argp) return -EINVAL;
+		validate(argp);
+		snd_dsp_stats_t * stats = argp;
+		snd_device_t * device = snd_main_device();
+		stats->periods   = device ? device->periods : 0;
+		stats->underruns = device ? device->underruns : 0;
+		stats->stream_underruns = dsp->underruns;
+		stats->queued = ring_buffer_unread(dsp->rb);
+		return 0;
 	}
 	return -1;
 }
@@ -142,6 +327,10 @@ static void snd_dsp_open(fs_node_t * node, unsigned int flags) {
 	dsp->samples = 0;
 	dsp->written = 0;
 	dsp->realtime = 0;
+	dsp->gain = SND_GAIN_UNITY;
+	dsp->underruns = 0;
+	snd_dsp_format_t format = { snd_output_rate(), 2, 16 };
+	snd_dsp_set_format(dsp, &format);
 	node->device = dsp;
 	spin_lock(_buffers_lock);
 	list_insert(&_buffers, node->device);
@@ -151,8 +340,10 @@ static void snd_dsp_open(fs_node_t * node, unsigned int flags) {
 static void snd_dsp_close(fs_node_t * node) {
 	struct dsp_node * dsp = node->device;
 	spin_lock(_buffers_lock);
-	list_delete(&_buffers, list_find(&_buffers, dsp));
+	node_t * buf_node = list_find(&_buffers, dsp);
+	list_delete(&_buffers, buf_node);
 	spin_unlock(_buffers_lock);
+	free(buf_node);
 
 	ring_buffer_destroy(dsp->rb);
 	free(dsp->rb);
@@ -233,51 +424,62 @@ static void snd_mixer_close(fs_node_t * node) {
 	return;
 }
 
-int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer) {
-	static int16_t tmp_buf[0x100];
-
-	memset(buffer, 0, size);
-
-	spin_lock(_buffers_lock);
-	foreach(buf_node, &_buffers) {
-		struct dsp_node * dsp = buf_node->value;
-		ring_buffer_t * buf = dsp->rb;
-		/* ~0x3 is to ensure we don't read partial samples or just a single channel */
-		size_t bytes_left = MIN(ring_buffer_unread(buf) & ~0x3, size);
-		int16_t * adding_ptr = (int16_t *) buffer;
-		while (bytes_left) {
-			size_t this_read_size = MIN(bytes_left, sizeof(tmp_buf));
-			ring_buffer_read(buf, this_read_size, (uint8_t *)tmp_buf);
-			dsp->samples += this_read_size / 4; /* 16 bits, 2 channels */
-			/*
-			 * Reduce the sample by a half so that multiple sources won't immediately
-			 * cause awful clipping. This is kind of a hack since it would probably be
-			 * better to just use some kind of compressor.
-			 */
-			for (size_t i = 0; i < N_ELEMENTS(tmp_buf); i++) {
-				tmp_buf[i] /= 2;
-			}
-			for (size_t i = 0; i < this_read_size / sizeof(*adding_ptr); i++) {
-				adding_ptr[i] += tmp_buf[i];
-			}
-			adding_ptr += this_read_size / sizeof(*adding_ptr);
-			bytes_left -= this_read_size;
+/*
+ * Add a stream's samples into the mix, scaled by its gain. The mix is
+ * kept at 32 bits so any number of streams can be summed before the
+ * result is clipped, once, into the output.
+ */
+static void snd_mix(int32_t * mix, int16_t * samples, size_t count, uint32_t gain) {
+	if (gain == SND_GAIN_UNITY) {
+		for (size_t i = 0; i < count; i++) {
+			mix[i] += samples[i];
+		}
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			mix[i] += (samples[i] * (int32_t)gain) / SND_GAIN_UNITY;
 		}
 	}
-	spin_unlock(_buffers_lock);
+}
 
-	return size;
+static inline int16_t snd_clip(int32_t sample) {
+	if (sample > INT16_MAX) return INT16_MAX;
+	if (sample < INT16_MIN) return INT16_MIN;
+	return sample;
 }
 
-static snd_device_t * snd_main_device() {
-	spin_lock(_devices_lock);
-	foreach(node, &_devices) {
-		spin_unlock(_devices_lock);
-		return node->value;
+int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer) {
+	static int16_t tmp_buf[SND_MIX_CHUNK];
+	static int32_t mix_buf[SND_MIX_CHUNK];
+
+	int16_t * out = (int16_t *)buffer;
+	size_t total = size / sizeof(*out);
+
+	for (size_t done = 0; done < total; done += SND_MIX_CHUNK) {
+		size_t count = MIN(total - done, SND_MIX_CHUNK);
+		memset(mix_buf, 0, count * sizeof(*mix_buf));
+
+		spin_lock(_buffers_lock);
+		foreach(buf_node, &_buffers) {
+			struct dsp_node * dsp = buf_node->value;
+			/* ~0x3 is to ensure we don't read partial samples or just a single channel */
+			size_t bytes = MIN(ring_buffer_unread(dsp->rb), count * sizeof(*tmp_buf)) & ~0x3;
+			if (!bytes) continue;
+			if (bytes < count * sizeof(*tmp_buf)) {
+				dsp->underruns++;
+			}
+			/* We are its only reader and there is data, so this won't sleep */
+			bytes = ring_buffer_read(dsp->rb, bytes, (uint8_t *)tmp_buf);
+			dsp->samples += bytes / 4; /* 16 bits, 2 channels */
+			snd_mix(mix_buf, tmp_buf, bytes / sizeof(*tmp_buf), dsp->gain);
+		}
+		spin_unlock(_buffers_lock);
+
+		for (size_t i = 0; i < count; i++) {
+			out[done + i] = snd_clip(mix_buf[i]);
+		}
 	}
 
-	spin_unlock(_devices_lock);
-	return NULL;
+	return size;
 }
 
 #if 0
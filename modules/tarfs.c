@@ -4,10 +4,16 @@
  * Copyright (C) 2018 K. Lange
  *
  * tarfs - Allows read-only mounting of ustar archives
+ *
+ * The archive's headers are read once at mount time into a tree of
+ * entries, one per file, with a name hash and an ordered child list for
+ * each directory; lookups and directory listings after that never go
+ * back to the archive. File data is still read from the device.
  */
 #include <kernel/system.h>
 #include <kernel/types.h>
 #include <kernel/fs.h>
+#include <kernel/slab.h>
 #include <kernel/logging.h>
 #include <kernel/module.h>
 #include <kernel/args.h>
@@ -19,9 +25,32 @@
 
 #define TARFS_LOG_LEVEL WARNING
 
+struct tarfs_entry {
+	char * name;            /* Last path component */
+	uint32_t inode;         /* Index in tarfs->entries */
+	unsigned int offset;    /* Of the header; data follows it */
+	unsigned int size;
+	unsigned int mode;
+	unsigned int uid;
+	unsigned int gid;
+	char type;              /* ustar type flag */
+	char * link;            /* Symlink target */
+
+	/* Directories only */
+	hashmap_t * by_name;
+	struct tarfs_entry ** children; /* In archive order */
+	uint32_t child_count;
+	uint32_t child_space;
+};
+
 struct tarfs {
 	fs_node_t * device;
 	unsigned int length;
+
+	/* Indexed by inode number; the root is 0 */
+	struct tarfs_entry ** entries;
+	uint32_t entry_count;
+	uint32_t entry_space;
 };
 
 struct ustar {
@@ -104,292 +133,264 @@ static unsigned int round_to_512(unsigned int i) {
 	return i + (512 - t);
 }
 
-static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out);
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset);
-
-#ifndef strncat
-static char * strncat(char *dest, const char *src, size_t n) {
-	char * end = dest;
-	while (*end != '\0') {
-		++end;
-	}
-	size_t i = 0;
-	while (*src && i < n) {
-		*end = *src;
-		end++;
-		src++;
-		i++;
+static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
+	read_fs(self->device, offset, sizeof(struct ustar), (unsigned char*)out);
+	if (out->ustar[0] != 'u' ||
+		out->ustar[1] != 's' ||
+		out->ustar[2] != 't' ||
+		out->ustar[3] != 'a' ||
+		out->ustar[4] != 'r') {
+		return 0;
 	}
-	*end = '\0';
-	return dest;
+	return 1;
 }
-#endif
 
-static int count_slashes(char * string) {
-	int i = 0;
-	char * s = strstr(string, "/");
-	while (s) {
-		if (*(s+1) == '\0') return i;
-		i++;
-		s = strstr(s+1,"/");
+/*
+ * Append a header field, which is only NUL-terminated if it is short.
+ */
+static char * copy_field(char * out, char * field, size_t len) {
+	for (size_t i = 0; i < len && field[i]; ++i) {
+		*out++ = field[i];
 	}
-	return i;
+	*out = '\0';
+	return out;
 }
 
-static struct dirent * readdir_tar_root(fs_node_t *node, uint32_t index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, ".");
-		return out;
+static struct tarfs_entry * tarfs_new_entry(struct tarfs * self, char * name, char type) {
+	struct tarfs_entry * entry = malloc(sizeof(struct tarfs_entry));
+	memset(entry, 0, sizeof(struct tarfs_entry));
+	entry->name = strdup(name);
+	entry->type = type;
+	entry->mode = 0555;
+	if (type == '5') {
+		entry->by_name = hashmap_create(8);
 	}
 
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, "..");
-		return out;
+	if (self->entry_count == self->entry_space) {
+		self->entry_space = self->entry_space ? self->entry_space * 2 : 64;
+		self->entries = realloc(self->entries, sizeof(struct tarfs_entry *) * self->entry_space);
 	}
+	entry->inode = self->entry_count;
+	self->entries[self->entry_count++] = entry;
+	return entry;
+}
 
-	index -= 2;
-
-	struct tarfs * self = node->device;
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+static void tarfs_add_child(struct tarfs_entry * dir, struct tarfs_entry * child) {
+	if (dir->child_count == dir->child_space) {
+		dir->child_space = dir->child_space ? dir->child_space * 2 : 8;
+		dir->children = realloc(dir->children, sizeof(struct tarfs_entry *) * dir->child_space);
+	}
+	dir->children[dir->child_count++] = child;
+	hashmap_set(dir->by_name, child->name, child);
+}
 
-		char filename_workspace[256];
-
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (!count_slashes(filename_workspace)) {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0'; /* remove trailing slash */
-			if (strlen(filename_workspace)) {
-				if (index == 0) {
-					struct dirent * out = malloc(sizeof(struct dirent));
-					memset(out, 0x00, sizeof(struct dirent));
-					out->ino = offset;
-					strcpy(out->name, filename_workspace);
-					free(file);
-					return out;
-				} else {
-					index--;
-				}
+/*
+ * Walk `path` (modified in place) from the root. With `create`, missing
+ * directories along the way are made up, as archives needn't list them.
+ */
+static struct tarfs_entry * tarfs_walk(struct tarfs * self, char * path, int create) {
+	struct tarfs_entry * dir = self->entries[0];
+	char * save;
+	char * part = strtok_r(path, "/", &save);
+	while (part) {
+		if (dir->type != '5') return NULL;
+		if (strcmp(part, ".")) {
+			struct tarfs_entry * next = hashmap_get(dir->by_name, part);
+			if (!next) {
+				if (!create) return NULL;
+				next = tarfs_new_entry(self, part, '5');
+				tarfs_add_child(dir, next);
 			}
+			dir = next;
 		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-
+		part = strtok_r(NULL, "/", &save);
 	}
-
-	free(file);
-	return NULL;
+	return dir;
 }
 
-static uint32_t read_tarfs(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
-	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-	size_t file_size = interpret_size(file);
-
-	if (offset > file_size) return 0;
-	if (offset + size > file_size) {
-		size = file_size - offset;
-	}
-
-	free(file);
-
-	return read_fs(self->device, offset + node->inode + 512, size, buffer);
-}
+/*
+ * Read every header in the archive into the entry tree.
+ */
+static void tarfs_index(struct tarfs * self) {
+	tarfs_new_entry(self, "", '5');
 
-static struct dirent * readdir_tarfs(fs_node_t *node, uint32_t index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, ".");
-		return out;
-	}
+	struct ustar * file = malloc(sizeof(struct ustar));
+	char path[260];
+	char link[101];
+	unsigned int offset = 0;
 
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->ino = 0;
-		strcpy(out->name, "..");
-		return out;
-	}
+	while (offset + 512 <= self->length && ustar_from_offset(self, offset, file)) {
+		unsigned int size = interpret_size(file);
+		unsigned int next = offset + 512 + round_to_512(size);
+		char type = file->type[0] ? file->type[0] : '0';
 
-	index -= 2;
+		if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+			/* Extended headers; not supported */
+			offset = next;
+			continue;
+		}
 
-	struct tarfs * self = node->device;
+		char * end = copy_field(path, file->prefix, 155);
+		if (end != path) *end++ = '/';
+		end = copy_field(end, file->filename, 100);
+		while (end > path && end[-1] == '/') *--end = '\0';
 
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = node->inode;
+		char * slash = strrchr(path, '/');
+		char * base = slash ? slash + 1 : path;
+		if (slash) *slash = '\0';
 
-	/* Read myself */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	int status = ustar_from_offset(self, node->inode, file);
-	char my_filename[256];
+		if (!*base || !strcmp(base, ".")) {
+			/* The archive's own top directory */
+			offset = next;
+			continue;
+		}
 
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
+		struct tarfs_entry * dir = tarfs_walk(self, slash ? path : "", 1);
+		if (!dir || dir->type != '5') {
+			debug_print(WARNING, "tarfs: %s is not under a directory", base);
+			offset = next;
+			continue;
+		}
 
-	while (offset < self->length) {
-		ustar_from_offset(self, offset, file);
+		copy_field(link, file->link, 100);
 
-		if (!status) {
-			free(file);
-			return NULL;
+		struct tarfs_entry * entry = hashmap_get(dir->by_name, base);
+		if (!entry) {
+			entry = tarfs_new_entry(self, base, type);
+			tarfs_add_child(dir, entry);
+		} else if (entry->type != '5' || type != '5') {
+			/* A later copy of the same name replaces the earlier one */
+			entry->type = type;
 		}
 
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (startswith(filename_workspace, my_filename)) {
-			if (!count_slashes(filename_workspace + strlen(my_filename))) {
-				if (strlen(filename_workspace + strlen(my_filename))) {
-					if (index == 0) {
-						char * slash = strstr(filename_workspace+strlen(my_filename),"/");
-						if (slash) *slash = '\0'; /* remove trailing slash */
-						struct dirent * out = malloc(sizeof(struct dirent));
-						memset(out, 0x00, sizeof(struct dirent));
-						out->ino = offset;
-						strcpy(out->name, filename_workspace+strlen(my_filename));
-						free(file);
-						return out;
-					} else {
-						index--;
-					}
-				}
+		entry->offset = offset;
+		entry->size   = size;
+		entry->mode   = interpret_mode(file);
+		entry->uid    = interpret_uid(file);
+		entry->gid    = interpret_gid(file);
+
+		if (type == '1') {
+			/* Hard link; share the data of what it links to */
+			struct tarfs_entry * target = tarfs_walk(self, link, 0);
+			if (target && target->type != '5') {
+				entry->type   = target->type;
+				entry->offset = target->offset;
+				entry->size   = target->size;
+				if (target->link) entry->link = strdup(target->link);
+			} else {
+				debug_print(WARNING, "tarfs: hard link %s has no target", base);
+				entry->size = 0;
 			}
+		} else if (type == '2') {
+			entry->link = strdup(link);
 		}
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+		offset = next;
 	}
 
 	free(file);
-	return NULL;
 }
 
-static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
+static uint32_t read_tarfs(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
 	struct tarfs * self = node->device;
+	struct tarfs_entry * entry = self->entries[node->inode];
 
-	/* find my own filename */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-
-	char my_filename[256];
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	/* Append name */
-	strncat(my_filename, name, strlen(name));
-	if (strlen(my_filename) > 255) {
-		debug_print(CRITICAL, "what");
+	if (offset > entry->size) return 0;
+	if (offset + size > entry->size) {
+		size = entry->size - offset;
 	}
 
-	unsigned int offset = node->inode;
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	return read_fs(self->device, offset + entry->offset + 512, size, buffer);
+}
 
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
+static int readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
+	struct tarfs * self = node->device;
+	struct tarfs_entry * entry = self->entries[node->inode];
+	size_t len = strlen(entry->link);
 
-		if (filename_workspace[strlen(filename_workspace)-1] == '/') {
-			filename_workspace[strlen(filename_workspace)-1] = '\0';
-		}
-		if (!strcmp(filename_workspace, my_filename)) {
-			return file_from_ustar(self, file, offset);
-		}
+	if (size < len + 1) {
+		debug_print(INFO, "Requested read size was only %d, need %d.", size, len+1);
+		memcpy(buf, entry->link, size-1);
+		buf[size-1] = '\0';
+		return size-1;
+	} else {
+		debug_print(INFO, "Reading link target is [%s]", entry->link);
+		memcpy(buf, entry->link, len + 1);
+		return len;
+	}
+}
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+static void dirent_from_entry(uint32_t index, struct tarfs_entry * dir, struct dirent * out) {
+	memset(out, 0x00, sizeof(struct dirent));
+	if (index == 0) {
+		strcpy(out->name, ".");
+	} else if (index == 1) {
+		strcpy(out->name, "..");
+	} else {
+		struct tarfs_entry * child = dir->children[index - 2];
+		out->ino = child->inode;
+		strcpy(out->name, child->name);
 	}
+}
 
+static struct dirent * readdir_tarfs(fs_node_t *node, uint32_t index) {
+	struct tarfs * self = node->device;
+	struct tarfs_entry * dir = self->entries[node->inode];
 
-	free(file);
-	return NULL;
+	if (index >= dir->child_count + 2) return NULL;
+
+	struct dirent * out = slab_alloc(&dirent_cache);
+	dirent_from_entry(index, dir, out);
+	return out;
 }
 
-static int readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
+/*
+ * The cursor is simply the readdir index.
+ */
+static uint32_t getdents_tarfs(fs_node_t *node, uint64_t *offset, struct dirent *entries, uint32_t count) {
 	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
+	struct tarfs_entry * dir = self->entries[node->inode];
+	uint32_t got = 0;
 
-	if (size < strlen(file->link) + 1) {
-		debug_print(INFO, "Requested read size was only %d, need %d.", size, strlen(file->link)+1);
-		memcpy(buf, file->link, size-1);
-		buf[size-1] = '\0';
-		free(file);
-		return size-1;
-	} else {
-		debug_print(INFO, "Reading link target is [%s]", file->link);
-		memcpy(buf, file->link, strlen(file->link) + 1);
-		free(file);
-		return strlen(file->link);
+	while (got < count && *offset < dir->child_count + 2) {
+		dirent_from_entry((uint32_t)*offset, dir, &entries[got]);
+		got++;
+		(*offset)++;
 	}
 
+	return got;
 }
 
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
-	fs_node_t * fs = malloc(sizeof(fs_node_t));
+static fs_node_t * finddir_tarfs(fs_node_t *node, char *name);
+
+static fs_node_t * file_from_entry(struct tarfs * self, uint32_t inode) {
+	struct tarfs_entry * entry = self->entries[inode];
+
+	fs_node_t * fs = slab_alloc(&fs_node_cache);
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
-	fs->inode  = offset;
+	fs->inode  = inode;
 	fs->impl   = 0;
-	char filename_workspace[256];
-	memcpy(fs->name, filename_workspace, strlen(filename_workspace)+1);
+	strcpy(fs->name, entry->name);
 
-	fs->uid = interpret_uid(file);
-	fs->gid = interpret_gid(file);
-	fs->length = interpret_size(file);
-	fs->mask = interpret_mode(file);
+	fs->uid = entry->uid;
+	fs->gid = entry->gid;
+	fs->length = entry->size;
+	fs->mask = entry->mode;
 	fs->nlink = 0; /* Unsupported */
-	fs->flags = FS_FILE;
-	if (file->type[0] == '5') {
-		fs->flags = FS_DIRECTORY;
+	if (entry->type == '5') {
+		fs->flags = FS_DIRECTORY | FS_DCACHE;
+		fs->length = 0;
 		fs->readdir = readdir_tarfs;
+		fs->getdents = getdents_tarfs;
 		fs->finddir = finddir_tarfs;
-	} else if (file->type[0] == '1') {
-		debug_print(ERROR, "Hardlink detected");
-		/* go through file and find target, reassign inode to point to that */
-	} else if (file->type[0] == '2') {
+	} else if (entry->type == '2') {
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
 		fs->flags = FS_FILE;
 		fs->read = read_tarfs;
 	}
-	free(file);
 #if 0
 	/* TODO times are also available from the file */
 	fs->atime = now();
@@ -399,52 +400,13 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 	return fs;
 }
 
-static fs_node_t * finddir_tar_root(fs_node_t *node, char *name) {
+static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
+	struct tarfs_entry * dir = self->entries[node->inode];
+	struct tarfs_entry * child = hashmap_get(dir->by_name, name);
+	if (!child) return NULL;
 
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (count_slashes(filename_workspace)) {
-			/* skip */
-		} else {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0';
-			if (!strcmp(filename_workspace, name)) {
-				return file_from_ustar(self, file, offset);
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
-	free(file);
-	return NULL;
-}
-
-static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
-	read_fs(self->device, offset, sizeof(struct ustar), (unsigned char*)out);
-	if (out->ustar[0] != 'u' ||
-		out->ustar[1] != 's' ||
-		out->ustar[2] != 't' ||
-		out->ustar[3] != 'a' ||
-		out->ustar[4] != 'r') {
-		return 0;
-	}
-	return 1;
+	return file_from_entry(self, child->inode);
 }
 
 static fs_node_t * tar_mount(char * device, char * mount_path) {
@@ -466,21 +428,18 @@ static fs_node_t * tar_mount(char * device, char * mount_path) {
 
 	/* Create a metadata struct for this mount */
 	struct tarfs * self = malloc(sizeof(struct tarfs));
+	memset(self, 0, sizeof(struct tarfs));
 
 	self->device = dev;
 	self->length = dev->length;
 
-	fs_node_t * root = malloc(sizeof(fs_node_t));
-	memset(root, 0, sizeof(fs_node_t));
+	tarfs_index(self);
+	debug_print(NOTICE, "tarfs: indexed %d entries", self->entry_count);
 
+	fs_node_t * root = file_from_entry(self, 0);
 	root->uid     = 0;
 	root->gid     = 0;
-	root->length  = 0;
 	root->mask    = 0555;
-	root->readdir = readdir_tar_root;
-	root->finddir = finddir_tar_root;
-	root->flags   = FS_DIRECTORY;
-	root->device  = self;
 
 	return root;
 }
@@ -495,4 +454,3 @@ static int fini(void) {
 }
 
 MODULE_DEF(tarfs, init, fini);
-
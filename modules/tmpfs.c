@@ -6,6 +6,7 @@
 #include <kernel/system.h>
 #include <kernel/logging.h>
 #include <kernel/fs.h>
+#include <kernel/slab.h>
 #include <kernel/version.h>
 #include <kernel/process.h>
 #include <kernel/mem.h>
@@ -20,15 +21,76 @@
 #define TMPFS_TYPE_DIR  2
 #define TMPFS_TYPE_LINK 3
 
-static char * buf_space = NULL;
+/*
+ * File blocks come from a pool of kernel heap pages, which are mapped
+ * in every address space, so reads and writes copy straight to and from
+ * them. The pool grabs pages from the heap a chunk at a time and hands
+ * a chunk back once every page in it has been freed.
+ */
+#define POOL_CHUNK_PAGES 32
+
+struct tmpfs_chunk {
+	char * base;
+	uint32_t free_map; /* Bit set for each free page */
+	struct tmpfs_chunk * next;
+};
+
+static struct tmpfs_chunk * pool_chunks = NULL;
 
 static spin_lock_t tmpfs_lock = { 0 };
-static spin_lock_t tmpfs_page_lock = { 0 };
+static spin_lock_t tmpfs_pool_lock = { 0 };
 
 struct tmpfs_dir * tmpfs_root = NULL;
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d);
 
+static char * tmpfs_page_alloc(void) {
+	spin_lock(tmpfs_pool_lock);
+
+	struct tmpfs_chunk * chunk = pool_chunks;
+	while (chunk && !chunk->free_map) {
+		chunk = chunk->next;
+	}
+
+	if (!chunk) {
+		chunk = malloc(sizeof(struct tmpfs_chunk));
+		chunk->base = valloc(POOL_CHUNK_PAGES * BLOCKSIZE);
+		chunk->free_map = 0xFFFFFFFF;
+		chunk->next = pool_chunks;
+		pool_chunks = chunk;
+	}
+
+	int page = __builtin_ctz(chunk->free_map);
+	chunk->free_map &= ~(1U << page);
+
+	spin_unlock(tmpfs_pool_lock);
+
+	char * out = chunk->base + page * BLOCKSIZE;
+	memset(out, 0, BLOCKSIZE);
+	return out;
+}
+
+static void tmpfs_page_free(char * page) {
+	spin_lock(tmpfs_pool_lock);
+
+	struct tmpfs_chunk ** link = &pool_chunks;
+	while (*link) {
+		struct tmpfs_chunk * chunk = *link;
+		if (page >= chunk->base && page < chunk->base + POOL_CHUNK_PAGES * BLOCKSIZE) {
+			chunk->free_map |= 1U << ((page - chunk->base) / BLOCKSIZE);
+			if (chunk->free_map == 0xFFFFFFFF) {
+				*link = chunk->next;
+				free(chunk->base);
+				free(chunk);
+			}
+			break;
+		}
+		link = &chunk->next;
+	}
+
+	spin_unlock(tmpfs_pool_lock);
+}
+
 static struct tmpfs_file * tmpfs_file_new(char * name) {
 
 	spin_lock(tmpfs_lock);
@@ -81,6 +143,7 @@ static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 
 	spin_lock(tmpfs_lock);
 	list_insert(d->files, t);
+	d->mtime = now();
 	spin_unlock(tmpfs_lock);
 
 	return 0;
@@ -129,7 +192,7 @@ static void tmpfs_file_free(struct tmpfs_file * t) {
 		free(t->target);
 	}
 	for (size_t i = 0; i < t->block_count; ++i) {
-		clear_frame((uintptr_t)t->blocks[i] * 0x1000);
+		tmpfs_page_free(t->blocks[i]);
 	}
 }
 
@@ -142,8 +205,6 @@ static void tmpfs_file_blocks_embiggen(struct tmpfs_file * t) {
 static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int create) {
 	debug_print(INFO, "Reading block %d from file %s", blockid, t->name);
 
-	spin_lock(tmpfs_page_lock);
-
 	if (create) {
 		spin_lock(tmpfs_lock);
 		while (blockid >= t->pointers) {
@@ -151,28 +212,17 @@ static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int
 		}
 		while (blockid >= t->block_count) {
 			debug_print(INFO, "Allocating block %d for file %s", blockid, t->name);
-			uintptr_t index = first_frame();
-			set_frame(index * 0x1000);
-			t->blocks[t->block_count] = (char*)index;
+			t->blocks[t->block_count] = tmpfs_page_alloc();
 			t->block_count += 1;
 		}
 		spin_unlock(tmpfs_lock);
 	} else {
 		if (blockid >= t->block_count) {
-			debug_print(ERROR, "This will probably end badly.");
 			return NULL;
 		}
 	}
-	debug_print(INFO, "Using block %d->0x%x (of %d) on file %s", blockid, t->blocks[blockid], t->block_count, t->name);
 
-	page_t * page = get_page((uintptr_t)buf_space,0,current_directory);
-	page->rw = 1;
-	page->user = 0;
-	page->frame = (uintptr_t)t->blocks[blockid];
-	page->present = 1;
-	invalidate_tables_at((uintptr_t)buf_space);
-
-	return (char *)buf_space;
+	return t->blocks[blockid];
 }
 
 
@@ -181,44 +231,29 @@ static uint32_t read_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uint
 
 	t->atime = now();
 
-	uint32_t end;
-	if (offset + size > t->length) {
+	if (offset >= t->length) return 0;
+
+	uint64_t end = offset + size;
+	if (end > t->length) {
 		end = t->length;
-	} else {
-		end = offset + size;
 	}
-	debug_print(INFO, "reading from %d to %d", offset, end);
-	uint32_t start_block  = offset / BLOCKSIZE;
-	uint32_t end_block    = end / BLOCKSIZE;
-	uint32_t end_size     = end - end_block * BLOCKSIZE;
-	uint32_t size_to_read = end - offset;
-	if (start_block == end_block && offset == end) return 0;
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 0);
-		memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), size_to_read);
-		spin_unlock(tmpfs_page_lock);
-		return size_to_read;
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer, (uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), BLOCKSIZE - (offset % BLOCKSIZE));
-				spin_unlock(tmpfs_page_lock);
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, BLOCKSIZE);
-				spin_unlock(tmpfs_page_lock);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 0);
-			memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, end_size);
-			spin_unlock(tmpfs_page_lock);
+	debug_print(INFO, "reading from %d to %d", (uint32_t)offset, (uint32_t)end);
+
+	for (uint64_t pos = offset; pos < end; ) {
+		uint32_t in_block = pos % BLOCKSIZE;
+		uint32_t chunk = BLOCKSIZE - in_block;
+		if (chunk > end - pos) chunk = end - pos;
+
+		char * block = tmpfs_file_getset_block(t, pos / BLOCKSIZE, 0);
+		if (block) {
+			memcpy(buffer + (pos - offset), block + in_block, chunk);
+		} else {
+			memset(buffer + (pos - offset), 0, chunk);
 		}
+		pos += chunk;
 	}
-	return size_to_read;
+
+	return end - offset;
 }
 
 static uint32_t write_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
@@ -227,41 +262,23 @@ static uint32_t write_tmpfs(fs_node_t *node, uint64_t offset, uint32_t size, uin
 	t->atime = now();
 	t->mtime = t->atime;
 
-	uint32_t end;
-	if (offset + size > t->length) {
-		t->length = offset + size;
+	uint64_t end = offset + size;
+
+	for (uint64_t pos = offset; pos < end; ) {
+		uint32_t in_block = pos % BLOCKSIZE;
+		uint32_t chunk = BLOCKSIZE - in_block;
+		if (chunk > end - pos) chunk = end - pos;
+
+		char * block = tmpfs_file_getset_block(t, pos / BLOCKSIZE, 1);
+		memcpy(block + in_block, buffer + (pos - offset), chunk);
+		pos += chunk;
 	}
-	end = offset + size;
-	uint32_t start_block  = offset / BLOCKSIZE;
-	uint32_t end_block    = end / BLOCKSIZE;
-	uint32_t end_size     = end - end_block * BLOCKSIZE;
-	uint32_t size_to_read = end - offset;
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 1);
-		memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, size_to_read);
-		spin_unlock(tmpfs_page_lock);
-		return size_to_read;
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy((uint8_t *)(((uint32_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, BLOCKSIZE - (offset % BLOCKSIZE));
-				spin_unlock(tmpfs_page_lock);
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), BLOCKSIZE);
-				spin_unlock(tmpfs_page_lock);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 1);
-			memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), end_size);
-			spin_unlock(tmpfs_page_lock);
-		}
+
+	if (end > t->length) {
+		t->length = end;
 	}
-	return size_to_read;
+
+	return size;
 }
 
 static int chmod_tmpfs(fs_node_t * node, int mode) {
@@ -288,7 +305,7 @@ static void truncate_tmpfs(fs_node_t * node) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
 	debug_print(INFO, "Truncating file %s", t->name);
 	for (size_t i = 0; i < t->block_count; ++i) {
-		clear_frame((uintptr_t)t->blocks[i] * 0x1000);
+		tmpfs_page_free(t->blocks[i]);
 		t->blocks[i] = 0;
 	}
 	t->block_count = 0;
@@ -304,7 +321,7 @@ static void open_tmpfs(fs_node_t * node, unsigned int flags) {
 }
 
 static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = slab_alloc(&fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
 	strcpy(fnode->name, t->name);
@@ -350,7 +367,7 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint32_t index) {
 	debug_print(NOTICE, "tmpfs - readdir id=%d", index);
 
 	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
+		struct dirent * out = slab_alloc(&dirent_cache);
 		memset(out, 0x00, sizeof(struct dirent));
 		out->ino = 0;
 		strcpy(out->name, ".");
@@ -358,7 +375,7 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint32_t index) {
 	}
 
 	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
+		struct dirent * out = slab_alloc(&dirent_cache);
 		memset(out, 0x00, sizeof(struct dirent));
 		out->ino = 0;
 		strcpy(out->name, "..");
@@ -372,7 +389,7 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint32_t index) {
 	foreach(f, d->files) {
 		if (i == index) {
 			struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-			struct dirent * out = malloc(sizeof(struct dirent));
+			struct dirent * out = slab_alloc(&dirent_cache);
 			memset(out, 0x00, sizeof(struct dirent));
 			out->ino = (uint32_t)t;
 			strcpy(out->name, t->name);
@@ -430,6 +447,7 @@ static int unlink_tmpfs(fs_node_t * node, char * name) {
 
 	if (i >= 0) {
 		list_remove(d->files, i);
+		d->mtime = now();
 	} else {
 		spin_unlock(tmpfs_lock);
 		return -ENOENT;
@@ -464,6 +482,7 @@ static int create_tmpfs(fs_node_t *parent, char *name, uint16_t permission) {
 
 	spin_lock(tmpfs_lock);
 	list_insert(d->files, t);
+	d->mtime = now();
 	spin_unlock(tmpfs_lock);
 
 	return 0;
@@ -495,13 +514,14 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, uint16_t permission) {
 
 	spin_lock(tmpfs_lock);
 	list_insert(d->files, out);
+	d->mtime = now();
 	spin_unlock(tmpfs_lock);
 
 	return 0;
 }
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = slab_alloc(&fs_node_cache);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
 	strcpy(fnode->name, "tmp");
@@ -512,7 +532,7 @@ static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
 	fnode->atime   = d->atime;
 	fnode->mtime   = d->mtime;
 	fnode->ctime   = d->ctime;
-	fnode->flags   = FS_DIRECTORY;
+	fnode->flags   = FS_DIRECTORY | FS_DCACHE;
 	fnode->read    = NULL;
 	fnode->write   = NULL;
 	fnode->open    = NULL;
@@ -564,8 +584,6 @@ fs_node_t * tmpfs_mount(char * device, char * mount_path) {
 
 static int tmpfs_initialize(void) {
 
-	buf_space = (void*)kvmalloc(BLOCKSIZE);
-
 	vfs_register("tmpfs", tmpfs_mount);
 
 	return 0;
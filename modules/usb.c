@@ -0,0 +1,267 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * USB core
+ *
+ * Keeps the host controllers, class drivers and attached devices, and
+ * runs the [usb] worker thread that does everything that has to sleep:
+ * looking at root ports when a controller says they changed, reading
+ * descriptors, and probing drivers. Drivers that load after a device
+ * is already attached get offered its unclaimed interfaces the next
+ * time the worker runs.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/process.h>
+#include <kernel/mod/usb.h>
+
+#include <toaru/list.h>
+
+#define USB_CONFIG_MAX 0x1000 /* Longest configuration we'll read */
+
+static list_t * controllers = NULL;
+static list_t * drivers = NULL;
+static list_t * devices = NULL;
+
+static list_t * worker_wait = NULL;
+static volatile int work_pending = 0;
+static volatile int drivers_added = 0;
+
+static void usb_wake_worker(void) {
+	work_pending = 1;
+	wakeup_queue(worker_wait);
+}
+
+void usb_hc_register(struct usb_hc * hc) {
+	uint32_t flags = int_save();
+	list_insert(controllers, hc);
+	hc->changed = 1; /* Whatever is plugged in at boot */
+	int_restore(flags);
+	usb_wake_worker();
+}
+
+/* Called from controller interrupt handlers */
+void usb_hc_changed(struct usb_hc * hc) {
+	hc->changed = 1;
+	usb_wake_worker();
+}
+
+void usb_register_driver(struct usb_driver * driver) {
+	uint32_t flags = int_save();
+	list_insert(drivers, driver);
+	drivers_added = 1;
+	int_restore(flags);
+	usb_wake_worker();
+}
+
+int usb_control(struct usb_device * dev, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length, void * data) {
+	if (dev->gone) return -1;
+
+	struct usb_setup setup;
+	setup.type    = type;
+	setup.request = request;
+	setup.value   = value;
+	setup.index   = index;
+	setup.length  = length;
+
+	mutex_lock(&dev->lock);
+	int r = dev->hc->ops->control(dev, &setup, data);
+	mutex_unlock(&dev->lock);
+	return r;
+}
+
+static int usb_get_descriptor(struct usb_device * dev, int type, int index, uint16_t length, void * data) {
+	return usb_control(dev, USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+			USB_REQ_GET_DESCRIPTOR, (type << 8) | index, 0, length, data);
+}
+
+/* Next descriptor of `type` in the configuration after `from`, or the first; stops at `stop` */
+static void * usb_next_descriptor(struct usb_device * dev, void * from, int type, int stop) {
+	uint8_t * end = dev->config + dev->config_length;
+	uint8_t * d = from ? (uint8_t *)from + ((uint8_t *)from)[0] : dev->config;
+	while (d + 2 <= end && d[0] >= 2 && d + d[0] <= end) {
+		if (d[1] == type) return d;
+		if (d[1] == stop) return NULL;
+		d += d[0];
+	}
+	return NULL;
+}
+
+struct usb_endpoint_descriptor * usb_find_endpoint(struct usb_device * dev, struct usb_interface_descriptor * intf, int type, int dir) {
+	struct usb_endpoint_descriptor * ep = (void *)intf;
+	while ((ep = usb_next_descriptor(dev, ep, USB_DESC_ENDPOINT, USB_DESC_INTERFACE))) {
+		if ((ep->attributes & USB_ENDPOINT_TYPE_MASK) == type && (ep->address & USB_DIR_IN) == dir) {
+			return ep;
+		}
+	}
+	return NULL;
+}
+
+struct usb_endpoint * usb_endpoint_open(struct usb_device * dev, struct usb_endpoint_descriptor * desc) {
+	struct usb_endpoint * ep = malloc(sizeof(struct usb_endpoint));
+	memset(ep, 0, sizeof(struct usb_endpoint));
+	ep->dev        = dev;
+	ep->address    = desc->address;
+	ep->attributes = desc->attributes;
+	ep->max_packet = desc->max_packet & 0x7FF;
+	ep->interval   = desc->interval;
+
+	if (dev->gone || dev->hc->ops->endpoint(ep)) {
+		debug_print(ERROR, "usb: port %d: couldn't set up endpoint 0x%2x", dev->port, desc->address);
+		free(ep);
+		return NULL;
+	}
+	return ep;
+}
+
+int usb_transfer(struct usb_endpoint * ep, void * data, size_t length) {
+	if (ep->dev->gone) return -1;
+	return ep->dev->hc->ops->transfer(ep, data, length);
+}
+
+int usb_poll(struct usb_endpoint * ep, size_t length, usb_complete_t callback) {
+	if (ep->dev->gone) return -1;
+	ep->callback = callback;
+	return ep->dev->hc->ops->poll(ep, length);
+}
+
+int usb_clear_halt(struct usb_endpoint * ep) {
+	return usb_control(ep->dev, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT,
+			USB_REQ_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, ep->address, 0, NULL);
+}
+
+/* Offer each interface nothing has taken yet to the drivers */
+static void usb_probe(struct usb_device * dev) {
+	struct usb_interface_descriptor * intf = NULL;
+	while ((intf = usb_next_descriptor(dev, intf, USB_DESC_INTERFACE, 0))) {
+		if (intf->alternate || intf->number >= USB_MAX_INTERFACES) continue;
+		if (dev->drivers[intf->number]) continue;
+		foreach(node, drivers) {
+			struct usb_driver * driver = node->value;
+			if (!driver->probe(dev, intf)) {
+				debug_print(NOTICE, "usb: port %d interface %d: %s", dev->port, intf->number, driver->name);
+				dev->drivers[intf->number] = driver;
+				break;
+			}
+			if (dev->gone) return;
+		}
+	}
+}
+
+int usb_device_attach(struct usb_device * dev) {
+	mutex_init(&dev->lock);
+
+	if (usb_get_descriptor(dev, USB_DESC_DEVICE, 0, sizeof(struct usb_device_descriptor), &dev->desc) < (int)sizeof(struct usb_device_descriptor)) {
+		debug_print(ERROR, "usb: port %d: no device descriptor", dev->port);
+		return 1;
+	}
+
+	struct usb_config_descriptor config;
+	if (usb_get_descriptor(dev, USB_DESC_CONFIG, 0, sizeof(config), &config) < (int)sizeof(config)) {
+		debug_print(ERROR, "usb: port %d: no configuration descriptor", dev->port);
+		return 1;
+	}
+
+	dev->config_length = config.total_length;
+	if (dev->config_length > USB_CONFIG_MAX) dev->config_length = USB_CONFIG_MAX;
+	dev->config = malloc(dev->config_length);
+	int got = usb_get_descriptor(dev, USB_DESC_CONFIG, 0, dev->config_length, dev->config);
+	if (got < (int)sizeof(config)) {
+		debug_print(ERROR, "usb: port %d: couldn't read configuration", dev->port);
+		return 1;
+	}
+	dev->config_length = got;
+
+	debug_print(NOTICE, "usb: port %d: %4x:%4x, class %2x, USB %x.%2x, %d interface%s",
+			dev->port, dev->desc.vendor_id, dev->desc.product_id, dev->desc.device_class,
+			dev->desc.usb_version >> 8, dev->desc.usb_version & 0xFF,
+			config.interfaces, config.interfaces == 1 ? "" : "s");
+
+	if (dev->desc.device_class == USB_CLASS_HUB) {
+		debug_print(WARNING, "usb: port %d: hubs aren't supported", dev->port);
+		return 1;
+	}
+
+	if (usb_control(dev, USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+			USB_REQ_SET_CONFIGURATION, config.value, 0, 0, NULL) < 0) {
+		debug_print(ERROR, "usb: port %d: couldn't set configuration %d", dev->port, config.value);
+		return 1;
+	}
+
+	list_insert(devices, dev);
+	usb_probe(dev);
+	return 0;
+}
+
+/*
+ * The device is gone. Drivers are told, but the structure is kept:
+ * a disk's device node may still point at it, and will just fail.
+ */
+void usb_device_detach(struct usb_device * dev) {
+	dev->gone = 1;
+	debug_print(NOTICE, "usb: port %d: disconnected", dev->port);
+
+	for (int i = 0; i < USB_MAX_INTERFACES; ++i) {
+		struct usb_driver * driver = dev->drivers[i];
+		if (!driver) continue;
+		for (int j = i; j < USB_MAX_INTERFACES; ++j) {
+			if (dev->drivers[j] == driver) dev->drivers[j] = NULL;
+		}
+		if (driver->disconnect) driver->disconnect(dev);
+	}
+
+	node_t * node = list_find(devices, dev);
+	if (node) {
+		list_delete(devices, node);
+		free(node);
+	}
+
+	dev->hc->ops->release(dev);
+}
+
+static void usb_worker(void * data, char * name) {
+	while (1) {
+		uint32_t flags = int_save();
+		if (!work_pending) {
+			sleep_on(worker_wait);
+			int_restore(flags);
+			continue;
+		}
+		work_pending = 0;
+		int reprobe = drivers_added;
+		drivers_added = 0;
+		int_restore(flags);
+
+		foreach(node, controllers) {
+			struct usb_hc * hc = node->value;
+			if (hc->changed) {
+				hc->changed = 0;
+				hc->ops->ports(hc);
+			}
+		}
+
+		if (reprobe) {
+			foreach(node, devices) {
+				usb_probe(node->value);
+			}
+		}
+	}
+}
+
+static int init(void) {
+	controllers = list_create();
+	drivers = list_create();
+	devices = list_create();
+	worker_wait = list_create();
+	create_kernel_tasklet(usb_worker, "[usb]", NULL);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(usb, init, fini);
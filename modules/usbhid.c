@@ -0,0 +1,251 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * USB HID Boot Protocol Keyboards and Mice
+ *
+ * Puts boot-class interfaces into the boot protocol, which has fixed
+ * report layouts, and has the controller poll their interrupt
+ * endpoints. Reports go straight to /dev/input from the controller's
+ * interrupt handler: keyboards as the set 1 scancodes a PS/2 keyboard
+ * would have sent, so everything above treats them the same, and mice
+ * as relative motion.
+ *
+ * USB keyboards don't repeat keys themselves. They're asked to resend
+ * their report every 32ms while nothing changes, and a key that has
+ * been held half a second is pressed again on each of those.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/mouse.h>
+#include <kernel/input.h>
+#include <kernel/mod/usb.h>
+
+#include <toaru/list.h>
+
+#define HID_SUBCLASS_BOOT  1
+#define HID_PROTOCOL_KEYBOARD 1
+#define HID_PROTOCOL_MOUSE    2
+
+#define HID_REQ_SET_IDLE     0x0A
+#define HID_REQ_SET_PROTOCOL 0x0B
+#define HID_BOOT_PROTOCOL    0
+
+#define HID_KEYBOARD_IDLE 8   /* 4ms units: resend the report every 32ms */
+#define HID_REPEAT_DELAY  500 /* ms */
+#define HID_REPEAT_RATE   33
+
+#define HID_ROLLOVER 0x01     /* Too many keys down; the report means nothing */
+
+#define E0 0x100              /* Scancode takes the 0xE0 prefix */
+
+/* Keyboard usages to set 1 scancodes; zero for ones we don't send */
+static const uint16_t hid_keys[0x66] = {
+	[0x04] = 0x1E, [0x05] = 0x30, [0x06] = 0x2E, [0x07] = 0x20, /* a b c d */
+	[0x08] = 0x12, [0x09] = 0x21, [0x0A] = 0x22, [0x0B] = 0x23, /* e f g h */
+	[0x0C] = 0x17, [0x0D] = 0x24, [0x0E] = 0x25, [0x0F] = 0x26, /* i j k l */
+	[0x10] = 0x32, [0x11] = 0x31, [0x12] = 0x18, [0x13] = 0x19, /* m n o p */
+	[0x14] = 0x10, [0x15] = 0x13, [0x16] = 0x1F, [0x17] = 0x14, /* q r s t */
+	[0x18] = 0x16, [0x19] = 0x2F, [0x1A] = 0x11, [0x1B] = 0x2D, /* u v w x */
+	[0x1C] = 0x15, [0x1D] = 0x2C,                               /* y z */
+	[0x1E] = 0x02, [0x1F] = 0x03, [0x20] = 0x04, [0x21] = 0x05, /* 1 - 4 */
+	[0x22] = 0x06, [0x23] = 0x07, [0x24] = 0x08, [0x25] = 0x09, /* 5 - 8 */
+	[0x26] = 0x0A, [0x27] = 0x0B,                               /* 9 0 */
+	[0x28] = 0x1C, [0x29] = 0x01, [0x2A] = 0x0E, [0x2B] = 0x0F, /* Enter Esc Backspace Tab */
+	[0x2C] = 0x39, [0x2D] = 0x0C, [0x2E] = 0x0D, [0x2F] = 0x1A, /* Space - = [ */
+	[0x30] = 0x1B, [0x31] = 0x2B, [0x32] = 0x2B, [0x33] = 0x27, /* ] \ # ; */
+	[0x34] = 0x28, [0x35] = 0x29, [0x36] = 0x33, [0x37] = 0x34, /* ' ` , . */
+	[0x38] = 0x35, [0x39] = 0x3A,                               /* / Caps Lock */
+	[0x3A] = 0x3B, [0x3B] = 0x3C, [0x3C] = 0x3D, [0x3D] = 0x3E, /* F1 - F4 */
+	[0x3E] = 0x3F, [0x3F] = 0x40, [0x40] = 0x41, [0x41] = 0x42, /* F5 - F8 */
+	[0x42] = 0x43, [0x43] = 0x44, [0x44] = 0x57, [0x45] = 0x58, /* F9 - F12 */
+	[0x46] = E0|0x37, [0x47] = 0x46,                            /* Print Screen, Scroll Lock */
+	[0x49] = E0|0x52, [0x4A] = E0|0x47, [0x4B] = E0|0x49,       /* Insert Home Page Up */
+	[0x4C] = E0|0x53, [0x4D] = E0|0x4F, [0x4E] = E0|0x51,       /* Delete End Page Down */
+	[0x4F] = E0|0x4D, [0x50] = E0|0x4B, [0x51] = E0|0x50, [0x52] = E0|0x48, /* Right Left Down Up */
+	[0x53] = 0x45, [0x54] = E0|0x35, [0x55] = 0x37, [0x56] = 0x4A, /* Num Lock, keypad / * - */
+	[0x57] = 0x4E, [0x58] = E0|0x1C,                               /* Keypad + Enter */
+	[0x59] = 0x4F, [0x5A] = 0x50, [0x5B] = 0x51, [0x5C] = 0x4B,    /* Keypad 1 - 4 */
+	[0x5D] = 0x4C, [0x5E] = 0x4D, [0x5F] = 0x47, [0x60] = 0x48,    /* Keypad 5 - 8 */
+	[0x61] = 0x49, [0x62] = 0x52, [0x63] = 0x53,                   /* Keypad 9 0 . */
+	[0x64] = 0x56, [0x65] = E0|0x5D,                               /* \ Menu */
+};
+
+/* The modifier byte, bit by bit */
+static const uint16_t hid_modifiers[8] = {
+	0x1D, 0x2A, 0x38, E0|0x5B, /* Left Control, Shift, Alt, GUI */
+	E0|0x1D, 0x36, E0|0x38, E0|0x5C, /* Right ones */
+};
+
+struct hid_device {
+	struct usb_device * dev;
+	struct usb_endpoint * ep;
+	int protocol;
+
+	/* Keyboards */
+	uint8_t last[8];
+	uint8_t repeat_key;
+	uint64_t repeat_at;
+};
+
+static list_t * hid_devices = NULL;
+
+static uint64_t hid_now(void) {
+	unsigned long s, ss;
+	timer_now(&s, &ss);
+	return (uint64_t)s * 1000 + ss / 1000;
+}
+
+static void hid_scancode(uint16_t code, int release) {
+	if (!code) return;
+	if (code & E0) input_key(0xE0);
+	input_key((code & 0x7F) | (release ? 0x80 : 0));
+}
+
+static void hid_key(uint8_t usage, int release) {
+	if (usage < sizeof(hid_keys) / sizeof(*hid_keys)) {
+		hid_scancode(hid_keys[usage], release);
+	}
+}
+
+static int report_has(uint8_t * report, uint8_t usage) {
+	for (int i = 2; i < 8; ++i) {
+		if (report[i] == usage) return 1;
+	}
+	return 0;
+}
+
+static void hid_keyboard_report(struct usb_endpoint * ep, void * data, size_t length) {
+	struct hid_device * hid = ep->driver_data;
+	uint8_t report[8] = {0};
+	memcpy(report, data, length < 8 ? length : 8);
+
+	if (report[2] == HID_ROLLOVER) return;
+
+	uint8_t changed = report[0] ^ hid->last[0];
+	for (int i = 0; i < 8; ++i) {
+		if (changed & (1 << i)) {
+			hid_scancode(hid_modifiers[i], !(report[0] & (1 << i)));
+		}
+	}
+
+	for (int i = 2; i < 8; ++i) {
+		if (hid->last[i] && !report_has(report, hid->last[i])) {
+			hid_key(hid->last[i], 1);
+		}
+	}
+
+	uint64_t now = hid_now();
+	int pressed = 0;
+	for (int i = 2; i < 8; ++i) {
+		if (report[i] && !report_has(hid->last, report[i])) {
+			hid_key(report[i], 0);
+			hid->repeat_key = report[i];
+			hid->repeat_at = now + HID_REPEAT_DELAY;
+			pressed = 1;
+		}
+	}
+
+	if (hid->repeat_key && !report_has(report, hid->repeat_key)) {
+		hid->repeat_key = 0;
+	} else if (hid->repeat_key && !pressed && now >= hid->repeat_at) {
+		hid_key(hid->repeat_key, 0);
+		hid->repeat_at = now + HID_REPEAT_RATE;
+	}
+
+	memcpy(hid->last, report, 8);
+}
+
+static void hid_mouse_report(struct usb_endpoint * ep, void * data, size_t length) {
+	uint8_t * report = data;
+	if (length < 3) return;
+
+	uint32_t buttons = 0;
+	if (report[0] & 0x01) buttons |= LEFT_CLICK;
+	if (report[0] & 0x02) buttons |= RIGHT_CLICK;
+	if (report[0] & 0x04) buttons |= MIDDLE_CLICK;
+	if (length > 3 && (int8_t)report[3] > 0) buttons |= MOUSE_SCROLL_UP;
+	if (length > 3 && (int8_t)report[3] < 0) buttons |= MOUSE_SCROLL_DOWN;
+
+	/* USB counts down the screen, PS/2 (and so everything above us) up it */
+	input_relative((int8_t)report[1], -(int8_t)report[2], buttons);
+}
+
+static int hid_probe(struct usb_device * dev, struct usb_interface_descriptor * intf) {
+	if (intf->interface_class != USB_CLASS_HID || intf->interface_subclass != HID_SUBCLASS_BOOT) return 1;
+	int protocol = intf->interface_protocol;
+	if (protocol != HID_PROTOCOL_KEYBOARD && protocol != HID_PROTOCOL_MOUSE) return 1;
+
+	struct usb_endpoint_descriptor * desc = usb_find_endpoint(dev, intf, USB_ENDPOINT_INTERRUPT, USB_DIR_IN);
+	if (!desc) return 1;
+
+	uint8_t type = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+	if (usb_control(dev, type, HID_REQ_SET_PROTOCOL, HID_BOOT_PROTOCOL, intf->number, 0, NULL) < 0) {
+		debug_print(WARNING, "usbhid: port %d: couldn't select the boot protocol", dev->port);
+		return 1;
+	}
+	/* Not every device does idle rates; key repeat just won't work on those */
+	usb_control(dev, type, HID_REQ_SET_IDLE, protocol == HID_PROTOCOL_KEYBOARD ? HID_KEYBOARD_IDLE << 8 : 0, intf->number, 0, NULL);
+
+	struct usb_endpoint * ep = usb_endpoint_open(dev, desc);
+	if (!ep) return 1;
+
+	struct hid_device * hid = malloc(sizeof(struct hid_device));
+	memset(hid, 0, sizeof(struct hid_device));
+	hid->dev = dev;
+	hid->ep = ep;
+	hid->protocol = protocol;
+	ep->driver_data = hid;
+
+	uint32_t flags = int_save();
+	list_insert(hid_devices, hid);
+	int_restore(flags);
+
+	if (usb_poll(ep, ep->max_packet, protocol == HID_PROTOCOL_KEYBOARD ? hid_keyboard_report : hid_mouse_report)) {
+		return 1;
+	}
+
+	debug_print(NOTICE, "usbhid: port %d: boot %s", dev->port, protocol == HID_PROTOCOL_KEYBOARD ? "keyboard" : "mouse");
+	return 0;
+}
+
+/* Let go of anything a keyboard was holding down when it went */
+static void hid_disconnect(struct usb_device * dev) {
+	uint32_t flags = int_save();
+	node_t * node = hid_devices->head;
+	while (node) {
+		node_t * next = node->next;
+		struct hid_device * hid = node->value;
+		if (hid->dev == dev) {
+			if (hid->protocol == HID_PROTOCOL_KEYBOARD) {
+				uint8_t none[8] = {0};
+				hid_keyboard_report(hid->ep, none, 8);
+			}
+			list_delete(hid_devices, node);
+			free(node);
+		}
+		node = next;
+	}
+	int_restore(flags);
+}
+
+static struct usb_driver hid_driver = {
+	.name = "usbhid",
+	.probe = hid_probe,
+	.disconnect = hid_disconnect,
+};
+
+static int init(void) {
+	hid_devices = list_create();
+	usb_register_driver(&hid_driver);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(usbhid, init, fini);
+MODULE_DEPENDS(usb);
@@ -0,0 +1,435 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * USB Mass Storage (Bulk-Only Transport)
+ *
+ * SCSI commands over a pair of bulk endpoints: a command block
+ * wrapper goes out, the data goes whichever way it goes, and a status
+ * wrapper comes back. One command is on a disk at a time, each moving
+ * up to the controller's 64KiB bounce buffer with READ(10) and
+ * WRITE(10); writes are followed by a cache flush before they return.
+ * Disks are mounted as /dev/sdX and otherwise look like any other
+ * block device. Only the first logical unit is used.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/process.h>
+#include <kernel/fs.h>
+#include <kernel/printf.h>
+#include <kernel/mutex.h>
+#include <kernel/mod/usb.h>
+
+#define MSD_SUBCLASS_SCSI 0x06
+#define MSD_PROTOCOL_BBB  0x50
+
+#define MSD_REQ_RESET 0xFF
+
+#define CBW_SIGNATURE 0x43425355
+#define CSW_SIGNATURE 0x53425355
+#define CSW_PASSED      0
+#define CSW_FAILED      1
+#define CSW_PHASE_ERROR 2
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE   0x03
+#define SCSI_INQUIRY         0x12
+#define SCSI_READ_CAPACITY   0x25
+#define SCSI_READ_10         0x28
+#define SCSI_WRITE_10        0x2A
+#define SCSI_SYNC_CACHE      0x35
+
+#define MSD_TRANSFER  0x10000 /* Most one command moves */
+#define MSD_READY_TRIES 20
+
+struct msd_cbw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t length;
+	uint8_t  flags;
+	uint8_t  lun;
+	uint8_t  cb_length;
+	uint8_t  cb[16];
+} __attribute__((packed));
+
+struct msd_csw {
+	uint32_t signature;
+	uint32_t tag;
+	uint32_t residue;
+	uint8_t  status;
+} __attribute__((packed));
+
+struct msd_disk {
+	struct usb_device * dev;
+	struct usb_endpoint * in;
+	struct usb_endpoint * out;
+	int interface;
+	uint32_t tag;
+	uint64_t blocks;
+	uint32_t block_size;
+	mutex_t lock;
+};
+
+static void msd_sleep(unsigned long ms) {
+	unsigned long s, ss;
+	relative_time(0, ms, &s, &ss);
+	sleep_until((process_t *)current_process, s, ss);
+	switch_task(0);
+}
+
+/* Reset recovery, for when the device and we disagree about where we are */
+static void msd_reset(struct msd_disk * disk) {
+	usb_control(disk->dev, USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, MSD_REQ_RESET, 0, disk->interface, 0, NULL);
+	usb_clear_halt(disk->in);
+	usb_clear_halt(disk->out);
+}
+
+/*
+ * Run a command, with the disk locked. Returns 0 if it passed with all
+ * of its data moved, 1 if it failed, and -1 if the transport did.
+ */
+static int msd_command(struct msd_disk * disk, uint8_t * cb, int cb_length, void * data, uint32_t length, int in) {
+	struct msd_cbw cbw;
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.signature = CBW_SIGNATURE;
+	cbw.tag       = ++disk->tag;
+	cbw.length    = length;
+	cbw.flags     = in ? USB_DIR_IN : USB_DIR_OUT;
+	cbw.cb_length = cb_length;
+	memcpy(cbw.cb, cb, cb_length);
+
+	if (usb_transfer(disk->out, &cbw, sizeof(cbw)) != sizeof(cbw)) {
+		msd_reset(disk);
+		return -1;
+	}
+
+	if (length) {
+		struct usb_endpoint * ep = in ? disk->in : disk->out;
+		if (usb_transfer(ep, data, length) < 0) {
+			/* A stalled data stage still has a status after it */
+			usb_clear_halt(ep);
+		}
+	}
+
+	struct msd_csw csw;
+	int r = usb_transfer(disk->in, &csw, sizeof(csw));
+	if (r < 0) {
+		usb_clear_halt(disk->in);
+		r = usb_transfer(disk->in, &csw, sizeof(csw));
+	}
+
+	if (r != sizeof(csw) || csw.signature != CSW_SIGNATURE || csw.tag != cbw.tag || csw.status == CSW_PHASE_ERROR) {
+		msd_reset(disk);
+		return -1;
+	}
+
+	return (csw.status != CSW_PASSED || csw.residue) ? 1 : 0;
+}
+
+static int msd_simple(struct msd_disk * disk, uint8_t * cb, int cb_length, void * data, uint32_t length, int in) {
+	mutex_lock(&disk->lock);
+	int r = msd_command(disk, cb, cb_length, data, length, in);
+	mutex_unlock(&disk->lock);
+	return r;
+}
+
+/* Wait out the unit attention a freshly plugged disk reports, and its spin up */
+static int msd_ready(struct msd_disk * disk) {
+	for (int i = 0; i < MSD_READY_TRIES; ++i) {
+		uint8_t tur[6] = { SCSI_TEST_UNIT_READY };
+		if (!msd_simple(disk, tur, 6, NULL, 0, 0)) return 0;
+
+		uint8_t sense[18];
+		uint8_t rs[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, sizeof(sense), 0 };
+		msd_simple(disk, rs, 6, sense, sizeof(sense), 1);
+		msd_sleep(100);
+	}
+	return 1;
+}
+
+static int msd_transfer(struct msd_disk * disk, uint64_t lba, unsigned int count, uint8_t * buf, int write) {
+	unsigned int per_command = MSD_TRANSFER / disk->block_size;
+
+	while (count) {
+		unsigned int n = count > per_command ? per_command : count;
+		uint8_t cb[10] = {
+			write ? SCSI_WRITE_10 : SCSI_READ_10, 0,
+			lba >> 24, lba >> 16, lba >> 8, lba,
+			0, n >> 8, n, 0,
+		};
+		if (msd_simple(disk, cb, 10, buf, n * disk->block_size, !write)) {
+			debug_print(ERROR, "usbmsd: port %d: %s of %d blocks at %d failed", disk->dev->port,
+					write ? "write" : "read", n, (uint32_t)lba);
+			return 1;
+		}
+		lba   += n;
+		count -= n;
+		buf   += n * disk->block_size;
+	}
+
+	if (write) {
+		/* Not every stick takes this; a failure here isn't one of the write */
+		uint8_t sync[10] = { SCSI_SYNC_CACHE };
+		msd_simple(disk, sync, 10, NULL, 0, 0);
+	}
+	return 0;
+}
+
+static uint64_t msd_max_offset(struct msd_disk * disk) {
+	return disk->blocks * disk->block_size;
+}
+
+static uint32_t read_msd(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct msd_disk * disk = (struct msd_disk *)node->device;
+	uint32_t bs = disk->block_size;
+
+	if (offset >= msd_max_offset(disk)) {
+		return 0;
+	}
+
+	if (offset + size > msd_max_offset(disk)) {
+		size = msd_max_offset(disk) - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset / bs;
+	uint64_t end_block = (offset + size - 1) / bs;
+	unsigned int x_offset = 0;
+
+	if (offset % bs || size < bs) {
+		unsigned int prefix_size = bs - (offset % bs);
+		if (prefix_size > size) prefix_size = size;
+		uint8_t * tmp = malloc(bs);
+		if (msd_transfer(disk, start_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(buffer, tmp + (offset % bs), prefix_size);
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % bs && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % bs;
+		uint8_t * tmp = malloc(bs);
+		if (msd_transfer(disk, end_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(buffer + size - postfix_size, tmp, postfix_size);
+		free(tmp);
+		end_block--;
+	}
+
+	if (start_block <= end_block) {
+		if (msd_transfer(disk, start_block, end_block - start_block + 1, buffer + x_offset, 0)) {
+			return 0;
+		}
+	}
+
+	return size;
+}
+
+static uint32_t write_msd(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t * buffer) {
+	struct msd_disk * disk = (struct msd_disk *)node->device;
+	uint32_t bs = disk->block_size;
+
+	if (offset >= msd_max_offset(disk)) {
+		return 0;
+	}
+
+	if (offset + size > msd_max_offset(disk)) {
+		size = msd_max_offset(disk) - offset;
+	}
+
+	if (!size) return 0;
+
+	uint64_t start_block = offset / bs;
+	uint64_t end_block = (offset + size - 1) / bs;
+	unsigned int x_offset = 0;
+
+	if (offset % bs || size < bs) {
+		/* Partial blocks are read, patched and written back */
+		unsigned int prefix_size = bs - (offset % bs);
+		if (prefix_size > size) prefix_size = size;
+		uint8_t * tmp = malloc(bs);
+		if (msd_transfer(disk, start_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(tmp + (offset % bs), buffer, prefix_size);
+		if (msd_transfer(disk, start_block, 1, tmp, 1)) {
+			free(tmp);
+			return 0;
+		}
+		free(tmp);
+		x_offset += prefix_size;
+		start_block++;
+	}
+
+	if ((offset + size) % bs && start_block <= end_block) {
+		unsigned int postfix_size = (offset + size) % bs;
+		uint8_t * tmp = malloc(bs);
+		if (msd_transfer(disk, end_block, 1, tmp, 0)) {
+			free(tmp);
+			return 0;
+		}
+		memcpy(tmp, buffer + size - postfix_size, postfix_size);
+		if (msd_transfer(disk, end_block, 1, tmp, 1)) {
+			free(tmp);
+			return 0;
+		}
+		free(tmp);
+		end_block--;
+	}
+
+	if (start_block <= end_block) {
+		if (msd_transfer(disk, start_block, end_block - start_block + 1, buffer + x_offset, 1)) {
+			return 0;
+		}
+	}
+
+	return size;
+}
+
+static void open_msd(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_msd(fs_node_t * node) {
+	return;
+}
+
+static fs_node_t * msd_device_create(struct msd_disk * disk, char l) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	sprintf(fnode->name, "sd%c", l);
+	fnode->device  = disk;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = msd_max_offset(disk);
+	fnode->flags   = FS_BLOCKDEVICE | FS_CACHED;
+	fnode->read    = read_msd;
+	fnode->write   = write_msd;
+	fnode->open    = open_msd;
+	fnode->close   = close_msd;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = NULL;
+	return fnode;
+}
+
+/* Pick the first /dev/sdX that's free */
+static char msd_drive_char(void) {
+	char devname[64];
+	for (char l = 'a'; l <= 'z'; ++l) {
+		sprintf(devname, "/dev/sd%c", l);
+		fs_node_t * node = kopen(devname, 0);
+		if (!node) return l;
+		close_fs(node);
+	}
+	return 0;
+}
+
+static int msd_probe(struct usb_device * dev, struct usb_interface_descriptor * intf) {
+	if (intf->interface_class != USB_CLASS_STORAGE) return 1;
+	if (intf->interface_subclass != MSD_SUBCLASS_SCSI || intf->interface_protocol != MSD_PROTOCOL_BBB) {
+		debug_print(WARNING, "usbmsd: port %d: storage subclass %d protocol 0x%x isn't supported",
+				dev->port, intf->interface_subclass, intf->interface_protocol);
+		return 1;
+	}
+
+	struct usb_endpoint_descriptor * in = usb_find_endpoint(dev, intf, USB_ENDPOINT_BULK, USB_DIR_IN);
+	struct usb_endpoint_descriptor * out = usb_find_endpoint(dev, intf, USB_ENDPOINT_BULK, USB_DIR_OUT);
+	if (!in || !out) return 1;
+
+	struct msd_disk * disk = malloc(sizeof(struct msd_disk));
+	memset(disk, 0, sizeof(struct msd_disk));
+	disk->dev = dev;
+	disk->interface = intf->number;
+	mutex_init(&disk->lock);
+
+	disk->in = usb_endpoint_open(dev, in);
+	disk->out = usb_endpoint_open(dev, out);
+	if (!disk->in || !disk->out) {
+		free(disk);
+		return 1;
+	}
+
+	uint8_t inquiry[36] = {0};
+	uint8_t iq[6] = { SCSI_INQUIRY, 0, 0, 0, sizeof(inquiry), 0 };
+	if (msd_simple(disk, iq, 6, inquiry, sizeof(inquiry), 1) < 0) {
+		debug_print(ERROR, "usbmsd: port %d: no answer to INQUIRY", dev->port);
+		free(disk);
+		return 1;
+	}
+
+	if (msd_ready(disk)) {
+		debug_print(WARNING, "usbmsd: port %d: never became ready (no medium?)", dev->port);
+		free(disk);
+		return 1;
+	}
+
+	uint8_t capacity[8];
+	uint8_t rc[10] = { SCSI_READ_CAPACITY };
+	if (msd_simple(disk, rc, 10, capacity, sizeof(capacity), 1)) {
+		debug_print(ERROR, "usbmsd: port %d: couldn't read capacity", dev->port);
+		free(disk);
+		return 1;
+	}
+	uint32_t last = (capacity[0] << 24) | (capacity[1] << 16) | (capacity[2] << 8) | capacity[3];
+	disk->block_size = (capacity[4] << 24) | (capacity[5] << 16) | (capacity[6] << 8) | capacity[7];
+	disk->blocks = (uint64_t)last + 1;
+
+	if (!disk->block_size || disk->block_size > MSD_TRANSFER || (disk->block_size & 511)) {
+		debug_print(ERROR, "usbmsd: port %d: block size of %d isn't supported", dev->port, disk->block_size);
+		free(disk);
+		return 1;
+	}
+
+	char l = msd_drive_char();
+	if (!l) {
+		debug_print(ERROR, "usbmsd: out of drive letters");
+		free(disk);
+		return 1;
+	}
+
+	/* Vendor and product are space padded, at 8 and 16 */
+	char vendor[9], product[17];
+	memcpy(vendor, inquiry + 8, 8);
+	vendor[8] = '\0';
+	memcpy(product, inquiry + 16, 16);
+	product[16] = '\0';
+
+	debug_print(NOTICE, "usbmsd: /dev/sd%c, %s %s, %d blocks of %d bytes", l, vendor, product,
+			(uint32_t)disk->blocks, disk->block_size);
+
+	char devname[64];
+	sprintf(devname, "/dev/sd%c", l);
+	vfs_mount(devname, msd_device_create(disk, l));
+	return 0;
+}
+
+static struct usb_driver msd_driver = {
+	.name = "usbmsd",
+	.probe = msd_probe,
+	.disconnect = NULL, /* Its node stays, and fails from then on */
+};
+
+static int init(void) {
+	usb_register_driver(&msd_driver);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(usbmsd, init, fini);
+MODULE_DEPENDS(usb);
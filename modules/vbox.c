@@ -16,6 +16,7 @@
 #include <kernel/video.h>
 #include <kernel/pipe.h>
 #include <kernel/mouse.h>
+#include <kernel/input.h>
 #include <kernel/args.h>
 
 #define VBOX_VENDOR_ID 0x80EE
@@ -136,7 +137,6 @@ static volatile uint32_t * vbox_vmmdev = 0;
 
 static fs_node_t * mouse_pipe;
 static fs_node_t * rect_pipe;
-static fs_node_t * pointer_pipe;
 
 static int mouse_state;
 
@@ -168,6 +168,9 @@ static int vbox_irq_handler(struct regs *r) {
 	packet.y_difference = y;
 	packet.buttons = 0;
 
+	/* Buttons still come from the PS/2 mouse */
+	input_absolute(x, y, 0, INPUT_F_NO_BUTTONS);
+
 	mouse_device_packet_t bitbucket;
 	while (pipe_size(mouse_pipe) > (int)(DISCARD_POINT * sizeof(packet))) {
 		read_fs(mouse_pipe, 0, sizeof(packet), (uint8_t *)&bitbucket);
@@ -222,16 +225,49 @@ static int ioctl_mouse(fs_node_t * node, int request, void * argp) {
 	return -1;
 }
 
-uint32_t write_pointer(fs_node_t * node, uint64_t offset, uint32_t size, uint8_t *buffer) {
+#define VBOX_POINTER_VISIBLE (1 << 0)
+#define VBOX_POINTER_ALPHA   (1 << 1)
+#define VBOX_POINTER_SHAPE   (1 << 2)
+
+/* Pointer shapes are an AND mask, padded to four bytes, then the image */
+static unsigned int pointer_mask_bytes(uint32_t width, uint32_t height) {
+	return ((((width + 7) / 8) * height) + 3) & ~3;
+}
+
+static int vbox_cursor_define(struct vid_cursor * cursor) {
+	unsigned int mask_bytes = pointer_mask_bytes(cursor->width, cursor->height);
+
+	memset(vbox_pointershape->data, 0x00, mask_bytes);
+	memcpy(&vbox_pointershape->data[mask_bytes], cursor->bitmap, cursor->width * cursor->height * 4);
 
+	vbox_pointershape->header.size = sizeof(struct vbox_pointershape) + mask_bytes + cursor->width * cursor->height * 4;
+	vbox_pointershape->header.rc = 0;
+	vbox_pointershape->flags = VBOX_POINTER_VISIBLE | VBOX_POINTER_ALPHA | VBOX_POINTER_SHAPE;
+	vbox_pointershape->xHot = cursor->hot_x;
+	vbox_pointershape->yHot = cursor->hot_y;
+	vbox_pointershape->width = cursor->width;
+	vbox_pointershape->height = cursor->height;
+	outportl(vbox_port, vbox_phys_pointershape);
+
+	return vbox_pointershape->header.rc < 0 ? -EIO : 0;
+}
+
+static int vbox_cursor_move(struct vid_cursor_pos * pos) {
+	/*
+	 * The host draws the pointer wherever its own mouse is, which is
+	 * only where ours is while the absolute mouse is on. All we can
+	 * do otherwise is show or hide it.
+	 */
 	if (!mouse_state) {
-		return -1;
+		return -EINVAL;
 	}
 
-	memcpy(&vbox_pointershape->data[288], buffer, 48*48*4);
+	vbox_pointershape->header.size = sizeof(struct vbox_pointershape);
+	vbox_pointershape->header.rc = 0;
+	vbox_pointershape->flags = pos->visible ? VBOX_POINTER_VISIBLE : 0;
 	outportl(vbox_port, vbox_phys_pointershape);
 
-	return size;
+	return 0;
 }
 
 uint32_t write_rectpipe(fs_node_t *node, uint64_t offset, uint32_t size, uint8_t *buffer) {
@@ -364,55 +400,26 @@ static int vbox_check(void) {
 		vbox_mg->header.reserved2 = 0;
 
 		if (!args_present("novboxpointer")) {
-			vbox_pointershape = (void*)kvmalloc_p(0x4000, &vbox_phys_pointershape);
+			vbox_pointershape = (void*)kvmalloc_p(0x5000, &vbox_phys_pointershape);
 
 			if (vbox_pointershape) {
 				fprintf(&vb, "Got a valid set of pages to load up a cursor.\n");
 				vbox_pointershape->header.version = VBOX_REQUEST_HEADER_VERSION;
 				vbox_pointershape->header.requestType = VMM_SetPointerShape;
-				vbox_pointershape->header.rc = 0;
 				vbox_pointershape->header.reserved1 = 0;
 				vbox_pointershape->header.reserved2 = 0;
-				vbox_pointershape->flags = (1 << 0) | (1 << 1) | (1 << 2);
-				vbox_pointershape->xHot = 26;
-				vbox_pointershape->yHot = 26;
-				vbox_pointershape->width = 48;
-				vbox_pointershape->height = 48;
-
-				unsigned int mask_bytes = ((vbox_pointershape->width + 7) / 8) * vbox_pointershape->height;
 
-				for (uint32_t i = 0; i < mask_bytes; ++i) {
-					vbox_pointershape->data[i] = 0x00;
-				}
-
-				while (mask_bytes & 3) {
-					mask_bytes++;
-				}
-				int base = mask_bytes;
-				fprintf(&vb, "mask_bytes = %d\n", mask_bytes);
+				/* Start with an empty cursor to see if the host takes them at all */
+				static uint32_t blank[48 * 48] = {0};
+				struct vid_cursor cursor = {48, 48, 26, 26, blank};
 
-				vbox_pointershape->header.size = sizeof(struct vbox_pointershape) + (48*48*4)+mask_bytes; /* update later */
-
-				for (int i = 0; i < 48 * 48; ++i) {
-					vbox_pointershape->data[base+i*4] = 0x00; /* blue */
-					vbox_pointershape->data[base+i*4+1] = 0x00; /* red */
-					vbox_pointershape->data[base+i*4+2] = 0x00; /* green */
-					vbox_pointershape->data[base+i*4+3] = 0x00; /* alpha */
-				}
-				outportl(vbox_port, vbox_phys_pointershape);
-
-				if (vbox_pointershape->header.rc < 0) {
+				if (vbox_cursor_define(&cursor) < 0) {
 					fprintf(&vb, "Bad response code: -%d\n", -vbox_pointershape->header.rc);
-				} else {
-					/* Success, let's install the device file */
+				} else if (!lfb_cursor_define) {
+					/* Success; the compositor can set it through the framebuffer */
 					fprintf(&vb, "Successfully initialized cursor, going to allow compositor to set it.\n");
-					pointer_pipe = malloc(sizeof(fs_node_t));
-					memset(pointer_pipe, 0, sizeof(fs_node_t));
-					pointer_pipe->mask = 0666;
-					pointer_pipe->flags = FS_CHARDEVICE;
-					pointer_pipe->write = write_pointer;
-
-					vfs_mount("/dev/vboxpointer", pointer_pipe);
+					lfb_cursor_define = vbox_cursor_define;
+					lfb_cursor_move = vbox_cursor_move;
 				}
 			}
 		}
@@ -2,6 +2,7 @@
 #include <kernel/printf.h>
 #include <kernel/module.h>
 #include <kernel/ata.h>
+#include <kernel/workqueue.h>
 
 static unsigned short * textmemptr = (unsigned short *)0xB8000;
 static void placech(unsigned char c, int x, int y, int attr) {
@@ -149,7 +150,9 @@ static void debug_ata_primary(void) {
 
 }
 
-static void tasklet(void * data, char * name) {
+static work_t checks;
+
+static void run_checks(void * data) {
 
 	write_string("Tasklet created, sleeping... _");
 
@@ -195,7 +198,8 @@ static int vgadbg_init(void) {
 	write_string(" We'll now do some checks to see what may be wrong with the system.\n");
 	write_string("\n");
 
-	create_kernel_tasklet(tasklet, "[[vgadbg]]", NULL);
+	work_init(&checks, run_checks, NULL, WORK_NORMAL);
+	queue_work(&checks);
 
 	return 0;
 }
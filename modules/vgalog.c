@@ -148,6 +148,7 @@ term_callbacks_t term_callbacks = {
 	unsupported_int,
 	term_set_csr_show,
 	NULL,
+	NULL,
 };
 
 
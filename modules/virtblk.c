@@ -0,0 +1,360 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Virtio Block Driver
+ *
+ * Provides raw block access to virtio disks. Requests are a header,
+ * a bounce buffer and a status byte, which with indirect descriptors
+ * take one ring entry each; a disk has a pool of them, so big
+ * transfers and concurrent callers have several requests in flight at
+ * once. Callers sleep until the completion interrupt. Disks are
+ * mounted as /dev/hdX, after any other driver's, and behave like ATA
+ * disks to everything above.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
+#include <kernel/module.h>
+#include <kernel/fs.h>
+#include <kernel/printf.h>
+#include <kernel/mod/virtio.h>
+#include <kernel/block.h>
+
+#include <toaru/list.h>
+
+#define VIRTIO_BLK_F_SIZE_MAX (1 << 1)
+#define VIRTIO_BLK_F_RO       (1 << 5)
+#define VIRTIO_BLK_F_FLUSH    (1 << 9)
+
+/* Device configuration */
+#define VIRTIO_BLK_CAPACITY 0x00  /* 64 bits, in 512-byte sectors */
+#define VIRTIO_BLK_SIZE_MAX 0x08
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+
+#define VBLK_SECTOR_SIZE    512
+#define VBLK_MAX_DISKS      8
+#define VBLK_REQUESTS       16
+#define VBLK_REQUEST_SECTORS 128
+#define VBLK_REQUEST_SIZE   (VBLK_REQUEST_SECTORS * VBLK_SECTOR_SIZE)
+
+struct virtio_blk_req_hdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__((packed));
+
+struct vblk_request {
+	int index;
+	struct virtio_blk_req_hdr * hdr;
+	uintptr_t hdr_phys;
+	volatile uint8_t * status;
+	uintptr_t status_phys;
+	uint8_t * buffer;
+	uintptr_t buffer_phys;
+	volatile int done;
+};
+
+struct vblk_disk {
+	struct virtio_device dev;
+	struct virtq * vq;
+	uint64_t sectors;
+	unsigned int max_sectors; /* Per request */
+	int readonly;
+
+	int requests;             /* In the pool */
+	struct vblk_request pool[VBLK_REQUESTS];
+	uint32_t busy;            /* Requests taken by callers */
+	list_t * wait;            /* Callers waiting on a request */
+	list_t * request_wait;    /* Callers waiting for a free one */
+
+	block_device_t block;
+};
+
+/* Issued requests, and where their data goes */
+struct vblk_inflight {
+	struct vblk_request * req;
+	uint8_t * buf;
+	size_t bytes;
+};
+
+static struct vblk_disk * disks[VBLK_MAX_DISKS];
+static int disk_count = 0;
+
+/* Take a free request; with `block` unset, -1 instead of sleeping */
+static struct vblk_request * vblk_request_take(struct vblk_disk * disk, int block) {
+	uint32_t all = (1UL << disk->requests) - 1;
+	while (1) {
+		uint32_t flags = int_save();
+		if (disk->busy != all) {
+			int i = 0;
+			while (disk->busy & (1UL << i)) i++;
+			disk->busy |= (1UL << i);
+			int_restore(flags);
+			disk->pool[i].done = 0;
+			return &disk->pool[i];
+		}
+		if (!block) {
+			int_restore(flags);
+			return NULL;
+		}
+		sleep_on(disk->request_wait);
+		int_restore(flags);
+	}
+}
+
+static void vblk_request_release(struct vblk_disk * disk, struct vblk_request * req) {
+	uint32_t flags = int_save();
+	disk->busy &= ~(1UL << req->index);
+	int_restore(flags);
+	wakeup_queue(disk->request_wait);
+}
+
+static void vblk_request_issue(struct vblk_disk * disk, struct vblk_request * req, uint32_t type, uint64_t sector, size_t bytes) {
+	req->hdr->type     = type;
+	req->hdr->reserved = 0;
+	req->hdr->sector   = sector;
+	*req->status = 0xFF;
+
+	struct virtq_buf bufs[3];
+	int count = 0;
+	bufs[count].phys = req->hdr_phys;
+	bufs[count].len  = sizeof(struct virtio_blk_req_hdr);
+	bufs[count].write = 0;
+	count++;
+	if (bytes) {
+		bufs[count].phys = req->buffer_phys;
+		bufs[count].len  = bytes;
+		bufs[count].write = (type == VIRTIO_BLK_T_IN);
+		count++;
+	}
+	bufs[count].phys = req->status_phys;
+	bufs[count].len  = 1;
+	bufs[count].write = 1;
+	count++;
+
+	/* The pool is sized so the ring always has room for all of it */
+	virtq_add(disk->vq, bufs, count, req);
+	virtq_kick(disk->vq);
+}
+
+/* Sleep until a request is done; returns 1 if it failed */
+static int vblk_request_wait(struct vblk_disk * disk, struct vblk_request * req) {
+	while (1) {
+		uint32_t flags = int_save();
+		if (!req->done) {
+			sleep_on(disk->wait);
+			int_restore(flags);
+			continue;
+		}
+		int_restore(flags);
+		break;
+	}
+	return *req->status != VIRTIO_BLK_S_OK;
+}
+
+static int vblk_finish(struct vblk_disk * disk, struct vblk_inflight * f, int write) {
+	int error = vblk_request_wait(disk, f->req);
+	if (!error && !write) {
+		memcpy(f->buf, f->req->buffer, f->bytes);
+	}
+	vblk_request_release(disk, f->req);
+	return error;
+}
+
+static int vblk_flush(struct vblk_disk * disk) {
+	if (!(disk->dev.features & VIRTIO_BLK_F_FLUSH)) return 0;
+	struct vblk_request * req = vblk_request_take(disk, 1);
+	vblk_request_issue(disk, req, VIRTIO_BLK_T_FLUSH, 0, 0);
+	int error = vblk_request_wait(disk, req);
+	vblk_request_release(disk, req);
+	return error;
+}
+
+/*
+ * Move `count` whole sectors between the disk and `buf`. Requests go
+ * out for as long as there are free ones, and are finished oldest
+ * first to make room; writes are flushed before this returns.
+ */
+static int vblk_transfer(struct vblk_disk * disk, uint64_t sector, unsigned int count, uint8_t * buf, int write) {
+	struct vblk_inflight inflight[VBLK_REQUESTS];
+	int head = 0, pending = 0;
+	int errors = 0;
+
+	while (count || pending) {
+		struct vblk_request * req = count ? vblk_request_take(disk, !pending) : NULL;
+		if (!req) {
+			errors |= vblk_finish(disk, &inflight[head], write);
+			head = (head + 1) % VBLK_REQUESTS;
+			pending--;
+			continue;
+		}
+
+		unsigned int sectors = count > disk->max_sectors ? disk->max_sectors : count;
+		size_t bytes = sectors * VBLK_SECTOR_SIZE;
+		if (write) {
+			memcpy(req->buffer, buf, bytes);
+		}
+		vblk_request_issue(disk, req, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, sector, bytes);
+
+		struct vblk_inflight * f = &inflight[(head + pending) % VBLK_REQUESTS];
+		f->req   = req;
+		f->buf   = buf;
+		f->bytes = bytes;
+		pending++;
+
+		sector += sectors;
+		count  -= sectors;
+		buf    += bytes;
+	}
+
+	if (write && !errors) {
+		errors |= vblk_flush(disk);
+	}
+
+	if (errors) {
+		debug_print(ERROR, "virtblk: %s failed", write ? "write" : "read");
+	}
+	return errors;
+}
+
+static int vblk_block_transfer(block_device_t * dev, uint64_t sector, unsigned int count, uint8_t * buf, int write) {
+	return vblk_transfer(dev->driver, sector, count, buf, write);
+}
+
+static fs_node_t * vblk_device_create(struct vblk_disk * disk) {
+	sprintf(disk->block.name, "virtblk%d", disk_count);
+	disk->block.sector_size = VBLK_SECTOR_SIZE;
+	disk->block.sectors     = disk->sectors;
+	disk->block.readonly    = disk->readonly;
+	disk->block.transfer    = vblk_block_transfer;
+	disk->block.driver      = disk;
+	return block_register(&disk->block);
+}
+
+static int vblk_irq_handler(struct regs * r) {
+	int handled = 0;
+	for (int i = 0; i < disk_count; ++i) {
+		struct vblk_disk * disk = disks[i];
+		if (!virtio_isr(&disk->dev)) continue;
+		struct vblk_request * req;
+		while ((req = virtq_get(disk->vq, NULL))) {
+			req->done = 1;
+		}
+		wakeup_queue(disk->wait);
+		irq_ack(disk->dev.irq);
+		handled = 1;
+	}
+	return handled;
+}
+
+/* Pick the first /dev/hdX nothing else has taken */
+static char vblk_drive_char(void) {
+	char devname[64];
+	for (char l = 'a'; l <= 'z'; ++l) {
+		sprintf(devname, "/dev/hd%c", l);
+		fs_node_t * node = kopen(devname, 0);
+		if (!node) return l;
+		close_fs(node);
+	}
+	return 0;
+}
+
+static void vblk_disk_init(uint32_t pci) {
+	struct vblk_disk * disk = malloc(sizeof(struct vblk_disk));
+	memset(disk, 0, sizeof(struct vblk_disk));
+
+	if (virtio_device_init(&disk->dev, pci, VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH)) {
+		free(disk);
+		return;
+	}
+
+	disk->vq = virtq_create(&disk->dev, 0);
+	if (!disk->vq) {
+		debug_print(ERROR, "virtblk: device 0x%x has no request queue", pci);
+		free(disk);
+		return;
+	}
+
+	disk->sectors = virtio_config_read32(&disk->dev, VIRTIO_BLK_CAPACITY) |
+		((uint64_t)virtio_config_read32(&disk->dev, VIRTIO_BLK_CAPACITY + 4) << 32);
+	disk->readonly = !!(disk->dev.features & VIRTIO_BLK_F_RO);
+
+	disk->max_sectors = VBLK_REQUEST_SECTORS;
+	if (disk->dev.features & VIRTIO_BLK_F_SIZE_MAX) {
+		uint32_t size_max = virtio_config_read32(&disk->dev, VIRTIO_BLK_SIZE_MAX) / VBLK_SECTOR_SIZE;
+		if (size_max && size_max < disk->max_sectors) disk->max_sectors = size_max;
+	}
+
+	/* Without indirect descriptors a request takes three ring entries */
+	disk->requests = VBLK_REQUESTS;
+	int ring_room = (disk->dev.features & VIRTIO_F_INDIRECT_DESC) ? disk->vq->size : disk->vq->size / 3;
+	if (disk->requests > ring_room) disk->requests = ring_room;
+	if (disk->requests < 1) {
+		debug_print(ERROR, "virtblk: request queue of %d is too small", disk->vq->size);
+		free(disk);
+		return;
+	}
+
+	/* Headers and status bytes share a page */
+	uintptr_t phys;
+	uint8_t * small = (void *)kvmalloc_p(0x1000, &phys);
+	for (int i = 0; i < disk->requests; ++i) {
+		struct vblk_request * req = &disk->pool[i];
+		req->index = i;
+		req->hdr = (struct virtio_blk_req_hdr *)(small + i * 32);
+		req->hdr_phys = phys + i * 32;
+		req->status = small + i * 32 + sizeof(struct virtio_blk_req_hdr);
+		req->status_phys = req->hdr_phys + sizeof(struct virtio_blk_req_hdr);
+		req->buffer = (void *)kvmalloc_p(VBLK_REQUEST_SIZE, &req->buffer_phys);
+	}
+
+	disk->wait = list_create();
+	disk->request_wait = list_create();
+
+	char l = vblk_drive_char();
+	if (!l) {
+		debug_print(ERROR, "virtblk: out of drive letters");
+		return;
+	}
+
+	disks[disk_count] = disk;
+	irq_install_handler(disk->dev.irq, vblk_irq_handler, "virtio-blk");
+	virtio_device_ready(&disk->dev);
+
+	debug_print(NOTICE, "virtblk: /dev/hd%c, %d sectors%s, %d requests of up to %d sectors",
+			l, (uint32_t)disk->sectors, disk->readonly ? " (read-only)" : "", disk->requests, disk->max_sectors);
+
+	char devname[64];
+	sprintf(devname, "/dev/hd%c", l);
+	vfs_mount(devname, vblk_device_create(disk));
+	disk_count++;
+}
+
+static int init(void) {
+	uint32_t found[VBLK_MAX_DISKS];
+	int count = virtio_find(VIRTIO_TYPE_BLOCK, found, VBLK_MAX_DISKS);
+	if (!count) {
+		debug_print(NOTICE, "virtblk: no devices found");
+		return 0;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		vblk_disk_init(found[i]);
+	}
+
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(virtblk, init, fini);
+MODULE_DEPENDS(virtio);
@@ -0,0 +1,316 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Virtio transport
+ *
+ * The legacy PCI transport and split virtqueues, for the virtio
+ * device drivers (virtblk, virtnet). Queues use indirect descriptors,
+ * so a request of several buffers takes one ring entry, and event
+ * indices, so the device and the driver each only hear from the other
+ * when there's something new; both are used whenever the device has
+ * them. See <kernel/mod/virtio.h>.
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/mem.h>
+#include <kernel/module.h>
+#include <kernel/pci.h>
+#include <kernel/mod/virtio.h>
+
+#define PCI_SUBSYSTEM_ID 0x2E
+
+/* Keep the compiler from moving ring accesses across this */
+#define barrier() asm volatile ("" ::: "memory")
+
+int virtio_find(int type, uint32_t * devices, int max) {
+	int found = 0;
+	pci_device_t * d;
+	for (int i = 0; found < max && (d = pci_find_device(VIRTIO_VENDOR_ID, PCI_ANY, i)); ++i) {
+		/* Transitional devices, with the legacy interface, are 0x1000 through 0x103F */
+		if (d->device_id < 0x1000 || d->device_id > 0x103F) continue;
+		if ((int)pci_read_field(d->address, PCI_SUBSYSTEM_ID, 2) != type) continue;
+		devices[found++] = d->address;
+	}
+	return found;
+}
+
+/*
+ * Reset the device and agree on features: whichever of `features`
+ * and the ring features the device offers.
+ */
+int virtio_device_init(struct virtio_device * dev, uint32_t pci, uint32_t features) {
+	dev->pci = pci;
+
+	uint16_t command_reg = pci_read_field(pci, PCI_COMMAND, 2);
+	command_reg |= (1 << 0) | (1 << 2); /* I/O space, bus mastering */
+	command_reg &= ~(1 << 10);          /* Interrupts on */
+	pci_write_field(pci, PCI_COMMAND, 2, command_reg);
+
+	uint32_t bar0 = pci_read_field(pci, PCI_BAR0, 4);
+	if (!(bar0 & 1)) {
+		debug_print(ERROR, "virtio: device 0x%x has no legacy I/O registers", pci);
+		return 1;
+	}
+	dev->io  = bar0 & 0xFFFC;
+
+	outportb(dev->io + VIRTIO_PCI_STATUS, 0);
+	outportb(dev->io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outportb(dev->io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	uint32_t host = inportl(dev->io + VIRTIO_PCI_HOST_FEATURES);
+	dev->features = host & (features | VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX);
+	outportl(dev->io + VIRTIO_PCI_GUEST_FEATURES, dev->features);
+
+	/* One vector for all the queues; configuration changes don't interest us */
+	dev->irq = pci_enable_msix(pci, 0);
+	if (dev->irq >= 0) {
+		dev->msix = 1;
+		outports(dev->io + VIRTIO_MSI_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+	} else {
+		dev->msix = 0;
+		dev->irq = pci_get_interrupt(pci);
+	}
+
+	debug_print(NOTICE, "virtio: device 0x%x at io 0x%x, irq %d, features 0x%x of 0x%x",
+			pci, dev->io, dev->irq, dev->features, host);
+	return 0;
+}
+
+void virtio_device_ready(struct virtio_device * dev) {
+	outportb(dev->io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+/*
+ * Reading the status also acknowledges the interrupt. With MSI-X the
+ * vector is the device's alone and the status isn't kept, so any
+ * interrupt is a queue one.
+ */
+uint8_t virtio_isr(struct virtio_device * dev) {
+	if (dev->msix) return VIRTIO_ISR_QUEUE;
+	return inportb(dev->io + VIRTIO_PCI_ISR);
+}
+
+/* The device configuration moves up to make room for the vector registers */
+static int virtio_config_base(struct virtio_device * dev) {
+	return dev->msix ? VIRTIO_PCI_CONFIG_MSIX : VIRTIO_PCI_CONFIG;
+}
+
+uint8_t virtio_config_read8(struct virtio_device * dev, int offset) {
+	return inportb(dev->io + virtio_config_base(dev) + offset);
+}
+
+uint32_t virtio_config_read32(struct virtio_device * dev, int offset) {
+	return inportl(dev->io + virtio_config_base(dev) + offset);
+}
+
+/*
+ * Set up queue `index` at the size the device asks for. The legacy
+ * layout is the descriptors and the available ring, then the used
+ * ring on the next page, all physically contiguous.
+ */
+struct virtq * virtq_create(struct virtio_device * dev, int index) {
+	outports(dev->io + VIRTIO_PCI_QUEUE_SEL, index);
+	uint16_t size = inports(dev->io + VIRTIO_PCI_QUEUE_SIZE);
+	if (!size) {
+		return NULL;
+	}
+
+	size_t avail_size = sizeof(struct virtq_avail) + sizeof(uint16_t) * (size + 1);
+	size_t used_offset = (sizeof(struct virtq_desc) * size + avail_size + 0xFFF) & ~0xFFF;
+	size_t used_size = sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * size + sizeof(uint16_t);
+	size_t total = (used_offset + used_size + 0xFFF) & ~0xFFF;
+
+	/* Aligned allocations of three pages or more are physically contiguous */
+	uintptr_t phys;
+	uint8_t * ring = (void *)kvmalloc_p(total < 0x3000 ? 0x3000 : total, &phys);
+	memset(ring, 0, total);
+
+	struct virtq * vq = malloc(sizeof(struct virtq));
+	memset(vq, 0, sizeof(struct virtq));
+	vq->dev   = dev;
+	vq->index = index;
+	vq->size  = size;
+	vq->desc  = (struct virtq_desc *)ring;
+	vq->avail = (struct virtq_avail *)(ring + sizeof(struct virtq_desc) * size);
+	vq->used  = (struct virtq_used *)(ring + used_offset);
+	vq->used_event  = &vq->avail->ring[size];
+	vq->avail_event = (volatile uint16_t *)&vq->used->ring[size];
+	vq->interrupts  = 1;
+
+	for (uint16_t i = 0; i < size; ++i) {
+		vq->desc[i].next = i + 1;
+	}
+	vq->free_head = 0;
+	vq->num_free  = size;
+
+	vq->cookies = malloc(sizeof(void *) * size);
+	memset(vq->cookies, 0, sizeof(void *) * size);
+
+	if (dev->features & VIRTIO_F_INDIRECT_DESC) {
+		size_t indirect_size = sizeof(struct virtq_desc) * VIRTQ_CHAIN_MAX * size;
+		vq->indirect = (void *)kvmalloc_p(indirect_size < 0x3000 ? 0x3000 : indirect_size, &vq->indirect_phys);
+	}
+
+	outportl(dev->io + VIRTIO_PCI_QUEUE_PFN, phys >> 12);
+
+	if (dev->msix) {
+		outports(dev->io + VIRTIO_MSI_QUEUE_VECTOR, 0);
+		if (inports(dev->io + VIRTIO_MSI_QUEUE_VECTOR) == VIRTIO_MSI_NO_VECTOR) {
+			debug_print(WARNING, "virtio: device 0x%x won't take an interrupt vector for queue %d", dev->pci, index);
+		}
+	}
+	return vq;
+}
+
+/*
+ * Put a chain of buffers on the available ring; `cookie` comes back
+ * from virtq_get() when the device is done with it. Returns -1 when
+ * the ring is full. The device isn't told until virtq_kick().
+ */
+int virtq_add(struct virtq * vq, struct virtq_buf * bufs, int count, void * cookie) {
+	if (count < 1 || count > VIRTQ_CHAIN_MAX) {
+		return -1;
+	}
+
+	uint32_t flags = int_save();
+	int indirect = vq->indirect && count > 1;
+	if (vq->num_free < (indirect ? 1 : count)) {
+		int_restore(flags);
+		return -1;
+	}
+
+	uint16_t head = vq->free_head;
+	if (indirect) {
+		struct virtq_desc * table = &vq->indirect[head * VIRTQ_CHAIN_MAX];
+		for (int i = 0; i < count; ++i) {
+			table[i].addr  = bufs[i].phys;
+			table[i].len   = bufs[i].len;
+			table[i].flags = (bufs[i].write ? VIRTQ_DESC_F_WRITE : 0) | (i < count - 1 ? VIRTQ_DESC_F_NEXT : 0);
+			table[i].next  = i + 1;
+		}
+		struct virtq_desc * desc = &vq->desc[head];
+		vq->free_head = desc->next;
+		desc->addr  = vq->indirect_phys + head * VIRTQ_CHAIN_MAX * sizeof(struct virtq_desc);
+		desc->len   = count * sizeof(struct virtq_desc);
+		desc->flags = VIRTQ_DESC_F_INDIRECT;
+		vq->num_free--;
+	} else {
+		/* The free list is already linked through next; the chain follows it */
+		uint16_t i = head;
+		for (int j = 0; j < count; ++j) {
+			struct virtq_desc * desc = &vq->desc[i];
+			desc->addr  = bufs[j].phys;
+			desc->len   = bufs[j].len;
+			desc->flags = (bufs[j].write ? VIRTQ_DESC_F_WRITE : 0) | (j < count - 1 ? VIRTQ_DESC_F_NEXT : 0);
+			i = desc->next;
+		}
+		vq->free_head = i;
+		vq->num_free -= count;
+	}
+
+	vq->cookies[head] = cookie;
+	vq->avail->ring[vq->avail->idx % vq->size] = head;
+	barrier();
+	vq->avail->idx++;
+
+	int_restore(flags);
+	return 0;
+}
+
+/* Tell the device about what's been added, unless it said it doesn't need telling */
+void virtq_kick(struct virtq * vq) {
+	uint32_t flags = int_save();
+	/* The new index has to be visible before we look at what the device wants */
+	__sync_synchronize();
+
+	uint16_t new = vq->avail->idx;
+	uint16_t old = vq->kicked;
+	vq->kicked = new;
+
+	int notify;
+	if (vq->dev->features & VIRTIO_F_EVENT_IDX) {
+		uint16_t event = *vq->avail_event;
+		notify = (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+	} else {
+		notify = !(*(volatile uint16_t *)&vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	}
+	int_restore(flags);
+
+	if (notify && new != old) {
+		outports(vq->dev->io + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+	}
+}
+
+/* Take the next chain the device is finished with, or NULL */
+void * virtq_get(struct virtq * vq, uint32_t * len) {
+	uint32_t flags = int_save();
+	if (vq->last_used == *(volatile uint16_t *)&vq->used->idx) {
+		int_restore(flags);
+		return NULL;
+	}
+	barrier();
+
+	struct virtq_used_elem * elem = &vq->used->ring[vq->last_used % vq->size];
+	uint16_t head = elem->id;
+	if (len) {
+		*len = elem->len;
+	}
+	vq->last_used++;
+	if (vq->interrupts && (vq->dev->features & VIRTIO_F_EVENT_IDX)) {
+		/* Next interrupt when the device goes past what we've seen */
+		*vq->used_event = vq->last_used;
+	}
+
+	void * cookie = vq->cookies[head];
+	vq->cookies[head] = NULL;
+
+	uint16_t i = head;
+	uint16_t count = 1;
+	while (vq->desc[i].flags & VIRTQ_DESC_F_NEXT) {
+		i = vq->desc[i].next;
+		count++;
+	}
+	vq->desc[i].next = vq->free_head;
+	vq->free_head = head;
+	vq->num_free += count;
+
+	int_restore(flags);
+	return cookie;
+}
+
+/*
+ * Ask for interrupts again. Returns 1 if the device has already
+ * finished something since, which the caller should look at before
+ * it goes to sleep.
+ */
+int virtq_enable_intr(struct virtq * vq) {
+	uint32_t flags = int_save();
+	vq->interrupts = 1;
+	vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+	*vq->used_event = vq->last_used;
+	__sync_synchronize();
+	int pending = (vq->last_used != *(volatile uint16_t *)&vq->used->idx);
+	int_restore(flags);
+	return pending;
+}
+
+void virtq_disable_intr(struct virtq * vq) {
+	uint32_t flags = int_save();
+	vq->interrupts = 0;
+	vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+	/* With event indices, an event behind us is one the device won't reach */
+	*vq->used_event = vq->last_used - 1;
+	int_restore(flags);
+}
+
+static int init(void) {
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(virtio, init, fini);
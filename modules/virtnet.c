@@ -0,0 +1,315 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * Virtio Network Driver
+ *
+ * Queue 0 receives and queue 1 transmits. Every buffer is a virtio
+ * header followed by the frame, each in its own descriptor (legacy
+ * devices want them apart); with indirect descriptors that's still
+ * one ring entry a buffer. Interrupts work as they do for the e1000:
+ * the first one turns them off and wakes the network worker, which
+ * polls until the ring is empty before asking again. The host can
+ * do TCP checksums for us; nothing else is offloaded.
+ */
+#include <kernel/module.h>
+#include <kernel/logging.h>
+#include <kernel/printf.h>
+#include <kernel/mem.h>
+#include <kernel/ipv4.h>
+#include <kernel/mod/net.h>
+#include <kernel/mod/virtio.h>
+
+#include <toaru/list.h>
+
+#define VIRTIO_NET_F_CSUM (1 << 0)
+#define VIRTIO_NET_F_MAC  (1 << 5)
+
+/* Device configuration */
+#define VIRTIO_NET_MAC 0x00
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+
+#define VIRTIO_NET_RXQ 0
+#define VIRTIO_NET_TXQ 1
+
+#define VNET_BUFFER_SIZE 2048
+#define VNET_RX_BUFFERS  128
+#define VNET_TX_BUFFERS  64
+#define VNET_RX_REFILL   16   /* Tell the device about returned buffers this many at a time */
+
+struct virtio_net_hdr {
+	uint8_t  flags;
+	uint8_t  gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset; /* From csum_start */
+} __attribute__((packed));
+
+#define VNET_FRAME_MAX (VNET_BUFFER_SIZE - sizeof(struct virtio_net_hdr))
+
+static struct virtio_device dev;
+static struct virtq * rxq;
+static struct virtq * txq;
+static uint8_t mac[6];
+
+static int rx_buffers;
+static int tx_buffers;
+static uint8_t * rx_bufs;
+static uintptr_t rx_bufs_phys;
+static uint8_t * tx_bufs;
+static uintptr_t tx_bufs_phys;
+
+static int tx_free[VNET_TX_BUFFERS]; /* Stack of idle transmit buffers */
+static int tx_free_count = 0;
+
+static list_t * rx_wait;
+static list_t * tx_wait;
+static spin_lock_t tx_lock = { 0 };
+
+static uint8_t* get_mac() {
+	return mac;
+}
+
+/* Buffers go by index; cookies are that plus one, so none is NULL */
+static void * buffer_cookie(int i) {
+	return (void *)(uintptr_t)(i + 1);
+}
+
+static int cookie_buffer(void * cookie) {
+	return (int)(uintptr_t)cookie - 1;
+}
+
+static void rx_give(int i) {
+	struct virtq_buf bufs[2];
+	bufs[0].phys  = rx_bufs_phys + i * VNET_BUFFER_SIZE;
+	bufs[0].len   = sizeof(struct virtio_net_hdr);
+	bufs[0].write = 1;
+	bufs[1].phys  = bufs[0].phys + sizeof(struct virtio_net_hdr);
+	bufs[1].len   = VNET_FRAME_MAX;
+	bufs[1].write = 1;
+	virtq_add(rxq, bufs, 2, buffer_cookie(i));
+}
+
+/*
+ * Virtio interrupts are per device, not per queue, so this only keeps
+ * the line from firing again and wakes whoever might be waiting.
+ */
+static int irq_handler(struct regs *r) {
+	if (!virtio_isr(&dev)) {
+		return 0;
+	}
+
+	irq_ack(dev.irq);
+
+	virtq_disable_intr(rxq);
+	wakeup_queue(rx_wait);
+	virtq_disable_intr(txq);
+	wakeup_queue(tx_wait);
+
+	return 1;
+}
+
+static struct netbuf * rx_poll(void) {
+	static int since_refill = 0;
+	void * cookie;
+	uint32_t len;
+
+	while ((cookie = virtq_get(rxq, &len))) {
+		int i = cookie_buffer(cookie);
+		struct netbuf * nb = NULL;
+		size_t plen = len > sizeof(struct virtio_net_hdr) ? len - sizeof(struct virtio_net_hdr) : 0;
+
+		if (plen && plen <= NETBUF_SIZE - NETBUF_HEADROOM) {
+			nb = netbuf_alloc();
+			memcpy(nb->data, rx_bufs + i * VNET_BUFFER_SIZE + sizeof(struct virtio_net_hdr), plen);
+			nb->len = plen;
+		}
+
+		rx_give(i);
+		if (++since_refill == VNET_RX_REFILL) {
+			since_refill = 0;
+			virtq_kick(rxq);
+		}
+
+		if (nb) return nb;
+	}
+
+	since_refill = 0;
+	virtq_kick(rxq);
+	return NULL;
+}
+
+static struct netbuf * dequeue_packet(void) {
+	while (1) {
+		struct netbuf * nb = rx_poll();
+		if (nb) return nb;
+
+		/* Ring is empty; sleep until the device interrupts again */
+		uint32_t flags = int_save();
+		if (virtq_enable_intr(rxq)) {
+			/* Something came in while we were turning interrupts on */
+			virtq_disable_intr(rxq);
+		} else {
+			sleep_on(rx_wait);
+		}
+		int_restore(flags);
+	}
+}
+
+/* Take back buffers the device has sent */
+static void tx_reclaim(void) {
+	void * cookie;
+	while ((cookie = virtq_get(txq, NULL))) {
+		tx_free[tx_free_count++] = cookie_buffer(cookie);
+	}
+}
+
+/* Get an idle transmit buffer; call with tx_lock held */
+static int tx_take(void) {
+	tx_reclaim();
+	while (!tx_free_count) {
+		/* All of them are out; wait for the device to finish one */
+		uint32_t flags = int_save();
+		if (virtq_enable_intr(txq)) {
+			virtq_disable_intr(txq);
+		} else {
+			sleep_on(tx_wait);
+		}
+		int_restore(flags);
+		tx_reclaim();
+	}
+	return tx_free[--tx_free_count];
+}
+
+static void tx_queue(uint8_t * payload, size_t payload_size, struct netbuf * nb) {
+	int i = tx_take();
+	uint8_t * buf = tx_bufs + i * VNET_BUFFER_SIZE;
+	struct virtio_net_hdr * hdr = (struct virtio_net_hdr *)buf;
+	uint8_t * frame = buf + sizeof(struct virtio_net_hdr);
+
+	memset(hdr, 0, sizeof(struct virtio_net_hdr));
+	memcpy(frame, payload, payload_size);
+
+	if (nb && (nb->flags & (NETBUF_TX_CSUM_IP | NETBUF_TX_CSUM_TCP))) {
+		/* Our copy gets the checksums; the netbuf may be sent again */
+		struct ipv4_packet * ipv4 = (struct ipv4_packet *)(frame + sizeof(struct ethernet_packet));
+		int ip_len = (ipv4->version_ihl & 0xF) * 4;
+		if (nb->flags & NETBUF_TX_CSUM_IP) {
+			/* Cheap enough to do here, and virtio has no way to ask for it */
+			ipv4->checksum = 0;
+			ipv4->checksum = htons(calculate_ipv4_checksum(ipv4));
+		}
+		if (nb->flags & NETBUF_TX_CSUM_TCP) {
+			hdr->flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+			hdr->csum_start  = sizeof(struct ethernet_packet) + ip_len;
+			hdr->csum_offset = 16; /* tcp_header.checksum */
+		}
+	}
+
+	struct virtq_buf bufs[2];
+	bufs[0].phys  = tx_bufs_phys + i * VNET_BUFFER_SIZE;
+	bufs[0].len   = sizeof(struct virtio_net_hdr);
+	bufs[0].write = 0;
+	bufs[1].phys  = bufs[0].phys + sizeof(struct virtio_net_hdr);
+	bufs[1].len   = payload_size;
+	bufs[1].write = 0;
+	virtq_add(txq, bufs, 2, buffer_cookie(i));
+	virtq_kick(txq);
+}
+
+static void send_packet(uint8_t* payload, size_t payload_size) {
+	if (payload_size > VNET_FRAME_MAX) {
+		debug_print(WARNING, "virtnet: dropping oversized frame of %d bytes", payload_size);
+		return;
+	}
+
+	spin_lock(tx_lock);
+	tx_queue(payload, payload_size, NULL);
+	spin_unlock(tx_lock);
+}
+
+static void send_netbuf(struct netbuf * nb) {
+	if (nb->len > VNET_FRAME_MAX) {
+		debug_print(WARNING, "virtnet: dropping oversized frame of %d bytes", nb->len);
+		return;
+	}
+
+	spin_lock(tx_lock);
+	tx_queue(nb->data, nb->len, nb);
+	spin_unlock(tx_lock);
+}
+
+static int init(void) {
+	uint32_t pci;
+	if (!virtio_find(VIRTIO_TYPE_NET, &pci, 1)) {
+		debug_print(NOTICE, "virtnet: no device found");
+		return 0;
+	}
+
+	if (virtio_device_init(&dev, pci, VIRTIO_NET_F_CSUM | VIRTIO_NET_F_MAC)) {
+		return 0;
+	}
+
+	rxq = virtq_create(&dev, VIRTIO_NET_RXQ);
+	txq = virtq_create(&dev, VIRTIO_NET_TXQ);
+	if (!rxq || !txq) {
+		debug_print(ERROR, "virtnet: device is missing its queues");
+		return 0;
+	}
+
+	if (dev.features & VIRTIO_NET_F_MAC) {
+		for (int i = 0; i < 6; ++i) {
+			mac[i] = virtio_config_read8(&dev, VIRTIO_NET_MAC + i);
+		}
+	} else {
+		/* QEMU's default */
+		uint8_t def[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+		memcpy(mac, def, 6);
+	}
+
+	/* Without indirect descriptors each buffer takes two ring entries */
+	int per_buffer = (dev.features & VIRTIO_F_INDIRECT_DESC) ? 1 : 2;
+	rx_buffers = MIN(VNET_RX_BUFFERS, rxq->size / per_buffer);
+	tx_buffers = MIN(VNET_TX_BUFFERS, txq->size / per_buffer);
+
+	rx_bufs = (void *)kvmalloc_p(VNET_BUFFER_SIZE * rx_buffers, &rx_bufs_phys);
+	tx_bufs = (void *)kvmalloc_p(VNET_BUFFER_SIZE * tx_buffers, &tx_bufs_phys);
+
+	for (int i = 0; i < rx_buffers; ++i) {
+		rx_give(i);
+	}
+	for (int i = 0; i < tx_buffers; ++i) {
+		tx_free[tx_free_count++] = i;
+	}
+
+	/* Transmit interrupts are only asked for when we run out of buffers */
+	virtq_disable_intr(txq);
+
+	rx_wait = list_create();
+	tx_wait = list_create();
+
+	irq_install_handler(dev.irq, irq_handler, "virtio-net");
+	virtio_device_ready(&dev);
+	virtq_kick(rxq);
+
+	debug_print(NOTICE, "virtnet: mac %2x:%2x:%2x:%2x:%2x:%2x, %d receive and %d transmit buffers",
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], rx_buffers, tx_buffers);
+
+	struct netif * netif = init_netif_funcs(get_mac, dequeue_packet, send_packet, "Virtio Network");
+	if (dev.features & VIRTIO_NET_F_CSUM) {
+		init_netif_offload(netif, NETIF_CAP_TX_CSUM, send_netbuf);
+	}
+
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(virtnet, init, fini);
+MODULE_DEPENDS(net);
+MODULE_DEPENDS(virtio);
@@ -26,6 +26,7 @@
 #include <kernel/video.h>
 #include <kernel/pipe.h>
 #include <kernel/mouse.h>
+#include <kernel/input.h>
 #include <kernel/args.h>
 
 #define VMWARE_MAGIC  0x564D5868 /* hXMV */
@@ -221,6 +222,8 @@ static void vmware_mouse(void) {
 		packet.buttons |= MOUSE_SCROLL_UP;
 	}
 
+	input_absolute(x, y, packet.buttons, 0);
+
 	mouse_device_packet_t bitbucket;
 	while (pipe_size(mouse_pipe) > (int)(DISCARD_POINT * sizeof(packet))) {
 		read_fs(mouse_pipe, 0, sizeof(packet), (uint8_t *)&bitbucket);
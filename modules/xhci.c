@@ -0,0 +1,1010 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2018 K. Lange
+ *
+ * xHCI USB Host Controller Driver
+ *
+ * Drives the first xHCI controller for the USB core. There's one
+ * command ring and one event ring on interrupter 0; every slot has a
+ * ring per endpoint, all a page each, and every endpoint a bounce
+ * buffer its transfers go through. Each endpoint has at most one
+ * transfer in flight: callers sleep until its completion event, and
+ * interrupt endpoints the core has asked us to poll are requeued from
+ * the interrupt handler as each report comes in.
+ *
+ * Root ports are handled by the core's worker thread, which comes here
+ * when a port status change event arrives: USB 2 ports are reset, USB 3
+ * ones train by themselves, and whatever enables is given a slot,
+ * addressed and handed to usb_device_attach().
+ */
+#include <kernel/system.h>
+#include <kernel/logging.h>
+#include <kernel/module.h>
+#include <kernel/process.h>
+#include <kernel/pci.h>
+#include <kernel/mem.h>
+#include <kernel/mutex.h>
+#include <kernel/mod/usb.h>
+
+#include <toaru/list.h>
+
+#define XHCI_PROG_IF 0x30
+
+/* Capability registers */
+#define XHCI_CAPLENGTH  0x00
+#define XHCI_HCIVERSION 0x02
+#define XHCI_HCSPARAMS1 0x04
+#define XHCI_HCSPARAMS2 0x08
+#define XHCI_HCCPARAMS1 0x10
+#define XHCI_DBOFF      0x14
+#define XHCI_RTSOFF     0x18
+
+#define HCCPARAMS1_CSZ (1 << 2)
+#define HCCPARAMS1_PPC (1 << 3)
+
+/* Operational registers */
+#define XHCI_USBCMD   0x00
+#define XHCI_USBSTS   0x04
+#define XHCI_PAGESIZE 0x08
+#define XHCI_CRCR     0x18
+#define XHCI_DCBAAP   0x30
+#define XHCI_CONFIG   0x38
+#define XHCI_PORTSC(n) (0x400 + ((n) - 1) * 0x10)
+
+#define USBCMD_RS    (1 << 0)
+#define USBCMD_HCRST (1 << 1)
+#define USBCMD_INTE  (1 << 2)
+
+#define USBSTS_HCH  (1 << 0)
+#define USBSTS_HSE  (1 << 2)
+#define USBSTS_EINT (1 << 3)
+#define USBSTS_PCD  (1 << 4)
+#define USBSTS_CNR  (1 << 11)
+
+#define PORTSC_CCS (1 << 0)
+#define PORTSC_PED (1 << 1)
+#define PORTSC_PR  (1 << 4)
+#define PORTSC_PP  (1 << 9)
+#define PORTSC_SPEED(v) (((v) >> 10) & 0xF)
+#define PORTSC_CSC (1 << 17)
+#define PORTSC_PRC (1 << 21)
+#define PORTSC_CHANGES 0x00FE0000                        /* Write one to clear */
+#define PORTSC_KEEP    (PORTSC_PP | (3 << 14) | (7 << 25)) /* What to write back as is */
+
+/* Runtime registers, interrupter 0 */
+#define XHCI_IMAN   0x20
+#define XHCI_IMOD   0x24
+#define XHCI_ERSTSZ 0x28
+#define XHCI_ERSTBA 0x30
+#define XHCI_ERDP   0x38
+
+#define IMAN_IP (1 << 0)
+#define IMAN_IE (1 << 1)
+#define ERDP_EHB (1 << 3)
+
+#define XHCI_IMOD_INTERVAL 400 /* In 250ns units: 100us, so input isn't held back */
+
+/* Extended capabilities */
+#define XHCI_EXT_LEGACY   1
+#define XHCI_EXT_PROTOCOL 2
+#define LEGACY_BIOS_OWNED (1 << 16)
+#define LEGACY_OS_OWNED   (1 << 24)
+#define LEGACY_SMI_ENABLES 0x0000E011
+#define LEGACY_SMI_EVENTS  0xE0000000
+
+/* TRBs */
+#define TRB_CYCLE (1 << 0)
+#define TRB_TC    (1 << 1)  /* Link: toggle cycle */
+#define TRB_ISP   (1 << 2)
+#define TRB_CH    (1 << 4)
+#define TRB_IOC   (1 << 5)
+#define TRB_IDT   (1 << 6)
+#define TRB_DIR_IN (1 << 16)
+#define TRB_TYPE(t) ((t) << 10)
+#define TRB_GET_TYPE(c) (((c) >> 10) & 0x3F)
+#define TRB_SLOT(s) ((uint32_t)(s) << 24)
+#define TRB_EP(e)   ((e) << 16)
+
+#define TRB_NORMAL        1
+#define TRB_SETUP         2
+#define TRB_DATA          3
+#define TRB_STATUS        4
+#define TRB_LINK          6
+#define TRB_ENABLE_SLOT   9
+#define TRB_DISABLE_SLOT  10
+#define TRB_ADDRESS       11
+#define TRB_CONFIGURE_EP  12
+#define TRB_EVALUATE      13
+#define TRB_RESET_EP      14
+#define TRB_STOP_EP       15
+#define TRB_SET_DEQUEUE   16
+#define TRB_TRANSFER_EVENT 32
+#define TRB_COMMAND_EVENT  33
+#define TRB_PORT_EVENT     34
+
+#define SETUP_TRT_OUT (2 << 16)
+#define SETUP_TRT_IN  (3 << 16)
+
+/* Completion codes */
+#define CC_SUCCESS 1
+#define CC_SHORT   13
+#define CC_NONE    -1 /* Not done, or the device went away */
+
+/* Endpoint context types */
+#define EP_BULK_OUT 2
+#define EP_INT_OUT  3
+#define EP_CONTROL  4
+#define EP_BULK_IN  6
+#define EP_INT_IN   7
+
+#define XHCI_RING_SIZE 256              /* TRBs a ring; one page */
+#define XHCI_RING_USABLE (XHCI_RING_SIZE - 1) /* The last links back */
+#define XHCI_MAX_PORTS 255
+#define XHCI_PIECE 0x1000               /* Bytes a TRB moves; never crosses 64K */
+#define XHCI_BULK_BUFFER 0x10000
+#define XHCI_TIMEOUT 1000000
+
+struct xhci_trb {
+	uint64_t param;
+	uint32_t status;
+	uint32_t control;
+} __attribute__((packed));
+
+struct xhci_erst_entry {
+	uint64_t base;
+	uint32_t size;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct xhci_ring {
+	volatile struct xhci_trb * trbs;
+	uintptr_t phys;
+	unsigned int enqueue;
+	uint32_t cycle;
+};
+
+struct xhci_slot;
+
+struct xhci_endpoint {
+	struct xhci_slot * slot;
+	struct usb_endpoint * ep;  /* NULL for endpoint 0 */
+	int dci;                   /* Device context index */
+	struct xhci_ring ring;
+	uint8_t * buffer;
+	uintptr_t buffer_phys;
+	size_t buffer_size;
+
+	/* The transfer in flight */
+	volatile int done;
+	int code;
+	size_t length;
+	size_t actual;
+	unsigned int first;        /* Ring index of its first TRB */
+	uintptr_t last;            /* Where its last TRB is */
+	int control;               /* A control transfer, done at the status stage */
+	int polling;               /* Requeued from the interrupt handler when done */
+	list_t * wait;
+};
+
+struct xhci_slot {
+	int id;
+	int port;
+	int speed;
+	uint8_t * context;         /* Output device context */
+	uintptr_t context_phys;
+	uint8_t * input;
+	uintptr_t input_phys;
+	int max_dci;
+	struct xhci_endpoint ep0;
+	struct xhci_endpoint * endpoints[32];
+	struct usb_device * dev;
+};
+
+static uint32_t xhci_pci = 0;
+static uintptr_t cap_base, op_base, rt_base, db_base;
+static int max_slots, max_ports, context_size;
+static int xhci_irq;
+
+static volatile uint64_t * dcbaa;
+static struct xhci_ring command_ring;
+static volatile struct xhci_trb * events;
+static uintptr_t events_phys;
+static unsigned int event_dequeue = 0;
+static uint32_t event_cycle = 1;
+
+static struct xhci_slot * slots[256];
+static struct xhci_slot * ports[XHCI_MAX_PORTS + 1];
+static uint8_t port_usb3[XHCI_MAX_PORTS + 1];
+static uint8_t port_failed[XHCI_MAX_PORTS + 1];
+
+static mutex_t command_lock;
+static list_t * command_wait;
+static volatile int command_done;
+static int command_code;
+static int command_slot;
+
+static struct usb_hc xhci_hc;
+
+static uint32_t mmio_read(uintptr_t addr) {
+	return *(volatile uint32_t *)addr;
+}
+
+static void mmio_write(uintptr_t addr, uint32_t value) {
+	*(volatile uint32_t *)addr = value;
+}
+
+static void mmio_write64(uintptr_t addr, uint64_t value) {
+	mmio_write(addr, (uint32_t)value);
+	mmio_write(addr + 4, (uint32_t)(value >> 32));
+}
+
+#define op_read(reg)      mmio_read(op_base + (reg))
+#define op_write(reg, v)  mmio_write(op_base + (reg), (v))
+#define rt_read(reg)      mmio_read(rt_base + (reg))
+#define rt_write(reg, v)  mmio_write(rt_base + (reg), (v))
+
+static void doorbell(int slot, int target) {
+	mmio_write(db_base + slot * 4, target);
+}
+
+static void xhci_sleep(unsigned long ms) {
+	unsigned long s, ss;
+	relative_time(0, ms, &s, &ss);
+	sleep_until((process_t *)current_process, s, ss);
+	switch_task(0);
+}
+
+static void * dma_page(uintptr_t * phys) {
+	void * page = (void *)kvmalloc_p(0x1000, phys);
+	memset(page, 0, 0x1000);
+	return page;
+}
+
+static void ring_init(struct xhci_ring * ring) {
+	ring->trbs = dma_page(&ring->phys);
+	ring->enqueue = 0;
+	ring->cycle = 1;
+	ring->trbs[XHCI_RING_USABLE].param = ring->phys;
+	ring->trbs[XHCI_RING_USABLE].control = TRB_TYPE(TRB_LINK) | TRB_TC;
+}
+
+static uintptr_t ring_phys(struct xhci_ring * ring, unsigned int index) {
+	return ring->phys + index * sizeof(struct xhci_trb);
+}
+
+/* Add a TRB; the cycle bit goes in last, so the controller never sees half of one */
+static uintptr_t ring_push(struct xhci_ring * ring, uint64_t param, uint32_t status, uint32_t control) {
+	volatile struct xhci_trb * trb = &ring->trbs[ring->enqueue];
+	uintptr_t phys = ring_phys(ring, ring->enqueue);
+	trb->param  = param;
+	trb->status = status;
+	asm volatile ("" ::: "memory");
+	trb->control = (control & ~TRB_CYCLE) | ring->cycle;
+
+	if (++ring->enqueue == XHCI_RING_USABLE) {
+		/* A chain that wraps keeps going through the link */
+		volatile struct xhci_trb * link = &ring->trbs[XHCI_RING_USABLE];
+		link->control = TRB_TYPE(TRB_LINK) | TRB_TC | (control & TRB_CH) | ring->cycle;
+		ring->enqueue = 0;
+		ring->cycle ^= 1;
+	}
+	return phys;
+}
+
+static uint32_t * slot_context(uint8_t * ctx) {
+	return (uint32_t *)ctx;
+}
+
+static uint32_t * endpoint_context(uint8_t * ctx, int dci) {
+	return (uint32_t *)(ctx + dci * context_size);
+}
+
+/* Input contexts start with the input control context */
+static uint32_t * input_control(struct xhci_slot * slot) {
+	memset(slot->input, 0, 0x1000);
+	return (uint32_t *)slot->input;
+}
+
+static uint8_t * input_device(struct xhci_slot * slot) {
+	return slot->input + context_size;
+}
+
+/* Run a command and sleep until it's done; 0, or its completion code */
+static int xhci_command(uint64_t param, uint32_t control, int * slot_out) {
+	mutex_lock(&command_lock);
+	command_done = 0;
+	ring_push(&command_ring, param, 0, control);
+	doorbell(0, 0);
+
+	while (1) {
+		uint32_t flags = int_save();
+		if (!command_done) {
+			sleep_on(command_wait);
+			int_restore(flags);
+			continue;
+		}
+		int_restore(flags);
+		break;
+	}
+
+	int code = command_code;
+	if (slot_out) *slot_out = command_slot;
+	mutex_unlock(&command_lock);
+	return code == CC_SUCCESS ? 0 : code;
+}
+
+static void endpoint_init(struct xhci_endpoint * xep, struct xhci_slot * slot, int dci, size_t buffer_size) {
+	xep->slot = slot;
+	xep->dci = dci;
+	ring_init(&xep->ring);
+	xep->buffer_size = buffer_size;
+	if (buffer_size > 0x1000) {
+		xep->buffer = (void *)kvmalloc_p(buffer_size, &xep->buffer_phys);
+	} else {
+		xep->buffer = dma_page(&xep->buffer_phys);
+	}
+	xep->done = 1;
+	xep->code = CC_SUCCESS;
+	xep->wait = list_create();
+}
+
+static void endpoint_start(struct xhci_endpoint * xep) {
+	xep->done = 0;
+	xep->code = CC_NONE;
+	xep->actual = xep->length;
+}
+
+/* Queue a normal transfer of `length` bytes out of the bounce buffer */
+static void endpoint_queue(struct xhci_endpoint * xep, size_t length) {
+	uint16_t max_packet = xep->ep ? xep->ep->max_packet : 8;
+	if (!max_packet) max_packet = 8;
+
+	xep->length  = length;
+	xep->control = 0;
+	xep->first   = xep->ring.enqueue;
+	endpoint_start(xep);
+
+	size_t offset = 0;
+	do {
+		size_t piece = length - offset > XHCI_PIECE ? XHCI_PIECE : length - offset;
+		int last = offset + piece >= length;
+		/* Packets left after this one, as the controller wants to know */
+		size_t packets = (length - offset - piece + max_packet - 1) / max_packet;
+		if (packets > 31) packets = 31;
+		xep->last = ring_push(&xep->ring, xep->buffer_phys + offset, piece | (packets << 17),
+				TRB_TYPE(TRB_NORMAL) | TRB_ISP | (last ? TRB_IOC : TRB_CH));
+		offset += piece;
+	} while (offset < length);
+
+	doorbell(xep->slot->id, xep->dci);
+}
+
+static int endpoint_wait(struct xhci_endpoint * xep) {
+	while (1) {
+		uint32_t flags = int_save();
+		if (!xep->done) {
+			sleep_on(xep->wait);
+			int_restore(flags);
+			continue;
+		}
+		int_restore(flags);
+		break;
+	}
+	return xep->code == CC_SUCCESS || xep->code == CC_SHORT ? 0 : 1;
+}
+
+/* After a failed transfer: get the endpoint running again from where we'll queue next */
+static void endpoint_recover(struct xhci_endpoint * xep) {
+	if (xep->code == CC_NONE) return; /* Gone */
+	debug_print(WARNING, "xhci: slot %d endpoint %d failed, completion code %d", xep->slot->id, xep->dci, xep->code);
+
+	uint32_t target = TRB_SLOT(xep->slot->id) | TRB_EP(xep->dci);
+	if (xhci_command(0, TRB_TYPE(TRB_RESET_EP) | target, NULL)) {
+		/* It wasn't halted; stop it instead so the dequeue pointer can move */
+		xhci_command(0, TRB_TYPE(TRB_STOP_EP) | target, NULL);
+	}
+	xhci_command(ring_phys(&xep->ring, xep->ring.enqueue) | xep->ring.cycle, TRB_TYPE(TRB_SET_DEQUEUE) | target, NULL);
+}
+
+static void transfer_event(volatile struct xhci_trb * ev) {
+	int id = ev->control >> 24;
+	int dci = (ev->control >> 16) & 0x1F;
+	struct xhci_slot * slot = slots[id];
+	if (!slot) return;
+	struct xhci_endpoint * xep = dci == 1 ? &slot->ep0 : slot->endpoints[dci];
+	if (!xep || xep->done) return;
+
+	int code = ev->status >> 24;
+	uint32_t residual = ev->status & 0xFFFFFF;
+	uintptr_t trb = (uintptr_t)ev->param;
+
+	if (code == CC_SHORT) {
+		if (xep->control) {
+			xep->actual = xep->length - residual;
+		} else {
+			/* Which piece of the transfer it stopped in */
+			unsigned int n = ((trb - xep->ring.phys) / sizeof(struct xhci_trb) + XHCI_RING_USABLE - xep->first) % XHCI_RING_USABLE;
+			size_t start = n * XHCI_PIECE;
+			size_t piece = xep->length - start > XHCI_PIECE ? XHCI_PIECE : xep->length - start;
+			xep->actual = start + piece - residual;
+		}
+		/* A short data stage still goes on to the status stage */
+		if (xep->control && trb != xep->last) return;
+	}
+
+	xep->code = code;
+
+	if (xep->polling) {
+		if (code == CC_SUCCESS || code == CC_SHORT) {
+			xep->done = 1;
+			if (xep->ep->callback) {
+				xep->ep->callback(xep->ep, xep->buffer, xep->actual);
+			}
+			if (xep->polling) {
+				endpoint_queue(xep, xep->length);
+			}
+		} else {
+			debug_print(WARNING, "xhci: slot %d endpoint %d stopped polling, completion code %d", id, dci, code);
+			xep->polling = 0;
+			xep->done = 1;
+		}
+		return;
+	}
+
+	xep->done = 1;
+	wakeup_queue(xep->wait);
+}
+
+static void command_event(volatile struct xhci_trb * ev) {
+	command_code = ev->status >> 24;
+	command_slot = ev->control >> 24;
+	command_done = 1;
+	wakeup_queue(command_wait);
+}
+
+static void xhci_events(void) {
+	while (1) {
+		volatile struct xhci_trb * ev = &events[event_dequeue];
+		if ((ev->control & TRB_CYCLE) != event_cycle) break;
+		asm volatile ("" ::: "memory");
+
+		switch (TRB_GET_TYPE(ev->control)) {
+			case TRB_TRANSFER_EVENT:
+				transfer_event(ev);
+				break;
+			case TRB_COMMAND_EVENT:
+				command_event(ev);
+				break;
+			case TRB_PORT_EVENT:
+				usb_hc_changed(&xhci_hc);
+				break;
+			default:
+				break;
+		}
+
+		if (++event_dequeue == XHCI_RING_SIZE) {
+			event_dequeue = 0;
+			event_cycle ^= 1;
+		}
+	}
+	mmio_write64(rt_base + XHCI_ERDP, (events_phys + event_dequeue * sizeof(struct xhci_trb)) | ERDP_EHB);
+}
+
+static int xhci_irq_handler(struct regs * r) {
+	uint32_t status = op_read(XHCI_USBSTS);
+	uint32_t iman = rt_read(XHCI_IMAN);
+	if (!(status & USBSTS_EINT) && !(iman & IMAN_IP)) {
+		return 0;
+	}
+
+	op_write(XHCI_USBSTS, USBSTS_EINT | USBSTS_PCD);
+	rt_write(XHCI_IMAN, IMAN_IE | IMAN_IP);
+	if (status & USBSTS_HSE) {
+		debug_print(ERROR, "xhci: host system error");
+	}
+
+	xhci_events();
+	irq_ack(xhci_irq);
+	return 1;
+}
+
+static int xhci_control_slot(struct xhci_slot * slot, struct usb_setup * setup, void * data) {
+	struct xhci_endpoint * xep = &slot->ep0;
+	size_t length = setup->length;
+	int in = setup->type & USB_DIR_IN;
+	if (length > xep->buffer_size) return -1;
+
+	if (!in && length) {
+		memcpy(xep->buffer, data, length);
+	}
+
+	xep->length  = length;
+	xep->control = 1;
+	xep->first   = xep->ring.enqueue;
+	endpoint_start(xep);
+
+	ring_push(&xep->ring, *(uint64_t *)setup, 8,
+			TRB_TYPE(TRB_SETUP) | TRB_IDT | (length ? (in ? SETUP_TRT_IN : SETUP_TRT_OUT) : 0));
+	if (length) {
+		ring_push(&xep->ring, xep->buffer_phys, length, TRB_TYPE(TRB_DATA) | TRB_ISP | (in ? TRB_DIR_IN : 0));
+	}
+	xep->last = ring_push(&xep->ring, 0, 0, TRB_TYPE(TRB_STATUS) | TRB_IOC | ((length && in) ? 0 : TRB_DIR_IN));
+	doorbell(slot->id, 1);
+
+	if (endpoint_wait(xep)) {
+		endpoint_recover(xep);
+		return -1;
+	}
+
+	if (in && xep->actual) {
+		memcpy(data, xep->buffer, xep->actual);
+	}
+	return xep->actual;
+}
+
+static int xhci_control(struct usb_device * dev, struct usb_setup * setup, void * data) {
+	return xhci_control_slot(dev->hc_data, setup, data);
+}
+
+/* Interval field for an endpoint context, in 125us units as a power of two */
+static int endpoint_interval(struct xhci_slot * slot, struct usb_endpoint * ep) {
+	if ((ep->attributes & USB_ENDPOINT_TYPE_MASK) != USB_ENDPOINT_INTERRUPT) return 0;
+	int interval = ep->interval ? ep->interval : 1;
+	if (slot->speed == USB_SPEED_FULL || slot->speed == USB_SPEED_LOW) {
+		/* In frames */
+		int e = 3;
+		while (e < 10 && (1 << (e + 1)) <= interval * 8) e++;
+		return e;
+	}
+	/* Already an exponent */
+	interval -= 1;
+	return interval > 15 ? 15 : interval;
+}
+
+static int xhci_endpoint(struct usb_endpoint * ep) {
+	struct xhci_slot * slot = ep->dev->hc_data;
+	int in = ep->address & USB_DIR_IN;
+	int dci = (ep->address & 0xF) * 2 + (in ? 1 : 0);
+	int type;
+
+	switch (ep->attributes & USB_ENDPOINT_TYPE_MASK) {
+		case USB_ENDPOINT_BULK:      type = in ? EP_BULK_IN : EP_BULK_OUT; break;
+		case USB_ENDPOINT_INTERRUPT: type = in ? EP_INT_IN : EP_INT_OUT; break;
+		default: return 1;
+	}
+
+	struct xhci_endpoint * xep = malloc(sizeof(struct xhci_endpoint));
+	memset(xep, 0, sizeof(struct xhci_endpoint));
+	xep->ep = ep;
+	endpoint_init(xep, slot, dci, type == EP_BULK_IN || type == EP_BULK_OUT ? XHCI_BULK_BUFFER : 0x1000);
+
+	if (dci > slot->max_dci) slot->max_dci = dci;
+
+	uint32_t * icc = input_control(slot);
+	icc[1] = (1 << 0) | (1 << dci);
+
+	uint32_t * sc = slot_context(input_device(slot));
+	memcpy(sc, slot_context(slot->context), context_size);
+	sc[0] = (sc[0] & ~(0x1FUL << 27)) | ((uint32_t)slot->max_dci << 27);
+
+	uint32_t * ec = endpoint_context(input_device(slot), dci);
+	ec[0] = endpoint_interval(slot, ep) << 16;
+	ec[1] = (3 << 1) | (type << 3) | ((uint32_t)ep->max_packet << 16);
+	ec[2] = xep->ring.phys | 1;
+	ec[3] = 0;
+	if (type == EP_INT_IN || type == EP_INT_OUT) {
+		ec[4] = ep->max_packet | ((uint32_t)ep->max_packet << 16);
+	} else {
+		ec[4] = 3072;
+	}
+
+	int code = xhci_command(slot->input_phys, TRB_TYPE(TRB_CONFIGURE_EP) | TRB_SLOT(slot->id), NULL);
+	if (code) {
+		debug_print(ERROR, "xhci: slot %d: couldn't configure endpoint %d, completion code %d", slot->id, dci, code);
+		return 1;
+	}
+
+	slot->endpoints[dci] = xep;
+	ep->hc_data = xep;
+	return 0;
+}
+
+/* One at a time on each endpoint; the class driver sees to that */
+static int xhci_transfer(struct usb_endpoint * ep, void * data, size_t length) {
+	struct xhci_endpoint * xep = ep->hc_data;
+	int in = ep->address & USB_DIR_IN;
+	size_t done = 0;
+
+	do {
+		size_t chunk = length - done > xep->buffer_size ? xep->buffer_size : length - done;
+		if (!in) {
+			memcpy(xep->buffer, (uint8_t *)data + done, chunk);
+		}
+		endpoint_queue(xep, chunk);
+		if (endpoint_wait(xep)) {
+			endpoint_recover(xep);
+			return -1;
+		}
+		if (in) {
+			memcpy((uint8_t *)data + done, xep->buffer, xep->actual);
+		}
+		done += xep->actual;
+		if (xep->actual < chunk) break;
+	} while (done < length);
+
+	return done;
+}
+
+static int xhci_poll(struct usb_endpoint * ep, size_t length) {
+	struct xhci_endpoint * xep = ep->hc_data;
+	if (length > xep->buffer_size) length = xep->buffer_size;
+	xep->polling = 1;
+	endpoint_queue(xep, length);
+	return 0;
+}
+
+/* Fail anything still waiting on the slot, and give it back */
+static void xhci_release(struct usb_device * dev) {
+	struct xhci_slot * slot = dev->hc_data;
+
+	uint32_t flags = int_save();
+	for (int dci = 1; dci < 32; ++dci) {
+		struct xhci_endpoint * xep = dci == 1 ? &slot->ep0 : slot->endpoints[dci];
+		if (!xep) continue;
+		xep->polling = 0;
+		if (!xep->done) {
+			xep->code = CC_NONE;
+			xep->done = 1;
+			wakeup_queue(xep->wait);
+		}
+	}
+	int_restore(flags);
+
+	xhci_command(0, TRB_TYPE(TRB_DISABLE_SLOT) | TRB_SLOT(slot->id), NULL);
+
+	/* The memory is kept; a woken waiter may still be looking at it */
+	flags = int_save();
+	slots[slot->id] = NULL;
+	dcbaa[slot->id] = 0;
+	int_restore(flags);
+}
+
+static int default_max_packet(int speed) {
+	switch (speed) {
+		case USB_SPEED_LOW:   return 8;
+		case USB_SPEED_SUPER: return 512;
+		default:              return 64;
+	}
+}
+
+/* Slot and address for a newly enabled port; NULL if it wouldn't take one */
+static struct xhci_slot * xhci_address(int port, int speed) {
+	int id;
+	int code = xhci_command(0, TRB_TYPE(TRB_ENABLE_SLOT), &id);
+	if (code || id < 1 || id > max_slots) {
+		debug_print(ERROR, "xhci: port %d: no slot for it, completion code %d", port, code);
+		return NULL;
+	}
+
+	struct xhci_slot * slot = malloc(sizeof(struct xhci_slot));
+	memset(slot, 0, sizeof(struct xhci_slot));
+	slot->id = id;
+	slot->port = port;
+	slot->speed = speed;
+	slot->max_dci = 1;
+	slot->context = dma_page(&slot->context_phys);
+	slot->input = dma_page(&slot->input_phys);
+	endpoint_init(&slot->ep0, slot, 1, 0x1000);
+
+	dcbaa[id] = slot->context_phys;
+	slots[id] = slot;
+
+	int max_packet = default_max_packet(speed);
+
+	uint32_t * icc = input_control(slot);
+	icc[1] = (1 << 0) | (1 << 1);
+
+	uint32_t * sc = slot_context(input_device(slot));
+	sc[0] = (1UL << 27) | (speed << 20);
+	sc[1] = port << 16;
+
+	uint32_t * ec = endpoint_context(input_device(slot), 1);
+	ec[1] = (3 << 1) | (EP_CONTROL << 3) | (max_packet << 16);
+	ec[2] = slot->ep0.ring.phys | 1;
+	ec[4] = 8;
+
+	code = xhci_command(slot->input_phys, TRB_TYPE(TRB_ADDRESS) | TRB_SLOT(id), NULL);
+	if (code) {
+		debug_print(ERROR, "xhci: port %d: address device failed, completion code %d", port, code);
+		xhci_command(0, TRB_TYPE(TRB_DISABLE_SLOT) | TRB_SLOT(id), NULL);
+		slots[id] = NULL;
+		dcbaa[id] = 0;
+		return NULL;
+	}
+
+	/* The real endpoint 0 packet size is in the first eight bytes of the descriptor */
+	struct usb_setup setup = { USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE, USB_REQ_GET_DESCRIPTOR, USB_DESC_DEVICE << 8, 0, 8 };
+	uint8_t head[8];
+	if (xhci_control_slot(slot, &setup, head) == 8) {
+		int real = speed == USB_SPEED_SUPER ? (1 << head[7]) : head[7];
+		if (real && real != max_packet) {
+			icc = input_control(slot);
+			icc[1] = (1 << 1);
+			ec = endpoint_context(input_device(slot), 1);
+			ec[1] = (3 << 1) | (EP_CONTROL << 3) | (real << 16);
+			ec[2] = slot->ep0.ring.phys | 1;
+			ec[4] = 8;
+			xhci_command(slot->input_phys, TRB_TYPE(TRB_EVALUATE) | TRB_SLOT(id), NULL);
+		}
+	}
+
+	return slot;
+}
+
+/* Reset a USB 2 port, or wait for a USB 3 one to train; returns 1 if it enabled */
+static int xhci_port_enable(int port) {
+	if (!port_usb3[port]) {
+		uint32_t portsc = op_read(XHCI_PORTSC(port));
+		op_write(XHCI_PORTSC(port), (portsc & PORTSC_KEEP) | PORTSC_PR);
+		for (int i = 0; i < 50; ++i) {
+			xhci_sleep(10);
+			if (op_read(XHCI_PORTSC(port)) & PORTSC_PRC) break;
+		}
+		portsc = op_read(XHCI_PORTSC(port));
+		op_write(XHCI_PORTSC(port), (portsc & PORTSC_KEEP) | PORTSC_PRC);
+	}
+
+	for (int i = 0; i < 50; ++i) {
+		uint32_t portsc = op_read(XHCI_PORTSC(port));
+		if (!(portsc & PORTSC_CCS)) return 0;
+		if (portsc & PORTSC_PED) return 1;
+		xhci_sleep(10);
+	}
+	return 0;
+}
+
+static void xhci_port_attach(int port) {
+	/* Devices want a moment after they're plugged in */
+	xhci_sleep(100);
+
+	if (!xhci_port_enable(port)) {
+		debug_print(WARNING, "xhci: port %d didn't enable", port);
+		port_failed[port] = 1;
+		return;
+	}
+
+	int speed = PORTSC_SPEED(op_read(XHCI_PORTSC(port)));
+	struct xhci_slot * slot = xhci_address(port, speed);
+	if (!slot) {
+		port_failed[port] = 1;
+		return;
+	}
+
+	struct usb_device * dev = malloc(sizeof(struct usb_device));
+	memset(dev, 0, sizeof(struct usb_device));
+	dev->hc = &xhci_hc;
+	dev->hc_data = slot;
+	dev->port = port;
+	dev->speed = speed;
+	slot->dev = dev;
+	ports[port] = slot;
+
+	/* Kept on the port even if no driver wants it, so it isn't tried again */
+	usb_device_attach(dev);
+}
+
+static void xhci_ports(struct usb_hc * hc) {
+	for (int port = 1; port <= max_ports; ++port) {
+		uint32_t portsc = op_read(XHCI_PORTSC(port));
+		if (portsc & PORTSC_CHANGES) {
+			op_write(XHCI_PORTSC(port), (portsc & PORTSC_KEEP) | (portsc & PORTSC_CHANGES));
+		}
+
+		int connected = portsc & PORTSC_CCS;
+		if (ports[port] && (!connected || (portsc & PORTSC_CSC))) {
+			struct xhci_slot * slot = ports[port];
+			ports[port] = NULL;
+			usb_device_detach(slot->dev);
+		}
+		if (portsc & PORTSC_CSC) {
+			port_failed[port] = 0;
+		}
+		if (connected && !ports[port] && !port_failed[port]) {
+			xhci_port_attach(port);
+		}
+	}
+}
+
+static struct usb_hc_ops xhci_ops = {
+	.ports    = xhci_ports,
+	.control  = xhci_control,
+	.endpoint = xhci_endpoint,
+	.transfer = xhci_transfer,
+	.poll     = xhci_poll,
+	.release  = xhci_release,
+};
+
+static void xhci_map(uintptr_t start, uintptr_t end) {
+	for (uintptr_t addr = start & 0xFFFFF000; addr < end; addr += 0x1000) {
+		page_t * p = get_page(addr, 1, kernel_directory);
+		dma_frame(p, 1, 1, addr);
+		p->writethrough = 1;
+		p->cachedisable = 1;
+	}
+	invalidate_page_tables();
+}
+
+/* Take the controller from the firmware, and note which ports are USB 3 */
+static void xhci_extended_caps(uint32_t hccparams1) {
+	uintptr_t offset = (hccparams1 >> 16) << 2;
+	while (offset) {
+		uintptr_t cap = cap_base + offset;
+		uint32_t head = mmio_read(cap);
+
+		if ((head & 0xFF) == XHCI_EXT_LEGACY) {
+			if (head & LEGACY_BIOS_OWNED) {
+				mmio_write(cap, head | LEGACY_OS_OWNED);
+				int i;
+				for (i = 0; i < XHCI_TIMEOUT && (mmio_read(cap) & LEGACY_BIOS_OWNED); ++i);
+				if (i == XHCI_TIMEOUT) {
+					debug_print(WARNING, "xhci: firmware wouldn't let go of the controller");
+				}
+			}
+			mmio_write(cap + 4, (mmio_read(cap + 4) & ~LEGACY_SMI_ENABLES) | LEGACY_SMI_EVENTS);
+		} else if ((head & 0xFF) == XHCI_EXT_PROTOCOL) {
+			int major = head >> 24;
+			uint32_t ports_field = mmio_read(cap + 8);
+			int first = ports_field & 0xFF;
+			int count = (ports_field >> 8) & 0xFF;
+			for (int p = first; p < first + count && p <= XHCI_MAX_PORTS; ++p) {
+				port_usb3[p] = (major == 3);
+			}
+		}
+
+		uint32_t next = (head >> 8) & 0xFF;
+		offset = next ? offset + (next << 2) : 0;
+	}
+}
+
+static int xhci_reset(void) {
+	op_write(XHCI_USBCMD, op_read(XHCI_USBCMD) & ~USBCMD_RS);
+	int i;
+	for (i = 0; i < XHCI_TIMEOUT && !(op_read(XHCI_USBSTS) & USBSTS_HCH); ++i);
+	if (i == XHCI_TIMEOUT) return 1;
+
+	op_write(XHCI_USBCMD, USBCMD_HCRST);
+	for (i = 0; i < XHCI_TIMEOUT && (op_read(XHCI_USBCMD) & USBCMD_HCRST); ++i);
+	for (; i < XHCI_TIMEOUT && (op_read(XHCI_USBSTS) & USBSTS_CNR); ++i);
+	return i == XHCI_TIMEOUT;
+}
+
+static int init(void) {
+	pci_device_t * pdev;
+	for (int index = 0; (pdev = pci_find_class(0x0C03, index)); ++index) {
+		if (pdev->prog_if == XHCI_PROG_IF) {
+			xhci_pci = pdev->address;
+			break;
+		}
+	}
+
+	if (!xhci_pci) {
+		debug_print(NOTICE, "xhci: no controller found");
+		return 0;
+	}
+
+	uint16_t command_reg = pci_read_field(xhci_pci, PCI_COMMAND, 2);
+	command_reg |= (1 << 1) | (1 << 2); /* Memory space, bus mastering */
+	pci_write_field(xhci_pci, PCI_COMMAND, 2, command_reg);
+
+	uint32_t bar = pci_read_field(xhci_pci, PCI_BAR0, 4);
+	if ((bar & 0x6) == 0x4 && pci_read_field(xhci_pci, PCI_BAR1, 4)) {
+		debug_print(ERROR, "xhci: registers are above 4GiB");
+		return 0;
+	}
+	cap_base = bar & 0xFFFFFFF0;
+	xhci_map(cap_base, cap_base + 0x1000);
+
+	op_base = cap_base + (mmio_read(cap_base + XHCI_CAPLENGTH) & 0xFF);
+	rt_base = cap_base + (mmio_read(cap_base + XHCI_RTSOFF) & ~0x1F);
+	db_base = cap_base + (mmio_read(cap_base + XHCI_DBOFF) & ~0x3);
+
+	uint32_t hcsparams1 = mmio_read(cap_base + XHCI_HCSPARAMS1);
+	uint32_t hcsparams2 = mmio_read(cap_base + XHCI_HCSPARAMS2);
+	uint32_t hccparams1 = mmio_read(cap_base + XHCI_HCCPARAMS1);
+	max_slots = hcsparams1 & 0xFF;
+	max_ports = (hcsparams1 >> 24) & 0xFF;
+	context_size = (hccparams1 & HCCPARAMS1_CSZ) ? 64 : 32;
+
+	uintptr_t end = op_base + XHCI_PORTSC(max_ports + 1);
+	if (rt_base + 0x40 > end) end = rt_base + 0x40;
+	if (db_base + 4 * (max_slots + 1) > end) end = db_base + 4 * (max_slots + 1);
+	xhci_map(cap_base, end);
+
+	debug_print(NOTICE, "xhci: controller at 0x%x, version %x, %d slots, %d ports, %d-byte contexts",
+			xhci_pci, mmio_read(cap_base + XHCI_CAPLENGTH) >> 16, max_slots, max_ports, context_size);
+
+	if (!(op_read(XHCI_PAGESIZE) & 1)) {
+		debug_print(ERROR, "xhci: controller doesn't do 4KiB pages");
+		return 0;
+	}
+
+	xhci_extended_caps(hccparams1);
+
+	if (xhci_reset()) {
+		debug_print(ERROR, "xhci: controller didn't reset");
+		return 0;
+	}
+
+	mutex_init(&command_lock);
+	command_wait = list_create();
+
+	op_write(XHCI_CONFIG, max_slots);
+
+	uintptr_t phys;
+	dcbaa = dma_page(&phys);
+	int scratchpads = (((hcsparams2 >> 21) & 0x1F) << 5) | ((hcsparams2 >> 27) & 0x1F);
+	if (scratchpads) {
+		uintptr_t array_phys;
+		uint64_t * array = dma_page(&array_phys);
+		for (int i = 0; i < scratchpads; ++i) {
+			uintptr_t page_phys;
+			dma_page(&page_phys);
+			array[i] = page_phys;
+		}
+		dcbaa[0] = array_phys;
+	}
+	mmio_write64(op_base + XHCI_DCBAAP, phys);
+
+	ring_init(&command_ring);
+	mmio_write64(op_base + XHCI_CRCR, command_ring.phys | 1);
+
+	events = dma_page(&events_phys);
+	uintptr_t erst_phys;
+	struct xhci_erst_entry * erst = dma_page(&erst_phys);
+	erst->base = events_phys;
+	erst->size = XHCI_RING_SIZE;
+	rt_write(XHCI_ERSTSZ, 1);
+	mmio_write64(rt_base + XHCI_ERDP, events_phys);
+	mmio_write64(rt_base + XHCI_ERSTBA, erst_phys);
+	rt_write(XHCI_IMOD, XHCI_IMOD_INTERVAL);
+
+	xhci_irq = pci_enable_msi(xhci_pci);
+	if (xhci_irq < 0) {
+		xhci_irq = pci_enable_msix(xhci_pci, 0);
+	}
+	if (xhci_irq < 0) {
+		xhci_irq = pci_get_interrupt(xhci_pci);
+	}
+	irq_install_handler(xhci_irq, xhci_irq_handler, "xhci");
+
+	rt_write(XHCI_IMAN, IMAN_IE | IMAN_IP);
+	op_write(XHCI_USBCMD, USBCMD_RS | USBCMD_INTE);
+
+	int i;
+	for (i = 0; i < XHCI_TIMEOUT && (op_read(XHCI_USBSTS) & USBSTS_HCH); ++i);
+	if (i == XHCI_TIMEOUT) {
+		debug_print(ERROR, "xhci: controller didn't start");
+		return 0;
+	}
+
+	if (hccparams1 & HCCPARAMS1_PPC) {
+		for (int port = 1; port <= max_ports; ++port) {
+			uint32_t portsc = op_read(XHCI_PORTSC(port));
+			op_write(XHCI_PORTSC(port), (portsc & PORTSC_KEEP) | PORTSC_PP);
+		}
+	}
+
+	xhci_hc.name = "xhci";
+	xhci_hc.ops  = &xhci_ops;
+	usb_hc_register(&xhci_hc);
+
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+MODULE_DEF(xhci, init, fini);
+MODULE_DEPENDS(usb);
@@ -15,12 +15,18 @@ class Classifier(object):
         '<toaru/kbd.h>':         (None, '-ltoaru_kbd',         []),
         '<toaru/list.h>':        (None, '-ltoaru_list',        []),
         '<toaru/hashmap.h>':     (None, '-ltoaru_hashmap',     ['<toaru/list.h>']),
+        '<toaru/fiber.h>':       (None, '-ltoaru_fiber',       ['<toaru/list.h>']),
         '<toaru/tree.h>':        (None, '-ltoaru_tree',        ['<toaru/list.h>']),
         '<toaru/pex.h>':         (None, '-ltoaru_pex',         []),
         '<toaru/auth.h>':        (None, '-ltoaru_auth',        []),
         '<toaru/graphics.h>':    (None, '-ltoaru_graphics',    []),
         '<toaru/drawstring.h>':  (None, '-ltoaru_drawstring',  ['<toaru/graphics.h>']),
         '<toaru/jpeg.h>':        (None, '-ltoaru_jpeg',        ['<toaru/graphics.h>']),
+        '<toaru/checksum.h>':    (None, '-ltoaru_checksum',    []),
+        '<toaru/inflate.h>':     (None, '-ltoaru_inflate',     ['<toaru/checksum.h>']),
+        '<toaru/png.h>':         (None, '-ltoaru_png',         ['<toaru/graphics.h>', '<toaru/inflate.h>']),
+        '<toaru/search.h>':      (None, '-ltoaru_search',      []),
+        '<toaru/walk.h>':        (None, '-ltoaru_walk',        ['<toaru/list.h>']),
         '<toaru/rline.h>':       (None, '-ltoaru_rline',       ['<toaru/kbd.h>']),
         '<toaru/rline_exp.h>':   (None, '-ltoaru_rline_exp',   ['<toaru/rline.h>']),
         '<toaru/confreader.h>':  (None, '-ltoaru_confreader',  ['<toaru/hashmap.h>']),
@@ -28,8 +34,9 @@ class Classifier(object):
         '<toaru/yutani.h>':      (None, '-ltoaru_yutani',      ['<toaru/kbd.h>', '<toaru/list.h>', '<toaru/pex.h>', '<toaru/graphics.h>', '<toaru/hashmap.h>']),
         '<toaru/decorations.h>': (None, '-ltoaru_decorations', ['<toaru/menu.h>', '<toaru/sdf.h>', '<toaru/graphics.h>', '<toaru/yutani.h>']),
         '<toaru/termemu.h>':     (None, '-ltoaru_termemu',     ['<toaru/graphics.h>']),
-        '<toaru/sdf.h>':         (None, '-ltoaru_sdf',         ['<toaru/graphics.h>', '<toaru/hashmap.h>']),
-        '<toaru/icon_cache.h>':  (None, '-ltoaru_icon_cache',  ['<toaru/graphics.h>', '<toaru/hashmap.h>']),
+        '<toaru/glyph_cache.h>': (None, '-ltoaru_glyph_cache', ['<toaru/graphics.h>', '<toaru/list.h>']),
+        '<toaru/sdf.h>':         (None, '-ltoaru_sdf',         ['<toaru/graphics.h>', '<toaru/hashmap.h>', '<toaru/glyph_cache.h>']),
+        '<toaru/icon_cache.h>':  (None, '-ltoaru_icon_cache',  ['<toaru/graphics.h>', '<toaru/hashmap.h>', '<toaru/png.h>']),
         '<toaru/menu.h>':        (None, '-ltoaru_menu',        ['<toaru/sdf.h>', '<toaru/yutani.h>', '<toaru/icon_cache.h>', '<toaru/graphics.h>', '<toaru/hashmap.h>']),
         '<toaru/textregion.h>':  (None, '-ltoaru_textregion',  ['<toaru/sdf.h>', '<toaru/yutani.h>','<toaru/graphics.h>', '<toaru/hashmap.h>']),
         '<toaru/button.h>':      (None, '-ltoaru_button',      ['<toaru/graphics.h>','<toaru/sdf.h>', '<toaru/icon_cache.h>']),
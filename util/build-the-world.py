@@ -491,6 +491,7 @@ class ISO9660(object):
             o = t.write(self.mods_data.data, o)
             for mod_file in [
                 'cdrom/mod/ac97.ko',
+                'cdrom/mod/ahci.ko',
                 'cdrom/mod/ata.ko',
                 'cdrom/mod/ataold.ko',
                 'cdrom/mod/debug_sh.ko',
@@ -506,6 +507,7 @@ class ISO9660(object):
                 'cdrom/mod/pcspkr.ko',
                 'cdrom/mod/portio.ko',
                 'cdrom/mod/procfs.ko',
+                'cdrom/mod/prof.ko',
                 'cdrom/mod/ps2kbd.ko',
                 'cdrom/mod/ps2mouse.ko',
                 'cdrom/mod/random.ko',
@@ -513,15 +515,23 @@ class ISO9660(object):
                 'cdrom/mod/serial.ko',
                 'cdrom/mod/snd.ko',
                 'cdrom/mod/tmpfs.ko',
+                'cdrom/mod/usb.ko',
+                'cdrom/mod/usbhid.ko',
+                'cdrom/mod/usbmsd.ko',
                 'cdrom/mod/usbuhci.ko',
                 'cdrom/mod/vbox.ko',
                 'cdrom/mod/vgadbg.ko',
                 'cdrom/mod/vgalog.ko',
                 'cdrom/mod/vidset.ko',
+                'cdrom/mod/virtblk.ko',
+                'cdrom/mod/virtio.ko',
+                'cdrom/mod/virtnet.ko',
                 'cdrom/mod/vmware.ko',
+                'cdrom/mod/xhci.ko',
                 'cdrom/mod/xtest.ko',
                 'cdrom/mod/zero.ko',
                 'cdrom/mod/tarfs.ko',
+                'cdrom/mod/overlay.ko',
             ]:
                 payload = ArbitraryData(path=mod_file)
                 payload.sector_offset = self.allocate_space(payload.size // 2048)
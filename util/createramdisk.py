@@ -2,10 +2,22 @@
 """
 Generates, from this source repository, a "tarramdisk" - a ustar archive
 suitable for booting ToaruOS. 
+
+With --compress, the archive is written as a block-compressed image:
+a header, an index of where each block starts, and the blocks of the
+archive, each LZ4-compressed on its own so the kernel can decompress
+any of them as it is read. Blocks that don't get smaller are stored
+as they are.
 """
 
+import io
+import struct
+import sys
 import tarfile
 
+BLOCK_SIZE = 65536
+MAGIC = b'TOARURZ1'
+
 users = {
     'root': 0,
     'local': 1000,
@@ -43,7 +55,77 @@ def file_filter(tarinfo):
 
     return tarinfo
 
-with tarfile.open('fatbase/ramdisk.img','w') as ramdisk:
+def lz4_write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+def lz4_sequence(out, literals, distance=0, match=0):
+    token = min(len(literals), 15) << 4
+    if distance:
+        token |= min(match - 4, 15)
+    out.append(token)
+    if len(literals) >= 15:
+        lz4_write_length(out, len(literals) - 15)
+    out += literals
+    if distance:
+        out += struct.pack('<H', distance)
+        if match - 4 >= 15:
+            lz4_write_length(out, match - 19)
+
+def lz4_compress_block(data):
+    """Greedy LZ4 block compressor, following the format's end-of-block rules."""
+    try:
+        import lz4.block
+        return lz4.block.compress(data, store_size=False)
+    except ImportError:
+        pass
+
+    out = bytearray()
+    n = len(data)
+    table = {}
+    anchor = 0
+    i = 0
+    # Matches can't start in the last 12 bytes or cover the last 5
+    while i < n - 12:
+        key = data[i:i+4]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i - candidate > 65535:
+            i += 1
+            continue
+        limit = n - 5 - i
+        match = 4
+        while match < limit and data[candidate + match] == data[i + match]:
+            match += 1
+        lz4_sequence(out, data[anchor:i], i - candidate, match)
+        i += match
+        anchor = i
+    lz4_sequence(out, data[anchor:])
+    return bytes(out)
+
+def compress_image(data):
+    blocks = []
+    for start in range(0, len(data), BLOCK_SIZE):
+        raw = data[start:start+BLOCK_SIZE]
+        packed = lz4_compress_block(raw)
+        blocks.append(packed if len(packed) < len(raw) else raw)
+
+    offset = 24 + 4 * (len(blocks) + 1)
+    offsets = []
+    for block in blocks:
+        offsets.append(offset)
+        offset += len(block)
+    offsets.append(offset)
+
+    header = MAGIC + struct.pack('<IIII', BLOCK_SIZE, len(blocks), len(data), 0)
+    return header + struct.pack('<%dI' % len(offsets), *offsets) + b''.join(blocks)
+
+compress = '--compress' in sys.argv[1:]
+output = io.BytesIO()
+
+with tarfile.open(fileobj=output,mode='w') as ramdisk:
     ramdisk.add('base',arcname='/',filter=file_filter)
 
     ramdisk.add('.',arcname='/src',filter=file_filter,recursive=False) # Add a src directory
@@ -56,4 +138,9 @@ with tarfile.open('fatbase/ramdisk.img','w') as ramdisk:
     ramdisk.add('modules',arcname='/src/modules',filter=file_filter)
     ramdisk.add('util/build-the-world.py',arcname='/usr/bin/build-the-world.py',filter=file_filter)
 
+data = output.getvalue()
+if compress:
+    data = compress_image(data)
 
+with open('fatbase/ramdisk.img','wb') as f:
+    f.write(data)
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""
+    Generate the powers of five for strtod() in libc/stdlib/strtod_table.h
+
+    usage: gen-pow5.py > libc/stdlib/strtod_table.h
+
+    For each decimal exponent q from -342 to 308, 5^q scaled by a power
+    of two so its top bit is set, and kept to 128 bits: truncated for
+    q >= 0 and rounded up for q < 0, as Eisel-Lemire expects. Each entry
+    is two words, most significant first.
+"""
+
+import sys
+
+SMALLEST = -342
+LARGEST = 308
+
+def power(q):
+    if q >= 0:
+        p = 5 ** q
+        while p < (1 << 127):
+            p *= 2
+        while p >= (1 << 128):
+            p //= 2
+        return p
+    p = 5 ** -q
+    z = 0
+    while (1 << z) < p:
+        z += 1
+    b = z + 127 if q >= -27 else 2 * z + 2 * 64
+    c = 2 ** b // p + 1
+    while c >= (1 << 128):
+        c //= 2
+    return c
+
+def emit(out):
+    out.write('/* Generated by util/gen-pow5.py - do not edit */\n')
+    out.write('#pragma once\n\n')
+    out.write('#include <stdint.h>\n\n')
+    out.write('#define POW5_SMALLEST (%d)\n' % SMALLEST)
+    out.write('#define POW5_LARGEST  %d\n\n' % LARGEST)
+    out.write('static const uint64_t pow5_128[%d] = {\n' % (2 * (LARGEST - SMALLEST + 1)))
+    for q in range(SMALLEST, LARGEST + 1):
+        p = power(q)
+        out.write('\t0x%016xULL, 0x%016xULL,\n' % (p >> 64, p & ((1 << 64) - 1)))
+    out.write('};\n')
+
+if __name__ == '__main__':
+    if len(sys.argv) != 1:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    emit(sys.stdout)
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""
+    Generate the wcwidth() tables in libc/wchar/wcwidth_table.h
+
+    usage: gen-wcwidth.py UnicodeData.txt EastAsianWidth.txt > libc/wchar/wcwidth_table.h
+
+    Both files are in the Unicode Character Database:
+    https://www.unicode.org/Public/UCD/latest/ucd/
+
+    Every codepoint gets a width from -1 to 2, stored as two bits. The
+    codepoints are cut into blocks, identical blocks are only stored once,
+    and an index says which block each one uses. The block size that makes
+    the smallest tables is picked.
+"""
+
+import sys
+
+MAX_CODEPOINT = 0x110000
+
+def read_categories(path):
+    categories = [None] * MAX_CODEPOINT
+    first = None
+    with open(path) as f:
+        for line in f:
+            fields = line.split(';')
+            if len(fields) < 3:
+                continue
+            cp = int(fields[0], 16)
+            name = fields[1]
+            if name.endswith(', First>'):
+                first = cp
+                continue
+            if name.endswith(', Last>'):
+                for c in range(first, cp + 1):
+                    categories[c] = fields[2]
+                continue
+            categories[cp] = fields[2]
+    return categories
+
+def read_wide(path):
+    wide = [False] * MAX_CODEPOINT
+    with open(path) as f:
+        for line in f:
+            line = line.split('#')[0].strip()
+            if not line:
+                continue
+            cps, kind = [x.strip() for x in line.split(';')]
+            if kind not in ('W', 'F'):
+                continue
+            if '..' in cps:
+                start, end = [int(x, 16) for x in cps.split('..')]
+            else:
+                start = end = int(cps, 16)
+            for c in range(start, end + 1):
+                wide[c] = True
+    return wide
+
+def widths_from_ucd(unicode_data, east_asian_width):
+    categories = read_categories(unicode_data)
+    wide = read_wide(east_asian_width)
+    widths = []
+    for c in range(MAX_CODEPOINT):
+        cat = categories[c]
+        if c == 0:
+            w = 0
+        elif cat is None or cat in ('Cc', 'Cs'):
+            w = -1
+        elif cat in ('Mn', 'Me', 'Cf') and c != 0xAD:
+            w = 0
+        elif 0x1160 <= c <= 0x11FF or c == 0x200B:
+            # Hangul medial vowels and final consonants join the syllable before them
+            w = 0
+        elif wide[c]:
+            w = 2
+        else:
+            w = 1
+        widths.append(w)
+    return widths
+
+def build(widths, shift):
+    size = 1 << shift
+    blocks = []
+    seen = {}
+    index = []
+    for start in range(0, MAX_CODEPOINT, size):
+        packed = bytearray(size // 4)
+        for i in range(size):
+            packed[i // 4] |= (widths[start + i] + 1) << ((i % 4) * 2)
+        packed = bytes(packed)
+        if packed not in seen:
+            seen[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(seen[packed])
+    index_size = 1 if len(blocks) <= 256 else 2
+    return index, blocks, len(index) * index_size + len(blocks) * (size // 4)
+
+def emit(widths, out=sys.stdout):
+    shift = min(range(5, 11), key=lambda s: build(widths, s)[2])
+    index, blocks, total = build(widths, shift)
+    index_type = 'uint8_t' if len(blocks) <= 256 else 'uint16_t'
+
+    out.write('/* Generated by util/gen-wcwidth.py - do not edit */\n')
+    out.write('#pragma once\n\n')
+    out.write('#include <stdint.h>\n\n')
+    out.write('/* %d bytes: %d blocks of %d codepoints */\n' % (total, len(blocks), 1 << shift))
+    out.write('#define WCWIDTH_SHIFT %d\n\n' % shift)
+
+    out.write('static const %s wcwidth_index[%d] = {\n' % (index_type, len(index)))
+    for i in range(0, len(index), 16):
+        out.write('\t' + ', '.join('%d' % x for x in index[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('static const uint8_t wcwidth_blocks[%d] = {\n' % (len(blocks) * ((1 << shift) // 4)))
+    for block in blocks:
+        for i in range(0, len(block), 16):
+            out.write('\t' + ', '.join('0x%02x' % x for x in block[i:i + 16]) + ',\n')
+    out.write('};\n')
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        sys.exit(1)
+    emit(widths_from_ucd(sys.argv[1], sys.argv[2]))
@@ -420,6 +420,7 @@ class ISO9660(object):
             o = t.write(self.mods_data.data, o)
             for mod_file in [
                 'fatbase/mod/ac97.ko',
+                'fatbase/mod/ahci.ko',
                 'fatbase/mod/ata.ko',
                 'fatbase/mod/ataold.ko',
                 'fatbase/mod/debug_sh.ko',
@@ -435,6 +436,7 @@ class ISO9660(object):
                 'fatbase/mod/pcspkr.ko',
                 'fatbase/mod/portio.ko',
                 'fatbase/mod/procfs.ko',
+                'fatbase/mod/prof.ko',
                 'fatbase/mod/ps2kbd.ko',
                 'fatbase/mod/ps2mouse.ko',
                 'fatbase/mod/random.ko',
@@ -442,15 +444,23 @@ class ISO9660(object):
                 'fatbase/mod/serial.ko',
                 'fatbase/mod/snd.ko',
                 'fatbase/mod/tmpfs.ko',
+                'fatbase/mod/usb.ko',
+                'fatbase/mod/usbhid.ko',
+                'fatbase/mod/usbmsd.ko',
                 'fatbase/mod/usbuhci.ko',
                 'fatbase/mod/vbox.ko',
                 'fatbase/mod/vgadbg.ko',
                 'fatbase/mod/vgalog.ko',
                 'fatbase/mod/vidset.ko',
+                'fatbase/mod/virtblk.ko',
+                'fatbase/mod/virtio.ko',
+                'fatbase/mod/virtnet.ko',
                 'fatbase/mod/vmware.ko',
+                'fatbase/mod/xhci.ko',
                 'fatbase/mod/xtest.ko',
                 'fatbase/mod/zero.ko',
                 'fatbase/mod/tarfs.ko',
+                'fatbase/mod/overlay.ko',
             ]:
                 payload = ArbitraryData(path=mod_file)
                 payload.sector_offset = self.allocate_space(payload.size // 2048)
@@ -1,119 +1,263 @@
 #!/usr/bin/env python3
 """
 Harness for running QEMU and communicating window sizes through serial.
+
+    qemu-harness.py                          interactive, with window resizing
+    qemu-harness.py --bench OUT.json [ARGS]  boot headless, run bench ARGS, save results
+    qemu-harness.py --compare OLD.json NEW.json [--threshold PERCENT]
+
+Benchmark runs boot image.iso in headless mode with no display. The
+fwcfg value opt/org.toaruos.bench makes /etc/startup.d/97_bench.sh run
+`bench` with the given arguments and send its output over the second
+serial port, which is the same TCP connection the interactive harness
+uses. Results are saved as JSON along with the commit they came from.
+
+--compare prints how each benchmark changed between two saved runs and
+exits with status 1 if any got slower by more than the threshold
+(10% by default).
 """
 
 import subprocess
 import asyncio
+import datetime
+import json
+import socket
 import time
 import sys
 
-from Xlib.display import Display
-from Xlib.protocol.event import KeyPress, KeyRelease
-from Xlib.XK import string_to_keysym
-import Xlib
-
 qemu_bin = 'qemu-system-i386'
 
-qemu = subprocess.Popen([
-    qemu_bin,
-    '-enable-kvm',
-    '-cdrom','image.iso',
-    # 1GB of RAM
-    '-m','1G',
-    # Enable audio
-    '-soundhw','ac97,pcspk',
-    # The GTK interface does not play well, force SDL
-    '-display', 'sdl',
-    # /dev/ttyS0 is stdio multiplexed with monitor
-    '-serial', 'mon:stdio',
-    # /dev/ttyS1 is TCP connection to the harness
-    '-serial','tcp::4444,server,nowait',
-    # Add a VGA card with 32mb of video RAM
-    '-device', 'VGA,id=video0,vgamem_mb=32',
-    # Set the fwcfg flag so our userspace app recognizes us
-    '-fw_cfg','name=opt/org.toaruos.displayharness,string=1',
-    # Boot directly to graphical mode
-    '-fw_cfg','name=opt/org.toaruos.bootmode,string=normal'
-])
-
-# Give QEMU some time to start up and create a window.
-time.sleep(1)
-
-# Find the QEMU window...
-def findQEMU(window):
-    try:
-        x = window.get_wm_name()
-        if 'QEMU' in x:
-            return window
-    except:
-        pass
-    children = window.query_tree().children
-    for w in children:
-        x = findQEMU(w)
-        if x: return x
-    return None
-
-display = Display()
-root = display.screen().root
-qemu_win = findQEMU(root)
-
-def send_key(key, state, up=False):
-    """Send a key press or release to the QEMU window."""
-    time.sleep(0.1)
-    t = KeyPress
-    if up:
-        t = KeyRelease
-
-    sym = string_to_keysym(key)
-    ke = t(
-        time=int(time.time()),
-        root=display.screen().root,
-        window=qemu_win,
-        same_screen=0,
-        child=Xlib.X.NONE,
-        root_x = 0, root_y = 0, event_x = 0, event_y = 0,
-        state = 0xc,
-        detail = display.keysym_to_keycode(sym)
-    )
-    qemu_win.send_event(ke)
-    display.flush()
-
-class Client(asyncio.Protocol):
-
-    def connection_made(self, transport):
-        asyncio.ensure_future(heartbeat(transport))
-
-    def data_received(self, data):
-        if 'X' in data.decode('utf-8'):
-            # Send Ctrl-Alt-u
-            send_key('Control_L',0x00)
-            send_key('Alt_L',0x04)
-            send_key('u',0x0c)
-            send_key('u',0x0c,True)
-            send_key('Alt_L',0x0c,True)
-            send_key('Control_L',0x04,True)
-
-async def heartbeat(transport):
-    """Heartbeat process checks window size every second and sends update signal."""
-    w = 0
-    h = 0
-    while 1:
-        await asyncio.sleep(1)
+def interactive():
+    from Xlib.display import Display
+    from Xlib.protocol.event import KeyPress, KeyRelease
+    from Xlib.XK import string_to_keysym
+    import Xlib
+
+    qemu = subprocess.Popen([
+        qemu_bin,
+        '-enable-kvm',
+        '-cdrom','image.iso',
+        # 1GB of RAM
+        '-m','1G',
+        # Enable audio
+        '-soundhw','ac97,pcspk',
+        # The GTK interface does not play well, force SDL
+        '-display', 'sdl',
+        # /dev/ttyS0 is stdio multiplexed with monitor
+        '-serial', 'mon:stdio',
+        # /dev/ttyS1 is TCP connection to the harness
+        '-serial','tcp::4444,server,nowait',
+        # Add a VGA card with 32mb of video RAM
+        '-device', 'VGA,id=video0,vgamem_mb=32',
+        # Set the fwcfg flag so our userspace app recognizes us
+        '-fw_cfg','name=opt/org.toaruos.displayharness,string=1',
+        # Boot directly to graphical mode
+        '-fw_cfg','name=opt/org.toaruos.bootmode,string=normal'
+    ])
+
+    # Give QEMU some time to start up and create a window.
+    time.sleep(1)
+
+    # Find the QEMU window...
+    def findQEMU(window):
+        try:
+            x = window.get_wm_name()
+            if 'QEMU' in x:
+                return window
+        except:
+            pass
+        children = window.query_tree().children
+        for w in children:
+            x = findQEMU(w)
+            if x: return x
+        return None
+
+    display = Display()
+    root = display.screen().root
+    qemu_win = findQEMU(root)
+
+    def send_key(key, state, up=False):
+        """Send a key press or release to the QEMU window."""
+        time.sleep(0.1)
+        t = KeyPress
+        if up:
+            t = KeyRelease
+
+        sym = string_to_keysym(key)
+        ke = t(
+            time=int(time.time()),
+            root=display.screen().root,
+            window=qemu_win,
+            same_screen=0,
+            child=Xlib.X.NONE,
+            root_x = 0, root_y = 0, event_x = 0, event_y = 0,
+            state = 0xc,
+            detail = display.keysym_to_keycode(sym)
+        )
+        qemu_win.send_event(ke)
+        display.flush()
+
+    class Client(asyncio.Protocol):
+
+        def connection_made(self, transport):
+            asyncio.ensure_future(heartbeat(transport))
+
+        def data_received(self, data):
+            if 'X' in data.decode('utf-8'):
+                # Send Ctrl-Alt-u
+                send_key('Control_L',0x00)
+                send_key('Alt_L',0x04)
+                send_key('u',0x0c)
+                send_key('u',0x0c,True)
+                send_key('Alt_L',0x0c,True)
+                send_key('Control_L',0x04,True)
+
+    async def heartbeat(transport):
+        """Heartbeat process checks window size every second and sends update signal."""
+        w = 0
+        h = 0
+        while 1:
+            await asyncio.sleep(1)
+            try:
+                g = qemu_win.get_geometry()
+            except Xlib.error.BadDrawable:
+                print("QEMU window is gone, exiting.")
+                asyncio.get_event_loop().call_soon(sys.exit, 0)
+                return
+            if g.width != w or g.height != h:
+                transport.write(("geometry-changed %d %d\n" % (g.width,g.height)).encode('utf-8'))
+            w = g.width
+            h = g.height
+
+    loop = asyncio.get_event_loop()
+    coro = loop.create_connection(Client,'127.0.0.1',4444)
+    asyncio.ensure_future(coro)
+    loop.run_forever()
+    loop.close()
+
+def run_bench(output, bench_args, timeout=1800):
+    """Boot headless, collect the benchmark results, and save them."""
+    args = ' '.join(bench_args) if bench_args else '-s 1'
+    qemu = subprocess.Popen([
+        qemu_bin,
+        '-enable-kvm',
+        '-cdrom','image.iso',
+        '-m','1G',
+        '-display', 'none',
+        # /dev/ttyS0 is stdio, for the kernel log
+        '-serial', 'stdio',
+        # /dev/ttyS1 is where the results come back; QEMU waits for us
+        '-serial','tcp::4444,server',
+        '-fw_cfg','name=opt/org.toaruos.bootmode,string=headless',
+        # QEMU splits options on commas; doubled ones are literal
+        '-fw_cfg','name=opt/org.toaruos.bench,string=' + args.replace(',', ',,'),
+    ], stdout=subprocess.DEVNULL)
+
+    sock = None
+    for _ in range(50):
         try:
-            g = qemu_win.get_geometry()
-        except Xlib.error.BadDrawable:
-            print("QEMU window is gone, exiting.")
-            asyncio.get_event_loop().call_soon(sys.exit, 0)
-            return
-        if g.width != w or g.height != h:
-            transport.write(("geometry-changed %d %d\n" % (g.width,g.height)).encode('utf-8'))
-        w = g.width
-        h = g.height
-
-loop = asyncio.get_event_loop()
-coro = loop.create_connection(Client,'127.0.0.1',4444)
-asyncio.ensure_future(coro)
-loop.run_forever()
-loop.close()
+            sock = socket.create_connection(('127.0.0.1', 4444))
+            break
+        except ConnectionRefusedError:
+            time.sleep(0.1)
+    if not sock:
+        qemu.kill()
+        sys.exit("qemu-harness: could not connect to QEMU's serial port")
+    sock.settimeout(timeout)
+
+    results = []
+    comments = []
+    started = False
+    finished = False
+    data = b''
+    try:
+        while not finished:
+            chunk = sock.recv(4096)
+            if not chunk:
+                sys.exit("qemu-harness: QEMU went away before the benchmarks finished")
+            data += chunk
+            *lines, data = data.split(b'\n')
+            for line in lines:
+                line = line.decode('utf-8', 'replace').strip('\r')
+                if line == '# bench begin':
+                    started = True
+                elif not started:
+                    continue
+                elif line == '# bench end':
+                    finished = True
+                    break
+                elif line.startswith('#'):
+                    comments.append(line[1:].strip())
+                    print(line)
+                elif line:
+                    name, iterations, ns, mib = line.split('\t')
+                    results.append({
+                        'name': name,
+                        'iterations': int(iterations),
+                        'ns_per_op': int(ns),
+                        'mib_per_s': None if mib == '-' else float(mib),
+                    })
+                    print(line)
+    except socket.timeout:
+        sys.exit("qemu-harness: timed out waiting for benchmarks")
+    finally:
+        sock.close()
+        qemu.kill()
+        qemu.wait()
+
+    try:
+        commit = subprocess.check_output(['git','rev-parse','HEAD'], stderr=subprocess.DEVNULL).decode().strip()
+    except (subprocess.CalledProcessError, FileNotFoundError):
+        commit = None
+
+    with open(output, 'w') as f:
+        json.dump({
+            'commit': commit,
+            'date': datetime.datetime.utcnow().isoformat() + 'Z',
+            'args': args,
+            'comments': comments,
+            'results': results,
+        }, f, indent=2)
+        f.write('\n')
+
+def compare(old_path, new_path, threshold):
+    """Show per-benchmark changes; true if nothing got slower than threshold percent."""
+    with open(old_path) as f:
+        old = {r['name']: r for r in json.load(f)['results']}
+    with open(new_path) as f:
+        new = json.load(f)['results']
+
+    ok = True
+    print('%-14s %12s %12s %8s' % ('name', 'old ns/op', 'new ns/op', 'change'))
+    for r in new:
+        before = old.get(r['name'])
+        if not before:
+            print('%-14s %12s %12d %8s' % (r['name'], '-', r['ns_per_op'], 'new'))
+            continue
+        change = (r['ns_per_op'] - before['ns_per_op']) * 100.0 / max(before['ns_per_op'], 1)
+        mark = ''
+        if change > threshold:
+            mark = '  <- slower'
+            ok = False
+        print('%-14s %12d %12d %+7.1f%%%s' % (r['name'], before['ns_per_op'], r['ns_per_op'], change, mark))
+    return ok
 
+if __name__ == '__main__':
+    if len(sys.argv) > 1 and sys.argv[1] == '--bench':
+        if len(sys.argv) < 3:
+            sys.exit(__doc__)
+        run_bench(sys.argv[2], sys.argv[3:])
+    elif len(sys.argv) > 1 and sys.argv[1] == '--compare':
+        args = sys.argv[2:]
+        threshold = 10.0
+        if '--threshold' in args:
+            i = args.index('--threshold')
+            threshold = float(args[i + 1])
+            del args[i:i + 2]
+        if len(args) != 2:
+            sys.exit(__doc__)
+        sys.exit(0 if compare(args[0], args[1], threshold) else 1)
+    elif len(sys.argv) > 1:
+        sys.exit(__doc__)
+    else:
+        interactive()
@@ -10,9 +10,16 @@ fatbase/mod/debug_sh.ko,\
 fatbase/mod/procfs.ko,\
 fatbase/mod/tmpfs.ko,\
 fatbase/mod/ata.ko,\
+fatbase/mod/ahci.ko,\
+fatbase/mod/virtio.ko,\
+fatbase/mod/virtblk.ko,\
 fatbase/mod/ext2.ko,\
 fatbase/mod/ps2kbd.ko,\
 fatbase/mod/ps2mouse.ko,\
+fatbase/mod/usb.ko,\
+fatbase/mod/xhci.ko,\
+fatbase/mod/usbhid.ko,\
+fatbase/mod/usbmsd.ko,\
 fatbase/mod/lfbvideo.ko,\
 fatbase/mod/vbox.ko,\
 fatbase/mod/vmware.ko,\
@@ -20,13 +27,16 @@ fatbase/mod/vidset.ko,\
 fatbase/mod/packetfs.ko,\
 fatbase/mod/snd.ko,\
 fatbase/mod/ac97.ko,\
+fatbase/mod/hda.ko,\
 fatbase/mod/net.ko,\
 fatbase/mod/pcnet.ko,\
 fatbase/mod/rtl.ko,\
 fatbase/mod/e1000.ko,\
+fatbase/mod/virtnet.ko,\
 fatbase/mod/pcspkr.ko,\
 fatbase/mod/portio.ko,\
 fatbase/mod/tarfs.ko,\
+fatbase/mod/overlay.ko,\
 fatbase/ramdisk.img \
 -append "root=/dev/ram0 root_type=tar logtoserial=2 vid=qemu" \
 -enable-kvm \